@@ -170,6 +170,15 @@ public class Collectd
   native public static int registerWrite (String name,
       CollectdWriteInterface object);
 
+  /**
+   * Java representation of collectd/src/plugin.h:plugin_register_write_batch
+   *
+   * @return Zero when successful, non-zero otherwise.
+   * @see CollectdWriteBatchInterface
+   */
+  native public static int registerWriteBatch (String name,
+      CollectdWriteBatchInterface object);
+
   /**
    * Java representation of collectd/src/plugin.h:plugin_register_flush
    *
@@ -231,6 +240,15 @@ public class Collectd
    */
   native public static int dispatchValues (ValueList vl);
 
+  /**
+   * Dispatches all value lists in <code>vls</code> in one call, using
+   * collectd/src/plugin.h:plugin_dispatch_values_batch. Value lists which
+   * cannot be converted are skipped.
+   *
+   * @return Zero when successful, non-zero otherwise.
+   */
+  native public static int dispatchValues (ValueList[] vls);
+
   /**
    * Java representation of collectd/src/plugin.h:plugin_dispatch_notification
    *
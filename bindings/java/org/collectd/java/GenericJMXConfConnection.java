@@ -39,6 +39,7 @@ import javax.management.remote.JMXConnectorFactory;
 
 import org.collectd.api.Collectd;
 import org.collectd.api.PluginData;
+import org.collectd.api.ValueList;
 import org.collectd.api.OConfigValue;
 import org.collectd.api.OConfigItem;
 
@@ -220,6 +221,7 @@ private void connect () /* {{{ */
   public void query () /* {{{ */
   {
     PluginData pd;
+    List<ValueList> values;
 
     connect ();
 
@@ -234,18 +236,24 @@ private void connect () /* {{{ */
     pd.setHost (this.getHost ());
     pd.setPlugin ("GenericJMX");
 
+    /* Everything read from this connection is dispatched with one call. */
+    values = new ArrayList<ValueList> ();
+
     for (int i = 0; i < this._mbeans.size (); i++)
     {
       int status;
 
       status = this._mbeans.get (i).query (this._jmx_connection, pd,
-          this._instance_prefix);
+          this._instance_prefix, values);
       if (status != 0)
       {
         this._jmx_connection = null;
-        return;
+        break;
       }
     } /* for */
+
+    if (values.size () > 0)
+      Collectd.dispatchValues (values.toArray (new ValueList[values.size ()]));
   } /* }}} void query */
 
   public String toString ()
@@ -21,17 +21,27 @@
 
 package org.collectd.java;
 
+import java.io.IOException;
+
 import java.util.Iterator;
 import java.util.List;
+import java.util.Map;
 import java.util.Set;
 import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.TreeSet;
+import java.util.WeakHashMap;
 
+import javax.management.Attribute;
+import javax.management.AttributeList;
+import javax.management.InstanceNotFoundException;
 import javax.management.MBeanServerConnection;
 import javax.management.ObjectName;
 import javax.management.MalformedObjectNameException;
 
 import org.collectd.api.Collectd;
 import org.collectd.api.PluginData;
+import org.collectd.api.ValueList;
 import org.collectd.api.OConfigValue;
 import org.collectd.api.OConfigItem;
 
@@ -42,6 +52,25 @@ class GenericJMXConfMBean
   private String _instance_prefix;
   private List<String> _instance_from;
   private List<GenericJMXConfValue> _values;
+  /* Names of all attributes read by the value blocks, fetched in one call. */
+  private String[] _attribute_names;
+  /* How long the result of queryNames is reused, in milliseconds. */
+  private long _refresh_interval;
+  /* The result of queryNames by connection. Connections which have been
+   * dropped are not referenced by anybody else and will be collected. */
+  private Map<MBeanServerConnection, NamesCacheEntry> _names_cache;
+
+  private static class NamesCacheEntry /* {{{ */
+  {
+    Set<ObjectName> names;
+    long time;
+
+    NamesCacheEntry (Set<ObjectName> names, long time)
+    {
+      this.names = names;
+      this.time = time;
+    }
+  } /* }}} class NamesCacheEntry */
 
   private String getConfigString (OConfigItem ci) /* {{{ */
   {
@@ -67,11 +96,30 @@ class GenericJMXConfMBean
     return (v.getString ());
   } /* }}} String getConfigString */
 
+  private Number getConfigNumber (OConfigItem ci) /* {{{ */
+  {
+    List<OConfigValue> values;
+    OConfigValue v;
+
+    values = ci.getValues ();
+    if ((values.size () != 1)
+        || (values.get (0).getType () != OConfigValue.OCONFIG_TYPE_NUMBER))
+    {
+      Collectd.logError ("GenericJMXConfMBean: The " + ci.getKey ()
+          + " configuration option needs exactly one numeric argument.");
+      return (null);
+    }
+
+    v = values.get (0);
+    return (v.getNumber ());
+  } /* }}} Number getConfigNumber */
+
 /*
  * <MBean "alias name">
  *   ObjectName "object name"
  *   InstancePrefix "foobar"
  *   InstanceFrom "name"
+ *   RefreshInterval 300
  *   <Value />
  *   <Value />
  *   :
@@ -82,6 +130,7 @@ class GenericJMXConfMBean
   {
     List<OConfigItem> children;
     Iterator<OConfigItem> iter;
+    Set<String> attributeNames;
 
     this._name = getConfigString (ci);
     if (this._name == null)
@@ -92,6 +141,9 @@ class GenericJMXConfMBean
     this._instance_prefix = null;
     this._instance_from = new ArrayList<String> ();
     this._values = new ArrayList<GenericJMXConfValue> ();
+    this._refresh_interval = 300000;
+    this._names_cache
+      = new WeakHashMap<MBeanServerConnection, NamesCacheEntry> ();
 
     children = ci.getChildren ();
     iter = children.iterator ();
@@ -129,6 +181,15 @@ class GenericJMXConfMBean
         if (tmp != null)
           this._instance_from.add (tmp);
       }
+      else if (child.getKey ().equalsIgnoreCase ("RefreshInterval"))
+      {
+        Number tmp = getConfigNumber (child);
+        if ((tmp != null) && (tmp.doubleValue () >= 0.0))
+          this._refresh_interval = (long) (tmp.doubleValue () * 1000.0);
+        else if (tmp != null)
+          Collectd.logError ("GenericJMXConfMBean: RefreshInterval must "
+              + "not be negative.");
+      }
       else if (child.getKey ().equalsIgnoreCase ("Value"))
       {
         GenericJMXConfValue cv;
@@ -147,6 +208,11 @@ class GenericJMXConfMBean
     if (this._values.size () == 0)
       throw (new IllegalArgumentException ("No value block was defined."));
 
+    attributeNames = new TreeSet<String> ();
+    for (int i = 0; i < this._values.size (); i++)
+      this._values.get (i).getAttributeNames (attributeNames);
+    this._attribute_names
+      = attributeNames.toArray (new String[attributeNames.size ()]);
   } /* }}} GenericJMXConfMBean (OConfigItem ci) */
 
   public String getName () /* {{{ */
@@ -154,15 +220,87 @@ class GenericJMXConfMBean
     return (this._name);
   } /* }}} */
 
+  /*
+   * Resolves the object name, which may be a pattern. The result is reused
+   * for `RefreshInterval' to save a round trip per read. Empty results are
+   * not cached, so that MBeans registered late are picked up quickly.
+   */
+  private Set<ObjectName> queryNames (MBeanServerConnection conn) /* {{{ */
+    throws IOException
+  {
+    NamesCacheEntry entry;
+    Set<ObjectName> names;
+    long now;
+
+    now = System.currentTimeMillis ();
+    entry = this._names_cache.get (conn);
+    if ((entry != null) && ((now - entry.time) < this._refresh_interval))
+      return (entry.names);
+
+    names = conn.queryNames (this._obj_name, /* query = */ null);
+    if (names.size () > 0)
+      this._names_cache.put (conn, new NamesCacheEntry (names, now));
+    else
+      this._names_cache.remove (conn);
+
+    return (names);
+  } /* }}} Set<ObjectName> queryNames */
+
+  /*
+   * Fetches all attributes used by the value blocks with one call. Attributes
+   * the MBean doesn't have are missing from the result; the value blocks
+   * query those one by one, since they may be operations.
+   */
+  private Map<String,Object> getAttributes (MBeanServerConnection conn, /* {{{ */
+      ObjectName objName)
+    throws InstanceNotFoundException, IOException
+  {
+    Map<String,Object> ret;
+    AttributeList attrs;
+
+    ret = new HashMap<String,Object> ();
+
+    try
+    {
+      attrs = conn.getAttributes (objName, this._attribute_names);
+    }
+    catch (InstanceNotFoundException e)
+    {
+      throw (e);
+    }
+    catch (IOException e)
+    {
+      throw (e);
+    }
+    catch (Exception e)
+    {
+      Collectd.logWarning ("GenericJMXConfMBean: getAttributes failed: " + e);
+      return (ret);
+    }
+
+    for (int i = 0; i < attrs.size (); i++)
+    {
+      Object obj = attrs.get (i);
+
+      if (obj instanceof Attribute)
+      {
+        Attribute attr = (Attribute) obj;
+        ret.put (attr.getName (), attr.getValue ());
+      }
+    }
+
+    return (ret);
+  } /* }}} Map<String,Object> getAttributes */
+
   public int query (MBeanServerConnection conn, PluginData pd, /* {{{ */
-      String instance_prefix)
+      String instance_prefix, List<ValueList> ret)
   {
     Set<ObjectName> names;
     Iterator<ObjectName> iter;
 
     try
     {
-      names = conn.queryNames (this._obj_name, /* query = */ null);
+      names = queryNames (conn);
     }
     catch (Exception e)
     {
@@ -181,6 +319,7 @@ class GenericJMXConfMBean
     {
       ObjectName   objName;
       PluginData   pd_tmp;
+      Map<String,Object> attributes;
       List<String> instanceList;
       StringBuffer instance;
 
@@ -192,6 +331,24 @@ class GenericJMXConfMBean
       Collectd.logDebug ("GenericJMXConfMBean: objName = "
           + objName.toString ());
 
+      try
+      {
+        attributes = getAttributes (conn, objName);
+      }
+      catch (InstanceNotFoundException e)
+      {
+        /* Unregistered since the names were cached. */
+        Collectd.logDebug ("GenericJMXConfMBean: " + objName.toString ()
+            + " has gone away.");
+        this._names_cache.remove (conn);
+        continue;
+      }
+      catch (IOException e)
+      {
+        Collectd.logError ("GenericJMXConfMBean: getAttributes failed: " + e);
+        return (-1);
+      }
+
       for (int i = 0; i < this._instance_from.size (); i++)
       {
         String propertyName;
@@ -228,7 +385,7 @@ class GenericJMXConfMBean
       Collectd.logDebug ("GenericJMXConfMBean: instance = " + instance.toString ());
 
       for (int i = 0; i < this._values.size (); i++)
-        this._values.get (i).query (conn, objName, pd_tmp);
+        this._values.get (i).query (conn, objName, pd_tmp, attributes, ret);
     }
 
     return (0);
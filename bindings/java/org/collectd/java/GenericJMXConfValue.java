@@ -23,6 +23,7 @@ package org.collectd.java;
 
 import java.util.Arrays;
 import java.util.List;
+import java.util.Map;
 import java.util.Set;
 import java.util.Iterator;
 import java.util.ArrayList;
@@ -183,7 +184,7 @@ class GenericJMXConfValue
   } /* }}} List<Number> genericCompositeToNumber */
 
   private void submitTable (List<Object> objects, ValueList vl, /* {{{ */
-      String instancePrefix)
+      String instancePrefix, List<ValueList> ret)
   {
     List<CompositeData> cdlist;
     Set<String> keySet = null;
@@ -239,12 +240,12 @@ class GenericJMXConfValue
         vl.setTypeInstance (instancePrefix + key);
       vl.setValues (values);
 
-      Collectd.dispatchValues (vl);
+      ret.add (new ValueList (vl));
     }
   } /* }}} void submitTable */
 
   private void submitScalar (List<Object> objects, ValueList vl, /* {{{ */
-      String instancePrefix)
+      String instancePrefix, List<ValueList> ret)
   {
     List<Number> values;
 
@@ -262,7 +263,7 @@ class GenericJMXConfValue
       vl.setTypeInstance (instancePrefix);
     vl.setValues (values);
 
-    Collectd.dispatchValues (vl);
+    ret.add (new ValueList (vl));
   } /* }}} void submitScalar */
 
   private Object queryAttributeRecursive (CompositeData parent, /* {{{ */
@@ -296,7 +297,7 @@ class GenericJMXConfValue
   } /* }}} queryAttributeRecursive */
 
   private Object queryAttribute (MBeanServerConnection conn, /* {{{ */
-      ObjectName objName, String attrName)
+      ObjectName objName, String attrName, Map<String,Object> attributes)
   {
     List<String> attrNameList;
     String key;
@@ -310,23 +311,31 @@ class GenericJMXConfValue
     for (int i = 1; i < attrNameArray.length; i++)
       attrNameList.add (attrNameArray[i]);
 
-    try
+    /* Attributes missing from the bulk result may be operations. */
+    if ((attributes != null) && (attributes.get (key) != null))
+    {
+      value = attributes.get (key);
+    }
+    else
     {
       try
       {
-        value = conn.getAttribute (objName, key);
+        try
+        {
+          value = conn.getAttribute (objName, key);
+        }
+        catch (javax.management.AttributeNotFoundException e)
+        {
+          value = conn.invoke (objName, key, /* args = */ null, /* types = */ null);
+        }
       }
-      catch (javax.management.AttributeNotFoundException e)
+      catch (Exception e)
       {
-        value = conn.invoke (objName, key, /* args = */ null, /* types = */ null);
+        Collectd.logError ("GenericJMXConfValue.query: getAttribute failed: "
+            + e);
+        return (null);
       }
     }
-    catch (Exception e)
-    {
-      Collectd.logError ("GenericJMXConfValue.query: getAttribute failed: "
-          + e);
-      return (null);
-    }
 
     if (attrNameList.size () == 0)
     {
@@ -492,16 +501,31 @@ class GenericJMXConfValue
   } /* }}} GenericJMXConfValue (OConfigItem ci) */
 
   /**
-   * Query values via JMX according to the object's configuration and dispatch
-   * them to collectd.
+   * Adds the names of the attributes this block reads, i.e. the first
+   * component of each attribute path, to <code>names</code>.
+   *
+   * @param names Set to which the attribute names are added.
+   */
+  public void getAttributeNames (Set<String> names) /* {{{ */
+  {
+    for (int i = 0; i < this._attributes.size (); i++)
+      names.add (this._attributes.get (i).split ("\\.")[0]);
+  } /* }}} void getAttributeNames */
+
+  /**
+   * Query values via JMX according to the object's configuration and append
+   * them to a list of value lists to be dispatched to collectd.
    *
-   * @param conn    Connection to the MBeanServer.
-   * @param objName Object name of the MBean to query.
-   * @param pd      Preset naming components. The members host, plugin and
-   *                plugin instance will be used.
+   * @param conn       Connection to the MBeanServer.
+   * @param objName    Object name of the MBean to query.
+   * @param pd         Preset naming components. The members host, plugin and
+   *                   plugin instance will be used.
+   * @param attributes Attributes of the MBean which have already been
+   *                   fetched, by name. Others are queried individually.
+   * @param ret        List to which the value lists are appended.
    */
   public void query (MBeanServerConnection conn, ObjectName objName, /* {{{ */
-      PluginData pd)
+      PluginData pd, Map<String,Object> attributes, List<ValueList> ret)
   {
     ValueList vl;
     List<DataSource> dsrc;
@@ -573,7 +597,8 @@ class GenericJMXConfValue
     {
       Object v;
 
-      v = queryAttribute (conn, objName, this._attributes.get (i));
+      v = queryAttribute (conn, objName, this._attributes.get (i),
+          attributes);
       if (v == null)
       {
         Collectd.logError ("GenericJMXConfValue.query: "
@@ -585,9 +610,9 @@ class GenericJMXConfValue
     }
 
     if (this._is_table)
-      submitTable (values, vl, instancePrefix);
+      submitTable (values, vl, instancePrefix, ret);
     else
-      submitScalar (values, vl, instancePrefix);
+      submitScalar (values, vl, instancePrefix, ret);
   } /* }}} void query */
 } /* class GenericJMXConfValue */
 
@@ -33,12 +33,18 @@
 #include "configfile.h"
 #include "meta_data.h"
 #include "utils_cache.h" /* for uc_get_rate() */
+#include "utils_histogram.h"
 #include "utils_subst.h"
 #include "utils_vl_lookup.h"
 
 #define AGG_MATCHES_ALL(str) (strcmp ("/.*/", str) == 0)
 #define AGG_FUNC_PLACEHOLDER "%{aggregation}"
 
+/* Number of shards per instance. Each thread updates the instance through
+ * one shard only, so up to this many threads can update the same instance
+ * without waiting for each other. */
+#define AGG_SHARDS 8
+
 struct aggregation_s /* {{{ */
 {
   identifier_t ident;
@@ -57,17 +63,18 @@ struct aggregation_s /* {{{ */
   _Bool calc_min;
   _Bool calc_max;
   _Bool calc_stddev;
+
+  /* Percentiles to calculate, e.g. 95.0 */
+  double *percentiles;
+  size_t percentiles_num;
 }; /* }}} */
 typedef struct aggregation_s aggregation_t;
 
-struct agg_instance_s;
-typedef struct agg_instance_s agg_instance_t;
-struct agg_instance_s /* {{{ */
+/* The values received by one shard of an instance since the instance has
+ * been read last. */
+struct agg_shard_s /* {{{ */
 {
   pthread_mutex_t lock;
-  identifier_t ident;
-
-  int ds_type;
 
   derive_t num;
   gauge_t sum;
@@ -76,21 +83,48 @@ struct agg_instance_s /* {{{ */
   gauge_t min;
   gauge_t max;
 
+  /* Only allocated if percentiles are calculated. */
+  histogram_t *histogram;
+}; /* }}} */
+typedef struct agg_shard_s agg_shard_t;
+
+struct agg_instance_s;
+typedef struct agg_instance_s agg_instance_t;
+struct agg_instance_s /* {{{ */
+{
+  identifier_t ident;
+  aggregation_t const *agg;
+
+  int ds_type;
+
+  agg_shard_t shards[AGG_SHARDS];
+  /* Holds the merged histograms of all shards while the instance is read. */
+  histogram_t *histogram;
+
   rate_to_value_state_t *state_num;
   rate_to_value_state_t *state_sum;
   rate_to_value_state_t *state_average;
   rate_to_value_state_t *state_min;
   rate_to_value_state_t *state_max;
   rate_to_value_state_t *state_stddev;
+  rate_to_value_state_t *state_percentile; /* [agg->percentiles_num] */
 
   agg_instance_t *next;
 }; /* }}} */
 
 static lookup_t *lookup = NULL;
+/* The lookup replaced by the last reload. The write callback may still be
+ * using it, so it is destroyed by the next reload. */
+static lookup_t *lookup_retired = NULL;
 
 static pthread_mutex_t agg_instance_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static agg_instance_t *agg_instance_list_head = NULL;
 
+/* Each thread is assigned one of the shards, stored as index plus one. */
+static pthread_key_t  agg_shard_key;
+static pthread_once_t agg_shard_once = PTHREAD_ONCE_INIT;
+static unsigned int   agg_shard_next = 0;
+
 static _Bool agg_is_regex (char const *str) /* {{{ */
 {
   size_t len;
@@ -110,12 +144,53 @@ static _Bool agg_is_regex (char const *str) /* {{{ */
 
 static void agg_destroy (aggregation_t *agg) /* {{{ */
 {
+  if (agg == NULL)
+    return;
+
+  sfree (agg->percentiles);
   sfree (agg);
 } /* }}} void agg_destroy */
 
+static void agg_shard_key_create (void) /* {{{ */
+{
+  pthread_key_create (&agg_shard_key, /* destructor = */ NULL);
+} /* }}} void agg_shard_key_create */
+
+/* Returns the index of the shard the calling thread updates instances
+ * through. Threads are assigned shards in turn. */
+static size_t agg_shard_index (void) /* {{{ */
+{
+  uintptr_t index;
+
+  pthread_once (&agg_shard_once, agg_shard_key_create);
+
+  index = (uintptr_t) pthread_getspecific (agg_shard_key);
+  if (index == 0)
+  {
+    index = (__sync_fetch_and_add (&agg_shard_next, 1) % AGG_SHARDS) + 1;
+    pthread_setspecific (agg_shard_key, (void *) index);
+  }
+
+  return ((size_t) (index - 1));
+} /* }}} size_t agg_shard_index */
+
+/* Resets the shard to "no values received". The lock must be held. */
+static void agg_shard_reset (agg_shard_t *shard) /* {{{ */
+{
+  shard->num = 0;
+  shard->sum = 0.0;
+  shard->squares_sum = 0.0;
+  shard->min = NAN;
+  shard->max = NAN;
+  if (shard->histogram != NULL)
+    histogram_reset (shard->histogram);
+} /* }}} void agg_shard_reset */
+
 /* Frees all dynamically allocated memory within the instance. */
 static void agg_instance_destroy (agg_instance_t *inst) /* {{{ */
 {
+  size_t i;
+
   if (inst == NULL)
     return;
 
@@ -139,11 +214,17 @@ static void agg_instance_destroy (agg_instance_t *inst) /* {{{ */
   sfree (inst->state_min);
   sfree (inst->state_max);
   sfree (inst->state_stddev);
+  sfree (inst->state_percentile);
+
+  for (i = 0; i < AGG_SHARDS; i++)
+  {
+    pthread_mutex_destroy (&inst->shards[i].lock);
+    histogram_destroy (inst->shards[i].histogram);
+  }
+  histogram_destroy (inst->histogram);
 
   memset (inst, 0, sizeof (*inst));
   inst->ds_type = -1;
-  inst->min = NAN;
-  inst->max = NAN;
 } /* }}} void agg_instance_destroy */
 
 static int agg_instance_create_name (agg_instance_t *inst, /* {{{ */
@@ -237,6 +318,7 @@ static agg_instance_t *agg_instance_create (data_set_t const *ds, /* {{{ */
     value_list_t const *vl, aggregation_t *agg)
 {
   agg_instance_t *inst;
+  size_t i;
 
   DEBUG ("aggregation plugin: Creating new instance.");
 
@@ -247,15 +329,17 @@ static agg_instance_t *agg_instance_create (data_set_t const *ds, /* {{{ */
     return (NULL);
   }
   memset (inst, 0, sizeof (*inst));
-  pthread_mutex_init (&inst->lock, /* attr = */ NULL);
+  for (i = 0; i < AGG_SHARDS; i++)
+  {
+    pthread_mutex_init (&inst->shards[i].lock, /* attr = */ NULL);
+    agg_shard_reset (inst->shards + i);
+  }
 
+  inst->agg = agg;
   inst->ds_type = ds->ds[0].type;
 
   agg_instance_create_name (inst, vl, agg);
 
-  inst->min = NAN;
-  inst->max = NAN;
-
 #define INIT_STATE(field) do { \
   inst->state_ ## field = NULL; \
   if (agg->calc_ ## field) { \
@@ -278,6 +362,19 @@ static agg_instance_t *agg_instance_create (data_set_t const *ds, /* {{{ */
 
 #undef INIT_STATE
 
+  if (agg->percentiles_num > 0)
+  {
+    inst->state_percentile = calloc (agg->percentiles_num,
+        sizeof (*inst->state_percentile));
+    inst->histogram = histogram_create ();
+    if ((inst->state_percentile == NULL) || (inst->histogram == NULL))
+    {
+      agg_instance_destroy (inst);
+      ERROR ("aggregation plugin: malloc() failed.");
+      return (NULL);
+    }
+  }
+
   pthread_mutex_lock (&agg_instance_list_lock);
   inst->next = agg_instance_list_head;
   agg_instance_list_head = inst;
@@ -293,6 +390,7 @@ static agg_instance_t *agg_instance_create (data_set_t const *ds, /* {{{ */
 static int agg_instance_update (agg_instance_t *inst, /* {{{ */
     data_set_t const *ds, value_list_t const *vl)
 {
+  agg_shard_t *shard;
   gauge_t *rate;
 
   if (ds->ds_num != 1)
@@ -319,18 +417,27 @@ static int agg_instance_update (agg_instance_t *inst, /* {{{ */
     return (0);
   }
 
-  pthread_mutex_lock (&inst->lock);
+  shard = inst->shards + agg_shard_index ();
+  pthread_mutex_lock (&shard->lock);
+
+  shard->num++;
+  shard->sum += rate[0];
+  shard->squares_sum += (rate[0] * rate[0]);
 
-  inst->num++;
-  inst->sum += rate[0];
-  inst->squares_sum += (rate[0] * rate[0]);
+  if (isnan (shard->min) || (shard->min > rate[0]))
+    shard->min = rate[0];
+  if (isnan (shard->max) || (shard->max < rate[0]))
+    shard->max = rate[0];
 
-  if (isnan (inst->min) || (inst->min > rate[0]))
-    inst->min = rate[0];
-  if (isnan (inst->max) || (inst->max < rate[0]))
-    inst->max = rate[0];
+  if (inst->agg->percentiles_num > 0)
+  {
+    if (shard->histogram == NULL)
+      shard->histogram = histogram_create ();
+    if (shard->histogram != NULL)
+      histogram_add (shard->histogram, rate[0]);
+  }
 
-  pthread_mutex_unlock (&inst->lock);
+  pthread_mutex_unlock (&shard->lock);
 
   sfree (rate);
   return (0);
@@ -378,6 +485,38 @@ static int agg_instance_read_func (agg_instance_t *inst, /* {{{ */
 static int agg_instance_read (agg_instance_t *inst, cdtime_t t) /* {{{ */
 {
   value_list_t vl = VALUE_LIST_INIT;
+  derive_t num = 0;
+  gauge_t sum = 0.0;
+  gauge_t squares_sum = 0.0;
+  gauge_t min = NAN;
+  gauge_t max = NAN;
+  size_t i;
+
+  /* Merge and reset the shards. Each shard is locked only briefly, so that
+   * writers are not held up while the values are being dispatched. */
+  if (inst->histogram != NULL)
+    histogram_reset (inst->histogram);
+
+  for (i = 0; i < AGG_SHARDS; i++)
+  {
+    agg_shard_t *shard = inst->shards + i;
+
+    pthread_mutex_lock (&shard->lock);
+
+    num += shard->num;
+    sum += shard->sum;
+    squares_sum += shard->squares_sum;
+    if (!isnan (shard->min) && (isnan (min) || (min > shard->min)))
+      min = shard->min;
+    if (!isnan (shard->max) && (isnan (max) || (max < shard->max)))
+      max = shard->max;
+    if ((inst->histogram != NULL) && (shard->histogram != NULL))
+      histogram_merge (inst->histogram, shard->histogram);
+
+    agg_shard_reset (shard);
+
+    pthread_mutex_unlock (&shard->lock);
+  }
 
   /* Pre-set all the fields in the value list that will not change per
    * aggregation type (sum, average, ...). The struct will be re-used and must
@@ -407,30 +546,32 @@ static int agg_instance_read (agg_instance_t *inst, cdtime_t t) /* {{{ */
   } \
 } while (0)
 
-  pthread_mutex_lock (&inst->lock);
-
-  READ_FUNC (num, (gauge_t) inst->num);
+  READ_FUNC (num, (gauge_t) num);
 
   /* All other aggregations are only defined when there have been any values
    * at all. */
-  if (inst->num > 0)
+  if (num > 0)
   {
-    READ_FUNC (sum, inst->sum);
-    READ_FUNC (average, (inst->sum / ((gauge_t) inst->num)));
-    READ_FUNC (min, inst->min);
-    READ_FUNC (max, inst->max);
-    READ_FUNC (stddev, sqrt((((gauge_t) inst->num) * inst->squares_sum)
-          - (inst->sum * inst->sum)) / ((gauge_t) inst->num));
-  }
+    READ_FUNC (sum, sum);
+    READ_FUNC (average, (sum / ((gauge_t) num)));
+    READ_FUNC (min, min);
+    READ_FUNC (max, max);
+    READ_FUNC (stddev, sqrt((((gauge_t) num) * squares_sum)
+          - (sum * sum)) / ((gauge_t) num));
+
+    for (i = 0; i < inst->agg->percentiles_num; i++)
+    {
+      char func[DATA_MAX_NAME_LEN];
 
-  /* Reset internal state. */
-  inst->num = 0;
-  inst->sum = 0.0;
-  inst->squares_sum = 0.0;
-  inst->min = NAN;
-  inst->max = NAN;
+      ssnprintf (func, sizeof (func), "percentile-%g",
+          inst->agg->percentiles[i]);
+      agg_instance_read_func (inst, func,
+          histogram_percentile (inst->histogram, inst->agg->percentiles[i]),
+          inst->state_percentile + i, &vl, inst->ident.plugin_instance, t);
+    }
+  }
 
-  pthread_mutex_unlock (&inst->lock);
+#undef READ_FUNC
 
   meta_data_destroy (vl.meta);
   vl.meta = NULL;
@@ -482,6 +623,7 @@ static void agg_lookup_free_obj_callback (void *user_obj) /* {{{ */
  *     CalculateMinimum true
  *     CalculateMaximum true
  *     CalculateStddev true
+ *     CalculatePercentile 50 95 99
  *   </Aggregation>
  * </Plugin>
  */
@@ -521,7 +663,47 @@ static int agg_config_handle_group_by (oconfig_item_t const *ci, /* {{{ */
   return (0);
 } /* }}} int agg_config_handle_group_by */
 
-static int agg_config_aggregation (oconfig_item_t *ci) /* {{{ */
+static int agg_config_handle_percentile (oconfig_item_t const *ci, /* {{{ */
+    aggregation_t *agg)
+{
+  int i;
+
+  for (i = 0; i < ci->values_num; i++)
+  {
+    double percent;
+    double *tmp;
+
+    if (ci->values[i].type != OCONFIG_TYPE_NUMBER)
+    {
+      ERROR ("aggregation plugin: Argument %i of the \"CalculatePercentile\" "
+          "option is not a number.", i + 1);
+      continue;
+    }
+
+    percent = ci->values[i].value.number;
+    if (!(percent > 0.0) || (percent > 100.0))
+    {
+      ERROR ("aggregation plugin: The percentile %g is not in the range "
+          "(0, 100] and will be ignored.", percent);
+      continue;
+    }
+
+    tmp = realloc (agg->percentiles,
+        (agg->percentiles_num + 1) * sizeof (*agg->percentiles));
+    if (tmp == NULL)
+    {
+      ERROR ("aggregation plugin: realloc failed.");
+      return (-1);
+    }
+    agg->percentiles = tmp;
+    agg->percentiles[agg->percentiles_num] = percent;
+    agg->percentiles_num++;
+  } /* for (ci->values) */
+
+  return (0);
+} /* }}} int agg_config_handle_percentile */
+
+static int agg_config_aggregation (lookup_t *lk, oconfig_item_t *ci) /* {{{ */
 {
   aggregation_t *agg;
   _Bool is_valid;
@@ -585,6 +767,8 @@ static int agg_config_aggregation (oconfig_item_t *ci) /* {{{ */
       cf_util_get_boolean (child, &agg->calc_max);
     else if (strcasecmp ("CalculateStddev", child->key) == 0)
       cf_util_get_boolean (child, &agg->calc_stddev);
+    else if (strcasecmp ("CalculatePercentile", child->key) == 0)
+      agg_config_handle_percentile (child, agg);
     else
       WARNING ("aggregation plugin: The \"%s\" key is not allowed inside "
           "<Aggregation /> blocks and will be ignored.", child->key);
@@ -647,7 +831,8 @@ static int agg_config_aggregation (oconfig_item_t *ci) /* {{{ */
   } /* }}} */
 
   if (!agg->calc_num && !agg->calc_sum && !agg->calc_average /* {{{ */
-      && !agg->calc_min && !agg->calc_max && !agg->calc_stddev)
+      && !agg->calc_min && !agg->calc_max && !agg->calc_stddev
+      && (agg->percentiles_num == 0))
   {
     ERROR ("aggregation plugin: No aggregation function has been specified. "
         "Without this, I don't know what I should be calculating. "
@@ -660,15 +845,15 @@ static int agg_config_aggregation (oconfig_item_t *ci) /* {{{ */
 
   if (!is_valid) /* {{{ */
   {
-    sfree (agg);
+    agg_destroy (agg);
     return (-1);
   } /* }}} */
 
-  status = lookup_add (lookup, &agg->ident, agg->group_by, agg);
+  status = lookup_add (lk, &agg->ident, agg->group_by, agg);
   if (status != 0)
   {
     ERROR ("aggregation plugin: lookup_add failed with status %i.", status);
-    sfree (agg);
+    agg_destroy (agg);
     return (-1);
   }
 
@@ -680,42 +865,86 @@ static int agg_config_aggregation (oconfig_item_t *ci) /* {{{ */
   return (0);
 } /* }}} int agg_config_aggregation */
 
-static int agg_config (oconfig_item_t *ci) /* {{{ */
+static lookup_t *agg_lookup_create (void) /* {{{ */
+{
+  lookup_t *lk;
+
+  lk = lookup_create (agg_lookup_class_callback,
+      agg_lookup_obj_callback,
+      agg_lookup_free_class_callback,
+      agg_lookup_free_obj_callback);
+  if (lk == NULL)
+    ERROR ("aggregation plugin: lookup_create failed.");
+
+  return (lk);
+} /* }}} lookup_t *agg_lookup_create */
+
+static void agg_config_lookup (lookup_t *lk, oconfig_item_t *ci) /* {{{ */
 {
   int i;
 
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Aggregation", child->key) == 0)
+      agg_config_aggregation (lk, child);
+    else
+      WARNING ("aggregation plugin: The \"%s\" key is not allowed inside "
+          "<Plugin aggregation /> blocks and will be ignored.", child->key);
+  }
+} /* }}} void agg_config_lookup */
+
+static int agg_config (oconfig_item_t *ci) /* {{{ */
+{
   pthread_mutex_lock (&agg_instance_list_lock);
 
   if (lookup == NULL)
   {
-    lookup = lookup_create (agg_lookup_class_callback,
-        agg_lookup_obj_callback,
-        agg_lookup_free_class_callback,
-        agg_lookup_free_obj_callback);
+    lookup = agg_lookup_create ();
     if (lookup == NULL)
     {
       pthread_mutex_unlock (&agg_instance_list_lock);
-      ERROR ("aggregation plugin: lookup_create failed.");
       return (-1);
     }
   }
 
-  for (i = 0; i < ci->children_num; i++)
-  {
-    oconfig_item_t *child = ci->children + i;
-
-    if (strcasecmp ("Aggregation", child->key) == 0)
-      agg_config_aggregation (child);
-    else
-      WARNING ("aggregation plugin: The \"%s\" key is not allowed inside "
-          "<Plugin aggregation /> blocks and will be ignored.", child->key);
-  }
+  agg_config_lookup (lookup, ci);
 
   pthread_mutex_unlock (&agg_instance_list_lock);
 
   return (0);
 } /* }}} int agg_config */
 
+/* Replaces all aggregations. The instances of the old aggregations are not
+ * read anymore, so values received since they have been read last are
+ * lost. */
+static int agg_reload (oconfig_item_t *ci) /* {{{ */
+{
+  lookup_t *new_lookup;
+  lookup_t *old_lookup;
+
+  new_lookup = agg_lookup_create ();
+  if (new_lookup == NULL)
+    return (-1);
+
+  agg_config_lookup (new_lookup, ci);
+
+  pthread_mutex_lock (&agg_instance_list_lock);
+  old_lookup = lookup;
+  lookup = new_lookup;
+  /* Instances the write callback still creates for the old lookup are
+   * added to the new list. agg_instance_destroy() removes them from there
+   * when the old lookup is destroyed. */
+  agg_instance_list_head = NULL;
+  pthread_mutex_unlock (&agg_instance_list_lock);
+
+  lookup_destroy (lookup_retired);
+  lookup_retired = old_lookup;
+
+  return (0);
+} /* }}} int agg_reload */
+
 static int agg_read (void) /* {{{ */
 {
   agg_instance_t *this;
@@ -784,6 +1013,7 @@ static int agg_write (data_set_t const *ds, value_list_t const *vl, /* {{{ */
 void module_register (void)
 {
   plugin_register_complex_config ("aggregation", agg_config);
+  plugin_register_reload_config ("aggregation", agg_reload);
   plugin_register_read ("aggregation", agg_read);
   plugin_register_write ("aggregation", agg_write, /* user_data = */ NULL);
 }
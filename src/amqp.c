@@ -32,8 +32,11 @@
 #include "utils_cmd_putval.h"
 #include "utils_format_json.h"
 #include "utils_format_graphite.h"
+#include "utils_spool.h"
+#include "utils_resolve.h"
 
 #include <pthread.h>
+#include <sys/time.h>
 
 #include <amqp.h>
 #include <amqp_framing.h>
@@ -49,6 +52,13 @@
 
 #define CAMQP_CHANNEL 1
 
+/* Size of the buffer value lists are collected in when batching. Larger
+ * messages are split into frames by the library. */
+#define CAMQP_BATCH_BUFFER_SIZE 131072
+/* How long to wait for publisher confirms once "MaxUnconfirmed" messages are
+ * outstanding, in milliseconds. */
+#define CAMQP_CONFIRM_TIMEOUT 10000
+
 /*
  * Data types
  */
@@ -75,12 +85,40 @@ struct camqp_config_s
     char    *postfix;
     char    escape_char;
     unsigned int graphite_flags;
+    /* publish & JSON format only; protected by "lock" */
+    format_json_cache_t *json_cache;
+    /* publish only: up to "batch_size" value lists are sent in one message.
+     * Protected by "lock". */
+    int      batch_size;
+    cdtime_t batch_timeout;
+    char    *batch_buffer;
+    size_t   batch_fill;
+    int      batch_values;
+    cdtime_t batch_init_time;
+    /* publish only: publisher confirms. Delivery tags count the messages
+     * published on the current channel. */
+    _Bool    confirm;
+    int      max_unconfirmed;
+    uint64_t delivery_tag;
+    uint64_t confirmed_tag;
+    /* publish only: messages which couldn't be published are kept on disk
+     * as the routing key, a null byte and the body. */
+    char    *spool_dir;
+    uint64_t spool_max_size;
+    uint64_t spool_replay_rate;
+    c_spool_t *spool;
+    cdtime_t retry_time;
 
     /* subscribe only */
     char   *exchange_type;
     char   *queue;
+    /* Number of unacknowledged messages the broker may send; zero means
+     * messages are acknowledged automatically. */
+    uint16_t prefetch_count;
 
     amqp_connection_state_t connection;
+    /* Only the first connection waits for the host name to be looked up. */
+    _Bool resolved_once;
     pthread_mutex_t lock;
 };
 typedef struct camqp_config_s camqp_config_t;
@@ -103,6 +141,9 @@ static _Bool      subscriber_threads_running = 1;
 /*
  * Functions
  */
+static int camqp_flush_locked (camqp_config_t *conf,
+        const char *routing_key);
+
 static void camqp_close_connection (camqp_config_t *conf) /* {{{ */
 {
     int sockfd;
@@ -125,6 +166,9 @@ static void camqp_config_free (void *ptr) /* {{{ */
     if (conf == NULL)
         return;
 
+    /* Publish the values still waiting in the batch buffer. */
+    if (conf->publish && (conf->batch_values > 0))
+        camqp_flush_locked (conf, /* routing key = */ NULL);
     camqp_close_connection (conf);
 
     sfree (conf->name);
@@ -138,8 +182,12 @@ static void camqp_config_free (void *ptr) /* {{{ */
     sfree (conf->routing_key);
     sfree (conf->prefix);
     sfree (conf->postfix);
+    format_json_cache_destroy (conf->json_cache);
+    sfree (conf->batch_buffer);
+    sfree (conf->spool_dir);
+    c_spool_destroy (conf->spool);
 
-
+    pthread_mutex_destroy (&conf->lock);
     sfree (conf);
 } /* }}} void camqp_config_free */
 
@@ -366,12 +414,31 @@ static int camqp_setup_queue (camqp_config_t *conf) /* {{{ */
                 conf->queue, conf->exchange);
     } /* if (conf->exchange != NULL) */
 
+    if (conf->prefetch_count > 0)
+    {
+        amqp_basic_qos_ok_t *qos_ret;
+
+        qos_ret = amqp_basic_qos (conf->connection,
+                /* channel        = */ CAMQP_CHANNEL,
+                /* prefetch_size  = */ 0,
+                /* prefetch_count = */ conf->prefetch_count,
+                /* global         = */ 0);
+        if ((qos_ret == NULL) && camqp_is_error (conf))
+        {
+            char errbuf[1024];
+            ERROR ("amqp plugin: amqp_basic_qos failed: %s",
+                    camqp_strerror (conf, errbuf, sizeof (errbuf)));
+            camqp_close_connection (conf);
+            return (-1);
+        }
+    }
+
     cm_ret = amqp_basic_consume (conf->connection,
             /* channel      = */ CAMQP_CHANNEL,
             /* queue        = */ amqp_cstring_bytes (conf->queue),
             /* consumer_tag = */ AMQP_EMPTY_BYTES,
             /* no_local     = */ 0,
-            /* no_ack       = */ 1,
+            /* no_ack       = */ (conf->prefetch_count == 0),
             /* exclusive    = */ 0,
             /* arguments    = */ AMQP_EMPTY_TABLE
         );
@@ -387,8 +454,50 @@ static int camqp_setup_queue (camqp_config_t *conf) /* {{{ */
     return (0);
 } /* }}} int camqp_setup_queue */
 
+/* Looks the broker's host name up through the resolver cache, so that
+ * librabbitmq is handed the numeric address and doesn't block on DNS. */
+static int camqp_resolve (camqp_config_t *conf, /* {{{ */
+        char *buffer, size_t buffer_size)
+{
+    struct addrinfo ai_hints;
+    struct addrinfo *ai_list = NULL;
+    char service[16];
+    int status;
+
+    memset (&ai_hints, 0, sizeof (ai_hints));
+#ifdef AI_ADDRCONFIG
+    ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+    ai_hints.ai_family = AF_UNSPEC;
+    ai_hints.ai_socktype = SOCK_STREAM;
+
+    ssnprintf (service, sizeof (service), "%i", conf->port);
+
+    status = ures_getaddrinfo (CONF(conf, host), service, &ai_hints,
+            /* wait = */ !conf->resolved_once, &ai_list);
+    conf->resolved_once = 1;
+    if (status != 0)
+    {
+        ERROR ("amqp plugin: getaddrinfo (%s) failed: %s",
+                CONF(conf, host), gai_strerror (status));
+        return (-1);
+    }
+
+    status = getnameinfo (ai_list->ai_addr, ai_list->ai_addrlen,
+            buffer, buffer_size, /* service = */ NULL, 0, NI_NUMERICHOST);
+    ures_freeaddrinfo (ai_list);
+    if (status != 0)
+    {
+        ERROR ("amqp plugin: getnameinfo failed: %s", gai_strerror (status));
+        return (-1);
+    }
+
+    return (0);
+} /* }}} int camqp_resolve */
+
 static int camqp_connect (camqp_config_t *conf) /* {{{ */
 {
+    char address[NI_MAXHOST];
     amqp_rpc_reply_t reply;
     int sockfd;
     int status;
@@ -396,6 +505,9 @@ static int camqp_connect (camqp_config_t *conf) /* {{{ */
     if (conf->connection != NULL)
         return (0);
 
+    if (camqp_resolve (conf, address, sizeof (address)) != 0)
+        return (-1);
+
     conf->connection = amqp_new_connection ();
     if (conf->connection == NULL)
     {
@@ -403,7 +515,7 @@ static int camqp_connect (camqp_config_t *conf) /* {{{ */
         return (ENOMEM);
     }
 
-    sockfd = amqp_open_socket (CONF(conf, host), conf->port);
+    sockfd = amqp_open_socket (address, conf->port);
     if (sockfd < 0)
     {
         char errbuf[1024];
@@ -454,6 +566,25 @@ static int camqp_connect (camqp_config_t *conf) /* {{{ */
 
     if (!conf->publish)
         return (camqp_setup_queue (conf));
+
+    conf->delivery_tag = 0;
+    conf->confirmed_tag = 0;
+#if HAVE_AMQP_SIMPLE_WAIT_FRAME_NOBLOCK
+    if (conf->confirm)
+    {
+        amqp_confirm_select_ok_t *cs_ret;
+
+        cs_ret = amqp_confirm_select (conf->connection, CAMQP_CHANNEL);
+        if ((cs_ret == NULL) && camqp_is_error (conf))
+        {
+            char errbuf[1024];
+            ERROR ("amqp plugin: amqp_confirm_select failed: %s",
+                    camqp_strerror (conf, errbuf, sizeof (errbuf)));
+            camqp_close_connection (conf);
+            return (-1);
+        }
+    }
+#endif
     return (0);
 } /* }}} int camqp_connect */
 
@@ -485,17 +616,50 @@ static int camqp_shutdown (void) /* {{{ */
 /*
  * Subscribing code
  */
+/* Handles a message in the "Command" format, which may contain any number of
+ * PUTVAL lines. */
+static int camqp_handle_commands (char *body) /* {{{ */
+{
+    char *saveptr = NULL;
+    char *line;
+    int status = 0;
+
+    for (line = strtok_r (body, "\r\n", &saveptr);
+            line != NULL;
+            line = strtok_r (NULL, "\r\n", &saveptr))
+    {
+        int tmp;
+
+        tmp = handle_putval (stderr, line);
+        if (tmp != 0)
+        {
+            ERROR ("amqp plugin: handle_putval failed with status %i.",
+                    tmp);
+            status = tmp;
+        }
+    }
+
+    return (status);
+} /* }}} int camqp_handle_commands */
+
 static int camqp_read_body (camqp_config_t *conf, /* {{{ */
         size_t body_size, const char *content_type)
 {
-    char body[body_size + 1];
+    char *body;
     char *body_ptr;
     size_t received;
     amqp_frame_t frame;
     int status;
 
-    memset (body, 0, sizeof (body));
-    body_ptr = &body[0];
+    /* Batched messages can be large, so don't put them on the stack. */
+    body = malloc (body_size + 1);
+    if (body == NULL)
+    {
+        ERROR ("amqp plugin: malloc failed.");
+        return (ENOMEM);
+    }
+    body[body_size] = 0;
+    body_ptr = body;
     received = 0;
 
     while (received < body_size)
@@ -508,6 +672,7 @@ static int camqp_read_body (camqp_config_t *conf, /* {{{ */
             ERROR ("amqp plugin: amqp_simple_wait_frame failed: %s",
                     sstrerror (status, errbuf, sizeof (errbuf)));
             camqp_close_connection (conf);
+            sfree (body);
             return (status);
         }
 
@@ -515,12 +680,14 @@ static int camqp_read_body (camqp_config_t *conf, /* {{{ */
         {
             NOTICE ("amqp plugin: Unexpected frame type: %#"PRIx8,
                     frame.frame_type);
+            sfree (body);
             return (-1);
         }
 
         if ((body_size - received) < frame.payload.body_fragment.len)
         {
             WARNING ("amqp plugin: Body is larger than indicated by header.");
+            sfree (body);
             return (-1);
         }
 
@@ -532,27 +699,23 @@ static int camqp_read_body (camqp_config_t *conf, /* {{{ */
 
     if (strcasecmp ("text/collectd", content_type) == 0)
     {
-        status = handle_putval (stderr, body);
-        if (status != 0)
-            ERROR ("amqp plugin: handle_putval failed with status %i.",
-                    status);
-        return (status);
+        status = camqp_handle_commands (body);
     }
     else if (strcasecmp ("application/json", content_type) == 0)
     {
         ERROR ("amqp plugin: camqp_read_body: Parsing JSON data has not "
                 "been implemented yet. FIXME!");
-        return (0);
+        status = 0;
     }
     else
     {
         ERROR ("amqp plugin: camqp_read_body: Unknown content type \"%s\".",
                 content_type);
-        return (EINVAL);
+        status = EINVAL;
     }
 
-    /* not reached */
-    return (0);
+    sfree (body);
+    return (status);
 } /* }}} int camqp_read_body */
 
 static int camqp_read_header (camqp_config_t *conf) /* {{{ */
@@ -603,10 +766,20 @@ static void *camqp_subscribe_thread (void *user_data) /* {{{ */
 
     cdtime_t interval = plugin_get_interval ();
 
+    /* With a prefetch count, received messages are acknowledged in batches
+     * using the "multiple" flag. */
+    uint64_t delivery_tag = 0;
+    int unacked = 0;
+    int ack_threshold = (conf->prefetch_count > 1)
+        ? (conf->prefetch_count / 2) : 1;
+
     while (subscriber_threads_running)
     {
         amqp_frame_t frame;
 
+        if (conf->connection == NULL)
+            unacked = 0;
+
         status = camqp_connect (conf);
         if (status != 0)
         {
@@ -646,7 +819,36 @@ static void *camqp_subscribe_thread (void *user_data) /* {{{ */
             continue;
         }
 
+        delivery_tag = ((amqp_basic_deliver_t *)
+                frame.payload.method.decoded)->delivery_tag;
+
+        /* Messages which cannot be parsed are acknowledged, too. They would
+         * only be delivered again. */
         status = camqp_read_header (conf);
+        if (conf->connection == NULL)
+            continue;
+
+        if (conf->prefetch_count > 0)
+        {
+            unacked++;
+
+            /* Acknowledge once nothing else has been received already. */
+            if ((unacked >= ack_threshold)
+                    || (!amqp_data_in_buffer (conf->connection)
+                        && !amqp_frames_enqueued (conf->connection)))
+            {
+                status = amqp_basic_ack (conf->connection, CAMQP_CHANNEL,
+                        delivery_tag, /* multiple = */ 1);
+                if (status != 0)
+                {
+                    ERROR ("amqp plugin: amqp_basic_ack failed with "
+                            "status %i.", status);
+                    camqp_close_connection (conf);
+                    continue;
+                }
+                unacked = 0;
+            }
+        }
 
         amqp_maybe_release_buffers (conf->connection);
     } /* while (subscriber_threads_running) */
@@ -692,11 +894,82 @@ static int camqp_subscribe_init (camqp_config_t *conf) /* {{{ */
 /*
  * Publishing code
  */
+#if HAVE_AMQP_SIMPLE_WAIT_FRAME_NOBLOCK
+/* Reads the publisher confirms which have arrived. Waits for them while
+ * "max_unconfirmed" or more messages are unconfirmed. Messages rejected by
+ * the broker are not sent again.
+ * XXX: You must hold "conf->lock" when calling this function! */
+static int camqp_read_confirms (camqp_config_t *conf) /* {{{ */
+{
+    while (conf->delivery_tag > conf->confirmed_tag)
+    {
+        _Bool wait = ((conf->delivery_tag - conf->confirmed_tag)
+                >= (uint64_t) conf->max_unconfirmed);
+        struct timeval tv;
+        amqp_frame_t frame;
+        int status;
+
+        tv.tv_sec = wait ? (CAMQP_CONFIRM_TIMEOUT / 1000) : 0;
+        tv.tv_usec = wait ? ((CAMQP_CONFIRM_TIMEOUT % 1000) * 1000) : 0;
+
+        status = amqp_simple_wait_frame_noblock (conf->connection,
+                &frame, &tv);
+        if ((status == AMQP_STATUS_TIMEOUT) && !wait)
+            return (0);
+        else if (status != AMQP_STATUS_OK)
+        {
+            if (status == AMQP_STATUS_TIMEOUT)
+                ERROR ("amqp plugin: Timed out waiting for publisher "
+                        "confirms.");
+            else
+                ERROR ("amqp plugin: amqp_simple_wait_frame_noblock failed "
+                        "with status %i.", status);
+            camqp_close_connection (conf);
+            return (-1);
+        }
+
+        if (frame.frame_type != AMQP_FRAME_METHOD)
+            continue;
+
+        if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD)
+        {
+            amqp_basic_ack_t *ack = frame.payload.method.decoded;
+
+            if (ack->delivery_tag > conf->confirmed_tag)
+                conf->confirmed_tag = ack->delivery_tag;
+        }
+        else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD)
+        {
+            amqp_basic_nack_t *nack = frame.payload.method.decoded;
+
+            if (nack->delivery_tag > conf->confirmed_tag)
+            {
+                ERROR ("amqp plugin: The broker rejected %"PRIu64" "
+                        "message(s).", nack->multiple
+                        ? (nack->delivery_tag - conf->confirmed_tag)
+                        : (uint64_t) 1);
+                conf->confirmed_tag = nack->delivery_tag;
+            }
+        }
+        else if ((frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD)
+                || (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
+        {
+            ERROR ("amqp plugin: The broker closed the connection.");
+            camqp_close_connection (conf);
+            return (-1);
+        }
+    }
+
+    return (0);
+} /* }}} int camqp_read_confirms */
+#endif
+
 /* XXX: You must hold "conf->lock" when calling this function! */
 static int camqp_write_locked (camqp_config_t *conf, /* {{{ */
-        const char *buffer, const char *routing_key)
+        const char *buffer, size_t buffer_len, const char *routing_key)
 {
     amqp_basic_properties_t props;
+    amqp_bytes_t body;
     int status;
 
     status = camqp_connect (conf);
@@ -718,6 +991,9 @@ static int camqp_write_locked (camqp_config_t *conf, /* {{{ */
     props.delivery_mode = conf->delivery_mode;
     props.app_id = amqp_cstring_bytes("collectd");
 
+    body.len = buffer_len;
+    body.bytes = (void *) buffer;
+
     status = amqp_basic_publish(conf->connection,
                 /* channel = */ 1,
                 amqp_cstring_bytes(CONF(conf, exchange)),
@@ -725,97 +1001,352 @@ static int camqp_write_locked (camqp_config_t *conf, /* {{{ */
                 /* mandatory = */ 0,
                 /* immediate = */ 0,
                 &props,
-                amqp_cstring_bytes(buffer));
+                body);
     if (status != 0)
     {
         ERROR ("amqp plugin: amqp_basic_publish failed with status %i.",
                 status);
         camqp_close_connection (conf);
+        return (status);
     }
+    conf->delivery_tag++;
+
+#if HAVE_AMQP_SIMPLE_WAIT_FRAME_NOBLOCK
+    if (conf->confirm)
+        status = camqp_read_confirms (conf);
+#endif
 
     return (status);
 } /* }}} int camqp_write_locked */
 
-static int camqp_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
-        user_data_t *user_data)
+static void camqp_routing_key (camqp_config_t *conf, /* {{{ */
+        const value_list_t *vl, char *routing_key, size_t routing_key_size)
 {
-    camqp_config_t *conf = user_data->data;
-    char routing_key[6 * DATA_MAX_NAME_LEN];
-    char buffer[4096];
+    size_t i;
+
+    if (conf->routing_key != NULL)
+    {
+        sstrncpy (routing_key, conf->routing_key, routing_key_size);
+        return;
+    }
+
+    ssnprintf (routing_key, routing_key_size, "collectd/%s/%s/%s/%s/%s",
+            vl->host,
+            vl->plugin, vl->plugin_instance,
+            vl->type, vl->type_instance);
+
+    /* Switch slashes (the only character forbidden by collectd) and dots
+     * (the separation character used by AMQP). */
+    for (i = 0; routing_key[i] != 0; i++)
+    {
+        if (routing_key[i] == '.')
+            routing_key[i] = '/';
+        else if (routing_key[i] == '/')
+            routing_key[i] = '.';
+    }
+} /* }}} void camqp_routing_key */
+
+static int camqp_spool_append (camqp_config_t *conf, /* {{{ */
+        const char *buffer, size_t buffer_len, const char *routing_key)
+{
+    size_t key_len = strlen (routing_key);
+    char *record;
     int status;
 
-    if ((ds == NULL) || (vl == NULL) || (conf == NULL))
-        return (EINVAL);
+    record = malloc (key_len + 1 + buffer_len);
+    if (record == NULL)
+    {
+        ERROR ("amqp plugin: malloc failed.");
+        return (ENOMEM);
+    }
+    memcpy (record, routing_key, key_len + 1);
+    memcpy (record + key_len + 1, buffer, buffer_len);
 
-    memset (buffer, 0, sizeof (buffer));
+    status = c_spool_append (conf->spool, record, key_len + 1 + buffer_len);
+    if (status != 0)
+        ERROR ("amqp plugin: Spooling a message of %zu bytes failed with "
+                "status %i.", buffer_len, status);
 
-    if (conf->routing_key != NULL)
+    sfree (record);
+    return (status);
+} /* }}} int camqp_spool_append */
+
+/* Publishes spooled messages until the spool is empty, the replay rate has
+ * been used up or publishing fails.
+ * XXX: You must hold "conf->lock" when calling this function! */
+static void camqp_spool_replay (camqp_config_t *conf) /* {{{ */
+{
+    while (42)
     {
-        sstrncpy (routing_key, conf->routing_key, sizeof (routing_key));
+        void *data;
+        size_t data_len;
+        char *body;
+        int status;
+
+        if (c_spool_shift (conf->spool, &data, &data_len) != 0)
+            break;
+
+        body = memchr (data, 0, data_len);
+        if (body == NULL)
+        {
+            ERROR ("amqp plugin: Dropping a spooled message without a "
+                    "routing key.");
+            sfree (data);
+            continue;
+        }
+        body++;
+
+        status = camqp_write_locked (conf, body,
+                data_len - (size_t) (body - (char *) data), data);
+        if (status != 0)
+        {
+            conf->retry_time = cdtime () + TIME_T_TO_CDTIME_T (1);
+            c_spool_append (conf->spool, data, data_len);
+            sfree (data);
+            break;
+        }
+        sfree (data);
     }
+} /* }}} void camqp_spool_replay */
+
+/* Publishes the collected value lists as one message. With batching, the
+ * configured routing key, or "collectd", is used for all of them. If the
+ * message cannot be published and a spool is configured, it is spooled and
+ * published when the broker is available again.
+ * XXX: You must hold "conf->lock" when calling this function! */
+static int camqp_flush_locked (camqp_config_t *conf, /* {{{ */
+        const char *routing_key)
+{
+    size_t fill = conf->batch_fill;
+    int status;
+
+    if (conf->batch_values == 0)
+        return (0);
+
+    if (conf->format == CAMQP_FORMAT_JSON)
+    {
+        size_t bfree = CAMQP_BATCH_BUFFER_SIZE - fill;
+
+        /* format_json_value_list_cached() left room for the closing
+         * bracket. */
+        status = format_json_finalize (conf->batch_buffer, &fill, &bfree);
+        assert (status == 0);
+    }
+
+    if (routing_key == NULL)
+        routing_key = (conf->routing_key != NULL)
+            ? conf->routing_key : "collectd";
+
+    /* Don't wait for a broker which failed a second ago. */
+    if ((conf->spool != NULL) && (conf->connection == NULL)
+            && (cdtime () < conf->retry_time))
+        status = -1;
     else
+        status = camqp_write_locked (conf, conf->batch_buffer, fill,
+                routing_key);
+
+    if (conf->spool != NULL)
     {
-        size_t i;
-        ssnprintf (routing_key, sizeof (routing_key), "collectd/%s/%s/%s/%s/%s",
-                vl->host,
-                vl->plugin, vl->plugin_instance,
-                vl->type, vl->type_instance);
-
-        /* Switch slashes (the only character forbidden by collectd) and dots
-         * (the separation character used by AMQP). */
-        for (i = 0; routing_key[i] != 0; i++)
+        if (status == 0)
+            camqp_spool_replay (conf);
+        else
         {
-            if (routing_key[i] == '.')
-                routing_key[i] = '/';
-            else if (routing_key[i] == '/')
-                routing_key[i] = '.';
+            if (conf->connection == NULL)
+                conf->retry_time = cdtime () + TIME_T_TO_CDTIME_T (1);
+            status = camqp_spool_append (conf, conf->batch_buffer, fill,
+                    routing_key);
         }
     }
 
-    if (conf->format == CAMQP_FORMAT_COMMAND)
+    conf->batch_fill = 0;
+    conf->batch_values = 0;
+
+    return (status);
+} /* }}} int camqp_flush_locked */
+
+/* Appends one value list to the batch buffer. Returns ENOMEM if it doesn't
+ * fit anymore.
+ * XXX: You must hold "conf->lock" when calling this function! */
+static int camqp_batch_add (camqp_config_t *conf, /* {{{ */
+        const data_set_t *ds, const value_list_t *vl)
+{
+    char *buffer = conf->batch_buffer + conf->batch_fill;
+    size_t buffer_size = CAMQP_BATCH_BUFFER_SIZE - conf->batch_fill;
+    size_t len;
+    int status;
+
+    if (conf->format == CAMQP_FORMAT_JSON)
     {
-        status = create_putval (buffer, sizeof (buffer), ds, vl);
-        if (status != 0)
+        size_t bfill = conf->batch_fill;
+        size_t bfree = buffer_size;
+
+        if (conf->json_cache == NULL)
+            conf->json_cache = format_json_cache_create ();
+        if (conf->json_cache == NULL)
+        {
+            ERROR ("amqp plugin: format_json_cache_create failed.");
+            return (-1);
+        }
+
+        if (bfill == 0)
+            format_json_initialize (conf->batch_buffer, &bfill, &bfree);
+        status = format_json_value_list_cached (conf->batch_buffer,
+                &bfill, &bfree, ds, vl, conf->store_rates, conf->json_cache);
+        if (status == -ENOMEM)
+            return (ENOMEM);
+        else if (status != 0)
         {
-            ERROR ("amqp plugin: create_putval failed with status %i.",
+            ERROR ("amqp plugin: Formatting JSON failed with status %i.",
                     status);
             return (status);
         }
+
+        conf->batch_fill = bfill;
     }
-    else if (conf->format == CAMQP_FORMAT_JSON)
+    else
     {
-        size_t bfree = sizeof (buffer);
-        size_t bfill = 0;
+        if (conf->format == CAMQP_FORMAT_COMMAND)
+        {
+            status = create_putval (buffer, buffer_size, ds, vl);
+            if (status != 0)
+            {
+                ERROR ("amqp plugin: create_putval failed with status %i.",
+                        status);
+                return (status);
+            }
+        }
+        else if (conf->format == CAMQP_FORMAT_GRAPHITE)
+        {
+            status = format_graphite (buffer, buffer_size, ds, vl,
+                        conf->prefix, conf->postfix, conf->escape_char,
+                        conf->graphite_flags);
+            if (status != 0)
+            {
+                /* Most likely the buffer is full; retried after a flush. */
+                buffer[0] = 0;
+                return ((conf->batch_fill > 0) ? ENOMEM : status);
+            }
+        }
+        else
+        {
+            ERROR ("amqp plugin: Invalid format (%i).", conf->format);
+            return (-1);
+        }
 
-        format_json_initialize (buffer, &bfill, &bfree);
-        format_json_value_list (buffer, &bfill, &bfree, ds, vl, conf->store_rates);
-        format_json_finalize (buffer, &bfill, &bfree);
+        /* The output has been truncated if it fills the buffer. Commands
+         * need one more byte for the newline separating them. */
+        len = strlen (buffer);
+        if ((len + ((conf->format == CAMQP_FORMAT_COMMAND) ? 2 : 1))
+                >= buffer_size)
+        {
+            buffer[0] = 0;
+            return (ENOMEM);
+        }
+        if (conf->format == CAMQP_FORMAT_COMMAND)
+        {
+            buffer[len++] = '\n';
+            buffer[len] = 0;
+        }
+
+        conf->batch_fill += len;
     }
-    else if (conf->format == CAMQP_FORMAT_GRAPHITE)
+
+    if (conf->batch_values == 0)
+        conf->batch_init_time = cdtime ();
+    conf->batch_values++;
+
+    return (0);
+} /* }}} int camqp_batch_add */
+
+static int camqp_write (const plugin_write_item_t *items, /* {{{ */
+        size_t items_num, user_data_t *user_data)
+{
+    camqp_config_t *conf = user_data->data;
+    int status = 0;
+    size_t i;
+
+    if ((items == NULL) || (conf == NULL))
+        return (EINVAL);
+
+    pthread_mutex_lock (&conf->lock);
+
+    if (conf->batch_buffer == NULL)
+        conf->batch_buffer = malloc (CAMQP_BATCH_BUFFER_SIZE);
+    if (conf->batch_buffer == NULL)
     {
-        status = format_graphite (buffer, sizeof (buffer), ds, vl,
-                    conf->prefix, conf->postfix, conf->escape_char,
-                    conf->graphite_flags);
-        if (status != 0)
+        pthread_mutex_unlock (&conf->lock);
+        ERROR ("amqp plugin: malloc failed.");
+        return (ENOMEM);
+    }
+
+    for (i = 0; i < items_num; i++)
+    {
+        const data_set_t *ds = items[i].ds;
+        const value_list_t *vl = items[i].vl;
+        int tmp;
+
+        tmp = camqp_batch_add (conf, ds, vl);
+        if ((tmp == ENOMEM) && (conf->batch_values > 0))
         {
-            ERROR ("amqp plugin: format_graphite failed with status %i.",
-                    status);
-            return (status);
+            /* The buffer is full: send it and start a new one. */
+            tmp = camqp_flush_locked (conf, /* routing key = */ NULL);
+            if (tmp == 0)
+                tmp = camqp_batch_add (conf, ds, vl);
+        }
+        if (tmp != 0)
+        {
+            if (tmp == ENOMEM)
+                ERROR ("amqp plugin: Value list %s/%s/%s is too large "
+                        "for a message.", vl->host, vl->plugin, vl->type);
+            status = tmp;
+            continue;
+        }
+
+        if (conf->batch_size == 1)
+        {
+            /* Without batching, each value list is routed on its own. */
+            char routing_key[6 * DATA_MAX_NAME_LEN];
+
+            camqp_routing_key (conf, vl, routing_key, sizeof (routing_key));
+            tmp = camqp_flush_locked (conf, routing_key);
         }
+        else if (conf->batch_values >= conf->batch_size)
+            tmp = camqp_flush_locked (conf, /* routing key = */ NULL);
+
+        if (tmp != 0)
+            status = tmp;
     }
-    else
+
+    if ((conf->batch_values > 0)
+            && ((cdtime () - conf->batch_init_time) >= conf->batch_timeout))
     {
-        ERROR ("amqp plugin: Invalid format (%i).", conf->format);
-        return (-1);
+        int tmp = camqp_flush_locked (conf, /* routing key = */ NULL);
+        if (tmp != 0)
+            status = tmp;
     }
 
-    pthread_mutex_lock (&conf->lock);
-    status = camqp_write_locked (conf, buffer, routing_key);
     pthread_mutex_unlock (&conf->lock);
 
     return (status);
 } /* }}} int camqp_write */
 
+static int camqp_flush (cdtime_t timeout, /* {{{ */
+        const char __attribute__((unused)) *identifier,
+        user_data_t *user_data)
+{
+    camqp_config_t *conf = user_data->data;
+    int status = 0;
+
+    pthread_mutex_lock (&conf->lock);
+    if ((conf->batch_values > 0)
+            && ((timeout == 0)
+                || ((cdtime () - conf->batch_init_time) >= timeout)))
+        status = camqp_flush_locked (conf, /* routing key = */ NULL);
+    pthread_mutex_unlock (&conf->lock);
+
+    return (status);
+} /* }}} int camqp_flush */
+
 /*
  * Config handling
  */
@@ -877,6 +1408,14 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
     /* publish only */
     conf->delivery_mode = CAMQP_DM_VOLATILE;
     conf->store_rates = 0;
+    conf->batch_size = 1;
+    conf->batch_timeout = plugin_get_interval ();
+    conf->batch_buffer = NULL;
+    conf->confirm = 0;
+    conf->max_unconfirmed = 128;
+    conf->spool_dir = NULL;
+    conf->spool_max_size = C_SPOOL_DEFAULT_MAX_SIZE;
+    conf->spool_replay_rate = C_SPOOL_DEFAULT_REPLAY_RATE;
     /* publish & graphite only */
     conf->prefix = NULL;
     conf->postfix = NULL;
@@ -884,6 +1423,7 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
     /* subscribe only */
     conf->exchange_type = NULL;
     conf->queue = NULL;
+    conf->prefetch_count = 0;
     /* general */
     conf->connection = NULL;
     pthread_mutex_init (&conf->lock, /* attr = */ NULL);
@@ -892,7 +1432,7 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
     status = cf_util_get_string (ci, &conf->name);
     if (status != 0)
     {
-        sfree (conf);
+        camqp_config_free (conf);
         return (status);
     }
 
@@ -956,6 +1496,59 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
             conf->escape_char = tmp_buff[0];
             sfree (tmp_buff);
         }
+        else if ((strcasecmp ("BatchSize", child->key) == 0) && publish)
+        {
+            status = cf_util_get_int (child, &conf->batch_size);
+            if ((status == 0) && (conf->batch_size < 1))
+            {
+                ERROR ("amqp plugin: \"BatchSize\" must be at least 1.");
+                status = -1;
+            }
+        }
+        else if ((strcasecmp ("BatchFlushTimeout", child->key) == 0) && publish)
+            status = cf_util_get_cdtime (child, &conf->batch_timeout);
+        else if ((strcasecmp ("PublisherConfirms", child->key) == 0) && publish)
+        {
+            status = cf_util_get_boolean (child, &conf->confirm);
+#if !HAVE_AMQP_SIMPLE_WAIT_FRAME_NOBLOCK
+            if ((status == 0) && conf->confirm)
+            {
+                ERROR ("amqp plugin: \"PublisherConfirms\" requires "
+                        "librabbitmq 0.4.0 or later.");
+                status = -1;
+            }
+#endif
+        }
+        else if ((strcasecmp ("MaxUnconfirmed", child->key) == 0) && publish)
+        {
+            status = cf_util_get_int (child, &conf->max_unconfirmed);
+            if ((status == 0) && (conf->max_unconfirmed < 1))
+            {
+                ERROR ("amqp plugin: \"MaxUnconfirmed\" must be at least 1.");
+                status = -1;
+            }
+        }
+        else if ((strcasecmp ("SpoolDirectory", child->key) == 0) && publish)
+            status = cf_util_get_string (child, &conf->spool_dir);
+        else if ((strcasecmp ("SpoolMaxSize", child->key) == 0) && publish)
+            status = c_spool_config_size (child, &conf->spool_max_size,
+                    1024 * 1024);
+        else if ((strcasecmp ("SpoolReplayRate", child->key) == 0) && publish)
+            status = c_spool_config_size (child, &conf->spool_replay_rate,
+                    1024);
+        else if ((strcasecmp ("PrefetchCount", child->key) == 0) && !publish)
+        {
+            int tmp = 0;
+            status = cf_util_get_int (child, &tmp);
+            if ((status == 0) && ((tmp < 0) || (tmp > 65535)))
+            {
+                ERROR ("amqp plugin: \"PrefetchCount\" must be between "
+                        "0 and 65535.");
+                status = -1;
+            }
+            else if (status == 0)
+                conf->prefetch_count = (uint16_t) tmp;
+        }
         else
             WARNING ("amqp plugin: Ignoring unknown "
                     "configuration option \"%s\".", child->key);
@@ -976,6 +1569,18 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
 
     }
 
+    if ((status == 0) && (conf->spool_dir != NULL))
+    {
+        conf->spool = c_spool_create (conf->spool_dir, conf->spool_max_size,
+                conf->spool_replay_rate);
+        if (conf->spool == NULL)
+        {
+            ERROR ("amqp plugin: Opening the spool in \"%s\" failed.",
+                    conf->spool_dir);
+            status = -1;
+        }
+    }
+
     if (status != 0)
     {
         camqp_config_free (conf);
@@ -995,12 +1600,15 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
 
         ssnprintf (cbname, sizeof (cbname), "amqp/%s", conf->name);
 
-        status = plugin_register_write (cbname, camqp_write, &ud);
+        status = plugin_register_write_batch (cbname, camqp_write, &ud);
         if (status != 0)
         {
             camqp_config_free (conf);
             return (status);
         }
+
+        ud.free_func = NULL;
+        plugin_register_flush (cbname, camqp_flush, &ud);
     }
     else
     {
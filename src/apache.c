@@ -28,6 +28,7 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
+#include "utils_curl_multi.h"
 
 #include <curl/curl.h>
 
@@ -54,6 +55,9 @@ struct apache_s
 	size_t apache_buffer_size;
 	size_t apache_buffer_fill;
 	CURL *curl;
+	/* Interval of the read callback, for values dispatched by the fetch
+	 * thread. */
+	cdtime_t interval;
 }; /* apache_s */
 
 typedef struct apache_s apache_t;
@@ -80,6 +84,16 @@ static void apache_free (apache_t *st)
 	}
 } /* apache_free */
 
+/* Frees the user data of a read callback. Those are freed before the
+ * shutdown callbacks are called, so the transfers still using it are
+ * aborted here. Instances failing their configuration have never been
+ * submitted and must not stop the other instances' transfers. */
+static void apache_read_free (void *arg)
+{
+	ucm_shutdown ();
+	apache_free (arg);
+} /* apache_read_free */
+
 static size_t apache_curl_callback (void *buf, size_t size, size_t nmemb,
 		void *user_data)
 {
@@ -307,7 +321,7 @@ static int config_add (oconfig_item_t *ci)
 
 		memset (&ud, 0, sizeof (ud));
 		ud.data = st;
-		ud.free_func = (void *) apache_free;
+		ud.free_func = apache_read_free;
 
 		memset (callback_name, 0, sizeof (callback_name));
 		ssnprintf (callback_name, sizeof (callback_name),
@@ -342,6 +356,8 @@ static int config (oconfig_item_t *ci)
 
 		if (strcasecmp ("Instance", child->key) == 0)
 			config_add (child);
+		else if (ucm_config (child) <= 0)
+			/* option of the fetch service */;
 		else
 			WARNING ("apache plugin: The configuration option "
 					"\"%s\" is not allowed here. Did you "
@@ -474,6 +490,8 @@ static void submit_value (const char *type, const char *type_instance,
 		sstrncpy (vl.type_instance, type_instance,
 				sizeof (vl.type_instance));
 
+	vl.interval = st->interval;
+
 	plugin_dispatch_values (&vl);
 } /* void submit_value */
 
@@ -581,7 +599,9 @@ static void submit_scoreboard (char *buf, apache_t *st)
 	}
 }
 
-static int apache_read_host (user_data_t *user_data) /* {{{ */
+/* Called by the fetch thread when the transfer has finished. */
+static void apache_curl_done (CURL __attribute__((unused)) *curl, /* {{{ */
+		CURLcode status, void *user_data)
 {
 	int i;
 
@@ -593,29 +613,17 @@ static int apache_read_host (user_data_t *user_data) /* {{{ */
 	char *fields[4];
 	int   fields_num;
 
-	apache_t *st;
-
-	st = user_data->data;
+	apache_t *st = user_data;
 
-	assert (st->url != NULL);
-	/* (Assured by `config_add') */
-
-	if (st->curl == NULL)
+	if ((status != CURLE_OK) || (st->apache_buffer_fill == 0))
 	{
-		int status;
-
-		status = init_host (st);
-		if (status != 0)
-			return (-1);
-	}
-	assert (st->curl != NULL);
-
-	st->apache_buffer_fill = 0;
-	if (curl_easy_perform (st->curl) != 0)
-	{
-		ERROR ("apache: curl_easy_perform failed: %s",
-				st->apache_curl_error);
-		return (-1);
+		if (status != CURLE_ABORTED_BY_CALLBACK)
+			ERROR ("apache: curl_easy_perform failed: %s",
+					(status != CURLE_OK)
+					? st->apache_curl_error
+					: "Empty response");
+		st->apache_buffer_fill = 0;
+		return;
 	}
 
 	/* fallback - server_type to apache if not set at this time */
@@ -665,7 +673,46 @@ static int apache_read_host (user_data_t *user_data) /* {{{ */
 		}
 	}
 
+	/* Reset here rather than in apache_read_host, which doesn't know
+	 * whether a transfer is still running. */
 	st->apache_buffer_fill = 0;
+} /* }}} void apache_curl_done */
+
+static int apache_read_host (user_data_t *user_data) /* {{{ */
+{
+	apache_t *st;
+	int status;
+
+	st = user_data->data;
+
+	assert (st->url != NULL);
+	/* (Assured by `config_add') */
+
+	/* No transfer can be running without a handle. */
+	if (st->curl == NULL)
+	{
+		st->interval = plugin_get_interval ();
+
+		status = init_host (st);
+		if (status != 0)
+			return (-1);
+	}
+	assert (st->curl != NULL);
+
+	status = ucm_submit (st->curl, st->url, apache_curl_done, st);
+	if (status == EBUSY)
+	{
+		WARNING ("apache plugin: The previous request for %s is still "
+				"in progress. Skipping this interval.",
+				st->url);
+		return (-1);
+	}
+	else if (status != 0)
+	{
+		ERROR ("apache plugin: ucm_submit failed with status %i.",
+				status);
+		return (-1);
+	}
 
 	return (0);
 } /* }}} int apache_read_host */
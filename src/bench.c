@@ -0,0 +1,912 @@
+/**
+ * collectd - src/bench.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "meta_data.h"
+#include "filter_chain.h"
+#include "utils_avltree.h"
+#include "utils_cache.h"
+#include "utils_heap.h"
+#include "utils_htable.h"
+#include "utils_format_graphite.h"
+#include "utils_format_json.h"
+#include "bench.h"
+
+#include <time.h>
+
+/* Defined by collectd.c in the daemon. */
+char hostname_g[DATA_MAX_NAME_LEN] = "localhost";
+cdtime_t interval_g;
+int  timeout_g = 2;
+_Bool float_format_legacy_g = 0;
+#if HAVE_LIBKSTAT
+kstat_ctl_t *kc;
+#endif /* HAVE_LIBKSTAT */
+
+/* The series are spread over this many hosts and plugins. Every third series
+ * has two derive data sources, the others one gauge. */
+#define BENCH_SERIES_DEFAULT 10000
+#define BENCH_HOSTS           100
+#define BENCH_PLUGINS          20
+
+/* Number of rules in the filter chain benchmark. Only every other rule
+ * matches any of the series' plugins. */
+#define BENCH_RULES            20
+
+/* The configuration parsed by the oconfig_parse benchmark has this many
+ * <Host> blocks of four options each, i.e. 100000 statements. */
+#define BENCH_CONFIG_HOSTS  20000
+
+struct bench_def_s
+{
+  const char *name;
+  void (*func) (bench_t *b);
+  /* Scaled by the "-n" option. */
+  uint64_t iterations;
+};
+typedef struct bench_def_s bench_def_t;
+
+static value_list_t *series = NULL;
+static value_t *series_values = NULL;
+static char **series_names = NULL;
+static size_t series_num = BENCH_SERIES_DEFAULT;
+
+static data_source_t dsrc_gauge[] = {
+  { "value", DS_TYPE_GAUGE, 0.0, NAN }
+};
+static data_set_t ds_gauge = { "gauge", 1, dsrc_gauge };
+
+static data_source_t dsrc_if_octets[] = {
+  { "rx", DS_TYPE_DERIVE, 0.0, NAN },
+  { "tx", DS_TYPE_DERIVE, 0.0, NAN }
+};
+static data_set_t ds_if_octets = { "if_octets", 2, dsrc_if_octets };
+
+/* Incremented for each round of updates, so values are never too old. */
+static cdtime_t bench_time = 0;
+
+static uint64_t bench_counter = 0;
+
+static uint64_t bench_now (void) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((((uint64_t) ts.tv_sec) * 1000000000) + ((uint64_t) ts.tv_nsec));
+} /* }}} uint64_t bench_now */
+
+void bench_start (bench_t *b) /* {{{ */
+{
+  b->ops = b->iterations;
+  b->start_ns = bench_now ();
+} /* }}} void bench_start */
+
+void bench_stop (bench_t *b) /* {{{ */
+{
+  b->elapsed_ns = bench_now () - b->start_ns;
+} /* }}} void bench_stop */
+
+static const data_set_t *bench_ds (const value_list_t *vl) /* {{{ */
+{
+  return ((strcmp (vl->type, "gauge") == 0) ? &ds_gauge : &ds_if_octets);
+} /* }}} const data_set_t *bench_ds */
+
+/* Returns a permutation of [0, num), the same one on every run. */
+static size_t *bench_permutation (size_t num) /* {{{ */
+{
+  unsigned short state[3] = { 0x1234, 0x5678, 0x9abc };
+  size_t *perm;
+  size_t i;
+
+  perm = malloc (num * sizeof (*perm));
+  if (perm == NULL)
+    return (NULL);
+
+  for (i = 0; i < num; i++)
+    perm[i] = i;
+  for (i = num - 1; i > 0; i--)
+  {
+    size_t j = (size_t) (erand48 (state) * ((double) (i + 1)));
+    size_t tmp = perm[i];
+
+    perm[i] = perm[j];
+    perm[j] = tmp;
+  }
+
+  return (perm);
+} /* }}} size_t *bench_permutation */
+
+/* The value lists are ordered like a client would send them: all series of
+ * a host, and of each of its plugins, after one another. */
+static int bench_series_create (void) /* {{{ */
+{
+  char name[6 * DATA_MAX_NAME_LEN];
+  size_t i;
+
+  series = calloc (series_num, sizeof (*series));
+  series_values = calloc (2 * series_num, sizeof (*series_values));
+  series_names = calloc (series_num, sizeof (*series_names));
+  if ((series == NULL) || (series_values == NULL) || (series_names == NULL))
+    return (ENOMEM);
+
+  for (i = 0; i < series_num; i++)
+  {
+    value_list_t *vl = series + i;
+    size_t per_host = (series_num + BENCH_HOSTS - 1) / BENCH_HOSTS;
+    size_t per_plugin = (per_host + BENCH_PLUGINS - 1) / BENCH_PLUGINS;
+    size_t in_host = i % per_host;
+
+    vl->values = series_values + 2 * i;
+    vl->time = TIME_T_TO_CDTIME_T (1000000000);
+    vl->interval = TIME_T_TO_CDTIME_T (10);
+    ssnprintf (vl->host, sizeof (vl->host), "host%03zu.example.com",
+        i / per_host);
+    ssnprintf (vl->plugin, sizeof (vl->plugin), "plugin%02zu",
+        in_host / per_plugin);
+    ssnprintf (vl->plugin_instance, sizeof (vl->plugin_instance), "%zu",
+        (in_host % per_plugin) / 4);
+    if ((i % 3) == 0)
+    {
+      sstrncpy (vl->type, "if_octets", sizeof (vl->type));
+      vl->values[0].derive = (derive_t) (1000 * i);
+      vl->values[1].derive = (derive_t) (2000 * i);
+      vl->values_len = 2;
+    }
+    else
+    {
+      sstrncpy (vl->type, "gauge", sizeof (vl->type));
+      vl->values[0].gauge = 0.5 * ((double) i);
+      vl->values_len = 1;
+    }
+    ssnprintf (vl->type_instance, sizeof (vl->type_instance), "ti%zu",
+        in_host % 4);
+
+    if (FORMAT_VL (name, sizeof (name), vl) != 0)
+      return (-1);
+    series_names[i] = strdup (name);
+    if (series_names[i] == NULL)
+      return (ENOMEM);
+  }
+
+  return (0);
+} /* }}} int bench_series_create */
+
+static int bench_compare_string (const void *a, const void *b) /* {{{ */
+{
+  return (strcmp (a, b));
+} /* }}} int bench_compare_string */
+
+static void bench_avl_insert (bench_t *b) /* {{{ */
+{
+  c_avl_tree_t *t = c_avl_create (bench_compare_string);
+  size_t *perm = bench_permutation (series_num);
+  uint64_t i;
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    char *key = series_names[perm[i % series_num]];
+
+    if (c_avl_insert (t, key, key) != 0)
+      c_avl_remove (t, key, NULL, NULL);
+  }
+  bench_stop (b);
+
+  c_avl_destroy (t);
+  sfree (perm);
+} /* }}} void bench_avl_insert */
+
+static void bench_avl_get (bench_t *b) /* {{{ */
+{
+  c_avl_tree_t *t = c_avl_create (bench_compare_string);
+  size_t *perm = bench_permutation (series_num);
+  uint64_t i;
+  size_t found = 0;
+
+  for (i = 0; i < series_num; i++)
+    c_avl_insert (t, series_names[i], series_names[i]);
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+    if (c_avl_get (t, series_names[perm[i % series_num]], NULL) == 0)
+      found++;
+  bench_stop (b);
+
+  assert (found == b->iterations);
+  c_avl_destroy (t);
+  sfree (perm);
+} /* }}} void bench_avl_get */
+
+static void bench_htable_insert (bench_t *b) /* {{{ */
+{
+  c_htable_t *t = c_htable_create ();
+  size_t *perm = bench_permutation (series_num);
+  uint64_t i;
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    char *key = series_names[perm[i % series_num]];
+
+    if (c_htable_insert (t, key, key) != 0)
+      c_htable_remove (t, key, NULL, NULL);
+  }
+  bench_stop (b);
+
+  c_htable_destroy (t);
+  sfree (perm);
+} /* }}} void bench_htable_insert */
+
+static void bench_htable_get (bench_t *b) /* {{{ */
+{
+  c_htable_t *t = c_htable_create ();
+  size_t *perm = bench_permutation (series_num);
+  uint64_t i;
+  size_t found = 0;
+
+  for (i = 0; i < series_num; i++)
+    c_htable_insert (t, series_names[i], series_names[i]);
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+    if (c_htable_get (t, series_names[perm[i % series_num]], NULL) == 0)
+      found++;
+  bench_stop (b);
+
+  assert (found == b->iterations);
+  c_htable_destroy (t);
+  sfree (perm);
+} /* }}} void bench_htable_get */
+
+/* Iterates over all entries, like the cache does to check for timeouts. */
+static void bench_avl_iterate (bench_t *b) /* {{{ */
+{
+  c_avl_tree_t *t = c_avl_create (bench_compare_string);
+  c_avl_iterator_t *iter = NULL;
+  uint64_t i;
+
+  for (i = 0; i < series_num; i++)
+    c_avl_insert (t, series_names[i], series_names[i]);
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    void *key;
+    void *value;
+
+    if ((iter == NULL) || (c_avl_iterator_next (iter, &key, &value) != 0))
+    {
+      if (iter != NULL)
+        c_avl_iterator_destroy (iter);
+      iter = c_avl_get_iterator (t);
+      c_avl_iterator_next (iter, &key, &value);
+    }
+  }
+  bench_stop (b);
+
+  c_avl_iterator_destroy (iter);
+  c_avl_destroy (t);
+} /* }}} void bench_avl_iterate */
+
+static int bench_compare_time (const void *a, const void *b) /* {{{ */
+{
+  const cdtime_t *t0 = a;
+  const cdtime_t *t1 = b;
+
+  if (*t0 < *t1)
+    return (-1);
+  else if (*t0 > *t1)
+    return (1);
+  else
+    return (0);
+} /* }}} int bench_compare_time */
+
+/* Inserts "series_num" entries, then replaces the root with a later one,
+ * like the read and timer threads reschedule their entries. */
+static void bench_heap (bench_t *b, _Bool reschedule) /* {{{ */
+{
+  c_heap_t *h = c_heap_create (bench_compare_time);
+  size_t *perm = bench_permutation (series_num);
+  cdtime_t *times = calloc (series_num, sizeof (*times));
+  uint64_t i;
+
+  for (i = 0; i < series_num; i++)
+    times[i] = (cdtime_t) perm[i];
+
+  if (!reschedule)
+    bench_start (b);
+  for (i = 0; i < series_num; i++)
+    c_heap_insert (h, times + i);
+  if (!reschedule)
+  {
+    bench_stop (b);
+    b->ops = series_num;
+  }
+  else
+  {
+    bench_start (b);
+    for (i = 0; i < b->iterations; i++)
+    {
+      cdtime_t *t = c_heap_get_root (h);
+
+      *t += (cdtime_t) series_num;
+      c_heap_insert (h, t);
+    }
+    bench_stop (b);
+  }
+
+  while (c_heap_get_root (h) != NULL)
+    /* empty */;
+  c_heap_destroy (h);
+  sfree (times);
+  sfree (perm);
+} /* }}} void bench_heap */
+
+static void bench_heap_insert (bench_t *b) /* {{{ */
+{
+  bench_heap (b, /* reschedule = */ 0);
+} /* }}} void bench_heap_insert */
+
+static void bench_heap_reschedule (bench_t *b) /* {{{ */
+{
+  bench_heap (b, /* reschedule = */ 1);
+} /* }}} void bench_heap_reschedule */
+
+static void bench_format_vl (bench_t *b) /* {{{ */
+{
+  char name[6 * DATA_MAX_NAME_LEN];
+  uint64_t i;
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+    FORMAT_VL (name, sizeof (name), series + (i % series_num));
+  bench_stop (b);
+} /* }}} void bench_format_vl */
+
+static void bench_uc_update (bench_t *b) /* {{{ */
+{
+  uint64_t i;
+
+  /* Makes sure all series are in the cache, so only updates are measured. */
+  bench_time += TIME_T_TO_CDTIME_T (10);
+  for (i = 0; i < series_num; i++)
+  {
+    series[i].time = bench_time;
+    uc_update (bench_ds (series + i), series + i);
+  }
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    value_list_t *vl = series + (i % series_num);
+
+    if ((i % series_num) == 0)
+      bench_time += TIME_T_TO_CDTIME_T (10);
+    vl->time = bench_time;
+    if (vl->values_len == 2)
+    {
+      vl->values[0].derive += 1000;
+      vl->values[1].derive += 2000;
+    }
+    uc_update (bench_ds (vl), vl);
+  }
+  bench_stop (b);
+} /* }}} void bench_uc_update */
+
+/* A match which compares the plugin of the value list with the "Plugin"
+ * option, like the regex match does with a literal. */
+static int bench_match_create (const oconfig_item_t *ci, /* {{{ */
+    void **user_data)
+{
+  char *plugin = NULL;
+
+  if ((ci->children_num != 1)
+      || (cf_util_get_string (ci->children, &plugin) != 0))
+    return (-1);
+
+  *user_data = plugin;
+  return (0);
+} /* }}} int bench_match_create */
+
+static int bench_match_destroy (void **user_data) /* {{{ */
+{
+  sfree (*user_data);
+  return (0);
+} /* }}} int bench_match_destroy */
+
+static int bench_match_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
+    const value_list_t *vl,
+    notification_meta_t __attribute__((unused)) **meta, void **user_data)
+{
+  if (strcmp (vl->plugin, *user_data) == 0)
+    return (FC_MATCH_MATCHES);
+  return (FC_MATCH_NO_MATCH);
+} /* }}} int bench_match_match */
+
+static int bench_match_constraints (void **user_data, /* {{{ */
+    fc_match_constraints_t *ret)
+{
+  ret->plugin = *user_data;
+  return (0);
+} /* }}} int bench_match_constraints */
+
+static int bench_target_invoke (const data_set_t __attribute__((unused)) *ds, /* {{{ */
+    value_list_t __attribute__((unused)) *vl,
+    notification_meta_t __attribute__((unused)) **meta,
+    void __attribute__((unused)) **user_data)
+{
+  bench_counter++;
+  return (FC_TARGET_CONTINUE);
+} /* }}} int bench_target_invoke */
+
+static fc_chain_t *bench_chain_create (void) /* {{{ */
+{
+  char config[8192];
+  size_t len = 0;
+  FILE *fh;
+  oconfig_item_t *ci;
+  match_proc_t mproc = { 0 };
+  target_proc_t tproc = { 0 };
+  int status;
+  int i;
+
+  mproc.create = bench_match_create;
+  mproc.destroy = bench_match_destroy;
+  mproc.match = bench_match_match;
+  mproc.constraints = bench_match_constraints;
+  mproc.flags = FC_MATCH_IDENTIFIER_ONLY;
+  fc_register_match ("bench_plugin", mproc);
+
+  tproc.invoke = bench_target_invoke;
+  fc_register_target ("bench_count", tproc);
+
+  /* Drops the series of some plugins and passes the others on, like a
+   * typical PostCacheChain. */
+  len += ssnprintf (config + len, sizeof (config) - len,
+      "<Chain \"bench\">\n");
+  for (i = 0; i < BENCH_RULES; i++)
+    len += ssnprintf (config + len, sizeof (config) - len,
+        "  <Rule \"rule%i\">\n"
+        "    <Match \"bench_plugin\">\n"
+        "      Plugin \"plugin%02i\"\n"
+        "    </Match>\n"
+        "    Target \"bench_count\"\n"
+        "    Target \"stop\"\n"
+        "  </Rule>\n", i, 2 * i);
+  len += ssnprintf (config + len, sizeof (config) - len,
+      "  Target \"bench_count\"\n"
+      "</Chain>\n");
+  assert (len < sizeof (config));
+
+  fh = fmemopen (config, len, "r");
+  if (fh == NULL)
+    return (NULL);
+  ci = oconfig_parse_fh (fh);
+  fclose (fh);
+  if ((ci == NULL) || (ci->children_num != 1))
+    return (NULL);
+
+  status = fc_configure (ci->children);
+  oconfig_free (ci);
+  if (status != 0)
+    return (NULL);
+
+  return (fc_chain_get_by_name ("bench"));
+} /* }}} fc_chain_t *bench_chain_create */
+
+static void bench_fc_process_chain (bench_t *b) /* {{{ */
+{
+  static fc_chain_t *chain = NULL;
+  uint64_t i;
+
+  if (chain == NULL)
+    chain = bench_chain_create ();
+  if (chain == NULL)
+  {
+    b->ops = 0;
+    return;
+  }
+
+  bench_counter = 0;
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    value_list_t *vl = series + (i % series_num);
+
+    fc_process_chain (bench_ds (vl), vl, chain);
+  }
+  bench_stop (b);
+
+  assert (bench_counter == b->iterations);
+} /* }}} void bench_fc_process_chain */
+
+static void bench_format_graphite (bench_t *b) /* {{{ */
+{
+  char buffer[4096];
+  uint64_t i;
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    value_list_t *vl = series + (i % series_num);
+
+    format_graphite (buffer, sizeof (buffer), bench_ds (vl), vl,
+        "collectd.", /* postfix = */ "", /* escape_char = */ '_',
+        GRAPHITE_SEPARATE_INSTANCES);
+  }
+  bench_stop (b);
+} /* }}} void bench_format_graphite */
+
+static void bench_format_graphite_cached (bench_t *b) /* {{{ */
+{
+  graphite_name_cache_t *c;
+  char buffer[4096];
+  uint64_t i;
+
+  c = graphite_name_cache_create ("collectd.", /* postfix = */ "",
+      /* escape_char = */ '_', GRAPHITE_SEPARATE_INSTANCES);
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    value_list_t *vl = series + (i % series_num);
+
+    format_graphite_cached (buffer, sizeof (buffer), bench_ds (vl), vl, c);
+  }
+  bench_stop (b);
+
+  graphite_name_cache_destroy (c);
+} /* }}} void bench_format_graphite_cached */
+
+static void bench_format_json (bench_t *b, /* {{{ */
+    format_json_cache_t *cache)
+{
+  char buffer[4096];
+  uint64_t i;
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    value_list_t *vl = series + (i % series_num);
+    size_t fill = 0;
+    size_t left = sizeof (buffer);
+
+    format_json_initialize (buffer, &fill, &left);
+    if (cache == NULL)
+      format_json_value_list (buffer, &fill, &left, bench_ds (vl), vl,
+          /* store_rates = */ 0);
+    else
+      format_json_value_list_cached (buffer, &fill, &left, bench_ds (vl), vl,
+          /* store_rates = */ 0, cache);
+  }
+  bench_stop (b);
+} /* }}} void bench_format_json */
+
+static void bench_format_json_value_list (bench_t *b) /* {{{ */
+{
+  bench_format_json (b, /* cache = */ NULL);
+} /* }}} void bench_format_json_value_list */
+
+static void bench_format_json_value_list_cached (bench_t *b) /* {{{ */
+{
+  format_json_cache_t *cache = format_json_cache_create ();
+
+  bench_format_json (b, cache);
+  format_json_cache_destroy (cache);
+} /* }}} void bench_format_json_value_list_cached */
+
+/* Clones and frees meta data like the network plugin attaches to received
+ * value lists, plus a few entries other plugins typically add. */
+static void bench_meta_data_clone (bench_t *b) /* {{{ */
+{
+  meta_data_t *md = meta_data_create ();
+  uint64_t i;
+
+  meta_data_add_boolean (md, "network:received", 1);
+  meta_data_add_string (md, "network:username", "bench");
+  meta_data_add_string (md, "network:source", "192.0.2.1");
+  meta_data_add_signed_int (md, "bench:signed", -42);
+  meta_data_add_unsigned_int (md, "bench:unsigned", 42);
+  meta_data_add_double (md, "bench:double", 0.5);
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+    meta_data_destroy (meta_data_clone (md));
+  bench_stop (b);
+
+  meta_data_destroy (md);
+} /* }}} void bench_meta_data_clone */
+
+static void bench_add_to_buffer (bench_t *b) /* {{{ */
+{
+  if (bench_network_add_to_buffer (b, series, series_num) != 0)
+    b->ops = 0;
+} /* }}} void bench_add_to_buffer */
+
+static void bench_parse_packet (bench_t *b, int security_level) /* {{{ */
+{
+  if (bench_network_parse_packet (b, series, series_num,
+        security_level) != 0)
+    b->ops = 0;
+} /* }}} void bench_parse_packet */
+
+static void bench_parse_packet_plain (bench_t *b) /* {{{ */
+{
+  bench_parse_packet (b, /* security_level = */ 0);
+} /* }}} void bench_parse_packet_plain */
+
+static void bench_parse_packet_signed (bench_t *b) /* {{{ */
+{
+  bench_parse_packet (b, /* security_level = */ 1);
+} /* }}} void bench_parse_packet_signed */
+
+static void bench_parse_packet_encrypted (bench_t *b) /* {{{ */
+{
+  bench_parse_packet (b, /* security_level = */ 2);
+} /* }}} void bench_parse_packet_encrypted */
+
+/* Writes a configuration like that of a large SNMP setup to a temporary
+ * file. Returns the number of statements or zero on failure. */
+static uint64_t bench_config_write (char *file, size_t file_size) /* {{{ */
+{
+  FILE *fh;
+  int fd;
+  int i;
+
+  sstrncpy (file, "/tmp/collectd_bench.conf.XXXXXX", file_size);
+  fd = mkstemp (file);
+  if (fd < 0)
+    return (0);
+
+  fh = fdopen (fd, "w");
+  if (fh == NULL)
+  {
+    close (fd);
+    unlink (file);
+    return (0);
+  }
+
+  fprintf (fh, "<Plugin \"snmp\">\n");
+  for (i = 0; i < BENCH_CONFIG_HOSTS; i++)
+    fprintf (fh, "  <Host \"host%05i.example.com\">\n"
+        "    Address \"192.0.2.%i\"\n"
+        "    Version 2\n"
+        "    Community \"public\"\n"
+        "    Collect \"std_traffic\" \"ifmib_if_errors\" \"hr_cpu\"\n"
+        "  </Host>\n", i, i % 256);
+  fprintf (fh, "</Plugin>\n");
+
+  if (fclose (fh) != 0)
+  {
+    unlink (file);
+    return (0);
+  }
+
+  return (1 + 5 * ((uint64_t) BENCH_CONFIG_HOSTS));
+} /* }}} uint64_t bench_config_write */
+
+static void bench_oconfig_parse (bench_t *b) /* {{{ */
+{
+  char file[64];
+  uint64_t statements;
+  uint64_t i;
+
+  statements = bench_config_write (file, sizeof (file));
+  if (statements == 0)
+  {
+    b->ops = 0;
+    return;
+  }
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    oconfig_item_t *ci = oconfig_parse_file (file);
+
+    if (ci == NULL)
+      break;
+    oconfig_free (ci);
+    sfree (ci);
+  }
+  bench_stop (b);
+
+  b->ops = (i < b->iterations) ? 0 : b->iterations * statements;
+  unlink (file);
+} /* }}} void bench_oconfig_parse */
+
+/* Keeps the messages of the daemon's code, e.g. about each new cache entry,
+ * from drowning the results. */
+static void bench_log (int severity, const char *msg, /* {{{ */
+    user_data_t __attribute__((unused)) *ud)
+{
+  if (severity <= LOG_WARNING)
+    fprintf (stderr, "%s\n", msg);
+} /* }}} void bench_log */
+
+static bench_def_t benchmarks[] =
+{
+  { "c_avl_insert",                  bench_avl_insert,                1000000 },
+  { "c_avl_get",                     bench_avl_get,                   1000000 },
+  { "c_avl_iterate",                 bench_avl_iterate,               1000000 },
+  { "c_htable_insert",               bench_htable_insert,             1000000 },
+  { "c_htable_get",                  bench_htable_get,                1000000 },
+  { "c_heap_insert",                 bench_heap_insert,                     0 },
+  { "c_heap_reschedule",             bench_heap_reschedule,           1000000 },
+  { "format_vl",                     bench_format_vl,                 1000000 },
+  { "uc_update",                     bench_uc_update,                 1000000 },
+  { "fc_process_chain",              bench_fc_process_chain,          1000000 },
+  { "format_graphite",               bench_format_graphite,           1000000 },
+  { "format_graphite_cached",        bench_format_graphite_cached,    1000000 },
+  { "format_json_value_list",        bench_format_json_value_list,    1000000 },
+  { "format_json_value_list_cached", bench_format_json_value_list_cached, 1000000 },
+  { "meta_data_clone",               bench_meta_data_clone,           1000000 },
+  { "add_to_buffer",                 bench_add_to_buffer,             1000000 },
+  /* The number of packets; the rate is reported for value lists. */
+  { "parse_packet_plain",            bench_parse_packet_plain,          20000 },
+  { "parse_packet_signed",           bench_parse_packet_signed,         20000 },
+  { "parse_packet_encrypted",        bench_parse_packet_encrypted,      20000 },
+  /* The number of files parsed; the rate is reported for statements. */
+  { "oconfig_parse",                 bench_oconfig_parse,                   5 }
+};
+
+static int compare_double (const void *a, const void *b) /* {{{ */
+{
+  double d0 = *((const double *) a);
+  double d1 = *((const double *) b);
+
+  if (d0 < d1)
+    return (-1);
+  else if (d0 > d1)
+    return (1);
+  else
+    return (0);
+} /* }}} int compare_double */
+
+/* Prints one line per benchmark: its name, the number of operations of each
+ * run, the fastest and the median time per operation in nanoseconds and the
+ * operations per second of the fastest run. */
+static int bench_run (bench_def_t const *def, double scale, /* {{{ */
+    int repeat)
+{
+  double ns_per_op[repeat];
+  bench_t b;
+  int i;
+
+  memset (&b, 0, sizeof (b));
+  b.name = def->name;
+  b.iterations = (uint64_t) (scale * ((double) def->iterations));
+  if (b.iterations < 1)
+    b.iterations = 1;
+
+  for (i = 0; i < repeat; i++)
+  {
+    def->func (&b);
+    if (b.ops == 0)
+    {
+      printf ("%s\tFAILED\n", def->name);
+      return (-1);
+    }
+    ns_per_op[i] = ((double) b.elapsed_ns) / ((double) b.ops);
+  }
+
+  qsort (ns_per_op, (size_t) repeat, sizeof (ns_per_op[0]), compare_double);
+  printf ("%s\t%"PRIu64"\t%.1f\t%.1f\t%.0f\n", def->name, b.ops,
+      ns_per_op[0], ns_per_op[repeat / 2], 1e9 / ns_per_op[0]);
+  fflush (stdout);
+
+  return (0);
+} /* }}} int bench_run */
+
+static void exit_usage (int status) /* {{{ */
+{
+  size_t i;
+
+  printf ("Usage: collectd_bench [-n <scale>] [-r <repeat>] [-c <series>] "
+      "[<benchmark> ...]\n"
+      "\n"
+      "  -n <scale>   Multiply the number of operations by <scale>.\n"
+      "  -r <repeat>  Run each benchmark <repeat> times. (Default: 5)\n"
+      "  -c <series>  Number of distinct series. (Default: %i)\n"
+      "\n"
+      "Benchmarks:\n", BENCH_SERIES_DEFAULT);
+  for (i = 0; i < STATIC_ARRAY_SIZE (benchmarks); i++)
+    printf ("  %s\n", benchmarks[i].name);
+  exit (status);
+} /* }}} void exit_usage */
+
+int main (int argc, char **argv) /* {{{ */
+{
+  double scale = 1.0;
+  int repeat = 5;
+  int failed = 0;
+  size_t i;
+  int c;
+
+  while ((c = getopt (argc, argv, "n:r:c:h")) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+        scale = atof (optarg);
+        break;
+      case 'r':
+        repeat = atoi (optarg);
+        break;
+      case 'c':
+        series_num = (size_t) atoi (optarg);
+        break;
+      case 'h':
+        exit_usage (EXIT_SUCCESS);
+      default:
+        exit_usage (EXIT_FAILURE);
+    }
+  }
+
+  if ((scale <= 0.0) || (repeat < 1) || (series_num < 1))
+    exit_usage (EXIT_FAILURE);
+
+  interval_g = TIME_T_TO_CDTIME_T (10);
+  bench_time = cdtime ();
+
+  plugin_init_ctx ();
+  plugin_register_log ("bench", bench_log, /* user_data = */ NULL);
+  plugin_register_data_set (&ds_gauge);
+  plugin_register_data_set (&ds_if_octets);
+  uc_init ();
+
+  if (bench_series_create () != 0)
+  {
+    fprintf (stderr, "Creating the series failed.\n");
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("# benchmark\tops\tns_per_op_min\tns_per_op_median\tops_per_s\n");
+  for (i = 0; i < STATIC_ARRAY_SIZE (benchmarks); i++)
+  {
+    bench_def_t def = benchmarks[i];
+
+    if (optind < argc)
+    {
+      int j;
+
+      for (j = optind; j < argc; j++)
+        if (strcmp (argv[j], def.name) == 0)
+          break;
+      if (j >= argc)
+        continue;
+    }
+
+    /* Benchmarks scaling with the number of series. */
+    if (def.iterations == 0)
+      def.iterations = (uint64_t) series_num;
+
+    if (bench_run (&def, scale, repeat) != 0)
+      failed++;
+  }
+
+  return ((failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+} /* }}} int main */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,65 @@
+/**
+ * collectd - src/bench.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include "collectd.h"
+#include "plugin.h"
+
+/*
+ * Micro-benchmarks of the daemon's hot paths, run by "make bench". Each
+ * benchmark function prepares its data, calls bench_start(), performs
+ * "b->iterations" operations and calls bench_stop(). Only the time between
+ * the two calls is measured.
+ */
+struct bench_s
+{
+  const char *name;
+  uint64_t iterations;
+
+  /* Number of operations performed between bench_start() and
+   * bench_stop(). Set to "iterations" by bench_start(); benchmarks which
+   * don't perform exactly "iterations" operations update it. */
+  uint64_t ops;
+
+  uint64_t start_ns;
+  uint64_t elapsed_ns;
+};
+typedef struct bench_s bench_t;
+
+void bench_start (bench_t *b);
+void bench_stop (bench_t *b);
+
+/*
+ * Benchmarks of the network plugin, see bench_network.c. The types of the
+ * value lists must be registered with plugin_register_data_set().
+ *
+ * "security_level" is 0 for plain packets, 1 for signed and 2 for encrypted
+ * packets.
+ */
+int bench_network_add_to_buffer (bench_t *b,
+    const value_list_t *vls, size_t vls_num);
+int bench_network_parse_packet (bench_t *b,
+    const value_list_t *vls, size_t vls_num, int security_level);
+
+#endif /* BENCH_H */
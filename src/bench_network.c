@@ -0,0 +1,347 @@
+/**
+ * collectd - src/bench_network.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/* The functions measured here are static, so the plugin is compiled into
+ * this file. The parsed value lists are counted instead of being handed to
+ * the daemon, so only the parser is measured. */
+#define plugin_dispatch_values_batch bench_dispatch_values_batch
+#include "network.c"
+#undef plugin_dispatch_values_batch
+
+#include "bench.h"
+
+static uint64_t bench_values_dispatched = 0;
+
+int bench_dispatch_values_batch (value_list_t const *vls, /* {{{ */
+    size_t vls_num)
+{
+  bench_values_dispatched += (uint64_t) vls_num;
+  return (0);
+} /* }}} int bench_dispatch_values_batch */
+
+int bench_network_add_to_buffer (bench_t *b, /* {{{ */
+    const value_list_t *vls, size_t vls_num)
+{
+  const data_set_t **ds;
+  char *buffer;
+  value_list_t vl_def;
+  int buffer_fill = 0;
+  size_t vl_index = 0;
+  uint64_t i;
+
+  ds = calloc (vls_num, sizeof (*ds));
+  buffer = malloc (network_config_packet_size);
+  if ((ds == NULL) || (buffer == NULL))
+  {
+    sfree (ds);
+    sfree (buffer);
+    return (ENOMEM);
+  }
+
+  for (i = 0; i < vls_num; i++)
+  {
+    ds[i] = plugin_get_ds (vls[i].type);
+    if (ds[i] == NULL)
+    {
+      sfree (ds);
+      sfree (buffer);
+      return (-1);
+    }
+  }
+
+  memset (&vl_def, 0, sizeof (vl_def));
+
+  bench_start (b);
+  for (i = 0; i < b->iterations; i++)
+  {
+    int status;
+
+    status = add_to_buffer (buffer + buffer_fill,
+        (int) network_config_packet_size - buffer_fill,
+        &vl_def, ds[vl_index], vls + vl_index);
+    if ((status < 0) && (buffer_fill == 0))
+    {
+      bench_stop (b);
+      sfree (ds);
+      sfree (buffer);
+      return (-1);
+    }
+    else if (status < 0)
+    {
+      /* The buffer is full: start over, like flush_buffer() does. */
+      buffer_fill = 0;
+      memset (&vl_def, 0, sizeof (vl_def));
+      i--;
+      continue;
+    }
+    buffer_fill += status;
+
+    vl_index++;
+    if (vl_index >= vls_num)
+      vl_index = 0;
+  }
+  bench_stop (b);
+
+  sfree (ds);
+  sfree (buffer);
+  return (0);
+} /* }}} int bench_network_add_to_buffer */
+
+#define BENCH_USERNAME "bench"
+#define BENCH_PASSWORD "secret"
+
+/* Appends the packet in "payload" to "packets", signing or encrypting it
+ * like the network plugin does before sending it. */
+static int bench_packet_add (sockent_t *client, /* {{{ */
+    const char *payload, size_t payload_size,
+    char ***packets, size_t **packet_sizes, size_t *packets_num)
+{
+  char *packet;
+  ssize_t packet_size = (ssize_t) payload_size;
+  char **tmp;
+  size_t *tmp_sizes;
+
+  packet = malloc (payload_size + BUFF_SIG_SIZE);
+  if (packet == NULL)
+    return (ENOMEM);
+
+#if HAVE_LIBGCRYPT
+  if (client->data.client.security_level == SECURITY_LEVEL_SIGN)
+    packet_size = network_sign_buffer (client, payload, payload_size, packet);
+  else if (client->data.client.security_level == SECURITY_LEVEL_ENCRYPT)
+    packet_size = network_encrypt_buffer (client, payload, payload_size,
+        packet);
+  else
+#endif
+    memcpy (packet, payload, payload_size);
+
+  if (packet_size < 0)
+  {
+    sfree (packet);
+    return (-1);
+  }
+
+  tmp = realloc (*packets, (*packets_num + 1) * sizeof (*tmp));
+  if (tmp == NULL)
+  {
+    sfree (packet);
+    return (ENOMEM);
+  }
+  *packets = tmp;
+
+  tmp_sizes = realloc (*packet_sizes, (*packets_num + 1) * sizeof (*tmp_sizes));
+  if (tmp_sizes == NULL)
+  {
+    sfree (packet);
+    return (ENOMEM);
+  }
+  *packet_sizes = tmp_sizes;
+
+  (*packets)[*packets_num] = packet;
+  (*packet_sizes)[*packets_num] = (size_t) packet_size;
+  (*packets_num)++;
+
+  return (0);
+} /* }}} int bench_packet_add */
+
+/* Puts "vls" into as many packets as network_write() would. */
+static int bench_packets_create (sockent_t *client, /* {{{ */
+    const value_list_t *vls, size_t vls_num,
+    char ***packets, size_t **packet_sizes, size_t *packets_num)
+{
+  char *buffer;
+  int buffer_size = (int) network_config_packet_size;
+  int buffer_fill = 0;
+  value_list_t vl_def;
+  size_t i;
+  int status = 0;
+
+  if (client->data.client.security_level != SECURITY_LEVEL_NONE)
+    buffer_size -= BUFF_SIG_SIZE;
+
+  buffer = malloc ((size_t) buffer_size);
+  if (buffer == NULL)
+    return (ENOMEM);
+  memset (&vl_def, 0, sizeof (vl_def));
+
+  for (i = 0; (i < vls_num) && (status == 0); i++)
+  {
+    const data_set_t *ds = plugin_get_ds (vls[i].type);
+    int len;
+
+    if (ds == NULL)
+    {
+      status = -1;
+      break;
+    }
+
+    len = add_to_buffer (buffer + buffer_fill, buffer_size - buffer_fill,
+        &vl_def, ds, vls + i);
+    if ((len < 0) && (buffer_fill > 0))
+    {
+      status = bench_packet_add (client, buffer, (size_t) buffer_fill,
+          packets, packet_sizes, packets_num);
+      buffer_fill = 0;
+      memset (&vl_def, 0, sizeof (vl_def));
+      i--;
+      continue;
+    }
+    else if (len < 0)
+    {
+      status = -1;
+      break;
+    }
+
+    buffer_fill += len;
+  }
+
+  if ((status == 0) && (buffer_fill > 0))
+    status = bench_packet_add (client, buffer, (size_t) buffer_fill,
+        packets, packet_sizes, packets_num);
+
+  sfree (buffer);
+  return (status);
+} /* }}} int bench_packets_create */
+
+int bench_network_parse_packet (bench_t *b, /* {{{ */
+    const value_list_t *vls, size_t vls_num, int security_level)
+{
+  sockent_t client;
+  sockent_t server;
+  char **packets = NULL;
+  size_t *packet_sizes = NULL;
+  size_t packets_num = 0;
+#if HAVE_LIBGCRYPT
+  char auth_file[] = "/tmp/collectd-bench.XXXXXX";
+#endif
+  uint64_t i;
+  int status;
+
+  memset (&client, 0, sizeof (client));
+  client.type = SOCKENT_TYPE_CLIENT;
+
+  memset (&server, 0, sizeof (server));
+  server.type = SOCKENT_TYPE_SERVER;
+  server.data.server.priority = PRIORITY_NORMAL;
+
+#if HAVE_LIBGCRYPT
+  if (!gcry_control (GCRYCTL_ANY_INITIALIZATION_P))
+  {
+    gcry_check_version (NULL);
+    gcry_control (GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+    gcry_control (GCRYCTL_INIT_SECMEM, 32768, 0);
+    gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  }
+
+  if (security_level != 0)
+  {
+    int fd;
+
+    client.data.client.security_level = (security_level == 1)
+      ? SECURITY_LEVEL_SIGN : SECURITY_LEVEL_ENCRYPT;
+    client.data.client.username = BENCH_USERNAME;
+    client.data.client.password = BENCH_PASSWORD;
+    gcry_md_hash_buffer (GCRY_MD_SHA256, client.data.client.password_hash,
+        BENCH_PASSWORD, strlen (BENCH_PASSWORD));
+    if ((network_init_aes256_cypher (&client.data.client.cypher,
+            client.data.client.password_hash,
+            sizeof (client.data.client.password_hash)) != 0)
+        || (network_init_hmac (&client.data.client.hmac,
+            BENCH_PASSWORD) != 0))
+      return (-1);
+
+    fd = mkstemp (auth_file);
+    if (fd < 0)
+      return (-1);
+    if (swrite (fd, BENCH_USERNAME ": " BENCH_PASSWORD "\n",
+          strlen (BENCH_USERNAME ": " BENCH_PASSWORD "\n")) != 0)
+    {
+      close (fd);
+      unlink (auth_file);
+      return (-1);
+    }
+    close (fd);
+
+    server.data.server.security_level = client.data.client.security_level;
+    server.data.server.userdb = fbh_create (auth_file);
+    if (server.data.server.userdb == NULL)
+    {
+      unlink (auth_file);
+      return (-1);
+    }
+  }
+#else
+  if (security_level != 0)
+    return (ENOTSUP);
+#endif
+
+  status = bench_packets_create (&client, vls, vls_num,
+      &packets, &packet_sizes, &packets_num);
+  if ((status == 0) && (packets_num == 0))
+    status = -1;
+
+  if (status == 0)
+  {
+    char buffer[network_config_packet_size];
+
+    bench_values_dispatched = 0;
+
+    /* Packets are decrypted in place, so each one is copied first, as
+     * recvfrom() would. */
+    bench_start (b);
+    for (i = 0; i < b->iterations; i++)
+    {
+      size_t n = (size_t) (i % packets_num);
+
+      memcpy (buffer, packets[n], packet_sizes[n]);
+      parse_packet (&server, buffer, packet_sizes[n], /* flags = */ 0,
+          /* username = */ NULL);
+    }
+    bench_stop (b);
+
+    /* Report the rate of value lists rather than packets. */
+    b->ops = bench_values_dispatched;
+    if (b->ops == 0)
+      status = -1;
+  }
+
+  for (i = 0; i < packets_num; i++)
+    sfree (packets[i]);
+  sfree (packets);
+  sfree (packet_sizes);
+
+#if HAVE_LIBGCRYPT
+  if (server.data.server.userdb != NULL)
+  {
+    fbh_destroy (server.data.server.userdb);
+    unlink (auth_file);
+  }
+  if (client.data.client.cypher != NULL)
+    gcry_cipher_close (client.data.client.cypher);
+  if (client.data.client.hmac != NULL)
+    gcry_md_close (client.data.client.hmac);
+#endif
+
+  return (status);
+} /* }}} int bench_network_parse_packet */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,566 @@
+/**
+ * collectd - src/bench_pipeline.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/*
+ * Measures the throughput of the daemon's dispatch pipeline: "generator" read
+ * callbacks dispatch value lists as fast as they can, which pass through the
+ * write queue, the cache and the filter chains to a "null" write callback
+ * that only counts them. Each combination of read threads, write threads and
+ * number of series is run in a process of its own, so the daemon's global
+ * state starts out fresh every time.
+ */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "filter_chain.h"
+#include "utils_histogram.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Defined by collectd.c in the daemon. */
+char hostname_g[DATA_MAX_NAME_LEN] = "localhost";
+cdtime_t interval_g;
+int  timeout_g = 2;
+_Bool float_format_legacy_g = 0;
+#if HAVE_LIBKSTAT
+kstat_ctl_t *kc;
+#endif /* HAVE_LIBKSTAT */
+
+#define PL_LIST_MAX 32
+
+#define PL_STATE_WARMUP    0
+#define PL_STATE_MEASURING 1
+#define PL_STATE_DONE      2
+
+/* One read callback; only one read thread runs it at a time. */
+struct pl_generator_s
+{
+  value_list_t *series;
+  size_t series_num;
+  size_t series_next;
+
+  /* Time spent in plugin_dispatch_values(). */
+  histogram_t *dispatch_latency;
+  struct pl_generator_s *next;
+};
+typedef struct pl_generator_s pl_generator_t;
+
+/* Per write thread, see pl_writer_get(). */
+struct pl_writer_s
+{
+  uint64_t written;
+  /* Time from dispatching a value list to its write callback. */
+  histogram_t *write_latency;
+  struct pl_writer_s *next;
+};
+typedef struct pl_writer_s pl_writer_t;
+
+static int read_threads_list[PL_LIST_MAX] = { 1, 2, 4 };
+static size_t read_threads_num = 3;
+static int write_threads_list[PL_LIST_MAX] = { 1, 2, 4 };
+static size_t write_threads_num = 3;
+static int series_list[PL_LIST_MAX] = { 1000, 100000 };
+static size_t series_list_num = 2;
+
+static int conf_generators = 16;
+static int conf_batch = 100;
+static double conf_duration = 5.0;
+static double conf_warmup = 1.0;
+static const char *conf_config_file = NULL;
+
+static volatile int pl_state = PL_STATE_WARMUP;
+
+static data_source_t dsrc_gauge[] = {
+  { "value", DS_TYPE_GAUGE, 0.0, NAN }
+};
+static data_set_t ds_gauge = { "gauge", 1, dsrc_gauge };
+
+static pl_generator_t *generator_list = NULL;
+
+static pthread_key_t   writer_key;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pl_writer_t    *writer_list = NULL;
+
+static int pl_log_level = LOG_WARNING;
+
+static void pl_log (int severity, const char *msg, /* {{{ */
+    user_data_t __attribute__((unused)) *ud)
+{
+  if (severity <= pl_log_level)
+    fprintf (stderr, "%s\n", msg);
+} /* }}} void pl_log */
+
+static int pl_generator_read (user_data_t *ud) /* {{{ */
+{
+  pl_generator_t *g = ud->data;
+  int i;
+
+  for (i = 0; i < conf_batch; i++)
+  {
+    value_list_t *vl = g->series + g->series_next;
+    cdtime_t t0;
+
+    g->series_next = (g->series_next + 1) % g->series_num;
+
+    /* The time of the value list is when it was dispatched, which the
+     * write callback uses to compute the latency. */
+    vl->values[0].gauge += 1.0;
+    t0 = cdtime ();
+    vl->time = t0;
+    plugin_dispatch_values (vl);
+
+    if (pl_state == PL_STATE_MEASURING)
+      histogram_add (g->dispatch_latency,
+          CDTIME_T_TO_DOUBLE (cdtime () - t0) * 1e6);
+  }
+
+  return (0);
+} /* }}} int pl_generator_read */
+
+static pl_writer_t *pl_writer_get (void) /* {{{ */
+{
+  pl_writer_t *w = pthread_getspecific (writer_key);
+
+  if (w != NULL)
+    return (w);
+
+  w = calloc (1, sizeof (*w));
+  if (w == NULL)
+    return (NULL);
+  w->write_latency = histogram_create ();
+  if (w->write_latency == NULL)
+  {
+    sfree (w);
+    return (NULL);
+  }
+
+  pthread_mutex_lock (&writer_lock);
+  w->next = writer_list;
+  writer_list = w;
+  pthread_mutex_unlock (&writer_lock);
+
+  pthread_setspecific (writer_key, w);
+  return (w);
+} /* }}} pl_writer_t *pl_writer_get */
+
+static int pl_null_write (const data_set_t __attribute__((unused)) *ds, /* {{{ */
+    const value_list_t *vl, user_data_t __attribute__((unused)) *ud)
+{
+  pl_writer_t *w = pl_writer_get ();
+
+  if (w == NULL)
+    return (-1);
+
+  if (pl_state == PL_STATE_MEASURING)
+  {
+    w->written++;
+    histogram_add (w->write_latency,
+        CDTIME_T_TO_DOUBLE (cdtime () - vl->time) * 1e6);
+  }
+
+  return (0);
+} /* }}} int pl_null_write */
+
+static int pl_generators_create (size_t series_num) /* {{{ */
+{
+  value_list_t *series;
+  value_t *values;
+  size_t i;
+  int g;
+
+  series = calloc (series_num, sizeof (*series));
+  values = calloc (series_num, sizeof (*values));
+  if ((series == NULL) || (values == NULL))
+    return (ENOMEM);
+
+  for (i = 0; i < series_num; i++)
+  {
+    value_list_t *vl = series + i;
+
+    vl->values = values + i;
+    vl->values_len = 1;
+    /* Long enough for the cache not to time out any series. */
+    vl->interval = TIME_T_TO_CDTIME_T (3600);
+    ssnprintf (vl->host, sizeof (vl->host), "host%04zu", i / 1000);
+    ssnprintf (vl->plugin, sizeof (vl->plugin), "plugin%02zu",
+        (i / 50) % 20);
+    ssnprintf (vl->plugin_instance, sizeof (vl->plugin_instance), "%zu",
+        (i / 5) % 10);
+    sstrncpy (vl->type, "gauge", sizeof (vl->type));
+    ssnprintf (vl->type_instance, sizeof (vl->type_instance), "%zu", i % 5);
+  }
+
+  /* The series are split among the generators. */
+  for (g = 0; g < conf_generators; g++)
+  {
+    pl_generator_t *gen;
+    char name[DATA_MAX_NAME_LEN];
+    struct timespec interval = { 0, 1 };
+    user_data_t ud = { 0 };
+    size_t first = (series_num * (size_t) g) / (size_t) conf_generators;
+    size_t last = (series_num * (size_t) (g + 1)) / (size_t) conf_generators;
+
+    if (first == last)
+      continue;
+
+    gen = calloc (1, sizeof (*gen));
+    if (gen == NULL)
+      return (ENOMEM);
+    gen->series = series + first;
+    gen->series_num = last - first;
+    gen->dispatch_latency = histogram_create ();
+    if (gen->dispatch_latency == NULL)
+      return (ENOMEM);
+    gen->next = generator_list;
+    generator_list = gen;
+
+    ssnprintf (name, sizeof (name), "generator-%i", g);
+    ud.data = gen;
+    /* Called again right away, so the generators dispatch as fast as the
+     * pipeline accepts the values. */
+    plugin_register_complex_read (/* group = */ NULL, name, pl_generator_read,
+        &interval, &ud);
+  }
+
+  return (0);
+} /* }}} int pl_generators_create */
+
+/* Reads the "PluginDir", "LoadPlugin" and "<Chain>" options of a config
+ * file, so the pipeline can be measured with realistic filter chains. */
+static int pl_config_read (const char *file) /* {{{ */
+{
+  oconfig_item_t *ci;
+  int status = 0;
+  int i;
+
+  ci = oconfig_parse_file (file);
+  if (ci == NULL)
+  {
+    ERROR ("bench_pipeline: Unable to read \"%s\".", file);
+    return (-1);
+  }
+
+  for (i = 0; (i < ci->children_num) && (status == 0); i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+    char *str = NULL;
+
+    if (strcasecmp ("Chain", child->key) == 0)
+    {
+      status = fc_configure (child);
+      continue;
+    }
+
+    status = cf_util_get_string (child, &str);
+    if (status != 0)
+      break;
+
+    if (strcasecmp ("PluginDir", child->key) == 0)
+      status = global_option_set ("PluginDir", str);
+    else if (strcasecmp ("LoadPlugin", child->key) == 0)
+      status = plugin_load (str, /* flags = */ 0);
+    else if ((strcasecmp ("PreCacheChain", child->key) == 0)
+        || (strcasecmp ("PostCacheChain", child->key) == 0))
+      status = global_option_set (child->key, str);
+    else
+      WARNING ("bench_pipeline: Ignoring the \"%s\" option.", child->key);
+
+    sfree (str);
+  }
+
+  oconfig_free (ci);
+  return (status);
+} /* }}} int pl_config_read */
+
+static void pl_read_thread_stats (const char __attribute__((unused)) *pool, /* {{{ */
+    size_t __attribute__((unused)) index,
+    uint64_t __attribute__((unused)) reads, uint64_t stolen,
+    cdtime_t __attribute__((unused)) lag, void *user_data)
+{
+  uint64_t *sum = user_data;
+
+  *sum += stolen;
+} /* }}} void pl_read_thread_stats */
+
+static uint64_t pl_context_switches (void) /* {{{ */
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) != 0)
+    return (0);
+
+  return ((uint64_t) (ru.ru_nvcsw + ru.ru_nivcsw));
+} /* }}} uint64_t pl_context_switches */
+
+static uint64_t pl_written (void) /* {{{ */
+{
+  pl_writer_t *w;
+  uint64_t sum = 0;
+
+  pthread_mutex_lock (&writer_lock);
+  for (w = writer_list; w != NULL; w = w->next)
+    sum += w->written;
+  pthread_mutex_unlock (&writer_lock);
+
+  return (sum);
+} /* }}} uint64_t pl_written */
+
+static void pl_sleep (double seconds) /* {{{ */
+{
+  struct timespec ts;
+
+  CDTIME_T_TO_TIMESPEC (DOUBLE_TO_CDTIME_T (seconds), &ts);
+  while ((nanosleep (&ts, &ts) != 0) && (errno == EINTR))
+    /* continue */;
+} /* }}} void pl_sleep */
+
+/* Runs one combination of the sweep and prints its results. Called in a
+ * process of its own. */
+static int pl_run (int read_threads, int write_threads, /* {{{ */
+    int series_num)
+{
+  char buffer[32];
+  histogram_t *dispatch_latency;
+  histogram_t *write_latency;
+  uint64_t dropped;
+  uint64_t stolen_before = 0;
+  uint64_t stolen_after = 0;
+  uint64_t csw;
+  size_t queue_peak;
+  cdtime_t start;
+  cdtime_t elapsed;
+  uint64_t written;
+  pl_generator_t *g;
+  pl_writer_t *w;
+
+  plugin_init_ctx ();
+  plugin_register_log ("bench_pipeline", pl_log, /* user_data = */ NULL);
+  plugin_register_data_set (&ds_gauge);
+  interval_g = TIME_T_TO_CDTIME_T (10);
+
+  ssnprintf (buffer, sizeof (buffer), "%i", read_threads);
+  global_option_set ("ReadThreads", buffer);
+  ssnprintf (buffer, sizeof (buffer), "%i", write_threads);
+  global_option_set ("WriteThreads", buffer);
+
+  if ((conf_config_file != NULL) && (pl_config_read (conf_config_file) != 0))
+    return (-1);
+
+  if (pthread_key_create (&writer_key, NULL) != 0)
+    return (-1);
+  plugin_register_write ("null", pl_null_write, /* user_data = */ NULL);
+  if (pl_generators_create ((size_t) series_num) != 0)
+    return (-1);
+
+  plugin_init_all ();
+
+  /* Let the cache fill up before measuring. */
+  pl_sleep (conf_warmup);
+
+  dropped = plugin_write_queue_dropped ();
+  (void) plugin_write_queue_peak ();
+  plugin_read_thread_stats (pl_read_thread_stats, &stolen_before);
+  csw = pl_context_switches ();
+  start = cdtime ();
+  pl_state = PL_STATE_MEASURING;
+
+  pl_sleep (conf_duration);
+
+  pl_state = PL_STATE_DONE;
+  elapsed = cdtime () - start;
+  written = pl_written ();
+  csw = pl_context_switches () - csw;
+  queue_peak = plugin_write_queue_peak ();
+  dropped = plugin_write_queue_dropped () - dropped;
+  plugin_read_thread_stats (pl_read_thread_stats, &stolen_after);
+
+  plugin_shutdown_all ();
+
+  /* All threads have stopped, so the histograms can be read. */
+  dispatch_latency = histogram_create ();
+  write_latency = histogram_create ();
+  if ((dispatch_latency == NULL) || (write_latency == NULL))
+    return (ENOMEM);
+  for (g = generator_list; g != NULL; g = g->next)
+    histogram_merge (dispatch_latency, g->dispatch_latency);
+  for (w = writer_list; w != NULL; w = w->next)
+    histogram_merge (write_latency, w->write_latency);
+
+  printf ("%i\t%i\t%i\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%zu\t%"PRIu64
+      "\t%.2f\t%"PRIu64"\n",
+      read_threads, write_threads, series_num,
+      ((double) written) / CDTIME_T_TO_DOUBLE (elapsed),
+      histogram_percentile (dispatch_latency, 50.0),
+      histogram_percentile (dispatch_latency, 99.0),
+      histogram_percentile (write_latency, 50.0),
+      histogram_percentile (write_latency, 99.0),
+      queue_peak, dropped,
+      (written > 0) ? (1000.0 * ((double) csw) / ((double) written)) : 0.0,
+      stolen_after - stolen_before);
+  fflush (stdout);
+
+  return (0);
+} /* }}} int pl_run */
+
+/* Parses a comma separated list of positive numbers. */
+static int pl_parse_list (const char *str, int *list, size_t *list_num) /* {{{ */
+{
+  char buffer[1024];
+  char *fields[PL_LIST_MAX];
+  int fields_num;
+  int i;
+
+  sstrncpy (buffer, str, sizeof (buffer));
+  for (i = 0; buffer[i] != 0; i++)
+    if (buffer[i] == ',')
+      buffer[i] = ' ';
+
+  fields_num = strsplit (buffer, fields, STATIC_ARRAY_SIZE (fields));
+  if (fields_num < 1)
+    return (-1);
+
+  for (i = 0; i < fields_num; i++)
+  {
+    char *endptr = NULL;
+
+    list[i] = (int) strtol (fields[i], &endptr, 10);
+    if ((endptr == fields[i]) || (*endptr != 0) || (list[i] < 1))
+      return (-1);
+  }
+  *list_num = (size_t) fields_num;
+
+  return (0);
+} /* }}} int pl_parse_list */
+
+static void exit_usage (int status) /* {{{ */
+{
+  printf ("Usage: collectd_bench_pipeline [options]\n"
+      "\n"
+      "  -r <n,...>   Numbers of read threads to try. (Default: 1,2,4)\n"
+      "  -w <n,...>   Numbers of write threads to try. (Default: 1,2,4)\n"
+      "  -c <n,...>   Numbers of series to try. (Default: 1000,100000)\n"
+      "  -g <n>       Number of generator read callbacks. (Default: 16)\n"
+      "  -b <n>       Values dispatched per read callback. (Default: 100)\n"
+      "  -d <sec>     Duration of each measurement. (Default: 5)\n"
+      "  -W <sec>     Warm-up before each measurement. (Default: 1)\n"
+      "  -C <file>    Read \"PluginDir\", \"LoadPlugin\", \"PreCacheChain\",\n"
+      "               \"PostCacheChain\" and <Chain> blocks from <file>.\n"
+      "  -v           Print informational messages of the daemon, too.\n");
+  exit (status);
+} /* }}} void exit_usage */
+
+int main (int argc, char **argv) /* {{{ */
+{
+  int failed = 0;
+  size_t r;
+  size_t w;
+  size_t c;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "r:w:c:g:b:d:W:C:vh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r':
+        if (pl_parse_list (optarg, read_threads_list, &read_threads_num) != 0)
+          exit_usage (EXIT_FAILURE);
+        break;
+      case 'w':
+        if (pl_parse_list (optarg, write_threads_list, &write_threads_num) != 0)
+          exit_usage (EXIT_FAILURE);
+        break;
+      case 'c':
+        if (pl_parse_list (optarg, series_list, &series_list_num) != 0)
+          exit_usage (EXIT_FAILURE);
+        break;
+      case 'g':
+        conf_generators = atoi (optarg);
+        break;
+      case 'b':
+        conf_batch = atoi (optarg);
+        break;
+      case 'd':
+        conf_duration = atof (optarg);
+        break;
+      case 'W':
+        conf_warmup = atof (optarg);
+        break;
+      case 'C':
+        conf_config_file = optarg;
+        break;
+      case 'v':
+        pl_log_level = LOG_INFO;
+        break;
+      case 'h':
+        exit_usage (EXIT_SUCCESS);
+      default:
+        exit_usage (EXIT_FAILURE);
+    }
+  }
+
+  if ((conf_generators < 1) || (conf_batch < 1) || (conf_duration <= 0.0)
+      || (conf_warmup < 0.0))
+    exit_usage (EXIT_FAILURE);
+
+  printf ("# read_threads\twrite_threads\tseries\tvalues_per_s"
+      "\tdispatch_p50_us\tdispatch_p99_us\twrite_p50_us\twrite_p99_us"
+      "\tqueue_peak\tdropped\tcsw_per_1000_values\treads_stolen\n");
+  fflush (stdout);
+
+  for (c = 0; c < series_list_num; c++)
+    for (r = 0; r < read_threads_num; r++)
+      for (w = 0; w < write_threads_num; w++)
+      {
+        pid_t pid;
+        int status = 0;
+
+        pid = fork ();
+        if (pid < 0)
+        {
+          perror ("fork");
+          exit (EXIT_FAILURE);
+        }
+        else if (pid == 0)
+        {
+          /* Don't wait for the threads to exit. */
+          _exit ((pl_run (read_threads_list[r], write_threads_list[w],
+                  series_list[c]) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        waitpid (pid, &status, 0);
+        if (!WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS))
+        {
+          printf ("%i\t%i\t%i\tFAILED\n", read_threads_list[r],
+              write_threads_list[w], series_list[c]);
+          fflush (stdout);
+          failed++;
+        }
+      }
+
+  return ((failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+} /* }}} int main */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
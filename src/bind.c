@@ -39,6 +39,8 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
+#include "utils_curl_multi.h"
+#include "utils_xml_stream.h"
 
 /* Some versions of libcurl don't include this themselves and then don't have
  * fd_set available. */
@@ -101,6 +103,7 @@ typedef struct list_info_ptr_s list_info_ptr_t;
 /* FIXME: Enabled by default for backwards compatibility. */
 /* TODO: Remove time parsing code. */
 static _Bool config_parse_time = 1;
+static _Bool config_streaming = 0;
 
 static char *url                   = NULL;
 static int global_opcodes          = 1;
@@ -120,6 +123,13 @@ static size_t bind_buffer_size = 0;
 static size_t bind_buffer_fill = 0;
 static char   bind_curl_error[CURL_ERROR_SIZE];
 
+/* Parses the response as it arrives if `config_streaming' is set. */
+static uxs_t *bind_parser = NULL;
+
+/* Interval of the read callback, for values dispatched by the fetch
+ * thread. */
+static cdtime_t bind_interval = 0;
+
 /* Translation table for the `nsstats' values. */
 static const translation_info_t nsstats_translation_table[] = /* {{{ */
 {
@@ -268,6 +278,7 @@ static void submit (time_t ts, const char *plugin_instance, /* {{{ */
         sizeof(vl.type_instance));
     replace_special (vl.plugin_instance, sizeof (vl.plugin_instance));
   }
+  vl.interval = bind_interval;
   plugin_dispatch_values(&vl);
 } /* }}} void submit */
 
@@ -279,6 +290,10 @@ static size_t bind_curl_callback (void *buf, size_t size, /* {{{ */
   if (len <= 0)
     return (len);
 
+  /* On error, abort the transfer instead of downloading the rest. */
+  if (bind_parser != NULL)
+    return ((uxs_feed (bind_parser, buf, len) == 0) ? len : 0);
+
   if ((bind_buffer_fill + len) >= bind_buffer_size)
   {
     char *temp;
@@ -1231,6 +1246,340 @@ static int bind_xml (const char *data) /* {{{ */
   return (ret);
 } /* }}} int bind_xml */
 
+/*
+ * Streaming parser
+ *
+ * Instead of building a tree and evaluating XPath expressions, the
+ * statistics listed in `bind_stream_paths' are picked up while the response
+ * is parsed. They use the same layouts as handled by
+ * bind_parse_generic_name_value and bind_parse_generic_value_list. Like
+ * BIND itself, this assumes that the <name> of a view or zone precedes its
+ * statistics.
+ */
+#define BIND_STATS_PATH "/isc/bind/statistics"
+
+enum bind_stream_stats_e
+{
+  BS_OPCODES,
+  BS_QTYPES,
+  BS_SERVER_STATS,
+  BS_ZONE_MAINT_STATS,
+  BS_RESOLVER_STATS,
+  BS_MEMORY_STATS,
+  BS_VIEW_QTYPES,
+  BS_VIEW_RESOLVER_STATS,
+  BS_VIEW_CACHE_RR_SETS,
+  BS_VIEW_ZONE
+};
+
+struct bind_stream_path_s
+{
+  const char *path;
+  int version; /* zero if used by all versions */
+  _Bool pairs; /* <name>/<counter> pairs rather than a value list */
+  int ds_type;
+  enum bind_stream_stats_e stats;
+};
+typedef struct bind_stream_path_s bind_stream_path_t;
+
+static const bind_stream_path_t bind_stream_paths[] = /* {{{ */
+{
+  { BIND_STATS_PATH "/server/requests/opcode",   0, 1, DS_TYPE_COUNTER,
+    BS_OPCODES },
+  { BIND_STATS_PATH "/server/queries-in/rdtype", 0, 1, DS_TYPE_COUNTER,
+    BS_QTYPES },
+  { BIND_STATS_PATH "/server/nsstats",           1, 0, DS_TYPE_COUNTER,
+    BS_SERVER_STATS },
+  { BIND_STATS_PATH "/server/nsstat",            2, 1, DS_TYPE_COUNTER,
+    BS_SERVER_STATS },
+  { BIND_STATS_PATH "/server/zonestats",         1, 0, DS_TYPE_COUNTER,
+    BS_ZONE_MAINT_STATS },
+  { BIND_STATS_PATH "/server/zonestat",          2, 1, DS_TYPE_COUNTER,
+    BS_ZONE_MAINT_STATS },
+  { BIND_STATS_PATH "/server/resstats",          1, 0, DS_TYPE_COUNTER,
+    BS_RESOLVER_STATS },
+  { BIND_STATS_PATH "/server/resstat",           2, 1, DS_TYPE_COUNTER,
+    BS_RESOLVER_STATS },
+  { BIND_STATS_PATH "/memory/summary",           0, 0, DS_TYPE_GAUGE,
+    BS_MEMORY_STATS },
+  { BIND_STATS_PATH "/views/view/rdtype",        0, 1, DS_TYPE_COUNTER,
+    BS_VIEW_QTYPES },
+  { BIND_STATS_PATH "/views/view/resstat",       0, 1, DS_TYPE_COUNTER,
+    BS_VIEW_RESOLVER_STATS },
+  { BIND_STATS_PATH "/views/view/cache/rrset",   0, 1, DS_TYPE_GAUGE,
+    BS_VIEW_CACHE_RR_SETS },
+  { BIND_STATS_PATH "/views/view/zones/zone/counters", 0, 0, DS_TYPE_COUNTER,
+    BS_VIEW_ZONE }
+};
+static size_t bind_stream_paths_num = STATIC_ARRAY_SIZE (bind_stream_paths);
+/* }}} */
+
+/* State of the streaming parser. Only used by the fetch thread. */
+struct bind_stream_state_s
+{
+  /* Version of the <statistics> tag, zero until it has been found and -1
+   * after it has been closed. */
+  int version;
+
+  cb_view_t *view;
+  const char *zone;
+
+  /* The statistics being parsed, if any, and their depth. */
+  const bind_stream_path_t *stats;
+  int stats_depth;
+  char name[DATA_MAX_NAME_LEN];
+  char counter[DATA_MAX_NAME_LEN];
+  _Bool have_name;
+  _Bool have_counter;
+};
+typedef struct bind_stream_state_s bind_stream_state_t;
+
+static bind_stream_state_t bind_stream;
+
+static _Bool bind_stream_wanted (enum bind_stream_stats_e stats) /* {{{ */
+{
+  cb_view_t *view = bind_stream.view;
+
+  switch (stats)
+  {
+    case BS_OPCODES:             return (global_opcodes != 0);
+    case BS_QTYPES:              return (global_qtypes != 0);
+    case BS_SERVER_STATS:        return (global_server_stats != 0);
+    case BS_ZONE_MAINT_STATS:    return (global_zone_maint_stats != 0);
+    case BS_RESOLVER_STATS:      return (global_resolver_stats != 0);
+    case BS_MEMORY_STATS:        return (global_memory_stats != 0);
+    case BS_VIEW_QTYPES:         return ((view != NULL) && view->qtypes);
+    case BS_VIEW_RESOLVER_STATS: return ((view != NULL) && view->resolver_stats);
+    case BS_VIEW_CACHE_RR_SETS:  return ((view != NULL) && view->cacherrsets);
+    case BS_VIEW_ZONE:
+      return ((view != NULL) && (bind_stream.zone != NULL));
+  }
+
+  return (0);
+} /* }}} _Bool bind_stream_wanted */
+
+static void bind_stream_submit (const bind_stream_path_t *stats, /* {{{ */
+    const char *name, const char *str)
+{
+  char plugin_instance[DATA_MAX_NAME_LEN];
+  list_info_ptr_t list_info = { plugin_instance, NULL };
+  translation_table_ptr_t table_ptr = { NULL, 0, plugin_instance };
+  const char *view_name = (bind_stream.view != NULL)
+    ? bind_stream.view->name : "";
+  value_t value;
+  int status;
+
+  /* Counters are handled as derives, see bind_xml_read_derive. */
+  status = parse_value (str, &value,
+      (stats->ds_type == DS_TYPE_GAUGE) ? DS_TYPE_GAUGE : DS_TYPE_DERIVE);
+  if (status != 0)
+  {
+    ERROR ("bind plugin: Parsing string \"%s\" to a value failed.", str);
+    return;
+  }
+
+  switch (stats->stats)
+  {
+    case BS_OPCODES:
+      sstrncpy (plugin_instance, "global-opcodes", sizeof (plugin_instance));
+      list_info.type = "dns_opcode";
+      break;
+    case BS_QTYPES:
+      sstrncpy (plugin_instance, "global-qtypes", sizeof (plugin_instance));
+      list_info.type = "dns_qtype";
+      break;
+    case BS_SERVER_STATS:
+      sstrncpy (plugin_instance, "global-server_stats",
+          sizeof (plugin_instance));
+      table_ptr.table = nsstats_translation_table;
+      table_ptr.table_length = nsstats_translation_table_length;
+      break;
+    case BS_ZONE_MAINT_STATS:
+      sstrncpy (plugin_instance, "global-zone_maint_stats",
+          sizeof (plugin_instance));
+      table_ptr.table = zonestats_translation_table;
+      table_ptr.table_length = zonestats_translation_table_length;
+      break;
+    case BS_RESOLVER_STATS:
+      sstrncpy (plugin_instance, "global-resolver_stats",
+          sizeof (plugin_instance));
+      table_ptr.table = resstats_translation_table;
+      table_ptr.table_length = resstats_translation_table_length;
+      break;
+    case BS_MEMORY_STATS:
+      sstrncpy (plugin_instance, "global-memory_stats",
+          sizeof (plugin_instance));
+      table_ptr.table = memsummary_translation_table;
+      table_ptr.table_length = memsummary_translation_table_length;
+      break;
+    case BS_VIEW_QTYPES:
+      ssnprintf (plugin_instance, sizeof (plugin_instance), "%s-qtypes",
+          view_name);
+      list_info.type = "dns_qtype";
+      break;
+    case BS_VIEW_RESOLVER_STATS:
+      ssnprintf (plugin_instance, sizeof (plugin_instance),
+          "%s-resolver_stats", view_name);
+      table_ptr.table = resstats_translation_table;
+      table_ptr.table_length = resstats_translation_table_length;
+      break;
+    case BS_VIEW_CACHE_RR_SETS:
+      ssnprintf (plugin_instance, sizeof (plugin_instance),
+          "%s-cache_rr_sets", view_name);
+      list_info.type = "dns_qtype_cached";
+      break;
+    case BS_VIEW_ZONE:
+      ssnprintf (plugin_instance, sizeof (plugin_instance), "%s-zone-%s",
+          view_name, bind_stream.zone);
+      table_ptr.table = nsstats_translation_table;
+      table_ptr.table_length = nsstats_translation_table_length;
+      break;
+  }
+
+  /* The server's time is not known yet when the views are parsed, so the
+   * time of the parsing is used. */
+  if (list_info.type != NULL)
+    bind_xml_list_callback (name, value, /* current_time = */ 0, &list_info);
+  else
+    bind_xml_table_callback (name, value, /* current_time = */ 0, &table_ptr);
+} /* }}} void bind_stream_submit */
+
+static void bind_stream_start (uxs_t *s, /* {{{ */
+    const char __attribute__((unused)) *name, const char **attrs,
+    void __attribute__((unused)) *user_data)
+{
+  int depth = uxs_depth (s);
+  size_t i;
+
+  /* Children of the statistics are handled in bind_stream_end. */
+  if (bind_stream.stats != NULL)
+    return;
+
+  if (uxs_matches (s, depth, BIND_STATS_PATH))
+  {
+    const char *attr_version;
+
+    /* One <statistics> node ought to be enough. */
+    if (bind_stream.version != 0)
+      return;
+
+    attr_version = uxs_attribute (attrs, "version");
+    if (attr_version == NULL)
+      NOTICE ("bind plugin: Found <statistics> tag doesn't have a "
+          "`version' attribute.");
+    /* See bind_xml. */
+    else if (strncmp ("1.", attr_version, strlen ("1.")) == 0)
+      bind_stream.version = 1;
+    else if (strncmp ("2.", attr_version, strlen ("2.")) == 0)
+      bind_stream.version = 2;
+    else
+      NOTICE ("bind plugin: Found <statistics> tag with version `%s'. "
+          "Unfortunately I have no clue how to parse that. "
+          "Please open a bug report for this.", attr_version);
+    return;
+  }
+
+  if (bind_stream.version <= 0)
+    return;
+
+  if (uxs_matches (s, depth, BIND_STATS_PATH "/views/view"))
+  {
+    bind_stream.view = NULL;
+    bind_stream.zone = NULL;
+    return;
+  }
+  else if (uxs_matches (s, depth, BIND_STATS_PATH "/views/view/zones/zone"))
+  {
+    bind_stream.zone = NULL;
+    return;
+  }
+
+  for (i = 0; i < bind_stream_paths_num; i++)
+  {
+    const bind_stream_path_t *p = bind_stream_paths + i;
+
+    if ((p->version != 0) && (p->version != bind_stream.version))
+      continue;
+    if (!uxs_matches (s, depth, p->path))
+      continue;
+
+    if (bind_stream_wanted (p->stats))
+    {
+      bind_stream.stats = p;
+      bind_stream.stats_depth = depth;
+      bind_stream.have_name = 0;
+      bind_stream.have_counter = 0;
+    }
+    break;
+  }
+} /* }}} void bind_stream_start */
+
+static void bind_stream_end (uxs_t *s, const char *name, /* {{{ */
+    const char *text, void __attribute__((unused)) *user_data)
+{
+  const bind_stream_path_t *stats = bind_stream.stats;
+  int depth = uxs_depth (s);
+  size_t i;
+
+  if (stats != NULL)
+  {
+    if (depth == bind_stream.stats_depth)
+    {
+      if (stats->pairs && bind_stream.have_name && bind_stream.have_counter)
+        bind_stream_submit (stats, bind_stream.name, bind_stream.counter);
+      bind_stream.stats = NULL;
+    }
+    else if (depth != bind_stream.stats_depth + 1)
+      /* ignore */;
+    else if (!stats->pairs)
+      bind_stream_submit (stats, name, text);
+    else if (strcmp ("name", name) == 0)
+    {
+      sstrncpy (bind_stream.name, text, sizeof (bind_stream.name));
+      bind_stream.have_name = 1;
+    }
+    else if (strcmp ("counter", name) == 0)
+    {
+      sstrncpy (bind_stream.counter, text, sizeof (bind_stream.counter));
+      bind_stream.have_counter = 1;
+    }
+    return;
+  }
+
+  if (bind_stream.version <= 0)
+    return;
+
+  if (uxs_matches (s, depth, BIND_STATS_PATH))
+  {
+    bind_stream.version = -1;
+  }
+  else if (uxs_matches (s, depth, BIND_STATS_PATH "/views/view/name"))
+  {
+    for (i = 0; i < views_num; i++)
+    {
+      if (strcasecmp (text, views[i].name) == 0)
+      {
+        bind_stream.view = views + i;
+        break;
+      }
+    }
+  }
+  else if ((bind_stream.view != NULL)
+      && uxs_matches (s, depth, BIND_STATS_PATH "/views/view/zones/zone/name"))
+  {
+    cb_view_t *view = bind_stream.view;
+
+    for (i = 0; i < view->zones_num; i++)
+    {
+      if (strcasecmp (text, view->zones[i]) == 0)
+      {
+        bind_stream.zone = view->zones[i];
+        break;
+      }
+    }
+  }
+} /* }}} void bind_stream_end */
+
 static int bind_config_set_bool (const char *name, int *var, /* {{{ */
     oconfig_item_t *ci)
 {
@@ -1371,6 +1720,10 @@ static int bind_config (oconfig_item_t *ci) /* {{{ */
       bind_config_add_view (child);
     else if (strcasecmp ("ParseTime", child->key) == 0)
       cf_util_get_boolean (child, &config_parse_time);
+    else if (strcasecmp ("Streaming", child->key) == 0)
+      cf_util_get_boolean (child, &config_streaming);
+    else if (ucm_config (child) <= 0)
+      /* option of the fetch service */;
     else
     {
       WARNING ("bind plugin: Unknown configuration option "
@@ -1400,9 +1753,57 @@ static int bind_init (void) /* {{{ */
   curl_easy_setopt (curl, CURLOPT_URL, (url != NULL) ? url : BIND_DEFAULT_URL);
   curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
 
+  if (config_streaming)
+  {
+    bind_parser = uxs_create (bind_stream_start, bind_stream_end,
+        /* user_data = */ NULL);
+    if (bind_parser == NULL)
+    {
+      ERROR ("bind plugin: bind_init: uxs_create failed.");
+      return (-1);
+    }
+  }
+
   return (0);
 } /* }}} int bind_init */
 
+/* Called by the fetch thread when the transfer has finished. */
+static void bind_curl_done (CURL __attribute__((unused)) *handle, /* {{{ */
+    CURLcode status, void __attribute__((unused)) *user_data)
+{
+  if (status != CURLE_OK)
+  {
+    /* The write callback aborts the transfer if parsing fails. */
+    if ((bind_parser != NULL) && (status == CURLE_WRITE_ERROR))
+      ERROR ("bind plugin: Parsing the server's response failed: %s",
+          uxs_strerror (bind_parser));
+    else if (status != CURLE_ABORTED_BY_CALLBACK)
+      ERROR ("bind plugin: curl_easy_perform failed: %s",
+          bind_curl_error);
+  }
+  else if (bind_parser != NULL)
+  {
+    if (uxs_finish (bind_parser) != 0)
+      ERROR ("bind plugin: Parsing the server's response failed: %s",
+          uxs_strerror (bind_parser));
+    else if (bind_stream.version == 0)
+      ERROR ("bind plugin: Cannot find the <statistics> tag.");
+  }
+  else if (bind_buffer_fill == 0)
+    ERROR ("bind plugin: The server's response was empty.");
+  else
+    bind_xml (bind_buffer);
+
+  /* Reset here rather than in bind_read, which doesn't know whether a
+   * transfer is still running. */
+  bind_buffer_fill = 0;
+  if (bind_parser != NULL)
+  {
+    uxs_reset (bind_parser);
+    memset (&bind_stream, 0, sizeof (bind_stream));
+  }
+} /* }}} void bind_curl_done */
+
 static int bind_read (void) /* {{{ */
 {
   int status;
@@ -1413,29 +1814,40 @@ static int bind_read (void) /* {{{ */
     return (-1);
   }
 
-  bind_buffer_fill = 0;
-  if (curl_easy_perform (curl) != 0)
+  /* Only set by the first read, before any transfer can be running. */
+  if (bind_interval == 0)
+    bind_interval = plugin_get_interval ();
+
+  status = ucm_submit (curl, (url != NULL) ? url : BIND_DEFAULT_URL,
+      bind_curl_done, /* user_data = */ NULL);
+  if (status == EBUSY)
   {
-    ERROR ("bind plugin: curl_easy_perform failed: %s",
-        bind_curl_error);
+    WARNING ("bind plugin: The previous request is still in progress. "
+        "Skipping this interval.");
     return (-1);
   }
-
-  status = bind_xml (bind_buffer);
-  if (status != 0)
+  else if (status != 0)
+  {
+    ERROR ("bind plugin: ucm_submit failed with status %i.", status);
     return (-1);
-  else
-    return (0);
+  }
+
+  return (0);
 } /* }}} int bind_read */
 
 static int bind_shutdown (void) /* {{{ */
 {
+  ucm_shutdown ();
+
   if (curl != NULL)
   {
     curl_easy_cleanup (curl);
     curl = NULL;
   }
 
+  uxs_destroy (bind_parser);
+  bind_parser = NULL;
+
   return (0);
 } /* }}} int bind_shutdown */
 
@@ -0,0 +1,1649 @@
+/**
+ * collectd - src/carbon.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_htable.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+/*
+ * Accepts the Graphite plaintext ("<path> <value> <timestamp>") and pickle
+ * protocols, like a carbon daemon, and dispatches the values. Paths are
+ * mapped to identifiers by the configured patterns, which are compiled into
+ * a trie of path components. Lines are parsed in the receive buffer without
+ * copying them, and the values read from one connection are dispatched as a
+ * batch.
+ */
+
+#define CB_DEFAULT_SERVICE_PLAINTEXT "2003"
+#define CB_DEFAULT_SERVICE_PICKLE    "2004"
+
+/* Initial size of the receive buffers and the maximum plaintext line
+ * length. */
+#define CB_BUFFER_SIZE 16384
+/* Pickle messages are length-prefixed; carbon's limit is the same. */
+#define CB_PICKLE_SIZE_MAX 1048576
+
+#define CB_BATCH_SIZE 256
+#define CB_COMPONENTS_MAX 32
+#define CB_PATH_MAX 1024
+
+#define CB_PROTOCOL_PLAINTEXT 0
+#define CB_PROTOCOL_PICKLE    1
+
+/* The fields of the identifier, and what the components of a pattern
+ * capture. */
+#define CB_FIELD_HOST            0
+#define CB_FIELD_PLUGIN          1
+#define CB_FIELD_PLUGIN_INSTANCE 2
+#define CB_FIELD_TYPE            3
+#define CB_FIELD_TYPE_INSTANCE   4
+#define CB_FIELDS_NUM            5
+/* Literal components and "*" don't capture anything. */
+#define CB_FIELD_NONE           -1
+
+/* One <Map> block. */
+struct cb_map_s;
+typedef struct cb_map_s cb_map_t;
+struct cb_map_s /* {{{ */
+{
+  char *pattern;
+  /* Fixed values of the fields, NULL for captured and empty fields. */
+  char *fields[CB_FIELDS_NUM];
+  /* What each component of the pattern captures. */
+  int captures[CB_COMPONENTS_MAX];
+  size_t components_num;
+  /* Looked up on first use if the type is fixed. */
+  const data_set_t *ds;
+
+  cb_map_t *next;
+}; /* }}} */
+
+/* A node of the trie. Each level is one component of the path. */
+struct cb_node_s;
+typedef struct cb_node_s cb_node_t;
+struct cb_node_s /* {{{ */
+{
+  /* Children for literal components, keyed by the component. */
+  c_htable_t *children;
+  /* Child matching any component; literal children are tried first. */
+  cb_node_t *wildcard;
+  /* The map whose pattern ends here, if any. */
+  cb_map_t *map;
+}; /* }}} */
+
+/* The head of cb_listener_t and cb_conn_t, stored in the epoll events. */
+struct cb_socket_s /* {{{ */
+{
+  int fd;
+  int protocol;
+  _Bool listening;
+}; /* }}} */
+typedef struct cb_socket_s cb_socket_t;
+
+struct cb_listener_s;
+typedef struct cb_listener_s cb_listener_t;
+struct cb_listener_s /* {{{ */
+{
+  cb_socket_t sock;
+  char *node;
+  char *service;
+
+  cb_listener_t *next;
+}; /* }}} */
+
+struct cb_conn_s /* {{{ */
+{
+  cb_socket_t sock;
+  char *buffer;
+  size_t size;
+  size_t fill;
+}; /* }}} */
+typedef struct cb_conn_s cb_conn_t;
+
+struct cb_thread_s /* {{{ */
+{
+  pthread_t id;
+  _Bool running;
+  int epfd;
+
+  /* The values waiting to be dispatched. */
+  value_list_t vls[CB_BATCH_SIZE];
+  value_t values[CB_BATCH_SIZE];
+  size_t vls_num;
+
+  uint64_t received;
+  uint64_t dropped;
+}; /* }}} */
+typedef struct cb_thread_s cb_thread_t;
+
+static cb_listener_t *listeners = NULL;
+static cb_map_t *maps = NULL;
+static cb_node_t *trie = NULL;
+static _Bool default_mapping = 1;
+
+static cb_thread_t *threads = NULL;
+static size_t threads_num = 1;
+static _Bool threads_quit = 0;
+
+/*
+ * Mapping
+ */
+static void cb_map_free (cb_map_t *m) /* {{{ */
+{
+  size_t i;
+
+  while (m != NULL)
+  {
+    cb_map_t *next = m->next;
+
+    sfree (m->pattern);
+    for (i = 0; i < CB_FIELDS_NUM; i++)
+      sfree (m->fields[i]);
+    sfree (m);
+
+    m = next;
+  }
+} /* }}} void cb_map_free */
+
+static void cb_node_free (cb_node_t *n) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  if (n == NULL)
+    return;
+
+  if (n->children != NULL)
+  {
+    while (c_htable_pick (n->children, &key, &value) == 0)
+    {
+      sfree (key);
+      cb_node_free (value);
+    }
+    c_htable_destroy (n->children);
+  }
+  cb_node_free (n->wildcard);
+  sfree (n);
+} /* }}} void cb_node_free */
+
+/* Splits "path" at the dots in place. Returns the number of components, or
+ * more than "size" if they don't fit. */
+static size_t cb_split_path (char *path, char **components, /* {{{ */
+    size_t size)
+{
+  size_t num = 0;
+  char *ptr = path;
+
+  while (1)
+  {
+    char *dot = strchr (ptr, '.');
+
+    if (num < size)
+      components[num] = ptr;
+    num++;
+
+    if (dot == NULL)
+      break;
+    *dot = 0;
+    ptr = dot + 1;
+  }
+
+  return (num);
+} /* }}} size_t cb_split_path */
+
+/* Returns the field a "{...}" component captures, or -2 if it's invalid. */
+static int cb_field_parse (const char *str) /* {{{ */
+{
+  if (strcasecmp ("{host}", str) == 0)
+    return (CB_FIELD_HOST);
+  else if (strcasecmp ("{plugin}", str) == 0)
+    return (CB_FIELD_PLUGIN);
+  else if (strcasecmp ("{plugin_instance}", str) == 0)
+    return (CB_FIELD_PLUGIN_INSTANCE);
+  else if (strcasecmp ("{type}", str) == 0)
+    return (CB_FIELD_TYPE);
+  else if (strcasecmp ("{type_instance}", str) == 0)
+    return (CB_FIELD_TYPE_INSTANCE);
+  return (-2);
+} /* }}} int cb_field_parse */
+
+/* Adds the pattern of "m" to the trie. */
+static int cb_trie_add (cb_map_t *m) /* {{{ */
+{
+  char pattern[CB_PATH_MAX];
+  char *components[CB_COMPONENTS_MAX];
+  cb_node_t *n;
+  size_t num;
+  size_t i;
+
+  sstrncpy (pattern, m->pattern, sizeof (pattern));
+  num = cb_split_path (pattern, components,
+      STATIC_ARRAY_SIZE (components));
+  if (num > CB_COMPONENTS_MAX)
+  {
+    ERROR ("carbon plugin: The pattern \"%s\" has more than %i components.",
+        m->pattern, CB_COMPONENTS_MAX);
+    return (EINVAL);
+  }
+
+  if (trie == NULL)
+  {
+    trie = calloc (1, sizeof (*trie));
+    if (trie == NULL)
+      return (ENOMEM);
+  }
+
+  n = trie;
+  for (i = 0; i < num; i++)
+  {
+    const char *c = components[i];
+    cb_node_t *child = NULL;
+
+    if ((strcmp ("*", c) == 0) || (c[0] == '{'))
+    {
+      if (c[0] == '{')
+        m->captures[i] = cb_field_parse (c);
+      else
+        m->captures[i] = CB_FIELD_NONE;
+
+      if (m->captures[i] < CB_FIELD_NONE)
+      {
+        ERROR ("carbon plugin: Invalid component \"%s\" in the pattern "
+            "\"%s\".", c, m->pattern);
+        return (EINVAL);
+      }
+
+      if (n->wildcard == NULL)
+        n->wildcard = calloc (1, sizeof (*n->wildcard));
+      child = n->wildcard;
+    }
+    else
+    {
+      m->captures[i] = CB_FIELD_NONE;
+
+      if (n->children == NULL)
+        n->children = c_htable_create ();
+      if ((n->children != NULL)
+          && (c_htable_get (n->children, c, (void *) &child) != 0))
+      {
+        char *key = strdup (c);
+
+        child = calloc (1, sizeof (*child));
+        if ((key == NULL) || (child == NULL)
+            || (c_htable_insert (n->children, key, child) != 0))
+        {
+          sfree (key);
+          sfree (child);
+        }
+      }
+    }
+
+    if (child == NULL)
+    {
+      ERROR ("carbon plugin: Allocating a trie node failed.");
+      return (ENOMEM);
+    }
+    n = child;
+  }
+
+  if (n->map != NULL)
+  {
+    WARNING ("carbon plugin: The pattern \"%s\" is the same as \"%s\" and "
+        "will be ignored.", m->pattern, n->map->pattern);
+    return (0);
+  }
+
+  m->components_num = num;
+  n->map = m;
+  return (0);
+} /* }}} int cb_trie_add */
+
+static cb_map_t *cb_trie_match (cb_node_t *n, /* {{{ */
+    char **components, size_t num, size_t depth)
+{
+  cb_node_t *child = NULL;
+  cb_map_t *m;
+
+  if (depth == num)
+    return (n->map);
+
+  if ((n->children != NULL)
+      && (c_htable_get (n->children, components[depth],
+          (void *) &child) == 0))
+  {
+    m = cb_trie_match (child, components, num, depth + 1);
+    if (m != NULL)
+      return (m);
+  }
+
+  if (n->wildcard != NULL)
+    return (cb_trie_match (n->wildcard, components, num, depth + 1));
+
+  return (NULL);
+} /* }}} cb_map_t *cb_trie_match */
+
+/* Appends "str" to the field "dst", separated by a dash. */
+static void cb_field_append (char *dst, size_t dst_size, /* {{{ */
+    const char *str)
+{
+  size_t len = strlen (dst);
+
+  if (len == 0)
+    sstrncpy (dst, str, dst_size);
+  else if ((len + 1) < dst_size)
+    ssnprintf (dst + len, dst_size - len, "-%s", str);
+} /* }}} void cb_field_append */
+
+/* Sets the identifier of "vl" from the path components, using "m". */
+static void cb_map_apply (const cb_map_t *m, /* {{{ */
+    char **components, value_list_t *vl)
+{
+  char *fields[CB_FIELDS_NUM] = { vl->host, vl->plugin, vl->plugin_instance,
+    vl->type, vl->type_instance };
+  size_t i;
+
+  for (i = 0; i < CB_FIELDS_NUM; i++)
+  {
+    if (m->fields[i] != NULL)
+      sstrncpy (fields[i], m->fields[i], DATA_MAX_NAME_LEN);
+    else
+      fields[i][0] = 0;
+  }
+
+  for (i = 0; i < m->components_num; i++)
+  {
+    if (m->captures[i] == CB_FIELD_NONE)
+      continue;
+    cb_field_append (fields[m->captures[i]], DATA_MAX_NAME_LEN,
+        components[i]);
+  }
+} /* }}} void cb_map_apply */
+
+/* Splits "str" at the first dash into "a" and "b". */
+static void cb_split_instance (const char *str, /* {{{ */
+    char *a, char *b)
+{
+  const char *dash = strchr (str, '-');
+
+  if (dash == NULL)
+  {
+    sstrncpy (a, str, DATA_MAX_NAME_LEN);
+    b[0] = 0;
+    return;
+  }
+
+  sstrncpy (a, str, (size_t) (dash - str) + 1 < DATA_MAX_NAME_LEN
+      ? (size_t) (dash - str) + 1 : DATA_MAX_NAME_LEN);
+  sstrncpy (b, dash + 1, DATA_MAX_NAME_LEN);
+} /* }}} void cb_split_instance */
+
+/* The reverse of the names written by write_graphite:
+ * "<host>.<plugin>[-<plugin instance>].<type>[-<type instance>][.<ds>]". */
+static int cb_default_apply (char **components, size_t num, /* {{{ */
+    value_list_t *vl)
+{
+  if ((num != 3) && (num != 4))
+    return (-1);
+
+  sstrncpy (vl->host, components[0], sizeof (vl->host));
+  cb_split_instance (components[1], vl->plugin, vl->plugin_instance);
+  cb_split_instance (components[2], vl->type, vl->type_instance);
+
+  return (0);
+} /* }}} int cb_default_apply */
+
+/*
+ * Dispatching
+ */
+static void cb_flush (cb_thread_t *t) /* {{{ */
+{
+  if (t->vls_num == 0)
+    return;
+
+  plugin_dispatch_values_batch (t->vls, t->vls_num);
+  t->vls_num = 0;
+} /* }}} void cb_flush */
+
+/* Maps "path", which is modified, and queues the value. */
+static int cb_submit (cb_thread_t *t, char *path, /* {{{ */
+    double value, double timestamp)
+{
+  char *components[CB_COMPONENTS_MAX];
+  const data_set_t *ds = NULL;
+  value_list_t *vl;
+  cb_map_t *m = NULL;
+  size_t num;
+
+  t->received++;
+
+  num = cb_split_path (path, components,
+      STATIC_ARRAY_SIZE (components));
+  if ((num == 0) || (num > CB_COMPONENTS_MAX))
+  {
+    t->dropped++;
+    return (-1);
+  }
+
+  vl = t->vls + t->vls_num;
+  memset (vl, 0, sizeof (*vl));
+
+  if (trie != NULL)
+    m = cb_trie_match (trie, components, num, /* depth = */ 0);
+
+  if (m != NULL)
+  {
+    cb_map_apply (m, components, vl);
+    ds = m->ds;
+    if ((ds == NULL) && (m->fields[CB_FIELD_TYPE] != NULL))
+      ds = m->ds = plugin_get_ds (vl->type);
+  }
+  else if (!default_mapping || (cb_default_apply (components, num, vl) != 0))
+  {
+    t->dropped++;
+    return (-1);
+  }
+
+  if (ds == NULL)
+    ds = plugin_get_ds (vl->type);
+  if ((ds == NULL) || (ds->ds_num != 1) || (vl->plugin[0] == 0))
+  {
+    DEBUG ("carbon plugin: No single-value type \"%s\" for \"%s\".",
+        vl->type, m != NULL ? m->pattern : "(default)");
+    t->dropped++;
+    return (-1);
+  }
+
+  switch (ds->ds[0].type)
+  {
+    case DS_TYPE_GAUGE:
+      t->values[t->vls_num].gauge = (gauge_t) value;
+      break;
+    case DS_TYPE_DERIVE:
+      t->values[t->vls_num].derive = (derive_t) value;
+      break;
+    case DS_TYPE_COUNTER:
+      t->values[t->vls_num].counter = (counter_t) value;
+      break;
+    case DS_TYPE_ABSOLUTE:
+      t->values[t->vls_num].absolute = (absolute_t) value;
+      break;
+  }
+
+  if (vl->host[0] == 0)
+    sstrncpy (vl->host, hostname_g, sizeof (vl->host));
+  vl->values = t->values + t->vls_num;
+  vl->values_len = 1;
+  /* Carbon clients send -1 for "now". */
+  vl->time = (timestamp > 0.0) ? DOUBLE_TO_CDTIME_T (timestamp) : cdtime ();
+  vl->interval = plugin_get_interval ();
+
+  t->vls_num++;
+  if (t->vls_num >= CB_BATCH_SIZE)
+    cb_flush (t);
+
+  return (0);
+} /* }}} int cb_submit */
+
+/*
+ * Plaintext protocol
+ */
+static int cb_parse_number (const char *str, double *ret) /* {{{ */
+{
+  char *endptr = NULL;
+
+  errno = 0;
+  *ret = strtod (str, &endptr);
+  if ((errno != 0) || (endptr == str) || (*endptr != 0))
+    return (-1);
+  return (0);
+} /* }}} int cb_parse_number */
+
+/* Handles one line, "<path> <value> [<timestamp>]", in place. */
+static int cb_handle_line (cb_thread_t *t, char *line) /* {{{ */
+{
+  char *fields[4];
+  int fields_num;
+  double value;
+  double timestamp = -1.0;
+
+  fields_num = strsplit (line, fields, STATIC_ARRAY_SIZE (fields));
+  if ((fields_num < 2) || (fields_num > 3))
+    return (-1);
+
+  if (cb_parse_number (fields[1], &value) != 0)
+    return (-1);
+  if ((fields_num == 3) && (cb_parse_number (fields[2], &timestamp) != 0))
+    return (-1);
+
+  return (cb_submit (t, fields[0], value, timestamp));
+} /* }}} int cb_handle_line */
+
+/* Handles the complete lines in the buffer and returns the number of bytes
+ * used. */
+static size_t cb_handle_plaintext (cb_thread_t *t, /* {{{ */
+    char *buffer, size_t buffer_len)
+{
+  char *line = buffer;
+  char *end = buffer + buffer_len;
+
+  while (line < end)
+  {
+    char *next = memchr (line, '\n', (size_t) (end - line));
+    if (next == NULL)
+      break;
+    *next = 0;
+
+    if ((next > line) && (next[-1] == '\r'))
+      next[-1] = 0;
+
+    if (line[0] != 0)
+      cb_handle_line (t, line);
+
+    line = next + 1;
+  }
+
+  return ((size_t) (line - buffer));
+} /* }}} size_t cb_handle_plaintext */
+
+/*
+ * Pickle protocol
+ *
+ * Carbon clients send lists of "(path, (timestamp, value))" tuples. Only the
+ * opcodes needed for lists, tuples, strings and numbers are understood; the
+ * message is dropped on any other one. The only objects which are kept are
+ * tuples; the elements appended to a list are submitted right away.
+ */
+#define CB_PICKLE_OTHER  0
+#define CB_PICKLE_NUMBER 1
+#define CB_PICKLE_STRING 2
+#define CB_PICKLE_TUPLE  3
+#define CB_PICKLE_LIST   4
+
+struct cb_pitem_s /* {{{ */
+{
+  int type;
+  double number;
+  const char *str;
+  size_t str_len;
+  /* The first two elements of tuples. */
+  size_t children[2];
+  size_t children_num;
+}; /* }}} */
+typedef struct cb_pitem_s cb_pitem_t;
+
+struct cb_pickle_s /* {{{ */
+{
+  cb_pitem_t *items;
+  size_t items_num;
+  size_t items_size;
+
+  /* Indices into "items". */
+  size_t *stack;
+  size_t stack_num;
+  size_t stack_size;
+
+  /* Positions in "stack". */
+  size_t *marks;
+  size_t marks_num;
+  size_t marks_size;
+
+  /* Indices into "items". */
+  size_t *memo;
+  size_t memo_num;
+  size_t memo_size;
+}; /* }}} */
+typedef struct cb_pickle_s cb_pickle_t;
+
+/* Grows "*array" so it holds at least "num" elements of "size" bytes. */
+static int cb_grow (void **array, size_t *array_size, /* {{{ */
+    size_t num, size_t size)
+{
+  size_t new_size;
+  void *tmp;
+
+  if (num <= *array_size)
+    return (0);
+
+  new_size = (*array_size == 0) ? 64 : *array_size;
+  while (new_size < num)
+    new_size *= 2;
+
+  tmp = realloc (*array, new_size * size);
+  if (tmp == NULL)
+    return (ENOMEM);
+  *array = tmp;
+  *array_size = new_size;
+  return (0);
+} /* }}} int cb_grow */
+
+static int cb_pickle_push_index (cb_pickle_t *p, size_t idx) /* {{{ */
+{
+  if (cb_grow ((void *) &p->stack, &p->stack_size, p->stack_num + 1,
+        sizeof (*p->stack)) != 0)
+    return (ENOMEM);
+  p->stack[p->stack_num] = idx;
+  p->stack_num++;
+  return (0);
+} /* }}} int cb_pickle_push_index */
+
+/* Pushes a new item and returns it, or NULL on failure. */
+static cb_pitem_t *cb_pickle_push (cb_pickle_t *p, int type) /* {{{ */
+{
+  cb_pitem_t *item;
+
+  if (cb_grow ((void *) &p->items, &p->items_size, p->items_num + 1,
+        sizeof (*p->items)) != 0)
+    return (NULL);
+  if (cb_pickle_push_index (p, p->items_num) != 0)
+    return (NULL);
+
+  item = p->items + p->items_num;
+  memset (item, 0, sizeof (*item));
+  item->type = type;
+  p->items_num++;
+  return (item);
+} /* }}} cb_pitem_t *cb_pickle_push */
+
+/* Submits "idx" if it's a "(path, (timestamp, value))" tuple. */
+static void cb_pickle_metric (cb_thread_t *t, cb_pickle_t *p, /* {{{ */
+    size_t idx)
+{
+  const cb_pitem_t *tuple = p->items + idx;
+  const cb_pitem_t *path;
+  const cb_pitem_t *point;
+  char buffer[CB_PATH_MAX];
+
+  if ((tuple->type != CB_PICKLE_TUPLE) || (tuple->children_num != 2))
+    return;
+
+  path = p->items + tuple->children[0];
+  point = p->items + tuple->children[1];
+  if ((path->type != CB_PICKLE_STRING) || (point->type != CB_PICKLE_TUPLE)
+      || (point->children_num != 2)
+      || (p->items[point->children[0]].type != CB_PICKLE_NUMBER)
+      || (p->items[point->children[1]].type != CB_PICKLE_NUMBER)
+      || (path->str_len >= sizeof (buffer)))
+    return;
+
+  memcpy (buffer, path->str, path->str_len);
+  buffer[path->str_len] = 0;
+
+  cb_submit (t, buffer, p->items[point->children[1]].number,
+      p->items[point->children[0]].number);
+} /* }}} void cb_pickle_metric */
+
+/* Pops the items above the last mark into a tuple. */
+static int cb_pickle_tuple (cb_pickle_t *p, size_t num) /* {{{ */
+{
+  cb_pitem_t *item;
+  size_t first;
+  size_t i;
+
+  if (num > p->stack_num)
+    return (-1);
+  first = p->stack_num - num;
+
+  if (cb_grow ((void *) &p->items, &p->items_size, p->items_num + 1,
+        sizeof (*p->items)) != 0)
+    return (ENOMEM);
+  item = p->items + p->items_num;
+  memset (item, 0, sizeof (*item));
+  item->type = CB_PICKLE_TUPLE;
+  item->children_num = num;
+  for (i = 0; (i < num) && (i < STATIC_ARRAY_SIZE (item->children)); i++)
+    item->children[i] = p->stack[first + i];
+
+  p->stack[first] = p->items_num;
+  p->stack_num = first + 1;
+  p->items_num++;
+  return (0);
+} /* }}} int cb_pickle_tuple */
+
+static int cb_pickle_pop_mark (cb_pickle_t *p, size_t *ret_pos) /* {{{ */
+{
+  if (p->marks_num == 0)
+    return (-1);
+  p->marks_num--;
+  *ret_pos = p->marks[p->marks_num];
+  return ((*ret_pos <= p->stack_num) ? 0 : -1);
+} /* }}} int cb_pickle_pop_mark */
+
+static int cb_pickle_memo_put (cb_pickle_t *p, uint64_t id) /* {{{ */
+{
+  size_t old_size = p->memo_size;
+
+  /* Pickle only memoizes objects it has created. */
+  if ((p->stack_num == 0) || (id > p->items_num))
+    return (-1);
+  if (cb_grow ((void *) &p->memo, &p->memo_size, (size_t) id + 1,
+        sizeof (*p->memo)) != 0)
+    return (ENOMEM);
+  if (p->memo_size > old_size)
+    memset (p->memo + old_size, 0xff,
+        (p->memo_size - old_size) * sizeof (*p->memo));
+
+  if (p->memo[id] == (size_t) -1)
+    p->memo_num++;
+  p->memo[id] = p->stack[p->stack_num - 1];
+  return (0);
+} /* }}} int cb_pickle_memo_put */
+
+static int cb_pickle_memo_get (cb_pickle_t *p, uint64_t id) /* {{{ */
+{
+  if ((id >= p->memo_size) || (p->memo[id] >= p->items_num))
+    return (-1);
+  return (cb_pickle_push_index (p, p->memo[id]));
+} /* }}} int cb_pickle_memo_get */
+
+/* Reads an unsigned little endian integer of "size" bytes. */
+static uint64_t cb_read_le (const unsigned char *ptr, size_t size) /* {{{ */
+{
+  uint64_t ret = 0;
+  size_t i;
+
+  for (i = size; i > 0; i--)
+    ret = (ret << 8) | (uint64_t) ptr[i - 1];
+  return (ret);
+} /* }}} uint64_t cb_read_le */
+
+/* Parses one pickle message. Returns non-zero if it isn't understood. */
+static int cb_pickle_parse (cb_thread_t *t, cb_pickle_t *p, /* {{{ */
+    const char *data, size_t data_len)
+{
+  const unsigned char *ptr = (const unsigned char *) data;
+  const unsigned char *end = ptr + data_len;
+
+  p->items_num = 0;
+  p->stack_num = 0;
+  p->marks_num = 0;
+  if (p->memo_num > 0)
+    memset (p->memo, 0xff, p->memo_size * sizeof (*p->memo));
+  p->memo_num = 0;
+
+#define NEED(n) do { if ((size_t) (end - ptr) < (size_t) (n)) return (-1); } \
+  while (0)
+
+  while (ptr < end)
+  {
+    unsigned char op = *ptr;
+    cb_pitem_t *item;
+    uint64_t len;
+    size_t pos;
+    size_t i;
+
+    ptr++;
+    switch (op)
+    {
+      case '.': /* STOP */
+        return (0);
+
+      case 0x80: /* PROTO */
+        NEED (1);
+        ptr++;
+        break;
+
+      case 0x95: /* FRAME */
+        NEED (8);
+        ptr += 8;
+        break;
+
+      case '(': /* MARK */
+        if (cb_grow ((void *) &p->marks, &p->marks_size, p->marks_num + 1,
+              sizeof (*p->marks)) != 0)
+          return (ENOMEM);
+        p->marks[p->marks_num] = p->stack_num;
+        p->marks_num++;
+        break;
+
+      case ']': /* EMPTY_LIST */
+        if (cb_pickle_push (p, CB_PICKLE_LIST) == NULL)
+          return (ENOMEM);
+        break;
+
+      case ')': /* EMPTY_TUPLE */
+        if (cb_pickle_tuple (p, 0) != 0)
+          return (-1);
+        break;
+
+      case 'N': /* NONE */
+      case 0x88: /* NEWTRUE */
+      case 0x89: /* NEWFALSE */
+        if (cb_pickle_push (p, CB_PICKLE_OTHER) == NULL)
+          return (ENOMEM);
+        break;
+
+      case 'a': /* APPEND */
+        if ((p->stack_num < 2)
+            || (p->items[p->stack[p->stack_num - 2]].type != CB_PICKLE_LIST))
+          return (-1);
+        cb_pickle_metric (t, p, p->stack[p->stack_num - 1]);
+        p->stack_num--;
+        break;
+
+      case 'e': /* APPENDS */
+      case 'l': /* LIST */
+        if (cb_pickle_pop_mark (p, &pos) != 0)
+          return (-1);
+        if ((op == 'e') && ((pos == 0)
+              || (p->items[p->stack[pos - 1]].type != CB_PICKLE_LIST)))
+          return (-1);
+        for (i = pos; i < p->stack_num; i++)
+          cb_pickle_metric (t, p, p->stack[i]);
+        p->stack_num = pos;
+        if ((op == 'l') && (cb_pickle_push (p, CB_PICKLE_LIST) == NULL))
+          return (ENOMEM);
+        break;
+
+      case 't': /* TUPLE */
+        if ((cb_pickle_pop_mark (p, &pos) != 0)
+            || (cb_pickle_tuple (p, p->stack_num - pos) != 0))
+          return (-1);
+        break;
+
+      case 0x85: /* TUPLE1 */
+      case 0x86: /* TUPLE2 */
+      case 0x87: /* TUPLE3 */
+        if (cb_pickle_tuple (p, (size_t) (op - 0x84)) != 0)
+          return (-1);
+        break;
+
+      case '0': /* POP */
+        if (p->stack_num == 0)
+          return (-1);
+        p->stack_num--;
+        break;
+
+      case '1': /* POP_MARK */
+        if (cb_pickle_pop_mark (p, &pos) != 0)
+          return (-1);
+        p->stack_num = pos;
+        break;
+
+      case '2': /* DUP */
+        if ((p->stack_num == 0)
+            || (cb_pickle_push_index (p, p->stack[p->stack_num - 1]) != 0))
+          return (-1);
+        break;
+
+      case 'K': /* BININT1 */
+      case 'M': /* BININT2 */
+      case 'J': /* BININT */
+        len = (op == 'K') ? 1 : ((op == 'M') ? 2 : 4);
+        NEED (len);
+        item = cb_pickle_push (p, CB_PICKLE_NUMBER);
+        if (item == NULL)
+          return (ENOMEM);
+        if (op == 'J')
+          item->number = (double) (int32_t) cb_read_le (ptr, 4);
+        else
+          item->number = (double) cb_read_le (ptr, (size_t) len);
+        ptr += len;
+        break;
+
+      case 0x8a: /* LONG1 */
+        NEED (1);
+        len = *ptr;
+        ptr++;
+        NEED (len);
+        if (len > 8)
+          return (-1);
+        item = cb_pickle_push (p, CB_PICKLE_NUMBER);
+        if (item == NULL)
+          return (ENOMEM);
+        {
+          uint64_t u = cb_read_le (ptr, (size_t) len);
+          /* Sign extension of the two's complement. */
+          if ((len > 0) && (len < 8) && (ptr[len - 1] & 0x80))
+            u |= ~((((uint64_t) 1) << (8 * len)) - 1);
+          item->number = (double) (int64_t) u;
+        }
+        ptr += len;
+        break;
+
+      case 'G': /* BINFLOAT */
+        NEED (8);
+        item = cb_pickle_push (p, CB_PICKLE_NUMBER);
+        if (item == NULL)
+          return (ENOMEM);
+        {
+          uint64_t u = 0;
+          double d;
+          for (i = 0; i < 8; i++)
+            u = (u << 8) | (uint64_t) ptr[i];
+          memcpy (&d, &u, sizeof (d));
+          item->number = d;
+        }
+        ptr += 8;
+        break;
+
+      case 'I': /* INT */
+      case 'L': /* LONG */
+      case 'F': /* FLOAT */
+      {
+        const unsigned char *nl = memchr (ptr, '\n', (size_t) (end - ptr));
+        char buffer[64];
+
+        if ((nl == NULL) || ((size_t) (nl - ptr) >= sizeof (buffer)))
+          return (-1);
+        memcpy (buffer, ptr, (size_t) (nl - ptr));
+        buffer[nl - ptr] = 0;
+        /* "123L" */
+        if ((op == 'L') && (nl > ptr) && (buffer[nl - ptr - 1] == 'L'))
+          buffer[nl - ptr - 1] = 0;
+
+        item = cb_pickle_push (p, CB_PICKLE_NUMBER);
+        if (item == NULL)
+          return (ENOMEM);
+        if (cb_parse_number (buffer, &item->number) != 0)
+          return (-1);
+        ptr = nl + 1;
+        break;
+      }
+
+      case 'S': /* STRING */
+      case 'V': /* UNICODE */
+      {
+        const unsigned char *nl = memchr (ptr, '\n', (size_t) (end - ptr));
+        const unsigned char *str = ptr;
+
+        if (nl == NULL)
+          return (-1);
+        len = (uint64_t) (nl - ptr);
+        /* STRING is quoted; escape sequences aren't expected in paths
+         * and are kept verbatim, like with UNICODE. */
+        if (op == 'S')
+        {
+          if ((len < 2) || ((str[0] != '\'') && (str[0] != '"'))
+              || (str[len - 1] != str[0]))
+            return (-1);
+          str++;
+          len -= 2;
+        }
+
+        item = cb_pickle_push (p, CB_PICKLE_STRING);
+        if (item == NULL)
+          return (ENOMEM);
+        item->str = (const char *) str;
+        item->str_len = (size_t) len;
+        ptr = nl + 1;
+        break;
+      }
+
+      case 'p': /* PUT */
+      case 'g': /* GET */
+      {
+        const unsigned char *nl = memchr (ptr, '\n', (size_t) (end - ptr));
+        char buffer[32];
+        double id;
+
+        if ((nl == NULL) || ((size_t) (nl - ptr) >= sizeof (buffer)))
+          return (-1);
+        memcpy (buffer, ptr, (size_t) (nl - ptr));
+        buffer[nl - ptr] = 0;
+        if ((cb_parse_number (buffer, &id) != 0) || (id < 0.0))
+          return (-1);
+
+        if ((op == 'p') ? (cb_pickle_memo_put (p, (uint64_t) id) != 0)
+            : (cb_pickle_memo_get (p, (uint64_t) id) != 0))
+          return (-1);
+        ptr = nl + 1;
+        break;
+      }
+
+      case 'U': /* SHORT_BINSTRING */
+      case 0x8c: /* SHORT_BINUNICODE */
+      case 'C': /* SHORT_BINBYTES */
+      case 'T': /* BINSTRING */
+      case 'X': /* BINUNICODE */
+      case 'B': /* BINBYTES */
+        if ((op == 'U') || (op == 0x8c) || (op == 'C'))
+        {
+          NEED (1);
+          len = *ptr;
+          ptr++;
+        }
+        else
+        {
+          NEED (4);
+          len = cb_read_le (ptr, 4);
+          ptr += 4;
+        }
+        NEED (len);
+        item = cb_pickle_push (p, CB_PICKLE_STRING);
+        if (item == NULL)
+          return (ENOMEM);
+        item->str = (const char *) ptr;
+        item->str_len = (size_t) len;
+        ptr += len;
+        break;
+
+      case 'q': /* BINPUT */
+      case 'r': /* LONG_BINPUT */
+      case 'h': /* BINGET */
+      case 'j': /* LONG_BINGET */
+        len = ((op == 'q') || (op == 'h')) ? 1 : 4;
+        NEED (len);
+        {
+          uint64_t id = cb_read_le (ptr, (size_t) len);
+          ptr += len;
+          if ((op == 'q') || (op == 'r'))
+          {
+            if (cb_pickle_memo_put (p, id) != 0)
+              return (-1);
+          }
+          else if (cb_pickle_memo_get (p, id) != 0)
+            return (-1);
+        }
+        break;
+
+      case 0x94: /* MEMOIZE */
+        if (cb_pickle_memo_put (p, (uint64_t) p->memo_num) != 0)
+          return (-1);
+        break;
+
+      default:
+        DEBUG ("carbon plugin: Unsupported pickle opcode %#x.",
+            (unsigned int) op);
+        return (-1);
+    }
+  }
+
+#undef NEED
+
+  /* No STOP opcode. */
+  return (-1);
+} /* }}} int cb_pickle_parse */
+
+/* Handles the complete messages in the buffer and returns the number of bytes
+ * used, or (size_t) -1 if the connection should be closed. */
+static size_t cb_handle_pickle (cb_thread_t *t, cb_pickle_t *p, /* {{{ */
+    const char *buffer, size_t buffer_len, size_t *ret_need)
+{
+  size_t pos = 0;
+
+  *ret_need = 0;
+
+  while ((buffer_len - pos) >= 4)
+  {
+    const unsigned char *hdr = (const unsigned char *) buffer + pos;
+    size_t len = ((size_t) hdr[0] << 24) | ((size_t) hdr[1] << 16)
+      | ((size_t) hdr[2] << 8) | (size_t) hdr[3];
+
+    if (len > CB_PICKLE_SIZE_MAX)
+    {
+      WARNING ("carbon plugin: Pickle message of %zu bytes is too large.",
+          len);
+      return ((size_t) -1);
+    }
+
+    if ((buffer_len - pos - 4) < len)
+    {
+      *ret_need = len + 4;
+      break;
+    }
+
+    if (cb_pickle_parse (t, p, buffer + pos + 4, len) != 0)
+    {
+      DEBUG ("carbon plugin: Parsing a pickle message failed.");
+      t->dropped++;
+    }
+    pos += len + 4;
+  }
+
+  return (pos);
+} /* }}} size_t cb_handle_pickle */
+
+/*
+ * Connections
+ */
+static void cb_conn_close (cb_thread_t *t, cb_conn_t *conn) /* {{{ */
+{
+  epoll_ctl (t->epfd, EPOLL_CTL_DEL, conn->sock.fd, /* event = */ NULL);
+  close (conn->sock.fd);
+  sfree (conn->buffer);
+  sfree (conn);
+} /* }}} void cb_conn_close */
+
+static void cb_conn_accept (cb_thread_t *t, cb_socket_t *listener) /* {{{ */
+{
+  struct epoll_event ev;
+  cb_conn_t *conn;
+  int fd;
+  int flags;
+
+  fd = accept (listener->fd, /* addr = */ NULL, /* addrlen = */ NULL);
+  if (fd < 0)
+    return;
+
+  flags = fcntl (fd, F_GETFL);
+  if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0))
+  {
+    close (fd);
+    return;
+  }
+
+  conn = calloc (1, sizeof (*conn));
+  if (conn != NULL)
+  {
+    conn->size = CB_BUFFER_SIZE;
+    conn->buffer = malloc (conn->size + 1);
+  }
+  if ((conn == NULL) || (conn->buffer == NULL))
+  {
+    ERROR ("carbon plugin: Allocating a connection failed.");
+    if (conn != NULL)
+      sfree (conn->buffer);
+    sfree (conn);
+    close (fd);
+    return;
+  }
+  conn->sock.fd = fd;
+  conn->sock.protocol = listener->protocol;
+  conn->sock.listening = 0;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  if (epoll_ctl (t->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("carbon plugin: epoll_ctl failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    sfree (conn->buffer);
+    sfree (conn);
+    close (fd);
+  }
+} /* }}} void cb_conn_accept */
+
+/* Reads from the connection and handles what's complete. Returns non-zero if
+ * the connection should be closed. */
+static int cb_conn_read (cb_thread_t *t, cb_pickle_t *p, /* {{{ */
+    cb_conn_t *conn)
+{
+  ssize_t status;
+  size_t used;
+  size_t need = 0;
+
+  status = read (conn->sock.fd, conn->buffer + conn->fill,
+      conn->size - conn->fill);
+  if (status < 0)
+    return (((errno == EAGAIN) || (errno == EWOULDBLOCK)
+          || (errno == EINTR)) ? 0 : -1);
+  else if (status == 0)
+    return (-1);
+  conn->fill += (size_t) status;
+
+  if (conn->sock.protocol == CB_PROTOCOL_PICKLE)
+  {
+    used = cb_handle_pickle (t, p, conn->buffer, conn->fill, &need);
+    if (used == (size_t) -1)
+      return (-1);
+  }
+  else
+  {
+    used = cb_handle_plaintext (t, conn->buffer, conn->fill);
+    /* The line doesn't fit into the buffer; it is dropped. */
+    if ((used == 0) && (conn->fill == conn->size))
+    {
+      t->dropped++;
+      used = conn->fill;
+    }
+  }
+
+  cb_flush (t);
+
+  conn->fill -= used;
+  if (conn->fill > 0)
+    memmove (conn->buffer, conn->buffer + used, conn->fill);
+
+  /* Pickle messages may be larger than the buffer. */
+  if (need > conn->size)
+  {
+    char *tmp = realloc (conn->buffer, need + 1);
+    if (tmp == NULL)
+      return (-1);
+    conn->buffer = tmp;
+    conn->size = need;
+  }
+
+  return (0);
+} /* }}} int cb_conn_read */
+
+static void *cb_thread (void *arg) /* {{{ */
+{
+  cb_thread_t *t = arg;
+  struct epoll_event events[64];
+  cb_pickle_t pickle;
+
+  memset (&pickle, 0, sizeof (pickle));
+
+  while (!threads_quit)
+  {
+    int status;
+    int i;
+
+    status = epoll_wait (t->epfd, events, STATIC_ARRAY_SIZE (events),
+        /* timeout = */ 1000);
+    if (status < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+      ERROR ("carbon plugin: epoll_wait failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    for (i = 0; i < status; i++)
+    {
+      cb_socket_t *sock = events[i].data.ptr;
+
+      if (sock->listening)
+        cb_conn_accept (t, sock);
+      else if (((events[i].events & EPOLLIN) == 0)
+          || (cb_conn_read (t, &pickle, (cb_conn_t *) sock) != 0))
+        cb_conn_close (t, (cb_conn_t *) sock);
+    }
+  }
+
+  sfree (pickle.items);
+  sfree (pickle.stack);
+  sfree (pickle.marks);
+  sfree (pickle.memo);
+
+  return (NULL);
+} /* }}} void *cb_thread */
+
+/*
+ * Configuration and life cycle
+ */
+static int cb_open_listener (cb_listener_t *l) /* {{{ */
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  const char *service;
+  int fd = -1;
+  int status;
+
+  service = l->service;
+  if (service == NULL)
+    service = (l->sock.protocol == CB_PROTOCOL_PICKLE)
+      ? CB_DEFAULT_SERVICE_PICKLE : CB_DEFAULT_SERVICE_PLAINTEXT;
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+  ai_hints.ai_flags = 0;
+#ifdef AI_PASSIVE
+  ai_hints.ai_flags |= AI_PASSIVE;
+#endif
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  status = getaddrinfo (l->node, service, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    ERROR ("carbon plugin: getaddrinfo (%s, %s) failed: %s",
+        (l->node == NULL) ? "(null)" : l->node, service,
+        gai_strerror (status));
+    return (-1);
+  }
+
+  /* Like most servers, only the first address is used. */
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    int yes = 1;
+    int flags;
+
+    /* Sockets handed over by the previous process are set up already. */
+    fd = plugin_handoff_take (SOCK_STREAM, ai_ptr->ai_addr,
+        ai_ptr->ai_addrlen);
+    if (fd >= 0)
+      break;
+
+    fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        ai_ptr->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    flags = fcntl (fd, F_GETFL);
+    if ((setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) == 0)
+        && (flags >= 0)
+        && (fcntl (fd, F_SETFL, flags | O_NONBLOCK) == 0)
+        && (bind (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0)
+        && (listen (fd, /* backlog = */ 1024) == 0))
+      break;
+
+    {
+      char errbuf[1024];
+      ERROR ("carbon plugin: Setting up the socket failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+    }
+    close (fd);
+    fd = -1;
+  }
+
+  freeaddrinfo (ai_list);
+
+  if (fd < 0)
+    return (-1);
+
+  plugin_handoff_add (fd);
+  l->sock.fd = fd;
+  l->sock.listening = 1;
+  return (0);
+} /* }}} int cb_open_listener */
+
+static int cb_config_listen (oconfig_item_t *ci) /* {{{ */
+{
+  cb_listener_t *l;
+  int i;
+
+  if ((ci->values_num < 1) || (ci->values_num > 2)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING)
+      || ((ci->values_num == 2)
+        && (ci->values[1].type != OCONFIG_TYPE_STRING)))
+  {
+    ERROR ("carbon plugin: The `Listen' block needs a host and optionally "
+        "a port.");
+    return (-1);
+  }
+
+  l = calloc (1, sizeof (*l));
+  if (l == NULL)
+    return (ENOMEM);
+  l->sock.fd = -1;
+  l->sock.protocol = CB_PROTOCOL_PLAINTEXT;
+  l->node = strdup (ci->values[0].value.string);
+  if (ci->values_num == 2)
+    l->service = strdup (ci->values[1].value.string);
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Protocol", child->key) == 0)
+    {
+      char proto[16];
+
+      if (cf_util_get_string_buffer (child, proto, sizeof (proto)) != 0)
+        continue;
+      if (strcasecmp ("plaintext", proto) == 0)
+        l->sock.protocol = CB_PROTOCOL_PLAINTEXT;
+      else if (strcasecmp ("pickle", proto) == 0)
+        l->sock.protocol = CB_PROTOCOL_PICKLE;
+      else
+        ERROR ("carbon plugin: Unknown protocol \"%s\".", proto);
+    }
+    else
+      ERROR ("carbon plugin: The \"%s\" option is not allowed in the "
+          "`Listen' block.", child->key);
+  }
+
+  l->next = listeners;
+  listeners = l;
+  return (0);
+} /* }}} int cb_config_listen */
+
+static int cb_config_map (oconfig_item_t *ci) /* {{{ */
+{
+  static const char *keys[CB_FIELDS_NUM] = { "Host", "Plugin",
+    "PluginInstance", "Type", "TypeInstance" };
+  cb_map_t *m;
+  int status = 0;
+  int i;
+
+  m = calloc (1, sizeof (*m));
+  if (m == NULL)
+    return (ENOMEM);
+
+  if (cf_util_get_string (ci, &m->pattern) != 0)
+  {
+    sfree (m);
+    return (-1);
+  }
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+    size_t j;
+
+    for (j = 0; j < CB_FIELDS_NUM; j++)
+      if (strcasecmp (keys[j], child->key) == 0)
+        break;
+
+    if (j < CB_FIELDS_NUM)
+      status = cf_util_get_string (child, &m->fields[j]);
+    else
+    {
+      ERROR ("carbon plugin: The \"%s\" option is not allowed in the "
+          "`Map' block.", child->key);
+      status = -1;
+    }
+    if (status != 0)
+      break;
+  }
+
+  if (status == 0)
+    status = cb_trie_add (m);
+
+  if (status != 0)
+  {
+    ERROR ("carbon plugin: Ignoring the map \"%s\".", m->pattern);
+    m->next = NULL;
+    cb_map_free (m);
+    return (status);
+  }
+
+  m->next = maps;
+  maps = m;
+  return (0);
+} /* }}} int cb_config_map */
+
+static int cb_config (oconfig_item_t *ci) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Listen", child->key) == 0)
+      cb_config_listen (child);
+    else if (strcasecmp ("Map", child->key) == 0)
+      cb_config_map (child);
+    else if (strcasecmp ("DefaultMapping", child->key) == 0)
+      cf_util_get_boolean (child, &default_mapping);
+    else if (strcasecmp ("Threads", child->key) == 0)
+    {
+      int tmp = (int) threads_num;
+      if ((cf_util_get_int (child, &tmp) == 0)
+          && ((tmp < 1) || (tmp > 64)))
+        WARNING ("carbon plugin: `Threads' must be between 1 and 64.");
+      else
+        threads_num = (size_t) tmp;
+    }
+    else
+      ERROR ("carbon plugin: The \"%s\" config option is not valid.",
+          child->key);
+  }
+
+  return (0);
+} /* }}} int cb_config */
+
+static int cb_init (void) /* {{{ */
+{
+  cb_listener_t *l;
+  size_t i;
+  int status;
+
+  if (threads != NULL)
+    return (0);
+
+  if (listeners == NULL)
+  {
+    ERROR ("carbon plugin: No `Listen' block has been configured.");
+    return (-1);
+  }
+
+  threads = calloc (threads_num, sizeof (*threads));
+  if (threads == NULL)
+  {
+    ERROR ("carbon plugin: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < threads_num; i++)
+  {
+    threads[i].epfd = epoll_create (/* size = */ 64);
+    if (threads[i].epfd < 0)
+    {
+      char errbuf[1024];
+      ERROR ("carbon plugin: epoll_create failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      return (-1);
+    }
+  }
+
+  for (l = listeners; l != NULL; l = l->next)
+  {
+    if (cb_open_listener (l) != 0)
+    {
+      ERROR ("carbon plugin: Listening on [%s]:%s failed.",
+          (l->node != NULL) ? l->node : "any",
+          (l->service != NULL) ? l->service : "(default)");
+      continue;
+    }
+
+    /* Every thread accepts connections and handles the ones it accepted. */
+    for (i = 0; i < threads_num; i++)
+    {
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+      ev.events |= EPOLLEXCLUSIVE;
+#endif
+      ev.data.ptr = &l->sock;
+      if (epoll_ctl (threads[i].epfd, EPOLL_CTL_ADD, l->sock.fd, &ev) != 0)
+      {
+        char errbuf[1024];
+        ERROR ("carbon plugin: epoll_ctl failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+      }
+    }
+  }
+
+  for (i = 0; i < threads_num; i++)
+  {
+    status = plugin_thread_create (&threads[i].id, /* attr = */ NULL,
+        cb_thread, threads + i);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("carbon plugin: pthread_create failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      continue;
+    }
+    threads[i].running = 1;
+  }
+
+  return (0);
+} /* }}} int cb_init */
+
+static void cb_stop_threads (void) /* {{{ */
+{
+  size_t i;
+
+  threads_quit = 1;
+  for (i = 0; (threads != NULL) && (i < threads_num); i++)
+  {
+    if (!threads[i].running)
+      continue;
+    pthread_join (threads[i].id, /* retval = */ NULL);
+    threads[i].running = 0;
+  }
+} /* }}} void cb_stop_threads */
+
+/* Called on hitless restarts: the next process accepts the connections now.
+ * The threads dispatch what they have read before exiting. */
+static int cb_handoff (void) /* {{{ */
+{
+  cb_stop_threads ();
+  return (0);
+} /* }}} int cb_handoff */
+
+static int cb_shutdown (void) /* {{{ */
+{
+  size_t i;
+
+  cb_stop_threads ();
+
+  /* Connections are closed with the epoll sets; their memory is released
+   * when the process exits. */
+  for (i = 0; (threads != NULL) && (i < threads_num); i++)
+    if (threads[i].epfd >= 0)
+      close (threads[i].epfd);
+  sfree (threads);
+
+  while (listeners != NULL)
+  {
+    cb_listener_t *next = listeners->next;
+
+    if (listeners->sock.fd >= 0)
+      close (listeners->sock.fd);
+    sfree (listeners->node);
+    sfree (listeners->service);
+    sfree (listeners);
+
+    listeners = next;
+  }
+
+  cb_node_free (trie);
+  trie = NULL;
+  cb_map_free (maps);
+  maps = NULL;
+
+  return (0);
+} /* }}} int cb_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("carbon", cb_config);
+  plugin_register_init ("carbon", cb_init);
+  plugin_register_handoff ("carbon", cb_handoff);
+  plugin_register_shutdown ("carbon", cb_shutdown);
+} /* void module_register */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,849 @@
+/**
+ * collectd - src/cgroups.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_avltree.h"
+#include "utils_ignorelist.h"
+
+#if !KERNEL_LINUX
+# error "No applicable input method."
+#endif
+
+#include <dirent.h>
+
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# define CG_HAVE_INOTIFY 1
+/* Removals are taken from the parent's events: the open statistics files pin
+ * the removed directory, which delays its own IN_DELETE_SELF. */
+# define CG_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM \
+    | IN_ONLYDIR)
+#else
+# define CG_HAVE_INOTIFY 0
+#endif
+
+#define CG_FILES_MAX 2
+#define CG_VALUES_MAX 8
+
+struct cg_group_s;
+typedef struct cg_group_s cg_group_t;
+
+/* A controller hierarchy, e.g. "/sys/fs/cgroup/memory", and the statistics
+ * files read from each of its cgroups. */
+struct cg_controller_s
+{
+  const char *name;
+  const char *files[CG_FILES_MAX];
+  void (*read) (const cg_group_t *g);
+
+  c_avl_tree_t *groups; /* relative path -> cg_group_t */
+  _Bool mounted;
+
+  /* One inotify instance per hierarchy, because controllers mounted
+   * together would share the watch descriptors otherwise. */
+  int inotify_fd;
+  c_avl_tree_t *watches; /* wd -> cg_group_t */
+};
+typedef struct cg_controller_s cg_controller_t;
+
+/* One cgroup of one controller. The root of the hierarchy has the empty
+ * path; it is watched but not reported. */
+struct cg_group_s
+{
+  char *path;     /* relative to the controller's mount point */
+  char *instance; /* last path component, the plugin instance */
+  cg_controller_t *ctl;
+
+  int wd;
+  unsigned int generation;
+
+  /* Statistics files, kept open between reads. NULL for ignored cgroups. */
+  pread_file_t *files[CG_FILES_MAX];
+};
+
+static void cg_read_cpuacct (const cg_group_t *g);
+static void cg_read_memory (const cg_group_t *g);
+static void cg_read_blkio (const cg_group_t *g);
+
+static cg_controller_t controllers[] =
+{
+  { "cpuacct", { "cpuacct.stat", NULL }, cg_read_cpuacct, NULL, 0, -1, NULL },
+  { "memory",  { "memory.stat", NULL }, cg_read_memory, NULL, 0, -1, NULL },
+  { "blkio",   { "blkio.throttle.io_service_bytes",
+                 "blkio.throttle.io_serviced" },
+               cg_read_blkio, NULL, 0, -1, NULL }
+};
+static size_t controllers_num = STATIC_ARRAY_SIZE (controllers);
+
+static char *cg_mountpoint = NULL;
+static ignorelist_t *cg_ignorelist = NULL;
+
+static unsigned int cg_generation = 0;
+static _Bool cg_rescan = 1;
+
+/*
+ * Dispatching
+ */
+static void cg_submit (const cg_group_t *g, const char *type,
+    plugin_value_entry_t *entries, size_t entries_num)
+{
+  value_list_t vl = VALUE_LIST_INIT;
+
+  if (entries_num == 0)
+    return;
+
+  sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+  sstrncpy (vl.plugin, "cgroups", sizeof (vl.plugin));
+  sstrncpy (vl.plugin_instance, g->instance, sizeof (vl.plugin_instance));
+  sstrncpy (vl.type, type, sizeof (vl.type));
+
+  plugin_dispatch_values_multi (&vl, entries, entries_num);
+} /* void cg_submit */
+
+/* Returns the contents of the group's statistics file or NULL if the file
+ * cannot be read, e.g. because the cgroup has been removed just now. */
+static char *cg_read_file (const cg_group_t *g, size_t index)
+{
+  char *buffer;
+
+  buffer = pread_file_read (g->files[index], /* ret_len = */ NULL);
+  if ((buffer == NULL) && (errno != ENOENT) && (errno != ENODEV))
+  {
+    char errbuf[1024];
+    WARNING ("cgroups plugin: Reading %s/%s/%s/%s failed: %s",
+        cg_mountpoint, g->ctl->name, g->path, g->ctl->files[index],
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+  }
+
+  return (buffer);
+} /* char *cg_read_file */
+
+/* cpuacct.stat: "user <ticks>" and "system <ticks>" */
+static void cg_read_cpuacct (const cg_group_t *g)
+{
+  value_t values[2];
+  plugin_value_entry_t entries[2];
+  size_t entries_num = 0;
+  char *ptr;
+  char *fields[3];
+  int num;
+
+  ptr = cg_read_file (g, 0);
+  if (ptr == NULL)
+    return;
+
+  memset (entries, 0, sizeof (entries));
+  while ((num = strsplit_line (&ptr, fields, STATIC_ARRAY_SIZE (fields))) >= 0)
+  {
+    if (entries_num >= STATIC_ARRAY_SIZE (entries))
+      break;
+    if (num != 2)
+      continue;
+
+    if ((strcmp ("user", fields[0]) != 0)
+        && (strcmp ("system", fields[0]) != 0))
+      continue;
+    if (strtoderive (fields[1], &values[entries_num].derive) != 0)
+      continue;
+
+    entries[entries_num].type_instance = fields[0];
+    entries[entries_num].values = values + entries_num;
+    entries[entries_num].values_len = 1;
+    entries_num++;
+  }
+
+  cg_submit (g, "cpu", entries, entries_num);
+} /* void cg_read_cpuacct */
+
+/* memory.stat: "<key> <value>" lines. The "total_*" keys include the
+ * children and are skipped; the children are reported themselves. */
+static void cg_read_memory (const cg_group_t *g)
+{
+  static const char *memory_keys[] =
+  {
+    "cache", "rss", "rss_huge", "mapped_file", "swap"
+  };
+  value_t values[CG_VALUES_MAX];
+  plugin_value_entry_t entries[CG_VALUES_MAX];
+  size_t entries_num = 0;
+  value_t faults[2];
+  int faults_valid = 0;
+  char *ptr;
+  char *fields[3];
+  int num;
+
+  ptr = cg_read_file (g, 0);
+  if (ptr == NULL)
+    return;
+
+  memset (entries, 0, sizeof (entries));
+  while ((num = strsplit_line (&ptr, fields, STATIC_ARRAY_SIZE (fields))) >= 0)
+  {
+    size_t i;
+
+    if (num != 2)
+      continue;
+
+    if (strcmp ("pgfault", fields[0]) == 0)
+    {
+      if (strtoderive (fields[1], &faults[0].derive) == 0)
+        faults_valid |= 0x01;
+      continue;
+    }
+    else if (strcmp ("pgmajfault", fields[0]) == 0)
+    {
+      if (strtoderive (fields[1], &faults[1].derive) == 0)
+        faults_valid |= 0x02;
+      continue;
+    }
+
+    for (i = 0; i < STATIC_ARRAY_SIZE (memory_keys); i++)
+      if (strcmp (memory_keys[i], fields[0]) == 0)
+        break;
+    if ((i >= STATIC_ARRAY_SIZE (memory_keys))
+        || (entries_num >= STATIC_ARRAY_SIZE (entries)))
+      continue;
+
+    if (parse_value (fields[1], values + entries_num, DS_TYPE_GAUGE) != 0)
+      continue;
+
+    entries[entries_num].type_instance = fields[0];
+    entries[entries_num].values = values + entries_num;
+    entries[entries_num].values_len = 1;
+    entries_num++;
+  }
+
+  if (faults_valid == 0x03)
+  {
+    entries[entries_num].type = "vmpage_faults";
+    entries[entries_num].type_instance = "";
+    entries[entries_num].values = faults;
+    entries[entries_num].values_len = 2;
+    entries_num++;
+  }
+
+  cg_submit (g, "memory", entries, entries_num);
+} /* void cg_read_memory */
+
+/* Sums "<major>:<minor> Read|Write <value>" lines over all devices. The
+ * final "Total <value>" line has only two fields and is skipped. */
+static int cg_sum_blkio (char *ptr, value_t *values)
+{
+  char *fields[4];
+  int valid = 0;
+  int num;
+
+  values[0].derive = 0;
+  values[1].derive = 0;
+
+  while ((num = strsplit_line (&ptr, fields, STATIC_ARRAY_SIZE (fields))) >= 0)
+  {
+    derive_t tmp;
+    size_t i;
+
+    if (num != 3)
+      continue;
+
+    if (strcmp ("Read", fields[1]) == 0)
+      i = 0;
+    else if (strcmp ("Write", fields[1]) == 0)
+      i = 1;
+    else
+      continue;
+
+    if (strtoderive (fields[2], &tmp) != 0)
+      continue;
+
+    values[i].derive += tmp;
+    valid = 1;
+  }
+
+  return (valid ? 0 : -1);
+} /* int cg_sum_blkio */
+
+static void cg_read_blkio (const cg_group_t *g)
+{
+  static const char *types[] = { "disk_octets", "disk_ops" };
+  value_t values[CG_FILES_MAX][2];
+  plugin_value_entry_t entries[CG_FILES_MAX];
+  size_t entries_num = 0;
+  size_t i;
+
+  memset (entries, 0, sizeof (entries));
+  for (i = 0; i < CG_FILES_MAX; i++)
+  {
+    char *ptr;
+
+    ptr = cg_read_file (g, i);
+    if ((ptr == NULL) || (cg_sum_blkio (ptr, values[i]) != 0))
+      continue;
+
+    entries[entries_num].type = types[i];
+    entries[entries_num].type_instance = "";
+    entries[entries_num].values = values[i];
+    entries[entries_num].values_len = 2;
+    entries_num++;
+  }
+
+  cg_submit (g, types[0], entries, entries_num);
+} /* void cg_read_blkio */
+
+/*
+ * Discovery
+ */
+#if CG_HAVE_INOTIFY
+static int cg_wd_compare (const void *a, const void *b)
+{
+  int wd_a = *((const int *) a);
+  int wd_b = *((const int *) b);
+
+  if (wd_a < wd_b)
+    return (-1);
+  else if (wd_a > wd_b)
+    return (1);
+  return (0);
+} /* int cg_wd_compare */
+
+/* Watches the cgroup's directory for new children. Failures are not fatal:
+ * the next complete scan tries again. */
+static void cg_watch_add (cg_group_t *g, const char *abs_path)
+{
+  cg_controller_t *ctl = g->ctl;
+
+  if ((ctl->inotify_fd < 0) || (g->wd >= 0))
+    return;
+
+  g->wd = inotify_add_watch (ctl->inotify_fd, abs_path, CG_WATCH_MASK);
+  if (g->wd < 0)
+  {
+    char errbuf[1024];
+    /* ENOSPC means fs.inotify.max_user_watches has been reached. */
+    WARNING ("cgroups plugin: inotify_add_watch (%s) failed: %s", abs_path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    cg_rescan = 1;
+    return;
+  }
+
+  if (c_avl_insert (ctl->watches, &g->wd, g) != 0)
+  {
+    ERROR ("cgroups plugin: c_avl_insert failed.");
+    inotify_rm_watch (ctl->inotify_fd, g->wd);
+    g->wd = -1;
+    cg_rescan = 1;
+  }
+} /* void cg_watch_add */
+#endif /* CG_HAVE_INOTIFY */
+
+static void cg_group_destroy (cg_group_t *g)
+{
+  size_t i;
+
+  if (g == NULL)
+    return;
+
+#if CG_HAVE_INOTIFY
+  if (g->wd >= 0)
+  {
+    c_avl_remove (g->ctl->watches, &g->wd, NULL, NULL);
+    inotify_rm_watch (g->ctl->inotify_fd, g->wd);
+  }
+#endif
+
+  for (i = 0; i < CG_FILES_MAX; i++)
+    pread_file_destroy (g->files[i]);
+  sfree (g->path);
+  sfree (g);
+} /* void cg_group_destroy */
+
+static cg_group_t *cg_group_create (cg_controller_t *ctl, const char *path)
+{
+  cg_group_t *g;
+  char file[PATH_MAX];
+  size_t i;
+
+  g = calloc (1, sizeof (*g));
+  if (g == NULL)
+  {
+    ERROR ("cgroups plugin: calloc failed.");
+    return (NULL);
+  }
+  g->ctl = ctl;
+  g->wd = -1;
+
+  g->path = strdup (path);
+  if (g->path == NULL)
+  {
+    ERROR ("cgroups plugin: strdup failed.");
+    sfree (g);
+    return (NULL);
+  }
+
+  g->instance = strrchr (g->path, '/');
+  g->instance = (g->instance == NULL) ? g->path : g->instance + 1;
+
+  /* The root is the host itself, which other plugins report. Ignored groups
+   * are kept for their children, but don't open any files. */
+  if ((path[0] == 0) || ignorelist_match (cg_ignorelist, g->instance))
+    return (g);
+
+  for (i = 0; i < CG_FILES_MAX; i++)
+  {
+    if (ctl->files[i] == NULL)
+      continue;
+
+    ssnprintf (file, sizeof (file), "%s/%s/%s/%s",
+        cg_mountpoint, ctl->name, path, ctl->files[i]);
+    g->files[i] = pread_file_create (file);
+    if (g->files[i] == NULL)
+    {
+      ERROR ("cgroups plugin: pread_file_create failed.");
+      cg_group_destroy (g);
+      return (NULL);
+    }
+  }
+
+  return (g);
+} /* cg_group_t *cg_group_create */
+
+/* Adds the cgroup at `path' and all cgroups below it, or marks them as seen
+ * if they are known already. */
+static int cg_scan (cg_controller_t *ctl, const char *path)
+{
+  char abs_path[PATH_MAX];
+  cg_group_t *g = NULL;
+  DIR *dh;
+  struct dirent *ent;
+
+  if (path[0] == 0)
+    ssnprintf (abs_path, sizeof (abs_path), "%s/%s",
+        cg_mountpoint, ctl->name);
+  else
+    ssnprintf (abs_path, sizeof (abs_path), "%s/%s/%s",
+        cg_mountpoint, ctl->name, path);
+
+  if (c_avl_get (ctl->groups, path, (void *) &g) != 0)
+  {
+    g = cg_group_create (ctl, path);
+    if (g == NULL)
+      return (-1);
+
+    if (c_avl_insert (ctl->groups, g->path, g) != 0)
+    {
+      ERROR ("cgroups plugin: c_avl_insert failed.");
+      cg_group_destroy (g);
+      return (-1);
+    }
+  }
+  g->generation = cg_generation;
+
+#if CG_HAVE_INOTIFY
+  /* Watch before reading the directory, so that no child is missed. */
+  cg_watch_add (g, abs_path);
+#endif
+
+  dh = opendir (abs_path);
+  if (dh == NULL)
+  {
+    /* Removed in the meantime. The stale group is dropped by the next
+     * complete scan or the IN_IGNORED event. */
+    if (errno == ENOENT)
+      return (0);
+    return (-1);
+  }
+
+  while ((ent = readdir (dh)) != NULL)
+  {
+    char child[PATH_MAX];
+
+    if (ent->d_name[0] == '.')
+      continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+    if ((ent->d_type != DT_DIR) && (ent->d_type != DT_UNKNOWN))
+      continue;
+#endif
+
+    if (path[0] == 0)
+      sstrncpy (child, ent->d_name, sizeof (child));
+    else
+      ssnprintf (child, sizeof (child), "%s/%s", path, ent->d_name);
+
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (ent->d_type == DT_UNKNOWN)
+#endif
+    {
+      struct stat statbuf;
+
+      if ((fstatat (dirfd (dh), ent->d_name, &statbuf,
+              AT_SYMLINK_NOFOLLOW) != 0) || !S_ISDIR (statbuf.st_mode))
+        continue;
+    }
+
+    cg_scan (ctl, child);
+  }
+
+  closedir (dh);
+  return (0);
+} /* int cg_scan */
+
+/* Drops the cgroup at `path' and all cgroups below it. If `path' is NULL,
+ * drops the cgroups the last complete scan didn't see instead. */
+static void cg_remove (cg_controller_t *ctl, const char *path)
+{
+  c_avl_iterator_t *iter;
+  cg_group_t *g;
+  char *key;
+  char **remove = NULL;
+  size_t remove_num = 0;
+  size_t path_len = (path != NULL) ? strlen (path) : 0;
+  size_t i;
+
+  iter = c_avl_get_iterator (ctl->groups);
+  while (c_avl_iterator_next (iter, (void *) &key, (void *) &g) == 0)
+  {
+    char **tmp;
+
+    if (path == NULL)
+    {
+      if (g->generation == cg_generation)
+        continue;
+    }
+    else if ((strncmp (path, key, path_len) != 0)
+        || ((key[path_len] != 0) && (key[path_len] != '/')))
+      continue;
+
+    tmp = realloc (remove, (remove_num + 1) * sizeof (*remove));
+    if (tmp == NULL)
+      break;
+    remove = tmp;
+    remove[remove_num++] = key;
+  }
+  c_avl_iterator_destroy (iter);
+
+  for (i = 0; i < remove_num; i++)
+  {
+    if (c_avl_remove (ctl->groups, remove[i], NULL, (void *) &g) == 0)
+      cg_group_destroy (g);
+  }
+  sfree (remove);
+} /* void cg_remove */
+
+/* Scans all hierarchies completely and drops the cgroups which are gone.
+ * Without inotify, this is done on each read. */
+static void cg_scan_all (void)
+{
+  size_t i;
+
+  cg_generation++;
+  cg_rescan = 0;
+
+  for (i = 0; i < controllers_num; i++)
+  {
+    cg_controller_t *ctl = controllers + i;
+
+    if (!ctl->mounted)
+      continue;
+
+    cg_scan (ctl, "");
+    cg_remove (ctl, /* path = */ NULL);
+  }
+} /* void cg_scan_all */
+
+#if CG_HAVE_INOTIFY
+/* Applies the pending inotify events: new directories are scanned, removed
+ * ones dropped. Anything unexpected triggers a complete scan. */
+static void cg_watch_check (cg_controller_t *ctl)
+{
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  while (42)
+  {
+    ssize_t len;
+    char *ptr;
+
+    len = read (ctl->inotify_fd, buffer, sizeof (buffer));
+    if ((len < 0) && (errno == EINTR))
+      continue;
+    else if (len < 0)
+    {
+      if (errno != EAGAIN)
+      {
+        char errbuf[1024];
+        WARNING ("cgroups plugin: Reading inotify events failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        cg_rescan = 1;
+      }
+      return;
+    }
+    else if (len == 0)
+      return;
+
+    for (ptr = buffer; ptr < buffer + len; )
+    {
+      struct inotify_event *ev = (struct inotify_event *) ptr;
+      cg_group_t *g = NULL;
+
+      ptr += sizeof (*ev) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        cg_rescan = 1;
+        continue;
+      }
+
+      if (c_avl_get (ctl->watches, &ev->wd, (void *) &g) != 0)
+        continue;
+
+      if (ev->mask & IN_IGNORED)
+      {
+        /* The directory has been removed; the kernel dropped the watch. */
+        c_avl_remove (ctl->watches, &ev->wd, NULL, NULL);
+        g->wd = -1;
+        if (c_avl_remove (ctl->groups, g->path, NULL, NULL) == 0)
+          cg_group_destroy (g);
+        continue;
+      }
+
+      if ((ev->mask & IN_ISDIR) && (ev->len > 0))
+      {
+        char child[PATH_MAX];
+
+        if (ev->name[0] == '.')
+          continue;
+
+        if (g->path[0] == 0)
+          sstrncpy (child, ev->name, sizeof (child));
+        else
+          ssnprintf (child, sizeof (child), "%s/%s", g->path, ev->name);
+
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+          cg_remove (ctl, child);
+        else
+          cg_scan (ctl, child);
+      }
+    }
+  }
+} /* void cg_watch_check */
+#endif /* CG_HAVE_INOTIFY */
+
+/*
+ * Plugin callbacks
+ */
+static int cg_config (oconfig_item_t *ci)
+{
+  int i;
+
+  if (cg_ignorelist == NULL)
+    cg_ignorelist = ignorelist_create (/* invert = */ 1);
+  if (cg_ignorelist == NULL)
+    return (-1);
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Mountpoint", child->key) == 0)
+      cf_util_get_string (child, &cg_mountpoint);
+    else if (strcasecmp ("CGroup", child->key) == 0)
+    {
+      char *name = NULL;
+
+      if (cf_util_get_string (child, &name) != 0)
+        continue;
+      ignorelist_add (cg_ignorelist, name);
+      sfree (name);
+    }
+    else if (strcasecmp ("IgnoreSelected", child->key) == 0)
+    {
+      _Bool invert = 1;
+
+      if (cf_util_get_boolean (child, &invert) != 0)
+        continue;
+      ignorelist_set_invert (cg_ignorelist, invert ? 0 : 1);
+    }
+    else
+      WARNING ("cgroups plugin: Ignoring unknown config option `%s'.",
+          child->key);
+  }
+
+  return (0);
+} /* int cg_config */
+
+static int cg_init (void)
+{
+  size_t i;
+  int mounted_num = 0;
+
+  if (cg_mountpoint == NULL)
+    cg_mountpoint = strdup ("/sys/fs/cgroup");
+  if (cg_ignorelist == NULL)
+    cg_ignorelist = ignorelist_create (/* invert = */ 1);
+  if ((cg_mountpoint == NULL) || (cg_ignorelist == NULL))
+  {
+    ERROR ("cgroups plugin: Allocating memory failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < controllers_num; i++)
+  {
+    cg_controller_t *ctl = controllers + i;
+    char path[PATH_MAX];
+    struct stat statbuf;
+
+    ssnprintf (path, sizeof (path), "%s/%s/%s",
+        cg_mountpoint, ctl->name, ctl->files[0]);
+    ctl->mounted = (stat (path, &statbuf) == 0);
+    if (!ctl->mounted)
+    {
+      INFO ("cgroups plugin: The %s controller is not mounted at %s/%s.",
+          ctl->name, cg_mountpoint, ctl->name);
+      continue;
+    }
+
+    if (ctl->groups == NULL)
+      ctl->groups = c_avl_create ((void *) strcmp);
+    if (ctl->groups == NULL)
+    {
+      ERROR ("cgroups plugin: c_avl_create failed.");
+      return (-1);
+    }
+    mounted_num++;
+
+#if CG_HAVE_INOTIFY
+    if (ctl->watches == NULL)
+      ctl->watches = c_avl_create (cg_wd_compare);
+    if ((ctl->watches != NULL) && (ctl->inotify_fd < 0))
+    {
+      ctl->inotify_fd = inotify_init ();
+      if ((ctl->inotify_fd < 0) || (fcntl (ctl->inotify_fd, F_SETFL,
+              fcntl (ctl->inotify_fd, F_GETFL) | O_NONBLOCK) != 0))
+      {
+        char errbuf[1024];
+        WARNING ("cgroups plugin: Setting up inotify for %s failed: %s. "
+            "Scanning the hierarchy completely on each read.", ctl->name,
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        if (ctl->inotify_fd >= 0)
+          close (ctl->inotify_fd);
+        ctl->inotify_fd = -1;
+      }
+    }
+#endif
+  }
+
+  if (mounted_num == 0)
+  {
+    ERROR ("cgroups plugin: No cgroup controllers found below %s.",
+        cg_mountpoint);
+    return (-1);
+  }
+
+  cg_rescan = 1;
+  return (0);
+} /* int cg_init */
+
+static int cg_read (void)
+{
+  size_t i;
+
+  for (i = 0; i < controllers_num; i++)
+  {
+    cg_controller_t *ctl = controllers + i;
+
+    if (!ctl->mounted)
+      continue;
+#if CG_HAVE_INOTIFY
+    if (ctl->inotify_fd >= 0)
+      cg_watch_check (ctl);
+    else
+#endif
+      cg_rescan = 1;
+  }
+
+  if (cg_rescan)
+    cg_scan_all ();
+
+  for (i = 0; i < controllers_num; i++)
+  {
+    cg_controller_t *ctl = controllers + i;
+    c_avl_iterator_t *iter;
+    cg_group_t *g;
+    char *key;
+
+    if (!ctl->mounted)
+      continue;
+
+    iter = c_avl_get_iterator (ctl->groups);
+    while (c_avl_iterator_next (iter, (void *) &key, (void *) &g) == 0)
+    {
+      if (g->files[0] != NULL)
+        ctl->read (g);
+    }
+    c_avl_iterator_destroy (iter);
+  }
+
+  return (0);
+} /* int cg_read */
+
+static int cg_shutdown (void)
+{
+  size_t i;
+
+  for (i = 0; i < controllers_num; i++)
+  {
+    cg_controller_t *ctl = controllers + i;
+    cg_group_t *g;
+    void *key;
+
+    if (ctl->groups == NULL)
+      continue;
+
+    while (c_avl_pick (ctl->groups, &key, (void *) &g) == 0)
+      cg_group_destroy (g);
+    c_avl_destroy (ctl->groups);
+    ctl->groups = NULL;
+
+#if CG_HAVE_INOTIFY
+    if (ctl->inotify_fd >= 0)
+      close (ctl->inotify_fd);
+    ctl->inotify_fd = -1;
+    if (ctl->watches != NULL)
+      c_avl_destroy (ctl->watches);
+    ctl->watches = NULL;
+#endif
+  }
+
+  ignorelist_free (cg_ignorelist);
+  cg_ignorelist = NULL;
+  sfree (cg_mountpoint);
+
+  return (0);
+} /* int cg_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("cgroups", cg_config);
+  plugin_register_init ("cgroups", cg_init);
+  plugin_register_read ("cgroups", cg_read);
+  plugin_register_shutdown ("cgroups", cg_shutdown);
+} /* void module_register */
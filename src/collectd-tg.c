@@ -40,12 +40,16 @@
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "utils_heap.h"
 
@@ -57,6 +61,11 @@
 #define DEF_NUM_PLUGINS    20
 #define DEF_NUM_VALUES 100000
 #define DEF_INTERVAL       10.0
+#define DEF_NUM_THREADS     1
+
+/* With a target rate, each thread may send this many seconds worth of
+ * values in a burst after falling behind. */
+#define BUCKET_SECONDS 0.01
 
 static int conf_num_hosts = DEF_NUM_HOSTS;
 static int conf_num_plugins = DEF_NUM_PLUGINS;
@@ -64,15 +73,48 @@ static int conf_num_values = DEF_NUM_VALUES;
 static double conf_interval = DEF_INTERVAL;
 static const char *conf_destination = NET_DEFAULT_V6_ADDR;
 static const char *conf_service = NET_DEFAULT_PORT;
-
-static lcc_network_t *net;
-
-static c_heap_t *values_heap = NULL;
+static int conf_num_threads = DEF_NUM_THREADS;
+static double conf_rate = 0.0;
+static double conf_zipf = 0.0;
+static double conf_duration = 0.0;
+static lcc_security_level_t conf_security_level = NONE;
+static char *conf_username = NULL;
+static char *conf_password = NULL;
+static _Bool conf_markers = 0;
+
+/* Cumulative distribution of the hosts if they are Zipf distributed. */
+static double *host_cdf = NULL;
 
 static struct sigaction sigint_action;
 static struct sigaction sigterm_action;
 
-static _Bool loop = 1;
+static volatile _Bool loop = 1;
+
+/* Each sender thread has its own socket and its own value lists. */
+struct tg_thread_s
+{
+  pthread_t tid;
+  int index;
+
+  lcc_network_t *net;
+  unsigned short rand_state[3];
+
+  /* Either scheduled by time in the heap or, with a target rate, picked
+   * from the array. "series_cdf" is used if the series are Zipf
+   * distributed. */
+  c_heap_t *heap;
+  lcc_value_list_t **series;
+  double *series_cdf;
+  int series_num;
+
+  /* Marker sent once per second, see send_marker(). */
+  lcc_value_list_t *marker;
+  double marker_next;
+
+  /* Written by the thread only. */
+  volatile uint64_t values_sent;
+};
+typedef struct tg_thread_s tg_thread_t;
 
 __attribute__((noreturn))
 static void exit_usage (int exit_status) /* {{{ */
@@ -91,13 +133,22 @@ static void exit_usage (int exit_status) /* {{{ */
       "                   (Default: %s)\n"
       "    -D <port>      Destination port of the network packets.\n"
       "                   (Default: %s)\n"
+      "    -t <number>    Number of sender threads. (Default: %i)\n"
+      "    -r <rate>      Send this many values per second in total instead\n"
+      "                   of once per interval.\n"
+      "    -z <exponent>  Zipf exponent of the host and, with -r, the value\n"
+      "                   list distributions. (Default: 0, uniform)\n"
+      "    -T <seconds>   Stop after this many seconds.\n"
+      "    -s <user:pass> Sign the network packets.\n"
+      "    -e <user:pass> Encrypt the network packets.\n"
+      "    -m             Send marker values with sequence numbers.\n"
       "    -h             Print usage information (this output).\n"
       "\n"
       "Copyright (C) 2010-2012  Florian Forster\n"
       "Licensed under the GNU General Public License, version 2 (GPLv2)\n",
       DEF_NUM_VALUES, DEF_NUM_HOSTS, DEF_NUM_PLUGINS,
       DEF_INTERVAL,
-      NET_DEFAULT_V6_ADDR, NET_DEFAULT_PORT);
+      NET_DEFAULT_V6_ADDR, NET_DEFAULT_PORT, DEF_NUM_THREADS);
   exit (exit_status);
 } /* }}} void exit_usage */
 
@@ -106,6 +157,34 @@ static void signal_handler (int signal) /* {{{ */
   loop = 0;
 } /* }}} void signal_handler */
 
+static double now_realtime (void) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (((double) ts.tv_sec) + ((double) ts.tv_nsec) / 1e9);
+} /* }}} double now_realtime */
+
+static double now_monotonic (void) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (((double) ts.tv_sec) + ((double) ts.tv_nsec) / 1e9);
+} /* }}} double now_monotonic */
+
+static void sleep_seconds (double seconds) /* {{{ */
+{
+  struct timespec ts;
+
+  if (seconds <= 0.0)
+    return;
+
+  ts.tv_sec = (time_t) seconds;
+  ts.tv_nsec = (long) ((seconds - ((double) ts.tv_sec)) * 1e9);
+  nanosleep (&ts, /* remaining = */ NULL);
+} /* }}} void sleep_seconds */
+
 static int compare_time (const void *v0, const void *v1) /* {{{ */
 {
   const lcc_value_list_t *vl0 = v0;
@@ -119,7 +198,7 @@ static int compare_time (const void *v0, const void *v1) /* {{{ */
     return (0);
 } /* }}} int compare_time */
 
-static int get_boundet_random (int min, int max) /* {{{ */
+static int get_boundet_random (tg_thread_t *t, int min, int max) /* {{{ */
 {
   int range;
 
@@ -130,10 +209,58 @@ static int get_boundet_random (int min, int max) /* {{{ */
 
   range = max - min;
 
-  return (min + ((int) (((double) range) * ((double) random ()) / (((double) RAND_MAX) + 1.0))));
+  return (min + ((int) (((double) range) * erand48 (t->rand_state))));
 } /* }}} int get_boundet_random */
 
-static lcc_value_list_t *create_value_list (void) /* {{{ */
+/* Returns the cumulative distribution of a Zipf distribution over "num"
+ * elements, i.e. element i is picked with a probability proportional to
+ * 1 / (i + 1)^exponent. */
+static double *zipf_create (int num, double exponent) /* {{{ */
+{
+  double *cdf;
+  double sum = 0.0;
+  int i;
+
+  cdf = calloc ((size_t) num, sizeof (*cdf));
+  if (cdf == NULL)
+    return (NULL);
+
+  for (i = 0; i < num; i++)
+  {
+    sum += 1.0 / pow ((double) (i + 1), exponent);
+    cdf[i] = sum;
+  }
+  for (i = 0; i < num; i++)
+    cdf[i] /= sum;
+
+  return (cdf);
+} /* }}} double *zipf_create */
+
+/* Picks an element in [0, num), using the distribution "cdf" if it is not
+ * NULL and a uniform distribution otherwise. */
+static int pick_random (tg_thread_t *t, const double *cdf, int num) /* {{{ */
+{
+  double r = erand48 (t->rand_state);
+  int lo = 0;
+  int hi = num - 1;
+
+  if (cdf == NULL)
+    return (get_boundet_random (t, 0, num));
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (cdf[mid] < r)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo);
+} /* }}} int pick_random */
+
+static lcc_value_list_t *create_value_list (tg_thread_t *t) /* {{{ */
 {
   lcc_value_list_t *vl;
   int host_num;
@@ -165,13 +292,13 @@ static lcc_value_list_t *create_value_list (void) /* {{{ */
 
   vl->values_len = 1;
 
-  host_num = get_boundet_random (0, conf_num_hosts);
+  host_num = pick_random (t, host_cdf, conf_num_hosts);
 
   vl->interval = conf_interval;
   vl->time = 1.0 + time (NULL)
     + (host_num % (1 + (int) vl->interval));
 
-  if (get_boundet_random (0, 2) == 0)
+  if (get_boundet_random (t, 0, 2) == 0)
     vl->values_types[0] = LCC_TYPE_GAUGE;
   else
     vl->values_types[0] = LCC_TYPE_DERIVE;
@@ -179,12 +306,12 @@ static lcc_value_list_t *create_value_list (void) /* {{{ */
   snprintf (vl->identifier.host, sizeof (vl->identifier.host),
       "host%04i", host_num);
   snprintf (vl->identifier.plugin, sizeof (vl->identifier.plugin),
-      "plugin%03i", get_boundet_random (0, conf_num_plugins));
+      "plugin%03i", get_boundet_random (t, 0, conf_num_plugins));
   strncpy (vl->identifier.type,
       (vl->values_types[0] == LCC_TYPE_GAUGE) ? "gauge" : "derive",
       sizeof (vl->identifier.type));
   snprintf (vl->identifier.type_instance, sizeof (vl->identifier.type_instance),
-      "ti%li", random ());
+      "ti%li", (long) nrand48 (t->rand_state));
 
   return (vl);
 } /* }}} int create_value_list */
@@ -199,24 +326,246 @@ static void destroy_value_list (lcc_value_list_t *vl) /* {{{ */
   free (vl);
 } /* }}} void destroy_value_list */
 
-static int send_value (lcc_value_list_t *vl) /* {{{ */
+static int send_value (tg_thread_t *t, lcc_value_list_t *vl) /* {{{ */
 {
   int status;
 
   if (vl->values_types[0] == LCC_TYPE_GAUGE)
-    vl->values[0].gauge = 100.0 * ((gauge_t) random ()) / (((gauge_t) RAND_MAX) + 1.0);
+    vl->values[0].gauge = 100.0 * erand48 (t->rand_state);
   else
-    vl->values[0].derive += get_boundet_random (0, 100);
+    vl->values[0].derive += get_boundet_random (t, 0, 100);
 
-  status = lcc_network_values_send (net, vl);
+  status = lcc_network_values_send (t->net, vl);
   if (status != 0)
     fprintf (stderr, "lcc_network_values_send failed with status %i.\n", status);
 
-  vl->time += vl->interval;
+  t->values_sent++;
 
   return (0);
 } /* }}} int send_value */
 
+/* Markers are the value list "collectd-tg/tg-<thread>/derive-sent": The
+ * value is the number of value lists the thread has sent so far and the
+ * time is the time it was sent at. A receiver can detect lost packets from
+ * the gaps between the markers it receives and compute the delay from the
+ * time of their arrival. */
+static void send_marker (tg_thread_t *t, double now) /* {{{ */
+{
+  if (now < t->marker_next)
+    return;
+
+  t->marker->values[0].derive = (derive_t) t->values_sent;
+  t->marker->time = now_realtime ();
+  lcc_network_values_send (t->net, t->marker);
+  t->marker_next = now + 1.0;
+} /* }}} void send_marker */
+
+/* Sends each value list once per interval, like real clients do. */
+static void run_interval (tg_thread_t *t) /* {{{ */
+{
+  while (loop)
+  {
+    lcc_value_list_t *vl = c_heap_get_root (t->heap);
+    double now;
+
+    if (vl == NULL)
+      break;
+
+    /* Check if we need to sleep */
+    now = now_realtime ();
+    while (loop && (now < vl->time))
+    {
+      double wait = vl->time - now;
+
+      sleep_seconds ((wait < 0.01) ? wait : 0.01);
+      now = now_realtime ();
+      if (conf_markers)
+        send_marker (t, now_monotonic ());
+    }
+
+    send_value (t, vl);
+    vl->time += vl->interval;
+    if (conf_markers)
+      send_marker (t, now_monotonic ());
+
+    c_heap_insert (t->heap, vl);
+  }
+} /* }}} void run_interval */
+
+/* Sends values at the target rate. A token bucket allows catching up with
+ * short bursts, so the average rate stays exact. */
+static void run_rate (tg_thread_t *t) /* {{{ */
+{
+  double rate = conf_rate / ((double) conf_num_threads);
+  double capacity = rate * BUCKET_SECONDS;
+  double tokens = 0.0;
+  double last = now_monotonic ();
+
+  if (capacity < 1.0)
+    capacity = 1.0;
+
+  while (loop)
+  {
+    lcc_value_list_t *vl;
+    double now = now_monotonic ();
+
+    tokens += (now - last) * rate;
+    if (tokens > capacity)
+      tokens = capacity;
+    last = now;
+
+    if (conf_markers)
+      send_marker (t, now);
+
+    if (tokens < 1.0)
+    {
+      sleep_seconds ((1.0 - tokens) / rate);
+      continue;
+    }
+
+    while (tokens >= 1.0)
+    {
+      vl = t->series[pick_random (t, t->series_cdf, t->series_num)];
+      vl->time = now_realtime ();
+      send_value (t, vl);
+      tokens -= 1.0;
+    }
+  }
+} /* }}} void run_rate */
+
+static void *sender_thread (void *arg) /* {{{ */
+{
+  tg_thread_t *t = arg;
+
+  if (conf_rate > 0.0)
+    run_rate (t);
+  else
+    run_interval (t);
+
+  if (conf_markers)
+  {
+    t->marker_next = 0.0;
+    send_marker (t, now_monotonic ());
+  }
+  lcc_network_flush (t->net);
+
+  return ((void *) 0);
+} /* }}} void *sender_thread */
+
+static int thread_init (tg_thread_t *t, int index) /* {{{ */
+{
+  lcc_server_t *srv;
+  int i;
+
+  memset (t, 0, sizeof (*t));
+  t->index = index;
+  t->rand_state[0] = (unsigned short) index;
+  t->rand_state[1] = (unsigned short) time (NULL);
+  t->rand_state[2] = (unsigned short) getpid ();
+
+  t->net = lcc_network_create ();
+  if (t->net == NULL)
+  {
+    fprintf (stderr, "lcc_network_create failed.\n");
+    return (-1);
+  }
+
+  srv = lcc_server_create (t->net, conf_destination, conf_service);
+  if (srv == NULL)
+  {
+    fprintf (stderr, "lcc_server_create failed.\n");
+    return (-1);
+  }
+
+  lcc_server_set_ttl (srv, 42);
+  if ((conf_security_level != NONE)
+      && (lcc_server_set_security_level (srv, conf_security_level,
+          conf_username, conf_password) != 0))
+  {
+    fprintf (stderr, "lcc_server_set_security_level failed.\n");
+    return (-1);
+  }
+
+  /* The value lists are split among the threads. */
+  t->series_num = conf_num_values / conf_num_threads;
+  if (index < (conf_num_values % conf_num_threads))
+    t->series_num++;
+
+  t->heap = c_heap_create (compare_time);
+  t->series = calloc ((size_t) t->series_num + 1, sizeof (*t->series));
+  if ((t->heap == NULL) || (t->series == NULL))
+  {
+    fprintf (stderr, "Allocating the value lists failed.\n");
+    return (-1);
+  }
+
+  if ((conf_rate > 0.0) && (conf_zipf > 0.0) && (t->series_num > 0))
+  {
+    t->series_cdf = zipf_create (t->series_num, conf_zipf);
+    if (t->series_cdf == NULL)
+    {
+      fprintf (stderr, "zipf_create failed.\n");
+      return (-1);
+    }
+  }
+
+  for (i = 0; i < t->series_num; i++)
+  {
+    lcc_value_list_t *vl;
+
+    vl = create_value_list (t);
+    if (vl == NULL)
+    {
+      fprintf (stderr, "create_value_list failed.\n");
+      return (-1);
+    }
+
+    t->series[i] = vl;
+    if (conf_rate <= 0.0)
+      c_heap_insert (t->heap, vl);
+  }
+
+  if (conf_markers)
+  {
+    t->marker = create_value_list (t);
+    if (t->marker == NULL)
+      return (-1);
+    t->marker->values_types[0] = LCC_TYPE_DERIVE;
+    snprintf (t->marker->identifier.host,
+        sizeof (t->marker->identifier.host), "collectd-tg");
+    snprintf (t->marker->identifier.plugin,
+        sizeof (t->marker->identifier.plugin), "tg");
+    snprintf (t->marker->identifier.plugin_instance,
+        sizeof (t->marker->identifier.plugin_instance), "%i", index);
+    snprintf (t->marker->identifier.type,
+        sizeof (t->marker->identifier.type), "derive");
+    snprintf (t->marker->identifier.type_instance,
+        sizeof (t->marker->identifier.type_instance), "sent");
+    t->marker->interval = 1.0;
+  }
+
+  return (0);
+} /* }}} int thread_init */
+
+static void thread_destroy (tg_thread_t *t) /* {{{ */
+{
+  int i;
+
+  if (t->series != NULL)
+    for (i = 0; i < t->series_num; i++)
+      destroy_value_list (t->series[i]);
+  free (t->series);
+  free (t->series_cdf);
+  destroy_value_list (t->marker);
+
+  /* The value lists are freed already. */
+  if (t->heap != NULL)
+    c_heap_destroy (t->heap);
+
+  if (t->net != NULL)
+    lcc_network_destroy (t->net);
+} /* }}} void thread_destroy */
+
 static int get_integer_opt (const char *str, int *ret_value) /* {{{ */
 {
   char *endptr;
@@ -275,11 +624,38 @@ static int get_double_opt (const char *str, double *ret_value) /* {{{ */
   return (0);
 } /* }}} int get_double_opt */
 
+/* Parses "<user>:<password>" for the -s and -e options. */
+static int get_credentials_opt (const char *str, /* {{{ */
+    lcc_security_level_t level)
+{
+  const char *colon = strchr (str, ':');
+
+  if ((colon == NULL) || (colon == str))
+  {
+    fprintf (stderr, "Credentials have to be given as "
+        "\"<user>:<password>\": \"%s\"\n", str);
+    exit (EXIT_FAILURE);
+  }
+
+  free (conf_username);
+  free (conf_password);
+  conf_username = strndup (str, (size_t) (colon - str));
+  conf_password = strdup (colon + 1);
+  if ((conf_username == NULL) || (conf_password == NULL))
+  {
+    fprintf (stderr, "strdup failed.\n");
+    exit (EXIT_FAILURE);
+  }
+
+  conf_security_level = level;
+  return (0);
+} /* }}} int get_credentials_opt */
+
 static int read_options (int argc, char **argv) /* {{{ */
 {
   int opt;
 
-  while ((opt = getopt (argc, argv, "n:H:p:i:d:D:h")) != -1)
+  while ((opt = getopt (argc, argv, "n:H:p:i:d:D:t:r:z:T:s:e:mh")) != -1)
   {
     switch (opt)
     {
@@ -307,6 +683,34 @@ static int read_options (int argc, char **argv) /* {{{ */
         conf_service = optarg;
         break;
 
+      case 't':
+        get_integer_opt (optarg, &conf_num_threads);
+        break;
+
+      case 'r':
+        get_double_opt (optarg, &conf_rate);
+        break;
+
+      case 'z':
+        get_double_opt (optarg, &conf_zipf);
+        break;
+
+      case 'T':
+        get_double_opt (optarg, &conf_duration);
+        break;
+
+      case 's':
+        get_credentials_opt (optarg, SIGN);
+        break;
+
+      case 'e':
+        get_credentials_opt (optarg, ENCRYPT);
+        break;
+
+      case 'm':
+        conf_markers = 1;
+        break;
+
       case 'h':
         exit_usage (EXIT_SUCCESS);
 
@@ -315,14 +719,37 @@ static int read_options (int argc, char **argv) /* {{{ */
     } /* switch (opt) */
   } /* while (getopt) */
 
+  if ((conf_num_values < 1) || (conf_num_hosts < 1) || (conf_num_plugins < 1)
+      || (conf_num_threads < 1) || (conf_num_threads > conf_num_values))
+  {
+    fprintf (stderr, "The numbers of value lists, hosts, plugins and "
+        "threads have to be positive, and there have to be at least as "
+        "many value lists as threads.\n");
+    exit (EXIT_FAILURE);
+  }
+
   return (0);
 } /* }}} int read_options */
 
+static uint64_t values_sent_total (tg_thread_t *threads) /* {{{ */
+{
+  uint64_t sum = 0;
+  int i;
+
+  for (i = 0; i < conf_num_threads; i++)
+    sum += threads[i].values_sent;
+
+  return (sum);
+} /* }}} uint64_t values_sent_total */
+
 int main (int argc, char **argv) /* {{{ */
 {
+  tg_thread_t *threads;
+  double start;
+  double last_report;
+  uint64_t last_sent = 0;
+  uint64_t total;
   int i;
-  time_t last_time;
-  int values_sent = 0;
 
   read_options (argc, argv);
 
@@ -332,102 +759,80 @@ int main (int argc, char **argv) /* {{{ */
   sigterm_action.sa_handler = signal_handler;
   sigaction (SIGTERM, &sigterm_action, /* old = */ NULL);
 
-
-  values_heap = c_heap_create (compare_time);
-  if (values_heap == NULL)
-  {
-    fprintf (stderr, "c_heap_create failed.\n");
-    exit (EXIT_FAILURE);
-  }
-
-  net = lcc_network_create ();
-  if (net == NULL)
+  if (conf_zipf > 0.0)
   {
-    fprintf (stderr, "lcc_network_create failed.\n");
-    exit (EXIT_FAILURE);
-  }
-  else
-  {
-    lcc_server_t *srv;
-    
-    srv = lcc_server_create (net, conf_destination, conf_service);
-    if (srv == NULL)
+    host_cdf = zipf_create (conf_num_hosts, conf_zipf);
+    if (host_cdf == NULL)
     {
-      fprintf (stderr, "lcc_server_create failed.\n");
+      fprintf (stderr, "zipf_create failed.\n");
       exit (EXIT_FAILURE);
     }
+  }
 
-    lcc_server_set_ttl (srv, 42);
-#if 0
-    lcc_server_set_security_level (srv, ENCRYPT,
-        "admin", "password1");
-#endif
+  threads = calloc ((size_t) conf_num_threads, sizeof (*threads));
+  if (threads == NULL)
+  {
+    fprintf (stderr, "calloc failed.\n");
+    exit (EXIT_FAILURE);
   }
 
   fprintf (stdout, "Creating %i values ... ", conf_num_values);
   fflush (stdout);
-  for (i = 0; i < conf_num_values; i++)
-  {
-    lcc_value_list_t *vl;
+  for (i = 0; i < conf_num_threads; i++)
+    if (thread_init (threads + i, i) != 0)
+      exit (EXIT_FAILURE);
+  fprintf (stdout, "done\n");
 
-    vl = create_value_list ();
-    if (vl == NULL)
+  start = now_monotonic ();
+  for (i = 0; i < conf_num_threads; i++)
+  {
+    if (pthread_create (&threads[i].tid, /* attr = */ NULL,
+          sender_thread, threads + i) != 0)
     {
-      fprintf (stderr, "create_value_list failed.\n");
+      fprintf (stderr, "pthread_create failed.\n");
       exit (EXIT_FAILURE);
     }
-
-    c_heap_insert (values_heap, vl);
   }
-  fprintf (stdout, "done\n");
 
-  last_time = 0;
+  last_report = start;
   while (loop)
   {
-    lcc_value_list_t *vl = c_heap_get_root (values_heap);
+    double now;
 
-    if (vl == NULL)
-      break;
+    sleep_seconds (0.1);
+    now = now_monotonic ();
 
-    if (vl->time != last_time)
+    if ((conf_duration > 0.0) && ((now - start) >= conf_duration))
+      loop = 0;
+
+    if ((now - last_report) >= 1.0)
     {
-      printf ("%i values have been sent.\n", values_sent);
-
-      /* Check if we need to sleep */
-      time_t now = time (NULL);
-
-      while (now < vl->time)
-      {
-        /* 1 / 100 second */
-        struct timespec ts = { 0, 10000000 };
-        nanosleep (&ts, /* remaining = */ NULL);
-        now = time (NULL);
-
-        if (!loop)
-          break;
-      }
-      last_time = vl->time;
+      total = values_sent_total (threads);
+      printf ("%"PRIu64" values have been sent (%.0f values/s).\n", total,
+          ((double) (total - last_sent)) / (now - last_report));
+      last_sent = total;
+      last_report = now;
     }
-
-    send_value (vl);
-    values_sent++;
-
-    c_heap_insert (values_heap, vl);
   }
 
   fprintf (stdout, "Shutting down.\n");
   fflush (stdout);
 
-  while (42)
-  {
-    lcc_value_list_t *vl = c_heap_get_root (values_heap);
-    if (vl == NULL)
-      break;
-    destroy_value_list (vl);
-  }
-  c_heap_destroy (values_heap);
+  for (i = 0; i < conf_num_threads; i++)
+    pthread_join (threads[i].tid, /* retval = */ NULL);
+
+  total = values_sent_total (threads);
+  printf ("Sent %"PRIu64" values in %.3f seconds (%.0f values/s).\n",
+      total, now_monotonic () - start,
+      ((double) total) / (now_monotonic () - start));
+
+  for (i = 0; i < conf_num_threads; i++)
+    thread_destroy (threads + i);
+  free (threads);
+  free (host_cdf);
+  free (conf_username);
+  free (conf_password);
 
-  lcc_network_destroy (net);
   exit (EXIT_SUCCESS);
   return (0);
 } /* }}} int main */
@@ -42,6 +42,7 @@
 char hostname_g[DATA_MAX_NAME_LEN];
 cdtime_t interval_g;
 int  timeout_g;
+_Bool float_format_legacy_g = 0;
 #if HAVE_LIBKSTAT
 kstat_ctl_t *kc;
 #endif /* HAVE_LIBKSTAT */
@@ -59,6 +60,13 @@ static void *do_flush (void __attribute__((unused)) *arg)
 	return NULL;
 }
 
+static void *do_reload (void __attribute__((unused)) *arg)
+{
+	cf_reload ();
+	pthread_exit (NULL);
+	return NULL;
+}
+
 static void sig_int_handler (int __attribute__((unused)) signal)
 {
 	loop++;
@@ -82,6 +90,19 @@ static void sig_usr1_handler (int __attribute__((unused)) signal)
 	pthread_attr_destroy (&attr);
 }
 
+static void sig_hup_handler (int __attribute__((unused)) signal)
+{
+	pthread_t      thread;
+	pthread_attr_t attr;
+
+	/* Reloads are serialized by cf_reload, so the thread may have to wait
+	 * for a previous one. */
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create (&thread, &attr, do_reload, NULL);
+	pthread_attr_destroy (&attr);
+}
+
 static int init_hostname (void)
 {
 	const char *str;
@@ -156,6 +177,19 @@ static int init_global_variables (void)
 	}
 	DEBUG ("timeout_g = %i;", timeout_g);
 
+	str = global_option_get ("FloatFormat");
+	if ((str == NULL) || (strcasecmp ("Shortest", str) == 0))
+		float_format_legacy_g = 0;
+	else if (strcasecmp ("Legacy", str) == 0)
+		float_format_legacy_g = 1;
+	else
+	{
+		fprintf (stderr, "Invalid value for the \"FloatFormat\" "
+				"option: \"%s\". Valid values are \"Shortest\" "
+				"and \"Legacy\".\n", str);
+		return (-1);
+	}
+
 	if (init_hostname () != 0)
 		return (-1);
 	DEBUG ("hostname_g = %s;", hostname_g);
@@ -395,6 +429,7 @@ int main (int argc, char **argv)
 	struct sigaction sig_int_action;
 	struct sigaction sig_term_action;
 	struct sigaction sig_usr1_action;
+	struct sigaction sig_hup_action;
 	struct sigaction sig_pipe_action;
 	char *configfile = CONFIGFILE;
 	int test_config  = 0;
@@ -587,6 +622,15 @@ int main (int argc, char **argv)
 		return (1);
 	}
 
+	memset (&sig_hup_action, '\0', sizeof (sig_hup_action));
+	sig_hup_action.sa_handler = sig_hup_handler;
+	if (0 != sigaction (SIGHUP, &sig_hup_action, NULL)) {
+		char errbuf[1024];
+		ERROR ("Error: Failed to install a signal handler for signal HUP: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (1);
+	}
+
 	/*
 	 * run the actual loops
 	 */
@@ -293,5 +293,6 @@ typedef uint64_t cdtime_t;
 extern char     hostname_g[];
 extern cdtime_t interval_g;
 extern int      timeout_g;
+extern _Bool    float_format_legacy_g;
 
 #endif /* COLLECTD_H */
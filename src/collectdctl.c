@@ -28,11 +28,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <strings.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 
 #if NAN_STATIC_DEFAULT
 # include <math.h>
@@ -68,23 +70,64 @@
 #include "libcollectdclient/collectd/client.h"
 
 #define DEFAULT_SOCK LOCALSTATEDIR"/run/"PACKAGE_NAME"-unixsock"
+#define DEFAULT_PARALLELISM 16
 
 extern char *optarg;
 extern int   optind;
 
+/* Output of a command. It is written to "fh" directly or, if "fh" is NULL,
+ * collected in "buffer" until all daemons have been queried. */
+struct ctl_output_s
+{
+  FILE   *fh;
+  char   *buffer;
+  size_t  buffer_len;
+  size_t  buffer_size;
+};
+typedef struct ctl_output_s ctl_output_t;
+
+/* One daemon a command is sent to. */
+struct ctl_target_s
+{
+  const char       *address;
+  lcc_connection_t *c;
+  ctl_output_t      out;
+  ctl_output_t      err;
+  int               status;
+};
+typedef struct ctl_target_s ctl_target_t;
+
+typedef int (*ctl_command_t) (ctl_target_t *t, int argc, char **argv);
+
+struct ctl_fanout_s
+{
+  ctl_command_t   command;
+  ctl_target_t   *targets;
+  size_t          targets_num;
+  size_t          targets_next;
+  pthread_mutex_t lock;
+
+  int    argc;
+  char **argv;
+};
+typedef struct ctl_fanout_s ctl_fanout_t;
+
 static void exit_usage (const char *name, int status) {
   fprintf ((status == 0) ? stdout : stderr,
       "Usage: %s [options] <command> [cmd options]\n\n"
 
       "Available options:\n"
-      "  -s       Path to collectd's UNIX socket.\n"
-      "           Default: "DEFAULT_SOCK"\n"
+      "  -s       Path to collectd's UNIX socket. May be given more than\n"
+      "           once. Default: "DEFAULT_SOCK"\n"
+      "  -f       File listing the daemons' addresses, one per line.\n"
+      "  -P       Number of daemons queried at the same time.\n"
+      "           Default: %i\n"
 
       "\n  -h       Display this help and exit.\n"
 
       "\nAvailable commands:\n\n"
 
-      " * getval <identifier>\n"
+      " * getval <identifier> [<identifier> ...]\n"
       " * flush [timeout=<seconds>] [plugin=<name>] [identifier=<id>]\n"
       " * listval\n"
       " * putval <identifier> [interval=<seconds>] <value-list(s)>\n"
@@ -98,13 +141,72 @@ static void exit_usage (const char *name, int status) {
       "Hostname defaults to the local hostname if omitted (e.g., uptime/uptime).\n"
       "No error is returned if the specified identifier does not exist.\n"
 
+      "\nIf more than one daemon is given, each line of output is prefixed\n"
+      "with the address of the daemon it belongs to.\n"
+
       "\n"PACKAGE" "VERSION", http://collectd.org/\n"
       "by Florian octo Forster <octo@verplant.org>\n"
       "for contributions see `AUTHORS'\n"
-      , name);
+      , name, DEFAULT_PARALLELISM);
   exit (status);
 }
 
+static void ctl_printf (ctl_output_t *out, const char *format, ...)
+{
+  va_list ap;
+  int len;
+
+  if (out->fh != NULL) {
+    va_start (ap, format);
+    vfprintf (out->fh, format, ap);
+    va_end (ap);
+    return;
+  }
+
+  while (42) {
+    size_t avail = out->buffer_size - out->buffer_len;
+
+    va_start (ap, format);
+    len = vsnprintf (out->buffer + out->buffer_len, avail, format, ap);
+    va_end (ap);
+
+    if (len < 0)
+      return;
+    if ((size_t) len < avail) {
+      out->buffer_len += (size_t) len;
+      return;
+    }
+
+    {
+      size_t size = 2 * out->buffer_size + (size_t) len + 1;
+      char *tmp = realloc (out->buffer, size);
+      if (tmp == NULL)
+        return;
+      out->buffer = tmp;
+      out->buffer_size = size;
+    }
+  }
+} /* ctl_printf */
+
+/* Prints the collected output, prefixing each line with "prefix". */
+static void ctl_output_flush (ctl_output_t *out, FILE *fh, const char *prefix)
+{
+  char *line = out->buffer;
+  char *end  = out->buffer + out->buffer_len;
+
+  while (line < end) {
+    char *eol = memchr (line, '\n', (size_t) (end - line));
+    size_t len = (eol == NULL) ? (size_t) (end - line) : (size_t) (eol - line);
+
+    fprintf (fh, "%s: %.*s\n", prefix, (int) len, line);
+    line += len + 1;
+  }
+
+  free (out->buffer);
+  out->buffer = NULL;
+  out->buffer_len = out->buffer_size = 0;
+} /* ctl_output_flush */
+
 /* Count the number of occurrences of the character 'chr'
  * in the specified string. */
 static int count_chars (const char *str, char chr) {
@@ -137,7 +239,7 @@ static int array_grow (void **array, int *array_len, size_t elem_size)
   return (0);
 } /* array_grow */
 
-static int parse_identifier (lcc_connection_t *c,
+static int parse_identifier (ctl_target_t *t,
     const char *value, lcc_identifier_t *ident)
 {
   char hostname[1024];
@@ -152,7 +254,7 @@ static int parse_identifier (lcc_connection_t *c,
      * (there is only one '/' in the identifier)
      * Let's add the local hostname */
     if (gethostname (hostname, sizeof (hostname)) != 0) {
-      fprintf (stderr, "ERROR: Failed to get local hostname: %s",
+      ctl_printf (&t->err, "ERROR: Failed to get local hostname: %s",
           strerror (errno));
       return (-1);
     }
@@ -166,35 +268,103 @@ static int parse_identifier (lcc_connection_t *c,
     ident_str[sizeof (ident_str) - 1] = '\0';
   }
 
-  status = lcc_string_to_identifier (c, ident, ident_str);
+  status = lcc_string_to_identifier (t->c, ident, ident_str);
   if (status != 0) {
-    fprintf (stderr, "ERROR: Failed to parse identifier ``%s'': %s.\n",
-        ident_str, lcc_strerror(c));
+    ctl_printf (&t->err, "ERROR: Failed to parse identifier ``%s'': %s.\n",
+        ident_str, lcc_strerror (t->c));
     return (-1);
   }
   return (0);
 } /* parse_identifier */
 
-static int getval (lcc_connection_t *c, int argc, char **argv)
+struct getval_request_s
+{
+  ctl_target_t *t;
+  const char   *ident_str;
+  int           prefix;
+};
+typedef struct getval_request_s getval_request_t;
+
+static void getval_callback (lcc_connection_t *c,
+    int status, const char *message, size_t values_num,
+    const gauge_t *values, char * const *values_names, void *user_data)
+{
+  getval_request_t *r = user_data;
+  size_t i;
+
+  if (status != 0) {
+    ctl_printf (&r->t->err, "ERROR: %s: %s\n", r->ident_str, message);
+    return;
+  }
+
+  for (i = 0; i < values_num; ++i) {
+    if (r->prefix)
+      ctl_printf (&r->t->out, "%s: %s=%e\n",
+          r->ident_str, values_names[i], values[i]);
+    else
+      ctl_printf (&r->t->out, "%s=%e\n", values_names[i], values[i]);
+  }
+} /* getval_callback */
+
+static int getval (ctl_target_t *t, int argc, char **argv)
 {
+  lcc_connection_t *c = t->c;
   lcc_identifier_t ident;
 
   size_t   ret_values_num   = 0;
   gauge_t *ret_values       = NULL;
   char   **ret_values_names = NULL;
 
+  getval_request_t *requests;
+
   int status;
   size_t i;
 
   assert (strcasecmp (argv[0], "getval") == 0);
 
-  if (argc != 2) {
-    fprintf (stderr, "ERROR: getval: Missing identifier.\n");
+  if (argc < 2) {
+    ctl_printf (&t->err, "ERROR: getval: Missing identifier.\n");
     return (-1);
   }
 
+  /* Several identifiers, or several daemons whose shm segments can not be
+   * told apart, are queried with pipelined GETVAL commands. */
+  if ((argc > 2) || (t->out.fh == NULL)) {
+    requests = calloc ((size_t) (argc - 1), sizeof (*requests));
+    if (requests == NULL) {
+      ctl_printf (&t->err, "ERROR: Failed to allocate memory.\n");
+      return (-1);
+    }
+
+    for (i = 0; i < (size_t) (argc - 1); ++i) {
+      requests[i].t = t;
+      requests[i].ident_str = argv[i + 1];
+      requests[i].prefix = (argc > 2);
+
+      memset (&ident, 0, sizeof (ident));
+      status = parse_identifier (t, argv[i + 1], &ident);
+      if (status != 0)
+        break;
+
+      status = lcc_getval_async (c, &ident, getval_callback, requests + i);
+      if (status != 0) {
+        ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
+        break;
+      }
+    }
+
+    status = lcc_wait (c);
+    if (status < 0)
+      ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
+    free (requests);
+
+    if ((status != 0) || (i < (size_t) (argc - 1)))
+      return (-1);
+    return (0);
+  }
+
   memset (&ident, 0, sizeof (ident));
-  status = parse_identifier (c, argv[1], &ident);
+  status = parse_identifier (t, argv[1], &ident);
   if (status != 0)
     return (status);
 
@@ -214,18 +384,48 @@ static int getval (lcc_connection_t *c, int argc, char **argv)
   status = lcc_getval (c, &ident,
       &ret_values_num, &ret_values, &ret_values_names);
   if (status != 0) {
-    fprintf (stderr, "ERROR: %s\n", lcc_strerror (c));
+    ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
     BAIL_OUT (-1);
   }
 
   for (i = 0; i < ret_values_num; ++i)
-    printf ("%s=%e\n", ret_values_names[i], ret_values[i]);
+    ctl_printf (&t->out, "%s=%e\n", ret_values_names[i], ret_values[i]);
   BAIL_OUT (0);
 #undef BAIL_OUT
 } /* getval */
 
-static int flush (lcc_connection_t *c, int argc, char **argv)
+struct flush_request_s
+{
+  ctl_target_t     *t;
+  const char       *plugin;
+  lcc_identifier_t *ident;
+};
+typedef struct flush_request_s flush_request_t;
+
+static void flush_callback (lcc_connection_t *c,
+    int status, const char *message, void *user_data)
+{
+  flush_request_t *r = user_data;
+  char id[1024];
+
+  if (status == 0)
+    return;
+
+  if (r->ident == NULL) {
+    ctl_printf (&r->t->err, "ERROR: Failed to flush plugin `%s': %s.\n",
+        (r->plugin == NULL) ? "(all)" : r->plugin, message);
+    return;
+  }
+
+  lcc_identifier_to_string (c, id, sizeof (id), r->ident);
+  ctl_printf (&r->t->err, "ERROR: Failed to flush plugin `%s', "
+      "identifier `%s': %s.\n",
+      (r->plugin == NULL) ? "(all)" : r->plugin, id, message);
+} /* flush_callback */
+
+static int flush (ctl_target_t *t, int argc, char **argv)
 {
+  lcc_connection_t *c = t->c;
   int timeout = -1;
 
   lcc_identifier_t *identifiers = NULL;
@@ -234,6 +434,9 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
   char **plugins = NULL;
   int plugins_num = 0;
 
+  flush_request_t *requests = NULL;
+  int requests_num = 0;
+
   int status;
   int i;
 
@@ -247,6 +450,9 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
     if (plugins != NULL) \
       free (plugins); \
     plugins_num = 0; \
+    if (requests != NULL) \
+      free (requests); \
+    requests_num = 0; \
     return (s); \
   } while (0)
 
@@ -257,7 +463,7 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
     value = strchr (argv[i], (int)'=');
 
     if (! value) {
-      fprintf (stderr, "ERROR: flush: Invalid option ``%s''.\n", argv[i]);
+      ctl_printf (&t->err, "ERROR: flush: Invalid option ``%s''.\n", argv[i]);
       BAIL_OUT (-1);
     }
 
@@ -270,13 +476,13 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
       timeout = (int) strtol (value, &endptr, 0);
 
       if (endptr == value) {
-        fprintf (stderr, "ERROR: Failed to parse timeout as number: %s.\n",
+        ctl_printf (&t->err, "ERROR: Failed to parse timeout as number: %s.\n",
             value);
         BAIL_OUT (-1);
       }
       else if ((endptr != NULL) && (*endptr != '\0')) {
-        fprintf (stderr, "WARNING: Ignoring trailing garbage after timeout: "
-            "%s.\n", endptr);
+        ctl_printf (&t->err, "WARNING: Ignoring trailing garbage after "
+            "timeout: %s.\n", endptr);
       }
     }
     else if (strcasecmp (key, "plugin") == 0) {
@@ -294,13 +500,13 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
         BAIL_OUT (status);
 
       memset (identifiers + (identifiers_num - 1), 0, sizeof (*identifiers));
-      status = parse_identifier (c, value,
+      status = parse_identifier (t, value,
           identifiers + (identifiers_num - 1));
       if (status != 0)
         BAIL_OUT (status);
     }
     else {
-      fprintf (stderr, "ERROR: flush: Unknown option `%s'.\n", key);
+      ctl_printf (&t->err, "ERROR: flush: Unknown option `%s'.\n", key);
       BAIL_OUT (-1);
     }
   }
@@ -314,37 +520,47 @@ static int flush (lcc_connection_t *c, int argc, char **argv)
     plugins[0] = NULL;
   }
 
+  /* All combinations are sent before the first response is read. The
+   * requests have to stay around until lcc_wait() returns. */
+  requests = calloc ((size_t) plugins_num
+      * (size_t) ((identifiers_num > 0) ? identifiers_num : 1),
+      sizeof (*requests));
+  if (requests == NULL) {
+    ctl_printf (&t->err, "ERROR: Failed to allocate memory.\n");
+    BAIL_OUT (-1);
+  }
+
   for (i = 0; i < plugins_num; ++i) {
-    if (identifiers_num == 0) {
-      status = lcc_flush (c, plugins[i], NULL, timeout);
-      if (status != 0)
-        fprintf (stderr, "ERROR: Failed to flush plugin `%s': %s.\n",
-            (plugins[i] == NULL) ? "(all)" : plugins[i], lcc_strerror (c));
-    }
-    else {
-      int j;
-
-      for (j = 0; j < identifiers_num; ++j) {
-        status = lcc_flush (c, plugins[i], identifiers + j, timeout);
-        if (status != 0) {
-          char id[1024];
-
-          lcc_identifier_to_string (c, id, sizeof (id), identifiers + j);
-          fprintf (stderr, "ERROR: Failed to flush plugin `%s', "
-              "identifier `%s': %s.\n",
-              (plugins[i] == NULL) ? "(all)" : plugins[i],
-              id, lcc_strerror (c));
-        }
+    int j;
+
+    for (j = 0; (j < identifiers_num) || (j == 0); ++j) {
+      flush_request_t *r = requests + requests_num;
+
+      r->t = t;
+      r->plugin = plugins[i];
+      r->ident = (identifiers_num > 0) ? identifiers + j : NULL;
+      ++requests_num;
+
+      status = lcc_flush_async (c, r->plugin, r->ident, timeout,
+          flush_callback, r);
+      if (status != 0) {
+        ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
+        BAIL_OUT (-1);
       }
     }
   }
 
-  BAIL_OUT (0);
+  status = lcc_wait (c);
+  if (status < 0)
+    ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
+
+  BAIL_OUT ((status == 0) ? 0 : -1);
 #undef BAIL_OUT
 } /* flush */
 
-static int listval (lcc_connection_t *c, int argc, char **argv)
+static int listval (ctl_target_t *t, int argc, char **argv)
 {
+  lcc_connection_t *c = t->c;
   lcc_identifier_t *ret_ident     = NULL;
   size_t            ret_ident_num = 0;
 
@@ -354,7 +570,7 @@ static int listval (lcc_connection_t *c, int argc, char **argv)
   assert (strcasecmp (argv[0], "listval") == 0);
 
   if (argc != 1) {
-    fprintf (stderr, "ERROR: listval: Does not accept any arguments.\n");
+    ctl_printf (&t->err, "ERROR: listval: Does not accept any arguments.\n");
     return (-1);
   }
 
@@ -368,7 +584,7 @@ static int listval (lcc_connection_t *c, int argc, char **argv)
 
   status = lcc_listval (c, &ret_ident, &ret_ident_num);
   if (status != 0) {
-    fprintf (stderr, "ERROR: %s\n", lcc_strerror (c));
+    ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
     BAIL_OUT (status);
   }
 
@@ -377,19 +593,29 @@ static int listval (lcc_connection_t *c, int argc, char **argv)
 
     status = lcc_identifier_to_string (c, id, sizeof (id), ret_ident + i);
     if (status != 0) {
-      fprintf (stderr, "ERROR: listval: Failed to convert returned "
+      ctl_printf (&t->err, "ERROR: listval: Failed to convert returned "
           "identifier to a string: %s\n", lcc_strerror (c));
       continue;
     }
 
-    printf ("%s\n", id);
+    ctl_printf (&t->out, "%s\n", id);
   }
   BAIL_OUT (0);
 #undef BAIL_OUT
 } /* listval */
 
-static int putval (lcc_connection_t *c, int argc, char **argv)
+static void putval_callback (lcc_connection_t *c,
+    int status, const char *message, void *user_data)
 {
+  ctl_target_t *t = user_data;
+
+  if (status != 0)
+    ctl_printf (&t->err, "ERROR: Server error: %s\n", message);
+} /* putval_callback */
+
+static int putval (ctl_target_t *t, int argc, char **argv)
+{
+  lcc_connection_t *c = t->c;
   lcc_value_list_t vl = LCC_VALUE_LIST_INIT;
 
   /* 64 ought to be enough for anybody ;-) */
@@ -403,7 +629,7 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
   assert (strcasecmp (argv[0], "putval") == 0);
 
   if (argc < 3) {
-    fprintf (stderr, "ERROR: putval: Missing identifier "
+    ctl_printf (&t->err, "ERROR: putval: Missing identifier "
         "and/or value list.\n");
     return (-1);
   }
@@ -411,7 +637,7 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
   vl.values       = values;
   vl.values_types = values_types;
 
-  status = parse_identifier (c, argv[1], &vl.identifier);
+  status = parse_identifier (t, argv[1], &vl.identifier);
   if (status != 0)
     return (status);
 
@@ -433,17 +659,17 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
         vl.interval = strtol (value, &endptr, 0);
 
         if (endptr == value) {
-          fprintf (stderr, "ERROR: Failed to parse interval as number: %s.\n",
-              value);
+          ctl_printf (&t->err, "ERROR: Failed to parse interval as number: "
+              "%s.\n", value);
           return (-1);
         }
         else if ((endptr != NULL) && (*endptr != '\0')) {
-          fprintf (stderr, "WARNING: Ignoring trailing garbage after "
+          ctl_printf (&t->err, "WARNING: Ignoring trailing garbage after "
               "interval: %s.\n", endptr);
         }
       }
       else {
-        fprintf (stderr, "ERROR: putval: Unknown option `%s'.\n", key);
+        ctl_printf (&t->err, "ERROR: putval: Unknown option `%s'.\n", key);
         return (-1);
       }
     }
@@ -453,7 +679,7 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
       tmp = strchr (argv[i], (int)':');
 
       if (tmp == NULL) {
-        fprintf (stderr, "ERROR: putval: Invalid value list: %s.\n",
+        ctl_printf (&t->err, "ERROR: putval: Invalid value list: %s.\n",
             argv[i]);
         return (-1);
       }
@@ -470,12 +696,12 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
         vl.time = strtol (argv[i], &endptr, 0);
 
         if (endptr == argv[i]) {
-          fprintf (stderr, "ERROR: Failed to parse time as number: %s.\n",
+          ctl_printf (&t->err, "ERROR: Failed to parse time as number: %s.\n",
               argv[i]);
           return (-1);
         }
         else if ((endptr != NULL) && (*endptr != '\0')) {
-          fprintf (stderr, "ERROR: Garbage after time: %s.\n", endptr);
+          ctl_printf (&t->err, "ERROR: Garbage after time: %s.\n", endptr);
           return (-1);
         }
       }
@@ -513,12 +739,12 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
         ++values_len;
 
         if (endptr == value) {
-          fprintf (stderr, "ERROR: Failed to parse value as number: %s.\n",
+          ctl_printf (&t->err, "ERROR: Failed to parse value as number: %s.\n",
               argv[i]);
           return (-1);
         }
         else if ((endptr != NULL) && (*endptr != '\0')) {
-          fprintf (stderr, "ERROR: Garbage after value: %s.\n", endptr);
+          ctl_printf (&t->err, "ERROR: Garbage after value: %s.\n", endptr);
           return (-1);
         }
 
@@ -528,41 +754,240 @@ static int putval (lcc_connection_t *c, int argc, char **argv)
       assert (values_len >= 1);
       vl.values_len = values_len;
 
-      status = lcc_putval (c, &vl);
+      /* The value lists are sent without waiting for each response. */
+      status = lcc_putval_async (c, &vl, putval_callback, t);
       if (status != 0) {
-        fprintf (stderr, "ERROR: %s\n", lcc_strerror (c));
+        ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
         return (-1);
       }
     }
   }
 
+  status = lcc_wait (c);
+  if (status < 0) {
+    ctl_printf (&t->err, "ERROR: %s\n", lcc_strerror (c));
+    return (-1);
+  }
+  else if (status > 0)
+    return (-1);
+
   if (values_len == 0) {
-    fprintf (stderr, "ERROR: putval: Missing value list(s).\n");
+    ctl_printf (&t->err, "ERROR: putval: Missing value list(s).\n");
     return (-1);
   }
   return (0);
 } /* putval */
 
+static void run_target (ctl_target_t *t, ctl_command_t command,
+    int argc, char **argv)
+{
+  char **args;
+  int i;
+
+  t->c = NULL;
+  if (lcc_connect (t->address, &t->c) != 0) {
+    ctl_printf (&t->err, "ERROR: Failed to connect to daemon at %s: %s.\n",
+        t->address, strerror (errno));
+    t->status = 1;
+    return;
+  }
+
+  /* The commands modify their arguments while parsing them. */
+  args = calloc ((size_t) argc, sizeof (*args));
+  if (args == NULL) {
+    ctl_printf (&t->err, "ERROR: Failed to allocate memory.\n");
+    LCC_DESTROY (t->c);
+    t->status = -1;
+    return;
+  }
+  for (i = 0; i < argc; ++i) {
+    args[i] = strdup (argv[i]);
+    if (args[i] == NULL)
+      break;
+  }
+
+  if (i < argc) {
+    ctl_printf (&t->err, "ERROR: Failed to allocate memory.\n");
+    t->status = -1;
+  }
+  else
+    t->status = (*command) (t, argc, args);
+
+  while (i > 0)
+    free (args[--i]);
+  free (args);
+
+  LCC_DESTROY (t->c);
+} /* run_target */
+
+static void *fanout_worker (void *arg)
+{
+  ctl_fanout_t *f = arg;
+
+  while (42) {
+    size_t i;
+
+    pthread_mutex_lock (&f->lock);
+    i = f->targets_next++;
+    pthread_mutex_unlock (&f->lock);
+
+    if (i >= f->targets_num)
+      break;
+
+    run_target (f->targets + i, f->command, f->argc, f->argv);
+  }
+
+  return (NULL);
+} /* fanout_worker */
+
+/* Queries all daemons using up to "parallelism" threads and prints their
+ * output in the order the daemons were given. Returns the number of daemons
+ * for which the command failed. */
+static int fanout (ctl_target_t *targets, size_t targets_num,
+    int parallelism, ctl_command_t command, int argc, char **argv)
+{
+  ctl_fanout_t f;
+  pthread_t *threads;
+  size_t threads_num = 0;
+  int failed = 0;
+  size_t i;
+
+  memset (&f, 0, sizeof (f));
+  f.targets     = targets;
+  f.targets_num = targets_num;
+  f.command     = command;
+  f.argc        = argc;
+  f.argv        = argv;
+  pthread_mutex_init (&f.lock, /* attr = */ NULL);
+
+  if ((size_t) parallelism > targets_num)
+    parallelism = (int) targets_num;
+
+  threads = calloc ((size_t) parallelism, sizeof (*threads));
+  if (threads != NULL) {
+    for (i = 0; i < (size_t) parallelism; ++i) {
+      if (pthread_create (threads + threads_num, /* attr = */ NULL,
+            fanout_worker, &f) != 0) {
+        fprintf (stderr, "WARNING: Failed to start thread: %s.\n",
+            strerror (errno));
+        break;
+      }
+      ++threads_num;
+    }
+  }
+
+  /* Do the work ourselves if no thread could be started. */
+  if (threads_num == 0)
+    fanout_worker (&f);
+
+  for (i = 0; i < threads_num; ++i)
+    pthread_join (threads[i], /* retval = */ NULL);
+  free (threads);
+  pthread_mutex_destroy (&f.lock);
+
+  for (i = 0; i < targets_num; ++i) {
+    ctl_output_flush (&targets[i].out, stdout, targets[i].address);
+    ctl_output_flush (&targets[i].err, stderr, targets[i].address);
+    if (targets[i].status != 0)
+      ++failed;
+  }
+
+  return (failed);
+} /* fanout */
+
+/* Reads the addresses of daemons from "file", one per line. Empty lines and
+ * lines starting with a hash are ignored. */
+static int read_addresses (const char *file,
+    char ***addresses, int *addresses_num)
+{
+  FILE *fh;
+  char line[1024];
+  int status = 0;
+
+  fh = fopen (file, "r");
+  if (fh == NULL) {
+    fprintf (stderr, "ERROR: Failed to open `%s': %s.\n",
+        file, strerror (errno));
+    return (-1);
+  }
+
+  while (fgets (line, sizeof (line), fh) != NULL) {
+    char *ptr = line;
+    size_t len;
+
+    while ((*ptr == ' ') || (*ptr == '\t'))
+      ptr++;
+    len = strcspn (ptr, " \t\r\n");
+    ptr[len] = '\0';
+
+    if ((len == 0) || (*ptr == '#'))
+      continue;
+
+    status = array_grow ((void *)addresses, addresses_num,
+        sizeof (**addresses));
+    if (status != 0)
+      break;
+
+    (*addresses)[*addresses_num - 1] = strdup (ptr);
+    if ((*addresses)[*addresses_num - 1] == NULL) {
+      --(*addresses_num);
+      status = -1;
+      break;
+    }
+  }
+
+  fclose (fh);
+  return (status);
+} /* read_addresses */
+
 int main (int argc, char **argv) {
-  char address[1024] = "unix:"DEFAULT_SOCK;
+  char **addresses = NULL;
+  int addresses_num = 0;
+  int parallelism = DEFAULT_PARALLELISM;
 
-  lcc_connection_t *c;
+  ctl_command_t command;
+  ctl_target_t *targets;
 
   int status;
+  int i;
 
   while (42) {
     int c;
 
-    c = getopt (argc, argv, "s:h");
+    c = getopt (argc, argv, "s:f:P:h");
 
     if (c == -1)
       break;
 
     switch (c) {
       case 's':
+      {
+        char address[1024];
+
         snprintf (address, sizeof (address), "unix:%s", optarg);
         address[sizeof (address) - 1] = '\0';
+
+        if ((array_grow ((void *)&addresses, &addresses_num,
+                sizeof (*addresses)) != 0)
+            || ((addresses[addresses_num - 1] = strdup (address)) == NULL))
+          return (1);
         break;
+      }
+      case 'f':
+        if (read_addresses (optarg, &addresses, &addresses_num) != 0)
+          return (1);
+        break;
+      case 'P':
+      {
+        char *endptr = NULL;
+
+        parallelism = (int) strtol (optarg, &endptr, 0);
+        if ((endptr == optarg) || (*endptr != '\0') || (parallelism < 1)) {
+          fprintf (stderr, "%s: invalid parallelism: %s\n", argv[0], optarg);
+          exit_usage (argv[0], 1);
+        }
+        break;
+      }
       case 'h':
         exit_usage (argv[0], 0);
         break;
@@ -576,28 +1001,57 @@ int main (int argc, char **argv) {
     exit_usage (argv[0], 1);
   }
 
-  c = NULL;
-  status = lcc_connect (address, &c);
-  if (status != 0) {
-    fprintf (stderr, "ERROR: Failed to connect to daemon at %s: %s.\n",
-        address, strerror (errno));
-    return (1);
-  }
-
   if (strcasecmp (argv[optind], "getval") == 0)
-    status = getval (c, argc - optind, argv + optind);
+    command = getval;
   else if (strcasecmp (argv[optind], "flush") == 0)
-    status = flush (c, argc - optind, argv + optind);
+    command = flush;
   else if (strcasecmp (argv[optind], "listval") == 0)
-    status = listval (c, argc - optind, argv + optind);
+    command = listval;
   else if (strcasecmp (argv[optind], "putval") == 0)
-    status = putval (c, argc - optind, argv + optind);
+    command = putval;
   else {
     fprintf (stderr, "%s: invalid command: %s\n", argv[0], argv[optind]);
     return (1);
   }
 
-  LCC_DESTROY (c);
+  if (addresses_num == 0) {
+    if ((array_grow ((void *)&addresses, &addresses_num,
+            sizeof (*addresses)) != 0)
+        || ((addresses[0] = strdup ("unix:"DEFAULT_SOCK)) == NULL))
+      return (1);
+  }
+
+  targets = calloc ((size_t) addresses_num, sizeof (*targets));
+  if (targets == NULL) {
+    fprintf (stderr, "ERROR: Failed to allocate memory.\n");
+    return (1);
+  }
+
+  for (i = 0; i < addresses_num; ++i)
+    targets[i].address = addresses[i];
+
+  if (addresses_num == 1) {
+    /* A single daemon's output is printed as it arrives. */
+    targets[0].out.fh = stdout;
+    targets[0].err.fh = stderr;
+    run_target (targets, command, argc - optind, argv + optind);
+    status = targets[0].status;
+  }
+  else {
+    int failed;
+
+    failed = fanout (targets, (size_t) addresses_num, parallelism,
+        command, argc - optind, argv + optind);
+    if (failed > 0)
+      fprintf (stderr, "ERROR: The command failed for %i of %i daemons.\n",
+          failed, addresses_num);
+    status = (failed > 0) ? 1 : 0;
+  }
+
+  for (i = 0; i < addresses_num; ++i)
+    free (addresses[i]);
+  free (addresses);
+  free (targets);
 
   if (status != 0)
     return (status);
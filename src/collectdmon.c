@@ -31,6 +31,8 @@
 
 #include <fcntl.h>
 
+#include <poll.h>
+
 #include <signal.h>
 
 #include <stdio.h>
@@ -41,6 +43,7 @@
 #include <syslog.h>
 
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -64,6 +67,15 @@ static int restart = 0;
 static char  *pidfile      = NULL;
 static pid_t  collectd_pid = 0;
 
+/* Hitless restarts: collectd hands its listening sockets over through
+ * "handoff_sock" when it is stopped and they are passed on to the next
+ * process in "handoff_fds". See handoff_receive(). */
+#define HANDOFF_TIMEOUT 60
+#define HANDOFF_FDS_MAX 1024
+static int    handoff_sock    = -1;
+static int    handoff_fds[HANDOFF_FDS_MAX];
+static size_t handoff_fds_num = 0;
+
 static void exit_usage (char *name)
 {
 	printf ("Usage: %s <options> [-- <collectd options>]\n"
@@ -170,19 +182,86 @@ static int daemonize (void)
 	return 0;
 } /* daemonize */
 
+static void handoff_fds_close (void)
+{
+	size_t i;
+
+	for (i = 0; i < handoff_fds_num; ++i)
+		close (handoff_fds[i]);
+	handoff_fds_num = 0;
+	return;
+} /* handoff_fds_close */
+
+/* Passes the end of the socket pair and the sockets handed over by the
+ * previous process on to collectd. Called in the child. */
+static void handoff_setenv (int sock)
+{
+	char   buffer[HANDOFF_FDS_MAX * 12];
+	size_t offset = 0;
+	size_t i;
+
+	unsetenv ("COLLECTD_HANDOFF_FD");
+	unsetenv ("COLLECTD_LISTEN_FDS");
+
+	if (0 <= sock) {
+		snprintf (buffer, sizeof (buffer), "%i", sock);
+		setenv ("COLLECTD_HANDOFF_FD", buffer, 1);
+	}
+
+	if (0 == handoff_fds_num)
+		return;
+
+	buffer[0] = '\0';
+	for (i = 0; i < handoff_fds_num; ++i) {
+		int flags = fcntl (handoff_fds[i], F_GETFD);
+
+		if (0 <= flags)
+			fcntl (handoff_fds[i], F_SETFD, flags & ~FD_CLOEXEC);
+
+		offset += snprintf (buffer + offset, sizeof (buffer) - offset,
+				"%s%i", (0 == i) ? "" : " ", handoff_fds[i]);
+	}
+	setenv ("COLLECTD_LISTEN_FDS", buffer, 1);
+	return;
+} /* handoff_setenv */
+
 static int collectd_start (char **argv)
 {
 	pid_t pid = 0;
+	int   sv[2] = { -1, -1 };
+
+	if (0 != socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		syslog (LOG_WARNING, "Warning: socketpair() failed, restarts will "
+				"lose packets: %s", strerror (errno));
+		sv[0] = sv[1] = -1;
+	}
 
 	if (0 > (pid = fork ())) {
 		syslog (LOG_ERR, "Error: fork() failed: %s", strerror (errno));
+		if (0 <= sv[0]) {
+			close (sv[0]);
+			close (sv[1]);
+		}
 		return -1;
 	}
 	else if (pid != 0) {
 		collectd_pid = pid;
+
+		/* The sockets are collectd's now. */
+		handoff_fds_close ();
+
+		if (0 <= sv[0]) {
+			close (sv[1]);
+			fcntl (sv[0], F_SETFD, FD_CLOEXEC);
+		}
+		handoff_sock = sv[0];
 		return 0;
 	}
 
+	if (0 <= sv[0])
+		close (sv[0]);
+	handoff_setenv (sv[1]);
+
 	execvp (argv[0], argv);
 	syslog (LOG_ERR, "Error: execvp(%s) failed: %s",
 			argv[0], strerror (errno));
@@ -201,6 +280,87 @@ static int collectd_stop (void)
 	return 0;
 } /* collectd_stop */
 
+/* Waits for the collectd being stopped to hand over its listening sockets.
+ * Returns zero once it has written its cache snapshot and the next process
+ * may start, while it finishes shutting down. Otherwise the sockets received
+ * so far are passed to the next process all the same. */
+static int handoff_receive (void)
+{
+	int timeout = HANDOFF_TIMEOUT;
+	int status  = -1;
+
+	if (0 > handoff_sock)
+		return -1;
+
+	while ((0 == loop) && (0 < timeout)) {
+		struct pollfd   pfd;
+		struct msghdr   msg;
+		struct iovec    iov;
+		struct cmsghdr *cmsg;
+		char    payload[16];
+		char    control[CMSG_SPACE (64 * sizeof (int))];
+		ssize_t len;
+
+		pfd.fd      = handoff_sock;
+		pfd.events  = POLLIN;
+		pfd.revents = 0;
+
+		len = poll (&pfd, 1, 1000);
+		if ((0 > len) && (EINTR == errno))
+			continue;
+		else if (0 > len)
+			break;
+		else if (0 == len) {
+			--timeout;
+			continue;
+		}
+
+		memset (payload, 0, sizeof (payload));
+		iov.iov_base = payload;
+		iov.iov_len  = sizeof (payload) - 1;
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof (control);
+
+		/* Zero means collectd has exited without finishing. */
+		if (0 >= (len = recvmsg (handoff_sock, &msg, 0)))
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR (&msg); NULL != cmsg;
+				cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+			int    *fds;
+			size_t  fds_num;
+			size_t  i;
+
+			if ((SOL_SOCKET != cmsg->cmsg_level)
+					|| (SCM_RIGHTS != cmsg->cmsg_type))
+				continue;
+
+			fds     = (int *) CMSG_DATA (cmsg);
+			fds_num = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+
+			for (i = 0; i < fds_num; ++i) {
+				if (HANDOFF_FDS_MAX > handoff_fds_num)
+					handoff_fds[handoff_fds_num++] = fds[i];
+				else
+					close (fds[i]);
+			}
+		}
+
+		if (0 == strcmp (payload, "END")) {
+			status = 0;
+			break;
+		}
+	}
+
+	close (handoff_sock);
+	handoff_sock = -1;
+	return status;
+} /* handoff_receive */
+
 static void sig_int_term_handler (int __attribute__((unused)) signo)
 {
 	++loop;
@@ -264,6 +424,8 @@ int main (int argc, char **argv)
 
 	struct sigaction sa;
 
+	pid_t old_pid = 0;
+
 	int i = 0;
 
 	/* parse command line options */
@@ -336,19 +498,49 @@ int main (int argc, char **argv)
 	}
 
 	while (0 == loop) {
-		int status = 0;
+		int status     = 0;
+		int handed_off = 0;
 
 		if (0 != collectd_start (collectd_argv)) {
 			syslog (LOG_ERR, "Error: failed to start collectd.");
 			break;
 		}
 
+		/* The previous process finishes shutting down, e.g. flushes its
+		 * caches, while the new one starts up. */
+		if (0 < old_pid) {
+			while ((old_pid != waitpid (old_pid, &status, 0))
+					&& (EINTR == errno));
+			log_status (status);
+			old_pid = 0;
+		}
+
 		assert (0 < collectd_pid);
-		while ((collectd_pid != waitpid (collectd_pid, &status, 0))
-				&& (EINTR == errno))
-			if ((0 != loop) || (0 != restart))
+		while (0 == handed_off) {
+			if ((0 != loop) || (0 != restart)) {
 				collectd_stop ();
 
+				if ((0 == loop) && (0 == handoff_receive ())) {
+					handed_off = 1;
+					break;
+				}
+			}
+
+			if (collectd_pid == waitpid (collectd_pid, &status, 0))
+				break;
+			if (EINTR != errno)
+				break;
+		}
+
+		if (0 != handed_off) {
+			syslog (LOG_INFO, "Info: restarting collectd with %i "
+					"handed over sockets", (int) handoff_fds_num);
+			old_pid      = collectd_pid;
+			collectd_pid = 0;
+			restart      = 0;
+			continue;
+		}
+
 		collectd_pid = 0;
 
 		log_status (status);
@@ -364,6 +556,10 @@ int main (int argc, char **argv)
 
 	syslog (LOG_INFO, "Info: shutting down collectdmon");
 
+	handoff_fds_close ();
+	if (0 <= handoff_sock)
+		close (handoff_sock);
+
 	pidfile_delete ();
 	closelog ();
 
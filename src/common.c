@@ -631,9 +631,44 @@ int get_kstat (kstat_t **ksp_ptr, char *module, int instance, char *name)
 	return (0);
 }
 
+int get_kstat_cached (kstat_t **ksp_ptr, kid_t *chain_id,
+		char *module, int instance, char *name)
+{
+	if (kc == NULL)
+	{
+		*ksp_ptr = NULL;
+		return (-1);
+	}
+
+	/* Looking the kstat up walks the whole chain, so only do it again
+	 * once the chain has changed. */
+	if ((*ksp_ptr == NULL) || (*chain_id != kc->kc_chain_id))
+	{
+		*chain_id = kc->kc_chain_id;
+		return (get_kstat (ksp_ptr, module, instance, name));
+	}
+
+	if (kstat_read (kc, *ksp_ptr, NULL) == -1)
+	{
+		ERROR ("get_kstat_cached: kstat %s,%i,%s could not be read",
+				module, instance, name);
+		*ksp_ptr = NULL;
+		return (-1);
+	}
+
+	return (0);
+} /* int get_kstat_cached */
+
 long long get_kstat_value (kstat_t *ksp, char *name)
 {
-	kstat_named_t *kn;
+	int index = -1;
+
+	return (get_kstat_value_index (ksp, name, &index));
+}
+
+long long get_kstat_value_index (kstat_t *ksp, char *name, int *index)
+{
+	kstat_named_t *kn = NULL;
 	long long retval = -1LL;
 
 	if (ksp == NULL)
@@ -651,8 +686,26 @@ long long get_kstat_value (kstat_t *ksp, char *name)
 		return (-1LL);
 	}
 
-	if ((kn = (kstat_named_t *) kstat_data_lookup (ksp, name)) == NULL)
-		return (-1LL);
+	/* The entries of a kstat keep their order while it exists, so the
+	 * index found by the last lookup is right unless the kstat has been
+	 * replaced. Checking the name is cheaper than searching again. */
+	if ((*index >= 0) && ((uint_t) *index < ksp->ks_ndata))
+	{
+		kn = ((kstat_named_t *) ksp->ks_data) + *index;
+		if (strncmp (kn->name, name, sizeof (kn->name)) != 0)
+			kn = NULL;
+	}
+
+	if (kn == NULL)
+	{
+		kn = (kstat_named_t *) kstat_data_lookup (ksp, name);
+		if (kn == NULL)
+		{
+			*index = -1;
+			return (-1LL);
+		}
+		*index = (int) (kn - (kstat_named_t *) ksp->ks_data);
+	}
 
 	if (kn->data_type == KSTAT_DATA_INT32)
 		retval = (long long) kn->value.i32;
@@ -803,6 +856,359 @@ int format_name (char *ret, int ret_len,
 	return (0);
 } /* int format_name */
 
+/*
+ * Shortest round-trip formatting of doubles, using the Grisu2 algorithm
+ * by Florian Loitsch ("Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", PLDI 2010). The result always parses back to
+ * the same double and, in all but very few cases, is the shortest such
+ * string. It doesn't depend on the locale.
+ */
+typedef struct
+{
+	uint64_t f;
+	int e;
+} diy_fp_t;
+
+#define DP_SIGNIFICAND_MASK UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_EXPONENT_MASK    UINT64_C(0x7FF0000000000000)
+#define DP_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+
+/* Normalized 64 bit approximations of 10^-348, 10^-340, ..., 10^340. */
+static const uint64_t grisu_powers_f[] =
+{
+	UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+	UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+	UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+	UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+	UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+	UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+	UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+	UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+	UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+	UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+	UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+	UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+	UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+	UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+	UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+	UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+	UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+	UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+	UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+	UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+	UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+	UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+	UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+	UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+	UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+	UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+	UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+	UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+	UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+static const int16_t grisu_powers_e[] =
+{
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t grisu_pow10[] =
+{
+	UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+	UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+	UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+	UINT64_C(10000000000), UINT64_C(100000000000),
+	UINT64_C(1000000000000), UINT64_C(10000000000000),
+	UINT64_C(100000000000000), UINT64_C(1000000000000000),
+	UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+	UINT64_C(1000000000000000000), UINT64_C(10000000000000000000)
+};
+
+static diy_fp_t diy_fp_multiply (diy_fp_t x, diy_fp_t y) /* {{{ */
+{
+	uint64_t a = x.f >> 32;
+	uint64_t b = x.f & UINT64_C(0xFFFFFFFF);
+	uint64_t c = y.f >> 32;
+	uint64_t d = y.f & UINT64_C(0xFFFFFFFF);
+	uint64_t ac = a * c;
+	uint64_t bc = b * c;
+	uint64_t ad = a * d;
+	uint64_t bd = b * d;
+	uint64_t tmp;
+	diy_fp_t r;
+
+	tmp = (bd >> 32) + (ad & UINT64_C(0xFFFFFFFF))
+		+ (bc & UINT64_C(0xFFFFFFFF));
+	tmp += UINT64_C(1) << 31; /* round */
+
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+	return (r);
+} /* }}} diy_fp_t diy_fp_multiply */
+
+static diy_fp_t diy_fp_normalize (diy_fp_t x) /* {{{ */
+{
+	while ((x.f & (UINT64_C(1) << 63)) == 0)
+	{
+		x.f <<= 1;
+		x.e--;
+	}
+	return (x);
+} /* }}} diy_fp_t diy_fp_normalize */
+
+/* Returns the normalized value together with the boundaries m- and m+ of
+ * the interval of numbers that round to it. */
+static diy_fp_t grisu_boundaries (uint64_t bits, /* {{{ */
+		diy_fp_t *ret_minus, diy_fp_t *ret_plus)
+{
+	diy_fp_t v;
+	diy_fp_t plus;
+	diy_fp_t minus;
+	int biased_e = (int) ((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+
+	v.f = bits & DP_SIGNIFICAND_MASK;
+	if (biased_e != 0)
+	{
+		v.f += DP_HIDDEN_BIT;
+		v.e = biased_e - DP_EXPONENT_BIAS;
+	}
+	else
+		v.e = 1 - DP_EXPONENT_BIAS;
+
+	plus.f = (v.f << 1) + 1;
+	plus.e = v.e - 1;
+	plus = diy_fp_normalize (plus);
+
+	/* The lower boundary is closer if the significand is a power of two. */
+	if (v.f == DP_HIDDEN_BIT)
+	{
+		minus.f = (v.f << 2) - 1;
+		minus.e = v.e - 2;
+	}
+	else
+	{
+		minus.f = (v.f << 1) - 1;
+		minus.e = v.e - 1;
+	}
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	*ret_minus = minus;
+	*ret_plus = plus;
+	return (diy_fp_normalize (v));
+} /* }}} diy_fp_t grisu_boundaries */
+
+static void grisu_round (char *buffer, int len, /* {{{ */
+		uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while ((rest < wp_w) && ((delta - rest) >= ten_kappa)
+			&& (((rest + ten_kappa) < wp_w)
+				|| ((wp_w - rest) > (rest + ten_kappa - wp_w))))
+	{
+		buffer[len - 1]--;
+		rest += ten_kappa;
+	}
+} /* }}} void grisu_round */
+
+/* Generates the digits of "w" into "buffer" and returns their number.
+ * "*k" is adjusted so that the value is buffer * 10^k. */
+static int grisu_digits (diy_fp_t w, diy_fp_t mp, /* {{{ */
+		uint64_t delta, char *buffer, int *k)
+{
+	uint64_t one_f = UINT64_C(1) << (-mp.e);
+	uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t) (mp.f >> (-mp.e));
+	uint64_t p2 = mp.f & (one_f - 1);
+	int kappa;
+	int len = 0;
+
+	for (kappa = 1; (kappa < 10) && (p1 >= grisu_pow10[kappa]); kappa++)
+		/* count digits */;
+
+	while (kappa > 0)
+	{
+		uint32_t d = p1 / ((uint32_t) grisu_pow10[kappa - 1]);
+		uint64_t rest;
+
+		p1 %= (uint32_t) grisu_pow10[kappa - 1];
+		if ((d != 0) || (len != 0))
+			buffer[len++] = (char) ('0' + d);
+		kappa--;
+
+		rest = (((uint64_t) p1) << (-mp.e)) + p2;
+		if (rest <= delta)
+		{
+			*k += kappa;
+			grisu_round (buffer, len, delta, rest,
+					grisu_pow10[kappa] << (-mp.e), wp_w);
+			return (len);
+		}
+	}
+
+	while (42)
+	{
+		char d;
+
+		p2 *= 10;
+		delta *= 10;
+		d = (char) (p2 >> (-mp.e));
+		if ((d != 0) || (len != 0))
+			buffer[len++] = (char) ('0' + d);
+		p2 &= one_f - 1;
+		kappa--;
+
+		if (p2 < delta)
+		{
+			*k += kappa;
+			grisu_round (buffer, len, delta, p2, one_f,
+					(-kappa < 20) ? wp_w * grisu_pow10[-kappa] : 0);
+			return (len);
+		}
+	}
+} /* }}} int grisu_digits */
+
+/* Writes the shortest digits of the positive, finite, non-zero "bits" to
+ * "buffer" (at least 18 bytes) and returns their number. */
+static int grisu2 (uint64_t bits, char *buffer, int *k) /* {{{ */
+{
+	diy_fp_t v;
+	diy_fp_t w_m, w_p;
+	diy_fp_t c_mk;
+	diy_fp_t w, wp, wm;
+	double dk;
+	int ik;
+	int index;
+
+	v = grisu_boundaries (bits, &w_m, &w_p);
+
+	/* Find the cached power of ten c_mk = 10^-k which brings the binary
+	 * exponent of w_p * c_mk into [-60, -32]. */
+	dk = (-61 - w_p.e) * 0.30102999566398114 + 347;
+	ik = (int) dk;
+	if ((dk - ik) > 0.0)
+		ik++;
+	index = (ik >> 3) + 1;
+	c_mk.f = grisu_powers_f[index];
+	c_mk.e = grisu_powers_e[index];
+	*k = -(-348 + index * 8);
+
+	w = diy_fp_multiply (v, c_mk);
+	wp = diy_fp_multiply (w_p, c_mk);
+	wm = diy_fp_multiply (w_m, c_mk);
+	wm.f++;
+	wp.f--;
+
+	return (grisu_digits (w, wp, wp.f - wm.f, buffer, k));
+} /* }}} int grisu2 */
+
+static int format_double_shortest (char *buffer, size_t buffer_size, /* {{{ */
+		double value)
+{
+	/* Sign, 17 digits, "0.0000" or a point, e-308 and the null byte. */
+	char tmp[40];
+	char digits[24];
+	union { double d; uint64_t u; } bits;
+	_Bool negative;
+	int digits_num;
+	int k = 0;
+	int exponent;
+	size_t len = 0;
+
+	bits.d = value;
+	negative = (bits.u >> 63) != 0;
+	bits.u &= ~(UINT64_C(1) << 63);
+
+	if (isnan (value))
+		return (ssnprintf (buffer, buffer_size, negative ? "-nan" : "nan"));
+	else if (isinf (value))
+		return (ssnprintf (buffer, buffer_size, negative ? "-inf" : "inf"));
+
+	if (negative)
+		tmp[len++] = '-';
+
+	if (bits.u == 0)
+		digits_num = 0;
+	else
+		digits_num = grisu2 (bits.u, digits, &k);
+	/* The value is d.ddd * 10^exponent. */
+	exponent = digits_num + k - 1;
+
+	if (digits_num == 0)
+		tmp[len++] = '0';
+	else if ((exponent < -4) || (exponent >= 17))
+	{
+		/* Scientific notation, like "%g" uses it: d.ddde+XX */
+		int abs_exponent = (exponent < 0) ? -exponent : exponent;
+
+		tmp[len++] = digits[0];
+		if (digits_num > 1)
+		{
+			tmp[len++] = '.';
+			memcpy (tmp + len, digits + 1, digits_num - 1);
+			len += digits_num - 1;
+		}
+		tmp[len++] = 'e';
+		tmp[len++] = (exponent < 0) ? '-' : '+';
+		if (abs_exponent >= 100)
+			tmp[len++] = (char) ('0' + abs_exponent / 100);
+		tmp[len++] = (char) ('0' + (abs_exponent / 10) % 10);
+		tmp[len++] = (char) ('0' + abs_exponent % 10);
+	}
+	else if (exponent < 0)
+	{
+		/* 0.000ddd */
+		tmp[len++] = '0';
+		tmp[len++] = '.';
+		memset (tmp + len, '0', -exponent - 1);
+		len += -exponent - 1;
+		memcpy (tmp + len, digits, digits_num);
+		len += digits_num;
+	}
+	else if (digits_num <= exponent + 1)
+	{
+		/* ddd000 */
+		memcpy (tmp + len, digits, digits_num);
+		len += digits_num;
+		memset (tmp + len, '0', exponent + 1 - digits_num);
+		len += exponent + 1 - digits_num;
+	}
+	else
+	{
+		/* ddd.ddd */
+		memcpy (tmp + len, digits, exponent + 1);
+		len += exponent + 1;
+		tmp[len++] = '.';
+		memcpy (tmp + len, digits + exponent + 1, digits_num - exponent - 1);
+		len += digits_num - exponent - 1;
+	}
+	tmp[len] = 0;
+
+	if (buffer_size > 0)
+		sstrncpy (buffer, tmp, buffer_size);
+	return ((int) len);
+} /* }}} int format_double_shortest */
+
+int format_gauge (char *buffer, size_t buffer_size, /* {{{ */
+		char const *legacy_format, double value)
+{
+	if (buffer_size < 1)
+		return (-1);
+
+	if (float_format_legacy_g)
+		return (ssnprintf (buffer, buffer_size, legacy_format, value));
+
+	return (format_double_shortest (buffer, buffer_size, value));
+} /* }}} int format_gauge */
+
 int format_values (char *ret, size_t ret_len, /* {{{ */
 		const data_set_t *ds, const value_list_t *vl,
 		_Bool store_rates)
@@ -810,7 +1216,7 @@ int format_values (char *ret, size_t ret_len, /* {{{ */
         size_t offset = 0;
         int status;
         int i;
-        gauge_t *rates = NULL;
+        const gauge_t *rates = NULL;
 
         assert (0 == strcmp (ds->type, vl->type));
 
@@ -821,35 +1227,50 @@ int format_values (char *ret, size_t ret_len, /* {{{ */
                         __VA_ARGS__); \
         if (status < 1) \
         { \
-                sfree (rates); \
+                uc_release_rate_ref (vl, rates); \
                 return (-1); \
         } \
         else if (((size_t) status) >= (ret_len - offset)) \
         { \
-                sfree (rates); \
+                uc_release_rate_ref (vl, rates); \
                 return (-1); \
         } \
         else \
                 offset += ((size_t) status); \
 } while (0)
 
+#define BUFFER_ADD_GAUGE(format, value) do { \
+        status = format_gauge (ret + offset, ret_len - offset, \
+                        (format), (value)); \
+        if ((status < 1) || (((size_t) status) >= (ret_len - offset))) \
+        { \
+                uc_release_rate_ref (vl, rates); \
+                return (-1); \
+        } \
+        offset += ((size_t) status); \
+} while (0)
+
         BUFFER_ADD ("%.3f", CDTIME_T_TO_DOUBLE (vl->time));
 
         for (i = 0; i < ds->ds_num; i++)
         {
                 if (ds->ds[i].type == DS_TYPE_GAUGE)
-                        BUFFER_ADD (":%f", vl->values[i].gauge);
+                {
+                        BUFFER_ADD (":");
+                        BUFFER_ADD_GAUGE ("%f", vl->values[i].gauge);
+                }
                 else if (store_rates)
                 {
                         if (rates == NULL)
-                                rates = uc_get_rate (ds, vl);
+                                rates = uc_get_rate_ref (ds, vl);
                         if (rates == NULL)
                         {
                                 WARNING ("format_values: "
 						"uc_get_rate failed.");
                                 return (-1);
                         }
-                        BUFFER_ADD (":%g", rates[i]);
+                        BUFFER_ADD (":");
+                        BUFFER_ADD_GAUGE ("%g", rates[i]);
                 }
                 else if (ds->ds[i].type == DS_TYPE_COUNTER)
                         BUFFER_ADD (":%llu", vl->values[i].counter);
@@ -861,14 +1282,15 @@ int format_values (char *ret, size_t ret_len, /* {{{ */
                 {
                         ERROR ("format_values plugin: Unknown data source type: %i",
                                         ds->ds[i].type);
-                        sfree (rates);
+                        uc_release_rate_ref (vl, rates);
                         return (-1);
                 }
         } /* for ds->ds_num */
 
+#undef BUFFER_ADD_GAUGE
 #undef BUFFER_ADD
 
-        sfree (rates);
+        uc_release_rate_ref (vl, rates);
         return (0);
 } /* }}} int format_values */
 
@@ -1211,6 +1633,195 @@ int read_file_contents (const char *filename, char *buf, int bufsize)
 	return n;
 }
 
+struct pread_file_s
+{
+	char *path;
+	int fd;
+	char *buffer;
+	size_t buffer_size;
+};
+
+pread_file_t *pread_file_create (const char *path) /* {{{ */
+{
+	pread_file_t *pf;
+
+	pf = calloc (1, sizeof (*pf));
+	if (pf == NULL)
+		return (NULL);
+
+	pf->path = strdup (path);
+	if (pf->path == NULL)
+	{
+		sfree (pf);
+		return (NULL);
+	}
+	pf->fd = -1;
+
+	return (pf);
+} /* }}} pread_file_t *pread_file_create */
+
+void pread_file_destroy (pread_file_t *pf) /* {{{ */
+{
+	if (pf == NULL)
+		return;
+
+	if (pf->fd >= 0)
+		close (pf->fd);
+	sfree (pf->path);
+	sfree (pf->buffer);
+	sfree (pf);
+} /* }}} void pread_file_destroy */
+
+void pread_file_close (pread_file_t *pf) /* {{{ */
+{
+	if ((pf == NULL) || (pf->fd < 0))
+		return;
+
+	close (pf->fd);
+	pf->fd = -1;
+} /* }}} void pread_file_close */
+
+/* Reads the file from the start into its buffer, growing the buffer as
+ * needed. Returns the number of bytes read or less than zero on error. */
+static ssize_t pread_file_fill (pread_file_t *pf) /* {{{ */
+{
+	size_t offset = 0;
+
+	while (42)
+	{
+		ssize_t status;
+
+		if ((pf->buffer_size - offset) < 2)
+		{
+			size_t new_size = (pf->buffer_size == 0)
+				? 4096 : 2 * pf->buffer_size;
+			char *tmp;
+
+			tmp = realloc (pf->buffer, new_size);
+			if (tmp == NULL)
+			{
+				errno = ENOMEM;
+				return (-1);
+			}
+			pf->buffer = tmp;
+			pf->buffer_size = new_size;
+		}
+
+		status = pread (pf->fd, pf->buffer + offset,
+				pf->buffer_size - offset - 1, (off_t) offset);
+		if (status < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		else if (status == 0)
+			break;
+
+		offset += (size_t) status;
+	}
+
+	pf->buffer[offset] = 0;
+	return ((ssize_t) offset);
+} /* }}} ssize_t pread_file_fill */
+
+char *pread_file_read (pread_file_t *pf, size_t *ret_len) /* {{{ */
+{
+	ssize_t status = -1;
+	int i;
+
+	if (pf == NULL)
+	{
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	/* If reading fails, e.g. because the file has been replaced, try once
+	 * more with a freshly opened file. */
+	for (i = 0; (i < 2) && (status < 0); i++)
+	{
+		if (pf->fd < 0)
+		{
+			pf->fd = open (pf->path, O_RDONLY | O_CLOEXEC);
+			if (pf->fd < 0)
+				return (NULL);
+		}
+
+		status = pread_file_fill (pf);
+		if (status < 0)
+		{
+			int saved_errno = errno;
+
+			close (pf->fd);
+			pf->fd = -1;
+			errno = saved_errno;
+		}
+	}
+
+	if (status < 0)
+		return (NULL);
+
+	if (ret_len != NULL)
+		*ret_len = (size_t) status;
+	return (pf->buffer);
+} /* }}} char *pread_file_read */
+
+char *strline (char **ptr) /* {{{ */
+{
+	char *line = *ptr;
+	char *end;
+
+	if ((line == NULL) || (*line == 0))
+		return (NULL);
+
+	end = strchr (line, '\n');
+	if (end == NULL)
+		*ptr = line + strlen (line);
+	else
+	{
+		*end = 0;
+		*ptr = end + 1;
+	}
+
+	return (line);
+} /* }}} char *strline */
+
+int strsplit_line (char **ptr, char **fields, size_t size) /* {{{ */
+{
+	char *p = *ptr;
+	size_t i = 0;
+
+	if ((p == NULL) || (*p == 0))
+		return (-1);
+
+	while ((*p != 0) && (*p != '\n'))
+	{
+		if ((*p == ' ') || (*p == '\t') || (*p == '\r'))
+		{
+			*p = 0;
+			p++;
+			continue;
+		}
+
+		if (i < size)
+			fields[i] = p;
+		i++;
+
+		while ((*p != 0) && (*p != '\n')
+				&& (*p != ' ') && (*p != '\t') && (*p != '\r'))
+			p++;
+	}
+
+	if (*p == '\n')
+	{
+		*p = 0;
+		p++;
+	}
+	*ptr = p;
+
+	return ((int) ((i < size) ? i : size));
+} /* }}} int strsplit_line */
+
 counter_t counter_diff (counter_t old_value, counter_t new_value)
 {
 	counter_t diff;
@@ -241,7 +241,15 @@ int check_create_dir (const char *file_orig);
 
 #ifdef HAVE_LIBKSTAT
 int get_kstat (kstat_t **ksp_ptr, char *module, int instance, char *name);
+/* Like get_kstat(), but only looks the kstat up again if "*ksp_ptr" is NULL
+ * or the chain has been updated since "*chain_id" was set. Otherwise, just
+ * the kstat is read. */
+int get_kstat_cached (kstat_t **ksp_ptr, kid_t *chain_id,
+		char *module, int instance, char *name);
 long long get_kstat_value (kstat_t *ksp, char *name);
+/* Like get_kstat_value(), but keeps the position of "name" in "*index",
+ * which must be -1 initially, and skips searching the entries next time. */
+long long get_kstat_value_index (kstat_t *ksp, char *name, int *index);
 #endif
 
 #ifndef HAVE_HTONLL
@@ -266,6 +274,14 @@ int format_name (char *ret, int ret_len,
 #define FORMAT_VL(ret, ret_len, vl) \
 	format_name (ret, ret_len, (vl)->host, (vl)->plugin, (vl)->plugin_instance, \
 			(vl)->type, (vl)->type_instance)
+
+/* Formats a floating point value. With "FloatFormat Legacy", the value is
+ * formatted with "legacy_format", i.e. exactly like previous versions did.
+ * Otherwise the shortest string which parses back to the same value is
+ * used. Returns the number of characters like snprintf(3). */
+int format_gauge (char *buffer, size_t buffer_size,
+		char const *legacy_format, double value);
+
 int format_values (char *ret, size_t ret_len,
 		const data_set_t *ds, const value_list_t *vl,
 		_Bool store_rates);
@@ -298,6 +314,43 @@ int walk_directory (const char *dir, dirwalk_callback_f callback,
 /* Returns the number of bytes read or negative on error. */
 int read_file_contents (const char *filename, char *buf, int bufsize);
 
+/*
+ * A file, usually in /proc or /sys, that is kept open between reads and read
+ * from the start with pread(2) into a buffer that is reused, too. This saves
+ * the open(2) and close(2) calls and the stdio overhead of reading such files
+ * on every interval.
+ *
+ * pread_file_create() doesn't open the file yet. pread_file_read() returns
+ * the buffer holding the complete, null-terminated contents, or NULL with
+ * `errno' set on error. The buffer is valid until the next call. If reading
+ * fails, the file is opened again once.
+ */
+struct pread_file_s;
+typedef struct pread_file_s pread_file_t;
+
+pread_file_t *pread_file_create (const char *path);
+void pread_file_destroy (pread_file_t *pf);
+char *pread_file_read (pread_file_t *pf, size_t *ret_len);
+/* Closes the file but keeps the buffer. The next pread_file_read() opens the
+ * file again, following it if it has been replaced, e.g. by rename(2) or a
+ * log rotation, in the meantime. */
+void pread_file_close (pread_file_t *pf);
+
+/*
+ * Iterate over the lines of a buffer, such as the one returned by
+ * pread_file_read(). `ptr' points to the current line and is moved to the
+ * next one; the newline is replaced by a null byte.
+ *
+ * strline() returns the line or NULL at the end of the buffer.
+ *
+ * strsplit_line() splits the line in place like strsplit(), but in a single
+ * pass, and returns the number of fields stored in `fields', which may be
+ * zero for empty lines, or -1 at the end of the buffer. Fields beyond `size'
+ * are skipped.
+ */
+char *strline (char **ptr);
+int strsplit_line (char **ptr, char **fields, size_t size);
+
 counter_t counter_diff (counter_t old_value, counter_t new_value);
 
 /* Convert a rate back to a value_t. When converting to a derive_t, counter_t
@@ -31,6 +31,8 @@
 #include "types_list.h"
 #include "filter_chain.h"
 
+#include <pthread.h>
+
 #if HAVE_WORDEXP_H
 # include <wordexp.h>
 #endif /* HAVE_WORDEXP_H */
@@ -62,6 +64,8 @@ typedef struct cf_complex_callback_s
 {
 	char *type;
 	int (*callback) (oconfig_item_t *);
+	/* Optional, see cf_register_reload(). */
+	int (*reload) (oconfig_item_t *);
 	plugin_ctx_t ctx;
 	struct cf_complex_callback_s *next;
 } cf_complex_callback_t;
@@ -92,6 +96,10 @@ static int dispatch_loadplugin (const oconfig_item_t *ci);
 static cf_callback_t *first_callback = NULL;
 static cf_complex_callback_t *complex_callback_head = NULL;
 
+/* The file passed to cf_read(), read again by cf_reload(). */
+static char *cf_filename = NULL;
+static pthread_mutex_t cf_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static cf_value_map_t cf_value_map[] =
 {
 	{"TypesDB",    dispatch_value_typesdb},
@@ -108,8 +116,39 @@ static cf_global_option_t cf_global_options[] =
 	{"FQDNLookup",  NULL, "true"},
 	{"Interval",    NULL, NULL},
 	{"ReadThreads", NULL, "5"},
+	{"ReadPhaseSpread", NULL, "false"},
+	{"ReadTimeout", NULL, "0"},
+	{"AsyncReadThreads", NULL, "2"},
+	{"ResolverCacheTTL", NULL, "300"},
+	{"InitThreads", NULL, "1"},
 	{"WriteThreads", NULL, "5"},
+	{"WriteThreadsMax", NULL, "0"},
+	{"WriteThreadsGrowQueueLength", NULL, "0"},
+	{"WriteThreadsGrowLatency", NULL, "0"},
+	{"WriteQueueLimitHigh", NULL, "65536"},
+	{"WriteQueueLimitLow",  NULL, "0"},
+	{"WriteQueuePolicy",    NULL, "Block"},
+	{"WriteQueuePartitioned", NULL, "false"},
+	{"WriteTracing", NULL, "false"},
+	{"WriteTraceSample", NULL, "1000"},
+	{"CallbackCPUTime", NULL, "false"},
+	{"CoarseClock", NULL, "false"},
+	{"OverloadQueueLength", NULL, "0"},
+	{"OverloadReadLag", NULL, "0"},
+	{"OverloadMaxStretch", NULL, "8"},
+	{"ReadThreadCPUs", NULL, NULL},
+	{"WriteThreadCPUs", NULL, NULL},
+	{"NotificationThreads", NULL, "0"},
+	{"NotificationQueueLimit", NULL, "1024"},
+	{"LogThread", NULL, "false"},
+	{"LogQueueLimit", NULL, "4096"},
+	{"LogRateLimit", NULL, "0"},
 	{"Timeout",     NULL, "2"},
+	{"FloatFormat", NULL, "Shortest"},
+	{"CacheSnapshot", NULL, ""},
+	{"SeriesLimitPerPlugin", NULL, "0"},
+	{"SeriesLimitPerHost", NULL, "0"},
+	{"TypesDBCache", NULL, ""},
 	{"PreCacheChain",  NULL, "PreCache"},
 	{"PostCacheChain", NULL, "PostCache"}
 };
@@ -305,6 +344,66 @@ static int dispatch_loadplugin (const oconfig_item_t *ci)
 
 			ctx.interval = DOUBLE_TO_CDTIME_T (interval);
 		}
+		else if (strcasecmp ("AsyncQueue", ci->children[i].key) == 0)
+			cf_util_get_boolean (ci->children + i, &ctx.write_async);
+		else if (strcasecmp ("QueueLimit", ci->children[i].key) == 0) {
+			int limit = 0;
+
+			if (cf_util_get_int (ci->children + i, &limit) != 0)
+				continue;
+
+			if (limit < 1) {
+				WARNING ("The \"QueueLimit\" option of plugin "
+						"\"%s\" must be positive.", name);
+				continue;
+			}
+
+			ctx.write_async_limit = (size_t) limit;
+		}
+		else if (strcasecmp ("ReadThreads", ci->children[i].key) == 0) {
+			int num = 0;
+
+			if (cf_util_get_int (ci->children + i, &num) != 0)
+				continue;
+
+			if (num < 1) {
+				WARNING ("The \"ReadThreads\" option of plugin "
+						"\"%s\" must be positive.", name);
+				continue;
+			}
+
+			ctx.read_threads = num;
+		}
+		else if (strcasecmp ("LowPriority", ci->children[i].key) == 0)
+			cf_util_get_boolean (ci->children + i, &ctx.low_priority);
+		else if (strcasecmp ("ReadTimeout", ci->children[i].key) == 0) {
+			double timeout = 0.0;
+
+			if (cf_util_get_double (ci->children + i, &timeout) != 0)
+				continue;
+
+			if (timeout <= 0.0) {
+				WARNING ("The \"ReadTimeout\" option of plugin "
+						"\"%s\" must be positive.", name);
+				continue;
+			}
+
+			ctx.read_timeout = DOUBLE_TO_CDTIME_T (timeout);
+		}
+		else if (strcasecmp ("InitAfter", ci->children[i].key) == 0) {
+			oconfig_item_t *child = ci->children + i;
+			int j;
+
+			for (j = 0; j < child->values_num; j++) {
+				if (child->values[j].type != OCONFIG_TYPE_STRING) {
+					WARNING ("The \"InitAfter\" option of plugin "
+							"\"%s\" needs string arguments.", name);
+					continue;
+				}
+				plugin_init_after (name,
+						child->values[j].value.string);
+			}
+		}
 		else {
 			WARNING("Ignoring unknown LoadPlugin option \"%s\" "
 					"for plugin \"%s\"",
@@ -442,103 +541,58 @@ static int dispatch_block (oconfig_item_t *ci)
 	return (0);
 }
 
-static int cf_ci_replace_child (oconfig_item_t *dst, oconfig_item_t *src,
-		int offset)
+/* Moves "items_num" items to the end of the children of "dst". "dst_alloc"
+ * is the number of children allocated; the array is doubled when full, so
+ * that long configurations are merged in linear time. */
+static int cf_ci_append_items (oconfig_item_t *dst, int *dst_alloc,
+		const oconfig_item_t *items, int items_num)
 {
-	oconfig_item_t *temp;
-	int i;
-
-	assert (offset >= 0);
-	assert (dst->children_num > offset);
-
-	/* Free the memory used by the replaced child. Usually that's the
-	 * `Include "blah"' statement. */
-	temp = dst->children + offset;
-	for (i = 0; i < temp->values_num; i++)
-	{
-		if (temp->values[i].type == OCONFIG_TYPE_STRING)
-		{
-			sfree (temp->values[i].value.string);
-		}
-	}
-	sfree (temp->values);
-	temp = NULL;
-
-	/* If (src->children_num == 0) the array size is decreased. If offset
-	 * is _not_ the last element, (offset < (dst->children_num - 1)), then
-	 * we need to move the trailing elements before resizing the array. */
-	if ((src->children_num == 0) && (offset < (dst->children_num - 1)))
-	{
-		int nmemb = dst->children_num - (offset + 1);
-		memmove (dst->children + offset, dst->children + offset + 1,
-				sizeof (oconfig_item_t) * nmemb);
-	}
+	if (items_num <= 0)
+		return (0);
 
-	/* Resize the memory containing the children to be big enough to hold
-	 * all children. */
-	temp = (oconfig_item_t *) realloc (dst->children,
-			sizeof (oconfig_item_t)
-			* (dst->children_num + src->children_num - 1));
-	if (temp == NULL)
+	if ((dst->children_num + items_num) > *dst_alloc)
 	{
-		ERROR ("configfile: realloc failed.");
-		return (-1);
-	}
-	dst->children = temp;
-
-	/* If there are children behind the include statement, and they have
-	 * not yet been moved because (src->children_num == 0), then move them
-	 * to the end of the list, so that the new children have room before
-	 * them. */
-	if ((src->children_num > 0)
-			&& ((dst->children_num - (offset + 1)) > 0))
-	{
-		int nmemb = dst->children_num - (offset + 1);
-		int old_offset = offset + 1;
-		int new_offset = offset + src->children_num;
+		oconfig_item_t *temp;
+		int new_alloc = (*dst_alloc > 0) ? *dst_alloc : 16;
 
-		memmove (dst->children + new_offset,
-				dst->children + old_offset,
-				sizeof (oconfig_item_t) * nmemb);
-	}
+		while (new_alloc < (dst->children_num + items_num))
+			new_alloc *= 2;
 
-	/* Last but not least: If there are new children, copy them to the
-	 * memory reserved for them. */
-	if (src->children_num > 0)
-	{
-		memcpy (dst->children + offset,
-				src->children,
-				sizeof (oconfig_item_t) * src->children_num);
+		temp = (oconfig_item_t *) realloc (dst->children,
+				sizeof (oconfig_item_t) * new_alloc);
+		if (temp == NULL)
+		{
+			ERROR ("configfile: realloc failed.");
+			return (-1);
+		}
+		dst->children = temp;
+		*dst_alloc = new_alloc;
 	}
 
-	/* Update the number of children. */
-	dst->children_num += (src->children_num - 1);
+	memcpy (dst->children + dst->children_num, items,
+			sizeof (oconfig_item_t) * items_num);
+	dst->children_num += items_num;
 
 	return (0);
-} /* int cf_ci_replace_child */
+} /* int cf_ci_append_items */
 
-static int cf_ci_append_children (oconfig_item_t *dst, oconfig_item_t *src)
+/* Moves the children of "src" to "dst", see cf_ci_append_items(). On
+ * success "src" is left without children. */
+static int cf_ci_append_children (oconfig_item_t *dst, int *dst_alloc,
+		oconfig_item_t *src)
 {
-	oconfig_item_t *temp;
+	int status;
 
 	if ((src == NULL) || (src->children_num == 0))
 		return (0);
 
-	temp = (oconfig_item_t *) realloc (dst->children,
-			sizeof (oconfig_item_t)
-			* (dst->children_num + src->children_num));
-	if (temp == NULL)
-	{
-		ERROR ("configfile: realloc failed.");
-		return (-1);
-	}
-	dst->children = temp;
+	status = cf_ci_append_items (dst, dst_alloc,
+			src->children, src->children_num);
+	if (status != 0)
+		return (status);
 
-	memcpy (dst->children + dst->children_num,
-			src->children,
-			sizeof (oconfig_item_t)
-			* src->children_num);
-	dst->children_num += src->children_num;
+	sfree (src->children);
+	src->children_num = 0;
 
 	return (0);
 } /* int cf_ci_append_children */
@@ -547,58 +601,85 @@ static int cf_ci_append_children (oconfig_item_t *dst, oconfig_item_t *src)
 static oconfig_item_t *cf_read_generic (const char *path,
 		const char *pattern, int depth);
 
-static int cf_include_all (oconfig_item_t *root, int depth)
+/* Reads the files named by the `Include' statement "ci". Returns NULL if
+ * "ci" is not an `Include' statement or reading the files failed. */
+static oconfig_item_t *cf_include_read (const oconfig_item_t *ci, int depth)
 {
+	oconfig_item_t *new;
+	char *pattern = NULL;
 	int i;
 
-	for (i = 0; i < root->children_num; i++)
+	if (strcasecmp (ci->key, "Include") != 0)
+		return (NULL);
+
+	if ((ci->values_num != 1)
+			|| (ci->values[0].type != OCONFIG_TYPE_STRING))
 	{
-		oconfig_item_t *new;
-		oconfig_item_t *old;
+		ERROR ("configfile: `Include' needs exactly one string argument.");
+		return (NULL);
+	}
 
-		char *pattern = NULL;
+	for (i = 0; i < ci->children_num; ++i)
+	{
+		oconfig_item_t *child = ci->children + i;
 
-		int j;
+		if (strcasecmp (child->key, "Filter") == 0)
+			cf_util_get_string (child, &pattern);
+		else
+			ERROR ("configfile: Option `%s' not allowed in <Include> block.",
+					child->key);
+	}
 
-		if (strcasecmp (root->children[i].key, "Include") != 0)
-			continue;
+	new = cf_read_generic (ci->values[0].value.string, pattern, depth + 1);
+	sfree (pattern);
 
-		old = root->children + i;
+	return (new);
+} /* oconfig_item_t *cf_include_read */
 
-		if ((old->values_num != 1)
-				|| (old->values[0].type != OCONFIG_TYPE_STRING))
-		{
-			ERROR ("configfile: `Include' needs exactly one string argument.");
-			continue;
-		}
+/* Replaces the `Include' statements among the children of "root" with the
+ * statements read from the included files. The children are moved into a
+ * new array in a single pass; the included trees are not copied. */
+static int cf_include_all (oconfig_item_t *root, int depth)
+{
+	oconfig_item_t dst;
+	int dst_alloc = 0;
+	int i;
 
-		for (j = 0; j < old->children_num; ++j)
-		{
-			oconfig_item_t *child = old->children + j;
+	for (i = 0; i < root->children_num; i++)
+		if (strcasecmp (root->children[i].key, "Include") == 0)
+			break;
+	if (i >= root->children_num)
+		return (0);
 
-			if (strcasecmp (child->key, "Filter") == 0)
-				cf_util_get_string (child, &pattern);
-			else
-				ERROR ("configfile: Option `%s' not allowed in <Include> block.",
-						child->key);
-		}
+	memset (&dst, 0, sizeof (dst));
 
-		new = cf_read_generic (old->values[0].value.string, pattern, depth + 1);
-		sfree (pattern);
+	for (i = 0; i < root->children_num; i++)
+	{
+		oconfig_item_t *old = root->children + i;
+		oconfig_item_t *new;
 
+		new = cf_include_read (old, depth);
 		if (new == NULL)
+		{
+			/* Not an `Include' statement, or one which failed. */
+			if (cf_ci_append_items (&dst, &dst_alloc, old, 1) != 0)
+				oconfig_free (old);
 			continue;
+		}
 
-		/* Now replace the i'th child in `root' with `new'. */
-		cf_ci_replace_child (root, new, i);
-
-		/* ... and go back to the new i'th child. */
-		--i;
-
-		sfree (new->values);
+		/* Their own `Include's were resolved by cf_read_file(). */
+		cf_ci_append_children (&dst, &dst_alloc, new);
+		oconfig_free (new);
 		sfree (new);
+
+		/* Usually that's the `Include "blah"' statement. */
+		oconfig_free (old);
 	} /* for (i = 0; i < root->children_num; i++) */
 
+	sfree (root->children);
+	root->children = dst.children;
+	root->children_num = dst.children_num;
+
 	return (0);
 } /* int cf_include_all */
 
@@ -653,6 +734,7 @@ static oconfig_item_t *cf_read_dir (const char *dir,
 	oconfig_item_t *root = NULL;
 	DIR *dh;
 	struct dirent *de;
+	int root_alloc = 0;
 	char **filenames = NULL;
 	int filenames_num = 0;
 	int status;
@@ -731,8 +813,8 @@ static oconfig_item_t *cf_read_dir (const char *dir,
 			continue;
 		}
 
-		cf_ci_append_children (root, temp);
-		sfree (temp->children);
+		cf_ci_append_children (root, &root_alloc, temp);
+		oconfig_free (temp);
 		sfree (temp);
 
 		free (name);
@@ -758,6 +840,7 @@ static oconfig_item_t *cf_read_generic (const char *path,
 		const char *pattern, int depth)
 {
 	oconfig_item_t *root = NULL;
+	int root_alloc = 0;
 	int status;
 	const char *path_ptr;
 	wordexp_t we;
@@ -823,8 +906,8 @@ static oconfig_item_t *cf_read_generic (const char *path,
 			return (NULL);
 		}
 
-		cf_ci_append_children (root, temp);
-		sfree (temp->children);
+		cf_ci_append_children (root, &root_alloc, temp);
+		oconfig_free (temp);
 		sfree (temp);
 	}
 
@@ -1017,6 +1100,7 @@ int cf_register_complex (const char *type, int (*callback) (oconfig_item_t *))
 	}
 
 	new->callback = callback;
+	new->reload = NULL;
 	new->next = NULL;
 
 	new->ctx = plugin_get_ctx ();
@@ -1036,6 +1120,137 @@ int cf_register_complex (const char *type, int (*callback) (oconfig_item_t *))
 	return (0);
 } /* int cf_register_complex */
 
+int cf_register_reload (const char *type, int (*callback) (oconfig_item_t *))
+{
+	cf_complex_callback_t *cb;
+
+	for (cb = complex_callback_head; cb != NULL; cb = cb->next)
+	{
+		if (strcasecmp (type, cb->type) == 0)
+		{
+			cb->reload = callback;
+			return (0);
+		}
+	}
+
+	ERROR ("cf_register_reload: The %s plugin has no complex config "
+			"callback.", type);
+	return (ENOENT);
+} /* int cf_register_reload */
+
+/* Calls the reload callback of "cb" with all <Plugin> blocks for its type,
+ * merged into one. The callback is called even if there are no such blocks,
+ * so that it can remove its previous configuration. */
+static int cf_reload_complex (const oconfig_item_t *conf, /* {{{ */
+		const cf_complex_callback_t *cb)
+{
+	oconfig_item_t ci;
+	oconfig_value_t value;
+	plugin_ctx_t old_ctx;
+	int status;
+	int i;
+
+	memset (&ci, 0, sizeof (ci));
+	ci.key = "Plugin";
+	value.type = OCONFIG_TYPE_STRING;
+	value.value.string = cb->type;
+	ci.values = &value;
+	ci.values_num = 1;
+
+	/* The children are copied shallowly; only the array is freed below. */
+	for (i = 0; i < conf->children_num; i++)
+	{
+		const oconfig_item_t *block = conf->children + i;
+		oconfig_item_t *tmp;
+
+		if ((strcasecmp ("Plugin", block->key) != 0)
+				|| (block->values_num < 1)
+				|| (block->values[0].type != OCONFIG_TYPE_STRING)
+				|| (strcasecmp (cb->type,
+						block->values[0].value.string) != 0)
+				|| (block->children_num < 1))
+			continue;
+
+		tmp = realloc (ci.children, sizeof (*tmp)
+				* (ci.children_num + block->children_num));
+		if (tmp == NULL)
+		{
+			ERROR ("cf_reload: realloc failed.");
+			sfree (ci.children);
+			return (-1);
+		}
+		ci.children = tmp;
+		memcpy (ci.children + ci.children_num, block->children,
+				sizeof (*tmp) * block->children_num);
+		ci.children_num += block->children_num;
+	}
+
+	old_ctx = plugin_set_ctx (cb->ctx);
+	status = cb->reload (&ci);
+	plugin_set_ctx (old_ctx);
+
+	sfree (ci.children);
+	return (status);
+} /* }}} int cf_reload_complex */
+
+int cf_reload (void)
+{
+	oconfig_item_t *conf;
+	cf_complex_callback_t *cb;
+	int reloaded = 0;
+	int failed = 0;
+
+	pthread_mutex_lock (&cf_reload_lock);
+
+	if (cf_filename == NULL)
+	{
+		pthread_mutex_unlock (&cf_reload_lock);
+		return (-1);
+	}
+
+	INFO ("Reloading the configuration from %s.", cf_filename);
+
+	conf = cf_read_generic (cf_filename, /* pattern = */ NULL,
+			/* depth = */ 0);
+	if (conf == NULL)
+	{
+		ERROR ("cf_reload: Unable to read config file %s. "
+				"Keeping the current configuration.",
+				cf_filename);
+		pthread_mutex_unlock (&cf_reload_lock);
+		return (-1);
+	}
+
+	if (fc_reload (conf) == 0)
+		plugin_reload_chains ();
+	else
+		failed++;
+
+	for (cb = complex_callback_head; cb != NULL; cb = cb->next)
+	{
+		if (cb->reload == NULL)
+			continue;
+
+		if (cf_reload_complex (conf, cb) == 0)
+			reloaded++;
+		else
+		{
+			ERROR ("cf_reload: Reloading the configuration of the "
+					"%s plugin failed.", cb->type);
+			failed++;
+		}
+	}
+
+	oconfig_free (conf);
+
+	INFO ("Reloaded the filter chains and the configuration of %i "
+			"plugin(s), %i error(s). Other changes take effect after "
+			"a restart.", reloaded, failed);
+
+	pthread_mutex_unlock (&cf_reload_lock);
+	return ((failed == 0) ? 0 : -1);
+} /* int cf_reload */
+
 int cf_read (char *filename)
 {
 	oconfig_item_t *conf;
@@ -1048,6 +1263,9 @@ int cf_read (char *filename)
 		return (-1);
 	}
 
+	sfree (cf_filename);
+	cf_filename = strdup (filename);
+
 	for (i = 0; i < conf->children_num; i++)
 	{
 		if (conf->children[i].children == NULL)
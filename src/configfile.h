@@ -67,6 +67,16 @@ void cf_register (const char *type,
 
 int cf_register_complex (const char *type, int (*callback) (oconfig_item_t *));
 
+/*
+ * DESCRIPTION
+ *  Registers `callback' to be called by `cf_reload' with the new
+ *  configuration of the plugin `type', which must have registered a complex
+ *  config callback before. All `<Plugin $type>' blocks are merged into one,
+ *  which has no children if there are none. The callback should only replace
+ *  its configuration if the new one is valid.
+ */
+int cf_register_reload (const char *type, int (*callback) (oconfig_item_t *));
+
 /*
  * DESCRIPTION
  *  `cf_read' reads the config file `filename' and dispatches the read
@@ -84,6 +94,19 @@ int cf_register_complex (const char *type, int (*callback) (oconfig_item_t *));
  */
 int cf_read (char *filename);
 
+/*
+ * DESCRIPTION
+ *  Reads the config file passed to `cf_read' again and replaces the filter
+ *  chains and the configuration of plugins with a reload callback. The value
+ *  cache, the write queue and all other plugins are not touched; other
+ *  changes take effect after a restart. Calls are serialized.
+ *
+ * RETURN VALUE
+ *  Returns zero upon success and non-zero if the file could not be read or
+ *  any part failed to reload. Parts that failed keep their old configuration.
+ */
+int cf_reload (void);
+
 int global_option_set (const char *option, const char *value);
 const char *global_option_get (const char *option);
 
@@ -34,7 +34,7 @@
 /* #endif HAVE_SYSCTLBYNAME */
 
 #elif KERNEL_LINUX
-/* no global variables */
+static pread_file_t *pf_stat = NULL;
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_PERFSTAT
@@ -83,25 +83,34 @@ static int cs_read (void)
 /* #endif HAVE_SYSCTLBYNAME */
 
 #elif KERNEL_LINUX
-	FILE *fh;
-	char buffer[64];
+	char *buffer;
+	char *ptr;
+	char *line;
 	int numfields;
 	char *fields[3];
 	derive_t result = 0;
 	int status = -2;
 
-	fh = fopen ("/proc/stat", "r");
-	if (fh == NULL) {
-		ERROR ("contextswitch plugin: unable to open /proc/stat: %s",
-				sstrerror (errno, buffer, sizeof (buffer)));
+	if (pf_stat == NULL)
+		pf_stat = pread_file_create ("/proc/stat");
+
+	buffer = pread_file_read (pf_stat, NULL);
+	if (buffer == NULL) {
+		char errbuf[1024];
+		ERROR ("contextswitch plugin: unable to read /proc/stat: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
-	while (fgets(buffer, sizeof(buffer), fh) != NULL)
+	ptr = buffer;
+	while ((line = strline (&ptr)) != NULL)
 	{
 		char *endptr;
 
-		numfields = strsplit(buffer, fields, STATIC_ARRAY_SIZE (fields));
+		if (strncmp ("ctxt", line, 4) != 0)
+			continue;
+
+		numfields = strsplit_line (&line, fields, STATIC_ARRAY_SIZE (fields));
 		if (numfields != 2)
 			continue;
 
@@ -122,7 +131,6 @@ static int cs_read (void)
 		status = 0;
 		break;
 	}
-	fclose(fh);
 
 	if (status == -2)
 		ERROR ("contextswitch plugin: Unable to find context switch value.");
@@ -148,7 +156,20 @@ static int cs_read (void)
 	return status;
 }
 
+#if KERNEL_LINUX
+static int cs_shutdown (void)
+{
+	pread_file_destroy (pf_stat);
+	pf_stat = NULL;
+
+	return (0);
+}
+#endif /* KERNEL_LINUX */
+
 void module_register (void)
 {
 	plugin_register_read ("contextswitch", cs_read);
+#if KERNEL_LINUX
+	plugin_register_shutdown ("contextswitch", cs_shutdown);
+#endif
 } /* void module_register */
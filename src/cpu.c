@@ -113,7 +113,36 @@ static int cpu_temp_retry_max     = 1;
 /* #endif PROCESSOR_CPU_LOAD_INFO */
 
 #elif defined(KERNEL_LINUX)
-/* no variables needed */
+# define CPU_STATES_MAX 8
+
+/* How the states are reported: per CPU, summed up per NUMA node or per
+ * socket, or only the total of all CPUs. */
+# define CPU_REPORT_CPU    0
+# define CPU_REPORT_NODE   1
+# define CPU_REPORT_SOCKET 2
+# define CPU_REPORT_TOTAL  3
+
+static const char *config_keys[] =
+{
+	"ReportBy"
+};
+static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
+
+static const char *cpu_states[CPU_STATES_MAX] = { "user", "nice", "system",
+	"idle", "wait", "interrupt", "softirq", "steal" };
+
+static int report_by = CPU_REPORT_CPU;
+
+static pread_file_t *pf_stat = NULL;
+
+/* Maps CPU numbers to nodes or sockets ("groups") and holds the per-group
+ * sums. A group's `group_states' is the number of states all its CPUs
+ * reported, zero if none reported any. */
+static int     *cpu_group = NULL;
+static size_t   cpu_group_num = 0;
+static derive_t *group_values = NULL;
+static size_t  *group_states = NULL;
+static size_t   group_num = 0;
 /* #endif KERNEL_LINUX */
 
 #elif defined(HAVE_LIBKSTAT)
@@ -241,6 +270,8 @@ static int init (void)
 	return (0);
 } /* int init */
 
+/* Linux dispatches the states of each CPU with plugin_dispatch_values_multi. */
+#if !KERNEL_LINUX
 static void submit (int cpu_num, const char *type_instance, derive_t value)
 {
 	value_t values[1];
@@ -259,6 +290,204 @@ static void submit (int cpu_num, const char *type_instance, derive_t value)
 
 	plugin_dispatch_values (&vl);
 }
+#endif /* !KERNEL_LINUX */
+
+#if KERNEL_LINUX
+static int cpu_config (const char *key, const char *value)
+{
+	if (strcasecmp (key, "ReportBy") == 0)
+	{
+		if (strcasecmp (value, "CPU") == 0)
+			report_by = CPU_REPORT_CPU;
+		else if (strcasecmp (value, "Node") == 0)
+			report_by = CPU_REPORT_NODE;
+		else if (strcasecmp (value, "Socket") == 0)
+			report_by = CPU_REPORT_SOCKET;
+		else if (strcasecmp (value, "Total") == 0)
+			report_by = CPU_REPORT_TOTAL;
+		else
+		{
+			ERROR ("cpu plugin: Invalid value for ReportBy: `%s'. "
+					"Expected \"CPU\", \"Node\", \"Socket\" "
+					"or \"Total\".", value);
+			return (1);
+		}
+	}
+	else
+	{
+		return (-1);
+	}
+
+	return (0);
+} /* int cpu_config */
+
+/* The states of one CPU are dispatched as one batch. */
+static void cpu_submit_states (const char *plugin_instance,
+		const derive_t *states, size_t states_num)
+{
+	value_t values[CPU_STATES_MAX];
+	plugin_value_entry_t entries[CPU_STATES_MAX];
+	value_list_t vl = VALUE_LIST_INIT;
+	size_t i;
+
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "cpu", sizeof (vl.plugin));
+	sstrncpy (vl.plugin_instance, plugin_instance,
+			sizeof (vl.plugin_instance));
+	sstrncpy (vl.type, "cpu", sizeof (vl.type));
+
+	memset (entries, 0, sizeof (entries));
+	for (i = 0; i < states_num; i++)
+	{
+		values[i].derive = states[i];
+		entries[i].type_instance = cpu_states[i];
+		entries[i].values = values + i;
+		entries[i].values_len = 1;
+	}
+
+	plugin_dispatch_values_multi (&vl, entries, states_num);
+} /* void cpu_submit_states */
+
+/* Returns the NUMA node of a CPU, or zero if it cannot be determined, e.g. on
+ * kernels without NUMA support. */
+static int cpu_get_node (size_t cpu)
+{
+	char path[PATH_MAX];
+	DIR *dh;
+	struct dirent *de;
+	int node = 0;
+
+	ssnprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%zu", cpu);
+	dh = opendir (path);
+	if (dh == NULL)
+		return (0);
+
+	while ((de = readdir (dh)) != NULL)
+	{
+		char *endptr;
+		long tmp;
+
+		if (strncmp (de->d_name, "node", 4) != 0)
+			continue;
+
+		tmp = strtol (de->d_name + 4, &endptr, 10);
+		if ((endptr == de->d_name + 4) || (*endptr != 0) || (tmp < 0))
+			continue;
+
+		node = (int) tmp;
+		break;
+	}
+
+	closedir (dh);
+	return (node);
+} /* int cpu_get_node */
+
+/* Returns the physical package (socket) of a CPU, or zero. */
+static int cpu_get_socket (size_t cpu)
+{
+	char path[PATH_MAX];
+	char buffer[32];
+	int status;
+
+	ssnprintf (path, sizeof (path),
+			"/sys/devices/system/cpu/cpu%zu/topology/physical_package_id",
+			cpu);
+	status = read_file_contents (path, buffer, sizeof (buffer) - 1);
+	if (status <= 0)
+		return (0);
+	buffer[status] = 0;
+
+	status = atoi (buffer);
+	return ((status < 0) ? 0 : status);
+} /* int cpu_get_socket */
+
+/* (Re-)builds the CPU to group map for at least `min_cpus' CPUs. This is
+ * done once, and again only if a CPU shows up that wasn't configured when the
+ * map was built. */
+static int cpu_groups_update (size_t min_cpus)
+{
+	long conf_cpus;
+	size_t cpus_num;
+	size_t groups_num = 0;
+	int *tmp_group;
+	derive_t *tmp_values;
+	size_t *tmp_states;
+	size_t i;
+
+	conf_cpus = sysconf (_SC_NPROCESSORS_CONF);
+	cpus_num = min_cpus;
+	if ((conf_cpus > 0) && ((size_t) conf_cpus > cpus_num))
+		cpus_num = (size_t) conf_cpus;
+
+	tmp_group = realloc (cpu_group, cpus_num * sizeof (*cpu_group));
+	if (tmp_group == NULL)
+	{
+		ERROR ("cpu plugin: realloc failed.");
+		return (-1);
+	}
+	cpu_group = tmp_group;
+	cpu_group_num = 0;
+	group_num = 0;
+
+	for (i = 0; i < cpus_num; i++)
+	{
+		if (report_by == CPU_REPORT_NODE)
+			cpu_group[i] = cpu_get_node (i);
+		else
+			cpu_group[i] = cpu_get_socket (i);
+
+		if ((size_t) cpu_group[i] >= groups_num)
+			groups_num = (size_t) cpu_group[i] + 1;
+	}
+
+	tmp_values = realloc (group_values,
+			groups_num * CPU_STATES_MAX * sizeof (*group_values));
+	if (tmp_values == NULL)
+	{
+		ERROR ("cpu plugin: realloc failed.");
+		return (-1);
+	}
+	group_values = tmp_values;
+
+	tmp_states = realloc (group_states, groups_num * sizeof (*group_states));
+	if (tmp_states == NULL)
+	{
+		ERROR ("cpu plugin: realloc failed.");
+		return (-1);
+	}
+	group_states = tmp_states;
+
+	/* Sums already collected during this read are lost. The map is rebuilt
+	 * in the first read and hardly ever afterwards, so this is acceptable. */
+	memset (group_states, 0, groups_num * sizeof (*group_states));
+	group_num = groups_num;
+	cpu_group_num = cpus_num;
+
+	INFO ("cpu plugin: Mapped %zu CPUs to %zu %s%s.", cpus_num, groups_num,
+			(report_by == CPU_REPORT_NODE) ? "node" : "socket",
+			(groups_num == 1) ? "" : "s");
+
+	return (0);
+} /* int cpu_groups_update */
+
+static void cpu_group_add (int group, const derive_t *values,
+		size_t states_num)
+{
+	derive_t *sums = group_values + (group * CPU_STATES_MAX);
+	size_t i;
+
+	if (group_states[group] == 0)
+	{
+		memset (sums, 0, CPU_STATES_MAX * sizeof (*sums));
+		group_states[group] = states_num;
+	}
+	else if (states_num < group_states[group])
+		group_states[group] = states_num;
+
+	for (i = 0; i < states_num; i++)
+		sums[i] += values[i];
+} /* void cpu_group_add */
+#endif /* KERNEL_LINUX */
 
 static int cpu_read (void)
 {
@@ -349,61 +578,99 @@ static int cpu_read (void)
 /* #endif PROCESSOR_CPU_LOAD_INFO */
 
 #elif defined(KERNEL_LINUX)
-	int cpu;
-	derive_t user, nice, syst, idle;
-	derive_t wait, intr, sitr; /* sitr == soft interrupt */
-	FILE *fh;
-	char buf[1024];
+	derive_t values[CPU_STATES_MAX];
+	char *buf;
+	char *ptr;
+	char *line;
+	size_t i;
 
-	char *fields[9];
-	int numfields;
+	if (pf_stat == NULL)
+		pf_stat = pread_file_create ("/proc/stat");
 
-	if ((fh = fopen ("/proc/stat", "r")) == NULL)
+	if ((buf = pread_file_read (pf_stat, NULL)) == NULL)
 	{
 		char errbuf[1024];
-		ERROR ("cpu plugin: fopen (/proc/stat) failed: %s",
+		ERROR ("cpu plugin: Reading /proc/stat failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
-	while (fgets (buf, 1024, fh) != NULL)
+	if (group_states != NULL)
+		memset (group_states, 0, group_num * sizeof (*group_states));
+
+	ptr = buf;
+	while ((line = strline (&ptr)) != NULL)
 	{
-		if (strncmp (buf, "cpu", 3))
-			continue;
-		if ((buf[3] < '0') || (buf[3] > '9'))
+		char *endptr;
+		int cpu;
+		size_t states_num;
+
+		if (strncmp (line, "cpu", 3))
 			continue;
+		line += 3;
 
-		numfields = strsplit (buf, fields, 9);
-		if (numfields < 5)
+		/* The "cpu" line without a number holds the totals. */
+		if (*line == ' ')
+		{
+			if (report_by != CPU_REPORT_TOTAL)
+				continue;
+			cpu = -1;
+		}
+		else if ((*line >= '0') && (*line <= '9'))
+		{
+			if (report_by == CPU_REPORT_TOTAL)
+				continue;
+			cpu = (int) strtol (line, &line, 10);
+		}
+		else
 			continue;
 
-		cpu = atoi (fields[0] + 3);
-		user = atoll (fields[1]);
-		nice = atoll (fields[2]);
-		syst = atoll (fields[3]);
-		idle = atoll (fields[4]);
+		for (states_num = 0; states_num < CPU_STATES_MAX; states_num++)
+		{
+			values[states_num] = (derive_t) strtoll (line, &endptr, 10);
+			if (endptr == line)
+				break;
+			line = endptr;
+		}
 
-		submit (cpu, "user", user);
-		submit (cpu, "nice", nice);
-		submit (cpu, "system", syst);
-		submit (cpu, "idle", idle);
+		/* "wait", "interrupt" and "softirq" need 2.6 and "steal"
+		 * 2.6.11. */
+		if (states_num < 4)
+			continue;
+		else if (states_num < 7)
+			states_num = 4;
 
-		if (numfields >= 8)
+		if ((report_by == CPU_REPORT_CPU) || (report_by == CPU_REPORT_TOTAL))
 		{
-			wait = atoll (fields[5]);
-			intr = atoll (fields[6]);
-			sitr = atoll (fields[7]);
-
-			submit (cpu, "wait", wait);
-			submit (cpu, "interrupt", intr);
-			submit (cpu, "softirq", sitr);
+			char plugin_instance[DATA_MAX_NAME_LEN] = "";
 
-			if (numfields >= 9)
-				submit (cpu, "steal", atoll (fields[8]));
+			if (cpu >= 0)
+				ssnprintf (plugin_instance, sizeof (plugin_instance),
+						"%i", cpu);
+			cpu_submit_states (plugin_instance, values, states_num);
+			continue;
 		}
+
+		if ((size_t) cpu >= cpu_group_num)
+			cpu_groups_update ((size_t) cpu + 1);
+		if ((size_t) cpu >= cpu_group_num)
+			continue;
+
+		cpu_group_add (cpu_group[cpu], values, states_num);
 	}
 
-	fclose (fh);
+	for (i = 0; i < group_num; i++)
+	{
+		char plugin_instance[DATA_MAX_NAME_LEN];
+
+		if (group_states[i] == 0)
+			continue;
+
+		ssnprintf (plugin_instance, sizeof (plugin_instance), "%s%zu",
+				(report_by == CPU_REPORT_NODE) ? "node" : "socket", i);
+		cpu_submit_states (plugin_instance,
+				group_values + (i * CPU_STATES_MAX), group_states[i]);
+	}
 /* #endif defined(KERNEL_LINUX) */
 
 #elif defined(HAVE_LIBKSTAT)
@@ -599,8 +866,31 @@ static int cpu_read (void)
 	return (0);
 }
 
+#if KERNEL_LINUX
+static int cpu_shutdown (void)
+{
+	pread_file_destroy (pf_stat);
+	pf_stat = NULL;
+
+	sfree (cpu_group);
+	sfree (group_values);
+	sfree (group_states);
+	cpu_group_num = 0;
+	group_num = 0;
+
+	return (0);
+} /* int cpu_shutdown */
+#endif /* KERNEL_LINUX */
+
 void module_register (void)
 {
+#if KERNEL_LINUX
+	plugin_register_config ("cpu", cpu_config,
+			config_keys, config_keys_num);
+#endif
 	plugin_register_init ("cpu", init);
 	plugin_register_read ("cpu", cpu_read);
+#if KERNEL_LINUX
+	plugin_register_shutdown ("cpu", cpu_shutdown);
+#endif
 } /* void module_register */
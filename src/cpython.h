@@ -161,6 +161,13 @@ static inline PyObject *cpy_string_to_unicode_or_bytes(const char *buf) {
 
 void cpy_log_exception(const char *context);
 
+/* These dispatch locally or, in a worker process, send the values to the
+ * daemon. */
+int cpy_dispatch_values(const value_list_t *vl);
+int cpy_dispatch_values_multi(const value_list_t *tmpl,
+		const plugin_value_entry_t *entries, size_t entries_num);
+int cpy_dispatch_notification(const notification_t *n);
+
 /* Python object declarations. */
 
 typedef struct {
@@ -24,16 +24,34 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "utils_htable.h"
 #include "utils_cache.h"
 #include "utils_parse_option.h"
 
+#include <pthread.h>
+
+/*
+ * Private types
+ */
+/* An open file, kept in "csv_files" and in a list ordered by last use. */
+struct csv_file_s;
+typedef struct csv_file_s csv_file_t;
+struct csv_file_s
+{
+	char       *filename;
+	FILE       *fh;
+	csv_file_t *prev;
+	csv_file_t *next;
+};
+
 /*
  * Private variables
  */
 static const char *config_keys[] =
 {
 	"DataDir",
-	"StoreRates"
+	"StoreRates",
+	"OpenFiles"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -41,13 +59,23 @@ static char *datadir   = NULL;
 static int store_rates = 0;
 static int use_stdio   = 0;
 
+/* Up to "csv_files_max" files are kept open between writes. All of them are
+ * closed when the date, and with it the file names, changes. */
+static size_t           csv_files_max = 0;
+static size_t           csv_files_num = 0;
+static c_htable_t      *csv_files = NULL;
+static csv_file_t      *csv_files_head = NULL;
+static csv_file_t      *csv_files_tail = NULL;
+static char             csv_files_date[16] = "";
+static pthread_mutex_t  csv_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int value_list_to_string (char *buffer, int buffer_len,
 		const data_set_t *ds, const value_list_t *vl)
 {
 	int offset;
 	int status;
 	int i;
-	gauge_t *rates = NULL;
+	const gauge_t *rates = NULL;
 
 	assert (0 == strcmp (ds->type, vl->type));
 
@@ -69,22 +97,25 @@ static int value_list_to_string (char *buffer, int buffer_len,
 
 		if (ds->ds[i].type == DS_TYPE_GAUGE) 
 		{
-			status = ssnprintf (buffer + offset, buffer_len - offset,
-					",%lf", vl->values[i].gauge);
+			buffer[offset++] = ',';
+			status = format_gauge (buffer + offset,
+					buffer_len - offset,
+					"%lf", vl->values[i].gauge);
 		} 
 		else if (store_rates != 0)
 		{
 			if (rates == NULL)
-				rates = uc_get_rate (ds, vl);
+				rates = uc_get_rate_ref (ds, vl);
 			if (rates == NULL)
 			{
 				WARNING ("csv plugin: "
 						"uc_get_rate failed.");
 				return (-1);
 			}
-			status = ssnprintf (buffer + offset,
+			buffer[offset++] = ',';
+			status = format_gauge (buffer + offset,
 					buffer_len - offset,
-					",%lf", rates[i]);
+					"%lf", rates[i]);
 		}
 		else if (ds->ds[i].type == DS_TYPE_COUNTER)
 		{
@@ -110,19 +141,42 @@ static int value_list_to_string (char *buffer, int buffer_len,
 
 		if ((status < 1) || (status >= (buffer_len - offset)))
 		{
-			sfree (rates);
+			uc_release_rate_ref (vl, rates);
 			return (-1);
 		}
 
 		offset += status;
 	} /* for ds->ds_num */
 
-	sfree (rates);
+	uc_release_rate_ref (vl, rates);
 	return (0);
 } /* int value_list_to_string */
 
+/* Returns the current date as appended to the file names. */
+static int csv_date (char *buffer, size_t buffer_size)
+{
+	time_t now;
+	struct tm stm;
+
+	buffer[0] = 0;
+	if (use_stdio)
+		return (0);
+
+	/* TODO: Find a way to minimize the calls to `localtime_r',
+	 * since they are pretty expensive.. */
+	now = time (NULL);
+	if (localtime_r (&now, &stm) == NULL)
+	{
+		ERROR ("csv plugin: localtime_r failed");
+		return (1);
+	}
+
+	strftime (buffer, buffer_size, "-%Y-%m-%d", &stm);
+	return (0);
+} /* int csv_date */
+
 static int value_list_to_filename (char *buffer, int buffer_len,
-		const data_set_t *ds, const value_list_t *vl)
+		const data_set_t *ds, const value_list_t *vl, const char *date)
 {
 	int offset = 0;
 	int status;
@@ -164,23 +218,7 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 		return (-1);
 	offset += status;
 
-	if (!use_stdio)
-	{
-		time_t now;
-		struct tm stm;
-
-		/* TODO: Find a way to minimize the calls to `localtime_r',
-		 * since they are pretty expensive.. */
-		now = time (NULL);
-		if (localtime_r (&now, &stm) == NULL)
-		{
-			ERROR ("csv plugin: localtime_r failed");
-			return (1);
-		}
-
-		strftime (buffer + offset, buffer_len - offset,
-				"-%Y-%m-%d", &stm);
-	}
+	sstrncpy (buffer + offset, date, buffer_len - offset);
 
 	return (0);
 } /* int value_list_to_filename */
@@ -213,6 +251,169 @@ static int csv_create_file (const char *filename, const data_set_t *ds)
 	return 0;
 } /* int csv_create_file */
 
+/* Opens "filename" for appending and locks it, creating it if necessary. */
+static FILE *csv_open (const char *filename, const data_set_t *ds)
+{
+	struct stat  statbuf;
+	FILE        *csv;
+	int          csv_fd;
+	struct flock fl;
+	int          status;
+
+	if (stat (filename, &statbuf) == -1)
+	{
+		if (errno == ENOENT)
+		{
+			if (csv_create_file (filename, ds))
+				return (NULL);
+		}
+		else
+		{
+			char errbuf[1024];
+			ERROR ("stat(%s) failed: %s", filename,
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return (NULL);
+		}
+	}
+	else if (!S_ISREG (statbuf.st_mode))
+	{
+		ERROR ("stat(%s): Not a regular file!",
+				filename);
+		return (NULL);
+	}
+
+	csv = fopen (filename, "a");
+	if (csv == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: fopen (%s) failed: %s", filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (NULL);
+	}
+	csv_fd = fileno (csv);
+
+	memset (&fl, '\0', sizeof (fl));
+	fl.l_start  = 0;
+	fl.l_len    = 0; /* till end of file */
+	fl.l_pid    = getpid ();
+	fl.l_type   = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	status = fcntl (csv_fd, F_SETLK, &fl);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: flock (%s) failed: %s", filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		fclose (csv);
+		return (NULL);
+	}
+
+	return (csv);
+} /* FILE *csv_open */
+
+/* XXX: You must hold "csv_files_lock" when calling the csv_files_* functions! */
+static void csv_files_unlink (csv_file_t *f)
+{
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		csv_files_head = f->next;
+
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		csv_files_tail = f->prev;
+
+	f->prev = NULL;
+	f->next = NULL;
+} /* void csv_files_unlink */
+
+static void csv_files_close (csv_file_t *f)
+{
+	c_htable_remove (csv_files, f->filename, NULL, NULL);
+	csv_files_unlink (f);
+	csv_files_num--;
+
+	/* The lock is implicitely released. */
+	fclose (f->fh);
+	sfree (f->filename);
+	sfree (f);
+} /* void csv_files_close */
+
+static void csv_files_close_all (void)
+{
+	while (csv_files_head != NULL)
+		csv_files_close (csv_files_head);
+} /* void csv_files_close_all */
+
+/* Returns the open file "filename", opening it if necessary and closing the
+ * least recently used file if there are too many open files. */
+static FILE *csv_files_get (const char *filename, const data_set_t *ds)
+{
+	csv_file_t *f = NULL;
+
+	if (csv_files == NULL)
+	{
+		csv_files = c_htable_create ();
+		if (csv_files == NULL)
+			return (NULL);
+	}
+
+	if (c_htable_get (csv_files, filename, (void *) &f) == 0)
+	{
+		if (f != csv_files_head)
+		{
+			csv_files_unlink (f);
+			f->next = csv_files_head;
+			csv_files_head->prev = f;
+			csv_files_head = f;
+		}
+		return (f->fh);
+	}
+
+	f = calloc (1, sizeof (*f));
+	if (f == NULL)
+		return (NULL);
+
+	f->filename = strdup (filename);
+	if (f->filename == NULL)
+	{
+		sfree (f);
+		return (NULL);
+	}
+
+	f->fh = csv_open (filename, ds);
+	if (f->fh == NULL)
+	{
+		sfree (f->filename);
+		sfree (f);
+		return (NULL);
+	}
+
+	if (c_htable_insert (csv_files, f->filename, f) != 0)
+	{
+		fclose (f->fh);
+		sfree (f->filename);
+		sfree (f);
+		return (NULL);
+	}
+
+	f->next = csv_files_head;
+	if (csv_files_head != NULL)
+		csv_files_head->prev = f;
+	csv_files_head = f;
+	if (csv_files_tail == NULL)
+		csv_files_tail = f;
+	csv_files_num++;
+
+	while ((csv_files_num > csv_files_max) && (csv_files_tail != f))
+		csv_files_close (csv_files_tail);
+
+	return (f->fh);
+} /* FILE *csv_files_get */
+
 static int csv_config (const char *key, const char *value)
 {
 	if (strcasecmp ("DataDir", key) == 0)
@@ -252,6 +453,16 @@ static int csv_config (const char *key, const char *value)
 		else
 			store_rates = 0;
 	}
+	else if (strcasecmp ("OpenFiles", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 0)
+		{
+			ERROR ("csv plugin: `OpenFiles' must not be negative.");
+			return (1);
+		}
+		csv_files_max = (size_t) tmp;
+	}
 	else
 	{
 		return (-1);
@@ -262,20 +473,21 @@ static int csv_config (const char *key, const char *value)
 static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	struct stat  statbuf;
 	char         filename[512];
 	char         values[4096];
+	char         date[16];
 	FILE        *csv;
-	int          csv_fd;
-	struct flock fl;
-	int          status;
 
 	if (0 != strcmp (ds->type, vl->type)) {
 		ERROR ("csv plugin: DS type does not match value list type");
 		return -1;
 	}
 
-	if (value_list_to_filename (filename, sizeof (filename), ds, vl) != 0)
+	if (csv_date (date, sizeof (date)) != 0)
+		return (-1);
+
+	if (value_list_to_filename (filename, sizeof (filename), ds, vl,
+				date) != 0)
 		return (-1);
 
 	DEBUG ("csv plugin: csv_write: filename = %s;", filename);
@@ -306,55 +518,31 @@ static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		return (0);
 	}
 
-	if (stat (filename, &statbuf) == -1)
+	if (csv_files_max > 0)
 	{
-		if (errno == ENOENT)
+		pthread_mutex_lock (&csv_files_lock);
+
+		if (strcmp (date, csv_files_date) != 0)
 		{
-			if (csv_create_file (filename, ds))
-				return (-1);
+			csv_files_close_all ();
+			sstrncpy (csv_files_date, date, sizeof (csv_files_date));
 		}
-		else
+
+		csv = csv_files_get (filename, ds);
+		if (csv == NULL)
 		{
-			char errbuf[1024];
-			ERROR ("stat(%s) failed: %s", filename,
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
+			pthread_mutex_unlock (&csv_files_lock);
 			return (-1);
 		}
-	}
-	else if (!S_ISREG (statbuf.st_mode))
-	{
-		ERROR ("stat(%s): Not a regular file!",
-				filename);
-		return (-1);
-	}
 
-	csv = fopen (filename, "a");
-	if (csv == NULL)
-	{
-		char errbuf[1024];
-		ERROR ("csv plugin: fopen (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
+		fprintf (csv, "%s\n", values);
+		pthread_mutex_unlock (&csv_files_lock);
+		return (0);
 	}
-	csv_fd = fileno (csv);
-
-	memset (&fl, '\0', sizeof (fl));
-	fl.l_start  = 0;
-	fl.l_len    = 0; /* till end of file */
-	fl.l_pid    = getpid ();
-	fl.l_type   = F_WRLCK;
-	fl.l_whence = SEEK_SET;
 
-	status = fcntl (csv_fd, F_SETLK, &fl);
-	if (status != 0)
-	{
-		char errbuf[1024];
-		ERROR ("csv plugin: flock (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (csv);
+	csv = csv_open (filename, ds);
+	if (csv == NULL)
 		return (-1);
-	}
 
 	fprintf (csv, "%s\n", values);
 
@@ -365,9 +553,37 @@ static int csv_write (const data_set_t *ds, const value_list_t *vl,
 	return (0);
 } /* int csv_write */
 
+static int csv_flush (cdtime_t __attribute__((unused)) timeout,
+		const char __attribute__((unused)) *identifier,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	csv_file_t *f;
+
+	pthread_mutex_lock (&csv_files_lock);
+	for (f = csv_files_head; f != NULL; f = f->next)
+		fflush (f->fh);
+	pthread_mutex_unlock (&csv_files_lock);
+
+	return (0);
+} /* int csv_flush */
+
+static int csv_shutdown (void)
+{
+	pthread_mutex_lock (&csv_files_lock);
+	csv_files_close_all ();
+	if (csv_files != NULL)
+		c_htable_destroy (csv_files);
+	csv_files = NULL;
+	pthread_mutex_unlock (&csv_files_lock);
+
+	return (0);
+} /* int csv_shutdown */
+
 void module_register (void)
 {
 	plugin_register_config ("csv", csv_config,
 			config_keys, config_keys_num);
 	plugin_register_write ("csv", csv_write, /* user_data = */ NULL);
+	plugin_register_flush ("csv", csv_flush, /* user_data = */ NULL);
+	plugin_register_shutdown ("csv", csv_shutdown);
 } /* void module_register */
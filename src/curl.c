@@ -26,6 +26,7 @@
 #include "plugin.h"
 #include "configfile.h"
 #include "utils_match.h"
+#include "utils_curl_multi.h"
 
 #include <curl/curl.h>
 
@@ -76,9 +77,12 @@ struct web_page_s /* {{{ */
 /*
  * Global variables;
  */
-/* static CURLM *curl = NULL; */
 static web_page_t *pages_g = NULL;
 
+/* Interval of the read callback, for values dispatched by the fetch
+ * thread. */
+static cdtime_t read_interval_g = 0;
+
 /*
  * Private functions
  */
@@ -542,6 +546,11 @@ static int cc_config (oconfig_item_t *ci) /* {{{ */
       else
         errors++;
     }
+    else if ((status = ucm_config (child)) <= 0)
+    {
+      if (status != 0)
+        errors++;
+    }
     else
     {
       WARNING ("curl plugin: Option `%s' not allowed here.", child->key);
@@ -583,6 +592,7 @@ static void cc_submit (const web_page_t *wp, const web_match_t *wm, /* {{{ */
   sstrncpy (vl.plugin_instance, wp->instance, sizeof (vl.plugin_instance));
   sstrncpy (vl.type, wm->type, sizeof (vl.type));
   sstrncpy (vl.type_instance, wm->instance, sizeof (vl.type_instance));
+  vl.interval = read_interval_g;
 
   plugin_dispatch_values (&vl);
 } /* }}} void cc_submit */
@@ -600,43 +610,41 @@ static void cc_submit_response_time (const web_page_t *wp, double seconds) /* {{
   sstrncpy (vl.plugin, "curl", sizeof (vl.plugin));
   sstrncpy (vl.plugin_instance, wp->instance, sizeof (vl.plugin_instance));
   sstrncpy (vl.type, "response_time", sizeof (vl.type));
+  vl.interval = read_interval_g;
 
   plugin_dispatch_values (&vl);
 } /* }}} void cc_submit_response_time */
 
-static int cc_read_page (web_page_t *wp) /* {{{ */
+/* Called by the fetch thread when the transfer has finished. */
+static void cc_page_done (CURL *curl, CURLcode status, /* {{{ */
+    void *user_data)
 {
+  web_page_t *wp = user_data;
   web_match_t *wm;
-  int status;
-  struct timeval start, end;
-
-  if (wp->response_time)
-    gettimeofday (&start, NULL);
 
-  wp->buffer_fill = 0;
-  status = curl_easy_perform (wp->curl);
-  if (status != 0)
+  if (status != CURLE_OK)
   {
-    ERROR ("curl plugin: curl_easy_perform failed with staus %i: %s",
-        status, wp->curl_errbuf);
-    return (-1);
+    if (status != CURLE_ABORTED_BY_CALLBACK)
+      ERROR ("curl plugin: curl_easy_perform failed with staus %i: %s",
+          (int) status, wp->curl_errbuf);
+    wp->buffer_fill = 0;
+    return;
   }
 
   if (wp->response_time)
   {
+    /* Measured by libcurl, so the time the request waited for the fetch
+     * thread doesn't count. */
     double secs = 0;
-    gettimeofday (&end, NULL);
-    secs += end.tv_sec - start.tv_sec;
-    secs += (end.tv_usec - start.tv_usec) / 1000000.0;
+    curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME, &secs);
     cc_submit_response_time (wp, secs);
   }
 
-  for (wm = wp->matches; wm != NULL; wm = wm->next)
+  for (wm = wp->matches; (wm != NULL) && (wp->buffer != NULL); wm = wm->next)
   {
     cu_match_value_t *mv;
 
-    status = match_apply (wm->match, wp->buffer);
-    if (status != 0)
+    if (match_apply (wm->match, wp->buffer) != 0)
     {
       WARNING ("curl plugin: match_apply failed.");
       continue;
@@ -652,13 +660,41 @@ static int cc_read_page (web_page_t *wp) /* {{{ */
     cc_submit (wp, wm, mv);
   } /* for (wm = wp->matches; wm != NULL; wm = wm->next) */
 
+  /* Reset here rather than in cc_read_page, which doesn't know whether a
+   * transfer is still running. */
+  wp->buffer_fill = 0;
+} /* }}} void cc_page_done */
+
+static int cc_read_page (web_page_t *wp) /* {{{ */
+{
+  int status;
+
+  status = ucm_submit (wp->curl, wp->url, cc_page_done, wp);
+  if (status == EBUSY)
+  {
+    WARNING ("curl plugin: The previous request for page \"%s\" is "
+        "still in progress. Skipping this interval.", wp->instance);
+    return (-1);
+  }
+  else if (status != 0)
+  {
+    ERROR ("curl plugin: ucm_submit failed with status %i.", status);
+    return (-1);
+  }
+
   return (0);
 } /* }}} int cc_read_page */
 
+/* Starts the transfers of all pages. The values are dispatched by the fetch
+ * threads as the responses come in. */
 static int cc_read (void) /* {{{ */
 {
   web_page_t *wp;
 
+  /* Only set by the first read, before any transfer can be running. */
+  if (read_interval_g == 0)
+    read_interval_g = plugin_get_interval ();
+
   for (wp = pages_g; wp != NULL; wp = wp->next)
     cc_read_page (wp);
 
@@ -667,6 +703,8 @@ static int cc_read (void) /* {{{ */
 
 static int cc_shutdown (void) /* {{{ */
 {
+  ucm_shutdown ();
+
   cc_web_page_free (pages_g);
   pages_g = NULL;
 
@@ -25,8 +25,10 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
-#include "utils_avltree.h"
 #include "utils_complain.h"
+#include "utils_htable.h"
+
+#include "utils_curl_multi.h"
 
 #include <curl/curl.h>
 #include <yajl/yajl_parse.h>
@@ -40,18 +42,41 @@
 
 #define CJ_DEFAULT_HOST "localhost"
 #define CJ_KEY_MAGIC 0x43484b59UL /* CHKY */
+#define CJ_TREE_MAGIC 0x43485452UL /* CHTR */
 #define CJ_IS_KEY(key) ((key)->magic == CJ_KEY_MAGIC)
 #define CJ_ANY "*"
 #define COUCH_MIN(x,y) ((x) < (y) ? (x) : (y))
 
+/* Number of values collected before they are dispatched. */
+#define CJ_BATCH_SIZE 64
+
+/* Keys and trees both start with their magic, so that an entry of a tree can
+ * be told apart with CJ_IS_KEY. */
 struct cj_key_s;
 typedef struct cj_key_s cj_key_t;
 struct cj_key_s /* {{{ */
 {
+  unsigned long magic;
   char *path;
   char *type;
   char *instance;
+  /* Data source type of `type', looked up on first use. */
+  int ds_type;
+};
+/* }}} */
+
+/* One level of the configured key paths, e.g. "requests" for the paths
+ * "httpd/requests/count" and "httpd/requests/current". Each entry is either
+ * a key or another tree. */
+struct cj_tree_s;
+typedef struct cj_tree_s cj_tree_t;
+struct cj_tree_s /* {{{ */
+{
   unsigned long magic;
+  c_htable_t *entries;
+  /* The entry for CJ_ANY, so that names which are not configured need a
+   * single lookup. */
+  void *any;
 };
 /* }}} */
 
@@ -70,18 +95,30 @@ struct cj_s /* {{{ */
 
   CURL *curl;
   char curl_errbuf[CURL_ERROR_SIZE];
+  /* Interval of the read callback, for values dispatched by the fetch
+   * thread. */
+  cdtime_t interval;
 
   yajl_handle yajl;
-  c_avl_tree_t *tree;
+  cj_tree_t *tree;
   cj_key_t *key;
   int depth;
   struct {
     union {
-      c_avl_tree_t *tree;
+      cj_tree_t *tree;
       cj_key_t *key;
     };
     char name[DATA_MAX_NAME_LEN];
   } state[YAJL_MAX_DEPTH];
+
+  /* Values found in the current document, dispatched with
+   * plugin_dispatch_values_multi once the batch is full. */
+  struct {
+    char type_instance[DATA_MAX_NAME_LEN];
+    value_t value;
+  } batch[CJ_BATCH_SIZE];
+  plugin_value_entry_t batch_entries[CJ_BATCH_SIZE];
+  size_t batch_num;
 };
 typedef struct cj_s cj_t; /* }}} */
 
@@ -92,8 +129,9 @@ typedef unsigned int yajl_len_t;
 #endif
 
 static int cj_read (user_data_t *ud);
-static int cj_curl_perform (cj_t *db, CURL *curl);
+static int cj_curl_start (cj_t *db);
 static void cj_submit (cj_t *db, cj_key_t *key, value_t *value);
+static void cj_flush (cj_t *db);
 
 static size_t cj_curl_callback (void *buf, /* {{{ */
     size_t size, size_t nmemb, void *user_data)
@@ -111,16 +149,14 @@ static size_t cj_curl_callback (void *buf, /* {{{ */
   if (db == NULL)
     return (0);
 
+  if ((db->yajl == NULL) && (cj_curl_start (db) != 0))
+    return (0);
+
+  /* The document is completed in cj_curl_done. Doing so here would fail
+   * for documents spanning more than one chunk. */
   status = yajl_parse(db->yajl, (unsigned char *) buf, len);
   if (status == yajl_status_ok)
-  {
-#if HAVE_YAJL_V2
-    status = yajl_complete_parse(db->yajl);
-#else
-    status = yajl_parse_complete(db->yajl);
-#endif
     return (len);
-  }
 #if !HAVE_YAJL_V2
   else if (status == yajl_status_insufficient_data)
     return (len);
@@ -143,6 +179,9 @@ static int cj_get_type (cj_key_t *key)
 {
   const data_set_t *ds;
 
+  if (key->ds_type >= 0)
+    return (key->ds_type);
+
   ds = plugin_get_ds (key->type);
   if (ds == NULL)
   {
@@ -169,6 +208,7 @@ static int cj_get_type (cj_key_t *key)
         key->type);
   }
 
+  key->ds_type = ds->ds[0].type;
   return ds->ds[0].type;
 }
 
@@ -207,30 +247,38 @@ static int cj_cb_number (void *ctx,
   return (CJ_CB_CONTINUE);
 } /* int cj_cb_number */
 
+static void *cj_tree_lookup (cj_tree_t *tree, const char *name) /* {{{ */
+{
+  void *value;
+
+  if (c_htable_get (tree->entries, name, &value) == 0)
+    return (value);
+
+  return (tree->any);
+} /* }}} void *cj_tree_lookup */
+
 static int cj_cb_map_key (void *ctx, const unsigned char *val,
     yajl_len_t len)
 {
   cj_t *db = (cj_t *)ctx;
-  c_avl_tree_t *tree;
+  cj_tree_t *tree;
+  char *name;
 
   tree = db->state[db->depth-1].tree;
 
-  if (tree != NULL)
+  /* Maps which are not configured, or where a value is expected, are
+   * skipped without copying or looking up any of their keys. */
+  if ((tree == NULL) || CJ_IS_KEY (tree))
   {
-    cj_key_t *value;
-    char *name;
+    db->state[db->depth].key = NULL;
+    return (CJ_CB_CONTINUE);
+  }
 
-    name = db->state[db->depth].name;
-    len = COUCH_MIN(len, sizeof (db->state[db->depth].name)-1);
-    sstrncpy (name, (char *)val, len+1);
+  name = db->state[db->depth].name;
+  len = COUCH_MIN(len, sizeof (db->state[db->depth].name)-1);
+  sstrncpy (name, (char *)val, len+1);
 
-    if (c_avl_get (tree, name, (void *) &value) == 0)
-      db->state[db->depth].key = value;
-    else if (c_avl_get (tree, CJ_ANY, (void *) &value) == 0)
-      db->state[db->depth].key = value;
-    else
-      db->state[db->depth].key = NULL;
-  }
+  db->state[db->depth].key = cj_tree_lookup (tree, name);
 
   return (CJ_CB_CONTINUE);
 }
@@ -239,11 +287,6 @@ static int cj_cb_string (void *ctx, const unsigned char *val,
     yajl_len_t len)
 {
   cj_t *db = (cj_t *)ctx;
-  char str[len + 1];
-
-  /* Create a null-terminated version of the string. */
-  memcpy (str, val, len);
-  str[len] = 0;
 
   /* No configuration for this string -> simply return. */
   if (db->state[db->depth].key == NULL)
@@ -251,6 +294,12 @@ static int cj_cb_string (void *ctx, const unsigned char *val,
 
   if (!CJ_IS_KEY (db->state[db->depth].key))
   {
+    char str[len + 1];
+
+    /* Create a null-terminated version of the string. */
+    memcpy (str, val, len);
+    str[len] = 0;
+
     NOTICE ("curl_json plugin: Found string \"%s\", but the configuration "
         "expects a map here.", str);
     return (CJ_CB_CONTINUE);
@@ -327,24 +376,25 @@ static void cj_key_free (cj_key_t *key) /* {{{ */
   sfree (key);
 } /* }}} void cj_key_free */
 
-static void cj_tree_free (c_avl_tree_t *tree) /* {{{ */
+static void cj_tree_free (cj_tree_t *tree) /* {{{ */
 {
   char *name;
   void *value;
 
-  while (c_avl_pick (tree, (void *) &name, (void *) &value) == 0)
+  while (c_htable_pick (tree->entries, (void *) &name, (void *) &value) == 0)
   {
     cj_key_t *key = (cj_key_t *)value;
 
     if (CJ_IS_KEY(key))
       cj_key_free (key);
     else
-      cj_tree_free ((c_avl_tree_t *)value);
+      cj_tree_free ((cj_tree_t *)value);
 
     sfree (name);
   }
 
-  c_avl_destroy (tree);
+  c_htable_destroy (tree->entries);
+  sfree (tree);
 } /* }}} void cj_tree_free */
 
 static void cj_free (void *arg) /* {{{ */
@@ -378,12 +428,59 @@ static void cj_free (void *arg) /* {{{ */
   sfree (db);
 } /* }}} void cj_free */
 
+/* Frees the user data of a read callback. Those are freed before the shutdown
+ * callbacks are called, so the transfers still using it are aborted here.
+ * Blocks failing their configuration have never been submitted and must not
+ * stop the other blocks' transfers. */
+static void cj_read_free (void *arg) /* {{{ */
+{
+  ucm_shutdown ();
+  cj_free (arg);
+} /* }}} void cj_read_free */
+
 /* Configuration handling functions {{{ */
 
-static c_avl_tree_t *cj_avl_create(void)
+static cj_tree_t *cj_tree_create (void) /* {{{ */
 {
-  return c_avl_create ((int (*) (const void *, const void *)) strcmp);
-}
+  cj_tree_t *tree;
+
+  tree = calloc (1, sizeof (*tree));
+  if (tree == NULL)
+    return (NULL);
+  tree->magic = CJ_TREE_MAGIC;
+
+  tree->entries = c_htable_create ();
+  if (tree->entries == NULL)
+  {
+    sfree (tree);
+    return (NULL);
+  }
+
+  return (tree);
+} /* }}} cj_tree_t *cj_tree_create */
+
+static int cj_tree_insert (cj_tree_t *tree, const char *name, /* {{{ */
+    void *value)
+{
+  char *key;
+  int status;
+
+  key = strdup (name);
+  if (key == NULL)
+    return (-1);
+
+  status = c_htable_insert (tree->entries, key, value);
+  if (status != 0)
+  {
+    sfree (key);
+    return (status);
+  }
+
+  if (strcmp (CJ_ANY, name) == 0)
+    tree->any = value;
+
+  return (0);
+} /* }}} int cj_tree_insert */
 
 static int cj_config_add_key (cj_t *db, /* {{{ */
                                    oconfig_item_t *ci)
@@ -408,6 +505,7 @@ static int cj_config_add_key (cj_t *db, /* {{{ */
   }
   memset (key, 0, sizeof (*key));
   key->magic = CJ_KEY_MAGIC;
+  key->ds_type = -1;
 
   if (strcasecmp ("Key", ci->key) == 0)
   {
@@ -465,10 +563,16 @@ static int cj_config_add_key (cj_t *db, /* {{{ */
     char *ptr;
     char *name;
     char ent[PATH_MAX];
-    c_avl_tree_t *tree;
+    cj_tree_t *tree;
 
     if (db->tree == NULL)
-      db->tree = cj_avl_create();
+      db->tree = cj_tree_create ();
+    if (db->tree == NULL)
+    {
+      ERROR ("curl_json plugin: cj_tree_create failed.");
+      cj_key_free (key);
+      return (-1);
+    }
 
     tree = db->tree;
     name = key->path;
@@ -481,7 +585,7 @@ static int cj_config_add_key (cj_t *db, /* {{{ */
     {
       if (*ptr == '/')
       {
-        c_avl_tree_t *value;
+        cj_tree_t *value;
         int len;
 
         len = ptr-name;
@@ -489,10 +593,23 @@ static int cj_config_add_key (cj_t *db, /* {{{ */
           break;
         sstrncpy (ent, name, len+1);
 
-        if (c_avl_get (tree, ent, (void *) &value) != 0)
+        if (c_htable_get (tree->entries, ent, (void *) &value) != 0)
         {
-          value = cj_avl_create ();
-          c_avl_insert (tree, strdup (ent), value);
+          value = cj_tree_create ();
+          if ((value != NULL) && (cj_tree_insert (tree, ent, value) != 0))
+          {
+            cj_tree_free (value);
+            value = NULL;
+          }
+        }
+        else if (CJ_IS_KEY (value))
+          value = NULL;
+
+        /* A key can't be continued by another path. */
+        if (value == NULL)
+        {
+          tree = NULL;
+          break;
         }
 
         tree = value;
@@ -500,15 +617,17 @@ static int cj_config_add_key (cj_t *db, /* {{{ */
       }
       ++ptr;
     }
-    if (*name)
-      c_avl_insert (tree, strdup(name), key);
-    else
+    if ((tree == NULL) || (*name == 0)
+        || (cj_tree_insert (tree, name, key) != 0))
     {
       ERROR ("curl_json plugin: invalid key: %s", key->path);
       status = -1;
     }
   }
 
+  if (status != 0)
+    cj_key_free (key);
+
   return (status);
 } /* }}} int cj_config_add_key */
 
@@ -653,7 +772,7 @@ static int cj_config_add_url (oconfig_item_t *ci) /* {{{ */
 
     memset (&ud, 0, sizeof (ud));
     ud.data = (void *) db;
-    ud.free_func = cj_free;
+    ud.free_func = cj_read_free;
 
     ssnprintf (cb_name, sizeof (cb_name), "curl_json-%s-%s",
                db->instance, db->url);
@@ -693,6 +812,11 @@ static int cj_config (oconfig_item_t *ci) /* {{{ */
       else
         errors++;
     }
+    else if ((status = ucm_config (child)) <= 0)
+    {
+      if (status != 0)
+        errors++;
+    }
     else
     {
       WARNING ("curl_json plugin: Option `%s' not allowed here.", child->key);
@@ -711,46 +835,75 @@ static int cj_config (oconfig_item_t *ci) /* {{{ */
 
 /* }}} End of configuration handling functions */
 
+/* Adds a value to the batch, dispatching the batch first if it is full. */
 static void cj_submit (cj_t *db, cj_key_t *key, value_t *value) /* {{{ */
 {
-  value_list_t vl = VALUE_LIST_INIT;
-  char *host;
+  plugin_value_entry_t *entry;
+  char *type_instance;
+  size_t type_instance_size;
 
-  vl.values     = value;
-  vl.values_len = 1;
+  if (db->batch_num >= CJ_BATCH_SIZE)
+    cj_flush (db);
 
-  if ((db->host == NULL)
-      || (strcmp ("", db->host) == 0)
-      || (strcmp (CJ_DEFAULT_HOST, db->host) == 0))
-    host = hostname_g;
-  else
-    host = db->host;
+  type_instance = db->batch[db->batch_num].type_instance;
+  type_instance_size = sizeof (db->batch[db->batch_num].type_instance);
 
   if (key->instance == NULL)
   {
     if ((db->depth == 0) || (strcmp ("", db->state[db->depth-1].name) == 0))
-      sstrncpy (vl.type_instance, db->state[db->depth].name, sizeof (vl.type_instance));
+      sstrncpy (type_instance, db->state[db->depth].name, type_instance_size);
     else
-      ssnprintf (vl.type_instance, sizeof (vl.type_instance), "%s-%s",
+      ssnprintf (type_instance, type_instance_size, "%s-%s",
           db->state[db->depth-1].name, db->state[db->depth].name);
   }
   else
-    sstrncpy (vl.type_instance, key->instance, sizeof (vl.type_instance));
+    sstrncpy (type_instance, key->instance, type_instance_size);
+
+  db->batch[db->batch_num].value = *value;
+
+  entry = db->batch_entries + db->batch_num;
+  entry->type = key->type;
+  entry->type_instance = type_instance;
+  entry->values = &db->batch[db->batch_num].value;
+  entry->values_len = 1;
+
+  db->batch_num++;
+} /* }}} void cj_submit */
+
+static void cj_flush (cj_t *db) /* {{{ */
+{
+  value_list_t vl = VALUE_LIST_INIT;
+  char *host;
+
+  if (db->batch_num == 0)
+    return;
+
+  if ((db->host == NULL)
+      || (strcmp ("", db->host) == 0)
+      || (strcmp (CJ_DEFAULT_HOST, db->host) == 0))
+    host = hostname_g;
+  else
+    host = db->host;
 
   sstrncpy (vl.host, host, sizeof (vl.host));
   sstrncpy (vl.plugin, "curl_json", sizeof (vl.plugin));
   sstrncpy (vl.plugin_instance, db->instance, sizeof (vl.plugin_instance));
-  sstrncpy (vl.type, key->type, sizeof (vl.type));
+  vl.interval = db->interval;
 
-  plugin_dispatch_values (&vl);
-} /* }}} int cj_submit */
+  plugin_dispatch_values_multi (&vl, db->batch_entries, db->batch_num);
+  db->batch_num = 0;
+} /* }}} void cj_flush */
 
-static int cj_curl_perform (cj_t *db, CURL *curl) /* {{{ */
+/* Sets up the parser for a new document. Called by the fetch thread when
+ * the first data arrives, so the read callback never touches the parser
+ * state while a transfer may be in progress. */
+static int cj_curl_start (cj_t *db) /* {{{ */
 {
-  int status;
-  long rc;
-  char *url;
-  yajl_handle yprev = db->yajl;
+  db->depth = 0;
+  memset (&db->state, 0, sizeof(db->state));
+  db->state[db->depth].tree = db->tree;
+  db->key = NULL;
+  db->batch_num = 0;
 
   db->yajl = yajl_alloc (&ycallbacks,
 #if HAVE_YAJL_V2
@@ -762,62 +915,74 @@ static int cj_curl_perform (cj_t *db, CURL *curl) /* {{{ */
   if (db->yajl == NULL)
   {
     ERROR ("curl_json plugin: yajl_alloc failed.");
-    db->yajl = yprev;
     return (-1);
   }
 
+  return (0);
+} /* }}} int cj_curl_start */
+
+/* Called by the fetch thread when the transfer has finished. */
+static void cj_curl_done (CURL *curl, CURLcode status, /* {{{ */
+    void *user_data)
+{
+  cj_t *db = user_data;
+  yajl_status ystatus;
+  long rc;
+  char *url;
+
   url = NULL;
   curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
 
-  status = curl_easy_perform (curl);
-  if (status != 0)
+  if (status != CURLE_OK)
   {
-    ERROR ("curl_json plugin: curl_easy_perform failed with status %i: %s (%s)",
-           status, db->curl_errbuf, (url != NULL) ? url : "<null>");
-    yajl_free (db->yajl);
-    db->yajl = yprev;
-    return (-1);
+    if (status != CURLE_ABORTED_BY_CALLBACK)
+      ERROR ("curl_json plugin: curl_easy_perform failed with status %i: %s (%s)",
+             (int) status, db->curl_errbuf, (url != NULL) ? url : "<null>");
   }
-
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rc);
-
-  /* The response code is zero if a non-HTTP transport was used. */
-  if ((rc != 0) && (rc != 200))
+  else
   {
-    ERROR ("curl_json plugin: curl_easy_perform failed with "
-        "response code %ld (%s)", rc, url);
-    yajl_free (db->yajl);
-    db->yajl = yprev;
-    return (-1);
-  }
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rc);
 
+    /* The response code is zero if a non-HTTP transport was used. */
+    if ((rc != 0) && (rc != 200))
+      ERROR ("curl_json plugin: curl_easy_perform failed with "
+          "response code %ld (%s)", rc, url);
+    else if ((db->yajl == NULL) && (cj_curl_start (db) != 0))
+      /* yajl_alloc failed */;
+    else
+    {
 #if HAVE_YAJL_V2
-    status = yajl_complete_parse(db->yajl);
+      ystatus = yajl_complete_parse(db->yajl);
 #else
-    status = yajl_parse_complete(db->yajl);
+      ystatus = yajl_parse_complete(db->yajl);
 #endif
-  if (status != yajl_status_ok)
-  {
-    unsigned char *errmsg;
+      if (ystatus != yajl_status_ok)
+      {
+        unsigned char *errmsg;
 
-    errmsg = yajl_get_error (db->yajl, /* verbose = */ 0,
-        /* jsonText = */ NULL, /* jsonTextLen = */ 0);
-    ERROR ("curl_json plugin: yajl_parse_complete failed: %s",
-        (char *) errmsg);
-    yajl_free_error (db->yajl, errmsg);
-    yajl_free (db->yajl);
-    db->yajl = yprev;
-    return (-1);
+        errmsg = yajl_get_error (db->yajl, /* verbose = */ 0,
+            /* jsonText = */ NULL, /* jsonTextLen = */ 0);
+        ERROR ("curl_json plugin: yajl_parse_complete failed: %s",
+            (char *) errmsg);
+        yajl_free_error (db->yajl, errmsg);
+      }
+    }
   }
 
-  yajl_free (db->yajl);
-  db->yajl = yprev;
-  return (0);
-} /* }}} int cj_curl_perform */
+  /* Values found before an error are dispatched, too. */
+  if (status != CURLE_ABORTED_BY_CALLBACK)
+    cj_flush (db);
+  db->batch_num = 0;
+
+  if (db->yajl != NULL)
+    yajl_free (db->yajl);
+  db->yajl = NULL;
+} /* }}} void cj_curl_done */
 
 static int cj_read (user_data_t *ud) /* {{{ */
 {
   cj_t *db;
+  int status;
 
   if ((ud == NULL) || (ud->data == NULL))
   {
@@ -827,12 +992,24 @@ static int cj_read (user_data_t *ud) /* {{{ */
 
   db = (cj_t *) ud->data;
 
-  db->depth = 0;
-  memset (&db->state, 0, sizeof(db->state));
-  db->state[db->depth].tree = db->tree;
-  db->key = NULL;
+  /* Only set by the first read, before any transfer can be running. */
+  if (db->interval == 0)
+    db->interval = plugin_get_interval ();
 
-  return cj_curl_perform (db, db->curl);
+  status = ucm_submit (db->curl, db->url, cj_curl_done, db);
+  if (status == EBUSY)
+  {
+    WARNING ("curl_json plugin: The previous request for %s is still "
+        "in progress. Skipping this interval.", db->url);
+    return (-1);
+  }
+  else if (status != 0)
+  {
+    ERROR ("curl_json plugin: ucm_submit failed with status %i.", status);
+    return (-1);
+  }
+
+  return (0);
 } /* }}} int cj_read */
 
 void module_register (void)
@@ -24,6 +24,8 @@
 #include "plugin.h"
 #include "configfile.h"
 #include "utils_llist.h"
+#include "utils_curl_multi.h"
+#include "utils_xml_stream.h"
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -40,6 +42,11 @@ struct cx_values_s /* {{{ */
 {
   char path[DATA_MAX_NAME_LEN];
   size_t path_len;
+
+  /* Streaming mode: the text found for `path' in the current node and the
+   * number of times it was found. */
+  char text[DATA_MAX_NAME_LEN];
+  int found;
 };
 typedef struct cx_values_s cx_values_t;
 /* }}} */
@@ -54,6 +61,13 @@ struct cx_xpath_s /* {{{ */
   char *instance;
   int is_table;
   unsigned long magic;
+
+  /* Streaming mode: `path' as absolute path, the depth of the node it
+   * currently matches (zero if none) and the number of matching nodes. */
+  char *stream_path;
+  int depth;
+  int matches;
+  cx_values_t stream_instance;
 };
 typedef struct cx_xpath_s cx_xpath_t;
 /* }}} */
@@ -76,6 +90,13 @@ struct cx_s /* {{{ */
   char *buffer;
   size_t buffer_size;
   size_t buffer_fill;
+  /* Interval of the read callback, for values dispatched by the fetch
+   * thread. */
+  cdtime_t interval;
+
+  /* Set if the response is parsed while it's being downloaded. */
+  _Bool streaming;
+  uxs_t *parser;
 
   llist_t *list; /* list of xpath blocks */
 };
@@ -101,6 +122,18 @@ static size_t cx_curl_callback (void *buf, /* {{{ */
    if (len <= 0)
     return (len);
 
+  if (db->parser != NULL)
+  {
+    long rc = 0;
+
+    /* Error pages are not parsed, cx_curl_done reports the response code.
+     * On parse errors, the transfer is aborted. */
+    curl_easy_getinfo (db->curl, CURLINFO_RESPONSE_CODE, &rc);
+    if ((rc != 0) && (rc != 200))
+      return (len);
+    return ((uxs_feed (db->parser, buf, len) == 0) ? len : 0);
+  }
+
   if ((db->buffer_fill + len) >= db->buffer_size)
   {
     char *temp;
@@ -133,6 +166,7 @@ static void cx_xpath_free (cx_xpath_t *xpath) /* {{{ */
   sfree (xpath->instance_prefix);
   sfree (xpath->instance);
   sfree (xpath->values);
+  sfree (xpath->stream_path);
   sfree (xpath);
 } /* }}} void cx_xpath_free */
 
@@ -172,6 +206,9 @@ static void cx_free (void *arg) /* {{{ */
     curl_easy_cleanup (db->curl);
   db->curl = NULL;
 
+  uxs_destroy (db->parser);
+  db->parser = NULL;
+
   if (db->list != NULL)
     cx_list_free (db->list);
 
@@ -188,6 +225,16 @@ static void cx_free (void *arg) /* {{{ */
   sfree (db);
 } /* }}} void cx_free */
 
+/* Frees the user data of a read callback. Those are freed before the shutdown
+ * callbacks are called, so the transfers still using it are aborted here.
+ * Blocks failing their configuration have never been submitted and must not
+ * stop the other blocks' transfers. */
+static void cx_read_free (void *arg) /* {{{ */
+{
+  ucm_shutdown ();
+  cx_free (arg);
+} /* }}} void cx_read_free */
+
 static int cx_check_type (const data_set_t *ds, cx_xpath_t *xpath) /* {{{ */
 {
   if (!ds)
@@ -233,6 +280,29 @@ static int cx_if_not_text_node (xmlNodePtr node) /* {{{ */
   return -1;
 } /* }}} cx_if_not_text_node */
 
+static void cx_parse_value (const char *str, int ds_type, /* {{{ */
+    value_t *ret_value)
+{
+  switch (ds_type)
+  {
+    case DS_TYPE_COUNTER:
+      ret_value->counter = (counter_t) strtoull (str,
+          /* endptr = */ NULL, /* base = */ 0);
+      break;
+    case DS_TYPE_DERIVE:
+      ret_value->derive = (derive_t) strtoll (str,
+          /* endptr = */ NULL, /* base = */ 0);
+      break;
+    case DS_TYPE_ABSOLUTE:
+      ret_value->absolute = (absolute_t) strtoull (str,
+          /* endptr = */ NULL, /* base = */ 0);
+      break;
+    case DS_TYPE_GAUGE: 
+      ret_value->gauge = (gauge_t) strtod (str,
+          /* endptr = */ NULL);
+  }
+} /* }}} void cx_parse_value */
+
 static int cx_handle_single_value_xpath (xmlXPathContextPtr xpath_ctx, /* {{{ */
     cx_xpath_t *xpath,
     const data_set_t *ds, value_list_t *vl, int index)
@@ -279,24 +349,7 @@ static int cx_handle_single_value_xpath (xmlXPathContextPtr xpath_ctx, /* {{{ */
   }
 
   node_value = (char *) xmlNodeGetContent(values_node->nodeTab[0]);
-  switch (ds->ds[index].type)
-  {
-    case DS_TYPE_COUNTER:
-      vl->values[index].counter = (counter_t) strtoull (node_value,
-          /* endptr = */ NULL, /* base = */ 0);
-      break;
-    case DS_TYPE_DERIVE:
-      vl->values[index].derive = (derive_t) strtoll (node_value,
-          /* endptr = */ NULL, /* base = */ 0);
-      break;
-    case DS_TYPE_ABSOLUTE:
-      vl->values[index].absolute = (absolute_t) strtoull (node_value,
-          /* endptr = */ NULL, /* base = */ 0);
-      break;
-    case DS_TYPE_GAUGE: 
-      vl->values[index].gauge = (gauge_t) strtod (node_value,
-          /* endptr = */ NULL);
-  }
+  cx_parse_value (node_value, ds->ds[index].type, &vl->values[index]);
 
   /* free up object */
   xmlXPathFreeObject (values_node_obj);
@@ -420,7 +473,7 @@ static int cx_handle_instance_xpath (xmlXPathContextPtr xpath_ctx, /* {{{ */
 } /* }}} int cx_handle_instance_xpath */
 
 static int  cx_handle_base_xpath (char const *plugin_instance, /* {{{ */
-    char const *host,
+    char const *host, cdtime_t interval,
     xmlXPathContextPtr xpath_ctx, const data_set_t *ds, 
     char *base_xpath, cx_xpath_t *xpath)
 {
@@ -463,6 +516,7 @@ static int  cx_handle_base_xpath (char const *plugin_instance, /* {{{ */
   sstrncpy (vl.type, xpath->type, sizeof (vl.type));
   sstrncpy (vl.plugin, "curl_xml", sizeof (vl.plugin));
   sstrncpy (vl.host, (host != NULL) ? host : hostname_g, sizeof (vl.host));
+  vl.interval = interval;
   if (plugin_instance != NULL)
     sstrncpy (vl.plugin_instance, plugin_instance, sizeof (vl.plugin_instance)); 
 
@@ -505,7 +559,7 @@ static int cx_handle_parsed_xml(xmlDocPtr doc, /* {{{ */
     ds = plugin_get_ds (xpath->type);
 
     if ( (cx_check_type(ds, xpath) == 0) &&
-         (cx_handle_base_xpath(db->instance, db->host,
+         (cx_handle_base_xpath(db->instance, db->host, db->interval,
                                xpath_ctx, ds, le->key, xpath) == 0) )
       status = 0; /* we got atleast one success */
 
@@ -544,45 +598,259 @@ static int cx_parse_stats_xml(xmlChar* xml, cx_t *db) /* {{{ */
   return status;
 } /* }}} cx_parse_stats_xml */
 
-static int cx_curl_perform (cx_t *db, CURL *curl) /* {{{ */
+/*
+ * Streaming mode
+ *
+ * Instead of building a tree, the base paths are matched while the response
+ * is parsed. When a matching node is closed, the values are dispatched.
+ * Only simple expressions are supported, see cx_stream_check_path.
+ */
+static _Bool cx_stream_is_attribute (const char *expr) /* {{{ */
 {
-  int status;
+  return (expr[0] == '@');
+} /* }}} _Bool cx_stream_is_attribute */
+
+static _Bool cx_stream_is_self (const char *expr) /* {{{ */
+{
+  return ((strcmp (".", expr) == 0) || (strcmp ("text()", expr) == 0));
+} /* }}} _Bool cx_stream_is_self */
+
+/* Stores the text for `v' if its expression selects `name' relative to the
+ * base node: a child element, "@attribute" or the base node itself ("."). */
+static void cx_stream_set (cx_values_t *v, const char *expr, /* {{{ */
+    const char *name, const char *text)
+{
+  if (strcmp (expr, name) != 0)
+    return;
+
+  v->found++;
+  sstrncpy (v->text, text, sizeof (v->text));
+} /* }}} void cx_stream_set */
+
+static void cx_stream_submit (cx_t *db, cx_xpath_t *xpath) /* {{{ */
+{
+  const data_set_t *ds;
+  value_list_t vl = VALUE_LIST_INIT;
+  int i;
+
+  ds = plugin_get_ds (xpath->type);
+  if (cx_check_type (ds, xpath) != 0)
+    return;
+
+  /* Unlike with the tree, the first node has already been dispatched when
+   * the second one is found. */
+  if ((xpath->matches > 1) && (xpath->instance == NULL))
+  {
+    if (xpath->matches == 2)
+      ERROR ("curl_xml plugin: "
+          "InstanceFrom is must in xpath block since the base xpath "
+          "expression \"%s\" returned multiple results. Skipping the "
+          "remaining nodes...", xpath->path);
+    return;
+  }
+
+  if ((xpath->instance != NULL) && (xpath->stream_instance.found != 1))
+  {
+    WARNING ("curl_xml plugin: "
+        "relative xpath expression for 'InstanceFrom' \"%s\" is expected "
+        "to return exactly one text node. Skipping the node.",
+        xpath->instance);
+    return;
+  }
+
+  for (i = 0; i < xpath->values_len; i++)
+  {
+    if (xpath->values[i].found != 1)
+    {
+      WARNING ("curl_xml plugin: "
+          "relative xpath expression \"%s\" is expected to return "
+          "exactly one node. Skipping...", xpath->values[i].path);
+      return;
+    }
+  }
+
+  {
+    value_t values[xpath->values_len];
+
+    for (i = 0; i < xpath->values_len; i++)
+      cx_parse_value (xpath->values[i].text, ds->ds[i].type, &values[i]);
+
+    vl.values = values;
+    vl.values_len = xpath->values_len;
+    sstrncpy (vl.type, xpath->type, sizeof (vl.type));
+    sstrncpy (vl.plugin, "curl_xml", sizeof (vl.plugin));
+    sstrncpy (vl.host, (db->host != NULL) ? db->host : hostname_g,
+        sizeof (vl.host));
+    vl.interval = db->interval;
+    if (db->instance != NULL)
+      sstrncpy (vl.plugin_instance, db->instance,
+          sizeof (vl.plugin_instance));
+
+    ssnprintf (vl.type_instance, sizeof (vl.type_instance), "%s%s",
+        (xpath->instance_prefix != NULL) ? xpath->instance_prefix : "",
+        (xpath->instance != NULL) ? xpath->stream_instance.text : "");
+
+    plugin_dispatch_values (&vl);
+  }
+} /* }}} void cx_stream_submit */
+
+static void cx_stream_start (uxs_t *s, /* {{{ */
+    const char __attribute__((unused)) *name, const char **attrs,
+    void *user_data)
+{
+  cx_t *db = user_data;
+  int depth = uxs_depth (s);
+  llentry_t *le;
+
+  for (le = llist_head (db->list); le != NULL; le = le->next)
+  {
+    cx_xpath_t *xpath = le->value;
+    const char *attr;
+    int i;
+
+    /* Nested matches are ignored. */
+    if ((xpath->depth != 0) || !uxs_matches (s, depth, xpath->stream_path))
+      continue;
+
+    xpath->depth = depth;
+    xpath->matches++;
+
+    xpath->stream_instance.found = 0;
+    if ((xpath->instance != NULL) && cx_stream_is_attribute (xpath->instance)
+        && ((attr = uxs_attribute (attrs, xpath->instance + 1)) != NULL))
+      cx_stream_set (&xpath->stream_instance, xpath->instance,
+          xpath->instance, attr);
+
+    for (i = 0; i < xpath->values_len; i++)
+    {
+      cx_values_t *v = xpath->values + i;
+
+      v->found = 0;
+      if (cx_stream_is_attribute (v->path)
+          && ((attr = uxs_attribute (attrs, v->path + 1)) != NULL))
+        cx_stream_set (v, v->path, v->path, attr);
+    }
+  }
+} /* }}} void cx_stream_start */
+
+static void cx_stream_end (uxs_t *s, const char *name, /* {{{ */
+    const char *text, void *user_data)
+{
+  cx_t *db = user_data;
+  int depth = uxs_depth (s);
+  llentry_t *le;
+
+  for (le = llist_head (db->list); le != NULL; le = le->next)
+  {
+    cx_xpath_t *xpath = le->value;
+    int i;
+
+    if (xpath->depth == 0)
+      continue;
+
+    if (depth == (xpath->depth + 1))
+    {
+      if (xpath->instance != NULL)
+        cx_stream_set (&xpath->stream_instance, xpath->instance, name, text);
+      for (i = 0; i < xpath->values_len; i++)
+        cx_stream_set (xpath->values + i, xpath->values[i].path, name, text);
+    }
+    else if (depth == xpath->depth)
+    {
+      if ((xpath->instance != NULL) && cx_stream_is_self (xpath->instance))
+        cx_stream_set (&xpath->stream_instance, xpath->instance,
+            xpath->instance, text);
+      for (i = 0; i < xpath->values_len; i++)
+        if (cx_stream_is_self (xpath->values[i].path))
+          cx_stream_set (xpath->values + i, xpath->values[i].path,
+              xpath->values[i].path, text);
+
+      cx_stream_submit (db, xpath);
+      xpath->depth = 0;
+    }
+  }
+} /* }}} void cx_stream_end */
+
+static void cx_stream_reset (cx_t *db) /* {{{ */
+{
+  llentry_t *le;
+
+  uxs_reset (db->parser);
+
+  for (le = llist_head (db->list); le != NULL; le = le->next)
+  {
+    cx_xpath_t *xpath = le->value;
+
+    xpath->depth = 0;
+    xpath->matches = 0;
+  }
+} /* }}} void cx_stream_reset */
+
+static void cx_stream_finish (cx_t *db, const char *url) /* {{{ */
+{
+  llentry_t *le;
+
+  if (uxs_finish (db->parser) != 0)
+  {
+    ERROR ("curl_xml plugin: Failed to parse the xml document from %s: %s",
+        url, uxs_strerror (db->parser));
+    return;
+  }
+
+  for (le = llist_head (db->list); le != NULL; le = le->next)
+  {
+    cx_xpath_t *xpath = le->value;
+
+    if (xpath->matches == 0)
+      ERROR ("curl_xml plugin: "
+          "xpath expression \"%s\" doesn't match any of the nodes. "
+          "Skipping the xpath block...", xpath->path);
+  }
+} /* }}} void cx_stream_finish */
+
+/* Called by the fetch thread when the transfer has finished. */
+static void cx_curl_done (CURL *curl, CURLcode status, /* {{{ */
+    void *user_data)
+{
+  cx_t *db = user_data;
   long rc;
-  char *ptr;
   char *url;
 
-  db->buffer_fill = 0; 
-  status = curl_easy_perform (curl);
-
+  url = NULL;
   curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rc);
 
+  if (status == CURLE_ABORTED_BY_CALLBACK)
+    /* shutting down */;
   /* The response code is zero if a non-HTTP transport was used. */
-  if ((rc != 0) && (rc != 200))
-  {
+  else if ((rc != 0) && (rc != 200))
     ERROR ("curl_xml plugin: curl_easy_perform failed with response code %ld (%s)",
            rc, url);
-    return (-1);
-  }
-
-  if (status != 0)
-  {
+  /* The write callback aborts the transfer if parsing fails. */
+  else if ((db->parser != NULL) && (status == CURLE_WRITE_ERROR))
+    ERROR ("curl_xml plugin: Failed to parse the xml document from %s: %s",
+           url, uxs_strerror (db->parser));
+  else if (status != CURLE_OK)
     ERROR ("curl_xml plugin: curl_easy_perform failed with status %i: %s (%s)",
-           status, db->curl_errbuf, url);
-    return (-1);
-  }
-
-  ptr = db->buffer;
+           (int) status, db->curl_errbuf, url);
+  else if (db->parser != NULL)
+    cx_stream_finish (db, url);
+  else if (db->buffer_fill == 0)
+    ERROR ("curl_xml plugin: The response from %s was empty.", url);
+  else
+    cx_parse_stats_xml(BAD_CAST db->buffer, db);
 
-  status = cx_parse_stats_xml(BAD_CAST ptr, db);
+  /* Reset here rather than in cx_read, which doesn't know whether a
+   * transfer is still running. */
   db->buffer_fill = 0;
-
-  return status;
-} /* }}} int cx_curl_perform */
+  if (db->parser != NULL)
+    cx_stream_reset (db);
+} /* }}} void cx_curl_done */
 
 static int cx_read (user_data_t *ud) /* {{{ */
 {
   cx_t *db;
+  int status;
 
   if ((ud == NULL) || (ud->data == NULL))
   {
@@ -592,7 +860,24 @@ static int cx_read (user_data_t *ud) /* {{{ */
 
   db = (cx_t *) ud->data;
 
-  return cx_curl_perform (db, db->curl);
+  /* Only set by the first read, before any transfer can be running. */
+  if (db->interval == 0)
+    db->interval = plugin_get_interval ();
+
+  status = ucm_submit (db->curl, db->url, cx_curl_done, db);
+  if (status == EBUSY)
+  {
+    WARNING ("curl_xml plugin: The previous request for %s is still "
+        "in progress. Skipping this interval.", db->url);
+    return (-1);
+  }
+  else if (status != 0)
+  {
+    ERROR ("curl_xml plugin: ucm_submit failed with status %i.", status);
+    return (-1);
+  }
+
+  return (0);
 } /* }}} int cx_read */
 
 /* Configuration handling functions {{{ */
@@ -727,6 +1012,110 @@ static int cx_config_add_xpath (cx_t *db, /* {{{ */
   return (status);
 } /* }}} int cx_config_add_xpath */
 
+/* Checks that `name' is a plain element name, i.e. contains no axis,
+ * predicate, wildcard or function call. */
+static _Bool cx_stream_check_name (const char *name, size_t len) /* {{{ */
+{
+  size_t i;
+
+  if ((len == 0)
+      || ((len == 1) && (name[0] == '.'))
+      || ((len == 2) && (strncmp ("..", name, 2) == 0)))
+    return (0);
+
+  for (i = 0; i < len; i++)
+    if (!isalnum ((unsigned char) name[i]) && (strchr ("_-.:", name[i]) == NULL))
+      return (0);
+
+  return (1);
+} /* }}} _Bool cx_stream_check_name */
+
+/*
+ * In streaming mode, base paths have to be lists of element names, such as
+ * "table/tr", "/html/body/table/tr" or "//table/tr". Relative paths are
+ * relative to the document, as with the tree. `InstanceFrom' and
+ * `ValuesFrom' have to be a child element name, "@attribute" or ".".
+ */
+static int cx_stream_check_path (cx_xpath_t *xpath) /* {{{ */
+{
+  const char *ptr = xpath->path;
+  size_t len;
+  int i;
+
+  if (strncmp ("//", ptr, 2) == 0)
+    ptr += 2;
+  else if (ptr[0] == '/')
+    ptr++;
+
+  while (42)
+  {
+    len = strcspn (ptr, "/");
+    if (!cx_stream_check_name (ptr, len))
+    {
+      ERROR ("curl_xml plugin: The expression \"%s\" is not supported in "
+          "streaming mode. Only element names separated by slashes are "
+          "allowed.", xpath->path);
+      return (-1);
+    }
+
+    if (ptr[len] == 0)
+      break;
+    ptr += len + 1;
+  }
+
+  for (i = -1; i < xpath->values_len; i++)
+  {
+    const char *expr = (i < 0) ? xpath->instance : xpath->values[i].path;
+
+    if (expr == NULL)
+      continue;
+
+    if (cx_stream_is_self (expr))
+      continue;
+    if (cx_stream_is_attribute (expr))
+      expr++;
+
+    if (!cx_stream_check_name (expr, strlen (expr)))
+    {
+      ERROR ("curl_xml plugin: The expression \"%s\" is not supported in "
+          "streaming mode. Only the name of a child element, "
+          "\"@attribute\" or \".\" are allowed.",
+          (i < 0) ? xpath->instance : xpath->values[i].path);
+      return (-1);
+    }
+  }
+
+  len = strlen (xpath->path) + 2;
+  xpath->stream_path = malloc (len);
+  if (xpath->stream_path == NULL)
+  {
+    ERROR ("curl_xml plugin: malloc failed.");
+    return (-1);
+  }
+  ssnprintf (xpath->stream_path, len, "%s%s",
+      (xpath->path[0] == '/') ? "" : "/", xpath->path);
+
+  return (0);
+} /* }}} int cx_stream_check_path */
+
+static int cx_stream_init (cx_t *db) /* {{{ */
+{
+  llentry_t *le;
+
+  for (le = llist_head (db->list); le != NULL; le = le->next)
+    if (cx_stream_check_path (le->value) != 0)
+      return (-1);
+
+  db->parser = uxs_create (cx_stream_start, cx_stream_end, db);
+  if (db->parser == NULL)
+  {
+    ERROR ("curl_xml plugin: uxs_create failed.");
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int cx_stream_init */
+
 /* Initialize db->curl */
 static int cx_init_curl (cx_t *db) /* {{{ */
 {
@@ -831,6 +1220,8 @@ static int cx_config_add_url (oconfig_item_t *ci) /* {{{ */
       status = cf_util_get_boolean (child, &db->verify_host);
     else if (strcasecmp ("CACert", child->key) == 0)
       status = cf_util_get_string (child, &db->cacert);
+    else if (strcasecmp ("Streaming", child->key) == 0)
+      status = cf_util_get_boolean (child, &db->streaming);
     else if (strcasecmp ("xpath", child->key) == 0)
       status = cx_config_add_xpath (db, child);
     else
@@ -851,6 +1242,8 @@ static int cx_config_add_url (oconfig_item_t *ci) /* {{{ */
                "within `URL' block `%s'.", db->url);
       status = -1;
     }
+    if ((status == 0) && db->streaming)
+      status = cx_stream_init (db);
     if (status == 0)
       status = cx_init_curl (db);
   }
@@ -869,7 +1262,7 @@ static int cx_config_add_url (oconfig_item_t *ci) /* {{{ */
 
     memset (&ud, 0, sizeof (ud));
     ud.data = (void *) db;
-    ud.free_func = cx_free;
+    ud.free_func = cx_read_free;
 
     ssnprintf (cb_name, sizeof (cb_name), "curl_xml-%s-%s",
                db->instance, db->url);
@@ -910,6 +1303,11 @@ static int cx_config (oconfig_item_t *ci) /* {{{ */
       else
         errors++;
     }
+    else if ((status = ucm_config (child)) <= 0)
+    {
+      if (status != 0)
+        errors++;
+    }
     else
     {
       WARNING ("curl_xml plugin: Option `%s' not allowed here.", child->key);
@@ -27,6 +27,14 @@
 #include "configfile.h"
 #include "utils_mount.h"
 #include "utils_ignorelist.h"
+#include "utils_avltree.h"
+
+#include <pthread.h>
+
+#if KERNEL_LINUX
+# include <poll.h>
+# define DF_MOUNTINFO "/proc/self/mountinfo"
+#endif
 
 #if HAVE_STATVFS
 # if HAVE_SYS_STATVFS_H
@@ -35,6 +43,7 @@
 # define STATANYFS statvfs
 # define STATANYFS_STR "statvfs"
 # define BLOCKSIZE(s) ((s).f_frsize ? (s).f_frsize : (s).f_bsize)
+typedef struct statvfs df_statbuf_t;
 #elif HAVE_STATFS
 # if HAVE_SYS_STATFS_H
 #  include <sys/statfs.h>
@@ -42,6 +51,7 @@
 # define STATANYFS statfs
 # define STATANYFS_STR "statfs"
 # define BLOCKSIZE(s) (s).f_bsize
+typedef struct statfs df_statbuf_t;
 #else
 # error "No applicable input method."
 #endif
@@ -54,7 +64,10 @@ static const char *config_keys[] =
 	"IgnoreSelected",
 	"ReportByDevice",
 	"ReportReserved",
-	"ReportInodes"
+	"ReportInodes",
+	"DeduplicateDevices",
+	"StatThreads",
+	"StatTimeout"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -64,6 +77,62 @@ static ignorelist_t *il_fstype = NULL;
 
 static _Bool by_device = 0;
 static _Bool report_inodes = 0;
+static _Bool dedup_devices = 0;
+
+/*
+ * The mount table is parsed only when it has changed. On Linux, a change is
+ * signalled by POLLPRI on /proc/self/mountinfo; elsewhere it is parsed on
+ * every read. `df_selected' holds the mounts that pass the ignore lists,
+ * without duplicate devices.
+ */
+#if KERNEL_LINUX
+static int mountinfo_fd = -1;
+#endif
+static cu_mount_t *df_mounts = NULL;
+static cu_mount_t **df_selected = NULL;
+static size_t df_selected_num = 0;
+
+/*
+ * statvfs(2) is called by a fixed number of worker threads so a hung mount,
+ * e.g. an unreachable NFS server, doesn't block the read function. Each call
+ * is waited for at most `stat_timeout'. Jobs that are still running after that
+ * are "abandoned": they are moved to `df_hung' and freed by the worker once
+ * the call returns. Until then, that mount point is skipped. With
+ * `stat_threads' set to zero, statvfs(2) is called directly.
+ */
+#define DF_JOB_QUEUED  0
+#define DF_JOB_RUNNING 1
+#define DF_JOB_DONE    2
+
+struct df_job_s;
+typedef struct df_job_s df_job_t;
+struct df_job_s
+{
+	char *dir;
+	df_statbuf_t statbuf;
+	int status;
+	int errnum;
+
+	int state;
+	_Bool abandoned;
+	cdtime_t started;
+
+	df_job_t *next;
+};
+
+static int stat_threads = 4;
+static cdtime_t stat_timeout = 0;
+
+static pthread_mutex_t df_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t df_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t df_done_cond = PTHREAD_COND_INITIALIZER;
+static df_job_t *df_queue_head = NULL;
+static df_job_t *df_queue_tail = NULL;
+static df_job_t *df_hung = NULL;
+static int df_workers_num = 0;
+static _Bool df_workers_shutdown = 0;
+/* Time of the last job that was started or finished. */
+static cdtime_t df_progress = 0;
 
 static int df_init (void)
 {
@@ -131,7 +200,41 @@ static int df_config (const char *key, const char *value)
 
 		return (0);
 	}
+	else if (strcasecmp (key, "DeduplicateDevices") == 0)
+	{
+		if (IS_TRUE (value))
+			dedup_devices = 1;
+		else
+			dedup_devices = 0;
+
+		return (0);
+	}
+	else if (strcasecmp (key, "StatThreads") == 0)
+	{
+		int tmp = atoi (value);
+
+		if (tmp < 0)
+		{
+			ERROR ("df plugin: StatThreads must not be negative.");
+			return (1);
+		}
+		stat_threads = tmp;
+
+		return (0);
+	}
+	else if (strcasecmp (key, "StatTimeout") == 0)
+	{
+		double tmp = atof (value);
 
+		if (tmp <= 0.0)
+		{
+			ERROR ("df plugin: StatTimeout must be positive.");
+			return (1);
+		}
+		stat_timeout = DOUBLE_TO_CDTIME_T (tmp);
+
+		return (0);
+	}
 
 	return (-1);
 }
@@ -161,161 +264,544 @@ static void df_submit_one (char *plugin_instance,
 	plugin_dispatch_values (&vl);
 } /* void df_submit_one */
 
-static int df_read (void)
+static void df_submit_mount (cu_mount_t *mnt_ptr, df_statbuf_t *statbuf)
 {
+	unsigned long long blocksize;
+	char disk_name[256];
+	uint64_t blk_free;
+	uint64_t blk_reserved;
+	uint64_t blk_used;
+
+	if (!statbuf->f_blocks)
+		return;
+
+	if (by_device) 
+	{
+		/* eg, /dev/hda1  -- strip off the "/dev/" */
+		if (strncmp (mnt_ptr->spec_device, "/dev/", strlen ("/dev/")) == 0)
+			sstrncpy (disk_name, mnt_ptr->spec_device + strlen ("/dev/"), sizeof (disk_name));
+		else
+			sstrncpy (disk_name, mnt_ptr->spec_device, sizeof (disk_name));
+
+		if (strlen(disk_name) < 1) 
+		{
+			DEBUG("df: no device name name for mountpoint %s, skipping", mnt_ptr->dir);
+			return;
+		}
+	} 
+	else 
+	{
+		if (strcmp (mnt_ptr->dir, "/") == 0)
+		{
+			if (strcmp (mnt_ptr->type, "rootfs") == 0)
+				return;
+			sstrncpy (disk_name, "root", sizeof (disk_name));
+		}
+		else
+		{
+			int i, len;
+
+			sstrncpy (disk_name, mnt_ptr->dir + 1, sizeof (disk_name));
+			len = strlen (disk_name);
+
+			for (i = 0; i < len; i++)
+				if (disk_name[i] == '/')
+					disk_name[i] = '-';
+		}
+	}
+
+	blocksize = BLOCKSIZE(*statbuf);
+
+	/*
+	 * Sanity-check for the values in the struct
+	 */
+	/* Check for negative "available" byes. For example UFS can
+	 * report negative free space for user. Notice. blk_reserved
+	 * will start to diminish after this. */
 #if HAVE_STATVFS
-	struct statvfs statbuf;
+	/* Cast and temporary variable are needed to avoid
+	 * compiler warnings.
+	 * ((struct statvfs).f_bavail is unsigned (POSIX)) */
+	int64_t signed_bavail = (int64_t) statbuf->f_bavail;
+	if (signed_bavail < 0)
+		statbuf->f_bavail = 0;
 #elif HAVE_STATFS
-	struct statfs statbuf;
+	if (statbuf->f_bavail < 0)
+		statbuf->f_bavail = 0;
 #endif
-	/* struct STATANYFS statbuf; */
-	cu_mount_t *mnt_list;
+	/* Make sure that f_blocks >= f_bfree >= f_bavail */
+	if (statbuf->f_bfree < statbuf->f_bavail)
+		statbuf->f_bfree = statbuf->f_bavail;
+	if (statbuf->f_blocks < statbuf->f_bfree)
+		statbuf->f_blocks = statbuf->f_bfree;
+
+	blk_free     = (uint64_t) statbuf->f_bavail;
+	blk_reserved = (uint64_t) (statbuf->f_bfree - statbuf->f_bavail);
+	blk_used     = (uint64_t) (statbuf->f_blocks - statbuf->f_bfree);
+
+	df_submit_one (disk_name, "df_complex", "free",
+			(gauge_t) (blk_free * blocksize));
+	df_submit_one (disk_name, "df_complex", "reserved",
+			(gauge_t) (blk_reserved * blocksize));
+	df_submit_one (disk_name, "df_complex", "used",
+			(gauge_t) (blk_used * blocksize));
+
+	/* inode handling */
+	if (report_inodes)
+	{
+		uint64_t inode_free;
+		uint64_t inode_reserved;
+		uint64_t inode_used;
+
+		/* Sanity-check for the values in the struct */
+		if (statbuf->f_ffree < statbuf->f_favail)
+			statbuf->f_ffree = statbuf->f_favail;
+		if (statbuf->f_files < statbuf->f_ffree)
+			statbuf->f_files = statbuf->f_ffree;
+
+		inode_free = (uint64_t) statbuf->f_favail;
+		inode_reserved = (uint64_t) (statbuf->f_ffree - statbuf->f_favail);
+		inode_used = (uint64_t) (statbuf->f_files - statbuf->f_ffree);
+		
+		df_submit_one (disk_name, "df_inodes", "free",
+				(gauge_t) inode_free);
+		df_submit_one (disk_name, "df_inodes", "reserved",
+				(gauge_t) inode_reserved);
+		df_submit_one (disk_name, "df_inodes", "used",
+				(gauge_t) inode_used);
+	}
+} /* void df_submit_mount */
+
+/* Returns true if the mount table may have changed since the last call. */
+static _Bool df_mounts_changed (void)
+{
+#if KERNEL_LINUX
+	struct pollfd pfd;
+	int status;
+
+	if (mountinfo_fd < 0)
+	{
+		/* Changes are reported relative to the time the file was
+		 * opened, so the table has to be parsed after opening it. */
+		mountinfo_fd = open (DF_MOUNTINFO, O_RDONLY | O_CLOEXEC);
+		return (1);
+	}
+
+	memset (&pfd, 0, sizeof (pfd));
+	pfd.fd = mountinfo_fd;
+	pfd.events = POLLPRI;
+
+	status = poll (&pfd, 1, /* timeout = */ 0);
+	if (status == 0)
+		return (0);
+	else if ((status > 0) && ((pfd.revents & (POLLPRI | POLLERR)) == 0))
+		return (0);
+
+	return (1);
+#else
+	return (1);
+#endif
+} /* _Bool df_mounts_changed */
+
+/* Updates `df_mounts' and `df_selected' if the mount table has changed. */
+static int df_mounts_update (void)
+{
+	cu_mount_t *mnt_list = NULL;
 	cu_mount_t *mnt_ptr;
+	cu_mount_t **selected;
+	size_t selected_num = 0;
+	size_t mounts_num = 0;
+	c_avl_tree_t *devices = NULL;
+
+	if (!df_mounts_changed () && (df_mounts != NULL))
+		return (0);
 
-	mnt_list = NULL;
 	if (cu_mount_getlist (&mnt_list) == NULL)
 	{
 		ERROR ("df plugin: cu_mount_getlist failed.");
 		return (-1);
 	}
 
+	for (mnt_ptr = mnt_list; mnt_ptr != NULL; mnt_ptr = mnt_ptr->next)
+		mounts_num++;
+
+	selected = calloc (mounts_num, sizeof (*selected));
+	if (selected == NULL)
+	{
+		ERROR ("df plugin: calloc failed.");
+		cu_mount_freelist (mnt_list);
+		return (-1);
+	}
+
+	/* With ReportByDevice, duplicate devices would report the same values
+	 * under the same name. */
+	if (by_device || dedup_devices)
+		devices = c_avl_create ((void *) strcmp);
+
 	for (mnt_ptr = mnt_list; mnt_ptr != NULL; mnt_ptr = mnt_ptr->next)
 	{
-		unsigned long long blocksize;
-		char disk_name[256];
-		uint64_t blk_free;
-		uint64_t blk_reserved;
-		uint64_t blk_used;
-
-		if (ignorelist_match (il_device,
-					(mnt_ptr->spec_device != NULL)
-					? mnt_ptr->spec_device
-					: mnt_ptr->device))
+		char *device = (mnt_ptr->spec_device != NULL)
+			? mnt_ptr->spec_device
+			: mnt_ptr->device;
+
+		if (ignorelist_match (il_device, device))
 			continue;
 		if (ignorelist_match (il_mountpoint, mnt_ptr->dir))
 			continue;
 		if (ignorelist_match (il_fstype, mnt_ptr->type))
 			continue;
 
-		if (STATANYFS (mnt_ptr->dir, &statbuf) < 0)
+		/* Only real devices are de-duplicated: pseudo file systems
+		 * such as "tmpfs" share the same name but not the data. Bind
+		 * mounts of a device are skipped in favor of the first
+		 * mount. */
+		if ((devices != NULL) && (device != NULL)
+				&& (strncmp (device, "/dev/", strlen ("/dev/")) == 0))
 		{
-			char errbuf[1024];
-			ERROR (STATANYFS_STR"(%s) failed: %s",
-					mnt_ptr->dir,
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
+			int status = c_avl_insert (devices, device, NULL);
+			if (status > 0)
+			{
+				DEBUG ("df plugin: Skipping %s: %s is already "
+						"mounted elsewhere.", mnt_ptr->dir, device);
+				continue;
+			}
+		}
+
+		selected[selected_num] = mnt_ptr;
+		selected_num++;
+	}
+
+	if (devices != NULL)
+		c_avl_destroy (devices);
+
+	cu_mount_freelist (df_mounts);
+	sfree (df_selected);
+
+	df_mounts = mnt_list;
+	df_selected = selected;
+	df_selected_num = selected_num;
+
+	DEBUG ("df plugin: Parsed %zu mounts, %zu selected.",
+			mounts_num, selected_num);
+
+	return (0);
+} /* int df_mounts_update */
+
+static void df_job_free (df_job_t *job)
+{
+	if (job == NULL)
+		return;
+
+	sfree (job->dir);
+	sfree (job);
+} /* void df_job_free */
+
+/* Removes an abandoned job from `df_hung'. Call with `df_lock' held. */
+static void df_hung_remove (df_job_t *job)
+{
+	df_job_t *prev = NULL;
+	df_job_t *ptr;
+
+	for (ptr = df_hung; ptr != NULL; prev = ptr, ptr = ptr->next)
+		if (ptr == job)
+			break;
+
+	if (ptr == NULL)
+		return;
+
+	if (prev == NULL)
+		df_hung = ptr->next;
+	else
+		prev->next = ptr->next;
+	ptr->next = NULL;
+} /* void df_hung_remove */
+
+/* Returns true if a call for `dir' is still hanging. Call with `df_lock'
+ * held. */
+static _Bool df_is_hung (const char *dir)
+{
+	df_job_t *ptr;
+
+	for (ptr = df_hung; ptr != NULL; ptr = ptr->next)
+		if (strcmp (ptr->dir, dir) == 0)
+			return (1);
+
+	return (0);
+} /* _Bool df_is_hung */
+
+static void *df_worker (void __attribute__((unused)) *arg)
+{
+	pthread_mutex_lock (&df_lock);
+	while (!df_workers_shutdown)
+	{
+		df_job_t *job;
+
+		if (df_queue_head == NULL)
+		{
+			pthread_cond_wait (&df_work_cond, &df_lock);
 			continue;
 		}
 
-		if (!statbuf.f_blocks)
+		job = df_queue_head;
+		df_queue_head = job->next;
+		if (df_queue_head == NULL)
+			df_queue_tail = NULL;
+		job->next = NULL;
+
+		/* The read function gave up on the job before it was
+		 * started. */
+		if (job->abandoned)
+		{
+			df_job_free (job);
+			continue;
+		}
+
+		job->state = DF_JOB_RUNNING;
+		job->started = cdtime ();
+		df_progress = job->started;
+		pthread_mutex_unlock (&df_lock);
+
+		job->status = STATANYFS (job->dir, &job->statbuf);
+		job->errnum = (job->status == 0) ? 0 : errno;
+
+		pthread_mutex_lock (&df_lock);
+		job->state = DF_JOB_DONE;
+		df_progress = cdtime ();
+
+		if (job->abandoned)
+		{
+			NOTICE ("df plugin: " STATANYFS_STR "(%s) returned after "
+					"%.3f seconds.", job->dir,
+					CDTIME_T_TO_DOUBLE (df_progress - job->started));
+			df_hung_remove (job);
+			df_job_free (job);
+			continue;
+		}
+
+		pthread_cond_broadcast (&df_done_cond);
+	}
+	pthread_mutex_unlock (&df_lock);
+
+	return ((void *) 0);
+} /* void *df_worker */
+
+/* Starts missing worker threads. Call with `df_lock' held. */
+static int df_workers_start (void)
+{
+	while (df_workers_num < stat_threads)
+	{
+		pthread_t thread;
+		int status;
+
+		status = plugin_thread_create (&thread, /* attr = */ NULL,
+				df_worker, /* arg = */ NULL);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("df plugin: pthread_create failed: %s",
+					sstrerror (status, errbuf, sizeof (errbuf)));
+			break;
+		}
+
+		/* Workers stuck in statvfs(2) are never joined. */
+		pthread_detach (thread);
+		df_workers_num++;
+	}
+
+	return ((df_workers_num > 0) ? 0 : -1);
+} /* int df_workers_start */
+
+/* Calls statvfs(2) for all selected mounts in the worker threads and waits
+ * for the results. Jobs that didn't finish in time are NULL in `jobs'. */
+static void df_stat_async (df_job_t **jobs, size_t jobs_num)
+{
+	cdtime_t timeout = (stat_timeout > 0) ? stat_timeout : plugin_get_interval ();
+	size_t i;
+
+	df_progress = cdtime ();
+
+	for (i = 0; i < jobs_num; i++)
+	{
+		if (jobs[i] == NULL)
 			continue;
 
-		if (by_device) 
+		if (df_queue_tail == NULL)
+			df_queue_head = jobs[i];
+		else
+			df_queue_tail->next = jobs[i];
+		df_queue_tail = jobs[i];
+	}
+	pthread_cond_broadcast (&df_work_cond);
+
+	while (42)
+	{
+		cdtime_t now = cdtime ();
+		cdtime_t next = 0;
+		struct timespec ts;
+
+		for (i = 0; i < jobs_num; i++)
 		{
-			/* eg, /dev/hda1  -- strip off the "/dev/" */
-			if (strncmp (mnt_ptr->spec_device, "/dev/", strlen ("/dev/")) == 0)
-				sstrncpy (disk_name, mnt_ptr->spec_device + strlen ("/dev/"), sizeof (disk_name));
+			df_job_t *job = jobs[i];
+			cdtime_t deadline;
+
+			if ((job == NULL) || (job->state == DF_JOB_DONE))
+				continue;
+
+			/* Queued jobs wait for a free worker for at most
+			 * `timeout' after any progress was made. */
+			if (job->state == DF_JOB_RUNNING)
+				deadline = job->started + timeout;
 			else
-				sstrncpy (disk_name, mnt_ptr->spec_device, sizeof (disk_name));
+				deadline = df_progress + timeout;
 
-			if (strlen(disk_name) < 1) 
+			if (now >= deadline)
 			{
-				DEBUG("df: no device name name for mountpoint %s, skipping", mnt_ptr->dir);
+				/* Ownership passes to the worker. */
+				job->abandoned = 1;
+				if (job->state == DF_JOB_RUNNING)
+				{
+					WARNING ("df plugin: " STATANYFS_STR "(%s) did not "
+							"return within %.3f seconds. Skipping "
+							"this mount point until it does.",
+							job->dir, CDTIME_T_TO_DOUBLE (timeout));
+					job->next = df_hung;
+					df_hung = job;
+				}
+				else
+				{
+					WARNING ("df plugin: No worker thread was available "
+							"for %s within %.3f seconds.",
+							job->dir, CDTIME_T_TO_DOUBLE (timeout));
+				}
+				jobs[i] = NULL;
 				continue;
 			}
-		} 
-		else 
+
+			if ((next == 0) || (deadline < next))
+				next = deadline;
+		}
+
+		if (next == 0)
+			break;
+
+		CDTIME_T_TO_TIMESPEC (next, &ts);
+		pthread_cond_timedwait (&df_done_cond, &df_lock, &ts);
+	}
+} /* void df_stat_async */
+
+static int df_read (void)
+{
+	df_job_t **jobs;
+	size_t jobs_num;
+	_Bool async = 0;
+	size_t i;
+
+	if (df_mounts_update () != 0)
+		return (-1);
+
+	jobs_num = df_selected_num;
+	if (jobs_num == 0)
+		return (0);
+
+	jobs = calloc (jobs_num, sizeof (*jobs));
+	if (jobs == NULL)
+	{
+		ERROR ("df plugin: calloc failed.");
+		return (-1);
+	}
+
+	pthread_mutex_lock (&df_lock);
+
+	if ((stat_threads > 0) && (df_workers_start () == 0))
+		async = 1;
+
+	for (i = 0; i < jobs_num; i++)
+	{
+		if (df_is_hung (df_selected[i]->dir))
 		{
-			if (strcmp (mnt_ptr->dir, "/") == 0)
-			{
-				if (strcmp (mnt_ptr->type, "rootfs") == 0)
-					continue;
-				sstrncpy (disk_name, "root", sizeof (disk_name));
-			}
-			else
-			{
-				int i, len;
+			DEBUG ("df plugin: Skipping hung mount point %s.",
+					df_selected[i]->dir);
+			continue;
+		}
 
-				sstrncpy (disk_name, mnt_ptr->dir + 1, sizeof (disk_name));
-				len = strlen (disk_name);
+		jobs[i] = calloc (1, sizeof (*jobs[i]));
+		if (jobs[i] == NULL)
+			continue;
 
-				for (i = 0; i < len; i++)
-					if (disk_name[i] == '/')
-						disk_name[i] = '-';
-			}
+		jobs[i]->dir = strdup (df_selected[i]->dir);
+		if (jobs[i]->dir == NULL)
+		{
+			sfree (jobs[i]);
+			continue;
 		}
+		jobs[i]->state = DF_JOB_QUEUED;
+	}
 
-		blocksize = BLOCKSIZE(statbuf);
+	if (async)
+		df_stat_async (jobs, jobs_num);
 
-		/*
-		 * Sanity-check for the values in the struct
-		 */
-		/* Check for negative "available" byes. For example UFS can
-		 * report negative free space for user. Notice. blk_reserved
-		 * will start to diminish after this. */
-#if HAVE_STATVFS
-		/* Cast and temporary variable are needed to avoid
-		 * compiler warnings.
-		 * ((struct statvfs).f_bavail is unsigned (POSIX)) */
-		int64_t signed_bavail = (int64_t) statbuf.f_bavail;
-		if (signed_bavail < 0)
-			statbuf.f_bavail = 0;
-#elif HAVE_STATFS
-		if (statbuf.f_bavail < 0)
-			statbuf.f_bavail = 0;
-#endif
-		/* Make sure that f_blocks >= f_bfree >= f_bavail */
-		if (statbuf.f_bfree < statbuf.f_bavail)
-			statbuf.f_bfree = statbuf.f_bavail;
-		if (statbuf.f_blocks < statbuf.f_bfree)
-			statbuf.f_blocks = statbuf.f_bfree;
-
-		blk_free     = (uint64_t) statbuf.f_bavail;
-		blk_reserved = (uint64_t) (statbuf.f_bfree - statbuf.f_bavail);
-		blk_used     = (uint64_t) (statbuf.f_blocks - statbuf.f_bfree);
-
-		df_submit_one (disk_name, "df_complex", "free",
-				(gauge_t) (blk_free * blocksize));
-		df_submit_one (disk_name, "df_complex", "reserved",
-				(gauge_t) (blk_reserved * blocksize));
-		df_submit_one (disk_name, "df_complex", "used",
-				(gauge_t) (blk_used * blocksize));
-
-		/* inode handling */
-		if (report_inodes)
+	pthread_mutex_unlock (&df_lock);
+
+	for (i = 0; i < jobs_num; i++)
+	{
+		df_job_t *job = jobs[i];
+
+		if (job == NULL)
+			continue;
+
+		if (!async)
+		{
+			job->status = STATANYFS (job->dir, &job->statbuf);
+			job->errnum = (job->status == 0) ? 0 : errno;
+		}
+
+		if (job->status < 0)
 		{
-			uint64_t inode_free;
-			uint64_t inode_reserved;
-			uint64_t inode_used;
-
-			/* Sanity-check for the values in the struct */
-			if (statbuf.f_ffree < statbuf.f_favail)
-				statbuf.f_ffree = statbuf.f_favail;
-			if (statbuf.f_files < statbuf.f_ffree)
-				statbuf.f_files = statbuf.f_ffree;
-
-			inode_free = (uint64_t) statbuf.f_favail;
-			inode_reserved = (uint64_t) (statbuf.f_ffree - statbuf.f_favail);
-			inode_used = (uint64_t) (statbuf.f_files - statbuf.f_ffree);
-			
-			df_submit_one (disk_name, "df_inodes", "free",
-					(gauge_t) inode_free);
-			df_submit_one (disk_name, "df_inodes", "reserved",
-					(gauge_t) inode_reserved);
-			df_submit_one (disk_name, "df_inodes", "used",
-					(gauge_t) inode_used);
+			char errbuf[1024];
+			ERROR (STATANYFS_STR"(%s) failed: %s",
+					job->dir,
+					sstrerror (job->errnum, errbuf,
+						sizeof (errbuf)));
 		}
+		else
+			df_submit_mount (df_selected[i], &job->statbuf);
+
+		df_job_free (job);
 	}
 
-	cu_mount_freelist (mnt_list);
+	sfree (jobs);
 
 	return (0);
 } /* int df_read */
 
+static int df_shutdown (void)
+{
+	pthread_mutex_lock (&df_lock);
+	df_workers_shutdown = 1;
+	pthread_cond_broadcast (&df_work_cond);
+	pthread_mutex_unlock (&df_lock);
+
+#if KERNEL_LINUX
+	if (mountinfo_fd >= 0)
+	{
+		close (mountinfo_fd);
+		mountinfo_fd = -1;
+	}
+#endif
+
+	cu_mount_freelist (df_mounts);
+	df_mounts = NULL;
+	sfree (df_selected);
+	df_selected_num = 0;
+
+	return (0);
+} /* int df_shutdown */
+
 void module_register (void)
 {
 	plugin_register_config ("df", df_config,
 			config_keys, config_keys_num);
 	plugin_register_init ("df", df_init);
 	plugin_register_read ("df", df_read);
+	plugin_register_shutdown ("df", df_shutdown);
 } /* void module_register */
@@ -25,6 +25,7 @@
 #include "common.h"
 #include "plugin.h"
 #include "utils_ignorelist.h"
+#include "utils_htable.h"
 
 #if HAVE_MACH_MACH_TYPES_H
 #  include <mach/mach_types.h>
@@ -101,11 +102,16 @@ typedef struct diskstats
 
 	derive_t avg_read_time;
 	derive_t avg_write_time;
-
-	struct diskstats *next;
 } diskstats_t;
 
-static diskstats_t *disklist;
+/* The previous counters of each device, by name. Hosts with thousands of
+ * multipath devices and partitions made looking them up in a list slow. */
+static c_htable_t *disklist = NULL;
+
+/* /proc/diskstats or, with 2.4 kernels, /proc/partitions, which has one more
+ * leading field. */
+static pread_file_t *pf_diskstats = NULL;
+static int diskstats_fieldshift = 0;
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKSTAT
@@ -470,12 +476,12 @@ static int disk_read (void)
 /* #endif HAVE_IOKIT_IOKITLIB_H */
 
 #elif KERNEL_LINUX
-	FILE *fh;
-	char buffer[1024];
-	
+	char *buffer;
+	char *ptr;
+
 	char *fields[32];
 	int numfields;
-	int fieldshift = 0;
+	int fieldshift;
 
 	int minor = 0;
 
@@ -490,27 +496,45 @@ static int disk_read (void)
 	derive_t write_time    = 0;
 	int is_disk = 0;
 
-	diskstats_t *ds, *pre_ds;
+	diskstats_t *ds;
 
-	if ((fh = fopen ("/proc/diskstats", "r")) == NULL)
+	if (disklist == NULL)
 	{
-		fh = fopen ("/proc/partitions", "r");
-		if (fh == NULL)
+		disklist = c_htable_create ();
+		if (disklist == NULL)
 		{
-			ERROR ("disk plugin: fopen (/proc/{diskstats,partitions}) failed.");
+			ERROR ("disk plugin: c_htable_create failed.");
 			return (-1);
 		}
+	}
+
+	if (pf_diskstats == NULL)
+	{
+		if (access ("/proc/diskstats", R_OK) == 0)
+		{
+			pf_diskstats = pread_file_create ("/proc/diskstats");
+			diskstats_fieldshift = 0;
+		}
+		else
+		{
+			/* Kernel is 2.4.* */
+			pf_diskstats = pread_file_create ("/proc/partitions");
+			diskstats_fieldshift = 1;
+		}
+	}
+	fieldshift = diskstats_fieldshift;
 
-		/* Kernel is 2.4.* */
-		fieldshift = 1;
+	if ((buffer = pread_file_read (pf_diskstats, NULL)) == NULL)
+	{
+		ERROR ("disk plugin: Reading /proc/{diskstats,partitions} failed.");
+		return (-1);
 	}
 
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	ptr = buffer;
+	while ((numfields = strsplit_line (&ptr, fields, 32)) >= 0)
 	{
 		char *disk_name;
 
-		numfields = strsplit (buffer, fields, 32);
-
 		if ((numfields != (14 + fieldshift)) && (numfields != 7))
 			continue;
 
@@ -518,11 +542,7 @@ static int disk_read (void)
 
 		disk_name = fields[2 + fieldshift];
 
-		for (ds = disklist, pre_ds = disklist; ds != NULL; pre_ds = ds, ds = ds->next)
-			if (strcmp (disk_name, ds->name) == 0)
-				break;
-
-		if (ds == NULL)
+		if (c_htable_get (disklist, disk_name, (void *) &ds) != 0)
 		{
 			if ((ds = (diskstats_t *) calloc (1, sizeof (diskstats_t))) == NULL)
 				continue;
@@ -533,10 +553,12 @@ static int disk_read (void)
 				continue;
 			}
 
-			if (pre_ds == NULL)
-				disklist = ds;
-			else
-				pre_ds->next = ds;
+			if (c_htable_insert (disklist, ds->name, ds) != 0)
+			{
+				free (ds->name);
+				free (ds);
+				continue;
+			}
 		}
 
 		is_disk = 0;
@@ -676,9 +698,7 @@ static int disk_read (void)
 			disk_submit (disk_name, "disk_merged",
 					read_merged, write_merged);
 		} /* if (is_disk) */
-	} /* while (fgets (buffer, sizeof (buffer), fh) != NULL) */
-
-	fclose (fh);
+	} /* while (strsplit_line (&ptr, fields, 32) >= 0) */
 /* #endif defined(KERNEL_LINUX) */
 
 #elif HAVE_LIBKSTAT
@@ -802,10 +822,37 @@ static int disk_read (void)
 	return (0);
 } /* int disk_read */
 
+#if KERNEL_LINUX
+static int disk_shutdown (void)
+{
+	void *key;
+	void *value;
+
+	pread_file_destroy (pf_diskstats);
+	pf_diskstats = NULL;
+
+	if (disklist != NULL)
+	{
+		while (c_htable_pick (disklist, &key, &value) == 0)
+		{
+			sfree (key);
+			sfree (value);
+		}
+		c_htable_destroy (disklist);
+		disklist = NULL;
+	}
+
+	return (0);
+} /* int disk_shutdown */
+#endif /* KERNEL_LINUX */
+
 void module_register (void)
 {
   plugin_register_config ("disk", disk_config,
       config_keys, config_keys_num);
   plugin_register_init ("disk", disk_init);
   plugin_register_read ("disk", disk_read);
+#if KERNEL_LINUX
+  plugin_register_shutdown ("disk", disk_shutdown);
+#endif
 } /* void module_register */
@@ -53,13 +53,16 @@ static const char *config_keys[] =
 {
 	"Interface",
 	"IgnoreSource",
-	"SelectNumericQueryTypes"
+	"SelectNumericQueryTypes",
+	"CaptureBufferSize"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 static int select_numeric_qtype = 1;
 
 #define PCAP_SNAPLEN 1460
 static char   *pcap_device = NULL;
+/* Size of the kernel's capture buffer in bytes, zero for libpcap's default. */
+static int     pcap_buffer_size = 0;
 
 static derive_t       tr_queries;
 static derive_t       tr_responses;
@@ -75,6 +78,22 @@ static pthread_mutex_t qtype_mutex   = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t opcode_mutex  = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t rcode_mutex   = PTHREAD_MUTEX_INITIALIZER;
 
+/* Packets dropped by the kernel and the interface, as reported by
+ * `pcap_stats'. Protected by `traffic_mutex'. */
+static derive_t        pcap_dropped_kernel;
+static derive_t        pcap_dropped_interface;
+static _Bool           pcap_have_stats = 0;
+
+/* The listener thread counts into these without locking. They are merged
+ * into the counters above after each block of packets returned by
+ * `pcap_dispatch', so the mutexes are taken once per block rather than
+ * several times per packet. */
+static derive_t        pending_queries;
+static derive_t        pending_responses;
+static counter_list_t *pending_qtype_list;
+static counter_list_t *pending_opcode_list;
+static counter_list_t *pending_rcode_list;
+
 /*
  * Private functions
  */
@@ -137,6 +156,20 @@ static void counter_list_add (counter_list_t **list,
 	}
 }
 
+/* Adds the values of `src' to `dst' and resets them. The entries of `src' are
+ * kept, so no memory is allocated once all keys have been seen. */
+static void counter_list_merge (counter_list_t **dst, counter_list_t *src)
+{
+	for (; src != NULL; src = src->next)
+	{
+		if (src->value == 0)
+			continue;
+
+		counter_list_add (dst, src->key, src->value);
+		src->value = 0;
+	}
+}
+
 static int dns_config (const char *key, const char *value)
 {
 	if (strcasecmp (key, "Interface") == 0)
@@ -158,6 +191,23 @@ static int dns_config (const char *key, const char *value)
 		else
 			select_numeric_qtype = 1;
 	}
+	else if (strcasecmp (key, "CaptureBufferSize") == 0)
+	{
+		int tmp = atoi (value);
+
+		/* the value is given in megabytes */
+		if ((tmp < 0) || (tmp > 2047))
+		{
+			ERROR ("dns plugin: Invalid CaptureBufferSize: %s", value);
+			return (1);
+		}
+#if !HAVE_PCAP_SET_BUFFER_SIZE
+		if (tmp > 0)
+			WARNING ("dns plugin: CaptureBufferSize is not supported "
+					"by this version of libpcap and will be ignored.");
+#endif
+		pcap_buffer_size = tmp * 1024 * 1024;
+	}
 	else
 	{
 		return (-1);
@@ -166,6 +216,7 @@ static int dns_config (const char *key, const char *value)
 	return (0);
 }
 
+/* Called by `handle_pcap' in the listener thread for each DNS packet. */
 static void dns_child_callback (const rfc1035_header_t *dns)
 {
 	if (dns->qr == 0)
@@ -179,39 +230,120 @@ static void dns_child_callback (const rfc1035_header_t *dns)
 				skip = 1;
 		}
 
-		pthread_mutex_lock (&traffic_mutex);
-		tr_queries += dns->length;
-		pthread_mutex_unlock (&traffic_mutex);
+		pending_queries += dns->length;
 
 		if (skip == 0)
-		{
-			pthread_mutex_lock (&qtype_mutex);
-			counter_list_add (&qtype_list, dns->qtype,  1);
-			pthread_mutex_unlock (&qtype_mutex);
-		}
+			counter_list_add (&pending_qtype_list, dns->qtype,  1);
 	}
 	else
 	{
 		/* This is a reply */
-		pthread_mutex_lock (&traffic_mutex);
-		tr_responses += dns->length;
-		pthread_mutex_unlock (&traffic_mutex);
+		pending_responses += dns->length;
 
-		pthread_mutex_lock (&rcode_mutex);
-		counter_list_add (&rcode_list,  dns->rcode,  1);
-		pthread_mutex_unlock (&rcode_mutex);
+		counter_list_add (&pending_rcode_list,  dns->rcode,  1);
 	}
 
 	/* FIXME: Are queries, replies or both interesting? */
+	counter_list_add (&pending_opcode_list, dns->opcode, 1);
+}
+
+/* Moves the counts of the listener thread to the counters used by
+ * `dns_read'. */
+static void dns_child_merge (pcap_t *pcap_obj)
+{
+	struct pcap_stat ps;
+	_Bool have_stats;
+
+	memset (&ps, 0, sizeof (ps));
+	have_stats = (pcap_stats (pcap_obj, &ps) == 0);
+
+	pthread_mutex_lock (&traffic_mutex);
+	tr_queries   += pending_queries;
+	tr_responses += pending_responses;
+	if (have_stats)
+	{
+		pcap_dropped_kernel    = (derive_t) ps.ps_drop;
+		pcap_dropped_interface = (derive_t) ps.ps_ifdrop;
+		pcap_have_stats = 1;
+	}
+	pthread_mutex_unlock (&traffic_mutex);
+
+	pending_queries   = 0;
+	pending_responses = 0;
+
+	pthread_mutex_lock (&qtype_mutex);
+	counter_list_merge (&qtype_list, pending_qtype_list);
+	pthread_mutex_unlock (&qtype_mutex);
+
 	pthread_mutex_lock (&opcode_mutex);
-	counter_list_add (&opcode_list, dns->opcode, 1);
+	counter_list_merge (&opcode_list, pending_opcode_list);
 	pthread_mutex_unlock (&opcode_mutex);
-}
 
-static void *dns_child_loop (__attribute__((unused)) void *dummy)
+	pthread_mutex_lock (&rcode_mutex);
+	counter_list_merge (&rcode_list, pending_rcode_list);
+	pthread_mutex_unlock (&rcode_mutex);
+} /* void dns_child_merge */
+
+static pcap_t *dns_child_open (const char *device)
 {
 	pcap_t *pcap_obj;
 	char    pcap_error[PCAP_ERRBUF_SIZE];
+	int     timeout = (int) CDTIME_T_TO_MS (plugin_get_interval () / 2);
+
+#if HAVE_PCAP_SET_BUFFER_SIZE
+	int status;
+
+	/* pcap_create() and pcap_activate() allow to set the size of the capture
+	 * buffer. On Linux, libpcap uses a memory mapped ring buffer
+	 * (TPACKET_V3 if available) which `pcap_dispatch' reads block by
+	 * block. */
+	pcap_obj = pcap_create (device, pcap_error);
+	if (pcap_obj == NULL)
+	{
+		ERROR ("dns plugin: Opening interface `%s' "
+				"failed: %s", device, pcap_error);
+		return (NULL);
+	}
+
+	pcap_set_snaplen (pcap_obj, PCAP_SNAPLEN);
+	pcap_set_promisc (pcap_obj, 0 /* Not promiscuous */);
+	pcap_set_timeout (pcap_obj, timeout);
+	if (pcap_buffer_size > 0)
+		pcap_set_buffer_size (pcap_obj, pcap_buffer_size);
+
+	status = pcap_activate (pcap_obj);
+	if (status < 0)
+	{
+		ERROR ("dns plugin: Opening interface `%s' "
+				"failed: %s", device, pcap_geterr (pcap_obj));
+		pcap_close (pcap_obj);
+		return (NULL);
+	}
+	else if (status > 0)
+	{
+		WARNING ("dns plugin: Opening interface `%s': %s",
+				device, pcap_geterr (pcap_obj));
+	}
+#else
+	pcap_obj = pcap_open_live (device,
+			PCAP_SNAPLEN,
+			0 /* Not promiscuous */,
+			timeout,
+			pcap_error);
+	if (pcap_obj == NULL)
+	{
+		ERROR ("dns plugin: Opening interface `%s' "
+				"failed: %s", device, pcap_error);
+		return (NULL);
+	}
+#endif
+
+	return (pcap_obj);
+} /* pcap_t *dns_child_open */
+
+static void *dns_child_loop (__attribute__((unused)) void *dummy)
+{
+	pcap_t *pcap_obj;
 	struct  bpf_program fp;
 
 	int status;
@@ -225,20 +357,12 @@ static void *dns_child_loop (__attribute__((unused)) void *dummy)
 
 	/* Passing `pcap_device == NULL' is okay and the same as passign "any" */
 	DEBUG ("dns plugin: Creating PCAP object..");
-	pcap_obj = pcap_open_live ((pcap_device != NULL) ? pcap_device : "any",
-			PCAP_SNAPLEN,
-			0 /* Not promiscuous */,
-			(int) CDTIME_T_TO_MS (plugin_get_interval () / 2),
-			pcap_error);
+	pcap_obj = dns_child_open ((pcap_device != NULL) ? pcap_device : "any");
 	if (pcap_obj == NULL)
-	{
-		ERROR ("dns plugin: Opening interface `%s' "
-				"failed: %s",
-				(pcap_device != NULL) ? pcap_device : "any",
-				pcap_error);
 		return (NULL);
-	}
 
+	/* The filter is attached to the socket, i.e. the kernel drops all other
+	 * packets before they are copied to the capture buffer. */
 	memset (&fp, 0, sizeof (fp));
 	if (pcap_compile (pcap_obj, &fp, "udp port 53", 1, 0) < 0)
 	{
@@ -250,19 +374,30 @@ static void *dns_child_loop (__attribute__((unused)) void *dummy)
 		ERROR ("dns plugin: pcap_setfilter failed");
 		return (NULL);
 	}
+	pcap_freecode (&fp);
 
 	DEBUG ("dns plugin: PCAP object created.");
 
 	dnstop_set_pcap_obj (pcap_obj);
 	dnstop_set_callback (dns_child_callback);
 
-	status = pcap_loop (pcap_obj,
-			-1 /* loop forever */,
-			handle_pcap /* callback */,
-			NULL /* Whatever this means.. */);
-	if (status < 0)
-		ERROR ("dns plugin: Listener thread is exiting "
-				"abnormally: %s", pcap_geterr (pcap_obj));
+	while (42)
+	{
+		/* Handles all packets of the next block of the capture buffer (or
+		 * returns zero after the timeout). */
+		status = pcap_dispatch (pcap_obj,
+				-1 /* all packets of the block */,
+				handle_pcap /* callback */,
+				NULL /* Whatever this means.. */);
+		if (status < 0)
+		{
+			ERROR ("dns plugin: Listener thread is exiting "
+					"abnormally: %s", pcap_geterr (pcap_obj));
+			break;
+		}
+
+		dns_child_merge (pcap_obj);
+	}
 
 	DEBUG ("dns plugin: Child is exiting.");
 
@@ -353,6 +488,14 @@ static int dns_read (void)
 	if ((values[0] != 0) || (values[1] != 0))
 		submit_octets (values[0], values[1]);
 
+	pthread_mutex_lock (&traffic_mutex);
+	if (pcap_have_stats)
+	{
+		submit_derive ("dns_dropped", "kernel", pcap_dropped_kernel);
+		submit_derive ("dns_dropped", "interface", pcap_dropped_interface);
+	}
+	pthread_mutex_unlock (&traffic_mutex);
+
 	pthread_mutex_lock (&qtype_mutex);
 	for (ptr = qtype_list, len = 0;
 		       	(ptr != NULL) && (len < T_MAX);
@@ -47,7 +47,13 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <sys/select.h>
+#include <fcntl.h>
+
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
 
 /* some systems (e.g. Darwin) seem to not define UNIX_PATH_MAX at all */
 #ifndef UNIX_PATH_MAX
@@ -61,6 +67,12 @@
 #define SOCK_PATH LOCALSTATEDIR"/run/"PACKAGE_NAME"-email"
 #define MAX_CONNS 5
 #define MAX_CONNS_LIMIT 16384
+#define READ_THREADS 1
+#define READ_THREADS_LIMIT 64
+
+/* 256 bytes ought to be enough for anybody ;-) */
+#define LINE_LEN 256
+#define READ_BUFFER_SIZE 4096
 
 #define log_debug(...) DEBUG ("email: "__VA_ARGS__)
 #define log_err(...) ERROR ("email: "__VA_ARGS__)
@@ -81,27 +93,46 @@ typedef struct {
 	type_t *tail;
 } type_list_t;
 
-/* collector thread control information */
-typedef struct collector {
-	pthread_t thread;
+/* a client connection */
+typedef struct conn {
+	int fd;
 
-	/* socket descriptor of the current/last connection */
-	FILE *socket;
-} collector_t;
+	/* position in the reader's list of connections */
+	int index;
 
-/* linked list of pending connections */
-typedef struct conn {
-	/* socket to read data from */
-	FILE *socket;
+	/* the incomplete line read so far */
+	char   line[LINE_LEN + 1]; /* line + '\0' */
+	size_t line_len;
 
-	/* linked list of connections */
-	struct conn *next;
+	/* the rest of a line which was too long is ignored */
+	int skip;
 } conn_t;
 
-typedef struct {
-	conn_t *head;
-	conn_t *tail;
-} conn_list_t;
+/* Each reader thread waits for new connections and data on its connections
+ * with epoll(7), or poll(2) where that's not available, and keeps its own
+ * counters, which are merged by email_read (). */
+typedef struct reader {
+	pthread_t thread;
+	int       thread_running;
+
+#if HAVE_SYS_EPOLL_H
+	int epoll_fd;
+	/* whether the listening socket is in the epoll set */
+	int listening;
+#endif
+
+	conn_t **conns;
+	int    conns_num;
+
+	/* protects the counters */
+	pthread_mutex_t lock;
+
+	type_list_t list_count;
+	type_list_t list_size;
+	type_list_t list_check;
+	double score_sum;
+	int    score_count;
+} reader_t;
 
 /*
  * Private variables
@@ -112,7 +143,8 @@ static const char *config_keys[] =
 	"SocketFile",
 	"SocketGroup",
 	"SocketPerms",
-	"MaxConns"
+	"MaxConns",
+	"ReadThreads"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -121,45 +153,26 @@ static char *sock_file  = NULL;
 static char *sock_group = NULL;
 static int  sock_perms  = S_IRWXU | S_IRWXG;
 static int  max_conns   = MAX_CONNS;
+static int  read_threads = READ_THREADS;
 
 /* state of the plugin */
 static int disabled = 0;
 
-/* thread managing "client" connections */
-static pthread_t connector = (pthread_t) 0;
 static int connector_socket = -1;
 
-/* tell the collector threads that a new connection is available */
-static pthread_cond_t conn_available = PTHREAD_COND_INITIALIZER;
+/* Written to on shutdown. The read end is never drained, so it stays readable
+ * and wakes up all the readers. */
+static int shutdown_pipe[2] = { -1, -1 };
 
-/* connections that are waiting to be processed */
-static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
-static conn_list_t conns;
+static reader_t *readers = NULL;
+static int readers_num = 0;
+/* the maximum number of connections per reader */
+static int reader_conns_max = 0;
 
-/* tell the connector thread that a collector is available */
-static pthread_cond_t collector_available = PTHREAD_COND_INITIALIZER;
-
-/* collector threads */
-static collector_t **collectors = NULL;
-
-static pthread_mutex_t available_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int available_collectors;
-
-static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* the totals of all readers, only used by email_read () */
 static type_list_t list_count;
-static type_list_t list_count_copy;
-
-static pthread_mutex_t size_mutex = PTHREAD_MUTEX_INITIALIZER;
 static type_list_t list_size;
-static type_list_t list_size_copy;
-
-static pthread_mutex_t score_mutex = PTHREAD_MUTEX_INITIALIZER;
-static double score;
-static int score_count;
-
-static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
 static type_list_t list_check;
-static type_list_t list_check_copy;
 
 /*
  * Private functions
@@ -205,6 +218,18 @@ static int email_config (const char *key, const char *value)
 			max_conns = (int)tmp;
 		}
 	}
+	else if (0 == strcasecmp (key, "ReadThreads")) {
+		long int tmp = strtol (value, NULL, 0);
+
+		if ((tmp < 1) || (tmp > READ_THREADS_LIMIT)) {
+			ERROR ("email plugin: `ReadThreads' must be between 1 and %i, "
+					"will use default %i.", READ_THREADS_LIMIT, READ_THREADS);
+			read_threads = READ_THREADS;
+		}
+		else {
+			read_threads = (int)tmp;
+		}
+	}
 	else {
 		return -1;
 	}
@@ -246,142 +271,369 @@ static void type_list_incr (type_list_t *list, char *name, int incr)
 	return;
 } /* static void type_list_incr (type_list_t *, char *) */
 
-static void *collect (void *arg)
+static void type_list_free (type_list_t *list)
 {
-	collector_t *this = (collector_t *)arg;
+	type_t *ptr = list->head;
 
-	while (1) {
-		int loop = 1;
+	while (NULL != ptr) {
+		type_t *next = ptr->next;
+
+		free (ptr->name);
+		free (ptr);
+		ptr = next;
+	}
+
+	list->head = NULL;
+	list->tail = NULL;
+} /* static void type_list_free (type_list_t *) */
+
+/* Handle one line of the protocol. Called with the reader's lock held. */
+static void handle_line (reader_t *this, char *line)
+{
+	log_debug ("collect: line = '%s'", line);
 
-		conn_t *connection;
+	if (':' != line[1]) {
+		log_err ("collect: syntax error in line '%s'", line);
+		return;
+	}
 
-		pthread_mutex_lock (&conns_mutex);
+	if ('e' == line[0]) { /* e:<type>:<bytes> */
+		char *ptr  = NULL;
+		char *type = strtok_r (line + 2, ":", &ptr);
+		char *tmp  = strtok_r (NULL, ":", &ptr);
+		int  bytes = 0;
 
-		while (NULL == conns.head) {
-			pthread_cond_wait (&conn_available, &conns_mutex);
+		if (NULL == tmp) {
+			log_err ("collect: syntax error in line '%s'", line);
+			return;
 		}
 
-		connection = conns.head;
-		conns.head = conns.head->next;
+		bytes = atoi (tmp);
+
+		type_list_incr (&this->list_count, type, 1);
+
+		if (bytes > 0)
+			type_list_incr (&this->list_size, type, bytes);
+	}
+	else if ('s' == line[0]) { /* s:<value> */
+		this->score_sum += atof (line + 2);
+		++this->score_count;
+	}
+	else if ('c' == line[0]) { /* c:<type1>[,<type2>,...] */
+		char *ptr  = NULL;
+		char *type = strtok_r (line + 2, ",", &ptr);
 
-		if (NULL == conns.head) {
-			conns.tail = NULL;
+		while (NULL != type) {
+			type_list_incr (&this->list_check, type, 1);
+			type = strtok_r (NULL, ",", &ptr);
 		}
+	}
+	else {
+		log_err ("collect: unknown type '%c'", line[0]);
+	}
+} /* static void handle_line (reader_t *, char *) */
 
-		pthread_mutex_unlock (&conns_mutex);
+/* Split the data read from a connection into lines. Called with the reader's
+ * lock held. */
+static void handle_data (reader_t *this, conn_t *connection,
+		const char *data, size_t size)
+{
+	while (size > 0) {
+		const char *end = memchr (data, '\n', size);
+		size_t len = (NULL != end) ? (size_t)(end - data) : size;
+
+		if (! connection->skip) {
+			if (connection->line_len + len > LINE_LEN) {
+				log_warn ("collect: line too long (> %i characters) "
+						"on fd #%i, ignoring it", LINE_LEN, connection->fd);
+				connection->skip = 1;
+			}
+			else {
+				memcpy (connection->line + connection->line_len, data, len);
+				connection->line_len += len;
+			}
+		}
 
-		/* make the socket available to the global
-		 * thread and connection management */
-		this->socket = connection->socket;
+		if (NULL == end)
+			break;
 
-		log_debug ("collect: handling connection on fd #%i",
-				fileno (this->socket));
+		if (! connection->skip) {
+			connection->line[connection->line_len] = '\0';
+			if ((connection->line_len > 0)
+					&& ('\r' == connection->line[connection->line_len - 1]))
+				connection->line[connection->line_len - 1] = '\0';
+			handle_line (this, connection->line);
+		}
 
-		while (loop) {
-			/* 256 bytes ought to be enough for anybody ;-) */
-			char line[256 + 1]; /* line + '\0' */
-			int  len = 0;
+		connection->line_len = 0;
+		connection->skip = 0;
 
-			errno = 0;
-			if (NULL == fgets (line, sizeof (line), this->socket)) {
-				loop = 0;
+		data += len + 1;
+		size -= len + 1;
+	}
+} /* static void handle_data (reader_t *, conn_t *, const char *, size_t) */
 
-				if (0 != errno) {
-					char errbuf[1024];
-					log_err ("collect: reading from socket (fd #%i) "
-							"failed: %s", fileno (this->socket),
-							sstrerror (errno, errbuf, sizeof (errbuf)));
-				}
-				break;
-			}
+/* Enable or disable waiting for new connections. */
+static void reader_listen (reader_t *this, int enable)
+{
+#if HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+
+	if (enable == this->listening)
+		return;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = enable ? EPOLLIN : 0;
+	ev.data.ptr = NULL;
 
-			len = strlen (line);
-			if (('\n' != line[len - 1]) && ('\r' != line[len - 1])) {
-				log_warn ("collect: line too long (> %zu characters): "
-						"'%s' (truncated)", sizeof (line) - 1, line);
+	if (0 != epoll_ctl (this->epoll_fd, EPOLL_CTL_MOD, connector_socket, &ev)) {
+		char errbuf[1024];
+		log_err ("epoll_ctl() failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return;
+	}
+	this->listening = enable;
+#else
+	/* the listening socket is only polled while there's room */
+	(void) this;
+	(void) enable;
+#endif
+} /* static void reader_listen (reader_t *, int) */
+
+static void close_connection (reader_t *this, conn_t *connection)
+{
+	log_debug ("Shutting down connection on fd #%i", connection->fd);
 
-				while (NULL != fgets (line, sizeof (line), this->socket))
-					if (('\n' == line[len - 1]) || ('\r' == line[len - 1]))
-						break;
+	/* closing the descriptor removes it from the epoll set */
+	close (connection->fd);
+
+	--this->conns_num;
+	this->conns[connection->index] = this->conns[this->conns_num];
+	this->conns[connection->index]->index = connection->index;
+	this->conns[this->conns_num] = NULL;
+	free (connection);
+
+	reader_listen (this, 1);
+} /* static void close_connection (reader_t *, conn_t *) */
+
+/* Read everything available on a connection. Returns non-zero if the
+ * connection has been closed. */
+static int read_connection (reader_t *this, conn_t *connection)
+{
+	char buffer[READ_BUFFER_SIZE];
+
+	while (1) {
+		ssize_t status = read (connection->fd, buffer, sizeof (buffer));
+
+		if (status > 0) {
+			pthread_mutex_lock (&this->lock);
+			handle_data (this, connection, buffer, (size_t)status);
+			pthread_mutex_unlock (&this->lock);
+			continue;
+		}
+
+		if (status < 0) {
+			if (EINTR == errno)
 				continue;
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+				return 0;
+
+			{
+				char errbuf[1024];
+				log_err ("collect: reading from socket (fd #%i) "
+						"failed: %s", connection->fd,
+						sstrerror (errno, errbuf, sizeof (errbuf)));
 			}
+		}
+		else if ((connection->line_len > 0) && (! connection->skip)) {
+			/* the last line isn't terminated by a newline */
+			pthread_mutex_lock (&this->lock);
+			handle_data (this, connection, "\n", 1);
+			pthread_mutex_unlock (&this->lock);
+		}
+
+		close_connection (this, connection);
+		return 1;
+	}
+} /* static int read_connection (reader_t *, conn_t *) */
+
+/* Accept a new connection, unless another reader has been faster. */
+static void accept_connection (reader_t *this)
+{
+	conn_t *connection;
+	int remote;
+	int flags;
+
+	if (this->conns_num >= reader_conns_max) {
+		reader_listen (this, 0);
+		return;
+	}
+
+	remote = accept (connector_socket, NULL, NULL);
+	if (-1 == remote) {
+		if ((EINTR != errno) && (EAGAIN != errno) && (EWOULDBLOCK != errno)
+				&& (ECONNABORTED != errno)) {
+			char errbuf[1024];
+			log_err ("accept() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+		}
+		return;
+	}
 
-			line[len - 1] = '\0';
+	flags = fcntl (remote, F_GETFL);
+	if ((-1 == flags) || (0 != fcntl (remote, F_SETFL, flags | O_NONBLOCK))) {
+		char errbuf[1024];
+		log_err ("fcntl() failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (remote);
+		return;
+	}
+
+	connection = (conn_t *)calloc (1, sizeof (*connection));
+	if (NULL == connection) {
+		log_err ("calloc() failed");
+		close (remote);
+		return;
+	}
+	connection->fd = remote;
+
+#if HAVE_SYS_EPOLL_H
+	{
+		struct epoll_event ev;
+
+		memset (&ev, 0, sizeof (ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = connection;
+
+		if (0 != epoll_ctl (this->epoll_fd, EPOLL_CTL_ADD, remote, &ev)) {
+			char errbuf[1024];
+			log_err ("epoll_ctl() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			close (remote);
+			free (connection);
+			return;
+		}
+	}
+#endif
 
-			log_debug ("collect: line = '%s'", line);
+	log_debug ("collect: handling connection on fd #%i", remote);
 
-			if (':' != line[1]) {
-				log_err ("collect: syntax error in line '%s'", line);
+	connection->index = this->conns_num;
+	this->conns[this->conns_num] = connection;
+	++this->conns_num;
+
+	if (this->conns_num >= reader_conns_max)
+		reader_listen (this, 0);
+} /* static void accept_connection (reader_t *) */
+
+#if HAVE_SYS_EPOLL_H
+static void *collect (void *arg)
+{
+	reader_t *this = (reader_t *)arg;
+	struct epoll_event events[64];
+
+	while (1) {
+		int num;
+		int i;
+
+		num = epoll_wait (this->epoll_fd, events, STATIC_ARRAY_SIZE (events),
+				/* timeout = */ -1);
+		if (num < 0) {
+			char errbuf[1024];
+
+			if (EINTR == errno)
 				continue;
-			}
 
-			if ('e' == line[0]) { /* e:<type>:<bytes> */
-				char *ptr  = NULL;
-				char *type = strtok_r (line + 2, ":", &ptr);
-				char *tmp  = strtok_r (NULL, ":", &ptr);
-				int  bytes = 0;
+			log_err ("epoll_wait() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			disabled = 1;
+			break;
+		}
 
-				if (NULL == tmp) {
-					log_err ("collect: syntax error in line '%s'", line);
-					continue;
-				}
+		for (i = 0; i < num; ++i) {
+			if (events[i].data.ptr == (void *)shutdown_pipe)
+				return ((void *) 0);
+			else if (NULL == events[i].data.ptr)
+				accept_connection (this);
+			else
+				read_connection (this, events[i].data.ptr);
+		}
+	}
 
-				bytes = atoi (tmp);
+	return ((void *) 0);
+} /* static void *collect (void *) */
+#else /* !HAVE_SYS_EPOLL_H */
+static void *collect (void *arg)
+{
+	reader_t *this = (reader_t *)arg;
+	struct pollfd *fds;
+	conn_t **conns;
+
+	/* the shutdown pipe, the listening socket and the connections */
+	fds = (struct pollfd *)calloc (reader_conns_max + 2, sizeof (*fds));
+	/* connections may be closed while handling the results */
+	conns = (conn_t **)calloc (reader_conns_max, sizeof (*conns));
+	if ((NULL == fds) || (NULL == conns)) {
+		log_err ("calloc() failed");
+		disabled = 1;
+		sfree (fds);
+		sfree (conns);
+		return ((void *) 0);
+	}
 
-				pthread_mutex_lock (&count_mutex);
-				type_list_incr (&list_count, type, 1);
-				pthread_mutex_unlock (&count_mutex);
+	while (1) {
+		int conns_num = this->conns_num;
+		int listening = (this->conns_num < reader_conns_max);
+		int num = 1;
+		int i;
+
+		fds[0].fd = shutdown_pipe[0];
+		fds[0].events = POLLIN;
+		if (listening) {
+			fds[num].fd = connector_socket;
+			fds[num].events = POLLIN;
+			++num;
+		}
 
-				if (bytes > 0) {
-					pthread_mutex_lock (&size_mutex);
-					type_list_incr (&list_size, type, bytes);
-					pthread_mutex_unlock (&size_mutex);
-				}
-			}
-			else if ('s' == line[0]) { /* s:<value> */
-				pthread_mutex_lock (&score_mutex);
-				score = (score * (double)score_count + atof (line + 2))
-						/ (double)(score_count + 1);
-				++score_count;
-				pthread_mutex_unlock (&score_mutex);
-			}
-			else if ('c' == line[0]) { /* c:<type1>[,<type2>,...] */
-				char *ptr  = NULL;
-				char *type = strtok_r (line + 2, ",", &ptr);
-
-				do {
-					pthread_mutex_lock (&check_mutex);
-					type_list_incr (&list_check, type, 1);
-					pthread_mutex_unlock (&check_mutex);
-				} while (NULL != (type = strtok_r (NULL, ",", &ptr)));
-			}
-			else {
-				log_err ("collect: unknown type '%c'", line[0]);
-			}
-		} /* while (loop) */
+		for (i = 0; i < conns_num; ++i) {
+			conns[i] = this->conns[i];
+			fds[num + i].fd = conns[i]->fd;
+			fds[num + i].events = POLLIN;
+		}
 
-		log_debug ("Shutting down connection on fd #%i",
-				fileno (this->socket));
+		if (poll (fds, (nfds_t)(num + conns_num), /* timeout = */ -1) < 0) {
+			char errbuf[1024];
 
-		fclose (connection->socket);
-		free (connection);
+			if (EINTR == errno)
+				continue;
 
-		this->socket = NULL;
+			log_err ("poll() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			disabled = 1;
+			break;
+		}
 
-		pthread_mutex_lock (&available_mutex);
-		++available_collectors;
-		pthread_mutex_unlock (&available_mutex);
+		if (0 != fds[0].revents)
+			break;
 
-		pthread_cond_signal (&collector_available);
-	} /* while (1) */
+		for (i = 0; i < conns_num; ++i)
+			if (0 != fds[num + i].revents)
+				read_connection (this, conns[i]);
 
-	pthread_exit ((void *)0);
+		if (listening && (0 != fds[1].revents))
+			accept_connection (this);
+	}
+
+	sfree (fds);
+	sfree (conns);
 	return ((void *) 0);
 } /* static void *collect (void *) */
+#endif /* HAVE_SYS_EPOLL_H */
 
-static void *open_connection (void __attribute__((unused)) *arg)
+static int open_socket (void)
 {
 	struct sockaddr_un addr;
+	int flags;
 
 	char *path  = (NULL == sock_file) ? SOCK_PATH : sock_file;
 	char *group = (NULL == sock_group) ? COLLECTD_GRP_NAME : sock_group;
@@ -390,10 +642,9 @@ static void *open_connection (void __attribute__((unused)) *arg)
 	errno = 0;
 	if (-1 == (connector_socket = socket (PF_UNIX, SOCK_STREAM, 0))) {
 		char errbuf[1024];
-		disabled = 1;
 		log_err ("socket() failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		pthread_exit ((void *)1);
+		return -1;
 	}
 
 	addr.sun_family = AF_UNIX;
@@ -404,23 +655,24 @@ static void *open_connection (void __attribute__((unused)) *arg)
 				offsetof (struct sockaddr_un, sun_path)
 					+ strlen(addr.sun_path))) {
 		char errbuf[1024];
-		disabled = 1;
 		close (connector_socket);
 		connector_socket = -1;
 		log_err ("bind() failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		pthread_exit ((void *)1);
+		return -1;
 	}
 
+	/* all the readers accept connections */
 	errno = 0;
-	if (-1 == listen (connector_socket, 5)) {
+	if ((-1 == listen (connector_socket, 5))
+			|| (-1 == (flags = fcntl (connector_socket, F_GETFL)))
+			|| (0 != fcntl (connector_socket, F_SETFL, flags | O_NONBLOCK))) {
 		char errbuf[1024];
-		disabled = 1;
 		close (connector_socket);
 		connector_socket = -1;
 		log_err ("listen() failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		pthread_exit ((void *)1);
+		return -1;
 	}
 
 	{
@@ -461,187 +713,168 @@ static void *open_connection (void __attribute__((unused)) *arg)
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 	}
 
-	{ /* initialize collector threads */
-		int i   = 0;
-		int err = 0;
-
-		pthread_attr_t ptattr;
-
-		conns.head = NULL;
-		conns.tail = NULL;
-
-		pthread_attr_init (&ptattr);
-		pthread_attr_setdetachstate (&ptattr, PTHREAD_CREATE_DETACHED);
-
-		available_collectors = max_conns;
-
-		collectors =
-			(collector_t **)smalloc (max_conns * sizeof (collector_t *));
-
-		for (i = 0; i < max_conns; ++i) {
-			collectors[i] = (collector_t *)smalloc (sizeof (collector_t));
-			collectors[i]->socket = NULL;
+	return 0;
+} /* static int open_socket (void) */
 
-			if (0 != (err = plugin_thread_create (&collectors[i]->thread,
-							&ptattr, collect, collectors[i]))) {
-				char errbuf[1024];
-				log_err ("pthread_create() failed: %s",
-						sstrerror (errno, errbuf, sizeof (errbuf)));
-				collectors[i]->thread = (pthread_t) 0;
-			}
-		}
+static int reader_init (reader_t *this)
+{
+	memset (this, 0, sizeof (*this));
+	pthread_mutex_init (&this->lock, /* attr = */ NULL);
 
-		pthread_attr_destroy (&ptattr);
+	this->conns = (conn_t **)calloc (reader_conns_max, sizeof (conn_t *));
+	if (NULL == this->conns) {
+		log_err ("calloc() failed");
+		return -1;
 	}
 
-	while (1) {
-		int remote = 0;
-
-		conn_t *connection;
+#if HAVE_SYS_EPOLL_H
+	this->epoll_fd = epoll_create (/* size = */ reader_conns_max + 2);
+	if (this->epoll_fd < 0) {
+		char errbuf[1024];
+		log_err ("epoll_create() failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return -1;
+	}
 
-		pthread_mutex_lock (&available_mutex);
+	{
+		struct epoll_event ev;
 
-		while (0 == available_collectors) {
-			pthread_cond_wait (&collector_available, &available_mutex);
+		memset (&ev, 0, sizeof (ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = (void *)shutdown_pipe;
+		if (0 != epoll_ctl (this->epoll_fd, EPOLL_CTL_ADD, shutdown_pipe[0],
+					&ev)) {
+			char errbuf[1024];
+			log_err ("epoll_ctl() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return -1;
 		}
 
-		--available_collectors;
-
-		pthread_mutex_unlock (&available_mutex);
-
-		do {
-			errno = 0;
-			if (-1 == (remote = accept (connector_socket, NULL, NULL))) {
-				if (EINTR != errno) {
-					char errbuf[1024];
-					disabled = 1;
-					close (connector_socket);
-					connector_socket = -1;
-					log_err ("accept() failed: %s",
-							sstrerror (errno, errbuf, sizeof (errbuf)));
-					pthread_exit ((void *)1);
-				}
-			}
-		} while (EINTR == errno);
-
-		connection = (conn_t *)smalloc (sizeof (conn_t));
-
-		connection->socket = fdopen (remote, "r");
-		connection->next   = NULL;
-
-		if (NULL == connection->socket) {
-			close (remote);
-			continue;
+		ev.data.ptr = NULL;
+		if (0 != epoll_ctl (this->epoll_fd, EPOLL_CTL_ADD, connector_socket,
+					&ev)) {
+			char errbuf[1024];
+			log_err ("epoll_ctl() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return -1;
 		}
+		this->listening = 1;
+	}
+#endif
 
-		pthread_mutex_lock (&conns_mutex);
-
-		if (NULL == conns.head) {
-			conns.head = connection;
-			conns.tail = connection;
-		}
-		else {
-			conns.tail->next = connection;
-			conns.tail = conns.tail->next;
-		}
+	return 0;
+} /* static int reader_init (reader_t *) */
 
-		pthread_mutex_unlock (&conns_mutex);
+static void reader_destroy (reader_t *this)
+{
+	int i;
 
-		pthread_cond_signal (&conn_available);
+	for (i = 0; i < this->conns_num; ++i) {
+		close (this->conns[i]->fd);
+		free (this->conns[i]);
 	}
+	sfree (this->conns);
+	this->conns_num = 0;
 
-	pthread_exit ((void *) 0);
-	return ((void *) 0);
-} /* static void *open_connection (void *) */
+#if HAVE_SYS_EPOLL_H
+	if (this->epoll_fd >= 0)
+		close (this->epoll_fd);
+	this->epoll_fd = -1;
+#endif
+
+	type_list_free (&this->list_count);
+	type_list_free (&this->list_size);
+	type_list_free (&this->list_check);
+	pthread_mutex_destroy (&this->lock);
+} /* static void reader_destroy (reader_t *) */
 
 static int email_init (void)
 {
-	int err = 0;
+	int i;
 
-	if (0 != (err = plugin_thread_create (&connector, NULL,
-				open_connection, NULL))) {
+	if (0 != open_socket ()) {
+		disabled = 1;
+		return (-1);
+	}
+
+	if (0 != pipe (shutdown_pipe)) {
 		char errbuf[1024];
 		disabled = 1;
-		log_err ("pthread_create() failed: %s",
+		log_err ("pipe() failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
-	return (0);
-} /* int email_init */
-
-static int email_shutdown (void)
-{
-	type_t *ptr = NULL;
-
-	int i = 0;
+	readers_num = (read_threads < max_conns) ? read_threads : max_conns;
+	reader_conns_max = (max_conns + readers_num - 1) / readers_num;
 
-	if (connector != ((pthread_t) 0)) {
-		pthread_kill (connector, SIGTERM);
-		connector = (pthread_t) 0;
+	readers = (reader_t *)calloc (readers_num, sizeof (reader_t));
+	if (NULL == readers) {
+		disabled = 1;
+		log_err ("calloc() failed");
+		return (-1);
 	}
 
-	if (connector_socket >= 0) {
-		close (connector_socket);
-		connector_socket = -1;
-	}
+	for (i = 0; i < readers_num; ++i) {
+		int err;
 
-	/* don't allow any more connections to be processed */
-	pthread_mutex_lock (&conns_mutex);
+		if (0 != reader_init (readers + i)) {
+			disabled = 1;
+			return (-1);
+		}
 
-	available_collectors = 0;
+		if (0 != (err = plugin_thread_create (&readers[i].thread, NULL,
+						collect, readers + i))) {
+			char errbuf[1024];
+			disabled = 1;
+			log_err ("pthread_create() failed: %s",
+					sstrerror (err, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+		readers[i].thread_running = 1;
+	}
 
-	if (collectors != NULL) {
-		for (i = 0; i < max_conns; ++i) {
-			if (collectors[i] == NULL)
-				continue;
+	return (0);
+} /* int email_init */
 
-			if (collectors[i]->thread != ((pthread_t) 0)) {
-				pthread_kill (collectors[i]->thread, SIGTERM);
-				collectors[i]->thread = (pthread_t) 0;
-			}
+static int email_shutdown (void)
+{
+	int i = 0;
 
-			if (collectors[i]->socket != NULL) {
-				fclose (collectors[i]->socket);
-				collectors[i]->socket = NULL;
-			}
+	if (shutdown_pipe[1] >= 0) {
+		char c = 0;
 
-			sfree (collectors[i]);
+		if (1 != write (shutdown_pipe[1], &c, 1)) {
+			char errbuf[1024];
+			log_err ("write() failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
 		}
-		sfree (collectors);
-	} /* if (collectors != NULL) */
-
-	pthread_mutex_unlock (&conns_mutex);
-
-	for (ptr = list_count.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
 	}
 
-	for (ptr = list_count_copy.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
+	if (NULL != readers) {
+		for (i = 0; i < readers_num; ++i) {
+			if (readers[i].thread_running)
+				pthread_join (readers[i].thread, NULL);
+			reader_destroy (readers + i);
+		}
+		sfree (readers);
+		readers_num = 0;
 	}
 
-	for (ptr = list_size.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
+	for (i = 0; i < 2; ++i) {
+		if (shutdown_pipe[i] >= 0)
+			close (shutdown_pipe[i]);
+		shutdown_pipe[i] = -1;
 	}
 
-	for (ptr = list_size_copy.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
+	if (connector_socket >= 0) {
+		close (connector_socket);
+		connector_socket = -1;
 	}
 
-	for (ptr = list_check.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
-	}
-
-	for (ptr = list_check_copy.head; NULL != ptr; ptr = ptr->next) {
-		free (ptr->name);
-		free (ptr);
-	}
+	type_list_free (&list_count);
+	type_list_free (&list_size);
+	type_list_free (&list_check);
 
 	unlink ((NULL == sock_file) ? SOCK_PATH : sock_file);
 
@@ -667,97 +900,78 @@ static void email_submit (const char *type, const char *type_instance, gauge_t v
 	plugin_dispatch_values (&vl);
 } /* void email_submit */
 
-/* Copy list l1 to list l2. l2 may partly exist already, but it is assumed
- * that neither the order nor the name of any element of either list is
- * changed and no elements are deleted. The values of l1 are reset to zero
- * after they have been copied to l2. */
-static void copy_type_list (type_list_t *l1, type_list_t *l2)
+/* Add the values of the reader's list `src' to `dst' and reset them to
+ * zero. The names in `dst' are kept, so that they are reported every time. */
+static void merge_type_list (type_list_t *src, type_list_t *dst)
 {
-	type_t *ptr1;
-	type_t *ptr2;
-
-	type_t *last = NULL;
-
-	for (ptr1 = l1->head, ptr2 = l2->head; NULL != ptr1;
-			ptr1 = ptr1->next, last = ptr2, ptr2 = ptr2->next) {
-		if (NULL == ptr2) {
-			ptr2 = (type_t *)smalloc (sizeof (type_t));
-			ptr2->name = NULL;
-			ptr2->next = NULL;
-
-			if (NULL == last) {
-				l2->head = ptr2;
-			}
-			else {
-				last->next = ptr2;
-			}
-
-			l2->tail = ptr2;
-		}
+	type_t *ptr;
 
-		if (NULL == ptr2->name) {
-			ptr2->name = sstrdup (ptr1->name);
-		}
+	for (ptr = src->head; NULL != ptr; ptr = ptr->next) {
+		if (0 == ptr->value)
+			continue;
 
-		ptr2->value = ptr1->value;
-		ptr1->value = 0;
+		type_list_incr (dst, ptr->name, ptr->value);
+		ptr->value = 0;
 	}
 	return;
-}
+} /* static void merge_type_list (type_list_t *, type_list_t *) */
+
+static void reset_type_list (type_list_t *list)
+{
+	type_t *ptr;
+
+	for (ptr = list->head; NULL != ptr; ptr = ptr->next)
+		ptr->value = 0;
+} /* static void reset_type_list (type_list_t *) */
 
 static int email_read (void)
 {
 	type_t *ptr;
 
-	double score_old;
-	int score_count_old;
+	double score_sum = 0.0;
+	int score_count = 0;
+	int i;
 
 	if (disabled)
 		return (-1);
 
-	/* email count */
-	pthread_mutex_lock (&count_mutex);
+	reset_type_list (&list_count);
+	reset_type_list (&list_size);
+	reset_type_list (&list_check);
 
-	copy_type_list (&list_count, &list_count_copy);
+	for (i = 0; i < readers_num; ++i) {
+		reader_t *this = readers + i;
 
-	pthread_mutex_unlock (&count_mutex);
+		pthread_mutex_lock (&this->lock);
 
-	for (ptr = list_count_copy.head; NULL != ptr; ptr = ptr->next) {
-		email_submit ("email_count", ptr->name, ptr->value);
-	}
+		merge_type_list (&this->list_count, &list_count);
+		merge_type_list (&this->list_size, &list_size);
+		merge_type_list (&this->list_check, &list_check);
 
-	/* email size */
-	pthread_mutex_lock (&size_mutex);
+		score_sum += this->score_sum;
+		score_count += this->score_count;
+		this->score_sum = 0.0;
+		this->score_count = 0;
 
-	copy_type_list (&list_size, &list_size_copy);
+		pthread_mutex_unlock (&this->lock);
+	}
 
-	pthread_mutex_unlock (&size_mutex);
+	/* email count */
+	for (ptr = list_count.head; NULL != ptr; ptr = ptr->next) {
+		email_submit ("email_count", ptr->name, ptr->value);
+	}
 
-	for (ptr = list_size_copy.head; NULL != ptr; ptr = ptr->next) {
+	/* email size */
+	for (ptr = list_size.head; NULL != ptr; ptr = ptr->next) {
 		email_submit ("email_size", ptr->name, ptr->value);
 	}
 
 	/* spam score */
-	pthread_mutex_lock (&score_mutex);
-
-	score_old = score;
-	score_count_old = score_count;
-	score = 0.0;
-	score_count = 0;
-
-	pthread_mutex_unlock (&score_mutex);
-
-	if (score_count_old > 0)
-		email_submit ("spam_score", "", score_old);
+	if (score_count > 0)
+		email_submit ("spam_score", "", score_sum / (double)score_count);
 
 	/* spam checks */
-	pthread_mutex_lock (&check_mutex);
-
-	copy_type_list (&list_check, &list_check_copy);
-
-	pthread_mutex_unlock (&check_mutex);
-
-	for (ptr = list_check_copy.head; NULL != ptr; ptr = ptr->next)
+	for (ptr = list_check.head; NULL != ptr; ptr = ptr->next)
 		email_submit ("spam_check", ptr->name, ptr->value);
 
 	return (0);
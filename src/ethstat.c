@@ -28,6 +28,7 @@
 #include "configfile.h"
 #include "utils_avltree.h"
 #include "utils_complain.h"
+#include "utils_ignorelist.h"
 
 #if HAVE_SYS_IOCTL_H
 # include <sys/ioctl.h>
@@ -49,16 +50,41 @@ struct value_map_s
 };
 typedef struct value_map_s value_map_t;
 
-static char **interfaces = NULL;
+/*
+ * The names of an interface's statistics only change when the driver is
+ * reloaded, so they are fetched only when the number of statistics changes.
+ * At that point, the statistics to collect and their mappings are looked up
+ * once and stored in `indices' and `maps'. Each read then only issues the
+ * ETHTOOL_GDRVINFO and ETHTOOL_GSTATS ioctls, into the cached buffers.
+ */
+struct interface_s
+{
+  char *name;
+
+  size_t n_stats;
+  struct ethtool_gstrings *strings;
+  struct ethtool_stats *stats;
+
+  size_t *indices;
+  value_map_t **maps;
+  size_t indices_num;
+};
+typedef struct interface_s interface_t;
+
+static interface_t *interfaces = NULL;
 static size_t interfaces_num = 0;
 
 static c_avl_tree_t *value_map = NULL;
+static ignorelist_t *ignorelist = NULL;
 
 static _Bool collect_mapped_only = 0;
 
+/* Control socket used for all ioctls. */
+static int ethstat_fd = -1;
+
 static int ethstat_add_interface (const oconfig_item_t *ci) /* {{{ */
 {
-  char **tmp;
+  interface_t *tmp;
   int status;
 
   tmp = realloc (interfaces,
@@ -66,15 +92,15 @@ static int ethstat_add_interface (const oconfig_item_t *ci) /* {{{ */
   if (tmp == NULL)
     return (-1);
   interfaces = tmp;
-  interfaces[interfaces_num] = NULL;
+  memset (interfaces + interfaces_num, 0, sizeof (*interfaces));
 
-  status = cf_util_get_string (ci, interfaces + interfaces_num);
+  status = cf_util_get_string (ci, &interfaces[interfaces_num].name);
   if (status != 0)
     return (status);
 
   interfaces_num++;
   INFO("ethstat plugin: Registered interface %s",
-      interfaces[interfaces_num - 1]);
+      interfaces[interfaces_num - 1].name);
 
   return (0);
 } /* }}} int ethstat_add_interface */
@@ -162,6 +188,29 @@ static int ethstat_config (oconfig_item_t *ci) /* {{{ */
       ethstat_add_map (child);
     else if (strcasecmp ("MappedOnly", child->key) == 0)
       (void) cf_util_get_boolean (child, &collect_mapped_only);
+    else if (strcasecmp ("Key", child->key) == 0)
+    {
+      char *key = NULL;
+
+      if (cf_util_get_string (child, &key) != 0)
+        continue;
+
+      if (ignorelist == NULL)
+        ignorelist = ignorelist_create (/* invert = */ 1);
+      ignorelist_add (ignorelist, key);
+      sfree (key);
+    }
+    else if (strcasecmp ("IgnoreSelected", child->key) == 0)
+    {
+      _Bool ignore_selected = 0;
+
+      if (cf_util_get_boolean (child, &ignore_selected) != 0)
+        continue;
+
+      if (ignorelist == NULL)
+        ignorelist = ignorelist_create (/* invert = */ 1);
+      ignorelist_set_invert (ignorelist, ignore_selected ? 0 : 1);
+    }
     else
       WARNING ("ethstat plugin: The config option \"%s\" is unknown.",
           child->key);
@@ -171,26 +220,10 @@ static int ethstat_config (oconfig_item_t *ci) /* {{{ */
 } /* }}} */
 
 static void ethstat_submit_value (const char *device,
-    const char *type_instance, derive_t value)
+    const char *type_instance, const value_map_t *map, derive_t value)
 {
-  static c_complain_t complain_no_map = C_COMPLAIN_INIT_STATIC;
-
   value_t values[1];
   value_list_t vl = VALUE_LIST_INIT;
-  value_map_t *map = NULL;
-
-  if (value_map != NULL)
-    c_avl_get (value_map, type_instance, (void *) &map);
-
-  /* If the "MappedOnly" option is specified, ignore unmapped values. */
-  if (collect_mapped_only && (map == NULL))
-  {
-    if (value_map == NULL)
-      c_complain (LOG_WARNING, &complain_no_map,
-          "ethstat plugin: The \"MappedOnly\" option has been set to true, "
-          "but no mapping has been configured. All values will be ignored!");
-    return;
-  }
 
   values[0].derive = value;
   vl.values = values;
@@ -214,41 +247,112 @@ static void ethstat_submit_value (const char *device,
   plugin_dispatch_values (&vl);
 }
 
-static int ethstat_read_interface (char *device)
+static void ethstat_interface_clear (interface_t *iface) /* {{{ */
 {
-  int fd;
-  struct ifreq req;
-  struct ethtool_drvinfo drvinfo;
-  struct ethtool_gstrings *strings;
-  struct ethtool_stats *stats;
-  size_t n_stats;
-  size_t strings_size;
-  size_t stats_size;
+  sfree (iface->strings);
+  sfree (iface->stats);
+  sfree (iface->indices);
+  sfree (iface->maps);
+  iface->n_stats = 0;
+  iface->indices_num = 0;
+} /* }}} void ethstat_interface_clear */
+
+/* Fetches the names of all statistics and selects the ones to collect. */
+static int ethstat_interface_refresh (interface_t *iface, /* {{{ */
+    struct ifreq *req, size_t n_stats)
+{
+  static c_complain_t complain_no_map = C_COMPLAIN_INIT_STATIC;
+
   size_t i;
   int status;
 
-  memset (&req, 0, sizeof (req));
-  sstrncpy(req.ifr_name, device, sizeof (req.ifr_name));
+  ethstat_interface_clear (iface);
 
-  fd = socket(AF_INET, SOCK_DGRAM, /* protocol = */ 0);
-  if (fd < 0)
+  iface->strings = malloc (sizeof (struct ethtool_gstrings)
+      + (n_stats * ETH_GSTRING_LEN));
+  iface->stats = malloc (sizeof (struct ethtool_stats)
+      + (n_stats * sizeof (uint64_t)));
+  iface->indices = calloc (n_stats, sizeof (*iface->indices));
+  iface->maps = calloc (n_stats, sizeof (*iface->maps));
+  if ((iface->strings == NULL) || (iface->stats == NULL)
+      || (iface->indices == NULL) || (iface->maps == NULL))
+  {
+    ethstat_interface_clear (iface);
+    ERROR("ethstat plugin: malloc(3) failed.");
+    return (-1);
+  }
+
+  iface->strings->cmd = ETHTOOL_GSTRINGS;
+  iface->strings->string_set = ETH_SS_STATS;
+  iface->strings->len = n_stats;
+  req->ifr_data = (void *) iface->strings;
+  status = ioctl (ethstat_fd, SIOCETHTOOL, req);
+  if (status < 0)
   {
     char errbuf[1024];
-    ERROR("ethstat plugin: Failed to open control socket: %s",
+    ethstat_interface_clear (iface);
+    ERROR ("ethstat plugin: Cannot get strings from %s: %s",
+        iface->name,
         sstrerror (errno, errbuf, sizeof (errbuf)));
-    return 1;
+    return (-1);
   }
 
+  if (collect_mapped_only && (value_map == NULL))
+    c_complain (LOG_WARNING, &complain_no_map,
+        "ethstat plugin: The \"MappedOnly\" option has been set to true, "
+        "but no mapping has been configured. All values will be ignored!");
+
+  for (i = 0; i < n_stats; i++)
+  {
+    char *stat_name = (char *) &iface->strings->data[i * ETH_GSTRING_LEN];
+    value_map_t *map = NULL;
+
+    /* The names are not guaranteed to be null-terminated. */
+    stat_name[ETH_GSTRING_LEN - 1] = 0;
+
+    if (ignorelist_match (ignorelist, stat_name) != 0)
+      continue;
+
+    if (value_map != NULL)
+      c_avl_get (value_map, stat_name, (void *) &map);
+
+    /* If the "MappedOnly" option is specified, ignore unmapped values. */
+    if (collect_mapped_only && (map == NULL))
+      continue;
+
+    iface->indices[iface->indices_num] = i;
+    iface->maps[iface->indices_num] = map;
+    iface->indices_num++;
+  }
+
+  iface->n_stats = n_stats;
+
+  DEBUG ("ethstat plugin: %s: Collecting %zu of %zu statistics.",
+      iface->name, iface->indices_num, n_stats);
+
+  return (0);
+} /* }}} int ethstat_interface_refresh */
+
+static int ethstat_read_interface (interface_t *iface) /* {{{ */
+{
+  struct ifreq req;
+  struct ethtool_drvinfo drvinfo;
+  size_t n_stats;
+  size_t i;
+  int status;
+
+  memset (&req, 0, sizeof (req));
+  sstrncpy(req.ifr_name, iface->name, sizeof (req.ifr_name));
+
   memset (&drvinfo, 0, sizeof (drvinfo));
   drvinfo.cmd = ETHTOOL_GDRVINFO;
   req.ifr_data = (void *) &drvinfo;
-  status = ioctl (fd, SIOCETHTOOL, &req);
+  status = ioctl (ethstat_fd, SIOCETHTOOL, &req);
   if (status < 0)
   {
     char errbuf[1024];
-    close (fd);
     ERROR ("ethstat plugin: Failed to get driver information "
-        "from %s: %s", device,
+        "from %s: %s", iface->name,
         sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
@@ -256,75 +360,48 @@ static int ethstat_read_interface (char *device)
   n_stats = (size_t) drvinfo.n_stats;
   if (n_stats < 1)
   {
-    close (fd);
-    ERROR("ethstat plugin: No stats available for %s", device);
+    ethstat_interface_clear (iface);
+    ERROR("ethstat plugin: No stats available for %s", iface->name);
     return (-1);
   }
 
-  strings_size = sizeof (struct ethtool_gstrings)
-    + (n_stats * ETH_GSTRING_LEN);
-  stats_size = sizeof (struct ethtool_stats)
-    + (n_stats * sizeof (uint64_t));
-
-  strings = malloc (strings_size);
-  stats = malloc (stats_size);
-  if ((strings == NULL) || (stats == NULL))
+  if (n_stats != iface->n_stats)
   {
-    close (fd);
-    sfree (strings);
-    sfree (stats);
-    ERROR("ethstat plugin: malloc(3) failed.");
-    return (-1);
+    status = ethstat_interface_refresh (iface, &req, n_stats);
+    if (status != 0)
+      return (status);
   }
 
-  strings->cmd = ETHTOOL_GSTRINGS;
-  strings->string_set = ETH_SS_STATS;
-  strings->len = n_stats;
-  req.ifr_data = (void *) strings;
-  status = ioctl (fd, SIOCETHTOOL, &req);
-  if (status < 0)
-  {
-    char errbuf[1024];
-    close (fd);
-    free (strings);
-    free (stats);
-    ERROR ("ethstat plugin: Cannot get strings from %s: %s",
-        device,
-        sstrerror (errno, errbuf, sizeof (errbuf)));
-    return (-1);
-  }
+  if (iface->indices_num == 0)
+    return (0);
 
-  stats->cmd = ETHTOOL_GSTATS;
-  stats->n_stats = n_stats;
-  req.ifr_data = (void *) stats;
-  status = ioctl (fd, SIOCETHTOOL, &req);
+  iface->stats->cmd = ETHTOOL_GSTATS;
+  iface->stats->n_stats = n_stats;
+  req.ifr_data = (void *) iface->stats;
+  status = ioctl (ethstat_fd, SIOCETHTOOL, &req);
   if (status < 0)
   {
     char errbuf[1024];
-    close (fd);
-    free(strings);
-    free(stats);
+    /* Fetch the names again next time, in case the driver changed. */
+    ethstat_interface_clear (iface);
     ERROR("ethstat plugin: Reading statistics from %s failed: %s",
-        device,
+        iface->name,
         sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
-  for (i = 0; i < n_stats; i++)
+  for (i = 0; i < iface->indices_num; i++)
   {
+    size_t idx = iface->indices[i];
     const char *stat_name;
 
-    stat_name = (void *) &strings->data[i * ETH_GSTRING_LEN];
+    stat_name = (void *) &iface->strings->data[idx * ETH_GSTRING_LEN];
     DEBUG("ethstat plugin: device = \"%s\": %s = %"PRIu64,
-        device, stat_name, (uint64_t) stats->data[i]);
-    ethstat_submit_value (device,
-        stat_name, (derive_t) stats->data[i]);
+        iface->name, stat_name, (uint64_t) iface->stats->data[idx]);
+    ethstat_submit_value (iface->name, stat_name, iface->maps[i],
+        (derive_t) iface->stats->data[idx]);
   }
 
-  close (fd);
-  sfree (strings);
-  sfree (stats);
-
   return (0);
 } /* }}} ethstat_read_interface */
 
@@ -332,8 +409,20 @@ static int ethstat_read(void)
 {
   size_t i;
 
+  if (ethstat_fd < 0)
+  {
+    ethstat_fd = socket(AF_INET, SOCK_DGRAM, /* protocol = */ 0);
+    if (ethstat_fd < 0)
+    {
+      char errbuf[1024];
+      ERROR("ethstat plugin: Failed to open control socket: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      return (-1);
+    }
+  }
+
   for (i = 0; i < interfaces_num; i++)
-    ethstat_read_interface (interfaces[i]);
+    ethstat_read_interface (interfaces + i);
 
   return 0;
 }
@@ -342,6 +431,24 @@ static int ethstat_shutdown (void)
 {
   void *key = NULL;
   void *value = NULL;
+  size_t i;
+
+  if (ethstat_fd >= 0)
+  {
+    close (ethstat_fd);
+    ethstat_fd = -1;
+  }
+
+  for (i = 0; i < interfaces_num; i++)
+  {
+    ethstat_interface_clear (interfaces + i);
+    sfree (interfaces[i].name);
+  }
+  sfree (interfaces);
+  interfaces_num = 0;
+
+  ignorelist_free (ignorelist);
+  ignorelist = NULL;
 
   if (value_map == NULL)
     return (0);
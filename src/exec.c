@@ -31,6 +31,7 @@
 
 #include "utils_cmd_putval.h"
 #include "utils_cmd_putnotif.h"
+#include "utils_complain.h"
 
 #include <sys/types.h>
 #include <pwd.h>
@@ -41,9 +42,13 @@
 
 #define PL_NORMAL        0x01
 #define PL_NOTIF_ACTION  0x02
+#define PL_NOTIF_PERSISTENT 0x04
 
 #define PL_RUNNING       0x10
 
+/* Size of the buffer used to read the output of `Exec' programs. */
+#define EXEC_BUFFER_SIZE 65536
+
 /*
  * Private data types
  */
@@ -54,7 +59,33 @@
  * The `pid' and `status' fields are thus unused if the `PL_NOTIF_ACTION' flag
  * is set.
  * The `PL_RUNNING' flag is set in `exec_read' and unset in `exec_read_one'.
+ * Persistent notification executables are the exception: their `pid' is only
+ * written by the thread in `exec_stream_thread'.
  */
+struct notification_entry_s;
+typedef struct notification_entry_s notification_entry_t;
+struct notification_entry_s
+{
+  notification_t n;
+  notification_entry_t *next;
+};
+
+/* The queue of a persistent notification executable. */
+typedef struct exec_stream_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  pthread_t       thread;
+  _Bool           thread_running;
+  _Bool           shutdown;
+
+  notification_entry_t *head;
+  notification_entry_t *tail;
+  size_t                num;
+
+  c_complain_t    complaint;
+} exec_stream_t;
+
 struct program_list_s;
 typedef struct program_list_s program_list_t;
 struct program_list_s
@@ -66,6 +97,9 @@ struct program_list_s
   int             pid;
   int             status;
   int             flags;
+  exec_stream_t  *stream;
+  /* Keeps the identifiers written by `Exec' programs between runs. */
+  putval_batch_t *putval_batch;
   program_list_t *next;
 };
 
@@ -81,6 +115,9 @@ typedef struct program_list_and_notification_s
 static program_list_t *pl_head = NULL;
 static pthread_mutex_t pl_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Maximum number of notifications queued for a persistent executable. */
+static size_t notification_queue_length = 1024;
+
 /*
  * Functions
  */
@@ -135,6 +172,8 @@ static int exec_config_exec (oconfig_item_t *ci) /* {{{ */
 
   if (strcasecmp ("NotificationExec", ci->key) == 0)
     pl->flags |= PL_NOTIF_ACTION;
+  else if (strcasecmp ("PersistentNotificationExec", ci->key) == 0)
+    pl->flags |= PL_NOTIF_ACTION | PL_NOTIF_PERSISTENT;
   else
     pl->flags |= PL_NORMAL;
 
@@ -240,6 +279,26 @@ static int exec_config_exec (oconfig_item_t *ci) /* {{{ */
     DEBUG ("exec plugin: argv[%i] = %s", i, pl->argv[i]);
   }
 
+  if (pl->flags & PL_NOTIF_PERSISTENT)
+  {
+    pl->stream = (exec_stream_t *) malloc (sizeof (*pl->stream));
+    if (pl->stream == NULL)
+    {
+      ERROR ("exec plugin: malloc failed.");
+      for (i = 0; pl->argv[i] != NULL; i++)
+        sfree (pl->argv[i]);
+      sfree (pl->argv);
+      sfree (pl->exec);
+      sfree (pl->user);
+      sfree (pl);
+      return (-1);
+    }
+    memset (pl->stream, 0, sizeof (*pl->stream));
+    pthread_mutex_init (&pl->stream->lock, /* attr = */ NULL);
+    pthread_cond_init (&pl->stream->cond, /* attr = */ NULL);
+    C_COMPLAIN_INIT (&pl->stream->complaint);
+  }
+
   pl->next = pl_head;
   pl_head = pl;
 
@@ -254,8 +313,19 @@ static int exec_config (oconfig_item_t *ci) /* {{{ */
   {
     oconfig_item_t *child = ci->children + i;
     if ((strcasecmp ("Exec", child->key) == 0)
-        || (strcasecmp ("NotificationExec", child->key) == 0))
+        || (strcasecmp ("NotificationExec", child->key) == 0)
+        || (strcasecmp ("PersistentNotificationExec", child->key) == 0))
       exec_config_exec (child);
+    else if (strcasecmp ("NotificationQueueLength", child->key) == 0)
+    {
+      int tmp = 0;
+
+      if ((cf_util_get_int (child, &tmp) == 0) && (tmp > 0))
+        notification_queue_length = (size_t) tmp;
+      else
+        WARNING ("exec plugin: `NotificationQueueLength' must be a "
+            "positive number.");
+    }
     else
     {
       WARNING ("exec plugin: Unknown config option `%s'.", child->key);
@@ -531,12 +601,27 @@ static int fork_child (program_list_t *pl, int *fd_in, int *fd_out, int *fd_err)
   return (pid);
 } /* int fork_child }}} */
 
-static int parse_line (char *buffer) /* {{{ */
+static int parse_line (program_list_t *pl, char *buffer) /* {{{ */
 {
-  if (strncasecmp ("PUTVAL", buffer, strlen ("PUTVAL")) == 0)
+  if (strncasecmp ("PUTVALS", buffer, strlen ("PUTVALS")) == 0)
+  {
+    if (pl->putval_batch != NULL)
+      putval_batch_flush (pl->putval_batch);
+    return (handle_putvals (stdout, buffer));
+  }
+  else if (strncasecmp ("PUTVAL", buffer, strlen ("PUTVAL")) == 0)
+  {
+    if (pl->putval_batch != NULL)
+      return (putval_batch_add (pl->putval_batch, stdout, buffer));
     return (handle_putval (stdout, buffer));
+  }
   else if (strncasecmp ("PUTNOTIF", buffer, strlen ("PUTNOTIF")) == 0)
+  {
+    /* Keep the order of values and notifications. */
+    if (pl->putval_batch != NULL)
+      putval_batch_flush (pl->putval_batch);
     return (handle_putnotif (stdout, buffer));
+  }
   else
   {
     ERROR ("exec plugin: Unable to parse command, ignoring line: \"%s\"",
@@ -551,14 +636,26 @@ static void *exec_read_one (void *arg) /* {{{ */
   int fd, fd_err, highest_fd;
   fd_set fdset, copy;
   int status;
-  char buffer[1200];  /* if not completely read */
+  char *buffer;
+  size_t buffer_fill = 0;
+  _Bool discard = 0;
   char buffer_err[1024];
-  char *pbuffer = buffer;
   char *pbuffer_err = buffer_err;
 
-  status = fork_child (pl, NULL, &fd, &fd_err);
+  if (pl->putval_batch == NULL)
+    pl->putval_batch = putval_batch_create ();
+
+  buffer = malloc (EXEC_BUFFER_SIZE);
+  if (buffer == NULL)
+  {
+    ERROR ("exec plugin: malloc failed.");
+    status = -1;
+  }
+  else
+    status = fork_child (pl, NULL, &fd, &fd_err);
   if (status < 0)
   {
+    sfree (buffer);
     /* Reset the "running" flag */
     pthread_mutex_lock (&pl_lock);
     pl->flags &= ~PL_RUNNING;
@@ -593,9 +690,11 @@ static void *exec_read_one (void *arg) /* {{{ */
 
     if (FD_ISSET(fd, &copy))
     {
+      char *pbuffer;
       char *pnl;
+      size_t remaining;
 
-      len = read(fd, pbuffer, sizeof(buffer) - 1 - (pbuffer - buffer));
+      len = read (fd, buffer + buffer_fill, EXEC_BUFFER_SIZE - 1 - buffer_fill);
 
       if (len < 0)
       {
@@ -604,29 +703,44 @@ static void *exec_read_one (void *arg) /* {{{ */
       }
       else if (len == 0) break;  /* We've reached EOF */
 
-      pbuffer[len] = '\0';
+      buffer_fill += (size_t) len;
+      buffer[buffer_fill] = '\0';
 
-      len += pbuffer - buffer;
+      /* Only the bytes just read can contain new line breaks. */
       pbuffer = buffer;
-
-      while ((pnl = strchr(pbuffer, '\n')))
+      remaining = buffer_fill;
+      while ((pnl = memchr (pbuffer, '\n', remaining)) != NULL)
       {
         *pnl = '\0';
-        if (*(pnl-1) == '\r' ) *(pnl-1) = '\0';
+        if ((pnl > pbuffer) && (*(pnl - 1) == '\r'))
+          *(pnl - 1) = '\0';
 
-        parse_line (pbuffer);
+        if (!discard)
+          parse_line (pl, pbuffer);
+        discard = 0;
 
-        pbuffer = ++pnl;
+        remaining -= (size_t) (pnl + 1 - pbuffer);
+        pbuffer = pnl + 1;
       }
-      /* not completely read ? */
-      if (pbuffer - buffer < len)
+
+      /* Dispatch the values of complete lines before waiting for more. */
+      if (pl->putval_batch != NULL)
+        putval_batch_flush (pl->putval_batch);
+
+      /* A line that doesn't fit into the buffer is dropped. */
+      if (remaining >= EXEC_BUFFER_SIZE - 1)
       {
-        len -= pbuffer - buffer;
-        memmove(buffer, pbuffer, len);
-        pbuffer = buffer + len;
+        if (!discard)
+          ERROR ("exec plugin: Program `%s' wrote a line longer than %i "
+              "bytes. Ignoring it.", pl->exec, EXEC_BUFFER_SIZE - 1);
+        discard = 1;
+        remaining = 0;
       }
-      else
-        pbuffer = buffer;
+
+      /* not completely read ? */
+      if ((remaining > 0) && (pbuffer != buffer))
+        memmove (buffer, pbuffer, remaining);
+      buffer_fill = remaining;
     }
     else if (FD_ISSET(fd_err, &copy))
     {
@@ -700,41 +814,21 @@ static void *exec_read_one (void *arg) /* {{{ */
   close (fd);
   if (fd_err >= 0)
     close (fd_err);
+  sfree (buffer);
 
   pthread_exit ((void *) 0);
   return (NULL);
 } /* void *exec_read_one }}} */
 
-static void *exec_notification_one (void *arg) /* {{{ */
+/* Writes the notification in the format documented in collectd-exec(5). In
+ * `stream' mode, the message is kept on a single line so that several
+ * notifications can be written to the same program. */
+static void exec_print_notification (FILE *fh, /* {{{ */
+    const notification_t *n, _Bool stream)
 {
-  program_list_t *pl = ((program_list_and_notification_t *) arg)->pl;
-  notification_t *n = &((program_list_and_notification_t *) arg)->n;
   notification_meta_t *meta;
-  int fd;
-  FILE *fh;
-  int pid;
-  int status;
   const char *severity;
 
-  pid = fork_child (pl, &fd, NULL, NULL);
-  if (pid < 0) {
-    sfree (arg);
-    pthread_exit ((void *) 1);
-  }
-
-  fh = fdopen (fd, "w");
-  if (fh == NULL)
-  {
-    char errbuf[1024];
-    ERROR ("exec plugin: fdopen (%i) failed: %s", fd,
-        sstrerror (errno, errbuf, sizeof (errbuf)));
-    kill (pl->pid, SIGTERM);
-    pl->pid = 0;
-    close (fd);
-    sfree (arg);
-    pthread_exit ((void *) 1);
-  }
-
   severity = "FAILURE";
   if (n->severity == NOTIF_WARNING)
     severity = "WARNING";
@@ -773,7 +867,51 @@ static void *exec_notification_one (void *arg) /* {{{ */
           meta->nm_value.nm_boolean ? "true" : "false");
   }
 
-  fprintf (fh, "\n%s\n", n->message);
+  if (stream)
+  {
+    char message[NOTIF_MAX_MSG_LEN];
+    char *ptr;
+
+    /* Each notification ends with the line following the header. */
+    sstrncpy (message, n->message, sizeof (message));
+    for (ptr = strpbrk (message, "\r\n"); ptr != NULL;
+        ptr = strpbrk (ptr, "\r\n"))
+      *ptr = ' ';
+    fprintf (fh, "\n%s\n", message);
+  }
+  else
+    fprintf (fh, "\n%s\n", n->message);
+} /* }}} void exec_print_notification */
+
+static void *exec_notification_one (void *arg) /* {{{ */
+{
+  program_list_t *pl = ((program_list_and_notification_t *) arg)->pl;
+  notification_t *n = &((program_list_and_notification_t *) arg)->n;
+  int fd;
+  FILE *fh;
+  int pid;
+  int status;
+
+  pid = fork_child (pl, &fd, NULL, NULL);
+  if (pid < 0) {
+    sfree (arg);
+    pthread_exit ((void *) 1);
+  }
+
+  fh = fdopen (fd, "w");
+  if (fh == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("exec plugin: fdopen (%i) failed: %s", fd,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    kill (pl->pid, SIGTERM);
+    pl->pid = 0;
+    close (fd);
+    sfree (arg);
+    pthread_exit ((void *) 1);
+  }
+
+  exec_print_notification (fh, n, /* stream = */ 0);
 
   fflush (fh);
   fclose (fh);
@@ -791,14 +929,243 @@ static void *exec_notification_one (void *arg) /* {{{ */
   return (NULL);
 } /* void *exec_notification_one }}} */
 
+/* Starts a persistent notification executable and returns a stream connected
+ * to its STDIN. */
+static FILE *exec_stream_start_child (program_list_t *pl) /* {{{ */
+{
+  int fd;
+  int pid;
+  FILE *fh;
+
+  pid = fork_child (pl, &fd, NULL, NULL);
+  if (pid < 0)
+    return (NULL);
+  pl->pid = pid;
+
+  fh = fdopen (fd, "w");
+  if (fh == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("exec plugin: fdopen (%i) failed: %s", fd,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    kill (pl->pid, SIGTERM);
+    pl->pid = 0;
+    close (fd);
+    return (NULL);
+  }
+
+  DEBUG ("exec plugin: Started persistent notification executable %s "
+      "as PID %i.", pl->exec, pid);
+  return (fh);
+} /* }}} FILE *exec_stream_start_child */
+
+/* Closes the STDIN of a persistent notification executable and waits up to
+ * one second for it to exit before sending SIGTERM. */
+static void exec_stream_stop_child (program_list_t *pl, FILE **fh) /* {{{ */
+{
+  struct timespec ts = { 0, 100000000 }; /* 100 ms */
+  int i;
+
+  if (*fh != NULL)
+    fclose (*fh);
+  *fh = NULL;
+
+  if (pl->pid <= 0)
+  {
+    pl->pid = 0;
+    return;
+  }
+
+  for (i = 0; i < 10; i++)
+  {
+    int status;
+    pid_t ret;
+
+    ret = waitpid (pl->pid, &status, WNOHANG);
+    /* The signal handler may have reaped the child already. */
+    if ((ret == pl->pid) || ((ret < 0) && (errno == ECHILD)))
+    {
+      pl->pid = 0;
+      return;
+    }
+
+    nanosleep (&ts, /* remaining = */ NULL);
+  }
+
+  kill (pl->pid, SIGTERM);
+  INFO ("exec plugin: Sent SIGTERM to %hu", (unsigned short int) pl->pid);
+  waitpid (pl->pid, /* status = */ NULL, WNOHANG);
+  pl->pid = 0;
+} /* }}} void exec_stream_stop_child */
+
+/* Writes one notification to a persistent executable, starting it if
+ * necessary. If writing to a running program fails, e.g. because it exited,
+ * the program is restarted once. */
+static int exec_stream_write (program_list_t *pl, FILE **fh, /* {{{ */
+    cdtime_t *next_start, c_complain_t *complaint,
+    const notification_t *n)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    _Bool started = 0;
+
+    if (*fh == NULL)
+    {
+      /* Don't restart a failing program more than once per interval. */
+      if (cdtime () < *next_start)
+        return (-1);
+
+      *fh = exec_stream_start_child (pl);
+      if (*fh == NULL)
+      {
+        *next_start = cdtime () + plugin_get_interval ();
+        c_complain (LOG_ERR, complaint, "exec plugin: Starting %s failed.",
+            pl->exec);
+        return (-1);
+      }
+      started = 1;
+    }
+
+    exec_print_notification (*fh, n, /* stream = */ 1);
+    if ((fflush (*fh) == 0) && !ferror (*fh))
+    {
+      c_release (LOG_INFO, complaint, "exec plugin: Writing notifications "
+          "to %s succeeded.", pl->exec);
+      return (0);
+    }
+
+    exec_stream_stop_child (pl, fh);
+    if (started)
+    {
+      *next_start = cdtime () + plugin_get_interval ();
+      break;
+    }
+  }
+
+  c_complain (LOG_ERR, complaint, "exec plugin: Writing a notification to "
+      "%s failed.", pl->exec);
+  return (-1);
+} /* }}} int exec_stream_write */
+
+static void *exec_stream_thread (void *arg) /* {{{ */
+{
+  program_list_t *pl = arg;
+  exec_stream_t *s = pl->stream;
+  c_complain_t complaint = C_COMPLAIN_INIT_STATIC;
+  cdtime_t next_start = 0;
+  FILE *fh = NULL;
+
+  pthread_mutex_lock (&s->lock);
+  while (42)
+  {
+    notification_entry_t *e;
+
+    while (!s->shutdown && (s->head == NULL))
+      pthread_cond_wait (&s->cond, &s->lock);
+
+    /* The queue is drained before shutting down. */
+    if (s->head == NULL)
+      break;
+
+    e = s->head;
+    s->head = e->next;
+    if (s->head == NULL)
+      s->tail = NULL;
+    s->num--;
+    pthread_mutex_unlock (&s->lock);
+
+    exec_stream_write (pl, &fh, &next_start, &complaint, &e->n);
+
+    if (e->n.meta != NULL)
+      plugin_notification_meta_free (e->n.meta);
+    sfree (e);
+
+    pthread_mutex_lock (&s->lock);
+  }
+  pthread_mutex_unlock (&s->lock);
+
+  exec_stream_stop_child (pl, &fh);
+  return (NULL);
+} /* }}} void *exec_stream_thread */
+
+/* Queues a notification for a persistent executable. The queue is bounded:
+ * if the program doesn't keep up, new notifications are dropped. */
+static void exec_stream_enqueue (program_list_t *pl, /* {{{ */
+    const notification_t *n)
+{
+  exec_stream_t *s = pl->stream;
+  notification_entry_t *e;
+
+  pthread_mutex_lock (&s->lock);
+  if (!s->thread_running || s->shutdown)
+  {
+    pthread_mutex_unlock (&s->lock);
+    return;
+  }
+
+  if (s->num >= notification_queue_length)
+  {
+    c_complain (LOG_WARNING, &s->complaint, "exec plugin: The notification "
+        "queue of %s is full. Dropping notifications.", pl->exec);
+    pthread_mutex_unlock (&s->lock);
+    return;
+  }
+  c_release (LOG_INFO, &s->complaint, "exec plugin: The notification queue "
+      "of %s has room again.", pl->exec);
+  pthread_mutex_unlock (&s->lock);
+
+  e = malloc (sizeof (*e));
+  if (e == NULL)
+  {
+    ERROR ("exec plugin: malloc failed.");
+    return;
+  }
+  memcpy (&e->n, n, sizeof (e->n));
+  e->n.meta = NULL;
+  plugin_notification_meta_copy (&e->n, n);
+  e->next = NULL;
+
+  pthread_mutex_lock (&s->lock);
+  if (s->tail == NULL)
+    s->head = e;
+  else
+    s->tail->next = e;
+  s->tail = e;
+  s->num++;
+  pthread_cond_signal (&s->cond);
+  pthread_mutex_unlock (&s->lock);
+} /* }}} void exec_stream_enqueue */
+
 static int exec_init (void) /* {{{ */
 {
   struct sigaction sa;
+  program_list_t *pl;
 
   memset (&sa, '\0', sizeof (sa));
   sa.sa_handler = sigchld_handler;
   sigaction (SIGCHLD, &sa, NULL);
 
+  for (pl = pl_head; pl != NULL; pl = pl->next)
+  {
+    int status;
+
+    if (pl->stream == NULL)
+      continue;
+
+    status = plugin_thread_create (&pl->stream->thread, /* attr = */ NULL,
+        exec_stream_thread, (void *) pl);
+    if (status != 0)
+    {
+      ERROR ("exec plugin: pthread_create failed for %s.", pl->exec);
+      continue;
+    }
+    pthread_mutex_lock (&pl->stream->lock);
+    pl->stream->thread_running = 1;
+    pthread_mutex_unlock (&pl->stream->lock);
+  }
+
   return (0);
 } /* int exec_init }}} */
 
@@ -849,6 +1216,12 @@ static int exec_notification (const notification_t *n, /* {{{ */
     if ((pl->flags & PL_NOTIF_ACTION) == 0)
       continue;
 
+    if (pl->stream != NULL)
+    {
+      exec_stream_enqueue (pl, n);
+      continue;
+    }
+
     /* Skip if a child is already running. */
     if (pl->pid != 0)
       continue;
@@ -883,6 +1256,23 @@ static int exec_shutdown (void) /* {{{ */
   program_list_t *pl;
   program_list_t *next;
 
+  /* Let persistent notification executables process what's left in their
+   * queues first. */
+  for (pl = pl_head; pl != NULL; pl = pl->next)
+  {
+    if (pl->stream == NULL)
+      continue;
+
+    pthread_mutex_lock (&pl->stream->lock);
+    pl->stream->shutdown = 1;
+    pthread_cond_broadcast (&pl->stream->cond);
+    pthread_mutex_unlock (&pl->stream->lock);
+
+    if (pl->stream->thread_running)
+      pthread_join (pl->stream->thread, /* retval = */ NULL);
+    pl->stream->thread_running = 0;
+  }
+
   pl = pl_head;
   while (pl != NULL)
   {
@@ -894,6 +1284,13 @@ static int exec_shutdown (void) /* {{{ */
       INFO ("exec plugin: Sent SIGTERM to %hu", (unsigned short int) pl->pid);
     }
 
+    if (pl->stream != NULL)
+    {
+      pthread_mutex_destroy (&pl->stream->lock);
+      pthread_cond_destroy (&pl->stream->cond);
+      sfree (pl->stream);
+    }
+    putval_batch_destroy (pl->putval_batch);
     sfree (pl->user);
     sfree (pl);
 
@@ -24,6 +24,7 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"       
+#include "configfile.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,8 +32,47 @@
 #include <dirent.h>
 #include <fnmatch.h>
 
+/* Scan relative to directory file descriptors, so the kernel doesn't have to
+ * resolve the full path of every file again. */
+#if HAVE_OPENAT && HAVE_FSTATAT && HAVE_FDOPENDIR
+# define FC_HAVE_AT 1
+#else
+# define FC_HAVE_AT 0
+#endif
+
+#if FC_HAVE_AT && HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# include "utils_avltree.h"
+# define FC_HAVE_INOTIFY 1
+# define FC_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#else
+# define FC_HAVE_INOTIFY 0
+#endif
+
 #define FC_RECURSIVE 1
 #define FC_HIDDEN 2
+#define FC_INOTIFY 4
+
+#define FC_SCAN_TOTAL 0 /* whole tree into the given counters */
+#define FC_SCAN_WATCH 1 /* whole tree, one watch per directory */
+#define FC_SCAN_FILES 2 /* only the files directly in the directory */
+
+#if FC_HAVE_INOTIFY
+/* A directory watched with inotify. The counters only include the files
+ * directly in this directory. */
+struct fc_watch_s
+{
+  int wd;
+  char *path;
+
+  uint64_t files_num;
+  uint64_t files_size;
+
+  _Bool dirty;
+};
+typedef struct fc_watch_s fc_watch_t;
+#endif
 
 struct fc_directory_conf_s
 {
@@ -52,6 +92,16 @@ struct fc_directory_conf_s
 
   /* Helper for the recursive functions */
   time_t now;
+
+#if FC_HAVE_INOTIFY
+  /* Incremental mode: the watches, keyed by watch descriptor. */
+  int inotify_fd;
+  c_avl_tree_t *watches;
+  _Bool watch_failed;
+  _Bool rescan;
+  cdtime_t rescan_interval;
+  cdtime_t last_rescan;
+#endif
 };
 typedef struct fc_directory_conf_s fc_directory_conf_t;
 
@@ -88,6 +138,8 @@ static void fc_submit_dir (const fc_directory_conf_t *dir)
  *     Name "*.conf"
  *     MTime -3600
  *     Size "+10M"
+ *     Inotify true
+ *     RescanInterval 3600
  *   </Directory>
  * </Plugin>
  *
@@ -317,8 +369,8 @@ static int fc_config_add_dir_option (fc_directory_conf_t *dir,
   if ((ci->values_num != 1)
       || (ci->values[0].type != OCONFIG_TYPE_BOOLEAN))
   {
-    WARNING ("filecount plugin: The `Recursive' config options needs exactly "
-        "one boolean argument.");
+    WARNING ("filecount plugin: The `%s' config options needs exactly "
+        "one boolean argument.", ci->key);
     return (-1);
   }
 
@@ -367,6 +419,11 @@ static int fc_config_add_dir (oconfig_item_t *ci)
   dir->mtime = 0;
   dir->size = 0;
 
+#if FC_HAVE_INOTIFY
+  dir->inotify_fd = -1;
+  dir->rescan_interval = TIME_T_TO_CDTIME_T (3600);
+#endif
+
   status = 0;
   for (i = 0; i < ci->children_num; i++)
   {
@@ -384,6 +441,12 @@ static int fc_config_add_dir (oconfig_item_t *ci)
       status = fc_config_add_dir_option (dir, option, FC_RECURSIVE);
     else if (strcasecmp ("IncludeHidden", option->key) == 0)
       status = fc_config_add_dir_option (dir, option, FC_HIDDEN);
+    else if (strcasecmp ("Inotify", option->key) == 0)
+      status = fc_config_add_dir_option (dir, option, FC_INOTIFY);
+#if FC_HAVE_INOTIFY
+    else if (strcasecmp ("RescanInterval", option->key) == 0)
+      status = cf_util_get_cdtime (option, &dir->rescan_interval);
+#endif
     else
     {
       WARNING ("filecount plugin: fc_config_add_dir: "
@@ -456,6 +519,277 @@ static int fc_init (void)
   return (0);
 } /* int fc_init */
 
+/* Returns non-zero if the regular file `filename' passes the selectors. */
+static int fc_file_matches (const fc_directory_conf_t *dir,
+    const char *filename, const struct stat *statbuf)
+{
+  if (dir->name != NULL)
+  {
+    if (fnmatch (dir->name, filename, /* flags = */ 0) != 0)
+      return (0);
+  }
+
+  if (dir->mtime != 0)
+  {
+    time_t mtime = dir->now;
+
+    if (dir->mtime < 0)
+      mtime += dir->mtime;
+    else
+      mtime -= dir->mtime;
+
+    DEBUG ("filecount plugin: Only collecting files that were touched %s %u.",
+        (dir->mtime < 0) ? "after" : "before",
+        (unsigned int) mtime);
+
+    if (((dir->mtime < 0) && (statbuf->st_mtime < mtime))
+        || ((dir->mtime > 0) && (statbuf->st_mtime > mtime)))
+      return (0);
+  }
+
+  if (dir->size != 0)
+  {
+    off_t size;
+
+    if (dir->size < 0)
+      size = (off_t) ((-1) * dir->size);
+    else
+      size = (off_t) dir->size;
+
+    if (((dir->size < 0) && (statbuf->st_size > size))
+        || ((dir->size > 0) && (statbuf->st_size < size)))
+      return (0);
+  }
+
+  return (1);
+} /* int fc_file_matches */
+
+#if FC_HAVE_INOTIFY
+static int fc_wd_compare (const void *a, const void *b)
+{
+  int wd_a = *((const int *) a);
+  int wd_b = *((const int *) b);
+
+  if (wd_a < wd_b)
+    return (-1);
+  else if (wd_a > wd_b)
+    return (1);
+  return (0);
+} /* int fc_wd_compare */
+
+static void fc_watch_close (fc_directory_conf_t *dir)
+{
+  fc_watch_t *w;
+  void *key;
+
+  if (dir->watches != NULL)
+  {
+    while (c_avl_pick (dir->watches, &key, (void *) &w) == 0)
+    {
+      sfree (w->path);
+      sfree (w);
+    }
+    c_avl_destroy (dir->watches);
+    dir->watches = NULL;
+  }
+
+  if (dir->inotify_fd >= 0)
+  {
+    close (dir->inotify_fd);
+    dir->inotify_fd = -1;
+  }
+} /* void fc_watch_close */
+
+static fc_watch_t *fc_watch_add (fc_directory_conf_t *dir, const char *path)
+{
+  fc_watch_t *w;
+  int status;
+
+  w = calloc (1, sizeof (*w));
+  if (w == NULL)
+  {
+    ERROR ("filecount plugin: calloc failed.");
+    dir->watch_failed = 1;
+    return (NULL);
+  }
+
+  w->wd = inotify_add_watch (dir->inotify_fd, path, FC_WATCH_MASK);
+  if (w->wd < 0)
+  {
+    char errbuf[1024];
+    /* ENOSPC means fs.inotify.max_user_watches has been reached. */
+    ERROR ("filecount plugin: inotify_add_watch (%s) failed: %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    sfree (w);
+    dir->watch_failed = 1;
+    return (NULL);
+  }
+
+  w->path = strdup (path);
+  if (w->path == NULL)
+  {
+    ERROR ("filecount plugin: strdup failed.");
+    sfree (w);
+    dir->watch_failed = 1;
+    return (NULL);
+  }
+
+  status = c_avl_insert (dir->watches, &w->wd, w);
+  if (status != 0)
+  {
+    /* The same directory has been reached twice, e.g. via a bind mount.
+     * Count it only once. */
+    sfree (w->path);
+    sfree (w);
+    return (NULL);
+  }
+
+  return (w);
+} /* fc_watch_t *fc_watch_add */
+#endif /* FC_HAVE_INOTIFY */
+
+#if FC_HAVE_AT
+/* Counts the files in the directory `fd' refers to and closes `fd'. `path' is
+ * only used for messages and watches. */
+static int fc_scan_dir (fc_directory_conf_t *dir, int fd, const char *path,
+    int mode, uint64_t *files_num, uint64_t *files_size)
+{
+  DIR *dh;
+  struct dirent *ent;
+  int failure = 0;
+
+#if FC_HAVE_INOTIFY
+  if (mode == FC_SCAN_WATCH)
+  {
+    fc_watch_t *w = fc_watch_add (dir, path);
+
+    if (w == NULL)
+    {
+      close (fd);
+      return (dir->watch_failed ? -1 : 0);
+    }
+    files_num = &w->files_num;
+    files_size = &w->files_size;
+  }
+#endif
+
+  dh = fdopendir (fd);
+  if (dh == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("filecount plugin: Cannot open `%s': %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    return (-1);
+  }
+
+  while ((ent = readdir (dh)) != NULL)
+  {
+    struct stat statbuf;
+    int status;
+
+    if (dir->options & FC_HIDDEN)
+    {
+      if ((strcmp (".", ent->d_name) == 0)
+          || (strcmp ("..", ent->d_name) == 0))
+        continue;
+    }
+    else if (ent->d_name[0] == '.')
+      continue;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+    /* Avoid the stat call for entries which won't be counted anyway. */
+    if ((ent->d_type != DT_UNKNOWN) && (ent->d_type != DT_REG)
+        && (ent->d_type != DT_DIR))
+      continue;
+    if ((ent->d_type == DT_DIR) && ((mode == FC_SCAN_FILES)
+          || !(dir->options & FC_RECURSIVE)))
+      continue;
+    if ((ent->d_type == DT_REG) && (dir->name != NULL)
+        && (fnmatch (dir->name, ent->d_name, /* flags = */ 0) != 0))
+      continue;
+#endif
+
+    status = fstatat (dirfd (dh), ent->d_name, &statbuf,
+        AT_SYMLINK_NOFOLLOW);
+    if (status != 0)
+    {
+      /* Removed since readdir returned it. */
+      if (errno == ENOENT)
+        continue;
+      ERROR ("filecount plugin: stat (%s/%s) failed.", path, ent->d_name);
+      failure++;
+      continue;
+    }
+
+    if (S_ISDIR (statbuf.st_mode))
+    {
+      char abs_path[PATH_MAX];
+      int sub_fd;
+
+      if ((mode == FC_SCAN_FILES) || !(dir->options & FC_RECURSIVE))
+        continue;
+
+      ssnprintf (abs_path, sizeof (abs_path), "%s/%s", path, ent->d_name);
+
+      sub_fd = openat (dirfd (dh), ent->d_name,
+          O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      if (sub_fd < 0)
+      {
+        char errbuf[1024];
+        if (errno == ENOENT)
+          continue;
+        ERROR ("filecount plugin: Cannot open `%s': %s", abs_path,
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        failure++;
+        continue;
+      }
+
+      status = fc_scan_dir (dir, sub_fd, abs_path, mode,
+          files_num, files_size);
+      if (status != 0)
+        failure++;
+      continue;
+    }
+    else if (!S_ISREG (statbuf.st_mode))
+      continue;
+
+    if (!fc_file_matches (dir, ent->d_name, &statbuf))
+      continue;
+
+    (*files_num)++;
+    *files_size += (uint64_t) statbuf.st_size;
+  }
+
+  closedir (dh);
+
+#if FC_HAVE_INOTIFY
+  /* Don't bother with the rest of the tree, it will be scanned without
+   * watches. */
+  if ((mode == FC_SCAN_WATCH) && dir->watch_failed)
+    return (-1);
+#endif
+
+  return ((failure > 0) ? -1 : 0);
+} /* int fc_scan_dir */
+
+static int fc_scan_path (fc_directory_conf_t *dir, const char *path,
+    int mode, uint64_t *files_num, uint64_t *files_size)
+{
+  int fd;
+
+  fd = open (path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    ERROR ("filecount plugin: Cannot open `%s': %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  return (fc_scan_dir (dir, fd, path, mode, files_num, files_size));
+} /* int fc_scan_path */
+#else /* if !FC_HAVE_AT */
 static int fc_read_dir_callback (const char *dirname, const char *filename,
     void *user_data)
 {
@@ -487,50 +821,187 @@ static int fc_read_dir_callback (const char *dirname, const char *filename,
     return (0);
   }
 
-  if (dir->name != NULL)
+  if (!fc_file_matches (dir, filename, &statbuf))
+    return (0);
+
+  dir->files_num++;
+  dir->files_size += (uint64_t) statbuf.st_size;
+
+  return (0);
+} /* int fc_read_dir_callback */
+#endif /* !FC_HAVE_AT */
+
+#if FC_HAVE_INOTIFY
+/* Drops all watches and scans the whole tree again, adding a watch for each
+ * directory. */
+static int fc_watch_rebuild (fc_directory_conf_t *dir)
+{
+  int status;
+
+  fc_watch_close (dir);
+  dir->watch_failed = 0;
+  dir->rescan = 0;
+
+  dir->watches = c_avl_create (fc_wd_compare);
+  if (dir->watches == NULL)
   {
-    status = fnmatch (dir->name, filename, /* flags = */ 0);
-    if (status != 0)
-      return (0);
+    ERROR ("filecount plugin: c_avl_create failed.");
+    return (-1);
   }
 
-  if (dir->mtime != 0)
+  dir->inotify_fd = inotify_init ();
+  if (dir->inotify_fd < 0)
   {
-    time_t mtime = dir->now;
-
-    if (dir->mtime < 0)
-      mtime += dir->mtime;
-    else
-      mtime -= dir->mtime;
+    char errbuf[1024];
+    ERROR ("filecount plugin: inotify_init failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    dir->watch_failed = 1;
+    fc_watch_close (dir);
+    return (-1);
+  }
 
-    DEBUG ("filecount plugin: Only collecting files that were touched %s %u.",
-        (dir->mtime < 0) ? "after" : "before",
-        (unsigned int) mtime);
+  status = fcntl (dir->inotify_fd, F_SETFL,
+      fcntl (dir->inotify_fd, F_GETFL) | O_NONBLOCK);
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("filecount plugin: fcntl failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    dir->watch_failed = 1;
+    fc_watch_close (dir);
+    return (-1);
+  }
 
-    if (((dir->mtime < 0) && (statbuf.st_mtime < mtime))
-        || ((dir->mtime > 0) && (statbuf.st_mtime > mtime)))
-      return (0);
+  status = fc_scan_path (dir, dir->path, FC_SCAN_WATCH,
+      /* files_num = */ NULL, /* files_size = */ NULL);
+  if (status != 0)
+  {
+    fc_watch_close (dir);
+    return (-1);
   }
 
-  if (dir->size != 0)
+  dir->last_rescan = cdtime ();
+  return (0);
+} /* int fc_watch_rebuild */
+
+/* Reads all pending events and marks the affected directories. Changes to
+ * the directory structure require a complete rescan. */
+static void fc_watch_check (fc_directory_conf_t *dir)
+{
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  while (42)
   {
-    off_t size;
+    ssize_t len;
+    char *ptr;
 
-    if (dir->size < 0)
-      size = (off_t) ((-1) * dir->size);
-    else
-      size = (off_t) dir->size;
+    len = read (dir->inotify_fd, buffer, sizeof (buffer));
+    if ((len < 0) && (errno == EINTR))
+      continue;
+    else if (len < 0)
+    {
+      if (errno != EAGAIN)
+      {
+        char errbuf[1024];
+        WARNING ("filecount plugin: Reading inotify events for `%s' failed: %s",
+            dir->path, sstrerror (errno, errbuf, sizeof (errbuf)));
+        dir->rescan = 1;
+      }
+      return;
+    }
+    else if (len == 0)
+      return;
 
-    if (((dir->size < 0) && (statbuf.st_size > size))
-        || ((dir->size > 0) && (statbuf.st_size < size)))
-      return (0);
+    for (ptr = buffer; ptr < buffer + len; )
+    {
+      struct inotify_event *ev = (struct inotify_event *) ptr;
+      fc_watch_t *w = NULL;
+
+      ptr += sizeof (*ev) + ev->len;
+
+      if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED
+            | IN_DELETE_SELF | IN_MOVE_SELF))
+      {
+        dir->rescan = 1;
+        continue;
+      }
+
+      if ((ev->mask & IN_ISDIR) && (dir->options & FC_RECURSIVE)
+          && (ev->mask & (IN_CREATE | IN_DELETE
+              | IN_MOVED_FROM | IN_MOVED_TO)))
+      {
+        dir->rescan = 1;
+        continue;
+      }
+
+      if (c_avl_get (dir->watches, &ev->wd, (void *) &w) == 0)
+        w->dirty = 1;
+    }
   }
+} /* void fc_watch_check */
 
-  dir->files_num++;
-  dir->files_size += (uint64_t) statbuf.st_size;
+/* Updates the counters from inotify events. Returns non-zero if the
+ * directory has to be scanned without watches. */
+static int fc_read_dir_watched (fc_directory_conf_t *dir)
+{
+  c_avl_iterator_t *iter;
+  fc_watch_t *w;
+  void *key;
+
+  if (dir->inotify_fd >= 0)
+    fc_watch_check (dir);
+
+  if ((dir->rescan_interval > 0)
+      && ((cdtime () - dir->last_rescan) >= dir->rescan_interval))
+    dir->rescan = 1;
+
+  if (!dir->rescan && (dir->inotify_fd >= 0))
+  {
+    iter = c_avl_get_iterator (dir->watches);
+    while (c_avl_iterator_next (iter, &key, (void *) &w) == 0)
+    {
+      if (!w->dirty)
+        continue;
+
+      w->dirty = 0;
+      w->files_num = 0;
+      w->files_size = 0;
+      if (fc_scan_path (dir, w->path, FC_SCAN_FILES,
+            &w->files_num, &w->files_size) != 0)
+      {
+        dir->rescan = 1;
+        break;
+      }
+    }
+    c_avl_iterator_destroy (iter);
+  }
+
+  if (dir->rescan || (dir->inotify_fd < 0))
+  {
+    if (fc_watch_rebuild (dir) != 0)
+    {
+      if (dir->watch_failed)
+      {
+        WARNING ("filecount plugin: Watching `%s' failed. Scanning the "
+            "directory completely on each read from now on.", dir->path);
+        dir->options &= ~FC_INOTIFY;
+      }
+      return (-1);
+    }
+  }
+
+  iter = c_avl_get_iterator (dir->watches);
+  while (c_avl_iterator_next (iter, &key, (void *) &w) == 0)
+  {
+    dir->files_num += w->files_num;
+    dir->files_size += w->files_size;
+  }
+  c_avl_iterator_destroy (iter);
 
   return (0);
-} /* int fc_read_dir_callback */
+} /* int fc_read_dir_watched */
+#endif /* FC_HAVE_INOTIFY */
 
 static int fc_read_dir (fc_directory_conf_t *dir)
 {
@@ -541,12 +1012,28 @@ static int fc_read_dir (fc_directory_conf_t *dir)
 
   if (dir->mtime != 0)
     dir->now = time (NULL);
-    
+
+#if FC_HAVE_INOTIFY
+  if ((dir->options & FC_INOTIFY)
+      && (fc_read_dir_watched (dir) == 0))
+  {
+    fc_submit_dir (dir);
+    return (0);
+  }
+  dir->files_num = 0;
+  dir->files_size = 0;
+#endif
+
+#if FC_HAVE_AT
+  status = fc_scan_path (dir, dir->path, FC_SCAN_TOTAL,
+      &dir->files_num, &dir->files_size);
+#else
   status = walk_directory (dir->path, fc_read_dir_callback, dir,
       /* include hidden */ (dir->options & FC_HIDDEN) ? 1 : 0);
+#endif
   if (status != 0)
   {
-    WARNING ("filecount plugin: walk_directory (%s) failed.", dir->path);
+    WARNING ("filecount plugin: Scanning `%s' failed.", dir->path);
     return (-1);
   }
 
@@ -565,11 +1052,32 @@ static int fc_read (void)
   return (0);
 } /* int fc_read */
 
+static int fc_shutdown (void)
+{
+  size_t i;
+
+  for (i = 0; i < directories_num; i++)
+  {
+#if FC_HAVE_INOTIFY
+    fc_watch_close (directories[i]);
+#endif
+    sfree (directories[i]->name);
+    sfree (directories[i]->instance);
+    sfree (directories[i]->path);
+    sfree (directories[i]);
+  }
+  sfree (directories);
+  directories_num = 0;
+
+  return (0);
+} /* int fc_shutdown */
+
 void module_register (void)
 {
   plugin_register_complex_config ("filecount", fc_config);
   plugin_register_init ("filecount", fc_init);
   plugin_register_read ("filecount", fc_read);
+  plugin_register_shutdown ("filecount", fc_shutdown);
 } /* void module_register */
 
 /*
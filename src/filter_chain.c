@@ -25,6 +25,20 @@
 #include "utils_complain.h"
 #include "common.h"
 #include "filter_chain.h"
+#include "utils_epoch.h"
+#include "utils_htable.h"
+
+#include <pthread.h>
+
+/* Number of series a chain remembers decisions for. When the cache is full,
+ * it is emptied and filled again. */
+#ifndef FC_CACHE_MAX_ENTRIES
+# define FC_CACHE_MAX_ENTRIES 65536
+#endif
+
+#define FC_DECISION_UNKNOWN  0
+#define FC_DECISION_MATCH    1
+#define FC_DECISION_NO_MATCH 2
 
 /*
  * Data types
@@ -62,6 +76,23 @@ struct fc_rule_s
   fc_match_t  *matches;
   fc_target_t *targets;
   fc_rule_t *next;
+
+  /* Position in the chain and the values the matches require, if any. */
+  size_t index;
+  char *plugin;
+  char *type;
+
+  /* True if all matches only look at the identifier. */
+  _Bool cacheable;
+}; /* }}} */
+
+/* Rules in the order of the chain, used by the chain's index. */
+struct fc_rule_list_s;
+typedef struct fc_rule_list_s fc_rule_list_t; /* {{{ */
+struct fc_rule_list_s
+{
+  fc_rule_t **rules;
+  size_t rules_num;
 }; /* }}} */
 
 /* List of chains, used for `chain_list_head' */
@@ -71,7 +102,44 @@ struct fc_chain_s /* {{{ */
   fc_rule_t   *rules;
   fc_target_t *targets;
   fc_chain_t  *next;
+
+  /* Rules which require a specific plugin and/or type are indexed by
+   * "plugin/type", with one of the fields empty if it isn't restricted.
+   * Since identifiers cannot contain slashes, the keys are unambiguous. All
+   * other rules are in "unindexed". "index" is NULL if no rule has
+   * restrictions. */
+  c_htable_t *index;
+  fc_rule_list_t unindexed;
+
+  /* With "CacheDecisions", maps identifiers to an array holding one
+   * FC_DECISION_* value per rule. Only the results of cacheable rules are
+   * stored. */
+  _Bool cache_decisions;
+  c_htable_t *cache;
+  size_t cache_num;
+  size_t rules_num;
+  pthread_mutex_t cache_lock;
+}; /* }}} */
+
+/* A copy of the decisions cached for one series, used while the series is
+ * processed, so that the cache lock needn't be held. */
+struct fc_decisions_s /* {{{ */
+{
+  char identifier[6 * DATA_MAX_NAME_LEN];
+  unsigned char *values;
+  _Bool changed;
+}; /* }}} */
+typedef struct fc_decisions_s fc_decisions_t;
+
+/* Iterates over the rules of a chain which may match a value list, in the
+ * order of the chain. */
+#define FC_CURSOR_LISTS 4
+struct fc_rule_cursor_s /* {{{ */
+{
+  fc_rule_list_t *lists[FC_CURSOR_LISTS];
+  size_t pos[FC_CURSOR_LISTS];
 }; /* }}} */
+typedef struct fc_rule_cursor_s fc_rule_cursor_t;
 
 /*
  * Global variables
@@ -79,6 +147,12 @@ struct fc_chain_s /* {{{ */
 static fc_match_t  *match_list_head;
 static fc_target_t *target_list_head;
 static fc_chain_t  *chain_list_head;
+/* The chains replaced by the last fc_reload(). plugin.c only switches to the
+ * new chains after fc_reload() has returned, and value lists which were being
+ * processed at that time may still use the old ones. They are freed by the
+ * next reload, once the write threads have left the sections they may have
+ * been using them in, see c_epoch_enter(). */
+static fc_chain_t  *chain_list_retired;
 
 /*
  * Private functions
@@ -130,6 +204,8 @@ static void fc_free_rules (fc_rule_t *r) /* {{{ */
 
   fc_free_matches (r->matches);
   fc_free_targets (r->targets);
+  sfree (r->plugin);
+  sfree (r->type);
 
   if (r->next != NULL)
     fc_free_rules (r->next);
@@ -137,11 +213,57 @@ static void fc_free_rules (fc_rule_t *r) /* {{{ */
   free (r);
 } /* }}} void fc_free_rules */
 
+static void fc_free_index (fc_chain_t *c) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  if (c->index != NULL)
+  {
+    while (c_htable_pick (c->index, &key, &value) == 0)
+    {
+      fc_rule_list_t *list = value;
+
+      sfree (key);
+      sfree (list->rules);
+      sfree (list);
+    }
+    c_htable_destroy (c->index);
+    c->index = NULL;
+  }
+
+  sfree (c->unindexed.rules);
+  c->unindexed.rules_num = 0;
+} /* }}} void fc_free_index */
+
+/* The caller must hold "cache_lock". */
+static void fc_cache_clear (fc_chain_t *c) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  while (c_htable_pick (c->cache, &key, &value) == 0)
+  {
+    sfree (key);
+    sfree (value);
+  }
+  c->cache_num = 0;
+} /* }}} void fc_cache_clear */
+
 static void fc_free_chains (fc_chain_t *c) /* {{{ */
 {
   if (c == NULL)
     return;
 
+  if (c->cache != NULL)
+  {
+    fc_cache_clear (c);
+    c_htable_destroy (c->cache);
+    c->cache = NULL;
+    pthread_mutex_destroy (&c->cache_lock);
+  }
+
+  fc_free_index (c);
   fc_free_rules (c->rules);
   fc_free_targets (c->targets);
 
@@ -169,6 +291,321 @@ static char *fc_strdup (const char *orig) /* {{{ */
   return (dest);
 } /* }}} char *fc_strdup */
 
+/* Collects the plugin and type the rule's matches require. If two matches
+ * require different values, the first one is used: the rule can't match
+ * anyway. */
+static int fc_rule_set_constraints (fc_rule_t *rule) /* {{{ */
+{
+  fc_match_t *m;
+
+  rule->cacheable = (rule->matches != NULL);
+
+  for (m = rule->matches; m != NULL; m = m->next)
+  {
+    fc_match_constraints_t c;
+
+    if (!(m->proc.flags & FC_MATCH_IDENTIFIER_ONLY))
+      rule->cacheable = 0;
+
+    if (m->proc.constraints == NULL)
+      continue;
+
+    memset (&c, 0, sizeof (c));
+    if ((*m->proc.constraints) (&m->user_data, &c) != 0)
+      continue;
+
+    if ((rule->plugin == NULL) && (c.plugin != NULL) && (c.plugin[0] != 0))
+      rule->plugin = fc_strdup (c.plugin);
+    if ((rule->type == NULL) && (c.type != NULL) && (c.type[0] != 0))
+      rule->type = fc_strdup (c.type);
+  }
+
+  return (0);
+} /* }}} int fc_rule_set_constraints */
+
+static int fc_rule_list_append (fc_rule_list_t *list, /* {{{ */
+    fc_rule_t *rule)
+{
+  fc_rule_t **tmp;
+
+  tmp = realloc (list->rules, (list->rules_num + 1) * sizeof (*list->rules));
+  if (tmp == NULL)
+    return (ENOMEM);
+
+  list->rules = tmp;
+  list->rules[list->rules_num] = rule;
+  list->rules_num++;
+
+  return (0);
+} /* }}} int fc_rule_list_append */
+
+/* Sorts the rules of a chain into the index. Called once all rules of the
+ * chain have been configured. */
+static int fc_chain_build_index (fc_chain_t *chain) /* {{{ */
+{
+  fc_rule_t *rule;
+  size_t index = 0;
+  size_t indexed = 0;
+
+  fc_free_index (chain);
+
+  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  {
+    rule->index = index++;
+    if ((rule->plugin != NULL) || (rule->type != NULL))
+      indexed++;
+  }
+
+  if (indexed > 0)
+  {
+    chain->index = c_htable_create ();
+    if (chain->index == NULL)
+      return (ENOMEM);
+  }
+
+  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  {
+    fc_rule_list_t *list = NULL;
+    char key[2 * DATA_MAX_NAME_LEN];
+
+    if ((chain->index == NULL)
+        || ((rule->plugin == NULL) && (rule->type == NULL)))
+    {
+      if (fc_rule_list_append (&chain->unindexed, rule) != 0)
+        return (ENOMEM);
+      continue;
+    }
+
+    ssnprintf (key, sizeof (key), "%s/%s",
+        (rule->plugin != NULL) ? rule->plugin : "",
+        (rule->type != NULL) ? rule->type : "");
+
+    if (c_htable_get (chain->index, key, (void *) &list) != 0)
+    {
+      char *key_copy;
+
+      list = calloc (1, sizeof (*list));
+      key_copy = fc_strdup (key);
+      if ((list == NULL) || (key_copy == NULL)
+          || (c_htable_insert (chain->index, key_copy, list) != 0))
+      {
+        sfree (list);
+        sfree (key_copy);
+        return (ENOMEM);
+      }
+    }
+
+    if (fc_rule_list_append (list, rule) != 0)
+      return (ENOMEM);
+  }
+
+  chain->rules_num = index;
+
+  DEBUG ("fc_chain_build_index (%s): %zu of %zu rules are indexed.",
+      chain->name, indexed, index);
+
+  return (0);
+} /* }}} int fc_chain_build_index */
+
+/* Copies the decisions cached for "vl" to "d". */
+static void fc_decisions_load (fc_chain_t *chain, /* {{{ */
+    const value_list_t *vl, fc_decisions_t *d)
+{
+  void *cached = NULL;
+
+  d->changed = 0;
+  if (FORMAT_VL (d->identifier, sizeof (d->identifier), vl) != 0)
+  {
+    d->values = NULL;
+    return;
+  }
+
+  d->values = calloc (chain->rules_num, 1);
+  if (d->values == NULL)
+    return;
+
+  pthread_mutex_lock (&chain->cache_lock);
+  if (c_htable_get (chain->cache, d->identifier, &cached) == 0)
+    memcpy (d->values, cached, chain->rules_num);
+  pthread_mutex_unlock (&chain->cache_lock);
+} /* }}} void fc_decisions_load */
+
+/* Stores new decisions in the cache and releases "d". */
+static void fc_decisions_store (fc_chain_t *chain, /* {{{ */
+    fc_decisions_t *d)
+{
+  void *cached = NULL;
+
+  if (d->values == NULL)
+    return;
+
+  if (!d->changed)
+  {
+    sfree (d->values);
+    return;
+  }
+
+  pthread_mutex_lock (&chain->cache_lock);
+  if (c_htable_get (chain->cache, d->identifier, &cached) == 0)
+  {
+    /* Another thread may have added decisions in the meantime. */
+    size_t i;
+
+    for (i = 0; i < chain->rules_num; i++)
+      if (d->values[i] != FC_DECISION_UNKNOWN)
+        ((unsigned char *) cached)[i] = d->values[i];
+    sfree (d->values);
+  }
+  else
+  {
+    char *key;
+
+    if (chain->cache_num >= FC_CACHE_MAX_ENTRIES)
+    {
+      DEBUG ("fc_decisions_store (%s): The cache is full. Emptying it.",
+          chain->name);
+      fc_cache_clear (chain);
+    }
+
+    key = fc_strdup (d->identifier);
+    if ((key != NULL)
+        && (c_htable_insert (chain->cache, key, d->values) == 0))
+      chain->cache_num++;
+    else
+    {
+      sfree (key);
+      sfree (d->values);
+    }
+  }
+  pthread_mutex_unlock (&chain->cache_lock);
+
+  d->values = NULL;
+} /* }}} void fc_decisions_store */
+
+/* Switches "d" to the series of "vl" if a target changed its identifier. */
+static void fc_decisions_update (fc_chain_t *chain, /* {{{ */
+    const value_list_t *vl, fc_decisions_t *d)
+{
+  char identifier[6 * DATA_MAX_NAME_LEN];
+
+  if ((d->values != NULL)
+      && (FORMAT_VL (identifier, sizeof (identifier), vl) == 0)
+      && (strcmp (identifier, d->identifier) == 0))
+    return;
+
+  fc_decisions_store (chain, d);
+  fc_decisions_load (chain, vl, d);
+} /* }}} void fc_decisions_update */
+
+/* Returns true if all matches of "rule" match. The result of cacheable rules
+ * is taken from, and stored in, "d" if it is not NULL. */
+static _Bool fc_rule_matches (fc_chain_t *chain, fc_rule_t *rule, /* {{{ */
+    const data_set_t *ds, const value_list_t *vl, fc_decisions_t *d)
+{
+  fc_match_t *match;
+  unsigned char *decision = NULL;
+
+  if (rule->cacheable && (d != NULL) && (d->values != NULL))
+  {
+    decision = d->values + rule->index;
+    if (*decision != FC_DECISION_UNKNOWN)
+      return (*decision == FC_DECISION_MATCH);
+  }
+
+  /* N. B.: rule->matches may be NULL. */
+  for (match = rule->matches; match != NULL; match = match->next)
+  {
+    int status;
+
+    /* FIXME: Pass the meta-data to match targets here (when implemented). */
+    status = (*match->proc.match) (ds, vl, /* meta = */ NULL,
+        &match->user_data);
+    if (status < 0)
+    {
+      WARNING ("fc_process_chain (%s): A match failed.", chain->name);
+      /* Don't remember errors; they may be temporary. */
+      return (0);
+    }
+    else if (status != FC_MATCH_MATCHES)
+      break;
+  }
+
+  if (decision != NULL)
+  {
+    *decision = (match == NULL) ? FC_DECISION_MATCH : FC_DECISION_NO_MATCH;
+    d->changed = 1;
+  }
+
+  return (match == NULL);
+} /* }}} _Bool fc_rule_matches */
+
+/* Positions "cursor" on the first rule at or after "first_index" which may
+ * match "vl". */
+static void fc_rule_cursor_init (fc_rule_cursor_t *cursor, /* {{{ */
+    fc_chain_t *chain, const value_list_t *vl, size_t first_index)
+{
+  size_t lists_num = 0;
+  size_t i;
+
+  memset (cursor, 0, sizeof (*cursor));
+  cursor->lists[lists_num++] = &chain->unindexed;
+
+  if (chain->index != NULL)
+  {
+    char key[2 * DATA_MAX_NAME_LEN];
+    void *list;
+
+    ssnprintf (key, sizeof (key), "%s/%s", vl->plugin, vl->type);
+    if (c_htable_get (chain->index, key, &list) == 0)
+      cursor->lists[lists_num++] = list;
+
+    ssnprintf (key, sizeof (key), "%s/", vl->plugin);
+    if (c_htable_get (chain->index, key, &list) == 0)
+      cursor->lists[lists_num++] = list;
+
+    ssnprintf (key, sizeof (key), "/%s", vl->type);
+    if (c_htable_get (chain->index, key, &list) == 0)
+      cursor->lists[lists_num++] = list;
+  }
+
+  for (i = 0; i < lists_num; i++)
+  {
+    fc_rule_list_t *list = cursor->lists[i];
+
+    while ((cursor->pos[i] < list->rules_num)
+        && (list->rules[cursor->pos[i]]->index < first_index))
+      cursor->pos[i]++;
+  }
+} /* }}} void fc_rule_cursor_init */
+
+static fc_rule_t *fc_rule_cursor_next (fc_rule_cursor_t *cursor) /* {{{ */
+{
+  fc_rule_t *next = NULL;
+  size_t next_list = 0;
+  size_t i;
+
+  for (i = 0; i < FC_CURSOR_LISTS; i++)
+  {
+    fc_rule_list_t *list = cursor->lists[i];
+    fc_rule_t *rule;
+
+    if ((list == NULL) || (cursor->pos[i] >= list->rules_num))
+      continue;
+
+    rule = list->rules[cursor->pos[i]];
+    if ((next == NULL) || (rule->index < next->index))
+    {
+      next = rule;
+      next_list = i;
+    }
+  }
+
+  if (next != NULL)
+    cursor->pos[next_list]++;
+
+  return (next);
+} /* }}} fc_rule_t *fc_rule_cursor_next */
+
 /*
  * Configuration.
  *
@@ -415,6 +852,8 @@ static int fc_config_add_rule (fc_chain_t *chain, /* {{{ */
     return (-1);
   }
 
+  fc_rule_set_constraints (rule);
+
   if (chain->rules != NULL)
   {
     fc_rule_t *ptr;
@@ -433,7 +872,8 @@ static int fc_config_add_rule (fc_chain_t *chain, /* {{{ */
   return (0);
 } /* }}} int fc_config_add_rule */
 
-static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
+static int fc_config_add_chain (fc_chain_t **list_head, /* {{{ */
+    const oconfig_item_t *ci)
 {
   fc_chain_t *chain;
   int status = 0;
@@ -468,6 +908,8 @@ static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
       status = fc_config_add_rule (chain, option);
     else if (strcasecmp ("Target", option->key) == 0)
       status = fc_config_add_target (&chain->targets, option);
+    else if (strcasecmp ("CacheDecisions", option->key) == 0)
+      status = cf_util_get_boolean (option, &chain->cache_decisions);
     else
     {
       WARNING ("Filter subsystem: Chain %s: Option `%s' not allowed "
@@ -479,17 +921,38 @@ static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
       break;
   } /* for (ci->children) */
 
+  if (status == 0)
+  {
+    status = fc_chain_build_index (chain);
+    if (status != 0)
+      ERROR ("Filter subsystem: Chain %s: Building the rule index failed.",
+          chain->name);
+  }
+
+  if ((status == 0) && chain->cache_decisions && (chain->rules_num > 0))
+  {
+    chain->cache = c_htable_create ();
+    if (chain->cache == NULL)
+    {
+      ERROR ("Filter subsystem: Chain %s: c_htable_create failed.",
+          chain->name);
+      status = -1;
+    }
+    else
+      pthread_mutex_init (&chain->cache_lock, /* attr = */ NULL);
+  }
+
   if (status != 0)
   {
     fc_free_chains (chain);
     return (-1);
   }
 
-  if (chain_list_head != NULL)
+  if (*list_head != NULL)
   {
     fc_chain_t *ptr;
 
-    ptr = chain_list_head;
+    ptr = *list_head;
     while (ptr->next != NULL)
       ptr = ptr->next;
 
@@ -497,7 +960,7 @@ static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
   }
   else
   {
-    chain_list_head = chain;
+    *list_head = chain;
   }
 
   return (0);
@@ -609,7 +1072,10 @@ static int fc_bit_write_create (const oconfig_item_t *ci, /* {{{ */
 {
   int i;
 
-  char **plugin_list;
+  /* The list is terminated by a reference with an empty name. The
+   * references resolve the plugin names to write callbacks once, rather
+   * than for each value. */
+  plugin_write_ref_t *plugin_list;
   size_t plugin_list_len;
 
   plugin_list = NULL;
@@ -618,7 +1084,7 @@ static int fc_bit_write_create (const oconfig_item_t *ci, /* {{{ */
   for (i = 0; i < ci->children_num; i++)
   {
     oconfig_item_t *child = ci->children + i;
-    char **temp;
+    plugin_write_ref_t *temp;
     int j;
 
     if (strcasecmp ("Plugin", child->key) != 0)
@@ -638,7 +1104,7 @@ static int fc_bit_write_create (const oconfig_item_t *ci, /* {{{ */
         continue;
       }
 
-      temp = (char **) realloc (plugin_list, (plugin_list_len + 2)
+      temp = realloc (plugin_list, (plugin_list_len + 2)
           * (sizeof (*plugin_list)));
       if (temp == NULL)
       {
@@ -647,14 +1113,10 @@ static int fc_bit_write_create (const oconfig_item_t *ci, /* {{{ */
       }
       plugin_list = temp;
 
-      plugin_list[plugin_list_len] = fc_strdup (child->values[j].value.string);
-      if (plugin_list[plugin_list_len] == NULL)
-      {
-        ERROR ("fc_bit_write_create: fc_strdup failed.");
-        continue;
-      }
+      plugin_write_ref_init (plugin_list + plugin_list_len,
+          child->values[j].value.string);
       plugin_list_len++;
-      plugin_list[plugin_list_len] = NULL;
+      memset (plugin_list + plugin_list_len, 0, sizeof (*plugin_list));
     } /* for (j = 0; j < child->values_num; j++) */
   } /* for (i = 0; i < ci->children_num; i++) */
 
@@ -665,17 +1127,10 @@ static int fc_bit_write_create (const oconfig_item_t *ci, /* {{{ */
 
 static int fc_bit_write_destroy (void **user_data) /* {{{ */
 {
-  char **plugin_list;
-  size_t i;
-
   if ((user_data == NULL) || (*user_data == NULL))
     return (0);
 
-  plugin_list = *user_data;
-
-  for (i = 0; plugin_list[i] != NULL; i++)
-    free (plugin_list[i]);
-  free (plugin_list);
+  free (*user_data);
 
   return (0);
 } /* }}} int fc_bit_write_destroy */
@@ -684,14 +1139,14 @@ static int fc_bit_write_invoke (const data_set_t *ds, /* {{{ */
     value_list_t *vl, notification_meta_t __attribute__((unused)) **meta,
     void **user_data)
 {
-  char **plugin_list;
+  plugin_write_ref_t *plugin_list;
   int status;
 
   plugin_list = NULL;
   if (user_data != NULL)
     plugin_list = *user_data;
 
-  if ((plugin_list == NULL) || (plugin_list[0] == NULL))
+  if ((plugin_list == NULL) || (plugin_list[0].name[0] == 0))
   {
     static c_complain_t enoent_complaint = C_COMPLAIN_INIT_STATIC;
 
@@ -723,15 +1178,16 @@ static int fc_bit_write_invoke (const data_set_t *ds, /* {{{ */
   {
     size_t i;
 
-    for (i = 0; plugin_list[i] != NULL; i++)
+    for (i = 0; plugin_list[i].name[0] != 0; i++)
     {
-      status = plugin_write (plugin_list[i], ds, vl);
+      status = plugin_write_ref (plugin_list + i, ds, vl);
       if (status != 0)
       {
         INFO ("Filter subsystem: Built-in target `write': Dispatching value to "
-            "the `%s' plugin failed with status %i.", plugin_list[i], status);
+            "the `%s' plugin failed with status %i.", plugin_list[i].name,
+            status);
       }
-    } /* for (i = 0; plugin_list[i] != NULL; i++) */
+    } /* for (i = 0; plugin_list[i].name[0] != 0; i++) */
   }
 
   return (FC_TARGET_CONTINUE);
@@ -863,6 +1319,9 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
 {
   fc_rule_t *rule;
   fc_target_t *target;
+  fc_rule_cursor_t cursor;
+  fc_decisions_t decisions;
+  fc_decisions_t *d = NULL;
   int status;
 
   if (chain == NULL)
@@ -870,34 +1329,23 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
 
   DEBUG ("fc_process_chain (chain = %s);", chain->name);
 
-  status = FC_TARGET_CONTINUE;
-  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  if (chain->cache != NULL)
   {
-    fc_match_t *match;
+    d = &decisions;
+    fc_decisions_load (chain, vl, d);
+  }
 
+  status = FC_TARGET_CONTINUE;
+  fc_rule_cursor_init (&cursor, chain, vl, /* first_index = */ 0);
+  while ((rule = fc_rule_cursor_next (&cursor)) != NULL)
+  {
     if (rule->name[0] != 0)
     {
       DEBUG ("fc_process_chain (%s): Testing the `%s' rule.",
           chain->name, rule->name);
     }
 
-    /* N. B.: rule->matches may be NULL. */
-    for (match = rule->matches; match != NULL; match = match->next)
-    {
-      /* FIXME: Pass the meta-data to match targets here (when implemented). */
-      status = (*match->proc.match) (ds, vl, /* meta = */ NULL,
-          &match->user_data);
-      if (status < 0)
-      {
-        WARNING ("fc_process_chain (%s): A match failed.", chain->name);
-        break;
-      }
-      else if (status != FC_MATCH_MATCHES)
-        break;
-    }
-
-    /* for-loop has been aborted: Either error or no match. */
-    if (match != NULL)
+    if (!fc_rule_matches (chain, rule, ds, vl, d))
     {
       status = FC_TARGET_CONTINUE;
       continue;
@@ -951,7 +1399,15 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
     {
       status = FC_TARGET_CONTINUE;
     }
-  } /* for (rule) */
+
+    /* The targets may have changed the identifier. */
+    fc_rule_cursor_init (&cursor, chain, vl, rule->index + 1);
+    if (d != NULL)
+      fc_decisions_update (chain, vl, d);
+  } /* while (rule) */
+
+  if (d != NULL)
+    fc_decisions_store (chain, d);
 
   if (status == FC_TARGET_STOP)
     return (FC_TARGET_STOP);
@@ -1029,7 +1485,7 @@ int fc_configure (const oconfig_item_t *ci) /* {{{ */
     return (-EINVAL);
 
   if (strcasecmp ("Chain", ci->key) == 0)
-    return (fc_config_add_chain (ci));
+    return (fc_config_add_chain (&chain_list_head, ci));
 
   WARNING ("Filter subsystem: Unknown top level config option `%s'.",
       ci->key);
@@ -1037,4 +1493,45 @@ int fc_configure (const oconfig_item_t *ci) /* {{{ */
   return (-1);
 } /* }}} int fc_configure */
 
+int fc_reload (const oconfig_item_t *ci) /* {{{ */
+{
+  fc_chain_t *new_head = NULL;
+  fc_chain_t *old_head;
+  int i;
+
+  fc_init_once ();
+
+  if (ci == NULL)
+    return (-EINVAL);
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Chain", child->key) != 0)
+      continue;
+
+    if (fc_config_add_chain (&new_head, child) != 0)
+    {
+      ERROR ("Filter subsystem: Reloading the chains failed. Keeping the "
+          "current chains.");
+      fc_free_chains (new_head);
+      return (-1);
+    }
+  }
+
+  /* The chains must be complete before other threads can find them. */
+  __sync_synchronize ();
+  old_head = chain_list_head;
+  chain_list_head = new_head;
+
+  /* The previous reload's chains have been unreachable since plugin.c
+   * switched away from them. */
+  c_epoch_synchronize ();
+  fc_free_chains (chain_list_retired);
+  chain_list_retired = old_head;
+
+  return (0);
+} /* }}} int fc_reload */
+
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -28,6 +28,8 @@
 #define FC_MATCH_NO_MATCH  0
 #define FC_MATCH_MATCHES   1
 
+#define FC_MATCH_IDENTIFIER_ONLY 0x0001
+
 #define FC_TARGET_CONTINUE 0
 #define FC_TARGET_STOP     1
 #define FC_TARGET_RETURN   2
@@ -35,12 +37,27 @@
 /*
  * Match functions
  */
+/* Literal values the plugin and type of a value list must have for a match to
+ * succeed, or NULL if the match doesn't restrict a field. Chains use these to
+ * only evaluate the rules which can possibly match a value list. */
+struct fc_match_constraints_s
+{
+  const char *plugin;
+  const char *type;
+};
+typedef struct fc_match_constraints_s fc_match_constraints_t;
+
 struct match_proc_s
 {
   int (*create) (const oconfig_item_t *ci, void **user_data);
   int (*destroy) (void **user_data);
   int (*match) (const data_set_t *ds, const value_list_t *vl,
       notification_meta_t **meta, void **user_data);
+  /* Optional. The strings must remain valid until "destroy" is called. */
+  int (*constraints) (void **user_data, fc_match_constraints_t *ret);
+  /* FC_MATCH_IDENTIFIER_ONLY: The result only depends on the identifier of
+   * the value list and may be cached per series. */
+  int flags;
 };
 typedef struct match_proc_s match_proc_t;
 
@@ -48,6 +65,9 @@ int fc_register_match (const char *name, match_proc_t proc);
 
 /*
  * Target functions
+ *
+ * Targets which change the value list they are given must call
+ * plugin_value_list_make_writable() first.
  */
 struct target_proc_s
 {
@@ -97,5 +117,11 @@ int fc_default_action (const data_set_t *ds, value_list_t *vl);
  */
 int fc_configure (const oconfig_item_t *ci);
 
+/* Replaces all chains with the <Chain> blocks among the children of "ci",
+ * which is usually the root of the config file. The current chains are kept
+ * if any of the new ones is invalid. Chain pointers obtained before, for
+ * example from "fc_chain_get_by_name", remain valid until the next reload. */
+int fc_reload (const oconfig_item_t *ci);
+
 #endif /* FILTER_CHAIN_H */
 /* vim: set sw=2 sts=2 et : */
@@ -19,11 +19,13 @@
  *   Florian octo Forster <octo at collectd.org>
  **/
 
+#define _GNU_SOURCE /* For recvmmsg() */
+
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
 #include "configfile.h"
-#include "utils_avltree.h"
+#include "utils_htable.h"
 
 #if HAVE_PTHREAD_H
 # include <pthread.h>
@@ -60,6 +62,11 @@
 # define BUFF_SIZE 1400
 #endif
 
+/* Number of packets to read from a socket with one call to recvmmsg(2). */
+#ifndef MC_RECEIVE_BATCH
+# define MC_RECEIVE_BATCH 32
+#endif
+
 struct socket_entry_s
 {
   int                     fd;
@@ -84,6 +91,7 @@ struct metric_map_s
   char *ds_name;
   int   ds_type;
   int   ds_index;
+  int   ds_num;
 };
 typedef struct metric_map_s metric_map_t;
 
@@ -130,82 +138,93 @@ static size_t metric_map_len_default = STATIC_ARRAY_SIZE (metric_map_default);
 static metric_map_t *metric_map = NULL;
 static size_t        metric_map_len = 0;
 
-static c_avl_tree_t   *staging_tree;
+/* Maps Ganglia metric names to entries of `metric_map' and
+ * `metric_map_default'. Built by `gmond_init' and read-only afterwards. */
+static c_htable_t *metric_table = NULL;
+
+/* Staging entries by "host/type/type_instance". */
+static c_htable_t     *staging_table;
 static pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static metric_map_t *metric_lookup (const char *key) /* {{{ */
+static int metric_table_create (void) /* {{{ */
 {
-  metric_map_t *map;
-  size_t map_len;
   size_t i;
 
-  /* Search the user-supplied table first.. */
-  map = metric_map;
-  map_len = metric_map_len;
-  for (i = 0; i < map_len; i++)
-    if (strcmp (map[i].ganglia_name, key) == 0)
-      break;
+  metric_table = c_htable_create ();
+  if (metric_table == NULL)
+    return (-1);
 
-  /* .. and fall back to the built-in table if nothing is found. */
-  if (i >= map_len)
-  {
-    map = metric_map_default;
-    map_len = metric_map_len_default;
+  /* Entries from the user-supplied table take precedence over the built-in
+   * ones, so insert them first. Later duplicates are ignored. */
+  for (i = 0; i < metric_map_len; i++)
+    if (c_htable_insert (metric_table, metric_map[i].ganglia_name,
+          metric_map + i) < 0)
+      return (-1);
 
-    for (i = 0; i < map_len; i++)
-      if (strcmp (map[i].ganglia_name, key) == 0)
-        break;
-  }
+  for (i = 0; i < metric_map_len_default; i++)
+    if (c_htable_insert (metric_table, metric_map_default[i].ganglia_name,
+          metric_map_default + i) < 0)
+      return (-1);
 
-  if (i >= map_len)
+  return (0);
+} /* }}} int metric_table_create */
+
+static metric_map_t *metric_lookup (const char *key) /* {{{ */
+{
+  metric_map_t *map;
+
+  map = NULL;
+  if ((metric_table == NULL)
+      || (c_htable_get (metric_table, key, (void *) &map) != 0))
     return (NULL);
 
   /* Look up the DS type and ds_index. */
-  if ((map[i].ds_type < 0) || (map[i].ds_index < 0)) /* {{{ */
+  if ((map->ds_type < 0) || (map->ds_index < 0)) /* {{{ */
   {
     const data_set_t *ds;
 
-    ds = plugin_get_ds (map[i].type);
+    ds = plugin_get_ds (map->type);
     if (ds == NULL)
     {
-      WARNING ("gmond plugin: Type not defined: %s", map[i].type);
+      WARNING ("gmond plugin: Type not defined: %s", map->type);
       return (NULL);
     }
 
-    if ((map[i].ds_name == NULL) && (ds->ds_num != 1))
+    if ((map->ds_name == NULL) && (ds->ds_num != 1))
     {
       WARNING ("gmond plugin: No data source name defined for metric %s, "
           "but type %s has more than one data source.",
-          map[i].ganglia_name, map[i].type);
+          map->ganglia_name, map->type);
       return (NULL);
     }
 
-    if (map[i].ds_name == NULL)
+    if (map->ds_name == NULL)
     {
-      map[i].ds_index = 0;
+      map->ds_index = 0;
     }
     else
     {
       int j;
 
       for (j = 0; j < ds->ds_num; j++)
-        if (strcasecmp (ds->ds[j].name, map[i].ds_name) == 0)
+        if (strcasecmp (ds->ds[j].name, map->ds_name) == 0)
           break;
 
       if (j >= ds->ds_num)
       {
         WARNING ("gmond plugin: There is no data source "
             "named `%s' in type `%s'.",
-            map[i].ds_name, ds->type);
+            map->ds_name, ds->type);
         return (NULL);
       }
-      map[i].ds_index = j;
+      map->ds_index = j;
     }
 
-    map[i].ds_type = ds->ds[map[i].ds_index].type;
-  } /* }}} if ((map[i].ds_type < 0) || (map[i].ds_index < 0)) */
+    map->ds_num = ds->ds_num;
+    map->ds_type = ds->ds[map->ds_index].type;
+  } /* }}} if ((map->ds_type < 0) || (map->ds_index < 0)) */
 
-  return (map + i);
+  return (map);
 } /* }}} metric_map_t *metric_lookup */
 
 static int create_sockets (socket_entry_t **ret_sockets, /* {{{ */
@@ -422,14 +441,14 @@ static staging_entry_t *staging_entry_get (const char *host, /* {{{ */
   staging_entry_t *se;
   int status;
 
-  if (staging_tree == NULL)
+  if (staging_table == NULL)
     return (NULL);
 
   ssnprintf (key, sizeof (key), "%s/%s/%s", host, type,
       (type_instance != NULL) ? type_instance : "");
 
   se = NULL;
-  status = c_avl_get (staging_tree, key, (void *) &se);
+  status = c_htable_get (staging_table, key, (void *) &se);
   if (status == 0)
     return (se);
 
@@ -459,10 +478,10 @@ static staging_entry_t *staging_entry_get (const char *host, /* {{{ */
     sstrncpy (se->vl.type_instance, type_instance,
         sizeof (se->vl.type_instance));
 
-  status = c_avl_insert (staging_tree, se->key, se);
+  status = c_htable_insert (staging_table, se->key, se);
   if (status != 0)
   {
-    ERROR ("gmond plugin: c_avl_insert failed.");
+    ERROR ("gmond plugin: c_htable_insert failed.");
     sfree (se->vl.values);
     sfree (se);
     return (NULL);
@@ -501,37 +520,25 @@ static int staging_entry_submit (const char *host, const char *name, /* {{{ */
   return (0);
 } /* }}} int staging_entry_submit */
 
+/* `map' must have been resolved by `metric_lookup'. */
 static int staging_entry_update (const char *host, const char *name, /* {{{ */
-    const char *type, const char *type_instance,
-    int ds_index, int ds_type, value_t value)
+    const metric_map_t *map, value_t value)
 {
-  const data_set_t *ds;
   staging_entry_t *se;
-
-  ds = plugin_get_ds (type);
-  if (ds == NULL)
-  {
-    ERROR ("gmond plugin: Looking up type %s failed.", type);
-    return (-1);
-  }
-
-  if (ds->ds_num <= ds_index)
-  {
-    ERROR ("gmond plugin: Invalid index %i: %s has only %i data source(s).",
-        ds_index, ds->type, ds->ds_num);
-    return (-1);
-  }
+  int ds_index = map->ds_index;
+  int ds_type = map->ds_type;
 
   pthread_mutex_lock (&staging_lock);
 
-  se = staging_entry_get (host, name, type, type_instance, ds->ds_num);
+  se = staging_entry_get (host, name, map->type, map->type_instance,
+      map->ds_num);
   if (se == NULL)
   {
     pthread_mutex_unlock (&staging_lock);
     ERROR ("gmond plugin: staging_entry_get failed.");
     return (-1);
   }
-  if (se->vl.values_len != ds->ds_num)
+  if (se->vl.values_len != map->ds_num)
   {
     pthread_mutex_unlock (&staging_lock);
     return (-1);
@@ -667,10 +674,7 @@ static int mc_handle_value_msg (Ganglia_value_msg *msg) /* {{{ */
     else
       assert (23 == 42);
 
-    return (staging_entry_update (host, name,
-          map->type, map->type_instance,
-          map->ds_index, map->ds_type,
-          val_copy));
+    return (staging_entry_update (host, name, map, val_copy));
   }
 
   DEBUG ("gmond plugin: Cannot find a translation for %s.", name);
@@ -685,7 +689,6 @@ static int mc_handle_metadata_msg (Ganglia_metadata_msg *msg) /* {{{ */
     {
       Ganglia_metadatadef msg_meta;
       staging_entry_t *se;
-      const data_set_t *ds;
       metric_map_t *map;
 
       msg_meta = msg->Ganglia_metadata_msg_u.gfull;
@@ -701,13 +704,6 @@ static int mc_handle_metadata_msg (Ganglia_metadata_msg *msg) /* {{{ */
         return (0);
       }
 
-      ds = plugin_get_ds (map->type);
-      if (ds == NULL)
-      {
-        WARNING ("gmond plugin: Could not find data set %s.", map->type);
-        return (-1);
-      }
-
       DEBUG ("gmond plugin: Received meta data for %s/%s.",
           msg_meta.metric_id.host, msg_meta.metric_id.name);
 
@@ -715,7 +711,7 @@ static int mc_handle_metadata_msg (Ganglia_metadata_msg *msg) /* {{{ */
       se = staging_entry_get (msg_meta.metric_id.host,
           msg_meta.metric_id.name,
           map->type, map->type_instance,
-          ds->ds_num);
+          map->ds_num);
       if (se != NULL)
         se->vl.interval = TIME_T_TO_CDTIME_T (msg_meta.metric.tmax);
       pthread_mutex_unlock (&staging_lock);
@@ -787,8 +783,10 @@ static int mc_handle_metric (void *buffer, size_t buffer_size) /* {{{ */
 
 static int mc_handle_socket (struct pollfd *p) /* {{{ */
 {
-  char buffer[BUFF_SIZE];
-  ssize_t buffer_size;
+  char buffer[MC_RECEIVE_BATCH][BUFF_SIZE];
+  size_t buffer_size[MC_RECEIVE_BATCH];
+  int num;
+  int i;
 
   if ((p->revents & (POLLIN | POLLPRI)) == 0)
   {
@@ -796,8 +794,39 @@ static int mc_handle_socket (struct pollfd *p) /* {{{ */
     return (-1);
   }
 
-  buffer_size = recv (p->fd, buffer, sizeof (buffer), /* flags = */ 0);
-  if (buffer_size <= 0)
+#if HAVE_RECVMMSG
+  {
+    struct mmsghdr msgs[MC_RECEIVE_BATCH];
+    struct iovec iovs[MC_RECEIVE_BATCH];
+
+    memset (msgs, 0, sizeof (msgs));
+    for (i = 0; i < MC_RECEIVE_BATCH; i++)
+    {
+      iovs[i].iov_base = buffer[i];
+      iovs[i].iov_len = sizeof (buffer[i]);
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* poll(2) said there is at least one packet, so only the rest must not
+     * block. */
+    num = recvmmsg (p->fd, msgs, MC_RECEIVE_BATCH, MSG_DONTWAIT,
+        /* timeout = */ NULL);
+    for (i = 0; i < num; i++)
+      buffer_size[i] = (size_t) msgs[i].msg_len;
+  }
+#else
+  {
+    ssize_t status;
+
+    status = recv (p->fd, buffer[0], sizeof (buffer[0]), /* flags = */ 0);
+    num = (status > 0) ? 1 : -1;
+    if (num > 0)
+      buffer_size[0] = (size_t) status;
+  }
+#endif
+
+  if (num <= 0)
   {
     char errbuf[1024];
     ERROR ("gmond plugin: recv failed: %s",
@@ -806,7 +835,9 @@ static int mc_handle_socket (struct pollfd *p) /* {{{ */
     return (-1);
   }
 
-  mc_handle_metric (buffer, (size_t) buffer_size);
+  for (i = 0; i < num; i++)
+    mc_handle_metric (buffer[i], buffer_size[i]);
+
   return (0);
 } /* }}} int mc_handle_socket */
 
@@ -1082,10 +1113,16 @@ static int gmond_init (void) /* {{{ */
       (mc_receive_port != NULL) ? mc_receive_port : MC_RECEIVE_PORT_DEFAULT,
       /* listen = */ 0);
 
-  staging_tree = c_avl_create ((void *) strcmp);
-  if (staging_tree == NULL)
+  if (metric_table_create () != 0)
+  {
+    ERROR ("gmond plugin: Creating the metric table failed.");
+    return (-1);
+  }
+
+  staging_table = c_htable_create ();
+  if (staging_table == NULL)
   {
-    ERROR ("gmond plugin: c_avl_create failed.");
+    ERROR ("gmond plugin: c_htable_create failed.");
     return (-1);
   }
 
@@ -1110,6 +1147,22 @@ static int gmond_shutdown (void) /* {{{ */
   mc_send_sockets_num = 0;
   pthread_mutex_unlock (&mc_send_sockets_lock);
 
+  if (staging_table != NULL)
+  {
+    char *key;
+    staging_entry_t *se;
+
+    while (c_htable_pick (staging_table, (void *) &key, (void *) &se) == 0)
+    {
+      sfree (se->vl.values);
+      sfree (se);
+    }
+    c_htable_destroy (staging_table);
+    staging_table = NULL;
+  }
+
+  c_htable_destroy (metric_table);
+  metric_table = NULL;
 
   return (0);
 } /* }}} int gmond_shutdown */
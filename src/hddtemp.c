@@ -33,6 +33,7 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
+#include "utils_async.h"
 
 # include <netdb.h>
 # include <sys/socket.h>
@@ -59,49 +60,20 @@ static char hddtemp_port[16];
 
 /*
  * NAME
- *  hddtemp_query_daemon
+ *  hddtemp_connect
  *
  * DESCRIPTION
- * Connect to the hddtemp daemon and receive data.
- *
- * ARGUMENTS:
- *  `buffer'            The buffer where we put the received ascii string.
- *  `buffer_size'       Size of the buffer
- *
- * RETURN VALUE:
- *   >= 0 if ok, < 0 otherwise.
- *
- * NOTES:
- *  Example of possible strings, as received from daemon:
+ *  Starts connecting to the hddtemp daemon, which sends the temperatures and
+ *  closes the connection without being asked. Example of possible strings,
+ *  as received from the daemon:
  *    |/dev/hda|ST340014A|36|C|
  *    |/dev/hda|ST380011A|46|C||/dev/hdd|ST340016A|SLP|*|
- *
- * FIXME:
- *  we need to create a new socket each time. Is there another way?
- *  Hm, maybe we can re-use the `sockaddr' structure? -octo
  */
-static int hddtemp_query_daemon (char *buffer, int buffer_size)
+static int hddtemp_connect (user_data_t __attribute__((unused)) *ud)
 {
-	int fd;
-	ssize_t status;
-	int buffer_fill;
-
 	const char *host;
 	const char *port;
 
-	struct addrinfo  ai_hints;
-	struct addrinfo *ai_list, *ai_ptr;
-	int              ai_return;
-
-	memset (&ai_hints, '\0', sizeof (ai_hints));
-	ai_hints.ai_flags    = 0;
-#ifdef AI_ADDRCONFIG
-	ai_hints.ai_flags   |= AI_ADDRCONFIG;
-#endif
-	ai_hints.ai_family   = PF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_STREAM;
-	ai_hints.ai_protocol = IPPROTO_TCP;
-
 	host = hddtemp_host;
 	if (host == NULL)
 		host = HDDTEMP_DEF_HOST;
@@ -110,97 +82,7 @@ static int hddtemp_query_daemon (char *buffer, int buffer_size)
 	if (strlen (port) == 0)
 		port = HDDTEMP_DEF_PORT;
 
-	if ((ai_return = getaddrinfo (host, port, &ai_hints, &ai_list)) != 0)
-	{
-		char errbuf[1024];
-		ERROR ("hddtemp plugin: getaddrinfo (%s, %s): %s",
-				host, port,
-				(ai_return == EAI_SYSTEM)
-				? sstrerror (errno, errbuf, sizeof (errbuf))
-				: gai_strerror (ai_return));
-		return (-1);
-	}
-
-	fd = -1;
-	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
-	{
-		/* create our socket descriptor */
-		fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
-				ai_ptr->ai_protocol);
-		if (fd < 0)
-		{
-			char errbuf[1024];
-			ERROR ("hddtemp plugin: socket: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			continue;
-		}
-
-		/* connect to the hddtemp daemon */
-		if (connect (fd, (struct sockaddr *) ai_ptr->ai_addr,
-					ai_ptr->ai_addrlen))
-		{
-			char errbuf[1024];
-			INFO ("hddtemp plugin: connect (%s, %s) failed: %s",
-					host, port,
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (fd);
-			fd = -1;
-			continue;
-		}
-
-		/* A socket could be opened and connecting succeeded. We're
-		 * done. */
-		break;
-	}
-
-	freeaddrinfo (ai_list);
-
-	if (fd < 0)
-	{
-		ERROR ("hddtemp plugin: Could not connect to daemon.");
-		return (-1);
-	}
-
-	/* receive data from the hddtemp daemon */
-	memset (buffer, '\0', buffer_size);
-
-	buffer_fill = 0;
-	while ((status = read (fd, buffer + buffer_fill, buffer_size - buffer_fill)) != 0)
-	{
-		if (status == -1)
-		{
-			char errbuf[1024];
-
-			if ((errno == EAGAIN) || (errno == EINTR))
-				continue;
-
-			ERROR ("hddtemp plugin: Error reading from socket: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (fd);
-			return (-1);
-		}
-		buffer_fill += status;
-
-		if (buffer_fill >= buffer_size)
-			break;
-	}
-
-	if (buffer_fill >= buffer_size)
-	{
-		buffer[buffer_size - 1] = '\0';
-		WARNING ("hddtemp plugin: Message from hddtemp has been "
-				"truncated.");
-	}
-	else if (buffer_fill == 0)
-	{
-		WARNING ("hddtemp plugin: Peer has unexpectedly shut down "
-				"the socket. Buffer: `%s'", buffer);
-		close (fd);
-		return (-1);
-	}
-
-	close (fd);
-	return (0);
+	return (uas_connect ("hddtemp plugin", host, port, SOCK_STREAM));
 }
 
 static int hddtemp_config (const char *key, const char *value)
@@ -245,7 +127,8 @@ static void hddtemp_submit (char *type_instance, double value)
 	plugin_dispatch_values (&vl);
 }
 
-static int hddtemp_read (void)
+static int hddtemp_parse (const char *response, size_t response_len,
+		_Bool eof, user_data_t __attribute__((unused)) *ud)
 {
 	char buf[1024];
 	char *fields[128];
@@ -255,9 +138,21 @@ static int hddtemp_read (void)
 	int num_disks;
 	int i;
 
-	/* get data from daemon */
-	if (hddtemp_query_daemon (buf, sizeof (buf)) < 0)
+	if (!eof)
+		return (EAGAIN);
+
+	if (response_len == 0)
+	{
+		WARNING ("hddtemp plugin: Peer has unexpectedly shut down "
+				"the socket.");
 		return (-1);
+	}
+	else if (response_len >= sizeof (buf))
+	{
+		WARNING ("hddtemp plugin: Message from hddtemp has been "
+				"truncated.");
+	}
+	sstrncpy (buf, response, sizeof (buf));
 
 	/* NB: strtok_r will eat up "||" and leading "|"'s */
 	num_fields = 0;
@@ -297,13 +192,20 @@ static int hddtemp_read (void)
 	}
 	
 	return (0);
-} /* int hddtemp_read */
+} /* int hddtemp_parse */
 
 /* module_register
    Register collectd plugin. */
 void module_register (void)
 {
+	plugin_async_read_t cb;
+
+	memset (&cb, 0, sizeof (cb));
+	cb.connect = hddtemp_connect;
+	cb.parse = hddtemp_parse;
+
 	plugin_register_config ("hddtemp", hddtemp_config,
 			config_keys, config_keys_num);
-	plugin_register_read ("hddtemp", hddtemp_read);
+	plugin_register_async_read (/* group = */ NULL, "hddtemp", &cb,
+			/* interval = */ NULL, /* user_data = */ NULL);
 }
@@ -58,6 +58,19 @@
 # include <libperfstat.h>
 #endif
 
+/* With "UseNetlink", the counters of all interfaces are read with a single
+ * RTM_GETLINK dump instead of parsing /proc/net/dev or calling getifaddrs(),
+ * which is much cheaper on hosts with thousands of interfaces and always
+ * yields 64 bit counters. */
+#if KERNEL_LINUX && HAVE_LINUX_RTNETLINK_H && HAVE_DECL_IFLA_STATS64
+# define IF_HAVE_NETLINK 1
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+# include "utils_avltree.h"
+#else
+# define IF_HAVE_NETLINK 0
+#endif
+
 /*
  * Various people have reported problems with `getifaddrs' and varying versions
  * of `glibc'. That's why it's disabled by default. Since more statistics are
@@ -87,9 +100,10 @@ static const char *config_keys[] =
 {
 	"Interface",
 	"IgnoreSelected",
+	"UseNetlink",
 	NULL
 };
-static int config_keys_num = 2;
+static int config_keys_num = 3;
 
 static ignorelist_t *ignorelist = NULL;
 
@@ -100,6 +114,34 @@ static kstat_t *ksp[MAX_NUMIF];
 static int numif = 0;
 #endif /* HAVE_LIBKSTAT */
 
+#if !HAVE_GETIFADDRS && KERNEL_LINUX
+static pread_file_t *pf_net_dev = NULL;
+#endif
+
+#if IF_HAVE_NETLINK
+/* Large enough for any message of a dump, see NLMSG_GOODSIZE. */
+# define IF_NETLINK_BUFFER_SIZE 65536
+
+/* The verdict of the ignorelist for an interface index. It is only
+ * evaluated again if the interface has been renamed. */
+struct if_netlink_entry_s
+{
+	int ifindex;
+	char name[DATA_MAX_NAME_LEN];
+	_Bool ignored;
+	/* Value of "nl_generation" when the interface was last seen. */
+	uint64_t seen;
+};
+typedef struct if_netlink_entry_s if_netlink_entry_t;
+
+static _Bool use_netlink = 0;
+static int nl_fd = -1;
+static uint32_t nl_seq = 0;
+static char *nl_buffer = NULL;
+static c_avl_tree_t *nl_index = NULL;
+static uint64_t nl_generation = 0;
+#endif /* IF_HAVE_NETLINK */
+
 static int interface_config (const char *key, const char *value)
 {
 	if (ignorelist == NULL)
@@ -116,6 +158,15 @@ static int interface_config (const char *key, const char *value)
 			invert = 0;
 		ignorelist_set_invert (ignorelist, invert);
 	}
+	else if (strcasecmp (key, "UseNetlink") == 0)
+	{
+#if IF_HAVE_NETLINK
+		use_netlink = IS_TRUE (value) ? 1 : 0;
+#else
+		WARNING ("interface plugin: The `UseNetlink' option is not "
+				"supported on this system.");
+#endif
+	}
 	else
 	{
 		return (-1);
@@ -154,6 +205,312 @@ static int interface_init (void)
 } /* int interface_init */
 #endif /* HAVE_LIBKSTAT */
 
+#if IF_HAVE_NETLINK
+static int if_netlink_compare (const void *a, const void *b)
+{
+	int ifindex_a = *((const int *) a);
+	int ifindex_b = *((const int *) b);
+
+	if (ifindex_a < ifindex_b)
+		return (-1);
+	else if (ifindex_a > ifindex_b)
+		return (1);
+	return (0);
+} /* int if_netlink_compare */
+
+static void if_netlink_close (void)
+{
+	if (nl_fd >= 0)
+		close (nl_fd);
+	nl_fd = -1;
+} /* void if_netlink_close */
+
+static int if_netlink_open (void)
+{
+	struct sockaddr_nl sa;
+	struct timeval tv;
+
+	if (nl_buffer == NULL)
+	{
+		nl_buffer = malloc (IF_NETLINK_BUFFER_SIZE);
+		if (nl_buffer == NULL)
+		{
+			ERROR ("interface plugin: malloc failed.");
+			return (-1);
+		}
+	}
+
+	if (nl_index == NULL)
+	{
+		nl_index = c_avl_create (if_netlink_compare);
+		if (nl_index == NULL)
+		{
+			ERROR ("interface plugin: c_avl_create failed.");
+			return (-1);
+		}
+	}
+
+	nl_fd = socket (AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (nl_fd < 0)
+	{
+		char errbuf[1024];
+		ERROR ("interface plugin: Opening a netlink socket failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind (nl_fd, (struct sockaddr *) &sa, sizeof (sa)) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("interface plugin: Binding the netlink socket failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		if_netlink_close ();
+		return (-1);
+	}
+
+	/* Don't block the read thread forever if the kernel never finishes
+	 * the dump. */
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt (nl_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	return (0);
+} /* int if_netlink_open */
+
+/* Returns true if the interface "name" is to be ignored. */
+static _Bool if_netlink_ignored (int ifindex, const char *name)
+{
+	if_netlink_entry_t *e;
+
+	if (c_avl_get (nl_index, &ifindex, (void *) &e) != 0)
+	{
+		e = calloc (1, sizeof (*e));
+		if (e == NULL)
+			return (ignorelist_match (ignorelist, name) != 0);
+		e->ifindex = ifindex;
+
+		if (c_avl_insert (nl_index, &e->ifindex, e) != 0)
+		{
+			sfree (e);
+			return (ignorelist_match (ignorelist, name) != 0);
+		}
+	}
+
+	e->seen = nl_generation;
+	if ((e->name[0] == 0) || (strncmp (e->name, name, sizeof (e->name)) != 0))
+	{
+		sstrncpy (e->name, name, sizeof (e->name));
+		e->ignored = (ignorelist_match (ignorelist, name) != 0);
+	}
+
+	return (e->ignored);
+} /* _Bool if_netlink_ignored */
+
+/* Forgets the interfaces which were not part of the last dump. */
+static void if_netlink_prune (size_t seen)
+{
+	c_avl_iterator_t *iter;
+	if_netlink_entry_t *e;
+	int *stale;
+	size_t stale_num = 0;
+	size_t i;
+	void *key;
+
+	if ((size_t) c_avl_size (nl_index) <= seen)
+		return;
+
+	stale = calloc ((size_t) c_avl_size (nl_index), sizeof (*stale));
+	if (stale == NULL)
+		return;
+
+	iter = c_avl_get_iterator (nl_index);
+	while (c_avl_iterator_next (iter, &key, (void *) &e) == 0)
+		if (e->seen != nl_generation)
+			stale[stale_num++] = e->ifindex;
+	c_avl_iterator_destroy (iter);
+
+	for (i = 0; i < stale_num; i++)
+		if (c_avl_remove (nl_index, stale + i, &key, (void *) &e) == 0)
+			sfree (e);
+
+	sfree (stale);
+} /* void if_netlink_prune */
+
+static void if_netlink_submit (const char *dev,
+		const struct rtnl_link_stats64 *stats)
+{
+	value_t values[3][2];
+	plugin_value_entry_t entries[3];
+	value_list_t vl = VALUE_LIST_INIT;
+
+	values[0][0].derive = (derive_t) stats->rx_bytes;
+	values[0][1].derive = (derive_t) stats->tx_bytes;
+	values[1][0].derive = (derive_t) stats->rx_packets;
+	values[1][1].derive = (derive_t) stats->tx_packets;
+	values[2][0].derive = (derive_t) stats->rx_errors;
+	values[2][1].derive = (derive_t) stats->tx_errors;
+
+	entries[0].type = "if_octets";
+	entries[1].type = "if_packets";
+	entries[2].type = "if_errors";
+	entries[0].type_instance = NULL;
+	entries[1].type_instance = NULL;
+	entries[2].type_instance = NULL;
+	entries[0].values = values[0];
+	entries[1].values = values[1];
+	entries[2].values = values[2];
+	entries[0].values_len = 2;
+	entries[1].values_len = 2;
+	entries[2].values_len = 2;
+
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "interface", sizeof (vl.plugin));
+	sstrncpy (vl.plugin_instance, dev, sizeof (vl.plugin_instance));
+
+	plugin_dispatch_values_multi (&vl, entries, STATIC_ARRAY_SIZE (entries));
+} /* void if_netlink_submit */
+
+/* Handles one RTM_NEWLINK message of the dump. */
+static void if_netlink_link (const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifm = NLMSG_DATA (nlh);
+	const struct rtattr *rta;
+	struct rtnl_link_stats64 stats;
+	const char *name = NULL;
+	_Bool have_stats = 0;
+	int len;
+
+	len = (int) nlh->nlmsg_len - (int) NLMSG_LENGTH (sizeof (*ifm));
+	if (len < 0)
+		return;
+
+	memset (&stats, 0, sizeof (stats));
+	for (rta = (const struct rtattr *) (((const char *) ifm)
+				+ NLMSG_ALIGN (sizeof (*ifm)));
+			RTA_OK (rta, len);
+			rta = RTA_NEXT (rta, len))
+	{
+		size_t size = RTA_PAYLOAD (rta);
+
+		if (rta->rta_type == IFLA_IFNAME)
+		{
+			/* Make sure the name is terminated. */
+			if ((size > 0) && (((const char *) RTA_DATA (rta))[size - 1] == 0))
+				name = RTA_DATA (rta);
+		}
+		else if (rta->rta_type == IFLA_STATS64)
+		{
+			/* The attribute isn't 8-byte aligned and may be shorter
+			 * than the struct of newer headers. */
+			if (size > sizeof (stats))
+				size = sizeof (stats);
+			if (size >= 6 * sizeof (uint64_t))
+			{
+				memcpy (&stats, RTA_DATA (rta), size);
+				have_stats = 1;
+			}
+		}
+	}
+
+	if ((name == NULL) || !have_stats)
+		return;
+
+	if (if_netlink_ignored (ifm->ifi_index, name))
+		return;
+
+	if_netlink_submit (name, &stats);
+} /* void if_netlink_link */
+
+static int if_netlink_read (void)
+{
+	struct
+	{
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifm;
+	} req;
+	size_t seen = 0;
+	_Bool done = 0;
+
+	if ((nl_fd < 0) && (if_netlink_open () != 0))
+		return (-1);
+
+	memset (&req, 0, sizeof (req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH (sizeof (req.ifm));
+	req.nlh.nlmsg_type = RTM_GETLINK;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++nl_seq;
+	req.ifm.ifi_family = AF_UNSPEC;
+
+	if (send (nl_fd, &req, req.nlh.nlmsg_len, 0) < 0)
+	{
+		char errbuf[1024];
+		ERROR ("interface plugin: Sending the RTM_GETLINK request "
+				"failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		if_netlink_close ();
+		return (-1);
+	}
+
+	nl_generation++;
+
+	while (!done)
+	{
+		const struct nlmsghdr *nlh;
+		ssize_t status;
+		int len;
+
+		/* With MSG_TRUNC, the real size of a message which didn't fit
+		 * is returned. */
+		status = recv (nl_fd, nl_buffer, IF_NETLINK_BUFFER_SIZE, MSG_TRUNC);
+		if ((status < 0) && (errno == EINTR))
+			continue;
+		if ((status <= 0) || (status > IF_NETLINK_BUFFER_SIZE))
+		{
+			char errbuf[1024];
+			ERROR ("interface plugin: Receiving the RTM_GETLINK dump "
+					"failed: %s", (status <= 0)
+					? sstrerror (errno, errbuf, sizeof (errbuf))
+					: "Message truncated");
+			/* The rest of the dump would confuse the next read. */
+			if_netlink_close ();
+			return (-1);
+		}
+
+		len = (int) status;
+		for (nlh = (const struct nlmsghdr *) nl_buffer;
+				NLMSG_OK (nlh, len);
+				nlh = NLMSG_NEXT (nlh, len))
+		{
+			if (nlh->nlmsg_seq != nl_seq)
+				continue;
+
+			if (nlh->nlmsg_type == NLMSG_DONE)
+			{
+				done = 1;
+				break;
+			}
+			else if (nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				ERROR ("interface plugin: The kernel rejected the "
+						"RTM_GETLINK request.");
+				if_netlink_close ();
+				return (-1);
+			}
+			else if (nlh->nlmsg_type == RTM_NEWLINK)
+			{
+				if_netlink_link (nlh);
+				seen++;
+			}
+		}
+	}
+
+	if_netlink_prune (seen);
+	return (0);
+} /* int if_netlink_read */
+#endif /* IF_HAVE_NETLINK */
+
 static void if_submit (const char *dev, const char *type,
 		derive_t rx,
 		derive_t tx)
@@ -177,7 +534,8 @@ static void if_submit (const char *dev, const char *type,
 	plugin_dispatch_values (&vl);
 } /* void if_submit */
 
-static int interface_read (void)
+/* Reads the counters with whatever method this system supports. */
+static int if_read_system (void)
 {
 #if HAVE_GETIFADDRS
 	struct ifaddrs *if_list;
@@ -231,8 +589,9 @@ static int interface_read (void)
 /* #endif HAVE_GETIFADDRS */
 
 #elif KERNEL_LINUX
-	FILE *fh;
-	char buffer[1024];
+	char *buffer;
+	char *ptr;
+	char *line;
 	derive_t incoming, outgoing;
 	char *device;
 
@@ -240,29 +599,33 @@ static int interface_read (void)
 	char *fields[16];
 	int numfields;
 
-	if ((fh = fopen ("/proc/net/dev", "r")) == NULL)
+	if (pf_net_dev == NULL)
+		pf_net_dev = pread_file_create ("/proc/net/dev");
+
+	if ((buffer = pread_file_read (pf_net_dev, NULL)) == NULL)
 	{
 		char errbuf[1024];
-		WARNING ("interface plugin: fopen: %s",
+		WARNING ("interface plugin: Reading /proc/net/dev failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
-	while (fgets (buffer, 1024, fh) != NULL)
+	ptr = buffer;
+	while ((line = strline (&ptr)) != NULL)
 	{
-		if (!(dummy = strchr(buffer, ':')))
+		if (!(dummy = strchr(line, ':')))
 			continue;
 		dummy[0] = '\0';
 		dummy++;
 
-		device = buffer;
+		device = line;
 		while (device[0] == ' ')
 			device++;
 
 		if (device[0] == '\0')
 			continue;
 
-		numfields = strsplit (dummy, fields, 16);
+		numfields = strsplit_line (&dummy, fields, 16);
 
 		if (numfields < 11)
 			continue;
@@ -279,8 +642,6 @@ static int interface_read (void)
 		outgoing = atoll (fields[10]);
 		if_submit (device, "if_errors", incoming, outgoing);
 	}
-
-	fclose (fh);
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKSTAT
@@ -374,8 +735,44 @@ static int interface_read (void)
 #endif /* HAVE_PERFSTAT */
 
 	return (0);
+} /* int if_read_system */
+
+static int interface_read (void)
+{
+#if IF_HAVE_NETLINK
+	if (use_netlink)
+		return (if_netlink_read ());
+#endif
+	return (if_read_system ());
 } /* int interface_read */
 
+#if (!HAVE_GETIFADDRS && KERNEL_LINUX) || IF_HAVE_NETLINK
+static int interface_shutdown (void)
+{
+#if !HAVE_GETIFADDRS && KERNEL_LINUX
+	pread_file_destroy (pf_net_dev);
+	pf_net_dev = NULL;
+#endif
+
+#if IF_HAVE_NETLINK
+	if_netlink_close ();
+	sfree (nl_buffer);
+	if (nl_index != NULL)
+	{
+		void *key;
+		void *value;
+
+		while (c_avl_pick (nl_index, &key, &value) == 0)
+			sfree (value);
+		c_avl_destroy (nl_index);
+		nl_index = NULL;
+	}
+#endif
+
+	return (0);
+} /* int interface_shutdown */
+#endif
+
 void module_register (void)
 {
 	plugin_register_config ("interface", interface_config,
@@ -384,4 +781,7 @@ void module_register (void)
 	plugin_register_init ("interface", interface_init);
 #endif
 	plugin_register_read ("interface", interface_read);
+#if (!HAVE_GETIFADDRS && KERNEL_LINUX) || IF_HAVE_NETLINK
+	plugin_register_shutdown ("interface", interface_shutdown);
+#endif
 } /* void module_register */
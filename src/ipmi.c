@@ -48,6 +48,11 @@ struct c_ipmi_sensor_list_s
   char sensor_name[DATA_MAX_NAME_LEN];
   char sensor_type[DATA_MAX_NAME_LEN];
   int sensor_not_present;
+  /* A reading has been requested by c_ipmi_read but not yet been sent. */
+  _Bool read_requested;
+  /* A reading has been sent and its handler hasn't been called yet. */
+  _Bool read_pending;
+  cdtime_t read_time;
   c_ipmi_sensor_list_t *next;
 };
 
@@ -56,6 +61,9 @@ struct c_ipmi_sensor_list_s
  */
 static pthread_mutex_t sensor_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static c_ipmi_sensor_list_t *sensor_list = NULL;
+/* Number of readings sent to the BMC which haven't completed. */
+static int sensor_reads_pending = 0;
+static int c_ipmi_max_pending = 8;
 
 static int c_ipmi_init_in_progress = 0;
 static int c_ipmi_active = 0;
@@ -67,7 +75,8 @@ static const char *config_keys[] =
 	"IgnoreSelected",
 	"NotifySensorAdd",
 	"NotifySensorRemove",
-	"NotifySensorNotPresent"
+	"NotifySensorNotPresent",
+	"MaxPendingReads"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -110,29 +119,155 @@ static void c_ipmi_error (const char *func, int status)
 /* Prototype for sensor_list_remove, so sensor_read_handler can call it. */
 static int sensor_list_remove (ipmi_sensor_t *sensor);
 
+/* Looks up the list entry of `sensor_id'. Must be called with
+ * `sensor_list_lock' held. */
+static c_ipmi_sensor_list_t *sensor_list_lookup (ipmi_sensor_id_t sensor_id)
+{
+  c_ipmi_sensor_list_t *list_item;
+
+  for (list_item = sensor_list;
+      list_item != NULL;
+      list_item = list_item->next)
+    if (ipmi_cmp_sensor_id (sensor_id, list_item->sensor_id) == 0)
+      return (list_item);
+
+  return (NULL);
+} /* c_ipmi_sensor_list_t *sensor_list_lookup */
+
 static void sensor_read_handler (ipmi_sensor_t *sensor,
     int err,
     enum ipmi_value_present_e value_present,
     unsigned int __attribute__((unused)) raw_value,
     double value,
     ipmi_states_t __attribute__((unused)) *states,
-    void *user_data)
+    void __attribute__((unused)) *user_data);
+
+/* Sends the requested readings, keeping at most `c_ipmi_max_pending' of them
+ * outstanding. The OpenIPMI functions are called without holding
+ * `sensor_list_lock', because the handlers may run in another thread and need
+ * that lock while OpenIPMI holds its own locks. */
+static void sensor_list_read_next (void)
+{
+  ipmi_sensor_id_t sensor_ids[16];
+  c_ipmi_sensor_list_t *list_item;
+  cdtime_t now;
+  int sensor_ids_num;
+  int status;
+  int i;
+
+  while (42)
+  {
+    now = cdtime ();
+    sensor_ids_num = 0;
+
+    pthread_mutex_lock (&sensor_list_lock);
+    for (list_item = sensor_list;
+        list_item != NULL;
+        list_item = list_item->next)
+    {
+      if ((sensor_reads_pending >= c_ipmi_max_pending)
+          || (sensor_ids_num >= (int) STATIC_ARRAY_SIZE (sensor_ids)))
+        break;
+
+      if (!list_item->read_requested)
+        continue;
+
+      list_item->read_requested = 0;
+      list_item->read_pending = 1;
+      list_item->read_time = now;
+      sensor_reads_pending++;
+
+      sensor_ids[sensor_ids_num] = list_item->sensor_id;
+      sensor_ids_num++;
+    }
+    pthread_mutex_unlock (&sensor_list_lock);
+
+    if (sensor_ids_num == 0)
+      break;
+
+    for (i = 0; i < sensor_ids_num; i++)
+    {
+      status = ipmi_sensor_id_get_reading (sensor_ids[i],
+          sensor_read_handler, /* user data = */ NULL);
+      if (status == 0)
+        continue;
+
+      c_ipmi_error ("ipmi_sensor_id_get_reading", status);
+
+      pthread_mutex_lock (&sensor_list_lock);
+      list_item = sensor_list_lookup (sensor_ids[i]);
+      if ((list_item != NULL) && list_item->read_pending)
+      {
+        list_item->read_pending = 0;
+        sensor_reads_pending--;
+      }
+      pthread_mutex_unlock (&sensor_list_lock);
+    }
+  } /* while (42) */
+} /* void sensor_list_read_next */
+
+static void sensor_read_handler (ipmi_sensor_t *sensor,
+    int err,
+    enum ipmi_value_present_e value_present,
+    unsigned int __attribute__((unused)) raw_value,
+    double value,
+    ipmi_states_t __attribute__((unused)) *states,
+    void __attribute__((unused)) *user_data)
 {
   value_t values[1];
   value_list_t vl = VALUE_LIST_INIT;
 
-  c_ipmi_sensor_list_t *list_item = (c_ipmi_sensor_list_t *)user_data;
+  c_ipmi_sensor_list_t *list_item;
+  char sensor_name[DATA_MAX_NAME_LEN];
+  char sensor_type[DATA_MAX_NAME_LEN];
+  int not_present_changed = 0;
+
+  /* The list entry may be removed while the reading is pending, so it is
+   * looked up again rather than passed as user data. */
+  pthread_mutex_lock (&sensor_list_lock);
+  list_item = sensor_list_lookup (ipmi_sensor_convert_to_id (sensor));
+  if (list_item == NULL)
+  {
+    pthread_mutex_unlock (&sensor_list_lock);
+    sensor_list_read_next ();
+    return;
+  }
+
+  if (list_item->read_pending)
+  {
+    list_item->read_pending = 0;
+    sensor_reads_pending--;
+  }
+
+  if ((err != 0) && ((err & 0xff) == IPMI_NOT_PRESENT_CC))
+  {
+    if (list_item->sensor_not_present == 0)
+    {
+      list_item->sensor_not_present = 1;
+      not_present_changed = 1;
+    }
+  }
+  else if ((err == 0) && (list_item->sensor_not_present == 1))
+  {
+    list_item->sensor_not_present = 0;
+    not_present_changed = 1;
+  }
+
+  sstrncpy (sensor_name, list_item->sensor_name, sizeof (sensor_name));
+  sstrncpy (sensor_type, list_item->sensor_type, sizeof (sensor_type));
+  pthread_mutex_unlock (&sensor_list_lock);
+
+  /* Keep the BMC busy while this reading is being handled. */
+  sensor_list_read_next ();
 
   if (err != 0)
   {
     if ((err & 0xff) == IPMI_NOT_PRESENT_CC)
     {
-      if (list_item->sensor_not_present == 0)
+      if (not_present_changed)
       {
-        list_item->sensor_not_present = 1;
-
         INFO ("ipmi plugin: sensor_read_handler: sensor %s "
-            "not present.", list_item->sensor_name);
+            "not present.", sensor_name);
 
         if (c_ipmi_nofiy_notpresent)
         {
@@ -140,11 +275,11 @@ static void sensor_read_handler (ipmi_sensor_t *sensor,
             "", "", "", NULL };
 
           sstrncpy (n.host, hostname_g, sizeof (n.host));
-          sstrncpy (n.type_instance, list_item->sensor_name,
+          sstrncpy (n.type_instance, sensor_name,
               sizeof (n.type_instance));
-          sstrncpy (n.type, list_item->sensor_type, sizeof (n.type));
+          sstrncpy (n.type, sensor_type, sizeof (n.type));
           ssnprintf (n.message, sizeof (n.message),
-              "sensor %s not present", list_item->sensor_name);
+              "sensor %s not present", sensor_name);
 
           plugin_dispatch_notification (&n);
         }
@@ -153,40 +288,38 @@ static void sensor_read_handler (ipmi_sensor_t *sensor,
     else if (IPMI_IS_IPMI_ERR(err) && IPMI_GET_IPMI_ERR(err) == IPMI_NOT_SUPPORTED_IN_PRESENT_STATE_CC)
     {
       INFO ("ipmi plugin: sensor_read_handler: Sensor %s not ready",
-          list_item->sensor_name);
+          sensor_name);
     }
     else
     {
       if (IPMI_IS_IPMI_ERR(err))
         INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
             "because it failed with IPMI error %#x.",
-            list_item->sensor_name, IPMI_GET_IPMI_ERR(err));
+            sensor_name, IPMI_GET_IPMI_ERR(err));
       else if (IPMI_IS_OS_ERR(err))
         INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
             "because it failed with OS error %#x.",
-            list_item->sensor_name, IPMI_GET_OS_ERR(err));
+            sensor_name, IPMI_GET_OS_ERR(err));
       else if (IPMI_IS_RMCPP_ERR(err))
         INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
             "because it failed with RMCPP error %#x.",
-            list_item->sensor_name, IPMI_GET_RMCPP_ERR(err));
+            sensor_name, IPMI_GET_RMCPP_ERR(err));
       else if (IPMI_IS_SOL_ERR(err))
         INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
             "because it failed with RMCPP error %#x.",
-            list_item->sensor_name, IPMI_GET_SOL_ERR(err));
+            sensor_name, IPMI_GET_SOL_ERR(err));
       else
         INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
             "because it failed with error %#x. of class %#x",
-            list_item->sensor_name, err & 0xff, err & 0xffffff00);
+            sensor_name, err & 0xff, err & 0xffffff00);
       sensor_list_remove (sensor);
     }
     return;
   }
-  else if (list_item->sensor_not_present == 1)
+  else if (not_present_changed)
   {
-    list_item->sensor_not_present = 0;
-
     INFO ("ipmi plugin: sensor_read_handler: sensor %s present.",
-        list_item->sensor_name);
+        sensor_name);
 
     if (c_ipmi_nofiy_notpresent)
     {
@@ -194,11 +327,11 @@ static void sensor_read_handler (ipmi_sensor_t *sensor,
         "", "", "", NULL };
 
       sstrncpy (n.host, hostname_g, sizeof (n.host));
-      sstrncpy (n.type_instance, list_item->sensor_name,
+      sstrncpy (n.type_instance, sensor_name,
           sizeof (n.type_instance));
-      sstrncpy (n.type, list_item->sensor_type, sizeof (n.type));
+      sstrncpy (n.type, sensor_type, sizeof (n.type));
       ssnprintf (n.message, sizeof (n.message),
-          "sensor %s present", list_item->sensor_name);
+          "sensor %s present", sensor_name);
 
       plugin_dispatch_notification (&n);
     }
@@ -209,7 +342,7 @@ static void sensor_read_handler (ipmi_sensor_t *sensor,
     INFO ("ipmi plugin: sensor_read_handler: Removing sensor %s, "
         "because it provides %s. If you need this sensor, "
         "please file a bug report.",
-        list_item->sensor_name,
+        sensor_name,
         (value_present == IPMI_RAW_VALUE_PRESENT)
         ? "only the raw value"
         : "no value");
@@ -224,8 +357,8 @@ static void sensor_read_handler (ipmi_sensor_t *sensor,
 
   sstrncpy (vl.host, hostname_g, sizeof (vl.host));
   sstrncpy (vl.plugin, "ipmi", sizeof (vl.plugin));
-  sstrncpy (vl.type, list_item->sensor_type, sizeof (vl.type));
-  sstrncpy (vl.type_instance, list_item->sensor_name, sizeof (vl.type_instance));
+  sstrncpy (vl.type, sensor_type, sizeof (vl.type));
+  sstrncpy (vl.type_instance, sensor_name, sizeof (vl.type_instance));
 
   plugin_dispatch_values (&vl);
 } /* void sensor_read_handler */
@@ -410,6 +543,9 @@ static int sensor_list_remove (ipmi_sensor_t *sensor)
   else
     list_prev->next = list_item->next;
 
+  if (list_item->read_pending)
+    sensor_reads_pending--;
+
   list_prev = NULL;
   list_item->next = NULL;
 
@@ -434,9 +570,13 @@ static int sensor_list_remove (ipmi_sensor_t *sensor)
   return (0);
 } /* int sensor_list_remove */
 
+/* Requests a reading of all sensors. Returns without waiting for them; the
+ * values are dispatched by sensor_read_handler as the readings complete. */
 static int sensor_list_read_all (void)
 {
   c_ipmi_sensor_list_t *list_item;
+  cdtime_t now = cdtime ();
+  cdtime_t timeout = 3 * plugin_get_interval ();
 
   pthread_mutex_lock (&sensor_list_lock);
 
@@ -444,12 +584,32 @@ static int sensor_list_read_all (void)
       list_item != NULL;
       list_item = list_item->next)
   {
-    ipmi_sensor_id_get_reading (list_item->sensor_id,
-        sensor_read_handler, /* user data = */ list_item);
+    /* The last reading hasn't completed yet. Don't queue another one, so a
+     * slow sensor shows up as missing values instead of piling up requests.
+     * OpenIPMI reports a timeout eventually; if it doesn't, give up on the
+     * reading after a few intervals. */
+    if (list_item->read_pending)
+    {
+      if ((now - list_item->read_time) < timeout)
+      {
+        DEBUG ("ipmi plugin: sensor_list_read_all: Reading sensor %s "
+            "is still in progress.", list_item->sensor_name);
+        continue;
+      }
+
+      WARNING ("ipmi plugin: Reading sensor %s timed out.",
+          list_item->sensor_name);
+      list_item->read_pending = 0;
+      sensor_reads_pending--;
+    }
+
+    list_item->read_requested = 1;
   } /* for (list_item) */
 
   pthread_mutex_unlock (&sensor_list_lock);
 
+  sensor_list_read_next ();
+
   return (0);
 } /* int sensor_list_read_all */
 
@@ -461,6 +621,7 @@ static int sensor_list_remove_all (void)
 
   list_item = sensor_list;
   sensor_list = NULL;
+  sensor_reads_pending = 0;
 
   pthread_mutex_unlock (&sensor_list_lock);
 
@@ -552,7 +713,8 @@ static void domain_connection_change_handler (ipmi_domain_t *domain,
 static int thread_init (os_handler_t **ret_os_handler)
 {
   os_handler_t *os_handler;
-  ipmi_open_option_t open_option[1];
+  ipmi_open_option_t open_option[2];
+  int open_option_num = 0;
   ipmi_con_t *smi_connection = NULL;
   ipmi_domain_id_t domain_id;
   int status;
@@ -577,13 +739,21 @@ static int thread_init (os_handler_t **ret_os_handler)
   }
 
   memset (open_option, 0, sizeof (open_option));
-  open_option[0].option = IPMI_OPEN_OPTION_ALL;
-  open_option[0].ival = 1;
+  open_option[open_option_num].option = IPMI_OPEN_OPTION_ALL;
+  open_option[open_option_num].ival = 1;
+  open_option_num++;
+#ifdef IPMI_OPEN_OPTION_USE_CACHE
+  /* Read the SDRs from OpenIPMI's local cache instead of fetching the whole
+   * repository from the BMC again. */
+  open_option[open_option_num].option = IPMI_OPEN_OPTION_USE_CACHE;
+  open_option[open_option_num].ival = 1;
+  open_option_num++;
+#endif
 
   status = ipmi_open_domain ("mydomain", &smi_connection, /* num_con = */ 1,
       domain_connection_change_handler, /* user data = */ NULL,
       /* domain_fully_up_handler = */ NULL, /* user data = */ NULL,
-      open_option, sizeof (open_option) / sizeof (open_option[0]),
+      open_option, open_option_num,
       &domain_id);
   if (status != 0)
   {
@@ -651,6 +821,16 @@ static int c_ipmi_config (const char *key, const char *value)
     if (IS_TRUE (value))
       c_ipmi_nofiy_notpresent = 1;
   }
+  else if (strcasecmp ("MaxPendingReads", key) == 0)
+  {
+    int tmp = atoi (value);
+    if (tmp < 1)
+    {
+      WARNING ("ipmi plugin: `MaxPendingReads' must be at least one.");
+      return (1);
+    }
+    c_ipmi_max_pending = tmp;
+  }
   else
   {
     return (-1);
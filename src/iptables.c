@@ -424,71 +424,109 @@ static void submit_chain( iptc_handle_t *handle, ip_chain_t *chain )
 }
 
 
-static int iptables_read (void)
+/* Orders the chains by protocol and table, so that all chains of a table can
+ * be read from one copy of it. */
+static int iptables_chain_compare (const void *a, const void *b)
 {
-    int i;
-    int num_failures = 0;
-    ip_chain_t *chain;
+    const ip_chain_t *c0 = *((ip_chain_t * const *) a);
+    const ip_chain_t *c1 = *((ip_chain_t * const *) b);
 
-    /* Init the iptc handle structure and query the correct table */    
-    for (i = 0; i < chain_num; i++)
-    {
-	chain = chain_list[i];
-	
-	if (!chain)
-	{
-	    DEBUG ("iptables plugin: chain == NULL");
-	    continue;
-	}
+    if (c0->ip_version != c1->ip_version)
+	return ((c0->ip_version < c1->ip_version) ? -1 : 1);
 
-	if ( chain->ip_version == IPV4 )
-        {
+    return (strcmp (c0->table, c1->table));
+} /* int iptables_chain_compare */
+
+static int iptables_init (void)
+{
+    if (chain_num > 1)
+	qsort (chain_list, (size_t) chain_num, sizeof (*chain_list),
+		iptables_chain_compare);
+
+    return (0);
+} /* int iptables_init */
+
+/* Reads the chains chain_list[first] .. chain_list[last - 1], which are all
+ * in the same table, from a single snapshot of that table. Returns the number
+ * of chains which could not be read. */
+static int iptables_read_table (int first, int last)
+{
+    int i;
 #ifdef HAVE_IPTC_HANDLE_T
-		iptc_handle_t _handle;
-		iptc_handle_t *handle = &_handle;
+    iptc_handle_t _handle;
+    iptc_handle_t *handle = &_handle;
 
-		*handle = iptc_init (chain->table);
+    *handle = iptc_init (chain_list[first]->table);
 #else
-		iptc_handle_t *handle;
-                handle = iptc_init (chain->table);
+    iptc_handle_t *handle;
+    handle = iptc_init (chain_list[first]->table);
 #endif
 
-                if (!handle)
-                {
-                        ERROR ("iptables plugin: iptc_init (%s) failed: %s",
-                                chain->table, iptc_strerror (errno));
-                        num_failures++;
-                        continue;
-                }
+    if (!handle)
+    {
+	ERROR ("iptables plugin: iptc_init (%s) failed: %s",
+		chain_list[first]->table, iptc_strerror (errno));
+	return (last - first);
+    }
 
-                submit_chain (handle, chain);
-                iptc_free (handle);
-        }
-        else if ( chain->ip_version == IPV6 )
-        {
+    /* libiptc indexes the chains of the snapshot, so looking up each chain
+     * is cheap compared to copying the table from the kernel. */
+    for (i = first; i < last; i++)
+	submit_chain (handle, chain_list[i]);
+
+    iptc_free (handle);
+    return (0);
+} /* int iptables_read_table */
+
+static int ip6tables_read_table (int first, int last)
+{
+    int i;
 #ifdef HAVE_IP6TC_HANDLE_T
-		ip6tc_handle_t _handle;
-		ip6tc_handle_t *handle = &_handle;
+    ip6tc_handle_t _handle;
+    ip6tc_handle_t *handle = &_handle;
 
-		*handle = ip6tc_init (chain->table);
+    *handle = ip6tc_init (chain_list[first]->table);
 #else
-                ip6tc_handle_t *handle;
-                handle = ip6tc_init (chain->table);
+    ip6tc_handle_t *handle;
+    handle = ip6tc_init (chain_list[first]->table);
 #endif
 
-                if (!handle)
-                {
-                        ERROR ("iptables plugin: ip6tc_init (%s) failed: %s",
-                                chain->table, ip6tc_strerror (errno));
-                        num_failures++;
-                        continue;
-                }
+    if (!handle)
+    {
+	ERROR ("iptables plugin: ip6tc_init (%s) failed: %s",
+		chain_list[first]->table, ip6tc_strerror (errno));
+	return (last - first);
+    }
 
-                submit6_chain (handle, chain);
-                ip6tc_free (handle);
-        }
-        else num_failures++;
+    for (i = first; i < last; i++)
+	submit6_chain (handle, chain_list[i]);
+
+    ip6tc_free (handle);
+    return (0);
+} /* int ip6tables_read_table */
 
+static int iptables_read (void)
+{
+    int i;
+    int j;
+    int num_failures = 0;
+
+    /* The list is sorted by iptables_init, so chains of the same table are
+     * next to each other. */
+    for (i = 0; i < chain_num; i = j)
+    {
+	ip_chain_t *chain = chain_list[i];
+
+	for (j = i + 1; j < chain_num; j++)
+	    if (iptables_chain_compare (&chain_list[i], &chain_list[j]) != 0)
+		break;
+
+	if (chain->ip_version == IPV4)
+	    num_failures += iptables_read_table (i, j);
+	else if (chain->ip_version == IPV6)
+	    num_failures += ip6tables_read_table (i, j);
+	else
+	    num_failures += j - i;
     } /* for (i = 0 .. chain_num) */
 
     return ((num_failures < chain_num) ? 0 : -1);
@@ -515,6 +553,7 @@ void module_register (void)
 {
     plugin_register_config ("iptables", iptables_config,
 	    config_keys, config_keys_num);
+    plugin_register_init ("iptables", iptables_init);
     plugin_register_read ("iptables", iptables_read);
     plugin_register_shutdown ("iptables", iptables_shutdown);
 } /* void module_register */
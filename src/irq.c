@@ -37,12 +37,26 @@
 static const char *config_keys[] =
 {
 	"Irq",
-	"IgnoreSelected"
+	"IgnoreSelected",
+	"TopCPUs"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static ignorelist_t *ignorelist = NULL;
 
+static pread_file_t *pf_interrupts = NULL;
+
+/* If greater than zero, the counts of the CPUs that handled an irq most
+ * often are reported, too. */
+typedef struct irq_cpu_s
+{
+	int cpu;
+	derive_t value;
+} irq_cpu_t;
+
+static irq_cpu_t *top_cpus = NULL;
+static size_t top_cpus_num = 0;
+
 /*
  * Private functions
  */
@@ -62,6 +76,33 @@ static int irq_config (const char *key, const char *value)
 			invert = 0;
 		ignorelist_set_invert (ignorelist, invert);
 	}
+	else if (strcasecmp (key, "TopCPUs") == 0)
+	{
+		int num = atoi (value);
+		irq_cpu_t *tmp;
+
+		if (num < 0)
+		{
+			ERROR ("irq plugin: TopCPUs must not be negative.");
+			return (1);
+		}
+
+		if (num == 0)
+		{
+			sfree (top_cpus);
+			top_cpus_num = 0;
+			return (0);
+		}
+
+		tmp = realloc (top_cpus, num * sizeof (*top_cpus));
+		if (tmp == NULL)
+		{
+			ERROR ("irq plugin: realloc failed.");
+			return (1);
+		}
+		top_cpus = tmp;
+		top_cpus_num = (size_t) num;
+	}
 	else
 	{
 		return (-1);
@@ -70,32 +111,51 @@ static int irq_config (const char *key, const char *value)
 	return (0);
 }
 
-static void irq_submit (const char *irq_name, derive_t value)
+static void irq_submit (const char *irq_name, int cpu, derive_t value)
 {
 	value_t values[1];
 	value_list_t vl = VALUE_LIST_INIT;
 
-	if (ignorelist_match (ignorelist, irq_name) != 0)
-		return;
-
 	values[0].derive = value;
 
 	vl.values = values;
 	vl.values_len = 1;
 	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
 	sstrncpy (vl.plugin, "irq", sizeof (vl.plugin));
+	if (cpu >= 0)
+		ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+				"%i", cpu);
 	sstrncpy (vl.type, "irq", sizeof (vl.type));
 	sstrncpy (vl.type_instance, irq_name, sizeof (vl.type_instance));
 
 	plugin_dispatch_values (&vl);
 } /* void irq_submit */
 
+/* Inserts a per-CPU count into the sorted `top_cpus' array, which holds
+ * `*num' entries. */
+static void irq_top_add (size_t *num, int cpu, derive_t value)
+{
+	size_t i;
+
+	if ((*num == top_cpus_num) && (value <= top_cpus[*num - 1].value))
+		return;
+
+	if (*num < top_cpus_num)
+		(*num)++;
+
+	for (i = *num - 1; (i > 0) && (top_cpus[i - 1].value < value); i--)
+		top_cpus[i] = top_cpus[i - 1];
+
+	top_cpus[i].cpu = cpu;
+	top_cpus[i].value = value;
+} /* void irq_top_add */
+
 static int irq_read (void)
 {
-	FILE *fh;
-	char buffer[1024];
+	char *buffer;
+	char *ptr;
+	char *line;
 	int  cpu_count;
-	char *fields[256];
 
 	/*
 	 * Example content:
@@ -103,90 +163,122 @@ static int irq_read (void)
 	 * 0:       2574          1          3          2   IO-APIC-edge      timer
 	 * 1:     102553     158669     218062      70587   IO-APIC-edge      i8042
 	 * 8:          0          0          0          1   IO-APIC-edge      rtc0
+	 *
+	 * Each line is parsed in place, in one pass, and only up to the last
+	 * per-CPU column.
 	 */
-	fh = fopen ("/proc/interrupts", "r");
-	if (fh == NULL)
+	if (pf_interrupts == NULL)
+		pf_interrupts = pread_file_create ("/proc/interrupts");
+
+	buffer = pread_file_read (pf_interrupts, NULL);
+	if (buffer == NULL)
 	{
 		char errbuf[1024];
-		ERROR ("irq plugin: fopen (/proc/interrupts): %s",
+		ERROR ("irq plugin: Reading /proc/interrupts failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
 	/* Get CPU count from the first line */
-	if(fgets (buffer, sizeof (buffer), fh) != NULL) {
-		cpu_count = strsplit (buffer, fields,
-				STATIC_ARRAY_SIZE (fields));
-	} else {
+	ptr = buffer;
+	line = strline (&ptr);
+	if (line == NULL)
+	{
 		ERROR ("irq plugin: unable to get CPU count from first line "
 				"of /proc/interrupts");
 		return (-1);
 	}
 
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	cpu_count = 0;
+	while (*line != 0)
+	{
+		while (isspace ((int) *line))
+			line++;
+		if (*line == 0)
+			break;
+
+		cpu_count++;
+		while ((*line != 0) && !isspace ((int) *line))
+			line++;
+	}
+
+	while ((line = strline (&ptr)) != NULL)
 	{
 		char *irq_name;
-		size_t irq_name_len;
+		char *endptr;
 		derive_t irq_value;
+		size_t top_num = 0;
 		int i;
-		int fields_num;
-		int irq_values_to_parse;
-
-		fields_num = strsplit (buffer, fields,
-				STATIC_ARRAY_SIZE (fields));
-		if (fields_num < 2)
-			continue;
-
-		/* Parse this many numeric fields, skip the rest
-		 * (+1 because first there is a name of irq in each line) */
-		if (fields_num >= cpu_count + 1)
-			irq_values_to_parse = cpu_count;
-		else
-			irq_values_to_parse = fields_num - 1;
 
 		/* First field is irq name and colon */
-		irq_name = fields[0];
-		irq_name_len = strlen (irq_name);
-		if (irq_name_len < 2)
-			continue;
+		while (isspace ((int) *line))
+			line++;
+
+		irq_name = line;
+		while ((*line != 0) && (*line != ':') && !isspace ((int) *line))
+			line++;
 
 		/* Check if irq name ends with colon.
 		 * Otherwise it's a header. */
-		if (irq_name[irq_name_len - 1] != ':')
+		if ((*line != ':') || (line == irq_name))
 			continue;
+		*line = 0;
+		line++;
 
-		irq_name[irq_name_len - 1] = 0;
-		irq_name_len--;
+		if (ignorelist_match (ignorelist, irq_name) != 0)
+			continue;
 
 		irq_value = 0;
-		for (i = 1; i <= irq_values_to_parse; i++)
+		for (i = 0; i < cpu_count; i++)
 		{
 			/* Per-CPU value */
-			value_t v;
-			int status;
+			derive_t v;
 
-			status = parse_value (fields[i], &v, DS_TYPE_DERIVE);
-			if (status != 0)
+			errno = 0;
+			v = (derive_t) strtoull (line, &endptr, 10);
+			if ((endptr == line) || (errno != 0))
 				break;
+			line = endptr;
 
-			irq_value += v.derive;
+			irq_value += v;
+			if (top_cpus_num > 0)
+				irq_top_add (&top_num, i, v);
 		} /* for (i) */
 
 		/* No valid fields -> do not submit anything. */
-		if (i <= 1)
+		if (i == 0)
 			continue;
 
-		irq_submit (irq_name, irq_value);
-	}
+		irq_submit (irq_name, /* cpu = */ -1, irq_value);
 
-	fclose (fh);
+		/* Lines like "ERR" and "MIS" have a single, global count. */
+		if (i == cpu_count)
+		{
+			size_t j;
+
+			for (j = 0; j < top_num; j++)
+				irq_submit (irq_name, top_cpus[j].cpu, top_cpus[j].value);
+		}
+	}
 
 	return (0);
 } /* int irq_read */
 
+static int irq_shutdown (void)
+{
+	pread_file_destroy (pf_interrupts);
+	pf_interrupts = NULL;
+
+	sfree (top_cpus);
+	top_cpus_num = 0;
+
+	return (0);
+} /* int irq_shutdown */
+
 void module_register (void)
 {
 	plugin_register_config ("irq", irq_config,
 			config_keys, config_keys_num);
 	plugin_register_read ("irq", irq_read);
+	plugin_register_shutdown ("irq", irq_shutdown);
 } /* void module_register */
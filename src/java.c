@@ -25,6 +25,7 @@
 #include "plugin.h"
 #include "common.h"
 #include "filter_chain.h"
+#include "utils_avltree.h"
 
 #include <pthread.h>
 #include <jni.h>
@@ -63,6 +64,7 @@ typedef struct java_plugin_class_s java_plugin_class_t;
 #define CB_TYPE_NOTIFICATION 8
 #define CB_TYPE_MATCH        9
 #define CB_TYPE_TARGET      10
+#define CB_TYPE_WRITE_BATCH 11
 struct cjni_callback_info_s /* {{{ */
 {
   char     *name;
@@ -74,6 +76,35 @@ struct cjni_callback_info_s /* {{{ */
 typedef struct cjni_callback_info_s cjni_callback_info_t;
 /* }}} */
 
+/* Classes and methods used to convert value lists. They are looked up once,
+ * after the JVM has been created, rather than for each value list. */
+struct cjni_cache_s /* {{{ */
+{
+  jclass    c_long;
+  jmethodID m_long_constructor;
+
+  jclass    c_double;
+  jmethodID m_double_constructor;
+
+  jclass    c_dataset;
+  jmethodID m_dataset_constructor;
+  jmethodID m_dataset_add;
+
+  jclass    c_valuelist;
+  jmethodID m_valuelist_constructor;
+  jmethodID m_valuelist_set_data_set;
+  jmethodID m_valuelist_set_host;
+  jmethodID m_valuelist_set_plugin;
+  jmethodID m_valuelist_set_plugin_instance;
+  jmethodID m_valuelist_set_type;
+  jmethodID m_valuelist_set_type_instance;
+  jmethodID m_valuelist_set_time;
+  jmethodID m_valuelist_set_interval;
+  jmethodID m_valuelist_add_value;
+};
+typedef struct cjni_cache_s cjni_cache_t;
+/* }}} */
+
 /*
  * Global variables
  */
@@ -95,6 +126,13 @@ static pthread_mutex_t       java_callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static oconfig_item_t       *config_block = NULL;
 
+static cjni_cache_t          cjni_cache;
+
+/* DataSet objects passed to write callbacks, keyed by type. The values are
+ * global references. */
+static c_avl_tree_t         *java_data_sets      = NULL;
+static pthread_mutex_t       java_data_sets_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Prototypes
  *
@@ -109,6 +147,8 @@ static int cjni_callback_register (JNIEnv *jvm_env, jobject o_name,
 static int cjni_read (user_data_t *user_data);
 static int cjni_write (const data_set_t *ds, const value_list_t *vl,
     user_data_t *ud);
+static int cjni_write_batch (const plugin_write_item_t *items,
+    size_t items_num, user_data_t *ud);
 static int cjni_flush (cdtime_t timeout, const char *identifier, user_data_t *ud);
 static void cjni_log (int severity, const char *message, user_data_t *ud);
 static int cjni_notification (const notification_t *n, user_data_t *ud);
@@ -225,57 +265,15 @@ static int ctoj_double (JNIEnv *jvm_env, /* {{{ */
 /* Convert a jlong to a java.lang.Number */
 static jobject ctoj_jlong_to_number (JNIEnv *jvm_env, jlong value) /* {{{ */
 {
-  jclass c_long;
-  jmethodID m_long_constructor;
-
-  /* Look up the java.lang.Long class */
-  c_long = (*jvm_env)->FindClass (jvm_env, "java/lang/Long");
-  if (c_long == NULL)
-  {
-    ERROR ("java plugin: ctoj_jlong_to_number: Looking up the "
-        "java.lang.Long class failed.");
-    return (NULL);
-  }
-
-  m_long_constructor = (*jvm_env)->GetMethodID (jvm_env,
-      c_long, "<init>", "(J)V");
-  if (m_long_constructor == NULL)
-  {
-    ERROR ("java plugin: ctoj_jlong_to_number: Looking up the "
-        "`Long (long)' constructor failed.");
-    return (NULL);
-  }
-
   return ((*jvm_env)->NewObject (jvm_env,
-        c_long, m_long_constructor, value));
+        cjni_cache.c_long, cjni_cache.m_long_constructor, value));
 } /* }}} jobject ctoj_jlong_to_number */
 
 /* Convert a jdouble to a java.lang.Number */
 static jobject ctoj_jdouble_to_number (JNIEnv *jvm_env, jdouble value) /* {{{ */
 {
-  jclass c_double;
-  jmethodID m_double_constructor;
-
-  /* Look up the java.lang.Long class */
-  c_double = (*jvm_env)->FindClass (jvm_env, "java/lang/Double");
-  if (c_double == NULL)
-  {
-    ERROR ("java plugin: ctoj_jdouble_to_number: Looking up the "
-        "java.lang.Double class failed.");
-    return (NULL);
-  }
-
-  m_double_constructor = (*jvm_env)->GetMethodID (jvm_env,
-      c_double, "<init>", "(D)V");
-  if (m_double_constructor == NULL)
-  {
-    ERROR ("java plugin: ctoj_jdouble_to_number: Looking up the "
-        "`Double (double)' constructor failed.");
-    return (NULL);
-  }
-
   return ((*jvm_env)->NewObject (jvm_env,
-        c_double, m_double_constructor, value));
+        cjni_cache.c_double, cjni_cache.m_double_constructor, value));
 } /* }}} jobject ctoj_jdouble_to_number */
 
 /* Convert a value_t to a java.lang.Number */
@@ -596,42 +594,10 @@ static jobject ctoj_oconfig_item (JNIEnv *jvm_env, /* {{{ */
 /* Convert a data_set_t to a org/collectd/api/DataSet */
 static jobject ctoj_data_set (JNIEnv *jvm_env, const data_set_t *ds) /* {{{ */
 {
-  jclass c_dataset;
-  jmethodID m_constructor;
-  jmethodID m_add;
   jobject o_type;
   jobject o_dataset;
   int i;
 
-  /* Look up the org/collectd/api/DataSet class */
-  c_dataset = (*jvm_env)->FindClass (jvm_env, "org/collectd/api/DataSet");
-  if (c_dataset == NULL)
-  {
-    ERROR ("java plugin: ctoj_data_set: Looking up the "
-        "org/collectd/api/DataSet class failed.");
-    return (NULL);
-  }
-
-  /* Search for the `DataSet (String type)' constructor. */
-  m_constructor = (*jvm_env)->GetMethodID (jvm_env,
-      c_dataset, "<init>", "(Ljava/lang/String;)V");
-  if (m_constructor == NULL)
-  {
-    ERROR ("java plugin: ctoj_data_set: Looking up the "
-        "`DataSet (String)' constructor failed.");
-    return (NULL);
-  }
-
-  /* Search for the `void addDataSource (DataSource)' method. */
-  m_add = (*jvm_env)->GetMethodID (jvm_env,
-      c_dataset, "addDataSource", "(Lorg/collectd/api/DataSource;)V");
-  if (m_add == NULL)
-  {
-    ERROR ("java plugin: ctoj_data_set: Looking up the "
-        "`addDataSource (DataSource)' method failed.");
-    return (NULL);
-  }
-
   o_type = (*jvm_env)->NewStringUTF (jvm_env, ds->type);
   if (o_type == NULL)
   {
@@ -640,7 +606,7 @@ static jobject ctoj_data_set (JNIEnv *jvm_env, const data_set_t *ds) /* {{{ */
   }
 
   o_dataset = (*jvm_env)->NewObject (jvm_env,
-      c_dataset, m_constructor, o_type);
+      cjni_cache.c_dataset, cjni_cache.m_dataset_constructor, o_type);
   if (o_dataset == NULL)
   {
     ERROR ("java plugin: ctoj_data_set: Creating a DataSet object failed.");
@@ -664,7 +630,8 @@ static jobject ctoj_data_set (JNIEnv *jvm_env, const data_set_t *ds) /* {{{ */
       return (NULL);
     }
 
-    (*jvm_env)->CallVoidMethod (jvm_env, o_dataset, m_add, o_datasource);
+    (*jvm_env)->CallVoidMethod (jvm_env, o_dataset, cjni_cache.m_dataset_add,
+        o_datasource);
 
     (*jvm_env)->DeleteLocalRef (jvm_env, o_datasource);
   } /* for (i = 0; i < ds->ds_num; i++) */
@@ -672,22 +639,77 @@ static jobject ctoj_data_set (JNIEnv *jvm_env, const data_set_t *ds) /* {{{ */
   return (o_dataset);
 } /* }}} jobject ctoj_data_set */
 
-static int ctoj_value_list_add_value (JNIEnv *jvm_env, /* {{{ */
-    value_t value, int ds_type,
-    jclass class_ptr, jobject object_ptr)
+/* Returns the DataSet object for `ds' as a global reference which must not
+ * be released by the caller. The objects are created on first use and shared
+ * by all value lists of the same type. */
+static jobject ctoj_data_set_cached (JNIEnv *jvm_env, /* {{{ */
+    const data_set_t *ds)
 {
-  jmethodID m_addvalue;
-  jobject o_number;
+  jobject o_dataset;
+  jobject o_local;
+  char *type;
+  int status;
 
-  m_addvalue = (*jvm_env)->GetMethodID (jvm_env, class_ptr,
-      "addValue", "(Ljava/lang/Number;)V");
-  if (m_addvalue == NULL)
+  pthread_mutex_lock (&java_data_sets_lock);
+
+  if (java_data_sets == NULL)
   {
-    ERROR ("java plugin: ctoj_value_list_add_value: "
-        "Cannot find method `void addValue (Number)'.");
-    return (-1);
+    java_data_sets = c_avl_create ((void *) strcmp);
+    if (java_data_sets == NULL)
+    {
+      pthread_mutex_unlock (&java_data_sets_lock);
+      ERROR ("java plugin: ctoj_data_set_cached: c_avl_create failed.");
+      return (NULL);
+    }
+  }
+
+  if (c_avl_get (java_data_sets, ds->type, (void *) &o_dataset) == 0)
+  {
+    pthread_mutex_unlock (&java_data_sets_lock);
+    return (o_dataset);
+  }
+
+  o_local = ctoj_data_set (jvm_env, ds);
+  if (o_local == NULL)
+  {
+    pthread_mutex_unlock (&java_data_sets_lock);
+    ERROR ("java plugin: ctoj_data_set_cached: ctoj_data_set (%s) failed.",
+        ds->type);
+    return (NULL);
   }
 
+  o_dataset = (*jvm_env)->NewGlobalRef (jvm_env, o_local);
+  (*jvm_env)->DeleteLocalRef (jvm_env, o_local);
+  if (o_dataset == NULL)
+  {
+    pthread_mutex_unlock (&java_data_sets_lock);
+    ERROR ("java plugin: ctoj_data_set_cached: NewGlobalRef failed.");
+    return (NULL);
+  }
+
+  type = strdup (ds->type);
+  if (type == NULL)
+    status = -1;
+  else
+    status = c_avl_insert (java_data_sets, type, o_dataset);
+  if (status != 0)
+  {
+    pthread_mutex_unlock (&java_data_sets_lock);
+    ERROR ("java plugin: ctoj_data_set_cached: c_avl_insert failed.");
+    sfree (type);
+    (*jvm_env)->DeleteGlobalRef (jvm_env, o_dataset);
+    return (NULL);
+  }
+
+  pthread_mutex_unlock (&java_data_sets_lock);
+  return (o_dataset);
+} /* }}} jobject ctoj_data_set_cached */
+
+static int ctoj_value_list_add_value (JNIEnv *jvm_env, /* {{{ */
+    value_t value, int ds_type, jobject object_ptr)
+{
+  jobject o_number;
+
   o_number = ctoj_value_to_number (jvm_env, value, ds_type);
   if (o_number == NULL)
   {
@@ -696,7 +718,8 @@ static int ctoj_value_list_add_value (JNIEnv *jvm_env, /* {{{ */
     return (-1);
   }
 
-  (*jvm_env)->CallVoidMethod (jvm_env, object_ptr, m_addvalue, o_number);
+  (*jvm_env)->CallVoidMethod (jvm_env, object_ptr,
+      cjni_cache.m_valuelist_add_value, o_number);
 
   (*jvm_env)->DeleteLocalRef (jvm_env, o_number);
 
@@ -704,36 +727,20 @@ static int ctoj_value_list_add_value (JNIEnv *jvm_env, /* {{{ */
 } /* }}} int ctoj_value_list_add_value */
 
 static int ctoj_value_list_add_data_set (JNIEnv *jvm_env, /* {{{ */
-    jclass c_valuelist, jobject o_valuelist, const data_set_t *ds)
+    jobject o_valuelist, const data_set_t *ds)
 {
-  jmethodID m_setdataset;
   jobject o_dataset;
 
-  /* Look for the `void setDataSource (List<DataSource> ds)' method. */
-  m_setdataset = (*jvm_env)->GetMethodID (jvm_env, c_valuelist,
-      "setDataSet", "(Lorg/collectd/api/DataSet;)V");
-  if (m_setdataset == NULL)
-  {
-    ERROR ("java plugin: ctoj_value_list_add_data_set: "
-        "Cannot find the `void setDataSet (DataSet)' method.");
-    return (-1);
-  }
-
-  /* Create a DataSet object. */
-  o_dataset = ctoj_data_set (jvm_env, ds);
+  o_dataset = ctoj_data_set_cached (jvm_env, ds);
   if (o_dataset == NULL)
   {
     ERROR ("java plugin: ctoj_value_list_add_data_set: "
-        "ctoj_data_set (%s) failed.", ds->type);
+        "ctoj_data_set_cached (%s) failed.", ds->type);
     return (-1);
   }
 
-  /* Actually call the method. */
   (*jvm_env)->CallVoidMethod (jvm_env,
-      o_valuelist, m_setdataset, o_dataset);
-
-  /* Decrease reference counter on the List<DataSource> object. */
-  (*jvm_env)->DeleteLocalRef (jvm_env, o_dataset);
+      o_valuelist, cjni_cache.m_valuelist_set_data_set, o_dataset);
 
   return (0);
 } /* }}} int ctoj_value_list_add_data_set */
@@ -742,36 +749,12 @@ static int ctoj_value_list_add_data_set (JNIEnv *jvm_env, /* {{{ */
 static jobject ctoj_value_list (JNIEnv *jvm_env, /* {{{ */
     const data_set_t *ds, const value_list_t *vl)
 {
-  jclass c_valuelist;
-  jmethodID m_valuelist_constructor;
   jobject o_valuelist;
   int status;
   int i;
 
-  /* First, create a new ValueList instance..
-   * Look up the class.. */
-  c_valuelist = (*jvm_env)->FindClass (jvm_env,
-      "org/collectd/api/ValueList");
-  if (c_valuelist == NULL)
-  {
-    ERROR ("java plugin: ctoj_value_list: "
-        "FindClass (org/collectd/api/ValueList) failed.");
-    return (NULL);
-  }
-
-  /* Lookup the `ValueList ()' constructor. */
-  m_valuelist_constructor = (*jvm_env)->GetMethodID (jvm_env, c_valuelist,
-      "<init>", "()V");
-  if (m_valuelist_constructor == NULL)
-  {
-    ERROR ("java plugin: ctoj_value_list: Cannot find the "
-        "`ValueList ()' constructor.");
-    return (NULL);
-  }
-
-  /* Create a new instance. */
-  o_valuelist = (*jvm_env)->NewObject (jvm_env, c_valuelist,
-      m_valuelist_constructor);
+  o_valuelist = (*jvm_env)->NewObject (jvm_env, cjni_cache.c_valuelist,
+      cjni_cache.m_valuelist_constructor);
   if (o_valuelist == NULL)
   {
     ERROR ("java plugin: ctoj_value_list: Creating a new ValueList instance "
@@ -779,8 +762,7 @@ static jobject ctoj_value_list (JNIEnv *jvm_env, /* {{{ */
     return (NULL);
   }
 
-  status = ctoj_value_list_add_data_set (jvm_env,
-      c_valuelist, o_valuelist, ds);
+  status = ctoj_value_list_add_data_set (jvm_env, o_valuelist, ds);
   if (status != 0)
   {
     ERROR ("java plugin: ctoj_value_list: "
@@ -790,49 +772,38 @@ static jobject ctoj_value_list (JNIEnv *jvm_env, /* {{{ */
   }
 
   /* Set the strings.. */
-#define SET_STRING(str,method_name) do { \
-  status = ctoj_string (jvm_env, str, \
-      c_valuelist, o_valuelist, method_name); \
-  if (status != 0) { \
-    ERROR ("java plugin: ctoj_value_list: ctoj_string (%s) failed.", \
-        method_name); \
+#define SET_STRING(str,method) do { \
+  jstring o_string = (*jvm_env)->NewStringUTF (jvm_env, str); \
+  if (o_string == NULL) { \
+    ERROR ("java plugin: ctoj_value_list: NewStringUTF failed."); \
     (*jvm_env)->DeleteLocalRef (jvm_env, o_valuelist); \
     return (NULL); \
-  } } while (0)
+  } \
+  (*jvm_env)->CallVoidMethod (jvm_env, o_valuelist, \
+      cjni_cache.method, o_string); \
+  (*jvm_env)->DeleteLocalRef (jvm_env, o_string); \
+  } while (0)
 
-  SET_STRING (vl->host,            "setHost");
-  SET_STRING (vl->plugin,          "setPlugin");
-  SET_STRING (vl->plugin_instance, "setPluginInstance");
-  SET_STRING (vl->type,            "setType");
-  SET_STRING (vl->type_instance,   "setTypeInstance");
+  SET_STRING (vl->host,            m_valuelist_set_host);
+  SET_STRING (vl->plugin,          m_valuelist_set_plugin);
+  SET_STRING (vl->plugin_instance, m_valuelist_set_plugin_instance);
+  SET_STRING (vl->type,            m_valuelist_set_type);
+  SET_STRING (vl->type_instance,   m_valuelist_set_type_instance);
 
 #undef SET_STRING
 
-  /* Set the `time' member. Java stores time in milliseconds. */
-  status = ctoj_long (jvm_env, (jlong) CDTIME_T_TO_MS (vl->time),
-      c_valuelist, o_valuelist, "setTime");
-  if (status != 0)
-  {
-    ERROR ("java plugin: ctoj_value_list: ctoj_long (setTime) failed.");
-    (*jvm_env)->DeleteLocalRef (jvm_env, o_valuelist);
-    return (NULL);
-  }
-
-  /* Set the `interval' member.. */
-  status = ctoj_long (jvm_env,
-      (jlong) CDTIME_T_TO_MS (vl->interval),
-      c_valuelist, o_valuelist, "setInterval");
-  if (status != 0)
-  {
-    ERROR ("java plugin: ctoj_value_list: ctoj_long (setInterval) failed.");
-    (*jvm_env)->DeleteLocalRef (jvm_env, o_valuelist);
-    return (NULL);
-  }
+  /* Set the `time' and `interval' members. Java stores time in
+   * milliseconds. */
+  (*jvm_env)->CallVoidMethod (jvm_env, o_valuelist,
+      cjni_cache.m_valuelist_set_time, (jlong) CDTIME_T_TO_MS (vl->time));
+  (*jvm_env)->CallVoidMethod (jvm_env, o_valuelist,
+      cjni_cache.m_valuelist_set_interval,
+      (jlong) CDTIME_T_TO_MS (vl->interval));
 
   for (i = 0; i < vl->values_len; i++)
   {
     status = ctoj_value_list_add_value (jvm_env, vl->values[i], ds->ds[i].type,
-        c_valuelist, o_valuelist);
+        o_valuelist);
     if (status != 0)
     {
       ERROR ("java plugin: ctoj_value_list: "
@@ -1344,6 +1315,81 @@ static jint JNICALL cjni_api_dispatch_values (JNIEnv *jvm_env, /* {{{ */
   return (status);
 } /* }}} jint cjni_api_dispatch_values */
 
+static jint JNICALL cjni_api_dispatch_values_batch (JNIEnv *jvm_env, /* {{{ */
+    jobject this, jobjectArray java_vls)
+{
+  value_list_t vl_init = VALUE_LIST_INIT;
+  value_list_t *vls;
+  jsize java_vls_num;
+  size_t vls_num;
+  jsize i;
+  int status;
+  int failed = 0;
+
+  java_vls_num = (*jvm_env)->GetArrayLength (jvm_env, java_vls);
+  if (java_vls_num <= 0)
+    return (0);
+
+  vls = calloc ((size_t) java_vls_num, sizeof (*vls));
+  if (vls == NULL)
+  {
+    ERROR ("java plugin: cjni_api_dispatch_values_batch: calloc failed.");
+    return (-1);
+  }
+
+  /* Value lists which can't be converted are skipped, so that one bad entry
+   * doesn't drop the whole batch. Each conversion gets its own local frame,
+   * because large batches would otherwise pile up local references. */
+  vls_num = 0;
+  for (i = 0; i < java_vls_num; i++)
+  {
+    jobject java_vl;
+
+    if ((*jvm_env)->PushLocalFrame (jvm_env, /* capacity = */ 16) != 0)
+    {
+      ERROR ("java plugin: cjni_api_dispatch_values_batch: "
+          "PushLocalFrame failed.");
+      failed++;
+      break;
+    }
+
+    memcpy (vls + vls_num, &vl_init, sizeof (vl_init));
+    java_vl = (*jvm_env)->GetObjectArrayElement (jvm_env, java_vls, i);
+    if (java_vl == NULL)
+      status = -1;
+    else
+      status = jtoc_value_list (jvm_env, vls + vls_num, java_vl);
+
+    (*jvm_env)->PopLocalFrame (jvm_env, /* result = */ NULL);
+
+    if (status != 0)
+    {
+      ERROR ("java plugin: cjni_api_dispatch_values_batch: "
+          "jtoc_value_list failed for entry %i.", (int) i);
+      sfree (vls[vls_num].values);
+      failed++;
+      continue;
+    }
+
+    vls_num++;
+  }
+
+  status = 0;
+  if (vls_num > 0)
+    status = plugin_dispatch_values_batch (vls, vls_num);
+
+  while (vls_num > 0)
+  {
+    vls_num--;
+    sfree (vls[vls_num].values);
+  }
+  sfree (vls);
+
+  if ((status == 0) && (failed > 0))
+    status = -1;
+  return (status);
+} /* }}} jint cjni_api_dispatch_values_batch */
+
 static jint JNICALL cjni_api_dispatch_notification (JNIEnv *jvm_env, /* {{{ */
     jobject this, jobject o_notification)
 {
@@ -1451,6 +1497,30 @@ static jint JNICALL cjni_api_register_write (JNIEnv *jvm_env, /* {{{ */
   return (0);
 } /* }}} jint cjni_api_register_write */
 
+static jint JNICALL cjni_api_register_write_batch (JNIEnv *jvm_env, /* {{{ */
+    jobject this, jobject o_name, jobject o_write)
+{
+  user_data_t ud;
+  cjni_callback_info_t *cbi;
+
+  cbi = cjni_callback_info_create (jvm_env, o_name, o_write,
+      CB_TYPE_WRITE_BATCH);
+  if (cbi == NULL)
+    return (-1);
+
+  DEBUG ("java plugin: Registering new batch write callback: %s", cbi->name);
+
+  memset (&ud, 0, sizeof (ud));
+  ud.data = (void *) cbi;
+  ud.free_func = cjni_callback_info_destroy;
+
+  plugin_register_write_batch (cbi->name, cjni_write_batch, &ud);
+
+  (*jvm_env)->DeleteLocalRef (jvm_env, o_write);
+
+  return (0);
+} /* }}} jint cjni_api_register_write_batch */
+
 static jint JNICALL cjni_api_register_flush (JNIEnv *jvm_env, /* {{{ */
     jobject this, jobject o_name, jobject o_flush)
 {
@@ -1637,6 +1707,10 @@ static JNINativeMethod jni_api_functions[] = /* {{{ */
     "(Lorg/collectd/api/ValueList;)I",
     cjni_api_dispatch_values },
 
+  { "dispatchValues",
+    "([Lorg/collectd/api/ValueList;)I",
+    cjni_api_dispatch_values_batch },
+
   { "dispatchNotification",
     "(Lorg/collectd/api/Notification;)I",
     cjni_api_dispatch_notification },
@@ -1661,6 +1735,10 @@ static JNINativeMethod jni_api_functions[] = /* {{{ */
     "(Ljava/lang/String;Lorg/collectd/api/CollectdWriteInterface;)I",
     cjni_api_register_write },
 
+  { "registerWriteBatch",
+    "(Ljava/lang/String;Lorg/collectd/api/CollectdWriteBatchInterface;)I",
+    cjni_api_register_write_batch },
+
   { "registerFlush",
     "(Ljava/lang/String;Lorg/collectd/api/CollectdFlushInterface;)I",
     cjni_api_register_flush },
@@ -1728,6 +1806,11 @@ static cjni_callback_info_t *cjni_callback_info_create (JNIEnv *jvm_env, /* {{{
       method_signature = "(Lorg/collectd/api/ValueList;)I";
       break;
 
+    case CB_TYPE_WRITE_BATCH:
+      method_name = "writeBatch";
+      method_signature = "([Lorg/collectd/api/ValueList;)I";
+      break;
+
     case CB_TYPE_FLUSH:
       method_name = "flush";
       method_signature = "(Ljava/lang/Number;Ljava/lang/String;)I";
@@ -1949,6 +2032,103 @@ static int cjni_init_native (JNIEnv *jvm_env) /* {{{ */
   return (0);
 } /* }}} int cjni_init_native */
 
+/* Look up the classes and methods in `cjni_cache'. */
+static int cjni_cache_init (JNIEnv *jvm_env) /* {{{ */
+{
+#define CACHE_CLASS(member,name) do { \
+  jclass tmp = (*jvm_env)->FindClass (jvm_env, name); \
+  if (tmp == NULL) { \
+    ERROR ("java plugin: cjni_cache_init: FindClass (%s) failed.", name); \
+    return (-1); \
+  } \
+  cjni_cache.member = (*jvm_env)->NewGlobalRef (jvm_env, tmp); \
+  (*jvm_env)->DeleteLocalRef (jvm_env, tmp); \
+  if (cjni_cache.member == NULL) { \
+    ERROR ("java plugin: cjni_cache_init: NewGlobalRef (%s) failed.", name); \
+    return (-1); \
+  } } while (0)
+
+#define CACHE_METHOD(member,class,name,signature) do { \
+  cjni_cache.member = (*jvm_env)->GetMethodID (jvm_env, cjni_cache.class, \
+      name, signature); \
+  if (cjni_cache.member == NULL) { \
+    ERROR ("java plugin: cjni_cache_init: Cannot find the `%s' method " \
+        "with signature `%s'.", name, signature); \
+    return (-1); \
+  } } while (0)
+
+  CACHE_CLASS (c_long, "java/lang/Long");
+  CACHE_METHOD (m_long_constructor, c_long, "<init>", "(J)V");
+
+  CACHE_CLASS (c_double, "java/lang/Double");
+  CACHE_METHOD (m_double_constructor, c_double, "<init>", "(D)V");
+
+  CACHE_CLASS (c_dataset, "org/collectd/api/DataSet");
+  CACHE_METHOD (m_dataset_constructor, c_dataset,
+      "<init>", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_dataset_add, c_dataset,
+      "addDataSource", "(Lorg/collectd/api/DataSource;)V");
+
+  CACHE_CLASS (c_valuelist, "org/collectd/api/ValueList");
+  CACHE_METHOD (m_valuelist_constructor, c_valuelist, "<init>", "()V");
+  CACHE_METHOD (m_valuelist_set_data_set, c_valuelist,
+      "setDataSet", "(Lorg/collectd/api/DataSet;)V");
+  CACHE_METHOD (m_valuelist_set_host, c_valuelist,
+      "setHost", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_valuelist_set_plugin, c_valuelist,
+      "setPlugin", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_valuelist_set_plugin_instance, c_valuelist,
+      "setPluginInstance", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_valuelist_set_type, c_valuelist,
+      "setType", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_valuelist_set_type_instance, c_valuelist,
+      "setTypeInstance", "(Ljava/lang/String;)V");
+  CACHE_METHOD (m_valuelist_set_time, c_valuelist, "setTime", "(J)V");
+  CACHE_METHOD (m_valuelist_set_interval, c_valuelist, "setInterval", "(J)V");
+  CACHE_METHOD (m_valuelist_add_value, c_valuelist,
+      "addValue", "(Ljava/lang/Number;)V");
+
+#undef CACHE_METHOD
+#undef CACHE_CLASS
+
+  return (0);
+} /* }}} int cjni_cache_init */
+
+/* Release the global references held by `cjni_cache' and `java_data_sets'. */
+static void cjni_cache_destroy (JNIEnv *jvm_env) /* {{{ */
+{
+  char *type;
+  jobject o_dataset;
+
+  pthread_mutex_lock (&java_data_sets_lock);
+  if (java_data_sets != NULL)
+  {
+    while (c_avl_pick (java_data_sets, (void *) &type,
+          (void *) &o_dataset) == 0)
+    {
+      (*jvm_env)->DeleteGlobalRef (jvm_env, o_dataset);
+      sfree (type);
+    }
+    c_avl_destroy (java_data_sets);
+    java_data_sets = NULL;
+  }
+  pthread_mutex_unlock (&java_data_sets_lock);
+
+#define RELEASE_CLASS(member) do { \
+  if (cjni_cache.member != NULL) \
+    (*jvm_env)->DeleteGlobalRef (jvm_env, cjni_cache.member); \
+  } while (0)
+
+  RELEASE_CLASS (c_long);
+  RELEASE_CLASS (c_double);
+  RELEASE_CLASS (c_dataset);
+  RELEASE_CLASS (c_valuelist);
+
+#undef RELEASE_CLASS
+
+  memset (&cjni_cache, 0, sizeof (cjni_cache));
+} /* }}} void cjni_cache_destroy */
+
 /* Create the JVM. This is called when the first thread tries to access the JVM
  * via cjni_thread_attach. */
 static int cjni_create_jvm (void) /* {{{ */
@@ -2004,6 +2184,13 @@ static int cjni_create_jvm (void) /* {{{ */
     return (-1);
   }
 
+  status = cjni_cache_init (jvm_env);
+  if (status != 0)
+  {
+    ERROR ("java plugin: cjni_create_jvm: cjni_cache_init failed.");
+    return (-1);
+  }
+
   DEBUG ("java plugin: The JVM has been created.");
   return (0);
 } /* }}} int cjni_create_jvm */
@@ -2552,6 +2739,80 @@ static int cjni_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
   return (ret_status);
 } /* }}} int cjni_write */
 
+/* Call the CB_TYPE_WRITE_BATCH callback pointed to by the `user_data_t'
+ * pointer, passing all value lists as one array. */
+static int cjni_write_batch (const plugin_write_item_t *items, /* {{{ */
+    size_t items_num, user_data_t *ud)
+{
+  JNIEnv *jvm_env;
+  cjni_callback_info_t *cbi;
+  jobjectArray o_array;
+  int status;
+  int ret_status;
+  size_t i;
+
+  if (jvm == NULL)
+  {
+    ERROR ("java plugin: cjni_write_batch: jvm == NULL");
+    return (-1);
+  }
+
+  if ((ud == NULL) || (ud->data == NULL))
+  {
+    ERROR ("java plugin: cjni_write_batch: Invalid user data.");
+    return (-1);
+  }
+
+  if (items_num == 0)
+    return (0);
+
+  jvm_env = cjni_thread_attach ();
+  if (jvm_env == NULL)
+    return (-1);
+
+  cbi = (cjni_callback_info_t *) ud->data;
+
+  o_array = (*jvm_env)->NewObjectArray (jvm_env, (jsize) items_num,
+      cjni_cache.c_valuelist, /* initial element = */ NULL);
+  if (o_array == NULL)
+  {
+    ERROR ("java plugin: cjni_write_batch: NewObjectArray failed.");
+    cjni_thread_detach ();
+    return (-1);
+  }
+
+  for (i = 0; i < items_num; i++)
+  {
+    jobject vl_java;
+
+    vl_java = ctoj_value_list (jvm_env, items[i].ds, items[i].vl);
+    if (vl_java == NULL)
+    {
+      ERROR ("java plugin: cjni_write_batch: ctoj_value_list failed.");
+      (*jvm_env)->DeleteLocalRef (jvm_env, o_array);
+      cjni_thread_detach ();
+      return (-1);
+    }
+
+    (*jvm_env)->SetObjectArrayElement (jvm_env, o_array, (jsize) i, vl_java);
+    (*jvm_env)->DeleteLocalRef (jvm_env, vl_java);
+  }
+
+  ret_status = (*jvm_env)->CallIntMethod (jvm_env,
+      cbi->object, cbi->method, o_array);
+
+  (*jvm_env)->DeleteLocalRef (jvm_env, o_array);
+
+  status = cjni_thread_detach ();
+  if (status != 0)
+  {
+    ERROR ("java plugin: cjni_write_batch: cjni_thread_detach failed.");
+    return (-1);
+  }
+
+  return (ret_status);
+} /* }}} int cjni_write_batch */
+
 /* Call the CB_TYPE_FLUSH callback pointed to by the `user_data_t' pointer. */
 static int cjni_flush (cdtime_t timeout, const char *identifier, /* {{{ */
     user_data_t *ud)
@@ -2924,10 +3185,16 @@ static int cjni_match_target_invoke (const data_set_t *ds, /* {{{ */
       ERROR ("java plugin: cjni_match_target_invoke: "
           "jtoc_value_list failed.");
     }
+    else if (plugin_value_list_make_writable (vl) != 0)
+    {
+      ERROR ("java plugin: cjni_match_target_invoke: "
+          "plugin_value_list_make_writable failed.");
+      sfree (new_vl.values);
+    }
     else /* if (status == 0) */
     {
-      /* plugin_dispatch_values assures that this is dynamically allocated
-       * memory. */
+      /* plugin_value_list_make_writable assures that this is dynamically
+       * allocated memory. */
       sfree (vl->values);
 
       /* This will replace the vl->values pointer to a new, dynamically
@@ -3047,6 +3314,8 @@ static int cjni_shutdown (void) /* {{{ */
   java_classes_list_len = 0;
   sfree (java_classes_list);
 
+  cjni_cache_destroy (jvm_env);
+
   /* Destroy the JVM */
   DEBUG ("java plugin: Destroying the JVM.");
   (*jvm)->DestroyJavaVM (jvm);
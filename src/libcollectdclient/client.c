@@ -45,8 +45,10 @@
 #include <errno.h>
 #include <math.h>
 #include <netdb.h>
+#include <sys/time.h>
 
 #include "collectd/client.h"
+#include "collectd/shm.h"
 
 /* NI_MAXHOST has been obsoleted by RFC 3493 which is a reason for SunOS 5.11
  * to no longer define it. We'll use the old, RFC 2553 value here. */
@@ -97,13 +99,34 @@
 # define LCC_DEBUG(...) /**/
 #endif
 
+/* Number of commands sent before their responses are read. The responses to
+ * this many PUTVAL commands have to fit into the socket buffers, or the
+ * server would block writing them while we block sending. */
+#define LCC_PIPELINE_DEPTH 128
+
 /*
  * Types
  */
+struct lcc_pending_s
+{
+  lcc_callback_t callback;
+  /* Set instead of "callback" for GETVAL commands. */
+  lcc_getval_callback_t getval_callback;
+  void *user_data;
+};
+typedef struct lcc_pending_s lcc_pending_t;
+
 struct lcc_connection_s
 {
   FILE *fh;
   char errbuf[1024];
+
+  /* Commands sent without reading their response yet, oldest first. */
+  lcc_pending_t pending[LCC_PIPELINE_DEPTH];
+  size_t pending_num;
+
+  /* The segment of the shm plugin, if connected to a local daemon. */
+  lcc_shm_t shm;
 };
 
 struct lcc_response_s
@@ -354,6 +377,198 @@ static int lcc_receive (lcc_connection_t *c, /* {{{ */
   return (0);
 } /* }}} int lcc_receive */
 
+/* Parses the "name=value" lines of a successful GETVAL response. */
+static int lcc_parse_getval (lcc_connection_t *c, /* {{{ */
+    lcc_response_t *res, size_t *ret_values_num, gauge_t **ret_values,
+    char ***ret_values_names)
+{
+  size_t   values_num;
+  gauge_t *values = NULL;
+  char   **values_names = NULL;
+
+  size_t i;
+
+  values_num = res->lines_num;
+
+#define BAIL_OUT(e) do { \
+  lcc_set_errno (c, (e)); \
+  free (values); \
+  if (values_names != NULL) { \
+    for (i = 0; i < values_num; i++) { \
+      free (values_names[i]); \
+    } \
+  } \
+  free (values_names); \
+  return (-1); \
+} while (0)
+
+  /* If neither the values nor the names are requested, return here.. */
+  if ((ret_values == NULL) && (ret_values_names == NULL))
+  {
+    if (ret_values_num != NULL)
+      *ret_values_num = values_num;
+    return (0);
+  }
+
+  /* Allocate space for the values */
+  if (ret_values != NULL)
+  {
+    values = (gauge_t *) malloc (values_num * sizeof (*values));
+    if (values == NULL)
+      BAIL_OUT (ENOMEM);
+  }
+
+  if (ret_values_names != NULL)
+  {
+    values_names = (char **) calloc (values_num, sizeof (*values_names));
+    if (values_names == NULL)
+      BAIL_OUT (ENOMEM);
+  }
+
+  for (i = 0; i < res->lines_num; i++)
+  {
+    char *key;
+    char *value;
+    char *endptr;
+
+    key = res->lines[i];
+    value = strchr (key, '=');
+    if (value == NULL)
+      BAIL_OUT (EILSEQ);
+
+    *value = 0;
+    value++;
+
+    if (values != NULL)
+    {
+      endptr = NULL;
+      errno = 0;
+      values[i] = strtod (value, &endptr);
+
+      if ((endptr == value) || (errno != 0))
+        BAIL_OUT (errno);
+    }
+
+    if (values_names != NULL)
+    {
+      values_names[i] = strdup (key);
+      if (values_names[i] == NULL)
+        BAIL_OUT (ENOMEM);
+    }
+  } /* for (i = 0; i < res->lines_num; i++) */
+#undef BAIL_OUT
+
+  if (ret_values_num != NULL)
+    *ret_values_num = values_num;
+  if (ret_values != NULL)
+    *ret_values = values;
+  if (ret_values_names != NULL)
+    *ret_values_names = values_names;
+
+  return (0);
+} /* }}} int lcc_parse_getval */
+
+/* Reads the responses to all pipelined commands and passes them to their
+ * callbacks. Returns the number of commands which failed or less than zero
+ * if the responses could not be read. */
+static int lcc_receive_pending (lcc_connection_t *c) /* {{{ */
+{
+  int failed = 0;
+  size_t i;
+
+  if (c->pending_num == 0)
+    return (0);
+
+  if (fflush (c->fh) != 0)
+  {
+    lcc_set_errno (c, errno);
+    c->pending_num = 0;
+    return (-1);
+  }
+
+  for (i = 0; i < c->pending_num; i++)
+  {
+    lcc_pending_t *p = c->pending + i;
+    lcc_response_t res;
+
+    memset (&res, 0, sizeof (res));
+    if (lcc_receive (c, &res) != 0)
+    {
+      c->pending_num = 0;
+      return (-1);
+    }
+
+    if (res.status != 0)
+    {
+      LCC_SET_ERRSTR (c, "Server error: %s", res.message);
+      failed++;
+    }
+
+    if (p->getval_callback != NULL)
+    {
+      size_t   values_num = 0;
+      gauge_t *values = NULL;
+      char   **values_names = NULL;
+      size_t j;
+
+      if ((res.status == 0) && (lcc_parse_getval (c, &res,
+              &values_num, &values, &values_names) != 0))
+      {
+        res.status = -1;
+        SSTRCPY (res.message, lcc_strerror (c));
+        failed++;
+      }
+
+      (*p->getval_callback) (c, res.status, res.message,
+          values_num, values, values_names, p->user_data);
+
+      for (j = 0; j < values_num; j++)
+        free (values_names[j]);
+      free (values_names);
+      free (values);
+    }
+    else if (p->callback != NULL)
+      (*p->callback) (c, res.status, res.message, p->user_data);
+    lcc_response_free (&res);
+  }
+  c->pending_num = 0;
+
+  return (failed);
+} /* }}} int lcc_receive_pending */
+
+/* Sends a command without waiting for its response. The responses are read
+ * once LCC_PIPELINE_DEPTH commands are pending, or by lcc_wait(). */
+static int lcc_send_pipelined (lcc_connection_t *c, /* {{{ */
+    const char *command, lcc_callback_t callback,
+    lcc_getval_callback_t getval_callback, void *user_data)
+{
+  int status;
+
+  if (c->fh == NULL)
+  {
+    lcc_set_errno (c, EBADF);
+    return (-1);
+  }
+
+  if (c->pending_num >= LCC_PIPELINE_DEPTH)
+  {
+    status = lcc_receive_pending (c);
+    if (status < 0)
+      return (status);
+  }
+
+  status = lcc_send (c, command);
+  if (status != 0)
+    return (status);
+
+  c->pending[c->pending_num].callback = callback;
+  c->pending[c->pending_num].getval_callback = getval_callback;
+  c->pending[c->pending_num].user_data = user_data;
+  c->pending_num++;
+
+  return (0);
+} /* }}} int lcc_send_pipelined */
+
 static int lcc_sendreceive (lcc_connection_t *c, /* {{{ */
     const char *command, lcc_response_t *ret_res)
 {
@@ -366,6 +581,12 @@ static int lcc_sendreceive (lcc_connection_t *c, /* {{{ */
     return (-1);
   }
 
+  /* Responses arrive in order, so pipelined commands are finished first.
+   * Their failures have been reported to their callbacks. */
+  status = lcc_receive_pending (c);
+  if (status < 0)
+    return (status);
+
   status = lcc_send (c, command);
   if (status != 0)
     return (status);
@@ -378,6 +599,95 @@ static int lcc_sendreceive (lcc_connection_t *c, /* {{{ */
   return (status);
 } /* }}} int lcc_sendreceive */
 
+/* Maps the segment named by $COLLECTD_SHM, or the default one. Failing is not
+ * an error; GETVAL is sent to the daemon then. */
+static void lcc_shm_connect (lcc_connection_t *c) /* {{{ */
+{
+  const char *file = getenv ("COLLECTD_SHM");
+
+  if (c->shm.base != NULL)
+    lcc_shm_close (&c->shm);
+
+  if ((file != NULL) && (file[0] == 0))
+    return;
+
+  lcc_shm_open (&c->shm, file);
+} /* }}} void lcc_shm_connect */
+
+/* Answers GETVAL from the segment. Returns non-zero if the series isn't in
+ * it or its values are outdated, so that the caller asks the daemon. */
+static int lcc_getval_shm (lcc_connection_t *c, const char *ident_str, /* {{{ */
+    size_t *ret_values_num, gauge_t **ret_values, char ***ret_values_names)
+{
+  lcc_shm_slot_t slot;
+  struct timeval tv;
+  gauge_t *values = NULL;
+  char **values_names = NULL;
+  double now;
+  size_t i;
+  int index;
+
+  if (c->shm.base == NULL)
+    return (-1);
+
+  /* The daemon has shut down; it may have been restarted. */
+  if (c->shm.header->pid == 0)
+  {
+    lcc_shm_connect (c);
+    if (c->shm.base == NULL)
+      return (-1);
+  }
+
+  index = lcc_shm_find (&c->shm, ident_str);
+  if ((index < 0) || (lcc_shm_read (&c->shm, index, &slot) != 0))
+    return (-1);
+
+  /* Like the cache, values are outdated after two intervals. */
+  gettimeofday (&tv, /* timezone = */ NULL);
+  now = ((double) tv.tv_sec) + (((double) tv.tv_usec) / 1000000.0);
+  if ((slot.time == 0) || (now > (LCC_SHM_TIME_TO_DOUBLE (slot.time)
+          + 2.0 * LCC_SHM_TIME_TO_DOUBLE (slot.interval))))
+    return (-1);
+
+  if (ret_values != NULL)
+  {
+    values = malloc (slot.values_num * sizeof (*values));
+    if (values == NULL)
+      return (-1);
+    memcpy (values, slot.values, slot.values_num * sizeof (*values));
+  }
+
+  if (ret_values_names != NULL)
+  {
+    values_names = calloc (slot.values_num, sizeof (*values_names));
+    for (i = 0; (values_names != NULL) && (i < slot.values_num); i++)
+    {
+      slot.values_names[i][LCC_SHM_DS_NAME_LEN - 1] = 0;
+      values_names[i] = strdup (slot.values_names[i]);
+      if (values_names[i] == NULL)
+        break;
+    }
+
+    if ((values_names == NULL) || (i < slot.values_num))
+    {
+      if (values_names != NULL)
+        for (i = 0; i < slot.values_num; i++)
+          free (values_names[i]);
+      free (values_names);
+      free (values);
+      return (-1);
+    }
+  }
+
+  if (ret_values_num != NULL)
+    *ret_values_num = slot.values_num;
+  if (ret_values != NULL)
+    *ret_values = values;
+  if (ret_values_names != NULL)
+    *ret_values_names = values_names;
+  return (0);
+} /* }}} int lcc_getval_shm */
+
 static int lcc_open_unixsocket (lcc_connection_t *c, const char *path) /* {{{ */
 {
   struct sockaddr_un sa;
@@ -417,6 +727,9 @@ static int lcc_open_unixsocket (lcc_connection_t *c, const char *path) /* {{{ */
     return (-1);
   }
 
+  /* The daemon is local, so its values may be in shared memory. */
+  lcc_shm_connect (c);
+
   return (0);
 } /* }}} int lcc_open_unixsocket */
 
@@ -607,32 +920,24 @@ int lcc_disconnect (lcc_connection_t *c) /* {{{ */
 
   if (c->fh != NULL)
   {
+    lcc_receive_pending (c);
     fclose (c->fh);
     c->fh = NULL;
   }
 
+  lcc_shm_close (&c->shm);
+
   free (c);
   return (0);
 } /* }}} int lcc_disconnect */
 
-int lcc_getval (lcc_connection_t *c, lcc_identifier_t *ident, /* {{{ */
-    size_t *ret_values_num, gauge_t **ret_values, char ***ret_values_names)
+static int lcc_format_getval (lcc_connection_t *c, /* {{{ */
+    char *command, size_t command_size, char *ident_str,
+    size_t ident_str_size, const lcc_identifier_t *ident)
 {
-  char ident_str[6 * LCC_NAME_LEN];
   char ident_esc[12 * LCC_NAME_LEN];
-  char command[14 * LCC_NAME_LEN];
-
-  lcc_response_t res;
-  size_t   values_num;
-  gauge_t *values = NULL;
-  char   **values_names = NULL;
-
-  size_t i;
   int status;
 
-  if (c == NULL)
-    return (-1);
-
   if (ident == NULL)
   {
     lcc_set_errno (c, EINVAL);
@@ -640,13 +945,37 @@ int lcc_getval (lcc_connection_t *c, lcc_identifier_t *ident, /* {{{ */
   }
 
   /* Build a commend with an escaped version of the identifier string. */
-  status = lcc_identifier_to_string (c, ident_str, sizeof (ident_str), ident);
+  status = lcc_identifier_to_string (c, ident_str, ident_str_size, ident);
   if (status != 0)
     return (status);
 
-  snprintf (command, sizeof (command), "GETVAL %s",
+  snprintf (command, command_size, "GETVAL %s",
       lcc_strescape (ident_esc, ident_str, sizeof (ident_esc)));
-  command[sizeof (command) - 1] = 0;
+  command[command_size - 1] = 0;
+
+  return (0);
+} /* }}} int lcc_format_getval */
+
+int lcc_getval (lcc_connection_t *c, lcc_identifier_t *ident, /* {{{ */
+    size_t *ret_values_num, gauge_t **ret_values, char ***ret_values_names)
+{
+  char ident_str[6 * LCC_NAME_LEN];
+  char command[14 * LCC_NAME_LEN];
+
+  lcc_response_t res;
+  int status;
+
+  if (c == NULL)
+    return (-1);
+
+  status = lcc_format_getval (c, command, sizeof (command),
+      ident_str, sizeof (ident_str), ident);
+  if (status != 0)
+    return (status);
+
+  if (lcc_getval_shm (c, ident_str,
+        ret_values_num, ret_values, ret_values_names) == 0)
+    return (0);
 
   /* Send talk to the daemon.. */
   status = lcc_sendreceive (c, command, &res);
@@ -660,95 +989,47 @@ int lcc_getval (lcc_connection_t *c, lcc_identifier_t *ident, /* {{{ */
     return (-1);
   }
 
-  values_num = res.lines_num;
+  status = lcc_parse_getval (c, &res,
+      ret_values_num, ret_values, ret_values_names);
+  lcc_response_free (&res);
 
-#define BAIL_OUT(e) do { \
-  lcc_set_errno (c, (e)); \
-  free (values); \
-  if (values_names != NULL) { \
-    for (i = 0; i < values_num; i++) { \
-      free (values_names[i]); \
-    } \
-  } \
-  free (values_names); \
-  lcc_response_free (&res); \
-  return (-1); \
-} while (0)
+  return (status);
+} /* }}} int lcc_getval */
 
-  /* If neither the values nor the names are requested, return here.. */
-  if ((ret_values == NULL) && (ret_values_names == NULL))
-  {
-    if (ret_values_num != NULL)
-      *ret_values_num = values_num;
-    lcc_response_free (&res);
-    return (0);
-  }
+int lcc_getval_async (lcc_connection_t *c, /* {{{ */
+    const lcc_identifier_t *ident, lcc_getval_callback_t callback,
+    void *user_data)
+{
+  char ident_str[6 * LCC_NAME_LEN];
+  char command[14 * LCC_NAME_LEN];
+  int status;
 
-  /* Allocate space for the values */
-  if (ret_values != NULL)
-  {
-    values = (gauge_t *) malloc (values_num * sizeof (*values));
-    if (values == NULL)
-      BAIL_OUT (ENOMEM);
-  }
+  if (c == NULL)
+    return (-1);
 
-  if (ret_values_names != NULL)
+  if (callback == NULL)
   {
-    values_names = (char **) calloc (values_num, sizeof (*values_names));
-    if (values_names == NULL)
-      BAIL_OUT (ENOMEM);
+    lcc_set_errno (c, EINVAL);
+    return (-1);
   }
 
-  for (i = 0; i < res.lines_num; i++)
-  {
-    char *key;
-    char *value;
-    char *endptr;
-
-    key = res.lines[i];
-    value = strchr (key, '=');
-    if (value == NULL)
-      BAIL_OUT (EILSEQ);
-
-    *value = 0;
-    value++;
-
-    if (values != NULL)
-    {
-      endptr = NULL;
-      errno = 0;
-      values[i] = strtod (value, &endptr);
-
-      if ((endptr == value) || (errno != 0))
-        BAIL_OUT (errno);
-    }
-
-    if (values_names != NULL)
-    {
-      values_names[i] = strdup (key);
-      if (values_names[i] == NULL)
-        BAIL_OUT (ENOMEM);
-    }
-  } /* for (i = 0; i < res.lines_num; i++) */
-
-  if (ret_values_num != NULL)
-    *ret_values_num = values_num;
-  if (ret_values != NULL)
-    *ret_values = values;
-  if (ret_values_names != NULL)
-    *ret_values_names = values_names;
-
-  lcc_response_free (&res);
+  status = lcc_format_getval (c, command, sizeof (command),
+      ident_str, sizeof (ident_str), ident);
+  if (status != 0)
+    return (status);
 
-  return (0);
-} /* }}} int lcc_getval */
+  /* The shm segment is not consulted: The responses have to arrive in the
+   * order the commands were sent. */
+  return (lcc_send_pipelined (c, command,
+        /* callback = */ NULL, callback, user_data));
+} /* }}} int lcc_getval_async */
 
-int lcc_putval (lcc_connection_t *c, const lcc_value_list_t *vl) /* {{{ */
+static int lcc_format_putval (lcc_connection_t *c, /* {{{ */
+    char *command, size_t command_size, const lcc_value_list_t *vl)
 {
   char ident_str[6 * LCC_NAME_LEN];
   char ident_esc[12 * LCC_NAME_LEN];
-  char command[1024] = "";
-  lcc_response_t res;
+  char buffer[1024] = "";
   int status;
   size_t i;
 
@@ -764,35 +1045,52 @@ int lcc_putval (lcc_connection_t *c, const lcc_value_list_t *vl) /* {{{ */
   if (status != 0)
     return (status);
 
-  SSTRCATF (command, "PUTVAL %s",
+  SSTRCATF (buffer, "PUTVAL %s",
       lcc_strescape (ident_esc, ident_str, sizeof (ident_esc)));
 
   if (vl->interval > 0.0)
-    SSTRCATF (command, " interval=%.3f", vl->interval);
+    SSTRCATF (buffer, " interval=%.3f", vl->interval);
 
   if (vl->time > 0.0)
-    SSTRCATF (command, " %.3f", vl->time);
+    SSTRCATF (buffer, " %.3f", vl->time);
   else
-    SSTRCAT (command, " N");
+    SSTRCAT (buffer, " N");
 
   for (i = 0; i < vl->values_len; i++)
   {
     if (vl->values_types[i] == LCC_TYPE_COUNTER)
-      SSTRCATF (command, ":%"PRIu64, vl->values[i].counter);
+      SSTRCATF (buffer, ":%"PRIu64, vl->values[i].counter);
     else if (vl->values_types[i] == LCC_TYPE_GAUGE)
     {
       if (isnan (vl->values[i].gauge))
-        SSTRCATF (command, ":U");
+        SSTRCATF (buffer, ":U");
       else
-        SSTRCATF (command, ":%g", vl->values[i].gauge);
+        SSTRCATF (buffer, ":%g", vl->values[i].gauge);
     }
     else if (vl->values_types[i] == LCC_TYPE_DERIVE)
-	SSTRCATF (command, ":%"PRIu64, vl->values[i].derive);
+	SSTRCATF (buffer, ":%"PRIu64, vl->values[i].derive);
     else if (vl->values_types[i] == LCC_TYPE_ABSOLUTE)
-	SSTRCATF (command, ":%"PRIu64, vl->values[i].absolute);
+	SSTRCATF (buffer, ":%"PRIu64, vl->values[i].absolute);
 
   } /* for (i = 0; i < vl->values_len; i++) */
 
+  assert (command_size > 0);
+  strncpy (command, buffer, command_size);
+  command[command_size - 1] = 0;
+
+  return (0);
+} /* }}} int lcc_format_putval */
+
+int lcc_putval (lcc_connection_t *c, const lcc_value_list_t *vl) /* {{{ */
+{
+  char command[1024];
+  lcc_response_t res;
+  int status;
+
+  status = lcc_format_putval (c, command, sizeof (command), vl);
+  if (status != 0)
+    return (status);
+
   status = lcc_sendreceive (c, command, &res);
   if (status != 0)
     return (status);
@@ -808,29 +1106,96 @@ int lcc_putval (lcc_connection_t *c, const lcc_value_list_t *vl) /* {{{ */
   return (0);
 } /* }}} int lcc_putval */
 
-int lcc_flush (lcc_connection_t *c, const char *plugin, /* {{{ */
-    lcc_identifier_t *ident, int timeout)
+int lcc_putval_async (lcc_connection_t *c, /* {{{ */
+    const lcc_value_list_t *vl, lcc_callback_t callback, void *user_data)
 {
-  char command[1024] = "";
-  lcc_response_t res;
+  char command[1024];
   int status;
 
-  if (c == NULL)
+  status = lcc_format_putval (c, command, sizeof (command), vl);
+  if (status != 0)
+    return (status);
+
+  return (lcc_send_pipelined (c, command, callback,
+        /* getval_callback = */ NULL, user_data));
+} /* }}} int lcc_putval_async */
+
+int lcc_putval_bulk (lcc_connection_t *c, /* {{{ */
+    const lcc_value_list_t *vls, size_t vls_num)
+{
+  int failed = 0;
+  int status;
+  size_t i;
+
+  if ((c == NULL) || ((vls == NULL) && (vls_num > 0)))
   {
     lcc_set_errno (c, EINVAL);
     return (-1);
   }
 
-  SSTRCPY (command, "FLUSH");
+  for (i = 0; i < vls_num; i++)
+  {
+    char command[1024];
+
+    /* Invalid value lists are counted as failed and skipped. */
+    if (lcc_format_putval (c, command, sizeof (command), vls + i) != 0)
+    {
+      failed++;
+      continue;
+    }
+
+    if (c->pending_num >= LCC_PIPELINE_DEPTH)
+    {
+      status = lcc_receive_pending (c);
+      if (status < 0)
+        return (status);
+      failed += status;
+    }
+
+    status = lcc_send_pipelined (c, command, /* callback = */ NULL,
+        /* getval_callback = */ NULL, /* user_data = */ NULL);
+    if (status != 0)
+      return (status);
+  }
+
+  status = lcc_wait (c);
+  if (status < 0)
+    return (status);
+
+  return (failed + status);
+} /* }}} int lcc_putval_bulk */
+
+int lcc_wait (lcc_connection_t *c) /* {{{ */
+{
+  if (c == NULL)
+    return (-1);
+
+  if (c->fh == NULL)
+  {
+    lcc_set_errno (c, EBADF);
+    return (-1);
+  }
+
+  return (lcc_receive_pending (c));
+} /* }}} int lcc_wait */
+
+static int lcc_format_flush (lcc_connection_t *c, /* {{{ */
+    char *command, size_t command_size, const char *plugin,
+    const lcc_identifier_t *ident, int timeout)
+{
+  char buffer[1024] = "";
+  int status;
+
+  SSTRCPY (buffer, "FLUSH");
 
   if (timeout > 0)
-    SSTRCATF (command, " timeout=%i", timeout);
+    SSTRCATF (buffer, " timeout=%i", timeout);
 
   if (plugin != NULL)
   {
-    char buffer[2 * LCC_NAME_LEN];
-    SSTRCATF (command, " plugin=%s",
-        lcc_strescape (buffer, plugin, sizeof (buffer)));
+    char plugin_esc[2 * LCC_NAME_LEN];
+    SSTRCATF (buffer, " plugin=%s",
+        lcc_strescape (plugin_esc, plugin, sizeof (plugin_esc)));
   }
 
   if (ident != NULL)
@@ -842,10 +1207,35 @@ int lcc_flush (lcc_connection_t *c, const char *plugin, /* {{{ */
     if (status != 0)
       return (status);
 
-    SSTRCATF (command, " identifier=%s",
+    SSTRCATF (buffer, " identifier=%s",
         lcc_strescape (ident_esc, ident_str, sizeof (ident_esc)));
   }
 
+  assert (command_size > 0);
+  strncpy (command, buffer, command_size);
+  command[command_size - 1] = 0;
+
+  return (0);
+} /* }}} int lcc_format_flush */
+
+int lcc_flush (lcc_connection_t *c, const char *plugin, /* {{{ */
+    lcc_identifier_t *ident, int timeout)
+{
+  char command[1024];
+  lcc_response_t res;
+  int status;
+
+  if (c == NULL)
+  {
+    lcc_set_errno (c, EINVAL);
+    return (-1);
+  }
+
+  status = lcc_format_flush (c, command, sizeof (command),
+      plugin, ident, timeout);
+  if (status != 0)
+    return (status);
+
   status = lcc_sendreceive (c, command, &res);
   if (status != 0)
     return (status);
@@ -861,6 +1251,25 @@ int lcc_flush (lcc_connection_t *c, const char *plugin, /* {{{ */
   return (0);
 } /* }}} int lcc_flush */
 
+int lcc_flush_async (lcc_connection_t *c, const char *plugin, /* {{{ */
+    const lcc_identifier_t *ident, int timeout,
+    lcc_callback_t callback, void *user_data)
+{
+  char command[1024];
+  int status;
+
+  if (c == NULL)
+    return (-1);
+
+  status = lcc_format_flush (c, command, sizeof (command),
+      plugin, ident, timeout);
+  if (status != 0)
+    return (status);
+
+  return (lcc_send_pipelined (c, command, callback,
+        /* getval_callback = */ NULL, user_data));
+} /* }}} int lcc_flush_async */
+
 /* TODO: Implement lcc_putnotif */
 
 int lcc_listval (lcc_connection_t *c, /* {{{ */
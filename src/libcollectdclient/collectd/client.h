@@ -94,6 +94,19 @@ typedef struct lcc_value_list_s lcc_value_list_t;
 struct lcc_connection_s;
 typedef struct lcc_connection_s lcc_connection_t;
 
+/* Called with the status and message of the server's response to a command
+ * submitted with one of the *_async functions. "status" is zero if the
+ * command succeeded. */
+typedef void (*lcc_callback_t) (lcc_connection_t *c,
+    int status, const char *message, void *user_data);
+
+/* Called with the response to a command submitted with lcc_getval_async().
+ * The values and their names are only valid during the call and are freed
+ * afterwards. "values_num" is zero if "status" is non-zero. */
+typedef void (*lcc_getval_callback_t) (lcc_connection_t *c,
+    int status, const char *message, size_t values_num,
+    const gauge_t *values, char * const *values_names, void *user_data);
+
 /*
  * Functions
  */
@@ -104,11 +117,43 @@ int lcc_disconnect (lcc_connection_t *c);
 int lcc_getval (lcc_connection_t *c, lcc_identifier_t *ident,
     size_t *ret_values_num, gauge_t **ret_values, char ***ret_values_names);
 
+/* Sends a GETVAL command without waiting for the response, like
+ * lcc_putval_async(). The response is parsed and passed to "callback", which
+ * must not be NULL. Unlike lcc_getval(), the values are always read from the
+ * daemon, never from the shared memory segment of the shm plugin. */
+int lcc_getval_async (lcc_connection_t *c, const lcc_identifier_t *ident,
+    lcc_getval_callback_t callback, void *user_data);
+
 int lcc_putval (lcc_connection_t *c, const lcc_value_list_t *vl);
 
+/* Sends a PUTVAL command without waiting for the response. Up to 128
+ * commands are sent before the responses are read and passed to "callback",
+ * which may be NULL. Synchronous functions and lcc_wait() read all pending
+ * responses first. */
+int lcc_putval_async (lcc_connection_t *c, const lcc_value_list_t *vl,
+    lcc_callback_t callback, void *user_data);
+
+/* Submits all value lists using pipelined PUTVAL commands. Returns the
+ * number of value lists that were invalid or rejected by the server, or less
+ * than zero if the connection failed. lcc_strerror() describes the last
+ * failure. */
+int lcc_putval_bulk (lcc_connection_t *c,
+    const lcc_value_list_t *vls, size_t vls_num);
+
+/* Reads the responses to all commands sent with the *_async functions. Returns
+ * the number of commands that failed, or less than zero if the connection
+ * failed. */
+int lcc_wait (lcc_connection_t *c);
+
 int lcc_flush (lcc_connection_t *c, const char *plugin,
     lcc_identifier_t *ident, int timeout);
 
+/* Sends a FLUSH command without waiting for the response, like
+ * lcc_putval_async(). */
+int lcc_flush_async (lcc_connection_t *c, const char *plugin,
+    const lcc_identifier_t *ident, int timeout,
+    lcc_callback_t callback, void *user_data);
+
 int lcc_listval (lcc_connection_t *c,
     lcc_identifier_t **ret_ident, size_t *ret_ident_num);
 
@@ -74,6 +74,8 @@ int lcc_server_set_security_level (lcc_server_t *srv,
  */
 int lcc_network_values_send (lcc_network_t *net,
     const lcc_value_list_t *vl);
+/* Sends the values which are waiting for a network buffer to fill up. */
+int lcc_network_flush (lcc_network_t *net);
 #if 0
 int lcc_network_notification_send (lcc_network_t *net,
     const lcc_notification_t *notif);
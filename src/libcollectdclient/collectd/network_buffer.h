@@ -50,6 +50,13 @@ int lcc_network_buffer_finalize (lcc_network_buffer_t *nb);
 int lcc_network_buffer_add_value (lcc_network_buffer_t *nb,
     const lcc_value_list_t *vl);
 
+/* Adds value lists from "vls" until the buffer is full and stores how many
+ * have been added in "ret_num". Returns zero if all of them fit, ENOMEM if
+ * the buffer is full and EINVAL if a value list is invalid; in both cases
+ * "vls[*ret_num]" has not been added. */
+int lcc_network_buffer_add_values (lcc_network_buffer_t *nb,
+    const lcc_value_list_t *vls, size_t vls_num, size_t *ret_num);
+
 int lcc_network_buffer_get (lcc_network_buffer_t *nb,
     void *buffer, size_t *buffer_size);
 
@@ -0,0 +1,259 @@
+/**
+ * libcollectdclient - src/libcollectdclient/collectd/shm.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef LIBCOLLECTDCLIENT_SHM_H
+#define LIBCOLLECTDCLIENT_SHM_H 1
+
+/*
+ * Layout of the shared memory segment written by the "shm" plugin, and
+ * functions to read it. This header is the whole library, so that readers
+ * don't need to link against anything.
+ *
+ * The segment is a header, an index and an array of slots, one per series.
+ * Slots are never moved or freed and their names never change. The index is
+ * an open-addressing hash table of slot numbers plus one, filled in after
+ * the slot's name has been written. The values of a slot are protected by a
+ * sequence lock: its "seq" is odd while the writer updates it, and readers
+ * retry if it was odd or has changed while they copied the values.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define LCC_SHM_DEFAULT_FILE "/dev/shm/collectd"
+
+#define LCC_SHM_MAGIC   0x63647368 /* "cdsh" */
+#define LCC_SHM_VERSION 1
+
+#define LCC_SHM_NAME_LEN    512
+#define LCC_SHM_DS_NAME_LEN 32
+#define LCC_SHM_VALUES_MAX  16
+
+struct lcc_shm_header_s
+{
+  uint32_t magic;
+  uint32_t version;
+  /* Number of slots and of index entries, a power of two. */
+  uint32_t slots_num;
+  uint32_t index_size;
+  /* Number of slots in use; only grows. */
+  volatile uint32_t slots_used;
+  /* Process ID of the writer, zero once it has shut down. */
+  volatile uint32_t pid;
+};
+typedef struct lcc_shm_header_s lcc_shm_header_t;
+
+struct lcc_shm_slot_s
+{
+  volatile uint32_t seq;
+  uint32_t values_num;
+  /* In the daemon's time format, 2^-30 seconds. */
+  uint64_t time;
+  uint64_t interval;
+  double values[LCC_SHM_VALUES_MAX];
+  char values_names[LCC_SHM_VALUES_MAX][LCC_SHM_DS_NAME_LEN];
+  char name[LCC_SHM_NAME_LEN];
+};
+typedef struct lcc_shm_slot_s lcc_shm_slot_t;
+
+struct lcc_shm_s
+{
+  void *base;
+  size_t size;
+  const lcc_shm_header_t *header;
+  const volatile uint32_t *index;
+  const lcc_shm_slot_t *slots;
+};
+typedef struct lcc_shm_s lcc_shm_t;
+
+#define LCC_SHM_TIME_TO_DOUBLE(t) (((double) (t)) / 1073741824.0)
+
+/* Returns the size of a segment with "slots_num" slots. */
+static inline size_t lcc_shm_size (uint32_t slots_num, uint32_t index_size)
+{
+  size_t index_bytes = index_size * sizeof (uint32_t);
+
+  /* Keep the slots 8-byte aligned. */
+  index_bytes = (index_bytes + 7) & ~((size_t) 7);
+  return (sizeof (lcc_shm_header_t) + index_bytes
+      + slots_num * sizeof (lcc_shm_slot_t));
+}
+
+/* FNV-1a, used by the writer and the readers for the index. */
+static inline uint32_t lcc_shm_hash (const char *name)
+{
+  uint32_t hash = 2166136261U;
+
+  for (; *name != 0; name++)
+  {
+    hash ^= (uint32_t) (unsigned char) *name;
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+/* Sets the pointers into the mapped segment at "base". Returns zero if the
+ * segment is valid. */
+static inline int lcc_shm_attach (lcc_shm_t *shm, void *base, size_t size)
+{
+  const lcc_shm_header_t *h = base;
+  size_t index_bytes;
+
+  if ((size < sizeof (*h)) || (h->magic != LCC_SHM_MAGIC)
+      || (h->version != LCC_SHM_VERSION) || (h->index_size == 0)
+      || ((h->index_size & (h->index_size - 1)) != 0)
+      || (lcc_shm_size (h->slots_num, h->index_size) > size))
+    return (EINVAL);
+
+  index_bytes = (h->index_size * sizeof (uint32_t) + 7) & ~((size_t) 7);
+
+  shm->base = base;
+  shm->size = size;
+  shm->header = h;
+  shm->index = (const volatile uint32_t *) (h + 1);
+  shm->slots = (const lcc_shm_slot_t *) ((const char *) (h + 1) + index_bytes);
+  return (0);
+}
+
+/* Maps the segment read-only. Returns zero or an errno value. */
+static inline int lcc_shm_open (lcc_shm_t *shm, const char *file)
+{
+  struct stat statbuf;
+  void *base;
+  int fd;
+  int status;
+
+  memset (shm, 0, sizeof (*shm));
+  if (file == NULL)
+    file = LCC_SHM_DEFAULT_FILE;
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0)
+    return (errno);
+
+  if (fstat (fd, &statbuf) != 0)
+  {
+    status = errno;
+    close (fd);
+    return (status);
+  }
+
+  base = mmap (NULL, (size_t) statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  status = errno;
+  close (fd);
+  if (base == MAP_FAILED)
+    return (status);
+
+  status = lcc_shm_attach (shm, base, (size_t) statbuf.st_size);
+  if (status != 0)
+  {
+    munmap (base, (size_t) statbuf.st_size);
+    memset (shm, 0, sizeof (*shm));
+  }
+  return (status);
+}
+
+static inline void lcc_shm_close (lcc_shm_t *shm)
+{
+  if (shm->base != NULL)
+    munmap (shm->base, shm->size);
+  memset (shm, 0, sizeof (*shm));
+}
+
+/* Returns the slot of the series "name", as formatted by
+ * lcc_identifier_to_string(), or -1 if it isn't in the segment. */
+static inline int lcc_shm_find (const lcc_shm_t *shm, const char *name)
+{
+  uint32_t mask = shm->header->index_size - 1;
+  uint32_t pos = lcc_shm_hash (name) & mask;
+  uint32_t i;
+
+  for (i = 0; i <= mask; i++)
+  {
+    uint32_t entry = shm->index[(pos + i) & mask];
+
+    if (entry == 0)
+      return (-1);
+    /* Pairs with the barrier before the writer fills in the index. */
+    __sync_synchronize ();
+    if ((entry <= shm->header->slots_num)
+        && (strncmp (shm->slots[entry - 1].name, name,
+            LCC_SHM_NAME_LEN) == 0))
+      return ((int) (entry - 1));
+  }
+
+  return (-1);
+}
+
+/* Copies the values of "slot" into "ret_slot", without the name. Returns
+ * zero, or EAGAIN if the writer kept updating the slot. */
+static inline int lcc_shm_read (const lcc_shm_t *shm, int slot,
+    lcc_shm_slot_t *ret_slot)
+{
+  const lcc_shm_slot_t *s;
+  int tries;
+
+  if ((slot < 0) || ((uint32_t) slot >= shm->header->slots_num))
+    return (EINVAL);
+  s = shm->slots + slot;
+
+  for (tries = 0; tries < 1000; tries++)
+  {
+    uint32_t seq = s->seq;
+
+    if (seq & 1)
+      continue;
+    __sync_synchronize ();
+
+    ret_slot->values_num = s->values_num;
+    ret_slot->time = s->time;
+    ret_slot->interval = s->interval;
+    memcpy (ret_slot->values, s->values, sizeof (ret_slot->values));
+    memcpy (ret_slot->values_names, s->values_names,
+        sizeof (ret_slot->values_names));
+
+    __sync_synchronize ();
+    if (s->seq == seq)
+    {
+      ret_slot->seq = seq;
+      if (ret_slot->values_num > LCC_SHM_VALUES_MAX)
+        ret_slot->values_num = LCC_SHM_VALUES_MAX;
+      return (0);
+    }
+  }
+
+  return (EAGAIN);
+}
+
+#endif /* LIBCOLLECTDCLIENT_SHM_H */
+/* vim: set sw=2 sts=2 et : */
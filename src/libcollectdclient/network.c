@@ -67,6 +67,8 @@ struct lcc_server_s
   socklen_t sa_len;
 
   lcc_network_buffer_t *buffer;
+  /* Set while the buffer holds values which haven't been sent. */
+  _Bool buffer_used;
 
   lcc_server_t *next;
 };
@@ -216,6 +218,7 @@ static int server_send_buffer (lcc_server_t *srv) /* {{{ */
   lcc_network_buffer_finalize (srv->buffer);
   status = lcc_network_buffer_get (srv->buffer, buffer, &buffer_size);
   lcc_network_buffer_initialize (srv->buffer);
+  srv->buffer_used = 0;
 
   if (status != 0)
     return (status);
@@ -246,11 +249,15 @@ static int server_value_add (lcc_server_t *srv, /* {{{ */
   int status;
 
   status = lcc_network_buffer_add_value (srv->buffer, vl);
-  if (status == 0)
-    return (0);
+  if (status != 0)
+  {
+    server_send_buffer (srv);
+    status = lcc_network_buffer_add_value (srv->buffer, vl);
+  }
 
-  server_send_buffer (srv);
-  return (lcc_network_buffer_add_value (srv->buffer, vl));
+  if (status == 0)
+    srv->buffer_used = 1;
+  return (status);
 } /* }}} int server_value_add */
 
 /*
@@ -401,4 +408,27 @@ int lcc_network_values_send (lcc_network_t *net, /* {{{ */
   return (0);
 } /* }}} int lcc_network_values_send */
 
+int lcc_network_flush (lcc_network_t *net) /* {{{ */
+{
+  lcc_server_t *srv;
+  int status = 0;
+
+  if (net == NULL)
+    return (EINVAL);
+
+  for (srv = net->servers; srv != NULL; srv = srv->next)
+  {
+    int tmp;
+
+    if (!srv->buffer_used)
+      continue;
+
+    tmp = server_send_buffer (srv);
+    if (tmp != 0)
+      status = tmp;
+  }
+
+  return (status);
+} /* }}} int lcc_network_flush */
+
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -107,6 +107,8 @@ struct lcc_network_buffer_s
   char *password;
 
 #if HAVE_LIBGCRYPT
+  /* Both are set up with the password once and reused for all buffers. */
+  gcry_md_hd_t sign_hd;
   gcry_cipher_hd_t encr_cypher;
   size_t encr_header_len;
   char encr_iv[16];
@@ -262,16 +264,14 @@ static int nb_add_values (char **ret_buffer, /* {{{ */
   uint16_t      pkg_type;
   uint16_t      pkg_length;
   uint16_t      pkg_num_values;
-  uint8_t       pkg_values_types[vl->values_len];
-  value_t       pkg_values[vl->values_len];
 
-  size_t offset;
+  char *types_ptr;
+  char *values_ptr;
   size_t i;
 
   packet_len = sizeof (pkg_type) + sizeof (pkg_length)
     + sizeof (pkg_num_values)
-    + sizeof (pkg_values_types)
-    + sizeof (pkg_values);
+    + vl->values_len * (sizeof (uint8_t) + sizeof (value_t));
 
   if (*ret_buffer_len < packet_len)
     return (ENOMEM);
@@ -280,51 +280,51 @@ static int nb_add_values (char **ret_buffer, /* {{{ */
   pkg_length = htons ((uint16_t) packet_len);
   pkg_num_values = htons ((uint16_t) vl->values_len);
 
+  /*
+   * Use `memcpy' to write everything to the buffer, because the pointer
+   * may be unaligned and some architectures, such as SPARC, can't handle
+   * that. The values are converted straight into the buffer.
+   */
+  packet_ptr = *ret_buffer;
+  memcpy (packet_ptr, &pkg_type, sizeof (pkg_type));
+  memcpy (packet_ptr + sizeof (pkg_type), &pkg_length, sizeof (pkg_length));
+  memcpy (packet_ptr + sizeof (pkg_type) + sizeof (pkg_length),
+      &pkg_num_values, sizeof (pkg_num_values));
+
+  types_ptr = packet_ptr + sizeof (pkg_type) + sizeof (pkg_length)
+    + sizeof (pkg_num_values);
+  values_ptr = types_ptr + vl->values_len;
+
   for (i = 0; i < vl->values_len; i++)
   {
-    pkg_values_types[i] = (uint8_t) vl->values_types[i];
+    value_t pkg_value;
+
+    types_ptr[i] = (char) (uint8_t) vl->values_types[i];
     switch (vl->values_types[i])
     {
       case LCC_TYPE_COUNTER:
-        pkg_values[i].counter = (counter_t) htonll (vl->values[i].counter);
+        pkg_value.counter = (counter_t) htonll (vl->values[i].counter);
         break;
 
       case LCC_TYPE_GAUGE:
-        pkg_values[i].gauge = (gauge_t) htond (vl->values[i].gauge);
+        pkg_value.gauge = (gauge_t) htond (vl->values[i].gauge);
         break;
 
       case LCC_TYPE_DERIVE:
-        pkg_values[i].derive = (derive_t) htonll (vl->values[i].derive);
+        pkg_value.derive = (derive_t) htonll (vl->values[i].derive);
         break;
 
       case LCC_TYPE_ABSOLUTE:
-        pkg_values[i].absolute = (absolute_t) htonll (vl->values[i].absolute);
+        pkg_value.absolute = (absolute_t) htonll (vl->values[i].absolute);
         break;
 
       default:
         return (EINVAL);
     } /* switch (vl->values_types[i]) */
-  } /* for (vl->values_len) */
 
-  /*
-   * Use `memcpy' to write everything to the buffer, because the pointer
-   * may be unaligned and some architectures, such as SPARC, can't handle
-   * that.
-   */
-  packet_ptr = *ret_buffer;
-  offset = 0;
-  memcpy (packet_ptr + offset, &pkg_type, sizeof (pkg_type));
-  offset += sizeof (pkg_type);
-  memcpy (packet_ptr + offset, &pkg_length, sizeof (pkg_length));
-  offset += sizeof (pkg_length);
-  memcpy (packet_ptr + offset, &pkg_num_values, sizeof (pkg_num_values));
-  offset += sizeof (pkg_num_values);
-  memcpy (packet_ptr + offset, pkg_values_types, sizeof (pkg_values_types));
-  offset += sizeof (pkg_values_types);
-  memcpy (packet_ptr + offset, pkg_values, sizeof (pkg_values));
-  offset += sizeof (pkg_values);
-
-  assert (offset == packet_len);
+    memcpy (values_ptr + i * sizeof (pkg_value), &pkg_value,
+        sizeof (pkg_value));
+  } /* for (vl->values_len) */
 
   *ret_buffer = packet_ptr + packet_len;
   *ret_buffer_len -= packet_len;
@@ -419,6 +419,17 @@ static int nb_add_string (char **ret_buffer, /* {{{ */
   return (0);
 } /* }}} int nb_add_string */
 
+#define NB_HOST            0x01
+#define NB_PLUGIN          0x02
+#define NB_PLUGIN_INSTANCE 0x04
+#define NB_TYPE            0x08
+#define NB_TYPE_INSTANCE   0x10
+#define NB_TIME            0x20
+#define NB_INTERVAL        0x40
+
+/* Adds the parts of "vl" differing from the previous value list, and the
+ * values. The buffer and its state are only changed if everything fits, so
+ * a value list which doesn't fit can be added to the next buffer. */
 static int nb_add_value_list (lcc_network_buffer_t *nb, /* {{{ */
     const lcc_value_list_t *vl)
 {
@@ -427,6 +438,8 @@ static int nb_add_value_list (lcc_network_buffer_t *nb, /* {{{ */
 
   const lcc_identifier_t *ident_src;
   lcc_identifier_t *ident_dst;
+  int changed = 0;
+  int status;
 
   ident_src = &vl->identifier;
   ident_dst = &nb->state.identifier;
@@ -435,17 +448,16 @@ static int nb_add_value_list (lcc_network_buffer_t *nb, /* {{{ */
   {
     if (nb_add_string (&buffer, &buffer_size, TYPE_HOST,
           ident_src->host, strlen (ident_src->host)) != 0)
-      return (-1);
-    SSTRNCPY (ident_dst->host, ident_src->host, sizeof (ident_dst->host));
+      return (ENOMEM);
+    changed |= NB_HOST;
   }
 
   if (strcmp (ident_dst->plugin, ident_src->plugin) != 0)
   {
     if (nb_add_string (&buffer, &buffer_size, TYPE_PLUGIN,
           ident_src->plugin, strlen (ident_src->plugin)) != 0)
-      return (-1);
-    SSTRNCPY (ident_dst->plugin, ident_src->plugin,
-        sizeof (ident_dst->plugin));
+      return (ENOMEM);
+    changed |= NB_PLUGIN;
   }
 
   if (strcmp (ident_dst->plugin_instance,
@@ -454,17 +466,16 @@ static int nb_add_value_list (lcc_network_buffer_t *nb, /* {{{ */
     if (nb_add_string (&buffer, &buffer_size, TYPE_PLUGIN_INSTANCE,
           ident_src->plugin_instance,
           strlen (ident_src->plugin_instance)) != 0)
-      return (-1);
-    SSTRNCPY (ident_dst->plugin_instance, ident_src->plugin_instance,
-        sizeof (ident_dst->plugin_instance));
+      return (ENOMEM);
+    changed |= NB_PLUGIN_INSTANCE;
   }
 
   if (strcmp (ident_dst->type, ident_src->type) != 0)
   {
     if (nb_add_string (&buffer, &buffer_size, TYPE_TYPE,
           ident_src->type, strlen (ident_src->type)) != 0)
-      return (-1);
-    SSTRNCPY (ident_dst->type, ident_src->type, sizeof (ident_dst->type));
+      return (ENOMEM);
+    changed |= NB_TYPE;
   }
 
   if (strcmp (ident_dst->type_instance,
@@ -473,27 +484,45 @@ static int nb_add_value_list (lcc_network_buffer_t *nb, /* {{{ */
     if (nb_add_string (&buffer, &buffer_size, TYPE_TYPE_INSTANCE,
           ident_src->type_instance,
           strlen (ident_src->type_instance)) != 0)
-      return (-1);
-    SSTRNCPY (ident_dst->type_instance, ident_src->type_instance,
-        sizeof (ident_dst->type_instance));
+      return (ENOMEM);
+    changed |= NB_TYPE_INSTANCE;
   }
 
   if (nb->state.time != vl->time)
   {
     if (nb_add_time (&buffer, &buffer_size, TYPE_TIME_HR, vl->time))
-      return (-1);
-    nb->state.time = vl->time;
+      return (ENOMEM);
+    changed |= NB_TIME;
   }
 
   if (nb->state.interval != vl->interval)
   {
     if (nb_add_time (&buffer, &buffer_size, TYPE_INTERVAL_HR, vl->interval))
-      return (-1);
-    nb->state.interval = vl->interval;
+      return (ENOMEM);
+    changed |= NB_INTERVAL;
   }
 
-  if (nb_add_values (&buffer, &buffer_size, vl) != 0)
-    return (-1);
+  status = nb_add_values (&buffer, &buffer_size, vl);
+  if (status != 0)
+    return (status);
+
+  if (changed & NB_HOST)
+    SSTRNCPY (ident_dst->host, ident_src->host, sizeof (ident_dst->host));
+  if (changed & NB_PLUGIN)
+    SSTRNCPY (ident_dst->plugin, ident_src->plugin,
+        sizeof (ident_dst->plugin));
+  if (changed & NB_PLUGIN_INSTANCE)
+    SSTRNCPY (ident_dst->plugin_instance, ident_src->plugin_instance,
+        sizeof (ident_dst->plugin_instance));
+  if (changed & NB_TYPE)
+    SSTRNCPY (ident_dst->type, ident_src->type, sizeof (ident_dst->type));
+  if (changed & NB_TYPE_INSTANCE)
+    SSTRNCPY (ident_dst->type_instance, ident_src->type_instance,
+        sizeof (ident_dst->type_instance));
+  if (changed & NB_TIME)
+    nb->state.time = vl->time;
+  if (changed & NB_INTERVAL)
+    nb->state.interval = vl->interval;
 
   nb->ptr = buffer;
   nb->free = buffer_size;
@@ -506,7 +535,6 @@ static int nb_add_signature (lcc_network_buffer_t *nb) /* {{{ */
   char *buffer;
   size_t buffer_size;
 
-  gcry_md_hd_t hd;
   gcry_error_t err;
   unsigned char *hash;
   const size_t hash_length = 32;
@@ -519,31 +547,42 @@ static int nb_add_signature (lcc_network_buffer_t *nb) /* {{{ */
   assert (nb->size >= (nb->free + PART_SIGNATURE_SHA256_SIZE));
   buffer_size = nb->size - (nb->free + PART_SIGNATURE_SHA256_SIZE);
 
-  hd = NULL;
-  err = gcry_md_open (&hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
-  if (err != 0)
-    return (-1);
+  if (nb->sign_hd == NULL)
+  {
+    err = gcry_md_open (&nb->sign_hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+    if (err != 0)
+    {
+      nb->sign_hd = NULL;
+      return (-1);
+    }
 
-  assert (nb->password != NULL);
-  err = gcry_md_setkey (hd, nb->password, strlen (nb->password));
-  if (err != 0)
+    assert (nb->password != NULL);
+    err = gcry_md_setkey (nb->sign_hd, nb->password, strlen (nb->password));
+    if (err != 0)
+    {
+      gcry_md_close (nb->sign_hd);
+      nb->sign_hd = NULL;
+      return (-1);
+    }
+  }
+  else
   {
-    gcry_md_close (hd);
-    return (-1);
+    /* Resetting an HMAC keeps the key. */
+    gcry_md_reset (nb->sign_hd);
   }
 
-  gcry_md_write (hd, buffer, buffer_size);
-  hash = gcry_md_read (hd, GCRY_MD_SHA256);
+  gcry_md_write (nb->sign_hd, buffer, buffer_size);
+  hash = gcry_md_read (nb->sign_hd, GCRY_MD_SHA256);
   if (hash == NULL)
   {
-    gcry_md_close (hd);
+    gcry_md_close (nb->sign_hd);
+    nb->sign_hd = NULL;
     return (-1);
   }
 
   assert (((2 * sizeof (uint16_t)) + hash_length) == PART_SIGNATURE_SHA256_SIZE);
   memcpy (nb->buffer + (2 * sizeof (uint16_t)), hash, hash_length);
 
-  gcry_md_close (hd);
   return (0);
 } /* }}} int nb_add_signature */
 
@@ -565,8 +604,9 @@ static int nb_add_encryption (lcc_network_buffer_t *nb) /* {{{ */
   pkg_length = htons ((uint16_t) package_length);
   memcpy (nb->buffer + 2, &pkg_length, sizeof (pkg_length));
 
-  /* Calculate what to hash */
-  hash_ptr = nb->buffer + PART_ENCRYPTION_AES256_SIZE;
+  /* Calculate what to hash: everything after the header, which includes
+   * the username. */
+  hash_ptr = nb->buffer + nb->encr_header_len;
   hash_size = package_length - nb->encr_header_len;
 
   /* Calculate what to encrypt */
@@ -629,6 +669,23 @@ static int nb_add_encryption (lcc_network_buffer_t *nb) /* {{{ */
 } /* }}} int nb_add_encryption */
 #endif
 
+/* Closes the crypto contexts, which depend on the password. */
+static void nb_free_crypto (lcc_network_buffer_t *nb) /* {{{ */
+{
+#if HAVE_LIBGCRYPT
+  if (nb->sign_hd != NULL)
+  {
+    gcry_md_close (nb->sign_hd);
+    nb->sign_hd = NULL;
+  }
+  if (nb->encr_cypher != NULL)
+  {
+    gcry_cipher_close (nb->encr_cypher);
+    nb->encr_cypher = NULL;
+  }
+#endif
+} /* }}} void nb_free_crypto */
+
 /*
  * Public functions
  */
@@ -674,6 +731,9 @@ void lcc_network_buffer_destroy (lcc_network_buffer_t *nb) /* {{{ */
   if (nb == NULL)
     return;
 
+  nb_free_crypto (nb);
+  free (nb->username);
+  free (nb->password);
   free (nb->buffer);
   free (nb);
 } /* }}} void lcc_network_buffer_destroy */
@@ -685,6 +745,8 @@ int lcc_network_buffer_set_security_level (lcc_network_buffer_t *nb, /* {{{ */
   char *username_copy;
   char *password_copy;
 
+  nb_free_crypto (nb);
+
   if (level == NONE)
   {
     free (nb->username);
@@ -723,7 +785,7 @@ int lcc_network_buffer_initialize (lcc_network_buffer_t *nb) /* {{{ */
   if (nb == NULL)
     return (EINVAL);
 
-  memset (nb->buffer, 0, nb->size);
+  /* Only the used part of the buffer is ever read, so it is not cleared. */
   memset (&nb->state, 0, sizeof (nb->state));
   nb->ptr = nb->buffer;
   nb->free = nb->size;
@@ -760,8 +822,9 @@ int lcc_network_buffer_initialize (lcc_network_buffer_t *nb) /* {{{ */
     nb->encr_header_len = username_length;
     nb->encr_header_len += PART_ENCRYPTION_AES256_SIZE;
 
-    gcry_randomize ((void *) &nb->encr_iv, sizeof (nb->encr_iv),
-        GCRY_STRONG_RANDOM);
+    /* The IV only has to be unique, which the nonce generator guarantees
+     * without draining the entropy pool for every buffer. */
+    gcry_create_nonce ((void *) &nb->encr_iv, sizeof (nb->encr_iv));
 
     /* Filled in in finalize. */
     memset (hash, 0, sizeof (hash));
@@ -806,6 +869,26 @@ int lcc_network_buffer_add_value (lcc_network_buffer_t *nb, /* {{{ */
   return (status);
 } /* }}} int lcc_network_buffer_add_value */
 
+int lcc_network_buffer_add_values (lcc_network_buffer_t *nb, /* {{{ */
+    const lcc_value_list_t *vls, size_t vls_num, size_t *ret_num)
+{
+  size_t i;
+  int status = 0;
+
+  if ((nb == NULL) || ((vls == NULL) && (vls_num > 0)) || (ret_num == NULL))
+    return (EINVAL);
+
+  for (i = 0; i < vls_num; i++)
+  {
+    status = nb_add_value_list (nb, vls + i);
+    if (status != 0)
+      break;
+  }
+
+  *ret_num = i;
+  return (status);
+} /* }}} int lcc_network_buffer_add_values */
+
 int lcc_network_buffer_get (lcc_network_buffer_t *nb, /* {{{ */
     void *buffer, size_t *buffer_size)
 {
@@ -5,6 +5,8 @@ struct statement_list_s
 {
 	oconfig_item_t *statement;
 	int             statement_num;
+	/* Number of elements allocated in "statement". */
+	int             statement_alloc;
 };
 typedef struct statement_list_s statement_list_t;
 
@@ -12,6 +14,8 @@ struct argument_list_s
 {
 	oconfig_value_t *argument;
 	int              argument_num;
+	/* Number of elements allocated in "argument". */
+	int              argument_alloc;
 };
 typedef struct argument_list_s argument_list_t;
 
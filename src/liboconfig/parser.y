@@ -24,6 +24,7 @@
 
 static char *unquote (const char *orig);
 static int yyerror (const char *s);
+static void *array_grow (void *array, int num, int *alloc, size_t size);
 
 /* Lexer variables */
 extern int yylineno;
@@ -85,15 +86,17 @@ argument_list:
 	argument_list argument
 	{
 	 $$ = $1;
+	 $$.argument = array_grow ($$.argument, $$.argument_num,
+		&$$.argument_alloc, sizeof (oconfig_value_t));
+	 $$.argument[$$.argument_num] = $2;
 	 $$.argument_num++;
-	 $$.argument = realloc ($$.argument, $$.argument_num * sizeof (oconfig_value_t));
-	 $$.argument[$$.argument_num-1] = $2;
 	}
 	| argument
 	{
 	 $$.argument = malloc (sizeof (oconfig_value_t));
 	 $$.argument[0] = $1;
 	 $$.argument_num = 1;
+	 $$.argument_alloc = 1;
 	}
 	;
 
@@ -175,9 +178,10 @@ statement_list:
 	 $$ = $1;
 	 if (($2.values_num > 0) || ($2.children_num > 0))
 	 {
+		 $$.statement = array_grow ($$.statement, $$.statement_num,
+			&$$.statement_alloc, sizeof (oconfig_item_t));
+		 $$.statement[$$.statement_num] = $2;
 		 $$.statement_num++;
-		 $$.statement = realloc ($$.statement, $$.statement_num * sizeof (oconfig_item_t));
-		 $$.statement[$$.statement_num-1] = $2;
 	 }
 	}
 	| statement
@@ -187,11 +191,13 @@ statement_list:
 		 $$.statement = malloc (sizeof (oconfig_item_t));
 		 $$.statement[0] = $1;
 		 $$.statement_num = 1;
+		 $$.statement_alloc = 1;
 	 }
 	 else
 	 {
 	 	$$.statement = NULL;
 		$$.statement_num = 0;
+		$$.statement_alloc = 0;
 	 }
 	}
 	;
@@ -228,11 +234,35 @@ static int yyerror (const char *s)
 	return (-1);
 } /* int yyerror */
 
+/* Makes room for one more element in "array", which holds "num" elements.
+ * The allocation is doubled when full, so that long lists of statements and
+ * arguments are built in linear time. */
+static void *array_grow (void *array, int num, int *alloc, size_t size)
+{
+	void *tmp;
+	int new_alloc;
+
+	if (num < *alloc)
+		return (array);
+
+	new_alloc = (*alloc > 0) ? (2 * *alloc) : 4;
+	tmp = realloc (array, new_alloc * size);
+	if (tmp == NULL)
+	{
+		yyerror ("realloc failed");
+		exit (1);
+	}
+
+	*alloc = new_alloc;
+	return (tmp);
+} /* void *array_grow */
+
 static char *unquote (const char *orig)
 {
 	char *ret = strdup (orig);
 	int len;
 	int i;
+	int j;
 
 	if (ret == NULL)
 		return (NULL);
@@ -242,18 +272,18 @@ static char *unquote (const char *orig)
 	if ((len < 2) || (ret[0] != '"') || (ret[len - 1] != '"'))
 		return (ret);
 
+	/* Drop the quotes and the backslashes in one pass. */
 	len -= 2;
-	memmove (ret, ret + 1, len);
-	ret[len] = '\0';
-
-	for (i = 0; i < len; i++)
+	for (i = 0, j = 1; i < len; i++, j++)
 	{
-		if (ret[i] == '\\')
+		if (ret[j] == '\\')
 		{
-			memmove (ret + i, ret + (i + 1), len - i);
+			j++;
 			len--;
 		}
+		ret[i] = ret[j];
 	}
+	ret[len] = '\0';
 
 	return (ret);
 } /* char *unquote */
@@ -26,6 +26,8 @@
 #include "utils_ignorelist.h"
 #include "utils_complain.h"
 
+#include <pthread.h>
+
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
 #include <libxml/parser.h>
@@ -45,6 +47,8 @@ static const char *config_keys[] = {
     "HostnameFormat",
     "InterfaceFormat",
 
+    "Threads",
+
     NULL
 };
 #define NR_CONFIG_KEYS ((sizeof config_keys / sizeof config_keys[0]) - 1)
@@ -57,6 +61,33 @@ static c_complain_t conn_complain = C_COMPLAIN_INIT_STATIC;
 /* Seconds between list refreshes, 0 disables completely. */
 static int interval = 60;
 
+/* Number of threads querying the domains if bulk statistics are not
+ * available. */
+static int read_threads = 1;
+
+/* virDomainListGetStats(3) was added in libvirt 1.2.8. The daemon may still
+ * be older, so this is cleared when it doesn't support the call. */
+#if LIBVIR_VERSION_NUMBER >= 1002008
+static _Bool bulk_stats = 1;
+#endif
+
+/* Domain events. The lists are refreshed when domains are started or stopped
+ * or devices are removed, rather than every `RefreshInterval' seconds. */
+static pthread_t event_thread_id;
+static _Bool event_thread_running = 0;
+static _Bool event_thread_loop = 0;
+static int event_timer = -1;
+static int event_lifecycle_cb = -1;
+static _Bool event_register_failed = 0;
+#if LIBVIR_VERSION_NUMBER >= 1001001
+static int event_device_removed_cb = -1;
+#endif
+#if LIBVIR_VERSION_NUMBER >= 1003003
+static int event_device_added_cb = -1;
+#endif
+static _Bool lists_dirty = 0;
+static pthread_mutex_t lists_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* List of domains, if specified. */
 static ignorelist_t *il_domains = NULL;
 /* List of block devices, if specified. */
@@ -235,13 +266,167 @@ submit_derive2 (const char *type, derive_t v0, derive_t v1,
     plugin_dispatch_values (&vl);
 } /* void submit_derive2 */
 
+static const char *
+interface_display_name (const struct interface_device *dev)
+{
+    switch (interface_format) {
+        case if_address:
+            return dev->address;
+        case if_number:
+            return dev->number;
+        case if_name:
+        default:
+            return dev->path;
+    }
+} /* const char *interface_display_name */
+
+static void
+lists_dirty_set (void)
+{
+    pthread_mutex_lock (&lists_dirty_lock);
+    lists_dirty = 1;
+    pthread_mutex_unlock (&lists_dirty_lock);
+}
+
+/* Returns and clears the flag set by the event callbacks. */
+static _Bool
+lists_dirty_get (void)
+{
+    _Bool ret;
+
+    pthread_mutex_lock (&lists_dirty_lock);
+    ret = lists_dirty;
+    lists_dirty = 0;
+    pthread_mutex_unlock (&lists_dirty_lock);
+
+    return ret;
+}
+
+static void
+lv_event_lifecycle (virConnectPtr c, virDomainPtr dom,
+                    int event, int detail, void *opaque)
+{
+    /* Only running domains are collected. */
+    if ((event == VIR_DOMAIN_EVENT_STARTED)
+            || (event == VIR_DOMAIN_EVENT_STOPPED))
+        lists_dirty_set ();
+}
+
+#if LIBVIR_VERSION_NUMBER >= 1001001
+static void
+lv_event_device (virConnectPtr c, virDomainPtr dom,
+                 const char *dev_alias, void *opaque)
+{
+    lists_dirty_set ();
+}
+#endif
+
+static void
+lv_event_timeout (int timer, void *opaque)
+{
+    /* Only there to make virEventRunDefaultImpl() return regularly. */
+}
+
+static void *
+lv_event_thread (void *arg)
+{
+    while (event_thread_loop) {
+        if (virEventRunDefaultImpl () < 0) {
+            VIRT_ERROR (NULL, "libvirt plugin: virEventRunDefaultImpl");
+            break;
+        }
+    }
+
+    return NULL;
+} /* void *lv_event_thread */
+
+static void
+lv_event_register (void)
+{
+    if (!event_thread_running || (event_lifecycle_cb >= 0)
+            || event_register_failed)
+        return;
+
+    event_lifecycle_cb = virConnectDomainEventRegisterAny (conn,
+            /* dom = */ NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+            VIR_DOMAIN_EVENT_CALLBACK (lv_event_lifecycle),
+            /* opaque = */ NULL, /* freecb = */ NULL);
+    if (event_lifecycle_cb < 0) {
+        event_register_failed = 1;
+        INFO ("libvirt plugin: Registering for domain events failed. "
+                "Refreshing the lists every %i seconds.", interval);
+        return;
+    }
+
+#if LIBVIR_VERSION_NUMBER >= 1001001
+    event_device_removed_cb = virConnectDomainEventRegisterAny (conn,
+            NULL, VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED,
+            VIR_DOMAIN_EVENT_CALLBACK (lv_event_device), NULL, NULL);
+#endif
+#if LIBVIR_VERSION_NUMBER >= 1003003
+    event_device_added_cb = virConnectDomainEventRegisterAny (conn,
+            NULL, VIR_DOMAIN_EVENT_ID_DEVICE_ADDED,
+            VIR_DOMAIN_EVENT_CALLBACK (lv_event_device), NULL, NULL);
+#endif
+} /* void lv_event_register */
+
+static void
+lv_disconnect (void)
+{
+    if (conn == NULL)
+        return;
+
+    if (event_lifecycle_cb >= 0)
+        virConnectDomainEventDeregisterAny (conn, event_lifecycle_cb);
+    event_lifecycle_cb = -1;
+#if LIBVIR_VERSION_NUMBER >= 1001001
+    if (event_device_removed_cb >= 0)
+        virConnectDomainEventDeregisterAny (conn, event_device_removed_cb);
+    event_device_removed_cb = -1;
+#endif
+#if LIBVIR_VERSION_NUMBER >= 1003003
+    if (event_device_added_cb >= 0)
+        virConnectDomainEventDeregisterAny (conn, event_device_added_cb);
+    event_device_added_cb = -1;
+#endif
+
+    event_register_failed = 0;
+
+    virConnectClose (conn);
+    conn = NULL;
+} /* void lv_disconnect */
+
 static int
 lv_init (void)
 {
+    int status;
+
     if (virInitialize () != 0)
         return -1;
 
-	return 0;
+    if (event_thread_running)
+        return 0;
+
+    /* Must be done before the connection is opened. */
+    if (virEventRegisterDefaultImpl () != 0) {
+        VIRT_ERROR (NULL, "libvirt plugin: virEventRegisterDefaultImpl");
+        return 0;
+    }
+
+    event_timer = virEventAddTimeout (/* ms = */ 1000, lv_event_timeout,
+            /* opaque = */ NULL, /* freecb = */ NULL);
+
+    event_thread_loop = 1;
+    status = plugin_thread_create (&event_thread_id, /* attr = */ NULL,
+            lv_event_thread, /* arg = */ NULL);
+    if (status != 0) {
+        ERROR ("libvirt plugin: Starting the event thread failed.");
+        event_thread_loop = 0;
+        return 0;
+    }
+    event_thread_running = 1;
+
+    return 0;
 }
 
 static int
@@ -357,160 +542,375 @@ lv_config (const char *key, const char *value)
         return 0;
     }
 
+    if (strcasecmp (key, "Threads") == 0) {
+        char *eptr = NULL;
+        int tmp = (int) strtol (value, &eptr, 10);
+        if (eptr == NULL || *eptr != '\0' || tmp < 1) {
+            ERROR ("libvirt plugin: Threads must be a positive number.");
+            return -1;
+        }
+        read_threads = tmp;
+        return 0;
+    }
+
     /* Unrecognised option. */
     return -1;
 }
 
+static void
+lv_read_domain (virDomainPtr dom)
+{
+    virDomainInfo info;
+    virVcpuInfoPtr vinfo = NULL;
+    int status;
+    int j;
+
+    status = virDomainGetInfo (dom, &info);
+    if (status != 0)
+    {
+        ERROR ("libvirt plugin: virDomainGetInfo failed with status %i.",
+                status);
+        return;
+    }
+
+    cpu_submit (info.cpuTime, dom, "virt_cpu_total");
+
+    vinfo = malloc (info.nrVirtCpu * sizeof (vinfo[0]));
+    if (vinfo == NULL) {
+        ERROR ("libvirt plugin: malloc failed.");
+        return;
+    }
+
+    status = virDomainGetVcpus (dom, vinfo, info.nrVirtCpu,
+            /* cpu map = */ NULL, /* cpu map length = */ 0);
+    if (status < 0)
+    {
+        ERROR ("libvirt plugin: virDomainGetVcpus failed with status %i.",
+                status);
+        free (vinfo);
+        return;
+    }
+
+    for (j = 0; j < info.nrVirtCpu; ++j)
+        vcpu_submit (vinfo[j].cpuTime,
+                dom, vinfo[j].number, "virt_vcpu");
+
+    sfree (vinfo);
+} /* void lv_read_domain */
+
+static void
+lv_read_block_device (const struct block_device *dev)
+{
+    struct _virDomainBlockStats stats;
+
+    if (virDomainBlockStats (dev->dom, dev->path,
+                &stats, sizeof stats) != 0)
+        return;
+
+    if ((stats.rd_req != -1) && (stats.wr_req != -1))
+        submit_derive2 ("disk_ops",
+                (derive_t) stats.rd_req, (derive_t) stats.wr_req,
+                dev->dom, dev->path);
+
+    if ((stats.rd_bytes != -1) && (stats.wr_bytes != -1))
+        submit_derive2 ("disk_octets",
+                (derive_t) stats.rd_bytes, (derive_t) stats.wr_bytes,
+                dev->dom, dev->path);
+} /* void lv_read_block_device */
+
+static void
+lv_read_interface_device (const struct interface_device *dev)
+{
+    struct _virDomainInterfaceStats stats;
+    const char *display_name = interface_display_name (dev);
+
+    if (virDomainInterfaceStats (dev->dom, dev->path,
+                &stats, sizeof stats) != 0)
+        return;
+
+    if ((stats.rx_bytes != -1) && (stats.tx_bytes != -1))
+        submit_derive2 ("if_octets",
+                (derive_t) stats.rx_bytes, (derive_t) stats.tx_bytes,
+                dev->dom, display_name);
+
+    if ((stats.rx_packets != -1) && (stats.tx_packets != -1))
+        submit_derive2 ("if_packets",
+                (derive_t) stats.rx_packets, (derive_t) stats.tx_packets,
+                dev->dom, display_name);
+
+    if ((stats.rx_errs != -1) && (stats.tx_errs != -1))
+        submit_derive2 ("if_errors",
+                (derive_t) stats.rx_errs, (derive_t) stats.tx_errs,
+                dev->dom, display_name);
+
+    if ((stats.rx_drop != -1) && (stats.tx_drop != -1))
+        submit_derive2 ("if_dropped",
+                (derive_t) stats.rx_drop, (derive_t) stats.tx_drop,
+                dev->dom, display_name);
+} /* void lv_read_interface_device */
+
+/* Worker `n' of `read_threads' handles every read_threads-th domain and
+ * device, starting at index `n'. The remote driver multiplexes the calls of
+ * all threads over the one connection. */
+static void *
+lv_read_worker (void *arg)
+{
+    int n = (int) (intptr_t) arg;
+    int i;
+
+    for (i = n; i < nr_domains; i += read_threads)
+        lv_read_domain (domains[i]);
+
+    for (i = n; i < nr_block_devices; i += read_threads)
+        lv_read_block_device (block_devices + i);
+
+    for (i = n; i < nr_interface_devices; i += read_threads)
+        lv_read_interface_device (interface_devices + i);
+
+    return NULL;
+} /* void *lv_read_worker */
+
 static int
-lv_read (void)
+lv_read_parallel (void)
 {
-    time_t t;
+    pthread_t threads[read_threads];
+    _Bool started[read_threads];
     int i;
 
-    if (conn == NULL) {
-        /* `conn_string == NULL' is acceptable. */
-        conn = virConnectOpenReadOnly (conn_string);
-        if (conn == NULL) {
-            c_complain (LOG_ERR, &conn_complain,
-                    "libvirt plugin: Unable to connect: "
-                    "virConnectOpenReadOnly failed.");
-            return -1;
-        }
-    }
-    c_release (LOG_NOTICE, &conn_complain,
-            "libvirt plugin: Connection established.");
+    /* The calling thread is worker zero. */
+    for (i = 1; i < read_threads; i++)
+        started[i] = (plugin_thread_create (threads + i, /* attr = */ NULL,
+                    lv_read_worker, (void *) (intptr_t) i) == 0);
 
-    time (&t);
+    lv_read_worker ((void *) 0);
 
-    /* Need to refresh domain or device lists? */
-    if ((last_refresh == (time_t) 0) ||
-            ((interval > 0) && ((last_refresh + interval) <= t))) {
-        if (refresh_lists () != 0) {
-            if (conn != NULL)
-                virConnectClose (conn);
-            conn = NULL;
-            return -1;
-        }
-        last_refresh = t;
+    for (i = 1; i < read_threads; i++) {
+        if (started[i])
+            pthread_join (threads[i], /* retval = */ NULL);
+        else
+            lv_read_worker ((void *) (intptr_t) i);
     }
 
-#if 0
-    for (i = 0; i < nr_domains; ++i)
-        fprintf (stderr, "domain %s\n", virDomainGetName (domains[i]));
-    for (i = 0; i < nr_block_devices; ++i)
-        fprintf  (stderr, "block device %d %s:%s\n",
-                  i, virDomainGetName (block_devices[i].dom),
-                  block_devices[i].path);
-    for (i = 0; i < nr_interface_devices; ++i)
-        fprintf (stderr, "interface device %d %s:%s\n",
-                 i, virDomainGetName (interface_devices[i].dom),
-                 interface_devices[i].path);
-#endif
+    return 0;
+} /* int lv_read_parallel */
 
-    /* Get CPU usage, VCPU usage for each domain. */
-    for (i = 0; i < nr_domains; ++i) {
-        virDomainInfo info;
-        virVcpuInfoPtr vinfo = NULL;
-        int status;
-        int j;
+#if LIBVIR_VERSION_NUMBER >= 1002008
+/* The virDomainPtr objects of the records aren't necessarily the ones passed
+ * in, so domains are compared by UUID. */
+static _Bool
+lv_domain_equal (virDomainPtr a, virDomainPtr b)
+{
+    unsigned char uuid_a[VIR_UUID_BUFLEN];
+    unsigned char uuid_b[VIR_UUID_BUFLEN];
 
-        status = virDomainGetInfo (domains[i], &info);
-        if (status != 0)
-        {
-            ERROR ("libvirt plugin: virDomainGetInfo failed with status %i.",
-                    status);
-            continue;
-        }
+    if (a == b)
+        return 1;
 
-        cpu_submit (info.cpuTime, domains[i], "virt_cpu_total");
+    if ((virDomainGetUUID (a, uuid_a) != 0)
+            || (virDomainGetUUID (b, uuid_b) != 0))
+        return 0;
 
-        vinfo = malloc (info.nrVirtCpu * sizeof (vinfo[0]));
-        if (vinfo == NULL) {
-            ERROR ("libvirt plugin: malloc failed.");
-            continue;
-        }
+    return memcmp (uuid_a, uuid_b, sizeof (uuid_a)) == 0;
+}
 
-        status = virDomainGetVcpus (domains[i], vinfo, info.nrVirtCpu,
-                /* cpu map = */ NULL, /* cpu map length = */ 0);
-        if (status < 0)
-        {
-            ERROR ("libvirt plugin: virDomainGetVcpus failed with status %i.",
-                    status);
-            free (vinfo);
-            continue;
-        }
+static int
+lv_record_get_pair (const virDomainStatsRecordPtr r,
+        const char *prefix, unsigned int index,
+        const char *field0, const char *field1,
+        derive_t *ret0, derive_t *ret1)
+{
+    char name[DATA_MAX_NAME_LEN];
+    unsigned long long v0;
+    unsigned long long v1;
+
+    ssnprintf (name, sizeof (name), "%s.%u.%s", prefix, index, field0);
+    if (virTypedParamsGetULLong (r->params, r->nparams, name, &v0) != 1)
+        return -1;
 
-        for (j = 0; j < info.nrVirtCpu; ++j)
-            vcpu_submit (vinfo[j].cpuTime,
-                    domains[i], vinfo[j].number, "virt_vcpu");
+    ssnprintf (name, sizeof (name), "%s.%u.%s", prefix, index, field1);
+    if (virTypedParamsGetULLong (r->params, r->nparams, name, &v1) != 1)
+        return -1;
+
+    *ret0 = (derive_t) v0;
+    *ret1 = (derive_t) v1;
+    return 0;
+}
 
-        sfree (vinfo);
+static void
+lv_submit_record (const virDomainStatsRecordPtr r)
+{
+    char name[DATA_MAX_NAME_LEN];
+    unsigned long long cpu_time;
+    unsigned int count;
+    unsigned int i;
+    int j;
+
+    if (virTypedParamsGetULLong (r->params, r->nparams,
+                "cpu.time", &cpu_time) == 1)
+        cpu_submit (cpu_time, r->dom, "virt_cpu_total");
+
+    count = 0;
+    virTypedParamsGetUInt (r->params, r->nparams, "vcpu.maximum", &count);
+    for (i = 0; i < count; i++) {
+        ssnprintf (name, sizeof (name), "vcpu.%u.time", i);
+        if (virTypedParamsGetULLong (r->params, r->nparams,
+                    name, &cpu_time) == 1)
+            vcpu_submit ((derive_t) cpu_time, r->dom, (int) i, "virt_vcpu");
     }
 
-    /* Get block device stats for each domain. */
-    for (i = 0; i < nr_block_devices; ++i) {
-        struct _virDomainBlockStats stats;
+    count = 0;
+    virTypedParamsGetUInt (r->params, r->nparams, "block.count", &count);
+    for (i = 0; i < count; i++) {
+        const char *path = NULL;
+        derive_t v0, v1;
 
-        if (virDomainBlockStats (block_devices[i].dom, block_devices[i].path,
-                    &stats, sizeof stats) != 0)
+        ssnprintf (name, sizeof (name), "block.%u.name", i);
+        if (virTypedParamsGetString (r->params, r->nparams,
+                    name, &path) != 1)
             continue;
 
-        if ((stats.rd_req != -1) && (stats.wr_req != -1))
-            submit_derive2 ("disk_ops",
-                    (derive_t) stats.rd_req, (derive_t) stats.wr_req,
-                    block_devices[i].dom, block_devices[i].path);
+        /* Only devices which made it onto the list are collected. */
+        for (j = 0; j < nr_block_devices; j++)
+            if ((strcmp (block_devices[j].path, path) == 0)
+                    && lv_domain_equal (block_devices[j].dom, r->dom))
+                break;
+        if (j >= nr_block_devices)
+            continue;
 
-        if ((stats.rd_bytes != -1) && (stats.wr_bytes != -1))
-            submit_derive2 ("disk_octets",
-                    (derive_t) stats.rd_bytes, (derive_t) stats.wr_bytes,
-                    block_devices[i].dom, block_devices[i].path);
-    } /* for (nr_block_devices) */
+        if (lv_record_get_pair (r, "block", i, "rd.reqs", "wr.reqs",
+                    &v0, &v1) == 0)
+            submit_derive2 ("disk_ops", v0, v1, r->dom, path);
+        if (lv_record_get_pair (r, "block", i, "rd.bytes", "wr.bytes",
+                    &v0, &v1) == 0)
+            submit_derive2 ("disk_octets", v0, v1, r->dom, path);
+    }
 
-    /* Get interface stats for each domain. */
-    for (i = 0; i < nr_interface_devices; ++i) {
-        struct _virDomainInterfaceStats stats;
-        char *display_name = NULL;
+    count = 0;
+    virTypedParamsGetUInt (r->params, r->nparams, "net.count", &count);
+    for (i = 0; i < count; i++) {
+        const char *path = NULL;
+        const char *display_name;
+        derive_t v0, v1;
 
+        ssnprintf (name, sizeof (name), "net.%u.name", i);
+        if (virTypedParamsGetString (r->params, r->nparams,
+                    name, &path) != 1)
+            continue;
 
-        switch (interface_format) {
-            case if_address:
-                display_name = interface_devices[i].address;
-                break;
-            case if_number:
-                display_name = interface_devices[i].number;
+        for (j = 0; j < nr_interface_devices; j++)
+            if ((strcmp (interface_devices[j].path, path) == 0)
+                    && lv_domain_equal (interface_devices[j].dom, r->dom))
                 break;
-            case if_name:
-            default:
-                display_name = interface_devices[i].path;
-        }
-
-        if (virDomainInterfaceStats (interface_devices[i].dom,
-                    interface_devices[i].path,
-                    &stats, sizeof stats) != 0)
+        if (j >= nr_interface_devices)
             continue;
+        display_name = interface_display_name (interface_devices + j);
+
+        if (lv_record_get_pair (r, "net", i, "rx.bytes", "tx.bytes",
+                    &v0, &v1) == 0)
+            submit_derive2 ("if_octets", v0, v1, r->dom, display_name);
+        if (lv_record_get_pair (r, "net", i, "rx.pkts", "tx.pkts",
+                    &v0, &v1) == 0)
+            submit_derive2 ("if_packets", v0, v1, r->dom, display_name);
+        if (lv_record_get_pair (r, "net", i, "rx.errs", "tx.errs",
+                    &v0, &v1) == 0)
+            submit_derive2 ("if_errors", v0, v1, r->dom, display_name);
+        if (lv_record_get_pair (r, "net", i, "rx.drop", "tx.drop",
+                    &v0, &v1) == 0)
+            submit_derive2 ("if_dropped", v0, v1, r->dom, display_name);
+    }
+} /* void lv_submit_record */
 
-	if ((stats.rx_bytes != -1) && (stats.tx_bytes != -1))
-	    submit_derive2 ("if_octets",
-		    (derive_t) stats.rx_bytes, (derive_t) stats.tx_bytes,
-		    interface_devices[i].dom, display_name);
+/* Fetches the statistics of all domains with one call. Returns non-zero if
+ * the caller should fall back to querying the domains one by one. */
+static int
+lv_read_bulk (void)
+{
+    virDomainPtr *list;
+    virDomainStatsRecordPtr *records = NULL;
+    int status;
+    int i;
 
-	if ((stats.rx_packets != -1) && (stats.tx_packets != -1))
-	    submit_derive2 ("if_packets",
-		    (derive_t) stats.rx_packets, (derive_t) stats.tx_packets,
-		    interface_devices[i].dom, display_name);
+    if (nr_domains < 1)
+        return 0;
 
-	if ((stats.rx_errs != -1) && (stats.tx_errs != -1))
-	    submit_derive2 ("if_errors",
-		    (derive_t) stats.rx_errs, (derive_t) stats.tx_errs,
-		    interface_devices[i].dom, display_name);
+    /* virDomainListGetStats() expects a NULL terminated list. */
+    list = calloc (nr_domains + 1, sizeof (*list));
+    if (list == NULL) {
+        ERROR ("libvirt plugin: calloc failed.");
+        return -1;
+    }
+    memcpy (list, domains, nr_domains * sizeof (*list));
+
+    status = virDomainListGetStats (list,
+            VIR_DOMAIN_STATS_CPU_TOTAL | VIR_DOMAIN_STATS_VCPU
+            | VIR_DOMAIN_STATS_INTERFACE | VIR_DOMAIN_STATS_BLOCK,
+            &records, /* flags = */ 0);
+    sfree (list);
+
+    if (status < 0) {
+        virErrorPtr err = virConnGetLastError (conn);
+
+        if ((err != NULL) && (err->code == VIR_ERR_NO_SUPPORT)) {
+            INFO ("libvirt plugin: The hypervisor doesn't support bulk "
+                    "statistics. Querying domains one by one.");
+            bulk_stats = 0;
+        } else {
+            VIRT_ERROR (conn, "libvirt plugin: virDomainListGetStats");
+            /* Probably a domain went away. */
+            lists_dirty_set ();
+        }
+        return -1;
+    }
 
-	if ((stats.rx_drop != -1) && (stats.tx_drop != -1))
-	    submit_derive2 ("if_dropped",
-		    (derive_t) stats.rx_drop, (derive_t) stats.tx_drop,
-		    interface_devices[i].dom, display_name);
-    } /* for (nr_interface_devices) */
+    for (i = 0; i < status; i++)
+        lv_submit_record (records[i]);
 
+    virDomainStatsRecordListFree (records);
     return 0;
+} /* int lv_read_bulk */
+#endif /* LIBVIR_VERSION_NUMBER >= 1002008 */
+
+static int
+lv_read (void)
+{
+    time_t t;
+
+    if (conn == NULL) {
+        /* `conn_string == NULL' is acceptable. */
+        conn = virConnectOpenReadOnly (conn_string);
+        if (conn == NULL) {
+            c_complain (LOG_ERR, &conn_complain,
+                    "libvirt plugin: Unable to connect: "
+                    "virConnectOpenReadOnly failed.");
+            return -1;
+        }
+    }
+    c_release (LOG_NOTICE, &conn_complain,
+            "libvirt plugin: Connection established.");
+
+    time (&t);
+
+    lv_event_register ();
+
+    /* Need to refresh domain or device lists? With domain events, the
+     * lists are refreshed when domains or devices come and go. */
+    if (lists_dirty_get () || (last_refresh == (time_t) 0) ||
+            ((event_lifecycle_cb < 0) && (interval > 0)
+             && ((last_refresh + interval) <= t))) {
+        if (refresh_lists () != 0) {
+            lv_disconnect ();
+            return -1;
+        }
+        last_refresh = t;
+    }
+
+    /* Get CPU usage, VCPU usage and device stats for each domain. */
+#if LIBVIR_VERSION_NUMBER >= 1002008
+    if (bulk_stats && (lv_read_bulk () == 0))
+        return 0;
+#endif
+
+    return lv_read_parallel ();
 }
 
 static int
@@ -826,9 +1226,16 @@ lv_shutdown (void)
     free_interface_devices ();
     free_domains ();
 
-    if (conn != NULL)
-        virConnectClose (conn);
-    conn = NULL;
+    lv_disconnect ();
+
+    if (event_thread_running) {
+        event_thread_loop = 0;
+        pthread_join (event_thread_id, /* retval = */ NULL);
+        event_thread_running = 0;
+    }
+    if (event_timer >= 0)
+        virEventRemoveTimeout (event_timer);
+    event_timer = -1;
 
     ignorelist_free (il_domains);
     il_domains = NULL;
@@ -49,6 +49,10 @@
 # include <libperfstat.h>
 #endif /* HAVE_PERFSTAT */
 
+#if !defined(HAVE_GETLOADAVG) && defined(KERNEL_LINUX)
+static pread_file_t *pf_loadavg = NULL;
+#endif
+
 static void load_submit (gauge_t snum, gauge_t mnum, gauge_t lnum)
 {
 	value_t values[3];
@@ -84,37 +88,23 @@ static int load_read (void)
 
 #elif defined(KERNEL_LINUX)
 	gauge_t snum, mnum, lnum;
-	FILE *loadavg;
-	char buffer[16];
+	char *buffer;
 
 	char *fields[8];
 	int numfields;
 
-	if ((loadavg = fopen ("/proc/loadavg", "r")) == NULL)
-	{
-		char errbuf[1024];
-		WARNING ("load: fopen: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
-	}
+	if (pf_loadavg == NULL)
+		pf_loadavg = pread_file_create ("/proc/loadavg");
 
-	if (fgets (buffer, 16, loadavg) == NULL)
+	if ((buffer = pread_file_read (pf_loadavg, NULL)) == NULL)
 	{
 		char errbuf[1024];
-		WARNING ("load: fgets: %s",
+		WARNING ("load: Reading /proc/loadavg failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (loadavg);
 		return (-1);
 	}
 
-	if (fclose (loadavg))
-	{
-		char errbuf[1024];
-		WARNING ("load: fclose: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-	}
-
-	numfields = strsplit (buffer, fields, 8);
+	numfields = strsplit_line (&buffer, fields, 8);
 
 	if (numfields < 3)
 		return (-1);
@@ -166,7 +156,20 @@ static int load_read (void)
 	return (0);
 }
 
+#if !defined(HAVE_GETLOADAVG) && defined(KERNEL_LINUX)
+static int load_shutdown (void)
+{
+	pread_file_destroy (pf_loadavg);
+	pf_loadavg = NULL;
+
+	return (0);
+}
+#endif
+
 void module_register (void)
 {
 	plugin_register_read ("load", load_read);
+#if !defined(HAVE_GETLOADAVG) && defined(KERNEL_LINUX)
+	plugin_register_shutdown ("load", load_shutdown);
+#endif
 } /* void module_register */
@@ -0,0 +1,210 @@
+/**
+ * collectd - src/match_deadband.c
+ * Copyright (C) 2013  Florian Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "utils_cache.h"
+#include "filter_chain.h"
+
+/*
+ * Matches values which are within a tolerance of the values last passed on,
+ * so that they can be dropped with the "stop" target. The comparison uses the
+ * rates in the value cache, so the match only works in the "PostCache"
+ * chain. The values passed on are kept in the cache entry as well.
+ */
+
+/*
+ * private data types
+ */
+struct mdb_match_s;
+typedef struct mdb_match_s mdb_match_t;
+struct mdb_match_s
+{
+  double absolute;
+  /* Fraction of the value last passed on, not percent. */
+  double relative;
+  /* Number of intervals after which a value is passed on regardless. */
+  int heartbeat;
+};
+
+/*
+ * internal helper functions
+ */
+static _Bool mdb_within (const mdb_match_t *m, /* {{{ */
+    gauge_t value, gauge_t emitted)
+{
+  gauge_t diff;
+
+  if (isnan (value) || isnan (emitted))
+    return (isnan (value) && isnan (emitted));
+
+  diff = fabs (value - emitted);
+  if (diff == 0.0)
+    return (1);
+  if ((m->absolute > 0.0) && (diff <= m->absolute))
+    return (1);
+  if ((m->relative > 0.0) && (diff <= m->relative * fabs (emitted)))
+    return (1);
+
+  return (0);
+} /* }}} _Bool mdb_within */
+
+static int mdb_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
+{
+  mdb_match_t *m;
+  double percent = 0.0;
+  int status;
+  int i;
+
+  m = (mdb_match_t *) malloc (sizeof (*m));
+  if (m == NULL)
+  {
+    ERROR ("mdb_create: malloc failed.");
+    return (-ENOMEM);
+  }
+  memset (m, 0, sizeof (*m));
+
+  m->absolute = 0.0;
+  m->relative = 0.0;
+  m->heartbeat = 10;
+
+  status = 0;
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Absolute", child->key) == 0)
+      status = cf_util_get_double (child, &m->absolute);
+    else if (strcasecmp ("Relative", child->key) == 0)
+      status = cf_util_get_double (child, &percent);
+    else if (strcasecmp ("Heartbeat", child->key) == 0)
+      status = cf_util_get_int (child, &m->heartbeat);
+    else
+    {
+      ERROR ("deadband match: The `%s' configuration option is not "
+          "understood and will be ignored.", child->key);
+      status = 0;
+    }
+
+    if (status != 0)
+      break;
+  }
+
+  /* Additional sanity-checking */
+  while (status == 0)
+  {
+    if ((m->absolute < 0.0) || (percent < 0.0))
+    {
+      ERROR ("deadband match: `Absolute' and `Relative' must not be "
+          "negative. This match will be ignored.");
+      status = -1;
+    }
+    else if (m->heartbeat < 1)
+    {
+      ERROR ("deadband match: `Heartbeat' must be at least 1. "
+          "This match will be ignored.");
+      status = -1;
+    }
+
+    break;
+  }
+
+  if (status != 0)
+  {
+    free (m);
+    return (status);
+  }
+
+  m->relative = percent / 100.0;
+
+  *user_data = m;
+  return (0);
+} /* }}} int mdb_create */
+
+static int mdb_destroy (void **user_data) /* {{{ */
+{
+  if (user_data != NULL)
+  {
+    sfree (*user_data);
+  }
+
+  return (0);
+} /* }}} int mdb_destroy */
+
+static int mdb_match (const data_set_t *ds, /* {{{ */
+    const value_list_t *vl,
+    notification_meta_t __attribute__((unused)) **meta, void **user_data)
+{
+  mdb_match_t *m;
+  uc_handle_t h;
+  size_t values_num;
+  gauge_t values[ds->ds_num];
+  gauge_t emitted[ds->ds_num];
+  cdtime_t emitted_time = 0;
+  _Bool within;
+  size_t i;
+
+  if ((user_data == NULL) || (*user_data == NULL))
+    return (-1);
+
+  m = *user_data;
+  values_num = (size_t) ds->ds_num;
+
+  if (uc_get_handle (vl, &h) != 0)
+    return (FC_MATCH_NO_MATCH);
+
+  if (uc_handle_get_rate (&h, values, values_num) != 0)
+  {
+    uc_handle_release (&h);
+    return (FC_MATCH_NO_MATCH);
+  }
+
+  within = (uc_handle_get_emitted (&h, emitted, values_num,
+        &emitted_time) == 0);
+
+  /* A value is passed on at least every "heartbeat" intervals, so that
+   * readers relying on regular updates don't consider the series stale. */
+  if (within && (vl->time >= emitted_time + m->heartbeat * vl->interval))
+    within = 0;
+
+  for (i = 0; within && (i < values_num); i++)
+    within = mdb_within (m, values[i], emitted[i]);
+
+  if (!within)
+    uc_handle_set_emitted (&h, values, values_num, vl->time);
+
+  uc_handle_release (&h);
+
+  return (within ? FC_MATCH_MATCHES : FC_MATCH_NO_MATCH);
+} /* }}} int mdb_match */
+
+void module_register (void)
+{
+  match_proc_t mproc;
+
+  memset (&mproc, 0, sizeof (mproc));
+  mproc.create  = mdb_create;
+  mproc.destroy = mdb_destroy;
+  mproc.match   = mdb_match;
+  fc_register_match ("deadband", mproc);
+} /* module_register */
+
+/* vim: set sw=2 sts=2 tw=78 et fdm=marker : */
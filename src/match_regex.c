@@ -45,6 +45,9 @@ struct mr_regex_s
 {
 	regex_t re;
 	char *re_str;
+	/* Set if "re_str" matches exactly one string, see mr_literal(). Such
+	 * expressions are evaluated with strcmp(3) instead of regexec(3). */
+	char *literal;
 
 	mr_regex_t *next;
 };
@@ -59,6 +62,11 @@ struct mr_match_s
 	mr_regex_t *type;
 	mr_regex_t *type_instance;
 	_Bool invert;
+
+	/* Set if one of the plugin or type expressions only matches a single
+	 * string, see mr_literal(). */
+	char *plugin_literal;
+	char *type_literal;
 };
 
 /*
@@ -72,6 +80,7 @@ static void mr_free_regex (mr_regex_t *r) /* {{{ */
 	regfree (&r->re);
 	memset (&r->re, 0, sizeof (r->re));
 	free (r->re_str);
+	free (r->literal);
 
 	if (r->next != NULL)
 		mr_free_regex (r->next);
@@ -87,6 +96,8 @@ static void mr_free_match (mr_match_t *m) /* {{{ */
 	mr_free_regex (m->plugin_instance);
 	mr_free_regex (m->type);
 	mr_free_regex (m->type_instance);
+	free (m->plugin_literal);
+	free (m->type_literal);
 
 	free (m);
 } /* }}} void mr_free_match */
@@ -103,9 +114,12 @@ static int mr_match_regexen (mr_regex_t *re_head, /* {{{ */
 	{
 		int status;
 
-		status = regexec (&re->re, string,
-				/* nmatch = */ 0, /* pmatch = */ NULL,
-				/* eflags = */ 0);
+		if (re->literal != NULL)
+			status = strcmp (re->literal, string);
+		else
+			status = regexec (&re->re, string,
+					/* nmatch = */ 0, /* pmatch = */ NULL,
+					/* eflags = */ 0);
 		if (status == 0)
 		{
 			DEBUG ("regex match: Regular expression `%s' matches `%s'.",
@@ -123,6 +137,57 @@ static int mr_match_regexen (mr_regex_t *re_head, /* {{{ */
 	return (FC_MATCH_MATCHES);
 } /* }}} int mr_match_regexen */
 
+/* Returns the string matched by expressions such as "^cpu$" or
+ * "^foo\\.bar$", which match exactly one string, or NULL if the expression
+ * isn't of this form. */
+static char *mr_literal (const char *re_str) /* {{{ */
+{
+	char buffer[DATA_MAX_NAME_LEN];
+	size_t len = 0;
+	const char *ptr;
+
+	if (re_str[0] != '^')
+		return (NULL);
+
+	for (ptr = re_str + 1; *ptr != 0; ptr++)
+	{
+		if ((ptr[0] == '$') && (ptr[1] == 0))
+			break;
+
+		if (len >= sizeof (buffer) - 1)
+			return (NULL);
+
+		if (ptr[0] == '\\')
+		{
+			/* Escaped special characters stand for themselves. Other
+			 * escapes may be extensions, such as "\\<" in GNU libc. */
+			if ((ptr[1] == 0)
+					|| (strchr (".[]()*+?{}|^$\\", ptr[1]) == NULL))
+				return (NULL);
+			ptr++;
+		}
+		else if (strchr (".[]()*+?{}|^$", ptr[0]) != NULL)
+			return (NULL);
+
+		buffer[len++] = ptr[0];
+	}
+
+	if (*ptr != '$')
+		return (NULL);
+
+	buffer[len] = 0;
+	return (strdup (buffer));
+} /* }}} char *mr_literal */
+
+/* Remembers the first literal expression of "re_head". */
+static void mr_set_literal (char **literal, mr_regex_t *re_head) /* {{{ */
+{
+	mr_regex_t *re;
+
+	for (re = re_head; (re != NULL) && (*literal == NULL); re = re->next)
+		*literal = mr_literal (re->re_str);
+} /* }}} void mr_set_literal */
+
 static int mr_config_add_regex (mr_regex_t **re_head, /* {{{ */
 		oconfig_item_t *ci)
 {
@@ -165,6 +230,8 @@ static int mr_config_add_regex (mr_regex_t **re_head, /* {{{ */
 		return (-1);
 	}
 
+	re->literal = mr_literal (re->re_str);
+
 	if (*re_head == NULL)
 	{
 		*re_head = re;
@@ -251,6 +318,13 @@ static int mr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
 		return (status);
 	}
 
+	/* An inverted match succeeds for all other strings. */
+	if (!m->invert)
+	{
+		mr_set_literal (&m->plugin_literal, m->plugin);
+		mr_set_literal (&m->type_literal, m->type);
+	}
+
 	*user_data = m;
 	return (0);
 } /* }}} int mr_create */
@@ -298,6 +372,21 @@ static int mr_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
 	return (match_value);
 } /* }}} int mr_match */
 
+static int mr_constraints (void **user_data, /* {{{ */
+		fc_match_constraints_t *ret)
+{
+	mr_match_t *m;
+
+	if ((user_data == NULL) || (*user_data == NULL))
+		return (-1);
+
+	m = *user_data;
+	ret->plugin = m->plugin_literal;
+	ret->type = m->type_literal;
+
+	return (0);
+} /* }}} int mr_constraints */
+
 void module_register (void)
 {
 	match_proc_t mproc;
@@ -306,6 +395,8 @@ void module_register (void)
 	mproc.create  = mr_create;
 	mproc.destroy = mr_destroy;
 	mproc.match   = mr_match;
+	mproc.flags   = FC_MATCH_IDENTIFIER_ONLY;
+	mproc.constraints = mr_constraints;
 	fc_register_match ("regex", mproc);
 } /* module_register */
 
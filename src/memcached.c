@@ -48,6 +48,9 @@ struct memcached_s
   char *socket;
   char *host;
   char *port;
+
+  /* The connection is kept open between reads. -1 if not connected. */
+  int fd;
 };
 typedef struct memcached_s memcached_t;
 
@@ -58,10 +61,18 @@ static void memcached_free (memcached_t *st)
   if (st == NULL)
     return;
 
+  if (st->fd >= 0)
+  {
+    shutdown (st->fd, SHUT_RDWR);
+    close (st->fd);
+    st->fd = -1;
+  }
+
   sfree (st->name);
   sfree (st->socket);
   sfree (st->host);
   sfree (st->port);
+  sfree (st);
 }
 
 static int memcached_connect_unix (memcached_t *st)
@@ -84,6 +95,15 @@ static int memcached_connect_unix (memcached_t *st)
     return (-1);
   }
 
+  if (connect (fd, (struct sockaddr *) &serv_addr, sizeof (serv_addr)) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("memcached plugin: memcached_connect_unix: connect(%s) failed: %s",
+        st->socket, sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    return (-1);
+  }
+
   return (fd);
 } /* int memcached_connect_unix */
 
@@ -162,38 +182,53 @@ static int memcached_connect (memcached_t *st)
     return (memcached_connect_inet (st));
 }
 
-static int memcached_query_daemon (char *buffer, size_t buffer_size, memcached_t *st)
+static void memcached_disconnect (memcached_t *st)
 {
-  int fd = -1;
-  int status;
-  size_t buffer_fill;
+  if (st->fd < 0)
+    return;
 
-  fd = memcached_connect (st);
-  if (fd < 0) {
-    ERROR ("memcached plugin: Instance \"%s\" could not connect to daemon.",
-        st->name);
-    return -1;
-  }
+  shutdown (st->fd, SHUT_RDWR);
+  close (st->fd);
+  st->fd = -1;
+} /* void memcached_disconnect */
 
-  status = (int) swrite (fd, "stats\r\n", strlen ("stats\r\n"));
-  if (status != 0)
+/* Sends "stats" over the open connection and receives the response. If an
+ * error occurs, the connection cannot be used any further and has to be
+ * closed by the caller. Errors are only logged if `verbose' is true. */
+static int memcached_query_stats (char *buffer, size_t buffer_size,
+    memcached_t *st, _Bool verbose)
+{
+  char const end_token[5] = {'E', 'N', 'D', '\r', '\n'};
+  size_t buffer_fill;
+  ssize_t status;
+
+  if (swrite (st->fd, "stats\r\n", strlen ("stats\r\n")) != 0)
   {
     char errbuf[1024];
-    ERROR ("memcached plugin: write(2) failed: %s",
-        sstrerror (errno, errbuf, sizeof (errbuf)));
-    shutdown(fd, SHUT_RDWR);
-    close (fd);
+    if (verbose)
+      ERROR ("memcached plugin: write(2) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
-  /* receive data from the memcached daemon */
+  /* receive data from the memcached daemon, leaving room for the
+   * terminating null byte */
   memset (buffer, 0, buffer_size);
 
   buffer_fill = 0;
-  while ((status = (int) recv (fd, buffer + buffer_fill,
-          buffer_size - buffer_fill, /* flags = */ 0)) != 0)
+  while (42)
   {
-    char const end_token[5] = {'E', 'N', 'D', '\r', '\n'};
+    if (buffer_fill >= buffer_size - 1)
+    {
+      /* The rest of the response is still waiting to be received, so the
+       * connection can't be used for the next read. */
+      WARNING ("memcached plugin: Message was truncated.");
+      memcached_disconnect (st);
+      return (0);
+    }
+
+    status = recv (st->fd, buffer + buffer_fill,
+        buffer_size - 1 - buffer_fill, /* flags = */ 0);
     if (status < 0)
     {
       char errbuf[1024];
@@ -201,37 +236,65 @@ static int memcached_query_daemon (char *buffer, size_t buffer_size, memcached_t
       if ((errno == EAGAIN) || (errno == EINTR))
           continue;
 
-      ERROR ("memcached: Error reading from socket: %s",
-          sstrerror (errno, errbuf, sizeof (errbuf)));
-      shutdown(fd, SHUT_RDWR);
-      close (fd);
+      if (verbose)
+        ERROR ("memcached: Error reading from socket: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
       return (-1);
     }
-
-    buffer_fill += (size_t) status;
-    if (buffer_fill > buffer_size)
+    else if (status == 0)
     {
-      buffer_fill = buffer_size;
-      WARNING ("memcached plugin: Message was truncated.");
-      break;
+      if (verbose)
+        WARNING ("memcached plugin: Instance \"%s\": The connection has "
+            "been closed by memcached.", st->name);
+      return (-1);
     }
 
+    buffer_fill += (size_t) status;
+
     /* If buffer ends in end_token, we have all the data. */
-    if (memcmp (buffer + buffer_fill - sizeof (end_token),
-          end_token, sizeof (end_token)) == 0)
+    if ((buffer_fill >= sizeof (end_token))
+        && (memcmp (buffer + buffer_fill - sizeof (end_token),
+            end_token, sizeof (end_token)) == 0))
       break;
   } /* while (recv) */
 
-  status = 0;
-  if (buffer_fill == 0)
+  return (0);
+} /* int memcached_query_stats */
+
+static int memcached_query_daemon (char *buffer, size_t buffer_size, memcached_t *st)
+{
+  int i;
+
+  /* memcached may have closed a connection which has been kept open since the
+   * last read, e.g. because it has been restarted. In that case the query is
+   * repeated once with a new connection. */
+  for (i = 0; i < 2; i++)
   {
-    WARNING ("memcached plugin: No data returned by memcached.");
-    status = -1;
+    _Bool reused = (st->fd >= 0);
+
+    if (st->fd < 0)
+    {
+      st->fd = memcached_connect (st);
+      if (st->fd < 0)
+      {
+        ERROR ("memcached plugin: Instance \"%s\" could not connect to daemon.",
+            st->name);
+        return (-1);
+      }
+    }
+
+    if (memcached_query_stats (buffer, buffer_size, st,
+          /* verbose = */ !reused) == 0)
+      return (0);
+
+    memcached_disconnect (st);
+    if (!reused)
+      break;
+
+    DEBUG ("memcached plugin: Instance \"%s\": Reconnecting.", st->name);
   }
 
-  shutdown(fd, SHUT_RDWR);
-  close(fd);
-  return (status);
+  return (-1);
 } /* int memcached_query_daemon */
 
 static void memcached_init_vl (value_list_t *vl, memcached_t const *st)
@@ -538,6 +601,7 @@ static int config_add_instance(oconfig_item_t *ci)
   st->socket = NULL;
   st->host = NULL;
   st->port = NULL;
+  st->fd = -1;
 
   if (strcasecmp (ci->key, "Plugin") == 0) /* default instance */
     st->name = sstrdup ("__legacy__");
@@ -632,6 +696,7 @@ static int memcached_init (void)
   st->socket = NULL;
   st->host = NULL;
   st->port = NULL;
+  st->fd = -1;
 
   status = memcached_add_read_callback (st);
   if (status == 0)
@@ -67,7 +67,7 @@ static vm_size_t pagesize;
 /* #endif HAVE_SYSCTLBYNAME */
 
 #elif KERNEL_LINUX
-/* no global variables */
+static pread_file_t *pf_meminfo = NULL;
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKSTAT
@@ -261,8 +261,9 @@ static int memory_read (void)
 /* #endif HAVE_SYSCTLBYNAME */
 
 #elif KERNEL_LINUX
-	FILE *fh;
-	char buffer[1024];
+	char *buffer;
+	char *ptr;
+	char *line;
 
 	char *fields[8];
 	int numfields;
@@ -272,30 +273,34 @@ static int memory_read (void)
 	long long mem_cached = 0;
 	long long mem_free = 0;
 
-	if ((fh = fopen ("/proc/meminfo", "r")) == NULL)
+	if (pf_meminfo == NULL)
+		pf_meminfo = pread_file_create ("/proc/meminfo");
+
+	if ((buffer = pread_file_read (pf_meminfo, NULL)) == NULL)
 	{
 		char errbuf[1024];
-		WARNING ("memory: fopen: %s",
+		WARNING ("memory: Reading /proc/meminfo failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return (-1);
 	}
 
-	while (fgets (buffer, 1024, fh) != NULL)
+	ptr = buffer;
+	while ((line = strline (&ptr)) != NULL)
 	{
 		long long *val = NULL;
 
-		if (strncasecmp (buffer, "MemTotal:", 9) == 0)
+		if (strncasecmp (line, "MemTotal:", 9) == 0)
 			val = &mem_used;
-		else if (strncasecmp (buffer, "MemFree:", 8) == 0)
+		else if (strncasecmp (line, "MemFree:", 8) == 0)
 			val = &mem_free;
-		else if (strncasecmp (buffer, "Buffers:", 8) == 0)
+		else if (strncasecmp (line, "Buffers:", 8) == 0)
 			val = &mem_buffered;
-		else if (strncasecmp (buffer, "Cached:", 7) == 0)
+		else if (strncasecmp (line, "Cached:", 7) == 0)
 			val = &mem_cached;
 		else
 			continue;
 
-		numfields = strsplit (buffer, fields, 8);
+		numfields = strsplit_line (&line, fields, 8);
 
 		if (numfields < 2)
 			continue;
@@ -303,13 +308,6 @@ static int memory_read (void)
 		*val = atoll (fields[1]) * 1024LL;
 	}
 
-	if (fclose (fh))
-	{
-		char errbuf[1024];
-		WARNING ("memory: fclose: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-	}
-
 	if (mem_used >= (mem_free + mem_buffered + mem_cached))
 	{
 		mem_used -= mem_free + mem_buffered + mem_cached;
@@ -446,8 +444,21 @@ static int memory_read (void)
 	return (0);
 }
 
+#if KERNEL_LINUX
+static int memory_shutdown (void)
+{
+	pread_file_destroy (pf_meminfo);
+	pf_meminfo = NULL;
+
+	return (0);
+} /* int memory_shutdown */
+#endif /* KERNEL_LINUX */
+
 void module_register (void)
 {
 	plugin_register_init ("memory", memory_init);
 	plugin_register_read ("memory", memory_read);
+#if KERNEL_LINUX
+	plugin_register_shutdown ("memory", memory_shutdown);
+#endif
 } /* void module_register */
@@ -23,8 +23,6 @@
 #include "plugin.h"
 #include "meta_data.h"
 
-#include <pthread.h>
-
 /*
  * Data types
  */
@@ -42,18 +40,40 @@ struct meta_entry_s;
 typedef struct meta_entry_s meta_entry_t;
 struct meta_entry_s
 {
-  char         *key;
+  const char   *key;
   meta_value_t  value;
   int           type;
-  meta_entry_t *next;
+  /* If true, "key" could not be interned and lives in the string area. */
+  _Bool         key_inline;
 };
 
+/* The entries and the string area follow the structure in the same
+ * allocation until they outgrow it and are moved to "block". Space of
+ * replaced and deleted strings is reclaimed when they are moved. */
 struct meta_data_s
 {
-  meta_entry_t   *head;
-  pthread_mutex_t lock;
+  meta_entry_t *entries;
+  size_t        entries_num;
+  size_t        entries_size;
+
+  char         *strings;
+  size_t        strings_used;
+  size_t        strings_size;
+
+  void         *block;
 };
 
+#define MD_INITIAL_ENTRIES 2
+#define MD_INITIAL_STRINGS 32
+
+/* Interned keys. Slots are filled using compare-and-swap and are never
+ * emptied, so looking up a key doesn't need a lock. Keys are used by many
+ * value lists but there are only a few of them; once the table is full, keys
+ * are stored with each meta data object instead. */
+#define MD_KEYS_NUM   1024
+#define MD_KEYS_PROBE 16
+static char *md_keys[MD_KEYS_NUM];
+
 /*
  * Private functions
  */
@@ -75,137 +95,231 @@ static char *md_strdup (const char *orig) /* {{{ */
   return (dest);
 } /* }}} char *md_strdup */
 
-static meta_entry_t *md_entry_alloc (const char *key) /* {{{ */
+/* Returns the interned copy of "key" or NULL if the table is full. */
+static const char *md_key_intern (const char *key) /* {{{ */
 {
-  meta_entry_t *e;
+  const unsigned char *ptr;
+  uint32_t hash = 2166136261U;
+  char *copy = NULL;
+  size_t i;
 
-  e = (meta_entry_t *) malloc (sizeof (*e));
-  if (e == NULL)
+  /* 32 bit FNV-1a */
+  for (ptr = (const unsigned char *) key; *ptr != 0; ptr++)
   {
-    ERROR ("md_entry_alloc: malloc failed.");
-    return (NULL);
+    hash ^= (uint32_t) *ptr;
+    hash *= 16777619U;
   }
-  memset (e, 0, sizeof (*e));
 
-  e->key = md_strdup (key);
-  if (e->key == NULL)
+  for (i = 0; i < MD_KEYS_PROBE; i++)
   {
-    free (e);
-    ERROR ("md_entry_alloc: md_strdup failed.");
-    return (NULL);
-  }
-
-  e->type = 0;
-  e->next = NULL;
-
-  return (e);
-} /* }}} meta_entry_t *md_entry_alloc */
-
-static meta_entry_t *md_entry_clone (const meta_entry_t *orig) /* {{{ */
-{
-  meta_entry_t *copy;
+    size_t slot = ((size_t) hash + i) % MD_KEYS_NUM;
+    char *k = md_keys[slot];
 
-  if (orig == NULL)
-    return (NULL);
+    if (k == NULL)
+    {
+      if (copy == NULL)
+      {
+        copy = md_strdup (key);
+        if (copy == NULL)
+          return (NULL);
+      }
+
+      if (__sync_bool_compare_and_swap (&md_keys[slot], NULL, copy))
+        return (copy);
+
+      /* Another thread took the slot. */
+      k = md_keys[slot];
+    }
 
-  copy = md_entry_alloc (orig->key);
-  copy->type = orig->type;
-  if (copy->type == MD_TYPE_STRING)
-    copy->value.mv_string = strdup (orig->value.mv_string);
-  else
-    copy->value = orig->value;
+    if (strcmp (key, k) == 0)
+    {
+      free (copy);
+      return (k);
+    }
+  }
 
-  copy->next = md_entry_clone (orig->next);
-  return (copy);
-} /* }}} meta_entry_t *md_entry_clone */
+  free (copy);
+  return (NULL);
+} /* }}} const char *md_key_intern */
 
-static void md_entry_free (meta_entry_t *e) /* {{{ */
+static size_t md_alloc_size (size_t entries_size, size_t strings_size) /* {{{ */
 {
-  if (e == NULL)
-    return;
+  return (sizeof (meta_data_t)
+      + entries_size * sizeof (meta_entry_t)
+      + strings_size);
+} /* }}} size_t md_alloc_size */
+
+/* Points "entries" and "strings" to the space following the structure. */
+static void md_init_inline (meta_data_t *md, /* {{{ */
+    size_t entries_size, size_t strings_size)
+{
+  memset (md, 0, sizeof (*md));
 
-  free (e->key);
+  md->entries = (meta_entry_t *) (md + 1);
+  md->entries_size = entries_size;
+  md->strings = (char *) (md->entries + entries_size);
+  md->strings_size = strings_size;
+  md->block = NULL;
+} /* }}} void md_init_inline */
 
-  if (e->type == MD_TYPE_STRING)
-    free (e->value.mv_string);
+static char *md_strings_add (char *strings, size_t *used, /* {{{ */
+    const char *str)
+{
+  size_t len = strlen (str) + 1;
+  char *ret = strings + *used;
 
-  if (e->next != NULL)
-    md_entry_free (e->next);
+  memcpy (ret, str, len);
+  *used += len;
 
-  free (e);
-} /* }}} void md_entry_free */
+  return (ret);
+} /* }}} char *md_strings_add */
 
-static int md_entry_insert (meta_data_t *md, meta_entry_t *e) /* {{{ */
+/* Returns the number of bytes needed for the strings still in use. */
+static size_t md_strings_live (const meta_data_t *md) /* {{{ */
 {
-  meta_entry_t *this;
-  meta_entry_t *prev;
-
-  if ((md == NULL) || (e == NULL))
-    return (-EINVAL);
-
-  pthread_mutex_lock (&md->lock);
+  size_t sz = 0;
+  size_t i;
 
-  prev = NULL;
-  this = md->head;
-  while (this != NULL)
+  for (i = 0; i < md->entries_num; i++)
   {
-    if (strcasecmp (e->key, this->key) == 0)
-      break;
-
-    prev = this;
-    this = this->next;
+    if (md->entries[i].key_inline)
+      sz += strlen (md->entries[i].key) + 1;
+    if (md->entries[i].type == MD_TYPE_STRING)
+      sz += strlen (md->entries[i].value.mv_string) + 1;
   }
 
-  if (this == NULL)
-  {
-    /* This key does not exist yet. */
-    if (md->head == NULL)
-      md->head = e;
-    else
-    {
-      assert (prev != NULL);
-      prev->next = e;
-    }
+  return (sz);
+} /* }}} size_t md_strings_live */
 
-    e->next = NULL;
-  }
-  else /* (this != NULL) */
-  {
-    if (prev == NULL)
-      md->head = e;
-    else
-      prev->next = e;
+/* Copies the entries of "src" to "entries" and their strings to "strings",
+ * leaving out unused space. Returns the number of bytes of "strings" used. */
+static size_t md_copy (meta_entry_t *entries, char *strings, /* {{{ */
+    const meta_data_t *src)
+{
+  size_t used = 0;
+  size_t i;
 
-    e->next = this->next;
+  for (i = 0; i < src->entries_num; i++)
+  {
+    meta_entry_t *e = entries + i;
+
+    *e = src->entries[i];
+    if (e->key_inline)
+      e->key = md_strings_add (strings, &used, e->key);
+    if (e->type == MD_TYPE_STRING)
+      e->value.mv_string = md_strings_add (strings, &used,
+          e->value.mv_string);
   }
 
-  pthread_mutex_unlock (&md->lock);
+  return (used);
+} /* }}} size_t md_copy */
 
-  if (this != NULL)
+/* Makes room for "entries_need" more entries and "strings_need" more bytes of
+ * strings. Entries are moved, so pointers to them are invalidated. */
+static int md_reserve (meta_data_t *md, /* {{{ */
+    size_t entries_need, size_t strings_need)
+{
+  size_t entries_size;
+  size_t strings_size;
+  size_t strings_live;
+  meta_entry_t *entries;
+  char *block;
+
+  if (((md->entries_num + entries_need) <= md->entries_size)
+      && ((md->strings_used + strings_need) <= md->strings_size))
+    return (0);
+
+  strings_live = md_strings_live (md);
+
+  entries_size = (md->entries_size > 0)
+    ? md->entries_size : MD_INITIAL_ENTRIES;
+  while (entries_size < (md->entries_num + entries_need))
+    entries_size *= 2;
+
+  strings_size = (md->strings_size > 0)
+    ? md->strings_size : MD_INITIAL_STRINGS;
+  while (strings_size < (strings_live + strings_need))
+    strings_size *= 2;
+
+  block = malloc (entries_size * sizeof (meta_entry_t) + strings_size);
+  if (block == NULL)
   {
-    this->next = NULL;
-    md_entry_free (this);
+    ERROR ("md_reserve: malloc failed.");
+    return (-ENOMEM);
   }
+  entries = (meta_entry_t *) block;
+
+  md->strings_used = md_copy (entries,
+      block + entries_size * sizeof (meta_entry_t), md);
+
+  free (md->block);
+  md->block = block;
+  md->entries = entries;
+  md->entries_size = entries_size;
+  md->strings = block + entries_size * sizeof (meta_entry_t);
+  md->strings_size = strings_size;
 
   return (0);
-} /* }}} int md_entry_insert */
+} /* }}} int md_reserve */
 
-/* XXX: The lock on md must be held while calling this function! */
 static meta_entry_t *md_entry_lookup (meta_data_t *md, /* {{{ */
     const char *key)
 {
-  meta_entry_t *e;
+  size_t i;
 
   if ((md == NULL) || (key == NULL))
     return (NULL);
 
-  for (e = md->head; e != NULL; e = e->next)
-    if (strcasecmp (key, e->key) == 0)
-      break;
+  for (i = 0; i < md->entries_num; i++)
+    if ((key == md->entries[i].key)
+        || (strcasecmp (key, md->entries[i].key) == 0))
+      return (md->entries + i);
 
-  return (e);
+  return (NULL);
 } /* }}} meta_entry_t *md_entry_lookup */
 
+/* Returns the entry for "key", which is added if it doesn't exist, with room
+ * for "strings_need" bytes of strings. The caller sets the type and value. */
+static meta_entry_t *md_entry_get (meta_data_t *md, /* {{{ */
+    const char *key, size_t strings_need)
+{
+  meta_entry_t *e;
+  const char *interned;
+
+  e = md_entry_lookup (md, key);
+  if (e != NULL)
+  {
+    size_t index = (size_t) (e - md->entries);
+
+    if (md_reserve (md, 0, strings_need) != 0)
+      return (NULL);
+    return (md->entries + index);
+  }
+
+  interned = md_key_intern (key);
+  if (interned == NULL)
+    strings_need += strlen (key) + 1;
+
+  if (md_reserve (md, 1, strings_need) != 0)
+    return (NULL);
+
+  e = md->entries + md->entries_num;
+  memset (e, 0, sizeof (*e));
+  if (interned != NULL)
+  {
+    e->key = interned;
+    e->key_inline = 0;
+  }
+  else
+  {
+    e->key = md_strings_add (md->strings, &md->strings_used, key);
+    e->key_inline = 1;
+  }
+  md->entries_num++;
+
+  return (e);
+} /* }}} meta_entry_t *md_entry_get */
+
 /*
  * Public functions
  */
@@ -213,16 +327,13 @@ meta_data_t *meta_data_create (void) /* {{{ */
 {
   meta_data_t *md;
 
-  md = (meta_data_t *) malloc (sizeof (*md));
+  md = malloc (md_alloc_size (MD_INITIAL_ENTRIES, MD_INITIAL_STRINGS));
   if (md == NULL)
   {
     ERROR ("meta_data_create: malloc failed.");
     return (NULL);
   }
-  memset (md, 0, sizeof (*md));
-
-  md->head = NULL;
-  pthread_mutex_init (&md->lock, /* attr = */ NULL);
+  md_init_inline (md, MD_INITIAL_ENTRIES, MD_INITIAL_STRINGS);
 
   return (md);
 } /* }}} meta_data_t *meta_data_create */
@@ -230,17 +341,23 @@ meta_data_t *meta_data_create (void) /* {{{ */
 meta_data_t *meta_data_clone (meta_data_t *orig) /* {{{ */
 {
   meta_data_t *copy;
+  size_t strings_size;
 
   if (orig == NULL)
     return (NULL);
 
-  copy = meta_data_create ();
+  /* The copy is allocated at once and has no room to spare. */
+  strings_size = md_strings_live (orig);
+  copy = malloc (md_alloc_size (orig->entries_num, strings_size));
   if (copy == NULL)
+  {
+    ERROR ("meta_data_clone: malloc failed.");
     return (NULL);
+  }
+  md_init_inline (copy, orig->entries_num, strings_size);
 
-  pthread_mutex_lock (&orig->lock);
-  copy->head = md_entry_clone (orig->head);
-  pthread_mutex_unlock (&orig->lock);
+  copy->strings_used = md_copy (copy->entries, copy->strings, orig);
+  copy->entries_num = orig->entries_num;
 
   return (copy);
 } /* }}} meta_data_t *meta_data_clone */
@@ -250,32 +367,16 @@ void meta_data_destroy (meta_data_t *md) /* {{{ */
   if (md == NULL)
     return;
 
-  pthread_mutex_destroy(&md->lock);
-  md_entry_free (md->head);
-  pthread_mutex_destroy (&md->lock);
+  free (md->block);
   free (md);
 } /* }}} void meta_data_destroy */
 
 int meta_data_exists (meta_data_t *md, const char *key) /* {{{ */
 {
-  meta_entry_t *e;
-
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
-  for (e = md->head; e != NULL; e = e->next)
-  {
-    if (strcasecmp (key, e->key) == 0)
-    {
-      pthread_mutex_unlock (&md->lock);
-      return (1);
-    }
-  }
-
-  pthread_mutex_unlock (&md->lock);
-  return (0);
+  return (md_entry_lookup (md, key) != NULL);
 } /* }}} int meta_data_exists */
 
 int meta_data_type (meta_data_t *md, const char *key) /* {{{ */
@@ -285,78 +386,43 @@ int meta_data_type (meta_data_t *md, const char *key) /* {{{ */
   if ((md == NULL) || (key == NULL))
     return -EINVAL;
 
-  pthread_mutex_lock (&md->lock);
-
-  for (e = md->head; e != NULL; e = e->next)
-  {
-    if (strcasecmp (key, e->key) == 0)
-    {
-      pthread_mutex_unlock (&md->lock);
-      return e->type;
-    }
-  }
+  e = md_entry_lookup (md, key);
+  if (e == NULL)
+    return 0;
 
-  pthread_mutex_unlock (&md->lock);
-  return 0;
+  return e->type;
 } /* }}} int meta_data_type */
 
 int meta_data_toc (meta_data_t *md, char ***toc) /* {{{ */
 {
-  int i = 0, count = 0;
-  meta_entry_t *e;
+  size_t i;
 
   if ((md == NULL) || (toc == NULL))
     return -EINVAL;
 
-  pthread_mutex_lock (&md->lock);
-
-  for (e = md->head; e != NULL; e = e->next)
-    ++count;    
+  *toc = malloc(md->entries_num * sizeof(**toc));
+  for (i = 0; i < md->entries_num; i++)
+    (*toc)[i] = strdup(md->entries[i].key);
 
-  *toc = malloc(count * sizeof(**toc));
-  for (e = md->head; e != NULL; e = e->next)
-    (*toc)[i++] = strdup(e->key);
-  
-  pthread_mutex_unlock (&md->lock);
-  return count;
+  return (int) md->entries_num;
 } /* }}} int meta_data_toc */
 
 int meta_data_delete (meta_data_t *md, const char *key) /* {{{ */
 {
-  meta_entry_t *this;
-  meta_entry_t *prev;
+  meta_entry_t *e;
+  size_t index;
 
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
-  prev = NULL;
-  this = md->head;
-  while (this != NULL)
-  {
-    if (strcasecmp (key, this->key) == 0)
-      break;
-
-    prev = this;
-    this = this->next;
-  }
-
-  if (this == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
+  e = md_entry_lookup (md, key);
+  if (e == NULL)
     return (-ENOENT);
-  }
-
-  if (prev == NULL)
-    md->head = this->next;
-  else
-    prev->next = this->next;
 
-  pthread_mutex_unlock (&md->lock);
-
-  this->next = NULL;
-  md_entry_free (this);
+  /* Keep the order of the remaining entries. */
+  index = (size_t) (e - md->entries);
+  memmove (e, e + 1, (md->entries_num - (index + 1)) * sizeof (*e));
+  md->entries_num--;
 
   return (0);
 } /* }}} int meta_data_delete */
@@ -368,24 +434,32 @@ int meta_data_add_string (meta_data_t *md, /* {{{ */
     const char *key, const char *value)
 {
   meta_entry_t *e;
+  char *copy = NULL;
 
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  e = md_entry_alloc (key);
-  if (e == NULL)
-    return (-ENOMEM);
+  /* The string area may be moved below. */
+  if ((value >= md->strings) && (value < (md->strings + md->strings_size)))
+  {
+    copy = md_strdup (value);
+    if (copy == NULL)
+      return (-ENOMEM);
+    value = copy;
+  }
 
-  e->value.mv_string = md_strdup (value);
-  if (e->value.mv_string == NULL)
+  e = md_entry_get (md, key, strlen (value) + 1);
+  if (e == NULL)
   {
-    ERROR ("meta_data_add_string: md_strdup failed.");
-    md_entry_free (e);
+    free (copy);
     return (-ENOMEM);
   }
+
+  e->value.mv_string = md_strings_add (md->strings, &md->strings_used, value);
   e->type = MD_TYPE_STRING;
 
-  return (md_entry_insert (md, e));
+  free (copy);
+  return (0);
 } /* }}} int meta_data_add_string */
 
 int meta_data_add_signed_int (meta_data_t *md, /* {{{ */
@@ -396,14 +470,14 @@ int meta_data_add_signed_int (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  e = md_entry_alloc (key);
+  e = md_entry_get (md, key, /* strings_need = */ 0);
   if (e == NULL)
     return (-ENOMEM);
 
   e->value.mv_signed_int = value;
   e->type = MD_TYPE_SIGNED_INT;
 
-  return (md_entry_insert (md, e));
+  return (0);
 } /* }}} int meta_data_add_signed_int */
 
 int meta_data_add_unsigned_int (meta_data_t *md, /* {{{ */
@@ -414,14 +488,14 @@ int meta_data_add_unsigned_int (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  e = md_entry_alloc (key);
+  e = md_entry_get (md, key, /* strings_need = */ 0);
   if (e == NULL)
     return (-ENOMEM);
 
   e->value.mv_unsigned_int = value;
   e->type = MD_TYPE_UNSIGNED_INT;
 
-  return (md_entry_insert (md, e));
+  return (0);
 } /* }}} int meta_data_add_unsigned_int */
 
 int meta_data_add_double (meta_data_t *md, /* {{{ */
@@ -432,14 +506,14 @@ int meta_data_add_double (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  e = md_entry_alloc (key);
+  e = md_entry_get (md, key, /* strings_need = */ 0);
   if (e == NULL)
     return (-ENOMEM);
 
   e->value.mv_double = value;
   e->type = MD_TYPE_DOUBLE;
 
-  return (md_entry_insert (md, e));
+  return (0);
 } /* }}} int meta_data_add_double */
 
 int meta_data_add_boolean (meta_data_t *md, /* {{{ */
@@ -450,14 +524,14 @@ int meta_data_add_boolean (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL))
     return (-EINVAL);
 
-  e = md_entry_alloc (key);
+  e = md_entry_get (md, key, /* strings_need = */ 0);
   if (e == NULL)
     return (-ENOMEM);
 
   e->value.mv_boolean = value;
   e->type = MD_TYPE_BOOLEAN;
 
-  return (md_entry_insert (md, e));
+  return (0);
 } /* }}} int meta_data_add_boolean */
 
 /*
@@ -472,31 +546,22 @@ int meta_data_get_string (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
   e = md_entry_lookup (md, key);
   if (e == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
-  }
 
   if (e->type != MD_TYPE_STRING)
   {
-    ERROR ("meta_data_get_signed_int: Type mismatch for key `%s'", e->key);
-    pthread_mutex_unlock (&md->lock);
+    ERROR ("meta_data_get_string: Type mismatch for key `%s'", e->key);
     return (-ENOENT);
   }
 
   temp = md_strdup (e->value.mv_string);
   if (temp == NULL)
   {
-    pthread_mutex_unlock (&md->lock);
     ERROR ("meta_data_get_string: md_strdup failed.");
     return (-ENOMEM);
   }
- 
-  pthread_mutex_unlock (&md->lock);
 
   *value = temp;
 
@@ -511,25 +576,18 @@ int meta_data_get_signed_int (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
   e = md_entry_lookup (md, key);
   if (e == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
-  }
 
   if (e->type != MD_TYPE_SIGNED_INT)
   {
     ERROR ("meta_data_get_signed_int: Type mismatch for key `%s'", e->key);
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
   }
 
   *value = e->value.mv_signed_int;
 
-  pthread_mutex_unlock (&md->lock);
   return (0);
 } /* }}} int meta_data_get_signed_int */
 
@@ -541,25 +599,18 @@ int meta_data_get_unsigned_int (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
   e = md_entry_lookup (md, key);
   if (e == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
-  }
 
   if (e->type != MD_TYPE_UNSIGNED_INT)
   {
     ERROR ("meta_data_get_unsigned_int: Type mismatch for key `%s'", e->key);
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
   }
 
   *value = e->value.mv_unsigned_int;
 
-  pthread_mutex_unlock (&md->lock);
   return (0);
 } /* }}} int meta_data_get_unsigned_int */
 
@@ -571,25 +622,18 @@ int meta_data_get_double (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
   e = md_entry_lookup (md, key);
   if (e == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
-  }
 
   if (e->type != MD_TYPE_DOUBLE)
   {
     ERROR ("meta_data_get_double: Type mismatch for key `%s'", e->key);
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
   }
 
   *value = e->value.mv_double;
 
-  pthread_mutex_unlock (&md->lock);
   return (0);
 } /* }}} int meta_data_get_double */
 
@@ -601,25 +645,18 @@ int meta_data_get_boolean (meta_data_t *md, /* {{{ */
   if ((md == NULL) || (key == NULL) || (value == NULL))
     return (-EINVAL);
 
-  pthread_mutex_lock (&md->lock);
-
   e = md_entry_lookup (md, key);
   if (e == NULL)
-  {
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
-  }
 
   if (e->type != MD_TYPE_BOOLEAN)
   {
     ERROR ("meta_data_get_boolean: Type mismatch for key `%s'", e->key);
-    pthread_mutex_unlock (&md->lock);
     return (-ENOENT);
   }
 
   *value = e->value.mv_boolean;
 
-  pthread_mutex_unlock (&md->lock);
   return (0);
 } /* }}} int meta_data_get_boolean */
 
@@ -33,6 +33,9 @@
 #define MD_TYPE_DOUBLE       4
 #define MD_TYPE_BOOLEAN      5
 
+/* Meta data objects are not locked. They belong to a single value list at a
+ * time; objects used by several threads, such as those of the value cache,
+ * need to be protected by the user. */
 struct meta_data_s;
 typedef struct meta_data_s meta_data_t;
 
@@ -44,6 +44,13 @@
 # endif
 #endif
 
+/* Maximum number of registers read with one request. */
+#ifdef MODBUS_MAX_READ_REGISTERS
+# define MB_MAX_REGISTERS MODBUS_MAX_READ_REGISTERS
+#else
+# define MB_MAX_REGISTERS 125
+#endif
+
 /*
  * <Data "data_name">
  *   RegisterBase 1234
@@ -56,6 +63,7 @@
  *   Address "addr"
  *   Port "1234"
  *   Interval 60
+ *   MaxRegisterGap 0
  *
  *   <Slave 1>
  *     Instance "foobar" # optional
@@ -90,11 +98,28 @@ struct mb_data_s /* {{{ */
   mb_data_t *next;
 }; /* }}} */
 
+/* A range of registers read with one request. "registers" points into the
+ * slave's "collect" list, which is sorted by register, and the group covers
+ * "registers_num" consecutive entries of that list. */
+struct mb_data_group_s;
+typedef struct mb_data_group_s mb_data_group_t;
+struct mb_data_group_s /* {{{ */
+{
+  int register_base;
+  int register_num;
+
+  mb_data_t *registers;
+  size_t registers_num;
+
+  mb_data_group_t *next;
+}; /* }}} */
+
 struct mb_slave_s /* {{{ */
 {
   int id;
   char instance[DATA_MAX_NAME_LEN];
   mb_data_t *collect;
+  mb_data_group_t *groups;
 }; /* }}} */
 typedef struct mb_slave_s mb_slave_t;
 
@@ -105,6 +130,8 @@ struct mb_host_s /* {{{ */
   /* char service[NI_MAXSERV]; */
   int port;
   cdtime_t interval;
+  /* Number of unused registers allowed between two ranges read together. */
+  int max_register_gap;
 
   mb_slave_t *slaves;
   size_t slaves_num;
@@ -119,16 +146,6 @@ struct mb_host_s /* {{{ */
 }; /* }}} */
 typedef struct mb_host_s mb_host_t;
 
-struct mb_data_group_s;
-typedef struct mb_data_group_s mb_data_group_t;
-struct mb_data_group_s /* {{{ */
-{
-  mb_data_t *registers;
-  size_t registers_num;
-
-  mb_data_group_t *next;
-}; /* }}} */
-
 /*
  * Global variables
  */
@@ -226,6 +243,101 @@ static int data_copy_by_name (mb_data_t **dst, mb_data_t *src, /* {{{ */
   return (data_copy (dst, ptr));
 } /* }}} int data_copy_by_name */
 
+/* Returns the number of registers occupied by a value. */
+static int data_register_num (const mb_data_t *data) /* {{{ */
+{
+  if ((data->register_type == REG_TYPE_INT32)
+      || (data->register_type == REG_TYPE_UINT32)
+      || (data->register_type == REG_TYPE_FLOAT))
+    return (2);
+  return (1);
+} /* }}} int data_register_num */
+
+/* Sorts a list by register, using insertion sort. The lists are short and
+ * sorted only once. */
+static mb_data_t *data_sort (mb_data_t *src) /* {{{ */
+{
+  mb_data_t *sorted = NULL;
+
+  while (src != NULL)
+  {
+    mb_data_t *data = src;
+    mb_data_t **ptr;
+
+    src = src->next;
+
+    ptr = &sorted;
+    while ((*ptr != NULL) && ((*ptr)->register_base <= data->register_base))
+      ptr = &(*ptr)->next;
+
+    data->next = *ptr;
+    *ptr = data;
+  }
+
+  return (sorted);
+} /* }}} mb_data_t *data_sort */
+
+static void groups_free_all (mb_data_group_t *group) /* {{{ */
+{
+  while (group != NULL)
+  {
+    mb_data_group_t *next = group->next;
+    sfree (group);
+    group = next;
+  }
+} /* }}} void groups_free_all */
+
+/* Plans the requests for a slave: Sorts the "collect" list and merges
+ * adjacent or overlapping registers into groups of up to MB_MAX_REGISTERS.
+ * Registers more than "max_gap" apart are read separately. */
+static int slave_plan_groups (mb_slave_t *slave, int max_gap) /* {{{ */
+{
+  mb_data_group_t **tail;
+  mb_data_group_t *group = NULL;
+  mb_data_t *data;
+
+  groups_free_all (slave->groups);
+  slave->groups = NULL;
+  tail = &slave->groups;
+
+  slave->collect = data_sort (slave->collect);
+
+  for (data = slave->collect; data != NULL; data = data->next)
+  {
+    int end = data->register_base + data_register_num (data);
+
+    if ((group != NULL)
+        && (data->register_base
+          <= (group->register_base + group->register_num + max_gap))
+        && ((end - group->register_base) <= MB_MAX_REGISTERS))
+    {
+      if ((end - group->register_base) > group->register_num)
+        group->register_num = end - group->register_base;
+      group->registers_num++;
+      continue;
+    }
+
+    group = malloc (sizeof (*group));
+    if (group == NULL)
+    {
+      groups_free_all (slave->groups);
+      slave->groups = NULL;
+      return (ENOMEM);
+    }
+    memset (group, 0, sizeof (*group));
+    group->register_base = data->register_base;
+    group->register_num = data_register_num (data);
+    group->registers = data;
+    group->registers_num = 1;
+    group->next = NULL;
+
+    *tail = group;
+    tail = &group->next;
+  }
+
+  return (0);
+} /* }}} int slave_plan_groups */
+
 /* Read functions */
 
 static int mb_submit (mb_host_t *host, mb_slave_t *slave, /* {{{ */
@@ -385,17 +497,12 @@ static int mb_init_connection (mb_host_t *host) /* {{{ */
     (vt).absolute = (absolute_t) (raw); \
 } while (0)
 
-static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
-    mb_data_t *data)
+/* Decodes the value of "data" from the registers read for its group and
+ * dispatches it. */
+static int mb_submit_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
+    mb_data_t *data, const uint16_t *values)
 {
-  uint16_t values[2];
-  int values_num;
   const data_set_t *ds;
-  int status;
-  int i;
-
-  if ((host == NULL) || (slave == NULL) || (data == NULL))
-    return (EINVAL);
 
   ds = plugin_get_ds (data->type);
   if (ds == NULL)
@@ -421,86 +528,13 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
         "is not UINT32.", data->type, DS_TYPE_TO_STRING (ds->ds[0].type));
   }
 
-  memset (values, 0, sizeof (values));
-  if ((data->register_type == REG_TYPE_INT32)
-      || (data->register_type == REG_TYPE_UINT32)
-      || (data->register_type == REG_TYPE_FLOAT))
-    values_num = 2;
-  else
-    values_num = 1;
-
-#if LEGACY_LIBMODBUS
-  /* Version 2.0.3: Pass the connection struct as a pointer and pass the slave
-   * id to each call of "read_holding_registers". */
-# define modbus_read_registers(ctx, addr, nb, dest) \
-  read_holding_registers (&(ctx), slave->id, (addr), (nb), (dest))
-#else /* if !LEGACY_LIBMODBUS */
-  /* Version 2.9.2: Set the slave id once before querying the registers. */
-  status = modbus_set_slave (host->connection, slave->id);
-  if (status != 0)
-  {
-    ERROR ("Modbus plugin: modbus_set_slave (%i) failed with status %i.",
-        slave->id, status);
-    return (-1);
-  }
-#endif
-
-  for (i = 0; i < 2; i++)
-  {
-    status = modbus_read_registers (host->connection,
-        /* start_addr = */ data->register_base,
-        /* num_registers = */ values_num, /* buffer = */ values);
-    if (status > 0)
-      break;
-
-    if (host->is_connected)
-    {
-#if LEGACY_LIBMODBUS
-      modbus_close (&host->connection);
-      host->is_connected = 0;
-#else
-      modbus_close (host->connection);
-      modbus_free (host->connection);
-      host->connection = NULL;
-#endif
-    }
-
-    /* If we already tried reconnecting this round, give up. */
-    if (host->have_reconnected)
-    {
-      ERROR ("Modbus plugin: modbus_read_registers (%s) failed. "
-          "Reconnecting has already been tried. Giving up.", host->host);
-      return (-1);
-    }
-
-    /* Maybe the device closed the connection during the waiting interval.
-     * Try re-establishing the connection. */
-    status = mb_init_connection (host);
-    if (status != 0)
-    {
-      ERROR ("Modbus plugin: modbus_read_registers (%s) failed. "
-          "While trying to reconnect, connecting to \"%s\" failed. "
-          "Giving up.",
-          host->host, host->node);
-      return (-1);
-    }
-
-    DEBUG ("Modbus plugin: Re-established connection to %s", host->host);
-
-    /* try again */
-    continue;
-  } /* for (i = 0, 1) */
-
-  DEBUG ("Modbus plugin: mb_read_data: Success! "
-      "modbus_read_registers returned with status %i.", status);
-
   if (data->register_type == REG_TYPE_FLOAT)
   {
     float float_value;
     value_t vt;
 
     float_value = mb_register_to_float (values[0], values[1]);
-    DEBUG ("Modbus plugin: mb_read_data: "
+    DEBUG ("Modbus plugin: mb_submit_data: "
         "Returned float value is %g", (double) float_value);
 
     CAST_TO_VALUE_T (ds, vt, float_value);
@@ -517,7 +551,7 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
 
     v.u32 = (((uint32_t) values[0]) << 16)
       | ((uint32_t) values[1]);
-    DEBUG ("Modbus plugin: mb_read_data: "
+    DEBUG ("Modbus plugin: mb_submit_data: "
         "Returned int32 value is %"PRIi32, v.i32);
 
     CAST_TO_VALUE_T (ds, vt, v.i32);
@@ -534,7 +568,7 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
 
     v.u16 = values[0];
 
-    DEBUG ("Modbus plugin: mb_read_data: "
+    DEBUG ("Modbus plugin: mb_submit_data: "
         "Returned int16 value is %"PRIi16, v.i16);
 
     CAST_TO_VALUE_T (ds, vt, v.i16);
@@ -547,7 +581,7 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
 
     v32 = (((uint32_t) values[0]) << 16)
       | ((uint32_t) values[1]);
-    DEBUG ("Modbus plugin: mb_read_data: "
+    DEBUG ("Modbus plugin: mb_submit_data: "
         "Returned uint32 value is %"PRIu32, v32);
 
     CAST_TO_VALUE_T (ds, vt, v32);
@@ -557,7 +591,7 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
   {
     value_t vt;
 
-    DEBUG ("Modbus plugin: mb_read_data: "
+    DEBUG ("Modbus plugin: mb_submit_data: "
         "Returned uint16 value is %"PRIu16, values[0]);
 
     CAST_TO_VALUE_T (ds, vt, values[0]);
@@ -565,25 +599,137 @@ static int mb_read_data (mb_host_t *host, mb_slave_t *slave, /* {{{ */
   }
 
   return (0);
-} /* }}} int mb_read_data */
+} /* }}} int mb_submit_data */
 
-static int mb_read_slave (mb_host_t *host, mb_slave_t *slave) /* {{{ */
+
+static int mb_read_registers (mb_host_t *host, mb_slave_t *slave, /* {{{ */
+    int register_base, int register_num, uint16_t *values)
+{
+  int status;
+  int i;
+
+#if LEGACY_LIBMODBUS
+  /* Version 2.0.3: Pass the connection struct as a pointer and pass the slave
+   * id to each call of "read_holding_registers". */
+# define modbus_read_registers(ctx, addr, nb, dest) \
+  read_holding_registers (&(ctx), slave->id, (addr), (nb), (dest))
+#endif
+
+  for (i = 0; i < 2; i++)
+  {
+#if !LEGACY_LIBMODBUS
+    /* Version 2.9.2: Set the slave id before querying the registers. The
+     * connection may have been re-established in the previous iteration. */
+    status = modbus_set_slave (host->connection, slave->id);
+    if (status != 0)
+    {
+      ERROR ("Modbus plugin: modbus_set_slave (%i) failed with status %i.",
+          slave->id, status);
+      return (-1);
+    }
+#endif
+
+    status = modbus_read_registers (host->connection,
+        /* start_addr = */ register_base,
+        /* num_registers = */ register_num, /* buffer = */ values);
+    if (status > 0)
+      break;
+
+    if (host->is_connected)
+    {
+#if LEGACY_LIBMODBUS
+      modbus_close (&host->connection);
+      host->is_connected = 0;
+#else
+      modbus_close (host->connection);
+      modbus_free (host->connection);
+      host->connection = NULL;
+#endif
+    }
+
+    /* If we already tried reconnecting this round, give up. */
+    if (host->have_reconnected)
+    {
+      ERROR ("Modbus plugin: modbus_read_registers (%s) failed. "
+          "Reconnecting has already been tried. Giving up.", host->host);
+      return (-1);
+    }
+
+    /* Maybe the device closed the connection during the waiting interval.
+     * Try re-establishing the connection. */
+    status = mb_init_connection (host);
+    if (status != 0)
+    {
+      ERROR ("Modbus plugin: modbus_read_registers (%s) failed. "
+          "While trying to reconnect, connecting to \"%s\" failed. "
+          "Giving up.",
+          host->host, host->node);
+      return (-1);
+    }
+
+    DEBUG ("Modbus plugin: Re-established connection to %s", host->host);
+
+    /* try again */
+    continue;
+  } /* for (i = 0, 1) */
+
+  if (status <= 0)
+    return (-1);
+
+  DEBUG ("Modbus plugin: mb_read_registers: Success! "
+      "modbus_read_registers returned with status %i.", status);
+
+  return (0);
+} /* }}} int mb_read_registers */
+
+/* Reads all registers of a group with one request and dispatches the values
+ * of its data entries. Returns the number of values dispatched. */
+static int mb_read_group (mb_host_t *host, mb_slave_t *slave, /* {{{ */
+    mb_data_group_t *group)
 {
+  uint16_t values[MB_MAX_REGISTERS];
   mb_data_t *data;
+  size_t i;
   int success;
   int status;
 
-  if ((host == NULL) || (slave == NULL))
+  if ((host == NULL) || (slave == NULL) || (group == NULL))
     return (EINVAL);
 
+  assert (group->register_num <= MB_MAX_REGISTERS);
+
+  memset (values, 0, sizeof (values));
+  status = mb_read_registers (host, slave,
+      group->register_base, group->register_num, values);
+  if (status != 0)
+    return (0);
+
   success = 0;
-  for (data = slave->collect; data != NULL; data = data->next)
+  data = group->registers;
+  for (i = 0; (i < group->registers_num) && (data != NULL); i++)
   {
-    status = mb_read_data (host, slave, data);
+    status = mb_submit_data (host, slave, data,
+        values + (data->register_base - group->register_base));
     if (status == 0)
       success++;
+    data = data->next;
   }
 
+  return (success);
+} /* }}} int mb_read_group */
+
+static int mb_read_slave (mb_host_t *host, mb_slave_t *slave) /* {{{ */
+{
+  mb_data_group_t *group;
+  int success;
+
+  if ((host == NULL) || (slave == NULL))
+    return (EINVAL);
+
+  success = 0;
+  for (group = slave->groups; group != NULL; group = group->next)
+    success += mb_read_group (host, slave, group);
+
   if (success == 0)
     return (-1);
   else
@@ -651,7 +797,10 @@ static void slaves_free_all (mb_slave_t *slaves, size_t slaves_num) /* {{{ */
     return;
 
   for (i = 0; i < slaves_num; i++)
+  {
+    groups_free_all (slaves[i].groups);
     data_free_all (slaves[i].collect);
+  }
   sfree (slaves);
 } /* }}} void slaves_free_all */
 
@@ -817,6 +966,7 @@ static int mb_config_add_slave (mb_host_t *host, oconfig_item_t *ci) /* {{{ */
   slave = host->slaves + host->slaves_num;
   memset (slave, 0, sizeof (*slave));
   slave->collect = NULL;
+  slave->groups = NULL;
 
   status = cf_util_get_int (ci, &slave->id);
   if (status != 0)
@@ -900,6 +1050,15 @@ static int mb_config_add_host (oconfig_item_t *ci) /* {{{ */
     }
     else if (strcasecmp ("Interval", child->key) == 0)
       status = cf_util_get_cdtime (child, &host->interval);
+    else if (strcasecmp ("MaxRegisterGap", child->key) == 0)
+    {
+      status = cf_util_get_int (child, &host->max_register_gap);
+      if ((status == 0) && (host->max_register_gap < 0))
+      {
+        ERROR ("Modbus plugin: MaxRegisterGap must not be negative.");
+        status = -1;
+      }
+    }
     else if (strcasecmp ("Slave", child->key) == 0)
       /* Don't set status: Gracefully continue if a slave fails. */
       mb_config_add_slave (host, child);
@@ -921,6 +1080,15 @@ static int mb_config_add_host (oconfig_item_t *ci) /* {{{ */
     status = -1;
   }
 
+  /* Plan the requests once all options of the host are known. */
+  if (status == 0)
+  {
+    size_t j;
+
+    for (j = 0; (j < host->slaves_num) && (status == 0); j++)
+      status = slave_plan_groups (host->slaves + j, host->max_register_gap);
+  }
+
   if (status == 0)
   {
     user_data_t ud;
@@ -30,6 +30,8 @@
 #include "common.h"
 #include "utils_ignorelist.h"
 
+#include <pthread.h>
+
 #include <netapp_api.h>
 #include <netapp_errno.h>
 
@@ -270,8 +272,11 @@ struct host_config_s {
 	char *password;
 	char *vfiler;
 	cdtime_t interval;
+	int timeout;
 
-	na_server_t *srv;
+	/* One connection per thread; queries are spread across the threads. */
+	int threads;
+	na_server_t **srv;
 	cfg_wafl_t *cfg_wafl;
 	cfg_disk_t *cfg_disk;
 	cfg_volume_perf_t *cfg_volume_perf;
@@ -439,8 +444,14 @@ static void free_host_config (host_config_t *hc) /* {{{ */
 	free_cfg_snapvault (hc->cfg_snapvault);
 	free_cfg_system (hc->cfg_system);
 
-	if (hc->srv != NULL)
-		na_server_close (hc->srv);
+	if (hc->srv != NULL) {
+		int i;
+
+		for (i = 0; i < hc->threads; i++)
+			if (hc->srv[i] != NULL)
+				na_server_close (hc->srv[i]);
+		sfree (hc->srv);
+	}
 
 	sfree (hc);
 
@@ -697,6 +708,23 @@ static int submit_double (const char *host, const char *plugin_inst, /* {{{ */
 				&v, 1, timestamp, interval));
 } /* }}} int submit_uint64 */
 
+/* Sends `query' to the host and reports how long it took to answer. */
+static na_elem_t *cna_invoke (const host_config_t *host, /* {{{ */
+		na_server_t *srv, const char *query_name, na_elem_t *query)
+{
+	na_elem_t *data;
+	cdtime_t start;
+
+	start = cdtime ();
+	data = na_server_invoke_elem (srv, query);
+
+	submit_double (host->name, "api", "response_time", query_name,
+			CDTIME_T_TO_DOUBLE (cdtime () - start),
+			/* timestamp = */ 0, host->interval);
+
+	return (data);
+} /* }}} na_elem_t *cna_invoke */
+
 /* Calculate hit ratio from old and new counters and submit the resulting
  * percentage. Used by "submit_wafl_data". */
 static int submit_cache_ratio (const char *host, /* {{{ */
@@ -1012,7 +1040,7 @@ static int cna_setup_wafl (cfg_wafl_t *cw) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_wafl */
 
-static int cna_query_wafl (host_config_t *host) /* {{{ */
+static int cna_query_wafl (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -1034,7 +1062,7 @@ static int cna_query_wafl (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_wafl->query != NULL);
 
-	data = na_server_invoke_elem(host->srv, host->cfg_wafl->query);
+	data = cna_invoke (host, srv, "wafl", host->cfg_wafl->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_wafl: na_server_invoke_elem failed for host %s: %s",
@@ -1206,7 +1234,7 @@ static int cna_setup_disk (cfg_disk_t *cd) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_disk */
 
-static int cna_query_disk (host_config_t *host) /* {{{ */
+static int cna_query_disk (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -1229,7 +1257,7 @@ static int cna_query_disk (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_disk->query != NULL);
 
-	data = na_server_invoke_elem(host->srv, host->cfg_disk->query);
+	data = cna_invoke (host, srv, "disk", host->cfg_disk->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_disk: na_server_invoke_elem failed for host %s: %s",
@@ -1377,7 +1405,7 @@ static int cna_setup_volume_perf (cfg_volume_perf_t *cd) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_volume_perf */
 
-static int cna_query_volume_perf (host_config_t *host) /* {{{ */
+static int cna_query_volume_perf (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -1400,7 +1428,7 @@ static int cna_query_volume_perf (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_volume_perf->query != NULL);
 
-	data = na_server_invoke_elem (host->srv, host->cfg_volume_perf->query);
+	data = cna_invoke (host, srv, "volume_perf", host->cfg_volume_perf->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_volume_perf: na_server_invoke_elem failed for host %s: %s",
@@ -1543,13 +1571,13 @@ static int cna_change_volume_status (const char *hostname, /* {{{ */
 } /* }}} int cna_change_volume_status */
 
 static void cna_handle_volume_snap_usage(const host_config_t *host, /* {{{ */
-		data_volume_usage_t *v)
+		na_server_t *srv, data_volume_usage_t *v)
 {
 	uint64_t snap_used = 0, value;
 	na_elem_t *data, *elem_snap, *elem_snapshots;
 	na_elem_iter_t iter_snap;
 
-	data = na_server_invoke_elem(host->srv, v->snap_query);
+	data = na_server_invoke_elem(srv, v->snap_query);
 	if (na_results_status(data) != NA_OK)
 	{
 		if (na_results_errno(data) == EVOLUMEOFFLINE) {
@@ -1691,7 +1719,7 @@ static void cna_handle_volume_sis_saved (const host_config_t *host, /* {{{ */
 } /* }}} void cna_handle_volume_sis_saved */
 
 static int cna_handle_volume_usage_data (const host_config_t *host, /* {{{ */
-		cfg_volume_usage_t *cfg_volume, na_elem_t *data)
+		na_server_t *srv, cfg_volume_usage_t *cfg_volume, na_elem_t *data)
 {
 	na_elem_t *elem_volume;
 	na_elem_t *elem_volumes;
@@ -1732,7 +1760,7 @@ static int cna_handle_volume_usage_data (const host_config_t *host, /* {{{ */
 			continue;
 
 		if ((v->flags & CFG_VOLUME_USAGE_SNAP) != 0)
-			cna_handle_volume_snap_usage(host, v);
+			cna_handle_volume_snap_usage(host, srv, v);
 		
 		if ((v->flags & CFG_VOLUME_USAGE_DF) == 0)
 			continue;
@@ -1785,7 +1813,7 @@ static int cna_setup_volume_usage (cfg_volume_usage_t *cvu) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_volume_usage */
 
-static int cna_query_volume_usage (host_config_t *host) /* {{{ */
+static int cna_query_volume_usage (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -1808,7 +1836,7 @@ static int cna_query_volume_usage (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_volume_usage->query != NULL);
 
-	data = na_server_invoke_elem(host->srv, host->cfg_volume_usage->query);
+	data = cna_invoke (host, srv, "volume_usage", host->cfg_volume_usage->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_volume_usage: na_server_invoke_elem failed for host %s: %s",
@@ -1817,7 +1845,7 @@ static int cna_query_volume_usage (host_config_t *host) /* {{{ */
 		return (-1);
 	}
 
-	status = cna_handle_volume_usage_data (host, host->cfg_volume_usage, data);
+	status = cna_handle_volume_usage_data (host, srv, host->cfg_volume_usage, data);
 
 	if (status == 0)
 		host->cfg_volume_usage->interval.last_read = now;
@@ -1909,7 +1937,7 @@ static int cna_setup_quota (cfg_quota_t *cq) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_quota */
 
-static int cna_query_quota (host_config_t *host) /* {{{ */
+static int cna_query_quota (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -1932,7 +1960,7 @@ static int cna_query_quota (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_quota->query != NULL);
 
-	data = na_server_invoke_elem (host->srv, host->cfg_quota->query);
+	data = cna_invoke (host, srv, "quota", host->cfg_quota->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_quota: na_server_invoke_elem failed for host %s: %s",
@@ -2009,7 +2037,7 @@ static int cna_handle_snapvault_data (const char *hostname, /* {{{ */
 } /* }}} int cna_handle_snapvault_data */
 
 static int cna_handle_snapvault_iter (host_config_t *host, /* {{{ */
-		na_elem_t *data)
+		na_server_t *srv, na_elem_t *data)
 {
 	const char *tag;
 
@@ -2029,7 +2057,7 @@ static int cna_handle_snapvault_iter (host_config_t *host, /* {{{ */
 	for (i = 0; i < records_count; ++i) {
 		na_elem_t *elem;
 
-		elem = na_server_invoke (host->srv,
+		elem = na_server_invoke (srv,
 				"snapvault-secondary-relationship-status-list-iter-next",
 				"maximum", "1", "tag", tag, NULL);
 
@@ -2046,7 +2074,7 @@ static int cna_handle_snapvault_iter (host_config_t *host, /* {{{ */
 		na_elem_free (elem);
 	}
 
-	na_elem_free (na_server_invoke (host->srv,
+	na_elem_free (na_server_invoke (srv,
 			"snapvault-secondary-relationship-status-list-iter-end",
 			"tag", tag, NULL));
 	return (0);
@@ -2070,7 +2098,7 @@ static int cna_setup_snapvault (cfg_snapvault_t *sv) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_snapvault */
 
-static int cna_query_snapvault (host_config_t *host) /* {{{ */
+static int cna_query_snapvault (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -2091,7 +2119,7 @@ static int cna_query_snapvault (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_snapvault->query != NULL);
 
-	data = na_server_invoke_elem (host->srv, host->cfg_snapvault->query);
+	data = cna_invoke (host, srv, "snapvault", host->cfg_snapvault->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_snapvault: na_server_invoke_elem failed for host %s: %s",
@@ -2100,7 +2128,7 @@ static int cna_query_snapvault (host_config_t *host) /* {{{ */
 		return (-1);
 	}
 
-	status = cna_handle_snapvault_iter (host, data);
+	status = cna_handle_snapvault_iter (host, srv, data);
 
 	if (status == 0)
 		host->cfg_snapvault->interval.last_read = now;
@@ -2228,7 +2256,7 @@ static int cna_setup_system (cfg_system_t *cs) /* {{{ */
 	return (0);
 } /* }}} int cna_setup_system */
 
-static int cna_query_system (host_config_t *host) /* {{{ */
+static int cna_query_system (host_config_t *host, na_server_t *srv) /* {{{ */
 {
 	na_elem_t *data;
 	int status;
@@ -2250,7 +2278,7 @@ static int cna_query_system (host_config_t *host) /* {{{ */
 		return (status);
 	assert (host->cfg_system->query != NULL);
 
-	data = na_server_invoke_elem(host->srv, host->cfg_system->query);
+	data = cna_invoke (host, srv, "system", host->cfg_system->query);
 	if (na_results_status (data) != NA_OK)
 	{
 		ERROR ("netapp plugin: cna_query_system: na_server_invoke_elem failed for host %s: %s",
@@ -2830,6 +2858,8 @@ static host_config_t *cna_alloc_host (void) /* {{{ */
 	host->username = NULL;
 	host->password = NULL;
 	host->vfiler = NULL;
+	host->timeout = 5;
+	host->threads = 1;
 	host->srv = NULL;
 	host->cfg_wafl = NULL;
 	host->cfg_disk = NULL;
@@ -2889,6 +2919,8 @@ static host_config_t *cna_shallow_clone_host (host_config_t *host) /* {{{ */
 	}
 
 	clone->interval = host->interval;
+	clone->timeout = host->timeout;
+	clone->threads = host->threads;
 
 	return (clone);
 } /* }}} host_config_t *cna_shallow_clone_host */
@@ -2967,6 +2999,10 @@ static int cna_config_host (host_config_t *host, /* {{{ */
 			status = cf_util_get_string (item, &host->password);
 		} else if (!strcasecmp(item->key, "Interval")) {
 			status = cf_util_get_cdtime (item, &host->interval);
+		} else if (!strcasecmp(item->key, "Timeout")) {
+			status = cf_util_get_int (item, &host->timeout);
+		} else if (!strcasecmp(item->key, "Threads")) {
+			status = cf_util_get_int (item, &host->threads);
 		} else if (!strcasecmp(item->key, "WAFL")) {
 			cna_config_wafl(host, item);
 		} else if (!strcasecmp(item->key, "Disks")) {
@@ -3019,6 +3055,18 @@ static int cna_config_host (host_config_t *host, /* {{{ */
 	if (host->port <= 0)
 		host->port = (host->protocol == NA_SERVER_TRANSPORT_HTTP) ? 80 : 443;
 
+	if (host->timeout <= 0) {
+		WARNING ("netapp plugin: \"Timeout\" must be positive. Using 5 seconds "
+				"for host \"%s\".", host->name);
+		host->timeout = 5;
+	}
+
+	if (host->threads <= 0) {
+		WARNING ("netapp plugin: \"Threads\" must be positive. Using one "
+				"thread for host \"%s\".", host->name);
+		host->threads = 1;
+	}
+
 	if ((host->username == NULL) || (host->password == NULL)) {
 		WARNING("netapp plugin: Please supply login information for host \"%s\". "
 				"Ignoring host block.", host->name);
@@ -3028,6 +3076,12 @@ static int cna_config_host (host_config_t *host, /* {{{ */
 	if (status != 0)
 		return status;
 
+	host->srv = calloc ((size_t) host->threads, sizeof (*host->srv));
+	if (host->srv == NULL) {
+		ERROR ("netapp plugin: calloc failed.");
+		return (-1);
+	}
+
 	return (0);
 } /* }}} host_config_t *cna_config_host */
 
@@ -3036,38 +3090,34 @@ static int cna_config_host (host_config_t *host, /* {{{ */
  *
  * Pretty standard stuff here.
  */
-static int cna_init_host (host_config_t *host) /* {{{ */
+static na_server_t *cna_open_server (const host_config_t *host) /* {{{ */
 {
 	/* Request version 1.1 of the ONTAP API */
 	int major_version = 1, minor_version = 1;
-
-	if (host == NULL)
-		return (EINVAL);
-
-	if (host->srv != NULL)
-		return (0);
+	na_server_t *srv;
 
 	if (host->vfiler != NULL) /* Request version 1.7 of the ONTAP API */
 		minor_version = 7;
 
-	host->srv = na_server_open (host->host, major_version, minor_version);
-	if (host->srv == NULL) {
+	srv = na_server_open (host->host, major_version, minor_version);
+	if (srv == NULL) {
 		ERROR ("netapp plugin: na_server_open (%s) failed.", host->host);
-		return (-1);
+		return (NULL);
 	}
 
-	na_server_set_transport_type(host->srv, host->protocol,
+	na_server_set_transport_type(srv, host->protocol,
 			/* transportarg = */ NULL);
-	na_server_set_port(host->srv, host->port);
-	na_server_style(host->srv, NA_STYLE_LOGIN_PASSWORD);
-	na_server_adminuser(host->srv, host->username, host->password);
-	na_server_set_timeout(host->srv, 5 /* seconds */);
+	na_server_set_port(srv, host->port);
+	na_server_style(srv, NA_STYLE_LOGIN_PASSWORD);
+	na_server_adminuser(srv, host->username, host->password);
+	na_server_set_timeout(srv, host->timeout);
 
 	if (host->vfiler != NULL) {
-		if (! na_server_set_vfiler (host->srv, host->vfiler)) {
+		if (! na_server_set_vfiler (srv, host->vfiler)) {
 			ERROR ("netapp plugin: Failed to connect to VFiler '%s' on host '%s'.",
 					host->vfiler, host->host);
-			return (-1);
+			na_server_close (srv);
+			return (NULL);
 		}
 		else {
 			INFO ("netapp plugin: Connected to VFiler '%s' on host '%s'.",
@@ -3075,8 +3125,8 @@ static int cna_init_host (host_config_t *host) /* {{{ */
 		}
 	}
 
-	return (0);
-} /* }}} int cna_init_host */
+	return (srv);
+} /* }}} na_server_t *cna_open_server */
 
 static int cna_init (void) /* {{{ */
 {
@@ -3092,60 +3142,122 @@ static int cna_init (void) /* {{{ */
 	return (0);
 } /* }}} cna_init */
 
-static int cna_read_internal (host_config_t *host) { /* {{{ */
-	int status;
+typedef int cna_query_t (host_config_t *host, na_server_t *srv);
+
+/* The query groups of a host. They use different parts of the host's
+ * configuration, so they can run in parallel. */
+static cna_query_t *const cna_queries[] = {
+	cna_query_wafl,
+	cna_query_disk,
+	cna_query_volume_perf,
+	cna_query_volume_usage,
+	cna_query_quota,
+	cna_query_snapvault,
+	cna_query_system
+};
+static const size_t cna_queries_num = STATIC_ARRAY_SIZE (cna_queries);
 
-	status = cna_query_wafl (host);
-	if (status != 0)
-		return (status);
+typedef struct {
+	host_config_t *host;
+	pthread_mutex_t lock;
+	size_t next;
+} cna_read_state_t;
 
-	status = cna_query_disk (host);
-	if (status != 0)
-		return (status);
+typedef struct {
+	cna_read_state_t *state;
+	int index;
+	int status;
+	pthread_t thread;
+} cna_read_worker_t;
+
+/* Runs queries from the shared list using the connection with the worker's
+ * index until all queries have been started. A worker whose query fails
+ * closes its connection and stops; it is reopened during the next read. */
+static int cna_read_internal (cna_read_state_t *state, int index) { /* {{{ */
+	host_config_t *host = state->host;
+	int status;
 
-	status = cna_query_volume_perf (host);
-	if (status != 0)
-		return (status);
+	if (host->srv[index] == NULL) {
+		host->srv[index] = cna_open_server (host);
+		if (host->srv[index] == NULL)
+			return (-1);
+	}
 
-	status = cna_query_volume_usage (host);
-	if (status != 0)
-		return (status);
+	while (42) {
+		size_t i;
 
-	status = cna_query_quota (host);
-	if (status != 0)
-		return (status);
+		pthread_mutex_lock (&state->lock);
+		i = state->next;
+		if (i < cna_queries_num)
+			state->next++;
+		pthread_mutex_unlock (&state->lock);
 
-	status = cna_query_snapvault (host);
-	if (status != 0)
-		return (status);
+		if (i >= cna_queries_num)
+			break;
 
-	status = cna_query_system (host);
-	if (status != 0)
-		return (status);
+		status = (*cna_queries[i]) (host, host->srv[index]);
+		if (status != 0) {
+			na_server_close (host->srv[index]);
+			host->srv[index] = NULL;
+			return (status);
+		}
+	}
 
 	return 0;
 } /* }}} int cna_read_internal */
 
+static void *cna_read_thread (void *arg) /* {{{ */
+{
+	cna_read_worker_t *worker = arg;
+
+	worker->status = cna_read_internal (worker->state, worker->index);
+	return (NULL);
+} /* }}} void *cna_read_thread */
+
 static int cna_read (user_data_t *ud) { /* {{{ */
 	host_config_t *host;
-	int status;
+	cna_read_state_t state;
+	cna_read_worker_t workers[STATIC_ARRAY_SIZE (cna_queries)];
+	int workers_num;
+	int i;
 
 	if ((ud == NULL) || (ud->data == NULL))
 		return (-1);
 
 	host = ud->data;
 
-	status = cna_init_host (host);
-	if (status != 0)
-		return (status);
-
-	status = cna_read_internal (host);
-	if (status != 0)
-	{
-		if (host->srv != NULL)
-			na_server_close (host->srv);
-		host->srv = NULL;
+	memset (&state, 0, sizeof (state));
+	state.host = host;
+	pthread_mutex_init (&state.lock, /* attr = */ NULL);
+
+	/* More threads than query groups would only sit idle. */
+	workers_num = host->threads;
+	if (workers_num > (int) cna_queries_num)
+		workers_num = (int) cna_queries_num;
+
+	memset (workers, 0, sizeof (workers));
+	for (i = 1; i < workers_num; i++) {
+		int status;
+
+		workers[i].state = &state;
+		workers[i].index = i;
+		status = plugin_thread_create (&workers[i].thread, /* attr = */ NULL,
+				cna_read_thread, &workers[i]);
+		if (status != 0) {
+			ERROR ("netapp plugin: Starting a thread for host %s failed.",
+					host->name);
+			break;
+		}
 	}
+	workers_num = i;
+
+	/* The read thread does its share of the work, too. */
+	cna_read_internal (&state, /* index = */ 0);
+
+	for (i = 1; i < workers_num; i++)
+		pthread_join (workers[i].thread, /* retval = */ NULL);
+
+	pthread_mutex_destroy (&state.lock);
 
 	return 0;
 } /* }}} int cna_read */
@@ -23,15 +23,21 @@
  **/
 
 #define _BSD_SOURCE /* For struct ip_mreq */
+#define _GNU_SOURCE /* For recvmmsg() */
 
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
 #include "configfile.h"
+#include "utils_affinity.h"
 #include "utils_fbhash.h"
 #include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_complain.h"
+#include "utils_lock.h"
+#include "utils_resolve.h"
+#include "utils_ring.h"
+#include "utils_vl_lookup.h"
 
 #include "network.h"
 
@@ -47,6 +53,9 @@
 #if HAVE_NETINET_IN_H
 # include <netinet/in.h>
 #endif
+#if HAVE_NETINET_UDP_H
+# include <netinet/udp.h>
+#endif
 #if HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
@@ -56,6 +65,11 @@
 #if HAVE_NET_IF_H
 # include <net/if.h>
 #endif
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+#include <regex.h>
 
 #if HAVE_LIBGCRYPT
 # include <pthread.h>
@@ -114,20 +128,106 @@ struct sockent_client
 	int security_level;
 	char *username;
 	char *password;
+	/* Keyed once in sockent_open(). */
 	gcry_cipher_hd_t cypher;
+	gcry_md_hd_t hmac;
 	unsigned char password_hash[32];
 #endif
+	/* The socket whose signed or encrypted packets are sent on this one as
+	 * well, because the security settings are the same. Points to this
+	 * socket if there is no earlier one. */
+	struct sockent *encoder;
+
+	/* TCP only. The connection is (re-)established by the send thread,
+	 * waiting "tcp_backoff" between failed attempts. Frames which
+	 * couldn't be written yet are kept in "tcp_out". */
+#define TCP_STATE_DISCONNECTED 0
+#define TCP_STATE_CONNECTING   1
+#define TCP_STATE_CONNECTED    2
+	int       tcp_state;
+	cdtime_t  tcp_retry;
+	cdtime_t  tcp_backoff;
+	pthread_mutex_t tcp_lock;
+	char     *tcp_out;
+	size_t    tcp_out_len;
+	size_t    tcp_out_size;
+#define COMPRESSION_NONE 0
+#define COMPRESSION_ZLIB 1
+	int       compression;
+	/* UDP only. Send many packets with one call, letting the kernel
+	 * split them up, see network_send_segmented(). */
+	int       segment_offload;
+};
+
+/* Matches one part of the identifier, see network_config_add_filter(). */
+#define FILTER_ANY     0
+#define FILTER_LITERAL 1
+#define FILTER_REGEX   2
+struct filter_selector_s
+{
+	int      kind;
+	char    *literal;
+	regex_t  regex;
+};
+typedef struct filter_selector_s filter_selector_t;
+
+/* An <Allow /> or <Deny /> block of a <Listen /> socket. */
+struct filter_rule_s
+{
+	char *name;
+	_Bool deny;
+	filter_selector_t host;
+	filter_selector_t plugin;
+	filter_selector_t type;
+	/* Values discarded by a <Deny /> rule. */
+	derive_t dropped;
+};
+typedef struct filter_rule_s filter_rule_t;
+
+/* Rule numbers, in configuration order. */
+struct filter_index_s
+{
+	size_t *rules;
+	size_t  rules_num;
 };
+typedef struct filter_index_s filter_index_t;
+
+/* The rules of a socket, indexed by plugin: the rules to check for a value
+ * are those of its plugin in "by_plugin" and those in "any_plugin", which
+ * don't select a plugin literally. The first matching rule decides; values
+ * matching none are allowed. Read-only once the configuration is read, so
+ * searching it needs no lock. */
+struct filter_s
+{
+	filter_rule_t  *rules;
+	size_t          rules_num;
+	c_avl_tree_t   *by_plugin;
+	filter_index_t  any_plugin;
+};
+typedef struct filter_s filter_t;
 
 struct sockent_server
 {
 	int *fd;
 	size_t fd_num;
+	/* Number of sockets opened for each address, one per receive thread. */
+	int receive_threads;
+	/* Pass packets on to the servers instead of dispatching them, see
+	 * relay_packet(). */
+	int relay;
+	/* See network_shed(). */
+#define PRIORITY_LOW    0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_HIGH   2
+#define PRIORITY_NUM    3
+	int priority;
+	/* The <Allow /> and <Deny /> blocks, or NULL. See
+	 * network_filter_deny(). */
+	filter_t *filter;
 #if HAVE_LIBGCRYPT
 	int security_level;
 	char *auth_file;
 	fbhash_t *userdb;
-	gcry_cipher_hd_t cypher;
 #endif
 };
 
@@ -136,6 +236,9 @@ typedef struct sockent
 #define SOCKENT_TYPE_CLIENT 1
 #define SOCKENT_TYPE_SERVER 2
 	int type;
+#define NETWORK_PROTOCOL_UDP 0
+#define NETWORK_PROTOCOL_TCP 1
+	int protocol;
 
 	char *node;
 	char *service;
@@ -216,6 +319,54 @@ struct part_values_s
 };
 typedef struct part_values_s part_values_t;
 
+/*                      1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-------------------------------+-------------------------------+
+ * ! Type                          ! Length                        !
+ * +---------------+---------------+---------------+---------------+
+ * ! Sequence      ! Flags         ! Num of values ! Type0         !
+ * +---------------+---------------+---------------+---------------+
+ * : Value0, Value1, ...                                           :
+ * +---------------------------------------------------------------+
+ *
+ * The values of TYPE_VALUES_COMPACT parts take a variable number of bytes.
+ * Without COMPACT_FLAG_DELTA (a "key frame"), counters and absolutes are sent
+ * as varints, derives as zigzag encoded varints and gauges as the bits of the
+ * double. With COMPACT_FLAG_DELTA, counters, derives and absolutes are sent
+ * as the zigzag encoded difference to the previous value and gauges as the
+ * XOR with the bits of the previous value. The previous values are those of
+ * the same series with a sequence number one less.
+ *
+ * Varints take seven bits per byte, least significant group first, with the
+ * high bit set in all but the last byte. Gauge bits are sent as a byte giving
+ * the number of leading zero bytes (high nibble) and of the bytes which
+ * follow (low nibble), followed by those bytes, most significant first. The
+ * remaining bytes are zero.
+ */
+#define COMPACT_FLAG_DELTA 0x01
+#define COMPACT_HEADER_SIZE 7
+
+/*                      1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-------------------------------+-------------------------------+
+ * ! Type                          ! Length                        !
+ * +-------------------------------+-------------------------------+
+ * ! Session (Bits  0 - 31)                                        !
+ * ! Session (Bits 32 - 63)                                        !
+ * +---------------------------------------------------------------+
+ * ! Number                                                        !
+ * +---------------------------------------------------------------+
+ *
+ * A TYPE_IDENT_DEFINE part assigns the number to the identifier set by the
+ * host, plugin, plugin instance, type and type instance parts before it,
+ * which are then all sent. A TYPE_IDENT_REF part sets all five to the
+ * identifier of the number. The session is chosen by the sender at startup,
+ * so the numbers of different senders and of restarts don't mix. Values
+ * following a number the receiver doesn't know are dropped; the sender
+ * defines each number again every "IdentifierRefreshInterval" value lists.
+ */
+#define DICT_PART_SIZE 16
+
 /*                      1 1 1 1 1 1 1 1 1 1 2 2 2 2 2 2 2 2 2 2 3 3
  *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
  * +-------------------------------+-------------------------------+
@@ -263,12 +414,21 @@ struct part_encryption_aes256_s
 };
 typedef struct part_encryption_aes256_s part_encryption_aes256_t;
 
+/* Sources are told apart by their address: the key is the address family
+ * followed by the IPv4 or IPv6 address, see network_source_key(). */
+#define SOURCE_KEY_SIZE 17
+
+/* The packet data is allocated together with the entry, see
+ * receive_pool_create(). */
 struct receive_list_entry_s
 {
   char *data;
   int  data_len;
   int  fd;
-  struct receive_list_entry_s *next;
+  /* Only set if "SourceStats" is enabled. */
+  unsigned char source[SOURCE_KEY_SIZE];
+  /* The receive thread whose pool the entry belongs to. */
+  struct receive_thread_s *owner;
 };
 typedef struct receive_list_entry_s receive_list_entry_t;
 
@@ -280,67 +440,390 @@ static int network_config_ttl = 0;
 static size_t network_config_packet_size = 1452;
 static int network_config_forward = 0;
 static int network_config_stats = 0;
+/* Number of packets to read from a socket with one call to recvmmsg(2). */
+#if HAVE_RECVMMSG
+static int network_config_batch_size = 32;
+#else
+static int network_config_batch_size = 1;
+#endif
+/* Number of packet buffers of each receive thread. */
+static int network_config_receive_buffers = 4096;
 
 static sockent_t *sending_sockets = NULL;
 
-static receive_list_entry_t *receive_list_head = NULL;
-static receive_list_entry_t *receive_list_tail = NULL;
-static pthread_mutex_t       receive_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t        receive_list_cond = PTHREAD_COND_INITIALIZER;
-static uint64_t              receive_list_length = 0;
+/* Each dispatch thread parses the packets the receive threads queue for it.
+ * The packets of one host always go to the same thread, see
+ * network_dispatch_index(). "lock" and "cond" are only used to sleep while
+ * all queues are empty. */
+struct dispatch_thread_s
+{
+	pthread_t       id;
+	_Bool           running;
+	size_t          index;
+
+	c_mutex_t       lock;
+	pthread_cond_t  cond;
+	/* Set while the thread is about to wait for "cond". The receive
+	 * threads only signal it then. */
+	volatile int    waiting;
+};
+typedef struct dispatch_thread_s dispatch_thread_t;
+
+static dispatch_thread_t *dispatch_threads = NULL;
+/* The memory of all receive pools, reported by the self plugin. */
+static plugin_memory_t   *receive_memory = NULL;
+static size_t             dispatch_threads_num = 0;
+static int                network_config_dispatch_threads = 1;
+/* See the "ReceiveThreadCPUs" and "DispatchThreadCPUs" options. */
+static c_cpusets_t       *network_config_receive_cpus = NULL;
+static c_cpusets_t       *network_config_dispatch_cpus = NULL;
+
+/* Each receive thread polls its share of the listening sockets and reads
+ * packets into a fixed pool of buffers. Full buffers are passed to the
+ * dispatch threads and come back through lock-free rings, one pair per
+ * dispatch thread. The counters are written by that thread only. */
+struct receive_thread_s
+{
+	pthread_t      id;
+	_Bool          running;
+	struct pollfd *pollfd;
+	size_t         pollfd_num;
+
+	/* All entries and their data, in one allocation of "pool_size"
+	 * bytes. */
+	char                  *pool;
+	size_t                 pool_size;
+	/* Entries which are free to use. Only the receive thread touches
+	 * this, it's refilled from "returned". */
+	receive_list_entry_t **free_entries;
+	size_t                 free_entries_num;
+	/* queued[i]: packets for dispatch thread i.
+	 * returned[i]: entries dispatch thread i is done with. */
+	c_spsc_t             **queued;
+	c_spsc_t             **returned;
+
+	derive_t          octets;
+	derive_t          packets;
+	/* Packets read and discarded because all buffers were in use. */
+	derive_t          dropped;
+	/* Packets discarded by network_shed(), by priority. */
+	derive_t          shed[PRIORITY_NUM];
+	/* Receive system calls and the largest number of packets returned by
+	 * one of them since the statistics were last read. */
+	derive_t          calls;
+	volatile uint64_t batch_peak;
+	/* Greatest number of packets queued for one dispatch thread since the
+	 * statistics were last read. */
+	volatile uint64_t queue_peak;
+};
+typedef struct receive_thread_s receive_thread_t;
 
 static sockent_t     *listen_sockets = NULL;
-static struct pollfd *listen_sockets_pollfd = NULL;
 static size_t         listen_sockets_num = 0;
-
-/* The receive and dispatch threads will run as long as `listen_loop' is set to
- * zero. */
+/* TCP sockets in "listen_sockets". They're polled by the TCP thread, not the
+ * receive threads. */
+static size_t         tcp_listen_sockets_num = 0;
+/* Maps the file descriptors of "listen_sockets" to their entry. */
+static sockent_t    **listen_sockets_by_fd = NULL;
+static size_t         listen_sockets_by_fd_num = 0;
+
+static receive_thread_t *receive_threads = NULL;
+static size_t            receive_threads_num = 0;
+
+/* Limits of the packets waiting for the dispatch threads, zero if unlimited.
+ * "queued_packets" and "queued_bytes" are only kept up to date while one of
+ * the limits is set, see network_shed(). */
+static uint64_t          network_config_max_queued_packets = 0;
+static uint64_t          network_config_max_queued_bytes = 0;
+static volatile uint64_t queued_packets = 0;
+static volatile uint64_t queued_bytes = 0;
+#define NETWORK_LIMITS_ENABLED ((network_config_max_queued_packets > 0) \
+		|| (network_config_max_queued_bytes > 0))
+
+/* The receive threads will run as long as `listen_loop' is set to zero. */
 static int       listen_loop = 0;
-static int       receive_thread_running = 0;
-static pthread_t receive_thread_id;
-static int       dispatch_thread_running = 0;
-static pthread_t dispatch_thread_id;
-
-/* Buffer in which to-be-sent network packets are constructed. */
-static char            *send_buffer;
-static char            *send_buffer_ptr;
-static int              send_buffer_fill;
-static value_list_t     send_buffer_vl = VALUE_LIST_STATIC;
-static pthread_mutex_t  send_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set once the receive threads have exited. The dispatch threads then empty
+ * their queues and exit, too. */
+static volatile int dispatch_loop = 0;
+
+/* Per-source accounting using the "space saving" algorithm: each table
+ * tracks up to "network_config_source_stats" sources. A source which isn't
+ * tracked yet replaces the one with the fewest octets and inherits its
+ * octets, so the heavy senders stay in the table no matter how many small
+ * ones there are. There is one table per dispatch thread, which always sees
+ * the same sources, plus one for the TCP thread. "source_lock" protects
+ * "source_tables" from being freed while it's read by
+ * network_source_command(). */
+struct source_entry_s
+{
+  unsigned char key[SOURCE_KEY_SIZE];
+  derive_t octets;
+  derive_t packets;
+  derive_t values;
+  derive_t errors;
+  /* The octets inherited from the source this one replaced. "octets" may
+   * be too large by up to this much, the other counters too small. */
+  derive_t overestimate;
+};
+typedef struct source_entry_s source_entry_t;
+
+struct source_table_s
+{
+  pthread_mutex_t lock;
+  c_avl_tree_t   *tree;
+  source_entry_t *entries;
+  size_t          entries_num;
+};
+typedef struct source_table_s source_table_t;
+
+static int             network_config_source_stats = 0;
+static source_table_t *source_tables = NULL;
+static size_t          source_tables_num = 0;
+static pthread_mutex_t source_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A connection accepted on one of the TCP sockets. "buffer" holds the part of
+ * the stream which doesn't form a complete frame yet. */
+struct tcp_connection_s
+{
+	int        fd;
+	sockent_t *se;
+	unsigned char source[SOURCE_KEY_SIZE];
+	char      *buffer;
+	size_t     fill;
+	size_t     size;
+};
+typedef struct tcp_connection_s tcp_connection_t;
+
+/* Largest frame accepted, before and after decompressing. */
+#define TCP_FRAME_MAX 4194304
+/* Connections accepted beyond this number are closed right away. */
+#define TCP_CONNECTIONS_MAX 1024
+/* Frames are dropped while this many bytes are waiting to be sent. */
+#define TCP_OUT_MAX 8388608
+/* Longest wait between two connection attempts. */
+#define TCP_BACKOFF_MAX TIME_T_TO_CDTIME_T (60)
+
+/* The TCP thread accepts connections and reads frames from them. It stops
+ * when "listen_loop" is set, like the receive threads. */
+static pthread_t tcp_thread_id;
+static _Bool     tcp_thread_running = 0;
+
+/* Buffer in which to-be-sent network packets are constructed. Each write
+ * thread fills a buffer of its own, see network_send_buffer_get(), so the
+ * threads don't contend for a lock and each packet holds the series one
+ * thread sees next to each other. The buffer is sent after each batch of
+ * values, see network_write_batch(). "lock" is only taken by other threads
+ * when flushing. */
+struct send_buffer_s
+{
+	c_mutex_t       lock;
+	char           *buffer;
+	char           *ptr;
+	int             fill;
+	/* The host, plugin, etc. last written to "buffer". Parts which
+	 * didn't change are left out. */
+	value_list_t    vl_def;
+
+	struct send_buffer_s *next;
+};
+typedef struct send_buffer_s send_buffer_t;
+
+/* All send buffers, so they can be flushed. */
+static send_buffer_t   *send_buffers = NULL;
+static c_mutex_t        send_buffers_lock =
+	C_MUTEX_INITIALIZER ("network-send_buffers");
+static pthread_key_t    send_buffer_key;
+static pthread_once_t   send_buffer_once = PTHREAD_ONCE_INIT;
+
+/* Finished packets are queued and sent by the send thread, so writing
+ * doesn't wait for the network. */
+struct send_packet_s
+{
+	size_t size;
+	struct send_packet_s *next;
+	char data[];
+};
+typedef struct send_packet_s send_packet_t;
+
+/* Packets passed to one call of sendmmsg(2). */
+#define SEND_BATCH_SIZE 32
+/* Writers wait while this many packets are queued. */
+#define SEND_QUEUE_LIMIT 1024
+
+static send_packet_t   *send_queue_head = NULL;
+static send_packet_t   *send_queue_tail = NULL;
+static size_t           send_queue_length = 0;
+/* Sent packets, kept for reuse. */
+static send_packet_t   *send_queue_free = NULL;
+static c_mutex_t        send_queue_lock =
+	C_MUTEX_INITIALIZER ("network-send_queue");
+static pthread_cond_t   send_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   send_space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        send_thread_id;
+static _Bool            send_thread_running = 0;
+/* Set at shutdown. The send thread empties the queue and exits, packets are
+ * then sent right away. */
+static int              send_loop = 0;
+
+/* The time of the last value sent of each series, so it's not accepted when
+ * it comes back, see check_receive_okay(). Series are identified by the hash
+ * of their identifier, which is also used to pick the slot. A slot which has
+ * been taken over by another series only means a looped value isn't caught
+ * here; the cache then discards it as too old. Allocated if there are
+ * servers to send to. */
+struct sent_slot_s
+{
+  uint64_t hash;
+  cdtime_t time;
+};
+typedef struct sent_slot_s sent_slot_t;
+
+#define SENT_SLOTS_NUM 16384
+#define SENT_LOCKS_NUM 64
+
+static sent_slot_t     *sent_slots = NULL;
+static pthread_mutex_t  sent_locks[SENT_LOCKS_NUM];
+
+/* The last values of a series, as 64 bit patterns, for TYPE_VALUES_COMPACT
+ * parts. The sending side keeps them in "compact_trees", shared by all write
+ * threads because a series may be written by any of them. Each tree holds
+ * the series whose identifier hash modulo COMPACT_TREES_NUM is its index and
+ * is protected by the lock with the same index. The receiving side keeps
+ * them in the parse arena: all packets of one host are parsed by the same
+ * thread. */
+struct compact_state_s
+{
+  uint64_t hash;
+  uint8_t  seq;
+  /* Values sent since and including the last key frame. */
+  int      count;
+  size_t   values_num;
+  uint64_t values[];
+};
+typedef struct compact_state_s compact_state_t;
+
+#define COMPACT_TREES_NUM 64
+
+static int              network_config_compact = 0;
+static int              network_config_keyframe_interval = 8;
+static c_avl_tree_t    *compact_trees[COMPACT_TREES_NUM];
+static pthread_mutex_t  compact_locks[COMPACT_TREES_NUM];
+
+/* The number of each series for TYPE_IDENT_* parts. Like the compact state,
+ * the sending side keeps them in trees picked by the identifier hash, the
+ * receiving side in the parse arena. "uses" counts the value lists sent since
+ * the number was last defined; zero if it never has been. */
+struct dict_state_s
+{
+  uint64_t hash;
+  uint32_t id;
+  int      uses;
+};
+typedef struct dict_state_s dict_state_t;
+
+struct dict_key_s
+{
+  uint64_t session;
+  uint32_t id;
+};
+typedef struct dict_key_s dict_key_t;
+
+/* Host, plugin, plugin instance, type and type instance follow "strings" one
+ * after another, each null terminated. */
+struct dict_entry_s
+{
+  dict_key_t key;
+  cdtime_t   used;
+  char       strings[];
+};
+typedef struct dict_entry_s dict_entry_t;
+
+#define DICT_TREES_NUM 64
+/* Receivers forget numbers which haven't been used for this long. */
+#define DICT_EXPIRE TIME_T_TO_CDTIME_T (3600)
+
+static int              network_config_dictionary = 0;
+static int              network_config_dictionary_refresh = 8;
+static uint64_t         dict_session = 0;
+static uint32_t         dict_next_id = 0;
+static c_avl_tree_t    *dict_trees[DICT_TREES_NUM];
+static pthread_mutex_t  dict_locks[DICT_TREES_NUM];
 
 /* XXX: These counters are incremented from one place only. The spot in which
- * the values are incremented is either only reachable by one thread (the
- * dispatch thread, for example) or locked by some lock (send_buffer_lock for
- * example). Only if neither is true, the stats_lock is acquired. The counters
- * are always read without holding a lock in the hope that writing 8 bytes to
- * memory is an atomic operation. */
-static derive_t stats_octets_rx  = 0;
+ * the values are incremented is either locked by some lock or the counter is
+ * updated atomically (the "dispatched" and "sent" counters, which all dispatch
+ * and write threads update, respectively). Otherwise the stats_lock is
+ * acquired. The counters are always read without holding a lock in the hope
+ * that writing 8 bytes to memory is an atomic operation. */
 static derive_t stats_octets_tx  = 0;
-static derive_t stats_packets_rx = 0;
 static derive_t stats_packets_tx = 0;
 static derive_t stats_values_dispatched = 0;
 static derive_t stats_values_not_dispatched = 0;
 static derive_t stats_values_sent = 0;
 static derive_t stats_values_not_sent = 0;
+static derive_t stats_packets_relayed = 0;
+static derive_t stats_packets_not_relayed = 0;
+/* Compact values which couldn't be decoded, because the previous values of
+ * their series were lost. */
+static derive_t stats_values_compact_lost = 0;
+/* Values dropped because their identifier number wasn't known. */
+static derive_t stats_values_dict_lost = 0;
+/* Values discarded by network_queue_values() while shedding, by priority. */
+static derive_t stats_values_shed[PRIORITY_NUM];
+/* Written by the TCP thread only. */
+static derive_t stats_octets_rx_tcp = 0;
+static derive_t stats_frames_rx_tcp = 0;
+/* Bytes not sent over TCP because a connection was down for too long or
+ * failed while sending. */
+static derive_t stats_octets_dropped_tcp = 0;
 static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* The <Priority /> blocks. Searching the lookup may create objects, so it's
+ * done with "priority_lock" held, which also protects "priority_match". */
+static lookup_t       *priority_lookup = NULL;
+static pthread_mutex_t priority_lock = PTHREAD_MUTEX_INITIALIZER;
+static int             priority_match;
+
 /*
  * Private functions
  */
+/* Remembers that the value of "vl" has been sent, see check_receive_okay(). */
+static void network_sent_set (const value_list_t *vl) /* {{{ */
+{
+  uint64_t hash;
+  size_t idx;
+
+  if (sent_slots == NULL)
+    return;
+
+  hash = plugin_hash_vl (vl);
+  idx = (size_t) (hash & (SENT_SLOTS_NUM - 1));
+
+  pthread_mutex_lock (sent_locks + (idx % SENT_LOCKS_NUM));
+  sent_slots[idx].hash = hash;
+  sent_slots[idx].time = vl->time;
+  pthread_mutex_unlock (sent_locks + (idx % SENT_LOCKS_NUM));
+} /* }}} void network_sent_set */
+
 static _Bool check_receive_okay (const value_list_t *vl) /* {{{ */
 {
-  uint64_t time_sent = 0;
-  int status;
+  uint64_t hash;
+  size_t idx;
+  _Bool okay;
 
-  status = uc_meta_data_get_unsigned_int (vl,
-      "network:time_sent", &time_sent);
+  if (sent_slots == NULL)
+    return (1);
+
+  hash = plugin_hash_vl (vl);
+  idx = (size_t) (hash & (SENT_SLOTS_NUM - 1));
 
   /* This is a value we already sent. Don't allow it to be received again in
    * order to avoid looping. */
-  if ((status == 0) && (time_sent >= ((uint64_t) vl->time)))
-    return (0);
+  pthread_mutex_lock (sent_locks + (idx % SENT_LOCKS_NUM));
+  okay = (sent_slots[idx].hash != hash) || (sent_slots[idx].time < vl->time);
+  pthread_mutex_unlock (sent_locks + (idx % SENT_LOCKS_NUM));
 
-  return (1);
+  return (okay);
 } /* }}} _Bool check_receive_okay */
 
 static _Bool check_send_okay (const value_list_t *vl) /* {{{ */
@@ -406,2573 +889,6532 @@ static _Bool check_send_notify_okay (const notification_t *n) /* {{{ */
   return (!received);
 } /* }}} _Bool check_send_notify_okay */
 
-static int network_dispatch_values (value_list_t *vl, /* {{{ */
-    const char *username)
+/* The value lists of one packet. Values are decoded from the packet straight
+ * into "values" and the lists are handed to the daemon in one batch once the
+ * packet has been parsed, see network_parse_flush(). Each dispatch thread has
+ * an arena of its own, see network_parse_arena_get(). */
+struct parse_arena_s
 {
-  int status;
+  value_list_t *vls;
+  size_t        vls_num;
+  size_t        vls_size;
+
+  /* Large enough for all values of one packet, so it's never reallocated
+   * while "vls" points into it. */
+  value_t      *values;
+  size_t        values_num;
+  size_t        values_size;
+
+  /* Value lists parsed by this thread, see network_parse_count(). */
+  uint64_t      vls_received;
+
+  /* The last values of each series received in TYPE_VALUES_COMPACT parts,
+   * created on first use. */
+  c_avl_tree_t *compact;
+
+  /* The identifiers defined by TYPE_IDENT_DEFINE parts, created on first
+   * use, and when unused ones were last removed. */
+  c_avl_tree_t *dict;
+  cdtime_t      dict_expired;
+};
+typedef struct parse_arena_s parse_arena_t;
 
-  if ((vl->time <= 0)
-      || (strlen (vl->host) <= 0)
-      || (strlen (vl->plugin) <= 0)
-      || (strlen (vl->type) <= 0))
-    return (-EINVAL);
+static pthread_key_t  parse_arena_key;
+static pthread_once_t parse_arena_once = PTHREAD_ONCE_INIT;
 
-  if (!check_receive_okay (vl))
-  {
-#if COLLECT_DEBUG
-    char name[6*DATA_MAX_NAME_LEN];
-    FORMAT_VL (name, sizeof (name), vl);
-    name[sizeof (name) - 1] = 0;
-    DEBUG ("network plugin: network_dispatch_values: "
-	"NOT dispatching %s.", name);
-#endif
-    stats_values_not_dispatched++;
+static int compact_state_compare (const void *a, const void *b) /* {{{ */
+{
+  uint64_t ha = *((const uint64_t *) a);
+  uint64_t hb = *((const uint64_t *) b);
+
+  if (ha == hb)
     return (0);
-  }
+  return ((ha < hb) ? -1 : 1);
+} /* }}} int compact_state_compare */
+
+static int dict_key_compare (const void *a, const void *b) /* {{{ */
+{
+  const dict_key_t *ka = a;
+  const dict_key_t *kb = b;
 
-  assert (vl->meta == NULL);
+  if (ka->session != kb->session)
+    return ((ka->session < kb->session) ? -1 : 1);
+  if (ka->id != kb->id)
+    return ((ka->id < kb->id) ? -1 : 1);
+  return (0);
+} /* }}} int dict_key_compare */
 
-  vl->meta = meta_data_create ();
-  if (vl->meta == NULL)
+/* Frees the "trees_num" trees at "trees" and their states. */
+static void compact_trees_destroy (c_avl_tree_t **trees, /* {{{ */
+    size_t trees_num)
+{
+  size_t i;
+
+  for (i = 0; i < trees_num; i++)
   {
-    ERROR ("network plugin: meta_data_create failed.");
-    return (-ENOMEM);
+    void *key;
+    void *value;
+
+    if (trees[i] == NULL)
+      continue;
+
+    while (c_avl_pick (trees[i], &key, &value) == 0)
+      sfree (value);
+    c_avl_destroy (trees[i]);
+    trees[i] = NULL;
   }
+} /* }}} void compact_trees_destroy */
 
-  status = meta_data_add_boolean (vl->meta, "network:received", 1);
-  if (status != 0)
+/* Returns the state of the series "hash" with room for "values_num" values,
+ * creating it or replacing one of another size. Returns NULL if memory is
+ * short. */
+static compact_state_t *compact_state_get (c_avl_tree_t *tree, /* {{{ */
+    uint64_t hash, size_t values_num)
+{
+  compact_state_t *cs = NULL;
+
+  if (c_avl_get (tree, &hash, (void *) &cs) == 0)
   {
-    ERROR ("network plugin: meta_data_add_boolean failed.");
-    meta_data_destroy (vl->meta);
-    vl->meta = NULL;
-    return (status);
+    if (cs->values_num == values_num)
+      return (cs);
+
+    c_avl_remove (tree, &hash, /* key = */ NULL, /* value = */ NULL);
+    sfree (cs);
   }
 
-  if (username != NULL)
+  cs = calloc (1, sizeof (*cs) + values_num * sizeof (cs->values[0]));
+  if (cs == NULL)
+    return (NULL);
+  cs->hash = hash;
+  cs->values_num = values_num;
+
+  if (c_avl_insert (tree, &cs->hash, cs) != 0)
   {
-    status = meta_data_add_string (vl->meta, "network:username", username);
-    if (status != 0)
-    {
-      ERROR ("network plugin: meta_data_add_string failed.");
-      meta_data_destroy (vl->meta);
-      vl->meta = NULL;
-      return (status);
-    }
+    sfree (cs);
+    return (NULL);
   }
 
-  plugin_dispatch_values (vl);
-  stats_values_dispatched++;
+  return (cs);
+} /* }}} compact_state_t *compact_state_get */
 
-  meta_data_destroy (vl->meta);
-  vl->meta = NULL;
+static void parse_arena_destroy (void *arg) /* {{{ */
+{
+  parse_arena_t *arena = arg;
 
-  return (0);
-} /* }}} int network_dispatch_values */
+  if (arena == NULL)
+    return;
 
-static int network_dispatch_notification (notification_t *n) /* {{{ */
+  compact_trees_destroy (&arena->compact, 1);
+  compact_trees_destroy (&arena->dict, 1);
+  sfree (arena->vls);
+  sfree (arena->values);
+  sfree (arena);
+} /* }}} void parse_arena_destroy */
+
+static void parse_arena_key_create (void) /* {{{ */
 {
-  int status;
+  pthread_key_create (&parse_arena_key, parse_arena_destroy);
+} /* }}} void parse_arena_key_create */
 
-  assert (n->meta == NULL);
+static parse_arena_t *network_parse_arena_get (void) /* {{{ */
+{
+  parse_arena_t *arena;
 
-  status = plugin_notification_meta_add_boolean (n, "network:received", 1);
-  if (status != 0)
+  pthread_once (&parse_arena_once, parse_arena_key_create);
+  arena = pthread_getspecific (parse_arena_key);
+  if (arena != NULL)
+    return (arena);
+
+  arena = calloc (1, sizeof (*arena));
+  if (arena == NULL)
+    return (NULL);
+
+  /* Every value takes at least two bytes in a packet, its type and one byte
+   * in a TYPE_VALUES_COMPACT part. */
+  arena->values_size = network_config_packet_size / 2;
+  arena->values = calloc (arena->values_size, sizeof (*arena->values));
+  if (arena->values == NULL)
   {
-    ERROR ("network plugin: plugin_notification_meta_add_boolean failed.");
-    plugin_notification_meta_free (n->meta);
-    n->meta = NULL;
-    return (status);
+    sfree (arena);
+    return (NULL);
   }
 
-  status = plugin_dispatch_notification (n);
+  pthread_setspecific (parse_arena_key, arena);
+  return (arena);
+} /* }}} parse_arena_t *network_parse_arena_get */
 
-  plugin_notification_meta_free (n->meta);
-  n->meta = NULL;
+/* Returns the number of value lists the calling thread has parsed so far. */
+static uint64_t network_parse_count (void) /* {{{ */
+{
+  parse_arena_t *arena = network_parse_arena_get ();
 
-  return (status);
-} /* }}} int network_dispatch_notification */
+  return ((arena == NULL) ? 0 : arena->vls_received);
+} /* }}} uint64_t network_parse_count */
 
-#if HAVE_LIBGCRYPT
-static gcry_cipher_hd_t network_get_aes256_cypher (sockent_t *se, /* {{{ */
-    const void *iv, size_t iv_size, const char *username)
+/* Returns a pointer to the IPv4 or IPv6 address in "addr" and stores its size
+ * in "ret_size". Returns NULL for other address families. */
+static const unsigned char *network_addr_bytes ( /* {{{ */
+    const struct sockaddr_storage *addr, socklen_t addr_len,
+    size_t *ret_size)
 {
-  gcry_error_t err;
-  gcry_cipher_hd_t *cyper_ptr;
-  unsigned char password_hash[32];
-
-  if (se->type == SOCKENT_TYPE_CLIENT)
+  if ((addr->ss_family == AF_INET)
+      && (addr_len >= sizeof (struct sockaddr_in)))
   {
-	  cyper_ptr = &se->data.client.cypher;
-	  memcpy (password_hash, se->data.client.password_hash,
-			  sizeof (password_hash));
+    const struct sockaddr_in *sa = (const struct sockaddr_in *) addr;
+    *ret_size = sizeof (sa->sin_addr);
+    return ((const unsigned char *) &sa->sin_addr);
   }
-  else
+  else if ((addr->ss_family == AF_INET6)
+      && (addr_len >= sizeof (struct sockaddr_in6)))
   {
-	  char *secret;
+    const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *) addr;
+    *ret_size = sizeof (sa->sin6_addr);
+    return ((const unsigned char *) &sa->sin6_addr);
+  }
+
+  *ret_size = 0;
+  return (NULL);
+} /* }}} const unsigned char *network_addr_bytes */
 
-	  cyper_ptr = &se->data.server.cypher;
+static void network_source_key (unsigned char *key, /* {{{ */
+    const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+  const unsigned char *bytes;
+  size_t bytes_num = 0;
 
-	  if (username == NULL)
-		  return (NULL);
+  memset (key, 0, SOURCE_KEY_SIZE);
 
-	  secret = fbh_get (se->data.server.userdb, username);
-	  if (secret == NULL)
-		  return (NULL);
+  bytes = network_addr_bytes (addr, addr_len, &bytes_num);
+  if (bytes == NULL)
+    return;
 
-	  gcry_md_hash_buffer (GCRY_MD_SHA256,
-			  password_hash,
-			  secret, strlen (secret));
+  key[0] = (unsigned char) addr->ss_family;
+  memcpy (key + 1, bytes, bytes_num);
+} /* }}} void network_source_key */
 
-	  sfree (secret);
-  }
+static void network_source_name (const unsigned char *key, /* {{{ */
+    char *buffer, size_t buffer_size)
+{
+  if ((key[0] != AF_INET) && (key[0] != AF_INET6))
+    sstrncpy (buffer, "unknown", buffer_size);
+  else if (inet_ntop ((int) key[0], key + 1, buffer,
+        (socklen_t) buffer_size) == NULL)
+    sstrncpy (buffer, "invalid", buffer_size);
+} /* }}} void network_source_name */
+
+static int source_key_compare (const void *a, const void *b) /* {{{ */
+{
+  return (memcmp (a, b, SOURCE_KEY_SIZE));
+} /* }}} int source_key_compare */
+
+/* Adds one packet of "octets" bytes with "values" value lists from "key" to
+ * "st". */
+static void network_source_account (source_table_t *st, /* {{{ */
+    const unsigned char *key, size_t octets, uint64_t values, _Bool error)
+{
+  source_entry_t *src = NULL;
+
+  pthread_mutex_lock (&st->lock);
 
-  if (*cyper_ptr == NULL)
+  if (c_avl_get (st->tree, key, (void *) &src) != 0)
   {
-    err = gcry_cipher_open (cyper_ptr,
-        GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_OFB, /* flags = */ 0);
-    if (err != 0)
+    if (st->entries_num < ((size_t) network_config_source_stats))
     {
-      ERROR ("network plugin: gcry_cipher_open returned: %s",
-          gcry_strerror (err));
-      *cyper_ptr = NULL;
-      return (NULL);
+      src = st->entries + st->entries_num;
+      st->entries_num++;
+      memset (src, 0, sizeof (*src));
+    }
+    else
+    {
+      derive_t inherited;
+      size_t i;
+
+      src = st->entries;
+      for (i = 1; i < st->entries_num; i++)
+        if (st->entries[i].octets < src->octets)
+          src = st->entries + i;
+
+      c_avl_remove (st->tree, src->key, /* key = */ NULL, /* value = */ NULL);
+      inherited = src->octets;
+      memset (src, 0, sizeof (*src));
+      src->octets = inherited;
+      src->overestimate = inherited;
+    }
+
+    memcpy (src->key, key, sizeof (src->key));
+    if (c_avl_insert (st->tree, src->key, src) != 0)
+    {
+      /* The entry stays unused until it's replaced again. */
+      pthread_mutex_unlock (&st->lock);
+      return;
     }
   }
-  else
+
+  src->octets += (derive_t) octets;
+  src->packets++;
+  src->values += (derive_t) values;
+  if (error)
+    src->errors++;
+
+  pthread_mutex_unlock (&st->lock);
+} /* }}} void network_source_account */
+
+static int source_entry_compare (const void *a, const void *b) /* {{{ */
+{
+  const source_entry_t *sa = a;
+  const source_entry_t *sb = b;
+
+  if (sa->octets > sb->octets)
+    return (-1);
+  else if (sa->octets < sb->octets)
+    return (1);
+  return (0);
+} /* }}} int source_entry_compare */
+
+/* Returns a copy of all tables, the sources with the most octets first. The
+ * caller must hold "source_lock" and free the returned array. */
+static source_entry_t *network_source_snapshot (size_t *ret_num) /* {{{ */
+{
+  source_entry_t *entries;
+  size_t entries_num = 0;
+  size_t i;
+
+  *ret_num = 0;
+  if (source_tables == NULL)
+    return (NULL);
+
+  entries = calloc (source_tables_num * (size_t) network_config_source_stats,
+      sizeof (*entries));
+  if (entries == NULL)
+    return (NULL);
+
+  for (i = 0; i < source_tables_num; i++)
   {
-    gcry_cipher_reset (*cyper_ptr);
+    source_table_t *st = source_tables + i;
+
+    pthread_mutex_lock (&st->lock);
+    memcpy (entries + entries_num, st->entries,
+        st->entries_num * sizeof (*entries));
+    entries_num += st->entries_num;
+    pthread_mutex_unlock (&st->lock);
   }
-  assert (*cyper_ptr != NULL);
 
-  err = gcry_cipher_setkey (*cyper_ptr,
-      password_hash, sizeof (password_hash));
-  if (err != 0)
+  qsort (entries, entries_num, sizeof (*entries), source_entry_compare);
+
+  *ret_num = entries_num;
+  return (entries);
+} /* }}} source_entry_t *network_source_snapshot */
+
+/* The "LISTSOURCES" command of the unixsock plugin. */
+static int network_source_command (FILE *fh, /* {{{ */
+    __attribute__((unused)) char *buffer,
+    __attribute__((unused)) user_data_t *ud)
+{
+  source_entry_t *entries;
+  size_t entries_num = 0;
+  size_t i;
+
+  pthread_mutex_lock (&source_lock);
+
+  if (source_tables == NULL)
   {
-    ERROR ("network plugin: gcry_cipher_setkey returned: %s",
-        gcry_strerror (err));
-    gcry_cipher_close (*cyper_ptr);
-    *cyper_ptr = NULL;
-    return (NULL);
+    pthread_mutex_unlock (&source_lock);
+    fprintf (fh, "-1 Source statistics are not enabled.\n");
+    return (-1);
   }
 
-  err = gcry_cipher_setiv (*cyper_ptr, iv, iv_size);
-  if (err != 0)
+  entries = network_source_snapshot (&entries_num);
+  pthread_mutex_unlock (&source_lock);
+
+  if (entries == NULL)
   {
-    ERROR ("network plugin: gcry_cipher_setkey returned: %s",
-        gcry_strerror (err));
-    gcry_cipher_close (*cyper_ptr);
-    *cyper_ptr = NULL;
-    return (NULL);
+    fprintf (fh, "-1 Copying the source statistics failed.\n");
+    return (-1);
   }
 
-  return (*cyper_ptr);
-} /* }}} int network_get_aes256_cypher */
-#endif /* HAVE_LIBGCRYPT */
+  fprintf (fh, "%zu Source%s found\n", entries_num,
+      (entries_num == 1) ? "" : "s");
+  for (i = 0; i < entries_num; i++)
+  {
+    source_entry_t *src = entries + i;
+    char name[INET6_ADDRSTRLEN];
+
+    network_source_name (src->key, name, sizeof (name));
+    fprintf (fh, "%s octets=%"PRIi64" packets=%"PRIi64" values=%"PRIi64
+        " errors=%"PRIi64" overestimate=%"PRIi64"\n",
+        name, src->octets, src->packets, src->values, src->errors,
+        src->overestimate);
+  }
 
-static int write_part_values (char **ret_buffer, int *ret_buffer_len,
-		const data_set_t *ds, const value_list_t *vl)
+  sfree (entries);
+  return (0);
+} /* }}} int network_source_command */
+
+static int network_source_tables_create (size_t num) /* {{{ */
 {
-	char *packet_ptr;
-	int packet_len;
-	int num_values;
+  size_t i;
 
-	part_header_t pkg_ph;
-	uint16_t      pkg_num_values;
-	uint8_t      *pkg_values_types;
-	value_t      *pkg_values;
+  source_tables = calloc (num, sizeof (*source_tables));
+  if (source_tables == NULL)
+  {
+    ERROR ("network plugin: calloc failed.");
+    return (-1);
+  }
+  source_tables_num = num;
 
-	int offset;
-	int i;
+  for (i = 0; i < num; i++)
+  {
+    source_table_t *st = source_tables + i;
 
-	num_values = vl->values_len;
-	packet_len = sizeof (part_header_t) + sizeof (uint16_t)
-		+ (num_values * sizeof (uint8_t))
-		+ (num_values * sizeof (value_t));
+    pthread_mutex_init (&st->lock, /* attr = */ NULL);
+    st->tree = c_avl_create (source_key_compare);
+    st->entries = calloc ((size_t) network_config_source_stats,
+        sizeof (*st->entries));
+    if ((st->tree == NULL) || (st->entries == NULL))
+    {
+      ERROR ("network plugin: Allocating the source statistics failed.");
+      return (-1);
+    }
+  }
 
-	if (*ret_buffer_len < packet_len)
-		return (-1);
+  return (0);
+} /* }}} int network_source_tables_create */
 
-	pkg_values_types = (uint8_t *) malloc (num_values * sizeof (uint8_t));
-	if (pkg_values_types == NULL)
-	{
-		ERROR ("network plugin: write_part_values: malloc failed.");
-		return (-1);
-	}
+/* The entries' keys are owned by the entries, so the trees only need to be
+ * emptied. */
+static void network_source_tables_destroy (void) /* {{{ */
+{
+  size_t i;
 
-	pkg_values = (value_t *) malloc (num_values * sizeof (value_t));
-	if (pkg_values == NULL)
-	{
-		free (pkg_values_types);
-		ERROR ("network plugin: write_part_values: malloc failed.");
-		return (-1);
-	}
+  pthread_mutex_lock (&source_lock);
+  for (i = 0; i < source_tables_num; i++)
+  {
+    source_table_t *st = source_tables + i;
+    void *key;
+    void *value;
 
-	pkg_ph.type = htons (TYPE_VALUES);
-	pkg_ph.length = htons (packet_len);
+    if (st->tree != NULL)
+    {
+      while (c_avl_pick (st->tree, &key, &value) == 0)
+        /* do nothing */;
+      c_avl_destroy (st->tree);
+    }
+    sfree (st->entries);
+    pthread_mutex_destroy (&st->lock);
+  }
+  sfree (source_tables);
+  source_tables_num = 0;
+  pthread_mutex_unlock (&source_lock);
+} /* }}} void network_source_tables_destroy */
+
+/* Returns the meta data attached to all values received from "username",
+ * which may be NULL. */
+static meta_data_t *network_received_meta_create (const char *username) /* {{{ */
+{
+  meta_data_t *meta;
+  int status;
 
-	pkg_num_values = htons ((uint16_t) vl->values_len);
+  meta = meta_data_create ();
+  if (meta == NULL)
+  {
+    ERROR ("network plugin: meta_data_create failed.");
+    return (NULL);
+  }
 
-	for (i = 0; i < num_values; i++)
-	{
-		pkg_values_types[i] = (uint8_t) ds->ds[i].type;
-		switch (ds->ds[i].type)
-		{
-			case DS_TYPE_COUNTER:
-				pkg_values[i].counter = htonll (vl->values[i].counter);
-				break;
+  status = meta_data_add_boolean (meta, "network:received", 1);
+  if (status != 0)
+  {
+    ERROR ("network plugin: meta_data_add_boolean failed.");
+    meta_data_destroy (meta);
+    return (NULL);
+  }
 
-			case DS_TYPE_GAUGE:
-				pkg_values[i].gauge = htond (vl->values[i].gauge);
-				break;
+  if (username != NULL)
+  {
+    status = meta_data_add_string (meta, "network:username", username);
+    if (status != 0)
+    {
+      ERROR ("network plugin: meta_data_add_string failed.");
+      meta_data_destroy (meta);
+      return (NULL);
+    }
+  }
 
-			case DS_TYPE_DERIVE:
-				pkg_values[i].derive = htonll (vl->values[i].derive);
-				break;
+  return (meta);
+} /* }}} meta_data_t *network_received_meta_create */
 
-			case DS_TYPE_ABSOLUTE:
-				pkg_values[i].absolute = htonll (vl->values[i].absolute);
-				break;
+/* Returns true if traffic of class "priority" is to be discarded because too
+ * many packets wait for the dispatch threads: low priority traffic once half
+ * of a limit is reached, normal priority traffic once the limit is reached.
+ * High priority traffic is only lost when all receive buffers are in use. */
+static _Bool network_shed (int priority) /* {{{ */
+{
+  uint64_t max_packets = network_config_max_queued_packets;
+  uint64_t max_bytes = network_config_max_queued_bytes;
 
-			default:
-				free (pkg_values_types);
-				free (pkg_values);
-				ERROR ("network plugin: write_part_values: "
-						"Unknown data source type: %i",
-						ds->ds[i].type);
-				return (-1);
-		} /* switch (ds->ds[i].type) */
-	} /* for (num_values) */
+  if (priority >= PRIORITY_HIGH)
+    return (0);
 
-	/*
-	 * Use `memcpy' to write everything to the buffer, because the pointer
-	 * may be unaligned and some architectures, such as SPARC, can't handle
-	 * that.
-	 */
-	packet_ptr = *ret_buffer;
-	offset = 0;
-	memcpy (packet_ptr + offset, &pkg_ph, sizeof (pkg_ph));
-	offset += sizeof (pkg_ph);
-	memcpy (packet_ptr + offset, &pkg_num_values, sizeof (pkg_num_values));
-	offset += sizeof (pkg_num_values);
-	memcpy (packet_ptr + offset, pkg_values_types, num_values * sizeof (uint8_t));
-	offset += num_values * sizeof (uint8_t);
-	memcpy (packet_ptr + offset, pkg_values, num_values * sizeof (value_t));
-	offset += num_values * sizeof (value_t);
+  if (priority == PRIORITY_LOW)
+  {
+    max_packets /= 2;
+    max_bytes /= 2;
+  }
 
-	assert (offset == packet_len);
+  if ((network_config_max_queued_packets > 0)
+      && (queued_packets >= max_packets))
+    return (1);
+  if ((network_config_max_queued_bytes > 0)
+      && (queued_bytes >= max_bytes))
+    return (1);
 
-	*ret_buffer = packet_ptr + packet_len;
-	*ret_buffer_len -= packet_len;
+  return (0);
+} /* }}} _Bool network_shed */
 
-	free (pkg_values_types);
-	free (pkg_values);
+static void *priority_class_callback ( /* {{{ */
+    __attribute__((unused)) data_set_t const *ds,
+    __attribute__((unused)) value_list_t const *vl,
+    void *user_class)
+{
+  return (user_class);
+} /* }}} void *priority_class_callback */
+
+/* Called for each matching <Priority /> block. The lowest priority wins. */
+static int priority_obj_callback ( /* {{{ */
+    __attribute__((unused)) data_set_t const *ds,
+    __attribute__((unused)) value_list_t const *vl,
+    void *user_class, __attribute__((unused)) void *user_obj)
+{
+  int *priority = user_class;
 
-	return (0);
-} /* int write_part_values */
+  if (*priority < priority_match)
+    priority_match = *priority;
 
-static int write_part_number (char **ret_buffer, int *ret_buffer_len,
-		int type, uint64_t value)
+  return (0);
+} /* }}} int priority_obj_callback */
+
+/* Returns the priority of "vl" according to the <Priority /> blocks, or
+ * "priority", the priority of the socket it was received on, if none of them
+ * matches. */
+static int network_value_priority (const value_list_t *vl, /* {{{ */
+    int priority)
 {
-	char *packet_ptr;
-	int packet_len;
+  const data_set_t *ds;
 
-	part_header_t pkg_head;
-	uint64_t pkg_value;
+  if (priority_lookup == NULL)
+    return (priority);
 
-	int offset;
+  ds = plugin_get_ds (vl->type);
+  if (ds == NULL)
+    return (priority);
 
-	packet_len = sizeof (pkg_head) + sizeof (pkg_value);
+  pthread_mutex_lock (&priority_lock);
+  priority_match = PRIORITY_NUM;
+  (void) lookup_search (priority_lookup, ds, vl);
+  if (priority_match < PRIORITY_NUM)
+    priority = priority_match;
+  pthread_mutex_unlock (&priority_lock);
 
-	if (*ret_buffer_len < packet_len)
-		return (-1);
+  return (priority);
+} /* }}} int network_value_priority */
 
-	pkg_head.type = htons (type);
-	pkg_head.length = htons (packet_len);
-	pkg_value = htonll (value);
+static _Bool filter_selector_match (const filter_selector_t *fs, /* {{{ */
+    const char *str)
+{
+  if (fs->kind == FILTER_LITERAL)
+    return (strcmp (fs->literal, str) == 0);
+  else if (fs->kind == FILTER_REGEX)
+    return (regexec (&fs->regex, str, /* nmatch = */ 0, NULL,
+          /* flags = */ 0) == 0);
+  return (1);
+} /* }}} _Bool filter_selector_match */
 
-	packet_ptr = *ret_buffer;
-	offset = 0;
-	memcpy (packet_ptr + offset, &pkg_head, sizeof (pkg_head));
-	offset += sizeof (pkg_head);
-	memcpy (packet_ptr + offset, &pkg_value, sizeof (pkg_value));
-	offset += sizeof (pkg_value);
+/* Returns the first rule of "f" matching "vl", or NULL. The rules of the
+ * plugin and those of any plugin are both sorted, so they are merged. */
+static filter_rule_t *network_filter_search (const filter_t *f, /* {{{ */
+    const value_list_t *vl)
+{
+  filter_index_t *plugin_index = NULL;
+  size_t plugin_num = 0;
+  size_t i = 0;
+  size_t j = 0;
 
-	assert (offset == packet_len);
+  if (c_avl_get (f->by_plugin, vl->plugin, (void *) &plugin_index) == 0)
+    plugin_num = plugin_index->rules_num;
 
-	*ret_buffer = packet_ptr + packet_len;
-	*ret_buffer_len -= packet_len;
+  while ((i < plugin_num) || (j < f->any_plugin.rules_num))
+  {
+    filter_rule_t *r;
 
-	return (0);
-} /* int write_part_number */
+    /* The plugin of rules in "plugin_index" is known to match. */
+    if ((j >= f->any_plugin.rules_num)
+        || ((i < plugin_num)
+          && (plugin_index->rules[i] < f->any_plugin.rules[j])))
+    {
+      r = f->rules + plugin_index->rules[i];
+      i++;
+    }
+    else
+    {
+      r = f->rules + f->any_plugin.rules[j];
+      j++;
+      if (!filter_selector_match (&r->plugin, vl->plugin))
+        continue;
+    }
 
-static int write_part_string (char **ret_buffer, int *ret_buffer_len,
-		int type, const char *str, int str_len)
+    if (filter_selector_match (&r->type, vl->type)
+        && filter_selector_match (&r->host, vl->host))
+      return (r);
+  }
+
+  return (NULL);
+} /* }}} filter_rule_t *network_filter_search */
+
+/* Returns true if the values following the identifier in "vl" are to be
+ * discarded. The matching rule only changes with the host, plugin or type,
+ * so it is kept in "match" until "match_valid" is cleared. */
+static _Bool network_filter_deny (const filter_t *f, /* {{{ */
+    const value_list_t *vl, filter_rule_t **match, _Bool *match_valid)
 {
-	char *buffer;
-	int buffer_len;
+  if (f == NULL)
+    return (0);
 
-	uint16_t pkg_type;
-	uint16_t pkg_length;
+  if (!*match_valid)
+  {
+    *match = network_filter_search (f, vl);
+    *match_valid = 1;
+  }
 
-	int offset;
+  if ((*match == NULL) || !(*match)->deny)
+    return (0);
 
-	buffer_len = 2 * sizeof (uint16_t) + str_len + 1;
-	if (*ret_buffer_len < buffer_len)
-		return (-1);
+  (void) __sync_add_and_fetch (&(*match)->dropped, 1);
+  return (1);
+} /* }}} _Bool network_filter_deny */
 
-	pkg_type = htons (type);
-	pkg_length = htons (buffer_len);
+static void filter_selector_free (filter_selector_t *fs) /* {{{ */
+{
+  if (fs->kind == FILTER_REGEX)
+    regfree (&fs->regex);
+  sfree (fs->literal);
+  fs->kind = FILTER_ANY;
+} /* }}} void filter_selector_free */
 
-	buffer = *ret_buffer;
-	offset = 0;
-	memcpy (buffer + offset, (void *) &pkg_type, sizeof (pkg_type));
-	offset += sizeof (pkg_type);
-	memcpy (buffer + offset, (void *) &pkg_length, sizeof (pkg_length));
-	offset += sizeof (pkg_length);
-	memcpy (buffer + offset, str, str_len);
-	offset += str_len;
-	memset (buffer + offset, '\0', 1);
-	offset += 1;
+static void network_filter_destroy (filter_t *f) /* {{{ */
+{
+  filter_index_t *index;
+  char *key;
+  size_t i;
 
-	assert (offset == buffer_len);
+  if (f == NULL)
+    return;
 
-	*ret_buffer = buffer + buffer_len;
-	*ret_buffer_len -= buffer_len;
+  if (f->by_plugin != NULL)
+  {
+    while (c_avl_pick (f->by_plugin, (void *) &key, (void *) &index) == 0)
+    {
+      sfree (key);
+      sfree (index->rules);
+      sfree (index);
+    }
+    c_avl_destroy (f->by_plugin);
+  }
+  sfree (f->any_plugin.rules);
 
-	return (0);
-} /* int write_part_string */
+  for (i = 0; i < f->rules_num; i++)
+  {
+    filter_rule_t *r = f->rules + i;
 
-static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
-		value_t **ret_values, int *ret_num_values)
+    sfree (r->name);
+    filter_selector_free (&r->host);
+    filter_selector_free (&r->plugin);
+    filter_selector_free (&r->type);
+  }
+  sfree (f->rules);
+  sfree (f);
+} /* }}} void network_filter_destroy */
+
+/* Adds "vl" to the arena. Its values must already point into the arena.
+ * "meta" is created on first use and shared by all value lists of the packet,
+ * the daemon copies it when dispatching. */
+static int network_queue_values (parse_arena_t *arena, /* {{{ */
+    value_list_t const *vl, meta_data_t **meta, const char *username,
+    int priority)
 {
-	char *buffer = *ret_buffer;
-	size_t buffer_len = *ret_buffer_len;
+  value_list_t *dst;
 
-	uint16_t tmp16;
-	size_t exp_size;
-	int   i;
+  arena->vls_received++;
 
-	uint16_t pkg_length;
-	uint16_t pkg_type;
-	uint16_t pkg_numval;
+  if ((vl->time <= 0)
+      || (strlen (vl->host) <= 0)
+      || (strlen (vl->plugin) <= 0)
+      || (strlen (vl->type) <= 0))
+    return (-EINVAL);
 
-	uint8_t *pkg_types;
-	value_t *pkg_values;
+  /* Nothing is shed before the low priority limit is reached, so the
+   * <Priority /> blocks are only searched during overload. */
+  if (network_shed (PRIORITY_LOW))
+  {
+    priority = network_value_priority (vl, priority);
+    if (network_shed (priority))
+    {
+      (void) __sync_add_and_fetch (&stats_values_shed[priority], 1);
+      return (0);
+    }
+  }
 
-	if (buffer_len < 15)
-	{
-		NOTICE ("network plugin: packet is too short: "
-				"buffer_len = %zu", buffer_len);
-		return (-1);
-	}
+  if (!check_receive_okay (vl))
+  {
+#if COLLECT_DEBUG
+    char name[6*DATA_MAX_NAME_LEN];
+    FORMAT_VL (name, sizeof (name), vl);
+    name[sizeof (name) - 1] = 0;
+    DEBUG ("network plugin: network_queue_values: "
+	"NOT dispatching %s.", name);
+#endif
+    (void) __sync_add_and_fetch (&stats_values_not_dispatched, 1);
+    return (0);
+  }
 
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	pkg_type = ntohs (tmp16);
+  if (*meta == NULL)
+  {
+    *meta = network_received_meta_create (username);
+    if (*meta == NULL)
+      return (-ENOMEM);
+  }
 
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	pkg_length = ntohs (tmp16);
+  if (arena->vls_num >= arena->vls_size)
+  {
+    value_list_t *tmp;
+    size_t new_size;
 
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	pkg_numval = ntohs (tmp16);
+    new_size = (arena->vls_size == 0) ? 16 : (2 * arena->vls_size);
+    tmp = realloc (arena->vls, new_size * sizeof (*arena->vls));
+    if (tmp == NULL)
+    {
+      ERROR ("network plugin: realloc failed.");
+      return (-ENOMEM);
+    }
+    arena->vls = tmp;
+    arena->vls_size = new_size;
+  }
 
-	assert (pkg_type == TYPE_VALUES);
+  dst = arena->vls + arena->vls_num;
+  memcpy (dst, vl, sizeof (*dst));
+  dst->meta = *meta;
+  arena->vls_num++;
 
-	exp_size = 3 * sizeof (uint16_t)
-		+ pkg_numval * (sizeof (uint8_t) + sizeof (value_t));
-	if (buffer_len < exp_size)
-	{
-		WARNING ("network plugin: parse_part_values: "
-				"Packet too short: "
-				"Chunk of size %zu expected, "
-				"but buffer has only %zu bytes left.",
-				exp_size, buffer_len);
-		return (-1);
-	}
+  return (0);
+} /* }}} int network_queue_values */
 
-	if (pkg_length != exp_size)
-	{
-		WARNING ("network plugin: parse_part_values: "
-				"Length and number of values "
-				"in the packet don't match.");
-		return (-1);
-	}
+/* Dispatches the value lists in the arena and empties it. */
+static void network_parse_flush (parse_arena_t *arena) /* {{{ */
+{
+  if (arena->vls_num > 0)
+  {
+    plugin_dispatch_values_batch (arena->vls, arena->vls_num);
+    (void) __sync_add_and_fetch (&stats_values_dispatched,
+        (derive_t) arena->vls_num);
+  }
 
-	pkg_types = (uint8_t *) malloc (pkg_numval * sizeof (uint8_t));
-	pkg_values = (value_t *) malloc (pkg_numval * sizeof (value_t));
-	if ((pkg_types == NULL) || (pkg_values == NULL))
-	{
-		sfree (pkg_types);
-		sfree (pkg_values);
-		ERROR ("network plugin: parse_part_values: malloc failed.");
-		return (-1);
-	}
+  arena->vls_num = 0;
+  arena->values_num = 0;
+} /* }}} void network_parse_flush */
 
-	memcpy ((void *) pkg_types, (void *) buffer, pkg_numval * sizeof (uint8_t));
-	buffer += pkg_numval * sizeof (uint8_t);
-	memcpy ((void *) pkg_values, (void *) buffer, pkg_numval * sizeof (value_t));
-	buffer += pkg_numval * sizeof (value_t);
+static int network_dispatch_notification (notification_t *n) /* {{{ */
+{
+  int status;
 
-	for (i = 0; i < pkg_numval; i++)
-	{
-		switch (pkg_types[i])
-		{
-		  case DS_TYPE_COUNTER:
-		    pkg_values[i].counter = (counter_t) ntohll (pkg_values[i].counter);
-		    break;
-
-		  case DS_TYPE_GAUGE:
-		    pkg_values[i].gauge = (gauge_t) ntohd (pkg_values[i].gauge);
-		    break;
-
-		  case DS_TYPE_DERIVE:
-		    pkg_values[i].derive = (derive_t) ntohll (pkg_values[i].derive);
-		    break;
-
-		  case DS_TYPE_ABSOLUTE:
-		    pkg_values[i].absolute = (absolute_t) ntohll (pkg_values[i].absolute);
-		    break;
+  assert (n->meta == NULL);
 
-		  default:
-		    NOTICE ("network plugin: parse_part_values: "
-			"Don't know how to handle data source type %"PRIu8,
-			pkg_types[i]);
-		    sfree (pkg_types);
-		    sfree (pkg_values);
-		    return (-1);
-		} /* switch (pkg_types[i]) */
-	}
+  status = plugin_notification_meta_add_boolean (n, "network:received", 1);
+  if (status != 0)
+  {
+    ERROR ("network plugin: plugin_notification_meta_add_boolean failed.");
+    plugin_notification_meta_free (n->meta);
+    n->meta = NULL;
+    return (status);
+  }
 
-	*ret_buffer     = buffer;
-	*ret_buffer_len = buffer_len - pkg_length;
-	*ret_num_values = pkg_numval;
-	*ret_values     = pkg_values;
+  status = plugin_dispatch_notification (n);
 
-	sfree (pkg_types);
+  plugin_notification_meta_free (n->meta);
+  n->meta = NULL;
 
-	return (0);
-} /* int parse_part_values */
+  return (status);
+} /* }}} int network_dispatch_notification */
 
-static int parse_part_number (void **ret_buffer, size_t *ret_buffer_len,
-		uint64_t *value)
+#if HAVE_LIBGCRYPT
+/* The keys of one user of an AuthFile. Server sockets share their packets
+ * among the dispatch threads, so each thread caches the keys it needs, see
+ * network_user_key_get(). The file isn't consulted and no keys are set up for
+ * each packet. An entry is set up again when "generation" no longer matches
+ * the one of "userdb", i.e. the file has been changed. */
+struct user_key_s
 {
-	char *buffer = *ret_buffer;
-	size_t buffer_len = *ret_buffer_len;
-
-	uint16_t tmp16;
-	uint64_t tmp64;
-	size_t exp_size = 2 * sizeof (uint16_t) + sizeof (uint64_t);
-
-	uint16_t pkg_length;
-
-	if (buffer_len < exp_size)
-	{
-		WARNING ("network plugin: parse_part_number: "
-				"Packet too short: "
-				"Chunk of size %zu expected, "
-				"but buffer has only %zu bytes left.",
-				exp_size, buffer_len);
-		return (-1);
-	}
-
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	/* pkg_type = ntohs (tmp16); */
-
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	pkg_length = ntohs (tmp16);
+  fbhash_t        *userdb;
+  char            *username;
+  unsigned int     generation;
+  /* False if "username" isn't in the file. */
+  _Bool            known;
 
-	memcpy ((void *) &tmp64, buffer, sizeof (tmp64));
-	buffer += sizeof (tmp64);
-	*value = ntohll (tmp64);
+  /* Keyed with the hashed password and the password, respectively. */
+  gcry_cipher_hd_t cypher;
+  gcry_md_hd_t     hmac;
+};
+typedef struct user_key_s user_key_t;
 
-	*ret_buffer = buffer;
-	*ret_buffer_len = buffer_len - pkg_length;
+/* The cache of a thread is emptied when it holds this many entries. */
+#define USER_KEYS_MAX 65536
 
-	return (0);
-} /* int parse_part_number */
+static pthread_key_t  user_keys_key;
+static pthread_once_t user_keys_once = PTHREAD_ONCE_INIT;
 
-static int parse_part_string (void **ret_buffer, size_t *ret_buffer_len,
-		char *output, int output_len)
+static int user_key_compare (const void *a, const void *b) /* {{{ */
 {
-	char *buffer = *ret_buffer;
-	size_t buffer_len = *ret_buffer_len;
-
-	uint16_t tmp16;
-	size_t header_size = 2 * sizeof (uint16_t);
-
-	uint16_t pkg_length;
-
-	if (buffer_len < header_size)
-	{
-		WARNING ("network plugin: parse_part_string: "
-				"Packet too short: "
-				"Chunk of at least size %zu expected, "
-				"but buffer has only %zu bytes left.",
-				header_size, buffer_len);
-		return (-1);
-	}
-
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	/* pkg_type = ntohs (tmp16); */
-
-	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
-	buffer += sizeof (tmp16);
-	pkg_length = ntohs (tmp16);
-
-	/* Check that packet fits in the input buffer */
-	if (pkg_length > buffer_len)
-	{
-		WARNING ("network plugin: parse_part_string: "
-				"Packet too big: "
-				"Chunk of size %"PRIu16" received, "
-				"but buffer has only %zu bytes left.",
-				pkg_length, buffer_len);
-		return (-1);
-	}
-
-	/* Check that pkg_length is in the valid range */
-	if (pkg_length <= header_size)
-	{
-		WARNING ("network plugin: parse_part_string: "
-				"Packet too short: "
-				"Header claims this packet is only %hu "
-				"bytes long.", pkg_length);
-		return (-1);
-	}
-
-	/* Check that the package data fits into the output buffer.
-	 * The previous if-statement ensures that:
-	 * `pkg_length > header_size' */
-	if ((output_len < 0)
-			|| ((size_t) output_len < ((size_t) pkg_length - header_size)))
-	{
-		WARNING ("network plugin: parse_part_string: "
-				"Output buffer too small.");
-		return (-1);
-	}
+  const user_key_t *k0 = a;
+  const user_key_t *k1 = b;
 
-	/* All sanity checks successfull, let's copy the data over */
-	output_len = pkg_length - header_size;
-	memcpy ((void *) output, (void *) buffer, output_len);
-	buffer += output_len;
+  if (k0->userdb != k1->userdb)
+    return ((k0->userdb < k1->userdb) ? -1 : 1);
 
-	/* For some very weird reason '\0' doesn't do the trick on SPARC in
-	 * this statement. */
-	if (output[output_len - 1] != 0)
-	{
-		WARNING ("network plugin: parse_part_string: "
-				"Received string does not end "
-				"with a NULL-byte.");
-		return (-1);
-	}
+  return (strcmp (k0->username, k1->username));
+} /* }}} int user_key_compare */
 
-	*ret_buffer = buffer;
-	*ret_buffer_len = buffer_len - pkg_length;
+static void user_key_free (user_key_t *k) /* {{{ */
+{
+  if (k == NULL)
+    return;
 
-	return (0);
-} /* int parse_part_string */
+  if (k->cypher != NULL)
+    gcry_cipher_close (k->cypher);
+  if (k->hmac != NULL)
+    gcry_md_close (k->hmac);
+  sfree (k->username);
+  sfree (k);
+} /* }}} void user_key_free */
 
-/* Forward declaration: parse_part_sign_sha256 and parse_part_encr_aes256 call
- * parse_packet and vice versa. */
-#define PP_SIGNED    0x01
-#define PP_ENCRYPTED 0x02
-static int parse_packet (sockent_t *se,
-		void *buffer, size_t buffer_size, int flags,
-		const char *username);
+static void user_keys_clear (c_avl_tree_t *tree) /* {{{ */
+{
+  user_key_t *key;
+  user_key_t *value;
 
-#define BUFFER_READ(p,s) do { \
-  memcpy ((p), buffer + buffer_offset, (s)); \
-  buffer_offset += (s); \
-} while (0)
+  while (c_avl_pick (tree, (void *) &key, (void *) &value) == 0)
+    user_key_free (value);
+} /* }}} void user_keys_clear */
 
-#if HAVE_LIBGCRYPT
-static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_len, int flags)
+static void user_keys_destroy (void *arg) /* {{{ */
 {
-  static c_complain_t complain_no_users = C_COMPLAIN_INIT_STATIC;
+  c_avl_tree_t *tree = arg;
 
-  char *buffer;
-  size_t buffer_len;
-  size_t buffer_offset;
+  if (tree == NULL)
+    return;
 
-  size_t username_len;
-  char *secret;
+  user_keys_clear (tree);
+  c_avl_destroy (tree);
+} /* }}} void user_keys_destroy */
 
-  part_signature_sha256_t pss;
-  uint16_t pss_head_length;
-  char hash[sizeof (pss.hash)];
+static void user_keys_key_create (void) /* {{{ */
+{
+  pthread_key_create (&user_keys_key, user_keys_destroy);
+} /* }}} void user_keys_key_create */
 
-  gcry_md_hd_t hd;
+/* Opens "*cypher_ptr", if necessary, and sets the key. */
+static int network_init_aes256_cypher (gcry_cipher_hd_t *cypher_ptr, /* {{{ */
+    const unsigned char *password_hash, size_t password_hash_size)
+{
   gcry_error_t err;
-  unsigned char *hash_ptr;
-
-  buffer = *ret_buffer;
-  buffer_len = *ret_buffer_len;
-  buffer_offset = 0;
 
-  if (se->data.server.userdb == NULL)
+  if (*cypher_ptr == NULL)
   {
-    c_complain (LOG_NOTICE, &complain_no_users,
-        "network plugin: Received signed network packet but can't verify it "
-        "because no user DB has been configured. Will accept it.");
-    return (0);
+    err = gcry_cipher_open (cypher_ptr,
+        GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_OFB, /* flags = */ 0);
+    if (err != 0)
+    {
+      ERROR ("network plugin: gcry_cipher_open returned: %s",
+          gcry_strerror (err));
+      *cypher_ptr = NULL;
+      return (-1);
+    }
   }
+  assert (*cypher_ptr != NULL);
 
-  /* Check if the buffer has enough data for this structure. */
-  if (buffer_len <= PART_SIGNATURE_SHA256_SIZE)
-    return (-ENOMEM);
-
-  /* Read type and length header */
-  BUFFER_READ (&pss.head.type, sizeof (pss.head.type));
-  BUFFER_READ (&pss.head.length, sizeof (pss.head.length));
-  pss_head_length = ntohs (pss.head.length);
-
-  /* Check if the `pss_head_length' is within bounds. */
-  if ((pss_head_length <= PART_SIGNATURE_SHA256_SIZE)
-      || (pss_head_length > buffer_len))
+  err = gcry_cipher_setkey (*cypher_ptr,
+      password_hash, password_hash_size);
+  if (err != 0)
   {
-    ERROR ("network plugin: HMAC-SHA-256 with invalid length received.");
+    ERROR ("network plugin: gcry_cipher_setkey returned: %s",
+        gcry_strerror (err));
+    gcry_cipher_close (*cypher_ptr);
+    *cypher_ptr = NULL;
     return (-1);
   }
 
-  /* Copy the hash. */
-  BUFFER_READ (pss.hash, sizeof (pss.hash));
-
-  /* Calculate username length (without null byte) and allocate memory */
-  username_len = pss_head_length - PART_SIGNATURE_SHA256_SIZE;
-  pss.username = malloc (username_len + 1);
-  if (pss.username == NULL)
-    return (-ENOMEM);
-
-  /* Read the username */
-  BUFFER_READ (pss.username, username_len);
-  pss.username[username_len] = 0;
+  return (0);
+} /* }}} int network_init_aes256_cypher */
 
-  assert (buffer_offset == pss_head_length);
+/* Opens "*hmac_ptr", if necessary, and sets the key. gcry_md_reset() keeps
+ * the key, so the handle can be used for any number of packets. */
+static int network_init_hmac (gcry_md_hd_t *hmac_ptr, /* {{{ */
+    const char *password)
+{
+  gcry_error_t err;
 
-  /* Query the password */
-  secret = fbh_get (se->data.server.userdb, pss.username);
-  if (secret == NULL)
+  if (*hmac_ptr == NULL)
   {
-    ERROR ("network plugin: Unknown user: %s", pss.username);
-    sfree (pss.username);
-    return (-ENOENT);
+    err = gcry_md_open (hmac_ptr, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+    if (err != 0)
+    {
+      ERROR ("network plugin: Creating HMAC object failed: %s",
+          gcry_strerror (err));
+      *hmac_ptr = NULL;
+      return (-1);
+    }
   }
+  assert (*hmac_ptr != NULL);
 
-  /* Create a hash device and check the HMAC */
-  hd = NULL;
-  err = gcry_md_open (&hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+  err = gcry_md_setkey (*hmac_ptr, password, strlen (password));
   if (err != 0)
   {
-    ERROR ("network plugin: Creating HMAC-SHA-256 object failed: %s",
+    ERROR ("network plugin: gcry_md_setkey failed: %s",
         gcry_strerror (err));
-    sfree (secret);
-    sfree (pss.username);
+    gcry_md_close (*hmac_ptr);
+    *hmac_ptr = NULL;
     return (-1);
   }
 
-  err = gcry_md_setkey (hd, secret, strlen (secret));
-  if (err != 0)
+  return (0);
+} /* }}} int network_init_hmac */
+
+/* Returns the keys of "username" from the AuthFile of "se", or NULL if the
+ * user is unknown. */
+static user_key_t *network_user_key_get (sockent_t *se, /* {{{ */
+    const char *username)
+{
+  c_avl_tree_t *tree;
+  user_key_t lookup;
+  user_key_t *k = NULL;
+  unsigned int generation;
+  unsigned char password_hash[32];
+  char secret[4096];
+
+  pthread_once (&user_keys_once, user_keys_key_create);
+  tree = pthread_getspecific (user_keys_key);
+  if (tree == NULL)
   {
-    ERROR ("network plugin: gcry_md_setkey failed: %s", gcry_strerror (err));
-    gcry_md_close (hd);
-    sfree (secret);
-    sfree (pss.username);
-    return (-1);
+    tree = c_avl_create (user_key_compare);
+    if (tree == NULL)
+      return (NULL);
+    pthread_setspecific (user_keys_key, tree);
   }
 
-  gcry_md_write (hd,
-      buffer     + PART_SIGNATURE_SHA256_SIZE,
-      buffer_len - PART_SIGNATURE_SHA256_SIZE);
-  hash_ptr = gcry_md_read (hd, GCRY_MD_SHA256);
-  if (hash_ptr == NULL)
+  generation = fbh_generation (se->data.server.userdb);
+
+  memset (&lookup, 0, sizeof (lookup));
+  lookup.userdb = se->data.server.userdb;
+  lookup.username = (char *) username;
+
+  if (c_avl_get (tree, &lookup, (void *) &k) == 0)
   {
-    ERROR ("network plugin: gcry_md_read failed.");
-    gcry_md_close (hd);
-    sfree (secret);
-    sfree (pss.username);
-    return (-1);
-  }
-  memcpy (hash, hash_ptr, sizeof (hash));
-
-  /* Clean up */
-  gcry_md_close (hd);
-  hd = NULL;
-
-  if (memcmp (pss.hash, hash, sizeof (pss.hash)) != 0)
-  {
-    WARNING ("network plugin: Verifying HMAC-SHA-256 signature failed: "
-        "Hash mismatch.");
+    if (k->generation == generation)
+      return (k->known ? k : NULL);
   }
   else
   {
-    parse_packet (se, buffer + buffer_offset, buffer_len - buffer_offset,
-        flags | PP_SIGNED, pss.username);
-  }
-
-  sfree (secret);
-  sfree (pss.username);
-
-  *ret_buffer = buffer + buffer_len;
-  *ret_buffer_len = 0;
-
-  return (0);
-} /* }}} int parse_part_sign_sha256 */
-/* #endif HAVE_LIBGCRYPT */
-
-#else /* if !HAVE_LIBGCRYPT */
-static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_size, int flags)
-{
-  static int warning_has_been_printed = 0;
-
-  char *buffer;
-  size_t buffer_size;
-  size_t buffer_offset;
-  uint16_t part_len;
+    /* Don't let made-up user names grow the cache without bounds. */
+    if (c_avl_size (tree) >= USER_KEYS_MAX)
+      user_keys_clear (tree);
 
-  part_signature_sha256_t pss;
-
-  buffer = *ret_buffer;
-  buffer_size = *ret_buffer_size;
-  buffer_offset = 0;
-
-  if (buffer_size <= PART_SIGNATURE_SHA256_SIZE)
-    return (-ENOMEM);
+    k = calloc (1, sizeof (*k));
+    if (k == NULL)
+      return (NULL);
+    k->userdb = se->data.server.userdb;
+    k->username = strdup (username);
+    if ((k->username == NULL) || (c_avl_insert (tree, k, k) != 0))
+    {
+      user_key_free (k);
+      return (NULL);
+    }
+  }
 
-  BUFFER_READ (&pss.head.type, sizeof (pss.head.type));
-  BUFFER_READ (&pss.head.length, sizeof (pss.head.length));
-  part_len = ntohs (pss.head.length);
+  k->generation = generation;
+  k->known = 0;
 
-  if ((part_len <= PART_SIGNATURE_SHA256_SIZE)
-      || (part_len > buffer_size))
-    return (-EINVAL);
+  if (fbh_get_r (se->data.server.userdb, username,
+        secret, sizeof (secret)) != 0)
+    return (NULL);
 
-  if (warning_has_been_printed == 0)
-  {
-    WARNING ("network plugin: Received signed packet, but the network "
-        "plugin was not linked with libgcrypt, so I cannot "
-        "verify the signature. The packet will be accepted.");
-    warning_has_been_printed = 1;
-  }
+  gcry_md_hash_buffer (GCRY_MD_SHA256, password_hash,
+      secret, strlen (secret));
 
-  parse_packet (se, buffer + part_len, buffer_size - part_len, flags,
-      /* username = */ NULL);
+  if ((network_init_aes256_cypher (&k->cypher, password_hash,
+          sizeof (password_hash)) == 0)
+      && (network_init_hmac (&k->hmac, secret) == 0))
+    k->known = 1;
 
-  *ret_buffer = buffer + buffer_size;
-  *ret_buffer_size = 0;
+  memset (secret, 0, sizeof (secret));
 
-  return (0);
-} /* }}} int parse_part_sign_sha256 */
-#endif /* !HAVE_LIBGCRYPT */
+  return (k->known ? k : NULL);
+} /* }}} user_key_t *network_user_key_get */
 
-#if HAVE_LIBGCRYPT
-static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
-		void **ret_buffer, size_t *ret_buffer_len,
-		int flags)
+/* Returns a cypher keyed for "se", or for "username" if "se" is a server
+ * socket, which is ready to process a packet with the initialization vector
+ * "iv". */
+static gcry_cipher_hd_t network_get_aes256_cypher (sockent_t *se, /* {{{ */
+    const void *iv, size_t iv_size, const char *username)
 {
-  char  *buffer = *ret_buffer;
-  size_t buffer_len = *ret_buffer_len;
-  size_t payload_len;
-  size_t part_size;
-  size_t buffer_offset;
-  uint16_t username_len;
-  part_encryption_aes256_t pea;
-  unsigned char hash[sizeof (pea.hash)];
-
   gcry_cipher_hd_t cypher;
   gcry_error_t err;
 
-  /* Make sure at least the header if available. */
-  if (buffer_len <= PART_ENCRYPTION_AES256_SIZE)
-  {
-    NOTICE ("network plugin: parse_part_encr_aes256: "
-        "Discarding short packet.");
-    return (-1);
-  }
-
-  buffer_offset = 0;
-
-  /* Copy the unencrypted information into `pea'. */
-  BUFFER_READ (&pea.head.type, sizeof (pea.head.type));
-  BUFFER_READ (&pea.head.length, sizeof (pea.head.length));
-
-  /* Check the `part size'. */
-  part_size = ntohs (pea.head.length);
-  if ((part_size <= PART_ENCRYPTION_AES256_SIZE)
-      || (part_size > buffer_len))
+  if (se->type == SOCKENT_TYPE_CLIENT)
+    cypher = se->data.client.cypher;
+  else
   {
-    NOTICE ("network plugin: parse_part_encr_aes256: "
-        "Discarding part with invalid size.");
-    return (-1);
-  }
+    user_key_t *k;
 
-  /* Read the username */
-  BUFFER_READ (&username_len, sizeof (username_len));
-  username_len = ntohs (username_len);
+    if (username == NULL)
+      return (NULL);
 
-  if ((username_len <= 0)
-      || (username_len > (part_size - (PART_ENCRYPTION_AES256_SIZE + 1))))
-  {
-    NOTICE ("network plugin: parse_part_encr_aes256: "
-        "Discarding part with invalid username length.");
-    return (-1);
+    k = network_user_key_get (se, username);
+    if (k == NULL)
+      return (NULL);
+    cypher = k->cypher;
   }
 
-  assert (username_len > 0);
-  pea.username = malloc (username_len + 1);
-  if (pea.username == NULL)
-    return (-ENOMEM);
-  BUFFER_READ (pea.username, username_len);
-  pea.username[username_len] = 0;
-
-  /* Last but not least, the initialization vector */
-  BUFFER_READ (pea.iv, sizeof (pea.iv));
-
-  /* Make sure we are at the right position */
-  assert (buffer_offset == (username_len +
-        PART_ENCRYPTION_AES256_SIZE - sizeof (pea.hash)));
-
-  cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv),
-      pea.username);
   if (cypher == NULL)
-  {
-    sfree (pea.username);
-    return (-1);
-  }
-
-  payload_len = part_size - (PART_ENCRYPTION_AES256_SIZE + username_len);
-  assert (payload_len > 0);
+    return (NULL);
 
-  /* Decrypt the packet in-place */
-  err = gcry_cipher_decrypt (cypher,
-      buffer    + buffer_offset,
-      part_size - buffer_offset,
-      /* in = */ NULL, /* in len = */ 0);
+  gcry_cipher_reset (cypher);
+  err = gcry_cipher_setiv (cypher, iv, iv_size);
   if (err != 0)
   {
-    sfree (pea.username);
-    ERROR ("network plugin: gcry_cipher_decrypt returned: %s",
+    ERROR ("network plugin: gcry_cipher_setiv returned: %s",
         gcry_strerror (err));
-    return (-1);
+    return (NULL);
   }
 
-  /* Read the hash */
-  BUFFER_READ (pea.hash, sizeof (pea.hash));
-
-  /* Make sure we're at the right position - again */
-  assert (buffer_offset == (username_len + PART_ENCRYPTION_AES256_SIZE));
-  assert (buffer_offset == (part_size - payload_len));
+  return (cypher);
+} /* }}} int network_get_aes256_cypher */
+#endif /* HAVE_LIBGCRYPT */
 
-  /* Check hash sum */
-  memset (hash, 0, sizeof (hash));
-  gcry_md_hash_buffer (GCRY_MD_SHA1, hash,
-      buffer + buffer_offset, payload_len);
-  if (memcmp (hash, pea.hash, sizeof (hash)) != 0)
-  {
-    sfree (pea.username);
-    ERROR ("network plugin: Decryption failed: Checksum mismatch.");
-    return (-1);
-  }
+static int write_part_values (char **ret_buffer, int *ret_buffer_len,
+		const data_set_t *ds, const value_list_t *vl)
+{
+	char *packet_ptr;
+	int packet_len;
+	int num_values;
 
-  parse_packet (se, buffer + buffer_offset, payload_len,
-      flags | PP_ENCRYPTED, pea.username);
+	part_header_t pkg_ph;
+	uint16_t      pkg_num_values;
+	uint8_t      *pkg_values_types;
+	value_t      *pkg_values;
 
-  /* XXX: Free pea.username?!? */
+	int offset;
+	int i;
 
-  /* Update return values */
-  *ret_buffer =     buffer     + part_size;
-  *ret_buffer_len = buffer_len - part_size;
+	num_values = vl->values_len;
+	packet_len = sizeof (part_header_t) + sizeof (uint16_t)
+		+ (num_values * sizeof (uint8_t))
+		+ (num_values * sizeof (value_t));
 
-  sfree (pea.username);
+	if (*ret_buffer_len < packet_len)
+		return (-1);
 
-  return (0);
-} /* }}} int parse_part_encr_aes256 */
-/* #endif HAVE_LIBGCRYPT */
+	pkg_values_types = (uint8_t *) malloc (num_values * sizeof (uint8_t));
+	if (pkg_values_types == NULL)
+	{
+		ERROR ("network plugin: write_part_values: malloc failed.");
+		return (-1);
+	}
 
-#else /* if !HAVE_LIBGCRYPT */
-static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_size, int flags)
-{
-  static int warning_has_been_printed = 0;
+	pkg_values = (value_t *) malloc (num_values * sizeof (value_t));
+	if (pkg_values == NULL)
+	{
+		free (pkg_values_types);
+		ERROR ("network plugin: write_part_values: malloc failed.");
+		return (-1);
+	}
 
-  char *buffer;
-  size_t buffer_size;
-  size_t buffer_offset;
+	pkg_ph.type = htons (TYPE_VALUES);
+	pkg_ph.length = htons (packet_len);
 
-  part_header_t ph;
-  size_t ph_length;
+	pkg_num_values = htons ((uint16_t) vl->values_len);
 
-  buffer = *ret_buffer;
-  buffer_size = *ret_buffer_size;
-  buffer_offset = 0;
+	for (i = 0; i < num_values; i++)
+	{
+		pkg_values_types[i] = (uint8_t) ds->ds[i].type;
+		switch (ds->ds[i].type)
+		{
+			case DS_TYPE_COUNTER:
+				pkg_values[i].counter = htonll (vl->values[i].counter);
+				break;
 
-  /* parse_packet assures this minimum size. */
-  assert (buffer_size >= (sizeof (ph.type) + sizeof (ph.length)));
+			case DS_TYPE_GAUGE:
+				pkg_values[i].gauge = htond (vl->values[i].gauge);
+				break;
 
-  BUFFER_READ (&ph.type, sizeof (ph.type));
-  BUFFER_READ (&ph.length, sizeof (ph.length));
-  ph_length = ntohs (ph.length);
+			case DS_TYPE_DERIVE:
+				pkg_values[i].derive = htonll (vl->values[i].derive);
+				break;
 
-  if ((ph_length <= PART_ENCRYPTION_AES256_SIZE)
-      || (ph_length > buffer_size))
-  {
-    ERROR ("network plugin: AES-256 encrypted part "
-        "with invalid length received.");
-    return (-1);
-  }
+			case DS_TYPE_ABSOLUTE:
+				pkg_values[i].absolute = htonll (vl->values[i].absolute);
+				break;
 
-  if (warning_has_been_printed == 0)
-  {
-    WARNING ("network plugin: Received encrypted packet, but the network "
+			default:
+				free (pkg_values_types);
+				free (pkg_values);
+				ERROR ("network plugin: write_part_values: "
+						"Unknown data source type: %i",
+						ds->ds[i].type);
+				return (-1);
+		} /* switch (ds->ds[i].type) */
+	} /* for (num_values) */
+
+	/*
+	 * Use `memcpy' to write everything to the buffer, because the pointer
+	 * may be unaligned and some architectures, such as SPARC, can't handle
+	 * that.
+	 */
+	packet_ptr = *ret_buffer;
+	offset = 0;
+	memcpy (packet_ptr + offset, &pkg_ph, sizeof (pkg_ph));
+	offset += sizeof (pkg_ph);
+	memcpy (packet_ptr + offset, &pkg_num_values, sizeof (pkg_num_values));
+	offset += sizeof (pkg_num_values);
+	memcpy (packet_ptr + offset, pkg_values_types, num_values * sizeof (uint8_t));
+	offset += num_values * sizeof (uint8_t);
+	memcpy (packet_ptr + offset, pkg_values, num_values * sizeof (value_t));
+	offset += num_values * sizeof (value_t);
+
+	assert (offset == packet_len);
+
+	*ret_buffer = packet_ptr + packet_len;
+	*ret_buffer_len -= packet_len;
+
+	free (pkg_values_types);
+	free (pkg_values);
+
+	return (0);
+} /* int write_part_values */
+
+static int write_part_number (char **ret_buffer, int *ret_buffer_len,
+		int type, uint64_t value)
+{
+	char *packet_ptr;
+	int packet_len;
+
+	part_header_t pkg_head;
+	uint64_t pkg_value;
+
+	int offset;
+
+	packet_len = sizeof (pkg_head) + sizeof (pkg_value);
+
+	if (*ret_buffer_len < packet_len)
+		return (-1);
+
+	pkg_head.type = htons (type);
+	pkg_head.length = htons (packet_len);
+	pkg_value = htonll (value);
+
+	packet_ptr = *ret_buffer;
+	offset = 0;
+	memcpy (packet_ptr + offset, &pkg_head, sizeof (pkg_head));
+	offset += sizeof (pkg_head);
+	memcpy (packet_ptr + offset, &pkg_value, sizeof (pkg_value));
+	offset += sizeof (pkg_value);
+
+	assert (offset == packet_len);
+
+	*ret_buffer = packet_ptr + packet_len;
+	*ret_buffer_len -= packet_len;
+
+	return (0);
+} /* int write_part_number */
+
+static int write_part_string (char **ret_buffer, int *ret_buffer_len,
+		int type, const char *str, int str_len)
+{
+	char *buffer;
+	int buffer_len;
+
+	uint16_t pkg_type;
+	uint16_t pkg_length;
+
+	int offset;
+
+	buffer_len = 2 * sizeof (uint16_t) + str_len + 1;
+	if (*ret_buffer_len < buffer_len)
+		return (-1);
+
+	pkg_type = htons (type);
+	pkg_length = htons (buffer_len);
+
+	buffer = *ret_buffer;
+	offset = 0;
+	memcpy (buffer + offset, (void *) &pkg_type, sizeof (pkg_type));
+	offset += sizeof (pkg_type);
+	memcpy (buffer + offset, (void *) &pkg_length, sizeof (pkg_length));
+	offset += sizeof (pkg_length);
+	memcpy (buffer + offset, str, str_len);
+	offset += str_len;
+	memset (buffer + offset, '\0', 1);
+	offset += 1;
+
+	assert (offset == buffer_len);
+
+	*ret_buffer = buffer + buffer_len;
+	*ret_buffer_len -= buffer_len;
+
+	return (0);
+} /* int write_part_string */
+
+static uint64_t compact_value_raw (int type, value_t v) /* {{{ */
+{
+	uint64_t raw = 0;
+
+	switch (type)
+	{
+		case DS_TYPE_COUNTER:
+			raw = (uint64_t) v.counter;
+			break;
+		case DS_TYPE_GAUGE:
+			memcpy (&raw, &v.gauge, sizeof (raw));
+			break;
+		case DS_TYPE_DERIVE:
+			raw = (uint64_t) v.derive;
+			break;
+		case DS_TYPE_ABSOLUTE:
+			raw = (uint64_t) v.absolute;
+			break;
+	}
+
+	return (raw);
+} /* }}} uint64_t compact_value_raw */
+
+static value_t compact_value_cook (int type, uint64_t raw) /* {{{ */
+{
+	value_t v;
+
+	memset (&v, 0, sizeof (v));
+	switch (type)
+	{
+		case DS_TYPE_COUNTER:
+			v.counter = (counter_t) raw;
+			break;
+		case DS_TYPE_GAUGE:
+			memcpy (&v.gauge, &raw, sizeof (v.gauge));
+			break;
+		case DS_TYPE_DERIVE:
+			v.derive = (derive_t) raw;
+			break;
+		case DS_TYPE_ABSOLUTE:
+			v.absolute = (absolute_t) raw;
+			break;
+	}
+
+	return (v);
+} /* }}} value_t compact_value_cook */
+
+static uint64_t compact_zigzag (int64_t v) /* {{{ */
+{
+	return ((((uint64_t) v) << 1) ^ ((v < 0) ? UINT64_MAX : 0));
+} /* }}} uint64_t compact_zigzag */
+
+static int64_t compact_unzigzag (uint64_t v) /* {{{ */
+{
+	return ((int64_t) ((v >> 1) ^ ((v & 1) ? UINT64_MAX : 0)));
+} /* }}} int64_t compact_unzigzag */
+
+/* Writes "v" as a varint to "buffer", which needs room for ten bytes.
+ * Returns the number of bytes written. */
+static size_t compact_put_varint (uint8_t *buffer, uint64_t v) /* {{{ */
+{
+	size_t len = 0;
+
+	while (v >= 0x80)
+	{
+		buffer[len++] = (uint8_t) (v | 0x80);
+		v >>= 7;
+	}
+	buffer[len++] = (uint8_t) v;
+
+	return (len);
+} /* }}} size_t compact_put_varint */
+
+static int compact_get_varint (const uint8_t **ptr, /* {{{ */
+		const uint8_t *end, uint64_t *ret_value)
+{
+	uint64_t v = 0;
+	unsigned int shift;
+
+	for (shift = 0; (*ptr < end) && (shift < 64); shift += 7)
+	{
+		uint8_t b = **ptr;
+
+		(*ptr)++;
+		v |= ((uint64_t) (b & 0x7f)) << shift;
+		if ((b & 0x80) == 0)
+		{
+			*ret_value = v;
+			return (0);
+		}
+	}
+
+	return (-1);
+} /* }}} int compact_get_varint */
+
+/* Writes the bits of a gauge, or their XOR with the previous ones, to
+ * "buffer", which needs room for nine bytes. Returns the number of bytes
+ * written. */
+static size_t compact_put_bits (uint8_t *buffer, uint64_t x) /* {{{ */
+{
+	int leading = 0;
+	int trailing = 0;
+	int len;
+	int i;
+
+	if (x == 0)
+	{
+		buffer[0] = 0;
+		return (1);
+	}
+
+	while (((x >> (56 - 8 * leading)) & 0xff) == 0)
+		leading++;
+	while (((x >> (8 * trailing)) & 0xff) == 0)
+		trailing++;
+	len = 8 - leading - trailing;
+
+	buffer[0] = (uint8_t) ((leading << 4) | len);
+	for (i = 0; i < len; i++)
+		buffer[1 + i] = (uint8_t) (x >> (8 * (trailing + len - 1 - i)));
+
+	return ((size_t) (1 + len));
+} /* }}} size_t compact_put_bits */
+
+static int compact_get_bits (const uint8_t **ptr, /* {{{ */
+		const uint8_t *end, uint64_t *ret_value)
+{
+	uint64_t x = 0;
+	int leading;
+	int len;
+	int i;
+
+	if (*ptr >= end)
+		return (-1);
+
+	leading = (**ptr) >> 4;
+	len = (**ptr) & 0x0f;
+	(*ptr)++;
+
+	if ((leading + len) > 8)
+		return (-1);
+	if (len == 0)
+	{
+		*ret_value = 0;
+		return (0);
+	}
+	if ((end - *ptr) < len)
+		return (-1);
+
+	for (i = 0; i < len; i++)
+	{
+		x = (x << 8) | (uint64_t) **ptr;
+		(*ptr)++;
+	}
+	*ret_value = x << (8 * (8 - leading - len));
+
+	return (0);
+} /* }}} int compact_get_bits */
+
+/* Like write_part_values(), but writes a TYPE_VALUES_COMPACT part encoding
+ * the values relative to those last sent of the same series. Every
+ * "CompactKeyframeInterval"th part of a series is sent as a key frame, so
+ * receivers which lost a packet or started later catch up. */
+static int write_part_values_compact (char **ret_buffer, /* {{{ */
+		int *ret_buffer_len,
+		const data_set_t *ds, const value_list_t *vl)
+{
+	uint8_t part[COMPACT_HEADER_SIZE + 255 * (1 + 10)];
+	compact_state_t *cs = NULL;
+	c_avl_tree_t *tree;
+	uint64_t hash;
+	size_t num_values;
+	size_t len;
+	size_t idx;
+	size_t i;
+	uint16_t tmp16;
+	uint8_t seq = 0;
+	_Bool delta;
+
+	num_values = (size_t) vl->values_len;
+	if ((num_values > 255) || (num_values != (size_t) ds->ds_num))
+		return (write_part_values (ret_buffer, ret_buffer_len, ds, vl));
+
+	hash = plugin_hash_vl (vl);
+	idx = (size_t) (hash % COMPACT_TREES_NUM);
+	tree = compact_trees[idx];
+	/* Without a tree, i.e. if memory was short during init, everything is
+	 * sent as key frames. */
+	if (tree == NULL)
+		idx = 0;
+
+	pthread_mutex_lock (compact_locks + idx);
+
+	if ((tree != NULL) && (c_avl_get (tree, &hash, (void *) &cs) == 0)
+			&& (cs->values_num != num_values))
+		cs = NULL;
+	delta = (cs != NULL) && (cs->count < network_config_keyframe_interval);
+
+	len = COMPACT_HEADER_SIZE + num_values;
+	for (i = 0; i < num_values; i++)
+	{
+		int type = ds->ds[i].type;
+		uint64_t raw = compact_value_raw (type, vl->values[i]);
+
+		if ((type != DS_TYPE_COUNTER) && (type != DS_TYPE_GAUGE)
+				&& (type != DS_TYPE_DERIVE)
+				&& (type != DS_TYPE_ABSOLUTE))
+		{
+			pthread_mutex_unlock (compact_locks + idx);
+			ERROR ("network plugin: write_part_values_compact: "
+					"Unknown data source type: %i", type);
+			return (-1);
+		}
+
+		part[COMPACT_HEADER_SIZE + i] = (uint8_t) type;
+		if (type == DS_TYPE_GAUGE)
+			len += compact_put_bits (part + len,
+					delta ? (raw ^ cs->values[i]) : raw);
+		else if (delta)
+			len += compact_put_varint (part + len,
+					compact_zigzag ((int64_t) (raw - cs->values[i])));
+		else if (type == DS_TYPE_DERIVE)
+			len += compact_put_varint (part + len,
+					compact_zigzag ((int64_t) raw));
+		else
+			len += compact_put_varint (part + len, raw);
+	}
+
+	if (len > (size_t) *ret_buffer_len)
+	{
+		pthread_mutex_unlock (compact_locks + idx);
+		return (-1);
+	}
+
+	/* The state only changes once the part is certain to be sent. If
+	 * memory is short, the next part of the series is a key frame, too. */
+	if (cs != NULL)
+		seq = (uint8_t) (cs->seq + 1);
+	else if (tree != NULL)
+		cs = compact_state_get (tree, hash, num_values);
+
+	if (cs != NULL)
+	{
+		cs->seq = seq;
+		cs->count = delta ? (cs->count + 1) : 1;
+		for (i = 0; i < num_values; i++)
+			cs->values[i] = compact_value_raw (ds->ds[i].type,
+					vl->values[i]);
+	}
+
+	pthread_mutex_unlock (compact_locks + idx);
+
+	tmp16 = htons (TYPE_VALUES_COMPACT);
+	memcpy (part, &tmp16, sizeof (tmp16));
+	tmp16 = htons ((uint16_t) len);
+	memcpy (part + 2, &tmp16, sizeof (tmp16));
+	part[4] = seq;
+	part[5] = delta ? COMPACT_FLAG_DELTA : 0;
+	part[6] = (uint8_t) num_values;
+
+	memcpy (*ret_buffer, part, len);
+	*ret_buffer += len;
+	*ret_buffer_len -= (int) len;
+
+	return (0);
+} /* }}} int write_part_values_compact */
+
+/* Writes a TYPE_IDENT_DEFINE or TYPE_IDENT_REF part with the number "id". */
+static int write_part_ident (char **ret_buffer, int *ret_buffer_len, /* {{{ */
+		int type, uint32_t id)
+{
+	part_header_t pkg_head;
+	uint64_t session;
+	uint32_t num;
+	char *ptr = *ret_buffer;
+
+	if (*ret_buffer_len < DICT_PART_SIZE)
+		return (-1);
+
+	pkg_head.type = htons ((uint16_t) type);
+	pkg_head.length = htons (DICT_PART_SIZE);
+	session = htonll (dict_session);
+	num = htonl (id);
+
+	memcpy (ptr, &pkg_head, sizeof (pkg_head));
+	ptr += sizeof (pkg_head);
+	memcpy (ptr, &session, sizeof (session));
+	ptr += sizeof (session);
+	memcpy (ptr, &num, sizeof (num));
+
+	*ret_buffer += DICT_PART_SIZE;
+	*ret_buffer_len -= DICT_PART_SIZE;
+
+	return (0);
+} /* }}} int write_part_ident */
+
+/* Returns the number of the series "hash" in "ret_id", assigning one to new
+ * series, and sets "ret_define" if the number has to be defined rather than
+ * referenced. Returns non-zero if the series has no number, e.g. because
+ * memory is short; its identifier is then sent as strings. The state is only
+ * updated by dict_commit(), once the value list is certain to be sent. */
+static int dict_lookup (uint64_t hash, /* {{{ */
+		uint32_t *ret_id, _Bool *ret_define)
+{
+	size_t idx = (size_t) (hash % DICT_TREES_NUM);
+	dict_state_t *st = NULL;
+
+	if (dict_trees[idx] == NULL)
+		return (-1);
+
+	pthread_mutex_lock (dict_locks + idx);
+
+	if (c_avl_get (dict_trees[idx], &hash, (void *) &st) != 0)
+	{
+		st = calloc (1, sizeof (*st));
+		if (st == NULL)
+		{
+			pthread_mutex_unlock (dict_locks + idx);
+			return (-1);
+		}
+		st->hash = hash;
+		st->id = __sync_fetch_and_add (&dict_next_id, 1);
+		st->uses = 0;
+
+		if (c_avl_insert (dict_trees[idx], &st->hash, st) != 0)
+		{
+			pthread_mutex_unlock (dict_locks + idx);
+			sfree (st);
+			return (-1);
+		}
+	}
+
+	*ret_id = st->id;
+	*ret_define = (st->uses == 0)
+		|| (st->uses >= network_config_dictionary_refresh);
+
+	pthread_mutex_unlock (dict_locks + idx);
+	return (0);
+} /* }}} int dict_lookup */
+
+static void dict_commit (uint64_t hash, _Bool define) /* {{{ */
+{
+	size_t idx = (size_t) (hash % DICT_TREES_NUM);
+	dict_state_t *st = NULL;
+
+	if (dict_trees[idx] == NULL)
+		return;
+
+	pthread_mutex_lock (dict_locks + idx);
+	if (c_avl_get (dict_trees[idx], &hash, (void *) &st) == 0)
+		st->uses = define ? 1 : (st->uses + 1);
+	pthread_mutex_unlock (dict_locks + idx);
+} /* }}} void dict_commit */
+
+/* Decodes the values part at "ret_buffer" into "values", which has room for
+ * "values_size" values. The types are checked in place. */
+static int parse_part_values (void **ret_buffer, size_t *ret_buffer_len,
+		value_t *values, size_t values_size, int *ret_num_values)
+{
+	char *buffer = *ret_buffer;
+	size_t buffer_len = *ret_buffer_len;
+
+	uint16_t tmp16;
+	size_t exp_size;
+	int   i;
+
+	uint16_t pkg_length;
+	uint16_t pkg_type;
+	uint16_t pkg_numval;
+
+	const uint8_t *pkg_types;
+
+	if (buffer_len < 15)
+	{
+		NOTICE ("network plugin: packet is too short: "
+				"buffer_len = %zu", buffer_len);
+		return (-1);
+	}
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	pkg_type = ntohs (tmp16);
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	pkg_length = ntohs (tmp16);
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	pkg_numval = ntohs (tmp16);
+
+	assert (pkg_type == TYPE_VALUES);
+
+	exp_size = 3 * sizeof (uint16_t)
+		+ pkg_numval * (sizeof (uint8_t) + sizeof (value_t));
+	if (buffer_len < exp_size)
+	{
+		WARNING ("network plugin: parse_part_values: "
+				"Packet too short: "
+				"Chunk of size %zu expected, "
+				"but buffer has only %zu bytes left.",
+				exp_size, buffer_len);
+		return (-1);
+	}
+
+	if (pkg_length != exp_size)
+	{
+		WARNING ("network plugin: parse_part_values: "
+				"Length and number of values "
+				"in the packet don't match.");
+		return (-1);
+	}
+
+	if (pkg_numval > values_size)
+	{
+		WARNING ("network plugin: parse_part_values: "
+				"Too many values in one packet.");
+		return (-1);
+	}
+
+	pkg_types = (const uint8_t *) buffer;
+	buffer += pkg_numval * sizeof (uint8_t);
+
+	/* The values aren't aligned in the packet, so they are copied one by
+	 * one before converting them. */
+	for (i = 0; i < pkg_numval; i++)
+	{
+		memcpy ((void *) (values + i), (void *) buffer, sizeof (value_t));
+		buffer += sizeof (value_t);
+
+		switch (pkg_types[i])
+		{
+		  case DS_TYPE_COUNTER:
+		    values[i].counter = (counter_t) ntohll (values[i].counter);
+		    break;
+
+		  case DS_TYPE_GAUGE:
+		    values[i].gauge = (gauge_t) ntohd (values[i].gauge);
+		    break;
+
+		  case DS_TYPE_DERIVE:
+		    values[i].derive = (derive_t) ntohll (values[i].derive);
+		    break;
+
+		  case DS_TYPE_ABSOLUTE:
+		    values[i].absolute = (absolute_t) ntohll (values[i].absolute);
+		    break;
+
+		  default:
+		    NOTICE ("network plugin: parse_part_values: "
+			"Don't know how to handle data source type %"PRIu8,
+			pkg_types[i]);
+		    return (-1);
+		} /* switch (pkg_types[i]) */
+	}
+
+	*ret_buffer     = buffer;
+	*ret_buffer_len = buffer_len - pkg_length;
+	*ret_num_values = pkg_numval;
+
+	return (0);
+} /* int parse_part_values */
+
+/* Decodes the TYPE_VALUES_COMPACT part at "ret_buffer", which belongs to the
+ * series "vl", into "values". Returns ENOENT if the part is fine but the
+ * values can't be decoded, because they are relative to values which haven't
+ * been received. */
+static int parse_part_values_compact (parse_arena_t *arena, /* {{{ */
+		void **ret_buffer, size_t *ret_buffer_len,
+		const value_list_t *vl,
+		value_t *values, size_t values_size, int *ret_num_values)
+{
+	const uint8_t *buffer = *ret_buffer;
+	const uint8_t *pkg_types;
+	const uint8_t *ptr;
+	const uint8_t *end;
+	uint64_t raw[255];
+	compact_state_t *cs = NULL;
+	uint64_t hash;
+	uint16_t tmp16;
+	uint16_t pkg_length;
+	uint8_t seq;
+	size_t num_values;
+	size_t i;
+	_Bool delta;
+	_Bool known;
+
+	if (*ret_buffer_len < COMPACT_HEADER_SIZE)
+	{
+		NOTICE ("network plugin: packet is too short: "
+				"buffer_len = %zu", *ret_buffer_len);
+		return (-1);
+	}
+
+	memcpy (&tmp16, buffer + 2, sizeof (tmp16));
+	pkg_length = ntohs (tmp16);
+	seq = buffer[4];
+	delta = (buffer[5] & COMPACT_FLAG_DELTA) != 0;
+	num_values = (size_t) buffer[6];
+
+	if ((pkg_length > *ret_buffer_len)
+			|| (pkg_length < (COMPACT_HEADER_SIZE + num_values)))
+	{
+		WARNING ("network plugin: parse_part_values_compact: "
+				"Length and number of values "
+				"in the packet don't match.");
+		return (-1);
+	}
+
+	if (num_values > values_size)
+	{
+		WARNING ("network plugin: parse_part_values_compact: "
+				"Too many values in one packet.");
+		return (-1);
+	}
+
+	if (arena->compact == NULL)
+		arena->compact = c_avl_create (compact_state_compare);
+
+	hash = plugin_hash_vl (vl);
+	if ((arena->compact != NULL)
+			&& (c_avl_get (arena->compact, &hash, (void *) &cs) == 0)
+			&& (cs->values_num != num_values))
+		cs = NULL;
+	known = !delta || ((cs != NULL) && (((uint8_t) (cs->seq + 1)) == seq));
+
+	pkg_types = buffer + COMPACT_HEADER_SIZE;
+	ptr = pkg_types + num_values;
+	end = buffer + pkg_length;
+
+	/* All values are decoded even if the previous ones are unknown, to
+	 * check the part is intact. */
+	for (i = 0; i < num_values; i++)
+	{
+		uint64_t tmp = 0;
+		int status;
+
+		if (pkg_types[i] == DS_TYPE_GAUGE)
+			status = compact_get_bits (&ptr, end, &tmp);
+		else if ((pkg_types[i] == DS_TYPE_COUNTER)
+				|| (pkg_types[i] == DS_TYPE_DERIVE)
+				|| (pkg_types[i] == DS_TYPE_ABSOLUTE))
+			status = compact_get_varint (&ptr, end, &tmp);
+		else
+		{
+			NOTICE ("network plugin: parse_part_values_compact: "
+					"Don't know how to handle data source "
+					"type %"PRIu8, pkg_types[i]);
+			return (-1);
+		}
+
+		if (status != 0)
+		{
+			WARNING ("network plugin: parse_part_values_compact: "
+					"Value %zu is truncated.", i);
+			return (-1);
+		}
+
+		if (!known)
+			continue;
+
+		if (pkg_types[i] == DS_TYPE_GAUGE)
+			raw[i] = delta ? (tmp ^ cs->values[i]) : tmp;
+		else if (delta)
+			raw[i] = cs->values[i] + (uint64_t) compact_unzigzag (tmp);
+		else if (pkg_types[i] == DS_TYPE_DERIVE)
+			raw[i] = (uint64_t) compact_unzigzag (tmp);
+		else
+			raw[i] = tmp;
+	}
+
+	if (ptr != end)
+	{
+		WARNING ("network plugin: parse_part_values_compact: "
+				"Length and values in the packet don't match.");
+		return (-1);
+	}
+
+	*ret_buffer     = ((char *) *ret_buffer) + pkg_length;
+	*ret_buffer_len -= pkg_length;
+
+	if (!known)
+		return (ENOENT);
+
+	if ((cs == NULL) && (arena->compact != NULL))
+		cs = compact_state_get (arena->compact, hash, num_values);
+	if (cs != NULL)
+	{
+		cs->seq = seq;
+		memcpy (cs->values, raw, num_values * sizeof (raw[0]));
+	}
+
+	for (i = 0; i < num_values; i++)
+		values[i] = compact_value_cook (pkg_types[i], raw[i]);
+	*ret_num_values = (int) num_values;
+
+	return (0);
+} /* }}} int parse_part_values_compact */
+
+/* Removes the identifiers which haven't been used for DICT_EXPIRE, so the
+ * numbers of senders which went away or restarted don't pile up. */
+static void dict_expire (parse_arena_t *arena, cdtime_t now) /* {{{ */
+{
+	c_avl_iterator_t *iter;
+	dict_key_t *key;
+	dict_entry_t *e;
+	dict_entry_t **expired = NULL;
+	size_t expired_num = 0;
+	size_t i;
+
+	arena->dict_expired = now;
+
+	iter = c_avl_get_iterator (arena->dict);
+	if (iter == NULL)
+		return;
+
+	while (c_avl_iterator_next (iter, (void *) &key, (void *) &e) == 0)
+	{
+		dict_entry_t **tmp;
+
+		if ((e->used + DICT_EXPIRE) > now)
+			continue;
+
+		tmp = realloc (expired, (expired_num + 1) * sizeof (*expired));
+		if (tmp == NULL)
+			break;
+		expired = tmp;
+		expired[expired_num] = e;
+		expired_num++;
+	}
+	c_avl_iterator_destroy (iter);
+
+	for (i = 0; i < expired_num; i++)
+	{
+		c_avl_remove (arena->dict, &expired[i]->key, NULL, NULL);
+		sfree (expired[i]);
+	}
+	sfree (expired);
+} /* }}} void dict_expire */
+
+/* Parses a TYPE_IDENT_DEFINE or TYPE_IDENT_REF part. A definition stores the
+ * identifier in "vl", a reference sets the identifier of "vl". Returns ENOENT
+ * if the referenced number is unknown. */
+static int parse_part_ident (parse_arena_t *arena, /* {{{ */
+		void **ret_buffer, size_t *ret_buffer_len, value_list_t *vl)
+{
+	char *buffer = *ret_buffer;
+	uint16_t tmp16;
+	uint64_t tmp64;
+	uint32_t tmp32;
+	uint16_t pkg_type;
+	uint16_t pkg_length;
+	dict_key_t key;
+	dict_entry_t *e = NULL;
+	const char *fields[5];
+	size_t lengths[5];
+	size_t size;
+	cdtime_t now;
+	char *ptr;
+	size_t i;
+
+	if (*ret_buffer_len < DICT_PART_SIZE)
+	{
+		WARNING ("network plugin: parse_part_ident: "
+				"Packet too short: "
+				"Chunk of size %u expected, "
+				"but buffer has only %zu bytes left.",
+				(unsigned int) DICT_PART_SIZE, *ret_buffer_len);
+		return (-1);
+	}
+
+	memcpy (&tmp16, buffer, sizeof (tmp16));
+	pkg_type = ntohs (tmp16);
+	memcpy (&tmp16, buffer + 2, sizeof (tmp16));
+	pkg_length = ntohs (tmp16);
+	if (pkg_length != DICT_PART_SIZE)
+	{
+		WARNING ("network plugin: parse_part_ident: "
+				"Part of size %u expected, got %"PRIu16".",
+				(unsigned int) DICT_PART_SIZE, pkg_length);
+		return (-1);
+	}
+
+	memset (&key, 0, sizeof (key));
+	memcpy (&tmp64, buffer + 4, sizeof (tmp64));
+	key.session = ntohll (tmp64);
+	memcpy (&tmp32, buffer + 12, sizeof (tmp32));
+	key.id = ntohl (tmp32);
+
+	*ret_buffer = buffer + DICT_PART_SIZE;
+	*ret_buffer_len -= DICT_PART_SIZE;
+
+	now = cdtime_coarse ();
+
+	if (pkg_type == TYPE_IDENT_REF)
+	{
+		if ((arena->dict == NULL)
+				|| (c_avl_get (arena->dict, &key, (void *) &e) != 0))
+			return (ENOENT);
+
+		ptr = e->strings;
+		sstrncpy (vl->host, ptr, sizeof (vl->host));
+		ptr += strlen (ptr) + 1;
+		sstrncpy (vl->plugin, ptr, sizeof (vl->plugin));
+		ptr += strlen (ptr) + 1;
+		sstrncpy (vl->plugin_instance, ptr, sizeof (vl->plugin_instance));
+		ptr += strlen (ptr) + 1;
+		sstrncpy (vl->type, ptr, sizeof (vl->type));
+		ptr += strlen (ptr) + 1;
+		sstrncpy (vl->type_instance, ptr, sizeof (vl->type_instance));
+
+		e->used = now;
+		return (0);
+	}
+
+	/* TYPE_IDENT_DEFINE */
+	if (arena->dict == NULL)
+	{
+		arena->dict = c_avl_create (dict_key_compare);
+		arena->dict_expired = now;
+		/* The references will be unknown. */
+		if (arena->dict == NULL)
+			return (0);
+	}
+	else if ((now - arena->dict_expired) >= DICT_EXPIRE)
+		dict_expire (arena, now);
+
+	fields[0] = vl->host;
+	fields[1] = vl->plugin;
+	fields[2] = vl->plugin_instance;
+	fields[3] = vl->type;
+	fields[4] = vl->type_instance;
+
+	size = sizeof (*e);
+	for (i = 0; i < STATIC_ARRAY_SIZE (fields); i++)
+	{
+		lengths[i] = strlen (fields[i]);
+		size += lengths[i] + 1;
+	}
+
+	e = malloc (size);
+	if (e == NULL)
+		return (0);
+	e->key = key;
+	e->used = now;
+	ptr = e->strings;
+	for (i = 0; i < STATIC_ARRAY_SIZE (fields); i++)
+	{
+		memcpy (ptr, fields[i], lengths[i] + 1);
+		ptr += lengths[i] + 1;
+	}
+
+	/* A redefinition, e.g. after the sender's series changed. */
+	{
+		dict_entry_t *old = NULL;
+
+		if (c_avl_remove (arena->dict, &key, NULL, (void *) &old) == 0)
+			sfree (old);
+	}
+
+	if (c_avl_insert (arena->dict, &e->key, e) != 0)
+		sfree (e);
+
+	return (0);
+} /* }}} int parse_part_ident */
+
+static int parse_part_number (void **ret_buffer, size_t *ret_buffer_len,
+		uint64_t *value)
+{
+	char *buffer = *ret_buffer;
+	size_t buffer_len = *ret_buffer_len;
+
+	uint16_t tmp16;
+	uint64_t tmp64;
+	size_t exp_size = 2 * sizeof (uint16_t) + sizeof (uint64_t);
+
+	uint16_t pkg_length;
+
+	if (buffer_len < exp_size)
+	{
+		WARNING ("network plugin: parse_part_number: "
+				"Packet too short: "
+				"Chunk of size %zu expected, "
+				"but buffer has only %zu bytes left.",
+				exp_size, buffer_len);
+		return (-1);
+	}
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	/* pkg_type = ntohs (tmp16); */
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	pkg_length = ntohs (tmp16);
+
+	memcpy ((void *) &tmp64, buffer, sizeof (tmp64));
+	buffer += sizeof (tmp64);
+	*value = ntohll (tmp64);
+
+	*ret_buffer = buffer;
+	*ret_buffer_len = buffer_len - pkg_length;
+
+	return (0);
+} /* int parse_part_number */
+
+static int parse_part_string (void **ret_buffer, size_t *ret_buffer_len,
+		char *output, int output_len)
+{
+	char *buffer = *ret_buffer;
+	size_t buffer_len = *ret_buffer_len;
+
+	uint16_t tmp16;
+	size_t header_size = 2 * sizeof (uint16_t);
+
+	uint16_t pkg_length;
+
+	if (buffer_len < header_size)
+	{
+		WARNING ("network plugin: parse_part_string: "
+				"Packet too short: "
+				"Chunk of at least size %zu expected, "
+				"but buffer has only %zu bytes left.",
+				header_size, buffer_len);
+		return (-1);
+	}
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	/* pkg_type = ntohs (tmp16); */
+
+	memcpy ((void *) &tmp16, buffer, sizeof (tmp16));
+	buffer += sizeof (tmp16);
+	pkg_length = ntohs (tmp16);
+
+	/* Check that packet fits in the input buffer */
+	if (pkg_length > buffer_len)
+	{
+		WARNING ("network plugin: parse_part_string: "
+				"Packet too big: "
+				"Chunk of size %"PRIu16" received, "
+				"but buffer has only %zu bytes left.",
+				pkg_length, buffer_len);
+		return (-1);
+	}
+
+	/* Check that pkg_length is in the valid range */
+	if (pkg_length <= header_size)
+	{
+		WARNING ("network plugin: parse_part_string: "
+				"Packet too short: "
+				"Header claims this packet is only %hu "
+				"bytes long.", pkg_length);
+		return (-1);
+	}
+
+	/* Check that the package data fits into the output buffer.
+	 * The previous if-statement ensures that:
+	 * `pkg_length > header_size' */
+	if ((output_len < 0)
+			|| ((size_t) output_len < ((size_t) pkg_length - header_size)))
+	{
+		WARNING ("network plugin: parse_part_string: "
+				"Output buffer too small.");
+		return (-1);
+	}
+
+	/* Check the string in the packet, so nothing is copied if it's
+	 * invalid. For some very weird reason '\0' doesn't do the trick on
+	 * SPARC in this statement. */
+	output_len = pkg_length - header_size;
+	if (buffer[output_len - 1] != 0)
+	{
+		WARNING ("network plugin: parse_part_string: "
+				"Received string does not end "
+				"with a NULL-byte.");
+		return (-1);
+	}
+
+	/* All sanity checks successfull, let's copy the data over */
+	memcpy ((void *) output, (void *) buffer, output_len);
+	buffer += output_len;
+
+	*ret_buffer = buffer;
+	*ret_buffer_len = buffer_len - pkg_length;
+
+	return (0);
+} /* int parse_part_string */
+
+/* Forward declaration: parse_part_sign_sha256 and parse_part_encr_aes256 call
+ * parse_packet and vice versa. */
+#define PP_SIGNED    0x01
+#define PP_ENCRYPTED 0x02
+static int parse_packet (sockent_t *se,
+		void *buffer, size_t buffer_size, int flags,
+		const char *username);
+/* Used by relay_packet(). */
+static void network_send_buffer (char *buffer, size_t buffer_len);
+
+#define BUFFER_READ(p,s) do { \
+  memcpy ((p), buffer + buffer_offset, (s)); \
+  buffer_offset += (s); \
+} while (0)
+
+#if HAVE_LIBGCRYPT
+static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
+    void **ret_buffer, size_t *ret_buffer_len, int flags)
+{
+  static c_complain_t complain_no_users = C_COMPLAIN_INIT_STATIC;
+
+  char *buffer;
+  size_t buffer_len;
+  size_t buffer_offset;
+
+  size_t username_len;
+  user_key_t *k;
+
+  part_signature_sha256_t pss;
+  uint16_t pss_head_length;
+  char hash[sizeof (pss.hash)];
+
+  unsigned char *hash_ptr;
+
+  buffer = *ret_buffer;
+  buffer_len = *ret_buffer_len;
+  buffer_offset = 0;
+
+  if (se->data.server.userdb == NULL)
+  {
+    c_complain (LOG_NOTICE, &complain_no_users,
+        "network plugin: Received signed network packet but can't verify it "
+        "because no user DB has been configured. Will accept it.");
+    /* Skip the signature, parse_packet() has checked its length. */
+    memcpy (&pss.head.length, buffer + sizeof (pss.head.type),
+        sizeof (pss.head.length));
+    pss_head_length = ntohs (pss.head.length);
+    *ret_buffer = buffer + pss_head_length;
+    *ret_buffer_len = buffer_len - pss_head_length;
+    return (0);
+  }
+
+  /* Check if the buffer has enough data for this structure. */
+  if (buffer_len <= PART_SIGNATURE_SHA256_SIZE)
+    return (-ENOMEM);
+
+  /* Read type and length header */
+  BUFFER_READ (&pss.head.type, sizeof (pss.head.type));
+  BUFFER_READ (&pss.head.length, sizeof (pss.head.length));
+  pss_head_length = ntohs (pss.head.length);
+
+  /* Check if the `pss_head_length' is within bounds. */
+  if ((pss_head_length <= PART_SIGNATURE_SHA256_SIZE)
+      || (pss_head_length > buffer_len))
+  {
+    ERROR ("network plugin: HMAC-SHA-256 with invalid length received.");
+    return (-1);
+  }
+
+  /* Copy the hash. */
+  BUFFER_READ (pss.hash, sizeof (pss.hash));
+
+  /* Calculate username length (without null byte) and allocate memory */
+  username_len = pss_head_length - PART_SIGNATURE_SHA256_SIZE;
+  pss.username = malloc (username_len + 1);
+  if (pss.username == NULL)
+    return (-ENOMEM);
+
+  /* Read the username */
+  BUFFER_READ (pss.username, username_len);
+  pss.username[username_len] = 0;
+
+  assert (buffer_offset == pss_head_length);
+
+  /* Look up the keyed HMAC of the user */
+  k = network_user_key_get (se, pss.username);
+  if (k == NULL)
+  {
+    ERROR ("network plugin: Unknown user: %s", pss.username);
+    sfree (pss.username);
+    return (-ENOENT);
+  }
+
+  /* Check the HMAC */
+  gcry_md_reset (k->hmac);
+  gcry_md_write (k->hmac,
+      buffer     + PART_SIGNATURE_SHA256_SIZE,
+      buffer_len - PART_SIGNATURE_SHA256_SIZE);
+  hash_ptr = gcry_md_read (k->hmac, GCRY_MD_SHA256);
+  if (hash_ptr == NULL)
+  {
+    ERROR ("network plugin: gcry_md_read failed.");
+    sfree (pss.username);
+    return (-1);
+  }
+  memcpy (hash, hash_ptr, sizeof (hash));
+
+  if (memcmp (pss.hash, hash, sizeof (pss.hash)) != 0)
+  {
+    WARNING ("network plugin: Verifying HMAC-SHA-256 signature failed: "
+        "Hash mismatch.");
+  }
+  else
+  {
+    parse_packet (se, buffer + buffer_offset, buffer_len - buffer_offset,
+        flags | PP_SIGNED, pss.username);
+  }
+
+  sfree (pss.username);
+
+  *ret_buffer = buffer + buffer_len;
+  *ret_buffer_len = 0;
+
+  return (0);
+} /* }}} int parse_part_sign_sha256 */
+/* #endif HAVE_LIBGCRYPT */
+
+#else /* if !HAVE_LIBGCRYPT */
+static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
+    void **ret_buffer, size_t *ret_buffer_size, int flags)
+{
+  static int warning_has_been_printed = 0;
+
+  char *buffer;
+  size_t buffer_size;
+  size_t buffer_offset;
+  uint16_t part_len;
+
+  part_signature_sha256_t pss;
+
+  buffer = *ret_buffer;
+  buffer_size = *ret_buffer_size;
+  buffer_offset = 0;
+
+  if (buffer_size <= PART_SIGNATURE_SHA256_SIZE)
+    return (-ENOMEM);
+
+  BUFFER_READ (&pss.head.type, sizeof (pss.head.type));
+  BUFFER_READ (&pss.head.length, sizeof (pss.head.length));
+  part_len = ntohs (pss.head.length);
+
+  if ((part_len <= PART_SIGNATURE_SHA256_SIZE)
+      || (part_len > buffer_size))
+    return (-EINVAL);
+
+  if (warning_has_been_printed == 0)
+  {
+    WARNING ("network plugin: Received signed packet, but the network "
+        "plugin was not linked with libgcrypt, so I cannot "
+        "verify the signature. The packet will be accepted.");
+    warning_has_been_printed = 1;
+  }
+
+  parse_packet (se, buffer + part_len, buffer_size - part_len, flags,
+      /* username = */ NULL);
+
+  *ret_buffer = buffer + buffer_size;
+  *ret_buffer_size = 0;
+
+  return (0);
+} /* }}} int parse_part_sign_sha256 */
+#endif /* !HAVE_LIBGCRYPT */
+
+#if HAVE_LIBGCRYPT
+static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
+		void **ret_buffer, size_t *ret_buffer_len,
+		int flags)
+{
+  char  *buffer = *ret_buffer;
+  size_t buffer_len = *ret_buffer_len;
+  size_t payload_len;
+  size_t part_size;
+  size_t buffer_offset;
+  uint16_t username_len;
+  part_encryption_aes256_t pea;
+  unsigned char hash[sizeof (pea.hash)];
+
+  gcry_cipher_hd_t cypher;
+  gcry_error_t err;
+
+  /* Make sure at least the header if available. */
+  if (buffer_len <= PART_ENCRYPTION_AES256_SIZE)
+  {
+    NOTICE ("network plugin: parse_part_encr_aes256: "
+        "Discarding short packet.");
+    return (-1);
+  }
+
+  buffer_offset = 0;
+
+  /* Copy the unencrypted information into `pea'. */
+  BUFFER_READ (&pea.head.type, sizeof (pea.head.type));
+  BUFFER_READ (&pea.head.length, sizeof (pea.head.length));
+
+  /* Check the `part size'. */
+  part_size = ntohs (pea.head.length);
+  if ((part_size <= PART_ENCRYPTION_AES256_SIZE)
+      || (part_size > buffer_len))
+  {
+    NOTICE ("network plugin: parse_part_encr_aes256: "
+        "Discarding part with invalid size.");
+    return (-1);
+  }
+
+  /* Read the username */
+  BUFFER_READ (&username_len, sizeof (username_len));
+  username_len = ntohs (username_len);
+
+  if ((username_len <= 0)
+      || (username_len > (part_size - (PART_ENCRYPTION_AES256_SIZE + 1))))
+  {
+    NOTICE ("network plugin: parse_part_encr_aes256: "
+        "Discarding part with invalid username length.");
+    return (-1);
+  }
+
+  assert (username_len > 0);
+  pea.username = malloc (username_len + 1);
+  if (pea.username == NULL)
+    return (-ENOMEM);
+  BUFFER_READ (pea.username, username_len);
+  pea.username[username_len] = 0;
+
+  /* Last but not least, the initialization vector */
+  BUFFER_READ (pea.iv, sizeof (pea.iv));
+
+  /* Make sure we are at the right position */
+  assert (buffer_offset == (username_len +
+        PART_ENCRYPTION_AES256_SIZE - sizeof (pea.hash)));
+
+  cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv),
+      pea.username);
+  if (cypher == NULL)
+  {
+    sfree (pea.username);
+    return (-1);
+  }
+
+  payload_len = part_size - (PART_ENCRYPTION_AES256_SIZE + username_len);
+  assert (payload_len > 0);
+
+  /* Decrypt the packet in-place */
+  err = gcry_cipher_decrypt (cypher,
+      buffer    + buffer_offset,
+      part_size - buffer_offset,
+      /* in = */ NULL, /* in len = */ 0);
+  if (err != 0)
+  {
+    sfree (pea.username);
+    ERROR ("network plugin: gcry_cipher_decrypt returned: %s",
+        gcry_strerror (err));
+    return (-1);
+  }
+
+  /* Read the hash */
+  BUFFER_READ (pea.hash, sizeof (pea.hash));
+
+  /* Make sure we're at the right position - again */
+  assert (buffer_offset == (username_len + PART_ENCRYPTION_AES256_SIZE));
+  assert (buffer_offset == (part_size - payload_len));
+
+  /* Check hash sum */
+  memset (hash, 0, sizeof (hash));
+  gcry_md_hash_buffer (GCRY_MD_SHA1, hash,
+      buffer + buffer_offset, payload_len);
+  if (memcmp (hash, pea.hash, sizeof (hash)) != 0)
+  {
+    sfree (pea.username);
+    ERROR ("network plugin: Decryption failed: Checksum mismatch.");
+    return (-1);
+  }
+
+  parse_packet (se, buffer + buffer_offset, payload_len,
+      flags | PP_ENCRYPTED, pea.username);
+
+  /* XXX: Free pea.username?!? */
+
+  /* Update return values */
+  *ret_buffer =     buffer     + part_size;
+  *ret_buffer_len = buffer_len - part_size;
+
+  sfree (pea.username);
+
+  return (0);
+} /* }}} int parse_part_encr_aes256 */
+/* #endif HAVE_LIBGCRYPT */
+
+#else /* if !HAVE_LIBGCRYPT */
+static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
+    void **ret_buffer, size_t *ret_buffer_size, int flags)
+{
+  static int warning_has_been_printed = 0;
+
+  char *buffer;
+  size_t buffer_size;
+  size_t buffer_offset;
+
+  part_header_t ph;
+  size_t ph_length;
+
+  buffer = *ret_buffer;
+  buffer_size = *ret_buffer_size;
+  buffer_offset = 0;
+
+  /* parse_packet assures this minimum size. */
+  assert (buffer_size >= (sizeof (ph.type) + sizeof (ph.length)));
+
+  BUFFER_READ (&ph.type, sizeof (ph.type));
+  BUFFER_READ (&ph.length, sizeof (ph.length));
+  ph_length = ntohs (ph.length);
+
+  if ((ph_length <= PART_ENCRYPTION_AES256_SIZE)
+      || (ph_length > buffer_size))
+  {
+    ERROR ("network plugin: AES-256 encrypted part "
+        "with invalid length received.");
+    return (-1);
+  }
+
+  if (warning_has_been_printed == 0)
+  {
+    WARNING ("network plugin: Received encrypted packet, but the network "
         "plugin was not linked with libgcrypt, so I cannot "
         "decrypt it. The part will be discarded.");
     warning_has_been_printed = 1;
   }
 
-  *ret_buffer += ph_length;
-  *ret_buffer_size -= ph_length;
+  *ret_buffer += ph_length;
+  *ret_buffer_size -= ph_length;
+
+  return (0);
+} /* }}} int parse_part_encr_aes256 */
+#endif /* !HAVE_LIBGCRYPT */
+
+#undef BUFFER_READ
+
+/* Returns true if the part of type "type" at "buffer" is well-formed. Only
+ * the sizes are checked, the contents are left to the final receiver.
+ * Unknown types are accepted, parse_packet() ignores them, too. */
+static _Bool relay_part_okay (uint16_t type, /* {{{ */
+		const char *buffer, size_t pkg_length)
+{
+	switch (type)
+	{
+		case TYPE_VALUES:
+		{
+			uint16_t num;
+
+			if (pkg_length < (sizeof (part_header_t) + sizeof (num)))
+				return (0);
+			memcpy (&num, buffer + sizeof (part_header_t), sizeof (num));
+			num = ntohs (num);
+			return (pkg_length == (sizeof (part_header_t) + sizeof (num)
+						+ num * (sizeof (uint8_t)
+							+ sizeof (value_t))));
+		}
+
+		case TYPE_IDENT_DEFINE:
+		case TYPE_IDENT_REF:
+			return (pkg_length == DICT_PART_SIZE);
+
+		/* The values themselves are checked by the receiver. */
+		case TYPE_VALUES_COMPACT:
+			return ((pkg_length >= COMPACT_HEADER_SIZE)
+					&& (pkg_length >= (COMPACT_HEADER_SIZE
+							+ 2 * (size_t) ((const uint8_t *) buffer)[6])));
+
+		case TYPE_TIME:
+		case TYPE_TIME_HR:
+		case TYPE_INTERVAL:
+		case TYPE_INTERVAL_HR:
+		case TYPE_SEVERITY:
+			return (pkg_length
+					== (sizeof (part_header_t) + sizeof (uint64_t)));
+
+		case TYPE_HOST:
+		case TYPE_PLUGIN:
+		case TYPE_PLUGIN_INSTANCE:
+		case TYPE_TYPE:
+		case TYPE_TYPE_INSTANCE:
+		case TYPE_MESSAGE:
+			return ((pkg_length > sizeof (part_header_t))
+					&& (buffer[pkg_length - 1] == 0));
+	}
+
+	return (1);
+} /* }}} _Bool relay_part_okay */
+
+/* Queues the unencrypted parts at "buffer" for all servers, see
+ * relay_packet(). */
+static void relay_send (char *buffer, size_t buffer_size) /* {{{ */
+{
+	if (buffer_size == 0)
+		return;
+
+	if (buffer_size > network_config_packet_size)
+	{
+		WARNING ("network plugin: Not relaying a packet of %zu bytes, "
+				"try increasing `MaxPacketSize'.", buffer_size);
+		(void) __sync_add_and_fetch (&stats_packets_not_relayed, 1);
+		return;
+	}
+
+	network_send_buffer (buffer, buffer_size);
+	(void) __sync_add_and_fetch (&stats_packets_relayed, 1);
+} /* }}} void relay_send */
+
+/* Checks the packet received on the relay socket "se" like parse_packet(),
+ * verifying signatures and decrypting as configured, and passes the parts
+ * on to the servers as they are. The values aren't dispatched. The servers
+ * sign or encrypt the packets again according to their own settings. */
+static int relay_packet (sockent_t *se, /* {{{ */
+		void *buffer, size_t buffer_size, int flags)
+{
+	/* Parts which can be sent in one go. */
+	char *span = buffer;
+	size_t span_size = 0;
+	int status = 0;
+
+#if HAVE_LIBGCRYPT
+	_Bool secure = 0;
+
+	if (se->data.server.security_level == SECURITY_LEVEL_ENCRYPT)
+		secure = ((flags & PP_ENCRYPTED) != 0);
+	else if (se->data.server.security_level == SECURITY_LEVEL_SIGN)
+		secure = ((flags & (PP_ENCRYPTED | PP_SIGNED)) != 0);
+	else
+		secure = 1;
+#endif
+
+	while ((status == 0)
+			&& (buffer_size > sizeof (part_header_t)))
+	{
+		uint16_t pkg_length;
+		uint16_t pkg_type;
+
+		memcpy (&pkg_type, buffer, sizeof (pkg_type));
+		memcpy (&pkg_length, (char *) buffer + sizeof (pkg_type),
+				sizeof (pkg_length));
+		pkg_length = ntohs (pkg_length);
+		pkg_type = ntohs (pkg_type);
+
+		if ((pkg_length > buffer_size)
+				|| (pkg_length < (2 * sizeof (uint16_t))))
+			break;
+
+		if ((pkg_type == TYPE_ENCR_AES256)
+				|| (pkg_type == TYPE_SIGN_SHA256))
+		{
+			/* The payload comes back through parse_packet() and
+			 * is relayed on its own. */
+			relay_send (span, span_size);
+			span_size = 0;
+
+			if (pkg_type == TYPE_ENCR_AES256)
+				status = parse_part_encr_aes256 (se,
+						&buffer, &buffer_size, flags);
+			else
+				status = parse_part_sign_sha256 (se,
+						&buffer, &buffer_size, flags);
+			span = buffer;
+			continue;
+		}
+
+#if HAVE_LIBGCRYPT
+		if (!secure)
+		{
+			relay_send (span, span_size);
+			span_size = 0;
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= pkg_length;
+			span = buffer;
+			continue;
+		}
+#endif
+
+		if (!relay_part_okay (pkg_type, buffer, pkg_length))
+		{
+			NOTICE ("network plugin: Not relaying a packet with an "
+					"invalid part of type %#x.",
+					(unsigned int) pkg_type);
+			(void) __sync_add_and_fetch (&stats_packets_not_relayed,
+					1);
+			return (-1);
+		}
+
+		span_size += pkg_length;
+		buffer = ((char *) buffer) + pkg_length;
+		buffer_size -= pkg_length;
+	}
+
+	relay_send (span, span_size);
+
+	return (status);
+} /* }}} int relay_packet */
+
+static int parse_packet (sockent_t *se, /* {{{ */
+		void *buffer, size_t buffer_size, int flags,
+		const char *username)
+{
+	int status;
+
+	value_list_t vl = VALUE_LIST_INIT;
+	notification_t n;
+	parse_arena_t *arena;
+	meta_data_t *meta = NULL;
+	/* Set after a TYPE_IDENT_REF part with an unknown number, until an
+	 * identifier is known again. */
+	_Bool ident_lost = 0;
+	/* The rule matching the identifier in "vl", see
+	 * network_filter_deny(). */
+	filter_rule_t *filter_match = NULL;
+	_Bool filter_valid = 0;
+
+#if HAVE_LIBGCRYPT
+	int packet_was_signed = (flags & PP_SIGNED);
+        int packet_was_encrypted = (flags & PP_ENCRYPTED);
+	int printed_ignore_warning = 0;
+#endif /* HAVE_LIBGCRYPT */
+
+
+	if (se->data.server.relay)
+		return (relay_packet (se, buffer, buffer_size, flags));
+
+	memset (&vl, '\0', sizeof (vl));
+	memset (&n, '\0', sizeof (n));
+	status = 0;
+
+	arena = network_parse_arena_get ();
+	if (arena == NULL)
+	{
+		ERROR ("network plugin: parse_packet: "
+				"Allocating the parse arena failed.");
+		return (-ENOMEM);
+	}
+
+	while ((status == 0) && (0 < buffer_size)
+			&& ((unsigned int) buffer_size > sizeof (part_header_t)))
+	{
+		uint16_t pkg_length;
+		uint16_t pkg_type;
+
+		memcpy ((void *) &pkg_type,
+				(void *) buffer,
+				sizeof (pkg_type));
+		memcpy ((void *) &pkg_length,
+				(void *) (buffer + sizeof (pkg_type)),
+				sizeof (pkg_length));
+
+		pkg_length = ntohs (pkg_length);
+		pkg_type = ntohs (pkg_type);
+
+		if (pkg_length > buffer_size)
+			break;
+		/* Ensure that this loop terminates eventually */
+		if (pkg_length < (2 * sizeof (uint16_t)))
+			break;
+
+		if (pkg_type == TYPE_ENCR_AES256)
+		{
+			status = parse_part_encr_aes256 (se,
+					&buffer, &buffer_size, flags);
+			if (status != 0)
+			{
+				ERROR ("network plugin: Decrypting AES256 "
+						"part failed "
+						"with status %i.", status);
+				break;
+			}
+		}
+#if HAVE_LIBGCRYPT
+		else if ((se->data.server.security_level == SECURITY_LEVEL_ENCRYPT)
+				&& (packet_was_encrypted == 0))
+		{
+			if (printed_ignore_warning == 0)
+			{
+				INFO ("network plugin: Unencrypted packet or "
+						"part has been ignored.");
+				printed_ignore_warning = 1;
+			}
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= (size_t) pkg_length;
+			continue;
+		}
+#endif /* HAVE_LIBGCRYPT */
+		else if (pkg_type == TYPE_SIGN_SHA256)
+		{
+			status = parse_part_sign_sha256 (se,
+                                        &buffer, &buffer_size, flags);
+			if (status != 0)
+			{
+				ERROR ("network plugin: Verifying HMAC-SHA-256 "
+						"signature failed "
+						"with status %i.", status);
+				break;
+			}
+		}
+#if HAVE_LIBGCRYPT
+		else if ((se->data.server.security_level == SECURITY_LEVEL_SIGN)
+				&& (packet_was_encrypted == 0)
+				&& (packet_was_signed == 0))
+		{
+			if (printed_ignore_warning == 0)
+			{
+				INFO ("network plugin: Unsigned packet or "
+						"part has been ignored.");
+				printed_ignore_warning = 1;
+			}
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= (size_t) pkg_length;
+			continue;
+		}
+#endif /* HAVE_LIBGCRYPT */
+		else if (ident_lost && ((pkg_type == TYPE_VALUES)
+					|| (pkg_type == TYPE_VALUES_COMPACT)))
+		{
+			(void) __sync_add_and_fetch (&stats_values_dict_lost, 1);
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= (size_t) pkg_length;
+		}
+		else if (((pkg_type == TYPE_VALUES)
+					|| (pkg_type == TYPE_VALUES_COMPACT))
+				&& network_filter_deny (se->data.server.filter,
+					&vl, &filter_match, &filter_valid))
+		{
+			/* Skipped before the values are decoded. The rules
+			 * don't depend on the values, so skipping the deltas
+			 * of a compact series loses nothing. */
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= (size_t) pkg_length;
+		}
+		else if ((pkg_type == TYPE_IDENT_DEFINE)
+				|| (pkg_type == TYPE_IDENT_REF))
+		{
+			status = parse_part_ident (arena, &buffer, &buffer_size,
+					&vl);
+			filter_valid = 0;
+			ident_lost = (status == ENOENT);
+			if (status == ENOENT)
+				status = 0;
+		}
+		else if (pkg_type == TYPE_VALUES)
+		{
+			/* TCP frames hold many packets, which may not fit
+			 * into the arena together. */
+			if ((arena->values_size - arena->values_num)
+					< (pkg_length / (sizeof (uint8_t)
+							+ sizeof (value_t))))
+				network_parse_flush (arena);
+
+			status = parse_part_values (&buffer, &buffer_size,
+					arena->values + arena->values_num,
+					arena->values_size - arena->values_num,
+					&vl.values_len);
+			if (status != 0)
+				break;
+
+			vl.values = arena->values + arena->values_num;
+			arena->values_num += (size_t) vl.values_len;
+
+			network_queue_values (arena, &vl, &meta, username,
+					se->data.server.priority);
+		}
+		else if (pkg_type == TYPE_VALUES_COMPACT)
+		{
+			/* Each value takes at least two bytes. */
+			if ((arena->values_size - arena->values_num)
+					< (size_t) (pkg_length / 2))
+				network_parse_flush (arena);
+
+			status = parse_part_values_compact (arena,
+					&buffer, &buffer_size, &vl,
+					arena->values + arena->values_num,
+					arena->values_size - arena->values_num,
+					&vl.values_len);
+			if (status == ENOENT)
+			{
+				(void) __sync_add_and_fetch (
+						&stats_values_compact_lost, 1);
+				status = 0;
+				continue;
+			}
+			else if (status != 0)
+				break;
+
+			vl.values = arena->values + arena->values_num;
+			arena->values_num += (size_t) vl.values_len;
+
+			network_queue_values (arena, &vl, &meta, username,
+					se->data.server.priority);
+		}
+		else if (pkg_type == TYPE_TIME)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.time = TIME_T_TO_CDTIME_T (tmp);
+		}
+		else if (pkg_type == TYPE_TIME_HR)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.time = (cdtime_t) tmp;
+		}
+		else if (pkg_type == TYPE_INTERVAL)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.interval = TIME_T_TO_CDTIME_T (tmp);
+		}
+		else if (pkg_type == TYPE_INTERVAL_HR)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				vl.interval = (cdtime_t) tmp;
+		}
+		else if (pkg_type == TYPE_HOST)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					vl.host, sizeof (vl.host));
+			/* Senders using the dictionary send all strings after
+			 * the host, so the identifier is complete again. */
+			ident_lost = 0;
+			filter_valid = 0;
+		}
+		else if (pkg_type == TYPE_PLUGIN)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					vl.plugin, sizeof (vl.plugin));
+			filter_valid = 0;
+		}
+		else if (pkg_type == TYPE_PLUGIN_INSTANCE)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					vl.plugin_instance,
+					sizeof (vl.plugin_instance));
+		}
+		else if (pkg_type == TYPE_TYPE)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					vl.type, sizeof (vl.type));
+			filter_valid = 0;
+		}
+		else if (pkg_type == TYPE_TYPE_INSTANCE)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					vl.type_instance,
+					sizeof (vl.type_instance));
+		}
+		else if (pkg_type == TYPE_MESSAGE)
+		{
+			status = parse_part_string (&buffer, &buffer_size,
+					n.message, sizeof (n.message));
+
+			/* The host, plugin, etc. parts have only been stored
+			 * in "vl", they are copied if the notification is
+			 * dispatched. */
+			n.time = vl.time;
+
+			if (status != 0)
+			{
+				/* do nothing */
+			}
+			else if ((n.severity != NOTIF_FAILURE)
+					&& (n.severity != NOTIF_WARNING)
+					&& (n.severity != NOTIF_OKAY))
+			{
+				INFO ("network plugin: "
+						"Ignoring notification with "
+						"unknown severity %i.",
+						n.severity);
+			}
+			else if (n.time <= 0)
+			{
+				INFO ("network plugin: "
+						"Ignoring notification with "
+						"time == 0.");
+			}
+			else if (strlen (n.message) <= 0)
+			{
+				INFO ("network plugin: "
+						"Ignoring notification with "
+						"an empty message.");
+			}
+			else
+			{
+				sstrncpy (n.host, vl.host, sizeof (n.host));
+				sstrncpy (n.plugin, vl.plugin,
+						sizeof (n.plugin));
+				sstrncpy (n.plugin_instance,
+						vl.plugin_instance,
+						sizeof (n.plugin_instance));
+				sstrncpy (n.type, vl.type, sizeof (n.type));
+				sstrncpy (n.type_instance, vl.type_instance,
+						sizeof (n.type_instance));
+				network_dispatch_notification (&n);
+			}
+		}
+		else if (pkg_type == TYPE_SEVERITY)
+		{
+			uint64_t tmp = 0;
+			status = parse_part_number (&buffer, &buffer_size,
+					&tmp);
+			if (status == 0)
+				n.severity = (int) tmp;
+		}
+		else
+		{
+			if (pkg_type != TYPE_PADDING)
+				DEBUG ("network plugin: parse_packet: Unknown "
+						"part type: 0x%04hx", pkg_type);
+			buffer = ((char *) buffer) + pkg_length;
+			buffer_size -= (size_t) pkg_length;
+		}
+	} /* while (buffer_size > sizeof (part_header_t)) */
+
+	if (status == 0 && buffer_size > 0)
+		WARNING ("network plugin: parse_packet: Received truncated "
+				"packet, try increasing `MaxPacketSize'");
+
+	/* This includes the values of the enclosing packet, if any, which are
+	 * also still in the arena. */
+	network_parse_flush (arena);
+	meta_data_destroy (meta);
+
+	return (status);
+} /* }}} int parse_packet */
+
+static void free_sockent_client (struct sockent_client *sec) /* {{{ */
+{
+  if (sec->fd >= 0)
+  {
+    close (sec->fd);
+    sec->fd = -1;
+  }
+  sfree (sec->addr);
+  sfree (sec->tcp_out);
+  pthread_mutex_destroy (&sec->tcp_lock);
+#if HAVE_LIBGCRYPT
+  sfree (sec->username);
+  sfree (sec->password);
+  if (sec->cypher != NULL)
+    gcry_cipher_close (sec->cypher);
+  if (sec->hmac != NULL)
+    gcry_md_close (sec->hmac);
+#endif
+} /* }}} void free_sockent_client */
+
+static void free_sockent_server (struct sockent_server *ses) /* {{{ */
+{
+  size_t i;
+
+  for (i = 0; i < ses->fd_num; i++)
+  {
+    if (ses->fd[i] >= 0)
+    {
+      close (ses->fd[i]);
+      ses->fd[i] = -1;
+    }
+  }
+
+  sfree (ses->fd);
+  network_filter_destroy (ses->filter);
+  ses->filter = NULL;
+#if HAVE_LIBGCRYPT
+  sfree (ses->auth_file);
+  fbh_destroy (ses->userdb);
+#endif
+} /* }}} void free_sockent_server */
+
+static void sockent_destroy (sockent_t *se) /* {{{ */
+{
+  sockent_t *next;
+
+  DEBUG ("network plugin: sockent_destroy (se = %p);", (void *) se);
+
+  while (se != NULL)
+  {
+    next = se->next;
+
+    sfree (se->node);
+    sfree (se->service);
+
+    if (se->type == SOCKENT_TYPE_CLIENT)
+      free_sockent_client (&se->data.client);
+    else
+      free_sockent_server (&se->data.server);
+
+    sfree (se);
+    se = next;
+  }
+} /* }}} void sockent_destroy */
+
+/*
+ * int network_set_ttl
+ *
+ * Set the `IP_MULTICAST_TTL', `IP_TTL', `IPV6_MULTICAST_HOPS' or
+ * `IPV6_UNICAST_HOPS', depending on which option is applicable.
+ *
+ * The `struct addrinfo' is used to destinguish between unicast and multicast
+ * sockets.
+ */
+static int network_set_ttl (const sockent_t *se, const struct addrinfo *ai)
+{
+	DEBUG ("network plugin: network_set_ttl: network_config_ttl = %i;",
+			network_config_ttl);
+
+        assert (se->type == SOCKENT_TYPE_CLIENT);
+
+	if ((network_config_ttl < 1) || (network_config_ttl > 255))
+		return (-1);
+
+	if (ai->ai_family == AF_INET)
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
+		int optname;
+
+		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
+			optname = IP_MULTICAST_TTL;
+		else
+			optname = IP_TTL;
+
+		if (setsockopt (se->data.client.fd, IPPROTO_IP, optname,
+					&network_config_ttl,
+					sizeof (network_config_ttl)) != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network plugin: setsockopt (ipv4-ttl): %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+	}
+	else if (ai->ai_family == AF_INET6)
+	{
+		/* Useful example: http://gsyc.escet.urjc.es/~eva/IPv6-web/examples/mcast.html */
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
+		int optname;
+
+		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
+			optname = IPV6_MULTICAST_HOPS;
+		else
+			optname = IPV6_UNICAST_HOPS;
+
+		if (setsockopt (se->data.client.fd, IPPROTO_IPV6, optname,
+					&network_config_ttl,
+					sizeof (network_config_ttl)) != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network plugin: setsockopt(ipv6-ttl): %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return (-1);
+		}
+	}
+
+	return (0);
+} /* int network_set_ttl */
+
+static int network_set_interface (const sockent_t *se, const struct addrinfo *ai) /* {{{ */
+{
+	DEBUG ("network plugin: network_set_interface: interface index = %i;",
+			se->interface);
+
+        assert (se->type == SOCKENT_TYPE_CLIENT);
+
+	if (ai->ai_family == AF_INET)
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
+
+		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
+		{
+#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
+			/* If possible, use the "ip_mreqn" structure which has
+			 * an "interface index" member. Using the interface
+			 * index is preferred here, because of its similarity
+			 * to the way IPv6 handles this. Unfortunately, it
+			 * appears not to be portable. */
+			struct ip_mreqn mreq;
+
+			memset (&mreq, 0, sizeof (mreq));
+			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
+			mreq.imr_address.s_addr = ntohl (INADDR_ANY);
+			mreq.imr_ifindex = se->interface;
+#else
+			struct ip_mreq mreq;
+
+			memset (&mreq, 0, sizeof (mreq));
+			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
+			mreq.imr_interface.s_addr = ntohl (INADDR_ANY);
+#endif
+
+			if (setsockopt (se->data.client.fd, IPPROTO_IP, IP_MULTICAST_IF,
+						&mreq, sizeof (mreq)) != 0)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (ipv4-multicast-if): %s",
+						sstrerror (errno, errbuf, sizeof (errbuf)));
+				return (-1);
+			}
+
+			return (0);
+		}
+	}
+	else if (ai->ai_family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
+
+		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
+		{
+			if (setsockopt (se->data.client.fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+						&se->interface,
+						sizeof (se->interface)) != 0)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (ipv6-multicast-if): %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				return (-1);
+			}
+
+			return (0);
+		}
+	}
+
+	/* else: Not a multicast interface. */
+	if (se->interface != 0)
+	{
+#if defined(HAVE_IF_INDEXTONAME) && HAVE_IF_INDEXTONAME && defined(SO_BINDTODEVICE)
+		char interface_name[IFNAMSIZ];
+
+		if (if_indextoname (se->interface, interface_name) == NULL)
+			return (-1);
+
+		DEBUG ("network plugin: Binding socket to interface %s", interface_name);
+
+		if (setsockopt (se->data.client.fd, SOL_SOCKET, SO_BINDTODEVICE,
+					interface_name,
+					sizeof(interface_name)) == -1 )
+		{
+			char errbuf[1024];
+			ERROR ("network plugin: setsockopt (bind-if): %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+/* #endif HAVE_IF_INDEXTONAME && SO_BINDTODEVICE */
+
+#else
+		WARNING ("network plugin: Cannot set the interface on a unicast "
+			"socket because "
+# if !defined(SO_BINDTODEVICE)
+			"the \"SO_BINDTODEVICE\" socket option "
+# else
+			"the \"if_indextoname\" function "
+# endif
+			"is not available on your system.");
+#endif
+
+	}
+
+	return (0);
+} /* }}} network_set_interface */
+
+static int network_bind_socket (int fd, const struct addrinfo *ai,
+		const int interface_idx, _Bool reuse_port)
+{
+#if KERNEL_SOLARIS
+	char loop   = 0;
+#else
+	int loop = 0;
+#endif
+	int yes  = 1;
+
+	/* allow multiple sockets to use the same PORT number */
+	if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR,
+				&yes, sizeof(yes)) == -1) {
+                char errbuf[1024];
+                ERROR ("network plugin: setsockopt (reuseaddr): %s",
+                                sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	/* Let the kernel spread the packets over several sockets bound to the
+	 * same address, see the "ReceiveThreads" option. */
+#ifdef SO_REUSEPORT
+	if (reuse_port && (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+					&yes, sizeof (yes)) == -1))
+	{
+		char errbuf[1024];
+		ERROR ("network plugin: setsockopt (reuseport): %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+#else
+	assert (!reuse_port);
+#endif
+
+	DEBUG ("fd = %i; calling `bind'", fd);
+
+	if (bind (fd, ai->ai_addr, ai->ai_addrlen) == -1)
+	{
+		char errbuf[1024];
+		ERROR ("bind: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	if (ai->ai_family == AF_INET)
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
+		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
+		{
+#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
+			struct ip_mreqn mreq;
+#else
+			struct ip_mreq mreq;
+#endif
+
+			DEBUG ("fd = %i; IPv4 multicast address found", fd);
+
+			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
+#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
+			/* Set the interface using the interface index if
+			 * possible (available). Unfortunately, the struct
+			 * ip_mreqn is not portable. */
+			mreq.imr_address.s_addr = ntohl (INADDR_ANY);
+			mreq.imr_ifindex = interface_idx;
+#else
+			mreq.imr_interface.s_addr = ntohl (INADDR_ANY);
+#endif
+
+			if (setsockopt (fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+						&loop, sizeof (loop)) == -1)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (multicast-loop): %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				return (-1);
+			}
+
+			if (setsockopt (fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+						&mreq, sizeof (mreq)) == -1)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (add-membership): %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				return (-1);
+			}
+
+			return (0);
+		}
+	}
+	else if (ai->ai_family == AF_INET6)
+	{
+		/* Useful example: http://gsyc.escet.urjc.es/~eva/IPv6-web/examples/mcast.html */
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
+		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
+		{
+			struct ipv6_mreq mreq;
+
+			DEBUG ("fd = %i; IPv6 multicast address found", fd);
+
+			memcpy (&mreq.ipv6mr_multiaddr,
+					&addr->sin6_addr,
+					sizeof (addr->sin6_addr));
+
+			/* http://developer.apple.com/documentation/Darwin/Reference/ManPages/man4/ip6.4.html
+			 * ipv6mr_interface may be set to zeroes to
+			 * choose the default multicast interface or to
+			 * the index of a particular multicast-capable
+			 * interface if the host is multihomed.
+			 * Membership is associ-associated with a
+			 * single interface; programs running on
+			 * multihomed hosts may need to join the same
+			 * group on more than one interface.*/
+			mreq.ipv6mr_interface = interface_idx;
+
+			if (setsockopt (fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+						&loop, sizeof (loop)) == -1)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (ipv6-multicast-loop): %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				return (-1);
+			}
+
+			if (setsockopt (fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP,
+						&mreq, sizeof (mreq)) == -1)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: setsockopt (ipv6-add-membership): %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				return (-1);
+			}
+
+			return (0);
+		}
+	}
+
+#if defined(HAVE_IF_INDEXTONAME) && HAVE_IF_INDEXTONAME && defined(SO_BINDTODEVICE)
+	/* if a specific interface was set, bind the socket to it. But to avoid
+ 	 * possible problems with multicast routing, only do that for non-multicast
+	 * addresses */
+	if (interface_idx != 0)
+	{
+		char interface_name[IFNAMSIZ];
+
+		if (if_indextoname (interface_idx, interface_name) == NULL)
+			return (-1);
+
+		DEBUG ("fd = %i; Binding socket to interface %s", fd, interface_name);
+
+		if (setsockopt (fd, SOL_SOCKET, SO_BINDTODEVICE,
+					interface_name,
+					sizeof(interface_name)) == -1 )
+		{
+			char errbuf[1024];
+			ERROR ("network plugin: setsockopt (bind-if): %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+	}
+#endif /* HAVE_IF_INDEXTONAME && SO_BINDTODEVICE */
+
+	return (0);
+} /* int network_bind_socket */
+
+/* Makes the bound TCP socket "fd" accept connections. The TCP thread accepts
+ * them in a loop, so the socket doesn't block. */
+static int network_listen_socket (int fd) /* {{{ */
+{
+	int flags;
+
+	flags = fcntl (fd, F_GETFL);
+	if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("network plugin: fcntl failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	if (listen (fd, /* backlog = */ 64) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("network plugin: listen(2) failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	return (0);
+} /* }}} int network_listen_socket */
+
+/* Initialize a sockent structure. `type' must be either `SOCKENT_TYPE_CLIENT'
+ * or `SOCKENT_TYPE_SERVER' */
+static int sockent_init (sockent_t *se, int type) /* {{{ */
+{
+	if (se == NULL)
+		return (-1);
+
+	memset (se, 0, sizeof (*se));
+
+	se->type = SOCKENT_TYPE_CLIENT;
+	se->protocol = NETWORK_PROTOCOL_UDP;
+	se->node = NULL;
+	se->service = NULL;
+	se->interface = 0;
+	se->next = NULL;
+
+	if (type == SOCKENT_TYPE_SERVER)
+	{
+		se->type = SOCKENT_TYPE_SERVER;
+		se->data.server.fd = NULL;
+		se->data.server.receive_threads = 1;
+		se->data.server.priority = PRIORITY_NORMAL;
+#if HAVE_LIBGCRYPT
+		se->data.server.security_level = SECURITY_LEVEL_NONE;
+		se->data.server.auth_file = NULL;
+		se->data.server.userdb = NULL;
+#endif
+	}
+	else
+	{
+		se->data.client.fd = -1;
+		se->data.client.addr = NULL;
+		se->data.client.tcp_state = TCP_STATE_DISCONNECTED;
+		se->data.client.tcp_retry = 0;
+		se->data.client.tcp_backoff = 0;
+		pthread_mutex_init (&se->data.client.tcp_lock, /* attr = */ NULL);
+		se->data.client.compression = COMPRESSION_NONE;
+#if HAVE_LIBGCRYPT
+		se->data.client.security_level = SECURITY_LEVEL_NONE;
+		se->data.client.username = NULL;
+		se->data.client.password = NULL;
+		se->data.client.cypher = NULL;
+		se->data.client.hmac = NULL;
+#endif
+	}
+
+	return (0);
+} /* }}} int sockent_init */
+
+/* The hints used to look up the addresses of "se". */
+static void sockent_ai_hints (const sockent_t *se, /* {{{ */
+		struct addrinfo *ai_hints)
+{
+	memset (ai_hints, 0, sizeof (*ai_hints));
+	ai_hints->ai_flags  = 0;
+#ifdef AI_PASSIVE
+	ai_hints->ai_flags |= AI_PASSIVE;
+#endif
+#ifdef AI_ADDRCONFIG
+	ai_hints->ai_flags |= AI_ADDRCONFIG;
+#endif
+	ai_hints->ai_family   = AF_UNSPEC;
+	if (se->protocol == NETWORK_PROTOCOL_TCP)
+	{
+		ai_hints->ai_socktype = SOCK_STREAM;
+		ai_hints->ai_protocol = IPPROTO_TCP;
+	}
+	else
+	{
+		ai_hints->ai_socktype = SOCK_DGRAM;
+		ai_hints->ai_protocol = IPPROTO_UDP;
+	}
+} /* }}} void sockent_ai_hints */
+
+/* Open the file descriptors for a initialized sockent structure. */
+static int sockent_open (sockent_t *se) /* {{{ */
+{
+	struct addrinfo  ai_hints;
+	struct addrinfo *ai_list, *ai_ptr;
+	int              ai_return;
+
+        const char *node;
+        const char *service;
+
+	if (se == NULL)
+		return (-1);
+
+	/* Set up the security structures. */
+#if HAVE_LIBGCRYPT /* {{{ */
+	if (se->type == SOCKENT_TYPE_CLIENT)
+	{
+		if (se->data.client.security_level > SECURITY_LEVEL_NONE)
+		{
+			if ((se->data.client.username == NULL)
+					|| (se->data.client.password == NULL))
+			{
+				ERROR ("network plugin: Client socket with "
+						"security requested, but no "
+						"credentials are configured.");
+				return (-1);
+			}
+			gcry_md_hash_buffer (GCRY_MD_SHA256,
+					se->data.client.password_hash,
+					se->data.client.password,
+					strlen (se->data.client.password));
+
+			if ((network_init_aes256_cypher (&se->data.client.cypher,
+							se->data.client.password_hash,
+							sizeof (se->data.client.password_hash)) != 0)
+					|| (network_init_hmac (&se->data.client.hmac,
+							se->data.client.password) != 0))
+				return (-1);
+		}
+	}
+	else /* (se->type == SOCKENT_TYPE_SERVER) */
+	{
+		if (se->data.server.security_level > SECURITY_LEVEL_NONE)
+		{
+			if (se->data.server.auth_file == NULL)
+			{
+				ERROR ("network plugin: Server socket with "
+						"security requested, but no "
+						"password file is configured.");
+				return (-1);
+			}
+		}
+		if (se->data.server.auth_file != NULL)
+		{
+			se->data.server.userdb = fbh_create (se->data.server.auth_file);
+			if (se->data.server.userdb == NULL)
+			{
+				ERROR ("network plugin: Reading password file "
+						"`%s' failed.",
+						se->data.server.auth_file);
+				if (se->data.server.security_level > SECURITY_LEVEL_NONE)
+					return (-1);
+			}
+		}
+	}
+#endif /* }}} HAVE_LIBGCRYPT */
+
+        node = se->node;
+        service = se->service;
+
+        if (service == NULL)
+          service = NET_DEFAULT_PORT;
+
+        DEBUG ("network plugin: sockent_open: node = %s; service = %s;",
+            node, service);
+
+	sockent_ai_hints (se, &ai_hints);
+
+	/* Called while reading the configuration, when blocking is fine. The
+	 * answer is cached for network_tcp_connect(). */
+	ai_return = ures_getaddrinfo (node, service, &ai_hints,
+			/* wait = */ 1, &ai_list);
+	if (ai_return != 0)
+	{
+		ERROR ("network plugin: getaddrinfo (%s, %s) failed: %s",
+				(se->node == NULL) ? "(null)" : se->node,
+				(se->service == NULL) ? "(null)" : se->service,
+				gai_strerror (ai_return));
+		return (-1);
+	}
+
+	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+	{
+		int status;
+
+		if (se->type == SOCKENT_TYPE_SERVER) /* {{{ */
+		{
+			int threads = se->data.server.receive_threads;
+			int j;
+
+			/* All TCP sockets are polled by the TCP thread. */
+			if (se->protocol == NETWORK_PROTOCOL_TCP)
+				threads = 1;
+
+			/* One socket per receive thread. sockent_add() hands
+			 * out the sockets to the threads round-robin. */
+			for (j = 0; j < threads; j++)
+			{
+				int *tmp;
+
+				tmp = realloc (se->data.server.fd, sizeof (*tmp)
+						* (se->data.server.fd_num + 1));
+				if (tmp == NULL)
+				{
+					ERROR ("network plugin: realloc failed.");
+					break;
+				}
+				se->data.server.fd = tmp;
+				tmp = se->data.server.fd + se->data.server.fd_num;
+
+				/* Sockets handed over by the previous process
+				 * are bound and set up already. */
+				*tmp = plugin_handoff_take (ai_ptr->ai_socktype,
+						ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+				if (*tmp >= 0)
+				{
+					plugin_handoff_add (*tmp);
+					se->data.server.fd_num++;
+					continue;
+				}
+
+				*tmp = socket (ai_ptr->ai_family,
+						ai_ptr->ai_socktype,
+						ai_ptr->ai_protocol);
+				if (*tmp < 0)
+				{
+					char errbuf[1024];
+					ERROR ("network plugin: socket(2) failed: %s",
+							sstrerror (errno, errbuf,
+								sizeof (errbuf)));
+					break;
+				}
+
+				status = network_bind_socket (*tmp, ai_ptr,
+						se->interface,
+						/* reuse_port = */ (threads > 1));
+				if ((status == 0)
+						&& (se->protocol == NETWORK_PROTOCOL_TCP))
+					status = network_listen_socket (*tmp);
+				if (status != 0)
+				{
+					close (*tmp);
+					*tmp = -1;
+					break;
+				}
+
+				plugin_handoff_add (*tmp);
+				se->data.server.fd_num++;
+			}
+			continue;
+		} /* }}} if (se->type == SOCKENT_TYPE_SERVER) */
+		else if (se->protocol == NETWORK_PROTOCOL_TCP) /* {{{ */
+		{
+			/* The send thread connects, see
+			 * network_tcp_connect(). Only the first address is
+			 * used, like with UDP. */
+			se->data.client.addr = calloc (1,
+					sizeof (*se->data.client.addr));
+			if (se->data.client.addr == NULL)
+			{
+				ERROR ("network plugin: calloc failed.");
+				continue;
+			}
+
+			assert (sizeof (*se->data.client.addr) >= ai_ptr->ai_addrlen);
+			memcpy (se->data.client.addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+			se->data.client.addrlen = ai_ptr->ai_addrlen;
+			break;
+		} /* }}} if (se->protocol == NETWORK_PROTOCOL_TCP) */
+		else /* if (se->type == SOCKENT_TYPE_CLIENT) {{{ */
+		{
+			se->data.client.fd = socket (ai_ptr->ai_family,
+					ai_ptr->ai_socktype,
+					ai_ptr->ai_protocol);
+			if (se->data.client.fd < 0)
+			{
+				char errbuf[1024];
+				ERROR ("network plugin: socket(2) failed: %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				continue;
+			}
+
+			se->data.client.addr = malloc (sizeof (*se->data.client.addr));
+			if (se->data.client.addr == NULL)
+			{
+				ERROR ("network plugin: malloc failed.");
+				close (se->data.client.fd);
+				se->data.client.fd = -1;
+				continue;
+			}
+
+			memset (se->data.client.addr, 0, sizeof (*se->data.client.addr));
+			assert (sizeof (*se->data.client.addr) >= ai_ptr->ai_addrlen);
+			memcpy (se->data.client.addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+			se->data.client.addrlen = ai_ptr->ai_addrlen;
+
+			network_set_ttl (se, ai_ptr);
+			network_set_interface (se, ai_ptr);
+
+			/* We don't open more than one write-socket per
+			 * node/service pair.. */
+			break;
+		} /* }}} if (se->type == SOCKENT_TYPE_CLIENT) */
+	} /* for (ai_list) */
+
+	ures_freeaddrinfo (ai_list);
+
+	/* Check if all went well. */
+	if (se->type == SOCKENT_TYPE_SERVER)
+	{
+		if (se->data.server.fd_num <= 0)
+			return (-1);
+	}
+	else if (se->protocol == NETWORK_PROTOCOL_TCP)
+	{
+		if (se->data.client.addr == NULL)
+			return (-1);
+	}
+	else /* if (se->type == SOCKENT_TYPE_CLIENT) */
+	{
+		if (se->data.client.fd < 0)
+			return (-1);
+	}
+
+	return (0);
+} /* }}} int sockent_open */
+
+/* Add a sockent to the global list of sockets */
+static int sockent_add (sockent_t *se) /* {{{ */
+{
+	sockent_t *last_ptr;
+
+	if (se == NULL)
+		return (-1);
+
+	if ((se->type == SOCKENT_TYPE_SERVER)
+			&& (se->protocol == NETWORK_PROTOCOL_TCP))
+	{
+		/* Polled by the TCP thread, see network_tcp_receive(). */
+		tcp_listen_sockets_num += se->data.server.fd_num;
+
+		if (listen_sockets == NULL)
+		{
+			listen_sockets = se;
+			return (0);
+		}
+		last_ptr = listen_sockets;
+	}
+	else if (se->type == SOCKENT_TYPE_SERVER)
+	{
+		size_t threads = (size_t) se->data.server.receive_threads;
+		size_t i;
+
+		if (receive_threads_num < threads)
+		{
+			receive_thread_t *tmp;
+
+			tmp = realloc (receive_threads, sizeof (*tmp) * threads);
+			if (tmp == NULL)
+			{
+				ERROR ("network plugin: realloc failed.");
+				return (-1);
+			}
+			receive_threads = tmp;
+			memset (receive_threads + receive_threads_num, 0,
+					sizeof (*tmp) * (threads - receive_threads_num));
+			receive_threads_num = threads;
+		}
+
+		/* Make room in all threads first, so that either all or none of
+		 * the sockets are polled. */
+		for (i = 0; (i < threads) && (i < se->data.server.fd_num); i++)
+		{
+			receive_thread_t *rt = receive_threads + i;
+			size_t num = (se->data.server.fd_num - i + threads - 1)
+				/ threads;
+			struct pollfd *tmp;
+
+			tmp = realloc (rt->pollfd,
+					sizeof (*tmp) * (rt->pollfd_num + num));
+			if (tmp == NULL)
+			{
+				ERROR ("network plugin: realloc failed.");
+				return (-1);
+			}
+			rt->pollfd = tmp;
+		}
+
+		for (i = 0; i < se->data.server.fd_num; i++)
+		{
+			size_t fd = (size_t) se->data.server.fd[i];
+
+			if (fd >= listen_sockets_by_fd_num)
+			{
+				sockent_t **tmp;
+
+				tmp = realloc (listen_sockets_by_fd,
+						sizeof (*tmp) * (fd + 1));
+				if (tmp == NULL)
+				{
+					ERROR ("network plugin: realloc failed.");
+					return (-1);
+				}
+				memset (tmp + listen_sockets_by_fd_num, 0,
+						sizeof (*tmp) * (fd + 1
+							- listen_sockets_by_fd_num));
+				listen_sockets_by_fd = tmp;
+				listen_sockets_by_fd_num = fd + 1;
+			}
+		}
+
+		/* Nothing can fail from here on. */
+		for (i = 0; i < se->data.server.fd_num; i++)
+		{
+			receive_thread_t *rt = receive_threads + (i % threads);
+			struct pollfd *tmp = rt->pollfd + rt->pollfd_num;
+
+			memset (tmp, 0, sizeof (*tmp));
+			tmp->fd = se->data.server.fd[i];
+			tmp->events = POLLIN | POLLPRI;
+			tmp->revents = 0;
+			rt->pollfd_num++;
+		}
+
+		for (i = 0; i < se->data.server.fd_num; i++)
+			listen_sockets_by_fd[se->data.server.fd[i]] = se;
+
+		listen_sockets_num += se->data.server.fd_num;
+
+		if (listen_sockets == NULL)
+		{
+			listen_sockets = se;
+			return (0);
+		}
+		last_ptr = listen_sockets;
+	}
+	else /* if (se->type == SOCKENT_TYPE_CLIENT) */
+	{
+		if (sending_sockets == NULL)
+		{
+			sending_sockets = se;
+			return (0);
+		}
+		last_ptr = sending_sockets;
+	}
+
+	while (last_ptr->next != NULL)
+		last_ptr = last_ptr->next;
+	last_ptr->next = se;
+
+	return (0);
+} /* }}} int sockent_add */
+
+/* Allocates the packet buffers of "rt" and the rings connecting it to the
+ * dispatch threads. Every ring can hold the whole pool, so pushing to one
+ * never fails. */
+static int receive_pool_create (receive_thread_t *rt) /* {{{ */
+{
+  size_t pool_size = (size_t) network_config_receive_buffers;
+  size_t entry_size;
+  size_t i;
+
+  /* Keep the entries aligned. */
+  entry_size = sizeof (receive_list_entry_t) + network_config_packet_size;
+  entry_size = (entry_size + 7) & ~((size_t) 7);
+
+  rt->pool = calloc (pool_size, entry_size);
+  rt->free_entries = calloc (pool_size, sizeof (*rt->free_entries));
+  rt->queued = calloc (dispatch_threads_num, sizeof (*rt->queued));
+  rt->returned = calloc (dispatch_threads_num, sizeof (*rt->returned));
+  if ((rt->pool == NULL) || (rt->free_entries == NULL)
+      || (rt->queued == NULL) || (rt->returned == NULL))
+  {
+    ERROR ("network plugin: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < dispatch_threads_num; i++)
+  {
+    rt->queued[i] = c_spsc_create (pool_size);
+    rt->returned[i] = c_spsc_create (pool_size);
+    if ((rt->queued[i] == NULL) || (rt->returned[i] == NULL))
+    {
+      ERROR ("network plugin: c_spsc_create failed.");
+      return (-1);
+    }
+  }
+
+  for (i = 0; i < pool_size; i++)
+  {
+    receive_list_entry_t *ent;
+
+    ent = (receive_list_entry_t *) (rt->pool + (i * entry_size));
+    ent->data = (char *) (ent + 1);
+    ent->owner = rt;
+    rt->free_entries[i] = ent;
+  }
+  rt->free_entries_num = pool_size;
+
+  if (receive_memory == NULL)
+    receive_memory = plugin_memory_counter ("network-receive");
+  rt->pool_size = pool_size * entry_size;
+  plugin_memory_add (receive_memory, (int64_t) rt->pool_size);
 
   return (0);
-} /* }}} int parse_part_encr_aes256 */
-#endif /* !HAVE_LIBGCRYPT */
+} /* }}} int receive_pool_create */
 
-#undef BUFFER_READ
+/* Must only be called when neither the receive thread nor any dispatch
+ * thread is running. */
+static void receive_pool_destroy (receive_thread_t *rt) /* {{{ */
+{
+  size_t i;
 
-static int parse_packet (sockent_t *se, /* {{{ */
-		void *buffer, size_t buffer_size, int flags,
-		const char *username)
+  for (i = 0; i < dispatch_threads_num; i++)
+  {
+    if (rt->queued != NULL)
+      c_spsc_destroy (rt->queued[i]);
+    if (rt->returned != NULL)
+      c_spsc_destroy (rt->returned[i]);
+  }
+  sfree (rt->queued);
+  sfree (rt->returned);
+  sfree (rt->free_entries);
+  rt->free_entries_num = 0;
+  sfree (rt->pool);
+  plugin_memory_add (receive_memory, -((int64_t) rt->pool_size));
+  rt->pool_size = 0;
+} /* }}} void receive_pool_destroy */
+
+/* Returns a free entry of "rt" or NULL if all of them are in use. */
+static receive_list_entry_t *receive_pool_get (receive_thread_t *rt) /* {{{ */
+{
+  receive_list_entry_t *ent;
+
+  if (rt->free_entries_num == 0)
+  {
+    size_t i;
+
+    for (i = 0; i < dispatch_threads_num; i++)
+      while ((ent = c_spsc_pop (rt->returned[i])) != NULL)
+        rt->free_entries[rt->free_entries_num++] = ent;
+
+    if (rt->free_entries_num == 0)
+      return (NULL);
+  }
+
+  rt->free_entries_num--;
+  ent = rt->free_entries[rt->free_entries_num];
+  ent->data_len = 0;
+  ent->fd = -1;
+
+  return (ent);
+} /* }}} receive_list_entry_t *receive_pool_get */
+
+/* Takes the next packet queued for "dt", looking at the receive threads in
+ * turn, starting after the one "last" points to. */
+static receive_list_entry_t *dispatch_next (dispatch_thread_t *dt, /* {{{ */
+    size_t *last)
+{
+  size_t i;
+
+  for (i = 1; i <= receive_threads_num; i++)
+  {
+    size_t index = (*last + i) % receive_threads_num;
+    receive_thread_t *rt = receive_threads + index;
+    receive_list_entry_t *ent;
+
+    if (rt->queued == NULL)
+      continue;
+
+    ent = c_spsc_pop (rt->queued[dt->index]);
+    if (ent != NULL)
+    {
+      *last = index;
+      return (ent);
+    }
+  }
+
+  return (NULL);
+} /* }}} receive_list_entry_t *dispatch_next */
+
+static void *dispatch_thread (void *arg) /* {{{ */
+{
+  dispatch_thread_t *dt = arg;
+  size_t last = 0;
+
+  while (42)
+  {
+    receive_list_entry_t *ent;
+    sockent_t *se;
+
+    ent = dispatch_next (dt, &last);
+    if (ent == NULL)
+    {
+      /* Announce that we're going to sleep and look again, so a packet
+       * queued in between is not missed. See network_receive_wakeup(). */
+      c_mutex_lock (&dt->lock);
+      dt->waiting = 1;
+      __sync_synchronize ();
+      while (((ent = dispatch_next (dt, &last)) == NULL)
+          && (dispatch_loop == 0))
+        c_cond_wait (&dt->cond, &dt->lock);
+      dt->waiting = 0;
+      c_mutex_unlock (&dt->lock);
+    }
+
+    /* Check whether we are supposed to exit. We do NOT check
+     * `dispatch_loop' first because we dispatch all missing packets before
+     * shutting down. */
+    if (ent == NULL)
+      break;
+
+    /* Look up the correct `sockent_t' */
+    se = NULL;
+    if ((ent->fd >= 0) && (((size_t) ent->fd) < listen_sockets_by_fd_num))
+      se = listen_sockets_by_fd[ent->fd];
+
+    if (se == NULL)
+    {
+      ERROR ("network plugin: Got packet from FD %i, but can't "
+          "find an appropriate socket entry.",
+          ent->fd);
+    }
+    else if (source_tables != NULL)
+    {
+      uint64_t values = network_parse_count ();
+      int status;
+
+      status = parse_packet (se, ent->data, ent->data_len, /* flags = */ 0,
+          /* username = */ NULL);
+      network_source_account (source_tables + dt->index, ent->source,
+          (size_t) ent->data_len, network_parse_count () - values,
+          /* error = */ (status != 0));
+    }
+    else
+    {
+      parse_packet (se, ent->data, ent->data_len, /* flags = */ 0,
+          /* username = */ NULL);
+    }
+
+    if (NETWORK_LIMITS_ENABLED)
+    {
+      (void) __sync_sub_and_fetch (&queued_packets, 1);
+      (void) __sync_sub_and_fetch (&queued_bytes, (uint64_t) ent->data_len);
+    }
+
+    /* The ring holds the owner's whole pool, so this can't fail. */
+    c_spsc_push (ent->owner->returned[dt->index], ent);
+  } /* while (42) */
+
+  return (NULL);
+} /* }}} void *dispatch_thread */
+
+/* Selects the dispatch thread for packets from "addr". All packets from one
+ * host go to the same thread, so they are dispatched in order. */
+static size_t network_dispatch_index (const struct sockaddr_storage *addr, /* {{{ */
+		socklen_t addr_len)
+{
+	const unsigned char *bytes;
+	size_t bytes_num = 0;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	if (dispatch_threads_num < 2)
+		return (0);
+
+	bytes = network_addr_bytes (addr, addr_len, &bytes_num);
+
+	/* FNV-1a */
+	for (i = 0; i < bytes_num; i++)
+	{
+		hash ^= (uint32_t) bytes[i];
+		hash *= 16777619U;
+	}
+
+	return (((size_t) hash) % dispatch_threads_num);
+} /* }}} size_t network_dispatch_index */
+
+/* Reads up to "num" packets from "fd" into "ents", which must all be
+ * allocated, and their source addresses into "addrs". Returns the number of
+ * packets read, zero if there were none and less than zero on error. */
+static int network_receive_packets (int fd, /* {{{ */
+		receive_list_entry_t **ents, struct sockaddr_storage *addrs,
+		socklen_t *addrs_len, size_t num)
 {
 	int status;
 
-	value_list_t vl = VALUE_LIST_INIT;
-	notification_t n;
+#if HAVE_RECVMMSG
+	if (num > 1)
+	{
+		struct mmsghdr msgs[num];
+		struct iovec iovs[num];
+		size_t i;
 
-#if HAVE_LIBGCRYPT
-	int packet_was_signed = (flags & PP_SIGNED);
-        int packet_was_encrypted = (flags & PP_ENCRYPTED);
-	int printed_ignore_warning = 0;
-#endif /* HAVE_LIBGCRYPT */
+		memset (msgs, 0, sizeof (msgs));
+		for (i = 0; i < num; i++)
+		{
+			iovs[i].iov_base = ents[i]->data;
+			iovs[i].iov_len = network_config_packet_size;
+			msgs[i].msg_hdr.msg_name = addrs + i;
+			msgs[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+			msgs[i].msg_hdr.msg_iov = iovs + i;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
+		/* poll(2) said there is at least one packet, so only the
+		 * rest must not block. */
+		status = recvmmsg (fd, msgs, (unsigned int) num,
+				MSG_DONTWAIT, /* timeout = */ NULL);
+		if (status > 0)
+		{
+			for (i = 0; i < ((size_t) status); i++)
+			{
+				ents[i]->data_len = (int) msgs[i].msg_len;
+				addrs_len[i] = msgs[i].msg_hdr.msg_namelen;
+			}
+			return (status);
+		}
+	}
+	else
+#endif /* HAVE_RECVMMSG */
+	{
+		addrs_len[0] = sizeof (addrs[0]);
+		status = recvfrom (fd, ents[0]->data, network_config_packet_size,
+				MSG_DONTWAIT, (struct sockaddr *) addrs, addrs_len);
+		if (status >= 0)
+		{
+			ents[0]->data_len = status;
+			return (1);
+		}
+	}
 
-	memset (&vl, '\0', sizeof (vl));
-	memset (&n, '\0', sizeof (n));
-	status = 0;
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+		return (0);
+	return (-1);
+} /* }}} int network_receive_packets */
 
-	while ((status == 0) && (0 < buffer_size)
-			&& ((unsigned int) buffer_size > sizeof (part_header_t)))
+/* Wakes up dispatch thread "index" if it's waiting for packets. Called by the
+ * receive threads after queueing packets. */
+static void network_receive_wakeup (size_t index) /* {{{ */
+{
+	dispatch_thread_t *dt = dispatch_threads + index;
+
+	/* Pairs with the barrier in dispatch_thread(): either we see
+	 * "waiting" or the dispatch thread sees the new packets. */
+	__sync_synchronize ();
+	if (!dt->waiting)
+		return;
+
+	c_mutex_lock (&dt->lock);
+	pthread_cond_signal (&dt->cond);
+	c_mutex_unlock (&dt->lock);
+} /* }}} void network_receive_wakeup */
+
+/* Reads and discards one packet from "fd". Used when all buffers are in
+ * use, so the socket doesn't stay readable forever. */
+static int network_receive_drop (receive_thread_t *rt, int fd) /* {{{ */
+{
+	char buffer[network_config_packet_size];
+	ssize_t status;
+
+	status = recv (fd, buffer, sizeof (buffer), MSG_DONTWAIT);
+	if (status >= 0)
 	{
-		uint16_t pkg_length;
-		uint16_t pkg_type;
+		rt->dropped++;
+		return (0);
+	}
 
-		memcpy ((void *) &pkg_type,
-				(void *) buffer,
-				sizeof (pkg_type));
-		memcpy ((void *) &pkg_length,
-				(void *) (buffer + sizeof (pkg_type)),
-				sizeof (pkg_length));
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+		return (0);
+	return (-1);
+} /* }}} int network_receive_drop */
 
-		pkg_length = ntohs (pkg_length);
-		pkg_type = ntohs (pkg_type);
+static int network_receive (receive_thread_t *rt) /* {{{ */
+{
+	size_t batch_size = (size_t) network_config_batch_size;
+	receive_list_entry_t *ents[batch_size];
+	struct sockaddr_storage addrs[batch_size];
+	socklen_t addrs_len[batch_size];
+	size_t ents_num = 0;
+	_Bool queued[dispatch_threads_num];
 
-		if (pkg_length > buffer_size)
+	size_t i;
+	int status = 0;
+
+        assert (rt->pollfd_num > 0);
+
+	while (listen_loop == 0)
+	{
+		status = poll (rt->pollfd, rt->pollfd_num, -1);
+
+		if (status <= 0)
+		{
+			char errbuf[1024];
+			if (errno == EINTR)
+				continue;
+			ERROR ("poll failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			status = -1;
 			break;
-		/* Ensure that this loop terminates eventually */
-		if (pkg_length < (2 * sizeof (uint16_t)))
+		}
+
+		memset (queued, 0, sizeof (queued));
+
+		for (i = 0; (i < rt->pollfd_num) && (status > 0); i++)
+		{
+			int fd = rt->pollfd[i].fd;
+			int priority = PRIORITY_NORMAL;
+			int packets_num;
+			size_t j;
+
+			if ((rt->pollfd[i].revents
+						& (POLLIN | POLLPRI)) == 0)
+				continue;
+			status--;
+
+			if ((((size_t) fd) < listen_sockets_by_fd_num)
+					&& (listen_sockets_by_fd[fd] != NULL))
+				priority = listen_sockets_by_fd[fd]->data.server.priority;
+
+			/* Entries left unused by a call are kept for the
+			 * next one. */
+			while (ents_num < batch_size)
+			{
+				ents[ents_num] = receive_pool_get (rt);
+				if (ents[ents_num] == NULL)
+					break;
+				ents_num++;
+			}
+
+			if (ents_num == 0)
+				packets_num = network_receive_drop (rt, fd);
+			else
+				packets_num = network_receive_packets (fd,
+						ents, addrs, addrs_len,
+						ents_num);
+			if (packets_num < 0)
+			{
+				char errbuf[1024];
+				ERROR ("recv failed: %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+				status = -1;
+				break;
+			}
+			else if (packets_num == 0)
+				continue;
+
+			rt->calls++;
+			if (rt->batch_peak < ((uint64_t) packets_num))
+				rt->batch_peak = (uint64_t) packets_num;
+
+			for (j = 0; j < ((size_t) packets_num); j++)
+			{
+				receive_list_entry_t *ent = ents[j];
+				size_t index = network_dispatch_index (addrs + j,
+						addrs_len[j]);
+				size_t length;
+
+				ent->fd = fd;
+				if (source_tables != NULL)
+					network_source_key (ent->source,
+							addrs + j, addrs_len[j]);
+
+				rt->octets += ((uint64_t) ent->data_len);
+				rt->packets++;
+
+				if (NETWORK_LIMITS_ENABLED)
+				{
+					if (network_shed (priority))
+					{
+						rt->shed[priority]++;
+						rt->free_entries[rt->free_entries_num++] = ent;
+						continue;
+					}
+					(void) __sync_add_and_fetch (&queued_packets, 1);
+					(void) __sync_add_and_fetch (&queued_bytes,
+							(uint64_t) ent->data_len);
+				}
+
+				/* The ring holds the whole pool, so this
+				 * can't fail. */
+				c_spsc_push (rt->queued[index], ent);
+				queued[index] = 1;
+
+				length = c_spsc_length (rt->queued[index]);
+				if (rt->queue_peak < ((uint64_t) length))
+					rt->queue_peak = (uint64_t) length;
+			}
+
+			/* Move the unused entries to the front. */
+			for (j = 0; (j + packets_num) < ents_num; j++)
+				ents[j] = ents[j + packets_num];
+			ents_num -= (size_t) packets_num;
+		} /* for (rt->pollfd) */
+
+		for (i = 0; i < dispatch_threads_num; i++)
+			if (queued[i])
+				network_receive_wakeup (i);
+
+		if (status < 0)
 			break;
+	} /* while (listen_loop == 0) */
 
-		if (pkg_type == TYPE_ENCR_AES256)
+	/* The entries in "ents" are freed with the pool. Everything queued
+	 * is dispatched before the dispatch threads exit. */
+	return ((status < 0) ? -1 : 0);
+} /* }}} int network_receive */
+
+static void *receive_thread (void *arg)
+{
+	return (network_receive (arg) ? (void *) 1 : (void *) 0);
+} /* void *receive_thread */
+
+/* Parses one frame received on "conn". "scratch" has room for TCP_FRAME_MAX
+ * bytes, it takes the decompressed payload. */
+static int network_tcp_frame (tcp_connection_t *conn, /* {{{ */
+		uint32_t header, char *payload, size_t payload_size,
+		char *scratch)
+{
+	stats_frames_rx_tcp++;
+
+	if ((header & ~((uint32_t) FRAME_SIZE_MASK)) == 0)
+		return (parse_packet (conn->se, payload, payload_size,
+					/* flags = */ 0, /* username = */ NULL));
+
+#if HAVE_LIBZ
+	if ((header & ~((uint32_t) FRAME_SIZE_MASK)) == FRAME_FLAG_ZLIB)
+	{
+		uLongf scratch_size = TCP_FRAME_MAX;
+		int status;
+
+		status = uncompress ((Bytef *) scratch, &scratch_size,
+				(Bytef *) payload, (uLong) payload_size);
+		if (status != Z_OK)
 		{
-			status = parse_part_encr_aes256 (se,
-					&buffer, &buffer_size, flags);
-			if (status != 0)
+			WARNING ("network plugin: Decompressing a frame "
+					"failed with status %i.", status);
+			return (-1);
+		}
+
+		return (parse_packet (conn->se, scratch, (size_t) scratch_size,
+					/* flags = */ 0, /* username = */ NULL));
+	}
+#endif
+
+	WARNING ("network plugin: Received a frame with unsupported "
+			"flags 0x%02x.", (unsigned int) (header >> 24));
+	return (-1);
+} /* }}} int network_tcp_frame */
+
+/* Reads what is available on "conn" and parses the frames now complete.
+ * Returns less than zero if the connection should be closed. */
+static int network_tcp_read (tcp_connection_t *conn, /* {{{ */
+		char *scratch)
+{
+	while (42)
+	{
+		size_t offset = 0;
+		ssize_t status;
+
+		if (conn->fill >= conn->size)
+		{
+			size_t new_size = (conn->size == 0)
+				? 65536 : (2 * conn->size);
+			char *tmp;
+
+			if (new_size > (FRAME_HEADER_SIZE + TCP_FRAME_MAX))
+				new_size = FRAME_HEADER_SIZE + TCP_FRAME_MAX;
+
+			tmp = realloc (conn->buffer, new_size);
+			if (tmp == NULL)
 			{
-				ERROR ("network plugin: Decrypting AES256 "
-						"part failed "
-						"with status %i.", status);
-				break;
+				ERROR ("network plugin: realloc failed.");
+				return (-1);
 			}
+			conn->buffer = tmp;
+			conn->size = new_size;
 		}
-#if HAVE_LIBGCRYPT
-		else if ((se->data.server.security_level == SECURITY_LEVEL_ENCRYPT)
-				&& (packet_was_encrypted == 0))
+
+		status = recv (conn->fd, conn->buffer + conn->fill,
+				conn->size - conn->fill, MSG_DONTWAIT);
+		if (status == 0)
+			return (-1);
+		else if (status < 0)
 		{
-			if (printed_ignore_warning == 0)
-			{
-				INFO ("network plugin: Unencrypted packet or "
-						"part has been ignored.");
-				printed_ignore_warning = 1;
-			}
-			buffer = ((char *) buffer) + pkg_length;
-			continue;
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return (0);
+
+			WARNING ("network plugin: recv(2) failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return (-1);
 		}
-#endif /* HAVE_LIBGCRYPT */
-		else if (pkg_type == TYPE_SIGN_SHA256)
+
+		conn->fill += (size_t) status;
+		stats_octets_rx_tcp += (derive_t) status;
+
+		while ((conn->fill - offset) >= FRAME_HEADER_SIZE)
 		{
-			status = parse_part_sign_sha256 (se,
-                                        &buffer, &buffer_size, flags);
-			if (status != 0)
+			uint32_t header;
+			size_t payload_size;
+
+			memcpy (&header, conn->buffer + offset, sizeof (header));
+			header = ntohl (header);
+			payload_size = (size_t) (header & FRAME_SIZE_MASK);
+
+			if (payload_size > TCP_FRAME_MAX)
 			{
-				ERROR ("network plugin: Verifying HMAC-SHA-256 "
-						"signature failed "
-						"with status %i.", status);
-				break;
+				WARNING ("network plugin: Received a frame of "
+						"%zu bytes, the limit is %i. "
+						"Closing the connection.",
+						payload_size, TCP_FRAME_MAX);
+				return (-1);
 			}
-		}
-#if HAVE_LIBGCRYPT
-		else if ((se->data.server.security_level == SECURITY_LEVEL_SIGN)
-				&& (packet_was_encrypted == 0)
-				&& (packet_was_signed == 0))
-		{
-			if (printed_ignore_warning == 0)
+
+			if ((conn->fill - offset)
+					< (FRAME_HEADER_SIZE + payload_size))
+				break;
+
+			/* Ignore frames which can't be parsed, the next one
+			 * starts right after them anyway. */
+			if (source_tables != NULL)
 			{
-				INFO ("network plugin: Unsigned packet or "
-						"part has been ignored.");
-				printed_ignore_warning = 1;
+				uint64_t values = network_parse_count ();
+				int frame_status;
+
+				frame_status = network_tcp_frame (conn, header,
+						conn->buffer + offset + FRAME_HEADER_SIZE,
+						payload_size, scratch);
+				network_source_account (source_tables
+						+ (source_tables_num - 1),
+						conn->source,
+						FRAME_HEADER_SIZE + payload_size,
+						network_parse_count () - values,
+						/* error = */ (frame_status != 0));
 			}
-			buffer = ((char *) buffer) + pkg_length;
-			continue;
+			else
+				network_tcp_frame (conn, header,
+						conn->buffer + offset + FRAME_HEADER_SIZE,
+						payload_size, scratch);
+			offset += FRAME_HEADER_SIZE + payload_size;
 		}
-#endif /* HAVE_LIBGCRYPT */
-		else if (pkg_type == TYPE_VALUES)
+
+		if (offset > 0)
 		{
-			status = parse_part_values (&buffer, &buffer_size,
-					&vl.values, &vl.values_len);
-			if (status != 0)
-				break;
+			memmove (conn->buffer, conn->buffer + offset,
+					conn->fill - offset);
+			conn->fill -= offset;
+		}
+	} /* while (42) */
+} /* }}} int network_tcp_read */
 
-			network_dispatch_values (&vl, username);
+static void network_tcp_accept (int fd, sockent_t *se, /* {{{ */
+		tcp_connection_t *conns, size_t *conns_num)
+{
+	while (42)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof (addr);
+		int conn_fd;
 
-			sfree (vl.values);
-		}
-		else if (pkg_type == TYPE_TIME)
+		conn_fd = accept (fd, (struct sockaddr *) &addr, &addr_len);
+		if (conn_fd < 0)
 		{
-			uint64_t tmp = 0;
-			status = parse_part_number (&buffer, &buffer_size,
-					&tmp);
-			if (status == 0)
-			{
-				vl.time = TIME_T_TO_CDTIME_T (tmp);
-				n.time  = TIME_T_TO_CDTIME_T (tmp);
-			}
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				WARNING ("network plugin: accept(2) failed: %s",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+			return;
 		}
-		else if (pkg_type == TYPE_TIME_HR)
+
+		if (*conns_num >= TCP_CONNECTIONS_MAX)
 		{
-			uint64_t tmp = 0;
-			status = parse_part_number (&buffer, &buffer_size,
-					&tmp);
-			if (status == 0)
-			{
-				vl.time = (cdtime_t) tmp;
-				n.time  = (cdtime_t) tmp;
-			}
+			WARNING ("network plugin: Too many TCP connections, "
+					"closing the new one.");
+			close (conn_fd);
+			continue;
 		}
-		else if (pkg_type == TYPE_INTERVAL)
+
+		memset (conns + *conns_num, 0, sizeof (*conns));
+		conns[*conns_num].fd = conn_fd;
+		conns[*conns_num].se = se;
+		network_source_key (conns[*conns_num].source, &addr, addr_len);
+		(*conns_num)++;
+	}
+} /* }}} void network_tcp_accept */
+
+static int network_tcp_receive (void) /* {{{ */
+{
+	struct pollfd pollfd[tcp_listen_sockets_num + TCP_CONNECTIONS_MAX];
+	sockent_t *listen_se[tcp_listen_sockets_num];
+	size_t listen_num = 0;
+	tcp_connection_t *conns;
+	size_t conns_num = 0;
+	char *scratch;
+	sockent_t *se;
+	size_t i;
+	int status = 0;
+
+	conns = calloc (TCP_CONNECTIONS_MAX, sizeof (*conns));
+	scratch = malloc (TCP_FRAME_MAX);
+	if ((conns == NULL) || (scratch == NULL))
+	{
+		ERROR ("network plugin: network_tcp_receive: malloc failed.");
+		sfree (conns);
+		sfree (scratch);
+		return (-1);
+	}
+
+	for (se = listen_sockets; se != NULL; se = se->next)
+	{
+		if (se->protocol != NETWORK_PROTOCOL_TCP)
+			continue;
+
+		for (i = 0; i < se->data.server.fd_num; i++)
 		{
-			uint64_t tmp = 0;
-			status = parse_part_number (&buffer, &buffer_size,
-					&tmp);
-			if (status == 0)
-				vl.interval = TIME_T_TO_CDTIME_T (tmp);
+			memset (pollfd + listen_num, 0, sizeof (*pollfd));
+			pollfd[listen_num].fd = se->data.server.fd[i];
+			pollfd[listen_num].events = POLLIN;
+			listen_se[listen_num] = se;
+			listen_num++;
 		}
-		else if (pkg_type == TYPE_INTERVAL_HR)
+	}
+	assert (listen_num == tcp_listen_sockets_num);
+
+	while (listen_loop == 0)
+	{
+		for (i = 0; i < conns_num; i++)
 		{
-			uint64_t tmp = 0;
-			status = parse_part_number (&buffer, &buffer_size,
-					&tmp);
-			if (status == 0)
-				vl.interval = (cdtime_t) tmp;
+			memset (pollfd + listen_num + i, 0, sizeof (*pollfd));
+			pollfd[listen_num + i].fd = conns[i].fd;
+			pollfd[listen_num + i].events = POLLIN;
 		}
-		else if (pkg_type == TYPE_HOST)
+
+		status = poll (pollfd, listen_num + conns_num, -1);
+		if (status <= 0)
 		{
-			status = parse_part_string (&buffer, &buffer_size,
-					vl.host, sizeof (vl.host));
-			if (status == 0)
-				sstrncpy (n.host, vl.host, sizeof (n.host));
+			char errbuf[1024];
+			if (errno == EINTR)
+				continue;
+			ERROR ("poll failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			status = -1;
+			break;
 		}
-		else if (pkg_type == TYPE_PLUGIN)
+		status = 0;
+
+		/* Read the existing connections first, "conns" is changed
+		 * below. Closed connections are replaced by the last one. */
+		for (i = conns_num; i > 0; i--)
 		{
-			status = parse_part_string (&buffer, &buffer_size,
-					vl.plugin, sizeof (vl.plugin));
-			if (status == 0)
-				sstrncpy (n.plugin, vl.plugin,
-						sizeof (n.plugin));
+			tcp_connection_t *conn = conns + (i - 1);
+
+			if (pollfd[listen_num + i - 1].revents == 0)
+				continue;
+
+			if (network_tcp_read (conn, scratch) == 0)
+				continue;
+
+			close (conn->fd);
+			sfree (conn->buffer);
+			conns_num--;
+			if (conn != (conns + conns_num))
+				memcpy (conn, conns + conns_num, sizeof (*conn));
 		}
-		else if (pkg_type == TYPE_PLUGIN_INSTANCE)
+
+		for (i = 0; i < listen_num; i++)
+			if (pollfd[i].revents != 0)
+				network_tcp_accept (pollfd[i].fd, listen_se[i],
+						conns, &conns_num);
+	} /* while (listen_loop == 0) */
+
+	for (i = 0; i < conns_num; i++)
+	{
+		close (conns[i].fd);
+		sfree (conns[i].buffer);
+	}
+	sfree (conns);
+	sfree (scratch);
+
+	return (status);
+} /* }}} int network_tcp_receive */
+
+static void *tcp_thread (void __attribute__((unused)) *arg)
+{
+	return (network_tcp_receive () ? (void *) 1 : (void *) 0);
+} /* void *tcp_thread */
+
+static _Bool sockent_same_security (const sockent_t *a, /* {{{ */
+    const sockent_t *b)
+{
+#if HAVE_LIBGCRYPT
+  if (a->data.client.security_level != b->data.client.security_level)
+    return (0);
+  if (a->data.client.security_level == SECURITY_LEVEL_NONE)
+    return (1);
+
+  if ((a->data.client.username == NULL) || (b->data.client.username == NULL)
+      || (a->data.client.password == NULL)
+      || (b->data.client.password == NULL))
+    return (0);
+
+  return ((strcmp (a->data.client.username, b->data.client.username) == 0)
+      && (strcmp (a->data.client.password, b->data.client.password) == 0));
+#else
+  return (1);
+#endif
+} /* }}} _Bool sockent_same_security */
+
+/* Sets the "encoder" of all sending sockets, see "struct sockent_client". */
+static void network_init_encoders (void) /* {{{ */
+{
+  sockent_t *se;
+
+  for (se = sending_sockets; se != NULL; se = se->next)
+  {
+    sockent_t *other;
+
+    se->data.client.encoder = se;
+    for (other = sending_sockets; other != se; other = other->next)
+    {
+      if (sockent_same_security (other, se))
+      {
+        se->data.client.encoder = other;
+        break;
+      }
+    }
+  }
+} /* }}} void network_init_encoders */
+
+static void network_init_buffer (send_buffer_t *sb)
+{
+	memset (sb->buffer, 0, network_config_packet_size);
+	sb->ptr = sb->buffer;
+	sb->fill = 0;
+
+	memset (&sb->vl_def, 0, sizeof (sb->vl_def));
+} /* int network_init_buffer */
+
+/* Sends the "num" packets in "buffers" to the destination of "se". */
+static void network_send_plain (const sockent_t *se, /* {{{ */
+		char **buffers, const size_t *sizes, size_t num)
+{
+	size_t offset = 0;
+	int status;
+
+	while (offset < num)
+	{
+#if HAVE_SENDMMSG
+		struct mmsghdr msgs[num];
+		struct iovec iovs[num];
+		size_t i;
+
+		memset (msgs, 0, sizeof (msgs));
+		for (i = offset; i < num; i++)
 		{
-			status = parse_part_string (&buffer, &buffer_size,
-					vl.plugin_instance,
-					sizeof (vl.plugin_instance));
-			if (status == 0)
-				sstrncpy (n.plugin_instance,
-						vl.plugin_instance,
-						sizeof (n.plugin_instance));
+			iovs[i].iov_base = buffers[i];
+			iovs[i].iov_len = sizes[i];
+			msgs[i].msg_hdr.msg_name = se->data.client.addr;
+			msgs[i].msg_hdr.msg_namelen = se->data.client.addrlen;
+			msgs[i].msg_hdr.msg_iov = iovs + i;
+			msgs[i].msg_hdr.msg_iovlen = 1;
 		}
-		else if (pkg_type == TYPE_TYPE)
+
+		status = sendmmsg (se->data.client.fd, msgs + offset,
+				(unsigned int) (num - offset), /* flags = */ 0);
+		if (status > 0)
 		{
-			status = parse_part_string (&buffer, &buffer_size,
-					vl.type, sizeof (vl.type));
-			if (status == 0)
-				sstrncpy (n.type, vl.type, sizeof (n.type));
+			offset += (size_t) status;
+			continue;
 		}
-		else if (pkg_type == TYPE_TYPE_INSTANCE)
+#else
+		status = sendto (se->data.client.fd, buffers[offset],
+				sizes[offset], /* flags = */ 0,
+				(struct sockaddr *) se->data.client.addr,
+				se->data.client.addrlen);
+		if (status >= 0)
 		{
-			status = parse_part_string (&buffer, &buffer_size,
-					vl.type_instance,
-					sizeof (vl.type_instance));
-			if (status == 0)
-				sstrncpy (n.type_instance, vl.type_instance,
-						sizeof (n.type_instance));
+			offset++;
+			continue;
 		}
-		else if (pkg_type == TYPE_MESSAGE)
-		{
-			status = parse_part_string (&buffer, &buffer_size,
-					n.message, sizeof (n.message));
+#endif
+		if ((status < 0) && (errno == EINTR))
+			continue;
 
-			if (status != 0)
-			{
-				/* do nothing */
-			}
-			else if ((n.severity != NOTIF_FAILURE)
-					&& (n.severity != NOTIF_WARNING)
-					&& (n.severity != NOTIF_OKAY))
-			{
-				INFO ("network plugin: "
-						"Ignoring notification with "
-						"unknown severity %i.",
-						n.severity);
-			}
-			else if (n.time <= 0)
-			{
-				INFO ("network plugin: "
-						"Ignoring notification with "
-						"time == 0.");
-			}
-			else if (strlen (n.message) <= 0)
-			{
-				INFO ("network plugin: "
-						"Ignoring notification with "
-						"an empty message.");
-			}
-			else
-			{
-				network_dispatch_notification (&n);
-			}
+		if (status < 0)
+		{
+			char errbuf[1024];
+			ERROR ("network plugin: sendto failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
 		}
-		else if (pkg_type == TYPE_SEVERITY)
+		/* Skip the packet which failed. */
+		offset++;
+	} /* while (offset < num) */
+} /* }}} void network_send_plain */
+
+#ifdef UDP_SEGMENT
+/* Linux doesn't accept more segments per call. */
+#define SEGMENTS_MAX 64
+/* Largest UDP payload over IPv6. */
+#define SEGMENTED_SIZE_MAX 65487
+
+/* Sends "size" bytes of equally sized, "segment_size" byte datagrams, the last
+ * of which may be shorter, with one call. Returns zero on success. */
+static int network_send_segments (const sockent_t *se, /* {{{ */
+		char *buffer, size_t size, size_t segment_size)
+{
+	char control[CMSG_SPACE (sizeof (uint16_t))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	uint16_t gso_size = (uint16_t) segment_size;
+	int status;
+
+	iov.iov_base = buffer;
+	iov.iov_len = size;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_name = se->data.client.addr;
+	msg.msg_namelen = se->data.client.addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	memset (control, 0, sizeof (control));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+	cm = CMSG_FIRSTHDR (&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN (sizeof (gso_size));
+	memcpy (CMSG_DATA (cm), &gso_size, sizeof (gso_size));
+
+	do
+	{
+		status = (int) sendmsg (se->data.client.fd, &msg,
+				/* flags = */ 0);
+	} while ((status < 0) && (errno == EINTR));
+
+	return ((status < 0) ? -1 : 0);
+} /* }}} int network_send_segments */
+
+/* Like network_send_plain(), but packs the packets into one buffer, each
+ * padded to MaxPacketSize with a TYPE_PADDING part, and hands the whole
+ * buffer to the kernel, which sends it as separate datagrams. Packets
+ * which can't be padded because less than a part header is missing end a
+ * buffer. If the kernel doesn't support this, the socket falls back to
+ * network_send_plain() for good. */
+static void network_send_segmented (sockent_t *se, /* {{{ */
+		char **buffers, const size_t *sizes, size_t num)
+{
+	size_t segment_size = network_config_packet_size;
+	char buffer[SEGMENTED_SIZE_MAX];
+	size_t fill = 0;
+	size_t last_size = 0;
+	size_t first = 0;
+	size_t i;
+
+	if ((2 * segment_size) > sizeof (buffer))
+	{
+		network_send_plain (se, buffers, sizes, num);
+		return;
+	}
+
+	for (i = 0; i < num; i++)
+	{
+		size_t gap = segment_size - sizes[i];
+		_Bool last = 0;
+
+		memcpy (buffer + fill, buffers[i], sizes[i]);
+		last_size = sizes[i];
+		if (gap >= sizeof (part_header_t))
 		{
-			uint64_t tmp = 0;
-			status = parse_part_number (&buffer, &buffer_size,
-					&tmp);
-			if (status == 0)
-				n.severity = (int) tmp;
+			part_header_t ph;
+
+			ph.type = htons (TYPE_PADDING);
+			ph.length = htons ((uint16_t) gap);
+			memcpy (buffer + fill + sizes[i], &ph, sizeof (ph));
+			memset (buffer + fill + sizes[i] + sizeof (ph), 0,
+					gap - sizeof (ph));
 		}
-		else
+		else if (gap > 0)
+			last = 1;
+		fill += segment_size;
+
+		if (!last && (i < (num - 1))
+				&& ((i - first + 1) < SEGMENTS_MAX)
+				&& ((fill + segment_size) <= sizeof (buffer)))
+			continue;
+
+		/* The padding of the last packet isn't sent. */
+		fill -= segment_size - last_size;
+		if ((i > first)
+				&& (network_send_segments (se, buffer, fill,
+						segment_size) != 0))
 		{
-			DEBUG ("network plugin: parse_packet: Unknown part"
-					" type: 0x%04hx", pkg_type);
-			buffer = ((char *) buffer) + pkg_length;
+			char errbuf[1024];
+
+			if ((errno == EIO) || (errno == EINVAL)
+					|| (errno == ENOPROTOOPT)
+					|| (errno == EOPNOTSUPP))
+			{
+				WARNING ("network plugin: Sending segmented "
+						"packets to %s failed: %s. "
+						"Disabling `SegmentOffload'.",
+						se->node, sstrerror (errno,
+							errbuf, sizeof (errbuf)));
+				se->data.client.segment_offload = 0;
+				network_send_plain (se, buffers + first,
+						sizes + first, num - first);
+				return;
+			}
+
+			ERROR ("network plugin: sendmsg failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
 		}
-	} /* while (buffer_size > sizeof (part_header_t)) */
+		else if (i == first)
+			network_send_plain (se, buffers + first,
+					sizes + first, 1);
 
-	if (status == 0 && buffer_size > 0)
-		WARNING ("network plugin: parse_packet: Received truncated "
-				"packet, try increasing `MaxPacketSize'");
+		fill = 0;
+		first = i + 1;
+	}
+} /* }}} void network_send_segmented */
+#endif /* UDP_SEGMENT */
 
-	return (status);
-} /* }}} int parse_packet */
+#if HAVE_LIBGCRYPT
+#define BUFFER_ADD(p,s) do { \
+  memcpy (buffer + buffer_offset, (p), (s)); \
+  buffer_offset += (s); \
+} while (0)
 
-static void free_sockent_client (struct sockent_client *sec) /* {{{ */
+/* Writes the signed version of "in_buffer" to "buffer", which must have room
+ * for BUFF_SIG_SIZE more bytes. Returns its size or less than zero on
+ * error. */
+static ssize_t network_sign_buffer (const sockent_t *se, /* {{{ */
+		const char *in_buffer, size_t in_buffer_size, char *buffer)
 {
-  if (sec->fd >= 0)
+  part_signature_sha256_t ps;
+  size_t buffer_offset;
+  size_t username_len;
+
+  /* Keyed in sockent_open(). */
+  gcry_md_hd_t hd = se->data.client.hmac;
+  unsigned char *hash;
+
+  if (hd == NULL)
+    return (-1);
+  gcry_md_reset (hd);
+
+  username_len = strlen (se->data.client.username);
+  if (username_len > (BUFF_SIG_SIZE - PART_SIGNATURE_SHA256_SIZE))
   {
-    close (sec->fd);
-    sec->fd = -1;
+    ERROR ("network plugin: Username too long: %s",
+        se->data.client.username);
+    return (-1);
   }
-  sfree (sec->addr);
-#if HAVE_LIBGCRYPT
-  sfree (sec->username);
-  sfree (sec->password);
-  if (sec->cypher != NULL)
-    gcry_cipher_close (sec->cypher);
-#endif
-} /* }}} void free_sockent_client */
 
-static void free_sockent_server (struct sockent_server *ses) /* {{{ */
-{
-  size_t i;
+  memcpy (buffer + PART_SIGNATURE_SHA256_SIZE,
+      se->data.client.username, username_len);
+  memcpy (buffer + PART_SIGNATURE_SHA256_SIZE + username_len,
+      in_buffer, in_buffer_size);
 
-  for (i = 0; i < ses->fd_num; i++)
+  /* Initialize the `ps' structure. */
+  memset (&ps, 0, sizeof (ps));
+  ps.head.type = htons (TYPE_SIGN_SHA256);
+  ps.head.length = htons (PART_SIGNATURE_SHA256_SIZE + username_len);
+
+  /* Calculate the hash value. */
+  gcry_md_write (hd, buffer + PART_SIGNATURE_SHA256_SIZE,
+      username_len + in_buffer_size);
+  hash = gcry_md_read (hd, GCRY_MD_SHA256);
+  if (hash == NULL)
   {
-    if (ses->fd[i] >= 0)
-    {
-      close (ses->fd[i]);
-      ses->fd[i] = -1;
-    }
+    ERROR ("network plugin: gcry_md_read failed.");
+    return (-1);
   }
+  memcpy (ps.hash, hash, sizeof (ps.hash));
 
-  sfree (ses->fd);
-#if HAVE_LIBGCRYPT
-  sfree (ses->auth_file);
-  fbh_destroy (ses->userdb);
-  if (ses->cypher != NULL)
-    gcry_cipher_close (ses->cypher);
-#endif
-} /* }}} void free_sockent_server */
+  /* Add the header */
+  buffer_offset = 0;
 
-static void sockent_destroy (sockent_t *se) /* {{{ */
+  BUFFER_ADD (&ps.head.type, sizeof (ps.head.type));
+  BUFFER_ADD (&ps.head.length, sizeof (ps.head.length));
+  BUFFER_ADD (ps.hash, sizeof (ps.hash));
+
+  assert (buffer_offset == PART_SIGNATURE_SHA256_SIZE);
+
+  return ((ssize_t) (PART_SIGNATURE_SHA256_SIZE + username_len
+        + in_buffer_size));
+} /* }}} ssize_t network_sign_buffer */
+
+/* Writes the encrypted version of "in_buffer" to "buffer", which must have
+ * room for BUFF_SIG_SIZE more bytes. Returns its size or less than zero on
+ * error. */
+static ssize_t network_encrypt_buffer (sockent_t *se, /* {{{ */
+		const char *in_buffer, size_t in_buffer_size, char *buffer)
 {
-  sockent_t *next;
+  part_encryption_aes256_t pea;
+  size_t buffer_size;
+  size_t buffer_offset;
+  size_t header_size;
+  size_t username_len;
+  gcry_error_t err;
+  gcry_cipher_hd_t cypher;
 
-  DEBUG ("network plugin: sockent_destroy (se = %p);", (void *) se);
+  /* Initialize the header fields */
+  memset (&pea, 0, sizeof (pea));
+  pea.head.type = htons (TYPE_ENCR_AES256);
 
-  while (se != NULL)
+  pea.username = se->data.client.username;
+
+  username_len = strlen (pea.username);
+  if ((PART_ENCRYPTION_AES256_SIZE + username_len) > BUFF_SIG_SIZE)
   {
-    next = se->next;
+    ERROR ("network plugin: Username too long: %s", pea.username);
+    return (-1);
+  }
 
-    sfree (se->node);
-    sfree (se->service);
+  buffer_size = PART_ENCRYPTION_AES256_SIZE + username_len + in_buffer_size;
+  header_size = PART_ENCRYPTION_AES256_SIZE + username_len
+    - sizeof (pea.hash);
 
-    if (se->type == SOCKENT_TYPE_CLIENT)
-      free_sockent_client (&se->data.client);
-    else
-      free_sockent_server (&se->data.server);
+  DEBUG ("network plugin: network_encrypt_buffer: "
+      "buffer_size = %zu;", buffer_size);
 
-    sfree (se);
-    se = next;
+  pea.head.length = htons ((uint16_t) (PART_ENCRYPTION_AES256_SIZE
+        + username_len + in_buffer_size));
+  pea.username_length = htons ((uint16_t) username_len);
+
+  /* Chose a random initialization vector. */
+  gcry_randomize ((void *) &pea.iv, sizeof (pea.iv), GCRY_STRONG_RANDOM);
+
+  /* Create hash of the payload */
+  gcry_md_hash_buffer (GCRY_MD_SHA1, pea.hash, in_buffer, in_buffer_size);
+
+  /* Initialize the buffer */
+  buffer_offset = 0;
+  memset (buffer, 0, buffer_size);
+
+
+  BUFFER_ADD (&pea.head.type, sizeof (pea.head.type));
+  BUFFER_ADD (&pea.head.length, sizeof (pea.head.length));
+  BUFFER_ADD (&pea.username_length, sizeof (pea.username_length));
+  BUFFER_ADD (pea.username, username_len);
+  BUFFER_ADD (pea.iv, sizeof (pea.iv));
+  assert (buffer_offset == header_size);
+  BUFFER_ADD (pea.hash, sizeof (pea.hash));
+  BUFFER_ADD (in_buffer, in_buffer_size);
+
+  assert (buffer_offset == buffer_size);
+
+  cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv),
+      se->data.client.password);
+  if (cypher == NULL)
+    return (-1);
+
+  /* Encrypt the buffer in-place */
+  err = gcry_cipher_encrypt (cypher,
+      buffer      + header_size,
+      buffer_size - header_size,
+      /* in = */ NULL, /* in len = */ 0);
+  if (err != 0)
+  {
+    ERROR ("network plugin: gcry_cipher_encrypt returned: %s",
+        gcry_strerror (err));
+    return (-1);
   }
-} /* }}} void sockent_destroy */
 
-/*
- * int network_set_ttl
- *
- * Set the `IP_MULTICAST_TTL', `IP_TTL', `IPV6_MULTICAST_HOPS' or
- * `IPV6_UNICAST_HOPS', depending on which option is applicable.
- *
- * The `struct addrinfo' is used to destinguish between unicast and multicast
- * sockets.
- */
-static int network_set_ttl (const sockent_t *se, const struct addrinfo *ai)
+  return ((ssize_t) buffer_size);
+} /* }}} ssize_t network_encrypt_buffer */
+#undef BUFFER_ADD
+#endif /* HAVE_LIBGCRYPT */
+
+/* Closes the connection of "se" and drops what is left of its frames, the
+ * next connection has to start with a complete frame. The next attempt to
+ * connect is made after waiting twice as long as before. Called with
+ * "tcp_lock" held. */
+static void network_tcp_disconnect (sockent_t *se) /* {{{ */
 {
-	DEBUG ("network plugin: network_set_ttl: network_config_ttl = %i;",
-			network_config_ttl);
+  struct sockent_client *client = &se->data.client;
 
-        assert (se->type == SOCKENT_TYPE_CLIENT);
+  if (client->fd >= 0)
+  {
+    close (client->fd);
+    client->fd = -1;
+  }
+  client->tcp_state = TCP_STATE_DISCONNECTED;
 
-	if ((network_config_ttl < 1) || (network_config_ttl > 255))
-		return (-1);
+  (void) __sync_add_and_fetch (&stats_octets_dropped_tcp,
+      (derive_t) client->tcp_out_len);
+  client->tcp_out_len = 0;
 
-	if (ai->ai_family == AF_INET)
-	{
-		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
-		int optname;
+  if (client->tcp_backoff == 0)
+    client->tcp_backoff = TIME_T_TO_CDTIME_T (1);
+  else if (client->tcp_backoff < (TCP_BACKOFF_MAX / 2))
+    client->tcp_backoff *= 2;
+  else
+    client->tcp_backoff = TCP_BACKOFF_MAX;
+  client->tcp_retry = cdtime () + client->tcp_backoff;
+} /* }}} void network_tcp_disconnect */
+
+/* Updates the address of "se" from the resolver cache, which looks the name
+ * up again in the background once the answer has expired. Keeps the old
+ * address if there is no answer. */
+static void network_tcp_resolve (sockent_t *se) /* {{{ */
+{
+  struct sockent_client *client = &se->data.client;
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list = NULL;
+  const char *service = (se->service != NULL) ? se->service : NET_DEFAULT_PORT;
+
+  sockent_ai_hints (se, &ai_hints);
+  if (ures_getaddrinfo (se->node, service, &ai_hints, /* wait = */ 0,
+        &ai_list) != 0)
+    return;
 
-		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
-			optname = IP_MULTICAST_TTL;
-		else
-			optname = IP_TTL;
+  if (ai_list->ai_addrlen <= sizeof (*client->addr))
+  {
+    memset (client->addr, 0, sizeof (*client->addr));
+    memcpy (client->addr, ai_list->ai_addr, ai_list->ai_addrlen);
+    client->addrlen = ai_list->ai_addrlen;
+  }
+  ures_freeaddrinfo (ai_list);
+} /* }}} void network_tcp_resolve */
 
-		if (setsockopt (se->data.client.fd, IPPROTO_IP, optname,
-					&network_config_ttl,
-					sizeof (network_config_ttl)) != 0)
-		{
-			char errbuf[1024];
-			ERROR ("network plugin: setsockopt (ipv4-ttl): %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			return (-1);
-		}
-	}
-	else if (ai->ai_family == AF_INET6)
-	{
-		/* Useful example: http://gsyc.escet.urjc.es/~eva/IPv6-web/examples/mcast.html */
-		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
-		int optname;
+/* Connects "se" without blocking. Returns zero once the connection is
+ * established. Called with "tcp_lock" held. */
+static int network_tcp_connect (sockent_t *se) /* {{{ */
+{
+  struct sockent_client *client = &se->data.client;
+  char errbuf[1024];
+  int status;
 
-		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
-			optname = IPV6_MULTICAST_HOPS;
-		else
-			optname = IPV6_UNICAST_HOPS;
+  if (client->tcp_state == TCP_STATE_CONNECTED)
+    return (0);
+
+  if (client->tcp_state == TCP_STATE_DISCONNECTED)
+  {
+    int flags;
+
+    if (cdtime () < client->tcp_retry)
+      return (-1);
+
+    network_tcp_resolve (se);
+
+    client->fd = socket (client->addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (client->fd < 0)
+    {
+      ERROR ("network plugin: socket(2) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      network_tcp_disconnect (se);
+      return (-1);
+    }
+
+    flags = fcntl (client->fd, F_GETFL);
+    if ((flags < 0)
+        || (fcntl (client->fd, F_SETFL, flags | O_NONBLOCK) != 0))
+    {
+      ERROR ("network plugin: fcntl failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      network_tcp_disconnect (se);
+      return (-1);
+    }
+
+    status = connect (client->fd, (struct sockaddr *) client->addr,
+        client->addrlen);
+    if ((status != 0) && (errno != EINPROGRESS))
+    {
+      WARNING ("network plugin: Connecting to %s failed: %s",
+          se->node, sstrerror (errno, errbuf, sizeof (errbuf)));
+      network_tcp_disconnect (se);
+      return (-1);
+    }
 
-		if (setsockopt (se->data.client.fd, IPPROTO_IPV6, optname,
-					&network_config_ttl,
-					sizeof (network_config_ttl)) != 0)
-		{
-			char errbuf[1024];
-			ERROR ("network plugin: setsockopt(ipv6-ttl): %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			return (-1);
-		}
-	}
+    client->tcp_state = TCP_STATE_CONNECTING;
+  }
 
-	return (0);
-} /* int network_set_ttl */
+  /* TCP_STATE_CONNECTING */
+  {
+    struct pollfd pfd;
+    int error = 0;
+    socklen_t error_size = sizeof (error);
 
-static int network_set_interface (const sockent_t *se, const struct addrinfo *ai) /* {{{ */
-{
-	DEBUG ("network plugin: network_set_interface: interface index = %i;",
-			se->interface);
+    memset (&pfd, 0, sizeof (pfd));
+    pfd.fd = client->fd;
+    pfd.events = POLLOUT;
 
-        assert (se->type == SOCKENT_TYPE_CLIENT);
+    status = poll (&pfd, 1, /* timeout = */ 0);
+    if (status == 0)
+      return (-1);
 
-	if (ai->ai_family == AF_INET)
-	{
-		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
+    status = getsockopt (client->fd, SOL_SOCKET, SO_ERROR,
+        &error, &error_size);
+    if ((status != 0) || (error != 0))
+    {
+      WARNING ("network plugin: Connecting to %s failed: %s",
+          se->node, sstrerror ((status != 0) ? errno : error,
+            errbuf, sizeof (errbuf)));
+      network_tcp_disconnect (se);
+      return (-1);
+    }
+  }
 
-		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
-		{
-#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
-			/* If possible, use the "ip_mreqn" structure which has
-			 * an "interface index" member. Using the interface
-			 * index is preferred here, because of its similarity
-			 * to the way IPv6 handles this. Unfortunately, it
-			 * appears not to be portable. */
-			struct ip_mreqn mreq;
+  INFO ("network plugin: Connected to %s.", se->node);
+  client->tcp_state = TCP_STATE_CONNECTED;
+  client->tcp_backoff = 0;
+  return (0);
+} /* }}} int network_tcp_connect */
 
-			memset (&mreq, 0, sizeof (mreq));
-			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
-			mreq.imr_address.s_addr = ntohl (INADDR_ANY);
-			mreq.imr_ifindex = se->interface;
-#else
-			struct ip_mreq mreq;
+/* Writes as much of the pending frames of "se" as the socket takes without
+ * blocking. Called with "tcp_lock" held. */
+static void network_tcp_flush (sockent_t *se) /* {{{ */
+{
+  struct sockent_client *client = &se->data.client;
 
-			memset (&mreq, 0, sizeof (mreq));
-			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
-			mreq.imr_interface.s_addr = ntohl (INADDR_ANY);
-#endif
+  if (client->tcp_out_len == 0)
+    return;
 
-			if (setsockopt (se->data.client.fd, IPPROTO_IP, IP_MULTICAST_IF,
-						&mreq, sizeof (mreq)) != 0)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (ipv4-multicast-if): %s",
-						sstrerror (errno, errbuf, sizeof (errbuf)));
-				return (-1);
-			}
+  if (network_tcp_connect (se) != 0)
+    return;
 
-			return (0);
-		}
-	}
-	else if (ai->ai_family == AF_INET6)
-	{
-		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
+  while (client->tcp_out_len > 0)
+  {
+    ssize_t status;
 
-		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
-		{
-			if (setsockopt (se->data.client.fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
-						&se->interface,
-						sizeof (se->interface)) != 0)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (ipv6-multicast-if): %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+    status = send (client->fd, client->tcp_out, client->tcp_out_len,
+        MSG_DONTWAIT);
+    if (status < 0)
+    {
+      char errbuf[1024];
 
-			return (0);
-		}
-	}
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
 
-	/* else: Not a multicast interface. */
-	if (se->interface != 0)
-	{
-#if defined(HAVE_IF_INDEXTONAME) && HAVE_IF_INDEXTONAME && defined(SO_BINDTODEVICE)
-		char interface_name[IFNAMSIZ];
+      WARNING ("network plugin: Sending to %s failed: %s",
+          se->node, sstrerror (errno, errbuf, sizeof (errbuf)));
+      network_tcp_disconnect (se);
+      break;
+    }
 
-		if (if_indextoname (se->interface, interface_name) == NULL)
-			return (-1);
+    memmove (client->tcp_out, client->tcp_out + status,
+        client->tcp_out_len - (size_t) status);
+    client->tcp_out_len -= (size_t) status;
+  }
+} /* }}} void network_tcp_flush */
 
-		DEBUG ("network plugin: Binding socket to interface %s", interface_name);
+/* Appends one frame holding the "num" packets in "buffers" to the pending
+ * frames of "se". Called with "tcp_lock" held. */
+static void network_tcp_frame_add (sockent_t *se, /* {{{ */
+    char **buffers, const size_t *sizes, size_t num)
+{
+  struct sockent_client *client = &se->data.client;
+  size_t payload_size = 0;
+  size_t frame_size;
+  uint32_t header;
+  char *payload;
+  size_t i;
 
-		if (setsockopt (se->data.client.fd, SOL_SOCKET, SO_BINDTODEVICE,
-					interface_name,
-					sizeof(interface_name)) == -1 )
-		{
-			char errbuf[1024];
-			ERROR ("network plugin: setsockopt (bind-if): %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			return (-1);
-		}
-/* #endif HAVE_IF_INDEXTONAME && SO_BINDTODEVICE */
+  for (i = 0; i < num; i++)
+    payload_size += sizes[i];
 
-#else
-		WARNING ("network plugin: Cannot set the interface on a unicast "
-			"socket because "
-# if !defined(SO_BINDTODEVICE)
-			"the \"SO_BINDTODEVICE\" socket option "
-# else
-			"the \"if_indextoname\" function "
-# endif
-			"is not available on your system.");
+  frame_size = FRAME_HEADER_SIZE + payload_size;
+#if HAVE_LIBZ
+  if (client->compression == COMPRESSION_ZLIB)
+    frame_size = FRAME_HEADER_SIZE + compressBound ((uLong) payload_size);
 #endif
 
-	}
+  if ((client->tcp_out_len + frame_size) > TCP_OUT_MAX)
+  {
+    (void) __sync_add_and_fetch (&stats_octets_dropped_tcp,
+        (derive_t) payload_size);
+    return;
+  }
 
-	return (0);
-} /* }}} network_set_interface */
+  if ((client->tcp_out_len + frame_size) > client->tcp_out_size)
+  {
+    size_t new_size = (client->tcp_out_size == 0)
+      ? 65536 : client->tcp_out_size;
+    char *tmp;
 
-static int network_bind_socket (int fd, const struct addrinfo *ai, const int interface_idx)
-{
-#if KERNEL_SOLARIS
-	char loop   = 0;
-#else
-	int loop = 0;
-#endif
-	int yes  = 1;
+    while (new_size < (client->tcp_out_len + frame_size))
+      new_size *= 2;
 
-	/* allow multiple sockets to use the same PORT number */
-	if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR,
-				&yes, sizeof(yes)) == -1) {
-                char errbuf[1024];
-                ERROR ("network plugin: setsockopt (reuseaddr): %s",
-                                sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
-	}
+    tmp = realloc (client->tcp_out, new_size);
+    if (tmp == NULL)
+    {
+      ERROR ("network plugin: realloc failed.");
+      return;
+    }
+    client->tcp_out = tmp;
+    client->tcp_out_size = new_size;
+  }
 
-	DEBUG ("fd = %i; calling `bind'", fd);
+  payload = client->tcp_out + client->tcp_out_len + FRAME_HEADER_SIZE;
+  header = (uint32_t) payload_size;
 
-	if (bind (fd, ai->ai_addr, ai->ai_addrlen) == -1)
-	{
-		char errbuf[1024];
-		ERROR ("bind: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
-	}
+#if HAVE_LIBZ
+  if (client->compression == COMPRESSION_ZLIB)
+  {
+    char *in = buffers[0];
+    uLongf payload_compressed = (uLongf) (frame_size - FRAME_HEADER_SIZE);
+    int status;
 
-	if (ai->ai_family == AF_INET)
-	{
-		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
-		if (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)))
-		{
-#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
-			struct ip_mreqn mreq;
-#else
-			struct ip_mreq mreq;
-#endif
+    if (num > 1)
+    {
+      size_t offset = 0;
+
+      in = malloc (payload_size);
+      if (in == NULL)
+      {
+        ERROR ("network plugin: malloc failed.");
+        return;
+      }
+      for (i = 0; i < num; i++)
+      {
+        memcpy (in + offset, buffers[i], sizes[i]);
+        offset += sizes[i];
+      }
+    }
 
-			DEBUG ("fd = %i; IPv4 multicast address found", fd);
+    status = compress2 ((Bytef *) payload, &payload_compressed,
+        (Bytef *) in, (uLong) payload_size, Z_BEST_SPEED);
+    if (in != buffers[0])
+      sfree (in);
+
+    /* Encrypted packets don't shrink; they're sent as they are. */
+    if ((status == Z_OK) && (payload_compressed < payload_size))
+      header = FRAME_FLAG_ZLIB | (uint32_t) payload_compressed;
+    else if (status != Z_OK)
+      WARNING ("network plugin: compress2 failed with status %i.",
+          status);
+  }
 
-			mreq.imr_multiaddr.s_addr = addr->sin_addr.s_addr;
-#if HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
-			/* Set the interface using the interface index if
-			 * possible (available). Unfortunately, the struct
-			 * ip_mreqn is not portable. */
-			mreq.imr_address.s_addr = ntohl (INADDR_ANY);
-			mreq.imr_ifindex = interface_idx;
-#else
-			mreq.imr_interface.s_addr = ntohl (INADDR_ANY);
-#endif
+  if ((header & FRAME_FLAG_ZLIB) == 0)
+#endif /* HAVE_LIBZ */
+  {
+    size_t offset = 0;
 
-			if (setsockopt (fd, IPPROTO_IP, IP_MULTICAST_LOOP,
-						&loop, sizeof (loop)) == -1)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (multicast-loop): %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+    for (i = 0; i < num; i++)
+    {
+      memcpy (payload + offset, buffers[i], sizes[i]);
+      offset += sizes[i];
+    }
+  }
 
-			if (setsockopt (fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-						&mreq, sizeof (mreq)) == -1)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (add-membership): %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+  frame_size = FRAME_HEADER_SIZE + (size_t) (header & FRAME_SIZE_MASK);
+  header = htonl (header);
+  memcpy (client->tcp_out + client->tcp_out_len, &header, sizeof (header));
+  client->tcp_out_len += frame_size;
+} /* }}} void network_tcp_frame_add */
+
+/* Sends the "num" packets in "buffers" over the TCP connection of "se". The
+ * packets go into one frame, unless they are signed: the signature covers
+ * the rest of the frame. */
+static void network_tcp_send (sockent_t *se, /* {{{ */
+    char **buffers, const size_t *sizes, size_t num, _Bool frame_each)
+{
+  size_t i;
 
-			return (0);
-		}
-	}
-	else if (ai->ai_family == AF_INET6)
-	{
-		/* Useful example: http://gsyc.escet.urjc.es/~eva/IPv6-web/examples/mcast.html */
-		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
-		if (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr))
-		{
-			struct ipv6_mreq mreq;
+  pthread_mutex_lock (&se->data.client.tcp_lock);
 
-			DEBUG ("fd = %i; IPv6 multicast address found", fd);
+  if (frame_each)
+    for (i = 0; i < num; i++)
+      network_tcp_frame_add (se, buffers + i, sizes + i, 1);
+  else
+    network_tcp_frame_add (se, buffers, sizes, num);
 
-			memcpy (&mreq.ipv6mr_multiaddr,
-					&addr->sin6_addr,
-					sizeof (addr->sin6_addr));
+  network_tcp_flush (se);
 
-			/* http://developer.apple.com/documentation/Darwin/Reference/ManPages/man4/ip6.4.html
-			 * ipv6mr_interface may be set to zeroes to
-			 * choose the default multicast interface or to
-			 * the index of a particular multicast-capable
-			 * interface if the host is multihomed.
-			 * Membership is associ-associated with a
-			 * single interface; programs running on
-			 * multihomed hosts may need to join the same
-			 * group on more than one interface.*/
-			mreq.ipv6mr_interface = interface_idx;
+  pthread_mutex_unlock (&se->data.client.tcp_lock);
+} /* }}} void network_tcp_send */
 
-			if (setsockopt (fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
-						&loop, sizeof (loop)) == -1)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (ipv6-multicast-loop): %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+/* Returns true if frames are waiting to be sent over TCP. With
+ * "connected_only", connections which are down don't count. */
+static _Bool network_tcp_pending (_Bool connected_only) /* {{{ */
+{
+  sockent_t *se;
 
-			if (setsockopt (fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP,
-						&mreq, sizeof (mreq)) == -1)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: setsockopt (ipv6-add-membership): %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+  for (se = sending_sockets; se != NULL; se = se->next)
+  {
+    if ((se->protocol != NETWORK_PROTOCOL_TCP)
+        || (se->data.client.tcp_out_len == 0))
+      continue;
 
-			return (0);
-		}
-	}
+    if (!connected_only
+        || (se->data.client.tcp_state != TCP_STATE_DISCONNECTED))
+      return (1);
+  }
+
+  return (0);
+} /* }}} _Bool network_tcp_pending */
+
+static void network_tcp_flush_all (void) /* {{{ */
+{
+  sockent_t *se;
+
+  for (se = sending_sockets; se != NULL; se = se->next)
+  {
+    if (se->protocol != NETWORK_PROTOCOL_TCP)
+      continue;
 
-#if defined(HAVE_IF_INDEXTONAME) && HAVE_IF_INDEXTONAME && defined(SO_BINDTODEVICE)
-	/* if a specific interface was set, bind the socket to it. But to avoid
- 	 * possible problems with multicast routing, only do that for non-multicast
-	 * addresses */
-	if (interface_idx != 0)
-	{
-		char interface_name[IFNAMSIZ];
+    pthread_mutex_lock (&se->data.client.tcp_lock);
+    network_tcp_flush (se);
+    pthread_mutex_unlock (&se->data.client.tcp_lock);
+  }
+} /* }}} void network_tcp_flush_all */
+
+/* Sends the "num" packets in "buffers" to all servers. Sockets with the same
+ * security settings share the signed or encrypted packets. "scratch" must
+ * have room for "num" packets of network_config_packet_size plus
+ * BUFF_SIG_SIZE bytes each. */
+static void network_send_packets (char **buffers, /* {{{ */
+    const size_t *sizes, size_t num, char *scratch)
+{
+  sockent_t *encoder;
 
-		if (if_indextoname (interface_idx, interface_name) == NULL)
-			return (-1);
+  DEBUG ("network plugin: network_send_packets: num = %zu", num);
 
-		DEBUG ("fd = %i; Binding socket to interface %s", fd, interface_name);
+  for (encoder = sending_sockets; encoder != NULL; encoder = encoder->next)
+  {
+    char *out_buffers[num];
+    size_t out_sizes[num];
+    size_t out_num = 0;
+    sockent_t *se;
+    size_t i;
 
-		if (setsockopt (fd, SOL_SOCKET, SO_BINDTODEVICE,
-					interface_name,
-					sizeof(interface_name)) == -1 )
-		{
-			char errbuf[1024];
-			ERROR ("network plugin: setsockopt (bind-if): %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			return (-1);
-		}
-	}
-#endif /* HAVE_IF_INDEXTONAME && SO_BINDTODEVICE */
+    if (encoder->data.client.encoder != encoder)
+      continue;
 
-	return (0);
-} /* int network_bind_socket */
+    for (i = 0; i < num; i++)
+    {
+#if HAVE_LIBGCRYPT
+      char *out = scratch
+        + i * (network_config_packet_size + BUFF_SIG_SIZE);
+      ssize_t status;
+
+      if (encoder->data.client.security_level == SECURITY_LEVEL_ENCRYPT)
+        status = network_encrypt_buffer (encoder, buffers[i], sizes[i], out);
+      else if (encoder->data.client.security_level == SECURITY_LEVEL_SIGN)
+        status = network_sign_buffer (encoder, buffers[i], sizes[i], out);
+      else /* if (se->data.client.security_level == SECURITY_LEVEL_NONE) */
+#endif /* HAVE_LIBGCRYPT */
+      {
+        out_buffers[out_num] = buffers[i];
+        out_sizes[out_num] = sizes[i];
+        out_num++;
+        continue;
+      }
+#if HAVE_LIBGCRYPT
+      if (status < 0)
+        continue;
 
-/* Initialize a sockent structure. `type' must be either `SOCKENT_TYPE_CLIENT'
- * or `SOCKENT_TYPE_SERVER' */
-static int sockent_init (sockent_t *se, int type) /* {{{ */
-{
-	if (se == NULL)
-		return (-1);
+      out_buffers[out_num] = out;
+      out_sizes[out_num] = (size_t) status;
+      out_num++;
+#endif /* HAVE_LIBGCRYPT */
+    }
 
-	memset (se, 0, sizeof (*se));
+    if (out_num == 0)
+      continue;
 
-	se->type = SOCKENT_TYPE_CLIENT;
-	se->node = NULL;
-	se->service = NULL;
-	se->interface = 0;
-	se->next = NULL;
+    for (se = encoder; se != NULL; se = se->next)
+    {
+      if (se->data.client.encoder != encoder)
+        continue;
 
-	if (type == SOCKENT_TYPE_SERVER)
-	{
-		se->type = SOCKENT_TYPE_SERVER;
-		se->data.server.fd = NULL;
+      if (se->protocol == NETWORK_PROTOCOL_TCP)
+        network_tcp_send (se, out_buffers, out_sizes, out_num,
 #if HAVE_LIBGCRYPT
-		se->data.server.security_level = SECURITY_LEVEL_NONE;
-		se->data.server.auth_file = NULL;
-		se->data.server.userdb = NULL;
-		se->data.server.cypher = NULL;
+            /* frame_each = */ (encoder->data.client.security_level
+              == SECURITY_LEVEL_SIGN)
+#else
+            /* frame_each = */ 0
 #endif
-	}
-	else
-	{
-		se->data.client.fd = -1;
-		se->data.client.addr = NULL;
-#if HAVE_LIBGCRYPT
-		se->data.client.security_level = SECURITY_LEVEL_NONE;
-		se->data.client.username = NULL;
-		se->data.client.password = NULL;
-		se->data.client.cypher = NULL;
+            );
+#ifdef UDP_SEGMENT
+      else if (se->data.client.segment_offload)
+        network_send_segmented (se, out_buffers, out_sizes, out_num);
 #endif
-	}
-
-	return (0);
-} /* }}} int sockent_init */
+      else
+        network_send_plain (se, out_buffers, out_sizes, out_num);
+    }
+  } /* for (sending_sockets) */
+} /* }}} void network_send_packets */
 
-/* Open the file descriptors for a initialized sockent structure. */
-static int sockent_open (sockent_t *se) /* {{{ */
+static void *send_thread (void __attribute__((unused)) *arg) /* {{{ */
 {
-	struct addrinfo  ai_hints;
-	struct addrinfo *ai_list, *ai_ptr;
-	int              ai_return;
+  char *scratch;
+  int tries;
 
-        const char *node;
-        const char *service;
+  scratch = malloc (SEND_BATCH_SIZE
+      * (network_config_packet_size + BUFF_SIG_SIZE));
+  if (scratch == NULL)
+  {
+    ERROR ("network plugin: send_thread: malloc failed.");
+    return ((void *) 1);
+  }
 
-	if (se == NULL)
-		return (-1);
+  while (42)
+  {
+    send_packet_t *packets[SEND_BATCH_SIZE];
+    char *buffers[SEND_BATCH_SIZE];
+    size_t sizes[SEND_BATCH_SIZE];
+    size_t num = 0;
+    size_t i;
+
+    c_mutex_lock (&send_queue_lock);
+    while ((send_queue_head == NULL) && (send_loop == 0))
+    {
+      struct timespec ts;
+
+      if (!network_tcp_pending (/* connected_only = */ 0))
+      {
+        c_cond_wait (&send_queue_cond, &send_queue_lock);
+        continue;
+      }
+
+      /* Retry writing to TCP connections which were busy or down. */
+      CDTIME_T_TO_TIMESPEC (cdtime () + MS_TO_CDTIME_T (100), &ts);
+      if (c_cond_timedwait (&send_queue_cond, &send_queue_lock,
+            &ts) == ETIMEDOUT)
+      {
+        c_mutex_unlock (&send_queue_lock);
+        network_tcp_flush_all ();
+        c_mutex_lock (&send_queue_lock);
+      }
+    }
 
-	/* Set up the security structures. */
-#if HAVE_LIBGCRYPT /* {{{ */
-	if (se->type == SOCKENT_TYPE_CLIENT)
-	{
-		if (se->data.client.security_level > SECURITY_LEVEL_NONE)
-		{
-			if ((se->data.client.username == NULL)
-					|| (se->data.client.password == NULL))
-			{
-				ERROR ("network plugin: Client socket with "
-						"security requested, but no "
-						"credentials are configured.");
-				return (-1);
-			}
-			gcry_md_hash_buffer (GCRY_MD_SHA256,
-					se->data.client.password_hash,
-					se->data.client.password,
-					strlen (se->data.client.password));
-		}
-	}
-	else /* (se->type == SOCKENT_TYPE_SERVER) */
-	{
-		if (se->data.server.security_level > SECURITY_LEVEL_NONE)
-		{
-			if (se->data.server.auth_file == NULL)
-			{
-				ERROR ("network plugin: Server socket with "
-						"security requested, but no "
-						"password file is configured.");
-				return (-1);
-			}
-		}
-		if (se->data.server.auth_file != NULL)
-		{
-			se->data.server.userdb = fbh_create (se->data.server.auth_file);
-			if (se->data.server.userdb == NULL)
-			{
-				ERROR ("network plugin: Reading password file "
-						"`%s' failed.",
-						se->data.server.auth_file);
-				if (se->data.server.security_level > SECURITY_LEVEL_NONE)
-					return (-1);
-			}
-		}
-	}
-#endif /* }}} HAVE_LIBGCRYPT */
+    /* We do NOT check `send_loop' because the queue is emptied before
+     * shutting down. */
+    if (send_queue_head == NULL)
+    {
+      c_mutex_unlock (&send_queue_lock);
+      break;
+    }
 
-        node = se->node;
-        service = se->service;
+    while ((num < SEND_BATCH_SIZE) && (send_queue_head != NULL))
+    {
+      packets[num] = send_queue_head;
+      send_queue_head = send_queue_head->next;
+      send_queue_length--;
+      num++;
+    }
+    if (send_queue_head == NULL)
+      send_queue_tail = NULL;
+    pthread_cond_broadcast (&send_space_cond);
+    c_mutex_unlock (&send_queue_lock);
 
-        if (service == NULL)
-          service = NET_DEFAULT_PORT;
+    for (i = 0; i < num; i++)
+    {
+      buffers[i] = packets[i]->data;
+      sizes[i] = packets[i]->size;
+    }
+    network_send_packets (buffers, sizes, num, scratch);
 
-        DEBUG ("network plugin: sockent_open: node = %s; service = %s;",
-            node, service);
+    c_mutex_lock (&send_queue_lock);
+    for (i = 0; i < num; i++)
+    {
+      packets[i]->next = send_queue_free;
+      send_queue_free = packets[i];
+    }
+    c_mutex_unlock (&send_queue_lock);
+  } /* while (42) */
 
-	memset (&ai_hints, 0, sizeof (ai_hints));
-	ai_hints.ai_flags  = 0;
-#ifdef AI_PASSIVE
-	ai_hints.ai_flags |= AI_PASSIVE;
-#endif
-#ifdef AI_ADDRCONFIG
-	ai_hints.ai_flags |= AI_ADDRCONFIG;
-#endif
-	ai_hints.ai_family   = AF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_DGRAM;
-	ai_hints.ai_protocol = IPPROTO_UDP;
+  /* Give established TCP connections up to two seconds to take the rest. */
+  for (tries = 0; (tries < 20) && network_tcp_pending (/* connected_only = */ 1);
+      tries++)
+  {
+    struct timespec ts = { 0, 100000000 };
 
-	ai_return = getaddrinfo (node, service, &ai_hints, &ai_list);
-	if (ai_return != 0)
-	{
-		ERROR ("network plugin: getaddrinfo (%s, %s) failed: %s",
-				(se->node == NULL) ? "(null)" : se->node,
-				(se->service == NULL) ? "(null)" : se->service,
-				gai_strerror (ai_return));
-		return (-1);
-	}
+    network_tcp_flush_all ();
+    if (network_tcp_pending (/* connected_only = */ 1))
+      nanosleep (&ts, /* remaining = */ NULL);
+  }
 
-	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
-	{
-		int status;
+  sfree (scratch);
+  return ((void *) 0);
+} /* }}} void *send_thread */
 
-		if (se->type == SOCKENT_TYPE_SERVER) /* {{{ */
-		{
-			int *tmp;
+/* Queues a copy of "buffer" for the send thread. Once that has been stopped,
+ * the packet is sent right away. */
+static void network_send_buffer (char *buffer, size_t buffer_len) /* {{{ */
+{
+  send_packet_t *p;
 
-			tmp = realloc (se->data.server.fd,
-					sizeof (*tmp) * (se->data.server.fd_num + 1));
-			if (tmp == NULL)
-			{
-				ERROR ("network plugin: realloc failed.");
-				continue;
-			}
-			se->data.server.fd = tmp;
-			tmp = se->data.server.fd + se->data.server.fd_num;
+  DEBUG ("network plugin: network_send_buffer: buffer_len = %zu", buffer_len);
 
-			*tmp = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
-					ai_ptr->ai_protocol);
-			if (*tmp < 0)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: socket(2) failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				continue;
-			}
+  c_mutex_lock (&send_queue_lock);
+  while (send_thread_running && (send_loop == 0)
+      && (send_queue_length >= SEND_QUEUE_LIMIT))
+    c_cond_wait (&send_space_cond, &send_queue_lock);
 
-			status = network_bind_socket (*tmp, ai_ptr, se->interface);
-			if (status != 0)
-			{
-				close (*tmp);
-				*tmp = -1;
-				continue;
-			}
+  if (!send_thread_running || (send_loop != 0))
+  {
+    c_mutex_unlock (&send_queue_lock);
+    {
+      char scratch[network_config_packet_size + BUFF_SIG_SIZE];
+      network_send_packets (&buffer, &buffer_len, 1, scratch);
+    }
+    return;
+  }
 
-			se->data.server.fd_num++;
-			continue;
-		} /* }}} if (se->type == SOCKENT_TYPE_SERVER) */
-		else /* if (se->type == SOCKENT_TYPE_CLIENT) {{{ */
-		{
-			se->data.client.fd = socket (ai_ptr->ai_family,
-					ai_ptr->ai_socktype,
-					ai_ptr->ai_protocol);
-			if (se->data.client.fd < 0)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: socket(2) failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				continue;
-			}
+  p = send_queue_free;
+  if (p != NULL)
+    send_queue_free = p->next;
+  else
+  {
+    p = malloc (sizeof (*p) + network_config_packet_size);
+    if (p == NULL)
+    {
+      c_mutex_unlock (&send_queue_lock);
+      ERROR ("network plugin: network_send_buffer: malloc failed.");
+      return;
+    }
+  }
 
-			se->data.client.addr = malloc (sizeof (*se->data.client.addr));
-			if (se->data.client.addr == NULL)
-			{
-				ERROR ("network plugin: malloc failed.");
-				close (se->data.client.fd);
-				se->data.client.fd = -1;
-				continue;
-			}
+  assert (buffer_len <= network_config_packet_size);
+  memcpy (p->data, buffer, buffer_len);
+  p->size = buffer_len;
+  p->next = NULL;
 
-			memset (se->data.client.addr, 0, sizeof (*se->data.client.addr));
-			assert (sizeof (*se->data.client.addr) >= ai_ptr->ai_addrlen);
-			memcpy (se->data.client.addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
-			se->data.client.addrlen = ai_ptr->ai_addrlen;
+  if (send_queue_tail == NULL)
+    send_queue_head = p;
+  else
+    send_queue_tail->next = p;
+  send_queue_tail = p;
+  send_queue_length++;
+
+  pthread_cond_signal (&send_queue_cond);
+  c_mutex_unlock (&send_queue_lock);
+} /* }}} void network_send_buffer */
+
+static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
+		value_list_t *vl_def,
+		const data_set_t *ds, const value_list_t *vl)
+{
+	char *buffer_orig = buffer;
+	uint64_t hash = 0;
+	uint32_t id = 0;
+	_Bool define = 0;
+	_Bool ref = 0;
+	/* Set if all strings have to be sent, regardless of "vl_def". */
+	_Bool full = 0;
+
+	if (network_config_dictionary)
+	{
+		hash = plugin_hash_vl (vl);
+		if (dict_lookup (hash, &id, &define) == 0)
+			ref = !define;
+		full = !ref;
+	}
+
+	if (ref)
+	{
+		/* The receiver takes the strings from the dictionary. */
+		sstrncpy (vl_def->host, vl->host, sizeof (vl_def->host));
+		sstrncpy (vl_def->plugin, vl->plugin, sizeof (vl_def->plugin));
+		sstrncpy (vl_def->plugin_instance, vl->plugin_instance,
+				sizeof (vl_def->plugin_instance));
+		sstrncpy (vl_def->type, vl->type, sizeof (vl_def->type));
+		sstrncpy (vl_def->type_instance, vl->type_instance,
+				sizeof (vl_def->type_instance));
+	}
+
+	if (full || (strcmp (vl_def->host, vl->host) != 0))
+	{
+		if (write_part_string (&buffer, &buffer_size, TYPE_HOST,
+					vl->host, strlen (vl->host)) != 0)
+			return (-1);
+		sstrncpy (vl_def->host, vl->host, sizeof (vl_def->host));
+	}
+
+	if (vl_def->time != vl->time)
+	{
+		if (write_part_number (&buffer, &buffer_size, TYPE_TIME_HR,
+					(uint64_t) vl->time))
+			return (-1);
+		vl_def->time = vl->time;
+	}
 
-			network_set_ttl (se, ai_ptr);
-			network_set_interface (se, ai_ptr);
+	if (vl_def->interval != vl->interval)
+	{
+		if (write_part_number (&buffer, &buffer_size, TYPE_INTERVAL_HR,
+					(uint64_t) vl->interval))
+			return (-1);
+		vl_def->interval = vl->interval;
+	}
 
-			/* We don't open more than one write-socket per
-			 * node/service pair.. */
-			break;
-		} /* }}} if (se->type == SOCKENT_TYPE_CLIENT) */
-	} /* for (ai_list) */
+	if (full || (strcmp (vl_def->plugin, vl->plugin) != 0))
+	{
+		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN,
+					vl->plugin, strlen (vl->plugin)) != 0)
+			return (-1);
+		sstrncpy (vl_def->plugin, vl->plugin, sizeof (vl_def->plugin));
+	}
 
-	freeaddrinfo (ai_list);
+	if (full || (strcmp (vl_def->plugin_instance, vl->plugin_instance) != 0))
+	{
+		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN_INSTANCE,
+					vl->plugin_instance,
+					strlen (vl->plugin_instance)) != 0)
+			return (-1);
+		sstrncpy (vl_def->plugin_instance, vl->plugin_instance, sizeof (vl_def->plugin_instance));
+	}
 
-	/* Check if all went well. */
-	if (se->type == SOCKENT_TYPE_SERVER)
+	if (full || (strcmp (vl_def->type, vl->type) != 0))
 	{
-		if (se->data.server.fd_num <= 0)
+		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE,
+					vl->type, strlen (vl->type)) != 0)
 			return (-1);
+		sstrncpy (vl_def->type, ds->type, sizeof (vl_def->type));
 	}
-	else /* if (se->type == SOCKENT_TYPE_CLIENT) */
+
+	if (full || (strcmp (vl_def->type_instance, vl->type_instance) != 0))
 	{
-		if (se->data.client.fd < 0)
+		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE_INSTANCE,
+					vl->type_instance,
+					strlen (vl->type_instance)) != 0)
 			return (-1);
+		sstrncpy (vl_def->type_instance, vl->type_instance, sizeof (vl_def->type_instance));
 	}
 
-	return (0);
-} /* }}} int sockent_open */
+	if ((define || ref)
+			&& (write_part_ident (&buffer, &buffer_size,
+					define ? TYPE_IDENT_DEFINE : TYPE_IDENT_REF,
+					id) != 0))
+		return (-1);
 
-/* Add a sockent to the global list of sockets */
-static int sockent_add (sockent_t *se) /* {{{ */
+	if (network_config_compact)
+	{
+		if (write_part_values_compact (&buffer, &buffer_size, ds, vl) != 0)
+			return (-1);
+	}
+	else if (write_part_values (&buffer, &buffer_size, ds, vl) != 0)
+		return (-1);
+
+	if (define || ref)
+		dict_commit (hash, define);
+
+	return (buffer - buffer_orig);
+} /* }}} int add_to_buffer */
+
+/* The caller must hold "sb->lock". */
+static void flush_buffer (send_buffer_t *sb)
 {
-	sockent_t *last_ptr;
+	DEBUG ("network plugin: flush_buffer: fill = %i", sb->fill);
 
-	if (se == NULL)
-		return (-1);
+	network_send_buffer (sb->buffer, (size_t) sb->fill);
 
-	if (se->type == SOCKENT_TYPE_SERVER)
-	{
-		struct pollfd *tmp;
-		size_t i;
+	(void) __sync_add_and_fetch (&stats_octets_tx, (derive_t) sb->fill);
+	(void) __sync_add_and_fetch (&stats_packets_tx, 1);
 
-		tmp = realloc (listen_sockets_pollfd,
-				sizeof (*tmp) * (listen_sockets_num
-					+ se->data.server.fd_num));
-		if (tmp == NULL)
-		{
-			ERROR ("network plugin: realloc failed.");
-			return (-1);
-		}
-		listen_sockets_pollfd = tmp;
-		tmp = listen_sockets_pollfd + listen_sockets_num;
+	network_init_buffer (sb);
+}
 
-		for (i = 0; i < se->data.server.fd_num; i++)
-		{
-			memset (tmp + i, 0, sizeof (*tmp));
-			tmp[i].fd = se->data.server.fd[i];
-			tmp[i].events = POLLIN | POLLPRI;
-			tmp[i].revents = 0;
-		}
+/* Called when a thread exits. Sends what is left in its buffer. */
+static void send_buffer_destroy (void *arg) /* {{{ */
+{
+	send_buffer_t *sb = arg;
+	send_buffer_t **ptr;
 
-		listen_sockets_num += se->data.server.fd_num;
+	if (sb == NULL)
+		return;
 
-		if (listen_sockets == NULL)
-		{
-			listen_sockets = se;
-			return (0);
-		}
-		last_ptr = listen_sockets;
-	}
-	else /* if (se->type == SOCKENT_TYPE_CLIENT) */
+	c_mutex_lock (&send_buffers_lock);
+	for (ptr = &send_buffers; *ptr != NULL; ptr = &(*ptr)->next)
 	{
-		if (sending_sockets == NULL)
+		if (*ptr == sb)
 		{
-			sending_sockets = se;
-			return (0);
+			*ptr = sb->next;
+			break;
 		}
-		last_ptr = sending_sockets;
 	}
+	c_mutex_unlock (&send_buffers_lock);
 
-	while (last_ptr->next != NULL)
-		last_ptr = last_ptr->next;
-	last_ptr->next = se;
+	c_mutex_lock (&sb->lock);
+	if (sb->fill > 0)
+		flush_buffer (sb);
+	c_mutex_unlock (&sb->lock);
 
-	return (0);
-} /* }}} int sockent_add */
+	c_mutex_destroy (&sb->lock);
+	sfree (sb->buffer);
+	sfree (sb);
+} /* }}} void send_buffer_destroy */
 
-static void *dispatch_thread (void __attribute__((unused)) *arg) /* {{{ */
+static void send_buffer_key_create (void) /* {{{ */
 {
-  while (42)
-  {
-    receive_list_entry_t *ent;
-    sockent_t *se;
+	pthread_key_create (&send_buffer_key, send_buffer_destroy);
+} /* }}} void send_buffer_key_create */
 
-    /* Lock and wait for more data to come in */
-    pthread_mutex_lock (&receive_list_lock);
-    while ((listen_loop == 0)
-        && (receive_list_head == NULL))
-      pthread_cond_wait (&receive_list_cond, &receive_list_lock);
-
-    /* Remove the head entry and unlock */
-    ent = receive_list_head;
-    if (ent != NULL)
-      receive_list_head = ent->next;
-    receive_list_length--;
-    pthread_mutex_unlock (&receive_list_lock);
+/* Returns the send buffer of the calling thread, creating it if needed. */
+static send_buffer_t *network_send_buffer_get (void) /* {{{ */
+{
+	send_buffer_t *sb;
 
-    /* Check whether we are supposed to exit. We do NOT check `listen_loop'
-     * because we dispatch all missing packets before shutting down. */
-    if (ent == NULL)
-      break;
+	pthread_once (&send_buffer_once, send_buffer_key_create);
+	sb = pthread_getspecific (send_buffer_key);
+	if (sb != NULL)
+		return (sb);
 
-    /* Look for the correct `sockent_t' */
-    se = listen_sockets;
-    while (se != NULL)
-    {
-      size_t i;
+	sb = calloc (1, sizeof (*sb));
+	if (sb == NULL)
+		return (NULL);
 
-      for (i = 0; i < se->data.server.fd_num; i++)
-        if (se->data.server.fd[i] == ent->fd)
-          break;
+	sb->buffer = malloc (network_config_packet_size);
+	if (sb->buffer == NULL)
+	{
+		sfree (sb);
+		return (NULL);
+	}
+	c_mutex_init (&sb->lock, "network-send_buffer");
+	network_init_buffer (sb);
 
-      if (i < se->data.server.fd_num)
-        break;
+	c_mutex_lock (&send_buffers_lock);
+	sb->next = send_buffers;
+	send_buffers = sb;
+	c_mutex_unlock (&send_buffers_lock);
 
-      se = se->next;
-    }
+	pthread_setspecific (send_buffer_key, sb);
+	return (sb);
+} /* }}} send_buffer_t *network_send_buffer_get */
 
-    if (se == NULL)
-    {
-      ERROR ("network plugin: Got packet from FD %i, but can't "
-          "find an appropriate socket entry.",
-          ent->fd);
-      sfree (ent->data);
-      sfree (ent);
-      continue;
-    }
+/* Sends the contents of all send buffers. */
+static void network_flush_all (void) /* {{{ */
+{
+	send_buffer_t *sb;
 
-    parse_packet (se, ent->data, ent->data_len, /* flags = */ 0,
-	/* username = */ NULL);
-    sfree (ent->data);
-    sfree (ent);
-  } /* while (42) */
+	c_mutex_lock (&send_buffers_lock);
+	for (sb = send_buffers; sb != NULL; sb = sb->next)
+	{
+		c_mutex_lock (&sb->lock);
+		if (sb->fill > 0)
+			flush_buffer (sb);
+		c_mutex_unlock (&sb->lock);
+	}
+	c_mutex_unlock (&send_buffers_lock);
+} /* }}} void network_flush_all */
 
-  return (NULL);
-} /* }}} void *dispatch_thread */
+/* Values handled per acquisition of a send buffer's lock. */
+#define NETWORK_WRITE_CHUNK 64
 
-static int network_receive (void) /* {{{ */
+/* Returns true if "vl" is to be sent and marks it as sent in the cache. */
+static _Bool network_write_prepare (const value_list_t *vl) /* {{{ */
 {
-	char buffer[network_config_packet_size];
-	int  buffer_len;
+	if (!check_send_okay (vl))
+	{
+#if COLLECT_DEBUG
+	  char name[6*DATA_MAX_NAME_LEN];
+	  FORMAT_VL (name, sizeof (name), vl);
+	  name[sizeof (name) - 1] = 0;
+	  DEBUG ("network plugin: network_write: "
+	      "NOT sending %s.", name);
+#endif
+	  /* Counter is not protected by another lock and may be reached by
+	   * multiple threads */
+	  pthread_mutex_lock (&stats_lock);
+	  stats_values_not_sent++;
+	  pthread_mutex_unlock (&stats_lock);
+	  return (0);
+	}
 
-	int i;
-	int status;
+	network_sent_set (vl);
 
-	receive_list_entry_t *private_list_head;
-	receive_list_entry_t *private_list_tail;
-	uint64_t              private_list_length;
+	return (1);
+} /* }}} _Bool network_write_prepare */
 
-        assert (listen_sockets_num > 0);
+/* Appends "vl" to "sb". The caller must hold "sb->lock". */
+static int network_write_nolock (send_buffer_t *sb, /* {{{ */
+		const data_set_t *ds, const value_list_t *vl)
+{
+	int status;
 
-	private_list_head = NULL;
-	private_list_tail = NULL;
-	private_list_length = 0;
+	status = add_to_buffer (sb->ptr,
+			network_config_packet_size - (sb->fill + BUFF_SIG_SIZE),
+			&sb->vl_def,
+			ds, vl);
+	if (status >= 0)
+	{
+		/* status == bytes added to the buffer */
+		sb->fill += status;
+		sb->ptr  += status;
 
-	while (listen_loop == 0)
+		(void) __sync_add_and_fetch (&stats_values_sent, 1);
+	}
+	else
 	{
-		status = poll (listen_sockets_pollfd, listen_sockets_num, -1);
+		flush_buffer (sb);
 
-		if (status <= 0)
-		{
-			char errbuf[1024];
-			if (errno == EINTR)
-				continue;
-			ERROR ("poll failed: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			return (-1);
-		}
+		status = add_to_buffer (sb->ptr,
+				network_config_packet_size - (sb->fill + BUFF_SIG_SIZE),
+				&sb->vl_def,
+				ds, vl);
 
-		for (i = 0; (i < listen_sockets_num) && (status > 0); i++)
+		if (status >= 0)
 		{
-			receive_list_entry_t *ent;
-
-			if ((listen_sockets_pollfd[i].revents
-						& (POLLIN | POLLPRI)) == 0)
-				continue;
-			status--;
-
-			buffer_len = recv (listen_sockets_pollfd[i].fd,
-					buffer, sizeof (buffer),
-					0 /* no flags */);
-			if (buffer_len < 0)
-			{
-				char errbuf[1024];
-				ERROR ("recv failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+			sb->fill += status;
+			sb->ptr  += status;
 
-			stats_octets_rx += ((uint64_t) buffer_len);
-			stats_packets_rx++;
+			(void) __sync_add_and_fetch (&stats_values_sent, 1);
+		}
+	}
 
-			/* TODO: Possible performance enhancement: Do not free
-			 * these entries in the dispatch thread but put them in
-			 * another list, so we don't have to allocate more and
-			 * more of these structures. */
-			ent = malloc (sizeof (receive_list_entry_t));
-			if (ent == NULL)
-			{
-				ERROR ("network plugin: malloc failed.");
-				return (-1);
-			}
-			memset (ent, 0, sizeof (receive_list_entry_t));
-			ent->data = malloc (network_config_packet_size);
-			if (ent->data == NULL)
-			{
-				sfree (ent);
-				ERROR ("network plugin: malloc failed.");
-				return (-1);
-			}
-			ent->fd = listen_sockets_pollfd[i].fd;
-			ent->next = NULL;
+	if (status < 0)
+	{
+		ERROR ("network plugin: Unable to append to the "
+				"buffer for some weird reason");
+	}
+	else if ((network_config_packet_size - sb->fill) < 15)
+	{
+		flush_buffer (sb);
+	}
 
-			memcpy (ent->data, buffer, buffer_len);
-			ent->data_len = buffer_len;
+	return ((status < 0) ? -1 : 0);
+} /* }}} int network_write_nolock */
 
-			if (private_list_head == NULL)
-				private_list_head = ent;
-			else
-				private_list_tail->next = ent;
-			private_list_tail = ent;
-			private_list_length++;
+static int network_write_batch (const plugin_write_item_t *items, /* {{{ */
+		size_t items_num, user_data_t __attribute__((unused)) *user_data)
+{
+	send_buffer_t *sb;
+	int ret = 0;
+	size_t offset;
 
-			/* Do not block here. Blocking here has led to
-			 * insufficient performance in the past. */
-			if (pthread_mutex_trylock (&receive_list_lock) == 0)
-			{
-				assert (((receive_list_head == NULL) && (receive_list_length == 0))
-						|| ((receive_list_head != NULL) && (receive_list_length != 0)));
-
-				if (receive_list_head == NULL)
-					receive_list_head = private_list_head;
-				else
-					receive_list_tail->next = private_list_head;
-				receive_list_tail = private_list_tail;
-				receive_list_length += private_list_length;
-
-				pthread_cond_signal (&receive_list_cond);
-				pthread_mutex_unlock (&receive_list_lock);
-
-				private_list_head = NULL;
-				private_list_tail = NULL;
-				private_list_length = 0;
-			}
-		} /* for (listen_sockets_pollfd) */
-	} /* while (listen_loop == 0) */
+	sb = network_send_buffer_get ();
+	if (sb == NULL)
+	{
+		ERROR ("network plugin: Allocating a send buffer failed.");
+		return (-1);
+	}
 
-	/* Make sure everything is dispatched before exiting. */
-	if (private_list_head != NULL)
+	for (offset = 0; offset < items_num; offset += NETWORK_WRITE_CHUNK)
 	{
-		pthread_mutex_lock (&receive_list_lock);
+		_Bool send[NETWORK_WRITE_CHUNK];
+		size_t chunk_num;
+		size_t i;
 
-		if (receive_list_head == NULL)
-			receive_list_head = private_list_head;
-		else
-			receive_list_tail->next = private_list_head;
-		receive_list_tail = private_list_tail;
-		receive_list_length += private_list_length;
+		chunk_num = items_num - offset;
+		if (chunk_num > NETWORK_WRITE_CHUNK)
+			chunk_num = NETWORK_WRITE_CHUNK;
 
-		private_list_head = NULL;
-		private_list_tail = NULL;
-		private_list_length = 0;
+		/* The cache has a lock of its own; don't take it while holding
+		 * the send buffer's lock. */
+		for (i = 0; i < chunk_num; i++)
+			send[i] = network_write_prepare (items[offset + i].vl);
+
+		c_mutex_lock (&sb->lock);
+		for (i = 0; i < chunk_num; i++)
+		{
+			if (!send[i])
+				continue;
 
-		pthread_cond_signal (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
+			if (network_write_nolock (sb, items[offset + i].ds,
+						items[offset + i].vl) != 0)
+				ret = -1;
+		}
+		c_mutex_unlock (&sb->lock);
 	}
 
-	return (0);
-} /* }}} int network_receive */
+	/* All write threads take values from the same queue, so the next
+	 * value of a series may be written by another thread. Holding on to
+	 * this one until the buffer is full would send them out of order. */
+	c_mutex_lock (&sb->lock);
+	if (sb->fill > 0)
+		flush_buffer (sb);
+	c_mutex_unlock (&sb->lock);
 
-static void *receive_thread (void __attribute__((unused)) *arg)
+	return (ret);
+} /* }}} int network_write_batch */
+
+static int network_config_set_boolean (const oconfig_item_t *ci, /* {{{ */
+    int *retval)
 {
-	return (network_receive () ? (void *) 1 : (void *) 0);
-} /* void *receive_thread */
+  if ((ci->values_num != 1)
+      || ((ci->values[0].type != OCONFIG_TYPE_BOOLEAN)
+        && (ci->values[0].type != OCONFIG_TYPE_STRING)))
+  {
+    ERROR ("network plugin: The `%s' config option needs "
+        "exactly one boolean argument.", ci->key);
+    return (-1);
+  }
+
+  if (ci->values[0].type == OCONFIG_TYPE_BOOLEAN)
+  {
+    if (ci->values[0].value.boolean)
+      *retval = 1;
+    else
+      *retval = 0;
+  }
+  else
+  {
+    char *str = ci->values[0].value.string;
+
+    if (IS_TRUE (str))
+      *retval = 1;
+    else if (IS_FALSE (str))
+      *retval = 0;
+    else
+    {
+      ERROR ("network plugin: Cannot parse string value `%s' of the `%s' "
+          "option as boolean value.",
+          str, ci->key);
+      return (-1);
+    }
+  }
 
-static void network_init_buffer (void)
+  return (0);
+} /* }}} int network_config_set_boolean */
+
+static int network_config_set_ttl (const oconfig_item_t *ci) /* {{{ */
 {
-	memset (send_buffer, 0, network_config_packet_size);
-	send_buffer_ptr = send_buffer;
-	send_buffer_fill = 0;
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `TimeToLive' config option needs exactly "
+        "one numeric argument.");
+    return (-1);
+  }
+
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp > 0) && (tmp <= 255))
+    network_config_ttl = tmp;
 
-	memset (&send_buffer_vl, 0, sizeof (send_buffer_vl));
-} /* int network_init_buffer */
+  return (0);
+} /* }}} int network_config_set_ttl */
 
-static void networt_send_buffer_plain (const sockent_t *se, /* {{{ */
-		const char *buffer, size_t buffer_size)
+static int network_config_set_interface (const oconfig_item_t *ci, /* {{{ */
+    int *interface)
 {
-	int status;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `Interface' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
 
-	while (42)
-	{
-		status = sendto (se->data.client.fd, buffer, buffer_size,
-                    /* flags = */ 0,
-                    (struct sockaddr *) se->data.client.addr,
-                    se->data.client.addrlen);
-                if (status < 0)
-		{
-			char errbuf[1024];
-			if (errno == EINTR)
-				continue;
-			ERROR ("network plugin: sendto failed: %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			break;
-		}
+  if (interface == NULL)
+    return (-1);
 
-		break;
-	} /* while (42) */
-} /* }}} void networt_send_buffer_plain */
+  *interface = if_nametoindex (ci->values[0].value.string);
 
-#if HAVE_LIBGCRYPT
-#define BUFFER_ADD(p,s) do { \
-  memcpy (buffer + buffer_offset, (p), (s)); \
-  buffer_offset += (s); \
-} while (0)
+  return (0);
+} /* }}} int network_config_set_interface */
 
-static void networt_send_buffer_signed (const sockent_t *se, /* {{{ */
-		const char *in_buffer, size_t in_buffer_size)
+static int network_config_set_receive_threads (const oconfig_item_t *ci, /* {{{ */
+    int *ret_threads)
 {
-  part_signature_sha256_t ps;
-  char buffer[BUFF_SIG_SIZE + in_buffer_size];
-  size_t buffer_offset;
-  size_t username_len;
-
-  gcry_md_hd_t hd;
-  gcry_error_t err;
-  unsigned char *hash;
+  int tmp;
 
-  hd = NULL;
-  err = gcry_md_open (&hd, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
-  if (err != 0)
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
   {
-    ERROR ("network plugin: Creating HMAC object failed: %s",
-        gcry_strerror (err));
-    return;
+    WARNING ("network plugin: The `ReceiveThreads' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
   }
 
-  err = gcry_md_setkey (hd, se->data.client.password,
-      strlen (se->data.client.password));
-  if (err != 0)
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 1) || (tmp > 64))
   {
-    ERROR ("network plugin: gcry_md_setkey failed: %s",
-        gcry_strerror (err));
-    gcry_md_close (hd);
-    return;
+    WARNING ("network plugin: `ReceiveThreads' must be between 1 and 64.");
+    return (-1);
   }
-
-  username_len = strlen (se->data.client.username);
-  if (username_len > (BUFF_SIG_SIZE - PART_SIGNATURE_SHA256_SIZE))
+#ifndef SO_REUSEPORT
+  if (tmp > 1)
   {
-    ERROR ("network plugin: Username too long: %s",
-        se->data.client.username);
-    return;
+    WARNING ("network plugin: `ReceiveThreads' is greater than one, but "
+        "SO_REUSEPORT isn't available. Using one thread.");
+    tmp = 1;
   }
+#endif
+  *ret_threads = tmp;
 
-  memcpy (buffer + PART_SIGNATURE_SHA256_SIZE,
-      se->data.client.username, username_len);
-  memcpy (buffer + PART_SIGNATURE_SHA256_SIZE + username_len,
-      in_buffer, in_buffer_size);
+  return (0);
+} /* }}} int network_config_set_receive_threads */
 
-  /* Initialize the `ps' structure. */
-  memset (&ps, 0, sizeof (ps));
-  ps.head.type = htons (TYPE_SIGN_SHA256);
-  ps.head.length = htons (PART_SIGNATURE_SHA256_SIZE + username_len);
+static int network_config_set_dispatch_threads (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
 
-  /* Calculate the hash value. */
-  gcry_md_write (hd, buffer + PART_SIGNATURE_SHA256_SIZE,
-      username_len + in_buffer_size);
-  hash = gcry_md_read (hd, GCRY_MD_SHA256);
-  if (hash == NULL)
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
   {
-    ERROR ("network plugin: gcry_md_read failed.");
-    gcry_md_close (hd);
-    return;
+    WARNING ("network plugin: The `DispatchThreads' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
   }
-  memcpy (ps.hash, hash, sizeof (ps.hash));
-
-  /* Add the header */
-  buffer_offset = 0;
-
-  BUFFER_ADD (&ps.head.type, sizeof (ps.head.type));
-  BUFFER_ADD (&ps.head.length, sizeof (ps.head.length));
-  BUFFER_ADD (ps.hash, sizeof (ps.hash));
-
-  assert (buffer_offset == PART_SIGNATURE_SHA256_SIZE);
 
-  gcry_md_close (hd);
-  hd = NULL;
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 1) || (tmp > 64))
+  {
+    WARNING ("network plugin: `DispatchThreads' must be between 1 and 64.");
+    return (-1);
+  }
+  network_config_dispatch_threads = tmp;
 
-  buffer_offset = PART_SIGNATURE_SHA256_SIZE + username_len + in_buffer_size;
-  networt_send_buffer_plain (se, buffer, buffer_offset);
-} /* }}} void networt_send_buffer_signed */
+  return (0);
+} /* }}} int network_config_set_dispatch_threads */
 
-static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
-		const char *in_buffer, size_t in_buffer_size)
+static int network_config_set_cpus (const oconfig_item_t *ci, /* {{{ */
+    c_cpusets_t **ret_cpus)
 {
-  part_encryption_aes256_t pea;
-  char buffer[BUFF_SIG_SIZE + in_buffer_size];
-  size_t buffer_size;
-  size_t buffer_offset;
-  size_t header_size;
-  size_t username_len;
-  gcry_error_t err;
-  gcry_cipher_hd_t cypher;
+  c_cpusets_t *cpus;
 
-  /* Initialize the header fields */
-  memset (&pea, 0, sizeof (pea));
-  pea.head.type = htons (TYPE_ENCR_AES256);
-
-  pea.username = se->data.client.username;
-
-  username_len = strlen (pea.username);
-  if ((PART_ENCRYPTION_AES256_SIZE + username_len) > BUFF_SIG_SIZE)
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
   {
-    ERROR ("network plugin: Username too long: %s", pea.username);
-    return;
+    WARNING ("network plugin: The `%s' config option needs "
+        "exactly one string argument.", ci->key);
+    return (-1);
   }
 
-  buffer_size = PART_ENCRYPTION_AES256_SIZE + username_len + in_buffer_size;
-  header_size = PART_ENCRYPTION_AES256_SIZE + username_len
-    - sizeof (pea.hash);
-
-  assert (buffer_size <= sizeof (buffer));
-  DEBUG ("network plugin: networt_send_buffer_encrypted: "
-      "buffer_size = %zu;", buffer_size);
+  /* c_cpusets_parse() logs the error. */
+  cpus = c_cpusets_parse (ci->values[0].value.string);
+  if (cpus == NULL)
+    return (-1);
 
-  pea.head.length = htons ((uint16_t) (PART_ENCRYPTION_AES256_SIZE
-        + username_len + in_buffer_size));
-  pea.username_length = htons ((uint16_t) username_len);
+  c_cpusets_destroy (*ret_cpus);
+  *ret_cpus = cpus;
 
-  /* Chose a random initialization vector. */
-  gcry_randomize ((void *) &pea.iv, sizeof (pea.iv), GCRY_STRONG_RANDOM);
+  return (0);
+} /* }}} int network_config_set_cpus */
 
-  /* Create hash of the payload */
-  gcry_md_hash_buffer (GCRY_MD_SHA1, pea.hash, in_buffer, in_buffer_size);
+static int network_config_set_receive_buffers (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
 
-  /* Initialize the buffer */
-  buffer_offset = 0;
-  memset (buffer, 0, sizeof (buffer));
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `ReceiveBuffers' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
+  }
 
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 16) || (tmp > 1048576))
+  {
+    WARNING ("network plugin: `ReceiveBuffers' must be between 16 and "
+        "1048576.");
+    return (-1);
+  }
+  network_config_receive_buffers = tmp;
 
-  BUFFER_ADD (&pea.head.type, sizeof (pea.head.type));
-  BUFFER_ADD (&pea.head.length, sizeof (pea.head.length));
-  BUFFER_ADD (&pea.username_length, sizeof (pea.username_length));
-  BUFFER_ADD (pea.username, username_len);
-  BUFFER_ADD (pea.iv, sizeof (pea.iv));
-  assert (buffer_offset == header_size);
-  BUFFER_ADD (pea.hash, sizeof (pea.hash));
-  BUFFER_ADD (in_buffer, in_buffer_size);
+  return (0);
+} /* }}} int network_config_set_receive_buffers */
 
-  assert (buffer_offset == buffer_size);
+static int network_config_set_source_stats (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
 
-  cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv),
-      se->data.client.password);
-  if (cypher == NULL)
-    return;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `SourceStats' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
+  }
 
-  /* Encrypt the buffer in-place */
-  err = gcry_cipher_encrypt (cypher,
-      buffer      + header_size,
-      buffer_size - header_size,
-      /* in = */ NULL, /* in len = */ 0);
-  if (err != 0)
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 0) || (tmp > 65536))
   {
-    ERROR ("network plugin: gcry_cipher_encrypt returned: %s",
-        gcry_strerror (err));
-    return;
+    WARNING ("network plugin: `SourceStats' must be between 0 and 65536.");
+    return (-1);
   }
+  network_config_source_stats = tmp;
 
-  /* Send it out without further modifications */
-  networt_send_buffer_plain (se, buffer, buffer_size);
-} /* }}} void networt_send_buffer_encrypted */
-#undef BUFFER_ADD
-#endif /* HAVE_LIBGCRYPT */
+  return (0);
+} /* }}} int network_config_set_source_stats */
 
-static void network_send_buffer (char *buffer, size_t buffer_len) /* {{{ */
+static int network_config_set_batch_size (const oconfig_item_t *ci) /* {{{ */
 {
-  sockent_t *se;
-
-  DEBUG ("network plugin: network_send_buffer: buffer_len = %zu", buffer_len);
-
-  for (se = sending_sockets; se != NULL; se = se->next)
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
   {
-#if HAVE_LIBGCRYPT
-    if (se->data.client.security_level == SECURITY_LEVEL_ENCRYPT)
-      networt_send_buffer_encrypted (se, buffer, buffer_len);
-    else if (se->data.client.security_level == SECURITY_LEVEL_SIGN)
-      networt_send_buffer_signed (se, buffer, buffer_len);
-    else /* if (se->data.client.security_level == SECURITY_LEVEL_NONE) */
-#endif /* HAVE_LIBGCRYPT */
-      networt_send_buffer_plain (se, buffer, buffer_len);
-  } /* for (sending_sockets) */
-} /* }}} void network_send_buffer */
+    WARNING ("network plugin: The `ReceiveBatchSize' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
+  }
 
-static int add_to_buffer (char *buffer, int buffer_size, /* {{{ */
-		value_list_t *vl_def,
-		const data_set_t *ds, const value_list_t *vl)
-{
-	char *buffer_orig = buffer;
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 1) || (tmp > 1024))
+  {
+    WARNING ("network plugin: `ReceiveBatchSize' must be between 1 and "
+        "1024.");
+    return (-1);
+  }
+#if !HAVE_RECVMMSG
+  if (tmp > 1)
+  {
+    WARNING ("network plugin: `ReceiveBatchSize' is greater than one, but "
+        "recvmmsg(2) isn't available. Packets will be read one by one.");
+    tmp = 1;
+  }
+#endif
+  network_config_batch_size = tmp;
 
-	if (strcmp (vl_def->host, vl->host) != 0)
-	{
-		if (write_part_string (&buffer, &buffer_size, TYPE_HOST,
-					vl->host, strlen (vl->host)) != 0)
-			return (-1);
-		sstrncpy (vl_def->host, vl->host, sizeof (vl_def->host));
-	}
+  return (0);
+} /* }}} int network_config_set_batch_size */
 
-	if (vl_def->time != vl->time)
-	{
-		if (write_part_number (&buffer, &buffer_size, TYPE_TIME_HR,
-					(uint64_t) vl->time))
-			return (-1);
-		vl_def->time = vl->time;
-	}
+static int network_config_set_keyframe_interval ( /* {{{ */
+    const oconfig_item_t *ci)
+{
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `CompactKeyframeInterval' config option "
+        "needs exactly one numeric argument.");
+    return (-1);
+  }
 
-	if (vl_def->interval != vl->interval)
-	{
-		if (write_part_number (&buffer, &buffer_size, TYPE_INTERVAL_HR,
-					(uint64_t) vl->interval))
-			return (-1);
-		vl_def->interval = vl->interval;
-	}
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 1) || (tmp > 65536))
+  {
+    WARNING ("network plugin: `CompactKeyframeInterval' must be between 1 "
+        "and 65536.");
+    return (-1);
+  }
+  network_config_keyframe_interval = tmp;
 
-	if (strcmp (vl_def->plugin, vl->plugin) != 0)
-	{
-		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN,
-					vl->plugin, strlen (vl->plugin)) != 0)
-			return (-1);
-		sstrncpy (vl_def->plugin, vl->plugin, sizeof (vl_def->plugin));
-	}
+  return (0);
+} /* }}} int network_config_set_keyframe_interval */
 
-	if (strcmp (vl_def->plugin_instance, vl->plugin_instance) != 0)
-	{
-		if (write_part_string (&buffer, &buffer_size, TYPE_PLUGIN_INSTANCE,
-					vl->plugin_instance,
-					strlen (vl->plugin_instance)) != 0)
-			return (-1);
-		sstrncpy (vl_def->plugin_instance, vl->plugin_instance, sizeof (vl_def->plugin_instance));
-	}
+static int network_config_set_dictionary_refresh ( /* {{{ */
+    const oconfig_item_t *ci)
+{
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `IdentifierRefreshInterval' config option "
+        "needs exactly one numeric argument.");
+    return (-1);
+  }
 
-	if (strcmp (vl_def->type, vl->type) != 0)
-	{
-		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE,
-					vl->type, strlen (vl->type)) != 0)
-			return (-1);
-		sstrncpy (vl_def->type, ds->type, sizeof (vl_def->type));
-	}
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp < 1) || (tmp > 65536))
+  {
+    WARNING ("network plugin: `IdentifierRefreshInterval' must be between 1 "
+        "and 65536.");
+    return (-1);
+  }
+  network_config_dictionary_refresh = tmp;
 
-	if (strcmp (vl_def->type_instance, vl->type_instance) != 0)
-	{
-		if (write_part_string (&buffer, &buffer_size, TYPE_TYPE_INSTANCE,
-					vl->type_instance,
-					strlen (vl->type_instance)) != 0)
-			return (-1);
-		sstrncpy (vl_def->type_instance, vl->type_instance, sizeof (vl_def->type_instance));
-	}
+  return (0);
+} /* }}} int network_config_set_dictionary_refresh */
 
-	if (write_part_values (&buffer, &buffer_size, ds, vl) != 0)
-		return (-1);
+static int network_config_set_buffer_size (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `MaxPacketSize' config option needs exactly "
+        "one numeric argument.");
+    return (-1);
+  }
 
-	return (buffer - buffer_orig);
-} /* }}} int add_to_buffer */
+  tmp = (int) ci->values[0].value.number;
+  if ((tmp >= 1024) && (tmp <= 65535))
+    network_config_packet_size = tmp;
+
+  return (0);
+} /* }}} int network_config_set_buffer_size */
 
-static void flush_buffer (void)
+#if HAVE_LIBGCRYPT
+static int network_config_set_string (const oconfig_item_t *ci, /* {{{ */
+    char **ret_string)
 {
-	DEBUG ("network plugin: flush_buffer: send_buffer_fill = %i",
-			send_buffer_fill);
+  char *tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `%s' config option needs exactly "
+        "one string argument.", ci->key);
+    return (-1);
+  }
 
-	network_send_buffer (send_buffer, (size_t) send_buffer_fill);
+  tmp = strdup (ci->values[0].value.string);
+  if (tmp == NULL)
+    return (-1);
 
-	stats_octets_tx += ((uint64_t) send_buffer_fill);
-	stats_packets_tx++;
+  sfree (*ret_string);
+  *ret_string = tmp;
 
-	network_init_buffer ();
-}
+  return (0);
+} /* }}} int network_config_set_string */
+#endif /* HAVE_LIBGCRYPT */
 
-static int network_write (const data_set_t *ds, const value_list_t *vl,
-		user_data_t __attribute__((unused)) *user_data)
+#if HAVE_LIBGCRYPT
+static int network_config_set_security_level (oconfig_item_t *ci, /* {{{ */
+    int *retval)
 {
-	int status;
+  char *str;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `SecurityLevel' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
 
-	if (!check_send_okay (vl))
-	{
-#if COLLECT_DEBUG
-	  char name[6*DATA_MAX_NAME_LEN];
-	  FORMAT_VL (name, sizeof (name), vl);
-	  name[sizeof (name) - 1] = 0;
-	  DEBUG ("network plugin: network_write: "
-	      "NOT sending %s.", name);
-#endif
-	  /* Counter is not protected by another lock and may be reached by
-	   * multiple threads */
-	  pthread_mutex_lock (&stats_lock);
-	  stats_values_not_sent++;
-	  pthread_mutex_unlock (&stats_lock);
-	  return (0);
-	}
+  str = ci->values[0].value.string;
+  if (strcasecmp ("Encrypt", str) == 0)
+    *retval = SECURITY_LEVEL_ENCRYPT;
+  else if (strcasecmp ("Sign", str) == 0)
+    *retval = SECURITY_LEVEL_SIGN;
+  else if (strcasecmp ("None", str) == 0)
+    *retval = SECURITY_LEVEL_NONE;
+  else
+  {
+    WARNING ("network plugin: Unknown security level: %s.", str);
+    return (-1);
+  }
 
-	uc_meta_data_add_unsigned_int (vl,
-	    "network:time_sent", (uint64_t) vl->time);
+  return (0);
+} /* }}} int network_config_set_security_level */
+#endif /* HAVE_LIBGCRYPT */
 
-	pthread_mutex_lock (&send_buffer_lock);
+static int network_config_set_protocol (oconfig_item_t *ci, /* {{{ */
+    int *retval)
+{
+  char *str;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `Protocol' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
 
-	status = add_to_buffer (send_buffer_ptr,
-			network_config_packet_size - (send_buffer_fill + BUFF_SIG_SIZE),
-			&send_buffer_vl,
-			ds, vl);
-	if (status >= 0)
-	{
-		/* status == bytes added to the buffer */
-		send_buffer_fill += status;
-		send_buffer_ptr  += status;
+  str = ci->values[0].value.string;
+  if (strcasecmp ("UDP", str) == 0)
+    *retval = NETWORK_PROTOCOL_UDP;
+  else if (strcasecmp ("TCP", str) == 0)
+    *retval = NETWORK_PROTOCOL_TCP;
+  else
+  {
+    WARNING ("network plugin: Unknown protocol: %s.", str);
+    return (-1);
+  }
 
-		stats_values_sent++;
-	}
-	else
-	{
-		flush_buffer ();
+  return (0);
+} /* }}} int network_config_set_protocol */
 
-		status = add_to_buffer (send_buffer_ptr,
-				network_config_packet_size - (send_buffer_fill + BUFF_SIG_SIZE),
-				&send_buffer_vl,
-				ds, vl);
+static int network_config_set_compression (oconfig_item_t *ci, /* {{{ */
+    int *retval)
+{
+  char *str;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `Compression' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
 
-		if (status >= 0)
-		{
-			send_buffer_fill += status;
-			send_buffer_ptr  += status;
+  str = ci->values[0].value.string;
+  if (strcasecmp ("None", str) == 0)
+    *retval = COMPRESSION_NONE;
+#if HAVE_LIBZ
+  else if (strcasecmp ("Zlib", str) == 0)
+    *retval = COMPRESSION_ZLIB;
+#endif
+  else
+  {
+    WARNING ("network plugin: Unknown or unsupported compression: %s.",
+        str);
+    return (-1);
+  }
 
-			stats_values_sent++;
-		}
-	}
+  return (0);
+} /* }}} int network_config_set_compression */
 
-	if (status < 0)
-	{
-		ERROR ("network plugin: Unable to append to the "
-				"buffer for some weird reason");
-	}
-	else if ((network_config_packet_size - send_buffer_fill) < 15)
-	{
-		flush_buffer ();
-	}
+static int network_config_set_priority (const oconfig_item_t *ci, /* {{{ */
+    int *retval)
+{
+  char *str;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  {
+    WARNING ("network plugin: The `Priority' config option needs exactly "
+        "one string argument.");
+    return (-1);
+  }
 
-	pthread_mutex_unlock (&send_buffer_lock);
+  str = ci->values[0].value.string;
+  if (strcasecmp ("Low", str) == 0)
+    *retval = PRIORITY_LOW;
+  else if (strcasecmp ("Normal", str) == 0)
+    *retval = PRIORITY_NORMAL;
+  else if (strcasecmp ("High", str) == 0)
+    *retval = PRIORITY_HIGH;
+  else
+  {
+    WARNING ("network plugin: Unknown priority: %s.", str);
+    return (-1);
+  }
 
-	return ((status < 0) ? -1 : 0);
-} /* int network_write */
+  return (0);
+} /* }}} int network_config_set_priority */
 
-static int network_config_set_boolean (const oconfig_item_t *ci, /* {{{ */
-    int *retval)
+static int network_config_set_max_queued (const oconfig_item_t *ci, /* {{{ */
+    uint64_t *retval)
 {
   if ((ci->values_num != 1)
-      || ((ci->values[0].type != OCONFIG_TYPE_BOOLEAN)
-        && (ci->values[0].type != OCONFIG_TYPE_STRING)))
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER)
+      || (ci->values[0].value.number < 0.0))
   {
-    ERROR ("network plugin: The `%s' config option needs "
-        "exactly one boolean argument.", ci->key);
+    WARNING ("network plugin: The `%s' config option needs exactly one "
+        "non-negative numeric argument.", ci->key);
     return (-1);
   }
 
-  if (ci->values[0].type == OCONFIG_TYPE_BOOLEAN)
+  *retval = (uint64_t) ci->values[0].value.number;
+
+  return (0);
+} /* }}} int network_config_set_max_queued */
+
+/* Adds a <Priority /> block to "priority_lookup". The selectors work like
+ * those of the aggregation plugin: strings enclosed in slashes are regular
+ * expressions, the type must be given literally. */
+static int network_config_add_priority (const oconfig_item_t *ci) /* {{{ */
+{
+  identifier_t ident;
+  int *priority;
+  int status;
+  int i;
+
+  priority = malloc (sizeof (*priority));
+  if (priority == NULL)
   {
-    if (ci->values[0].value.boolean)
-      *retval = 1;
-    else
-      *retval = 0;
+    ERROR ("network plugin: malloc failed.");
+    return (-1);
   }
-  else
+
+  if (network_config_set_priority (ci, priority) != 0)
   {
-    char *str = ci->values[0].value.string;
+    sfree (priority);
+    return (-1);
+  }
 
-    if (IS_TRUE (str))
-      *retval = 1;
-    else if (IS_FALSE (str))
-      *retval = 0;
+  memset (&ident, 0, sizeof (ident));
+  sstrncpy (ident.host, "/.*/", sizeof (ident.host));
+  sstrncpy (ident.plugin, "/.*/", sizeof (ident.plugin));
+  sstrncpy (ident.plugin_instance, "/.*/", sizeof (ident.plugin_instance));
+  sstrncpy (ident.type_instance, "/.*/", sizeof (ident.type_instance));
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Host", child->key) == 0)
+      cf_util_get_string_buffer (child, ident.host, sizeof (ident.host));
+    else if (strcasecmp ("Plugin", child->key) == 0)
+      cf_util_get_string_buffer (child, ident.plugin, sizeof (ident.plugin));
+    else if (strcasecmp ("PluginInstance", child->key) == 0)
+      cf_util_get_string_buffer (child, ident.plugin_instance,
+          sizeof (ident.plugin_instance));
+    else if (strcasecmp ("Type", child->key) == 0)
+      cf_util_get_string_buffer (child, ident.type, sizeof (ident.type));
+    else if (strcasecmp ("TypeInstance", child->key) == 0)
+      cf_util_get_string_buffer (child, ident.type_instance,
+          sizeof (ident.type_instance));
     else
+      WARNING ("network plugin: Option `%s' is not allowed inside "
+          "<Priority /> blocks.", child->key);
+  }
+
+  if ((ident.type[0] == 0) || (ident.type[0] == '/'))
+  {
+    ERROR ("network plugin: <Priority /> blocks need a `Type' option, "
+        "which must not be a regular expression.");
+    sfree (priority);
+    return (-1);
+  }
+
+  if (priority_lookup == NULL)
+  {
+    priority_lookup = lookup_create (priority_class_callback,
+        priority_obj_callback, /* free_class = */ free,
+        /* free_obj = */ NULL);
+    if (priority_lookup == NULL)
     {
-      ERROR ("network plugin: Cannot parse string value `%s' of the `%s' "
-          "option as boolean value.",
-          str, ci->key);
+      ERROR ("network plugin: lookup_create failed.");
+      sfree (priority);
       return (-1);
     }
   }
 
+  status = lookup_add (priority_lookup, &ident, /* group_by = */ 0, priority);
+  if (status != 0)
+  {
+    ERROR ("network plugin: lookup_add failed with status %i.", status);
+    sfree (priority);
+    return (-1);
+  }
+
   return (0);
-} /* }}} int network_config_set_boolean */
+} /* }}} int network_config_add_priority */
 
-static int network_config_set_ttl (const oconfig_item_t *ci) /* {{{ */
+/* Strings enclosed in slashes are regular expressions, like in the
+ * <Priority /> blocks. */
+static int filter_selector_set (const oconfig_item_t *ci, /* {{{ */
+    filter_selector_t *fs)
 {
-  int tmp;
-  if ((ci->values_num != 1)
-      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  char *str = NULL;
+  size_t len;
+  int status;
+
+  if (cf_util_get_string (ci, &str) != 0)
+    return (-1);
+
+  filter_selector_free (fs);
+
+  len = strlen (str);
+  if ((len < 2) || (str[0] != '/') || (str[len - 1] != '/'))
   {
-    WARNING ("network plugin: The `TimeToLive' config option needs exactly "
-        "one numeric argument.");
+    fs->kind = FILTER_LITERAL;
+    fs->literal = str;
+    return (0);
+  }
+
+  str[len - 1] = 0;
+  status = regcomp (&fs->regex, str + 1, REG_EXTENDED | REG_NOSUB);
+  if (status != 0)
+  {
+    char errbuf[1024];
+    regerror (status, &fs->regex, errbuf, sizeof (errbuf));
+    ERROR ("network plugin: Compiling the regular expression \"%s\" "
+        "failed: %s", str + 1, errbuf);
+    sfree (str);
     return (-1);
   }
+  fs->kind = FILTER_REGEX;
+  sfree (str);
 
-  tmp = (int) ci->values[0].value.number;
-  if ((tmp > 0) && (tmp <= 255))
-    network_config_ttl = tmp;
+  return (0);
+} /* }}} int filter_selector_set */
+
+static int filter_index_append (filter_index_t *index, /* {{{ */
+    size_t rule)
+{
+  size_t *tmp;
+
+  tmp = realloc (index->rules, sizeof (*tmp) * (index->rules_num + 1));
+  if (tmp == NULL)
+    return (ENOMEM);
+  index->rules = tmp;
+  index->rules[index->rules_num] = rule;
+  index->rules_num++;
 
   return (0);
-} /* }}} int network_config_set_ttl */
+} /* }}} int filter_index_append */
 
-static int network_config_set_interface (const oconfig_item_t *ci, /* {{{ */
-    int *interface)
+/* Adds rule number "rule" to the index of "f", under its plugin if that is
+ * given literally. */
+static int network_filter_index (filter_t *f, size_t rule) /* {{{ */
 {
-  if ((ci->values_num != 1)
-      || (ci->values[0].type != OCONFIG_TYPE_STRING))
-  {
-    WARNING ("network plugin: The `Interface' config option needs exactly "
-        "one string argument.");
-    return (-1);
+  filter_rule_t *r = f->rules + rule;
+  filter_index_t *index = NULL;
+  char *key;
+
+  if (r->plugin.kind != FILTER_LITERAL)
+    return (filter_index_append (&f->any_plugin, rule));
+
+  if (c_avl_get (f->by_plugin, r->plugin.literal, (void *) &index) == 0)
+    return (filter_index_append (index, rule));
+
+  key = strdup (r->plugin.literal);
+  index = calloc (1, sizeof (*index));
+  if ((key == NULL) || (index == NULL)
+      || (filter_index_append (index, rule) != 0))
+  {
+    sfree (key);
+    sfree (index);
+    return (ENOMEM);
   }
 
-  if (interface == NULL)
+  if (c_avl_insert (f->by_plugin, key, index) != 0)
+  {
+    sfree (index->rules);
+    sfree (index);
+    sfree (key);
     return (-1);
-
-  *interface = if_nametoindex (ci->values[0].value.string);
+  }
 
   return (0);
-} /* }}} int network_config_set_interface */
+} /* }}} int network_filter_index */
 
-static int network_config_set_buffer_size (const oconfig_item_t *ci) /* {{{ */
+/* Adds an <Allow /> or <Deny /> block to the rules of a <Listen /> socket. */
+static int network_config_add_filter (const oconfig_item_t *ci, /* {{{ */
+    filter_t **ret_filter)
 {
-  int tmp;
-  if ((ci->values_num != 1)
-      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  filter_t *f = *ret_filter;
+  filter_rule_t *r;
+  filter_rule_t *tmp;
+  int status = 0;
+  int i;
+
+  if ((ci->values_num > 1)
+      || ((ci->values_num == 1)
+        && (ci->values[0].type != OCONFIG_TYPE_STRING)))
   {
-    WARNING ("network plugin: The `MaxPacketSize' config option needs exactly "
-        "one numeric argument.");
+    ERROR ("network plugin: <%s /> blocks take at most one string "
+        "argument, the name of the rule.", ci->key);
     return (-1);
   }
 
-  tmp = (int) ci->values[0].value.number;
-  if ((tmp >= 1024) && (tmp <= 65535))
-    network_config_packet_size = tmp;
+  if (f == NULL)
+  {
+    f = calloc (1, sizeof (*f));
+    if (f == NULL)
+      return (ENOMEM);
+    f->by_plugin = c_avl_create ((void *) strcmp);
+    if (f->by_plugin == NULL)
+    {
+      sfree (f);
+      return (ENOMEM);
+    }
+    *ret_filter = f;
+  }
 
-  return (0);
-} /* }}} int network_config_set_buffer_size */
+  tmp = realloc (f->rules, sizeof (*tmp) * (f->rules_num + 1));
+  if (tmp == NULL)
+    return (ENOMEM);
+  f->rules = tmp;
 
-#if HAVE_LIBGCRYPT
-static int network_config_set_string (const oconfig_item_t *ci, /* {{{ */
-    char **ret_string)
-{
-  char *tmp;
-  if ((ci->values_num != 1)
-      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  r = f->rules + f->rules_num;
+  memset (r, 0, sizeof (*r));
+  r->deny = (strcasecmp ("Deny", ci->key) == 0);
+
+  if (ci->values_num == 1)
+    r->name = strdup (ci->values[0].value.string);
+  else
   {
-    WARNING ("network plugin: The `%s' config option needs exactly "
-        "one string argument.", ci->key);
-    return (-1);
+    char name[DATA_MAX_NAME_LEN];
+    ssnprintf (name, sizeof (name), "rule%zu", f->rules_num + 1);
+    r->name = strdup (name);
   }
+  if (r->name == NULL)
+    return (ENOMEM);
 
-  tmp = strdup (ci->values[0].value.string);
-  if (tmp == NULL)
-    return (-1);
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
 
-  sfree (*ret_string);
-  *ret_string = tmp;
+    if (strcasecmp ("Host", child->key) == 0)
+      status = filter_selector_set (child, &r->host);
+    else if (strcasecmp ("Plugin", child->key) == 0)
+      status = filter_selector_set (child, &r->plugin);
+    else if (strcasecmp ("Type", child->key) == 0)
+      status = filter_selector_set (child, &r->type);
+    else
+    {
+      WARNING ("network plugin: Option `%s' is not allowed inside "
+          "<%s /> blocks.", child->key, ci->key);
+      continue;
+    }
 
-  return (0);
-} /* }}} int network_config_set_string */
-#endif /* HAVE_LIBGCRYPT */
+    if (status != 0)
+      break;
+  }
 
-#if HAVE_LIBGCRYPT
-static int network_config_set_security_level (oconfig_item_t *ci, /* {{{ */
-    int *retval)
-{
-  char *str;
-  if ((ci->values_num != 1)
-      || (ci->values[0].type != OCONFIG_TYPE_STRING))
+  if ((status == 0)
+      && (network_filter_index (f, f->rules_num) != 0))
   {
-    WARNING ("network plugin: The `SecurityLevel' config option needs exactly "
-        "one string argument.");
-    return (-1);
+    ERROR ("network plugin: Indexing the <%s /> block failed.", ci->key);
+    status = -1;
   }
 
-  str = ci->values[0].value.string;
-  if (strcasecmp ("Encrypt", str) == 0)
-    *retval = SECURITY_LEVEL_ENCRYPT;
-  else if (strcasecmp ("Sign", str) == 0)
-    *retval = SECURITY_LEVEL_SIGN;
-  else if (strcasecmp ("None", str) == 0)
-    *retval = SECURITY_LEVEL_NONE;
-  else
+  if (status != 0)
   {
-    WARNING ("network plugin: Unknown security level: %s.", str);
+    sfree (r->name);
+    filter_selector_free (&r->host);
+    filter_selector_free (&r->plugin);
+    filter_selector_free (&r->type);
     return (-1);
   }
 
+  f->rules_num++;
   return (0);
-} /* }}} int network_config_set_security_level */
-#endif /* HAVE_LIBGCRYPT */
+} /* }}} int network_config_add_filter */
 
 static int network_config_add_listen (const oconfig_item_t *ci) /* {{{ */
 {
@@ -3016,6 +7458,18 @@ static int network_config_add_listen (const oconfig_item_t *ci) /* {{{ */
     if (strcasecmp ("Interface", child->key) == 0)
       network_config_set_interface (child,
           &se->interface);
+    else if (strcasecmp ("ReceiveThreads", child->key) == 0)
+      network_config_set_receive_threads (child,
+          &se->data.server.receive_threads);
+    else if (strcasecmp ("Protocol", child->key) == 0)
+      network_config_set_protocol (child, &se->protocol);
+    else if (strcasecmp ("Relay", child->key) == 0)
+      network_config_set_boolean (child, &se->data.server.relay);
+    else if (strcasecmp ("Priority", child->key) == 0)
+      network_config_set_priority (child, &se->data.server.priority);
+    else if ((strcasecmp ("Allow", child->key) == 0)
+        || (strcasecmp ("Deny", child->key) == 0))
+      network_config_add_filter (child, &se->data.server.filter);
     else
     {
       WARNING ("network plugin: Option `%s' is not allowed here.",
@@ -3098,6 +7552,13 @@ static int network_config_add_server (const oconfig_item_t *ci) /* {{{ */
     if (strcasecmp ("Interface", child->key) == 0)
       network_config_set_interface (child,
           &se->interface);
+    else if (strcasecmp ("Protocol", child->key) == 0)
+      network_config_set_protocol (child, &se->protocol);
+    else if (strcasecmp ("Compression", child->key) == 0)
+      network_config_set_compression (child,
+          &se->data.client.compression);
+    else if (strcasecmp ("SegmentOffload", child->key) == 0)
+      network_config_set_boolean (child, &se->data.client.segment_offload);
     else
     {
       WARNING ("network plugin: Option `%s' is not allowed here.",
@@ -3105,7 +7566,42 @@ static int network_config_add_server (const oconfig_item_t *ci) /* {{{ */
     }
   }
 
+  if ((se->protocol != NETWORK_PROTOCOL_TCP)
+      && (se->data.client.compression != COMPRESSION_NONE))
+  {
+    WARNING ("network plugin: Compression is only supported over TCP, "
+        "ignoring the `Compression' option of %s.", se->node);
+    se->data.client.compression = COMPRESSION_NONE;
+  }
+
+#ifndef UDP_SEGMENT
+  if (se->data.client.segment_offload)
+  {
+    WARNING ("network plugin: `SegmentOffload' is not supported on this "
+        "system, ignoring it for %s.", se->node);
+    se->data.client.segment_offload = 0;
+  }
+#endif
+
+  if ((se->protocol == NETWORK_PROTOCOL_TCP)
+      && se->data.client.segment_offload)
+  {
+    WARNING ("network plugin: `SegmentOffload' is only supported over UDP, "
+        "ignoring it for %s.", se->node);
+    se->data.client.segment_offload = 0;
+  }
+
 #if HAVE_LIBGCRYPT
+  /* Padding would break signatures and encrypted packets, see
+   * network_send_segmented(). */
+  if ((se->data.client.security_level > SECURITY_LEVEL_NONE)
+      && se->data.client.segment_offload)
+  {
+    WARNING ("network plugin: `SegmentOffload' can't be used with a security "
+        "level higher than `none', ignoring it for %s.", se->node);
+    se->data.client.segment_offload = 0;
+  }
+
   if ((se->data.client.security_level > SECURITY_LEVEL_NONE)
       && ((se->data.client.username == NULL)
         || (se->data.client.password == NULL)))
@@ -3153,6 +7649,33 @@ static int network_config (oconfig_item_t *ci) /* {{{ */
       network_config_set_ttl (child);
     else if (strcasecmp ("MaxPacketSize", child->key) == 0)
       network_config_set_buffer_size (child);
+    else if (strcasecmp ("ReceiveBatchSize", child->key) == 0)
+      network_config_set_batch_size (child);
+    else if (strcasecmp ("DispatchThreads", child->key) == 0)
+      network_config_set_dispatch_threads (child);
+    else if (strcasecmp ("ReceiveThreadCPUs", child->key) == 0)
+      network_config_set_cpus (child, &network_config_receive_cpus);
+    else if (strcasecmp ("DispatchThreadCPUs", child->key) == 0)
+      network_config_set_cpus (child, &network_config_dispatch_cpus);
+    else if (strcasecmp ("ReceiveBuffers", child->key) == 0)
+      network_config_set_receive_buffers (child);
+    else if (strcasecmp ("MaxQueuedPackets", child->key) == 0)
+      network_config_set_max_queued (child,
+          &network_config_max_queued_packets);
+    else if (strcasecmp ("MaxQueuedBytes", child->key) == 0)
+      network_config_set_max_queued (child, &network_config_max_queued_bytes);
+    else if (strcasecmp ("Priority", child->key) == 0)
+      network_config_add_priority (child);
+    else if (strcasecmp ("SourceStats", child->key) == 0)
+      network_config_set_source_stats (child);
+    else if (strcasecmp ("CompactValues", child->key) == 0)
+      network_config_set_boolean (child, &network_config_compact);
+    else if (strcasecmp ("CompactKeyframeInterval", child->key) == 0)
+      network_config_set_keyframe_interval (child);
+    else if (strcasecmp ("IdentifierDictionary", child->key) == 0)
+      network_config_set_boolean (child, &network_config_dictionary);
+    else if (strcasecmp ("IdentifierRefreshInterval", child->key) == 0)
+      network_config_set_dictionary_refresh (child);
     else if (strcasecmp ("Forward", child->key) == 0)
       network_config_set_boolean (child, &network_config_forward);
     else if (strcasecmp ("ReportStats", child->key) == 0)
@@ -3241,37 +7764,129 @@ static int network_notification (const notification_t *n,
   return (0);
 } /* int network_notification */
 
-static int network_shutdown (void)
+/* Stops the receive, TCP and dispatch threads. Everything received has been
+ * dispatched when this returns. Called on handoff and on shutdown. */
+static int network_receive_stop (void) /* {{{ */
 {
+	size_t i;
+
 	listen_loop++;
 
-	/* Kill the listening thread */
-	if (receive_thread_running != 0)
+	/* Kill the listening threads */
+	for (i = 0; i < receive_threads_num; i++)
 	{
+		receive_thread_t *rt = receive_threads + i;
+
+		if (!rt->running)
+			continue;
+
 		INFO ("network plugin: Stopping receive thread.");
-		pthread_kill (receive_thread_id, SIGTERM);
-		pthread_join (receive_thread_id, NULL /* no return value */);
-		memset (&receive_thread_id, 0, sizeof (receive_thread_id));
-		receive_thread_running = 0;
+		pthread_kill (rt->id, SIGTERM);
+		pthread_join (rt->id, NULL /* no return value */);
+		memset (&rt->id, 0, sizeof (rt->id));
+		rt->running = 0;
+	}
+
+	if (tcp_thread_running)
+	{
+		INFO ("network plugin: Stopping TCP thread.");
+		pthread_kill (tcp_thread_id, SIGTERM);
+		pthread_join (tcp_thread_id, NULL /* no return value */);
+		tcp_thread_running = 0;
 	}
 
-	/* Shutdown the dispatching thread */
-	if (dispatch_thread_running != 0)
+	/* Shutdown the dispatching threads. They dispatch what is left in
+	 * their queues first. No more packets are queued at this point. */
+	dispatch_loop = 1;
+	__sync_synchronize ();
+	for (i = 0; i < dispatch_threads_num; i++)
 	{
+		dispatch_thread_t *dt = dispatch_threads + i;
+
+		if (!dt->running)
+			continue;
+
 		INFO ("network plugin: Stopping dispatch thread.");
-		pthread_mutex_lock (&receive_list_lock);
-		pthread_cond_broadcast (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
-		pthread_join (dispatch_thread_id, /* ret = */ NULL);
-		dispatch_thread_running = 0;
+		c_mutex_lock (&dt->lock);
+		pthread_cond_broadcast (&dt->cond);
+		c_mutex_unlock (&dt->lock);
+		pthread_join (dt->id, /* ret = */ NULL);
+		dt->running = 0;
+	}
+
+	return (0);
+} /* }}} int network_receive_stop */
+
+static int network_shutdown (void)
+{
+	size_t i;
+
+	network_receive_stop ();
+
+	/* The pools are freed before "dispatch_threads_num" is reset, it's
+	 * the number of rings. */
+	for (i = 0; i < receive_threads_num; i++)
+	{
+		receive_pool_destroy (receive_threads + i);
+		sfree (receive_threads[i].pollfd);
 	}
+	sfree (receive_threads);
+	receive_threads_num = 0;
+
+	for (i = 0; i < dispatch_threads_num; i++)
+	{
+		c_mutex_destroy (&dispatch_threads[i].lock);
+		pthread_cond_destroy (&dispatch_threads[i].cond);
+	}
+	sfree (dispatch_threads);
+	dispatch_threads_num = 0;
+
+	c_cpusets_destroy (network_config_receive_cpus);
+	network_config_receive_cpus = NULL;
+	c_cpusets_destroy (network_config_dispatch_cpus);
+	network_config_dispatch_cpus = NULL;
 
 	sockent_destroy (listen_sockets);
+	sfree (listen_sockets_by_fd);
+	listen_sockets_by_fd_num = 0;
+
+	/* Nothing is parsed anymore. */
+	lookup_destroy (priority_lookup);
+	priority_lookup = NULL;
+	network_source_tables_destroy ();
+
+	/* The buffers themselves are freed when their threads exit. */
+	network_flush_all ();
+
+	/* The send thread sends what is left in the queue first. */
+	c_mutex_lock (&send_queue_lock);
+	send_loop = 1;
+	pthread_cond_broadcast (&send_queue_cond);
+	pthread_cond_broadcast (&send_space_cond);
+	c_mutex_unlock (&send_queue_lock);
+
+	if (send_thread_running)
+	{
+		INFO ("network plugin: Stopping send thread.");
+		pthread_join (send_thread_id, /* ret = */ NULL);
+
+		c_mutex_lock (&send_queue_lock);
+		send_thread_running = 0;
+		c_mutex_unlock (&send_queue_lock);
+	}
 
-	if (send_buffer_fill > 0)
-		flush_buffer ();
+	while (send_queue_free != NULL)
+	{
+		send_packet_t *next = send_queue_free->next;
+		sfree (send_queue_free);
+		send_queue_free = next;
+	}
 
-	sfree (send_buffer);
+	/* The dispatch and write threads are gone, nobody checks or marks
+	 * values as sent anymore. */
+	sfree (sent_slots);
+	compact_trees_destroy (compact_trees, COMPACT_TREES_NUM);
+	compact_trees_destroy (dict_trees, DICT_TREES_NUM);
 
 	/* TODO: Close `sending_sockets' */
 
@@ -3294,18 +7909,58 @@ static int network_stats_read (void) /* {{{ */
 	derive_t copy_values_sent;
 	derive_t copy_values_not_sent;
 	derive_t copy_receive_list_length;
+	derive_t copy_receive_list_peak;
+	derive_t copy_receive_calls;
+	derive_t copy_receive_dropped;
+	derive_t copy_receive_shed[PRIORITY_NUM];
+	gauge_t copy_receive_batch_peak;
 	value_list_t vl = VALUE_LIST_INIT;
+	sockent_t *se;
+	size_t i;
 	value_t values[2];
 
-	copy_octets_rx = stats_octets_rx;
+	copy_octets_rx = 0;
+	copy_packets_rx = 0;
+	copy_receive_calls = 0;
+	copy_receive_dropped = 0;
+	memset (copy_receive_shed, 0, sizeof (copy_receive_shed));
+	copy_receive_batch_peak = 0.0;
+	copy_receive_list_length = 0;
+	copy_receive_list_peak = 0;
+	for (i = 0; i < receive_threads_num; i++)
+	{
+		receive_thread_t *rt = receive_threads + i;
+		size_t j;
+
+		copy_octets_rx += rt->octets;
+		copy_packets_rx += rt->packets;
+		copy_receive_calls += rt->calls;
+		copy_receive_dropped += rt->dropped;
+		for (j = 0; j < PRIORITY_NUM; j++)
+			copy_receive_shed[j] += rt->shed[j];
+		/* May miss a greater peak set concurrently; that's fine for
+		 * statistics. */
+		if (copy_receive_batch_peak < ((gauge_t) rt->batch_peak))
+			copy_receive_batch_peak = (gauge_t) rt->batch_peak;
+		rt->batch_peak = 0;
+
+		if (rt->queued != NULL)
+			for (j = 0; j < dispatch_threads_num; j++)
+				copy_receive_list_length += (derive_t)
+					c_spsc_length (rt->queued[j]);
+		copy_receive_list_peak += (derive_t) rt->queue_peak;
+		rt->queue_peak = 0;
+	}
+	if (copy_receive_list_peak < copy_receive_list_length)
+		copy_receive_list_peak = copy_receive_list_length;
+	copy_octets_rx += stats_octets_rx_tcp;
+	copy_packets_rx += stats_frames_rx_tcp;
 	copy_octets_tx = stats_octets_tx;
-	copy_packets_rx = stats_packets_rx;
 	copy_packets_tx = stats_packets_tx;
 	copy_values_dispatched = stats_values_dispatched;
 	copy_values_not_dispatched = stats_values_not_dispatched;
 	copy_values_sent = stats_values_sent;
 	copy_values_not_sent = stats_values_not_sent;
-	copy_receive_list_length = receive_list_length;
 
 	/* Initialize `vl' */
 	vl.values = values;
@@ -3350,18 +8005,180 @@ static int network_stats_read (void) /* {{{ */
 			sizeof (vl.type_instance));
 	plugin_dispatch_values (&vl);
 
+	/* Compact values relative to values which were lost. */
+	vl.values[0].derive = stats_values_compact_lost;
+	sstrncpy (vl.type_instance, "dispatch-lost",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Values referring to identifier numbers which were lost. */
+	vl.values[0].derive = stats_values_dict_lost;
+	sstrncpy (vl.type_instance, "dispatch-unknown",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Values discarded by the <Deny /> blocks of the <Listen /> sockets. */
+	for (se = listen_sockets; se != NULL; se = se->next)
+	{
+		filter_t *f = se->data.server.filter;
+
+		for (i = 0; (f != NULL) && (i < f->rules_num); i++)
+		{
+			if (!f->rules[i].deny)
+				continue;
+
+			vl.values[0].derive = f->rules[i].dropped;
+			ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+					"dispatch-filtered-%s", f->rules[i].name);
+			plugin_dispatch_values (&vl);
+		}
+	}
+
 	/* Receive queue length */
 	vl.values[0].gauge = (gauge_t) copy_receive_list_length;
 	sstrncpy (vl.type, "queue_length", sizeof (vl.type));
 	vl.type_instance[0] = 0;
 	plugin_dispatch_values (&vl);
 
+	vl.values[0].gauge = (gauge_t) copy_receive_list_peak;
+	sstrncpy (vl.type_instance, "peak", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Receive system calls. "if_packets" divided by this is the average
+	 * number of packets read by one call. */
+	vl.values[0].derive = copy_receive_calls;
+	sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "receive", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	vl.values[0].gauge = copy_receive_batch_peak;
+	sstrncpy (vl.type, "gauge", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "receive_batch-peak",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Packets discarded because all receive buffers were in use. */
+	vl.values[0].derive = copy_receive_dropped;
+	sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "receive-dropped",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Packets and values discarded by network_shed(). High priority
+	 * traffic is never shed. */
+	if (NETWORK_LIMITS_ENABLED)
+	{
+		static const char *priority_names[] = { "low", "normal" };
+
+		for (i = 0; i < STATIC_ARRAY_SIZE (priority_names); i++)
+		{
+			vl.values[0].derive = copy_receive_shed[i];
+			sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+			ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+					"receive-shed-%s", priority_names[i]);
+			plugin_dispatch_values (&vl);
+
+			vl.values[0].derive = stats_values_shed[i];
+			sstrncpy (vl.type, "total_values", sizeof (vl.type));
+			ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+					"dispatch-shed-%s", priority_names[i]);
+			plugin_dispatch_values (&vl);
+		}
+
+		vl.values[0].gauge = (gauge_t) queued_bytes;
+		sstrncpy (vl.type, "bytes", sizeof (vl.type));
+		sstrncpy (vl.type_instance, "receive-queued",
+				sizeof (vl.type_instance));
+		plugin_dispatch_values (&vl);
+	}
+
+	/* The busiest sources, see network_source_account(). */
+	if (source_tables != NULL)
+	{
+		source_entry_t *entries;
+		size_t entries_num = 0;
+
+		pthread_mutex_lock (&source_lock);
+		entries = network_source_snapshot (&entries_num);
+		pthread_mutex_unlock (&source_lock);
+
+		for (i = 0; i < entries_num; i++)
+		{
+			char name[INET6_ADDRSTRLEN];
+
+			network_source_name (entries[i].key, name, sizeof (name));
+			ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+					"source-%s", name);
+
+			vl.values[0].derive = entries[i].octets;
+			sstrncpy (vl.type, "if_rx_octets", sizeof (vl.type));
+			vl.type_instance[0] = 0;
+			plugin_dispatch_values (&vl);
+
+			vl.values[0].derive = entries[i].packets;
+			sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+			sstrncpy (vl.type_instance, "packets",
+					sizeof (vl.type_instance));
+			plugin_dispatch_values (&vl);
+
+			vl.values[0].derive = entries[i].values;
+			sstrncpy (vl.type, "total_values", sizeof (vl.type));
+			sstrncpy (vl.type_instance, "received",
+					sizeof (vl.type_instance));
+			plugin_dispatch_values (&vl);
+
+			vl.values[0].derive = entries[i].errors;
+			sstrncpy (vl.type, "if_rx_errors", sizeof (vl.type));
+			vl.type_instance[0] = 0;
+			plugin_dispatch_values (&vl);
+		}
+		sfree (entries);
+		vl.plugin_instance[0] = 0;
+	}
+
+	/* Packets passed on by relay sockets, see relay_packet(). */
+	vl.values[0].derive = stats_packets_relayed;
+	sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "relay-accepted",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	vl.values[0].derive = stats_packets_not_relayed;
+	sstrncpy (vl.type_instance, "relay-rejected",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Frames not sent over TCP, see network_tcp_disconnect(). */
+	vl.values[0].derive = stats_octets_dropped_tcp;
+	sstrncpy (vl.type, "total_bytes", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "send-dropped",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
 	return (0);
 } /* }}} int network_stats_read */
 
+/* Pins "thread" to its CPU set, if "ReceiveThreadCPUs" or
+ * "DispatchThreadCPUs" is set. Failing to do so is not fatal. */
+static void network_thread_cpus_apply (c_cpusets_t const *cpus, /* {{{ */
+		pthread_t thread, size_t index, char const *what)
+{
+	int status;
+
+	status = c_cpusets_apply (cpus, thread, index);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		WARNING ("network plugin: Pinning %s thread #%zu to its CPUs "
+				"failed: %s", what, index,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+	}
+} /* }}} void network_thread_cpus_apply */
+
 static int network_init (void)
 {
 	static _Bool have_init = 0;
+	size_t i;
 
 	/* Check if we were already initialized. If so, just return - there's
 	 * nothing more to do (for now, that is). */
@@ -3387,36 +8204,94 @@ static int network_init (void)
 		plugin_register_read ("network", network_stats_read);
 
 	plugin_register_shutdown ("network", network_shutdown);
+	plugin_register_handoff ("network", network_receive_stop);
 
-	send_buffer = malloc (network_config_packet_size);
-	if (send_buffer == NULL)
+	if (sending_sockets == NULL)
 	{
-		ERROR ("network plugin: malloc failed.");
-		return (-1);
+		sockent_t *se;
+
+		for (se = listen_sockets; se != NULL; se = se->next)
+			if (se->data.server.relay)
+				break;
+		if (se != NULL)
+			WARNING ("network plugin: Relaying is enabled for "
+					"%s, but no `Server' is configured. "
+					"Received packets will be discarded.",
+					se->node);
 	}
-	network_init_buffer ();
 
 	/* setup socket(s) and so on */
 	if (sending_sockets != NULL)
 	{
-		plugin_register_write ("network", network_write,
+		int status;
+
+		network_init_encoders ();
+
+		for (i = 0; i < SENT_LOCKS_NUM; i++)
+			pthread_mutex_init (sent_locks + i, /* attr = */ NULL);
+		sent_slots = calloc (SENT_SLOTS_NUM, sizeof (*sent_slots));
+		if (sent_slots == NULL)
+			ERROR ("network plugin: calloc failed. Values sent "
+					"may be received again.");
+
+		for (i = 0; i < COMPACT_TREES_NUM; i++)
+		{
+			pthread_mutex_init (compact_locks + i, /* attr = */ NULL);
+			if (network_config_compact)
+				compact_trees[i] = c_avl_create (
+						compact_state_compare);
+		}
+
+		for (i = 0; i < DICT_TREES_NUM; i++)
+		{
+			pthread_mutex_init (dict_locks + i, /* attr = */ NULL);
+			if (network_config_dictionary)
+				dict_trees[i] = c_avl_create (
+						compact_state_compare);
+		}
+		/* Numbers are only valid within one session, so a restarted
+		 * sender doesn't reuse the numbers of its predecessor. */
+		dict_session = plugin_hash_string (hostname_g) ^ cdtime ()
+			^ ((uint64_t) getpid () << 32);
+
+		status = plugin_thread_create (&send_thread_id,
+				NULL /* no attributes */,
+				send_thread,
+				NULL /* no argument */);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network: pthread_create failed: %s. "
+					"Sending packets synchronously.",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+		}
+		else
+		{
+			send_thread_running = 1;
+		}
+
+		plugin_register_write_batch ("network", network_write_batch,
 				/* user_data = */ NULL);
 		plugin_register_notification ("network", network_notification,
 				/* user_data = */ NULL);
 	}
 
-	/* If no threads need to be started, return here. */
-	if ((listen_sockets_num == 0)
-			|| ((dispatch_thread_running != 0)
-				&& (receive_thread_running != 0)))
-		return (0);
+	/* One table per dispatch thread and one for the TCP thread. */
+	if ((network_config_source_stats > 0) && (listen_sockets_num > 0))
+	{
+		if (network_source_tables_create ((size_t)
+					network_config_dispatch_threads + 1) != 0)
+			network_source_tables_destroy ();
+	}
 
-	if (dispatch_thread_running == 0)
+	if (tcp_listen_sockets_num > 0)
 	{
 		int status;
-		status = plugin_thread_create (&dispatch_thread_id,
+
+		status = plugin_thread_create (&tcp_thread_id,
 				NULL /* no attributes */,
-				dispatch_thread,
+				tcp_thread,
 				NULL /* no argument */);
 		if (status != 0)
 		{
@@ -3427,17 +8302,76 @@ static int network_init (void)
 		}
 		else
 		{
-			dispatch_thread_running = 1;
+			tcp_thread_running = 1;
+		}
+	}
+
+	/* If no threads need to be started, return here. */
+	if (listen_sockets_num == 0)
+		return (0);
+
+	dispatch_threads = calloc ((size_t) network_config_dispatch_threads,
+			sizeof (*dispatch_threads));
+	if (dispatch_threads == NULL)
+	{
+		ERROR ("network plugin: calloc failed.");
+		return (-1);
+	}
+	dispatch_threads_num = (size_t) network_config_dispatch_threads;
+
+	/* The dispatch threads look at the queues of all receive threads, so
+	 * create them first. */
+	for (i = 0; i < receive_threads_num; i++)
+	{
+		receive_thread_t *rt = receive_threads + i;
+
+		if ((rt->pollfd_num == 0) || (rt->pool != NULL))
+			continue;
+
+		if (receive_pool_create (rt) != 0)
+			return (-1);
+	}
+
+	for (i = 0; i < dispatch_threads_num; i++)
+	{
+		dispatch_thread_t *dt = dispatch_threads + i;
+		int status;
+
+		dt->index = i;
+		c_mutex_init (&dt->lock, "network-dispatch");
+		pthread_cond_init (&dt->cond, /* attr = */ NULL);
+
+		status = plugin_thread_create (&dt->id,
+				NULL /* no attributes */,
+				dispatch_thread,
+				dt);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network: pthread_create failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			/* The receive threads hand packets to all dispatch
+			 * threads, so don't start them. */
+			return (-1);
 		}
+		dt->running = 1;
+		network_thread_cpus_apply (network_config_dispatch_cpus, dt->id,
+				i, "dispatch");
 	}
 
-	if (receive_thread_running == 0)
+	for (i = 0; i < receive_threads_num; i++)
 	{
+		receive_thread_t *rt = receive_threads + i;
 		int status;
-		status = plugin_thread_create (&receive_thread_id,
+
+		if (rt->running || (rt->pollfd_num == 0))
+			continue;
+
+		status = plugin_thread_create (&rt->id,
 				NULL /* no attributes */,
 				receive_thread,
-				NULL /* no argument */);
+				rt);
 		if (status != 0)
 		{
 			char errbuf[1024];
@@ -3447,7 +8381,9 @@ static int network_init (void)
 		}
 		else
 		{
-			receive_thread_running = 1;
+			rt->running = 1;
+			network_thread_cpus_apply (network_config_receive_cpus,
+					rt->id, i, "receive");
 		}
 	}
 
@@ -3465,12 +8401,7 @@ static int network_flush (__attribute__((unused)) cdtime_t timeout,
 		__attribute__((unused)) const char *identifier,
 		__attribute__((unused)) user_data_t *user_data)
 {
-	pthread_mutex_lock (&send_buffer_lock);
-
-	if (send_buffer_fill > 0)
-	  flush_buffer ();
-
-	pthread_mutex_unlock (&send_buffer_lock);
+	network_flush_all ();
 
 	return (0);
 } /* int network_flush */
@@ -3481,6 +8412,8 @@ void module_register (void)
 	plugin_register_init   ("network", network_init);
 	plugin_register_flush   ("network", network_flush,
 			/* user_data = */ NULL);
+	plugin_register_command ("LISTSOURCES", network_source_command,
+			/* user_data = */ NULL);
 } /* void module_register */
 
 /* vim: set fdm=marker : */
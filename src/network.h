@@ -65,6 +65,15 @@
 #define TYPE_INTERVAL        0x0007
 #define TYPE_INTERVAL_HR     0x0009
 
+/* Values encoded relative to the previous values of the series. Only sent
+ * with "CompactValues" enabled. */
+#define TYPE_VALUES_COMPACT  0x0010
+
+/* Numbers standing for whole identifiers. Only sent with
+ * "IdentifierDictionary" enabled. */
+#define TYPE_IDENT_DEFINE    0x0011
+#define TYPE_IDENT_REF       0x0012
+
 /* Types to transmit notifications */
 #define TYPE_MESSAGE         0x0100
 #define TYPE_SEVERITY        0x0101
@@ -72,4 +81,24 @@
 #define TYPE_SIGN_SHA256     0x0200
 #define TYPE_ENCR_AES256     0x0210
 
+/* Fills a datagram up to the segment size when sending with UDP_SEGMENT.
+ * Ignored, like all unknown parts. */
+#define TYPE_PADDING         0x0300
+
+/*
+ * TCP streams are split into frames. Each frame has a four byte header in
+ * network byte order followed by one or more packets in the format above:
+ *
+ *  |  8 bits  |               24 bits                |
+ *  +----------+--------------------------------------+
+ *  |  flags   |         length of the payload        |
+ *  +----------+--------------------------------------+
+ *
+ * With FRAME_FLAG_ZLIB, the payload has been compressed with zlib's
+ * compress2().
+ */
+#define FRAME_HEADER_SIZE    4
+#define FRAME_SIZE_MASK      0x00ffffff
+#define FRAME_FLAG_ZLIB      0x01000000
+
 #endif /* NETWORK_H */
@@ -26,6 +26,7 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
+#include "utils_curl_multi.h"
 
 #include <curl/curl.h>
 
@@ -42,6 +43,10 @@ static char   nginx_buffer[16384];
 static size_t nginx_buffer_len = 0;
 static char   nginx_curl_error[CURL_ERROR_SIZE];
 
+/* Interval of the read callback, for values dispatched by the fetch
+ * thread. */
+static cdtime_t nginx_interval = 0;
+
 static const char *config_keys[] =
 {
   "URL",
@@ -193,10 +198,14 @@ static void submit (char *type, char *inst, long long value)
   if (inst != NULL)
     sstrncpy (vl.type_instance, inst, sizeof (vl.type_instance));
 
+  vl.interval = nginx_interval;
+
   plugin_dispatch_values (&vl);
 } /* void submit */
 
-static int nginx_read (void)
+/* Called by the fetch thread when the transfer has finished. */
+static void nginx_curl_done (CURL __attribute__((unused)) *handle,
+    CURLcode status, void __attribute__((unused)) *user_data)
 {
   int i;
 
@@ -208,16 +217,12 @@ static int nginx_read (void)
   char *fields[16];
   int   fields_num;
 
-  if (curl == NULL)
-    return (-1);
-  if (url == NULL)
-    return (-1);
-
-  nginx_buffer_len = 0;
-  if (curl_easy_perform (curl) != 0)
+  if (status != CURLE_OK)
   {
-    WARNING ("nginx plugin: curl_easy_perform failed: %s", nginx_curl_error);
-    return (-1);
+    if (status != CURLE_ABORTED_BY_CALLBACK)
+      WARNING ("nginx plugin: curl_easy_perform failed: %s", nginx_curl_error);
+    nginx_buffer_len = 0;
+    return;
   }
 
   ptr = nginx_buffer;
@@ -269,16 +274,57 @@ static int nginx_read (void)
     }
   }
 
+  /* Reset here rather than in nginx_read, which doesn't know whether a
+   * transfer is still running. */
   nginx_buffer_len = 0;
+} /* void nginx_curl_done */
+
+static int nginx_read (void)
+{
+  int status;
+
+  if (curl == NULL)
+    return (-1);
+  if (url == NULL)
+    return (-1);
+
+  /* Only set by the first read, before any transfer can be running. */
+  if (nginx_interval == 0)
+    nginx_interval = plugin_get_interval ();
+
+  status = ucm_submit (curl, url, nginx_curl_done, /* user_data = */ NULL);
+  if (status == EBUSY)
+  {
+    WARNING ("nginx plugin: The previous request is still in progress. "
+        "Skipping this interval.");
+    return (-1);
+  }
+  else if (status != 0)
+  {
+    ERROR ("nginx plugin: ucm_submit failed with status %i.", status);
+    return (-1);
+  }
 
   return (0);
 } /* int nginx_read */
 
+static int nginx_shutdown (void)
+{
+  ucm_shutdown ();
+
+  if (curl != NULL)
+    curl_easy_cleanup (curl);
+  curl = NULL;
+
+  return (0);
+} /* int nginx_shutdown */
+
 void module_register (void)
 {
   plugin_register_config ("nginx", config, config_keys, config_keys_num);
   plugin_register_init ("nginx", init);
   plugin_register_read ("nginx", nginx_read);
+  plugin_register_shutdown ("nginx", nginx_shutdown);
 } /* void module_register */
 
 /*
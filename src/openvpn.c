@@ -28,8 +28,10 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
+#include "utils_htable.h"
 
-#define V1STRING "Common Name,Real Address,Bytes Received,Bytes Sent,Connected Since\n"
+#define V1HEADER "Common Name,Real Address,Bytes Received,Bytes Sent,Connected Since"
+#define V1STRING V1HEADER "\n"
 #define V2STRING "HEADER,CLIENT_LIST,Common Name,Real Address,Virtual Address,Bytes Received,Bytes Sent,Connected Since,Connected Since (time_t)\n"
 #define V3STRING "HEADER CLIENT_LIST Common Name Real Address Virtual Address Bytes Received Bytes Sent Connected Since Connected Since (time_t)\n"
 #define VSSTRING "OpenVPN STATISTICS\n"
@@ -46,9 +48,47 @@ struct vpn_status_s
 		SINGLE = 10 /* currently no versions for single mode, maybe in the future */
 	} version;
 	char *name;
+
+	/* kept open between reads */
+	pread_file_t *pf;
+
+	/* vpn_client_t by common name and vpn_session_t by real address and
+	 * common name, multi mode only */
+	c_htable_t *clients;
+	c_htable_t *sessions;
+	unsigned int generation;
+	derive_t rx_total;
+	derive_t tx_total;
 };
 typedef struct vpn_status_s vpn_status_t;
 
+/* The counters dispatched for one common name. They are the sum of the
+ * differences of all of its sessions, so they keep increasing when a session
+ * ends or reconnects. */
+struct vpn_client_s
+{
+	char *name;
+	/* read in which the client was last seen */
+	unsigned int generation;
+	derive_t rx;
+	derive_t tx;
+};
+typedef struct vpn_client_s vpn_client_t;
+
+/* One connection of a client. The byte counters of a session start from
+ * zero when the client reconnects. */
+struct vpn_session_s
+{
+	/* "<real address>/<common name>" */
+	char *key;
+	vpn_client_t *client;
+	unsigned int generation;
+	/* as read from the status file */
+	derive_t rx_last;
+	derive_t tx_last;
+};
+typedef struct vpn_session_s vpn_session_t;
+
 static vpn_status_t **vpn_list = NULL;
 static int vpn_num = 0;
 
@@ -56,6 +96,7 @@ static _Bool new_naming_schema = 0;
 static _Bool collect_compression = 1;
 static _Bool collect_user_count  = 0;
 static _Bool collect_individual_users  = 1;
+static _Bool collect_total_traffic = 0;
 
 static const char *config_keys[] =
 {
@@ -64,14 +105,16 @@ static const char *config_keys[] =
 	"ImprovedNamingSchema",
 	"CollectCompression",
 	"CollectUserCount",
-	"CollectIndividualUsers"
+	"CollectIndividualUsers",
+	"CollectTotalTraffic"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 
 /* Helper function
- * copy-n-pasted from common.c - changed delim to ","  */
-static int openvpn_strsplit (char *string, char **fields, size_t size)
+ * copy-n-pasted from common.c - takes the delimiters as argument  */
+static int openvpn_strsplit (char *string, char **fields, size_t size,
+		const char *delim)
 {
 	size_t i;
 	char *ptr;
@@ -80,7 +123,7 @@ static int openvpn_strsplit (char *string, char **fields, size_t size)
 	i = 0;
 	ptr = string;
 	saveptr = NULL;
-	while ((fields[i] = strtok_r (ptr, ",", &saveptr)) != NULL)
+	while ((fields[i] = strtok_r (ptr, delim, &saveptr)) != NULL)
 	{
 		ptr = NULL;
 		i++;
@@ -166,9 +209,10 @@ static void compression_submit (char *pinst, char *tinst,
 	plugin_dispatch_values (&vl);
 } /* void compression_submit */
 
-static int single_read (char *name, FILE *fh)
+static int single_read (char *name, char *buffer)
 {
-	char buffer[1024];
+	char *line;
+	char *ptr = buffer;
 	char *fields[4];
 	const int max_fields = STATIC_ARRAY_SIZE (fields);
 	int  fields_num, read = 0;
@@ -190,9 +234,9 @@ static int single_read (char *name, FILE *fh)
 	overhead_rx = 0;
 	overhead_tx = 0;
 
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	while ((line = strline (&ptr)) != NULL)
 	{
-		fields_num = openvpn_strsplit (buffer, fields, max_fields);
+		fields_num = openvpn_strsplit (line, fields, max_fields, ",");
 
 		/* status file is generated by openvpn/sig.c:print_status()
 		 * http://svn.openvpn.net/projects/openvpn/trunk/openvpn/sig.c
@@ -260,202 +304,320 @@ static int single_read (char *name, FILE *fh)
 	return (read);
 } /* int single_read */
 
-/* for reading status version 1 */
-static int multi1_read (char *name, FILE *fh)
+static vpn_client_t *client_get (vpn_status_t *vpn, const char *name)
 {
-	char buffer[1024];
-	char *fields[10];
-	int  fields_num, read = 0, found_header = 0;
-	long long sum_users = 0;
+	vpn_client_t *client = NULL;
+
+	if (c_htable_get (vpn->clients, name, (void *) &client) == 0)
+		return (client);
 
-	/* read the file until the "ROUTING TABLE" line is found (no more info after) */
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	client = calloc (1, sizeof (*client));
+	if (client == NULL)
+		return (NULL);
+
+	client->name = strdup (name);
+	if (client->name == NULL)
 	{
-		if (strcmp (buffer, "ROUTING TABLE\n") == 0)
-			break;
+		sfree (client);
+		return (NULL);
+	}
 
-		if (strcmp (buffer, V1STRING) == 0)
-		{
-			found_header = 1;
-			continue;
-		}
+	if (c_htable_insert (vpn->clients, client->name, client) != 0)
+	{
+		sfree (client->name);
+		sfree (client);
+		return (NULL);
+	}
 
-		/* skip the first lines until the client list section is found */
-		if (found_header == 0)
-			/* we can't start reading data until this string is found */
-			continue;
+	return (client);
+} /* vpn_client_t *client_get */
 
-		fields_num = openvpn_strsplit (buffer,
-				fields, STATIC_ARRAY_SIZE (fields));
-		if (fields_num < 4)
-			continue;
+static vpn_session_t *session_get (vpn_status_t *vpn, vpn_client_t *client,
+		const char *address)
+{
+	vpn_session_t *session = NULL;
+	char key[2 * DATA_MAX_NAME_LEN];
 
-		if (collect_user_count)
-			/* If so, sum all users, ignore the individuals*/
-		{
-			sum_users += 1;
-		}
-		if (collect_individual_users)
-		{
-			if (new_naming_schema)
-			{
-				iostats_submit (name,               /* vpn instance */
-						fields[0],          /* "Common Name" */
-						atoll (fields[2]),  /* "Bytes Received" */
-						atoll (fields[3])); /* "Bytes Sent" */
-			}
-			else
-			{
-				iostats_submit (fields[0],          /* "Common Name" */
-						NULL,               /* unused when in multimode */
-						atoll (fields[2]),  /* "Bytes Received" */
-						atoll (fields[3])); /* "Bytes Sent" */
-			}
-		}
+	ssnprintf (key, sizeof (key), "%s/%s", address, client->name);
 
-		read = 1;
+	if (c_htable_get (vpn->sessions, key, (void *) &session) == 0)
+		return (session);
+
+	/* Not seen before, so all of its bytes are new. */
+	session = calloc (1, sizeof (*session));
+	if (session == NULL)
+		return (NULL);
+
+	session->key = strdup (key);
+	if (session->key == NULL)
+	{
+		sfree (session);
+		return (NULL);
 	}
+	session->client = client;
 
-	if (collect_user_count)
+	if (c_htable_insert (vpn->sessions, session->key, session) != 0)
 	{
-		numusers_submit(name, name, sum_users);
-		read = 1;
+		sfree (session->key);
+		sfree (session);
+		return (NULL);
 	}
 
-	return (read);
-} /* int multi1_read */
+	return (session);
+} /* vpn_session_t *session_get */
 
-/* for reading status version 2 */
-static int multi2_read (char *name, FILE *fh)
+/* A session's counters start from zero when it reconnects. */
+static derive_t session_delta (derive_t last, derive_t current)
 {
-	char buffer[1024];
-	char *fields[10];
-	const int max_fields = STATIC_ARRAY_SIZE (fields);
-	int  fields_num, read = 0;
-	long long sum_users    = 0;
+	if (current >= last)
+		return (current - last);
+	return (current);
+} /* derive_t session_delta */
+
+/* Adds the bytes one line of the client list has transferred since the
+ * previous read to its client. Sessions are told apart by their real
+ * address, so a decrease is always a reconnect and never one of several
+ * sessions of the same common name ending. */
+static int client_update (vpn_status_t *vpn, const char *name,
+		const char *address, derive_t rx, derive_t tx)
+{
+	vpn_client_t *client;
+	vpn_session_t *session;
+	derive_t rx_delta, tx_delta;
+
+	client = client_get (vpn, name);
+	if (client == NULL)
+		return (-1);
+	client->generation = vpn->generation;
 
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	session = session_get (vpn, client, address);
+	if (session == NULL)
+		return (-1);
+	session->generation = vpn->generation;
+
+	rx_delta = session_delta (session->rx_last, rx);
+	tx_delta = session_delta (session->tx_last, tx);
+	session->rx_last = rx;
+	session->tx_last = tx;
+
+	client->rx += rx_delta;
+	client->tx += tx_delta;
+	vpn->rx_total += rx_delta;
+	vpn->tx_total += tx_delta;
+
+	return (0);
+} /* int client_update */
+
+/* Forgets about the sessions which have ended since the previous read. */
+static void sessions_expire (vpn_status_t *vpn)
+{
+	c_htable_iterator_t *iter;
+	vpn_session_t *session;
+	char *key;
+
+	vpn_session_t **gone = NULL;
+	size_t gone_num = 0;
+	size_t i;
+
+	iter = c_htable_get_iterator (vpn->sessions);
+	if (iter == NULL)
+		return;
+
+	while (c_htable_iterator_next (iter, (void *) &key,
+				(void *) &session) == 0)
 	{
-		fields_num = openvpn_strsplit (buffer, fields, max_fields);
+		vpn_session_t **tmp;
 
-		/* status file is generated by openvpn/multi.c:multi_print_status()
-		 * http://svn.openvpn.net/projects/openvpn/trunk/openvpn/multi.c
-		 *
-		 * The line we're expecting has 8 fields. We ignore all lines
-		 *  with more or less fields.
-		 */
-		if (fields_num != 8)
+		if (session->generation == vpn->generation)
 			continue;
 
-		if (strcmp (fields[0], "CLIENT_LIST") != 0)
+		tmp = realloc (gone, (gone_num + 1) * sizeof (*gone));
+		if (tmp == NULL)
 			continue;
+		gone = tmp;
+		gone[gone_num] = session;
+		gone_num++;
+	}
+	c_htable_iterator_destroy (iter);
 
-		if (collect_user_count)
-			/* If so, sum all users, ignore the individuals*/
-		{
-			sum_users += 1;
-		}
-		if (collect_individual_users)
+	for (i = 0; i < gone_num; i++)
+	{
+		c_htable_remove (vpn->sessions, gone[i]->key, NULL, NULL);
+		sfree (gone[i]->key);
+		sfree (gone[i]);
+	}
+	sfree (gone);
+} /* void sessions_expire */
+
+/* Dispatches the counters of all clients seen in the latest read and
+ * forgets about the clients that have disconnected. */
+static void clients_submit (vpn_status_t *vpn)
+{
+	c_htable_iterator_t *iter;
+	vpn_client_t *client;
+	char *name;
+
+	vpn_client_t **gone = NULL;
+	size_t gone_num = 0;
+	size_t i;
+
+	/* A client is only gone if all of its sessions are, so no session
+	 * refers to the clients freed below anymore. */
+	sessions_expire (vpn);
+
+	iter = c_htable_get_iterator (vpn->clients);
+	if (iter == NULL)
+		return;
+
+	while (c_htable_iterator_next (iter, (void *) &name,
+				(void *) &client) == 0)
+	{
+		if (client->generation != vpn->generation)
 		{
-			if (new_naming_schema)
-			{
-				/* plugin inst = file name, type inst = fields[1] */
-				iostats_submit (name,               /* vpn instance */
-						fields[1],          /* "Common Name" */
-						atoll (fields[4]),  /* "Bytes Received" */
-						atoll (fields[5])); /* "Bytes Sent" */
-			}
-			else
-			{
-				/* plugin inst = fields[1], type inst = "" */
-				iostats_submit (fields[1],          /* "Common Name" */
-						NULL,               /* unused when in multimode */
-						atoll (fields[4]),  /* "Bytes Received" */
-						atoll (fields[5])); /* "Bytes Sent" */
-			}
+			vpn_client_t **tmp;
+
+			tmp = realloc (gone, (gone_num + 1) * sizeof (*gone));
+			if (tmp == NULL)
+				continue;
+			gone = tmp;
+			gone[gone_num] = client;
+			gone_num++;
+			continue;
 		}
 
-		read = 1;
+		if (!collect_individual_users)
+			continue;
+
+		if (new_naming_schema)
+			/* plugin inst = file name, type inst = "Common Name" */
+			iostats_submit (vpn->name, client->name, client->rx, client->tx);
+		else
+			/* plugin inst = "Common Name", type inst = "" */
+			iostats_submit (client->name, NULL, client->rx, client->tx);
 	}
+	c_htable_iterator_destroy (iter);
 
-	if (collect_user_count)
+	for (i = 0; i < gone_num; i++)
 	{
-		numusers_submit(name, name, sum_users);
-		read = 1;
+		c_htable_remove (vpn->clients, gone[i]->name, NULL, NULL);
+		sfree (gone[i]->name);
+		sfree (gone[i]);
 	}
+	sfree (gone);
 
-	return (read);
-} /* int multi2_read */
+	if (collect_total_traffic)
+		iostats_submit (vpn->name, "total", vpn->rx_total, vpn->tx_total);
+} /* void clients_submit */
 
-/* for reading status version 3 */
-static int multi3_read (char *name, FILE *fh)
+/* for reading status versions 1, 2 and 3 */
+static int multi_read (vpn_status_t *vpn, char *buffer)
 {
-	char buffer[1024];
+	char *line;
+	char *ptr = buffer;
 	char *fields[15];
-	const int max_fields = STATIC_ARRAY_SIZE (fields);
-	int  fields_num, read = 0;
-	long long sum_users    = 0;
+	int  fields_num, read = 0, found_header = 0;
+	long long sum_users = 0;
 
-	while (fgets (buffer, sizeof (buffer), fh) != NULL)
+	const char *sep;
+	size_t fields_size;
+	int fields_min, fields_max;
+	int name_index, rx_index, tx_index;
+
+	/* status file is generated by openvpn/multi.c:multi_print_status()
+	 * http://svn.openvpn.net/projects/openvpn/trunk/openvpn/multi.c
+	 *
+	 * Version 1 lists the clients after its header, up to the routing
+	 * table, with at least 4 fields. Versions 2 and 3 prefix each client
+	 * with "CLIENT_LIST" and have 8 and 12 fields, respectively. We ignore
+	 * all other lines. */
+	switch (vpn->version)
 	{
-		fields_num = strsplit (buffer, fields, max_fields);
+		case MULTI1:
+			sep = ",";
+			fields_size = 10;
+			fields_min = 4;
+			fields_max = 10;
+			name_index = 0;
+			break;
+		case MULTI2:
+			sep = ",";
+			fields_size = 9;
+			fields_min = fields_max = 8;
+			name_index = 1;
+			break;
+		case MULTI3:
+			sep = " \t\r\n";
+			fields_size = 13;
+			fields_min = fields_max = 12;
+			name_index = 1;
+			break;
+		default:
+			return (0);
+	}
+	rx_index = name_index + ((vpn->version == MULTI1) ? 2 : 3);
+	tx_index = rx_index + 1;
 
-		/* status file is generated by openvpn/multi.c:multi_print_status()
-		 * http://svn.openvpn.net/projects/openvpn/trunk/openvpn/multi.c
-		 *
-		 * The line we're expecting has 12 fields. We ignore all lines
-		 *  with more or less fields.
-		 */
-		if (fields_num != 12)
-		{
-			continue;
-		}
-		else
-		{
-			if (strcmp (fields[0], "CLIENT_LIST") != 0)
-				continue;
+	vpn->generation++;
 
-			if (collect_user_count)
-				/* If so, sum all users, ignore the individuals*/
-			{
-				sum_users += 1;
-			}
+	while ((line = strline (&ptr)) != NULL)
+	{
+		if (vpn->version == MULTI1)
+		{
+			/* no more info after the "ROUTING TABLE" line */
+			if (strcmp (line, "ROUTING TABLE") == 0)
+				break;
 
-			if (collect_individual_users)
+			if (strcmp (line, V1HEADER) == 0)
 			{
-				if (new_naming_schema)
-				{
-					iostats_submit (name,               /* vpn instance */
-							fields[1],          /* "Common Name" */
-							atoll (fields[4]),  /* "Bytes Received" */
-							atoll (fields[5])); /* "Bytes Sent" */
-				}
-				else
-				{
-					iostats_submit (fields[1],          /* "Common Name" */
-							NULL,               /* unused when in multimode */
-							atoll (fields[4]),  /* "Bytes Received" */
-							atoll (fields[5])); /* "Bytes Sent" */
-				}
+				found_header = 1;
+				continue;
 			}
 
-			read = 1;
+			/* we can't start reading data until the header is found */
+			if (found_header == 0)
+				continue;
 		}
+		else if (strncmp (line, "CLIENT_LIST", strlen ("CLIENT_LIST")) != 0)
+			continue;
+
+		fields_num = openvpn_strsplit (line, fields, fields_size, sep);
+		if ((fields_num < fields_min) || (fields_num > fields_max))
+			continue;
+
+		if ((vpn->version != MULTI1)
+				&& (strcmp (fields[0], "CLIENT_LIST") != 0))
+			continue;
+
+		/* If so, sum all users */
+		if (collect_user_count)
+			sum_users += 1;
+
+		if (client_update (vpn, fields[name_index],
+					fields[name_index + 1],      /* "Real Address" */
+					atoll (fields[rx_index]),   /* "Bytes Received" */
+					atoll (fields[tx_index])) != 0) /* "Bytes Sent" */
+			ERROR ("openvpn plugin: Failed to update client \"%s\".",
+					fields[name_index]);
+
+		read = 1;
 	}
 
+	if (collect_individual_users || collect_total_traffic)
+		clients_submit (vpn);
+
 	if (collect_user_count)
 	{
-		numusers_submit(name, name, sum_users);
+		numusers_submit(vpn->name, vpn->name, sum_users);
 		read = 1;
 	}
 
 	return (read);
-} /* int multi3_read */
+} /* int multi_read */
 
 /* read callback */
 static int openvpn_read (void)
 {
-	FILE *fh;
+	char *buffer;
 	int  i, read;
 
 	read = 0;
@@ -463,36 +625,22 @@ static int openvpn_read (void)
 	/* call the right read function for every status entry in the list */
 	for (i = 0; i < vpn_num; i++)
 	{
-		fh = fopen (vpn_list[i]->file, "r");
-		if (fh == NULL)
+		/* The file is kept open and read in one go, several MB for tens
+		 * of thousands of clients. */
+		buffer = pread_file_read (vpn_list[i]->pf, /* ret_len = */ NULL);
+		if (buffer == NULL)
 		{
 			char errbuf[1024];
-			WARNING ("openvpn plugin: fopen(%s) failed: %s", vpn_list[i]->file,
+			WARNING ("openvpn plugin: Reading %s failed: %s", vpn_list[i]->file,
 					sstrerror (errno, errbuf, sizeof (errbuf)));
 
 			continue;
 		}
 
-		switch (vpn_list[i]->version)
-		{
-			case SINGLE:
-				read = single_read(vpn_list[i]->name, fh);
-				break;
-
-			case MULTI1:
-				read = multi1_read(vpn_list[i]->name, fh);
-				break;
-
-			case MULTI2:
-				read = multi2_read(vpn_list[i]->name, fh);
-				break;
-
-			case MULTI3:
-				read = multi3_read(vpn_list[i]->name, fh);
-				break;
-		}
-
-		fclose (fh);
+		if (vpn_list[i]->version == SINGLE)
+			read = single_read (vpn_list[i]->name, buffer);
+		else
+			read = multi_read (vpn_list[i], buffer);
 	}
 
 	return (read ? 0 : -1);
@@ -620,11 +768,32 @@ static int openvpn_config (const char *key, const char *value)
 		}
 
 		/* create a new vpn element since file, version and name are ok */
-		temp = (vpn_status_t *) malloc (sizeof (vpn_status_t));
+		temp = (vpn_status_t *) calloc (1, sizeof (vpn_status_t));
+		if (temp == NULL)
+		{
+			ERROR ("openvpn plugin: calloc failed.");
+			sfree (status_file);
+			return (1);
+		}
 		temp->file = status_file;
 		temp->version = status_version;
 		temp->name = status_name;
 
+		temp->pf = pread_file_create (status_file);
+		if ((temp->pf == NULL) || ((status_version != SINGLE)
+					&& (((temp->clients = c_htable_create ()) == NULL)
+						|| ((temp->sessions = c_htable_create ()) == NULL))))
+		{
+			ERROR ("openvpn plugin: Allocating the state of \"%s\" failed.",
+					status_file);
+			pread_file_destroy (temp->pf);
+			if (temp->clients != NULL)
+				c_htable_destroy (temp->clients);
+			sfree (temp->file);
+			sfree (temp);
+			return (1);
+		}
+
 		vpn_list = (vpn_status_t **) realloc (vpn_list, (vpn_num + 1) * sizeof (vpn_status_t *));
 		if (vpn_list == NULL)
 		{
@@ -632,6 +801,11 @@ static int openvpn_config (const char *key, const char *value)
 			ERROR ("openvpn plugin: malloc failed: %s",
 					sstrerror (errno, errbuf, sizeof (errbuf)));
 
+			pread_file_destroy (temp->pf);
+			if (temp->clients != NULL)
+				c_htable_destroy (temp->clients);
+			if (temp->sessions != NULL)
+				c_htable_destroy (temp->sessions);
 			sfree (temp->file);
 			sfree (temp);
 			return (1);
@@ -677,6 +851,13 @@ static int openvpn_config (const char *key, const char *value)
 		else
 			collect_individual_users = 1;
 	} /* if (strcasecmp("CollectIndividualUsers", key) == 0) */
+	else if (strcasecmp("CollectTotalTraffic", key) == 0)
+	{
+		if (IS_TRUE (value))
+			collect_total_traffic = 1;
+		else
+			collect_total_traffic = 0;
+	} /* if (strcasecmp("CollectTotalTraffic", key) == 0) */
 	else
 	{
 		return (-1);
@@ -692,6 +873,35 @@ static int openvpn_shutdown (void)
 
 	for (i = 0; i < vpn_num; i++)
 	{
+		if (vpn_list[i]->sessions != NULL)
+		{
+			char *key;
+			vpn_session_t *session;
+
+			while (c_htable_pick (vpn_list[i]->sessions,
+						(void *) &key, (void *) &session) == 0)
+			{
+				sfree (session->key);
+				sfree (session);
+			}
+			c_htable_destroy (vpn_list[i]->sessions);
+		}
+
+		if (vpn_list[i]->clients != NULL)
+		{
+			char *name;
+			vpn_client_t *client;
+
+			while (c_htable_pick (vpn_list[i]->clients,
+						(void *) &name, (void *) &client) == 0)
+			{
+				sfree (client->name);
+				sfree (client);
+			}
+			c_htable_destroy (vpn_list[i]->clients);
+		}
+
+		pread_file_destroy (vpn_list[i]->pf);
 		sfree (vpn_list[i]->file);
 		sfree (vpn_list[i]);
 	}
@@ -705,10 +915,12 @@ static int openvpn_init (void)
 {
 	if (!collect_individual_users
 			&& !collect_compression
-			&& !collect_user_count)
+			&& !collect_user_count
+			&& !collect_total_traffic)
 	{
 		WARNING ("OpenVPN plugin: Neither `CollectIndividualUsers', "
-				"`CollectCompression', nor `CollectUserCount' is true. There's no "
+				"`CollectCompression', `CollectUserCount', nor "
+				"`CollectTotalTraffic' is true. There's no "
 				"data left to collect.");
 		return (-1);
 	}
@@ -118,6 +118,13 @@ typedef struct c_ithread_s {
 	/* the thread's Perl interpreter */
 	PerlInterpreter *interp;
 
+	/* number of (nested) calls of the thread which has checked out the
+	 * interpreter */
+	int depth;
+
+	/* single linked list of idle interpreters */
+	struct c_ithread_s *next_idle;
+
 	/* double linked list of threads */
 	struct c_ithread_s *prev;
 	struct c_ithread_s *next;
@@ -127,12 +134,14 @@ typedef struct {
 	c_ithread_t *head;
 	c_ithread_t *tail;
 
-#if COLLECT_DEBUG
+	/* interpreters of the pool which are not checked out */
+	c_ithread_t *idle;
+
 	/* some usage stats */
 	int number_of_threads;
-#endif /* COLLECT_DEBUG */
 
 	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
 } c_ithread_list_t;
 
 /* name / user_data for Perl matches / targets */
@@ -162,9 +171,12 @@ extern char **environ;
  * point to the "base" thread */
 static c_ithread_list_t *perl_threads = NULL;
 
-/* the key used to store each pthread's ithread */
+/* the key used to store the ithread a pthread has checked out */
 static pthread_key_t perl_thr_key;
 
+/* number of interpreters cloned from the base interpreter */
+static int perl_pool_size = 4;
+
 static int    perl_argc = 0;
 static char **perl_argv = NULL;
 
@@ -1166,9 +1178,9 @@ static void c_ithread_destroy (c_ithread_t *ithread)
 
 #if COLLECT_DEBUG
 	sv_report_used ();
+#endif /* COLLECT_DEBUG */
 
 	--perl_threads->number_of_threads;
-#endif /* COLLECT_DEBUG */
 
 	perl_destruct (aTHX);
 	perl_free (aTHX);
@@ -1187,30 +1199,6 @@ static void c_ithread_destroy (c_ithread_t *ithread)
 	return;
 } /* static void c_ithread_destroy (c_ithread_t *) */
 
-static void c_ithread_destructor (void *arg)
-{
-	c_ithread_t *ithread = (c_ithread_t *)arg;
-	c_ithread_t *t = NULL;
-
-	if (NULL == perl_threads)
-		return;
-
-	pthread_mutex_lock (&perl_threads->mutex);
-
-	for (t = perl_threads->head; NULL != t; t = t->next)
-		if (t == ithread)
-			break;
-
-	/* the ithread no longer exists */
-	if (NULL == t)
-		return;
-
-	c_ithread_destroy (ithread);
-
-	pthread_mutex_unlock (&perl_threads->mutex);
-	return;
-} /* static void c_ithread_destructor (void *) */
-
 /* must be called with perl_threads->mutex locked */
 static c_ithread_t *c_ithread_create (PerlInterpreter *base)
 {
@@ -1234,9 +1222,7 @@ static c_ithread_t *c_ithread_create (PerlInterpreter *base)
 		PL_endav = Nullav;
 	}
 
-#if COLLECT_DEBUG
 	++perl_threads->number_of_threads;
-#endif /* COLLECT_DEBUG */
 
 	t->next = NULL;
 
@@ -1250,10 +1236,80 @@ static c_ithread_t *c_ithread_create (PerlInterpreter *base)
 	}
 
 	perl_threads->tail = t;
+	return t;
+} /* static c_ithread_t *c_ithread_create (PerlInterpreter *) */
 
+/* must be called with perl_threads->mutex locked */
+static void c_ithread_pool_fill (void)
+{
+	/* perl_clone() switches to the new interpreter */
+	PerlInterpreter *current = PERL_GET_CONTEXT;
+
+	while (perl_threads->number_of_threads - 1 < perl_pool_size) {
+		c_ithread_t *t = c_ithread_create (perl_threads->head->interp);
+
+		t->next_idle = perl_threads->idle;
+		perl_threads->idle = t;
+	}
+
+	PERL_SET_CONTEXT (current);
+	return;
+} /* static void c_ithread_pool_fill (void) */
+
+/*
+ * Checks out an interpreter for the calling thread. Nested calls, e.g. a
+ * Perl match applied to values dispatched by a Perl read callback, use the
+ * interpreter the thread already holds. The main thread always uses the base
+ * interpreter. Any other thread blocks until one of the pool's interpreters
+ * is idle.
+ */
+static c_ithread_t *c_ithread_get (void)
+{
+	c_ithread_t *t = NULL;
+
+	t = (c_ithread_t *)pthread_getspecific (perl_thr_key);
+	if (NULL != t) {
+		++t->depth;
+		return t;
+	}
+
+	pthread_mutex_lock (&perl_threads->mutex);
+
+	/* the pool is filled by perl_init() - this only happens if a callback
+	 * is called before that */
+	if (perl_threads->number_of_threads - 1 < perl_pool_size)
+		c_ithread_pool_fill ();
+
+	while (NULL == perl_threads->idle)
+		pthread_cond_wait (&perl_threads->cond, &perl_threads->mutex);
+
+	t = perl_threads->idle;
+	perl_threads->idle = t->next_idle;
+	t->next_idle = NULL;
+
+	pthread_mutex_unlock (&perl_threads->mutex);
+
+	t->depth = 1;
 	pthread_setspecific (perl_thr_key, (const void *)t);
+	PERL_SET_CONTEXT (t->interp);
 	return t;
-} /* static c_ithread_t *c_ithread_create (PerlInterpreter *) */
+} /* static c_ithread_t *c_ithread_get (void) */
+
+static void c_ithread_put (c_ithread_t *t)
+{
+	if (0 < --t->depth)
+		return;
+
+	pthread_setspecific (perl_thr_key, NULL);
+	PERL_SET_CONTEXT (NULL);
+
+	pthread_mutex_lock (&perl_threads->mutex);
+	t->next_idle = perl_threads->idle;
+	perl_threads->idle = t;
+	pthread_cond_signal (&perl_threads->cond);
+	pthread_mutex_unlock (&perl_threads->mutex);
+	return;
+} /* static void c_ithread_put (c_ithread_t *) */
 
 /*
  * Filter chains implementation.
@@ -1401,27 +1457,15 @@ static int fc_call (pTHX_ int type, int cb_type, pfc_user_data_t *data, ...)
 static int fc_create (int type, const oconfig_item_t *ci, void **user_data)
 {
 	pfc_user_data_t *data;
+	c_ithread_t *t = NULL;
 
 	int ret = 0;
 
-	dTHX;
+	dTHXa (NULL);
 
 	if (NULL == perl_threads)
 		return 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
-
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
-
-		aTHX = t->interp;
-	}
-
-	log_debug ("fc_create: c_ithread: interp = %p (active threads: %i)",
-			aTHX, perl_threads->number_of_threads);
-
 	if ((1 != ci->values_num)
 			|| (OCONFIG_TYPE_STRING != ci->values[0].type)) {
 		log_warn ("A \"%s\" block expects a single string argument.",
@@ -1429,6 +1473,12 @@ static int fc_create (int type, const oconfig_item_t *ci, void **user_data)
 		return -1;
 	}
 
+	t = c_ithread_get ();
+	aTHX = t->interp;
+
+	log_debug ("fc_create: c_ithread: interp = %p (active threads: %i)",
+			aTHX, perl_threads->number_of_threads);
+
 	data = (pfc_user_data_t *)smalloc (sizeof (*data));
 	data->name      = sstrdup (ci->values[0].value.string);
 	data->user_data = newSV (0);
@@ -1439,29 +1489,25 @@ static int fc_create (int type, const oconfig_item_t *ci, void **user_data)
 		PFC_USER_DATA_FREE (data);
 	else
 		*user_data = data;
+
+	c_ithread_put (t);
 	return ret;
 } /* static int fc_create (int, const oconfig_item_t *, void **) */
 
 static int fc_destroy (int type, void **user_data)
 {
 	pfc_user_data_t *data = *(pfc_user_data_t **)user_data;
+	c_ithread_t *t = NULL;
 
 	int ret = 0;
 
-	dTHX;
+	dTHXa (NULL);
 
 	if ((NULL == perl_threads) || (NULL == data))
 		return 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
-
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
-
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	log_debug ("fc_destroy: c_ithread: interp = %p (active threads: %i)",
 			aTHX, perl_threads->number_of_threads);
@@ -1470,6 +1516,8 @@ static int fc_destroy (int type, void **user_data)
 
 	PFC_USER_DATA_FREE (data);
 	*user_data = NULL;
+
+	c_ithread_put (t);
 	return ret;
 } /* static int fc_destroy (int, void **) */
 
@@ -1477,28 +1525,27 @@ static int fc_exec (int type, const data_set_t *ds, const value_list_t *vl,
 		notification_meta_t **meta, void **user_data)
 {
 	pfc_user_data_t *data = *(pfc_user_data_t **)user_data;
+	c_ithread_t *t = NULL;
 
-	dTHX;
+	int ret = 0;
+
+	dTHXa (NULL);
 
 	if (NULL == perl_threads)
 		return 0;
 
 	assert (NULL != data);
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
-
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
-
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	log_debug ("fc_exec: c_ithread: interp = %p (active threads: %i)",
 			aTHX, perl_threads->number_of_threads);
 
-	return fc_call (aTHX_ type, FC_CB_EXEC, data, ds, vl, meta);
+	ret = fc_call (aTHX_ type, FC_CB_EXEC, data, ds, vl, meta);
+
+	c_ithread_put (t);
+	return ret;
 } /* static int fc_exec (int, const data_set_t *, const value_list_t *,
 		notification_meta_t **, void **) */
 
@@ -1909,42 +1956,49 @@ static XS (Collectd_call_by_name)
 
 static int perl_init (void)
 {
-	dTHX;
+	c_ithread_t *t = NULL;
 
-	if (NULL == perl_threads)
-		return 0;
+	int ret = 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
+	dTHXa (NULL);
 
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
+	if (NULL == perl_threads)
+		return 0;
 
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	log_debug ("perl_init: c_ithread: interp = %p (active threads: %i)",
 			aTHX, perl_threads->number_of_threads);
-	return pplugin_call_all (aTHX_ PLUGIN_INIT);
+	ret = pplugin_call_all (aTHX_ PLUGIN_INIT);
+
+	/* Clone the pool's interpreters after the init callbacks have been
+	 * called to let them inherit the plugins' state. This is done before
+	 * any read or write threads make use of the pool. */
+	pthread_mutex_lock (&perl_threads->mutex);
+	c_ithread_pool_fill ();
+	pthread_mutex_unlock (&perl_threads->mutex);
+
+	log_debug ("perl_init: %i interpreters in the pool",
+			perl_threads->number_of_threads - 1);
+
+	c_ithread_put (t);
+	return ret;
 } /* static int perl_init (void) */
 
 static int perl_read (void)
 {
-	dTHX;
+	c_ithread_t *t = NULL;
 
-	if (NULL == perl_threads)
-		return 0;
+	int ret = 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
+	dTHXa (NULL);
 
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
+	if (NULL == perl_threads)
+		return 0;
 
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	/* Assert that we're not running as the base thread. Otherwise, we might
 	 * run into concurrency issues with c_ithread_create(). See
@@ -1953,27 +2007,30 @@ static int perl_read (void)
 
 	log_debug ("perl_read: c_ithread: interp = %p (active threads: %i)",
 			aTHX, perl_threads->number_of_threads);
-	return pplugin_call_all (aTHX_ PLUGIN_READ);
+	ret = pplugin_call_all (aTHX_ PLUGIN_READ);
+
+	c_ithread_put (t);
+	return ret;
 } /* static int perl_read (void) */
 
-static int perl_write (const data_set_t *ds, const value_list_t *vl,
+/* All value lists a write thread has dequeued are handled using a single
+ * interpreter, so the write threads don't compete for the pool once per
+ * value list. */
+static int perl_write (const plugin_write_item_t *items, size_t items_num,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	int status;
-	dTHX;
+	c_ithread_t *t = NULL;
+	size_t i;
 
-	if (NULL == perl_threads)
-		return 0;
+	int status = 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
+	dTHXa (NULL);
 
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
+	if (NULL == perl_threads)
+		return 0;
 
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	/* Lock the base thread if this is not called from one of the read threads
 	 * to avoid race conditions with c_ithread_create(). See
@@ -1981,33 +2038,37 @@ static int perl_write (const data_set_t *ds, const value_list_t *vl,
 	if (aTHX == perl_threads->head->interp)
 		pthread_mutex_lock (&perl_threads->mutex);
 
-	log_debug ("perl_write: c_ithread: interp = %p (active threads: %i)",
-			aTHX, perl_threads->number_of_threads);
-	status = pplugin_call_all (aTHX_ PLUGIN_WRITE, ds, vl);
+	log_debug ("perl_write: c_ithread: interp = %p (active threads: %i, "
+			"value lists: %zu)",
+			aTHX, perl_threads->number_of_threads, items_num);
+
+	for (i = 0; i < items_num; ++i) {
+		int tmp = pplugin_call_all (aTHX_ PLUGIN_WRITE,
+				items[i].ds, items[i].vl);
+
+		if (0 != tmp)
+			status = tmp;
+	}
 
 	if (aTHX == perl_threads->head->interp)
 		pthread_mutex_unlock (&perl_threads->mutex);
 
+	c_ithread_put (t);
 	return status;
-} /* static int perl_write (const data_set_t *, const value_list_t *) */
+} /* static int perl_write (const plugin_write_item_t *, size_t) */
 
 static void perl_log (int level, const char *msg,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	dTHX;
+	c_ithread_t *t = NULL;
+
+	dTHXa (NULL);
 
 	if (NULL == perl_threads)
 		return;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
-
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
-
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	/* Lock the base thread if this is not called from one of the read threads
 	 * to avoid race conditions with c_ithread_create(). See
@@ -2020,47 +2081,50 @@ static void perl_log (int level, const char *msg,
 	if (aTHX == perl_threads->head->interp)
 		pthread_mutex_unlock (&perl_threads->mutex);
 
+	c_ithread_put (t);
 	return;
 } /* static void perl_log (int, const char *) */
 
 static int perl_notify (const notification_t *notif,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	dTHX;
+	c_ithread_t *t = NULL;
+
+	int ret = 0;
+
+	dTHXa (NULL);
 
 	if (NULL == perl_threads)
 		return 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
+	ret = pplugin_call_all (aTHX_ PLUGIN_NOTIF, notif);
 
-		aTHX = t->interp;
-	}
-	return pplugin_call_all (aTHX_ PLUGIN_NOTIF, notif);
+	c_ithread_put (t);
+	return ret;
 } /* static int perl_notify (const notification_t *) */
 
 static int perl_flush (cdtime_t timeout, const char *identifier,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	dTHX;
+	c_ithread_t *t = NULL;
+
+	int ret = 0;
+
+	dTHXa (NULL);
 
 	if (NULL == perl_threads)
 		return 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
+	ret = pplugin_call_all (aTHX_ PLUGIN_FLUSH, timeout, identifier);
 
-		aTHX = t->interp;
-	}
-	return pplugin_call_all (aTHX_ PLUGIN_FLUSH, timeout, identifier);
+	c_ithread_put (t);
+	return ret;
 } /* static int perl_flush (const int) */
 
 static int perl_shutdown (void)
@@ -2069,22 +2133,15 @@ static int perl_shutdown (void)
 
 	int ret = 0;
 
-	dTHX;
+	dTHXa (NULL);
 
 	plugin_unregister_complex_config ("perl");
 
 	if (NULL == perl_threads)
 		return 0;
 
-	if (NULL == aTHX) {
-		c_ithread_t *t = NULL;
-
-		pthread_mutex_lock (&perl_threads->mutex);
-		t = c_ithread_create (perl_threads->head->interp);
-		pthread_mutex_unlock (&perl_threads->mutex);
-
-		aTHX = t->interp;
-	}
+	t = c_ithread_get ();
+	aTHX = t->interp;
 
 	log_debug ("perl_shutdown: c_ithread: interp = %p (active threads: %i)",
 			aTHX, perl_threads->number_of_threads);
@@ -2098,6 +2155,8 @@ static int perl_shutdown (void)
 
 	ret = pplugin_call_all (aTHX_ PLUGIN_SHUTDOWN);
 
+	c_ithread_put (t);
+
 	pthread_mutex_lock (&perl_threads->mutex);
 	t = perl_threads->tail;
 
@@ -2113,6 +2172,7 @@ static int perl_shutdown (void)
 
 	pthread_mutex_unlock (&perl_threads->mutex);
 	pthread_mutex_destroy (&perl_threads->mutex);
+	pthread_cond_destroy (&perl_threads->cond);
 
 	sfree (perl_threads);
 
@@ -2239,7 +2299,7 @@ static int init_pi (int argc, char **argv)
 	}
 #endif /* COLLECT_DEBUG */
 
-	if (0 != pthread_key_create (&perl_thr_key, c_ithread_destructor)) {
+	if (0 != pthread_key_create (&perl_thr_key, NULL)) {
 		log_err ("init_pi: pthread_key_create failed");
 
 		/* this must not happen - cowardly giving up if it does */
@@ -2257,6 +2317,7 @@ static int init_pi (int argc, char **argv)
 	memset (perl_threads, 0, sizeof (c_ithread_list_t));
 
 	pthread_mutex_init (&perl_threads->mutex, NULL);
+	pthread_cond_init (&perl_threads->cond, NULL);
 	/* locking the mutex should not be necessary at this point
 	 * but let's just do it for the sake of completeness */
 	pthread_mutex_lock (&perl_threads->mutex);
@@ -2272,6 +2333,10 @@ static int init_pi (int argc, char **argv)
 	aTHX = perl_threads->head->interp;
 	pthread_mutex_unlock (&perl_threads->mutex);
 
+	/* the base interpreter is never returned to the pool */
+	perl_threads->head->depth = 1;
+	pthread_setspecific (perl_thr_key, (const void *)perl_threads->head);
+
 	perl_construct (aTHX);
 
 	PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
@@ -2283,6 +2348,8 @@ static int init_pi (int argc, char **argv)
 
 		perl_destruct (perl_threads->head->interp);
 		perl_free (perl_threads->head->interp);
+		pthread_mutex_destroy (&perl_threads->mutex);
+		pthread_cond_destroy (&perl_threads->cond);
 		sfree (perl_threads);
 
 		pthread_key_delete (perl_thr_key);
@@ -2301,7 +2368,7 @@ static int init_pi (int argc, char **argv)
 
 	plugin_register_read ("perl", perl_read);
 
-	plugin_register_write ("perl", perl_write, /* user_data = */ NULL);
+	plugin_register_write_batch ("perl", perl_write, /* user_data = */ NULL);
 	plugin_register_flush ("perl", perl_flush, /* user_data = */ NULL);
 	plugin_register_shutdown ("perl", perl_shutdown);
 	return 0;
@@ -2404,6 +2471,34 @@ static int perl_config_enabledebugger (pTHX_ oconfig_item_t *ci)
 	return 0;
 } /* static int perl_config_enabledebugger (oconfig_item_it *) */
 
+/*
+ * InterpreterPoolSize <Number>
+ */
+static int perl_config_interpreterpoolsize (pTHX_ oconfig_item_t *ci)
+{
+	int value = 0;
+
+	if ((0 != ci->children_num) || (1 != ci->values_num)
+			|| (OCONFIG_TYPE_NUMBER != ci->values[0].type)) {
+		log_err ("InterpreterPoolSize expects a single number argument.");
+		return 1;
+	}
+
+	value = (int)ci->values[0].value.number;
+	if (1 > value) {
+		log_err ("InterpreterPoolSize has to be at least 1.");
+		return 1;
+	}
+
+	if ((NULL != perl_threads)
+			&& (perl_threads->number_of_threads - 1 > value))
+		log_warn ("InterpreterPoolSize: %i interpreters have already "
+				"been created.", perl_threads->number_of_threads - 1);
+
+	perl_pool_size = value;
+	return 0;
+} /* static int perl_config_interpreterpoolsize (oconfig_item_it *) */
+
 /*
  * IncludeDir "<Dir>"
  */
@@ -2520,6 +2615,8 @@ static int perl_config (oconfig_item_t *ci)
 			current_status = perl_config_enabledebugger (aTHX_ c);
 		else if (0 == strcasecmp (c->key, "IncludeDir"))
 			current_status = perl_config_includedir (aTHX_ c);
+		else if (0 == strcasecmp (c->key, "InterpreterPoolSize"))
+			current_status = perl_config_interpreterpoolsize (aTHX_ c);
 		else if (0 == strcasecmp (c->key, "Plugin"))
 			current_status = perl_config_plugin (aTHX_ c);
 		else
@@ -23,6 +23,8 @@
  *   Florian Forster <octo at verplant.org>
  **/
 
+#define _GNU_SOURCE /* For recvmmsg() */
+
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
@@ -54,6 +56,20 @@
 # define PINBA_MAX_SOCKETS 16
 #endif
 
+/* Number of datagrams read from a socket with one call to recvmmsg(2). */
+#ifndef PINBA_RECV_BATCH
+# define PINBA_RECV_BATCH 16
+#endif
+
+/* Size of the memory pool requests are unpacked into. An unpacked request
+ * is usually smaller than the datagram it was read from; larger ones fall
+ * back to malloc(3). */
+#ifndef PINBA_ARENA_SIZE
+# define PINBA_ARENA_SIZE (2 * PINBA_UDP_BUFFER_SIZE)
+#endif
+
+#define PINBA_ARENA_ALIGN 16
+
 /*
  * Private data structures
  */
@@ -73,6 +89,19 @@ struct float_counter_s
 };
 typedef struct float_counter_s float_counter_t;
 
+struct pinba_counters_s
+{
+  derive_t req_count;
+
+  float_counter_t req_time;
+  float_counter_t ru_utime;
+  float_counter_t ru_stime;
+
+  derive_t doc_size;
+  gauge_t mem_peak;
+};
+typedef struct pinba_counters_s pinba_counters_t;
+
 struct pinba_statnode_s
 {
   /* collector name, used as plugin instance */
@@ -83,16 +112,36 @@ struct pinba_statnode_s
   char *server;
   char *script;
 
-  derive_t req_count;
+  /* Totals, updated from the collectors' counters by the read callback. */
+  pinba_counters_t counters;
+};
+typedef struct pinba_statnode_s pinba_statnode_t;
 
-  float_counter_t req_time;
-  float_counter_t ru_utime;
-  float_counter_t ru_stime;
+/* Memory pool for protobuf-c. Allocations are never freed individually;
+ * the whole pool is reset after each request has been accounted for. */
+struct pinba_arena_s
+{
+  char *data;
+  size_t size;
+  size_t used;
 
-  derive_t doc_size;
-  gauge_t mem_peak;
+  /* Blocks allocated with malloc(3) once "data" is exhausted. */
+  void *overflow;
 };
-typedef struct pinba_statnode_s pinba_statnode_t;
+typedef struct pinba_arena_s pinba_arena_t;
+
+/* Each receive thread accounts the requests it reads in its own set of
+ * counters, one per view, so threads don't contend for a lock. The read
+ * callback adds them to the totals in "stat_nodes". */
+struct pinba_collector_s
+{
+  pthread_t id;
+  _Bool running;
+
+  pthread_mutex_t lock;
+  pinba_counters_t *counters;
+};
+typedef struct pinba_collector_s pinba_collector_t;
 /* }}} */
 
 /*
@@ -101,14 +150,14 @@ typedef struct pinba_statnode_s pinba_statnode_t;
 /* {{{ */
 static pinba_statnode_t *stat_nodes = NULL;
 static unsigned int stat_nodes_num = 0;
-static pthread_mutex_t stat_nodes_lock;
 
 static char *conf_node = NULL;
 static char *conf_service = NULL;
+static int conf_threads = 1;
 
-static _Bool collector_thread_running = 0;
+static pinba_collector_t *collectors = NULL;
+static int collectors_num = 0;
 static _Bool collector_thread_do_shutdown = 0;
-static pthread_t collector_thread_id;
 /* }}} */
 
 /*
@@ -135,6 +184,20 @@ static void float_counter_add (float_counter_t *fc, float val) /* {{{ */
   }
 } /* }}} void float_counter_add */
 
+static void float_counter_merge (float_counter_t *dst, /* {{{ */
+    const float_counter_t *src)
+{
+  dst->i += src->i;
+  dst->n += src->n;
+
+  if (dst->n >= 1000000000)
+  {
+    dst->i += 1;
+    dst->n -= 1000000000;
+    assert (dst->n < 1000000000);
+  }
+} /* }}} void float_counter_merge */
+
 static derive_t float_counter_get (const float_counter_t *fc, /* {{{ */
     uint64_t factor)
 {
@@ -161,13 +224,61 @@ static void strset (char **str, const char *new) /* {{{ */
   *str = tmp;
 } /* }}} void strset */
 
+static void *pinba_arena_alloc (void *user_data, size_t size) /* {{{ */
+{
+  pinba_arena_t *a = user_data;
+  size_t aligned;
+  char *block;
+
+  aligned = (size + (PINBA_ARENA_ALIGN - 1)) & ~((size_t) PINBA_ARENA_ALIGN - 1);
+  if ((a->data != NULL) && (aligned <= (a->size - a->used)))
+  {
+    void *ret = a->data + a->used;
+    a->used += aligned;
+    return (ret);
+  }
+
+  /* The first PINBA_ARENA_ALIGN bytes link the overflow blocks. */
+  block = malloc (PINBA_ARENA_ALIGN + size);
+  if (block == NULL)
+    return (NULL);
+
+  *((void **) block) = a->overflow;
+  a->overflow = block;
+
+  return (block + PINBA_ARENA_ALIGN);
+} /* }}} void *pinba_arena_alloc */
+
+static void pinba_arena_free (void *user_data, void *ptr) /* {{{ */
+{
+  /* Released all at once by pinba_arena_reset. */
+} /* }}} void pinba_arena_free */
+
+static void pinba_arena_reset (pinba_arena_t *a) /* {{{ */
+{
+  while (a->overflow != NULL)
+  {
+    void *next = *((void **) a->overflow);
+    free (a->overflow);
+    a->overflow = next;
+  }
+
+  a->used = 0;
+} /* }}} void pinba_arena_reset */
+
+static void pinba_counters_reset (pinba_counters_t *c) /* {{{ */
+{
+  memset (c, 0, sizeof (*c));
+  c->mem_peak = NAN;
+} /* }}} void pinba_counters_reset */
+
 static void service_statnode_add(const char *name, /* {{{ */
     const char *host,
     const char *server,
     const char *script)
 {
   pinba_statnode_t *node;
-  
+
   node = realloc (stat_nodes,
       sizeof (*stat_nodes) * (stat_nodes_num + 1));
   if (node == NULL)
@@ -179,25 +290,57 @@ static void service_statnode_add(const char *name, /* {{{ */
 
   node = stat_nodes + stat_nodes_num;
   memset (node, 0, sizeof (*node));
-  
+
   /* reset strings */
   node->name   = NULL;
   node->host   = NULL;
   node->server = NULL;
   node->script = NULL;
 
-  node->mem_peak = NAN;
-  
+  pinba_counters_reset (&node->counters);
+
   /* fill query data */
   strset (&node->name, name);
   strset (&node->host, host);
   strset (&node->server, server);
   strset (&node->script, script);
-  
+
   /* increment counter */
   stat_nodes_num++;
 } /* }}} void service_statnode_add */
 
+/* Moves the counters of all collectors into the totals in "stat_nodes". */
+static void service_statnode_merge (void) /* {{{ */
+{
+  int i;
+  unsigned int j;
+
+  for (i = 0; i < collectors_num; i++)
+  {
+    pinba_collector_t *c = collectors + i;
+
+    pthread_mutex_lock (&c->lock);
+    for (j = 0; j < stat_nodes_num; j++)
+    {
+      pinba_counters_t *dst = &stat_nodes[j].counters;
+      pinba_counters_t *src = c->counters + j;
+
+      dst->req_count += src->req_count;
+      float_counter_merge (&dst->req_time, &src->req_time);
+      float_counter_merge (&dst->ru_utime, &src->ru_utime);
+      float_counter_merge (&dst->ru_stime, &src->ru_stime);
+      dst->doc_size += src->doc_size;
+
+      if (!isnan (src->mem_peak)
+          && (isnan (dst->mem_peak) || (dst->mem_peak < src->mem_peak)))
+        dst->mem_peak = src->mem_peak;
+
+      pinba_counters_reset (src);
+    }
+    pthread_mutex_unlock (&c->lock);
+  }
+} /* }}} void service_statnode_merge */
+
 /* Copy the data from the global "stat_nodes" list into the buffer pointed to
  * by "res", doing the derivation in the process. Returns the next index or
  * zero if the end of the list has been reached. */
@@ -205,53 +348,50 @@ static unsigned int service_statnode_collect (pinba_statnode_t *res, /* {{{ */
     unsigned int index)
 {
   pinba_statnode_t *node;
-  
+
   if (stat_nodes_num == 0)
     return 0;
-  
+
   /* begin collecting */
   if (index == 0)
-    pthread_mutex_lock (&stat_nodes_lock);
-  
+    service_statnode_merge ();
+
   /* end collecting */
   if (index >= stat_nodes_num)
-  {
-    pthread_mutex_unlock (&stat_nodes_lock);
     return 0;
-  }
 
   node = stat_nodes + index;
   memcpy (res, node, sizeof (*res));
 
   /* reset node */
-  node->mem_peak = NAN;
-  
+  node->counters.mem_peak = NAN;
+
   return (index + 1);
 } /* }}} unsigned int service_statnode_collect */
 
-static void service_statnode_process (pinba_statnode_t *node, /* {{{ */
+static void service_statnode_process (pinba_counters_t *c, /* {{{ */
     Pinba__Request* request)
 {
-  node->req_count++;
+  c->req_count++;
 
-  float_counter_add (&node->req_time, request->request_time);
-  float_counter_add (&node->ru_utime, request->ru_utime);
-  float_counter_add (&node->ru_stime, request->ru_stime);
+  float_counter_add (&c->req_time, request->request_time);
+  float_counter_add (&c->ru_utime, request->ru_utime);
+  float_counter_add (&c->ru_stime, request->ru_stime);
 
-  node->doc_size += request->document_size;
+  c->doc_size += request->document_size;
 
-  if (isnan (node->mem_peak)
-      || (node->mem_peak < ((gauge_t) request->memory_peak)))
-    node->mem_peak = (gauge_t) request->memory_peak;
+  if (isnan (c->mem_peak)
+      || (c->mem_peak < ((gauge_t) request->memory_peak)))
+    c->mem_peak = (gauge_t) request->memory_peak;
 
 } /* }}} void service_statnode_process */
 
-static void service_process_request (Pinba__Request *request) /* {{{ */
+/* The caller must hold the collector's lock. */
+static void service_process_request (pinba_collector_t *c, /* {{{ */
+    Pinba__Request *request)
 {
   unsigned int i;
 
-  pthread_mutex_lock (&stat_nodes_lock);
-  
   for (i = 0; i < stat_nodes_num; i++)
   {
     if ((stat_nodes[i].host != NULL)
@@ -266,10 +406,8 @@ static void service_process_request (Pinba__Request *request) /* {{{ */
       && (strcmp (request->script_name, stat_nodes[i].script) != 0))
       continue;
 
-    service_statnode_process(&stat_nodes[i], request);
+    service_statnode_process (c->counters + i, request);
   }
-  
-  pthread_mutex_unlock(&stat_nodes_lock);
 } /* }}} void service_process_request */
 
 static int pb_del_socket (pinba_socket_t *s, /* {{{ */
@@ -325,12 +463,29 @@ static int pb_add_socket (pinba_socket_t *s, /* {{{ */
         sstrerror (errno, errbuf, sizeof (errbuf)));
   }
 
+#ifdef SO_REUSEPORT
+  /* Every receive thread binds its own socket to the same address and the
+   * kernel distributes the datagrams among them. */
+  if (conf_threads > 1)
+  {
+    tmp = 1;
+    status = setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof (tmp));
+    if (status != 0)
+    {
+      char errbuf[1024];
+      WARNING ("pinba plugin: setsockopt(SO_REUSEPORT) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+    }
+  }
+#endif
+
   status = bind (fd, ai->ai_addr, ai->ai_addrlen);
   if (status != 0)
   {
     char errbuf[1024];
     ERROR ("pinba plugin: bind(2) failed: %s",
         sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
     return (0);
   }
 
@@ -391,7 +546,7 @@ static pinba_socket_t *pinba_socket_open (const char *node, /* {{{ */
     if (status != 0)
       break;
   } /* for (ai_list) */
-  
+
   freeaddrinfo (ai_list);
 
   if (s->fd_num < 1)
@@ -410,7 +565,7 @@ static void pinba_socket_free (pinba_socket_t *socket) /* {{{ */
 
   if (!socket)
     return;
-  
+
   for (i = 0; i < socket->fd_num; i++)
   {
     if (socket->fd[i].fd < 0)
@@ -418,84 +573,172 @@ static void pinba_socket_free (pinba_socket_t *socket) /* {{{ */
     close (socket->fd[i].fd);
     socket->fd[i].fd = -1;
   }
-  
+
   sfree(socket);
 } /* }}} void pinba_socket_free */
 
-static int pinba_process_stats_packet (const uint8_t *buffer, /* {{{ */
-    size_t buffer_size)
+/* The caller must hold the collector's lock. */
+static int pinba_process_stats_packet (pinba_collector_t *c, /* {{{ */
+    ProtobufCAllocator *allocator, pinba_arena_t *arena,
+    const uint8_t *buffer, size_t buffer_size)
 {
-  Pinba__Request *request;  
-  
-  request = pinba__request__unpack (NULL, buffer_size, buffer);
-  
+  Pinba__Request *request;
+
+  request = pinba__request__unpack (allocator, buffer_size, buffer);
+
   if (!request)
+  {
+    pinba_arena_reset (arena);
     return (-1);
+  }
+
+  service_process_request (c, request);
+
+  /* Frees the request, too. */
+  pinba_arena_reset (arena);
 
-  service_process_request(request);
-  pinba__request__free_unpacked (request, NULL);
-    
   return (0);
 } /* }}} int pinba_process_stats_packet */
 
-static int pinba_udp_read_callback_fn (int sock) /* {{{ */
+/* Reads up to PINBA_RECV_BATCH datagrams from "sock" without blocking.
+ * Returns the number of datagrams read, zero if there were none and less
+ * than zero on error. */
+static int pinba_udp_receive (int sock, uint8_t *buffers, /* {{{ */
+    size_t *sizes)
 {
-  uint8_t buffer[PINBA_UDP_BUFFER_SIZE];
-  size_t buffer_size;
   int status;
+  int num = 0;
 
-  while (42)
+#if HAVE_RECVMMSG
+  struct mmsghdr msgs[PINBA_RECV_BATCH];
+  struct iovec iovs[PINBA_RECV_BATCH];
+  int i;
+
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < PINBA_RECV_BATCH; i++)
   {
-    buffer_size = sizeof (buffer);
-    status = recvfrom (sock, buffer, buffer_size - 1, MSG_DONTWAIT, /* from = */ NULL, /* from len = */ 0);
+    iovs[i].iov_base = buffers + (i * PINBA_UDP_BUFFER_SIZE);
+    iovs[i].iov_len = PINBA_UDP_BUFFER_SIZE;
+    msgs[i].msg_hdr.msg_iov = iovs + i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  do
+  {
+    status = recvmmsg (sock, msgs, PINBA_RECV_BATCH, MSG_DONTWAIT,
+        /* timeout = */ NULL);
+  } while ((status < 0) && (errno == EINTR));
+
+  for (i = 0; i < status; i++)
+    sizes[i] = (size_t) msgs[i].msg_len;
+  if (status > 0)
+    num = status;
+#else
+  while (num < PINBA_RECV_BATCH)
+  {
+    status = recvfrom (sock, buffers + (num * PINBA_UDP_BUFFER_SIZE),
+        PINBA_UDP_BUFFER_SIZE, MSG_DONTWAIT,
+        /* from = */ NULL, /* from len = */ 0);
+    if ((status < 0) && (errno == EINTR))
+      continue;
     if (status < 0)
-    {
-      char errbuf[1024];
+      break;
+
+    sizes[num] = (size_t) status;
+    num++;
+  }
+#endif /* !HAVE_RECVMMSG */
+
+  if ((num == 0) && (status < 0))
+  {
+    char errbuf[1024];
 
-      if ((errno == EINTR)
+    if ((errno == EAGAIN)
 #ifdef EWOULDBLOCK
-          || (errno == EWOULDBLOCK)
+        || (errno == EWOULDBLOCK)
 #endif
-          || (errno == EAGAIN))
-      {
-        continue;
-      }
+       )
+      return (0);
+
+    WARNING ("pinba plugin: %s failed: %s",
+#if HAVE_RECVMMSG
+        "recvmmsg(2)",
+#else
+        "recvfrom(2)",
+#endif
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
 
-      WARNING("pinba plugin: recvfrom(2) failed: %s",
-          sstrerror (errno, errbuf, sizeof (errbuf)));
-      return (-1);
-    }
-    else if (status == 0)
-    {
-      DEBUG ("pinba plugin: recvfrom(2) returned unexpected status zero.");
-      return (-1);
-    }
-    else /* if (status > 0) */
-    {
-      assert (((size_t) status) < buffer_size);
-      buffer_size = (size_t) status;
-      buffer[buffer_size] = 0;
-
-      status = pinba_process_stats_packet (buffer, buffer_size);
-      if (status != 0)
-        DEBUG("pinba plugin: Parsing packet failed.");
-      return (status);
-    }
-  } /* while (42) */
+  return (num);
+} /* }}} int pinba_udp_receive */
+
+static int pinba_udp_read_callback_fn (pinba_collector_t *c, /* {{{ */
+    ProtobufCAllocator *allocator, pinba_arena_t *arena,
+    int sock, uint8_t *buffers, size_t *sizes)
+{
+  int num;
+  int i;
+
+  num = pinba_udp_receive (sock, buffers, sizes);
+  if (num <= 0)
+    return (num);
+
+  pthread_mutex_lock (&c->lock);
+  for (i = 0; i < num; i++)
+  {
+    int status;
+
+    if (sizes[i] == 0)
+      continue;
 
-  /* not reached */
-  assert (23 == 42);
-  return (-1);
-} /* }}} void pinba_udp_read_callback_fn */
+    status = pinba_process_stats_packet (c, allocator, arena,
+        buffers + (i * PINBA_UDP_BUFFER_SIZE), sizes[i]);
+    if (status != 0)
+      DEBUG("pinba plugin: Parsing packet failed.");
+  }
+  pthread_mutex_unlock (&c->lock);
 
-static int receive_loop (void) /* {{{ */
+  return (num);
+} /* }}} int pinba_udp_read_callback_fn */
+
+static int receive_loop (pinba_collector_t *c) /* {{{ */
 {
   pinba_socket_t *s;
+  pinba_arena_t arena;
+  ProtobufCAllocator allocator;
+  uint8_t *buffers;
+  size_t sizes[PINBA_RECV_BATCH];
+
+  memset (&arena, 0, sizeof (arena));
+  arena.data = malloc (PINBA_ARENA_SIZE);
+  if (arena.data != NULL)
+    arena.size = PINBA_ARENA_SIZE;
+
+  memset (&allocator, 0, sizeof (allocator));
+  allocator.alloc = pinba_arena_alloc;
+  allocator.free = pinba_arena_free;
+#ifndef PROTOBUF_C_VERSION_NUMBER
+  /* protobuf-c before 1.0 */
+  allocator.tmp_alloc = pinba_arena_alloc;
+  allocator.max_alloca = 8192;
+#endif
+  allocator.allocator_data = &arena;
+
+  buffers = malloc (PINBA_RECV_BATCH * PINBA_UDP_BUFFER_SIZE);
+  if (buffers == NULL)
+  {
+    ERROR ("pinba plugin: malloc failed.");
+    sfree (arena.data);
+    return (-1);
+  }
 
   s = pinba_socket_open (conf_node, conf_service);
   if (s == NULL)
   {
     ERROR ("pinba plugin: Collector thread is exiting prematurely.");
+    sfree (buffers);
+    sfree (arena.data);
     return (-1);
   }
 
@@ -522,6 +765,8 @@ static int receive_loop (void) /* {{{ */
       ERROR ("pinba plugin: poll(2) failed: %s",
           sstrerror (errno, errbuf, sizeof (errbuf)));
       pinba_socket_free (s);
+      sfree (buffers);
+      sfree (arena.data);
       return (-1);
     }
 
@@ -534,7 +779,8 @@ static int receive_loop (void) /* {{{ */
       }
       else if (s->fd[i].revents & (POLLIN | POLLPRI))
       {
-        pinba_udp_read_callback_fn (s->fd[i].fd);
+        pinba_udp_read_callback_fn (c, &allocator, &arena,
+            s->fd[i].fd, buffers, sizes);
       }
     } /* for (s->fd) */
   } /* while (!collector_thread_do_shutdown) */
@@ -542,15 +788,17 @@ static int receive_loop (void) /* {{{ */
   pinba_socket_free (s);
   s = NULL;
 
+  sfree (buffers);
+  pinba_arena_reset (&arena);
+  sfree (arena.data);
+
   return (0);
 } /* }}} int receive_loop */
 
 static void *collector_thread (void *arg) /* {{{ */
 {
-  receive_loop ();
+  receive_loop (arg);
 
-  memset (&collector_thread_id, 0, sizeof (collector_thread_id));
-  collector_thread_running = 0;
   pthread_exit (NULL);
   return (NULL);
 } /* }}} void *collector_thread */
@@ -605,10 +853,6 @@ static int pinba_config_view (const oconfig_item_t *ci) /* {{{ */
 static int plugin_config (oconfig_item_t *ci) /* {{{ */
 {
   int i;
-  
-  /* The lock should not be necessary in the config callback, but let's be
-   * sure.. */
-  pthread_mutex_lock (&stat_nodes_lock);
 
   for (i = 0; i < ci->children_num; i++)
   {
@@ -618,20 +862,37 @@ static int plugin_config (oconfig_item_t *ci) /* {{{ */
       cf_util_get_string (child, &conf_node);
     else if (strcasecmp ("Port", child->key) == 0)
       cf_util_get_service (child, &conf_service);
+    else if (strcasecmp ("Threads", child->key) == 0)
+    {
+      int tmp = conf_threads;
+
+      cf_util_get_int (child, &tmp);
+      if (tmp < 1)
+        WARNING ("pinba plugin: The \"Threads\" option must be positive.");
+      else
+        conf_threads = tmp;
+    }
     else if (strcasecmp ("View", child->key) == 0)
       pinba_config_view (child);
     else
       WARNING ("pinba plugin: Unknown config option: %s", child->key);
   }
 
-  pthread_mutex_unlock(&stat_nodes_lock);
-  
+#ifndef SO_REUSEPORT
+  if (conf_threads > 1)
+  {
+    WARNING ("pinba plugin: SO_REUSEPORT is not available on this system. "
+        "Only one thread will receive packets.");
+    conf_threads = 1;
+  }
+#endif
+
   return (0);
 } /* }}} int pinba_config */
 
 static int plugin_init (void) /* {{{ */
 {
-  int status;
+  int i;
 
   if (stat_nodes == NULL)
   {
@@ -642,45 +903,88 @@ static int plugin_init (void) /* {{{ */
         /* script = */ NULL);
   }
 
-  if (collector_thread_running)
+  if (collectors != NULL)
     return (0);
 
-  status = plugin_thread_create (&collector_thread_id,
-      /* attrs = */ NULL,
-      collector_thread,
-      /* args = */ NULL);
-  if (status != 0)
+  collectors = calloc ((size_t) conf_threads, sizeof (*collectors));
+  if (collectors == NULL)
   {
-    char errbuf[1024];
-    ERROR ("pinba plugin: pthread_create(3) failed: %s",
-        sstrerror (errno, errbuf, sizeof (errbuf)));
+    ERROR ("pinba plugin: calloc failed.");
     return (-1);
   }
-  collector_thread_running = 1;
+
+  for (i = 0; i < conf_threads; i++)
+  {
+    pinba_collector_t *c = collectors + i;
+    unsigned int j;
+    int status;
+
+    c->counters = calloc (stat_nodes_num, sizeof (*c->counters));
+    if (c->counters == NULL)
+    {
+      ERROR ("pinba plugin: calloc failed.");
+      break;
+    }
+    for (j = 0; j < stat_nodes_num; j++)
+      pinba_counters_reset (c->counters + j);
+
+    pthread_mutex_init (&c->lock, /* attr = */ NULL);
+    /* Seen by the read callback from now on. */
+    collectors_num++;
+
+    status = plugin_thread_create (&c->id,
+        /* attrs = */ NULL,
+        collector_thread,
+        /* args = */ c);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("pinba plugin: pthread_create(3) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+    c->running = 1;
+  }
+
+  if ((collectors_num < 1) || !collectors[0].running)
+    return (-1);
 
   return (0);
 } /* }}} */
 
 static int plugin_shutdown (void) /* {{{ */
 {
-  if (collector_thread_running)
+  int i;
+
+  DEBUG ("pinba plugin: Shutting down collector threads.");
+  collector_thread_do_shutdown = 1;
+
+  for (i = 0; i < collectors_num; i++)
   {
+    pinba_collector_t *c = collectors + i;
     int status;
 
-    DEBUG ("pinba plugin: Shutting down collector thread.");
-    collector_thread_do_shutdown = 1;
+    if (!c->running)
+      continue;
 
-    status = pthread_join (collector_thread_id, /* retval = */ NULL);
+    status = pthread_join (c->id, /* retval = */ NULL);
     if (status != 0)
     {
       char errbuf[1024];
       ERROR ("pinba plugin: pthread_join(3) failed: %s",
           sstrerror (status, errbuf, sizeof (errbuf)));
     }
+    c->running = 0;
+  }
 
-    collector_thread_running = 0;
-    collector_thread_do_shutdown = 0;
-  } /* if (collector_thread_running) */
+  for (i = 0; i < collectors_num; i++)
+  {
+    pthread_mutex_destroy (&collectors[i].lock);
+    sfree (collectors[i].counters);
+  }
+  sfree (collectors);
+  collectors_num = 0;
+  collector_thread_do_shutdown = 0;
 
   return (0);
 } /* }}} int plugin_shutdown */
@@ -696,29 +1000,29 @@ static int plugin_submit (const pinba_statnode_t *res) /* {{{ */
   sstrncpy (vl.plugin, "pinba", sizeof (vl.plugin));
   sstrncpy (vl.plugin_instance, res->name, sizeof (vl.plugin_instance));
 
-  value.derive = res->req_count;
+  value.derive = res->counters.req_count;
   sstrncpy (vl.type, "total_requests", sizeof (vl.type)); 
   plugin_dispatch_values (&vl);
 
-  value.derive = float_counter_get (&res->req_time, /* factor = */ 1000);
+  value.derive = float_counter_get (&res->counters.req_time, /* factor = */ 1000);
   sstrncpy (vl.type, "total_time_in_ms", sizeof (vl.type)); 
   plugin_dispatch_values (&vl);
 
-  value.derive = res->doc_size;
+  value.derive = res->counters.doc_size;
   sstrncpy (vl.type, "total_bytes", sizeof (vl.type)); 
   plugin_dispatch_values (&vl);
 
-  value.derive = float_counter_get (&res->ru_utime, /* factor = */ 100);
+  value.derive = float_counter_get (&res->counters.ru_utime, /* factor = */ 100);
   sstrncpy (vl.type, "cpu", sizeof (vl.type));
   sstrncpy (vl.type_instance, "user", sizeof (vl.type_instance));
   plugin_dispatch_values (&vl);
 
-  value.derive = float_counter_get (&res->ru_stime, /* factor = */ 100);
+  value.derive = float_counter_get (&res->counters.ru_stime, /* factor = */ 100);
   sstrncpy (vl.type, "cpu", sizeof (vl.type));
   sstrncpy (vl.type_instance, "system", sizeof (vl.type_instance));
   plugin_dispatch_values (&vl);
 
-  value.gauge = res->mem_peak;
+  value.gauge = res->counters.mem_peak;
   sstrncpy (vl.type, "memory", sizeof (vl.type));
   sstrncpy (vl.type_instance, "peak", sizeof (vl.type_instance));
   plugin_dispatch_values (&vl);
@@ -59,6 +59,16 @@ struct hostlist_s
 };
 typedef struct hostlist_s hostlist_t;
 
+/* The hosts are split into groups of at most `ping_group_size' hosts, which
+ * are pinged one after another, so that only that many requests are in
+ * flight at once. */
+struct ping_group_s
+{
+  pingobj_t *pingobj;
+  size_t hosts_num;
+};
+typedef struct ping_group_s ping_group_t;
+
 /*
  * Private variables
  */
@@ -72,6 +82,8 @@ static int    ping_ttl = PING_DEF_TTL;
 static double ping_interval = 1.0;
 static double ping_timeout = 0.9;
 static int    ping_max_missed = -1;
+static int    ping_max_in_flight = 0;
+static double ping_send_rate = 0.0;
 
 static int             ping_thread_loop = 0;
 static int             ping_thread_error = 0;
@@ -89,7 +101,9 @@ static const char *config_keys[] =
   "TTL",
   "Interval",
   "Timeout",
-  "MaxMissed"
+  "MaxMissed",
+  "MaxInFlight",
+  "SendRate"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -234,29 +248,15 @@ static int ping_dispatch_all (pingobj_t *pingobj) /* {{{ */
   return (0);
 } /* }}} int ping_dispatch_all */
 
-static void *ping_thread (void *arg) /* {{{ */
+static pingobj_t *ping_group_create (void) /* {{{ */
 {
-  static pingobj_t *pingobj = NULL;
-
-  struct timeval  tv_begin;
-  struct timeval  tv_end;
-  struct timespec ts_wait;
-  struct timespec ts_int;
-
-  hostlist_t *hl;
-  int count;
-
-  c_complain_t complaint = C_COMPLAIN_INIT_STATIC;
-
-  pthread_mutex_lock (&ping_lock);
+  pingobj_t *pingobj;
 
   pingobj = ping_construct ();
   if (pingobj == NULL)
   {
     ERROR ("ping plugin: ping_construct failed.");
-    ping_thread_error = 1;
-    pthread_mutex_unlock (&ping_lock);
-    return ((void *) -1);
+    return (NULL);
   }
 
   if (ping_source != NULL)
@@ -274,26 +274,136 @@ static void *ping_thread (void *arg) /* {{{ */
   ping_setopt (pingobj, PING_OPT_TIMEOUT, (void *) &ping_timeout);
   ping_setopt (pingobj, PING_OPT_TTL, (void *) &ping_ttl);
 
-  /* Add all the hosts to the ping object. */
-  count = 0;
+  return (pingobj);
+} /* }}} pingobj_t *ping_group_create */
+
+static void ping_groups_destroy (ping_group_t *groups, /* {{{ */
+    size_t groups_num)
+{
+  size_t i;
+
+  for (i = 0; i < groups_num; i++)
+    ping_destroy (groups[i].pingobj);
+  sfree (groups);
+} /* }}} void ping_groups_destroy */
+
+/* Returns the maximum number of hosts in a group, zero for no limit. With a
+ * send rate but no window, the window is the number of requests sent within
+ * one timeout. */
+static size_t ping_group_size (void) /* {{{ */
+{
+  double size;
+
+  if (ping_max_in_flight > 0)
+    return ((size_t) ping_max_in_flight);
+
+  if (ping_send_rate <= 0.0)
+    return (0);
+
+  size = ceil (ping_send_rate * ping_timeout);
+  if (size < 1.0)
+    return (1);
+  return ((size_t) size);
+} /* }}} size_t ping_group_size */
+
+/* Distributes the hosts over groups. Returns the number of groups, zero if no
+ * host could be added. */
+static size_t ping_groups_create (ping_group_t **ret_groups) /* {{{ */
+{
+  ping_group_t *groups = NULL;
+  size_t groups_num = 0;
+  size_t group_size;
+  hostlist_t *hl;
+
+  group_size = ping_group_size ();
+
   for (hl = hostlist_head; hl != NULL; hl = hl->next)
   {
-    int tmp_status;
-    tmp_status = ping_host_add (pingobj, hl->host);
-    if (tmp_status != 0)
+    ping_group_t *g;
+
+    if ((groups_num == 0)
+        || ((group_size > 0) && (groups[groups_num - 1].hosts_num >= group_size)))
+    {
+      ping_group_t *tmp;
+
+      tmp = realloc (groups, (groups_num + 1) * sizeof (*groups));
+      if (tmp == NULL)
+      {
+        ERROR ("ping plugin: realloc failed.");
+        break;
+      }
+      groups = tmp;
+
+      groups[groups_num].pingobj = ping_group_create ();
+      groups[groups_num].hosts_num = 0;
+      if (groups[groups_num].pingobj == NULL)
+        break;
+      groups_num++;
+    }
+
+    g = groups + (groups_num - 1);
+    if (ping_host_add (g->pingobj, hl->host) != 0)
       WARNING ("ping plugin: ping_host_add (%s) failed: %s",
-          hl->host, ping_get_error (pingobj));
+          hl->host, ping_get_error (g->pingobj));
     else
-      count++;
+      g->hosts_num++;
+  }
+
+  /* The last group may be empty if adding its hosts failed. */
+  if ((groups_num > 0) && (groups[groups_num - 1].hosts_num == 0))
+  {
+    ping_destroy (groups[groups_num - 1].pingobj);
+    groups_num--;
   }
 
-  if (count == 0)
+  if (groups_num == 0)
+  {
+    sfree (groups);
+    return (0);
+  }
+
+  *ret_groups = groups;
+  return (groups_num);
+} /* }}} size_t ping_groups_create */
+
+/* Waits until `t' or until the thread is told to stop. Returns non-zero in
+ * the latter case. Called with `ping_lock' held. */
+static int ping_wait_until (cdtime_t t) /* {{{ */
+{
+  struct timespec ts;
+
+  CDTIME_T_TO_TIMESPEC (t, &ts);
+  while ((ping_thread_loop > 0) && (cdtime () < t))
+    if (pthread_cond_timedwait (&ping_cond, &ping_lock, &ts) == ETIMEDOUT)
+      break;
+
+  return (ping_thread_loop <= 0);
+} /* }}} int ping_wait_until */
+
+static void *ping_thread (void *arg) /* {{{ */
+{
+  ping_group_t *groups = NULL;
+  size_t groups_num;
+  cdtime_t interval;
+
+  struct timeval  tv_begin;
+  struct timeval  tv_end;
+  struct timespec ts_wait;
+  struct timespec ts_int;
+
+  c_complain_t complaint = C_COMPLAIN_INIT_STATIC;
+
+  pthread_mutex_lock (&ping_lock);
+
+  groups_num = ping_groups_create (&groups);
+  if (groups_num == 0)
   {
     ERROR ("ping plugin: No host could be added to ping object. Giving up.");
     ping_thread_error = 1;
     pthread_mutex_unlock (&ping_lock);
     return ((void *) -1);
   }
+  interval = DOUBLE_TO_CDTIME_T (ping_interval);
 
   /* Set up `ts_int' */
   {
@@ -307,8 +417,10 @@ static void *ping_thread (void *arg) /* {{{ */
 
   while (ping_thread_loop > 0)
   {
+    cdtime_t round_begin;
+    cdtime_t next_send;
+    size_t i;
     int status;
-    _Bool send_successful = 0;
 
     if (gettimeofday (&tv_begin, NULL) < 0)
     {
@@ -319,28 +431,50 @@ static void *ping_thread (void *arg) /* {{{ */
       break;
     }
 
-    pthread_mutex_unlock (&ping_lock);
-
-    status = ping_send (pingobj);
-    if (status < 0)
-    {
-      c_complain (LOG_ERR, &complaint, "ping plugin: ping_send failed: %s",
-          ping_get_error (pingobj));
-    }
-    else
+    /* The groups are spread across the interval. With a send rate, a group
+     * isn't started before the requests of the previous one are paid for. */
+    round_begin = cdtime ();
+    next_send = round_begin;
+    for (i = 0; i < groups_num; i++)
     {
-      c_release (LOG_NOTICE, &complaint, "ping plugin: ping_send succeeded.");
-      send_successful = 1;
-    }
+      ping_group_t *g = groups + i;
+      cdtime_t spread;
 
-    pthread_mutex_lock (&ping_lock);
+      spread = round_begin + (cdtime_t) ((interval * i) / groups_num);
+      if (next_send < spread)
+        next_send = spread;
+      if ((i > 0) && (ping_wait_until (next_send) != 0))
+        break;
+
+      if (ping_send_rate > 0.0)
+        next_send = cdtime () + DOUBLE_TO_CDTIME_T (((double) g->hosts_num)
+            / ping_send_rate);
+
+      pthread_mutex_unlock (&ping_lock);
+
+      status = ping_send (g->pingobj);
+      if (status < 0)
+      {
+        c_complain (LOG_ERR, &complaint, "ping plugin: ping_send failed: %s",
+            ping_get_error (g->pingobj));
+      }
+      else
+      {
+        c_release (LOG_NOTICE, &complaint, "ping plugin: ping_send succeeded.");
+      }
+
+      pthread_mutex_lock (&ping_lock);
+
+      if (ping_thread_loop <= 0)
+        break;
+
+      if (status >= 0)
+        (void) ping_dispatch_all (g->pingobj);
+    } /* for (i = 0; i < groups_num; i++) */
 
     if (ping_thread_loop <= 0)
       break;
 
-    if (send_successful)
-      (void) ping_dispatch_all (pingobj);
-
     if (gettimeofday (&tv_end, NULL) < 0)
     {
       char errbuf[1024];
@@ -360,7 +494,7 @@ static void *ping_thread (void *arg) /* {{{ */
   } /* while (ping_thread_loop > 0) */
 
   pthread_mutex_unlock (&ping_lock);
-  ping_destroy (pingobj);
+  ping_groups_destroy (groups, groups_num);
 
   return ((void *) 0);
 } /* }}} void *ping_thread */
@@ -548,6 +682,27 @@ static int ping_config (const char *key, const char *value) /* {{{ */
     if (ping_max_missed < 0)
       INFO ("ping plugin: MaxMissed < 0, disabled re-resolving of hosts");
   }
+  else if (strcasecmp (key, "MaxInFlight") == 0)
+  {
+    int tmp;
+
+    tmp = atoi (value);
+    if (tmp >= 0)
+      ping_max_in_flight = tmp;
+    else
+      WARNING ("ping plugin: Ignoring invalid MaxInFlight %i.", tmp);
+  }
+  else if (strcasecmp (key, "SendRate") == 0)
+  {
+    double tmp;
+
+    tmp = atof (value);
+    if (tmp >= 0.0)
+      ping_send_rate = tmp;
+    else
+      WARNING ("ping plugin: Ignoring invalid send rate %g (%s)",
+          tmp, value);
+  }
   else
   {
     return (-1);
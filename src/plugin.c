@@ -25,17 +25,27 @@
 #include "plugin.h"
 #include "configfile.h"
 #include "filter_chain.h"
-#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_complain.h"
 #include "utils_llist.h"
 #include "utils_heap.h"
+#include "utils_htable.h"
+#include "utils_affinity.h"
+#include "utils_async.h"
+#include "utils_resolve.h"
+#include "utils_lock.h"
+#include "utils_avltree.h"
+#include "utils_epoch.h"
+#include "utils_ring.h"
 #include "utils_time.h"
 
 #if HAVE_PTHREAD_H
 # include <pthread.h>
 #endif
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+
 #include <ltdl.h>
 
 /*
@@ -46,12 +56,18 @@ struct callback_func_s
 	void *cf_callback;
 	user_data_t cf_udata;
 	plugin_ctx_t cf_ctx;
+	/* With "CallbackCPUTime", the CPU time spent in the callback in
+	 * nanoseconds, see plugin_callback_cpu_stats(). */
+	volatile uint64_t cf_cpu;
 };
 typedef struct callback_func_s callback_func_t;
 
 #define RF_SIMPLE  0
 #define RF_COMPLEX 1
 #define RF_REMOVE  65535
+struct init_job_s;
+typedef struct init_job_s init_job_t;
+
 struct read_func_s
 {
 	/* `read_func_t' "inherits" from `callback_func_t'.
@@ -66,16 +82,261 @@ struct read_func_s
 	cdtime_t rf_interval;
 	cdtime_t rf_effective_interval;
 	cdtime_t rf_next_read;
+	/* How long the last call of the callback took. */
+	cdtime_t rf_duration;
+	/* While init callbacks run concurrently, the init callback this read
+	 * function waits for, see init_job_holds(). */
+	init_job_t *rf_init;
 };
 typedef struct read_func_s read_func_t;
 
-struct write_queue_s;
-typedef struct write_queue_s write_queue_t;
+struct read_pool_s;
+typedef struct read_pool_s read_pool_t;
+
+/* Every read thread has a heap of read functions of its own and sleeps on its
+ * own condition variable, so that threads don't contend for one lock and are
+ * woken up individually. Threads without due work take due read functions
+ * from threads of the same pool which are busy running a callback. */
+struct read_queue_s
+{
+	c_mutex_t       lock;
+	pthread_cond_t  cond;
+	c_heap_t       *heap;
+	size_t          rf_num;
+	pthread_t       thread;
+	read_pool_t    *pool;
+
+	/* Written by the owning thread only. "wakeup" is the time the thread
+	 * sleeps until, zero while it is awake. */
+	volatile _Bool    busy;
+	volatile cdtime_t wakeup;
+
+	/* The read function the thread is running and when it started,
+	 * protected by "lock". When it exceeds its "ReadTimeout", the thread is
+	 * replaced by a new one and "generation" is incremented, which tells
+	 * the old thread to exit once the callback returns. */
+	read_func_t  *running;
+	cdtime_t      started;
+	unsigned int  generation;
+
+	/* Statistics, protected by "lock". */
+	uint64_t reads;
+	uint64_t stolen;
+	cdtime_t lag;
+};
+typedef struct read_queue_s read_queue_t;
+
+/* A group of read threads. Read functions of plugins loaded with the
+ * "ReadThreads" option are run by a pool of their own, named after the read
+ * function's group (or its name, if it has no group), so that blocking
+ * callbacks can't hold up the threads of the default pool. The default pool
+ * has an empty name. */
+struct read_pool_s
+{
+	char          name[DATA_MAX_NAME_LEN];
+	read_queue_t *queues;
+	size_t        queues_num;
+	read_pool_t  *next;
+};
+
+#define READ_WAKEUP_NEVER ((cdtime_t) -1)
+
+/* With "InitThreads", plugin_init_all() runs the init callbacks on a pool of
+ * threads. Each callback in "list_init" becomes a job, which is started once
+ * the jobs of the plugins named by its "InitAfter" option are done. */
+#define INIT_PENDING 0
+#define INIT_RUNNING 1
+#define INIT_DONE    2
+
+struct init_job_s
+{
+	llentry_t *le;
+	int state;
+	/* Indices into "init_jobs" of the jobs this one waits for. */
+	size_t *deps;
+	size_t deps_num;
+};
+
+/* One "InitAfter" setting: "plugin" is initialized after "after". */
+struct init_dependency_s
+{
+	char *plugin;
+	char *after;
+};
+typedef struct init_dependency_s init_dependency_t;
+
+/* Write callbacks registered from a plugin loaded with "AsyncQueue true" get
+ * their own queue and thread, so that a slow writer only delays itself. */
+struct write_func_s
+{
+	/* `write_func_t' "inherits" from `callback_func_t'.
+	 * The `wf_super' member MUST be the first one in this structure! */
+#define wf_callback wf_super.cf_callback
+#define wf_udata wf_super.cf_udata
+#define wf_ctx wf_super.cf_ctx
+	callback_func_t wf_super;
+	char wf_name[DATA_MAX_NAME_LEN];
+	/* If true, "wf_callback" is a `plugin_write_batch_cb'. */
+	_Bool wf_batch;
+	c_complain_t wf_complaint;
+
+	/* The following are only used if "wf_queue" is not NULL. */
+	c_ring_t *wf_queue;
+	pthread_t wf_thread;
+	pthread_mutex_t wf_lock;
+	pthread_cond_t wf_cond;
+	volatile int wf_waiting;
+	volatile _Bool wf_loop;
+	volatile uint64_t wf_dropped;
+
+	/* Histogram of the time calls of "wf_callback" take, see
+	 * plugin_write_latency_stats(). */
+	volatile uint64_t wf_latency[PLUGIN_WRITE_LATENCY_BUCKETS];
+	/* With "WriteTracing", histogram of the time from queueing a value
+	 * list until this callback has written it, see
+	 * plugin_write_delay_stats(). */
+	volatile uint64_t wf_delay[PLUGIN_WRITE_LATENCY_BUCKETS];
+};
+typedef struct write_func_s write_func_t;
+
+/* Value lists with up to this many values keep them inside the queue node. */
+#define WRITE_QUEUE_INLINE_VALUES 4
+
+/* A queued value list and the context of the plugin which dispatched it.
+ * Nodes are recycled through "write_queue_pool", so that in the steady state
+ * queueing a value list without meta data does not call malloc(3) at all. */
 struct write_queue_s
 {
-	value_list_t *vl;
+	value_list_t vl;
+	plugin_ctx_t ctx;
+	value_t values_inline[WRITE_QUEUE_INLINE_VALUES];
+	/* "vl.identity" points here once the identifier has been determined. */
+	char identity[6 * DATA_MAX_NAME_LEN];
+	/* "vl.rates" points here once the cache has been updated. Rates of value
+	 * lists with more values aren't kept; writers ask the cache instead. */
+	gauge_t rates[WRITE_QUEUE_INLINE_VALUES];
+	/* With "WriteTracing": when the value list was queued and the
+	 * sequence number of its trace, or zero if it is not traced. Copies
+	 * for asynchronous or batch write callbacks inherit both. */
+	cdtime_t enqueued;
+	uint64_t trace;
+};
+typedef struct write_queue_s write_queue_t;
+
+/* Number of sampled traces kept for plugin_write_traces(). */
+#define WRITE_TRACES_NUM 64
+
+/* A trace slot is reused once "WRITE_TRACES_NUM" newer traces have been
+ * started. "seq" tells whether the trace a value list refers to is still
+ * the one in the slot. */
+struct write_trace_slot_s
+{
+	plugin_write_trace_t trace;
+	uint64_t seq;
+};
+typedef struct write_trace_slot_s write_trace_slot_t;
+
+#define WRITE_QUEUE_DEFAULT_LIMIT 65536
+
+/* Maximum number of unused queue nodes kept around. */
+#define WRITE_QUEUE_POOL_SIZE 1024
+
+/* Maximum number of value lists a write thread dequeues in one go. */
+#define WRITE_BATCH_SIZE 128
+
+/* Values for batch write callbacks are collected while a write thread runs
+ * the value lists it has dequeued through the filter chains and are handed to
+ * the callbacks once all of them have been dispatched. */
+struct write_batch_item_s
+{
+	write_func_t *wf;
+	const data_set_t *ds;
+	value_list_t const *vl;
+	/* If not NULL, "vl" points into this copy, which is owned by the
+	 * batch. */
+	write_queue_t *copy;
+	/* See write_queue_t. */
+	cdtime_t enqueued;
+	uint64_t trace;
+};
+typedef struct write_batch_item_s write_batch_item_t;
+
+struct write_batch_s
+{
+	write_batch_item_t *items;
+	size_t items_num;
+	size_t items_size;
+
+	/* Argument array for one callback. */
+	plugin_write_item_t *args;
+	size_t args_size;
+
+	/* The queued value list currently being dispatched. It lives until the
+	 * batch has been flushed. */
+	value_list_t const *current;
+	/* "enqueued" and "trace" of the node "current" belongs to. */
+	cdtime_t current_enqueued;
+	uint64_t current_trace;
+	/* Index of the first item appended while dispatching "current". */
+	size_t current_first;
+	/* Set by plugin_value_list_make_writable(): the values of "current"
+	 * before they were copied. They are put back once it has been
+	 * dispatched. */
+	value_t *saved_values;
+	int saved_values_len;
+};
+typedef struct write_batch_s write_batch_t;
+
+/* With "NotificationThreads", notifications are handed to the notification
+ * callbacks by threads of their own, so that slow callbacks, e.g. ones
+ * sending mail or forking a process, don't hold up the dispatching thread. */
+struct notification_queue_s
+{
+	notification_t n;
 	plugin_ctx_t ctx;
-	write_queue_t *next;
+	uint64_t hash;
+	/* True if this entry is the one "notif_index" points to. */
+	_Bool indexed;
+	struct notification_queue_s *next;
+};
+typedef struct notification_queue_s notification_queue_t;
+
+#define NOTIF_QUEUE_DEFAULT_LIMIT 1024
+
+/* With "LogThread", messages are formatted into entries taken from
+ * "log_free" and handed to a logger thread through "log_queue". Both rings
+ * are lock-free; a message for which no entry is free is dropped. */
+struct log_entry_s
+{
+	int level;
+	char msg[1024];
+};
+typedef struct log_entry_s log_entry_t;
+
+#define LOG_QUEUE_DEFAULT_LIMIT 4096
+
+/* Messages are rate limited per call site, which is identified by the
+ * address of the format string. Call sites are kept in an open addressing
+ * table, probing up to LOG_CALLSITES_PROBE slots. Once those are taken by
+ * others, the call site shares the limit of its first slot, which is
+ * limiting too much rather than not at all. */
+struct log_callsite_s
+{
+	const char *format;
+	c_ratelimit_t limit;
+};
+typedef struct log_callsite_s log_callsite_t;
+
+#define LOG_CALLSITES_NUM   1024
+#define LOG_CALLSITES_PROBE 16
+
+/* What to do with values dispatched while the write queue is above its high
+ * watermark. */
+enum write_queue_policy_e
+{
+	WQ_POLICY_BLOCK,       /* block the dispatching thread */
+	WQ_POLICY_DROP_NEW,    /* drop new values until below the low watermark */
+	WQ_POLICY_DROP_RANDOM  /* drop with a probability growing with the fill */
 };
 
 /*
@@ -83,42 +344,231 @@ struct write_queue_s
  */
 static llist_t *list_init;
 static llist_t *list_write;
+/* Incremented whenever a write callback is registered, replaced or
+ * unregistered, so plugin_write_ref_t knows when to look its callback up
+ * again. Zero is never used, it marks unresolved references. */
+static uint64_t volatile list_write_generation = 1;
 static llist_t *list_flush;
 static llist_t *list_missing;
+static llist_t *list_command;
 static llist_t *list_shutdown;
+static llist_t *list_handoff;
 static llist_t *list_log;
 static llist_t *list_notification;
 
 static fc_chain_t *pre_cache_chain = NULL;
 static fc_chain_t *post_cache_chain = NULL;
 
-static c_avl_tree_t *data_sets;
+static c_htable_t *data_sets = NULL;
 
 static char *plugindir = NULL;
 
 static c_heap_t       *read_heap = NULL;
 static llist_t        *read_list;
 static int             read_loop = 1;
-static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  read_cond = PTHREAD_COND_INITIALIZER;
-static pthread_t      *read_threads = NULL;
-static int             read_threads_num = 0;
-
-static write_queue_t  *write_queue_head;
-static write_queue_t  *write_queue_tail;
-static _Bool           write_loop = 1;
-static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  write_cond = PTHREAD_COND_INITIALIZER;
+static c_mutex_t       read_lock = C_MUTEX_INITIALIZER ("read");
+/* The first pool is the default pool. */
+static read_pool_t    *read_pools = NULL;
+/* See read_timeout_check(). "read_threads_hung" is the number of replaced
+ * threads whose callback hasn't returned yet. */
+static cdtime_t        read_timeout = 0;
+static volatile size_t read_threads_hung = 0;
+static volatile uint64_t read_timeouts = 0;
+
+/* Hitless restarts, see collectdmon(1). collectdmon passes one end of a
+ * socket pair in "COLLECTD_HANDOFF_FD" and the listening sockets the previous
+ * process handed over in "COLLECTD_LISTEN_FDS". "handoff_inherited" holds the
+ * latter until plugins take them, "handoff_fds" the sockets to hand over at
+ * shutdown. Only used while reading the config, initializing and shutting
+ * down, i.e. by one thread. */
+#define HANDOFF_FDS_PER_MESSAGE 64
+static _Bool  handoff_initialized = 0;
+static int    handoff_fd = -1;
+static int   *handoff_inherited = NULL;
+static size_t handoff_inherited_num = 0;
+static int   *handoff_fds = NULL;
+static size_t handoff_fds_num = 0;
+
+/* The CPU sets of "ReadThreadCPUs" and "WriteThreadCPUs". */
+static c_cpusets_t    *read_thread_cpus = NULL;
+static c_cpusets_t    *write_thread_cpus = NULL;
+
+/* "init_jobs" is only set while plugin_init_all() runs the init callbacks.
+ * "init_lock" protects it and the state of the jobs. */
+static init_job_t        *init_jobs = NULL;
+static size_t             init_jobs_num = 0;
+static pthread_mutex_t    init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     init_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t      init_job_key;
+static init_dependency_t *init_deps = NULL;
+static size_t             init_deps_num = 0;
+
+/* Serializes changes of the callback lists and the data sets, which init
+ * callbacks may make concurrently. */
+static pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Bool           read_phase_spread = 0;
+
+/* The overload controller, see overload_check(). The intervals of read
+ * callbacks registered with "LowPriority" are multiplied by
+ * "overload_stretch", a power of two. The remaining variables are only
+ * accessed by the main thread. */
+static volatile unsigned int overload_stretch = 1;
+static volatile uint64_t     overload_adjustments = 0;
+static size_t                overload_queue_length = 0;
+static cdtime_t              overload_read_lag = 0;
+static unsigned int          overload_max_stretch = 8;
+static uint64_t              overload_last_reads = 0;
+static cdtime_t              overload_last_lag = 0;
+
+/* The write queue is made up of one partition or, with
+ * "WriteQueuePartitioned", of one partition per write thread. Value lists
+ * are assigned to a partition by a hash of their identifier, so that values
+ * of the same series are written in order. The partitions themselves are
+ * lock-free. "write_lock" and the condition variables are only used by
+ * threads which have to sleep, i.e. write threads waiting for values and,
+ * with the "Block" policy, dispatching threads waiting for room in the
+ * queue. */
+struct write_partition_s
+{
+	c_ring_t *queue;
+	/* The write threads of this partition sleep on "cond". */
+	pthread_cond_t cond;
+	volatile int waiting_consumers;
+	volatile _Bool shedding;
+};
+typedef struct write_partition_s write_partition_t;
+
+static write_partition_t *write_partitions = NULL;
+static size_t          write_partitions_num = 0;
+static _Bool           write_queue_partitioned = 0;
+static c_ring_t       *write_queue_pool = NULL;
+/* Limits of each partition. */
+static size_t          write_queue_limit_high = WRITE_QUEUE_DEFAULT_LIMIT;
+static size_t          write_queue_limit_low = WRITE_QUEUE_DEFAULT_LIMIT;
+static enum write_queue_policy_e write_queue_policy = WQ_POLICY_BLOCK;
+static volatile uint64_t write_queue_dropped = 0;
+static volatile size_t write_queue_peak = 0;
+static volatile uint64_t values_dispatched = 0;
+static volatile int    write_queue_waiting_producers = 0;
+static volatile _Bool  write_loop = 1;
+static c_mutex_t       write_lock = C_MUTEX_INITIALIZER ("write");
+static pthread_cond_t  write_space_cond = PTHREAD_COND_INITIALIZER;
 static pthread_t      *write_threads = NULL;
 static size_t          write_threads_num = 0;
 
+/* The pool of write threads holds between "write_threads_min" and
+ * "write_threads_max" threads, see write_threads_adjust(). Thread "i" exits
+ * once "write_threads_stop[i]" is set and sets "write_threads_exited[i]"; only
+ * the last thread is ever stopped. The arrays have "write_threads_max"
+ * elements. */
+static size_t          write_threads_min = 0;
+static size_t          write_threads_max = 0;
+static size_t          write_threads_grow_length = 0;
+static cdtime_t        write_threads_grow_latency = 0;
+static volatile _Bool *write_threads_stop = NULL;
+static volatile _Bool *write_threads_exited = NULL;
+/* Time spent writing by all threads and the longest time a value list waited
+ * in the queue, both since the previous check. */
+static volatile uint64_t write_threads_busy = 0;
+static volatile uint64_t write_threads_wait = 0;
+static cdtime_t        write_threads_last_check = 0;
+static unsigned int    write_threads_idle_checks = 0;
+static volatile uint64_t write_threads_adjustments = 0;
+
+/* See "struct callback_func_s". */
+static _Bool           callback_cpu_time = 0;
+
+/* Counters of plugin_memory_counter(), protected by "memory_lock". Entries
+ * are never freed. */
+struct plugin_memory_s
+{
+	char name[DATA_MAX_NAME_LEN];
+	volatile int64_t bytes;
+	struct plugin_memory_s *next;
+};
+static plugin_memory_t *memory_counters = NULL;
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* With "WriteTracing", every value list is stamped with the time it was
+ * queued and every "WriteTraceSample"th one is traced in full. */
+static _Bool           write_tracing = 0;
+static unsigned int    write_trace_sample = 0;
+static volatile uint64_t write_trace_counter = 0;
+static volatile uint64_t write_queue_wait[PLUGIN_WRITE_LATENCY_BUCKETS];
+/* Protected by "write_trace_lock". */
+static write_trace_slot_t write_traces[WRITE_TRACES_NUM];
+static uint64_t        write_traces_seq = 0;
+static pthread_mutex_t write_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protected by "notif_lock". "notif_index" holds the hashes of the queued
+ * notifications, so that identical ones can be coalesced. */
+static notification_queue_t *notif_queue_head = NULL;
+static notification_queue_t *notif_queue_tail = NULL;
+static size_t          notif_queue_length = 0;
+static size_t          notif_queue_limit = NOTIF_QUEUE_DEFAULT_LIMIT;
+static c_avl_tree_t   *notif_index = NULL;
+static uint64_t        notif_dropped = 0;
+static uint64_t        notif_coalesced = 0;
+static _Bool           notif_loop = 1;
+static pthread_mutex_t notif_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  notif_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t      *notif_threads = NULL;
+static size_t          notif_threads_num = 0;
+
+static log_entry_t    *log_entries = NULL;
+static c_ring_t       *log_free = NULL;
+static c_ring_t       *log_queue = NULL;
+static volatile _Bool  log_loop = 0;
+static volatile int    log_waiting = 0;
+static volatile uint64_t log_dropped = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       log_thread;
+
+/* Requests of plugin_flush_async(), in the order they were made, handed to
+ * the flush thread. "flush_index" maps the key of each pending request to
+ * it, so that a repeated request is merged into the pending one. */
+struct flush_request_s
+{
+	char *key;
+	char *plugin;
+	char *identifier;
+	cdtime_t timeout;
+	struct flush_request_s *next;
+};
+typedef struct flush_request_s flush_request_t;
+
+static flush_request_t *flush_head = NULL;
+static flush_request_t *flush_tail = NULL;
+static c_avl_tree_t   *flush_index = NULL;
+static volatile uint64_t flush_merged = 0;
+static _Bool           flush_loop = 0;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       flush_thread;
+
+/* Protected by "log_limit_lock". */
+static log_callsite_t  log_callsites[LOG_CALLSITES_NUM];
+static unsigned int    log_rate_limit = 0;
+static uint64_t        log_suppressed = 0;
+static pthread_mutex_t log_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Points to the write_batch_t of the calling write thread. */
+static pthread_key_t   write_batch_key;
+static _Bool           write_batch_key_initialized = 0;
+
 static pthread_key_t   plugin_ctx_key;
 static _Bool           plugin_ctx_key_initialized = 0;
 
 /*
  * Static functions
  */
-static int plugin_dispatch_values_internal (value_list_t *vl);
+static int plugin_compare_read_func (const void *arg0, const void *arg1);
+static int plugin_dispatch_values_internal (value_list_t *vl,
+		char *identity, size_t identity_size,
+		gauge_t *rates, size_t rates_size);
+static void plugin_dispatch_values_nodes (write_batch_t *b,
+		write_queue_t **nodes, size_t nodes_num);
 
 static const char *plugin_get_dir (void)
 {
@@ -128,6 +578,84 @@ static const char *plugin_get_dir (void)
 		return (plugindir);
 }
 
+/* 64 bit FNV-1a */
+#define PLUGIN_HASH_INIT 14695981039346656037ULL
+
+static uint64_t plugin_hash_update (uint64_t hash, const char *str) /* {{{ */
+{
+	const unsigned char *ptr;
+
+	for (ptr = (const unsigned char *) str; *ptr != 0; ptr++)
+	{
+		hash ^= (uint64_t) *ptr;
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash);
+} /* }}} uint64_t plugin_hash_update */
+
+uint64_t plugin_hash_string (const char *str) /* {{{ */
+{
+	return (plugin_hash_update (PLUGIN_HASH_INIT, str));
+} /* }}} uint64_t plugin_hash_string */
+
+uint64_t plugin_hash_vl (value_list_t const *vl) /* {{{ */
+{
+	uint64_t hash = PLUGIN_HASH_INIT;
+
+	/* Hash the field boundaries, too, so "a" "bc" and "ab" "c" differ. */
+	hash = plugin_hash_update (hash, vl->host) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, vl->plugin) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, vl->plugin_instance) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, vl->type) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, vl->type_instance);
+
+	return (hash);
+} /* }}} uint64_t plugin_hash_vl */
+
+static data_set_t *data_sets_get (const char *type) /* {{{ */
+{
+	data_set_t *ds = NULL;
+
+	if (data_sets == NULL)
+		return (NULL);
+
+	if (c_htable_get (data_sets, type, (void *) &ds) != 0)
+		return (NULL);
+
+	return (ds);
+} /* }}} data_set_t *data_sets_get */
+
+/* Returns the CPU time of the calling thread if "CallbackCPUTime" is enabled
+ * and zero otherwise. */
+static uint64_t cpu_time_start (void) /* {{{ */
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!callback_cpu_time
+			|| (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0))
+		return (0);
+
+	return (((uint64_t) ts.tv_sec) * 1000000000 + (uint64_t) ts.tv_nsec);
+#else
+	return (0);
+#endif
+} /* }}} uint64_t cpu_time_start */
+
+/* Adds the CPU time the calling thread used since "start" to "cf". */
+static void cpu_time_account (callback_func_t *cf, uint64_t start) /* {{{ */
+{
+	uint64_t now;
+
+	if (start == 0)
+		return;
+
+	now = cpu_time_start ();
+	if (now > start)
+		__sync_fetch_and_add (&cf->cf_cpu, now - start);
+} /* }}} void cpu_time_account */
+
 static void destroy_callback (callback_func_t *cf) /* {{{ */
 {
 	if (cf == NULL)
@@ -187,7 +715,7 @@ static void destroy_read_heap (void) /* {{{ */
 	read_heap = NULL;
 } /* }}} void destroy_read_heap */
 
-static int register_callback (llist_t **list, /* {{{ */
+static int register_callback_locked (llist_t **list, /* {{{ */
 		const char *name, callback_func_t *cf)
 {
 	llentry_t *le;
@@ -244,6 +772,18 @@ static int register_callback (llist_t **list, /* {{{ */
 	}
 
 	return (0);
+} /* }}} int register_callback_locked */
+
+static int register_callback (llist_t **list, /* {{{ */
+		const char *name, callback_func_t *cf)
+{
+	int status;
+
+	pthread_mutex_lock (&callback_lock);
+	status = register_callback_locked (list, name, cf);
+	pthread_mutex_unlock (&callback_lock);
+
+	return (status);
 } /* }}} int register_callback */
 
 static int create_register_callback (llist_t **list, /* {{{ */
@@ -282,12 +822,15 @@ static int plugin_unregister (llist_t *list, const char *name) /* {{{ */
 	if (list == NULL)
 		return (-1);
 
+	pthread_mutex_lock (&callback_lock);
 	e = llist_search (list, name);
+	if (e != NULL)
+		llist_remove (list, e);
+	pthread_mutex_unlock (&callback_lock);
+
 	if (e == NULL)
 		return (-1);
 
-	llist_remove (list, e);
-
 	sfree (e->key);
 	destroy_callback (e->value);
 
@@ -360,1072 +903,4449 @@ static int plugin_load_file (char *file, uint32_t flags)
 	return (0);
 }
 
-static void *plugin_read_thread (void __attribute__((unused)) *args)
+/* With "ReadPhaseSpread" enabled, every read function is called at a fixed
+ * offset within its interval. The offset is derived from the host and plugin
+ * name, so it is the same across restarts but differs between hosts and
+ * plugins. */
+static cdtime_t read_func_phase (const read_func_t *rf) /* {{{ */
 {
-	while (read_loop != 0)
-	{
-		read_func_t *rf;
-		plugin_ctx_t old_ctx;
-		cdtime_t now;
-		int status;
-		int rf_type;
-		int rc;
-
-		/* Get the read function that needs to be read next.
-		 * We don't need to hold "read_lock" for the heap, but we need
-		 * to call c_heap_get_root() and pthread_cond_wait() in the
-		 * same protected block. */
-		pthread_mutex_lock (&read_lock);
-		rf = c_heap_get_root (read_heap);
-		if (rf == NULL)
-		{
-			pthread_cond_wait (&read_cond, &read_lock);
-                        pthread_mutex_unlock (&read_lock);
-			continue;
-		}
-		pthread_mutex_unlock (&read_lock);
-
-		if (rf->rf_interval == 0)
-		{
-			/* this should not happen, because the interval is set
-			 * for each plugin when loading it
-			 * XXX: issue a warning? */
-			rf->rf_interval = plugin_get_interval ();
-			rf->rf_effective_interval = rf->rf_interval;
+	char key[2 * DATA_MAX_NAME_LEN];
 
-			rf->rf_next_read = cdtime ();
-		}
+	if (rf->rf_interval == 0)
+		return (0);
 
-		/* sleep until this entry is due,
-		 * using pthread_cond_timedwait */
-		pthread_mutex_lock (&read_lock);
-		/* In pthread_cond_timedwait, spurious wakeups are possible
-		 * (and really happen, at least on NetBSD with > 1 CPU), thus
-		 * we need to re-evaluate the condition every time
-		 * pthread_cond_timedwait returns. */
-		rc = 0;
-		while ((read_loop != 0)
-				&& (cdtime () < rf->rf_next_read)
-				&& rc == 0)
-		{
-			struct timespec ts = { 0 };
+	ssnprintf (key, sizeof (key), "%s/%s", hostname_g, rf->rf_name);
+	return ((cdtime_t) (plugin_hash_string (key) % rf->rf_interval));
+} /* }}} cdtime_t read_func_phase */
 
-			CDTIME_T_TO_TIMESPEC (rf->rf_next_read, &ts);
+/* Moves the first call of "rf" to the next point in time matching its
+ * phase. Does nothing unless "ReadPhaseSpread" is enabled. */
+static void read_func_schedule_first (read_func_t *rf) /* {{{ */
+{
+	cdtime_t now;
+	cdtime_t next;
 
-			rc = pthread_cond_timedwait (&read_cond, &read_lock,
-				&ts);
-		}
+	if (!read_phase_spread || (rf->rf_interval == 0))
+		return;
 
-		/* Must hold `read_lock' when accessing `rf->rf_type'. */
-		rf_type = rf->rf_type;
-		pthread_mutex_unlock (&read_lock);
+	now = cdtime ();
+	next = now - (now % rf->rf_interval) + read_func_phase (rf);
+	if (next < now)
+		next += rf->rf_interval;
 
-		/* Check if we're supposed to stop.. This may have interrupted
-		 * the sleep, too. */
-		if (read_loop == 0)
-		{
-			/* Insert `rf' again, so it can be free'd correctly */
-			c_heap_insert (read_heap, rf);
-			break;
-		}
+	rf->rf_next_read = next;
+} /* }}} void read_func_schedule_first */
 
-		/* The entry has been marked for deletion. The linked list
-		 * entry has already been removed by `plugin_unregister_read'.
-		 * All we have to do here is free the `read_func_t' and
-		 * continue. */
-		if (rf_type == RF_REMOVE)
-		{
-			DEBUG ("plugin_read_thread: Destroying the `%s' "
-					"callback.", rf->rf_name);
-			destroy_callback ((callback_func_t *) rf);
-			rf = NULL;
-			continue;
-		}
+/* Calls the read function "rf" and determines when it is due next. */
+static void read_func_call (read_func_t *rf) /* {{{ */
+{
+	plugin_ctx_t old_ctx;
+	cdtime_t start;
+	cdtime_t now;
+	uint64_t cpu;
+	int status;
 
-		DEBUG ("plugin_read_thread: Handling `%s'.", rf->rf_name);
+	if (rf->rf_interval == 0)
+	{
+		/* this should not happen, because the interval is set
+		 * for each plugin when loading it
+		 * XXX: issue a warning? */
+		rf->rf_interval = plugin_get_interval ();
+		rf->rf_effective_interval = rf->rf_interval;
 
-		old_ctx = plugin_set_ctx (rf->rf_ctx);
+		rf->rf_next_read = cdtime ();
+	}
 
-		if (rf_type == RF_SIMPLE)
-		{
-			int (*callback) (void);
+	DEBUG ("plugin_read_thread: Handling `%s'.", rf->rf_name);
 
-			callback = rf->rf_callback;
-			status = (*callback) ();
-		}
-		else
-		{
-			plugin_read_cb callback;
+	old_ctx = plugin_set_ctx (rf->rf_ctx);
+	start = cdtime ();
+	cpu = cpu_time_start ();
 
-			assert (rf_type == RF_COMPLEX);
+	if (rf->rf_type == RF_SIMPLE)
+	{
+		int (*callback) (void);
 
-			callback = rf->rf_callback;
-			status = (*callback) (&rf->rf_udata);
-		}
+		callback = rf->rf_callback;
+		status = (*callback) ();
+	}
+	else
+	{
+		plugin_read_cb callback;
 
-		plugin_set_ctx (old_ctx);
+		assert (rf->rf_type == RF_COMPLEX);
 
-		/* If the function signals failure, we will increase the
-		 * intervals in which it will be called. */
-		if (status != 0)
-		{
-			rf->rf_effective_interval *= 2;
-			if (rf->rf_effective_interval > TIME_T_TO_CDTIME_T (86400))
-				rf->rf_effective_interval = TIME_T_TO_CDTIME_T (86400);
+		callback = rf->rf_callback;
+		status = (*callback) (&rf->rf_udata);
+	}
 
-			NOTICE ("read-function of plugin `%s' failed. "
-					"Will suspend it for %.3f seconds.",
-					rf->rf_name,
-					CDTIME_T_TO_DOUBLE (rf->rf_effective_interval));
-		}
-		else
-		{
-			/* Success: Restore the interval, if it was changed. */
-			rf->rf_effective_interval = rf->rf_interval;
-		}
+	rf->rf_duration = cdtime () - start;
+	cpu_time_account (&rf->rf_super, cpu);
+	plugin_set_ctx (old_ctx);
 
-		/* update the ``next read due'' field */
-		now = cdtime ();
+	/* If the function signals failure, we will increase the
+	 * intervals in which it will be called. */
+	if (status != 0)
+	{
+		rf->rf_effective_interval *= 2;
+		if (rf->rf_effective_interval > TIME_T_TO_CDTIME_T (86400))
+			rf->rf_effective_interval = TIME_T_TO_CDTIME_T (86400);
 
-		DEBUG ("plugin_read_thread: Effective interval of the "
-				"%s plugin is %.3f seconds.",
+		NOTICE ("read-function of plugin `%s' failed. "
+				"Will suspend it for %.3f seconds.",
 				rf->rf_name,
 				CDTIME_T_TO_DOUBLE (rf->rf_effective_interval));
+	}
+	else
+	{
+		/* Success: Restore the interval, if it was changed. */
+		rf->rf_effective_interval = rf->rf_interval;
+	}
+
+	/* update the ``next read due'' field */
+	now = cdtime ();
 
-		/* Calculate the next (absolute) time at which this function
-		 * should be called. */
+	DEBUG ("plugin_read_thread: Effective interval of the "
+			"%s plugin is %.3f seconds.",
+			rf->rf_name,
+			CDTIME_T_TO_DOUBLE (rf->rf_effective_interval));
+
+	/* Calculate the next (absolute) time at which this function
+	 * should be called. Low-priority functions are called less often
+	 * while the daemon is overloaded. */
+	if (rf->rf_ctx.low_priority && (overload_stretch > 1))
+		rf->rf_next_read += rf->rf_effective_interval
+			* (cdtime_t) overload_stretch;
+	else
 		rf->rf_next_read += rf->rf_effective_interval;
 
-		/* Check, if `rf_next_read' is in the past. */
-		if (rf->rf_next_read < now)
-		{
-			/* `rf_next_read' is in the past. Insert `now'
-			 * so this value doesn't trail off into the
-			 * past too much. */
-			rf->rf_next_read = now;
-		}
+	/* Check, if `rf_next_read' is in the past. */
+	if ((rf->rf_next_read < now) && read_phase_spread)
+	{
+		/* Skip the missed intervals rather than giving up the
+		 * phase of this function. */
+		rf->rf_next_read += rf->rf_interval
+			* (((now - rf->rf_next_read) / rf->rf_interval) + 1);
+	}
+	else if (rf->rf_next_read < now)
+	{
+		/* `rf_next_read' is in the past. Insert `now'
+		 * so this value doesn't trail off into the
+		 * past too much. */
+		rf->rf_next_read = now;
+	}
 
-		DEBUG ("plugin_read_thread: Next read of the %s plugin at %.3f.",
-				rf->rf_name,
-				CDTIME_T_TO_DOUBLE (rf->rf_next_read));
+	DEBUG ("plugin_read_thread: Next read of the %s plugin at %.3f.",
+			rf->rf_name,
+			CDTIME_T_TO_DOUBLE (rf->rf_next_read));
+} /* }}} void read_func_call */
 
-		/* Re-insert this read function into the heap again. */
-		c_heap_insert (read_heap, rf);
-	} /* while (read_loop) */
+/* Returns the time at which the root of "q" is due. The caller must hold
+ * the queue's lock. */
+static cdtime_t read_queue_next (read_queue_t *q) /* {{{ */
+{
+	read_func_t *rf = c_heap_peek_root (q->heap);
 
-	pthread_exit (NULL);
-	return ((void *) 0);
-} /* void *plugin_read_thread */
+	return ((rf != NULL) ? rf->rf_next_read : READ_WAKEUP_NEVER);
+} /* }}} cdtime_t read_queue_next */
 
-static void start_read_threads (int num)
+/* Wakes up one idle read thread which would otherwise sleep past "due", so
+ * that it can take over work from a thread which just became busy. */
+static void read_queue_wake_helper (read_queue_t *self, cdtime_t due) /* {{{ */
 {
-	int i;
+	read_pool_t *pool = self->pool;
+	size_t i;
 
-	if (read_threads != NULL)
+	if (due == READ_WAKEUP_NEVER)
 		return;
 
-	read_threads = (pthread_t *) calloc (num, sizeof (pthread_t));
-	if (read_threads == NULL)
+	for (i = 1; i < pool->queues_num; i++)
 	{
-		ERROR ("plugin: start_read_threads: calloc failed.");
+		read_queue_t *q = pool->queues
+			+ (((size_t) (self - pool->queues) + i) % pool->queues_num);
+
+		if (q->busy || (q->wakeup <= due))
+			continue;
+
+		c_mutex_lock (&q->lock);
+		pthread_cond_signal (&q->cond);
+		c_mutex_unlock (&q->lock);
 		return;
 	}
+} /* }}} void read_queue_wake_helper */
 
-	read_threads_num = 0;
-	for (i = 0; i < num; i++)
+/* Takes a due read function from another thread of the same pool which is
+ * busy running a callback. If there is nothing to take, "deadline" is lowered
+ * to the time at which the next read function of such a thread becomes due. */
+static read_func_t *read_queue_steal (read_queue_t *self, /* {{{ */
+		cdtime_t now, cdtime_t *deadline)
+{
+	read_pool_t *pool = self->pool;
+	size_t i;
+
+	for (i = 1; i < pool->queues_num; i++)
 	{
-		if (pthread_create (read_threads + read_threads_num, NULL,
-					plugin_read_thread, NULL) == 0)
-		{
-			read_threads_num++;
-		}
-		else
-		{
-			ERROR ("plugin: start_read_threads: pthread_create failed.");
-			return;
-		}
-	} /* for (i) */
-} /* void start_read_threads */
+		read_queue_t *victim = pool->queues
+			+ (((size_t) (self - pool->queues) + i) % pool->queues_num);
+		read_func_t *rf;
 
-static void stop_read_threads (void)
-{
-	int i;
+		/* A thread which is not busy handles its own read functions
+		 * in time. */
+		if (!victim->busy)
+			continue;
 
-	if (read_threads == NULL)
-		return;
+		if (c_mutex_trylock (&victim->lock) != 0)
+			continue;
 
-	INFO ("collectd: Stopping %i read threads.", read_threads_num);
+		rf = c_heap_peek_root (victim->heap);
+		if ((rf != NULL) && (rf->rf_next_read <= now))
+		{
+			cdtime_t victim_next;
 
-	pthread_mutex_lock (&read_lock);
-	read_loop = 0;
-	DEBUG ("plugin: stop_read_threads: Signalling `read_cond'");
-	pthread_cond_broadcast (&read_cond);
-	pthread_mutex_unlock (&read_lock);
+			rf = c_heap_get_root (victim->heap);
+			victim->rf_num--;
+			victim_next = read_queue_next (victim);
+			c_mutex_unlock (&victim->lock);
 
-	for (i = 0; i < read_threads_num; i++)
-	{
-		if (pthread_join (read_threads[i], NULL) != 0)
+			/* The victim may have more due work than we can take. */
+			read_queue_wake_helper (self, victim_next);
+			return (rf);
+		}
+		else if ((rf != NULL) && (rf->rf_next_read < *deadline))
 		{
-			ERROR ("plugin: stop_read_threads: pthread_join failed.");
+			*deadline = rf->rf_next_read;
 		}
-		read_threads[i] = (pthread_t) 0;
-	}
-	sfree (read_threads);
-	read_threads_num = 0;
-} /* void stop_read_threads */
 
-static void plugin_value_list_free (value_list_t *vl) /* {{{ */
-{
-	if (vl == NULL)
-		return;
+		c_mutex_unlock (&victim->lock);
+	}
 
-	meta_data_destroy (vl->meta);
-	sfree (vl->values);
-	sfree (vl);
-} /* }}} void plugin_value_list_free */
+	return (NULL);
+} /* }}} read_func_t *read_queue_steal */
 
-static value_list_t *plugin_value_list_clone (value_list_t const *vl_orig) /* {{{ */
+/* Dispatches a notification about the read callback "name", which has been
+ * running for "duration", exceeding its timeout or, if "returned" is true,
+ * returning after it had. */
+static void read_timeout_notify (const char *name, /* {{{ */
+		cdtime_t duration, _Bool returned)
 {
-	value_list_t *vl;
-
-	if (vl_orig == NULL)
-		return (NULL);
+	notification_t n;
+
+	memset (&n, 0, sizeof (n));
+	n.severity = returned ? NOTIF_OKAY : NOTIF_FAILURE;
+	n.time = cdtime ();
+	sstrncpy (n.host, hostname_g, sizeof (n.host));
+	sstrncpy (n.plugin, "collectd", sizeof (n.plugin));
+	sstrncpy (n.plugin_instance, name, sizeof (n.plugin_instance));
+	sstrncpy (n.type_instance, "read_timeout", sizeof (n.type_instance));
+
+	if (returned)
+		ssnprintf (n.message, sizeof (n.message),
+				"The read callback \"%s\" returned after %.3f "
+				"seconds.", name, CDTIME_T_TO_DOUBLE (duration));
+	else
+		ssnprintf (n.message, sizeof (n.message),
+				"The read callback \"%s\" has been running for "
+				"%.3f seconds, exceeding its timeout. Started a "
+				"new read thread in place of the one running it.",
+				name, CDTIME_T_TO_DOUBLE (duration));
+
+	if (returned)
+		NOTICE ("plugin: %s", n.message);
+	else
+		ERROR ("plugin: %s", n.message);
 
-	vl = malloc (sizeof (*vl));
-	if (vl == NULL)
-		return (NULL);
-	memcpy (vl, vl_orig, sizeof (*vl));
+	plugin_dispatch_notification (&n);
+} /* }}} void read_timeout_notify */
 
-	vl->values = calloc (vl_orig->values_len, sizeof (*vl->values));
-	if (vl->values == NULL)
+/* Runs "rf" on behalf of "q" and inserts it into the queue's heap again.
+ * Returns true if the calling thread, started as "generation" of the queue's
+ * thread, has been replaced in the meantime and must exit. */
+static _Bool read_queue_run (read_queue_t *q, read_func_t *rf, /* {{{ */
+		_Bool stolen, unsigned int generation)
+{
+	char name[DATA_MAX_NAME_LEN];
+	cdtime_t duration;
+	cdtime_t lag;
+	cdtime_t now;
+	_Bool replaced;
+
+	/* The entry has been marked for deletion. The linked list
+	 * entry has already been removed by `plugin_unregister_read'.
+	 * All we have to do here is free the `read_func_t' and
+	 * continue. */
+	if (__sync_fetch_and_add (&rf->rf_type, 0) == RF_REMOVE)
 	{
-		plugin_value_list_free (vl);
-		return (NULL);
+		DEBUG ("plugin_read_thread: Destroying the `%s' "
+				"callback.", rf->rf_name);
+		destroy_callback ((callback_func_t *) rf);
+
+		if (!stolen)
+		{
+			c_mutex_lock (&q->lock);
+			q->rf_num--;
+			c_mutex_unlock (&q->lock);
+		}
+		return (0);
 	}
-	memcpy (vl->values, vl_orig->values,
-			vl_orig->values_len * sizeof (*vl->values));
 
-	vl->meta = meta_data_clone (vl->meta);
-	if ((vl_orig->meta != NULL) && (vl->meta == NULL))
+	now = cdtime ();
+	lag = (now > rf->rf_next_read) ? (now - rf->rf_next_read) : 0;
+
+	c_mutex_lock (&q->lock);
+	q->running = rf;
+	q->started = now;
+	c_mutex_unlock (&q->lock);
+
+	read_func_call (rf);
+
+	c_mutex_lock (&q->lock);
+	/* Once replaced, "running" belongs to the new thread. */
+	replaced = (q->generation != generation);
+	if (!replaced)
+		q->running = NULL;
+	/* Other threads may take "rf" as soon as it's in the heap. */
+	sstrncpy (name, rf->rf_name, sizeof (name));
+	duration = rf->rf_duration;
+	c_heap_insert (q->heap, rf);
+	if (stolen)
 	{
-		plugin_value_list_free (vl);
-		return (NULL);
+		q->rf_num++;
+		q->stolen++;
 	}
+	q->reads++;
+	q->lag += lag;
+	c_mutex_unlock (&q->lock);
 
-	if (vl->time == 0)
-		vl->time = cdtime ();
+	if (replaced)
+		read_timeout_notify (name, duration, /* returned = */ 1);
 
-	/* Fill in the interval from the thread context, if it is zero. */
-	if (vl->interval == 0)
+	return (replaced);
+} /* }}} _Bool read_queue_run */
+
+static void *plugin_read_thread (void *args) /* {{{ */
+{
+	read_queue_t *q = args;
+	unsigned int generation;
+	_Bool replaced = 0;
+
+	c_mutex_lock (&q->lock);
+	generation = q->generation;
+	while (read_loop != 0)
 	{
-		plugin_ctx_t ctx = plugin_get_ctx ();
+		read_func_t *rf;
+		cdtime_t deadline;
+		cdtime_t now;
 
-		if (ctx.interval != 0)
-			vl->interval = ctx.interval;
-		else
+		now = cdtime ();
+		rf = c_heap_peek_root (q->heap);
+		if ((rf != NULL) && (rf->rf_next_read <= now))
 		{
-			char name[6 * DATA_MAX_NAME_LEN];
-			FORMAT_VL (name, sizeof (name), vl);
-			ERROR ("plugin_value_list_clone: Unable to determine "
-					"interval from context for "
-					"value list \"%s\". "
-					"This indicates a broken plugin. "
-					"Please report this problem to the "
-					"collectd mailing list or at "
-					"<http://collectd.org/bugs/>.", name);
-			vl->interval = cf_get_default_interval ();
+			rf = c_heap_get_root (q->heap);
+			q->busy = 1;
+			deadline = read_queue_next (q);
+			c_mutex_unlock (&q->lock);
+
+			read_queue_wake_helper (q, deadline);
+			replaced = read_queue_run (q, rf, /* stolen = */ 0,
+					generation);
+
+			c_mutex_lock (&q->lock);
+			if (replaced)
+				break;
+			q->busy = 0;
+			continue;
 		}
-	}
-
-	return (vl);
-} /* }}} value_list_t *plugin_value_list_clone */
 
-static int plugin_write_enqueue (value_list_t const *vl) /* {{{ */
-{
-	write_queue_t *q;
+		deadline = (rf != NULL) ? rf->rf_next_read : READ_WAKEUP_NEVER;
 
-	q = malloc (sizeof (*q));
-	if (q == NULL)
-		return (ENOMEM);
-	q->next = NULL;
+		/* Nothing is due here. Help out threads which are busy. */
+		c_mutex_unlock (&q->lock);
+		rf = read_queue_steal (q, now, &deadline);
+		if (rf != NULL)
+		{
+			q->busy = 1;
+			replaced = read_queue_run (q, rf, /* stolen = */ 1,
+					generation);
+		}
+		c_mutex_lock (&q->lock);
 
-	q->vl = plugin_value_list_clone (vl);
-	if (q->vl == NULL)
-	{
-		sfree (q);
-		return (ENOMEM);
-	}
+		if (replaced)
+			break;
+		if (rf != NULL)
+		{
+			q->busy = 0;
+			continue;
+		}
 
-	/* Store context of caller (read plugin); otherwise, it would not be
-	 * available to the write plugins when actually dispatching the
-	 * value-list later on. */
-	q->ctx = plugin_get_ctx ();
+		/* Read functions may have been added while we didn't hold the
+		 * lock. */
+		if (read_queue_next (q) < deadline)
+			deadline = read_queue_next (q);
 
-	pthread_mutex_lock (&write_lock);
+		/* In pthread_cond_timedwait, spurious wakeups are possible
+		 * (and really happen, at least on NetBSD with > 1 CPU), thus
+		 * everything is re-evaluated every time it returns. */
+		q->wakeup = deadline;
+		if (read_loop == 0)
+			break;
+		else if (deadline == READ_WAKEUP_NEVER)
+			c_cond_wait (&q->cond, &q->lock);
+		else if (deadline > cdtime ())
+		{
+			struct timespec ts = { 0 };
 
-	if (write_queue_tail == NULL)
-	{
-		write_queue_head = q;
-		write_queue_tail = q;
-	}
-	else
-	{
-		write_queue_tail->next = q;
-		write_queue_tail = q;
-	}
+			CDTIME_T_TO_TIMESPEC (deadline, &ts);
+			c_cond_timedwait (&q->cond, &q->lock, &ts);
+		}
+		q->wakeup = 0;
+	} /* while (read_loop) */
+	c_mutex_unlock (&q->lock);
 
-	pthread_cond_signal (&write_cond);
-	pthread_mutex_unlock (&write_lock);
+	/* The queue may be freed once no replaced thread is left. */
+	if (replaced)
+		__sync_fetch_and_sub (&read_threads_hung, 1);
 
-	return (0);
-} /* }}} int plugin_write_enqueue */
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_read_thread */
 
-static value_list_t *plugin_write_dequeue (void) /* {{{ */
+/* Stops the threads of "pool". "read_loop" must have been set to zero. The
+ * caller must not hold "read_lock", because read callbacks may need it. */
+static void read_pool_stop (read_pool_t *pool) /* {{{ */
 {
-	write_queue_t *q;
-	value_list_t *vl;
-
-	pthread_mutex_lock (&write_lock);
+	size_t i;
 
-	while (write_loop && (write_queue_head == NULL))
-		pthread_cond_wait (&write_cond, &write_lock);
+	for (i = 0; i < pool->queues_num; i++)
+	{
+		c_mutex_lock (&pool->queues[i].lock);
+		pthread_cond_broadcast (&pool->queues[i].cond);
+		c_mutex_unlock (&pool->queues[i].lock);
+	}
 
-	if (write_queue_head == NULL)
+	for (i = 0; i < pool->queues_num; i++)
 	{
-		pthread_mutex_unlock (&write_lock);
-		return (NULL);
+		if (pthread_join (pool->queues[i].thread, NULL) != 0)
+		{
+			ERROR ("plugin: read_pool_stop: pthread_join failed.");
+		}
+		pool->queues[i].thread = (pthread_t) 0;
 	}
+} /* }}} void read_pool_stop */
+
+/* Moves the read functions of "pool" back to "read_heap" and frees the pool.
+ * The threads must not be running. */
+static void read_pool_destroy (read_pool_t *pool) /* {{{ */
+{
+	size_t i;
 
-	q = write_queue_head;
-	write_queue_head = q->next;
-	if (write_queue_head == NULL)
-		write_queue_tail = NULL;
+	for (i = 0; i < pool->queues_num; i++)
+	{
+		read_queue_t *q = pool->queues + i;
+		read_func_t *rf;
 
-	pthread_mutex_unlock (&write_lock);
+		while ((rf = c_heap_get_root (q->heap)) != NULL)
+			c_heap_insert (read_heap, rf);
 
-	(void) plugin_set_ctx (q->ctx);
+		c_heap_destroy (q->heap);
+		pthread_cond_destroy (&q->cond);
+		c_mutex_destroy (&q->lock);
+	}
 
-	vl = q->vl;
-	sfree (q);
-	return (vl);
-} /* }}} value_list_t *plugin_write_dequeue */
+	sfree (pool->queues);
+	sfree (pool);
+} /* }}} void read_pool_destroy */
 
-static void *plugin_write_thread (void __attribute__((unused)) *args) /* {{{ */
+/* Creates a pool of "num" read threads and adds it to "read_pools". The first
+ * pool created is the default pool. The caller must hold "read_lock". */
+/* Pins "thread", the "index"th thread of its kind, to its CPU set. Failing to
+ * do so is not fatal. */
+static void thread_cpus_apply (c_cpusets_t const *cpus, /* {{{ */
+		pthread_t thread, size_t index, char const *what)
 {
-	while (write_loop)
-	{
-		value_list_t *vl = plugin_write_dequeue ();
-		if (vl == NULL)
-			continue;
-
-		plugin_dispatch_values_internal (vl);
+	int status;
 
-		plugin_value_list_free (vl);
+	status = c_cpusets_apply (cpus, thread, index);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		WARNING ("plugin: Pinning %s thread #%zu to its CPUs failed: %s",
+				what, index, sstrerror (status, errbuf,
+					sizeof (errbuf)));
 	}
+} /* }}} void thread_cpus_apply */
 
-	pthread_exit (NULL);
-	return ((void *) 0);
-} /* }}} void *plugin_write_thread */
-
-static void start_write_threads (size_t num) /* {{{ */
+static read_pool_t *read_pool_create (const char *name, int num) /* {{{ */
 {
-	size_t i;
+	read_pool_t *pool;
+	size_t queues_num;
+	int i;
 
-	if (write_threads != NULL)
-		return;
+	pool = malloc (sizeof (*pool));
+	if (pool == NULL)
+	{
+		ERROR ("plugin: read_pool_create: malloc failed.");
+		return (NULL);
+	}
+	memset (pool, 0, sizeof (*pool));
+	sstrncpy (pool->name, name, sizeof (pool->name));
 
-	write_threads = (pthread_t *) calloc (num, sizeof (pthread_t));
-	if (write_threads == NULL)
+	pool->queues = calloc ((size_t) num, sizeof (*pool->queues));
+	if (pool->queues == NULL)
 	{
-		ERROR ("plugin: start_write_threads: calloc failed.");
-		return;
+		ERROR ("plugin: read_pool_create: calloc failed.");
+		sfree (pool);
+		return (NULL);
 	}
 
-	write_threads_num = 0;
+	queues_num = 0;
 	for (i = 0; i < num; i++)
+	{
+		read_queue_t *q = pool->queues + queues_num;
+
+		q->heap = c_heap_create (plugin_compare_read_func);
+		if (q->heap == NULL)
+		{
+			ERROR ("plugin: read_pool_create: c_heap_create failed.");
+			break;
+		}
+		c_mutex_init (&q->lock, "read_queue");
+		pthread_cond_init (&q->cond, /* attr = */ NULL);
+		q->pool = pool;
+
+		queues_num++;
+	}
+
+	/* Threads only look at the queues of their own pool, so this is
+	 * safe to set before they have started. */
+	pool->queues_num = 0;
+	for (i = 0; i < (int) queues_num; i++)
 	{
 		int status;
 
-		status = pthread_create (write_threads + write_threads_num,
-				/* attr = */ NULL,
-				plugin_write_thread,
-				/* arg = */ NULL);
+		status = pthread_create (&pool->queues[i].thread, NULL,
+				plugin_read_thread, pool->queues + i);
 		if (status != 0)
 		{
 			char errbuf[1024];
-			ERROR ("plugin: start_write_threads: pthread_create failed "
+			ERROR ("plugin: read_pool_create: pthread_create failed "
 					"with status %i (%s).", status,
 					sstrerror (status, errbuf, sizeof (errbuf)));
-			return;
+			break;
 		}
+		thread_cpus_apply (read_thread_cpus, pool->queues[i].thread,
+				(size_t) i, "read");
+		pool->queues_num++;
+	}
 
-		write_threads_num++;
-	} /* for (i) */
-} /* }}} void start_write_threads */
-
-static void stop_write_threads (void) /* {{{ */
-{
-	write_queue_t *q;
-	int i;
-
-	if (write_threads == NULL)
-		return;
-
-	INFO ("collectd: Stopping %zu write threads.", write_threads_num);
-
-	pthread_mutex_lock (&write_lock);
-	write_loop = 0;
-	DEBUG ("plugin: stop_write_threads: Signalling `write_cond'");
-	pthread_cond_broadcast (&write_cond);
-	pthread_mutex_unlock (&write_lock);
-
-	for (i = 0; i < write_threads_num; i++)
+	/* Without a thread, a queue's read functions would only be run when
+	 * stolen. The queues are still empty at this point. */
+	if (pool->queues_num < queues_num)
 	{
-		if (pthread_join (write_threads[i], NULL) != 0)
+		size_t running = pool->queues_num;
+
+		for (i = (int) running; i < (int) queues_num; i++)
 		{
-			ERROR ("plugin: stop_write_threads: pthread_join failed.");
+			c_heap_destroy (pool->queues[i].heap);
+			pthread_cond_destroy (&pool->queues[i].cond);
+			c_mutex_destroy (&pool->queues[i].lock);
 		}
-		write_threads[i] = (pthread_t) 0;
 	}
-	sfree (write_threads);
-	write_threads_num = 0;
 
-	pthread_mutex_lock (&write_lock);
-	i = 0;
-	for (q = write_queue_head; q != NULL; )
+	if (pool->queues_num == 0)
 	{
-		write_queue_t *q1 = q;
-		plugin_value_list_free (q->vl);
-		q = q->next;
-		sfree (q1);
-		i++;
+		sfree (pool->queues);
+		sfree (pool);
+		return (NULL);
 	}
-	write_queue_head = NULL;
-	write_queue_tail = NULL;
-	pthread_mutex_unlock (&write_lock);
 
-	if (i > 0)
+	if (read_pools == NULL)
 	{
-		WARNING ("plugin: %i value list%s left after shutting down "
-				"the write threads.",
-				i, (i == 1) ? " was" : "s were");
+		read_pools = pool;
+	}
+	else
+	{
+		pool->next = read_pools->next;
+		read_pools->next = pool;
 	}
-} /* }}} void stop_write_threads */
 
-/*
- * Public functions
- */
-void plugin_set_dir (const char *dir)
+	return (pool);
+} /* }}} read_pool_t *read_pool_create */
+
+/* Returns the pool which runs "rf", creating it if necessary. The caller must
+ * hold "read_lock" and the default pool must exist. */
+static read_pool_t *read_pool_get (read_func_t const *rf) /* {{{ */
 {
-	if (plugindir != NULL)
-		free (plugindir);
+	read_pool_t *default_pool = read_pools;
+	read_pool_t *pool;
+	const char *name;
 
-	if (dir == NULL)
-		plugindir = NULL;
-	else if ((plugindir = strdup (dir)) == NULL)
+	/* Don't start new threads while shutting down. */
+	if ((rf->rf_ctx.read_threads < 1) || (read_loop == 0))
+		return (default_pool);
+
+	name = (rf->rf_group[0] != 0) ? rf->rf_group : rf->rf_name;
+	for (pool = default_pool->next; pool != NULL; pool = pool->next)
+		if (strcmp (pool->name, name) == 0)
+			return (pool);
+
+	pool = read_pool_create (name, rf->rf_ctx.read_threads);
+	if (pool == NULL)
 	{
-		char errbuf[1024];
-		ERROR ("strdup failed: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
+		WARNING ("plugin: Unable to start the read threads of \"%s\". "
+				"Using the default read threads instead.", name);
+		return (default_pool);
 	}
-}
 
-#define BUFSIZE 512
-int plugin_load (const char *type, uint32_t flags)
+	INFO ("plugin: Started %zu read threads for \"%s\".",
+			pool->queues_num, name);
+	return (pool);
+} /* }}} read_pool_t *read_pool_get */
+
+/* Hands "rf" to the thread of its pool with the fewest read functions. The
+ * caller must hold "read_lock". */
+static int read_pool_insert (read_func_t *rf) /* {{{ */
 {
-	DIR  *dh;
-	const char *dir;
-	char  filename[BUFSIZE] = "";
-	char  typename[BUFSIZE];
-	int   typename_len;
-	int   ret;
-	struct stat    statbuf;
-	struct dirent *de;
+	read_pool_t *pool = read_pool_get (rf);
+	read_queue_t *q = pool->queues;
+	size_t i;
 	int status;
 
-	dir = plugin_get_dir ();
-	ret = 1;
+	for (i = 1; i < pool->queues_num; i++)
+		if (pool->queues[i].rf_num < q->rf_num)
+			q = pool->queues + i;
 
-	/* `cpu' should not match `cpufreq'. To solve this we add `.so' to the
-	 * type when matching the filename */
-	status = ssnprintf (typename, sizeof (typename), "%s.so", type);
-	if ((status < 0) || ((size_t) status >= sizeof (typename)))
-	{
-		WARNING ("plugin_load: Filename too long: \"%s.so\"", type);
-		return (-1);
-	}
-	typename_len = strlen (typename);
+	read_func_schedule_first (rf);
 
-	if ((dh = opendir (dir)) == NULL)
+	c_mutex_lock (&q->lock);
+	status = c_heap_insert (q->heap, rf);
+	if (status == 0)
 	{
-		char errbuf[1024];
-		ERROR ("plugin_load: opendir (%s) failed: %s", dir,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		return (-1);
+		q->rf_num++;
+		pthread_cond_signal (&q->cond);
 	}
+	c_mutex_unlock (&q->lock);
 
-	while ((de = readdir (dh)) != NULL)
+	return (status);
+} /* }}} int read_pool_insert */
+
+/* Returns true if "rf" has to wait for an init callback which has not
+ * finished yet: the one of the plugin it is named or grouped after, or the
+ * one which registered it. The job is remembered in "rf_init". */
+static _Bool init_job_holds (read_func_t *rf) /* {{{ */
+{
+	init_job_t *job = NULL;
+
+	pthread_mutex_lock (&init_lock);
+	if (init_jobs != NULL)
 	{
-		if (strncasecmp (de->d_name, typename, typename_len))
-			continue;
+		size_t i;
 
-		status = ssnprintf (filename, sizeof (filename),
-				"%s/%s", dir, de->d_name);
-		if ((status < 0) || ((size_t) status >= sizeof (filename)))
+		job = rf->rf_init;
+		if (job == NULL)
+			job = pthread_getspecific (init_job_key);
+
+		for (i = 0; (job == NULL) && (i < init_jobs_num); i++)
 		{
-			WARNING ("plugin_load: Filename too long: \"%s/%s\"",
-					dir, de->d_name);
-			continue;
+			const char *name = init_jobs[i].le->key;
+
+			if ((strcasecmp (name, rf->rf_name) == 0)
+					|| (strcasecmp (name, rf->rf_group) == 0))
+				job = init_jobs + i;
 		}
 
-		if (lstat (filename, &statbuf) == -1)
+		if ((job != NULL) && (job->state == INIT_DONE))
+			job = NULL;
+	}
+	rf->rf_init = job;
+	pthread_mutex_unlock (&init_lock);
+
+	return (job != NULL);
+} /* }}} _Bool init_job_holds */
+
+/* Hands the read functions in "read_heap" to the read threads, except for
+ * those which still wait for an init callback. The caller must hold
+ * "read_lock" and the default pool must exist. */
+static void read_heap_distribute (void) /* {{{ */
+{
+	read_func_t **held = NULL;
+	size_t held_num = 0;
+	read_func_t *rf;
+	size_t i;
+
+	while ((rf = c_heap_get_root (read_heap)) != NULL)
+	{
+		read_func_t **tmp;
+		_Bool was_held = (rf->rf_init != NULL);
+
+		if (!init_job_holds (rf))
 		{
-			char errbuf[1024];
-			WARNING ("plugin_load: stat (\"%s\") failed: %s",
-					filename,
-					sstrerror (errno, errbuf, sizeof (errbuf)));
+			/* Reads that were held back haven't been missed; start
+			 * from now rather than catching up. */
+			if (was_held && (rf->rf_next_read < cdtime ()))
+				rf->rf_next_read = cdtime ();
+			read_pool_insert (rf);
 			continue;
 		}
-		else if (!S_ISREG (statbuf.st_mode))
+
+		tmp = realloc (held, (held_num + 1) * sizeof (*held));
+		if (tmp == NULL)
 		{
-			/* don't follow symlinks */
-			WARNING ("plugin_load: %s is not a regular file.",
-				       	filename);
+			ERROR ("plugin: read_heap_distribute: realloc failed.");
+			read_pool_insert (rf);
 			continue;
 		}
+		held = tmp;
+		held[held_num++] = rf;
+	}
 
-		status = plugin_load_file (filename, flags);
-		if (status == 0)
-		{
-			/* success */
-			ret = 0;
-			break;
-		}
-		else
+	for (i = 0; i < held_num; i++)
+		c_heap_insert (read_heap, held[i]);
+	sfree (held);
+} /* }}} void read_heap_distribute */
+
+/* Called once per interval by the main thread. Replaces read threads whose
+ * callback has been running for longer than its "ReadTimeout": the new thread
+ * takes over the queue, while the old one is detached and exits once the
+ * callback returns. Until then, the callback isn't scheduled again because it
+ * isn't in any heap. */
+static void read_timeout_check (void) /* {{{ */
+{
+	static c_complain_t create_complaint = C_COMPLAIN_INIT_STATIC;
+	read_pool_t *pool;
+	cdtime_t now;
+	size_t i;
+
+	if (read_pools == NULL)
+		return;
+
+	now = cdtime ();
+	c_mutex_lock (&read_lock);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+	{
+		for (i = 0; i < pool->queues_num; i++)
 		{
-			ERROR ("plugin_load: Load plugin \"%s\" failed with "
-					"status %i.", type, status);
+			read_queue_t *q = pool->queues + i;
+			char name[DATA_MAX_NAME_LEN];
+			cdtime_t timeout;
+			cdtime_t duration;
+			pthread_t old;
+			int status;
+
+			c_mutex_lock (&q->lock);
+			if ((q->running == NULL) || (read_loop == 0))
+			{
+				c_mutex_unlock (&q->lock);
+				continue;
+			}
+
+			timeout = (q->running->rf_ctx.read_timeout > 0)
+				? q->running->rf_ctx.read_timeout : read_timeout;
+			duration = (now > q->started) ? (now - q->started) : 0;
+			if ((timeout == 0) || (duration <= timeout))
+			{
+				c_mutex_unlock (&q->lock);
+				continue;
+			}
+
+			/* The new thread waits for the lock and starts out
+			 * with the new generation. */
+			sstrncpy (name, q->running->rf_name, sizeof (name));
+			old = q->thread;
+			q->generation++;
+			status = pthread_create (&q->thread, /* attr = */ NULL,
+					plugin_read_thread, q);
+			if (status != 0)
+			{
+				char errbuf[1024];
+
+				q->generation--;
+				q->thread = old;
+				c_mutex_unlock (&q->lock);
+				c_complain (LOG_ERR, &create_complaint,
+						"plugin: read_timeout_check: "
+						"pthread_create failed with status "
+						"%i (%s).", status, sstrerror (status,
+							errbuf, sizeof (errbuf)));
+				continue;
+			}
+
+			/* "busy" and "running" belong to the new thread. */
+			q->running = NULL;
+			q->busy = 0;
+			__sync_fetch_and_add (&read_threads_hung, 1);
+			__sync_fetch_and_add (&read_timeouts, 1);
+			c_mutex_unlock (&q->lock);
+
+			pthread_detach (old);
+			thread_cpus_apply (read_thread_cpus, q->thread, i, "read");
+			c_release (LOG_INFO, &create_complaint,
+					"plugin: read_timeout_check: Starting "
+					"read threads works again.");
+
+			read_timeout_notify (name, duration,
+					/* returned = */ 0);
 		}
 	}
+	c_mutex_unlock (&read_lock);
+} /* }}} void read_timeout_check */
 
-	closedir (dh);
+static void start_read_threads (int num) /* {{{ */
+{
+	if (read_pools != NULL)
+		return;
 
-	if (filename[0] == 0)
-		ERROR ("plugin_load: Could not find plugin \"%s\" in %s",
-				type, dir);
+	c_mutex_lock (&read_lock);
 
-	return (ret);
-}
+	if (read_pool_create ("", num) == NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		return;
+	}
 
-/*
- * The `register_*' functions follow
- */
-int plugin_register_config (const char *name,
-		int (*callback) (const char *key, const char *val),
-		const char **keys, int keys_num)
-{
-	cf_register (name, callback, keys, keys_num);
-	return (0);
-} /* int plugin_register_config */
+	/* Distribute the read functions registered so far. The threads will
+	 * move them around as necessary. */
+	read_heap_distribute ();
 
-int plugin_register_complex_config (const char *type,
-		int (*callback) (oconfig_item_t *))
+	c_mutex_unlock (&read_lock);
+} /* }}} void start_read_threads */
+
+static void stop_read_threads (void) /* {{{ */
 {
-	return (cf_register_complex (type, callback));
-} /* int plugin_register_complex_config */
+	read_pool_t *pool;
+	size_t threads_num = 0;
 
-int plugin_register_init (const char *name,
-		int (*callback) (void))
+	if (read_pools == NULL)
+		return;
+
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		threads_num += pool->queues_num;
+	INFO ("collectd: Stopping %zu read threads.", threads_num);
+
+	/* No pools are added once "read_loop" is zero, so the list can be
+	 * walked without holding the lock. */
+	c_mutex_lock (&read_lock);
+	read_loop = 0;
+	c_mutex_unlock (&read_lock);
+
+	DEBUG ("plugin: stop_read_threads: Signalling the read threads");
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		read_pool_stop (pool);
+
+	/* Threads stuck in a callback still use their queue. */
+	if (read_threads_hung > 0)
+	{
+		WARNING ("plugin: %zu read callback%s did not return after "
+				"exceeding the ReadTimeout. Not freeing the read "
+				"threads' queues.", (size_t) read_threads_hung,
+				(read_threads_hung == 1) ? "" : "s");
+		read_pools = NULL;
+		return;
+	}
+
+	c_mutex_lock (&read_lock);
+	while (read_pools != NULL)
+	{
+		pool = read_pools;
+		read_pools = pool->next;
+		read_pool_destroy (pool);
+	}
+	c_mutex_unlock (&read_lock);
+} /* }}} void stop_read_threads */
+
+/* Copies "vl_orig" into "vl", which must point to uninitialized memory. The
+ * values are stored in "values_buf" if they fit. On failure, nothing needs to
+ * be freed. */
+static int plugin_value_list_copy (value_list_t *vl, /* {{{ */
+		value_list_t const *vl_orig,
+		value_t *values_buf, size_t values_buf_len)
 {
-	return (create_register_callback (&list_init, name, (void *) callback,
-				/* user_data = */ NULL));
-} /* plugin_register_init */
+	memcpy (vl, vl_orig, sizeof (*vl));
 
-static int plugin_compare_read_func (const void *arg0, const void *arg1)
+	if ((size_t) vl_orig->values_len <= values_buf_len)
+		vl->values = values_buf;
+	else
+		vl->values = calloc (vl_orig->values_len, sizeof (*vl->values));
+	if (vl->values == NULL)
+		return (ENOMEM);
+	memcpy (vl->values, vl_orig->values,
+			vl_orig->values_len * sizeof (*vl->values));
+
+	vl->meta = meta_data_clone (vl->meta);
+	if ((vl_orig->meta != NULL) && (vl->meta == NULL))
+	{
+		if (vl->values != values_buf)
+			sfree (vl->values);
+		return (ENOMEM);
+	}
+
+	if (vl->time == 0)
+		vl->time = cdtime ();
+
+	/* Fill in the interval from the thread context, if it is zero. */
+	if (vl->interval == 0)
+	{
+		plugin_ctx_t ctx = plugin_get_ctx ();
+
+		if (ctx.interval != 0)
+			vl->interval = ctx.interval;
+		else
+		{
+			char name[6 * DATA_MAX_NAME_LEN];
+			FORMAT_VL (name, sizeof (name), vl);
+			ERROR ("plugin_value_list_copy: Unable to determine "
+					"interval from context for "
+					"value list \"%s\". "
+					"This indicates a broken plugin. "
+					"Please report this problem to the "
+					"collectd mailing list or at "
+					"<http://collectd.org/bugs/>.", name);
+			vl->interval = cf_get_default_interval ();
+		}
+	}
+
+	return (0);
+} /* }}} int plugin_value_list_copy */
+
+/* Returns a queue node holding a copy of "vl" and the context of the calling
+ * thread. */
+static write_queue_t *write_queue_create (value_list_t const *vl) /* {{{ */
 {
-	const read_func_t *rf0;
-	const read_func_t *rf1;
+	write_queue_t *q;
 
-	rf0 = arg0;
-	rf1 = arg1;
+	q = c_ring_pop (write_queue_pool);
+	if (q == NULL)
+	{
+		q = malloc (sizeof (*q));
+		if (q == NULL)
+			return (NULL);
+	}
 
-	if (rf0->rf_next_read < rf1->rf_next_read)
-		return (-1);
-	else if (rf0->rf_next_read > rf1->rf_next_read)
-		return (1);
-	else
+	if (plugin_value_list_copy (&q->vl, vl,
+				q->values_inline, STATIC_ARRAY_SIZE (q->values_inline)) != 0)
+	{
+		sfree (q);
+		return (NULL);
+	}
+
+	/* Copies for asynchronous or batch write callbacks outlive the value
+	 * list they were taken from. */
+	if (vl->identity != NULL)
+	{
+		sstrncpy (q->identity, vl->identity, sizeof (q->identity));
+		q->vl.identity = q->identity;
+	}
+
+	q->vl.rates = NULL;
+	if ((vl->rates != NULL)
+			&& ((size_t) vl->values_len <= STATIC_ARRAY_SIZE (q->rates)))
+	{
+		memcpy (q->rates, vl->rates, vl->values_len * sizeof (*q->rates));
+		q->vl.rates = q->rates;
+	}
+
+	/* Store context of caller (read plugin); otherwise, it would not be
+	 * available to the write plugins when actually dispatching the
+	 * value-list later on. */
+	q->ctx = plugin_get_ctx ();
+
+	q->enqueued = 0;
+	q->trace = 0;
+
+	return (q);
+} /* }}} write_queue_t *write_queue_create */
+
+static void write_queue_free (write_queue_t *q) /* {{{ */
+{
+	if (q == NULL)
+		return;
+
+	meta_data_destroy (q->vl.meta);
+	q->vl.meta = NULL;
+	if (q->vl.values != q->values_inline)
+		sfree (q->vl.values);
+	q->vl.values = NULL;
+
+	if ((write_queue_pool == NULL) || (c_ring_push (write_queue_pool, q) != 0))
+		sfree (q);
+} /* }}} void write_queue_free */
+
+/* Frees the unused queue nodes. The pool itself stays in place: threads
+ * which are not stopped at shutdown, e.g. those receiving values from the
+ * network, may still dispatch values. */
+static void write_queue_pool_drain (void) /* {{{ */
+{
+	write_queue_t *q;
+
+	while ((q = c_ring_pop (write_queue_pool)) != NULL)
+		sfree (q);
+} /* }}} void write_queue_pool_drain */
+
+/* Returns true if the calling thread is one of the write threads. Those must
+ * never wait for room in the queue: they are the ones making room. */
+static _Bool is_write_thread (void) /* {{{ */
+{
+	pthread_t self = pthread_self ();
+	size_t i;
+
+	for (i = 0; i < write_threads_num; i++)
+		if (pthread_equal (self, write_threads[i]))
+			return (1);
+
+	return (0);
+} /* }}} _Bool is_write_thread */
+
+/* Creates the write queue with a single partition. start_write_threads()
+ * adds the other partitions, if any. */
+static int write_queue_init (void) /* {{{ */
+{
+	write_partition_t *p;
+
+	if (write_partitions != NULL)
 		return (0);
-} /* int plugin_compare_read_func */
 
-/* Add a read function to both, the heap and a linked list. The linked list if
- * used to look-up read functions, especially for the remove function. The heap
- * is used to determine which plugin to read next. */
-static int plugin_insert_read (read_func_t *rf)
+	c_mutex_lock (&write_lock);
+	if (write_partitions != NULL)
+	{
+		c_mutex_unlock (&write_lock);
+		return (0);
+	}
+
+	p = calloc (1, sizeof (*p));
+	if (p == NULL)
+	{
+		c_mutex_unlock (&write_lock);
+		ERROR ("plugin: write_queue_init: calloc failed.");
+		return (ENOMEM);
+	}
+
+	p->queue = c_ring_create (write_queue_limit_high);
+	if (p->queue == NULL)
+	{
+		c_mutex_unlock (&write_lock);
+		sfree (p);
+		ERROR ("plugin: write_queue_init: c_ring_create failed.");
+		return (ENOMEM);
+	}
+	pthread_cond_init (&p->cond, /* attr = */ NULL);
+
+	/* Without a pool, nodes are simply malloc'ed and freed. */
+	write_queue_pool = c_ring_create (WRITE_QUEUE_POOL_SIZE);
+	if (write_queue_pool == NULL)
+		WARNING ("plugin: write_queue_init: Creating the pool of "
+				"queue nodes failed.");
+
+	write_partitions_num = 1;
+	__sync_synchronize ();
+	write_partitions = p;
+	c_mutex_unlock (&write_lock);
+
+	return (0);
+} /* }}} int write_queue_init */
+
+/* Returns the number of value lists in all partitions. */
+static size_t write_queue_length (void) /* {{{ */
 {
-	int status;
-	llentry_t *le;
+	size_t length = 0;
+	size_t i;
 
-	rf->rf_next_read = cdtime ();
-	rf->rf_effective_interval = rf->rf_interval;
+	for (i = 0; i < write_partitions_num; i++)
+		length += c_ring_length (write_partitions[i].queue);
 
-	pthread_mutex_lock (&read_lock);
+	return (length);
+} /* }}} size_t write_queue_length */
 
-	if (read_list == NULL)
+/* Returns the partition "vl" belongs to. */
+static write_partition_t *write_partition_get (value_list_t const *vl) /* {{{ */
+{
+	if (write_partitions_num < 2)
+		return (write_partitions);
+
+	return (write_partitions + (plugin_hash_vl (vl) % write_partitions_num));
+} /* }}} write_partition_t *write_partition_get */
+
+/* Parses the "WriteQueue*" global options. Must be called before the queue
+ * is created, i.e. before the first value is dispatched. */
+static void write_queue_configure (void) /* {{{ */
+{
+	char const *tmp;
+	long high;
+	long low;
+
+	high = atol (global_option_get ("WriteQueueLimitHigh"));
+	low = atol (global_option_get ("WriteQueueLimitLow"));
+
+	if (high < 1)
+		high = WRITE_QUEUE_DEFAULT_LIMIT;
+	if ((low < 1) || (low > high))
 	{
-		read_list = llist_create ();
-		if (read_list == NULL)
-		{
-			pthread_mutex_unlock (&read_lock);
-			ERROR ("plugin_insert_read: read_list failed.");
-			return (-1);
-		}
+		if (low > high)
+			WARNING ("plugin: WriteQueueLimitLow (%li) is greater "
+					"than WriteQueueLimitHigh (%li). "
+					"Setting both to %li.", low, high, high);
+		low = high;
 	}
 
-	if (read_heap == NULL)
+	/* Values dispatched while reading the config file may have created the
+	 * queue with the default size already. */
+	if ((write_partitions != NULL)
+			&& ((size_t) high > c_ring_capacity (write_partitions->queue)))
 	{
-		read_heap = c_heap_create (plugin_compare_read_func);
-		if (read_heap == NULL)
+		WARNING ("plugin: The write queue has been created before "
+				"WriteQueueLimitHigh could take effect. "
+				"Limiting it to %zu.",
+				c_ring_capacity (write_partitions->queue));
+		high = (long) c_ring_capacity (write_partitions->queue);
+		if (low > high)
+			low = high;
+	}
+
+	write_queue_limit_high = (size_t) high;
+	write_queue_limit_low = (size_t) low;
+
+	write_queue_partitioned = IS_TRUE (global_option_get
+			("WriteQueuePartitioned")) ? 1 : 0;
+
+	write_tracing = IS_TRUE (global_option_get ("WriteTracing")) ? 1 : 0;
+	write_trace_sample = (unsigned int) atoi (global_option_get
+			("WriteTraceSample"));
+
+	tmp = global_option_get ("WriteQueuePolicy");
+	if ((tmp == NULL) || (strcasecmp ("Block", tmp) == 0))
+		write_queue_policy = WQ_POLICY_BLOCK;
+	else if (strcasecmp ("DropNew", tmp) == 0)
+		write_queue_policy = WQ_POLICY_DROP_NEW;
+	else if (strcasecmp ("DropRandom", tmp) == 0)
+		write_queue_policy = WQ_POLICY_DROP_RANDOM;
+	else
+	{
+		WARNING ("plugin: Unknown WriteQueuePolicy \"%s\". "
+				"Falling back to \"Block\".", tmp);
+		write_queue_policy = WQ_POLICY_BLOCK;
+	}
+} /* }}} void write_queue_configure */
+
+/* Decides whether a newly dispatched value has to be dropped, based on the
+ * current length of partition "p" and the configured policy. Blocks the
+ * caller if the policy says so. Returns true if the value should be
+ * dropped. */
+static _Bool write_queue_check_drop (write_partition_t *p) /* {{{ */
+{
+	size_t length = c_ring_length (p->queue);
+
+	/* Not exact when several threads dispatch at once, which is good
+	 * enough for statistics. */
+	if (length > write_queue_peak)
+		write_queue_peak = length;
+
+	if (length < write_queue_limit_low)
+	{
+		p->shedding = 0;
+		return (0);
+	}
+
+	switch (write_queue_policy)
+	{
+		case WQ_POLICY_BLOCK:
+			if (length < write_queue_limit_high)
+				return (0);
+
+			/* Write threads can't wait for themselves. */
+			if (is_write_thread ())
+				return (1);
+
+			c_mutex_lock (&write_lock);
+			__sync_fetch_and_add (&write_queue_waiting_producers, 1);
+			while (write_loop
+					&& (c_ring_length (p->queue) > write_queue_limit_low))
+				c_cond_wait (&write_space_cond, &write_lock);
+			__sync_fetch_and_sub (&write_queue_waiting_producers, 1);
+			c_mutex_unlock (&write_lock);
+
+			/* Don't queue new values while shutting down. */
+			return (!write_loop);
+
+		case WQ_POLICY_DROP_NEW:
+			if (length >= write_queue_limit_high)
+				p->shedding = 1;
+			return (p->shedding);
+
+		case WQ_POLICY_DROP_RANDOM:
 		{
-			pthread_mutex_unlock (&read_lock);
-			ERROR ("plugin_insert_read: c_heap_create failed.");
-			return (-1);
+			double p;
+
+			if (length >= write_queue_limit_high)
+				return (1);
+
+			p = ((double) (length - write_queue_limit_low))
+				/ ((double) (write_queue_limit_high - write_queue_limit_low));
+			return (((double) random ()) < (p * ((double) RAND_MAX)));
 		}
 	}
 
-	le = llist_search (read_list, rf->rf_name);
-	if (le != NULL)
+	return (0);
+} /* }}} _Bool write_queue_check_drop */
+
+static void write_queue_drop (value_list_t const *vl) /* {{{ */
+{
+	static c_complain_t drop_complaint = C_COMPLAIN_INIT_STATIC;
+	char name[6 * DATA_MAX_NAME_LEN];
+
+	__sync_fetch_and_add (&write_queue_dropped, 1);
+
+	/* Values arriving after the write threads have been stopped can't be
+	 * written anyway; don't spam the log with them. */
+	if (!write_loop)
+		return;
+
+	FORMAT_VL (name, sizeof (name), vl);
+	c_complain (LOG_WARNING, &drop_complaint,
+			"plugin_dispatch_values: The write queue holds %zu "
+			"values, dropping \"%s\" and possibly more. "
+			"Check the WriteQueueLimitHigh and WriteQueuePolicy "
+			"settings and the performance of your write plugins.",
+			write_queue_length (), name);
+} /* }}} void write_queue_drop */
+
+/* Wakes up a write thread of "p" if one is waiting. */
+static void write_partition_wakeup (write_partition_t *p) /* {{{ */
+{
+	/* The ring publishes the value with a plain store, which may be
+	 * reordered with the load of the counter below. With the barrier, a
+	 * consumer which incremented the counter (a full barrier, too) before
+	 * checking the ring either sees our value or is seen by us here. */
+	__sync_synchronize ();
+	if (p->waiting_consumers > 0)
 	{
-		pthread_mutex_unlock (&read_lock);
-		WARNING ("The read function \"%s\" is already registered. "
-				"Check for duplicate \"LoadPlugin\" lines "
-				"in your configuration!",
-				rf->rf_name);
-		return (EINVAL);
+		c_mutex_lock (&write_lock);
+		pthread_cond_signal (&p->cond);
+		c_mutex_unlock (&write_lock);
 	}
+} /* }}} void write_partition_wakeup */
 
-	le = llentry_create (rf->rf_name, rf);
-	if (le == NULL)
+/* Adds the time from "start" to "end" to a histogram with
+ * PLUGIN_WRITE_LATENCY_BUCKETS buckets of powers of two microseconds. */
+static void latency_account (volatile uint64_t *buckets, /* {{{ */
+		cdtime_t start, cdtime_t end)
+{
+	uint64_t us;
+	size_t i;
+
+	us = (end > start) ? (uint64_t) CDTIME_T_TO_US (end - start) : 0;
+	for (i = 0; i < (PLUGIN_WRITE_LATENCY_BUCKETS - 1); i++)
+		if (us < (((uint64_t) 1) << i))
+			break;
+
+	__sync_fetch_and_add (&buckets[i], 1);
+} /* }}} void latency_account */
+
+/* Starts the trace of a value list queued at "enqueued" and returns its
+ * sequence number. */
+static uint64_t write_trace_start (value_list_t const *vl, /* {{{ */
+		cdtime_t enqueued)
+{
+	char identity[6 * DATA_MAX_NAME_LEN];
+	write_trace_slot_t *slot;
+	uint64_t seq;
+
+	if (FORMAT_VL (identity, sizeof (identity), vl) != 0)
+		return (0);
+
+	pthread_mutex_lock (&write_trace_lock);
+	seq = ++write_traces_seq;
+	slot = write_traces + (seq % WRITE_TRACES_NUM);
+	memset (slot, 0, sizeof (*slot));
+	slot->seq = seq;
+	sstrncpy (slot->trace.identity, identity, sizeof (slot->trace.identity));
+	slot->trace.enqueued = enqueued;
+	pthread_mutex_unlock (&write_trace_lock);
+
+	return (seq);
+} /* }}} uint64_t write_trace_start */
+
+/* Accounts the time a value list queued at "enqueued" has spent in the write
+ * queue. */
+static void write_trace_dequeued (cdtime_t enqueued, uint64_t trace, /* {{{ */
+		cdtime_t now)
+{
+	write_trace_slot_t *slot;
+
+	if (enqueued == 0)
+		return;
+
+	latency_account (write_queue_wait, enqueued, now);
+	if (trace == 0)
+		return;
+
+	pthread_mutex_lock (&write_trace_lock);
+	slot = write_traces + (trace % WRITE_TRACES_NUM);
+	if (slot->seq == trace)
+		slot->trace.dequeued = now;
+	pthread_mutex_unlock (&write_trace_lock);
+} /* }}} void write_trace_dequeued */
+
+/* Accounts the time from queueing a value list at "enqueued" until "wf" has
+ * written it. */
+static void write_trace_written (write_func_t *wf, /* {{{ */
+		cdtime_t enqueued, uint64_t trace, cdtime_t now)
+{
+	write_trace_slot_t *slot;
+
+	if (enqueued == 0)
+		return;
+
+	latency_account (wf->wf_delay, enqueued, now);
+	if (trace == 0)
+		return;
+
+	pthread_mutex_lock (&write_trace_lock);
+	slot = write_traces + (trace % WRITE_TRACES_NUM);
+	if ((slot->seq == trace)
+			&& (slot->trace.writers_num < PLUGIN_WRITE_TRACE_WRITERS))
 	{
-		pthread_mutex_unlock (&read_lock);
-		ERROR ("plugin_insert_read: llentry_create failed.");
-		return (-1);
+		size_t i = slot->trace.writers_num;
+
+		sstrncpy (slot->trace.writers[i], wf->wf_name,
+				sizeof (slot->trace.writers[i]));
+		slot->trace.written[i] = now;
+		slot->trace.writers_num++;
 	}
+	pthread_mutex_unlock (&write_trace_lock);
+} /* }}} void write_trace_written */
+
+/* Queues a copy of "vl" without waking up the write threads. "ret_partition"
+ * is set to the partition the value list has been added to, or NULL if it
+ * has been dropped. The caller must call write_partition_wakeup() for it. */
+static int plugin_write_enqueue_nowakeup (value_list_t const *vl, /* {{{ */
+		write_partition_t **ret_partition)
+{
+	write_partition_t *p;
+	write_queue_t *q;
+	int status;
 
-	status = c_heap_insert (read_heap, rf);
+	*ret_partition = NULL;
+
+	status = write_queue_init ();
 	if (status != 0)
+		return (status);
+
+	p = write_partition_get (vl);
+	if (write_queue_check_drop (p))
 	{
-		pthread_mutex_unlock (&read_lock);
-		ERROR ("plugin_insert_read: c_heap_insert failed.");
-		llentry_destroy (le);
-		return (-1);
+		write_queue_drop (vl);
+		return (0);
+	}
+
+	q = write_queue_create (vl);
+	if (q == NULL)
+		return (ENOMEM);
+
+	/* Determined anew by plugin_dispatch_values_internal(), the caller
+	 * may have changed the value list since. */
+	q->vl.identity = NULL;
+	q->vl.identity_hash = 0;
+	q->vl.rates = NULL;
+
+	if (write_tracing || (write_threads_grow_latency > 0))
+		q->enqueued = cdtime ();
+	if (write_tracing)
+	{
+		if ((write_trace_sample > 0)
+				&& ((__sync_fetch_and_add (&write_trace_counter, 1)
+						% write_trace_sample) == 0))
+			q->trace = write_trace_start (vl, q->enqueued);
+	}
+
+	while (c_ring_push (p->queue, q) != 0)
+	{
+		/* The ring is full. Other dispatching threads raced us past the
+		 * high watermark; wait or drop according to the policy. */
+		if ((write_queue_policy != WQ_POLICY_BLOCK) || !write_loop
+				|| is_write_thread ())
+		{
+			write_queue_drop (vl);
+			write_queue_free (q);
+			return (0);
+		}
+
+		c_mutex_lock (&write_lock);
+		/* Values queued earlier in a batch may not have been signaled
+		 * yet. */
+		if (p->waiting_consumers > 0)
+			pthread_cond_signal (&p->cond);
+		__sync_fetch_and_add (&write_queue_waiting_producers, 1);
+		if (c_ring_length (p->queue) >= c_ring_capacity (p->queue))
+			c_cond_wait (&write_space_cond, &write_lock);
+		__sync_fetch_and_sub (&write_queue_waiting_producers, 1);
+		c_mutex_unlock (&write_lock);
+	}
+
+	*ret_partition = p;
+	return (0);
+} /* }}} int plugin_write_enqueue_nowakeup */
+
+static int plugin_write_enqueue (value_list_t const *vl) /* {{{ */
+{
+	write_partition_t *p;
+	int status;
+
+	status = plugin_write_enqueue_nowakeup (vl, &p);
+	if ((status == 0) && (p != NULL))
+		write_partition_wakeup (p);
+
+	return (status);
+} /* }}} int plugin_write_enqueue */
+
+/* Removes the next value list from partition "p". If "wait" is false,
+ * returns NULL right away when the partition is empty. Also returns NULL once
+ * "stop" has been set and the partition's condition has been signalled. */
+static write_queue_t *plugin_write_dequeue (write_partition_t *p, /* {{{ */
+		_Bool wait, volatile _Bool const *stop)
+{
+	write_queue_t *q;
+
+	while (42)
+	{
+		q = c_ring_pop (p->queue);
+		if ((q != NULL) || !wait)
+			break;
+
+		c_mutex_lock (&write_lock);
+		__sync_fetch_and_add (&p->waiting_consumers, 1);
+		q = c_ring_pop (p->queue);
+		if ((q == NULL) && write_loop && !*stop)
+			c_cond_wait (&p->cond, &write_lock);
+		__sync_fetch_and_sub (&p->waiting_consumers, 1);
+		c_mutex_unlock (&write_lock);
+
+		if ((q != NULL) || !write_loop || *stop)
+			break;
+	}
+
+	if (q == NULL)
+		return (NULL);
+
+	if ((write_queue_waiting_producers > 0)
+			&& (c_ring_length (p->queue) <= write_queue_limit_low))
+	{
+		c_mutex_lock (&write_lock);
+		pthread_cond_broadcast (&write_space_cond);
+		c_mutex_unlock (&write_lock);
+	}
+
+	return (q);
+} /* }}} write_queue_t *plugin_write_dequeue */
+
+static write_batch_t *write_batch_get (void) /* {{{ */
+{
+	if (!write_batch_key_initialized)
+		return (NULL);
+
+	return (pthread_getspecific (write_batch_key));
+} /* }}} write_batch_t *write_batch_get */
+
+static int write_batch_append (write_batch_t *b, /* {{{ */
+		write_func_t *wf, const data_set_t *ds, value_list_t const *vl)
+{
+	write_batch_item_t *item;
+
+	if (b->items_num >= b->items_size)
+	{
+		write_batch_item_t *tmp;
+		size_t new_size;
+
+		new_size = (b->items_size == 0)
+			? WRITE_BATCH_SIZE : (2 * b->items_size);
+		tmp = realloc (b->items, new_size * sizeof (*b->items));
+		if (tmp == NULL)
+			return (ENOMEM);
+
+		b->items = tmp;
+		b->items_size = new_size;
+	}
+
+	item = b->items + b->items_num;
+	item->wf = wf;
+	item->ds = ds;
+
+	/* The queued value list itself may be referenced until a target asks
+	 * to change it, see plugin_value_list_make_writable(). Once it has, the
+	 * values are restored after dispatching and have to be copied. The
+	 * "write" target may be called for any value list, so copy others,
+	 * too. */
+	if ((vl == b->current) && (b->saved_values == NULL))
+	{
+		item->vl = vl;
+		item->copy = NULL;
+	}
+	else
+	{
+		item->copy = write_queue_create (vl);
+		if (item->copy == NULL)
+			return (ENOMEM);
+		item->vl = &item->copy->vl;
+	}
+	item->enqueued = b->current_enqueued;
+	item->trace = b->current_trace;
+
+	b->items_num++;
+	return (0);
+} /* }}} int write_batch_append */
+
+/* Accounts a call of the callback of "wf" which started at "start". */
+static cdtime_t write_func_latency (write_func_t *wf, /* {{{ */
+		cdtime_t start)
+{
+	cdtime_t now = cdtime ();
+
+	latency_account (wf->wf_latency, start, now);
+	return (now);
+} /* }}} cdtime_t write_func_latency */
+
+/* Calls each batch write callback once with all of its collected values. */
+static void write_batch_flush (write_batch_t *b) /* {{{ */
+{
+	size_t i;
+
+	if (b->items_num == 0)
+		return;
+
+	if (b->args_size < b->items_num)
+	{
+		plugin_write_item_t *tmp;
+
+		tmp = realloc (b->args, b->items_size * sizeof (*b->args));
+		if (tmp == NULL)
+		{
+			ERROR ("plugin: write_batch_flush: realloc failed. "
+					"Dropping %zu values.", b->items_num);
+			for (i = 0; i < b->items_num; i++)
+				b->items[i].wf = NULL;
+		}
+		else
+		{
+			b->args = tmp;
+			b->args_size = b->items_size;
+		}
+	}
+
+	for (i = 0; i < b->items_num; i++)
+	{
+		write_func_t *wf = b->items[i].wf;
+		plugin_write_batch_cb callback;
+		cdtime_t start;
+		cdtime_t end;
+		uint64_t cpu;
+		size_t args_num;
+		size_t j;
+		int status;
+
+		/* Already handed to its callback. */
+		if (wf == NULL)
+			continue;
+
+		args_num = 0;
+		for (j = i; j < b->items_num; j++)
+		{
+			if (b->items[j].wf != wf)
+				continue;
+
+			b->args[args_num].ds = b->items[j].ds;
+			b->args[args_num].vl = b->items[j].vl;
+			args_num++;
+		}
+
+		DEBUG ("plugin: write_batch_flush: Writing %zu values via %s.",
+				args_num, wf->wf_name);
+		callback = wf->wf_callback;
+		start = cdtime ();
+		cpu = cpu_time_start ();
+		status = (*callback) (b->args, args_num, &wf->wf_udata);
+		cpu_time_account (&wf->wf_super, cpu);
+		end = write_func_latency (wf, start);
+
+		for (j = i; j < b->items_num; j++)
+		{
+			if (b->items[j].wf != wf)
+				continue;
+
+			write_trace_written (wf, b->items[j].enqueued,
+					b->items[j].trace, end);
+			b->items[j].wf = NULL;
+		}
+		if (status != 0)
+			c_complain (LOG_INFO, &wf->wf_complaint,
+					"plugin: Write callback \"%s\" failed "
+					"with status %i for a batch of %zu "
+					"values.", wf->wf_name, status, args_num);
+		else
+			c_release (LOG_INFO, &wf->wf_complaint,
+					"plugin: Write callback \"%s\" "
+					"succeeded again.", wf->wf_name);
+	}
+
+	for (i = 0; i < b->items_num; i++)
+		write_queue_free (b->items[i].copy);
+	b->items_num = 0;
+} /* }}} void write_batch_flush */
+
+static void *plugin_write_thread (void *args) /* {{{ */
+{
+	size_t index = (size_t) (uintptr_t) args;
+	write_partition_t *p = write_partitions + (index % write_partitions_num);
+	volatile _Bool const *stop = write_threads_stop + index;
+	_Bool autoscale = (write_threads_max > write_threads_min);
+	write_batch_t batch;
+
+	memset (&batch, 0, sizeof (batch));
+	pthread_setspecific (write_batch_key, &batch);
+
+	while (write_loop && !*stop)
+	{
+		write_queue_t *nodes[WRITE_BATCH_SIZE];
+		size_t nodes_num;
+		size_t i;
+		cdtime_t start = 0;
+
+		nodes[0] = plugin_write_dequeue (p, /* wait = */ 1, stop);
+		if (nodes[0] == NULL)
+			continue;
+
+		if (autoscale)
+		{
+			start = cdtime ();
+			/* Races between the threads may lose a maximum, which
+			 * only delays growing the pool. */
+			if ((nodes[0]->enqueued != 0)
+					&& (start > nodes[0]->enqueued)
+					&& ((start - nodes[0]->enqueued)
+						> write_threads_wait))
+				write_threads_wait = start - nodes[0]->enqueued;
+		}
+
+		/* Take whatever else is queued already, but don't wait for
+		 * more. */
+		nodes_num = 1;
+		while (nodes_num < WRITE_BATCH_SIZE)
+		{
+			nodes[nodes_num] = plugin_write_dequeue (p, /* wait = */ 0,
+					stop);
+			if (nodes[nodes_num] == NULL)
+				break;
+			nodes_num++;
+		}
+
+		if (write_tracing)
+		{
+			cdtime_t now = cdtime ();
+
+			for (i = 0; i < nodes_num; i++)
+				write_trace_dequeued (nodes[i]->enqueued,
+						nodes[i]->trace, now);
+		}
+
+		/* The filter chains may be replaced meanwhile; fc_reload()
+		 * waits for the section before freeing the old ones. */
+		c_epoch_enter ();
+		if ((nodes_num > 1) && (pre_cache_chain == NULL))
+			plugin_dispatch_values_nodes (&batch, nodes, nodes_num);
+		else
+		{
+			for (i = 0; i < nodes_num; i++)
+			{
+				(void) plugin_set_ctx (nodes[i]->ctx);
+				batch.current = &nodes[i]->vl;
+				batch.current_enqueued = nodes[i]->enqueued;
+				batch.current_trace = nodes[i]->trace;
+				batch.current_first = batch.items_num;
+				plugin_dispatch_values_internal (&nodes[i]->vl,
+						nodes[i]->identity,
+						sizeof (nodes[i]->identity),
+						nodes[i]->rates,
+						STATIC_ARRAY_SIZE (nodes[i]->rates));
+			}
+		}
+		c_epoch_leave ();
+		batch.current = NULL;
+		batch.current_enqueued = 0;
+		batch.current_trace = 0;
+
+		write_batch_flush (&batch);
+
+		for (i = 0; i < nodes_num; i++)
+			write_queue_free (nodes[i]);
+
+		if (autoscale)
+			__sync_fetch_and_add (&write_threads_busy,
+					(uint64_t) (cdtime () - start));
+	}
+
+	pthread_setspecific (write_batch_key, NULL);
+	sfree (batch.items);
+	sfree (batch.args);
+
+	write_threads_exited[index] = 1;
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_write_thread */
+
+/* Grows the write queue to "num" partitions with the limits split evenly
+ * among them. This must happen before any thread other than the main thread
+ * dispatches values. Values queued so far remain in the first partition. */
+static void write_partitions_add (size_t num) /* {{{ */
+{
+	write_partition_t *p;
+	size_t high;
+	size_t low;
+	size_t i;
+
+	high = (write_queue_limit_high + num - 1) / num;
+	low = write_queue_limit_low / num;
+	if (low < 1)
+		low = 1;
+
+	p = calloc (num, sizeof (*p));
+	if (p == NULL)
+	{
+		ERROR ("plugin: write_partitions_add: calloc failed.");
+		return;
+	}
+
+	/* The first partition keeps its queue, which may not be empty. None
+	 * of the condition variables is in use yet. */
+	p[0].queue = write_partitions[0].queue;
+	pthread_cond_init (&p[0].cond, /* attr = */ NULL);
+
+	for (i = 1; i < num; i++)
+	{
+		p[i].queue = c_ring_create (high);
+		if (p[i].queue == NULL)
+		{
+			ERROR ("plugin: write_partitions_add: "
+					"c_ring_create failed.");
+			break;
+		}
+		pthread_cond_init (&p[i].cond, /* attr = */ NULL);
+	}
+
+	if (i < 2)
+	{
+		pthread_cond_destroy (&p[0].cond);
+		sfree (p);
+		return;
+	}
+
+	c_mutex_lock (&write_lock);
+	pthread_cond_destroy (&write_partitions[0].cond);
+	sfree (write_partitions);
+	write_partitions = p;
+	write_partitions_num = i;
+	write_queue_limit_high = high;
+	write_queue_limit_low = (low < high) ? low : high;
+	c_mutex_unlock (&write_lock);
+
+	INFO ("plugin: Partitioned the write queue %zu ways.", i);
+} /* }}} void write_partitions_add */
+
+/* Starts write thread number "write_threads_num". */
+static int write_thread_start (void) /* {{{ */
+{
+	size_t i = write_threads_num;
+	int status;
+
+	write_threads_stop[i] = 0;
+	write_threads_exited[i] = 0;
+
+	status = pthread_create (write_threads + i, /* attr = */ NULL,
+			plugin_write_thread, /* arg = */ (void *) (uintptr_t) i);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("plugin: write_thread_start: pthread_create failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+		return (status);
+	}
+
+	/* Thread "i" takes values from partition "i" modulo the number of
+	 * partitions, so with as many CPU sets as partitions a partition is
+	 * written by threads on the same CPUs. */
+	thread_cpus_apply (write_thread_cpus, write_threads[i], i, "write");
+	write_threads_num++;
+	return (0);
+} /* }}} int write_thread_start */
+
+/* Starts "num" write threads, making room for up to "max". */
+static void start_write_threads (size_t num, size_t max) /* {{{ */
+{
+	size_t i;
+
+	if (write_threads != NULL)
+		return;
+
+	if (write_queue_init () != 0)
+		return;
+
+	if (!write_batch_key_initialized)
+	{
+		if (pthread_key_create (&write_batch_key, NULL) != 0)
+		{
+			ERROR ("plugin: start_write_threads: "
+					"pthread_key_create failed.");
+			return;
+		}
+		write_batch_key_initialized = 1;
+	}
+
+	if (write_queue_partitioned && (num > 1))
+		write_partitions_add (num);
+
+	if (max < num)
+		max = num;
+
+	write_threads = (pthread_t *) calloc (max, sizeof (pthread_t));
+	write_threads_stop = calloc (max, sizeof (*write_threads_stop));
+	write_threads_exited = calloc (max, sizeof (*write_threads_exited));
+	if ((write_threads == NULL) || (write_threads_stop == NULL)
+			|| (write_threads_exited == NULL))
+	{
+		ERROR ("plugin: start_write_threads: calloc failed.");
+		sfree (write_threads);
+		free ((void *) write_threads_stop);
+		free ((void *) write_threads_exited);
+		write_threads_stop = NULL;
+		write_threads_exited = NULL;
+		return;
+	}
+
+	write_threads_min = num;
+	write_threads_max = max;
+	write_threads_num = 0;
+	for (i = 0; i < num; i++)
+		if (write_thread_start () != 0)
+			break;
+
+	if (max > num)
+		INFO ("plugin: Scaling the write threads between %zu and %zu.",
+				num, max);
+} /* }}} void start_write_threads */
+
+/* Called once per interval by the main thread. Grows the pool of write
+ * threads by half of its size, up to "WriteThreadsMax", while the write queue
+ * holds at least "WriteThreadsGrowQueueLength" value lists or a value list
+ * waited at least "WriteThreadsGrowLatency" in it. Stops the last thread
+ * after three intervals in which the queue was short and one thread less
+ * would have been busy less than half of the time. */
+static void write_threads_adjust (void) /* {{{ */
+{
+	cdtime_t now;
+	cdtime_t elapsed;
+	uint64_t busy;
+	uint64_t wait;
+	size_t length;
+	size_t num = write_threads_num;
+
+	if ((write_threads_max <= write_threads_min) || (num == 0))
+		return;
+
+	now = cdtime ();
+	busy = __sync_lock_test_and_set (&write_threads_busy, 0);
+	wait = __sync_lock_test_and_set (&write_threads_wait, 0);
+	elapsed = (write_threads_last_check != 0)
+		? now - write_threads_last_check : 0;
+	write_threads_last_check = now;
+
+	/* A thread stopped at an earlier check may still be finishing its
+	 * batch. Don't change anything until it has exited. */
+	if (write_threads_stop[num - 1])
+	{
+		if (!write_threads_exited[num - 1])
+			return;
+		if (pthread_join (write_threads[num - 1], NULL) != 0)
+			ERROR ("plugin: write_threads_adjust: "
+					"pthread_join failed.");
+		write_threads[num - 1] = (pthread_t) 0;
+		write_threads_num = num - 1;
+		INFO ("plugin: Stopped a write thread, %zu are left.",
+				write_threads_num);
+		return;
+	}
+
+	length = write_queue_length ();
+	if ((length >= write_threads_grow_length)
+			|| ((write_threads_grow_latency > 0)
+				&& (wait >= write_threads_grow_latency)))
+	{
+		size_t want = num + (num + 1) / 2;
+
+		write_threads_idle_checks = 0;
+		if (want > write_threads_max)
+			want = write_threads_max;
+		if (num >= want)
+			return;
+
+		while (write_threads_num < want)
+			if (write_thread_start () != 0)
+				break;
+		if (write_threads_num == num)
+			return;
+
+		write_threads_adjustments++;
+		INFO ("plugin: The write queue holds %zu value lists and a value "
+				"list waited up to %.3f seconds. Started %zu write "
+				"threads, %zu are running.", length,
+				CDTIME_T_TO_DOUBLE ((cdtime_t) wait),
+				write_threads_num - num, write_threads_num);
+		return;
+	}
+
+	if ((num <= write_threads_min) || (elapsed == 0)
+			|| (length >= write_threads_grow_length / 2)
+			|| (2 * busy >= (uint64_t) elapsed * (num - 1)))
+	{
+		write_threads_idle_checks = 0;
+		return;
+	}
+
+	write_threads_idle_checks++;
+	if (write_threads_idle_checks < 3)
+		return;
+	write_threads_idle_checks = 0;
+
+	/* Joined by the next check once it has exited. */
+	c_mutex_lock (&write_lock);
+	write_threads_stop[num - 1] = 1;
+	pthread_cond_broadcast (&write_partitions[(num - 1)
+			% write_partitions_num].cond);
+	c_mutex_unlock (&write_lock);
+	write_threads_adjustments++;
+} /* }}} void write_threads_adjust */
+
+static void stop_write_threads (void) /* {{{ */
+{
+	write_queue_t *q;
+	size_t j;
+	int i;
+
+	if (write_threads == NULL)
+		return;
+
+	INFO ("collectd: Stopping %zu write threads.", write_threads_num);
+
+	c_mutex_lock (&write_lock);
+	write_loop = 0;
+	DEBUG ("plugin: stop_write_threads: Signalling the write threads");
+	for (i = 0; i < (int) write_partitions_num; i++)
+		pthread_cond_broadcast (&write_partitions[i].cond);
+	pthread_cond_broadcast (&write_space_cond);
+	c_mutex_unlock (&write_lock);
+
+	for (i = 0; i < write_threads_num; i++)
+	{
+		if (pthread_join (write_threads[i], NULL) != 0)
+		{
+			ERROR ("plugin: stop_write_threads: pthread_join failed.");
+		}
+		write_threads[i] = (pthread_t) 0;
+	}
+	sfree (write_threads);
+	free ((void *) write_threads_stop);
+	free ((void *) write_threads_exited);
+	write_threads_stop = NULL;
+	write_threads_exited = NULL;
+	write_threads_num = 0;
+
+	i = 0;
+	for (j = 0; j < write_partitions_num; j++)
+	{
+		while ((q = c_ring_pop (write_partitions[j].queue)) != NULL)
+		{
+			write_queue_free (q);
+			i++;
+		}
+	}
+
+	if (i > 0)
+	{
+		WARNING ("plugin: %i value list%s left after shutting down "
+				"the write threads.",
+				i, (i == 1) ? " was" : "s were");
+	}
+
+	if (write_queue_dropped > 0)
+	{
+		NOTICE ("plugin: %"PRIu64" value list%s dropped because the "
+				"write queue was full.",
+				(uint64_t) write_queue_dropped,
+				(write_queue_dropped == 1) ? " was" : "s were");
+	}
+} /* }}} void stop_write_threads */
+
+static void *plugin_write_async_thread (void *arg) /* {{{ */
+{
+	write_func_t *wf = arg;
+	c_complain_t failure_complaint = C_COMPLAIN_INIT_STATIC;
+
+	while (42)
+	{
+		write_queue_t *nodes[WRITE_BATCH_SIZE];
+		plugin_write_item_t items[WRITE_BATCH_SIZE];
+		size_t nodes_num;
+		size_t items_num;
+		size_t i;
+		cdtime_t start;
+		uint64_t cpu;
+		int status;
+
+		nodes[0] = c_ring_pop (wf->wf_queue);
+		if (nodes[0] == NULL)
+		{
+			pthread_mutex_lock (&wf->wf_lock);
+			__sync_fetch_and_add (&wf->wf_waiting, 1);
+			nodes[0] = c_ring_pop (wf->wf_queue);
+			if ((nodes[0] == NULL) && wf->wf_loop)
+				pthread_cond_wait (&wf->wf_cond, &wf->wf_lock);
+			__sync_fetch_and_sub (&wf->wf_waiting, 1);
+			pthread_mutex_unlock (&wf->wf_lock);
+		}
+
+		if (nodes[0] == NULL)
+		{
+			/* Only exit once the queue has been drained. */
+			if (!wf->wf_loop && (c_ring_length (wf->wf_queue) == 0))
+				break;
+			continue;
+		}
+
+		nodes_num = 1;
+		if (wf->wf_batch)
+		{
+			while (nodes_num < WRITE_BATCH_SIZE)
+			{
+				nodes[nodes_num] = c_ring_pop (wf->wf_queue);
+				if (nodes[nodes_num] == NULL)
+					break;
+				nodes_num++;
+			}
+		}
+
+		items_num = 0;
+		for (i = 0; i < nodes_num; i++)
+		{
+			const data_set_t *ds = plugin_get_ds (nodes[i]->vl.type);
+			if (ds == NULL)
+			{
+				ERROR ("plugin_write_async_thread: Unable to lookup "
+						"type `%s'.", nodes[i]->vl.type);
+				continue;
+			}
+
+			items[items_num].ds = ds;
+			items[items_num].vl = &nodes[i]->vl;
+			items_num++;
+		}
+
+		/* Keep the context of the dispatching read plugin, just like
+		 * plugin_write() does. */
+		(void) plugin_set_ctx (nodes[0]->ctx);
+
+		start = cdtime ();
+		cpu = cpu_time_start ();
+		if (items_num == 0)
+			status = 0;
+		else if (wf->wf_batch)
+		{
+			plugin_write_batch_cb callback = wf->wf_callback;
+			status = (*callback) (items, items_num, &wf->wf_udata);
+		}
+		else
+		{
+			plugin_write_cb callback = wf->wf_callback;
+			status = (*callback) (items[0].ds, items[0].vl,
+					&wf->wf_udata);
+		}
+		cpu_time_account (&wf->wf_super, cpu);
+		if (items_num > 0)
+		{
+			cdtime_t end = write_func_latency (wf, start);
+
+			for (i = 0; i < nodes_num; i++)
+				write_trace_written (wf, nodes[i]->enqueued,
+						nodes[i]->trace, end);
+		}
+
+		if (status != 0)
+			c_complain (LOG_ERR, &failure_complaint,
+					"plugin_write_async_thread: Write callback "
+					"\"%s\" failed with status %i.",
+					wf->wf_name, status);
+		else
+			c_release (LOG_INFO, &failure_complaint,
+					"plugin_write_async_thread: Write callback "
+					"\"%s\" succeeded again.", wf->wf_name);
+
+		for (i = 0; i < nodes_num; i++)
+			write_queue_free (nodes[i]);
+	}
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_write_async_thread */
+
+static int write_func_start_async (write_func_t *wf) /* {{{ */
+{
+	size_t limit;
+	int status;
+
+	limit = wf->wf_ctx.write_async_limit;
+	if (limit == 0)
+		limit = WRITE_QUEUE_DEFAULT_LIMIT;
+
+	wf->wf_queue = c_ring_create (limit);
+	if (wf->wf_queue == NULL)
+	{
+		ERROR ("plugin: write_func_start_async: c_ring_create failed.");
+		return (ENOMEM);
+	}
+
+	pthread_mutex_init (&wf->wf_lock, /* attr = */ NULL);
+	pthread_cond_init (&wf->wf_cond, /* attr = */ NULL);
+	wf->wf_waiting = 0;
+	wf->wf_dropped = 0;
+	wf->wf_loop = 1;
+
+	status = pthread_create (&wf->wf_thread, /* attr = */ NULL,
+			plugin_write_async_thread, wf);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("plugin: write_func_start_async: pthread_create failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+		pthread_cond_destroy (&wf->wf_cond);
+		pthread_mutex_destroy (&wf->wf_lock);
+		c_ring_destroy (wf->wf_queue);
+		wf->wf_queue = NULL;
+		return (status);
+	}
+
+	return (0);
+} /* }}} int write_func_start_async */
+
+/* Stops the thread of an asynchronous write callback after it has written
+ * all queued values. Does nothing for synchronous callbacks. */
+static void write_func_stop_async (write_func_t *wf) /* {{{ */
+{
+	if ((wf == NULL) || (wf->wf_queue == NULL))
+		return;
+
+	pthread_mutex_lock (&wf->wf_lock);
+	wf->wf_loop = 0;
+	pthread_cond_broadcast (&wf->wf_cond);
+	pthread_mutex_unlock (&wf->wf_lock);
+
+	if (pthread_join (wf->wf_thread, NULL) != 0)
+		ERROR ("plugin: write_func_stop_async: pthread_join failed.");
+
+	if (wf->wf_dropped > 0)
+		NOTICE ("plugin: Write callback \"%s\": %"PRIu64" value list%s "
+				"dropped because its queue was full.",
+				wf->wf_name, (uint64_t) wf->wf_dropped,
+				(wf->wf_dropped == 1) ? " was" : "s were");
+
+	pthread_cond_destroy (&wf->wf_cond);
+	pthread_mutex_destroy (&wf->wf_lock);
+	c_ring_destroy (wf->wf_queue);
+	wf->wf_queue = NULL;
+} /* }}} void write_func_stop_async */
+
+static void stop_async_writers (void) /* {{{ */
+{
+	llentry_t *le;
+
+	if (list_write == NULL)
+		return;
+
+	for (le = llist_head (list_write); le != NULL; le = le->next)
+		write_func_stop_async (le->value);
+} /* }}} void stop_async_writers */
+
+/* Queues a copy of "vl" for an asynchronous write callback. A full queue
+ * drops the value: blocking would stall the write threads and with them all
+ * other writers, which is what the queue is supposed to prevent. */
+static int write_func_enqueue (write_func_t *wf, /* {{{ */
+		value_list_t const *vl)
+{
+	static c_complain_t drop_complaint = C_COMPLAIN_INIT_STATIC;
+	write_batch_t *b;
+	write_queue_t *q;
+
+	q = write_queue_create (vl);
+	if (q == NULL)
+		return (ENOMEM);
+
+	b = write_batch_get ();
+	if (b != NULL)
+	{
+		q->enqueued = b->current_enqueued;
+		q->trace = b->current_trace;
+	}
+
+	if (c_ring_push (wf->wf_queue, q) != 0)
+	{
+		__sync_fetch_and_add (&wf->wf_dropped, 1);
+		c_complain (LOG_WARNING, &drop_complaint,
+				"plugin_write: The queue of write callback \"%s\" "
+				"is full (%zu values). Dropping values until "
+				"it catches up.",
+				wf->wf_name, c_ring_capacity (wf->wf_queue));
+		write_queue_free (q);
+		return (0);
+	}
+
+	/* Order the push before the check, see write_partition_wakeup(). */
+	__sync_synchronize ();
+	if (wf->wf_waiting > 0)
+	{
+		pthread_mutex_lock (&wf->wf_lock);
+		pthread_cond_signal (&wf->wf_cond);
+		pthread_mutex_unlock (&wf->wf_lock);
+	}
+
+	return (0);
+} /* }}} int write_func_enqueue */
+
+/* Hands "vl" to a single write callback, either directly or through its
+ * queue. */
+static int write_func_invoke (write_func_t *wf, /* {{{ */
+		const data_set_t *ds, const value_list_t *vl)
+{
+	plugin_write_cb callback;
+	write_batch_t *b;
+	cdtime_t start;
+	cdtime_t end;
+	uint64_t cpu;
+	int status;
+
+	if (wf->wf_queue != NULL)
+		return (write_func_enqueue (wf, vl));
+
+	if (wf->wf_batch)
+	{
+		plugin_write_batch_cb batch_callback = wf->wf_callback;
+
+		b = write_batch_get ();
+		plugin_write_item_t item;
+
+		/* Inside a write thread, the value is passed on together with
+		 * the rest of the batch. */
+		if ((b != NULL) && (write_batch_append (b, wf, ds, vl) == 0))
+			return (0);
+
+		item.ds = ds;
+		item.vl = vl;
+		start = cdtime ();
+		cpu = cpu_time_start ();
+		status = (*batch_callback) (&item, 1, &wf->wf_udata);
+		cpu_time_account (&wf->wf_super, cpu);
+		end = write_func_latency (wf, start);
+		if (b != NULL)
+			write_trace_written (wf, b->current_enqueued,
+					b->current_trace, end);
+		return (status);
+	}
+
+	callback = wf->wf_callback;
+	start = cdtime ();
+	cpu = cpu_time_start ();
+	status = (*callback) (ds, vl, &wf->wf_udata);
+	cpu_time_account (&wf->wf_super, cpu);
+	end = write_func_latency (wf, start);
+
+	/* Only value lists dispatched by a write thread have been queued. */
+	b = write_batch_get ();
+	if (b != NULL)
+		write_trace_written (wf, b->current_enqueued, b->current_trace,
+				end);
+	return (status);
+} /* }}} int write_func_invoke */
+
+/* Calls all notification callbacks in the calling thread. */
+static int plugin_dispatch_notification_internal ( /* {{{ */
+		const notification_t *notif)
+{
+	llentry_t *le;
+
+	le = llist_head (list_notification);
+	while (le != NULL)
+	{
+		callback_func_t *cf;
+		plugin_notification_cb callback;
+		int status;
+
+		/* do not switch plugin context; rather keep the context
+		 * (interval) information of the calling plugin */
+
+		cf = le->value;
+		callback = cf->cf_callback;
+		status = (*callback) (notif, &cf->cf_udata);
+		if (status != 0)
+		{
+			WARNING ("plugin_dispatch_notification: Notification "
+					"callback %s returned %i.",
+					le->key, status);
+		}
+
+		le = le->next;
+	}
+
+	return (0);
+} /* }}} int plugin_dispatch_notification_internal */
+
+/* Hashes everything but the time and the meta data of "n". */
+static uint64_t notification_hash (const notification_t *n) /* {{{ */
+{
+	char severity[16];
+	uint64_t hash;
+
+	ssnprintf (severity, sizeof (severity), "%i", n->severity);
+
+	hash = plugin_hash_update (PLUGIN_HASH_INIT, severity) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->host) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->plugin) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->plugin_instance) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->type) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->type_instance) * 1099511628211ULL;
+	hash = plugin_hash_update (hash, n->message);
+
+	return (hash);
+} /* }}} uint64_t notification_hash */
+
+static _Bool notification_equal (const notification_t *a, /* {{{ */
+		const notification_t *b)
+{
+	return ((a->severity == b->severity)
+			&& (strcmp (a->message, b->message) == 0)
+			&& (strcmp (a->host, b->host) == 0)
+			&& (strcmp (a->plugin, b->plugin) == 0)
+			&& (strcmp (a->plugin_instance, b->plugin_instance) == 0)
+			&& (strcmp (a->type, b->type) == 0)
+			&& (strcmp (a->type_instance, b->type_instance) == 0));
+} /* }}} _Bool notification_equal */
+
+static int notif_index_compare (const void *a, const void *b) /* {{{ */
+{
+	uint64_t ha = *((const uint64_t *) a);
+	uint64_t hb = *((const uint64_t *) b);
+
+	if (ha < hb)
+		return (-1);
+	else if (ha > hb)
+		return (1);
+	return (0);
+} /* }}} int notif_index_compare */
+
+static void notification_queue_free (notification_queue_t *e) /* {{{ */
+{
+	if (e == NULL)
+		return;
+
+	if (e->n.meta != NULL)
+		plugin_notification_meta_free (e->n.meta);
+	sfree (e);
+} /* }}} void notification_queue_free */
+
+/* Queues a copy of "notif" for the notification threads. A notification
+ * identical to one still waiting in the queue is dropped, as is any
+ * notification arriving while the queue is full. */
+static int notification_enqueue (const notification_t *notif) /* {{{ */
+{
+	static c_complain_t drop_complaint = C_COMPLAIN_INIT_STATIC;
+	notification_queue_t *e;
+	notification_queue_t *queued = NULL;
+	uint64_t hash;
+
+	hash = notification_hash (notif);
+
+	pthread_mutex_lock (&notif_lock);
+	/* The threads are shutting down. */
+	if (!notif_loop)
+	{
+		pthread_mutex_unlock (&notif_lock);
+		return (plugin_dispatch_notification_internal (notif));
+	}
+
+	if ((c_avl_get (notif_index, &hash, (void *) &queued) == 0)
+			&& notification_equal (&queued->n, notif))
+	{
+		notif_coalesced++;
+		pthread_mutex_unlock (&notif_lock);
+		return (0);
+	}
+
+	if (notif_queue_length >= notif_queue_limit)
+	{
+		notif_dropped++;
+		pthread_mutex_unlock (&notif_lock);
+
+		c_complain (LOG_WARNING, &drop_complaint,
+				"plugin_dispatch_notification: The notification "
+				"queue is full, dropping notifications. Check the "
+				"NotificationQueueLimit setting and the "
+				"performance of your notification plugins.");
+		return (-1);
+	}
+	pthread_mutex_unlock (&notif_lock);
+
+	e = malloc (sizeof (*e));
+	if (e == NULL)
+	{
+		ERROR ("plugin_dispatch_notification: malloc failed.");
+		return (ENOMEM);
+	}
+	memcpy (&e->n, notif, sizeof (e->n));
+	e->n.meta = NULL;
+	plugin_notification_meta_copy (&e->n, notif);
+	e->ctx = plugin_get_ctx ();
+	e->hash = hash;
+	e->indexed = 0;
+	e->next = NULL;
+
+	pthread_mutex_lock (&notif_lock);
+	if (!notif_loop)
+	{
+		pthread_mutex_unlock (&notif_lock);
+		plugin_dispatch_notification_internal (&e->n);
+		notification_queue_free (e);
+		return (0);
+	}
+
+	/* Another thread may have queued the same notification meanwhile.
+	 * That's fine, it is only delivered twice. */
+	if (c_avl_insert (notif_index, &e->hash, e) == 0)
+		e->indexed = 1;
+
+	if (notif_queue_tail == NULL)
+		notif_queue_head = e;
+	else
+		notif_queue_tail->next = e;
+	notif_queue_tail = e;
+	notif_queue_length++;
+
+	pthread_cond_signal (&notif_cond);
+	pthread_mutex_unlock (&notif_lock);
+
+	c_release (LOG_INFO, &drop_complaint,
+			"plugin_dispatch_notification: The notification queue "
+			"has room again.");
+	return (0);
+} /* }}} int notification_enqueue */
+
+static void *plugin_notification_thread (void __attribute__((unused)) *args) /* {{{ */
+{
+	pthread_mutex_lock (&notif_lock);
+	while (42)
+	{
+		notification_queue_t *e;
+
+		/* Deliver everything that is queued before exiting. */
+		while (notif_loop && (notif_queue_head == NULL))
+			pthread_cond_wait (&notif_cond, &notif_lock);
+
+		e = notif_queue_head;
+		if (e == NULL)
+			break;
+
+		notif_queue_head = e->next;
+		if (notif_queue_head == NULL)
+			notif_queue_tail = NULL;
+		notif_queue_length--;
+		if (e->indexed)
+			c_avl_remove (notif_index, &e->hash, NULL, NULL);
+		pthread_mutex_unlock (&notif_lock);
+
+		(void) plugin_set_ctx (e->ctx);
+		plugin_dispatch_notification_internal (&e->n);
+		notification_queue_free (e);
+
+		pthread_mutex_lock (&notif_lock);
+	}
+	pthread_mutex_unlock (&notif_lock);
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_notification_thread */
+
+static void start_notification_threads (size_t num) /* {{{ */
+{
+	size_t i;
+
+	if ((notif_threads != NULL) || (num < 1))
+		return;
+
+	notif_index = c_avl_create (notif_index_compare);
+	if (notif_index == NULL)
+	{
+		ERROR ("plugin: start_notification_threads: "
+				"c_avl_create failed.");
+		return;
+	}
+
+	notif_threads = calloc (num, sizeof (*notif_threads));
+	if (notif_threads == NULL)
+	{
+		ERROR ("plugin: start_notification_threads: calloc failed.");
+		c_avl_destroy (notif_index);
+		notif_index = NULL;
+		return;
+	}
+
+	notif_threads_num = 0;
+	for (i = 0; i < num; i++)
+	{
+		int status;
+
+		status = pthread_create (notif_threads + notif_threads_num,
+				/* attr = */ NULL, plugin_notification_thread,
+				/* arg = */ NULL);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("plugin: start_notification_threads: "
+					"pthread_create failed with status %i (%s).",
+					status, sstrerror (status, errbuf,
+						sizeof (errbuf)));
+			break;
+		}
+
+		notif_threads_num++;
+	}
+
+	if (notif_threads_num == 0)
+	{
+		sfree (notif_threads);
+		c_avl_destroy (notif_index);
+		notif_index = NULL;
+	}
+} /* }}} void start_notification_threads */
+
+/* Delivers the notifications still queued and stops the notification
+ * threads. Notifications dispatched afterwards are delivered directly. */
+static void stop_notification_threads (void) /* {{{ */
+{
+	size_t i;
+
+	if (notif_threads == NULL)
+		return;
+
+	pthread_mutex_lock (&notif_lock);
+	notif_loop = 0;
+	pthread_cond_broadcast (&notif_cond);
+	pthread_mutex_unlock (&notif_lock);
+
+	for (i = 0; i < notif_threads_num; i++)
+	{
+		if (pthread_join (notif_threads[i], NULL) != 0)
+		{
+			ERROR ("plugin: stop_notification_threads: "
+					"pthread_join failed.");
+		}
+	}
+
+	pthread_mutex_lock (&notif_lock);
+	sfree (notif_threads);
+	notif_threads_num = 0;
+	c_avl_destroy (notif_index);
+	notif_index = NULL;
+	pthread_mutex_unlock (&notif_lock);
+
+	if ((notif_dropped > 0) || (notif_coalesced > 0))
+		NOTICE ("plugin: %"PRIu64" notification%s dropped because the "
+				"queue was full, %"PRIu64" duplicate%s coalesced.",
+				notif_dropped, (notif_dropped == 1) ? " was" : "s were",
+				notif_coalesced, (notif_coalesced == 1) ? " was" : "s were");
+} /* }}} void stop_notification_threads */
+
+/* Calls all log callbacks in the calling thread. */
+static void plugin_log_internal (int level, const char *msg) /* {{{ */
+{
+	llentry_t *le;
+
+	le = llist_head (list_log);
+	while (le != NULL)
+	{
+		callback_func_t *cf;
+		plugin_log_cb callback;
+
+		cf = le->value;
+		callback = cf->cf_callback;
+
+		/* do not switch plugin context; rather keep the context
+		 * (interval) information of the calling plugin */
+
+		(*callback) (level, msg, &cf->cf_udata);
+
+		le = le->next;
+	}
+} /* }}} void plugin_log_internal */
+
+/* Returns true if a message with the given format may be logged according
+ * to "LogRateLimit". Preformatted messages, i.e. the format "%s", are used by
+ * many places, e.g. c_complain() and the language bindings, and are never
+ * limited. */
+static _Bool log_check_rate (const char *format) /* {{{ */
+{
+	log_callsite_t *cs;
+	uint64_t suppressed = 0;
+	size_t hash;
+	size_t i;
+	_Bool ok;
+
+	if ((log_rate_limit == 0) || (strcmp ("%s", format) == 0))
+		return (1);
+
+	hash = (size_t) ((((uintptr_t) format) >> 3) % LOG_CALLSITES_NUM);
+	cs = log_callsites + hash;
+
+	pthread_mutex_lock (&log_limit_lock);
+	for (i = 0; i < LOG_CALLSITES_PROBE; i++)
+	{
+		log_callsite_t *probe = log_callsites
+			+ ((hash + i) % LOG_CALLSITES_NUM);
+
+		if (probe->format == format)
+		{
+			cs = probe;
+			break;
+		}
+		else if (probe->format == NULL)
+		{
+			probe->format = format;
+			C_RATELIMIT_INIT (&probe->limit);
+			cs = probe;
+			break;
+		}
+	}
+
+	ok = c_ratelimit (&cs->limit, log_rate_limit,
+			TIME_T_TO_CDTIME_T (1), &suppressed);
+	if (!ok)
+		log_suppressed++;
+	pthread_mutex_unlock (&log_limit_lock);
+
+	/* Formatted here so the report itself is exempt from the limit. */
+	if (suppressed > 0)
+	{
+		char msg[1024];
+
+		ssnprintf (msg, sizeof (msg), "plugin_log: Suppressed %"PRIu64
+				" message%s like \"%s\".", suppressed,
+				(suppressed == 1) ? "" : "s", format);
+		plugin_log (LOG_NOTICE, "%s", msg);
+	}
+
+	return (ok);
+} /* }}} _Bool log_check_rate */
+
+static void *plugin_log_thread (void __attribute__((unused)) *args) /* {{{ */
+{
+	while (42)
+	{
+		log_entry_t *e;
+
+		e = c_ring_pop (log_queue);
+		if (e == NULL)
+		{
+			pthread_mutex_lock (&log_lock);
+			__sync_fetch_and_add (&log_waiting, 1);
+			e = c_ring_pop (log_queue);
+			if ((e == NULL) && log_loop)
+				pthread_cond_wait (&log_cond, &log_lock);
+			__sync_fetch_and_sub (&log_waiting, 1);
+			pthread_mutex_unlock (&log_lock);
+		}
+
+		if (e == NULL)
+		{
+			/* Write out everything before exiting. Messages
+			 * pushed after this check are written by the threads
+			 * logging them, see plugin_log(). */
+			__sync_synchronize ();
+			if (!log_loop && (c_ring_length (log_queue) == 0))
+				break;
+			continue;
+		}
+
+		plugin_log_internal (e->level, e->msg);
+		c_ring_push (log_free, e);
+	}
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_log_thread */
+
+static void start_log_thread (size_t limit) /* {{{ */
+{
+	size_t i;
+	int status;
+
+	if (log_queue != NULL)
+		return;
+
+	log_entries = calloc (limit, sizeof (*log_entries));
+	log_free = c_ring_create (limit);
+	log_queue = c_ring_create (limit);
+	if ((log_entries == NULL) || (log_free == NULL) || (log_queue == NULL))
+	{
+		ERROR ("plugin: start_log_thread: Allocating the log queue "
+				"failed.");
+		sfree (log_entries);
+		c_ring_destroy (log_free);
+		c_ring_destroy (log_queue);
+		log_free = log_queue = NULL;
+		return;
+	}
+
+	for (i = 0; i < limit; i++)
+		c_ring_push (log_free, log_entries + i);
+
+	log_loop = 1;
+	status = pthread_create (&log_thread, /* attr = */ NULL,
+			plugin_log_thread, /* arg = */ NULL);
+	if (status != 0)
+	{
+		char errbuf[1024];
+
+		log_loop = 0;
+		sfree (log_entries);
+		c_ring_destroy (log_free);
+		c_ring_destroy (log_queue);
+		log_free = log_queue = NULL;
+
+		ERROR ("plugin: start_log_thread: pthread_create failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+		return;
+	}
+} /* }}} void start_log_thread */
+
+/* Writes out the queued messages and stops the logger thread. Messages logged
+ * afterwards are handed to the log callbacks directly. The queue itself is
+ * not freed: threads which are not stopped at shutdown may still be in the
+ * middle of logging. */
+static void stop_log_thread (void) /* {{{ */
+{
+	if (!log_loop)
+		return;
+
+	pthread_mutex_lock (&log_lock);
+	log_loop = 0;
+	pthread_cond_broadcast (&log_cond);
+	pthread_mutex_unlock (&log_lock);
+
+	if (pthread_join (log_thread, NULL) != 0)
+		ERROR ("plugin: stop_log_thread: pthread_join failed.");
+
+	if (log_dropped > 0)
+		NOTICE ("plugin: %"PRIu64" log message%s dropped because the "
+				"log queue was full.", (uint64_t) log_dropped,
+				(log_dropped == 1) ? " was" : "s were");
+	if (log_suppressed > 0)
+		NOTICE ("plugin: %"PRIu64" log message%s suppressed by "
+				"LogRateLimit.", log_suppressed,
+				(log_suppressed == 1) ? " was" : "s were");
+} /* }}} void stop_log_thread */
+
+static void flush_request_free (flush_request_t *r) /* {{{ */
+{
+	if (r == NULL)
+		return;
+
+	sfree (r->key);
+	sfree (r->plugin);
+	sfree (r->identifier);
+	sfree (r);
+} /* }}} void flush_request_free */
+
+static void *plugin_flush_thread (void __attribute__((unused)) *args) /* {{{ */
+{
+	pthread_mutex_lock (&flush_lock);
+	while (flush_loop)
+	{
+		flush_request_t *batch;
+		flush_request_t *all = NULL;
+		flush_request_t *r;
+
+		if (flush_head == NULL)
+		{
+			pthread_cond_wait (&flush_cond, &flush_lock);
+			continue;
+		}
+
+		/* Requests made while this batch is being flushed are queued
+		 * anew, since their data may have arrived after the flush. */
+		batch = flush_head;
+		flush_head = flush_tail = NULL;
+		for (r = batch; r != NULL; r = r->next)
+		{
+			c_avl_remove (flush_index, r->key, NULL, NULL);
+			if ((r->plugin == NULL) && (r->identifier == NULL))
+				all = r;
+		}
+		pthread_mutex_unlock (&flush_lock);
+
+		while (batch != NULL)
+		{
+			r = batch;
+			batch = r->next;
+
+			/* Flushing all plugins and identifiers covers the other
+			 * requests of the batch, unless they have a lower
+			 * timeout. */
+			if ((all == NULL) || (r == all) || (r->timeout < all->timeout))
+				plugin_flush (r->plugin, r->timeout, r->identifier);
+			else
+				__sync_fetch_and_add (&flush_merged, 1);
+
+			if (r != all)
+				flush_request_free (r);
+		}
+
+		flush_request_free (all);
+		pthread_mutex_lock (&flush_lock);
+	}
+	pthread_mutex_unlock (&flush_lock);
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* }}} void *plugin_flush_thread */
+
+static void start_flush_thread (void) /* {{{ */
+{
+	int status;
+
+	if (flush_loop)
+		return;
+
+	flush_index = c_avl_create ((void *) strcmp);
+	if (flush_index == NULL)
+	{
+		ERROR ("plugin: start_flush_thread: c_avl_create failed.");
+		return;
+	}
+
+	flush_loop = 1;
+	status = plugin_thread_create (&flush_thread, /* attr = */ NULL,
+			plugin_flush_thread, /* arg = */ NULL);
+	if (status != 0)
+	{
+		char errbuf[1024];
+
+		flush_loop = 0;
+		c_avl_destroy (flush_index);
+		flush_index = NULL;
+
+		ERROR ("plugin: start_flush_thread: pthread_create failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+	}
+} /* }}} void start_flush_thread */
+
+/* Stops the flush thread. Pending requests are dropped: the daemon flushes
+ * all plugins right afterwards. */
+static void stop_flush_thread (void) /* {{{ */
+{
+	flush_request_t *r;
+
+	pthread_mutex_lock (&flush_lock);
+	if (!flush_loop)
+	{
+		pthread_mutex_unlock (&flush_lock);
+		return;
+	}
+	flush_loop = 0;
+	pthread_cond_broadcast (&flush_cond);
+	pthread_mutex_unlock (&flush_lock);
+
+	if (pthread_join (flush_thread, NULL) != 0)
+		ERROR ("plugin: stop_flush_thread: pthread_join failed.");
+
+	while ((r = flush_head) != NULL)
+	{
+		flush_head = r->next;
+		flush_request_free (r);
+	}
+	flush_tail = NULL;
+	c_avl_destroy (flush_index);
+	flush_index = NULL;
+
+	if (flush_merged > 0)
+		DEBUG ("plugin: %"PRIu64" flush request%s merged with other "
+				"requests.", (uint64_t) flush_merged,
+				(flush_merged == 1) ? " was" : "s were");
+} /* }}} void stop_flush_thread */
+
+/*
+ * Public functions
+ */
+void plugin_set_dir (const char *dir)
+{
+	if (plugindir != NULL)
+		free (plugindir);
+
+	if (dir == NULL)
+		plugindir = NULL;
+	else if ((plugindir = strdup (dir)) == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("strdup failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+}
+
+#define BUFSIZE 512
+int plugin_load (const char *type, uint32_t flags)
+{
+	DIR  *dh;
+	const char *dir;
+	char  filename[BUFSIZE] = "";
+	char  typename[BUFSIZE];
+	int   typename_len;
+	int   ret;
+	struct stat    statbuf;
+	struct dirent *de;
+	int status;
+
+	dir = plugin_get_dir ();
+	ret = 1;
+
+	/* `cpu' should not match `cpufreq'. To solve this we add `.so' to the
+	 * type when matching the filename */
+	status = ssnprintf (typename, sizeof (typename), "%s.so", type);
+	if ((status < 0) || ((size_t) status >= sizeof (typename)))
+	{
+		WARNING ("plugin_load: Filename too long: \"%s.so\"", type);
+		return (-1);
+	}
+	typename_len = strlen (typename);
+
+	if ((dh = opendir (dir)) == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("plugin_load: opendir (%s) failed: %s", dir,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while ((de = readdir (dh)) != NULL)
+	{
+		if (strncasecmp (de->d_name, typename, typename_len))
+			continue;
+
+		status = ssnprintf (filename, sizeof (filename),
+				"%s/%s", dir, de->d_name);
+		if ((status < 0) || ((size_t) status >= sizeof (filename)))
+		{
+			WARNING ("plugin_load: Filename too long: \"%s/%s\"",
+					dir, de->d_name);
+			continue;
+		}
+
+		if (lstat (filename, &statbuf) == -1)
+		{
+			char errbuf[1024];
+			WARNING ("plugin_load: stat (\"%s\") failed: %s",
+					filename,
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			continue;
+		}
+		else if (!S_ISREG (statbuf.st_mode))
+		{
+			/* don't follow symlinks */
+			WARNING ("plugin_load: %s is not a regular file.",
+				       	filename);
+			continue;
+		}
+
+		status = plugin_load_file (filename, flags);
+		if (status == 0)
+		{
+			/* success */
+			ret = 0;
+			break;
+		}
+		else
+		{
+			ERROR ("plugin_load: Load plugin \"%s\" failed with "
+					"status %i.", type, status);
+		}
+	}
+
+	closedir (dh);
+
+	if (filename[0] == 0)
+		ERROR ("plugin_load: Could not find plugin \"%s\" in %s",
+				type, dir);
+
+	return (ret);
+}
+
+/*
+ * The `register_*' functions follow
+ */
+int plugin_register_config (const char *name,
+		int (*callback) (const char *key, const char *val),
+		const char **keys, int keys_num)
+{
+	cf_register (name, callback, keys, keys_num);
+	return (0);
+} /* int plugin_register_config */
+
+int plugin_register_complex_config (const char *type,
+		int (*callback) (oconfig_item_t *))
+{
+	return (cf_register_complex (type, callback));
+} /* int plugin_register_complex_config */
+
+int plugin_register_reload_config (const char *type,
+		int (*callback) (oconfig_item_t *))
+{
+	return (cf_register_reload (type, callback));
+} /* int plugin_register_reload_config */
+
+int plugin_register_init (const char *name,
+		int (*callback) (void))
+{
+	return (create_register_callback (&list_init, name, (void *) callback,
+				/* user_data = */ NULL));
+} /* plugin_register_init */
+
+static int plugin_compare_read_func (const void *arg0, const void *arg1)
+{
+	const read_func_t *rf0;
+	const read_func_t *rf1;
+
+	rf0 = arg0;
+	rf1 = arg1;
+
+	if (rf0->rf_next_read < rf1->rf_next_read)
+		return (-1);
+	else if (rf0->rf_next_read > rf1->rf_next_read)
+		return (1);
+	else
+		return (0);
+} /* int plugin_compare_read_func */
+
+/* Add a read function to both, the heap and a linked list. The linked list if
+ * used to look-up read functions, especially for the remove function. The heap
+ * is used to determine which plugin to read next. */
+static int plugin_insert_read (read_func_t *rf)
+{
+	int status;
+	llentry_t *le;
+
+	rf->rf_next_read = cdtime ();
+	rf->rf_effective_interval = rf->rf_interval;
+
+	c_mutex_lock (&read_lock);
+
+	if (read_list == NULL)
+	{
+		read_list = llist_create ();
+		if (read_list == NULL)
+		{
+			c_mutex_unlock (&read_lock);
+			ERROR ("plugin_insert_read: read_list failed.");
+			return (-1);
+		}
+	}
+
+	if (read_heap == NULL)
+	{
+		read_heap = c_heap_create (plugin_compare_read_func);
+		if (read_heap == NULL)
+		{
+			c_mutex_unlock (&read_lock);
+			ERROR ("plugin_insert_read: c_heap_create failed.");
+			return (-1);
+		}
+	}
+
+	le = llist_search (read_list, rf->rf_name);
+	if (le != NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		WARNING ("The read function \"%s\" is already registered. "
+				"Check for duplicate \"LoadPlugin\" lines "
+				"in your configuration!",
+				rf->rf_name);
+		return (EINVAL);
+	}
+
+	le = llentry_create (rf->rf_name, rf);
+	if (le == NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		ERROR ("plugin_insert_read: llentry_create failed.");
+		return (-1);
+	}
+
+	/* Once the read threads are running, the heap only holds read
+	 * functions while they are being moved around or while they wait for
+	 * the init callback of their plugin. */
+	if ((read_pools != NULL) && !init_job_holds (rf))
+		status = read_pool_insert (rf);
+	else
+		status = c_heap_insert (read_heap, rf);
+	if (status != 0)
+	{
+		c_mutex_unlock (&read_lock);
+		ERROR ("plugin_insert_read: c_heap_insert failed.");
+		llentry_destroy (le);
+		return (-1);
+	}
+
+	/* This does not fail. */
+	llist_append (read_list, le);
+
+	c_mutex_unlock (&read_lock);
+	return (0);
+} /* int plugin_insert_read */
+
+int plugin_register_read (const char *name,
+		int (*callback) (void))
+{
+	read_func_t *rf;
+	int status;
+
+	rf = malloc (sizeof (*rf));
+	if (rf == NULL)
+	{
+		ERROR ("plugin_register_read: malloc failed.");
+		return (ENOMEM);
+	}
+
+	memset (rf, 0, sizeof (read_func_t));
+	rf->rf_callback = (void *) callback;
+	rf->rf_udata.data = NULL;
+	rf->rf_udata.free_func = NULL;
+	rf->rf_ctx = plugin_get_ctx ();
+	rf->rf_group[0] = '\0';
+	sstrncpy (rf->rf_name, name, sizeof (rf->rf_name));
+	rf->rf_type = RF_SIMPLE;
+	rf->rf_interval = plugin_get_interval ();
+
+	status = plugin_insert_read (rf);
+	if (status != 0)
+		sfree (rf);
+
+	return (status);
+} /* int plugin_register_read */
+
+int plugin_register_complex_read (const char *group, const char *name,
+		plugin_read_cb callback,
+		const struct timespec *interval,
+		user_data_t *user_data)
+{
+	read_func_t *rf;
+	int status;
+
+	rf = malloc (sizeof (*rf));
+	if (rf == NULL)
+	{
+		ERROR ("plugin_register_complex_read: malloc failed.");
+		return (ENOMEM);
+	}
+
+	memset (rf, 0, sizeof (read_func_t));
+	rf->rf_callback = (void *) callback;
+	if (group != NULL)
+		sstrncpy (rf->rf_group, group, sizeof (rf->rf_group));
+	else
+		rf->rf_group[0] = '\0';
+	sstrncpy (rf->rf_name, name, sizeof (rf->rf_name));
+	rf->rf_type = RF_COMPLEX;
+	if (interval != NULL)
+		rf->rf_interval = TIMESPEC_TO_CDTIME_T (interval);
+	else
+		rf->rf_interval = plugin_get_interval ();
+
+	/* Set user data */
+	if (user_data == NULL)
+	{
+		rf->rf_udata.data = NULL;
+		rf->rf_udata.free_func = NULL;
+	}
+	else
+	{
+		rf->rf_udata = *user_data;
+	}
+
+	rf->rf_ctx = plugin_get_ctx ();
+
+	status = plugin_insert_read (rf);
+	if (status != 0)
+		sfree (rf);
+
+	return (status);
+} /* int plugin_register_complex_read */
+
+static int plugin_async_read_cb (user_data_t *ud) /* {{{ */
+{
+	return (uas_request_start (ud->data));
+} /* }}} int plugin_async_read_cb */
+
+static void plugin_async_read_free (void *r) /* {{{ */
+{
+	uas_request_destroy (r, /* free_user_data = */ 1);
+} /* }}} void plugin_async_read_free */
+
+int plugin_register_async_read (const char *group, const char *name, /* {{{ */
+		const plugin_async_read_t *callbacks,
+		const struct timespec *interval,
+		user_data_t *user_data)
+{
+	uas_request_t *r;
+	user_data_t ud;
+	int status;
+
+	r = uas_request_create (name, callbacks, user_data);
+	if (r == NULL)
+	{
+		ERROR ("plugin_register_async_read: uas_request_create failed.");
+		return (EINVAL);
+	}
+
+	ud.data = r;
+	ud.free_func = plugin_async_read_free;
+
+	status = plugin_register_complex_read (group, name,
+			plugin_async_read_cb, interval, &ud);
+	/* The caller keeps "user_data" on failure. */
+	if (status != 0)
+		uas_request_destroy (r, /* free_user_data = */ 0);
+
+	return (status);
+} /* }}} int plugin_register_async_read */
+
+static int register_write_func (const char *name, /* {{{ */
+		void *callback, _Bool batch, user_data_t *ud)
+{
+	write_func_t *wf;
+	int status;
+
+	wf = malloc (sizeof (*wf));
+	if (wf == NULL)
+	{
+		ERROR ("plugin_register_write: malloc failed.");
+		return (ENOMEM);
+	}
+	memset (wf, 0, sizeof (*wf));
+
+	wf->wf_callback = callback;
+	wf->wf_batch = batch;
+	C_COMPLAIN_INIT (&wf->wf_complaint);
+	if (ud == NULL)
+	{
+		wf->wf_udata.data = NULL;
+		wf->wf_udata.free_func = NULL;
+	}
+	else
+	{
+		wf->wf_udata = *ud;
+	}
+	wf->wf_ctx = plugin_get_ctx ();
+	sstrncpy (wf->wf_name, name, sizeof (wf->wf_name));
+	wf->wf_queue = NULL;
+
+	if (wf->wf_ctx.write_async)
+	{
+		status = write_func_start_async (wf);
+		if (status != 0)
+		{
+			sfree (wf);
+			return (status);
+		}
+	}
+
+	/* The old callback is destroyed by register_callback(). Make sure
+	 * its thread is gone by then. */
+	if (list_write != NULL)
+	{
+		llentry_t *le = llist_search (list_write, name);
+		if (le != NULL)
+			write_func_stop_async (le->value);
+	}
+
+	status = register_callback (&list_write, name, (callback_func_t *) wf);
+	__sync_add_and_fetch (&list_write_generation, 1);
+	return (status);
+} /* }}} int register_write_func */
+
+int plugin_register_write (const char *name,
+		plugin_write_cb callback, user_data_t *ud)
+{
+	return (register_write_func (name, (void *) callback,
+				/* batch = */ 0, ud));
+} /* int plugin_register_write */
+
+int plugin_register_write_batch (const char *name,
+		plugin_write_batch_cb callback, user_data_t *ud)
+{
+	return (register_write_func (name, (void *) callback,
+				/* batch = */ 1, ud));
+} /* int plugin_register_write_batch */
+
+int plugin_register_flush (const char *name,
+		plugin_flush_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_flush, name,
+				(void *) callback, ud));
+} /* int plugin_register_flush */
+
+int plugin_register_missing (const char *name,
+		plugin_missing_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_missing, name,
+				(void *) callback, ud));
+} /* int plugin_register_missing */
+
+int plugin_register_command (const char *name,
+		plugin_command_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_command, name,
+				(void *) callback, ud));
+} /* int plugin_register_command */
+
+int plugin_register_shutdown (const char *name,
+		int (*callback) (void))
+{
+	return (create_register_callback (&list_shutdown, name,
+				(void *) callback, /* user_data = */ NULL));
+} /* int plugin_register_shutdown */
+
+static int plugin_register_data_set_locked (const data_set_t *ds)
+{
+	data_set_t *ds_copy;
+	int i;
+
+	if (data_sets_get (ds->type) != NULL)
+	{
+		NOTICE ("Replacing DS `%s' with another version.", ds->type);
+		plugin_unregister_data_set (ds->type);
+	}
+	else if (data_sets == NULL)
+	{
+		data_sets = c_htable_create ();
+		if (data_sets == NULL)
+			return (-1);
+	}
+
+	ds_copy = (data_set_t *) malloc (sizeof (data_set_t));
+	if (ds_copy == NULL)
+		return (-1);
+	memcpy(ds_copy, ds, sizeof (data_set_t));
+
+	ds_copy->ds = (data_source_t *) malloc (sizeof (data_source_t)
+			* ds->ds_num);
+	if (ds_copy->ds == NULL)
+	{
+		free (ds_copy);
+		return (-1);
+	}
+
+	for (i = 0; i < ds->ds_num; i++)
+		memcpy (ds_copy->ds + i, ds->ds + i, sizeof (data_source_t));
+
+	if (c_htable_insert (data_sets, (void *) ds_copy->type,
+				(void *) ds_copy) != 0)
+	{
+		sfree (ds_copy->ds);
+		sfree (ds_copy);
+		return (-1);
+	}
+
+	return (0);
+} /* int plugin_register_data_set_locked */
+
+int plugin_register_data_set (const data_set_t *ds)
+{
+	int status;
+
+	pthread_mutex_lock (&callback_lock);
+	status = plugin_register_data_set_locked (ds);
+	pthread_mutex_unlock (&callback_lock);
+
+	return (status);
+} /* int plugin_register_data_set */
+
+int plugin_register_data_sets (const data_set_t *ds, size_t ds_num)
+{
+	size_t i;
+	int status = 0;
+
+	pthread_mutex_lock (&callback_lock);
+
+	for (i = 0; i < ds_num; i++)
+		if (plugin_register_data_set_locked (ds + i) != 0)
+			status = -1;
+
+	pthread_mutex_unlock (&callback_lock);
+
+	return (status);
+} /* int plugin_register_data_sets */
+
+int plugin_register_log (const char *name,
+		plugin_log_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_log, name,
+				(void *) callback, ud));
+} /* int plugin_register_log */
+
+int plugin_register_notification (const char *name,
+		plugin_notification_cb callback, user_data_t *ud)
+{
+	return (create_register_callback (&list_notification, name,
+				(void *) callback, ud));
+} /* int plugin_register_log */
+
+int plugin_unregister_config (const char *name)
+{
+	cf_unregister (name);
+	return (0);
+} /* int plugin_unregister_config */
+
+int plugin_unregister_complex_config (const char *name)
+{
+	cf_unregister_complex (name);
+	return (0);
+} /* int plugin_unregister_complex_config */
+
+int plugin_unregister_init (const char *name)
+{
+	return (plugin_unregister (list_init, name));
+}
+
+int plugin_unregister_read (const char *name) /* {{{ */
+{
+	llentry_t *le;
+	read_func_t *rf;
+
+	if (name == NULL)
+		return (-ENOENT);
+
+	c_mutex_lock (&read_lock);
+
+	if (read_list == NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		return (-ENOENT);
+	}
+
+	le = llist_search (read_list, name);
+	if (le == NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		WARNING ("plugin_unregister_read: No such read function: %s",
+				name);
+		return (-ENOENT);
+	}
+
+	llist_remove (read_list, le);
+
+	rf = le->value;
+	assert (rf != NULL);
+	rf->rf_type = RF_REMOVE;
+
+	c_mutex_unlock (&read_lock);
+
+	llentry_destroy (le);
+
+	DEBUG ("plugin_unregister_read: Marked `%s' for removal.", name);
+
+	return (0);
+} /* }}} int plugin_unregister_read */
+
+static int compare_read_func_group (llentry_t *e, void *ud) /* {{{ */
+{
+	read_func_t *rf    = e->value;
+	char        *group = ud;
+
+	return strcmp (rf->rf_group, (const char *)group);
+} /* }}} int compare_read_func_group */
+
+int plugin_unregister_read_group (const char *group) /* {{{ */
+{
+	llentry_t *le;
+	read_func_t *rf;
+
+	int found = 0;
+
+	if (group == NULL)
+		return (-ENOENT);
+
+	c_mutex_lock (&read_lock);
+
+	if (read_list == NULL)
+	{
+		c_mutex_unlock (&read_lock);
+		return (-ENOENT);
+	}
+
+	while (42)
+	{
+		le = llist_search_custom (read_list,
+				compare_read_func_group, (void *)group);
+
+		if (le == NULL)
+			break;
+
+		++found;
+
+		llist_remove (read_list, le);
+
+		rf = le->value;
+		assert (rf != NULL);
+		rf->rf_type = RF_REMOVE;
+
+		llentry_destroy (le);
+
+		DEBUG ("plugin_unregister_read_group: "
+				"Marked `%s' (group `%s') for removal.",
+				rf->rf_name, group);
+	}
+
+	c_mutex_unlock (&read_lock);
+
+	if (found == 0)
+	{
+		WARNING ("plugin_unregister_read_group: No such "
+				"group of read function: %s", group);
+		return (-ENOENT);
+	}
+
+	return (0);
+} /* }}} int plugin_unregister_read_group */
+
+int plugin_unregister_write (const char *name)
+{
+	llentry_t *le;
+	int status;
+
+	if (list_write == NULL)
+		return (-1);
+
+	le = llist_search (list_write, name);
+	if (le == NULL)
+		return (-1);
+
+	write_func_stop_async (le->value);
+
+	status = plugin_unregister (list_write, name);
+	__sync_add_and_fetch (&list_write_generation, 1);
+	return (status);
+}
+
+int plugin_unregister_flush (const char *name)
+{
+	return (plugin_unregister (list_flush, name));
+}
+
+int plugin_unregister_missing (const char *name)
+{
+	return (plugin_unregister (list_missing, name));
+}
+
+int plugin_unregister_command (const char *name)
+{
+	return (plugin_unregister (list_command, name));
+}
+
+int plugin_unregister_shutdown (const char *name)
+{
+	return (plugin_unregister (list_shutdown, name));
+}
+
+int plugin_unregister_data_set (const char *name)
+{
+	data_set_t *ds;
+
+	if (data_sets == NULL)
+		return (-1);
+
+	if (c_htable_remove (data_sets, name, NULL, (void *) &ds) != 0)
+		return (-1);
+
+	sfree (ds->ds);
+	sfree (ds);
+
+	return (0);
+} /* int plugin_unregister_data_set */
+
+int plugin_unregister_log (const char *name)
+{
+	return (plugin_unregister (list_log, name));
+}
+
+int plugin_unregister_notification (const char *name)
+{
+	return (plugin_unregister (list_notification, name));
+}
+
+/* Calls the init callback in "le". If it fails, the plugin's read function
+ * is unregistered. */
+static void init_job_run (llentry_t *le) /* {{{ */
+{
+	callback_func_t *cf;
+	plugin_init_cb callback;
+	plugin_ctx_t old_ctx;
+	int status;
+
+	cf = le->value;
+	old_ctx = plugin_set_ctx (cf->cf_ctx);
+	callback = cf->cf_callback;
+	status = (*callback) ();
+	plugin_set_ctx (old_ctx);
+
+	if (status != 0)
+	{
+		ERROR ("Initialization of plugin `%s' "
+				"failed with status %i. "
+				"Plugin will be unloaded.",
+				le->key, status);
+		/* Plugins that register read callbacks from the init
+		 * callback should take care of appropriate error
+		 * handling themselves. */
+		/* FIXME: Unload _all_ functions */
+		plugin_unregister_read (le->key);
+	}
+} /* }}} void init_job_run */
+
+int plugin_init_after (const char *plugin, const char *after) /* {{{ */
+{
+	init_dependency_t *tmp;
+	init_dependency_t *dep;
+
+	if ((plugin == NULL) || (after == NULL))
+		return (EINVAL);
+
+	tmp = realloc (init_deps, (init_deps_num + 1) * sizeof (*init_deps));
+	if (tmp == NULL)
+		return (ENOMEM);
+	init_deps = tmp;
+
+	dep = init_deps + init_deps_num;
+	dep->plugin = strdup (plugin);
+	dep->after = strdup (after);
+	if ((dep->plugin == NULL) || (dep->after == NULL))
+	{
+		sfree (dep->plugin);
+		sfree (dep->after);
+		return (ENOMEM);
 	}
+	init_deps_num++;
 
-	/* This does not fail. */
-	llist_append (read_list, le);
-
-	/* Wake up all the read threads. */
-	pthread_cond_broadcast (&read_cond);
-	pthread_mutex_unlock (&read_lock);
 	return (0);
-} /* int plugin_insert_read */
+} /* }}} int plugin_init_after */
 
-int plugin_register_read (const char *name,
-		int (*callback) (void))
+static void init_jobs_destroy (void) /* {{{ */
 {
-	read_func_t *rf;
-	int status;
+	size_t i;
 
-	rf = malloc (sizeof (*rf));
-	if (rf == NULL)
+	pthread_mutex_lock (&init_lock);
+	for (i = 0; i < init_jobs_num; i++)
+		sfree (init_jobs[i].deps);
+	sfree (init_jobs);
+	init_jobs_num = 0;
+	pthread_mutex_unlock (&init_lock);
+
+	for (i = 0; i < init_deps_num; i++)
 	{
-		ERROR ("plugin_register_read: malloc failed.");
-		return (ENOMEM);
+		sfree (init_deps[i].plugin);
+		sfree (init_deps[i].after);
 	}
+	sfree (init_deps);
+	init_deps_num = 0;
+} /* }}} void init_jobs_destroy */
 
-	memset (rf, 0, sizeof (read_func_t));
-	rf->rf_callback = (void *) callback;
-	rf->rf_udata.data = NULL;
-	rf->rf_udata.free_func = NULL;
-	rf->rf_ctx = plugin_get_ctx ();
-	rf->rf_group[0] = '\0';
-	sstrncpy (rf->rf_name, name, sizeof (rf->rf_name));
-	rf->rf_type = RF_SIMPLE;
-	rf->rf_interval = plugin_get_interval ();
+/* Creates one job for each init callback, in the order of "list_init". */
+static int init_jobs_create (void) /* {{{ */
+{
+	init_job_t *jobs;
+	size_t jobs_num;
+	llentry_t *le;
+	size_t i;
+	size_t j;
 
-	status = plugin_insert_read (rf);
-	if (status != 0)
-		sfree (rf);
+	jobs_num = (size_t) llist_size (list_init);
+	if (jobs_num == 0)
+		return (0);
 
-	return (status);
-} /* int plugin_register_read */
+	jobs = calloc (jobs_num, sizeof (*jobs));
+	if (jobs == NULL)
+		return (ENOMEM);
 
-int plugin_register_complex_read (const char *group, const char *name,
-		plugin_read_cb callback,
-		const struct timespec *interval,
-		user_data_t *user_data)
-{
-	read_func_t *rf;
-	int status;
+	for (le = llist_head (list_init), i = 0;
+			(le != NULL) && (i < jobs_num);
+			le = le->next, i++)
+		jobs[i].le = le;
 
-	rf = malloc (sizeof (*rf));
-	if (rf == NULL)
+	for (i = 0; i < init_deps_num; i++)
 	{
-		ERROR ("plugin_register_complex_read: malloc failed.");
-		return (ENOMEM);
+		init_job_t *job = NULL;
+		size_t *tmp;
+
+		for (j = 0; (job == NULL) && (j < jobs_num); j++)
+			if (strcasecmp (jobs[j].le->key, init_deps[i].plugin) == 0)
+				job = jobs + j;
+
+		for (j = 0; j < jobs_num; j++)
+			if (strcasecmp (jobs[j].le->key, init_deps[i].after) == 0)
+				break;
+
+		/* Plugins without an init callback are ready right away. */
+		if ((job == NULL) || (j >= jobs_num) || (job == jobs + j))
+			continue;
+
+		tmp = realloc (job->deps, (job->deps_num + 1) * sizeof (*tmp));
+		if (tmp == NULL)
+		{
+			for (j = 0; j < jobs_num; j++)
+				sfree (jobs[j].deps);
+			sfree (jobs);
+			return (ENOMEM);
+		}
+		job->deps = tmp;
+		job->deps[job->deps_num++] = j;
 	}
 
-	memset (rf, 0, sizeof (read_func_t));
-	rf->rf_callback = (void *) callback;
-	if (group != NULL)
-		sstrncpy (rf->rf_group, group, sizeof (rf->rf_group));
-	else
-		rf->rf_group[0] = '\0';
-	sstrncpy (rf->rf_name, name, sizeof (rf->rf_name));
-	rf->rf_type = RF_COMPLEX;
-	if (interval != NULL)
-		rf->rf_interval = TIMESPEC_TO_CDTIME_T (interval);
-	else
-		rf->rf_interval = plugin_get_interval ();
+	pthread_mutex_lock (&init_lock);
+	init_jobs = jobs;
+	init_jobs_num = jobs_num;
+	pthread_mutex_unlock (&init_lock);
 
-	/* Set user data */
-	if (user_data == NULL)
+	return (0);
+} /* }}} int init_jobs_create */
+
+/* Returns the first pending job whose dependencies are done. If no such job
+ * exists although jobs are pending and none is running, the dependencies
+ * form a loop which is broken up by returning the first pending job. The
+ * caller must hold "init_lock". */
+static init_job_t *init_job_next (_Bool *pending) /* {{{ */
+{
+	init_job_t *first_pending = NULL;
+	_Bool running = 0;
+	size_t i;
+
+	for (i = 0; i < init_jobs_num; i++)
 	{
-		rf->rf_udata.data = NULL;
-		rf->rf_udata.free_func = NULL;
+		init_job_t *job = init_jobs + i;
+		size_t j;
+
+		if (job->state == INIT_RUNNING)
+			running = 1;
+		if (job->state != INIT_PENDING)
+			continue;
+
+		if (first_pending == NULL)
+			first_pending = job;
+
+		for (j = 0; j < job->deps_num; j++)
+			if (init_jobs[job->deps[j]].state != INIT_DONE)
+				break;
+		if (j >= job->deps_num)
+			return (job);
 	}
-	else
+
+	*pending = (first_pending != NULL);
+	if ((first_pending != NULL) && !running)
 	{
-		rf->rf_udata = *user_data;
+		WARNING ("plugin: The InitAfter settings of plugin `%s' form a "
+				"loop. Initializing it anyway.",
+				first_pending->le->key);
+		return (first_pending);
 	}
 
-	rf->rf_ctx = plugin_get_ctx ();
+	return (NULL);
+} /* }}} init_job_t *init_job_next */
 
-	status = plugin_insert_read (rf);
-	if (status != 0)
-		sfree (rf);
+/* Runs jobs until none are left. Used by the init threads and, if the
+ * callbacks are run serially, by the main thread. */
+static void *plugin_init_thread (void __attribute__((unused)) *arg) /* {{{ */
+{
+	pthread_mutex_lock (&init_lock);
+	while (42)
+	{
+		_Bool pending = 1;
+		init_job_t *job;
 
-	return (status);
-} /* int plugin_register_complex_read */
+		job = init_job_next (&pending);
+		if (job == NULL)
+		{
+			if (!pending)
+				break;
+			pthread_cond_wait (&init_cond, &init_lock);
+			continue;
+		}
 
-int plugin_register_write (const char *name,
-		plugin_write_cb callback, user_data_t *ud)
-{
-	return (create_register_callback (&list_write, name,
-				(void *) callback, ud));
-} /* int plugin_register_write */
+		job->state = INIT_RUNNING;
+		pthread_mutex_unlock (&init_lock);
 
-int plugin_register_flush (const char *name,
-		plugin_flush_cb callback, user_data_t *ud)
-{
-	return (create_register_callback (&list_flush, name,
-				(void *) callback, ud));
-} /* int plugin_register_flush */
+		pthread_setspecific (init_job_key, job);
+		init_job_run (job->le);
+		pthread_setspecific (init_job_key, NULL);
 
-int plugin_register_missing (const char *name,
-		plugin_missing_cb callback, user_data_t *ud)
-{
-	return (create_register_callback (&list_missing, name,
-				(void *) callback, ud));
-} /* int plugin_register_missing */
+		pthread_mutex_lock (&init_lock);
+		job->state = INIT_DONE;
+		pthread_cond_broadcast (&init_cond);
 
-int plugin_register_shutdown (const char *name,
-		int (*callback) (void))
-{
-	return (create_register_callback (&list_shutdown, name,
-				(void *) callback, /* user_data = */ NULL));
-} /* int plugin_register_shutdown */
+		/* Start the read functions of this plugin. "read_pools" is
+		 * only set by the main thread, before the init threads are
+		 * started. */
+		if (read_pools != NULL)
+		{
+			pthread_mutex_unlock (&init_lock);
+			c_mutex_lock (&read_lock);
+			read_heap_distribute ();
+			c_mutex_unlock (&read_lock);
+			pthread_mutex_lock (&init_lock);
+		}
+	}
+	pthread_mutex_unlock (&init_lock);
 
-int plugin_register_data_set (const data_set_t *ds)
+	return (NULL);
+} /* }}} void *plugin_init_thread */
+
+/* Runs the init callbacks on up to "num" threads, including the calling
+ * one, and returns once all of them are done. */
+static void init_jobs_run_parallel (size_t num) /* {{{ */
 {
-	data_set_t *ds_copy;
-	int i;
+	pthread_t *threads;
+	size_t threads_num = 0;
+	size_t i;
 
-	if ((data_sets != NULL)
-			&& (c_avl_get (data_sets, ds->type, NULL) == 0))
-	{
-		NOTICE ("Replacing DS `%s' with another version.", ds->type);
-		plugin_unregister_data_set (ds->type);
-	}
-	else if (data_sets == NULL)
+	if (num > init_jobs_num)
+		num = init_jobs_num;
+
+	threads = calloc (num - 1, sizeof (*threads));
+	for (i = 0; (threads != NULL) && (i < (num - 1)); i++)
 	{
-		data_sets = c_avl_create ((int (*) (const void *, const void *)) strcmp);
-		if (data_sets == NULL)
-			return (-1);
+		int status;
+
+		status = pthread_create (threads + i, NULL,
+				plugin_init_thread, NULL);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("plugin: init_jobs_run_parallel: pthread_create "
+					"failed with status %i (%s).", status,
+					sstrerror (status, errbuf, sizeof (errbuf)));
+			break;
+		}
+		threads_num++;
 	}
 
-	ds_copy = (data_set_t *) malloc (sizeof (data_set_t));
-	if (ds_copy == NULL)
-		return (-1);
-	memcpy(ds_copy, ds, sizeof (data_set_t));
+	INFO ("plugin: Running %zu init callbacks on %zu threads.",
+			init_jobs_num, threads_num + 1);
+	plugin_init_thread (NULL);
 
-	ds_copy->ds = (data_source_t *) malloc (sizeof (data_source_t)
-			* ds->ds_num);
-	if (ds_copy->ds == NULL)
+	for (i = 0; i < threads_num; i++)
+		pthread_join (threads[i], NULL);
+	sfree (threads);
+} /* }}} void init_jobs_run_parallel */
+
+/* Returns the average time by which read callbacks were called later than
+ * scheduled since the last call. */
+static cdtime_t overload_read_lag_get (void) /* {{{ */
+{
+	read_pool_t *pool;
+	uint64_t reads = 0;
+	cdtime_t lag = 0;
+	uint64_t reads_delta;
+	cdtime_t lag_delta;
+	size_t i;
+
+	c_mutex_lock (&read_lock);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
 	{
-		free (ds_copy);
-		return (-1);
+		for (i = 0; i < pool->queues_num; i++)
+		{
+			read_queue_t *q = pool->queues + i;
+
+			c_mutex_lock (&q->lock);
+			reads += q->reads;
+			lag += q->lag;
+			c_mutex_unlock (&q->lock);
+		}
 	}
+	c_mutex_unlock (&read_lock);
 
-	for (i = 0; i < ds->ds_num; i++)
-		memcpy (ds_copy->ds + i, ds->ds + i, sizeof (data_source_t));
+	reads_delta = reads - overload_last_reads;
+	lag_delta = lag - overload_last_lag;
+	overload_last_reads = reads;
+	overload_last_lag = lag;
 
-	return (c_avl_insert (data_sets, (void *) ds_copy->type, (void *) ds_copy));
-} /* int plugin_register_data_set */
+	if (reads_delta == 0)
+		return (0);
+	return (lag_delta / (cdtime_t) reads_delta);
+} /* }}} cdtime_t overload_read_lag_get */
 
-int plugin_register_log (const char *name,
-		plugin_log_cb callback, user_data_t *ud)
+static void overload_notify (size_t queue_length, /* {{{ */
+		cdtime_t read_lag)
 {
-	return (create_register_callback (&list_log, name,
-				(void *) callback, ud));
-} /* int plugin_register_log */
-
-int plugin_register_notification (const char *name,
-		plugin_notification_cb callback, user_data_t *ud)
+	notification_t n;
+
+	memset (&n, 0, sizeof (n));
+	n.severity = (overload_stretch > 1) ? NOTIF_WARNING : NOTIF_OKAY;
+	n.time = cdtime ();
+	sstrncpy (n.host, hostname_g, sizeof (n.host));
+	sstrncpy (n.plugin, "collectd", sizeof (n.plugin));
+	sstrncpy (n.type_instance, "overload", sizeof (n.type_instance));
+
+	if (overload_stretch > 1)
+		ssnprintf (n.message, sizeof (n.message),
+				"The write queue holds %zu value lists and read "
+				"callbacks lag %.3f seconds behind. Calling "
+				"low-priority read callbacks %u times less "
+				"often.", queue_length,
+				CDTIME_T_TO_DOUBLE (read_lag), overload_stretch);
+	else
+		ssnprintf (n.message, sizeof (n.message),
+				"The write queue holds %zu value lists and read "
+				"callbacks lag %.3f seconds behind. Restored the "
+				"intervals of low-priority read callbacks.",
+				queue_length, CDTIME_T_TO_DOUBLE (read_lag));
+
+	plugin_notification_meta_add_unsigned_int (&n, "stretch",
+			(uint64_t) overload_stretch);
+	plugin_notification_meta_add_unsigned_int (&n, "queue_length",
+			(uint64_t) queue_length);
+	plugin_notification_meta_add_double (&n, "read_lag",
+			CDTIME_T_TO_DOUBLE (read_lag));
+
+	if (overload_stretch > 1)
+		WARNING ("plugin: %s", n.message);
+	else
+		INFO ("plugin: %s", n.message);
+
+	plugin_dispatch_notification (&n);
+	plugin_notification_meta_free (n.meta);
+} /* }}} void overload_notify */
+
+/* Called once per interval by the main thread. Doubles the stretch of
+ * low-priority read callbacks while the write queue is longer than
+ * "OverloadQueueLength" or reads lag more than "OverloadReadLag" behind, up
+ * to "OverloadMaxStretch", and halves it again once both have fallen below
+ * half of their limit. */
+static void overload_check (void) /* {{{ */
 {
-	return (create_register_callback (&list_notification, name,
-				(void *) callback, ud));
-} /* int plugin_register_log */
+	size_t queue_length;
+	cdtime_t read_lag;
+	_Bool overloaded;
+	_Bool relaxed;
 
-int plugin_unregister_config (const char *name)
-{
-	cf_unregister (name);
-	return (0);
-} /* int plugin_unregister_config */
+	if ((overload_queue_length == 0) && (overload_read_lag == 0))
+		return;
 
-int plugin_unregister_complex_config (const char *name)
-{
-	cf_unregister_complex (name);
-	return (0);
-} /* int plugin_unregister_complex_config */
+	queue_length = write_queue_length ();
+	read_lag = overload_read_lag_get ();
 
-int plugin_unregister_init (const char *name)
-{
-	return (plugin_unregister (list_init, name));
-}
+	overloaded = ((overload_queue_length != 0)
+			&& (queue_length >= overload_queue_length))
+		|| ((overload_read_lag != 0) && (read_lag >= overload_read_lag));
+	relaxed = ((overload_queue_length == 0)
+			|| (queue_length < overload_queue_length / 2))
+		&& ((overload_read_lag == 0) || (read_lag < overload_read_lag / 2));
 
-int plugin_unregister_read (const char *name) /* {{{ */
+	if (overloaded && (overload_stretch < overload_max_stretch))
+	{
+		overload_stretch *= 2;
+		if (overload_stretch > overload_max_stretch)
+			overload_stretch = overload_max_stretch;
+	}
+	else if (relaxed && (overload_stretch > 1))
+		overload_stretch /= 2;
+	else
+		return;
+
+	overload_adjustments++;
+	overload_notify (queue_length, read_lag);
+} /* }}} void overload_check */
+
+/* Parses the "Overload*" global options. */
+static void overload_configure (void) /* {{{ */
 {
-	llentry_t *le;
-	read_func_t *rf;
+	long queue_length;
+	double read_lag;
+	int max_stretch;
 
-	if (name == NULL)
-		return (-ENOENT);
+	queue_length = atol (global_option_get ("OverloadQueueLength"));
+	read_lag = atof (global_option_get ("OverloadReadLag"));
+	max_stretch = atoi (global_option_get ("OverloadMaxStretch"));
 
-	pthread_mutex_lock (&read_lock);
+	overload_queue_length = (queue_length > 0) ? (size_t) queue_length : 0;
+	overload_read_lag = (read_lag > 0.0) ? DOUBLE_TO_CDTIME_T (read_lag) : 0;
 
-	if (read_list == NULL)
+	if (max_stretch < 2)
 	{
-		pthread_mutex_unlock (&read_lock);
-		return (-ENOENT);
+		WARNING ("plugin: OverloadMaxStretch must be at least 2. "
+				"Using 8.");
+		max_stretch = 8;
 	}
+	overload_max_stretch = (unsigned int) max_stretch;
+} /* }}} void overload_configure */
 
-	le = llist_search (read_list, name);
-	if (le == NULL)
-	{
-		pthread_mutex_unlock (&read_lock);
-		WARNING ("plugin_unregister_read: No such read function: %s",
-				name);
-		return (-ENOENT);
-	}
+static int fd_set_cloexec (int fd) /* {{{ */
+{
+	int flags = fcntl (fd, F_GETFD);
 
-	llist_remove (read_list, le);
+	if (flags < 0)
+		return (errno);
+	if (fcntl (fd, F_SETFD, flags | FD_CLOEXEC) != 0)
+		return (errno);
+	return (0);
+} /* }}} int fd_set_cloexec */
 
-	rf = le->value;
-	assert (rf != NULL);
-	rf->rf_type = RF_REMOVE;
+/* Parses the environment set by collectdmon. The variables are removed so
+ * that processes started by plugins, e.g. the exec plugin, don't see them. */
+static void handoff_init (void) /* {{{ */
+{
+	char *env;
 
-	pthread_mutex_unlock (&read_lock);
+	if (handoff_initialized)
+		return;
+	handoff_initialized = 1;
 
-	llentry_destroy (le);
+	env = getenv ("COLLECTD_HANDOFF_FD");
+	if (env != NULL)
+	{
+		handoff_fd = atoi (env);
+		if ((handoff_fd < 3) || (fd_set_cloexec (handoff_fd) != 0))
+			handoff_fd = -1;
+		unsetenv ("COLLECTD_HANDOFF_FD");
+	}
 
-	DEBUG ("plugin_unregister_read: Marked `%s' for removal.", name);
+	env = getenv ("COLLECTD_LISTEN_FDS");
+	if (env != NULL)
+	{
+		char *copy = strdup (env);
+		char *fields[1024];
+		int fields_num = 0;
+		int i;
+
+		if (copy != NULL)
+			fields_num = strsplit (copy, fields,
+					STATIC_ARRAY_SIZE (fields));
+		if (fields_num > 0)
+			handoff_inherited = calloc ((size_t) fields_num,
+					sizeof (*handoff_inherited));
+
+		for (i = 0; (handoff_inherited != NULL) && (i < fields_num); i++)
+		{
+			int fd = atoi (fields[i]);
 
-	return (0);
-} /* }}} int plugin_unregister_read */
+			if ((fd < 3) || (fd_set_cloexec (fd) != 0))
+				continue;
+			handoff_inherited[handoff_inherited_num++] = fd;
+		}
 
-static int compare_read_func_group (llentry_t *e, void *ud) /* {{{ */
-{
-	read_func_t *rf    = e->value;
-	char        *group = ud;
+		sfree (copy);
+		unsetenv ("COLLECTD_LISTEN_FDS");
 
-	return strcmp (rf->rf_group, (const char *)group);
-} /* }}} int compare_read_func_group */
+		if (handoff_inherited_num > 0)
+			INFO ("plugin: Inherited %zu listening sockets from the "
+					"previous process.", handoff_inherited_num);
+	}
+} /* }}} void handoff_init */
 
-int plugin_unregister_read_group (const char *group) /* {{{ */
+/* Closes the inherited sockets no plugin has taken, e.g. because the
+ * configuration has changed. */
+static void handoff_close_unclaimed (void) /* {{{ */
 {
-	llentry_t *le;
-	read_func_t *rf;
+	size_t i;
 
-	int found = 0;
+	for (i = 0; i < handoff_inherited_num; i++)
+		close (handoff_inherited[i]);
 
-	if (group == NULL)
-		return (-ENOENT);
+	if (handoff_inherited_num > 0)
+		NOTICE ("plugin: Closed %zu inherited sockets no plugin used.",
+				handoff_inherited_num);
 
-	pthread_mutex_lock (&read_lock);
+	sfree (handoff_inherited);
+	handoff_inherited_num = 0;
+} /* }}} void handoff_close_unclaimed */
 
-	if (read_list == NULL)
+static _Bool sockaddr_equal (struct sockaddr const *a, /* {{{ */
+		struct sockaddr const *b)
+{
+	if (a->sa_family != b->sa_family)
+		return (0);
+
+	if (a->sa_family == AF_INET)
 	{
-		pthread_mutex_unlock (&read_lock);
-		return (-ENOENT);
+		struct sockaddr_in const *a4 = (void *) a;
+		struct sockaddr_in const *b4 = (void *) b;
+
+		return ((a4->sin_port == b4->sin_port)
+				&& (a4->sin_addr.s_addr == b4->sin_addr.s_addr));
+	}
+	else if (a->sa_family == AF_INET6)
+	{
+		struct sockaddr_in6 const *a6 = (void *) a;
+		struct sockaddr_in6 const *b6 = (void *) b;
+
+		return ((a6->sin6_port == b6->sin6_port)
+				&& (memcmp (&a6->sin6_addr, &b6->sin6_addr,
+						sizeof (a6->sin6_addr)) == 0));
 	}
 
-	while (42)
+	return (0);
+} /* }}} _Bool sockaddr_equal */
+
+/* Sends the sockets registered with plugin_handoff_add() to collectdmon. It
+ * holds on to them until the next process has started, so packets arriving
+ * in between queue up in the sockets. */
+static void handoff_send_fds (void) /* {{{ */
+{
+	size_t offset;
+
+	for (offset = 0; offset < handoff_fds_num;
+			offset += HANDOFF_FDS_PER_MESSAGE)
 	{
-		le = llist_search_custom (read_list,
-				compare_read_func_group, (void *)group);
+		size_t num = handoff_fds_num - offset;
+		char control[CMSG_SPACE (HANDOFF_FDS_PER_MESSAGE * sizeof (int))];
+		char payload[] = "FDS";
+		struct iovec iov = { payload, sizeof (payload) };
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+
+		if (num > HANDOFF_FDS_PER_MESSAGE)
+			num = HANDOFF_FDS_PER_MESSAGE;
+
+		memset (control, 0, sizeof (control));
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE (num * sizeof (int));
+
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (num * sizeof (int));
+		memcpy (CMSG_DATA (cmsg), handoff_fds + offset,
+				num * sizeof (int));
+
+		/* Never block the shutdown on collectdmon. */
+		if (sendmsg (handoff_fd, &msg, MSG_DONTWAIT) < 0)
+		{
+			char errbuf[1024];
+			ERROR ("plugin: Handing the listening sockets over "
+					"failed: %s", sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return;
+		}
+	}
 
-		if (le == NULL)
-			break;
+	INFO ("plugin: Handed %zu listening sockets over to collectdmon.",
+			handoff_fds_num);
+} /* }}} void handoff_send_fds */
 
-		++found;
+/* Hands the listening sockets over and asks the plugins owning them to stop
+ * reading them, so that nothing they receive is lost once the write threads
+ * are stopped. */
+static void handoff_begin (void) /* {{{ */
+{
+	llentry_t *le;
 
-		llist_remove (read_list, le);
+	if (handoff_fd < 0)
+		return;
 
-		rf = le->value;
-		assert (rf != NULL);
-		rf->rf_type = RF_REMOVE;
+	if (handoff_fds_num > 0)
+		handoff_send_fds ();
 
-		llentry_destroy (le);
+	for (le = llist_head (list_handoff); le != NULL; le = le->next)
+	{
+		callback_func_t *cf = le->value;
+		plugin_handoff_cb callback = cf->cf_callback;
+		plugin_ctx_t old_ctx;
 
-		DEBUG ("plugin_unregister_read_group: "
-				"Marked `%s' (group `%s') for removal.",
-				rf->rf_name, group);
+		old_ctx = plugin_set_ctx (cf->cf_ctx);
+		(*callback) ();
+		plugin_set_ctx (old_ctx);
 	}
+} /* }}} void handoff_begin */
 
-	pthread_mutex_unlock (&read_lock);
+/* Tells collectdmon to start the next process. Called once the cache
+ * snapshot has been written, so the next process can pick it up; the
+ * remaining shutdown, e.g. flushing the RRDtool cache, overlaps with its
+ * startup. */
+static void handoff_end (void) /* {{{ */
+{
+	char payload[] = "END";
 
-	if (found == 0)
+	if (handoff_fd < 0)
+		return;
+
+	if (send (handoff_fd, payload, sizeof (payload), MSG_DONTWAIT) < 0)
 	{
-		WARNING ("plugin_unregister_read_group: No such "
-				"group of read function: %s", group);
-		return (-ENOENT);
+		char errbuf[1024];
+		ERROR ("plugin: Signalling the end of the handoff failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
 	}
 
-	return (0);
-} /* }}} int plugin_unregister_read_group */
+	close (handoff_fd);
+	handoff_fd = -1;
+	sfree (handoff_fds);
+	handoff_fds_num = 0;
+} /* }}} void handoff_end */
 
-int plugin_unregister_write (const char *name)
+int plugin_register_handoff (const char *name, /* {{{ */
+		plugin_handoff_cb callback)
 {
-	return (plugin_unregister (list_write, name));
-}
+	return (create_register_callback (&list_handoff, name,
+				(void *) callback, /* user_data = */ NULL));
+} /* }}} int plugin_register_handoff */
 
-int plugin_unregister_flush (const char *name)
+int plugin_handoff_take (int type, /* {{{ */
+		const struct sockaddr *addr, socklen_t addrlen)
 {
-	return (plugin_unregister (list_flush, name));
-}
+	size_t i;
 
-int plugin_unregister_missing (const char *name)
-{
-	return (plugin_unregister (list_missing, name));
-}
+	handoff_init ();
 
-int plugin_unregister_shutdown (const char *name)
-{
-	return (plugin_unregister (list_shutdown, name));
-}
+	if ((addr == NULL) || (addrlen == 0))
+		return (-1);
 
-int plugin_unregister_data_set (const char *name)
+	for (i = 0; i < handoff_inherited_num; i++)
+	{
+		struct sockaddr_storage bound;
+		socklen_t bound_len = sizeof (bound);
+		int fd = handoff_inherited[i];
+		int fd_type = 0;
+		socklen_t fd_type_len = sizeof (fd_type);
+
+		if ((getsockopt (fd, SOL_SOCKET, SO_TYPE, &fd_type,
+						&fd_type_len) != 0)
+				|| (fd_type != type))
+			continue;
+
+		memset (&bound, 0, sizeof (bound));
+		if ((getsockname (fd, (struct sockaddr *) &bound,
+						&bound_len) != 0)
+				|| !sockaddr_equal ((struct sockaddr *) &bound, addr))
+			continue;
+
+		/* Taken: remove it from the list. */
+		handoff_inherited[i] = handoff_inherited[handoff_inherited_num - 1];
+		handoff_inherited_num--;
+		return (fd);
+	}
+
+	return (-1);
+} /* }}} int plugin_handoff_take */
+
+int plugin_handoff_add (int fd) /* {{{ */
 {
-	data_set_t *ds;
+	int *tmp;
 
-	if (data_sets == NULL)
-		return (-1);
+	handoff_init ();
 
-	if (c_avl_remove (data_sets, name, NULL, (void *) &ds) != 0)
-		return (-1);
+	/* Not started by collectdmon. */
+	if (handoff_fd < 0)
+		return (0);
 
-	sfree (ds->ds);
-	sfree (ds);
+	tmp = realloc (handoff_fds, (handoff_fds_num + 1) * sizeof (*tmp));
+	if (tmp == NULL)
+		return (ENOMEM);
+	handoff_fds = tmp;
+	handoff_fds[handoff_fds_num] = fd;
+	handoff_fds_num++;
 
 	return (0);
-} /* int plugin_unregister_data_set */
+} /* }}} int plugin_handoff_add */
 
-int plugin_unregister_log (const char *name)
+void plugin_reload_chains (void)
 {
-	return (plugin_unregister (list_log, name));
-}
+	const char *chain_name;
 
-int plugin_unregister_notification (const char *name)
-{
-	return (plugin_unregister (list_notification, name));
-}
+	chain_name = global_option_get ("PreCacheChain");
+	pre_cache_chain = fc_chain_get_by_name (chain_name);
+
+	chain_name = global_option_get ("PostCacheChain");
+	post_cache_chain = fc_chain_get_by_name (chain_name);
+} /* void plugin_reload_chains */
 
 void plugin_init_all (void)
 {
-	const char *chain_name;
 	llentry_t *le;
-	int status;
+	int read_threads;
+	int init_threads;
 
 	/* Init the value cache */
 	uc_init ();
 
-	chain_name = global_option_get ("PreCacheChain");
-	pre_cache_chain = fc_chain_get_by_name (chain_name);
+	callback_cpu_time = IS_TRUE (global_option_get ("CallbackCPUTime"))
+		? 1 : 0;
+	cdtime_coarse_enable (IS_TRUE (global_option_get ("CoarseClock"))
+			? 1 : 0);
 
-	chain_name = global_option_get ("PostCacheChain");
-	post_cache_chain = fc_chain_get_by_name (chain_name);
+	{
+		int per_plugin = atoi (global_option_get ("SeriesLimitPerPlugin"));
+		int per_host = atoi (global_option_get ("SeriesLimitPerHost"));
+
+		uc_set_series_limits ((per_plugin > 0) ? (size_t) per_plugin : 0,
+				(per_host > 0) ? (size_t) per_host : 0);
+	}
+
+	/* Restore the cache before any values are dispatched, so newer values
+	 * take precedence. */
+	{
+		char const *file = global_option_get ("CacheSnapshot");
+		if ((file != NULL) && (file[0] != 0))
+			uc_snapshot_read (file);
+	}
+
+	{
+		int limit = atoi (global_option_get ("LogQueueLimit"));
+
+		log_rate_limit = (unsigned int) atoi (global_option_get ("LogRateLimit"));
+		if (IS_TRUE (global_option_get ("LogThread")))
+			start_log_thread ((limit > 0)
+					? (size_t) limit : LOG_QUEUE_DEFAULT_LIMIT);
+	}
+
+	plugin_reload_chains ();
+
+	write_queue_configure ();
+
+	{
+		char const *tmp;
+
+		tmp = global_option_get ("ReadThreadCPUs");
+		if ((tmp != NULL) && (tmp[0] != 0))
+			read_thread_cpus = c_cpusets_parse (tmp);
+		tmp = global_option_get ("WriteThreadCPUs");
+		if ((tmp != NULL) && (tmp[0] != 0))
+			write_thread_cpus = c_cpusets_parse (tmp);
+	}
 
 	{
 		char const *tmp = global_option_get ("WriteThreads");
 		int num = atoi (tmp);
+		int max = atoi (global_option_get ("WriteThreadsMax"));
+		long length = atol (global_option_get ("WriteThreadsGrowQueueLength"));
+		double latency = atof (global_option_get ("WriteThreadsGrowLatency"));
 
 		if (num < 1)
 			num = 5;
+		if ((max != 0) && (max < num))
+		{
+			WARNING ("plugin: WriteThreadsMax is less than WriteThreads. "
+					"Not scaling the write threads.");
+			max = num;
+		}
+
+		/* By default, one sixteenth of the queue's capacity. */
+		if (length > 0)
+			write_threads_grow_length = (size_t) length;
+		else
+			write_threads_grow_length = (write_queue_limit_high > 16)
+				? write_queue_limit_high / 16 : 1;
+		write_threads_grow_latency = (latency > 0.0)
+			? DOUBLE_TO_CDTIME_T (latency) : 0;
 
-		start_write_threads ((size_t) num);
+		start_write_threads ((size_t) num, (size_t) max);
+	}
+
+	start_flush_thread ();
+
+	{
+		int num = atoi (global_option_get ("NotificationThreads"));
+		int limit = atoi (global_option_get ("NotificationQueueLimit"));
+
+		if (limit > 0)
+			notif_queue_limit = (size_t) limit;
+		if (num > 0)
+			start_notification_threads ((size_t) num);
 	}
 
 	if ((list_init == NULL) && (read_heap == NULL))
+	{
+		handoff_close_unclaimed ();
 		return;
+	}
+
+	read_phase_spread = IS_TRUE (global_option_get ("ReadPhaseSpread"))
+		? 1 : 0;
+	{
+		double timeout = atof (global_option_get ("ReadTimeout"));
+
+		read_timeout = (timeout > 0.0) ? DOUBLE_TO_CDTIME_T (timeout) : 0;
+	}
+	overload_configure ();
+	/* "-1" is used by "-T" to not start any read threads. */
+	read_threads = atoi (global_option_get ("ReadThreads"));
+	if ((read_threads != -1) && (read_threads < 1))
+		read_threads = 5;
+	init_threads = atoi (global_option_get ("InitThreads"));
+
+	if (pthread_key_create (&init_job_key, NULL) != 0)
+	{
+		ERROR ("plugin_init_all: pthread_key_create failed.");
+		init_threads = 1;
+	}
 
 	/* Calling all init callbacks before checking if read callbacks
 	 * are available allows the init callbacks to register the read
 	 * callback. */
-	le = llist_head (list_init);
-	while (le != NULL)
+	if (init_jobs_create () != 0)
 	{
-		callback_func_t *cf;
-		plugin_init_cb callback;
-		plugin_ctx_t old_ctx;
-
-		cf = le->value;
-		old_ctx = plugin_set_ctx (cf->cf_ctx);
-		callback = cf->cf_callback;
-		status = (*callback) ();
-		plugin_set_ctx (old_ctx);
-
-		if (status != 0)
-		{
-			ERROR ("Initialization of plugin `%s' "
-					"failed with status %i. "
-					"Plugin will be unloaded.",
-					le->key, status);
-			/* Plugins that register read callbacks from the init
-			 * callback should take care of appropriate error
-			 * handling themselves. */
-			/* FIXME: Unload _all_ functions */
-			plugin_unregister_read (le->key);
-		}
-
-		le = le->next;
+		/* Without jobs, the dependencies can't be honored. */
+		for (le = llist_head (list_init); le != NULL; le = le->next)
+			init_job_run (le);
+	}
+	else if ((init_threads > 1) && (init_jobs_num > 1))
+	{
+		/* The read functions of plugins whose init callback is done
+		 * are run while the others are still initializing. */
+		if ((read_heap != NULL) && (read_threads > 0))
+			start_read_threads (read_threads);
+		init_jobs_run_parallel ((size_t) init_threads);
+	}
+	else
+	{
+		plugin_init_thread (NULL);
 	}
+	init_jobs_destroy ();
 
 	/* Start read-threads */
-	if (read_heap != NULL)
+	if ((read_heap != NULL) && (read_threads > 0))
 	{
-		const char *rt;
-		int num;
-		rt = global_option_get ("ReadThreads");
-		num = atoi (rt);
-		if (num != -1)
-			start_read_threads ((num > 0) ? num : 5);
+		if (read_pools == NULL)
+		{
+			start_read_threads (read_threads);
+		}
+		else
+		{
+			c_mutex_lock (&read_lock);
+			read_heap_distribute ();
+			c_mutex_unlock (&read_lock);
+		}
 	}
+
+	/* Plugins take the sockets they need while reading the config or
+	 * initializing. */
+	handoff_close_unclaimed ();
 } /* void plugin_init_all */
 
 /* TODO: Rename this function. */
 void plugin_read_all (void)
 {
 	uc_check_timeout ();
+	overload_check ();
+	write_threads_adjust ();
+	read_timeout_check ();
 
 	return;
 } /* void plugin_read_all */
@@ -1483,6 +5403,24 @@ int plugin_read_all_once (void)
 	return (return_status);
 } /* int plugin_read_all_once */
 
+/* Returns the write callback registered as "name", ignoring case. Names are
+ * normally registered in lower case, so the hashed exact lookup nearly
+ * always succeeds. */
+static write_func_t *plugin_write_lookup (const char *name) /* {{{ */
+{
+  llentry_t *le;
+
+  le = llist_search (list_write, name);
+  if (le != NULL)
+    return (le->value);
+
+  for (le = llist_head (list_write); le != NULL; le = le->next)
+    if (strcasecmp (name, le->key) == 0)
+      return (le->value);
+
+  return (NULL);
+} /* }}} write_func_t *plugin_write_lookup */
+
 int plugin_write (const char *plugin, /* {{{ */
 		const data_set_t *ds, const value_list_t *vl)
 {
@@ -1513,15 +5451,13 @@ int plugin_write (const char *plugin, /* {{{ */
     le = llist_head (list_write);
     while (le != NULL)
     {
-      callback_func_t *cf = le->value;
-      plugin_write_cb callback;
+      write_func_t *wf = le->value;
 
       /* do not switch plugin context; rather keep the context (interval)
        * information of the calling read plugin */
 
       DEBUG ("plugin: plugin_write: Writing values via %s.", le->key);
-      callback = cf->cf_callback;
-      status = (*callback) (ds, vl, &cf->cf_udata);
+      status = write_func_invoke (wf, ds, vl);
       if (status != 0)
         failure++;
       else
@@ -1537,34 +5473,72 @@ int plugin_write (const char *plugin, /* {{{ */
   }
   else /* plugin != NULL */
   {
-    callback_func_t *cf;
-    plugin_write_cb callback;
-
-    le = llist_head (list_write);
-    while (le != NULL)
-    {
-      if (strcasecmp (plugin, le->key) == 0)
-        break;
-
-      le = le->next;
-    }
+    write_func_t *wf;
 
-    if (le == NULL)
+    wf = plugin_write_lookup (plugin);
+    if (wf == NULL)
       return (ENOENT);
 
-    cf = le->value;
-
     /* do not switch plugin context; rather keep the context (interval)
      * information of the calling read plugin */
 
-    DEBUG ("plugin: plugin_write: Writing values via %s.", le->key);
-    callback = cf->cf_callback;
-    status = (*callback) (ds, vl, &cf->cf_udata);
+    DEBUG ("plugin: plugin_write: Writing values via %s.", wf->wf_name);
+    status = write_func_invoke (wf, ds, vl);
   }
 
   return (status);
 } /* }}} int plugin_write */
 
+void plugin_write_ref_init (plugin_write_ref_t *ref, const char *plugin) /* {{{ */
+{
+  memset (ref, 0, sizeof (*ref));
+  sstrncpy (ref->name, plugin, sizeof (ref->name));
+} /* }}} void plugin_write_ref_init */
+
+int plugin_write_ref (plugin_write_ref_t *ref, /* {{{ */
+    const data_set_t *ds, const value_list_t *vl)
+{
+  uint64_t generation;
+  write_func_t *wf;
+
+  if ((ref == NULL) || (vl == NULL))
+    return (EINVAL);
+
+  if (list_write == NULL)
+    return (ENOENT);
+
+  /* The callback is stored before the generation, so whoever sees the
+   * current generation in "ref" also sees the callback belonging to it.
+   * Several threads resolving the same reference store the same values. */
+  generation = list_write_generation;
+  if (ref->generation == generation)
+  {
+    wf = ref->callback;
+  }
+  else
+  {
+    wf = plugin_write_lookup (ref->name);
+    ref->callback = wf;
+    __sync_synchronize ();
+    ref->generation = generation;
+  }
+
+  if (wf == NULL)
+    return (ENOENT);
+
+  if (ds == NULL)
+  {
+    ds = plugin_get_ds (vl->type);
+    if (ds == NULL)
+    {
+      ERROR ("plugin_write_ref: Unable to lookup type `%s'.", vl->type);
+      return (ENOENT);
+    }
+  }
+
+  return (write_func_invoke (wf, ds, vl));
+} /* }}} int plugin_write_ref */
+
 int plugin_flush (const char *plugin, cdtime_t timeout, const char *identifier)
 {
   llentry_t *le;
@@ -1572,48 +5546,176 @@ int plugin_flush (const char *plugin, cdtime_t timeout, const char *identifier)
   if (list_flush == NULL)
     return (0);
 
-  le = llist_head (list_flush);
+  /* A single plugin is looked up through the list's index. */
+  if (plugin != NULL)
+    le = llist_search (list_flush, plugin);
+  else
+    le = llist_head (list_flush);
+
   while (le != NULL)
   {
     callback_func_t *cf;
     plugin_flush_cb callback;
     plugin_ctx_t old_ctx;
-
-    if ((plugin != NULL)
-        && (strcmp (plugin, le->key) != 0))
-    {
-      le = le->next;
-      continue;
-    }
+    uint64_t cpu;
 
     cf = le->value;
     old_ctx = plugin_set_ctx (cf->cf_ctx);
     callback = cf->cf_callback;
 
+    cpu = cpu_time_start ();
     (*callback) (timeout, identifier, &cf->cf_udata);
+    cpu_time_account (cf, cpu);
 
     plugin_set_ctx (old_ctx);
 
+    if (plugin != NULL)
+      break;
     le = le->next;
   }
   return (0);
 } /* int plugin_flush */
 
+int plugin_flush_async (const char *plugin, cdtime_t timeout, /* {{{ */
+		const char *identifier)
+{
+	flush_request_t *r;
+	char key[2 * DATA_MAX_NAME_LEN + 6 * DATA_MAX_NAME_LEN];
+
+	/* Plugin names and identifiers contain slashes, but no newlines. */
+	ssnprintf (key, sizeof (key), "%s\n%s",
+			(plugin != NULL) ? plugin : "",
+			(identifier != NULL) ? identifier : "");
+
+	pthread_mutex_lock (&flush_lock);
+
+	if (!flush_loop)
+	{
+		pthread_mutex_unlock (&flush_lock);
+		return (plugin_flush (plugin, timeout, identifier));
+	}
+
+	if (c_avl_get (flush_index, key, (void *) &r) == 0)
+	{
+		if (timeout < r->timeout)
+			r->timeout = timeout;
+		__sync_fetch_and_add (&flush_merged, 1);
+		pthread_mutex_unlock (&flush_lock);
+		return (0);
+	}
+
+	r = calloc (1, sizeof (*r));
+	if (r == NULL)
+	{
+		pthread_mutex_unlock (&flush_lock);
+		return (ENOMEM);
+	}
+	r->key = strdup (key);
+	r->plugin = (plugin != NULL) ? strdup (plugin) : NULL;
+	r->identifier = (identifier != NULL) ? strdup (identifier) : NULL;
+	r->timeout = timeout;
+	if ((r->key == NULL)
+			|| ((plugin != NULL) && (r->plugin == NULL))
+			|| ((identifier != NULL) && (r->identifier == NULL))
+			|| (c_avl_insert (flush_index, r->key, r) != 0))
+	{
+		pthread_mutex_unlock (&flush_lock);
+		flush_request_free (r);
+		return (ENOMEM);
+	}
+
+	if (flush_tail == NULL)
+		flush_head = r;
+	else
+		flush_tail->next = r;
+	flush_tail = r;
+
+	pthread_cond_signal (&flush_cond);
+	pthread_mutex_unlock (&flush_lock);
+
+	return (0);
+} /* }}} int plugin_flush_async */
+
+int plugin_command (const char *name, FILE *fh, char *buffer) /* {{{ */
+{
+  llentry_t *le;
+
+  if (list_command == NULL)
+    return (ENOENT);
+
+  for (le = llist_head (list_command); le != NULL; le = le->next)
+  {
+    callback_func_t *cf;
+    plugin_command_cb callback;
+    plugin_ctx_t old_ctx;
+    int status;
+
+    if (strcasecmp (name, le->key) != 0)
+      continue;
+
+    cf = le->value;
+    old_ctx = plugin_set_ctx (cf->cf_ctx);
+    callback = cf->cf_callback;
+
+    status = (*callback) (fh, buffer, &cf->cf_udata);
+
+    plugin_set_ctx (old_ctx);
+
+    return ((status < 0) ? status : 0);
+  }
+
+  return (ENOENT);
+} /* }}} int plugin_command */
+
 void plugin_shutdown_all (void)
 {
 	llentry_t *le;
 
-	stop_read_threads ();
+	stop_read_threads ();
+	/* Exchanges in progress dispatch values, too. */
+	uas_shutdown ();
+
+	destroy_all_callbacks (&list_init);
+
+	c_mutex_lock (&read_lock);
+	llist_destroy (read_list);
+	read_list = NULL;
+	c_mutex_unlock (&read_lock);
+
+	destroy_read_heap ();
+
+	handoff_begin ();
+
+	/* Blocks until all write threads have shut down. Asynchronous write
+	 * callbacks write out what is left in their queues. Both has to
+	 * happen before the write plugins' shutdown callbacks are called. */
+	stop_write_threads ();
+	stop_async_writers ();
+	write_queue_pool_drain ();
+
+	c_cpusets_destroy (read_thread_cpus);
+	read_thread_cpus = NULL;
+	c_cpusets_destroy (write_thread_cpus);
+	write_thread_cpus = NULL;
+
+	/* No more values are added to the cache from here on. */
+	{
+		char const *file = global_option_get ("CacheSnapshot");
+		if ((file != NULL) && (file[0] != 0))
+			uc_snapshot_write (file);
+	}
+
+	handoff_end ();
 
-	destroy_all_callbacks (&list_init);
+	/* Write callbacks, e.g. the threshold checks, emit notifications. */
+	stop_notification_threads ();
 
-	pthread_mutex_lock (&read_lock);
-	llist_destroy (read_list);
-	read_list = NULL;
-	pthread_mutex_unlock (&read_lock);
+	/* Log plugins may close their files in their shutdown callbacks. */
+	stop_log_thread ();
 
-	destroy_read_heap ();
+	stop_flush_thread ();
 
+	/* Ask all plugins to write out the state they kept. */
 	plugin_flush (/* plugin = */ NULL,
 			/* timeout = */ 0,
 			/* identifier = */ NULL);
@@ -1643,8 +5745,6 @@ void plugin_shutdown_all (void)
 		plugin_set_ctx (old_ctx);
 	}
 
-	stop_write_threads ();
-
 	/* Write plugins which use the `user_data' pointer usually need the
 	 * same data available to the flush callback. If this is the case, set
 	 * the free_function to NULL when registering the flush callback and to
@@ -1652,11 +5752,16 @@ void plugin_shutdown_all (void)
 	 * the data isn't freed twice. */
 	destroy_all_callbacks (&list_flush);
 	destroy_all_callbacks (&list_missing);
+	destroy_all_callbacks (&list_command);
 	destroy_all_callbacks (&list_write);
 
 	destroy_all_callbacks (&list_notification);
 	destroy_all_callbacks (&list_shutdown);
+	destroy_all_callbacks (&list_handoff);
 	destroy_all_callbacks (&list_log);
+
+	/* Write plugins may reconnect until their shutdown callbacks ran. */
+	ures_shutdown ();
 } /* void plugin_shutdown_all */
 
 int plugin_dispatch_missing (const value_list_t *vl) /* {{{ */
@@ -1700,203 +5805,793 @@ int plugin_dispatch_missing (const value_list_t *vl) /* {{{ */
   return (0);
 } /* int }}} plugin_dispatch_missing */
 
-static int plugin_dispatch_values_internal (value_list_t *vl)
+/* Puts back the values of "vl" if a target has replaced them with a copy. */
+static void value_list_restore (value_list_t *vl) /* {{{ */
+{
+	write_batch_t *b = write_batch_get ();
+
+	if ((b == NULL) || (b->current != vl) || (b->saved_values == NULL))
+		return;
+
+	sfree (vl->values);
+	vl->values = b->saved_values;
+	vl->values_len = b->saved_values_len;
+	b->saved_values = NULL;
+	b->saved_values_len = 0;
+} /* }}} void value_list_restore */
+
+/* Checks "vl" before it is dispatched and returns its data set, or NULL if
+ * it can't be dispatched. */
+static const data_set_t *plugin_dispatch_values_check (value_list_t *vl)
+{
+	static c_complain_t no_write_complaint = C_COMPLAIN_INIT_STATIC;
+
+	data_set_t *ds;
+
+	if ((vl == NULL) || (vl->type[0] == 0)
+			|| (vl->values == NULL) || (vl->values_len < 1))
+	{
+		ERROR ("plugin_dispatch_values: Invalid value list "
+				"from plugin %s.", vl->plugin);
+		return (NULL);
+	}
+
+	if (list_write == NULL)
+		c_complain_once (LOG_WARNING, &no_write_complaint,
+				"plugin_dispatch_values: No write callback has been "
+				"registered. Please load at least one output plugin, "
+				"if you want the collected data to be stored.");
+
+	if (c_htable_size (data_sets) == 0)
+	{
+		ERROR ("plugin_dispatch_values: No data sets registered. "
+				"Could the types database be read? Check "
+				"your `TypesDB' setting!");
+		return (NULL);
+	}
+
+	ds = data_sets_get (vl->type);
+	if (ds == NULL)
+	{
+		char ident[6 * DATA_MAX_NAME_LEN];
+
+		FORMAT_VL (ident, sizeof (ident), vl);
+		INFO ("plugin_dispatch_values: Dataset not found: %s "
+				"(from \"%s\"), check your types.db!",
+				vl->type, ident);
+		return (NULL);
+	}
+
+	/* Assured by plugin_value_list_copy(). The time is determined at
+	 * _enqueue_ time. */
+	assert (vl->time != 0);
+	assert (vl->interval != 0);
+
+	DEBUG ("plugin_dispatch_values: time = %.3f; interval = %.3f; "
+			"host = %s; "
+			"plugin = %s; plugin_instance = %s; "
+			"type = %s; type_instance = %s;",
+			CDTIME_T_TO_DOUBLE (vl->time),
+			CDTIME_T_TO_DOUBLE (vl->interval),
+			vl->host,
+			vl->plugin, vl->plugin_instance,
+			vl->type, vl->type_instance);
+
+	/* The lookup above compared the type names already. */
+#if COLLECT_DEBUG
+	assert (0 == strcmp (ds->type, vl->type));
+#endif
+
+#if COLLECT_DEBUG
+	assert (ds->ds_num == vl->values_len);
+#else
+	if (ds->ds_num != vl->values_len)
+	{
+		ERROR ("plugin_dispatch_values: ds->type = %s: "
+				"(ds->ds_num = %i) != "
+				"(vl->values_len = %i)",
+				ds->type, ds->ds_num, vl->values_len);
+		return (NULL);
+	}
+#endif
+
+	escape_slashes (vl->host, sizeof (vl->host));
+	escape_slashes (vl->plugin, sizeof (vl->plugin));
+	escape_slashes (vl->plugin_instance, sizeof (vl->plugin_instance));
+	escape_slashes (vl->type, sizeof (vl->type));
+	escape_slashes (vl->type_instance, sizeof (vl->type_instance));
+
+	return (ds);
+} /* const data_set_t *plugin_dispatch_values_check */
+
+/* Formats the identifier of "vl" into "identity" and points "vl->identity"
+ * to it. */
+static void plugin_dispatch_values_identify (value_list_t *vl,
+		char *identity, size_t identity_size)
+{
+	if (FORMAT_VL (identity, identity_size, vl) == 0)
+	{
+		vl->identity = identity;
+		vl->identity_hash = plugin_hash_string (identity);
+	}
+	else
+	{
+		vl->identity = NULL;
+		vl->identity_hash = 0;
+	}
+} /* void plugin_dispatch_values_identify */
+
+/* Releases "vl" once it has been passed on or is not to be. */
+static void plugin_dispatch_values_drop (value_list_t *vl, int free_meta_data)
+{
+	/* Restore the state of the value_list so that plugins don't get
+	 * confused.. */
+	value_list_restore (vl);
+
+	if ((free_meta_data != 0) && (vl->meta != NULL))
+	{
+		meta_data_destroy (vl->meta);
+		vl->meta = NULL;
+	}
+} /* void plugin_dispatch_values_drop */
+
+/* Hands "vl", which is in the cache already, to the post-cache chain or the
+ * write callbacks. */
+static void plugin_dispatch_values_finish (const data_set_t *ds,
+		value_list_t *vl, int free_meta_data)
+{
+	int status;
+
+	if (post_cache_chain != NULL)
+	{
+		/* Targets in the post-cache chain may change the
+		 * identifier and the values, too. */
+		vl->identity = NULL;
+		vl->identity_hash = 0;
+		vl->rates = NULL;
+
+		status = fc_process_chain (ds, vl, post_cache_chain);
+		if (status < 0)
+		{
+			WARNING ("plugin_dispatch_values: Running the "
+					"post-cache chain failed with "
+					"status %i (%#x).",
+					status, status);
+		}
+	}
+	else
+		fc_default_action (ds, vl);
+
+	plugin_dispatch_values_drop (vl, free_meta_data);
+} /* void plugin_dispatch_values_finish */
+
+static int plugin_dispatch_values_internal (value_list_t *vl,
+		char *identity, size_t identity_size,
+		gauge_t *rates, size_t rates_size)
+{
+	int status;
+	const data_set_t *ds;
+
+	int free_meta_data = 0;
+
+	ds = plugin_dispatch_values_check (vl);
+	if (ds == NULL)
+		return (-1);
+
+	/* Free meta data only if the calling function didn't specify any. In
+	 * this case matches and targets may add some and the calling function
+	 * may not expect (and therefore free) that data. */
+	if (vl->meta == NULL)
+		free_meta_data = 1;
+
+	/* The values are not copied for the filter chains. Targets which
+	 * change them call plugin_value_list_make_writable() first. */
+	if (pre_cache_chain != NULL)
+	{
+		status = fc_process_chain (ds, vl, pre_cache_chain);
+		if (status < 0)
+		{
+			WARNING ("plugin_dispatch_values: Running the "
+					"pre-cache chain failed with "
+					"status %i (%#x).",
+					status, status);
+		}
+		else if (status == FC_TARGET_STOP)
+		{
+			/* Restore the state of the value_list so that plugins
+			 * don't get confused.. */
+			value_list_restore (vl);
+			return (0);
+		}
+	}
+
+	/* Targets in the pre-cache chain may have changed the identifier, so
+	 * it is only determined now. */
+	plugin_dispatch_values_identify (vl, identity, identity_size);
+
+	/* Update the value cache. Writers storing rates find them in the
+	 * value list, instead of looking them up in the cache again. */
+	vl->rates = NULL;
+	if ((size_t) ds->ds_num <= rates_size)
+	{
+		status = uc_update_rates (ds, vl, rates);
+		if (status == 0)
+			vl->rates = rates;
+	}
+	else
+		status = uc_update (ds, vl);
+
+	/* New series beyond SeriesLimitPerPlugin or SeriesLimitPerHost are not
+	 * passed on either; the cache has reported them. */
+	if (status == EDQUOT)
+		plugin_dispatch_values_drop (vl, free_meta_data);
+	else
+		plugin_dispatch_values_finish (ds, vl, free_meta_data);
+
+	return (0);
+} /* int plugin_dispatch_values_internal */
+
+/* Dispatches the value lists of "nodes" like plugin_dispatch_values_internal()
+ * does one at a time, but updates the cache for all of them with one call.
+ * Only used without a pre-cache chain: its targets may make the values
+ * writable, which works for one value list of the batch at a time only. */
+static void plugin_dispatch_values_nodes (write_batch_t *b, /* {{{ */
+		write_queue_t **nodes, size_t nodes_num)
+{
+	uc_update_t updates[WRITE_BATCH_SIZE];
+	write_queue_t *valid[WRITE_BATCH_SIZE];
+	int free_meta_data[WRITE_BATCH_SIZE];
+	size_t updates_num = 0;
+	size_t i;
+
+	assert (nodes_num <= WRITE_BATCH_SIZE);
+
+	for (i = 0; i < nodes_num; i++)
+	{
+		write_queue_t *q = nodes[i];
+		const data_set_t *ds;
+
+		(void) plugin_set_ctx (q->ctx);
+		q->vl.rates = NULL;
+
+		ds = plugin_dispatch_values_check (&q->vl);
+		if (ds == NULL)
+			continue;
+
+		plugin_dispatch_values_identify (&q->vl,
+				q->identity, sizeof (q->identity));
+
+		valid[updates_num] = q;
+		free_meta_data[updates_num] = (q->vl.meta == NULL);
+		updates[updates_num].ds = ds;
+		updates[updates_num].vl = &q->vl;
+		updates[updates_num].rates = NULL;
+		if ((size_t) ds->ds_num <= STATIC_ARRAY_SIZE (q->rates))
+			updates[updates_num].rates = q->rates;
+		updates[updates_num].status = 0;
+		updates_num++;
+	}
+
+	(void) uc_update_multi (updates, updates_num);
+
+	for (i = 0; i < updates_num; i++)
+	{
+		write_queue_t *q = valid[i];
+
+		if (updates[i].status == 0)
+			q->vl.rates = updates[i].rates;
+		else if (updates[i].status == EDQUOT)
+		{
+			plugin_dispatch_values_drop (&q->vl, free_meta_data[i]);
+			continue;
+		}
+
+		(void) plugin_set_ctx (q->ctx);
+		b->current = &q->vl;
+		b->current_enqueued = q->enqueued;
+		b->current_trace = q->trace;
+		b->current_first = b->items_num;
+		plugin_dispatch_values_finish (updates[i].ds, &q->vl,
+				free_meta_data[i]);
+	}
+} /* }}} void plugin_dispatch_values_nodes */
+
+int plugin_value_list_make_writable (value_list_t *vl) /* {{{ */
+{
+	write_batch_t *b = write_batch_get ();
+	value_t *values;
+	size_t i;
+
+	/* Not being dispatched: the value list belongs to the caller. */
+	if ((vl == NULL) || (b == NULL) || (b->current != vl))
+		return (0);
+
+	/* Copy the value list for batch write callbacks which have been handed
+	 * it already, before it is changed under their feet. */
+	for (i = b->current_first; i < b->items_num; i++)
+	{
+		write_batch_item_t *item = b->items + i;
+
+		if ((item->vl != vl) || (item->copy != NULL))
+			continue;
+
+		item->copy = write_queue_create (vl);
+		if (item->copy == NULL)
+			return (ENOMEM);
+		item->vl = &item->copy->vl;
+	}
+
+	/* The rates no longer match the values. */
+	vl->rates = NULL;
+
+	if (b->saved_values != NULL)
+		return (0);
+
+	/* The values belong to the queue node. Hand out a copy which the
+	 * caller may also free and replace. */
+	values = calloc (vl->values_len, sizeof (*values));
+	if (values == NULL)
+		return (ENOMEM);
+	memcpy (values, vl->values, vl->values_len * sizeof (*values));
+
+	b->saved_values = vl->values;
+	b->saved_values_len = vl->values_len;
+	vl->values = values;
+
+	return (0);
+} /* }}} int plugin_value_list_make_writable */
+
+int plugin_dispatch_values (value_list_t const *vl)
+{
+	int status;
+
+	status = plugin_write_enqueue (vl);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("plugin_dispatch_values: plugin_write_enqueue failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+		return (status);
+	}
+
+	__sync_fetch_and_add (&values_dispatched, 1);
+	return (0);
+}
+
+/* Queues the value lists "vls" or, if it is NULL, the value lists made of
+ * "tmpl" and each of "entries", and wakes up each partition's write threads
+ * once. */
+static int dispatch_batch (char const *caller, /* {{{ */
+		value_list_t const *vls, value_list_t const *tmpl,
+		plugin_value_entry_t const *entries, size_t num)
+{
+	value_list_t vl;
+	size_t partitions_num;
+	size_t i;
+	int status;
+
+	status = write_queue_init ();
+	if (status != 0)
+		return (status);
+
+	/* Set after the queue has been initialized. */
+	partitions_num = write_partitions_num;
+
+	/* The identifier is copied once; only the type instance changes from
+	 * one entry to the next. */
+	if (vls == NULL)
+		memcpy (&vl, tmpl, sizeof (vl));
+
+	{
+		_Bool queued[partitions_num];
+		size_t dispatched = 0;
+
+		memset (queued, 0, sizeof (queued));
+
+		for (i = 0; i < num; i++)
+		{
+			value_list_t const *cur = &vl;
+			write_partition_t *p = NULL;
+
+			if (vls != NULL)
+				cur = vls + i;
+			else
+			{
+				plugin_value_entry_t const *e = entries + i;
+
+				sstrncpy (vl.type, (e->type != NULL)
+						? e->type : tmpl->type,
+						sizeof (vl.type));
+				sstrncpy (vl.type_instance,
+						(e->type_instance != NULL)
+						? e->type_instance
+						: tmpl->type_instance,
+						sizeof (vl.type_instance));
+				vl.values = e->values;
+				vl.values_len = e->values_len;
+			}
+
+			status = plugin_write_enqueue_nowakeup (cur, &p);
+			if (status != 0)
+			{
+				char errbuf[1024];
+				ERROR ("%s: plugin_write_enqueue_nowakeup "
+						"failed with status %i (%s).",
+						caller, status, sstrerror (status,
+							errbuf, sizeof (errbuf)));
+				break;
+			}
+
+			dispatched++;
+			if (p == NULL)
+				continue;
+			else if ((size_t) (p - write_partitions) < partitions_num)
+				queued[p - write_partitions] = 1;
+			else /* partitioned concurrently */
+				write_partition_wakeup (p);
+		}
+
+		/* Wake up each partition's write threads once. */
+		for (i = 0; i < partitions_num; i++)
+			if (queued[i])
+				write_partition_wakeup (write_partitions + i);
+
+		__sync_fetch_and_add (&values_dispatched, dispatched);
+	}
+
+	return (status);
+} /* }}} int dispatch_batch */
+
+int plugin_dispatch_values_batch (value_list_t const *vls, /* {{{ */
+		size_t vls_num)
+{
+	if ((vls == NULL) || (vls_num == 0))
+		return (0);
+
+	return (dispatch_batch ("plugin_dispatch_values_batch", vls,
+				/* template = */ NULL, /* entries = */ NULL,
+				vls_num));
+} /* }}} int plugin_dispatch_values_batch */
+
+int plugin_dispatch_values_multi (value_list_t const *tmpl, /* {{{ */
+		plugin_value_entry_t const *entries, size_t entries_num)
+{
+	if ((tmpl == NULL) || (entries == NULL) || (entries_num == 0))
+		return (0);
+
+	return (dispatch_batch ("plugin_dispatch_values_multi", /* vls = */ NULL,
+				tmpl, entries, entries_num));
+} /* }}} int plugin_dispatch_values_multi */
+
+size_t plugin_write_queue_length (void) /* {{{ */
 {
-	int status;
-	static c_complain_t no_write_complaint = C_COMPLAIN_INIT_STATIC;
+	return (write_queue_length ());
+} /* }}} size_t plugin_write_queue_length */
 
-	value_t *saved_values;
-	int      saved_values_len;
+uint64_t plugin_write_queue_dropped (void) /* {{{ */
+{
+	return ((uint64_t) write_queue_dropped);
+} /* }}} uint64_t plugin_write_queue_dropped */
 
-	data_set_t *ds;
+void plugin_write_threads_stats (size_t *num, uint64_t *adjustments) /* {{{ */
+{
+	if (num != NULL)
+		*num = write_threads_num;
+	if (adjustments != NULL)
+		*adjustments = write_threads_adjustments;
+} /* }}} void plugin_write_threads_stats */
 
-	int free_meta_data = 0;
+size_t plugin_write_queue_peak (void) /* {{{ */
+{
+	size_t peak = __sync_lock_test_and_set (&write_queue_peak, 0);
+	size_t length = write_queue_length ();
 
-	if ((vl == NULL) || (vl->type[0] == 0)
-			|| (vl->values == NULL) || (vl->values_len < 1))
-	{
-		ERROR ("plugin_dispatch_values: Invalid value list "
-				"from plugin %s.", vl->plugin);
-		return (-1);
-	}
+	return ((length > peak) ? length : peak);
+} /* }}} size_t plugin_write_queue_peak */
 
-	/* Free meta data only if the calling function didn't specify any. In
-	 * this case matches and targets may add some and the calling function
-	 * may not expect (and therefore free) that data. */
-	if (vl->meta == NULL)
-		free_meta_data = 1;
+uint64_t plugin_values_dispatched (void) /* {{{ */
+{
+	return ((uint64_t) values_dispatched);
+} /* }}} uint64_t plugin_values_dispatched */
 
-	if (list_write == NULL)
-		c_complain_once (LOG_WARNING, &no_write_complaint,
-				"plugin_dispatch_values: No write callback has been "
-				"registered. Please load at least one output plugin, "
-				"if you want the collected data to be stored.");
+void plugin_write_latency_stats (void (*callback) (const char *name, /* {{{ */
+			const uint64_t *buckets, size_t buckets_num,
+			void *user_data),
+		void *user_data)
+{
+	llentry_t *le;
 
-	if (data_sets == NULL)
-	{
-		ERROR ("plugin_dispatch_values: No data sets registered. "
-				"Could the types database be read? Check "
-				"your `TypesDB' setting!");
-		return (-1);
-	}
+	if ((callback == NULL) || (list_write == NULL))
+		return;
 
-	if (c_avl_get (data_sets, vl->type, (void *) &ds) != 0)
+	for (le = llist_head (list_write); le != NULL; le = le->next)
 	{
-		char ident[6 * DATA_MAX_NAME_LEN];
+		write_func_t *wf = le->value;
+		uint64_t buckets[PLUGIN_WRITE_LATENCY_BUCKETS];
+		size_t i;
 
-		FORMAT_VL (ident, sizeof (ident), vl);
-		INFO ("plugin_dispatch_values: Dataset not found: %s "
-				"(from \"%s\"), check your types.db!",
-				vl->type, ident);
-		return (-1);
-	}
+		for (i = 0; i < PLUGIN_WRITE_LATENCY_BUCKETS; i++)
+			buckets[i] = (uint64_t) wf->wf_latency[i];
 
-	/* Assured by plugin_value_list_clone(). The time is determined at
-	 * _enqueue_ time. */
-	assert (vl->time != 0);
-	assert (vl->interval != 0);
+		(*callback) (wf->wf_name, buckets, PLUGIN_WRITE_LATENCY_BUCKETS,
+				user_data);
+	}
+} /* }}} void plugin_write_latency_stats */
 
-	DEBUG ("plugin_dispatch_values: time = %.3f; interval = %.3f; "
-			"host = %s; "
-			"plugin = %s; plugin_instance = %s; "
-			"type = %s; type_instance = %s;",
-			CDTIME_T_TO_DOUBLE (vl->time),
-			CDTIME_T_TO_DOUBLE (vl->interval),
-			vl->host,
-			vl->plugin, vl->plugin_instance,
-			vl->type, vl->type_instance);
+void plugin_write_delay_stats (void (*callback) (const char *name, /* {{{ */
+			const uint64_t *buckets, size_t buckets_num,
+			void *user_data),
+		void *user_data)
+{
+	llentry_t *le;
 
-#if COLLECT_DEBUG
-	assert (0 == strcmp (ds->type, vl->type));
-#else
-	if (0 != strcmp (ds->type, vl->type))
-		WARNING ("plugin_dispatch_values: (ds->type = %s) != (vl->type = %s)",
-				ds->type, vl->type);
-#endif
+	if ((callback == NULL) || (list_write == NULL) || !write_tracing)
+		return;
 
-#if COLLECT_DEBUG
-	assert (ds->ds_num == vl->values_len);
-#else
-	if (ds->ds_num != vl->values_len)
+	for (le = llist_head (list_write); le != NULL; le = le->next)
 	{
-		ERROR ("plugin_dispatch_values: ds->type = %s: "
-				"(ds->ds_num = %i) != "
-				"(vl->values_len = %i)",
-				ds->type, ds->ds_num, vl->values_len);
-		return (-1);
+		write_func_t *wf = le->value;
+		uint64_t buckets[PLUGIN_WRITE_LATENCY_BUCKETS];
+		size_t i;
+
+		for (i = 0; i < PLUGIN_WRITE_LATENCY_BUCKETS; i++)
+			buckets[i] = (uint64_t) wf->wf_delay[i];
+
+		(*callback) (wf->wf_name, buckets, PLUGIN_WRITE_LATENCY_BUCKETS,
+				user_data);
 	}
-#endif
+} /* }}} void plugin_write_delay_stats */
 
-	escape_slashes (vl->host, sizeof (vl->host));
-	escape_slashes (vl->plugin, sizeof (vl->plugin));
-	escape_slashes (vl->plugin_instance, sizeof (vl->plugin_instance));
-	escape_slashes (vl->type, sizeof (vl->type));
-	escape_slashes (vl->type_instance, sizeof (vl->type_instance));
+void plugin_callback_cpu_stats (void (*callback) (const char *type, /* {{{ */
+			const char *name, cdtime_t cpu, void *user_data),
+		void *user_data)
+{
+	llentry_t *le;
 
-	/* Copy the values. This way, we can assure `targets' that they get
-	 * dynamically allocated values, which they can free and replace if
-	 * they like. */
-	if ((pre_cache_chain != NULL) || (post_cache_chain != NULL))
-	{
-		saved_values     = vl->values;
-		saved_values_len = vl->values_len;
+	if ((callback == NULL) || !callback_cpu_time)
+		return;
 
-		vl->values = (value_t *) calloc (vl->values_len,
-				sizeof (*vl->values));
-		if (vl->values == NULL)
+	if (read_list != NULL)
+	{
+		c_mutex_lock (&read_lock);
+		for (le = llist_head (read_list); le != NULL; le = le->next)
 		{
-			ERROR ("plugin_dispatch_values: calloc failed.");
-			vl->values = saved_values;
-			return (-1);
+			read_func_t *rf = le->value;
+
+			(*callback) ("read", rf->rf_name,
+					NS_TO_CDTIME_T (rf->rf_super.cf_cpu),
+					user_data);
 		}
-		memcpy (vl->values, saved_values,
-				vl->values_len * sizeof (*vl->values));
-	}
-	else /* if ((pre == NULL) && (post == NULL)) */
-	{
-		saved_values     = NULL;
-		saved_values_len = 0;
+		c_mutex_unlock (&read_lock);
 	}
 
-	if (pre_cache_chain != NULL)
-	{
-		status = fc_process_chain (ds, vl, pre_cache_chain);
-		if (status < 0)
+	if (list_write != NULL)
+		for (le = llist_head (list_write); le != NULL; le = le->next)
 		{
-			WARNING ("plugin_dispatch_values: Running the "
-					"pre-cache chain failed with "
-					"status %i (%#x).",
-					status, status);
+			write_func_t *wf = le->value;
+
+			(*callback) ("write", wf->wf_name,
+					NS_TO_CDTIME_T (wf->wf_super.cf_cpu),
+					user_data);
 		}
-		else if (status == FC_TARGET_STOP)
+
+	if (list_flush != NULL)
+		for (le = llist_head (list_flush); le != NULL; le = le->next)
 		{
-			/* Restore the state of the value_list so that plugins
-			 * don't get confused.. */
-			if (saved_values != NULL)
-			{
-				free (vl->values);
-				vl->values     = saved_values;
-				vl->values_len = saved_values_len;
-			}
-			return (0);
+			callback_func_t *cf = le->value;
+
+			(*callback) ("flush", le->key,
+					NS_TO_CDTIME_T (cf->cf_cpu), user_data);
 		}
-	}
+} /* }}} void plugin_callback_cpu_stats */
 
-	/* Update the value cache */
-	uc_update (ds, vl);
+plugin_memory_t *plugin_memory_counter (const char *name) /* {{{ */
+{
+	plugin_memory_t *m;
 
-	if (post_cache_chain != NULL)
+	pthread_mutex_lock (&memory_lock);
+	for (m = memory_counters; m != NULL; m = m->next)
+		if (strcmp (m->name, name) == 0)
+			break;
+
+	if (m == NULL)
 	{
-		status = fc_process_chain (ds, vl, post_cache_chain);
-		if (status < 0)
+		m = calloc (1, sizeof (*m));
+		if (m != NULL)
 		{
-			WARNING ("plugin_dispatch_values: Running the "
-					"post-cache chain failed with "
-					"status %i (%#x).",
-					status, status);
+			sstrncpy (m->name, name, sizeof (m->name));
+			m->next = memory_counters;
+			memory_counters = m;
 		}
 	}
-	else
-		fc_default_action (ds, vl);
+	pthread_mutex_unlock (&memory_lock);
 
-	/* Restore the state of the value_list so that plugins don't get
-	 * confused.. */
-	if (saved_values != NULL)
+	return (m);
+} /* }}} plugin_memory_t *plugin_memory_counter */
+
+void plugin_memory_add (plugin_memory_t *m, int64_t bytes) /* {{{ */
+{
+	if (m != NULL)
+		__sync_fetch_and_add (&m->bytes, bytes);
+} /* }}} void plugin_memory_add */
+
+void plugin_memory_stats (void (*callback) (const char *name, /* {{{ */
+			uint64_t bytes, void *user_data),
+		void *user_data)
+{
+	plugin_memory_t *m;
+	size_t nodes;
+	llentry_t *le;
+
+	if (callback == NULL)
+		return;
+
+	/* Queued value lists and unused nodes. Values which don't fit into
+	 * the node and meta data are not included. */
+	nodes = write_queue_length ();
+	if (write_queue_pool != NULL)
+		nodes += c_ring_length (write_queue_pool);
+	if (list_write != NULL)
+		for (le = llist_head (list_write); le != NULL; le = le->next)
+		{
+			write_func_t *wf = le->value;
+
+			if (wf->wf_queue != NULL)
+				nodes += c_ring_length (wf->wf_queue);
+		}
+	(*callback) ("write_queue", (uint64_t) (nodes * sizeof (write_queue_t)),
+			user_data);
+
+	/* Entries are only ever prepended. */
+	pthread_mutex_lock (&memory_lock);
+	m = memory_counters;
+	pthread_mutex_unlock (&memory_lock);
+
+	for (; m != NULL; m = m->next)
 	{
-		free (vl->values);
-		vl->values     = saved_values;
-		vl->values_len = saved_values_len;
+		int64_t bytes = m->bytes;
+
+		(*callback) (m->name, (bytes > 0) ? (uint64_t) bytes : 0,
+				user_data);
 	}
+} /* }}} void plugin_memory_stats */
 
-	if ((free_meta_data != 0) && (vl->meta != NULL))
+int plugin_write_queue_wait_stats (uint64_t *buckets, /* {{{ */
+		size_t buckets_num)
+{
+	size_t i;
+
+	if (!write_tracing)
+		return (-1);
+
+	for (i = 0; (i < buckets_num) && (i < PLUGIN_WRITE_LATENCY_BUCKETS); i++)
+		buckets[i] = (uint64_t) write_queue_wait[i];
+	for (; i < buckets_num; i++)
+		buckets[i] = 0;
+
+	return (0);
+} /* }}} int plugin_write_queue_wait_stats */
+
+int plugin_write_traces (plugin_write_trace_t **ret_traces, /* {{{ */
+		size_t *ret_traces_num)
+{
+	plugin_write_trace_t *traces;
+	size_t traces_num = 0;
+	uint64_t first;
+	uint64_t seq;
+
+	if (!write_tracing || (write_trace_sample == 0))
+		return (EINVAL);
+
+	traces = calloc (WRITE_TRACES_NUM, sizeof (*traces));
+	if (traces == NULL)
+		return (ENOMEM);
+
+	pthread_mutex_lock (&write_trace_lock);
+	first = (write_traces_seq > WRITE_TRACES_NUM)
+		? (write_traces_seq - WRITE_TRACES_NUM + 1) : 1;
+	for (seq = first; seq <= write_traces_seq; seq++)
 	{
-		meta_data_destroy (vl->meta);
-		vl->meta = NULL;
+		write_trace_slot_t *slot = write_traces + (seq % WRITE_TRACES_NUM);
+
+		if (slot->seq == seq)
+			traces[traces_num++] = slot->trace;
 	}
+	pthread_mutex_unlock (&write_trace_lock);
 
+	*ret_traces = traces;
+	*ret_traces_num = traces_num;
 	return (0);
-} /* int plugin_dispatch_values_internal */
+} /* }}} int plugin_write_traces */
 
-int plugin_dispatch_values (value_list_t const *vl)
+void plugin_read_timeout_stats (size_t *hung, uint64_t *timeouts) /* {{{ */
 {
-	int status;
+	if (hung != NULL)
+		*hung = read_threads_hung;
+	if (timeouts != NULL)
+		*timeouts = read_timeouts;
+} /* }}} void plugin_read_timeout_stats */
+
+void plugin_read_func_stats (void (*callback) (const char *name, /* {{{ */
+			cdtime_t interval, cdtime_t effective_interval,
+			cdtime_t duration, void *user_data),
+		void *user_data)
+{
+	llentry_t *le;
 
-	status = plugin_write_enqueue (vl);
-	if (status != 0)
+	if ((callback == NULL) || (read_list == NULL))
+		return;
+
+	c_mutex_lock (&read_lock);
+	for (le = llist_head (read_list); le != NULL; le = le->next)
 	{
-		char errbuf[1024];
-		ERROR ("plugin_dispatch_values: plugin_write_enqueue failed "
-				"with status %i (%s).", status,
-				sstrerror (status, errbuf, sizeof (errbuf)));
-		return (status);
+		read_func_t *rf = le->value;
+
+		(*callback) (rf->rf_name, rf->rf_interval,
+				rf->rf_effective_interval, rf->rf_duration,
+				user_data);
 	}
+	c_mutex_unlock (&read_lock);
+} /* }}} void plugin_read_func_stats */
 
-	return (0);
-}
+void plugin_write_async_stats (void (*callback) (const char *name, /* {{{ */
+			size_t length, uint64_t dropped, void *user_data),
+		void *user_data)
+{
+	llentry_t *le;
+
+	if ((callback == NULL) || (list_write == NULL))
+		return;
+
+	for (le = llist_head (list_write); le != NULL; le = le->next)
+	{
+		write_func_t *wf = le->value;
+
+		if (wf->wf_queue == NULL)
+			continue;
+
+		(*callback) (wf->wf_name, c_ring_length (wf->wf_queue),
+				(uint64_t) wf->wf_dropped, user_data);
+	}
+} /* }}} void plugin_write_async_stats */
+
+void plugin_read_thread_stats (void (*callback) (const char *pool, /* {{{ */
+			size_t index, uint64_t reads, uint64_t stolen, cdtime_t lag,
+			void *user_data),
+		void *user_data)
+{
+	read_pool_t *pool;
+	size_t i;
+
+	if (callback == NULL)
+		return;
+
+	c_mutex_lock (&read_lock);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+	{
+		for (i = 0; i < pool->queues_num; i++)
+		{
+			read_queue_t *q = pool->queues + i;
+			uint64_t reads;
+			uint64_t stolen;
+			cdtime_t lag;
+
+			c_mutex_lock (&q->lock);
+			reads = q->reads;
+			stolen = q->stolen;
+			lag = q->lag;
+			c_mutex_unlock (&q->lock);
+
+			(*callback) (pool->name, i, reads, stolen, lag,
+					user_data);
+		}
+	}
+	c_mutex_unlock (&read_lock);
+} /* }}} void plugin_read_thread_stats */
 
 int plugin_dispatch_notification (const notification_t *notif)
 {
-	llentry_t *le;
 	/* Possible TODO: Add flap detection here */
 
 	DEBUG ("plugin_dispatch_notification: severity = %i; message = %s; "
@@ -1908,43 +6603,89 @@ int plugin_dispatch_notification (const notification_t *notif)
 	if (list_notification == NULL)
 		return (-1);
 
-	le = llist_head (list_notification);
-	while (le != NULL)
-	{
-		callback_func_t *cf;
-		plugin_notification_cb callback;
-		int status;
-
-		/* do not switch plugin context; rather keep the context
-		 * (interval) information of the calling plugin */
-
-		cf = le->value;
-		callback = cf->cf_callback;
-		status = (*callback) (notif, &cf->cf_udata);
-		if (status != 0)
-		{
-			WARNING ("plugin_dispatch_notification: Notification "
-					"callback %s returned %i.",
-					le->key, status);
-		}
-
-		le = le->next;
-	}
+	if (notif_threads != NULL)
+		return (notification_enqueue (notif));
 
-	return (0);
+	return (plugin_dispatch_notification_internal (notif));
 } /* int plugin_dispatch_notification */
 
+void plugin_overload_stats (unsigned int *stretch, /* {{{ */
+		uint64_t *adjustments)
+{
+	if (stretch != NULL)
+		*stretch = overload_stretch;
+	if (adjustments != NULL)
+		*adjustments = overload_adjustments;
+} /* }}} void plugin_overload_stats */
+
+void plugin_notification_queue_stats (size_t *length, /* {{{ */
+		uint64_t *dropped, uint64_t *coalesced)
+{
+	pthread_mutex_lock (&notif_lock);
+	if (length != NULL)
+		*length = notif_queue_length;
+	if (dropped != NULL)
+		*dropped = notif_dropped;
+	if (coalesced != NULL)
+		*coalesced = notif_coalesced;
+	pthread_mutex_unlock (&notif_lock);
+} /* }}} void plugin_notification_queue_stats */
+
 void plugin_log (int level, const char *format, ...)
 {
 	char msg[1024];
 	va_list ap;
-	llentry_t *le;
 
 #if !COLLECT_DEBUG
 	if (level >= LOG_DEBUG)
 		return;
 #endif
 
+	if (!log_check_rate (format))
+		return;
+
+	if ((list_log != NULL) && log_loop)
+	{
+		log_entry_t *e = c_ring_pop (log_free);
+
+		if (e == NULL)
+		{
+			__sync_fetch_and_add (&log_dropped, 1);
+			return;
+		}
+
+		e->level = level;
+		va_start (ap, format);
+		vsnprintf (e->msg, sizeof (e->msg), format, ap);
+		e->msg[sizeof (e->msg) - 1] = '\0';
+		va_end (ap);
+
+		/* There are no more entries than the queue can hold. */
+		c_ring_push (log_queue, e);
+
+		/* Order the push before the loads below, see
+		 * write_partition_wakeup(). */
+		__sync_synchronize ();
+		if (!log_loop)
+		{
+			/* The log thread is being stopped and may have
+			 * exited before seeing the message. Write out what
+			 * is left ourselves. */
+			while ((e = c_ring_pop (log_queue)) != NULL)
+			{
+				plugin_log_internal (e->level, e->msg);
+				c_ring_push (log_free, e);
+			}
+		}
+		else if (log_waiting > 0)
+		{
+			pthread_mutex_lock (&log_lock);
+			pthread_cond_signal (&log_cond);
+			pthread_mutex_unlock (&log_lock);
+		}
+		return;
+	}
+
 	va_start (ap, format);
 	vsnprintf (msg, sizeof (msg), format, ap);
 	msg[sizeof (msg) - 1] = '\0';
@@ -1956,23 +6697,21 @@ void plugin_log (int level, const char *format, ...)
 		return;
 	}
 
-	le = llist_head (list_log);
-	while (le != NULL)
-	{
-		callback_func_t *cf;
-		plugin_log_cb callback;
-
-		cf = le->value;
-		callback = cf->cf_callback;
-
-		/* do not switch plugin context; rather keep the context
-		 * (interval) information of the calling plugin */
+	plugin_log_internal (level, msg);
+} /* void plugin_log */
 
-		(*callback) (level, msg, &cf->cf_udata);
+void plugin_log_stats (uint64_t *dropped, uint64_t *suppressed) /* {{{ */
+{
+	if (dropped != NULL)
+		*dropped = (uint64_t) log_dropped;
 
-		le = le->next;
+	if (suppressed != NULL)
+	{
+		pthread_mutex_lock (&log_limit_lock);
+		*suppressed = log_suppressed;
+		pthread_mutex_unlock (&log_limit_lock);
 	}
-} /* void plugin_log */
+} /* }}} void plugin_log_stats */
 
 int parse_log_severity (const char *severity)
 {
@@ -2016,7 +6755,8 @@ const data_set_t *plugin_get_ds (const char *name)
 {
 	data_set_t *ds;
 
-	if (c_avl_get (data_sets, name, (void *) &ds) != 0)
+	ds = data_sets_get (name);
+	if (ds == NULL)
 	{
 		DEBUG ("No such dataset registered: %s", name);
 		return (NULL);
@@ -27,6 +27,8 @@
 #include "meta_data.h"
 #include "utils_time.h"
 
+#include <sys/socket.h>
+
 #define PLUGIN_FLAGS_GLOBAL 0x0001
 
 #define DATA_MAX_NAME_LEN 64
@@ -96,12 +98,23 @@ struct value_list_s
 	char     type[DATA_MAX_NAME_LEN];
 	char     type_instance[DATA_MAX_NAME_LEN];
 	meta_data_t *meta;
+
+	/* Set by the daemon while the value list is being dispatched: the
+	 * identifier as formatted by FORMAT_VL and a hash of it. Plugins must
+	 * not set these; they are NULL and zero otherwise. */
+	const char *identity;
+	uint64_t    identity_hash;
+	/* Also set while dispatching: the rates the cache computed from this
+	 * value list, one per value, or NULL. Use uc_get_rate_ref() rather
+	 * than reading this directly. */
+	const gauge_t *rates;
 };
 typedef struct value_list_s value_list_t;
 
 #define VALUE_LIST_INIT { NULL, 0, 0, plugin_get_interval (), \
-	"localhost", "", "", "", "", NULL }
-#define VALUE_LIST_STATIC { NULL, 0, 0, 0, "localhost", "", "", "", "", NULL }
+	"localhost", "", "", "", "", NULL, NULL, 0, NULL }
+#define VALUE_LIST_STATIC { NULL, 0, 0, 0, "localhost", "", "", "", "", \
+	NULL, NULL, 0, NULL }
 
 struct data_source_s
 {
@@ -167,9 +180,76 @@ typedef struct user_data_s user_data_t;
 struct plugin_ctx_s
 {
 	cdtime_t interval;
+
+	/* Write callbacks registered with this context get a queue and a thread
+	 * of their own, see the "AsyncQueue" option of the "LoadPlugin" block. */
+	_Bool    write_async;
+	size_t   write_async_limit;
+
+	/* If greater than zero, read callbacks registered with this context are
+	 * run by a pool of this many threads of their own, see the
+	 * "ReadThreads" option of the "LoadPlugin" block. */
+	int      read_threads;
+
+	/* Read callbacks registered with this context are called less often
+	 * while the daemon is overloaded, see the "LowPriority" option of the
+	 * "LoadPlugin" block. */
+	_Bool    low_priority;
+
+	/* Read callbacks registered with this context are given up on after
+	 * running this long, see the "ReadTimeout" option of the "LoadPlugin"
+	 * block. Zero means the global "ReadTimeout" applies. */
+	cdtime_t read_timeout;
 };
 typedef struct plugin_ctx_s plugin_ctx_t;
 
+/* One value list of a batch dispatched with plugin_dispatch_values_multi().
+ * The identifier is taken from a template value list. */
+struct plugin_value_entry_s
+{
+	/* Override the template's type and type instance unless NULL. */
+	const char *type;
+	const char *type_instance;
+	value_t    *values;
+	int         values_len;
+};
+typedef struct plugin_value_entry_s plugin_value_entry_t;
+
+/* One value list handed to a batch write callback. */
+struct plugin_write_item_s
+{
+	const data_set_t   *ds;
+	const value_list_t *vl;
+};
+typedef struct plugin_write_item_s plugin_write_item_t;
+
+/* The callbacks of an asynchronous read function, see
+ * plugin_register_async_read(). Once per interval, an exchange with a remote
+ * endpoint is started: "connect" opens a socket unless the previous exchange
+ * left one open, "request" writes the request to send and "parse" handles the
+ * response. The socket is driven by the daemon's event loop threads, so that
+ * no read thread waits for the peer. */
+struct plugin_async_read_s
+{
+	/* Returns a non-blocking socket which is connected or still
+	 * connecting, or less than zero. See uas_connect() in utils_async.h. */
+	int (*connect) (user_data_t *ud);
+	/* Writes the request to "buffer" and returns its length, or less than
+	 * zero on failure. May be NULL if the peer talks first. */
+	int (*request) (char *buffer, size_t buffer_size, user_data_t *ud);
+	/* Called with all data received so far, null-terminated, whenever more
+	 * has arrived and with "eof" set once the peer has closed the
+	 * connection. Dispatches the values and returns zero once the response
+	 * is complete, EAGAIN if it isn't yet and any other value on failure. */
+	int (*parse) (const char *buffer, size_t buffer_len, _Bool eof,
+			user_data_t *ud);
+	/* Keep the socket open for the next exchange if this one succeeded. */
+	_Bool    keep_open;
+	/* How long an exchange may take. Zero means the plugin's interval. */
+	cdtime_t timeout;
+};
+typedef struct plugin_async_read_s plugin_async_read_t;
+
 /*
  * Callback types
  */
@@ -177,6 +257,8 @@ typedef int (*plugin_init_cb) (void);
 typedef int (*plugin_read_cb) (user_data_t *);
 typedef int (*plugin_write_cb) (const data_set_t *, const value_list_t *,
 		user_data_t *);
+typedef int (*plugin_write_batch_cb) (const plugin_write_item_t *items,
+		size_t items_num, user_data_t *);
 typedef int (*plugin_flush_cb) (cdtime_t timeout, const char *identifier,
 		user_data_t *);
 /* "missing" callback. Returns less than zero on failure, zero if other
@@ -185,7 +267,11 @@ typedef int (*plugin_flush_cb) (cdtime_t timeout, const char *identifier,
 typedef int (*plugin_missing_cb) (const value_list_t *, user_data_t *);
 typedef void (*plugin_log_cb) (int severity, const char *message,
 		user_data_t *);
+/* "command" callback. "buffer" is the complete command line, the callback
+ * writes its answer to "fh". */
+typedef int (*plugin_command_cb) (FILE *fh, char *buffer, user_data_t *);
 typedef int (*plugin_shutdown_cb) (void);
+typedef int (*plugin_handoff_cb) (void);
 typedef int (*plugin_notification_cb) (const notification_t *,
 		user_data_t *);
 
@@ -227,7 +313,24 @@ void plugin_set_dir (const char *dir);
  */
 int plugin_load (const char *name, uint32_t flags);
 
+/*
+ * NAME
+ *  plugin_init_after
+ *
+ * DESCRIPTION
+ *  Makes the init callback of `plugin' wait for the one of `after' when the
+ *  init callbacks are run by several threads, see the "InitThreads" option.
+ *  Used by the "InitAfter" option of the "LoadPlugin" block.
+ *
+ * RETURN VALUE
+ *  Returns zero upon success or an errno value otherwise.
+ */
+int plugin_init_after (const char *plugin, const char *after);
+
 void plugin_init_all (void);
+/* Looks up the chains named by "PreCacheChain" and "PostCacheChain" again,
+ * after the filter chains have been replaced by "fc_reload". */
+void plugin_reload_chains (void);
 void plugin_read_all (void);
 int plugin_read_all_once (void);
 void plugin_shutdown_all (void);
@@ -262,8 +365,70 @@ void plugin_shutdown_all (void);
 int plugin_write (const char *plugin,
     const data_set_t *ds, const value_list_t *vl);
 
+/*
+ * NAME
+ *  plugin_write_ref_init, plugin_write_ref
+ *
+ * DESCRIPTION
+ *  Like `plugin_write' with a plugin name, but the write callback is looked
+ *  up only on first use and again after write callbacks have been registered
+ *  or unregistered. Targets that always write to the same plugins keep one
+ *  reference per plugin, initialized once with `plugin_write_ref_init'.
+ *
+ * RETURN VALUE
+ *  Same as `plugin_write'; ENOENT if no such plugin is registered.
+ */
+struct plugin_write_ref_s
+{
+  char name[DATA_MAX_NAME_LEN];
+  void * volatile callback;
+  uint64_t volatile generation;
+};
+typedef struct plugin_write_ref_s plugin_write_ref_t;
+
+void plugin_write_ref_init (plugin_write_ref_t *ref, const char *plugin);
+int plugin_write_ref (plugin_write_ref_t *ref,
+    const data_set_t *ds, const value_list_t *vl);
+
 int plugin_flush (const char *plugin, cdtime_t timeout, const char *identifier);
 
+/*
+ * NAME
+ *  plugin_flush_async
+ *
+ * DESCRIPTION
+ *  Same as `plugin_flush', but the flush callbacks are called by a separate
+ *  thread and the function returns right away. A request for the same
+ *  plugin and identifier as one which is still pending is merged into that
+ *  one, keeping the lower timeout. Falls back to `plugin_flush' while the
+ *  daemon isn't running.
+ *
+ * RETURN VALUE
+ *  Zero if the request has been queued, an error code otherwise.
+ */
+int plugin_flush_async (const char *plugin, cdtime_t timeout,
+		const char *identifier);
+
+/*
+ * NAME
+ *  plugin_command
+ *
+ * DESCRIPTION
+ *  Calls the command callback registered as `name', ignoring case. Used by
+ *  the unixsock plugin for commands it doesn't know itself, so plugins can
+ *  offer commands of their own.
+ *
+ * ARGUMENTS
+ *  `name'      The command, i.e. the first word of `buffer'.
+ *  `fh'        Where the answer is written to.
+ *  `buffer'    The complete command line.
+ *
+ * RETURN VALUE
+ *  Returns zero if the command was called, a value greater than zero if no
+ *  such command is registered and a value below zero if the callback failed.
+ */
+int plugin_command (const char *name, FILE *fh, char *buffer);
+
 /*
  * The `plugin_register_*' functions are used to make `config', `init',
  * `read', `write' and `shutdown' functions known to the plugin
@@ -274,6 +439,10 @@ int plugin_register_config (const char *name,
 		const char **keys, int keys_num);
 int plugin_register_complex_config (const char *type,
 		int (*callback) (oconfig_item_t *));
+/* Called with the new configuration when the configuration is reloaded, see
+ * "cf_register_reload". Register after the complex config callback. */
+int plugin_register_reload_config (const char *type,
+		int (*callback) (oconfig_item_t *));
 int plugin_register_init (const char *name,
 		plugin_init_cb callback);
 int plugin_register_read (const char *name,
@@ -284,15 +453,63 @@ int plugin_register_complex_read (const char *group, const char *name,
 		plugin_read_cb callback,
 		const struct timespec *interval,
 		user_data_t *user_data);
+/* Registers a read function whose exchanges are driven by the event loop
+ * threads, see "plugin_async_read_t". Exchanges are started on the read
+ * function's schedule; one still in progress when the next is due causes that
+ * interval to be skipped. The callbacks must not unregister the function.
+ * Unregister with "plugin_unregister_read". "user_data" is freed like with
+ * "plugin_register_complex_read". */
+int plugin_register_async_read (const char *group, const char *name,
+		const plugin_async_read_t *callbacks,
+		const struct timespec *interval,
+		user_data_t *user_data);
 int plugin_register_write (const char *name,
 		plugin_write_cb callback, user_data_t *user_data);
+/* Like "plugin_register_write", but the callback receives all value lists a
+ * write thread has dequeued in one go. The values are only valid during the
+ * call. Since the items may have been dispatched by different read plugins,
+ * use "vl->interval" rather than "plugin_get_interval". Unregister with
+ * "plugin_unregister_write". */
+int plugin_register_write_batch (const char *name,
+		plugin_write_batch_cb callback, user_data_t *user_data);
 int plugin_register_flush (const char *name,
 		plugin_flush_cb callback, user_data_t *user_data);
 int plugin_register_missing (const char *name,
 		plugin_missing_cb callback, user_data_t *user_data);
+/* Command callbacks must be registered before the "init" callbacks run and
+ * are not unregistered before the daemon shuts down; the callback has to cope
+ * with being called after the plugin's "shutdown" callback. */
+int plugin_register_command (const char *name,
+		plugin_command_cb callback, user_data_t *user_data);
 int plugin_register_shutdown (const char *name,
 		plugin_shutdown_cb callback);
+
+/*
+ * Hitless restarts
+ *
+ * When started by collectdmon, the listening sockets registered with
+ * `plugin_handoff_add' are handed over to the next process on restart.
+ * Plugins opening a listening socket first call `plugin_handoff_take' to
+ * check whether the previous process has handed over a socket of the given
+ * type (SOCK_DGRAM, SOCK_STREAM) bound to `addr'. It returns its file
+ * descriptor, which is then owned by the plugin, or -1 if there is none.
+ * Either way, the plugin registers the socket with `plugin_handoff_add',
+ * which does nothing unless started by collectdmon.
+ *
+ * On shutdown, the sockets are handed over and then the callbacks registered
+ * with `plugin_register_handoff' are called, before the write threads are
+ * stopped. They must stop reading from the sockets and dispatch what they have
+ * received; the sockets are closed in the shutdown callback as usual.
+ */
+int plugin_handoff_take (int type,
+		const struct sockaddr *addr, socklen_t addrlen);
+int plugin_handoff_add (int fd);
+int plugin_register_handoff (const char *name,
+		plugin_handoff_cb callback);
 int plugin_register_data_set (const data_set_t *ds);
+/* Registers "ds_num" data sets at once, in order. Returns non-zero if any of
+ * them could not be registered. */
+int plugin_register_data_sets (const data_set_t *ds, size_t ds_num);
 int plugin_register_log (const char *name,
 		plugin_log_cb callback, user_data_t *user_data);
 int plugin_register_notification (const char *name,
@@ -306,6 +523,7 @@ int plugin_unregister_read_group (const char *group);
 int plugin_unregister_write (const char *name);
 int plugin_unregister_flush (const char *name);
 int plugin_unregister_missing (const char *name);
+int plugin_unregister_command (const char *name);
 int plugin_unregister_shutdown (const char *name);
 int plugin_unregister_data_set (const char *name);
 int plugin_unregister_log (const char *name);
@@ -327,10 +545,325 @@ int plugin_unregister_notification (const char *name);
  *              function.
  */
 int plugin_dispatch_values (value_list_t const *vl);
+
+/*
+ * NAME
+ *  plugin_dispatch_values_batch
+ *
+ * DESCRIPTION
+ *  Same as calling `plugin_dispatch_values' for each of the `vls_num' value
+ *  lists in `vls', but wakes up the write threads only once. The value lists
+ *  are copied, so the caller may reuse the memory once this returns.
+ *
+ * RETURN VALUE
+ *  Zero upon success, an error code if one of the value lists could not be
+ *  queued. The value lists following it are not dispatched then.
+ */
+int plugin_dispatch_values_batch (value_list_t const *vls, size_t vls_num);
+
+/*
+ * NAME
+ *  plugin_dispatch_values_multi
+ *
+ * DESCRIPTION
+ *  Dispatches one value list per entry in `entries' as a batch, like
+ *  `plugin_dispatch_values_batch'. Each value list is `tmpl' with the values
+ *  of the entry and its type and type instance, unless they are NULL. Meant for plugins reading many values of one plugin instance,
+ *  for example the states of a CPU. The value lists are copied, so the caller
+ *  may reuse `tmpl', `entries' and the values once this returns.
+ *
+ * RETURN VALUE
+ *  Zero upon success, an error code if one of the value lists could not be
+ *  queued. The entries following it are not dispatched then.
+ */
+int plugin_dispatch_values_multi (value_list_t const *tmpl,
+		plugin_value_entry_t const *entries, size_t entries_num);
 int plugin_dispatch_missing (const value_list_t *vl);
 
+/*
+ * NAME
+ *  plugin_hash_string
+ *
+ * DESCRIPTION
+ *  Returns the 64 bit FNV-1a hash of `str'. For an identifier as formatted by
+ *  FORMAT_VL, this is the hash stored in `value_list_t.identity_hash'.
+ */
+uint64_t plugin_hash_string (const char *str);
+
+/*
+ * NAME
+ *  plugin_hash_vl
+ *
+ * DESCRIPTION
+ *  Hashes the identifier of `vl' without formatting it first. The result
+ *  differs from plugin_hash_string() of the formatted identifier.
+ */
+uint64_t plugin_hash_vl (value_list_t const *vl);
+
+/*
+ * NAME
+ *  plugin_value_list_make_writable
+ *
+ * DESCRIPTION
+ *  Value lists are handed to the filter chains without copying them. Targets
+ *  must call this function before they change the value list they have been
+ *  given, be it the values, the identifier or the meta data. Afterwards,
+ *  `vl->values' is a dynamically allocated copy, which the target may also
+ *  free and replace. For value lists which are not being dispatched, this is
+ *  a no-op.
+ *
+ * RETURN VALUE
+ *  Zero on success, ENOMEM if copying failed. The value list must not be
+ *  changed in that case.
+ */
+int plugin_value_list_make_writable (value_list_t *vl);
+
+/*
+ * NAME
+ *  plugin_write_queue_length
+ *  plugin_write_queue_dropped
+ *
+ * DESCRIPTION
+ *  Return the number of value lists currently waiting in the write queue and
+ *  the number of value lists dropped since startup because the queue was
+ *  above its high watermark. See the `WriteQueueLimitHigh',
+ *  `WriteQueueLimitLow' and `WriteQueuePolicy' options.
+ */
+size_t plugin_write_queue_length (void);
+uint64_t plugin_write_queue_dropped (void);
+
+/*
+ * NAME
+ *  plugin_write_queue_peak
+ *
+ * DESCRIPTION
+ *  Returns the greatest length of the write queue since the last call and
+ *  starts over.
+ */
+size_t plugin_write_queue_peak (void);
+
+/*
+ * NAME
+ *  plugin_write_threads_stats
+ *
+ * DESCRIPTION
+ *  Returns the number of write threads currently running and the number of
+ *  times the pool has been grown or shrunk. See the `WriteThreadsMax'
+ *  option. Either pointer may be NULL.
+ */
+void plugin_write_threads_stats (size_t *num, uint64_t *adjustments);
+
+/*
+ * NAME
+ *  plugin_values_dispatched
+ *
+ * DESCRIPTION
+ *  Returns the number of value lists passed to `plugin_dispatch_values' and
+ *  accepted into the write queue since startup.
+ */
+uint64_t plugin_values_dispatched (void);
+
+/*
+ * NAME
+ *  plugin_write_async_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each write callback which has its own,
+ *  asynchronous queue. `length' is the number of value lists waiting in that
+ *  queue, `dropped' the number of value lists discarded because the queue was
+ *  full.
+ */
+void plugin_write_async_stats (void (*callback) (const char *name,
+			size_t length, uint64_t dropped, void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_read_thread_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each read thread. `pool' is the name of the
+ *  thread pool the thread belongs to, the empty string for the default pool,
+ *  and `index' the number of the thread within that pool. `reads' is the
+ *  number of read callbacks the thread has run, `stolen' the number of those
+ *  it took over from another, busy thread and `lag' the total time by which
+ *  they were run later than scheduled. All three are counters since startup.
+ */
+void plugin_read_thread_stats (void (*callback) (const char *pool,
+			size_t index, uint64_t reads, uint64_t stolen, cdtime_t lag,
+			void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_read_timeout_stats
+ *
+ * DESCRIPTION
+ *  Returns the number of read threads which have been replaced because their
+ *  callback exceeded its `ReadTimeout' and which are still stuck in it, and
+ *  the number of timeouts since startup. Either pointer may be NULL.
+ */
+void plugin_read_timeout_stats (size_t *hung, uint64_t *timeouts);
+
+/*
+ * NAME
+ *  plugin_read_func_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each registered read callback. `interval' is the
+ *  configured interval, `effective_interval' the interval the callback is
+ *  currently called in. The latter is doubled every time the callback fails
+ *  and reset once it succeeds. `duration' is the time the last call took.
+ */
+void plugin_read_func_stats (void (*callback) (const char *name,
+			cdtime_t interval, cdtime_t effective_interval,
+			cdtime_t duration, void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_write_latency_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each registered write callback with a histogram
+ *  of the time calls of that callback took. `buckets[i]' is the number of
+ *  calls which took less than 2^i microseconds (and, for i > 0, at least
+ *  2^(i-1) microseconds). The last bucket counts all calls which took longer.
+ *  The counters are not reset.
+ */
+#define PLUGIN_WRITE_LATENCY_BUCKETS 24
+void plugin_write_latency_stats (void (*callback) (const char *name,
+			const uint64_t *buckets, size_t buckets_num,
+			void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_write_delay_stats
+ *
+ * DESCRIPTION
+ *  Like plugin_write_latency_stats(), but the histograms hold the time from
+ *  queueing a value list until the write callback has returned. Only
+ *  available with the "WriteTracing" option; does nothing otherwise.
+ */
+void plugin_write_delay_stats (void (*callback) (const char *name,
+			const uint64_t *buckets, size_t buckets_num,
+			void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_write_queue_wait_stats
+ *
+ * DESCRIPTION
+ *  Copies the histogram of the time value lists spent in the write queue to
+ *  `buckets', using the buckets of plugin_write_latency_stats().
+ *
+ * RETURN VALUE
+ *  Zero on success, non-zero if the "WriteTracing" option is not enabled.
+ */
+int plugin_write_queue_wait_stats (uint64_t *buckets, size_t buckets_num);
+
+/*
+ * NAME
+ *  plugin_write_traces
+ *
+ * DESCRIPTION
+ *  Returns the most recent traces sampled with the "WriteTraceSample"
+ *  option, the oldest first. `written[i]' is the time `writers[i]' had
+ *  written the value list; `dequeued' is zero while the value list is still
+ *  queued. The caller must free `*ret_traces'.
+ *
+ * RETURN VALUE
+ *  Zero on success, EINVAL if tracing is not enabled.
+ */
+#define PLUGIN_WRITE_TRACE_WRITERS 8
+struct plugin_write_trace_s
+{
+	char identity[6 * DATA_MAX_NAME_LEN];
+	cdtime_t enqueued;
+	cdtime_t dequeued;
+	size_t writers_num;
+	char writers[PLUGIN_WRITE_TRACE_WRITERS][DATA_MAX_NAME_LEN];
+	cdtime_t written[PLUGIN_WRITE_TRACE_WRITERS];
+};
+typedef struct plugin_write_trace_s plugin_write_trace_t;
+
+int plugin_write_traces (plugin_write_trace_t **ret_traces,
+		size_t *ret_traces_num);
+
+/*
+ * NAME
+ *  plugin_callback_cpu_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each read, write and flush callback with the
+ *  CPU time the calling threads spent in it. `type' is "read", "write" or
+ *  "flush". Only available with the "CallbackCPUTime" option; does nothing
+ *  otherwise.
+ */
+void plugin_callback_cpu_stats (void (*callback) (const char *type,
+			const char *name, cdtime_t cpu, void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_memory_counter
+ *
+ * DESCRIPTION
+ *  Returns the memory counter called `name', creating it if necessary.
+ *  Plugins add the memory they allocate for a subsystem, e.g. a cache, with
+ *  plugin_memory_add() and subtract it when freeing it again, so the self
+ *  plugin can report it. Counters are never freed; look them up once.
+ *
+ * RETURN VALUE
+ *  The counter or NULL if allocating it failed. plugin_memory_add() accepts
+ *  NULL, too.
+ */
+struct plugin_memory_s;
+typedef struct plugin_memory_s plugin_memory_t;
+plugin_memory_t *plugin_memory_counter (const char *name);
+void plugin_memory_add (plugin_memory_t *m, int64_t bytes);
+
+/*
+ * NAME
+ *  plugin_memory_stats
+ *
+ * DESCRIPTION
+ *  Calls `callback' once for each memory counter and once for the write
+ *  queue, "write_queue", with the number of bytes allocated.
+ */
+void plugin_memory_stats (void (*callback) (const char *name,
+			uint64_t bytes, void *user_data),
+		void *user_data);
+
+/*
+ * NAME
+ *  plugin_overload_stats
+ *
+ * DESCRIPTION
+ *  Returns the factor by which the intervals of low-priority read callbacks
+ *  are currently stretched, one unless the daemon is overloaded, and the
+ *  number of times it has been changed. See the `OverloadQueueLength' and
+ *  `OverloadReadLag' options. Either pointer may be NULL.
+ */
+void plugin_overload_stats (unsigned int *stretch, uint64_t *adjustments);
+
 int plugin_dispatch_notification (const notification_t *notif);
 
+/*
+ * NAME
+ *  plugin_notification_queue_stats
+ *
+ * DESCRIPTION
+ *  Returns the number of notifications waiting for the notification threads,
+ *  the number dropped because the queue was full and the number dropped
+ *  because an identical notification was still queued. See the
+ *  `NotificationThreads' option. Any of the pointers may be NULL.
+ */
+void plugin_notification_queue_stats (size_t *length, uint64_t *dropped,
+		uint64_t *coalesced);
+
 void plugin_log (int level, const char *format, ...)
 	__attribute__ ((format(printf,2,3)));
 
@@ -338,6 +871,17 @@ void plugin_log (int level, const char *format, ...)
 int parse_log_severity (const char *severity);
 int parse_notif_severity (const char *severity);
 
+/*
+ * NAME
+ *  plugin_log_stats
+ *
+ * DESCRIPTION
+ *  Returns the number of log messages dropped because the queue of the
+ *  `LogThread' was full and the number suppressed by `LogRateLimit'. Either
+ *  pointer may be NULL.
+ */
+void plugin_log_stats (uint64_t *dropped, uint64_t *suppressed);
+
 #define ERROR(...)   plugin_log (LOG_ERR,     __VA_ARGS__)
 #define WARNING(...) plugin_log (LOG_WARNING, __VA_ARGS__)
 #define NOTICE(...)  plugin_log (LOG_NOTICE,  __VA_ARGS__)
@@ -116,6 +116,11 @@ typedef struct {
 	_Bool store_rates;
 } c_psql_writer_t;
 
+struct c_psql_database_s;
+
+/* A connection to the server. The first connection of a database is used by
+ * the writers and the read callback, any further connections are used by
+ * one query thread each. */
 typedef struct {
 	PGconn      *conn;
 	c_complain_t conn_complaint;
@@ -123,6 +128,19 @@ typedef struct {
 	int proto_version;
 	int server_version;
 
+	/* statements prepared on this connection, indexed by query first and by
+	 * writer second */
+	_Bool *prepared;
+
+	struct c_psql_database_s *db;
+	pthread_t    thread;
+	unsigned int round;
+} c_psql_conn_t;
+
+typedef struct c_psql_database_s {
+	c_psql_conn_t *conns;
+	int            conns_num;
+
 	int max_params_num;
 
 	/* user configuration */
@@ -133,9 +151,26 @@ typedef struct {
 	c_psql_writer_t **writers;
 	size_t            writers_num;
 
-	/* make sure we don't access the database object in parallel */
+	/* make sure we don't access the database object in parallel; this
+	 * protects the first connection only */
 	pthread_mutex_t   db_lock;
 
+	/* query threads; each round, the read callback and the threads take the
+	 * queries one after another, starting at `pool_next_query' */
+	pthread_mutex_t   pool_lock;
+	pthread_cond_t    pool_cond;
+	pthread_cond_t    pool_done_cond;
+	int               pool_threads_num;
+	int               pool_busy;
+	unsigned int      pool_round;
+	size_t            pool_next_query;
+	_Bool             pool_success;
+	_Bool             pool_started;
+	_Bool             pool_shutdown;
+
+	_Bool prepare;
+	_Bool report_query_times;
+
 	cdtime_t interval;
 
 	/* writer "caching" settings */
@@ -181,7 +216,7 @@ static size_t              writers_num   = 0;
 
 static int c_psql_begin (c_psql_database_t *db)
 {
-	PGresult *r = PQexec (db->conn, "BEGIN");
+	PGresult *r = PQexec (db->conns[0].conn, "BEGIN");
 
 	int status = 1;
 
@@ -192,7 +227,7 @@ static int c_psql_begin (c_psql_database_t *db)
 		}
 		else
 			log_warn ("Failed to initiate ('BEGIN') transaction: %s",
-					PQerrorMessage (db->conn));
+					PQerrorMessage (db->conns[0].conn));
 		PQclear (r);
 	}
 	return status;
@@ -200,7 +235,7 @@ static int c_psql_begin (c_psql_database_t *db)
 
 static int c_psql_commit (c_psql_database_t *db)
 {
-	PGresult *r = PQexec (db->conn, "COMMIT");
+	PGresult *r = PQexec (db->conns[0].conn, "COMMIT");
 
 	int status = 1;
 
@@ -212,7 +247,7 @@ static int c_psql_commit (c_psql_database_t *db)
 		}
 		else
 			log_warn ("Failed to commit transaction: %s",
-					PQerrorMessage (db->conn));
+					PQerrorMessage (db->conns[0].conn));
 		PQclear (r);
 	}
 	return status;
@@ -241,12 +276,8 @@ static c_psql_database_t *c_psql_database_new (const char *name)
 	databases[databases_num] = db;
 	++databases_num;
 
-	db->conn = NULL;
-
-	C_COMPLAIN_INIT (&db->conn_complaint);
-
-	db->proto_version = 0;
-	db->server_version = 0;
+	db->conns     = NULL;
+	db->conns_num = 1;
 
 	db->max_params_num = 0;
 
@@ -259,6 +290,20 @@ static c_psql_database_t *c_psql_database_new (const char *name)
 
 	pthread_mutex_init (&db->db_lock, /* attrs = */ NULL);
 
+	pthread_mutex_init (&db->pool_lock, /* attrs = */ NULL);
+	pthread_cond_init (&db->pool_cond, /* attrs = */ NULL);
+	pthread_cond_init (&db->pool_done_cond, /* attrs = */ NULL);
+	db->pool_threads_num = 0;
+	db->pool_busy        = 0;
+	db->pool_round       = 0;
+	db->pool_next_query  = 0;
+	db->pool_success     = 0;
+	db->pool_started     = 0;
+	db->pool_shutdown    = 0;
+
+	db->prepare            = 0;
+	db->report_query_times = 0;
+
 	db->interval   = 0;
 
 	db->commit_interval = 0;
@@ -293,14 +338,29 @@ static void c_psql_database_delete (void *data)
 	if (db->ref_cnt > 0)
 		return;
 
+	/* stop the query threads; they're waiting for the next round as no read
+	 * callback is running anymore */
+	pthread_mutex_lock (&db->pool_lock);
+	db->pool_shutdown = 1;
+	pthread_cond_broadcast (&db->pool_cond);
+	pthread_mutex_unlock (&db->pool_lock);
+
+	for (i = 1; i <= (size_t)db->pool_threads_num; ++i)
+		pthread_join (db->conns[i].thread, /* retval = */ NULL);
+	db->pool_threads_num = 0;
+
 	/* wait for the lock to be released by the last writer */
 	pthread_mutex_lock (&db->db_lock);
 
-	if (db->next_commit > 0)
+	if ((db->next_commit > 0) && (db->conns != NULL))
 		c_psql_commit (db);
 
-	PQfinish (db->conn);
-	db->conn = NULL;
+	if (db->conns != NULL)
+		for (i = 0; i < (size_t)db->conns_num; ++i) {
+			PQfinish (db->conns[i].conn);
+			sfree (db->conns[i].prepared);
+		}
+	sfree (db->conns);
 
 	if (db->q_prep_areas)
 		for (i = 0; i < db->queries_num; ++i)
@@ -317,6 +377,10 @@ static void c_psql_database_delete (void *data)
 
 	pthread_mutex_destroy (&db->db_lock);
 
+	pthread_cond_destroy (&db->pool_done_cond);
+	pthread_cond_destroy (&db->pool_cond);
+	pthread_mutex_destroy (&db->pool_lock);
+
 	sfree (db->database);
 	sfree (db->host);
 	sfree (db->port);
@@ -338,7 +402,7 @@ static void c_psql_database_delete (void *data)
 	return;
 } /* c_psql_database_delete */
 
-static int c_psql_connect (c_psql_database_t *db)
+static int c_psql_connect (c_psql_database_t *db, c_psql_conn_t *conn)
 {
 	char  conninfo[4096];
 	char *buf     = conninfo;
@@ -362,87 +426,137 @@ static int c_psql_connect (c_psql_database_t *db)
 	C_PSQL_PAR_APPEND (buf, buf_len, "krbsrvname", db->krbsrvname);
 	C_PSQL_PAR_APPEND (buf, buf_len, "service",    db->service);
 
-	db->conn = PQconnectdb (conninfo);
-	db->proto_version = PQprotocolVersion (db->conn);
+	conn->conn = PQconnectdb (conninfo);
+	conn->proto_version = PQprotocolVersion (conn->conn);
 	return 0;
 } /* c_psql_connect */
 
-static int c_psql_check_connection (c_psql_database_t *db)
+/* Prepared statements don't survive a new session. */
+static void c_psql_forget_prepared (c_psql_database_t *db,
+		c_psql_conn_t *conn)
+{
+	if (conn->prepared != NULL)
+		memset (conn->prepared, 0, (db->queries_num + db->writers_num)
+				* sizeof (*conn->prepared));
+} /* c_psql_forget_prepared */
+
+static int c_psql_check_connection (c_psql_database_t *db,
+		c_psql_conn_t *conn)
 {
 	_Bool init = 0;
 
-	if (! db->conn) {
+	if (! conn->conn) {
 		init = 1;
 
 		/* trigger c_release() */
-		if (0 == db->conn_complaint.interval)
-			db->conn_complaint.interval = 1;
+		if (0 == conn->conn_complaint.interval)
+			conn->conn_complaint.interval = 1;
 
-		c_psql_connect (db);
+		c_psql_connect (db, conn);
+		c_psql_forget_prepared (db, conn);
 	}
 
-	if (CONNECTION_OK != PQstatus (db->conn)) {
-		PQreset (db->conn);
+	if (CONNECTION_OK != PQstatus (conn->conn)) {
+		PQreset (conn->conn);
+		c_psql_forget_prepared (db, conn);
 
 		/* trigger c_release() */
-		if (0 == db->conn_complaint.interval)
-			db->conn_complaint.interval = 1;
+		if (0 == conn->conn_complaint.interval)
+			conn->conn_complaint.interval = 1;
 
-		if (CONNECTION_OK != PQstatus (db->conn)) {
-			c_complain (LOG_ERR, &db->conn_complaint,
+		if (CONNECTION_OK != PQstatus (conn->conn)) {
+			c_complain (LOG_ERR, &conn->conn_complaint,
 					"Failed to connect to database %s (%s): %s",
 					db->database, db->instance,
-					PQerrorMessage (db->conn));
+					PQerrorMessage (conn->conn));
 			return -1;
 		}
 
-		db->proto_version = PQprotocolVersion (db->conn);
+		conn->proto_version = PQprotocolVersion (conn->conn);
 	}
 
-	db->server_version = PQserverVersion (db->conn);
+	conn->server_version = PQserverVersion (conn->conn);
 
-	if (c_would_release (&db->conn_complaint)) {
+	if (c_would_release (&conn->conn_complaint)) {
 		char *server_host;
 		int   server_version;
 
-		server_host    = PQhost (db->conn);
-		server_version = PQserverVersion (db->conn);
+		server_host    = PQhost (conn->conn);
+		server_version = PQserverVersion (conn->conn);
 
-		c_do_release (LOG_INFO, &db->conn_complaint,
+		c_do_release (LOG_INFO, &conn->conn_complaint,
 				"Successfully %sconnected to database %s (user %s) "
 				"at server %s%s%s (server version: %d.%d.%d, "
 				"protocol version: %d, pid: %d)", init ? "" : "re",
-				PQdb (db->conn), PQuser (db->conn),
-				C_PSQL_SOCKET3 (server_host, PQport (db->conn)),
+				PQdb (conn->conn), PQuser (conn->conn),
+				C_PSQL_SOCKET3 (server_host, PQport (conn->conn)),
 				C_PSQL_SERVER_VERSION3 (server_version),
-				db->proto_version, PQbackendPID (db->conn));
+				conn->proto_version, PQbackendPID (conn->conn));
 
-		if (3 > db->proto_version)
+		if (3 > conn->proto_version)
 			log_warn ("Protocol version %d does not support parameters.",
-					db->proto_version);
+					conn->proto_version);
 	}
 	return 0;
 } /* c_psql_check_connection */
 
-static PGresult *c_psql_exec_query_noparams (c_psql_database_t *db,
+/* Executes `statement' using the extended query protocol. If prepared
+ * statements have been enabled, the statement is prepared on `conn' the
+ * first time it's used and executed by name afterwards. `idx' identifies the
+ * statement, see c_psql_conn_t.prepared. */
+static PGresult *c_psql_exec_statement (c_psql_database_t *db,
+		c_psql_conn_t *conn, size_t idx, const char *statement,
+		int params_num, const char *const *params)
+{
+	PGresult *res;
+	char name[32];
+
+	if (! db->prepare)
+		return PQexecParams (conn->conn, statement, params_num, NULL,
+				params, NULL, NULL, /* return text data */ 0);
+
+	ssnprintf (name, sizeof (name), "collectd_%zu", idx);
+
+	if (! conn->prepared[idx]) {
+		res = PQprepare (conn->conn, name, statement, params_num,
+				/* param types = */ NULL);
+		/* let the caller report the error */
+		if (PGRES_COMMAND_OK != PQresultStatus (res))
+			return res;
+
+		PQclear (res);
+		conn->prepared[idx] = 1;
+	}
+
+	return PQexecPrepared (conn->conn, name, params_num, params,
+			NULL, NULL, /* return text data */ 0);
+} /* c_psql_exec_statement */
+
+static PGresult *c_psql_exec_query_noparams (c_psql_conn_t *conn,
 		udb_query_t *q)
 {
-	return PQexec (db->conn, udb_query_get_statement (q));
+	return PQexec (conn->conn, udb_query_get_statement (q));
 } /* c_psql_exec_query_noparams */
 
 static PGresult *c_psql_exec_query_params (c_psql_database_t *db,
-		udb_query_t *q, c_psql_user_data_t *data)
+		c_psql_conn_t *conn, size_t idx, c_psql_user_data_t *data)
 {
-	char *params[db->max_params_num];
+	udb_query_t *q = db->queries[idx];
+	char *params[db->max_params_num + 1];
 	char  interval[64];
+	int   params_num;
 	int   i;
 
-	if ((data == NULL) || (data->params_num == 0))
-		return (c_psql_exec_query_noparams (db, q));
+	params_num = (data == NULL) ? 0 : data->params_num;
+
+	/* unlike PQexec, prepared statements may not contain more than
+	 * one command, so keep using it if they're not needed */
+	if ((params_num == 0) && (! db->prepare))
+		return (c_psql_exec_query_noparams (conn, q));
 
-	assert (db->max_params_num >= data->params_num);
+	assert (db->max_params_num >= params_num);
 
-	for (i = 0; i < data->params_num; ++i) {
+	for (i = 0; i < params_num; ++i) {
 		switch (data->params[i]) {
 			case C_PSQL_PARAM_HOST:
 				params[i] = C_PSQL_IS_UNIX_DOMAIN_SOCKET (db->host)
@@ -469,16 +583,39 @@ static PGresult *c_psql_exec_query_params (c_psql_database_t *db,
 		}
 	}
 
-	return PQexecParams (db->conn, udb_query_get_statement (q),
-			data->params_num, NULL,
-			(const char *const *) params,
-			NULL, NULL, /* return text data */ 0);
+	return c_psql_exec_statement (db, conn, idx, udb_query_get_statement (q),
+			params_num, (const char *const *) params);
 } /* c_psql_exec_query_params */
 
-/* db->db_lock must be locked when calling this function */
-static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
-		udb_query_preparation_area_t *prep_area)
+static void c_psql_submit_query_time (c_psql_database_t *db,
+		const char *host, udb_query_t *q, cdtime_t duration)
 {
+	value_t values[1];
+	value_list_t vl = VALUE_LIST_INIT;
+
+	values[0].gauge = CDTIME_T_TO_DOUBLE (duration);
+
+	vl.values = values;
+	vl.values_len = 1;
+	vl.interval = db->interval;
+	sstrncpy (vl.host, host, sizeof (vl.host));
+	sstrncpy (vl.plugin, "postgresql", sizeof (vl.plugin));
+	sstrncpy (vl.plugin_instance, db->instance, sizeof (vl.plugin_instance));
+	sstrncpy (vl.type, "duration", sizeof (vl.type));
+	sstrncpy (vl.type_instance, udb_query_get_name (q),
+			sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* c_psql_submit_query_time */
+
+/* If `conn' is the first connection, db->db_lock must be locked when calling
+ * this function. */
+static int c_psql_exec_query (c_psql_database_t *db, c_psql_conn_t *conn,
+		size_t idx)
+{
+	udb_query_preparation_area_t *prep_area = db->q_prep_areas[idx];
+	udb_query_t *q = db->queries[idx];
+
 	PGresult *res;
 
 	c_psql_user_data_t *data;
@@ -489,6 +626,9 @@ static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
 	char **column_values;
 	int    column_num;
 
+	_Bool shared = (conn == db->conns);
+	cdtime_t start;
+
 	int rows_num;
 	int status;
 	int row, col;
@@ -496,16 +636,18 @@ static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
 	/* The user data may hold parameter information, but may be NULL. */
 	data = udb_query_get_user_data (q);
 
+	start = cdtime ();
+
 	/* Versions up to `3' don't know how to handle parameters. */
-	if (3 <= db->proto_version)
-		res = c_psql_exec_query_params (db, q, data);
+	if (3 <= conn->proto_version)
+		res = c_psql_exec_query_params (db, conn, idx, data);
 	else if ((NULL == data) || (0 == data->params_num))
-		res = c_psql_exec_query_noparams (db, q);
+		res = c_psql_exec_query_noparams (conn, q);
 	else {
 		log_err ("Connection to database \"%s\" (%s) does not support "
 				"parameters (protocol version %d) - "
 				"cannot execute query \"%s\".",
-				db->database, db->instance, db->proto_version,
+				db->database, db->instance, conn->proto_version,
 				udb_query_get_name (q));
 		return -1;
 	}
@@ -513,33 +655,45 @@ static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
 	/* give c_psql_write() a chance to acquire the lock if called recursively
 	 * through dispatch_values(); this will happen if, both, queries and
 	 * writers are configured for a single connection */
-	pthread_mutex_unlock (&db->db_lock);
+	if (shared)
+		pthread_mutex_unlock (&db->db_lock);
 
 	column_names = NULL;
 	column_values = NULL;
 
 	if (PGRES_TUPLES_OK != PQresultStatus (res)) {
-		pthread_mutex_lock (&db->db_lock);
+		if (shared)
+			pthread_mutex_lock (&db->db_lock);
 
-		if ((CONNECTION_OK != PQstatus (db->conn))
-				&& (0 == c_psql_check_connection (db))) {
+		if ((CONNECTION_OK != PQstatus (conn->conn))
+				&& (0 == c_psql_check_connection (db, conn))) {
 			PQclear (res);
-			return c_psql_exec_query (db, q, prep_area);
+			return c_psql_exec_query (db, conn, idx);
 		}
 
 		log_err ("Failed to execute SQL query: %s",
-				PQerrorMessage (db->conn));
+				PQerrorMessage (conn->conn));
 		log_info ("SQL query was: %s",
 				udb_query_get_statement (q));
 		PQclear (res);
 		return -1;
 	}
 
+	if (C_PSQL_IS_UNIX_DOMAIN_SOCKET (db->host)
+			|| (0 == strcmp (db->host, "localhost")))
+		host = hostname_g;
+	else
+		host = db->host;
+
+	if (db->report_query_times)
+		c_psql_submit_query_time (db, host, q, cdtime () - start);
+
 #define BAIL_OUT(status) \
 	sfree (column_names); \
 	sfree (column_values); \
 	PQclear (res); \
-	pthread_mutex_lock (&db->db_lock); \
+	if (shared) \
+		pthread_mutex_lock (&db->db_lock); \
 	return status
 
 	rows_num = PQntuples (res);
@@ -570,12 +724,6 @@ static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
 		}
 	}
 
-	if (C_PSQL_IS_UNIX_DOMAIN_SOCKET (db->host)
-			|| (0 == strcmp (db->host, "localhost")))
-		host = hostname_g;
-	else
-		host = db->host;
-
 	status = udb_query_prepare_result (q, prep_area, host, "postgresql",
 			db->instance, column_names, (size_t) column_num, db->interval);
 	if (0 != status) {
@@ -613,12 +761,99 @@ static int c_psql_exec_query (c_psql_database_t *db, udb_query_t *q,
 #undef BAIL_OUT
 } /* c_psql_exec_query */
 
+/* Executes queries on `conn' until all queries of the current round have
+ * been taken. */
+static void c_psql_exec_queries (c_psql_database_t *db, c_psql_conn_t *conn)
+{
+	while (42) {
+		size_t i;
+
+		pthread_mutex_lock (&db->pool_lock);
+		i = db->pool_next_query;
+		if (i < db->queries_num)
+			++db->pool_next_query;
+		pthread_mutex_unlock (&db->pool_lock);
+
+		if (i >= db->queries_num)
+			break;
+
+		if ((0 != conn->server_version)
+				&& (udb_query_check_version (db->queries[i],
+						conn->server_version) <= 0))
+			continue;
+
+		if (0 == c_psql_exec_query (db, conn, i)) {
+			pthread_mutex_lock (&db->pool_lock);
+			db->pool_success = 1;
+			pthread_mutex_unlock (&db->pool_lock);
+		}
+	}
+} /* c_psql_exec_queries */
+
+static void *c_psql_pool_thread (void *arg)
+{
+	c_psql_conn_t *conn = arg;
+	c_psql_database_t *db = conn->db;
+
+	pthread_mutex_lock (&db->pool_lock);
+	while (42) {
+		while ((! db->pool_shutdown) && (conn->round == db->pool_round))
+			pthread_cond_wait (&db->pool_cond, &db->pool_lock);
+
+		if (db->pool_shutdown)
+			break;
+
+		conn->round = db->pool_round;
+		pthread_mutex_unlock (&db->pool_lock);
+
+		if (0 == c_psql_check_connection (db, conn))
+			c_psql_exec_queries (db, conn);
+
+		pthread_mutex_lock (&db->pool_lock);
+		--db->pool_busy;
+		if (0 == db->pool_busy)
+			pthread_cond_signal (&db->pool_done_cond);
+	}
+	pthread_mutex_unlock (&db->pool_lock);
+
+	return NULL;
+} /* c_psql_pool_thread */
+
+/* Starts one thread for each connection but the first one. This is called
+ * from the read callback, i.e. while no round is in progress. */
+static void c_psql_pool_start (c_psql_database_t *db)
+{
+	int i;
+
+	db->pool_started = 1;
+
+	for (i = 1; i < db->conns_num; ++i) {
+		c_psql_conn_t *conn = db->conns + i;
+		int status;
+
+		conn->round = db->pool_round;
+
+		status = plugin_thread_create (&conn->thread, /* attr = */ NULL,
+				c_psql_pool_thread, conn);
+		if (0 != status) {
+			char errbuf[1024];
+			log_err ("Starting a query thread for database %s (%s) failed: %s",
+					db->database, db->instance,
+					sstrerror (status, errbuf, sizeof (errbuf)));
+			break;
+		}
+
+		pthread_mutex_lock (&db->pool_lock);
+		++db->pool_threads_num;
+		pthread_mutex_unlock (&db->pool_lock);
+	}
+} /* c_psql_pool_start */
+
 static int c_psql_read (user_data_t *ud)
 {
 	c_psql_database_t *db;
 
-	int success = 0;
-	int i;
+	_Bool success;
 
 	if ((ud == NULL) || (ud->data == NULL)) {
 		log_err ("c_psql_read: Invalid user data.");
@@ -631,31 +866,30 @@ static int c_psql_read (user_data_t *ud)
 	assert (NULL != db->instance);
 	assert (NULL != db->queries);
 
-	pthread_mutex_lock (&db->db_lock);
+	if ((db->conns_num > 1) && (! db->pool_started))
+		c_psql_pool_start (db);
 
-	if (0 != c_psql_check_connection (db)) {
-		pthread_mutex_unlock (&db->db_lock);
-		return -1;
-	}
-
-	for (i = 0; i < db->queries_num; ++i)
-	{
-		udb_query_preparation_area_t *prep_area;
-		udb_query_t *q;
-
-		prep_area = db->q_prep_areas[i];
-		q = db->queries[i];
-
-		if ((0 != db->server_version)
-				&& (udb_query_check_version (q, db->server_version) <= 0))
-			continue;
-
-		if (0 == c_psql_exec_query (db, q, prep_area))
-			success = 1;
-	}
+	/* start a new round; the query threads execute queries in parallel to
+	 * the read callback */
+	pthread_mutex_lock (&db->pool_lock);
+	db->pool_next_query = 0;
+	db->pool_success = 0;
+	db->pool_busy = db->pool_threads_num;
+	++db->pool_round;
+	pthread_cond_broadcast (&db->pool_cond);
+	pthread_mutex_unlock (&db->pool_lock);
 
+	pthread_mutex_lock (&db->db_lock);
+	if (0 == c_psql_check_connection (db, db->conns))
+		c_psql_exec_queries (db, db->conns);
 	pthread_mutex_unlock (&db->db_lock);
 
+	pthread_mutex_lock (&db->pool_lock);
+	while (db->pool_busy > 0)
+		pthread_cond_wait (&db->pool_done_cond, &db->pool_lock);
+	success = db->pool_success;
+	pthread_mutex_unlock (&db->pool_lock);
+
 	if (! success)
 		return -1;
 	return 0;
@@ -831,6 +1065,7 @@ static int c_psql_write (const data_set_t *ds, const value_list_t *vl,
 		user_data_t *ud)
 {
 	c_psql_database_t *db;
+	c_psql_conn_t *conn;
 
 	char time_str[32];
 	char values_name_str[1024];
@@ -851,6 +1086,9 @@ static int c_psql_write (const data_set_t *ds, const value_list_t *vl,
 	assert (db->database != NULL);
 	assert (db->writers != NULL);
 
+	/* writers always use the first connection */
+	conn = db->conns;
+
 	if (cdtime_to_iso8601 (time_str, sizeof (time_str), vl->time) == 0) {
 		log_err ("c_psql_write: Failed to convert time to ISO 8601 format");
 		return -1;
@@ -874,7 +1112,7 @@ static int c_psql_write (const data_set_t *ds, const value_list_t *vl,
 
 	pthread_mutex_lock (&db->db_lock);
 
-	if (0 != c_psql_check_connection (db)) {
+	if (0 != c_psql_check_connection (db, conn)) {
 		pthread_mutex_unlock (&db->db_lock);
 		return -1;
 	}
@@ -906,22 +1144,20 @@ static int c_psql_write (const data_set_t *ds, const value_list_t *vl,
 		params[7] = values_type_str;
 		params[8] = values_str;
 
-		res = PQexecParams (db->conn, writer->statement,
-				STATIC_ARRAY_SIZE (params), NULL,
-				(const char *const *)params,
-				NULL, NULL, /* return text data */ 0);
+		res = c_psql_exec_statement (db, conn, db->queries_num + i,
+				writer->statement, STATIC_ARRAY_SIZE (params),
+				(const char *const *)params);
 
 		if ((PGRES_COMMAND_OK != PQresultStatus (res))
 				&& (PGRES_TUPLES_OK != PQresultStatus (res))) {
 			PQclear (res);
 
-			if ((CONNECTION_OK != PQstatus (db->conn))
-					&& (0 == c_psql_check_connection (db))) {
+			if ((CONNECTION_OK != PQstatus (conn->conn))
+					&& (0 == c_psql_check_connection (db, conn))) {
 				/* try again */
-				res = PQexecParams (db->conn, writer->statement,
-						STATIC_ARRAY_SIZE (params), NULL,
-						(const char *const *)params,
-						NULL, NULL, /* return text data */ 0);
+				res = c_psql_exec_statement (db, conn, db->queries_num + i,
+						writer->statement, STATIC_ARRAY_SIZE (params),
+						(const char *const *)params);
 
 				if ((PGRES_COMMAND_OK == PQresultStatus (res))
 						|| (PGRES_TUPLES_OK == PQresultStatus (res))) {
@@ -932,7 +1168,7 @@ static int c_psql_write (const data_set_t *ds, const value_list_t *vl,
 			}
 
 			log_err ("Failed to execute SQL query: %s",
-					PQerrorMessage (db->conn));
+					PQerrorMessage (conn->conn));
 			log_info ("SQL query was: '%s', "
 					"params: %s, %s, %s, %s, %s, %s, %s, %s",
 					writer->statement,
@@ -1241,6 +1477,12 @@ static int c_psql_config_database (oconfig_item_t *ci)
 			cf_util_get_cdtime (c, &db->interval);
 		else if (strcasecmp ("CommitInterval", c->key) == 0)
 			cf_util_get_cdtime (c, &db->commit_interval);
+		else if (strcasecmp ("Connections", c->key) == 0)
+			cf_util_get_int (c, &db->conns_num);
+		else if (strcasecmp ("PreparedStatements", c->key) == 0)
+			cf_util_get_boolean (c, &db->prepare);
+		else if (strcasecmp ("ReportQueryTimes", c->key) == 0)
+			cf_util_get_boolean (c, &db->report_query_times);
 		else
 			log_warn ("Ignoring unknown config key \"%s\".", c->key);
 	}
@@ -1280,6 +1522,41 @@ static int c_psql_config_database (oconfig_item_t *ci)
 		}
 	}
 
+	if (db->conns_num < 1) {
+		log_warn ("Database '%s': 'Connections' must be at least 1.",
+				db->database);
+		db->conns_num = 1;
+	}
+	/* any further connections would never be used */
+	else if ((db->conns_num > 1) && ((size_t)db->conns_num > db->queries_num))
+		db->conns_num = (db->queries_num > 0) ? (int)db->queries_num : 1;
+
+	db->conns = (c_psql_conn_t *) calloc ((size_t)db->conns_num,
+			sizeof (*db->conns));
+	if (db->conns == NULL) {
+		log_err ("Out of memory.");
+		c_psql_database_delete (db);
+		return -1;
+	}
+
+	for (i = 0; i < db->conns_num; ++i) {
+		c_psql_conn_t *conn = db->conns + i;
+
+		C_COMPLAIN_INIT (&conn->conn_complaint);
+		conn->db = db;
+
+		if ((! db->prepare) || (db->queries_num + db->writers_num == 0))
+			continue;
+
+		conn->prepared = (_Bool *) calloc (
+				db->queries_num + db->writers_num, sizeof (*conn->prepared));
+		if (conn->prepared == NULL) {
+			log_err ("Out of memory.");
+			c_psql_database_delete (db);
+			return -1;
+		}
+	}
+
 	ud.data = db;
 	ud.free_func = c_psql_database_delete;
 
@@ -38,6 +38,9 @@
 #include "common.h"
 #include "plugin.h"
 #include "configfile.h"
+#include "utils_avltree.h"
+
+#include <pthread.h>
 
 /* Include header files for the mach system, if they exist.. */
 #if HAVE_THREAD_INFO
@@ -92,6 +95,15 @@
 #  ifndef CONFIG_HZ
 #    define CONFIG_HZ 100
 #  endif
+#  include <sys/syscall.h>
+#  if HAVE_LINUX_CONNECTOR_H && HAVE_LINUX_CN_PROC_H
+#    include <poll.h>
+#    include <sys/socket.h>
+#    include <linux/netlink.h>
+#    include <linux/connector.h>
+#    include <linux/cn_proc.h>
+#    define PS_HAVE_EVENTS 1
+#  endif
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKVM_GETPROCS && HAVE_STRUCT_KINFO_PROC_FREEBSD
@@ -198,6 +210,14 @@ typedef struct procstat
 
 static procstat_t *list_head_g = NULL;
 
+/* Only look at the details of processes whose identity and match result have
+ * been cached. Linux only. */
+static _Bool ps_incremental = 0;
+
+/* Learn about new processes from the kernel's proc connector instead of
+ * listing /proc. Linux only. */
+static _Bool ps_events_enabled = 0;
+
 #if HAVE_THREAD_INFO
 static mach_port_t port_host_self;
 static mach_port_t port_task_self;
@@ -208,6 +228,87 @@ static mach_msg_type_number_t     pset_list_len;
 
 #elif KERNEL_LINUX
 static long pagesize_g;
+
+/* What is known about a process from previous reads. A process is identified
+ * by its PID, start time and name: the name is compared too, because exec(2)
+ * changes neither PID nor start time. */
+typedef struct ps_cache_entry_s
+{
+	int pid;
+	unsigned long long starttime;
+	char name[32];
+	unsigned long generation;
+
+	/* The `Process' and `ProcessMatch' entries the process matches. */
+	procstat_t **matches;
+	size_t matches_num;
+} ps_cache_entry_t;
+
+/* A match found by a shard, added to `list_head_g' once all shards are
+ * done. */
+typedef struct ps_shard_match_s
+{
+	procstat_t *ps;
+	procstat_entry_t entry;
+} ps_shard_match_t;
+
+/* The processes are split into shards by PID, each read by a thread of its
+ * own. Shards only share what is read-only while they run. */
+typedef struct ps_shard_s
+{
+	int *pids;
+	size_t pids_num;
+	size_t pids_size;
+
+	/* Maps PIDs to ps_cache_entry_t. Only used with `IncrementalScan'. */
+	c_avl_tree_t *cache;
+
+	ps_shard_match_t *matches;
+	size_t matches_num;
+	size_t matches_size;
+
+	int running;
+	int sleeping;
+	int zombies;
+	int stopped;
+	int paging;
+	int blocked;
+
+	pthread_t thread;
+	_Bool thread_running;
+} ps_shard_t;
+
+static int ps_read_threads = 1;
+static ps_shard_t *ps_shards = NULL;
+static size_t ps_shards_num = 0;
+
+static unsigned long ps_cache_generation = 0;
+
+static int ps_cache_compare (const void *a, const void *b);
+
+#if PS_HAVE_EVENTS
+typedef struct ps_event_s
+{
+	int pid;
+	_Bool exec;
+} ps_event_t;
+
+/* Events are dropped and /proc is listed again beyond this. */
+#define PS_EVENTS_MAX (1024 * 1024)
+
+static int ps_events_fd = -1;
+static pthread_t ps_events_thread;
+static int ps_events_loop = 0;
+
+static pthread_mutex_t ps_events_lock = PTHREAD_MUTEX_INITIALIZER;
+static ps_event_t *ps_events = NULL;
+static size_t ps_events_num = 0;
+static size_t ps_events_size = 0;
+static _Bool ps_events_rescan = 1;
+static derive_t ps_events_forks = 0;
+
+static int ps_events_start (void);
+#endif
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKVM_GETPROCS && HAVE_STRUCT_KINFO_PROC_FREEBSD
@@ -331,143 +432,153 @@ static int ps_list_match (const char *name, const char *cmdline, procstat_t *ps)
 	return (0);
 } /* int ps_list_match */
 
-/* add process entry to 'instances' of process 'name' (or refresh it) */
-static void ps_list_add (const char *name, const char *cmdline, procstat_entry_t *entry)
+/* add process entry to the 'instances' of 'ps' (or refresh it) */
+static void ps_list_add_entry (procstat_t *ps, procstat_entry_t *entry)
 {
-	procstat_t *ps;
 	procstat_entry_t *pse;
 
-	if (entry->id == 0)
-		return;
+	for (pse = ps->instances; pse != NULL; pse = pse->next)
+		if ((pse->id == entry->id) || (pse->next == NULL))
+			break;
 
-	for (ps = list_head_g; ps != NULL; ps = ps->next)
+	if ((pse == NULL) || (pse->id != entry->id))
 	{
-		if ((ps_list_match (name, cmdline, ps)) == 0)
-			continue;
+		procstat_entry_t *new;
 
-		for (pse = ps->instances; pse != NULL; pse = pse->next)
-			if ((pse->id == entry->id) || (pse->next == NULL))
-				break;
+		new = (procstat_entry_t *) malloc (sizeof (procstat_entry_t));
+		if (new == NULL)
+			return;
+		memset (new, 0, sizeof (procstat_entry_t));
+		new->id = entry->id;
 
-		if ((pse == NULL) || (pse->id != entry->id))
-		{
-			procstat_entry_t *new;
+		if (pse == NULL)
+			ps->instances = new;
+		else
+			pse->next = new;
 
-			new = (procstat_entry_t *) malloc (sizeof (procstat_entry_t));
-			if (new == NULL)
-				return;
-			memset (new, 0, sizeof (procstat_entry_t));
-			new->id = entry->id;
+		pse = new;
+	}
 
-			if (pse == NULL)
-				ps->instances = new;
-			else
-				pse->next = new;
+	pse->age = 0;
+	pse->num_proc   = entry->num_proc;
+	pse->num_lwp    = entry->num_lwp;
+	pse->vmem_size  = entry->vmem_size;
+	pse->vmem_rss   = entry->vmem_rss;
+	pse->vmem_data  = entry->vmem_data;
+	pse->vmem_code  = entry->vmem_code;
+	pse->stack_size = entry->stack_size;
+	pse->io_rchar   = entry->io_rchar;
+	pse->io_wchar   = entry->io_wchar;
+	pse->io_syscr   = entry->io_syscr;
+	pse->io_syscw   = entry->io_syscw;
+
+	ps->num_proc   += pse->num_proc;
+	ps->num_lwp    += pse->num_lwp;
+	ps->vmem_size  += pse->vmem_size;
+	ps->vmem_rss   += pse->vmem_rss;
+	ps->vmem_data  += pse->vmem_data;
+	ps->vmem_code  += pse->vmem_code;
+	ps->stack_size += pse->stack_size;
+
+	ps->io_rchar   += ((pse->io_rchar == -1)?0:pse->io_rchar);
+	ps->io_wchar   += ((pse->io_wchar == -1)?0:pse->io_wchar);
+	ps->io_syscr   += ((pse->io_syscr == -1)?0:pse->io_syscr);
+	ps->io_syscw   += ((pse->io_syscw == -1)?0:pse->io_syscw);
+
+	if ((entry->vmem_minflt_counter == 0)
+			&& (entry->vmem_majflt_counter == 0))
+	{
+		pse->vmem_minflt_counter += entry->vmem_minflt;
+		pse->vmem_minflt = entry->vmem_minflt;
 
-			pse = new;
+		pse->vmem_majflt_counter += entry->vmem_majflt;
+		pse->vmem_majflt = entry->vmem_majflt;
+	}
+	else
+	{
+		if (entry->vmem_minflt_counter < pse->vmem_minflt_counter)
+		{
+			pse->vmem_minflt = entry->vmem_minflt_counter
+				+ (ULONG_MAX - pse->vmem_minflt_counter);
 		}
-
-		pse->age = 0;
-		pse->num_proc   = entry->num_proc;
-		pse->num_lwp    = entry->num_lwp;
-		pse->vmem_size  = entry->vmem_size;
-		pse->vmem_rss   = entry->vmem_rss;
-		pse->vmem_data  = entry->vmem_data;
-		pse->vmem_code  = entry->vmem_code;
-		pse->stack_size = entry->stack_size;
-		pse->io_rchar   = entry->io_rchar;
-		pse->io_wchar   = entry->io_wchar;
-		pse->io_syscr   = entry->io_syscr;
-		pse->io_syscw   = entry->io_syscw;
-
-		ps->num_proc   += pse->num_proc;
-		ps->num_lwp    += pse->num_lwp;
-		ps->vmem_size  += pse->vmem_size;
-		ps->vmem_rss   += pse->vmem_rss;
-		ps->vmem_data  += pse->vmem_data;
-		ps->vmem_code  += pse->vmem_code;
-		ps->stack_size += pse->stack_size;
-
-		ps->io_rchar   += ((pse->io_rchar == -1)?0:pse->io_rchar);
-		ps->io_wchar   += ((pse->io_wchar == -1)?0:pse->io_wchar);
-		ps->io_syscr   += ((pse->io_syscr == -1)?0:pse->io_syscr);
-		ps->io_syscw   += ((pse->io_syscw == -1)?0:pse->io_syscw);
-
-		if ((entry->vmem_minflt_counter == 0)
-				&& (entry->vmem_majflt_counter == 0))
+		else
 		{
-			pse->vmem_minflt_counter += entry->vmem_minflt;
-			pse->vmem_minflt = entry->vmem_minflt;
+			pse->vmem_minflt = entry->vmem_minflt_counter - pse->vmem_minflt_counter;
+		}
+		pse->vmem_minflt_counter = entry->vmem_minflt_counter;
 
-			pse->vmem_majflt_counter += entry->vmem_majflt;
-			pse->vmem_majflt = entry->vmem_majflt;
+		if (entry->vmem_majflt_counter < pse->vmem_majflt_counter)
+		{
+			pse->vmem_majflt = entry->vmem_majflt_counter
+				+ (ULONG_MAX - pse->vmem_majflt_counter);
 		}
 		else
 		{
-			if (entry->vmem_minflt_counter < pse->vmem_minflt_counter)
-			{
-				pse->vmem_minflt = entry->vmem_minflt_counter
-					+ (ULONG_MAX - pse->vmem_minflt_counter);
-			}
-			else
-			{
-				pse->vmem_minflt = entry->vmem_minflt_counter - pse->vmem_minflt_counter;
-			}
-			pse->vmem_minflt_counter = entry->vmem_minflt_counter;
-
-			if (entry->vmem_majflt_counter < pse->vmem_majflt_counter)
-			{
-				pse->vmem_majflt = entry->vmem_majflt_counter
-					+ (ULONG_MAX - pse->vmem_majflt_counter);
-			}
-			else
-			{
-				pse->vmem_majflt = entry->vmem_majflt_counter - pse->vmem_majflt_counter;
-			}
-			pse->vmem_majflt_counter = entry->vmem_majflt_counter;
+			pse->vmem_majflt = entry->vmem_majflt_counter - pse->vmem_majflt_counter;
 		}
+		pse->vmem_majflt_counter = entry->vmem_majflt_counter;
+	}
 
-		ps->vmem_minflt_counter += pse->vmem_minflt;
-		ps->vmem_majflt_counter += pse->vmem_majflt;
+	ps->vmem_minflt_counter += pse->vmem_minflt;
+	ps->vmem_majflt_counter += pse->vmem_majflt;
 
-		if ((entry->cpu_user_counter == 0)
-				&& (entry->cpu_system_counter == 0))
-		{
-			pse->cpu_user_counter += entry->cpu_user;
-			pse->cpu_user = entry->cpu_user;
+	if ((entry->cpu_user_counter == 0)
+			&& (entry->cpu_system_counter == 0))
+	{
+		pse->cpu_user_counter += entry->cpu_user;
+		pse->cpu_user = entry->cpu_user;
 
-			pse->cpu_system_counter += entry->cpu_system;
-			pse->cpu_system = entry->cpu_system;
+		pse->cpu_system_counter += entry->cpu_system;
+		pse->cpu_system = entry->cpu_system;
+	}
+	else
+	{
+		if (entry->cpu_user_counter < pse->cpu_user_counter)
+		{
+			pse->cpu_user = entry->cpu_user_counter
+				+ (ULONG_MAX - pse->cpu_user_counter);
 		}
 		else
 		{
-			if (entry->cpu_user_counter < pse->cpu_user_counter)
-			{
-				pse->cpu_user = entry->cpu_user_counter
-					+ (ULONG_MAX - pse->cpu_user_counter);
-			}
-			else
-			{
-				pse->cpu_user = entry->cpu_user_counter - pse->cpu_user_counter;
-			}
-			pse->cpu_user_counter = entry->cpu_user_counter;
+			pse->cpu_user = entry->cpu_user_counter - pse->cpu_user_counter;
+		}
+		pse->cpu_user_counter = entry->cpu_user_counter;
 
-			if (entry->cpu_system_counter < pse->cpu_system_counter)
-			{
-				pse->cpu_system = entry->cpu_system_counter
-					+ (ULONG_MAX - pse->cpu_system_counter);
-			}
-			else
-			{
-				pse->cpu_system = entry->cpu_system_counter - pse->cpu_system_counter;
-			}
-			pse->cpu_system_counter = entry->cpu_system_counter;
+		if (entry->cpu_system_counter < pse->cpu_system_counter)
+		{
+			pse->cpu_system = entry->cpu_system_counter
+				+ (ULONG_MAX - pse->cpu_system_counter);
+		}
+		else
+		{
+			pse->cpu_system = entry->cpu_system_counter - pse->cpu_system_counter;
 		}
+		pse->cpu_system_counter = entry->cpu_system_counter;
+	}
+
+	ps->cpu_user_counter   += pse->cpu_user;
+	ps->cpu_system_counter += pse->cpu_system;
+} /* void ps_list_add_entry */
+
+#if !KERNEL_LINUX
+/* add process entry to 'instances' of process 'name' (or refresh it). On
+ * Linux, matches are collected per shard instead, see ps_shard_read(). */
+static void ps_list_add (const char *name, const char *cmdline, procstat_entry_t *entry)
+{
+	procstat_t *ps;
+
+	if (entry->id == 0)
+		return;
+
+	for (ps = list_head_g; ps != NULL; ps = ps->next)
+	{
+		if ((ps_list_match (name, cmdline, ps)) == 0)
+			continue;
 
-		ps->cpu_user_counter   += pse->cpu_user;
-		ps->cpu_system_counter += pse->cpu_system;
+		ps_list_add_entry (ps, entry);
 	}
 }
+#endif /* !KERNEL_LINUX */
 
 /* remove old entries from instances of processes in list_head_g */
 static void ps_list_reset (void)
@@ -573,6 +684,53 @@ static int ps_config (oconfig_item_t *ci)
 			ps_list_register (c->values[0].value.string,
 					c->values[1].value.string);
 		}
+		else if (strcasecmp (c->key, "ReadThreads") == 0)
+		{
+			int tmp = ps_read_threads;
+
+			if (cf_util_get_int (c, &tmp) != 0)
+				continue;
+			if (tmp < 1)
+			{
+				ERROR ("processes plugin: `ReadThreads' must be at "
+						"least 1.");
+				continue;
+			}
+			ps_read_threads = tmp;
+#if !KERNEL_LINUX
+			if (ps_read_threads > 1)
+			{
+				WARNING ("processes plugin: The `ReadThreads' option "
+						"is only supported on Linux and will be ignored.");
+				ps_read_threads = 1;
+			}
+#endif
+		}
+		else if (strcasecmp (c->key, "ProcessEvents") == 0)
+		{
+			cf_util_get_boolean (c, &ps_events_enabled);
+#if !KERNEL_LINUX || !PS_HAVE_EVENTS
+			if (ps_events_enabled)
+			{
+				WARNING ("processes plugin: The `ProcessEvents' option "
+						"is not supported on this system and will be "
+						"ignored.");
+				ps_events_enabled = 0;
+			}
+#endif
+		}
+		else if (strcasecmp (c->key, "IncrementalScan") == 0)
+		{
+			cf_util_get_boolean (c, &ps_incremental);
+#if !KERNEL_LINUX
+			if (ps_incremental)
+			{
+				WARNING ("processes plugin: The `IncrementalScan' option "
+						"is only supported on Linux and will be ignored.");
+				ps_incremental = 0;
+			}
+#endif
+		}
 		else
 		{
 			ERROR ("processes plugin: The `%s' configuration option is not "
@@ -614,9 +772,49 @@ static int ps_init (void)
 /* #endif HAVE_THREAD_INFO */
 
 #elif KERNEL_LINUX
+	size_t i;
+
 	pagesize_g = sysconf(_SC_PAGESIZE);
 	DEBUG ("pagesize_g = %li; CONFIG_HZ = %i;",
 			pagesize_g, CONFIG_HZ);
+
+	if (ps_shards == NULL)
+	{
+		ps_shards = calloc ((size_t) ps_read_threads, sizeof (*ps_shards));
+		if (ps_shards == NULL)
+		{
+			ERROR ("processes plugin: calloc failed.");
+			return (-1);
+		}
+		ps_shards_num = (size_t) ps_read_threads;
+	}
+
+#if PS_HAVE_EVENTS
+	/* Event mode builds on the cache of the incremental scan. */
+	if (ps_events_enabled && (ps_events_fd < 0))
+	{
+		if (ps_events_start () == 0)
+			ps_incremental = 1;
+		else
+		{
+			WARNING ("processes plugin: Falling back to scanning /proc.");
+			ps_events_enabled = 0;
+		}
+	}
+#endif
+
+	for (i = 0; i < ps_shards_num; i++)
+	{
+		if (!ps_incremental || (ps_shards[i].cache != NULL))
+			continue;
+
+		ps_shards[i].cache = c_avl_create (ps_cache_compare);
+		if (ps_shards[i].cache == NULL)
+		{
+			ERROR ("processes plugin: c_avl_create failed.");
+			return (-1);
+		}
+	}
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKVM_GETPROCS && HAVE_STRUCT_KINFO_PROC_FREEBSD
@@ -904,7 +1102,10 @@ static procstat_t *ps_read_io (int pid, procstat_t *ps)
 	return (ps);
 } /* procstat_t *ps_read_io */
 
-int ps_read_process (int pid, procstat_t *ps, char *state)
+/* Parses /proc/<pid>/stat. The number of threads is taken from the stat file
+ * too, the other files are left to the caller. */
+static int ps_read_stat (int pid, procstat_t *ps, char *state,
+		unsigned long long *starttime)
 {
 	char  filename[64];
 	char  buffer[1024];
@@ -979,6 +1180,7 @@ int ps_read_process (int pid, procstat_t *ps, char *state)
 	}
 
 	*state = fields[0][0];
+	*starttime = atoll (fields[19]);
 
 	if (*state == 'Z')
 	{
@@ -987,11 +1189,9 @@ int ps_read_process (int pid, procstat_t *ps, char *state)
 	}
 	else
 	{
-		if ( (ps->num_lwp = ps_read_tasks (pid)) == -1 )
-		{
-			/* returns -1 => kernel 2.4 */
+		ps->num_lwp  = atol (fields[17]);
+		if (ps->num_lwp < 1)
 			ps->num_lwp = 1;
-		}
 		ps->num_proc = 1;
 	}
 
@@ -1024,6 +1224,19 @@ int ps_read_process (int pid, procstat_t *ps, char *state)
 	cpu_system_counter = cpu_system_counter * 1000000 / CONFIG_HZ;
 	vmem_rss = vmem_rss * pagesize_g;
 
+	ps->cpu_user_counter = cpu_user_counter;
+	ps->cpu_system_counter = cpu_system_counter;
+	ps->vmem_size = (unsigned long) vmem_size;
+	ps->vmem_rss = (unsigned long) vmem_rss;
+	ps->stack_size = (unsigned long) stack_size;
+
+	/* success */
+	return (0);
+} /* int ps_read_stat */
+
+/* Reads /proc/<pid>/status and /proc/<pid>/io into "ps". */
+static void ps_read_details (int pid, procstat_t *ps)
+{
 	if ( (ps_read_vmem(pid, ps)) == NULL)
 	{
 		/* No VMem data */
@@ -1032,12 +1245,6 @@ int ps_read_process (int pid, procstat_t *ps, char *state)
 		DEBUG("ps_read_process: did not get vmem data for pid %i",pid);
 	}
 
-	ps->cpu_user_counter = cpu_user_counter;
-	ps->cpu_system_counter = cpu_system_counter;
-	ps->vmem_size = (unsigned long) vmem_size;
-	ps->vmem_rss = (unsigned long) vmem_rss;
-	ps->stack_size = (unsigned long) stack_size;
-
 	if ( (ps_read_io (pid, ps)) == NULL)
 	{
 		/* no io data */
@@ -1048,6 +1255,27 @@ int ps_read_process (int pid, procstat_t *ps, char *state)
 
 		DEBUG("ps_read_process: not get io data for pid %i",pid);
 	}
+} /* void ps_read_details */
+
+int ps_read_process (int pid, procstat_t *ps, char *state)
+{
+	unsigned long long starttime;
+	int num_lwp;
+	int status;
+
+	status = ps_read_stat (pid, ps, state, &starttime);
+	if (status != 0)
+		return (status);
+
+	/* Zombies have no details. */
+	if (ps->num_proc == 0)
+		return (0);
+
+	/* returns -1 => kernel 2.4 */
+	if ((num_lwp = ps_read_tasks (pid)) != -1)
+		ps->num_lwp = num_lwp;
+
+	ps_read_details (pid, ps);
 
 	/* success */
 	return (0);
@@ -1192,96 +1420,816 @@ static int read_fork_rate ()
 	ps_submit_fork_rate (value.derive);
 	return (0);
 }
-#endif /*KERNEL_LINUX */
 
-#if KERNEL_SOLARIS
-static const char *ps_get_cmdline (pid_t pid, /* {{{ */
-		char *buffer, size_t buffer_size)
+#ifdef SYS_getdents64
+struct ps_dirent64
 {
-	char path[PATH_MAX];
-	psinfo_t info;
-	int status;
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+#endif
 
-	snprintf(path, sizeof (path), "/proc/%i/psinfo", pid);
+/* Adds "pid" to the shard it belongs to. */
+static int ps_pids_append (int pid)
+{
+	ps_shard_t *shard = ps_shards + (pid % ps_shards_num);
 
-	status = read_file_contents (path, (void *) &info, sizeof (info));
-	if (status != ((int) buffer_size))
+	if (shard->pids_num >= shard->pids_size)
 	{
-		ERROR ("processes plugin: Unexpected return value "
-				"while reading \"%s\": "
-				"Returned %i but expected %zu.",
-				path, status, buffer_size);
-		return (NULL);
-	}
+		size_t new_size = (shard->pids_size == 0)
+			? 1024 : 2 * shard->pids_size;
+		int *tmp;
 
-	info.pr_psargs[sizeof (info.pr_psargs) - 1] = 0;
-	sstrncpy (buffer, info.pr_psargs, buffer_size);
+		tmp = realloc (shard->pids, new_size * sizeof (*shard->pids));
+		if (tmp == NULL)
+		{
+			ERROR ("processes plugin: realloc failed.");
+			return (-1);
+		}
+		shard->pids = tmp;
+		shard->pids_size = new_size;
+	}
 
-	return (buffer);
-} /* }}} int ps_get_cmdline */
+	shard->pids[shard->pids_num] = pid;
+	shard->pids_num++;
+	return (0);
+} /* int ps_pids_append */
 
-/*
- * Reads process information on the Solaris OS. The information comes mainly from
- * /proc/PID/status, /proc/PID/psinfo and /proc/PID/usage
- * The values for input and ouput chars are calculated "by hand"
- * Added a few "solaris" specific process states as well
- */
-static int ps_read_process(int pid, procstat_t *ps, char *state)
+/* Lists the PIDs in /proc into the shards. With getdents64(2) and a buffer
+ * on the stack, this takes one system call per few hundred processes instead
+ * of going through readdir(3)'s heap allocated buffer. */
+static int ps_list_pids (void)
 {
-	char filename[64];
-	char f_psinfo[64], f_usage[64];
-	char *buffer;
+	size_t i;
+	int pid;
 
-	pstatus_t *myStatus;
-	psinfo_t *myInfo;
-	prusage_t *myUsage;
+	for (i = 0; i < ps_shards_num; i++)
+		ps_shards[i].pids_num = 0;
 
-	snprintf(filename, sizeof (filename), "/proc/%i/status", pid);
-	snprintf(f_psinfo, sizeof (f_psinfo), "/proc/%i/psinfo", pid);
-	snprintf(f_usage, sizeof (f_usage), "/proc/%i/usage", pid);
+#ifdef SYS_getdents64
+	char buffer[32768] __attribute__((aligned(8)));
+	int fd;
 
+	fd = open ("/proc", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+	{
+		char errbuf[1024];
+		ERROR ("Cannot open `/proc': %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
 
-	buffer = malloc(sizeof (pstatus_t));
-	memset(buffer, 0, sizeof (pstatus_t));
-	read_file_contents(filename, buffer, sizeof (pstatus_t));
-	myStatus = (pstatus_t *) buffer;
+	while (42)
+	{
+		long status;
+		long offset;
 
-	buffer = malloc(sizeof (psinfo_t));
-	memset(buffer, 0, sizeof(psinfo_t));
-	read_file_contents(f_psinfo, buffer, sizeof (psinfo_t));
-	myInfo = (psinfo_t *) buffer;
+		status = syscall (SYS_getdents64, fd, buffer, sizeof (buffer));
+		if (status < 0)
+		{
+			char errbuf[1024];
 
-	buffer = malloc(sizeof (prusage_t));
-	memset(buffer, 0, sizeof(prusage_t));
-	read_file_contents(f_usage, buffer, sizeof (prusage_t));
-	myUsage = (prusage_t *) buffer;
+			if (errno == EINTR)
+				continue;
 
-	sstrncpy(ps->name, myInfo->pr_fname, sizeof (myInfo->pr_fname));
-	ps->num_lwp = myStatus->pr_nlwp;
-	if (myInfo->pr_wstat != 0) {
-		ps->num_proc = 0;
-		ps->num_lwp = 0;
-		*state = (char) 'Z';
-		return (0);
-	} else {
-		ps->num_proc = 1;
-		ps->num_lwp = myInfo->pr_nlwp;
-	}
+			ERROR ("processes plugin: getdents64 (/proc) failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			close (fd);
+			return (-1);
+		}
+		else if (status == 0)
+			break;
 
-	/*
-	 * Convert system time and user time from nanoseconds to microseconds
-	 * for compatibility with the linux module
-	 */
-	ps->cpu_system_counter = myStatus -> pr_stime.tv_nsec / 1000;
-	ps->cpu_user_counter = myStatus -> pr_utime.tv_nsec / 1000;
+		for (offset = 0; offset < status; )
+		{
+			struct ps_dirent64 *ent = (void *) (buffer + offset);
 
-	/*
-	 * Convert rssize from KB to bytes to be consistent w/ the linux module
-	 */
-	ps->vmem_rss = myInfo->pr_rssize * 1024;
-	ps->vmem_size = myInfo->pr_size * 1024;
-	ps->vmem_minflt_counter = myUsage->pr_minf;
-	ps->vmem_majflt_counter = myUsage->pr_majf;
+			offset += ent->d_reclen;
+
+			if (!isdigit ((int) ent->d_name[0]))
+				continue;
+
+			if ((pid = atoi (ent->d_name)) < 1)
+				continue;
+
+			if (ps_pids_append (pid) != 0)
+				break;
+		}
+	}
+
+	close (fd);
+#else /* !SYS_getdents64 */
+	struct dirent *ent;
+	DIR           *proc;
+
+	if ((proc = opendir ("/proc")) == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("Cannot open `/proc': %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while ((ent = readdir (proc)) != NULL)
+	{
+		if (!isdigit (ent->d_name[0]))
+			continue;
+
+		if ((pid = atoi (ent->d_name)) < 1)
+			continue;
+
+		if (ps_pids_append (pid) != 0)
+			break;
+	}
+
+	closedir (proc);
+#endif /* !SYS_getdents64 */
+
+	return (0);
+} /* int ps_list_pids */
+
+static int ps_cache_compare (const void *a, const void *b)
+{
+	int pid_a = *((const int *) a);
+	int pid_b = *((const int *) b);
+
+	if (pid_a < pid_b)
+		return (-1);
+	else if (pid_a > pid_b)
+		return (1);
+	return (0);
+} /* int ps_cache_compare */
+
+static void ps_cache_entry_free (ps_cache_entry_t *ce)
+{
+	if (ce == NULL)
+		return;
+
+	sfree (ce->matches);
+	sfree (ce);
+} /* void ps_cache_entry_free */
+
+/* Determines the `Process' and `ProcessMatch' entries a process matches.
+ * The command line is only read if there is a `ProcessMatch' entry. */
+static int ps_cache_entry_match (ps_cache_entry_t *ce,
+		char *cmdline, size_t cmdline_size)
+{
+	procstat_t *ps;
+	const char *cmdline_ptr = NULL;
+	_Bool cmdline_read = 0;
+	size_t num = 0;
+
+	sfree (ce->matches);
+	ce->matches_num = 0;
+
+	for (ps = list_head_g; ps != NULL; ps = ps->next)
+	{
+#if HAVE_REGEX_H
+		if ((ps->re != NULL) && !cmdline_read)
+		{
+			cmdline_ptr = ps_get_cmdline (ce->pid, ce->name,
+					cmdline, cmdline_size);
+			cmdline_read = 1;
+		}
+#endif
+		if (ps_list_match (ce->name, cmdline_ptr, ps))
+			num++;
+	}
+
+	if (num == 0)
+		return (0);
+
+	ce->matches = calloc (num, sizeof (*ce->matches));
+	if (ce->matches == NULL)
+	{
+		ERROR ("processes plugin: calloc failed.");
+		return (-1);
+	}
+
+	for (ps = list_head_g; ps != NULL; ps = ps->next)
+		if (ps_list_match (ce->name, cmdline_ptr, ps))
+			ce->matches[ce->matches_num++] = ps;
+
+	return (0);
+} /* int ps_cache_entry_match */
+
+/* Returns the cache entry of "pid", creating or updating it if the process
+ * is new or has been replaced since the last read. */
+static ps_cache_entry_t *ps_cache_get (ps_shard_t *shard, int pid,
+		const char *name, unsigned long long starttime,
+		char *cmdline, size_t cmdline_size)
+{
+	ps_cache_entry_t *ce = NULL;
+
+	if (c_avl_get (shard->cache, &pid, (void *) &ce) == 0)
+	{
+		if ((ce->starttime == starttime)
+				&& (strncmp (ce->name, name, sizeof (ce->name)) == 0))
+		{
+			ce->generation = ps_cache_generation;
+			return (ce);
+		}
+	}
+	else
+	{
+		ce = calloc (1, sizeof (*ce));
+		if (ce == NULL)
+		{
+			ERROR ("processes plugin: calloc failed.");
+			return (NULL);
+		}
+		ce->pid = pid;
+
+		if (c_avl_insert (shard->cache, &ce->pid, ce) != 0)
+		{
+			ERROR ("processes plugin: c_avl_insert failed.");
+			ps_cache_entry_free (ce);
+			return (NULL);
+		}
+	}
+
+	ce->starttime = starttime;
+	sstrncpy (ce->name, name, sizeof (ce->name));
+	ce->generation = ps_cache_generation;
+	ps_cache_entry_match (ce, cmdline, cmdline_size);
+
+	return (ce);
+} /* ps_cache_entry_t *ps_cache_get */
+
+/* Removes the entries of processes which have not been seen by the last
+ * read. */
+static void ps_cache_expire (ps_shard_t *shard)
+{
+	c_avl_iterator_t *iter;
+	ps_cache_entry_t **expired;
+	ps_cache_entry_t *ce;
+	size_t expired_num = 0;
+	size_t i;
+	int *pid;
+
+	expired = calloc ((size_t) c_avl_size (shard->cache) + 1,
+			sizeof (*expired));
+	if (expired == NULL)
+	{
+		ERROR ("processes plugin: calloc failed.");
+		return;
+	}
+
+	iter = c_avl_get_iterator (shard->cache);
+	while (c_avl_iterator_next (iter, (void *) &pid, (void *) &ce) == 0)
+		if (ce->generation != ps_cache_generation)
+			expired[expired_num++] = ce;
+	c_avl_iterator_destroy (iter);
+
+	for (i = 0; i < expired_num; i++)
+	{
+		c_avl_remove (shard->cache, &expired[i]->pid, NULL, NULL);
+		ps_cache_entry_free (expired[i]);
+	}
+
+	sfree (expired);
+} /* void ps_cache_expire */
+
+static void ps_fill_entry (procstat_entry_t *pse, int pid,
+		procstat_t const *ps)
+{
+	pse->id       = pid;
+	pse->age      = 0;
+
+	pse->num_proc   = ps->num_proc;
+	pse->num_lwp    = ps->num_lwp;
+	pse->vmem_size  = ps->vmem_size;
+	pse->vmem_rss   = ps->vmem_rss;
+	pse->vmem_data  = ps->vmem_data;
+	pse->vmem_code  = ps->vmem_code;
+	pse->stack_size = ps->stack_size;
+
+	pse->vmem_minflt = 0;
+	pse->vmem_minflt_counter = ps->vmem_minflt_counter;
+	pse->vmem_majflt = 0;
+	pse->vmem_majflt_counter = ps->vmem_majflt_counter;
+
+	pse->cpu_user = 0;
+	pse->cpu_user_counter = ps->cpu_user_counter;
+	pse->cpu_system = 0;
+	pse->cpu_system_counter = ps->cpu_system_counter;
+
+	pse->io_rchar = ps->io_rchar;
+	pse->io_wchar = ps->io_wchar;
+	pse->io_syscr = ps->io_syscr;
+	pse->io_syscw = ps->io_syscw;
+} /* void ps_fill_entry */
+
+/* Remembers that the process "pse" belongs to "ps". */
+static int ps_shard_add (ps_shard_t *shard, procstat_t *ps,
+		procstat_entry_t const *pse)
+{
+	if (shard->matches_num >= shard->matches_size)
+	{
+		size_t new_size = (shard->matches_size == 0)
+			? 16 : 2 * shard->matches_size;
+		ps_shard_match_t *tmp;
+
+		tmp = realloc (shard->matches, new_size * sizeof (*shard->matches));
+		if (tmp == NULL)
+		{
+			ERROR ("processes plugin: realloc failed.");
+			return (-1);
+		}
+		shard->matches = tmp;
+		shard->matches_size = new_size;
+	}
+
+	shard->matches[shard->matches_num].ps = ps;
+	memcpy (&shard->matches[shard->matches_num].entry, pse, sizeof (*pse));
+	shard->matches_num++;
+	return (0);
+} /* int ps_shard_add */
+
+/* Reads all files of "pid" and matches it against all entries. */
+static int ps_read_pid (ps_shard_t *shard, int pid,
+		char *cmdline, size_t cmdline_size, char *state)
+{
+	procstat_t ps;
+	procstat_entry_t pse;
+	procstat_t *ps_ptr;
+	const char *cmdline_ptr;
+	int status;
+
+	status = ps_read_process (pid, &ps, state);
+	if (status != 0)
+	{
+		DEBUG ("ps_read_process failed: %i", status);
+		return (status);
+	}
+
+	ps_fill_entry (&pse, pid, &ps);
+	cmdline_ptr = ps_get_cmdline (pid, ps.name, cmdline, cmdline_size);
+
+	for (ps_ptr = list_head_g; ps_ptr != NULL; ps_ptr = ps_ptr->next)
+		if (ps_list_match (ps.name, cmdline_ptr, ps_ptr))
+			ps_shard_add (shard, ps_ptr, &pse);
+
+	return (0);
+} /* int ps_read_pid */
+
+/* Reads only the stat file of "pid", unless it matches an entry according to
+ * the cache. */
+static int ps_read_pid_incremental (ps_shard_t *shard, int pid,
+		char *cmdline, size_t cmdline_size, char *state)
+{
+	procstat_t ps;
+	procstat_entry_t pse;
+	ps_cache_entry_t *ce;
+	unsigned long long starttime;
+	size_t i;
+	int status;
+
+	status = ps_read_stat (pid, &ps, state, &starttime);
+	if (status != 0)
+	{
+		DEBUG ("ps_read_stat failed: %i", status);
+		return (status);
+	}
+
+	ce = ps_cache_get (shard, pid, ps.name, starttime, cmdline, cmdline_size);
+	if ((ce == NULL) || (ce->matches_num == 0))
+		return (0);
+
+	if (ps.num_proc != 0)
+		ps_read_details (pid, &ps);
+
+	ps_fill_entry (&pse, pid, &ps);
+	for (i = 0; i < ce->matches_num; i++)
+		ps_shard_add (shard, ce->matches[i], &pse);
+
+	return (0);
+} /* int ps_read_pid_incremental */
+
+/* Reads the processes of one shard. Only touches the shard and the stat
+ * files, so that shards can be read in parallel. */
+static void *ps_shard_read (void *arg)
+{
+	ps_shard_t *shard = arg;
+	char cmdline[ARG_MAX];
+	char state;
+	size_t i;
+	int status;
+
+	shard->running = shard->sleeping = shard->zombies = 0;
+	shard->stopped = shard->paging = shard->blocked = 0;
+	shard->matches_num = 0;
+
+	for (i = 0; i < shard->pids_num; i++)
+	{
+		if (ps_incremental)
+			status = ps_read_pid_incremental (shard, shard->pids[i],
+					cmdline, sizeof (cmdline), &state);
+		else
+			status = ps_read_pid (shard, shard->pids[i],
+					cmdline, sizeof (cmdline), &state);
+		if (status != 0)
+			continue;
+
+		switch (state)
+		{
+			case 'R': shard->running++;  break;
+			case 'S': shard->sleeping++; break;
+			case 'D': shard->blocked++;  break;
+			case 'Z': shard->zombies++;  break;
+			case 'T': shard->stopped++;  break;
+			case 'W': shard->paging++;   break;
+		}
+	}
+
+	if (ps_incremental)
+		ps_cache_expire (shard);
+
+	return (NULL);
+} /* void *ps_shard_read */
+
+#if PS_HAVE_EVENTS
+/* Remembers that "pid" has to be looked at by the next read. Called with
+ * "ps_events_lock" held. */
+static void ps_events_add (int pid, _Bool exec)
+{
+	if (ps_events_num >= ps_events_size)
+	{
+		size_t new_size = (ps_events_size == 0)
+			? 1024 : 2 * ps_events_size;
+		ps_event_t *tmp;
+
+		/* Rather scan /proc again than growing without bounds while the
+		 * read callback is stuck. */
+		if (new_size > PS_EVENTS_MAX)
+		{
+			ps_events_rescan = 1;
+			ps_events_num = 0;
+			return;
+		}
+
+		tmp = realloc (ps_events, new_size * sizeof (*ps_events));
+		if (tmp == NULL)
+		{
+			ps_events_rescan = 1;
+			ps_events_num = 0;
+			return;
+		}
+		ps_events = tmp;
+		ps_events_size = new_size;
+	}
+
+	ps_events[ps_events_num].pid = pid;
+	ps_events[ps_events_num].exec = exec;
+	ps_events_num++;
+} /* void ps_events_add */
+
+static void ps_events_handle (struct proc_event const *ev)
+{
+	pthread_mutex_lock (&ps_events_lock);
+	switch (ev->what)
+	{
+		case PROC_EVENT_FORK:
+			/* Threads are counted as forks in /proc/stat, too. */
+			ps_events_forks++;
+			if (ev->event_data.fork.child_pid
+					== ev->event_data.fork.child_tgid)
+				ps_events_add (ev->event_data.fork.child_tgid,
+						/* exec = */ 0);
+			break;
+
+		case PROC_EVENT_EXEC:
+			ps_events_add (ev->event_data.exec.process_tgid,
+					/* exec = */ 1);
+			break;
+
+		case PROC_EVENT_COMM:
+			if (ev->event_data.comm.process_pid
+					== ev->event_data.comm.process_tgid)
+				ps_events_add (ev->event_data.comm.process_tgid,
+						/* exec = */ 0);
+			break;
+
+		default:
+			break;
+	}
+	pthread_mutex_unlock (&ps_events_lock);
+} /* void ps_events_handle */
+
+static void *ps_events_thread_main (void __attribute__((unused)) *arg)
+{
+	char buffer[8192] __attribute__((aligned(8)));
+
+	while (ps_events_loop)
+	{
+		struct pollfd pfd = { ps_events_fd, POLLIN, 0 };
+		struct nlmsghdr *nlh;
+		ssize_t status;
+		int len;
+
+		status = poll (&pfd, 1, /* timeout = */ 1000);
+		if (status <= 0)
+			continue;
+
+		status = recv (ps_events_fd, buffer, sizeof (buffer), /* flags = */ 0);
+		if (status < 0)
+		{
+			/* The socket buffer overflowed and events were lost. */
+			if (errno == ENOBUFS)
+			{
+				pthread_mutex_lock (&ps_events_lock);
+				ps_events_rescan = 1;
+				pthread_mutex_unlock (&ps_events_lock);
+			}
+			continue;
+		}
+
+		len = (int) status;
+		for (nlh = (struct nlmsghdr *) buffer; NLMSG_OK (nlh, len);
+				nlh = NLMSG_NEXT (nlh, len))
+		{
+			struct cn_msg *cn;
+
+			if ((nlh->nlmsg_type == NLMSG_NOOP)
+					|| (nlh->nlmsg_type == NLMSG_ERROR))
+				continue;
+
+			cn = NLMSG_DATA (nlh);
+			if ((cn->id.idx != CN_IDX_PROC) || (cn->id.val != CN_VAL_PROC))
+				continue;
+
+			ps_events_handle ((struct proc_event *) cn->data);
+		}
+	}
+
+	return (NULL);
+} /* void *ps_events_thread_main */
+
+/* Subscribes to the proc connector, which requires CAP_NET_ADMIN. */
+static int ps_events_start (void)
+{
+	struct sockaddr_nl addr;
+	char buffer[NLMSG_SPACE (sizeof (struct cn_msg)
+			+ sizeof (enum proc_cn_mcast_op))];
+	struct nlmsghdr *nlh;
+	struct cn_msg *cn;
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	int rcvbuf = 4 * 1024 * 1024;
+	int status;
+
+	ps_events_fd = socket (PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			NETLINK_CONNECTOR);
+	if (ps_events_fd < 0)
+	{
+		char errbuf[1024];
+		WARNING ("processes plugin: socket (NETLINK_CONNECTOR) failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	/* Bursts of forks must not overflow the buffer. */
+	setsockopt (ps_events_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+	memset (&addr, 0, sizeof (addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	addr.nl_pid = 0;
+
+	if (bind (ps_events_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+	{
+		char errbuf[1024];
+		WARNING ("processes plugin: bind (NETLINK_CONNECTOR) failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (ps_events_fd);
+		ps_events_fd = -1;
+		return (-1);
+	}
+
+	memset (buffer, 0, sizeof (buffer));
+	nlh = (struct nlmsghdr *) buffer;
+	nlh->nlmsg_len = NLMSG_LENGTH (sizeof (*cn) + sizeof (op));
+	nlh->nlmsg_type = NLMSG_DONE;
+	nlh->nlmsg_pid = 0;
+	cn = NLMSG_DATA (nlh);
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof (op);
+	memcpy (cn->data, &op, sizeof (op));
+
+	if (send (ps_events_fd, nlh, nlh->nlmsg_len, /* flags = */ 0) < 0)
+	{
+		char errbuf[1024];
+		WARNING ("processes plugin: Subscribing to process events failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (ps_events_fd);
+		ps_events_fd = -1;
+		return (-1);
+	}
+
+	ps_events_loop = 1;
+	ps_events_rescan = 1;
+	status = plugin_thread_create (&ps_events_thread, /* attr = */ NULL,
+			ps_events_thread_main, /* arg = */ NULL);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		WARNING ("processes plugin: pthread_create failed: %s",
+				sstrerror (status, errbuf, sizeof (errbuf)));
+		ps_events_loop = 0;
+		close (ps_events_fd);
+		ps_events_fd = -1;
+		return (-1);
+	}
+
+	return (0);
+} /* int ps_events_start */
+
+static void ps_events_stop (void)
+{
+	if (ps_events_fd < 0)
+		return;
+
+	ps_events_loop = 0;
+	pthread_join (ps_events_thread, /* retval = */ NULL);
+	close (ps_events_fd);
+	ps_events_fd = -1;
+
+	sfree (ps_events);
+	ps_events_num = 0;
+	ps_events_size = 0;
+} /* void ps_events_stop */
+
+/* Puts the PIDs reported since the last read and the PIDs of processes known
+ * to match into the shards. Falls back to listing /proc on the first read
+ * and whenever events were lost. */
+static int ps_events_list_pids (void)
+{
+	ps_event_t *events;
+	size_t events_num;
+	_Bool rescan;
+	size_t i;
+
+	pthread_mutex_lock (&ps_events_lock);
+	events = ps_events;
+	events_num = ps_events_num;
+	rescan = ps_events_rescan;
+	ps_events = NULL;
+	ps_events_num = 0;
+	ps_events_size = 0;
+	ps_events_rescan = 0;
+	pthread_mutex_unlock (&ps_events_lock);
+
+	/* The command line changes with exec(2), the name and start time may
+	 * not. Forget these processes so they are matched again. */
+	for (i = 0; i < events_num; i++)
+	{
+		ps_shard_t *shard = ps_shards + (events[i].pid % ps_shards_num);
+		ps_cache_entry_t *ce = NULL;
+
+		if (!events[i].exec)
+			continue;
+
+		if (c_avl_remove (shard->cache, &events[i].pid,
+					NULL, (void *) &ce) == 0)
+			ps_cache_entry_free (ce);
+	}
+
+	if (rescan)
+	{
+		sfree (events);
+		return (ps_list_pids ());
+	}
+
+	for (i = 0; i < ps_shards_num; i++)
+	{
+		c_avl_iterator_t *iter;
+		ps_cache_entry_t *ce;
+		int *pid;
+
+		ps_shards[i].pids_num = 0;
+
+		iter = c_avl_get_iterator (ps_shards[i].cache);
+		while (c_avl_iterator_next (iter, (void *) &pid, (void *) &ce) == 0)
+			if (ce->matches_num > 0)
+				ps_pids_append (ce->pid);
+		c_avl_iterator_destroy (iter);
+	}
+
+	for (i = 0; i < events_num; i++)
+		ps_pids_append (events[i].pid);
+	sfree (events);
+
+	/* A process may have been reported more than once. */
+	for (i = 0; i < ps_shards_num; i++)
+	{
+		ps_shard_t *shard = ps_shards + i;
+		size_t j;
+		size_t n = 0;
+
+		qsort (shard->pids, shard->pids_num, sizeof (*shard->pids),
+				ps_cache_compare);
+		for (j = 0; j < shard->pids_num; j++)
+			if ((n == 0) || (shard->pids[n - 1] != shard->pids[j]))
+				shard->pids[n++] = shard->pids[j];
+		shard->pids_num = n;
+	}
+
+	return (0);
+} /* int ps_events_list_pids */
+#endif /* PS_HAVE_EVENTS */
+#endif /*KERNEL_LINUX */
+
+#if KERNEL_SOLARIS
+static const char *ps_get_cmdline (pid_t pid, /* {{{ */
+		char *buffer, size_t buffer_size)
+{
+	char path[PATH_MAX];
+	psinfo_t info;
+	int status;
+
+	snprintf(path, sizeof (path), "/proc/%i/psinfo", pid);
+
+	status = read_file_contents (path, (void *) &info, sizeof (info));
+	if (status != ((int) buffer_size))
+	{
+		ERROR ("processes plugin: Unexpected return value "
+				"while reading \"%s\": "
+				"Returned %i but expected %zu.",
+				path, status, buffer_size);
+		return (NULL);
+	}
+
+	info.pr_psargs[sizeof (info.pr_psargs) - 1] = 0;
+	sstrncpy (buffer, info.pr_psargs, buffer_size);
+
+	return (buffer);
+} /* }}} int ps_get_cmdline */
+
+/*
+ * Reads process information on the Solaris OS. The information comes mainly from
+ * /proc/PID/status, /proc/PID/psinfo and /proc/PID/usage
+ * The values for input and ouput chars are calculated "by hand"
+ * Added a few "solaris" specific process states as well
+ */
+static int ps_read_process(int pid, procstat_t *ps, char *state)
+{
+	char filename[64];
+	char f_psinfo[64], f_usage[64];
+	char *buffer;
+
+	pstatus_t *myStatus;
+	psinfo_t *myInfo;
+	prusage_t *myUsage;
+
+	snprintf(filename, sizeof (filename), "/proc/%i/status", pid);
+	snprintf(f_psinfo, sizeof (f_psinfo), "/proc/%i/psinfo", pid);
+	snprintf(f_usage, sizeof (f_usage), "/proc/%i/usage", pid);
+
+
+	buffer = malloc(sizeof (pstatus_t));
+	memset(buffer, 0, sizeof (pstatus_t));
+	read_file_contents(filename, buffer, sizeof (pstatus_t));
+	myStatus = (pstatus_t *) buffer;
+
+	buffer = malloc(sizeof (psinfo_t));
+	memset(buffer, 0, sizeof(psinfo_t));
+	read_file_contents(f_psinfo, buffer, sizeof (psinfo_t));
+	myInfo = (psinfo_t *) buffer;
+
+	buffer = malloc(sizeof (prusage_t));
+	memset(buffer, 0, sizeof(prusage_t));
+	read_file_contents(f_usage, buffer, sizeof (prusage_t));
+	myUsage = (prusage_t *) buffer;
+
+	sstrncpy(ps->name, myInfo->pr_fname, sizeof (myInfo->pr_fname));
+	ps->num_lwp = myStatus->pr_nlwp;
+	if (myInfo->pr_wstat != 0) {
+		ps->num_proc = 0;
+		ps->num_lwp = 0;
+		*state = (char) 'Z';
+		return (0);
+	} else {
+		ps->num_proc = 1;
+		ps->num_lwp = myInfo->pr_nlwp;
+	}
+
+	/*
+	 * Convert system time and user time from nanoseconds to microseconds
+	 * for compatibility with the linux module
+	 */
+	ps->cpu_system_counter = myStatus -> pr_stime.tv_nsec / 1000;
+	ps->cpu_user_counter = myStatus -> pr_utime.tv_nsec / 1000;
+
+	/*
+	 * Convert rssize from KB to bytes to be consistent w/ the linux module
+	 */
+	ps->vmem_rss = myInfo->pr_rssize * 1024;
+	ps->vmem_size = myInfo->pr_size * 1024;
+	ps->vmem_minflt_counter = myUsage->pr_minf;
+	ps->vmem_majflt_counter = myUsage->pr_majf;
 
 	/*
 	 * TODO: Data and code segment calculations for Solaris
@@ -1682,99 +2630,95 @@ static int ps_read (void)
 	int paging   = 0;
 	int blocked  = 0;
 
-	struct dirent *ent;
-	DIR           *proc;
-	int            pid;
-
-	char cmdline[ARG_MAX];
-
-	int        status;
-	procstat_t ps;
-	procstat_entry_t pse;
-	char       state;
+	size_t i;
+	size_t j;
+	int status;
 
 	procstat_t *ps_ptr;
 
 	running = sleeping = zombies = stopped = paging = blocked = 0;
 	ps_list_reset ();
+	ps_cache_generation++;
 
-	if ((proc = opendir ("/proc")) == NULL)
-	{
-		char errbuf[1024];
-		ERROR ("Cannot open `/proc': %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
+#if PS_HAVE_EVENTS
+	if (ps_events_enabled)
+		status = ps_events_list_pids ();
+	else
+#endif
+		status = ps_list_pids ();
+	if (status != 0)
 		return (-1);
-	}
 
-	while ((ent = readdir (proc)) != NULL)
+	/* The first shard is read by this thread. */
+	for (i = 1; i < ps_shards_num; i++)
 	{
-		if (!isdigit (ent->d_name[0]))
-			continue;
+		ps_shard_t *shard = ps_shards + i;
 
-		if ((pid = atoi (ent->d_name)) < 1)
-			continue;
-
-		status = ps_read_process (pid, &ps, &state);
+		status = plugin_thread_create (&shard->thread, /* attr = */ NULL,
+				ps_shard_read, shard);
 		if (status != 0)
 		{
-			DEBUG ("ps_read_process failed: %i", status);
+			char errbuf[1024];
+			WARNING ("processes plugin: pthread_create failed: %s",
+					sstrerror (status, errbuf, sizeof (errbuf)));
+			ps_shard_read (shard);
 			continue;
 		}
+		shard->thread_running = 1;
+	}
+	ps_shard_read (ps_shards);
 
-		pse.id       = pid;
-		pse.age      = 0;
-
-		pse.num_proc   = ps.num_proc;
-		pse.num_lwp    = ps.num_lwp;
-		pse.vmem_size  = ps.vmem_size;
-		pse.vmem_rss   = ps.vmem_rss;
-		pse.vmem_data  = ps.vmem_data;
-		pse.vmem_code  = ps.vmem_code;
-		pse.stack_size = ps.stack_size;
-
-		pse.vmem_minflt = 0;
-		pse.vmem_minflt_counter = ps.vmem_minflt_counter;
-		pse.vmem_majflt = 0;
-		pse.vmem_majflt_counter = ps.vmem_majflt_counter;
-
-		pse.cpu_user = 0;
-		pse.cpu_user_counter = ps.cpu_user_counter;
-		pse.cpu_system = 0;
-		pse.cpu_system_counter = ps.cpu_system_counter;
-
-		pse.io_rchar = ps.io_rchar;
-		pse.io_wchar = ps.io_wchar;
-		pse.io_syscr = ps.io_syscr;
-		pse.io_syscw = ps.io_syscw;
+	for (i = 0; i < ps_shards_num; i++)
+	{
+		ps_shard_t *shard = ps_shards + i;
 
-		switch (state)
+		if (shard->thread_running)
 		{
-			case 'R': running++;  break;
-			case 'S': sleeping++; break;
-			case 'D': blocked++;  break;
-			case 'Z': zombies++;  break;
-			case 'T': stopped++;  break;
-			case 'W': paging++;   break;
+			pthread_join (shard->thread, /* retval = */ NULL);
+			shard->thread_running = 0;
 		}
 
-		ps_list_add (ps.name,
-				ps_get_cmdline (pid, ps.name, cmdline, sizeof (cmdline)),
-				&pse);
-	}
+		running  += shard->running;
+		sleeping += shard->sleeping;
+		zombies  += shard->zombies;
+		stopped  += shard->stopped;
+		paging   += shard->paging;
+		blocked  += shard->blocked;
 
-	closedir (proc);
+		for (j = 0; j < shard->matches_num; j++)
+			ps_list_add_entry (shard->matches[j].ps,
+					&shard->matches[j].entry);
+	}
 
-	ps_submit_state ("running",  running);
-	ps_submit_state ("sleeping", sleeping);
-	ps_submit_state ("zombies",  zombies);
-	ps_submit_state ("stopped",  stopped);
-	ps_submit_state ("paging",   paging);
-	ps_submit_state ("blocked",  blocked);
+	/* In event mode, only new and matching processes have been looked at,
+	 * so there are no totals per state. */
+	if (!ps_events_enabled)
+	{
+		ps_submit_state ("running",  running);
+		ps_submit_state ("sleeping", sleeping);
+		ps_submit_state ("zombies",  zombies);
+		ps_submit_state ("stopped",  stopped);
+		ps_submit_state ("paging",   paging);
+		ps_submit_state ("blocked",  blocked);
+	}
 
 	for (ps_ptr = list_head_g; ps_ptr != NULL; ps_ptr = ps_ptr->next)
 		ps_submit_proc_list (ps_ptr);
 
-	read_fork_rate();
+#if PS_HAVE_EVENTS
+	if (ps_events_enabled)
+	{
+		derive_t forks;
+
+		pthread_mutex_lock (&ps_events_lock);
+		forks = ps_events_forks;
+		pthread_mutex_unlock (&ps_events_lock);
+
+		ps_submit_fork_rate (forks);
+	}
+	else
+#endif
+		read_fork_rate();
 /* #endif KERNEL_LINUX */
 
 #elif HAVE_LIBKVM_GETPROCS && HAVE_STRUCT_KINFO_PROC_FREEBSD
@@ -2169,9 +3113,19 @@ static int ps_read (void)
 	return (0);
 } /* int ps_read */
 
+static int ps_shutdown (void)
+{
+#if PS_HAVE_EVENTS
+	ps_events_stop ();
+#endif
+
+	return (0);
+} /* int ps_shutdown */
+
 void module_register (void)
 {
 	plugin_register_complex_config ("processes", ps_config);
 	plugin_register_init ("processes", ps_init);
 	plugin_register_read ("processes", ps_read);
+	plugin_register_shutdown ("processes", ps_shutdown);
 } /* void module_register */
@@ -0,0 +1,1213 @@
+/**
+ * collectd - src/prometheus.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_cache.h"
+#include "utils_htable.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+/*
+ * Serves the values in the cache in the Prometheus text exposition format,
+ * so that scrapers can pull them. The cache is read with its streaming
+ * iterator on each scrape. The lines of each series are kept between scrapes
+ * and only rendered again if the series has been updated; if nothing has
+ * changed, the previous response, and its compressed version, is sent again.
+ *
+ * The HTTP server is a pool of threads, each polling the listening sockets
+ * and the non-blocking connections it has accepted.
+ */
+
+#define PX_DEFAULT_SERVICE "9103"
+#define PX_PATH "/metrics"
+#define PX_CONTENT_TYPE "text/plain; version=0.0.4"
+
+#define PX_CONNS_MAX 64
+#define PX_REQUEST_MAX 8192
+/* Idle connections are closed after this time. */
+#define PX_TIMEOUT TIME_T_TO_CDTIME_T (30)
+
+/* The rendered response, shared by the connections sending it. */
+struct px_body_s /* {{{ */
+{
+  int refs;
+  char *data;
+  size_t data_len;
+#if HAVE_LIBZ
+  char *gzip;
+  size_t gzip_len;
+#endif
+}; /* }}} */
+typedef struct px_body_s px_body_t;
+
+/* All series with the same plugin and type, one metric per data source. */
+struct px_family_s;
+typedef struct px_family_s px_family_t;
+
+struct px_series_s;
+typedef struct px_series_s px_series_t;
+struct px_series_s /* {{{ */
+{
+  /* The name in the cache; the key of "series". */
+  char *name;
+  px_family_t *family;
+  char *labels;
+
+  /* The time of the values rendered into "text". */
+  cdtime_t time;
+  /* The line of data source "i" is text[offsets[i]] to text[offsets[i+1]]. */
+  char *text;
+  size_t *offsets;
+  /* Generation of the scrape which has seen this series last. */
+  uint64_t seen;
+
+  px_series_t *prev;
+  px_series_t *next;
+}; /* }}} */
+
+struct px_family_s /* {{{ */
+{
+  /* "<plugin>/<type>"; the key of "families". */
+  char *key;
+  char **names;
+  size_t names_num;
+
+  px_series_t *head;
+  px_series_t *tail;
+
+  px_family_t *prev;
+  px_family_t *next;
+}; /* }}} */
+
+struct px_conn_s /* {{{ */
+{
+  int fd;
+  _Bool writing;
+  _Bool keep_alive;
+  cdtime_t last_active;
+
+  char request[PX_REQUEST_MAX];
+  size_t request_len;
+
+  char header[512];
+  size_t header_len;
+  /* Bytes of header and data sent. */
+  size_t sent;
+  px_body_t *body;
+  const char *data;
+  size_t data_len;
+}; /* }}} */
+typedef struct px_conn_s px_conn_t;
+
+struct px_thread_s /* {{{ */
+{
+  pthread_t id;
+  _Bool running;
+  px_conn_t *conns[PX_CONNS_MAX];
+  size_t conns_num;
+}; /* }}} */
+typedef struct px_thread_s px_thread_t;
+
+static char *conf_node = NULL;
+static char *conf_service = NULL;
+static size_t conf_threads_num = 2;
+static _Bool conf_gzip = 1;
+
+static int *listen_fds = NULL;
+static size_t listen_fds_num = 0;
+
+static px_thread_t *threads = NULL;
+static size_t threads_num = 0;
+static _Bool threads_quit = 0;
+
+/* Protects everything below. Scrapes render one after the other. */
+static pthread_mutex_t px_lock = PTHREAD_MUTEX_INITIALIZER;
+static c_htable_t *series = NULL;
+static c_htable_t *families = NULL;
+static px_family_t *families_head = NULL;
+static uint64_t generation = 0;
+static px_body_t *body = NULL;
+
+/*
+ * Rendering
+ */
+static void px_body_release (px_body_t *b) /* {{{ */
+{
+  if (b == NULL)
+    return;
+
+  b->refs--;
+  if (b->refs > 0)
+    return;
+
+  sfree (b->data);
+#if HAVE_LIBZ
+  sfree (b->gzip);
+#endif
+  sfree (b);
+} /* }}} void px_body_release */
+
+#if HAVE_LIBZ
+/* Compresses the body once; it is shared by all gzip requests. */
+static int px_body_compress (px_body_t *b) /* {{{ */
+{
+  z_stream z;
+  uLong size;
+  int status;
+
+  if (b->gzip != NULL)
+    return (0);
+
+  memset (&z, 0, sizeof (z));
+  /* A window of 15 bits, plus 16 for the gzip header. */
+  status = deflateInit2 (&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+      /* windowBits = */ 15 + 16, /* memLevel = */ 8, Z_DEFAULT_STRATEGY);
+  if (status != Z_OK)
+    return (-1);
+
+  size = deflateBound (&z, (uLong) b->data_len);
+  b->gzip = malloc ((size_t) size);
+  if (b->gzip == NULL)
+  {
+    deflateEnd (&z);
+    return (ENOMEM);
+  }
+
+  z.next_in = (Bytef *) b->data;
+  z.avail_in = (uInt) b->data_len;
+  z.next_out = (Bytef *) b->gzip;
+  z.avail_out = (uInt) size;
+
+  status = deflate (&z, Z_FINISH);
+  b->gzip_len = (size_t) z.total_out;
+  deflateEnd (&z);
+
+  if (status != Z_STREAM_END)
+  {
+    sfree (b->gzip);
+    b->gzip_len = 0;
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int px_body_compress */
+#endif
+
+/* Replaces the characters not allowed in metric names. */
+static void px_sanitize (char *str) /* {{{ */
+{
+  for (; *str != 0; str++)
+  {
+    if (!(isalnum ((unsigned char) *str) || (*str == '_') || (*str == ':')))
+      *str = '_';
+  }
+} /* }}} void px_sanitize */
+
+/* Appends a label to "buffer", escaping the value. */
+static void px_label_append (char *buffer, size_t buffer_size, /* {{{ */
+    const char *name, const char *value)
+{
+  size_t len = strlen (buffer);
+
+  if ((value == NULL) || (value[0] == 0))
+    return;
+
+  len += (size_t) ssnprintf (buffer + len, buffer_size - len, "%s%s=\"",
+      (len > 1) ? "," : "", name);
+  if (len >= buffer_size)
+  {
+    buffer[buffer_size - 1] = 0;
+    return;
+  }
+
+  for (; (*value != 0) && ((len + 3) < buffer_size); value++)
+  {
+    if ((*value == '\\') || (*value == '"'))
+      buffer[len++] = '\\';
+    else if (*value == '\n')
+    {
+      buffer[len++] = '\\';
+      buffer[len++] = 'n';
+      continue;
+    }
+    buffer[len++] = *value;
+  }
+
+  if ((len + 1) < buffer_size)
+    buffer[len++] = '"';
+  buffer[len] = 0;
+} /* }}} void px_label_append */
+
+static void px_series_free (px_series_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
+
+  sfree (s->name);
+  sfree (s->labels);
+  sfree (s->text);
+  sfree (s->offsets);
+  sfree (s);
+} /* }}} void px_series_free */
+
+static void px_family_free (px_family_t *f) /* {{{ */
+{
+  size_t i;
+
+  if (f == NULL)
+    return;
+
+  while (f->head != NULL)
+  {
+    px_series_t *next = f->head->next;
+    px_series_free (f->head);
+    f->head = next;
+  }
+
+  for (i = 0; i < f->names_num; i++)
+    sfree (f->names[i]);
+  sfree (f->names);
+  sfree (f->key);
+  sfree (f);
+} /* }}} void px_family_free */
+
+static px_family_t *px_family_get (const char *plugin, /* {{{ */
+    const char *type)
+{
+  char key[2 * DATA_MAX_NAME_LEN];
+  const data_set_t *ds;
+  px_family_t *f = NULL;
+  int i;
+
+  ssnprintf (key, sizeof (key), "%s/%s", plugin, type);
+  if (c_htable_get (families, key, (void *) &f) == 0)
+    return (f);
+
+  ds = plugin_get_ds (type);
+  if (ds == NULL)
+    return (NULL);
+
+  f = calloc (1, sizeof (*f));
+  if (f == NULL)
+    return (NULL);
+  f->key = strdup (key);
+  f->names = calloc ((size_t) ds->ds_num, sizeof (*f->names));
+  if ((f->key == NULL) || (f->names == NULL))
+  {
+    px_family_free (f);
+    return (NULL);
+  }
+
+  for (i = 0; i < ds->ds_num; i++)
+  {
+    char name[3 * DATA_MAX_NAME_LEN];
+
+    /* The name of single-value types is left out, like write_graphite
+     * does ("value"). */
+    if ((ds->ds_num == 1) && (strcmp ("value", ds->ds[i].name) == 0))
+      ssnprintf (name, sizeof (name), "collectd_%s_%s", plugin, type);
+    else
+      ssnprintf (name, sizeof (name), "collectd_%s_%s_%s", plugin, type,
+          ds->ds[i].name);
+    px_sanitize (name);
+
+    f->names[i] = strdup (name);
+    if (f->names[i] == NULL)
+    {
+      px_family_free (f);
+      return (NULL);
+    }
+    f->names_num++;
+  }
+
+  if (c_htable_insert (families, f->key, f) != 0)
+  {
+    px_family_free (f);
+    return (NULL);
+  }
+
+  f->next = families_head;
+  if (families_head != NULL)
+    families_head->prev = f;
+  families_head = f;
+
+  return (f);
+} /* }}} px_family_t *px_family_get */
+
+static px_series_t *px_series_create (const char *name) /* {{{ */
+{
+  char buffer[6 * DATA_MAX_NAME_LEN];
+  char labels[8 * DATA_MAX_NAME_LEN];
+  char *host;
+  char *plugin;
+  char *plugin_instance;
+  char *type;
+  char *type_instance;
+  px_family_t *f;
+  px_series_t *s;
+
+  sstrncpy (buffer, name, sizeof (buffer));
+  if (parse_identifier (buffer, &host, &plugin, &plugin_instance,
+        &type, &type_instance) != 0)
+    return (NULL);
+
+  f = px_family_get (plugin, type);
+  if (f == NULL)
+    return (NULL);
+
+  sstrncpy (labels, "{", sizeof (labels));
+  px_label_append (labels, sizeof (labels), "instance", host);
+  px_label_append (labels, sizeof (labels), "plugin_instance",
+      plugin_instance);
+  px_label_append (labels, sizeof (labels), "type_instance", type_instance);
+  if (strlen (labels) == 1)
+    labels[0] = 0;
+  else if ((strlen (labels) + 1) < sizeof (labels))
+    strcat (labels, "}");
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+  s->name = strdup (name);
+  s->labels = strdup (labels);
+  s->offsets = calloc (f->names_num + 1, sizeof (*s->offsets));
+  if ((s->name == NULL) || (s->labels == NULL) || (s->offsets == NULL)
+      || (c_htable_insert (series, s->name, s) != 0))
+  {
+    px_series_free (s);
+    return (NULL);
+  }
+
+  s->family = f;
+  s->prev = f->tail;
+  if (f->tail != NULL)
+    f->tail->next = s;
+  else
+    f->head = s;
+  f->tail = s;
+
+  return (s);
+} /* }}} px_series_t *px_series_create */
+
+static void px_series_remove (px_series_t *s) /* {{{ */
+{
+  px_family_t *f = s->family;
+
+  c_htable_remove (series, s->name, /* key = */ NULL, /* value = */ NULL);
+
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    f->head = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+  else
+    f->tail = s->prev;
+
+  px_series_free (s);
+} /* }}} void px_series_remove */
+
+static int px_series_render (px_series_t *s, /* {{{ */
+    const gauge_t *values, size_t values_num, cdtime_t t)
+{
+  px_family_t *f = s->family;
+  size_t len = 0;
+  size_t i;
+
+  if (values_num != f->names_num)
+    return (-1);
+
+  for (i = 0; i < values_num; i++)
+  {
+    char line[8 * DATA_MAX_NAME_LEN + 64];
+    int status;
+    char *tmp;
+
+    if (isnan (values[i]))
+      status = ssnprintf (line, sizeof (line), "%s%s NaN %ld\n",
+          f->names[i], s->labels, CDTIME_T_TO_MS (t));
+    else
+      status = ssnprintf (line, sizeof (line), "%s%s %.15g %ld\n",
+          f->names[i], s->labels, values[i], CDTIME_T_TO_MS (t));
+    if ((status < 0) || ((size_t) status >= sizeof (line)))
+      return (-1);
+
+    tmp = realloc (s->text, len + (size_t) status);
+    if (tmp == NULL)
+      return (ENOMEM);
+    s->text = tmp;
+
+    memcpy (s->text + len, line, (size_t) status);
+    s->offsets[i] = len;
+    len += (size_t) status;
+  }
+
+  s->offsets[values_num] = len;
+  s->time = t;
+  return (0);
+} /* }}} int px_series_render */
+
+/* Builds the response from the rendered lines. */
+static px_body_t *px_body_create (size_t size_hint) /* {{{ */
+{
+  px_body_t *b;
+  px_family_t *f;
+  size_t size = (size_hint > 0) ? size_hint : 4096;
+
+  b = calloc (1, sizeof (*b));
+  if (b == NULL)
+    return (NULL);
+  b->refs = 1;
+  b->data = malloc (size);
+  if (b->data == NULL)
+  {
+    sfree (b);
+    return (NULL);
+  }
+
+#define PX_APPEND(ptr, len) do {                                      \
+  if ((b->data_len + (len)) > size) {                                  \
+    char *tmp;                                                         \
+    while ((b->data_len + (len)) > size)                               \
+      size *= 2;                                                       \
+    tmp = realloc (b->data, size);                                     \
+    if (tmp == NULL) {                                                 \
+      px_body_release (b);                                             \
+      return (NULL);                                                   \
+    }                                                                  \
+    b->data = tmp;                                                     \
+  }                                                                    \
+  memcpy (b->data + b->data_len, (ptr), (len));                        \
+  b->data_len += (len);                                                \
+} while (0)
+
+  for (f = families_head; f != NULL; f = f->next)
+  {
+    size_t i;
+
+    /* The lines of a metric have to be grouped. */
+    for (i = 0; i < f->names_num; i++)
+    {
+      char type_line[4 * DATA_MAX_NAME_LEN];
+      px_series_t *s;
+      int status;
+
+      status = ssnprintf (type_line, sizeof (type_line), "# TYPE %s gauge\n",
+          f->names[i]);
+      if ((status > 0) && ((size_t) status < sizeof (type_line)))
+        PX_APPEND (type_line, (size_t) status);
+
+      for (s = f->head; s != NULL; s = s->next)
+        PX_APPEND (s->text + s->offsets[i],
+            s->offsets[i + 1] - s->offsets[i]);
+    }
+  }
+
+#undef PX_APPEND
+
+  return (b);
+} /* }}} px_body_t *px_body_create */
+
+/* Returns the current response, rendering the updated series first. Called
+ * with "px_lock" held. */
+static px_body_t *px_render (void) /* {{{ */
+{
+  uc_iter_t *iter;
+  px_family_t *f;
+  _Bool dirty = 0;
+  char *name;
+
+  iter = uc_get_iterator_filtered (/* patterns = */ NULL, 0,
+      /* regex = */ NULL, UC_ITER_VALUES);
+  if (iter == NULL)
+    return (NULL);
+
+  generation++;
+
+  while (uc_iterator_next (iter, &name) == 0)
+  {
+    px_series_t *s = NULL;
+    gauge_t *values = NULL;
+    size_t values_num = 0;
+    cdtime_t t = 0;
+
+    if ((uc_iterator_get_values (iter, &values, &values_num) != 0)
+        || (uc_iterator_get_time (iter, &t) != 0))
+      continue;
+
+    if (c_htable_get (series, name, (void *) &s) != 0)
+    {
+      s = px_series_create (name);
+      if (s == NULL)
+        continue;
+      dirty = 1;
+    }
+
+    s->seen = generation;
+    if (s->time == t)
+      continue;
+
+    if (px_series_render (s, values, values_num, t) != 0)
+    {
+      px_series_remove (s);
+      continue;
+    }
+    dirty = 1;
+  }
+
+  uc_iterator_destroy (iter);
+
+  /* Remove the series which have expired from the cache. */
+  f = families_head;
+  while (f != NULL)
+  {
+    px_family_t *next = f->next;
+    px_series_t *s = f->head;
+
+    while (s != NULL)
+    {
+      px_series_t *s_next = s->next;
+      if (s->seen != generation)
+      {
+        px_series_remove (s);
+        dirty = 1;
+      }
+      s = s_next;
+    }
+
+    if (f->head == NULL)
+    {
+      c_htable_remove (families, f->key, NULL, NULL);
+      if (f->prev != NULL)
+        f->prev->next = f->next;
+      else
+        families_head = f->next;
+      if (f->next != NULL)
+        f->next->prev = f->prev;
+      px_family_free (f);
+    }
+
+    f = next;
+  }
+
+  if (dirty || (body == NULL))
+  {
+    px_body_t *b = px_body_create ((body != NULL) ? body->data_len : 0);
+    if (b != NULL)
+    {
+      px_body_release (body);
+      body = b;
+    }
+  }
+
+  if (body != NULL)
+    body->refs++;
+  return (body);
+} /* }}} px_body_t *px_render */
+
+/*
+ * HTTP server
+ */
+static void px_conn_close (px_conn_t *conn) /* {{{ */
+{
+  close (conn->fd);
+  if (conn->body != NULL)
+  {
+    pthread_mutex_lock (&px_lock);
+    px_body_release (conn->body);
+    pthread_mutex_unlock (&px_lock);
+  }
+  sfree (conn);
+} /* }}} void px_conn_close */
+
+static void px_respond (px_conn_t *conn, /* {{{ */
+    const char *status_line, const char *content_type,
+    const char *data, size_t data_len, _Bool gzip, _Bool head)
+{
+  int status;
+
+  status = ssnprintf (conn->header, sizeof (conn->header),
+      "HTTP/1.1 %s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %zu\r\n"
+      "%s"
+      "Connection: %s\r\n"
+      "\r\n",
+      status_line, content_type, data_len,
+      gzip ? "Content-Encoding: gzip\r\n" : "",
+      conn->keep_alive ? "keep-alive" : "close");
+  conn->header_len = ((status > 0) && ((size_t) status < sizeof (conn->header)))
+    ? (size_t) status : 0;
+
+  conn->data = head ? NULL : data;
+  conn->data_len = head ? 0 : data_len;
+  conn->sent = 0;
+  conn->writing = 1;
+} /* }}} void px_respond */
+
+#define PX_TEXT_PLAIN "text/plain"
+#define PX_RESPOND_STATIC(conn, status_line, text) \
+  px_respond ((conn), (status_line), PX_TEXT_PLAIN, (text), strlen (text), \
+      /* gzip = */ 0, /* head = */ 0)
+
+/* Handles the request in conn->request, which ends at "end". */
+static void px_handle_request (px_conn_t *conn, char *end) /* {{{ */
+{
+  char *method;
+  char *path;
+  char *version;
+  char *line;
+  char *ptr = NULL;
+  _Bool gzip = 0;
+  _Bool head;
+
+  *end = 0;
+
+  line = strtok_r (conn->request, "\r\n", &ptr);
+  method = (line != NULL) ? line : "";
+  path = strchr (method, ' ');
+  version = (path != NULL) ? strchr (path + 1, ' ') : NULL;
+  if ((path == NULL) || (version == NULL))
+  {
+    conn->keep_alive = 0;
+    PX_RESPOND_STATIC (conn, "400 Bad Request", "Bad Request\n");
+    return;
+  }
+  *path++ = 0;
+  *version++ = 0;
+
+  conn->keep_alive = (strcmp ("HTTP/1.1", version) == 0);
+
+  while ((line = strtok_r (NULL, "\r\n", &ptr)) != NULL)
+  {
+    if (strncasecmp ("Accept-Encoding:", line, 16) == 0)
+      gzip = (strstr (line + 16, "gzip") != NULL);
+    else if (strncasecmp ("Connection:", line, 11) == 0)
+    {
+      if (strstr (line + 11, "close") != NULL)
+        conn->keep_alive = 0;
+      else if (strstr (line + 11, "eep-alive") != NULL)
+        conn->keep_alive = 1;
+    }
+  }
+
+  head = (strcmp ("HEAD", method) == 0);
+  if (!head && (strcmp ("GET", method) != 0))
+  {
+    PX_RESPOND_STATIC (conn, "405 Method Not Allowed",
+        "Method Not Allowed\n");
+    return;
+  }
+
+  /* The query string is ignored. */
+  if ((strncmp (PX_PATH, path, strlen (PX_PATH)) != 0)
+      || ((path[strlen (PX_PATH)] != 0) && (path[strlen (PX_PATH)] != '?')))
+  {
+    PX_RESPOND_STATIC (conn, "404 Not Found", "Not Found\n");
+    return;
+  }
+
+  pthread_mutex_lock (&px_lock);
+  conn->body = px_render ();
+#if HAVE_LIBZ
+  if ((conn->body != NULL) && gzip && conf_gzip
+      && (px_body_compress (conn->body) != 0))
+    gzip = 0;
+#else
+  gzip = 0;
+#endif
+  pthread_mutex_unlock (&px_lock);
+
+  if (conn->body == NULL)
+  {
+    PX_RESPOND_STATIC (conn, "500 Internal Server Error",
+        "Internal Server Error\n");
+    return;
+  }
+
+#if HAVE_LIBZ
+  if (gzip && conf_gzip)
+    px_respond (conn, "200 OK", PX_CONTENT_TYPE,
+        conn->body->gzip, conn->body->gzip_len, /* gzip = */ 1, head);
+  else
+#endif
+    px_respond (conn, "200 OK", PX_CONTENT_TYPE,
+        conn->body->data, conn->body->data_len, /* gzip = */ 0, head);
+} /* }}} void px_handle_request */
+
+/* Looks for a complete request in the buffer. */
+static void px_conn_process (px_conn_t *conn) /* {{{ */
+{
+  char *end;
+
+  if (conn->writing || (conn->request_len == 0))
+    return;
+
+  conn->request[conn->request_len] = 0;
+  end = strstr (conn->request, "\r\n\r\n");
+  if (end == NULL)
+  {
+    if (conn->request_len >= (sizeof (conn->request) - 1))
+    {
+      conn->keep_alive = 0;
+      PX_RESPOND_STATIC (conn, "400 Bad Request", "Bad Request\n");
+      conn->request_len = 0;
+    }
+    return;
+  }
+
+  /* Keep pipelined requests. The line breaks are needed to find the end. */
+  px_handle_request (conn, end);
+  end += 4;
+  conn->request_len -= (size_t) (end - conn->request);
+  memmove (conn->request, end, conn->request_len);
+} /* }}} void px_conn_process */
+
+/* Returns non-zero if the connection should be closed. */
+static int px_conn_read (px_conn_t *conn) /* {{{ */
+{
+  ssize_t status;
+
+  status = read (conn->fd, conn->request + conn->request_len,
+      sizeof (conn->request) - 1 - conn->request_len);
+  if (status < 0)
+    return (((errno == EAGAIN) || (errno == EWOULDBLOCK)
+          || (errno == EINTR)) ? 0 : -1);
+  else if (status == 0)
+    return (-1);
+
+  conn->request_len += (size_t) status;
+  px_conn_process (conn);
+  return (0);
+} /* }}} int px_conn_read */
+
+static int px_conn_write (px_conn_t *conn) /* {{{ */
+{
+  const char *ptr;
+  size_t len;
+  ssize_t status;
+
+  if (conn->sent < conn->header_len)
+  {
+    ptr = conn->header + conn->sent;
+    len = conn->header_len - conn->sent;
+  }
+  else
+  {
+    ptr = conn->data + (conn->sent - conn->header_len);
+    len = conn->data_len - (conn->sent - conn->header_len);
+  }
+
+  if (len > 0)
+  {
+    status = write (conn->fd, ptr, len);
+    if (status < 0)
+      return (((errno == EAGAIN) || (errno == EWOULDBLOCK)
+            || (errno == EINTR)) ? 0 : -1);
+    conn->sent += (size_t) status;
+  }
+
+  if (conn->sent < (conn->header_len + conn->data_len))
+    return (0);
+
+  /* Done with this response. */
+  conn->writing = 0;
+  if (conn->body != NULL)
+  {
+    pthread_mutex_lock (&px_lock);
+    px_body_release (conn->body);
+    pthread_mutex_unlock (&px_lock);
+    conn->body = NULL;
+  }
+  conn->data = NULL;
+
+  if (!conn->keep_alive)
+    return (-1);
+
+  px_conn_process (conn);
+  return (0);
+} /* }}} int px_conn_write */
+
+static void px_accept (px_thread_t *t, int listen_fd) /* {{{ */
+{
+  px_conn_t *conn;
+  int fd;
+  int flags;
+
+  fd = accept (listen_fd, /* addr = */ NULL, /* addrlen = */ NULL);
+  if (fd < 0)
+    return;
+
+  flags = fcntl (fd, F_GETFL);
+  if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0))
+  {
+    close (fd);
+    return;
+  }
+
+  conn = calloc (1, sizeof (*conn));
+  if (conn == NULL)
+  {
+    close (fd);
+    return;
+  }
+  conn->fd = fd;
+  conn->last_active = cdtime ();
+
+  t->conns[t->conns_num] = conn;
+  t->conns_num++;
+} /* }}} void px_accept */
+
+static void *px_thread (void *arg) /* {{{ */
+{
+  px_thread_t *t = arg;
+  struct pollfd fds[listen_fds_num + PX_CONNS_MAX];
+
+  while (!threads_quit)
+  {
+    size_t fds_num = 0;
+    cdtime_t now;
+    size_t i;
+    int status;
+
+    /* Stop accepting while all connection slots are used. */
+    for (i = 0; i < listen_fds_num; i++)
+    {
+      fds[fds_num].fd = listen_fds[i];
+      fds[fds_num].events = (t->conns_num < PX_CONNS_MAX) ? POLLIN : 0;
+      fds[fds_num].revents = 0;
+      fds_num++;
+    }
+    for (i = 0; i < t->conns_num; i++)
+    {
+      fds[fds_num].fd = t->conns[i]->fd;
+      fds[fds_num].events = t->conns[i]->writing ? POLLOUT : POLLIN;
+      fds[fds_num].revents = 0;
+      fds_num++;
+    }
+
+    status = poll (fds, (nfds_t) fds_num, /* timeout = */ 1000);
+    if (status < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+      ERROR ("prometheus plugin: poll failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    now = cdtime ();
+
+    /* Connections first, so that the indices in "fds" stay valid. */
+    i = t->conns_num;
+    while (i > 0)
+    {
+      px_conn_t *conn;
+      short revents;
+      _Bool done = 0;
+
+      i--;
+      conn = t->conns[i];
+      revents = fds[listen_fds_num + i].revents;
+
+      if (revents != 0)
+      {
+        if ((revents & (POLLERR | POLLNVAL))
+            || (conn->writing ? px_conn_write (conn) : px_conn_read (conn)))
+          done = 1;
+        else
+          conn->last_active = now;
+      }
+      else if ((now - conn->last_active) > PX_TIMEOUT)
+        done = 1;
+
+      if (!done)
+        continue;
+
+      px_conn_close (conn);
+      t->conns_num--;
+      t->conns[i] = t->conns[t->conns_num];
+    }
+
+    for (i = 0; i < listen_fds_num; i++)
+      if ((fds[i].revents & POLLIN) && (t->conns_num < PX_CONNS_MAX))
+        px_accept (t, listen_fds[i]);
+  }
+
+  while (t->conns_num > 0)
+  {
+    t->conns_num--;
+    px_conn_close (t->conns[t->conns_num]);
+  }
+
+  return (NULL);
+} /* }}} void *px_thread */
+
+/*
+ * Configuration and life cycle
+ */
+static int px_open_sockets (void) /* {{{ */
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  const char *service;
+  int status;
+
+  service = (conf_service != NULL) ? conf_service : PX_DEFAULT_SERVICE;
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+  ai_hints.ai_flags = 0;
+#ifdef AI_PASSIVE
+  ai_hints.ai_flags |= AI_PASSIVE;
+#endif
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  status = getaddrinfo (conf_node, service, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    ERROR ("prometheus plugin: getaddrinfo (%s, %s) failed: %s",
+        (conf_node == NULL) ? "(null)" : conf_node, service,
+        gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    int yes = 1;
+    int flags;
+    int fd;
+    int *tmp;
+
+    tmp = realloc (listen_fds, (listen_fds_num + 1) * sizeof (*listen_fds));
+    if (tmp == NULL)
+      break;
+    listen_fds = tmp;
+
+    /* Sockets handed over by the previous process are set up already. */
+    fd = plugin_handoff_take (SOCK_STREAM, ai_ptr->ai_addr,
+        ai_ptr->ai_addrlen);
+    if (fd < 0)
+    {
+      fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+          ai_ptr->ai_protocol);
+      if (fd < 0)
+        continue;
+
+#ifdef IPV6_V6ONLY
+      /* Listen on IPv4 and IPv6 with separate sockets. */
+      if (ai_ptr->ai_family == AF_INET6)
+        setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof (yes));
+#endif
+
+      flags = fcntl (fd, F_GETFL);
+      if ((setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+              sizeof (yes)) != 0)
+          || (flags < 0)
+          || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0)
+          || (bind (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) != 0)
+          || (listen (fd, /* backlog = */ 128) != 0))
+      {
+        char errbuf[1024];
+        ERROR ("prometheus plugin: Setting up the socket failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        close (fd);
+        continue;
+      }
+    }
+
+    plugin_handoff_add (fd);
+    listen_fds[listen_fds_num] = fd;
+    listen_fds_num++;
+  }
+
+  freeaddrinfo (ai_list);
+
+  return ((listen_fds_num > 0) ? 0 : -1);
+} /* }}} int px_open_sockets */
+
+static int px_config (oconfig_item_t *ci) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Host", child->key) == 0)
+      cf_util_get_string (child, &conf_node);
+    else if (strcasecmp ("Port", child->key) == 0)
+      cf_util_get_service (child, &conf_service);
+    else if (strcasecmp ("Threads", child->key) == 0)
+    {
+      int tmp = (int) conf_threads_num;
+      if ((cf_util_get_int (child, &tmp) == 0)
+          && ((tmp < 1) || (tmp > 64)))
+        WARNING ("prometheus plugin: `Threads' must be between 1 and 64.");
+      else
+        conf_threads_num = (size_t) tmp;
+    }
+    else if (strcasecmp ("Gzip", child->key) == 0)
+      cf_util_get_boolean (child, &conf_gzip);
+    else
+      ERROR ("prometheus plugin: The \"%s\" config option is not valid.",
+          child->key);
+  }
+
+#if !HAVE_LIBZ
+  if (conf_gzip)
+    NOTICE ("prometheus plugin: Compiled without zlib, responses will not "
+        "be compressed.");
+#endif
+
+  return (0);
+} /* }}} int px_config */
+
+static int px_init (void) /* {{{ */
+{
+  size_t i;
+  int status;
+
+  if (threads != NULL)
+    return (0);
+
+  series = c_htable_create ();
+  families = c_htable_create ();
+  if ((series == NULL) || (families == NULL))
+  {
+    ERROR ("prometheus plugin: c_htable_create failed.");
+    return (-1);
+  }
+
+  if (px_open_sockets () != 0)
+  {
+    ERROR ("prometheus plugin: Listening on [%s]:%s failed.",
+        (conf_node != NULL) ? conf_node : "any",
+        (conf_service != NULL) ? conf_service : PX_DEFAULT_SERVICE);
+    return (-1);
+  }
+
+  threads = calloc (conf_threads_num, sizeof (*threads));
+  if (threads == NULL)
+  {
+    ERROR ("prometheus plugin: calloc failed.");
+    return (-1);
+  }
+  threads_num = conf_threads_num;
+
+  for (i = 0; i < threads_num; i++)
+  {
+    status = plugin_thread_create (&threads[i].id, /* attr = */ NULL,
+        px_thread, threads + i);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("prometheus plugin: pthread_create failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      continue;
+    }
+    threads[i].running = 1;
+  }
+
+  return (0);
+} /* }}} int px_init */
+
+static void px_stop_threads (void) /* {{{ */
+{
+  size_t i;
+
+  threads_quit = 1;
+  for (i = 0; i < threads_num; i++)
+  {
+    if (!threads[i].running)
+      continue;
+    pthread_join (threads[i].id, /* retval = */ NULL);
+    threads[i].running = 0;
+  }
+} /* }}} void px_stop_threads */
+
+/* Called on hitless restarts: the next process accepts the connections now. */
+static int px_handoff (void) /* {{{ */
+{
+  px_stop_threads ();
+  return (0);
+} /* }}} int px_handoff */
+
+static int px_shutdown (void) /* {{{ */
+{
+  size_t i;
+
+  px_stop_threads ();
+  sfree (threads);
+  threads_num = 0;
+
+  for (i = 0; i < listen_fds_num; i++)
+    close (listen_fds[i]);
+  sfree (listen_fds);
+  listen_fds_num = 0;
+
+  while (families_head != NULL)
+  {
+    px_family_t *next = families_head->next;
+    px_family_free (families_head);
+    families_head = next;
+  }
+  c_htable_destroy (series);
+  series = NULL;
+  c_htable_destroy (families);
+  families = NULL;
+
+  px_body_release (body);
+  body = NULL;
+
+  sfree (conf_node);
+  sfree (conf_service);
+
+  return (0);
+} /* }}} int px_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("prometheus", px_config);
+  plugin_register_init ("prometheus", px_init);
+  plugin_register_handoff ("prometheus", px_handoff);
+  plugin_register_shutdown ("prometheus", px_shutdown);
+} /* void module_register */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
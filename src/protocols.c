@@ -43,6 +43,9 @@ static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static ignorelist_t *values_list = NULL;
 
+static pread_file_t *pf_snmp = NULL;
+static pread_file_t *pf_netstat = NULL;
+
 /* 
  * Functions
  */
@@ -72,11 +75,12 @@ static void submit (const char *protocol_name,
   plugin_dispatch_values (&vl);
 } /* void submit */
 
-static int read_file (const char *path)
+static int read_file (pread_file_t **pf, const char *path)
 {
-  FILE *fh;
-  char key_buffer[4096];
-  char value_buffer[4096];
+  char *buffer;
+  char *ptr;
+  char *key_buffer;
+  char *value_buffer;
   char *key_ptr;
   char *value_ptr;
   char *key_fields[256];
@@ -86,40 +90,31 @@ static int read_file (const char *path)
   int status;
   int i;
 
-  fh = fopen (path, "r");
-  if (fh == NULL)
+  if (*pf == NULL)
+    *pf = pread_file_create (path);
+
+  buffer = pread_file_read (*pf, NULL);
+  if (buffer == NULL)
   {
-    ERROR ("protocols plugin: fopen (%s) failed: %s.",
-        path, sstrerror (errno, key_buffer, sizeof (key_buffer)));
+    char errbuf[1024];
+    ERROR ("protocols plugin: Reading %s failed: %s.",
+        path, sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
+  ptr = buffer;
   status = -1;
   while (42)
   {
-    clearerr (fh);
-    key_ptr = fgets (key_buffer, sizeof (key_buffer), fh);
-    if (key_ptr == NULL)
+    key_buffer = strline (&ptr);
+    if (key_buffer == NULL)
     {
-      if (feof (fh) != 0)
-      {
-        status = 0;
-        break;
-      }
-      else if (ferror (fh) != 0)
-      {
-        ERROR ("protocols plugin: Reading from %s failed.", path);
-        break;
-      }
-      else
-      {
-        ERROR ("protocols plugin: fgets failed for an unknown reason.");
-        break;
-      }
-    } /* if (key_ptr == NULL) */
+      status = 0;
+      break;
+    }
 
-    value_ptr = fgets (value_buffer, sizeof (value_buffer), fh);
-    if (value_ptr == NULL)
+    value_buffer = strline (&ptr);
+    if (value_buffer == NULL)
     {
       ERROR ("protocols plugin: read_file (%s): Could not read values line.",
           path);
@@ -153,10 +148,9 @@ static int read_file (const char *path)
       break;
     }
 
-
-    key_fields_num = strsplit (key_ptr,
+    key_fields_num = strsplit_line (&key_ptr,
         key_fields, STATIC_ARRAY_SIZE (key_fields));
-    value_fields_num = strsplit (value_ptr,
+    value_fields_num = strsplit_line (&value_ptr,
         value_fields, STATIC_ARRAY_SIZE (value_fields));
 
     if (key_fields_num != value_fields_num)
@@ -184,8 +178,6 @@ static int read_file (const char *path)
     } /* for (i = 0; i < key_fields_num; i++) */
   } /* while (42) */
 
-  fclose (fh);
-
   return (status);
 } /* int read_file */
 
@@ -194,11 +186,11 @@ static int protocols_read (void)
   int status;
   int success = 0;
 
-  status = read_file (SNMP_FILE);
+  status = read_file (&pf_snmp, SNMP_FILE);
   if (status == 0)
     success++;
 
-  status = read_file (NETSTAT_FILE);
+  status = read_file (&pf_netstat, NETSTAT_FILE);
   if (status == 0)
     success++;
 
@@ -232,11 +224,22 @@ static int protocols_config (const char *key, const char *value)
   return (0);
 } /* int protocols_config */
 
+static int protocols_shutdown (void)
+{
+  pread_file_destroy (pf_snmp);
+  pf_snmp = NULL;
+  pread_file_destroy (pf_netstat);
+  pf_netstat = NULL;
+
+  return (0);
+} /* int protocols_shutdown */
+
 void module_register (void)
 {
   plugin_register_config ("protocols", protocols_config,
       config_keys, config_keys_num);
   plugin_register_read ("protocols", protocols_read);
+  plugin_register_shutdown ("protocols", protocols_shutdown);
 } /* void module_register */
 
 /* vim: set sw=2 sts=2 et : */
@@ -31,9 +31,14 @@
 #if HAVE_PTHREAD_H
 # include <pthread.h>
 #endif
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "collectd.h"
 #include "common.h"
+#include "utils_cmd_putnotif.h"
+#include "utils_cmd_putval.h"
+#include "utils_parse_option.h"
 
 #include "cpython.h"
 
@@ -150,6 +155,37 @@ static char reg_write_doc[] = "register_write(callback[, data][, name]) -> ident
 		"data: The optional data parameter passed to the register function.\n"
 		"    If the parameter was omitted it will be omitted here, too.";
 
+static char reg_write_batch_doc[] = "register_write_batch(callback[, data][, name]) -> identifier\n"
+		"\n"
+		"Register a callback function to receive values dispatched by other plugins\n"
+		"in batches. This is a lot faster than 'register_write' if many values are\n"
+		"written. Unregister it with 'unregister_write'.\n"
+		"'callback' is a callable object that will be called with all the values\n"
+		"    a write thread has taken from the queue in one go.\n"
+		"'data' is an optional object that will be passed back to the callback\n"
+		"    function every time it is called.\n"
+		"'name' is an optional identifier for this callback. The default name\n"
+		"    is 'python.<module>'.\n"
+		"'identifier' is the full identifier assigned to this callback.\n"
+		"\n"
+		"The callback function will be called with one or two parameters:\n"
+		"values: A list of (host, plugin, plugin_instance, type, type_instance,\n"
+		"    time, interval, values) tuples, where 'values' is a tuple of numbers.\n"
+		"    Meta data is not passed.\n"
+		"data: The optional data parameter passed to the register function.\n"
+		"    If the parameter was omitted it will be omitted here, too.";
+
+static char dispatch_many_doc[] = "dispatch_many(values[, plugin][, plugin_instance][, host][, time]"
+		"[, interval]) -> None\n"
+		"\n"
+		"Dispatch many value lists at once. This is a lot faster than calling\n"
+		"Values.dispatch for each of them.\n"
+		"'values' is a sequence of (type, type_instance, values) tuples, where\n"
+		"    'values' is a list or tuple of numbers like Values.values.\n"
+		"The other parameters are the same for all value lists. 'plugin' defaults\n"
+		"to 'python', 'host' to the global hostname and 'time' to now.\n"
+		"Meta data cannot be dispatched this way.";
+
 static char reg_notification_doc[] = "register_notification(callback[, data][, name]) -> identifier\n"
 		"\n"
 		"Register a callback function for notifications.\n"
@@ -223,6 +259,44 @@ static cpy_callback_t *cpy_config_callbacks;
 static cpy_callback_t *cpy_init_callbacks;
 static cpy_callback_t *cpy_shutdown_callbacks;
 
+/*
+ * Worker processes
+ *
+ * Modules imported with "ImportWorker" run in a process of their own, so that
+ * they don't compete for the GIL with the other modules. The process is
+ * forked in cpy_init, before any python threads are started, and only runs
+ * the config, init, read and shutdown callbacks of its module. Values and
+ * notifications are sent back to the daemon as PUTVAL and PUTNOTIF commands,
+ * see collectd-unixsock(5), and dispatched there by a reader thread.
+ */
+#define CPY_WORKER_BUFFER_SIZE 65536
+
+typedef struct cpy_worker_s {
+	char *module;
+	/* The <Module> blocks of the module, dispatched in the worker. */
+	oconfig_item_t **configs;
+	size_t configs_num;
+	pid_t pid;
+	int fd;
+	pthread_t thread;
+	_Bool thread_running;
+	struct cpy_worker_s *next;
+} cpy_worker_t;
+
+typedef struct cpy_worker_read_s {
+	cpy_callback_t *c;
+	cdtime_t interval;
+	cdtime_t next_read;
+	struct cpy_worker_read_s *next;
+} cpy_worker_read_t;
+
+static cpy_worker_t *cpy_workers;
+
+/* Only set in worker processes. */
+static FILE *cpy_worker_fh;
+static cpy_worker_read_t *cpy_worker_reads;
+static volatile sig_atomic_t cpy_worker_stop;
+
 static void cpy_destroy_user_data(void *data) {
 	cpy_callback_t *c = data;
 	free(c->name);
@@ -331,6 +405,56 @@ static int cpy_read_callback(user_data_t *data) {
 	return 0;
 }
 
+/* Returns a new reference to "value" as a Python number, or NULL if "type"
+ * is unknown. */
+static PyObject *cpy_value_to_python(int type, value_t value) {
+	if (type == DS_TYPE_COUNTER) {
+		if ((long) value.counter == value.counter)
+			return PyInt_FromLong(value.counter);
+		return PyLong_FromUnsignedLongLong(value.counter);
+	} else if (type == DS_TYPE_GAUGE) {
+		return PyFloat_FromDouble(value.gauge);
+	} else if (type == DS_TYPE_DERIVE) {
+		if ((long) value.derive == value.derive)
+			return PyInt_FromLong(value.derive);
+		return PyLong_FromLongLong(value.derive);
+	} else if (type == DS_TYPE_ABSOLUTE) {
+		if ((long) value.absolute == value.absolute)
+			return PyInt_FromLong(value.absolute);
+		return PyLong_FromUnsignedLongLong(value.absolute);
+	}
+	return NULL;
+}
+
+/* Converts "item" to a value of type "type". Returns non-zero and sets an
+ * exception on failure. */
+static int cpy_value_from_python(int type, PyObject *item, value_t *value) {
+	PyObject *num;
+
+	if (type == DS_TYPE_GAUGE) {
+		num = PyNumber_Float(item); /* New reference. */
+		if (num == NULL)
+			return -1;
+		value->gauge = PyFloat_AsDouble(num);
+	} else {
+		num = PyNumber_Long(item); /* New reference. */
+		if (num == NULL)
+			return -1;
+		/* This might overflow without raising an exception.
+		 * Not much we can do about it */
+		if (type == DS_TYPE_COUNTER)
+			value->counter = PyLong_AsUnsignedLongLong(num);
+		else if (type == DS_TYPE_DERIVE)
+			value->derive = PyLong_AsLongLong(num);
+		else if (type == DS_TYPE_ABSOLUTE)
+			value->absolute = PyLong_AsUnsignedLongLong(num);
+		else
+			PyErr_Format(PyExc_RuntimeError, "unknown data type %d", type);
+	}
+	Py_DECREF(num);
+	return (PyErr_Occurred() != NULL) ? -1 : 0;
+}
+
 static int cpy_write_callback(const data_set_t *ds, const value_list_t *value_list, user_data_t *data) {
 	int i;
 	cpy_callback_t *c = data->data;
@@ -344,24 +468,10 @@ static int cpy_write_callback(const data_set_t *ds, const value_list_t *value_li
 			CPY_RETURN_FROM_THREADS 0;
 		}
 		for (i = 0; i < value_list->values_len; ++i) {
-			if (ds->ds[i].type == DS_TYPE_COUNTER) {
-				if ((long) value_list->values[i].counter == value_list->values[i].counter)
-					PyList_SetItem(list, i, PyInt_FromLong(value_list->values[i].counter));
-				else
-					PyList_SetItem(list, i, PyLong_FromUnsignedLongLong(value_list->values[i].counter));
-			} else if (ds->ds[i].type == DS_TYPE_GAUGE) {
-				PyList_SetItem(list, i, PyFloat_FromDouble(value_list->values[i].gauge));
-			} else if (ds->ds[i].type == DS_TYPE_DERIVE) {
-				if ((long) value_list->values[i].derive == value_list->values[i].derive)
-					PyList_SetItem(list, i, PyInt_FromLong(value_list->values[i].derive));
-				else
-					PyList_SetItem(list, i, PyLong_FromLongLong(value_list->values[i].derive));
-			} else if (ds->ds[i].type == DS_TYPE_ABSOLUTE) {
-				if ((long) value_list->values[i].absolute == value_list->values[i].absolute)
-					PyList_SetItem(list, i, PyInt_FromLong(value_list->values[i].absolute));
-				else
-					PyList_SetItem(list, i, PyLong_FromUnsignedLongLong(value_list->values[i].absolute));
-			} else {
+			temp = cpy_value_to_python(ds->ds[i].type, value_list->values[i]); /* New reference. */
+			if (temp != NULL) {
+				PyList_SetItem(list, i, temp); /* Steals a reference. */
+			} else if (PyErr_Occurred() == NULL) {
 				Py_BEGIN_ALLOW_THREADS
 				ERROR("cpy_write_callback: Unknown value type %d.", ds->ds[i].type);
 				Py_END_ALLOW_THREADS
@@ -450,6 +560,62 @@ static int cpy_write_callback(const data_set_t *ds, const value_list_t *value_li
 	return 0;
 }
 
+/* Builds one lightweight tuple per value list, without meta data, and calls
+ * the callback once for all of them. */
+static int cpy_write_batch_callback(const plugin_write_item_t *items, size_t items_num, user_data_t *data) {
+	size_t i;
+	int j;
+	cpy_callback_t *c = data->data;
+	PyObject *ret, *list;
+
+	CPY_LOCK_THREADS
+		list = PyList_New((Py_ssize_t) items_num); /* New reference. */
+		if (list == NULL) {
+			cpy_log_exception("write batch callback");
+			CPY_RETURN_FROM_THREADS 0;
+		}
+		for (i = 0; i < items_num; ++i) {
+			const data_set_t *ds = items[i].ds;
+			const value_list_t *vl = items[i].vl;
+			PyObject *values, *tuple;
+
+			values = PyTuple_New(vl->values_len); /* New reference. */
+			for (j = 0; (values != NULL) && (j < vl->values_len); ++j) {
+				PyObject *v = cpy_value_to_python(ds->ds[j].type, vl->values[j]); /* New reference. */
+				if (v == NULL) {
+					Py_CLEAR(values);
+					break;
+				}
+				PyTuple_SET_ITEM(values, j, v); /* Steals a reference. */
+			}
+			if (values == NULL) {
+				if (PyErr_Occurred() != NULL)
+					cpy_log_exception("value building for write batch callback");
+				Py_DECREF(list);
+				CPY_RETURN_FROM_THREADS 0;
+			}
+			tuple = Py_BuildValue("(sssssddN)", vl->host, vl->plugin, /* New reference. */
+					vl->plugin_instance, vl->type, vl->type_instance,
+					CDTIME_T_TO_DOUBLE(vl->time), CDTIME_T_TO_DOUBLE(vl->interval),
+					values);
+			if (tuple == NULL) {
+				cpy_log_exception("value building for write batch callback");
+				Py_DECREF(list);
+				CPY_RETURN_FROM_THREADS 0;
+			}
+			PyList_SET_ITEM(list, (Py_ssize_t) i, tuple); /* Steals a reference. */
+		}
+		ret = PyObject_CallFunctionObjArgs(c->callback, list, c->data, (void *) 0); /* New reference. */
+		Py_DECREF(list);
+		if (ret == NULL) {
+			cpy_log_exception("write batch callback");
+		} else {
+			Py_DECREF(ret);
+		}
+	CPY_RELEASE_THREADS
+	return 0;
+}
+
 static int cpy_notification_callback(const notification_t *notification, user_data_t *data) {
 	cpy_callback_t *c = data->data;
 	PyObject *ret, *notify;
@@ -633,6 +799,18 @@ static PyObject *cpy_register_read(PyObject *self, PyObject *args, PyObject *kwd
 	user_data = malloc(sizeof(*user_data));
 	user_data->free_func = cpy_destroy_user_data;
 	user_data->data = c;
+	if (cpy_worker_fh != NULL) {
+		/* Worker processes call their read callbacks themselves. */
+		cpy_worker_read_t *r = calloc(1, sizeof(*r));
+		if (r != NULL) {
+			r->c = c;
+			r->interval = (interval > 0) ? DOUBLE_TO_CDTIME_T(interval) : plugin_get_interval();
+			r->next = cpy_worker_reads;
+			cpy_worker_reads = r;
+		}
+		free(user_data);
+		return cpy_string_to_unicode_or_bytes(buf);
+	}
 	ts.tv_sec = interval;
 	ts.tv_nsec = (interval - ts.tv_sec) * 1000000000;
 	plugin_register_complex_read(/* group = */ NULL, buf,
@@ -650,6 +828,11 @@ static PyObject *cpy_register_write(PyObject *self, PyObject *args, PyObject *kw
 			(void *) cpy_write_callback, args, kwds);
 }
 
+static PyObject *cpy_register_write_batch(PyObject *self, PyObject *args, PyObject *kwds) {
+	return cpy_register_generic_userdata((void *) plugin_register_write_batch,
+			(void *) cpy_write_batch_callback, args, kwds);
+}
+
 static PyObject *cpy_register_notification(PyObject *self, PyObject *args, PyObject *kwds) {
 	return cpy_register_generic_userdata((void *) plugin_register_notification,
 			(void *) cpy_notification_callback, args, kwds);
@@ -664,6 +847,169 @@ static PyObject *cpy_register_shutdown(PyObject *self, PyObject *args, PyObject
 	return cpy_register_generic(&cpy_shutdown_callbacks, args, kwds);
 }
 
+typedef struct {
+	char type[DATA_MAX_NAME_LEN];
+	char type_instance[DATA_MAX_NAME_LEN];
+} cpy_type_t;
+
+/* Converts one (type, type_instance, values) tuple. The values are stored in
+ * "*values", which is grown as needed. */
+static int cpy_dispatch_many_item(PyObject *item, cpy_type_t *t, value_t **values,
+		size_t *values_num, size_t *values_size) {
+	const char *type, *type_instance = NULL;
+	PyObject *type_obj, *type_instance_obj, *seq;
+	const data_set_t *ds;
+	Py_ssize_t i, size;
+
+	if (!PyTuple_Check(item) || (PyTuple_GET_SIZE(item) != 3)) {
+		PyErr_SetString(PyExc_TypeError, "values must contain (type, type_instance, values) tuples");
+		return -1;
+	}
+
+	type_obj = PyTuple_GET_ITEM(item, 0); /* Borrowed reference. */
+	Py_INCREF(type_obj);
+	type = cpy_unicode_or_bytes_to_string(&type_obj);
+	if (type == NULL) {
+		Py_XDECREF(type_obj);
+		return -1;
+	}
+	sstrncpy(t->type, type, sizeof(t->type));
+	Py_DECREF(type_obj);
+
+	type_instance_obj = PyTuple_GET_ITEM(item, 1); /* Borrowed reference. */
+	Py_INCREF(type_instance_obj);
+	if (type_instance_obj != Py_None) {
+		type_instance = cpy_unicode_or_bytes_to_string(&type_instance_obj);
+		if (type_instance == NULL) {
+			Py_XDECREF(type_instance_obj);
+			return -1;
+		}
+	}
+	sstrncpy(t->type_instance, type_instance ? type_instance : "", sizeof(t->type_instance));
+	Py_DECREF(type_instance_obj);
+
+	ds = plugin_get_ds(t->type);
+	if (ds == NULL) {
+		PyErr_Format(PyExc_TypeError, "Dataset %s not found", t->type);
+		return -1;
+	}
+
+	seq = PySequence_Fast(PyTuple_GET_ITEM(item, 2), "values must be list or tuple"); /* New reference. */
+	if (seq == NULL)
+		return -1;
+	size = PySequence_Fast_GET_SIZE(seq);
+	if (size != ds->ds_num) {
+		PyErr_Format(PyExc_RuntimeError, "type %s needs %d values, got %i", t->type, ds->ds_num, (int) size);
+		Py_DECREF(seq);
+		return -1;
+	}
+
+	if (*values_num + (size_t) size > *values_size) {
+		size_t new_size = 2 * (*values_size) + (size_t) size;
+		value_t *tmp = realloc(*values, new_size * sizeof(**values));
+		if (tmp == NULL) {
+			Py_DECREF(seq);
+			PyErr_NoMemory();
+			return -1;
+		}
+		*values = tmp;
+		*values_size = new_size;
+	}
+
+	for (i = 0; i < size; ++i) {
+		if (cpy_value_from_python(ds->ds[i].type, PySequence_Fast_GET_ITEM(seq, i),
+					*values + *values_num + i) != 0) {
+			Py_DECREF(seq);
+			return -1;
+		}
+	}
+	*values_num += (size_t) size;
+	Py_DECREF(seq);
+	return 0;
+}
+
+static PyObject *cpy_dispatch_many(PyObject *self, PyObject *args, PyObject *kwds) {
+	Py_ssize_t i, num;
+	int ret;
+	char *host = NULL, *plugin = NULL, *plugin_instance = NULL;
+	double time = 0, interval = 0;
+	PyObject *values, *seq;
+	value_list_t tmpl = VALUE_LIST_INIT;
+	cpy_type_t *types;
+	plugin_value_entry_t *entries;
+	value_t *v = NULL;
+	size_t v_num = 0, v_size = 0, offset = 0;
+	static char *kwlist[] = {"values", "plugin", "plugin_instance", "host", "time", "interval", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|etetetdd", kwlist, &values,
+			NULL, &plugin, NULL, &plugin_instance, NULL, &host, &time, &interval))
+		return NULL;
+
+	sstrncpy(tmpl.host, host ? host : hostname_g, sizeof(tmpl.host));
+	sstrncpy(tmpl.plugin, plugin ? plugin : "python", sizeof(tmpl.plugin));
+	if (plugin_instance != NULL)
+		sstrncpy(tmpl.plugin_instance, plugin_instance, sizeof(tmpl.plugin_instance));
+	PyMem_Free(host);
+	PyMem_Free(plugin);
+	PyMem_Free(plugin_instance);
+	tmpl.time = DOUBLE_TO_CDTIME_T(time);
+	tmpl.interval = DOUBLE_TO_CDTIME_T(interval);
+
+	seq = PySequence_Fast(values, "values must be a sequence"); /* New reference. */
+	if (seq == NULL)
+		return NULL;
+	num = PySequence_Fast_GET_SIZE(seq);
+	if (num == 0) {
+		Py_DECREF(seq);
+		Py_RETURN_NONE;
+	}
+
+	types = malloc(num * sizeof(*types));
+	entries = malloc(num * sizeof(*entries));
+	if ((types == NULL) || (entries == NULL)) {
+		free(types);
+		free(entries);
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < num; ++i) {
+		if (cpy_dispatch_many_item(PySequence_Fast_GET_ITEM(seq, i), types + i,
+				&v, &v_num, &v_size) != 0) {
+			free(types);
+			free(entries);
+			free(v);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		entries[i].type = types[i].type;
+		entries[i].type_instance = types[i].type_instance;
+		/* "v" may still move, so only the number of values is stored here. */
+		entries[i].values_len = (int) (v_num - offset);
+		offset = v_num;
+	}
+	Py_DECREF(seq);
+
+	offset = 0;
+	for (i = 0; i < num; ++i) {
+		entries[i].values = v + offset;
+		offset += (size_t) entries[i].values_len;
+	}
+
+	Py_BEGIN_ALLOW_THREADS;
+	ret = cpy_dispatch_values_multi(&tmpl, entries, (size_t) num);
+	Py_END_ALLOW_THREADS;
+
+	free(types);
+	free(entries);
+	free(v);
+	if (ret != 0) {
+		PyErr_SetString(PyExc_RuntimeError, "error dispatching values, read the logs");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
 static PyObject *cpy_error(PyObject *self, PyObject *args) {
 	char *text;
 	if (PyArg_ParseTuple(args, "et", NULL, &text) == 0) return NULL;
@@ -818,11 +1164,13 @@ static PyMethodDef cpy_methods[] = {
 	{"warning", cpy_warning, METH_VARARGS, log_doc},
 	{"error", cpy_error, METH_VARARGS, log_doc},
 	{"flush", (PyCFunction) cpy_flush, METH_VARARGS | METH_KEYWORDS, flush_doc},
+	{"dispatch_many", (PyCFunction) cpy_dispatch_many, METH_VARARGS | METH_KEYWORDS, dispatch_many_doc},
 	{"register_log", (PyCFunction) cpy_register_log, METH_VARARGS | METH_KEYWORDS, reg_log_doc},
 	{"register_init", (PyCFunction) cpy_register_init, METH_VARARGS | METH_KEYWORDS, reg_init_doc},
 	{"register_config", (PyCFunction) cpy_register_config, METH_VARARGS | METH_KEYWORDS, reg_config_doc},
 	{"register_read", (PyCFunction) cpy_register_read, METH_VARARGS | METH_KEYWORDS, reg_read_doc},
 	{"register_write", (PyCFunction) cpy_register_write, METH_VARARGS | METH_KEYWORDS, reg_write_doc},
+	{"register_write_batch", (PyCFunction) cpy_register_write_batch, METH_VARARGS | METH_KEYWORDS, reg_write_batch_doc},
 	{"register_notification", (PyCFunction) cpy_register_notification, METH_VARARGS | METH_KEYWORDS, reg_notification_doc},
 	{"register_flush", (PyCFunction) cpy_register_flush, METH_VARARGS | METH_KEYWORDS, reg_flush_doc},
 	{"register_shutdown", (PyCFunction) cpy_register_shutdown, METH_VARARGS | METH_KEYWORDS, reg_shutdown_doc},
@@ -837,10 +1185,400 @@ static PyMethodDef cpy_methods[] = {
 	{0, 0, 0, 0}
 };
 
+static PyObject *cpy_oconfig_to_pyconfig(oconfig_item_t *ci, PyObject *parent);
+
+/* Calls the config callback registered for a <Module> block. */
+static void cpy_config_module(oconfig_item_t *item, _Bool quiet) {
+	char *name = NULL;
+	cpy_callback_t *c;
+	PyObject *ret;
+
+	if (cf_util_get_string(item, &name) != 0)
+		return;
+	for (c = cpy_config_callbacks; c; c = c->next) {
+		if (strcasecmp(c->name + 7, name) == 0)
+			break;
+	}
+	if (c == NULL) {
+		if (!quiet)
+			WARNING("python plugin: Found a configuration for the \"%s\" plugin, "
+				"but the plugin isn't loaded or didn't register "
+				"a configuration callback.", name);
+		free(name);
+		return;
+	}
+	free(name);
+	if (c->data == NULL)
+		ret = PyObject_CallFunction(c->callback, "N",
+			cpy_oconfig_to_pyconfig(item, NULL)); /* New reference. */
+	else
+		ret = PyObject_CallFunction(c->callback, "NO",
+			cpy_oconfig_to_pyconfig(item, NULL), c->data); /* New reference. */
+	if (ret == NULL)
+		cpy_log_exception("loading module");
+	else
+		Py_DECREF(ret);
+}
+
+int cpy_dispatch_values(const value_list_t *vl) {
+	char buffer[1024 + 8 * DATA_MAX_NAME_LEN];
+	const data_set_t *ds;
+	value_list_t copy;
+
+	if (cpy_worker_fh == NULL)
+		return plugin_dispatch_values(vl);
+
+	ds = plugin_get_ds(vl->type);
+	if (ds == NULL)
+		return -1;
+
+	/* The daemon would use the time it reads the line otherwise. */
+	memcpy(&copy, vl, sizeof(copy));
+	if (copy.time == 0)
+		copy.time = cdtime();
+
+	if (create_putval(buffer, sizeof(buffer), ds, &copy) != 0)
+		return -1;
+	if (fprintf(cpy_worker_fh, "%s\n", buffer) < 0)
+		return -1;
+	return 0;
+}
+
+int cpy_dispatch_values_multi(const value_list_t *tmpl,
+		const plugin_value_entry_t *entries, size_t entries_num) {
+	value_list_t vl;
+	size_t i;
+
+	if (cpy_worker_fh == NULL)
+		return plugin_dispatch_values_multi(tmpl, entries, entries_num);
+
+	memcpy(&vl, tmpl, sizeof(vl));
+	for (i = 0; i < entries_num; ++i) {
+		if (entries[i].type != NULL)
+			sstrncpy(vl.type, entries[i].type, sizeof(vl.type));
+		if (entries[i].type_instance != NULL)
+			sstrncpy(vl.type_instance, entries[i].type_instance, sizeof(vl.type_instance));
+		vl.values = entries[i].values;
+		vl.values_len = entries[i].values_len;
+		if (cpy_dispatch_values(&vl) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Appends " key=value" to "buffer", quoting the value if necessary. Empty
+ * values are left out. */
+static void cpy_putnotif_option(char *buffer, size_t buffer_size,
+		const char *key, const char *value) {
+	char tmp[NOTIF_MAX_MSG_LEN + 2];
+	size_t len = strlen(buffer);
+	char *ptr;
+
+	if (value[0] == 0)
+		return;
+	sstrncpy(tmp, value, sizeof(tmp));
+	/* Each command takes one line. */
+	for (ptr = strpbrk(tmp, "\r\n"); ptr != NULL; ptr = strpbrk(ptr, "\r\n"))
+		*ptr = ' ';
+	escape_string(tmp, sizeof(tmp));
+	if (len < buffer_size)
+		ssnprintf(buffer + len, buffer_size - len, " %s=%s", key, tmp);
+}
+
+int cpy_dispatch_notification(const notification_t *n) {
+	char buffer[2 * NOTIF_MAX_MSG_LEN + 8 * DATA_MAX_NAME_LEN];
+	char time_str[32];
+
+	if (cpy_worker_fh == NULL)
+		return plugin_dispatch_notification(n);
+
+	ssnprintf(time_str, sizeof(time_str), "%.3f",
+			CDTIME_T_TO_DOUBLE((n->time != 0) ? n->time : cdtime()));
+	sstrncpy(buffer, "PUTNOTIF", sizeof(buffer));
+	cpy_putnotif_option(buffer, sizeof(buffer), "severity",
+			(n->severity == NOTIF_FAILURE) ? "failure"
+			: (n->severity == NOTIF_WARNING) ? "warning" : "okay");
+	cpy_putnotif_option(buffer, sizeof(buffer), "time", time_str);
+	cpy_putnotif_option(buffer, sizeof(buffer), "host", n->host);
+	cpy_putnotif_option(buffer, sizeof(buffer), "plugin", n->plugin);
+	cpy_putnotif_option(buffer, sizeof(buffer), "plugin_instance", n->plugin_instance);
+	cpy_putnotif_option(buffer, sizeof(buffer), "type", n->type);
+	cpy_putnotif_option(buffer, sizeof(buffer), "type_instance", n->type_instance);
+	cpy_putnotif_option(buffer, sizeof(buffer), "message", n->message);
+	if (fprintf(cpy_worker_fh, "%s\n", buffer) < 0)
+		return -1;
+	return 0;
+}
+
+static void cpy_worker_signal_handler(int sig) {
+	cpy_worker_stop = 1;
+}
+
+/* Calls the read callbacks of a worker process until it is told to stop. */
+static void cpy_worker_loop(void) {
+	cpy_worker_read_t *r;
+	PyObject *ret;
+
+	for (r = cpy_worker_reads; r; r = r->next)
+		r->next_read = cdtime();
+
+	while (!cpy_worker_stop) {
+		cdtime_t now = cdtime();
+		cdtime_t next = now + plugin_get_interval();
+		struct timespec ts;
+
+		for (r = cpy_worker_reads; r; r = r->next) {
+			if (r->next_read <= now) {
+				ret = PyObject_CallFunctionObjArgs(r->c->callback, r->c->data, (void *) 0); /* New reference. */
+				if (ret == NULL)
+					cpy_log_exception("read callback");
+				else
+					Py_DECREF(ret);
+				r->next_read += r->interval;
+				if (r->next_read <= now)
+					r->next_read = now + r->interval;
+			}
+			if (r->next_read < next)
+				next = r->next_read;
+		}
+
+		/* The daemon is gone if this fails. */
+		if (fflush(cpy_worker_fh) != 0)
+			break;
+
+		now = cdtime();
+		if (next > now) {
+			CDTIME_T_TO_TIMESPEC(next - now, &ts);
+			nanosleep(&ts, /* remaining = */ NULL);
+		}
+	}
+}
+
+static void cpy_call_callbacks(cpy_callback_t *list, const char *context) {
+	cpy_callback_t *c;
+	PyObject *ret;
+
+	for (c = list; c; c = c->next) {
+		ret = PyObject_CallFunctionObjArgs(c->callback, c->data, (void *) 0); /* New reference. */
+		if (ret == NULL)
+			cpy_log_exception(context);
+		else
+			Py_DECREF(ret);
+	}
+}
+
+/* Runs in the forked process and never returns. */
+static void cpy_worker_main(cpy_worker_t *w, int fd) {
+	struct sigaction sa;
+	cpy_worker_t *other;
+	PyObject *module;
+	size_t i;
+
+#if PY_VERSION_HEX >= 0x03070000
+	PyOS_AfterFork_Child();
+#else
+	PyOS_AfterFork();
+#endif
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cpy_worker_signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (other = cpy_workers; other; other = other->next) {
+		if ((other != w) && (other->fd >= 0))
+			close(other->fd);
+	}
+
+	cpy_worker_fh = fdopen(fd, "w");
+	if (cpy_worker_fh == NULL)
+		_exit(1);
+
+	/* The callbacks of the modules imported by the daemon must not run here,
+	 * too. They are never freed, but the process doesn't need that memory. */
+	cpy_config_callbacks = NULL;
+	cpy_init_callbacks = NULL;
+	cpy_shutdown_callbacks = NULL;
+
+	module = PyImport_ImportModule(w->module); /* New reference. */
+	if (module == NULL) {
+		ERROR("python plugin: Error importing module \"%s\" in its worker.", w->module);
+		cpy_log_exception("importing module");
+		_exit(1);
+	}
+	Py_DECREF(module);
+
+	for (i = 0; i < w->configs_num; ++i)
+		cpy_config_module(w->configs[i], /* quiet = */ 0);
+
+	cpy_call_callbacks(cpy_init_callbacks, "init callback");
+	cpy_worker_loop();
+	cpy_call_callbacks(cpy_shutdown_callbacks, "shutdown callback");
+
+	fclose(cpy_worker_fh);
+	_exit(0);
+}
+
+/* Reads the commands written by a worker and dispatches them. */
+static void *cpy_worker_reader(void *arg) {
+	cpy_worker_t *w = arg;
+	putval_batch_t *batch;
+	char *buffer;
+	size_t buffer_fill = 0;
+
+	batch = putval_batch_create();
+	buffer = malloc(CPY_WORKER_BUFFER_SIZE);
+	if ((batch == NULL) || (buffer == NULL)) {
+		ERROR("python plugin: malloc failed.");
+		putval_batch_destroy(batch);
+		free(buffer);
+		return NULL;
+	}
+
+	while (42) {
+		ssize_t len;
+		char *line, *end;
+		size_t remaining;
+
+		len = read(w->fd, buffer + buffer_fill, CPY_WORKER_BUFFER_SIZE - 1 - buffer_fill);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		} else if (len == 0) {
+			break;
+		}
+		buffer_fill += (size_t) len;
+
+		line = buffer;
+		remaining = buffer_fill;
+		while ((end = memchr(line, '\n', remaining)) != NULL) {
+			*end = 0;
+			if (strncasecmp("PUTVAL", line, strlen("PUTVAL")) == 0) {
+				putval_batch_add(batch, stdout, line);
+			} else if (strncasecmp("PUTNOTIF", line, strlen("PUTNOTIF")) == 0) {
+				putval_batch_flush(batch);
+				handle_putnotif(stdout, line);
+			}
+			remaining -= (size_t) (end + 1 - line);
+			line = end + 1;
+		}
+		putval_batch_flush(batch);
+
+		/* The worker only writes lines created by create_putval, which are
+		 * shorter than this. */
+		if (remaining >= CPY_WORKER_BUFFER_SIZE - 1)
+			remaining = 0;
+		if ((remaining > 0) && (line != buffer))
+			memmove(buffer, line, remaining);
+		buffer_fill = remaining;
+	}
+
+	if (!cpy_worker_stop)
+		ERROR("python plugin: The worker process of module \"%s\" exited.", w->module);
+
+	putval_batch_destroy(batch);
+	free(buffer);
+	return NULL;
+}
+
+static int cpy_worker_start(cpy_worker_t *w) {
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0) {
+		char errbuf[1024];
+		ERROR("python plugin: pipe failed: %s",
+				sstrerror(errno, errbuf, sizeof(errbuf)));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		char errbuf[1024];
+		ERROR("python plugin: fork failed: %s",
+				sstrerror(errno, errbuf, sizeof(errbuf)));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		cpy_worker_main(w, fds[1]);
+	}
+
+	close(fds[1]);
+	w->pid = pid;
+	w->fd = fds[0];
+
+	if (plugin_thread_create(&w->thread, NULL, cpy_worker_reader, w) != 0) {
+		ERROR("python plugin: Error creating the reader thread for module \"%s\".", w->module);
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	w->thread_running = 1;
+	return 0;
+}
+
+/* Asks the worker to exit, giving it two seconds to call its shutdown
+ * callbacks. */
+static void cpy_worker_stop_process(cpy_worker_t *w) {
+	struct timespec ts = { 0, 100000000 }; /* 100 ms */
+	int i;
+
+	if (w->pid <= 0)
+		return;
+
+	kill(w->pid, SIGTERM);
+	for (i = 0; i < 20; i++) {
+		pid_t ret = waitpid(w->pid, NULL, WNOHANG);
+		/* Another plugin's SIGCHLD handler may have reaped it. */
+		if ((ret == w->pid) || ((ret < 0) && (errno == ECHILD)))
+			break;
+		nanosleep(&ts, /* remaining = */ NULL);
+	}
+	if (i >= 20) {
+		kill(w->pid, SIGKILL);
+		waitpid(w->pid, NULL, 0);
+	}
+	w->pid = 0;
+
+	if (w->thread_running)
+		pthread_join(w->thread, NULL);
+	w->thread_running = 0;
+	close(w->fd);
+	w->fd = -1;
+}
+
+static cpy_worker_t *cpy_worker_find(const char *module) {
+	cpy_worker_t *w;
+
+	for (w = cpy_workers; w; w = w->next) {
+		if (strcasecmp(w->module, module) == 0)
+			return w;
+	}
+	return NULL;
+}
+
 static int cpy_shutdown(void) {
 	cpy_callback_t *c;
+	cpy_worker_t *w;
 	PyObject *ret;
 	
+	cpy_worker_stop = 1;
+	while (cpy_workers != NULL) {
+		size_t i;
+
+		w = cpy_workers;
+		cpy_workers = w->next;
+		cpy_worker_stop_process(w);
+		for (i = 0; i < w->configs_num; ++i)
+			oconfig_free(w->configs[i]);
+		free(w->configs);
+		free(w->module);
+		free(w);
+	}
+
 	/* This can happen if the module was loaded but not configured. */
 	if (state != NULL)
 		PyEval_RestoreThread(state);
@@ -909,8 +1647,7 @@ static void *cpy_interactive(void *data) {
 }
 
 static int cpy_init(void) {
-	cpy_callback_t *c;
-	PyObject *ret;
+	cpy_worker_t *w;
 	static pthread_t thread;
 	sigset_t sigset;
 	
@@ -919,15 +1656,12 @@ static int cpy_init(void) {
 		plugin_unregister_shutdown("python");
 		return 0;
 	}
+	/* Fork the workers while no python threads are running. */
+	for (w = cpy_workers; w; w = w->next)
+		cpy_worker_start(w);
 	PyEval_InitThreads();
 	/* Now it's finally OK to use python threads. */
-	for (c = cpy_init_callbacks; c; c = c->next) {
-		ret = PyObject_CallFunctionObjArgs(c->callback, c->data, (void *) 0); /* New reference. */
-		if (ret == NULL)
-			cpy_log_exception("init callback");
-		else
-			Py_DECREF(ret);
-	}
+	cpy_call_callbacks(cpy_init_callbacks, "init callback");
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGINT);
 	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
@@ -1123,35 +1857,37 @@ static int cpy_config(oconfig_item_t *ci) {
 			}
 			free(module_name);
 			Py_XDECREF(module);
-		} else if (strcasecmp(item->key, "Module") == 0) {
-			char *name = NULL;
-			cpy_callback_t *c;
-			PyObject *ret;
+		} else if (strcasecmp(item->key, "ImportWorker") == 0) {
+			cpy_worker_t *w;
 			
-			if (cf_util_get_string(item, &name) != 0)
+			w = calloc(1, sizeof(*w));
+			if (w == NULL)
+				continue;
+			if (cf_util_get_string(item, &w->module) != 0) {
+				free(w);
 				continue;
-			for (c = cpy_config_callbacks; c; c = c->next) {
-				if (strcasecmp(c->name + 7, name) == 0)
-					break;
 			}
-			if (c == NULL) {
-				WARNING("python plugin: Found a configuration for the \"%s\" plugin, "
-					"but the plugin isn't loaded or didn't register "
-					"a configuration callback.", name);
-				free(name);
+			w->fd = -1;
+			w->next = cpy_workers;
+			cpy_workers = w;
+		} else if (strcasecmp(item->key, "Module") == 0) {
+			cpy_worker_t *w = NULL;
+			oconfig_item_t **tmp;
+			
+			if ((item->values_num == 1) && (item->values[0].type == OCONFIG_TYPE_STRING))
+				w = cpy_worker_find(item->values[0].value.string);
+			if (w == NULL) {
+				cpy_config_module(item, /* quiet = */ 0);
 				continue;
 			}
-			free(name);
-			if (c->data == NULL)
-				ret = PyObject_CallFunction(c->callback, "N",
-					cpy_oconfig_to_pyconfig(item, NULL)); /* New reference. */
-			else
-				ret = PyObject_CallFunction(c->callback, "NO",
-					cpy_oconfig_to_pyconfig(item, NULL), c->data); /* New reference. */
-			if (ret == NULL)
-				cpy_log_exception("loading module");
-			else
-				Py_DECREF(ret);
+			/* Keep the block for the worker process. */
+			tmp = realloc(w->configs, (w->configs_num + 1) * sizeof(*w->configs));
+			if (tmp == NULL)
+				continue;
+			w->configs = tmp;
+			w->configs[w->configs_num] = oconfig_clone(item);
+			if (w->configs[w->configs_num] != NULL)
+				w->configs_num++;
 		} else {
 			WARNING("python plugin: Ignoring unknown config key \"%s\".", item->key);
 		}
@@ -594,7 +594,7 @@ static PyObject *Values_dispatch(Values *self, PyObject *args, PyObject *kwds) {
 	if (value_list.plugin[0] == 0)
 		sstrncpy(value_list.plugin, "python", sizeof(value_list.plugin));
 	Py_BEGIN_ALLOW_THREADS;
-	ret = plugin_dispatch_values(&value_list);
+	ret = cpy_dispatch_values(&value_list);
 	Py_END_ALLOW_THREADS;
 	meta_data_destroy(value_list.meta);
 	free(value);
@@ -911,7 +911,7 @@ static PyObject *Notification_dispatch(Notification *self, PyObject *args, PyObj
 	if (notification.plugin[0] == 0)
 		sstrncpy(notification.plugin, "python", sizeof(notification.plugin));
 	Py_BEGIN_ALLOW_THREADS;
-	ret = plugin_dispatch_notification(&notification);
+	ret = cpy_dispatch_notification(&notification);
 	Py_END_ALLOW_THREADS;
 	if (ret != 0) {
 		PyErr_SetString(PyExc_RuntimeError, "error dispatching notification, read the logs");
@@ -59,6 +59,9 @@ struct redis_node_s
   int port;
   int timeout;
 
+  /* The connection is kept open between reads. NULL if not connected. */
+  REDIS rh;
+
   redis_node_t *next;
 };
 
@@ -89,6 +92,7 @@ static int redis_node_add (const redis_node_t *rn) /* {{{ */
   }
 
   memcpy (rn_copy, rn, sizeof (*rn_copy));
+  rn_copy->rh = NULL;
   rn_copy->next = NULL;
 
   DEBUG ("redis plugin: Adding node \"%s\".", rn->name);
@@ -231,7 +235,7 @@ static void redis_submit_d (char *plugin_instance,
 static int redis_init (void) /* {{{ */
 {
   redis_node_t rn = { "default", REDIS_DEF_HOST, REDIS_DEF_PASSWD,
-    REDIS_DEF_PORT, REDIS_DEF_TIMEOUT, /* next = */ NULL };
+    REDIS_DEF_PORT, REDIS_DEF_TIMEOUT, /* rh = */ NULL, /* next = */ NULL };
 
   if (nodes_head == NULL)
     redis_node_add (&rn);
@@ -239,46 +243,89 @@ static int redis_init (void) /* {{{ */
   return (0);
 } /* }}} int redis_init */
 
+static void redis_disconnect (redis_node_t *rn) /* {{{ */
+{
+  if (rn->rh == NULL)
+    return;
+
+  credis_close (rn->rh);
+  rn->rh = NULL;
+} /* }}} void redis_disconnect */
+
+static int redis_connect (redis_node_t *rn) /* {{{ */
+{
+  int status;
+
+  if (rn->rh != NULL)
+    return (0);
+
+  rn->rh = credis_connect (rn->host, rn->port, rn->timeout);
+  if (rn->rh == NULL)
+  {
+    ERROR ("redis plugin: unable to connect to node `%s' (%s:%d).", rn->name, rn->host, rn->port);
+    return (-1);
+  }
+
+  if (strlen (rn->passwd) > 0)
+  {
+    DEBUG ("redis plugin: authenticanting node `%s' passwd(%s).", rn->name, rn->passwd);
+    status = credis_auth(rn->rh, rn->passwd);
+    if (status != 0)
+    {
+      WARNING ("redis plugin: unable to authenticate on node `%s'.", rn->name);
+      redis_disconnect (rn);
+      return (-1);
+    }
+  }
+
+  return (0);
+} /* }}} int redis_connect */
+
+/* Queries INFO, using the connection kept open since the last read if there
+ * is one. Redis may have closed that connection in the meantime, e.g. because
+ * of its "timeout" setting, so the query is repeated once with a new
+ * connection if it fails. */
+static int redis_query_info (redis_node_t *rn, REDIS_INFO *info) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    _Bool reused = (rn->rh != NULL);
+
+    if (redis_connect (rn) != 0)
+      return (-1);
+
+    memset (info, 0, sizeof (*info));
+    if (credis_info (rn->rh, info) == 0)
+      return (0);
+
+    redis_disconnect (rn);
+    if (!reused)
+      break;
+
+    DEBUG ("redis plugin: reconnecting to node `%s'.", rn->name);
+  }
+
+  WARNING ("redis plugin: unable to get info from node `%s'.", rn->name);
+  return (-1);
+} /* }}} int redis_query_info */
+
 static int redis_read (void) /* {{{ */
 {
   redis_node_t *rn;
 
   for (rn = nodes_head; rn != NULL; rn = rn->next)
   {
-    REDIS rh;
     REDIS_INFO info;
 
     int status;
 
     DEBUG ("redis plugin: querying info from node `%s' (%s:%d).", rn->name, rn->host, rn->port);
 
-    rh = credis_connect (rn->host, rn->port, rn->timeout);
-    if (rh == NULL)
-    {
-      ERROR ("redis plugin: unable to connect to node `%s' (%s:%d).", rn->name, rn->host, rn->port);
-      continue;
-    }
-
-    if (strlen (rn->passwd) > 0)
-    {
-      DEBUG ("redis plugin: authenticanting node `%s' passwd(%s).", rn->name, rn->passwd);
-      status = credis_auth(rh, rn->passwd);
-      if (status != 0)
-      {
-        WARNING ("redis plugin: unable to authenticate on node `%s'.", rn->name);
-        credis_close (rh);
-        continue;
-      }
-    }
-
-    memset (&info, 0, sizeof (info));
-    status = credis_info (rh, &info);
+    status = redis_query_info (rn, &info);
     if (status != 0)
-    {
-      WARNING ("redis plugin: unable to get info from node `%s'.", rn->name);
-      credis_close (rh);
       continue;
-    }
 
     /* typedef struct _cr_info {
      *   char redis_version[CREDIS_VERSION_STRING_SIZE];
@@ -310,19 +357,36 @@ static int redis_read (void) /* {{{ */
     redis_submit_g (rn->name, "volatile_changes", NULL, info.changes_since_last_save);
     redis_submit_d (rn->name, "total_connections", NULL, info.total_connections_received);
     redis_submit_d (rn->name, "total_operations", NULL, info.total_commands_processed);
-
-    credis_close (rh);
   }
 
   return 0;
 }
 /* }}} */
 
+static int redis_shutdown (void) /* {{{ */
+{
+  redis_node_t *rn;
+
+  rn = nodes_head;
+  while (rn != NULL)
+  {
+    redis_node_t *next = rn->next;
+
+    redis_disconnect (rn);
+    sfree (rn);
+    rn = next;
+  }
+  nodes_head = NULL;
+
+  return (0);
+} /* }}} int redis_shutdown */
+
 void module_register (void) /* {{{ */
 {
   plugin_register_complex_config ("redis", redis_config);
   plugin_register_init ("redis", redis_init);
   plugin_register_read ("redis", redis_read);
+  plugin_register_shutdown ("redis", redis_shutdown);
   /* TODO: plugin_register_write: one redis list per value id with
    * X elements */
 }
@@ -22,8 +22,14 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "utils_complain.h"
 #include "utils_rrdcreate.h"
 
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
 #undef HAVE_CONFIG_H
 #include <rrd.h>
 #include <rrd_client.h>
@@ -48,9 +54,38 @@ static rrdcreate_config_t rrdcreate_config =
 	/* consolidation_functions = */ NULL,
 	/* consolidation_functions_num = */ 0,
 
-	/* async = */ 0
+	/* async = */ 0,
+	/* async_threads = */ 4,
+	/* async_templates = */ 0
 };
 
+/* With a "BatchSize" greater than one, rc_write() only appends an "UPDATE"
+ * line to "batch_buffer". The batch thread sends the buffer to the daemon in
+ * BATCH mode once it holds "batch_size" updates or its oldest update is
+ * "batch_timeout" old. While a batch is being sent, at most "BATCH_BACKLOG"
+ * batches worth of updates are buffered. Batches that cannot be sent, even
+ * after reconnecting once, are dropped. */
+#define BATCH_BACKLOG 10
+#define RRDCACHED_DEFAULT_PORT "42217"
+static int      batch_size = 1;
+static cdtime_t batch_timeout = TIME_T_TO_CDTIME_T (1);
+static char    *batch_buffer = NULL;
+static size_t   batch_buffer_fill = 0;
+static size_t   batch_buffer_size = 0;
+static int      batch_values = 0;
+static cdtime_t batch_first = 0;
+static _Bool    batch_shutdown = 0;
+static _Bool    batch_thread_running = 0;
+static pthread_t       batch_thread;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  batch_cond = PTHREAD_COND_INITIALIZER;
+static c_complain_t    batch_complaint = C_COMPLAIN_INIT_STATIC;
+
+/* The connection batches are sent over. It is independent of librrd's client
+ * connection and only re-established after an error. */
+static FILE           *batch_fh = NULL;
+static pthread_mutex_t batch_send_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Prototypes.
  */
@@ -92,8 +127,9 @@ static int value_list_to_string (char *buffer, int buffer_len,
     }
     else if (ds->ds[i].type == DS_TYPE_GAUGE) 
     {
-      status = ssnprintf (buffer + offset, buffer_len - offset,
-          ":%f", vl->values[i].gauge);
+      buffer[offset++] = ':';
+      status = format_gauge (buffer + offset, buffer_len - offset,
+          "%f", vl->values[i].gauge);
     }
     else if (ds->ds[i].type == DS_TYPE_DERIVE) {
       status = ssnprintf (buffer + offset, buffer_len - offset,
@@ -163,6 +199,352 @@ static int value_list_to_filename (char *buffer, int buffer_len,
   return (0);
 } /* int value_list_to_filename */
 
+/* XXX: You must hold "batch_send_lock" when calling the rc_batch_* functions
+ * dealing with the connection! */
+static void rc_batch_disconnect (void) /* {{{ */
+{
+  if (batch_fh != NULL)
+    fclose (batch_fh);
+  batch_fh = NULL;
+} /* }}} void rc_batch_disconnect */
+
+static int rc_batch_connect_unix (const char *path) /* {{{ */
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  sstrncpy (sa.sun_path, path, sizeof (sa.sun_path));
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return (-1);
+
+  if (connect (fd, (struct sockaddr *) &sa, sizeof (sa)) != 0)
+  {
+    close (fd);
+    return (-1);
+  }
+
+  return (fd);
+} /* }}} int rc_batch_connect_unix */
+
+static int rc_batch_connect_network (const char *address) /* {{{ */
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  char host[NI_MAXHOST];
+  const char *port = RRDCACHED_DEFAULT_PORT;
+  char *ptr;
+  int fd = -1;
+  int status;
+
+  sstrncpy (host, address, sizeof (host));
+
+  /* "[address]:port", "host:port" or just the host. */
+  if (host[0] == '[')
+  {
+    ptr = strchr (host, ']');
+    if (ptr == NULL)
+      return (-1);
+    *ptr = 0;
+    ptr++;
+    if (*ptr == ':')
+      port = address + (ptr - host) + 1;
+    memmove (host, host + 1, strlen (host + 1) + 1);
+  }
+  else if (((ptr = strchr (host, ':')) != NULL)
+      && (strchr (ptr + 1, ':') == NULL))
+  {
+    *ptr = 0;
+    port = address + (ptr - host) + 1;
+  }
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  status = getaddrinfo (host, port, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    ERROR ("rrdcached plugin: getaddrinfo (%s, %s) failed: %s",
+        host, port, gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    if (connect (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0)
+      break;
+
+    close (fd);
+    fd = -1;
+  }
+
+  freeaddrinfo (ai_list);
+  return (fd);
+} /* }}} int rc_batch_connect_network */
+
+static int rc_batch_connect (void) /* {{{ */
+{
+  struct timeval tv;
+  int fd;
+
+  if (batch_fh != NULL)
+    return (0);
+
+  if (strncmp ("unix:", daemon_address, strlen ("unix:")) == 0)
+    fd = rc_batch_connect_unix (daemon_address + strlen ("unix:"));
+  else if (daemon_address[0] == '/')
+    fd = rc_batch_connect_unix (daemon_address);
+  else
+    fd = rc_batch_connect_network (daemon_address);
+
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    ERROR ("rrdcached plugin: Connecting to %s failed: %s",
+        daemon_address, sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  /* Don't block the batch thread forever if the daemon hangs. */
+  tv.tv_sec = 10;
+  tv.tv_usec = 0;
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  batch_fh = fdopen (fd, "r+");
+  if (batch_fh == NULL)
+  {
+    close (fd);
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int rc_batch_connect */
+
+/* Reads one response line and returns its status, i.e. the number of lines
+ * following it, or less than zero on failure. */
+static int rc_batch_read_response (char *buffer, size_t buffer_size) /* {{{ */
+{
+  char *endptr = NULL;
+  long status;
+
+  if (fgets (buffer, (int) buffer_size, batch_fh) == NULL)
+    return (-1);
+  buffer[strcspn (buffer, "\r\n")] = 0;
+
+  status = strtol (buffer, &endptr, 10);
+  if (endptr == buffer)
+    return (-1);
+
+  return ((int) status);
+} /* }}} int rc_batch_read_response */
+
+static int rc_batch_send_once (const char *buffer, size_t buffer_size) /* {{{ */
+{
+  char line[1024];
+  int errors;
+  int i;
+
+  if (rc_batch_connect () != 0)
+    return (-1);
+
+  if ((fputs ("BATCH\n", batch_fh) == EOF) || (fflush (batch_fh) != 0))
+    return (-1);
+
+  if (rc_batch_read_response (line, sizeof (line)) != 0)
+  {
+    ERROR ("rrdcached plugin: Starting a batch failed: %s", line);
+    return (-1);
+  }
+
+  if ((fwrite (buffer, 1, buffer_size, batch_fh) != buffer_size)
+      || (fputs (".\n", batch_fh) == EOF)
+      || (fflush (batch_fh) != 0))
+    return (-1);
+
+  errors = rc_batch_read_response (line, sizeof (line));
+  if (errors < 0)
+    return (-1);
+
+  /* Each error is reported as "<command number> <message>". */
+  for (i = 0; i < errors; i++)
+  {
+    if (fgets (line, sizeof (line), batch_fh) == NULL)
+      return (-1);
+    line[strcspn (line, "\r\n")] = 0;
+    if (i < 5)
+      WARNING ("rrdcached plugin: Batched update failed: %s", line);
+  }
+  if (errors > 5)
+    WARNING ("rrdcached plugin: %i more batched updates failed.", errors - 5);
+
+  return (0);
+} /* }}} int rc_batch_send_once */
+
+static int rc_batch_send (const char *buffer, size_t buffer_size) /* {{{ */
+{
+  _Bool connected;
+  int status;
+
+  pthread_mutex_lock (&batch_send_lock);
+
+  connected = (batch_fh != NULL);
+  status = rc_batch_send_once (buffer, buffer_size);
+  if (status != 0)
+  {
+    rc_batch_disconnect ();
+    /* The daemon may have closed an idle connection. */
+    if (connected)
+    {
+      status = rc_batch_send_once (buffer, buffer_size);
+      if (status != 0)
+        rc_batch_disconnect ();
+    }
+  }
+
+  pthread_mutex_unlock (&batch_send_lock);
+  return (status);
+} /* }}} int rc_batch_send */
+
+/* Sends all updates buffered so far. */
+static int rc_batch_flush (void) /* {{{ */
+{
+  char *buffer;
+  size_t buffer_fill;
+  int values;
+  int status;
+
+  pthread_mutex_lock (&batch_lock);
+  buffer = batch_buffer;
+  buffer_fill = batch_buffer_fill;
+  values = batch_values;
+  batch_buffer = NULL;
+  batch_buffer_fill = 0;
+  batch_buffer_size = 0;
+  batch_values = 0;
+  pthread_mutex_unlock (&batch_lock);
+
+  if (values == 0)
+  {
+    sfree (buffer);
+    return (0);
+  }
+
+  status = rc_batch_send (buffer, buffer_fill);
+  if (status != 0)
+    ERROR ("rrdcached plugin: Sending a batch of %i update%s to %s failed.",
+        values, (values == 1) ? "" : "s", daemon_address);
+  else
+    DEBUG ("rrdcached plugin: Sent a batch of %i update%s.",
+        values, (values == 1) ? "" : "s");
+
+  sfree (buffer);
+  return (status);
+} /* }}} int rc_batch_flush */
+
+static int rc_batch_append (const char *filename, /* {{{ */
+    const char *values)
+{
+  size_t len;
+
+  len = strlen ("UPDATE  \n") + strlen (filename) + strlen (values);
+
+  pthread_mutex_lock (&batch_lock);
+
+  if (batch_values >= (BATCH_BACKLOG * batch_size))
+  {
+    pthread_mutex_unlock (&batch_lock);
+    c_complain (LOG_ERR, &batch_complaint,
+        "rrdcached plugin: Too many updates are waiting to be sent to %s. "
+        "Dropping updates.", daemon_address);
+    return (-1);
+  }
+
+  if ((batch_buffer_fill + len + 1) > batch_buffer_size)
+  {
+    size_t size = (batch_buffer_size > 0) ? (2 * batch_buffer_size) : 4096;
+    char *tmp;
+
+    while (size < (batch_buffer_fill + len + 1))
+      size *= 2;
+
+    tmp = realloc (batch_buffer, size);
+    if (tmp == NULL)
+    {
+      pthread_mutex_unlock (&batch_lock);
+      ERROR ("rrdcached plugin: realloc failed.");
+      return (-1);
+    }
+    batch_buffer = tmp;
+    batch_buffer_size = size;
+  }
+
+  ssnprintf (batch_buffer + batch_buffer_fill,
+      batch_buffer_size - batch_buffer_fill,
+      "UPDATE %s %s\n", filename, values);
+  batch_buffer_fill += len;
+
+  if (batch_values == 0)
+    batch_first = cdtime ();
+  batch_values++;
+
+  if (batch_values >= batch_size)
+    pthread_cond_signal (&batch_cond);
+
+  pthread_mutex_unlock (&batch_lock);
+
+  c_release (LOG_INFO, &batch_complaint,
+      "rrdcached plugin: Updates are being sent to %s again.",
+      daemon_address);
+  return (0);
+} /* }}} int rc_batch_append */
+
+static void *rc_batch_thread (void __attribute__((unused)) *arg) /* {{{ */
+{
+  while (42)
+  {
+    _Bool shutdown;
+
+    pthread_mutex_lock (&batch_lock);
+    while (!batch_shutdown && (batch_values < batch_size))
+    {
+      struct timespec ts;
+      cdtime_t deadline;
+
+      if (batch_values == 0)
+      {
+        pthread_cond_wait (&batch_cond, &batch_lock);
+        continue;
+      }
+
+      deadline = batch_first + batch_timeout;
+      if (cdtime () >= deadline)
+        break;
+
+      CDTIME_T_TO_TIMESPEC (deadline, &ts);
+      pthread_cond_timedwait (&batch_cond, &batch_lock, &ts);
+    }
+    shutdown = batch_shutdown;
+    pthread_mutex_unlock (&batch_lock);
+
+    rc_batch_flush ();
+
+    if (shutdown)
+      break;
+  }
+
+  return ((void *) 0);
+} /* }}} void *rc_batch_thread */
+
 static int rc_config_get_int_positive (oconfig_item_t const *ci, int *ret)
 {
   int status;
@@ -277,6 +659,18 @@ static int rc_config (oconfig_item_t *ci)
     }
     else if (strcasecmp ("XFF", key) == 0)
       status = rc_config_get_xff (child, &rrdcreate_config.xff);
+    else if (strcasecmp ("BatchSize", key) == 0)
+    {
+      int tmp = -1;
+
+      status = rc_config_get_int_positive (child, &tmp);
+      if ((status == 0) && (tmp < 1))
+        status = EINVAL;
+      if (status == 0)
+        batch_size = tmp;
+    }
+    else if (strcasecmp ("BatchTimeout", key) == 0)
+      status = cf_util_get_cdtime (child, &batch_timeout);
     else
     {
       WARNING ("rrdcached plugin: Ignoring invalid option %s.", key);
@@ -402,6 +796,22 @@ static int rc_init (void)
   if (config_collect_stats)
     plugin_register_read ("rrdcached", rc_read);
 
+  if ((daemon_address != NULL) && (batch_size > 1) && !batch_thread_running)
+  {
+    int status;
+
+    status = plugin_thread_create (&batch_thread, /* attr = */ NULL,
+        rc_batch_thread, /* arg = */ NULL);
+    if (status != 0)
+    {
+      ERROR ("rrdcached plugin: Starting the batch thread failed. "
+          "Sending every update on its own.");
+      batch_size = 1;
+    }
+    else
+      batch_thread_running = 1;
+  }
+
   return (0);
 } /* int rc_init */
 
@@ -468,6 +878,9 @@ static int rc_write (const data_set_t *ds, const value_list_t *vl,
     }
   }
 
+  if (batch_thread_running)
+    return (rc_batch_append (filename, values));
+
   status = rrdc_connect (daemon_address);
   if (status != 0)
   {
@@ -495,6 +908,10 @@ static int rc_flush (__attribute__((unused)) cdtime_t timeout, /* {{{ */
   char filename[PATH_MAX + 1];
   int status;
 
+  /* Buffered updates have to reach the daemon before it is told to flush. */
+  if (batch_thread_running)
+    rc_batch_flush ();
+
   if (identifier == NULL)
     return (EINVAL);
 
@@ -525,6 +942,21 @@ static int rc_flush (__attribute__((unused)) cdtime_t timeout, /* {{{ */
 
 static int rc_shutdown (void)
 {
+  if (batch_thread_running)
+  {
+    pthread_mutex_lock (&batch_lock);
+    batch_shutdown = 1;
+    pthread_cond_signal (&batch_cond);
+    pthread_mutex_unlock (&batch_lock);
+
+    pthread_join (batch_thread, NULL);
+    batch_thread_running = 0;
+  }
+
+  pthread_mutex_lock (&batch_send_lock);
+  rc_batch_disconnect ();
+  pthread_mutex_unlock (&batch_send_lock);
+
   rrdc_disconnect ();
   return (0);
 } /* int rc_shutdown */
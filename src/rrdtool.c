@@ -26,7 +26,8 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
-#include "utils_avltree.h"
+#include "utils_htable.h"
+#include "utils_lock.h"
 #include "utils_rrdcreate.h"
 
 #include <rrd.h>
@@ -38,13 +39,27 @@
 /*
  * Private types
  */
+/* Updates are cached in binary form and only formatted into rrd_update(3)'s
+ * arguments by the queue thread. "values" holds "ds->ds_num" values for each
+ * of the "values_num" times. Both arrays grow geometrically and are kept when
+ * the entry is written, so a file's buffer is only allocated a few times. */
 struct rrd_cache_s
 {
-	int      values_num;
-	char   **values;
+	const data_set_t *ds;
+	int       values_num;
+	int       values_size;
+	cdtime_t *times;
+	value_t  *values;
 	cdtime_t first_value;
 	cdtime_t last_value;
 	int64_t  random_variation;
+	size_t   worker;
+	/* Set while the file is being created asynchronously. The entry is
+	 * neither queued nor flushed in that time. */
+	_Bool    creating;
+	/* The cache's key and the position in "flush_heap". */
+	char    *filename;
+	size_t   heap_index;
 	enum
 	{
 		FLAG_NONE   = 0x00,
@@ -68,6 +83,38 @@ struct rrd_queue_s
 };
 typedef struct rrd_queue_s rrd_queue_t;
 
+/* Each queue thread has queues of its own. Files are assigned to a thread by
+ * their directory, so one thread writes all the files of a directory. */
+struct rrd_queue_worker_s
+{
+	rrd_queue_t    *queue_head;
+	rrd_queue_t    *queue_tail;
+	rrd_queue_t    *flushq_head;
+	rrd_queue_t    *flushq_tail;
+	/* Number of entries at the head of the regular queue which have been
+	 * sorted by rrd_queue_sort(). */
+	size_t          sorted_num;
+	pthread_cond_t  cond;
+	pthread_t       thread;
+	int             thread_running;
+};
+typedef struct rrd_queue_worker_s rrd_queue_worker_t;
+
+/* Size of one formatted update, i.e. one argument to rrd_update(3). */
+#define RRD_UPDATE_SIZE 512
+
+/* Scratch space of the queue thread, reused for every file it writes. */
+struct rrd_update_buffer_s
+{
+	cdtime_t    *times;
+	value_t     *values;
+	char        *strings;
+	const char **argv;
+	size_t       updates_size;
+	size_t       values_size;
+};
+typedef struct rrd_update_buffer_s rrd_update_buffer_t;
+
 /*
  * Private variables
  */
@@ -76,6 +123,8 @@ static const char *config_keys[] =
 	"CacheTimeout",
 	"CacheFlush",
 	"CreateFilesAsync",
+	"CreateFilesThreads",
+	"CreateFilesFromTemplate",
 	"DataDir",
 	"StepSize",
 	"HeartBeat",
@@ -83,7 +132,12 @@ static const char *config_keys[] =
 	"RRATimespan",
 	"XFF",
 	"WritesPerSecond",
-	"RandomTimeout"
+	"RandomTimeout",
+	"WriteThreads",
+	"CacheMaxMemory",
+	"CacheMemoryLimit",
+	"QueueSortWindow",
+	"JournalFile"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -105,7 +159,9 @@ static rrdcreate_config_t rrdcreate_config =
 	/* consolidation_functions = */ NULL,
 	/* consolidation_functions_num = */ 0,
 
-	/* async = */ 0
+	/* async = */ 0,
+	/* async_threads = */ 4,
+	/* async_templates = */ 0
 };
 
 /* XXX: If you need to lock both, cache_lock and queue_lock, at the same time,
@@ -114,17 +170,39 @@ static cdtime_t    cache_timeout = 0;
 static cdtime_t    cache_flush_timeout = 0;
 static cdtime_t    random_timeout = TIME_T_TO_CDTIME_T (1);
 static cdtime_t    cache_flush_last;
-static c_avl_tree_t *cache = NULL;
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
-
-static rrd_queue_t    *queue_head = NULL;
-static rrd_queue_t    *queue_tail = NULL;
-static rrd_queue_t    *flushq_head = NULL;
-static rrd_queue_t    *flushq_tail = NULL;
-static pthread_t       queue_thread;
-static int             queue_thread_running = 1;
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static c_htable_t *cache = NULL;
+static c_mutex_t   cache_lock = C_MUTEX_INITIALIZER ("rrdtool-cache");
+/* The memory allocated for "cache" and the queues, reported by the self
+ * plugin. */
+static plugin_memory_t *cache_memory = NULL;
+static plugin_memory_t *queue_memory = NULL;
+
+/* Above "cache_max_memory", the entries with the most pending values are
+ * written first and buffers are freed once written. Above
+ * "cache_memory_limit", values which would need more memory are dropped.
+ * Zero disables either. "cache_bytes" is the value of "cache_memory",
+ * "cache_values_pending" the number of values not yet handed to a queue
+ * thread. Protected by "cache_lock". */
+static uint64_t    cache_max_memory = 0;
+static uint64_t    cache_memory_limit = 0;
+static uint64_t    cache_bytes = 0;
+static uint64_t    cache_values_pending = 0;
+static uint64_t    cache_values_shed = 0;
+static _Bool       cache_shedding = 0;
+
+/* Binary min-heap of the cache entries that are neither queued nor being
+ * written, ordered by "first_value", so flushing the cache only visits the
+ * entries that are due instead of the whole cache. Protected by "cache_lock". */
+#define HEAP_INDEX_NONE ((size_t) -1)
+static rrd_cache_t **flush_heap = NULL;
+static size_t        flush_heap_num = 0;
+static size_t        flush_heap_size = 0;
+
+static rrd_queue_worker_t *workers = NULL;
+static size_t          workers_num = 1;
+/* Number of regular queue entries sorted by file name at a time. */
+static size_t          queue_sort_window = 0;
+static c_mutex_t       queue_lock = C_MUTEX_INITIALIZER ("rrdtool-queue");
 
 #if !HAVE_THREADSAFE_LIBRRD
 static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -132,6 +210,13 @@ static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int do_shutdown = 0;
 
+/* If set, the cache is saved to this file on shutdown instead of being
+ * written to the RRD files, and loaded again on startup. "journal_written" is
+ * set, holding both locks, once the cache has been saved: the queue threads
+ * then exit without writing anything else. */
+static char *journal_file = NULL;
+static _Bool journal_written = 0;
+
 #if HAVE_THREADSAFE_LIBRRD
 static int srrd_update (char *filename, char *template,
 		int argc, const char **argv)
@@ -197,22 +282,10 @@ static int srrd_update (char *filename, char *template,
 } /* int srrd_update */
 #endif /* !HAVE_THREADSAFE_LIBRRD */
 
-static int value_list_to_string (char *buffer, int buffer_len,
-		const data_set_t *ds, const value_list_t *vl)
+static int rrd_ds_check (const data_set_t *ds)
 {
-	int offset;
-	int status;
-	time_t tt;
 	int i;
 
-	memset (buffer, '\0', buffer_len);
-
-	tt = CDTIME_T_TO_TIME_T (vl->time);
-	status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) tt);
-	if ((status < 1) || (status >= buffer_len))
-		return (-1);
-	offset = status;
-
 	for (i = 0; i < ds->ds_num; i++)
 	{
 		if ((ds->ds[i].type != DS_TYPE_COUNTER)
@@ -220,19 +293,38 @@ static int value_list_to_string (char *buffer, int buffer_len,
 				&& (ds->ds[i].type != DS_TYPE_DERIVE)
 				&& (ds->ds[i].type != DS_TYPE_ABSOLUTE))
 			return (-1);
+	}
 
+	return (0);
+} /* int rrd_ds_check */
+
+/* Formats ":<value>" for each data source, as used by rrd_update(3). */
+static int values_to_string (char *buffer, int buffer_len,
+		const data_set_t *ds, const value_t *values)
+{
+	int offset = 0;
+	int status;
+	int i;
+
+	for (i = 0; i < ds->ds_num; i++)
+	{
 		if (ds->ds[i].type == DS_TYPE_COUNTER)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%llu", vl->values[i].counter);
+					":%llu", values[i].counter);
 		else if (ds->ds[i].type == DS_TYPE_GAUGE)
-			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%lf", vl->values[i].gauge);
+		{
+			buffer[offset++] = ':';
+			status = format_gauge (buffer + offset, buffer_len - offset,
+					"%lf", values[i].gauge);
+		}
 		else if (ds->ds[i].type == DS_TYPE_DERIVE)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%"PRIi64, vl->values[i].derive);
-		else /*if (ds->ds[i].type == DS_TYPE_ABSOLUTE) */
+					":%"PRIi64, values[i].derive);
+		else if (ds->ds[i].type == DS_TYPE_ABSOLUTE)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%"PRIu64, vl->values[i].absolute);
+					":%"PRIu64, values[i].absolute);
+		else
+			return (-1);
 
 		if ((status < 1) || (status >= (buffer_len - offset)))
 			return (-1);
@@ -241,6 +333,21 @@ static int value_list_to_string (char *buffer, int buffer_len,
 	} /* for ds->ds_num */
 
 	return (0);
+} /* int values_to_string */
+
+static int value_list_to_string (char *buffer, int buffer_len,
+		const data_set_t *ds, cdtime_t time, const value_t *values)
+{
+	int status;
+	time_t tt;
+
+	tt = CDTIME_T_TO_TIME_T (time);
+	status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) tt);
+	if ((status < 1) || (status >= buffer_len))
+		return (-1);
+
+	return (values_to_string (buffer + status, buffer_len - status,
+				ds, values));
 } /* int value_list_to_string */
 
 static int value_list_to_filename (char *buffer, int buffer_len,
@@ -287,40 +394,282 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 	return (0);
 } /* int value_list_to_filename */
 
-static void *rrd_queue_thread (void __attribute__((unused)) *data)
+/* XXX: You must hold "cache_lock" when calling the heap functions! */
+static void rrd_heap_swap (size_t a, size_t b)
+{
+	rrd_cache_t *tmp = flush_heap[a];
+
+	flush_heap[a] = flush_heap[b];
+	flush_heap[b] = tmp;
+	flush_heap[a]->heap_index = a;
+	flush_heap[b]->heap_index = b;
+} /* void rrd_heap_swap */
+
+static void rrd_heap_up (size_t index)
 {
+	while (index > 0)
+	{
+		size_t parent = (index - 1) / 2;
+
+		if (flush_heap[parent]->first_value <= flush_heap[index]->first_value)
+			break;
+
+		rrd_heap_swap (parent, index);
+		index = parent;
+	}
+} /* void rrd_heap_up */
+
+static void rrd_heap_down (size_t index)
+{
+	while (42)
+	{
+		size_t left = (2 * index) + 1;
+		size_t right = left + 1;
+		size_t min = index;
+
+		if ((left < flush_heap_num)
+				&& (flush_heap[left]->first_value < flush_heap[min]->first_value))
+			min = left;
+		if ((right < flush_heap_num)
+				&& (flush_heap[right]->first_value < flush_heap[min]->first_value))
+			min = right;
+
+		if (min == index)
+			break;
+
+		rrd_heap_swap (index, min);
+		index = min;
+	}
+} /* void rrd_heap_down */
+
+static int rrd_heap_insert (rrd_cache_t *rc)
+{
+	if (rc->heap_index != HEAP_INDEX_NONE)
+		return (0);
+
+	if (flush_heap_num >= flush_heap_size)
+	{
+		size_t size = (flush_heap_size > 0) ? (2 * flush_heap_size) : 64;
+		rrd_cache_t **tmp;
+
+		tmp = realloc (flush_heap, size * sizeof (*tmp));
+		if (tmp == NULL)
+		{
+			ERROR ("rrdtool plugin: realloc failed. %s will only be "
+					"flushed when new values arrive.", rc->filename);
+			return (-1);
+		}
+		flush_heap = tmp;
+		flush_heap_size = size;
+	}
+
+	rc->heap_index = flush_heap_num;
+	flush_heap[flush_heap_num] = rc;
+	flush_heap_num++;
+	rrd_heap_up (rc->heap_index);
+
+	return (0);
+} /* int rrd_heap_insert */
+
+static void rrd_heap_remove (rrd_cache_t *rc)
+{
+	size_t index = rc->heap_index;
+
+	if (index == HEAP_INDEX_NONE)
+		return;
+
+	rc->heap_index = HEAP_INDEX_NONE;
+	flush_heap_num--;
+	if (index == flush_heap_num)
+		return;
+
+	flush_heap[index] = flush_heap[flush_heap_num];
+	flush_heap[index]->heap_index = index;
+	rrd_heap_up (index);
+	rrd_heap_down (flush_heap[index]->heap_index);
+} /* void rrd_heap_remove */
+
+/* Restores the heap order after "rc->first_value" has increased. */
+static void rrd_heap_update (rrd_cache_t *rc)
+{
+	if (rc->heap_index != HEAP_INDEX_NONE)
+		rrd_heap_down (rc->heap_index);
+} /* void rrd_heap_update */
+
+static int rrd_update_buffer_reserve (rrd_update_buffer_t *buf,
+		size_t updates_num, size_t ds_num)
+{
+	if (updates_num > buf->updates_size)
+	{
+		size_t size = (2 * buf->updates_size > updates_num)
+			? (2 * buf->updates_size) : updates_num;
+		cdtime_t *times;
+		char *strings;
+		const char **argv;
+
+		times = realloc (buf->times, size * sizeof (*times));
+		if (times == NULL)
+			return (-1);
+		buf->times = times;
+
+		strings = realloc (buf->strings, size * RRD_UPDATE_SIZE);
+		if (strings == NULL)
+			return (-1);
+		buf->strings = strings;
+
+		argv = realloc (buf->argv, size * sizeof (*argv));
+		if (argv == NULL)
+			return (-1);
+		buf->argv = argv;
+
+		buf->updates_size = size;
+	}
+
+	if ((updates_num * ds_num) > buf->values_size)
+	{
+		size_t size = (2 * buf->values_size > updates_num * ds_num)
+			? (2 * buf->values_size) : (updates_num * ds_num);
+		value_t *values;
+
+		values = realloc (buf->values, size * sizeof (*values));
+		if (values == NULL)
+			return (-1);
+		buf->values = values;
+		buf->values_size = size;
+	}
+
+	return (0);
+} /* int rrd_update_buffer_reserve */
+
+static void rrd_queue_entry_free (rrd_queue_t *queue_entry) /* {{{ */
+{
+	plugin_memory_add (queue_memory, -((int64_t) (sizeof (*queue_entry)
+				+ strlen (queue_entry->filename) + 1)));
+	sfree (queue_entry->filename);
+	sfree (queue_entry);
+} /* }}} void rrd_queue_entry_free */
+
+/* XXX: You must hold "cache_lock" when calling this function! */
+static void rrd_cache_memory_add (int64_t bytes) /* {{{ */
+{
+	cache_bytes += (uint64_t) bytes;
+	plugin_memory_add (cache_memory, bytes);
+
+	if (cache_shedding && (cache_bytes < cache_memory_limit))
+	{
+		cache_shedding = 0;
+		INFO ("rrdtool plugin: The cache is below CacheMemoryLimit again. "
+				"%"PRIu64" value%s been dropped so far.", cache_values_shed,
+				(cache_values_shed == 1) ? " has" : "s have");
+	}
+} /* }}} void rrd_cache_memory_add */
+
+/* Frees the buffer of an entry without pending values.
+ * XXX: You must hold "cache_lock" when calling this function! */
+static void rrd_cache_entry_release (rrd_cache_t *rc) /* {{{ */
+{
+	if ((rc->values_num != 0) || (rc->values_size == 0))
+		return;
+
+	rrd_cache_memory_add (-((int64_t) rc->values_size)
+			* (int64_t) (sizeof (*rc->times)
+				+ rc->ds->ds_num * sizeof (*rc->values)));
+	sfree (rc->times);
+	sfree (rc->values);
+	rc->values_size = 0;
+} /* }}} void rrd_cache_entry_release */
+
+static int rrd_queue_compare (const void *a, const void *b) /* {{{ */
+{
+	rrd_queue_t const *qa = *((rrd_queue_t * const *) a);
+	rrd_queue_t const *qb = *((rrd_queue_t * const *) b);
+
+	return (strcmp (qa->filename, qb->filename));
+} /* }}} int rrd_queue_compare */
+
+/* Sorts up to "queue_sort_window" entries at the head of the regular queue by
+ * file name. The files of a directory, and the directories of a host, are
+ * then written one after another instead of in the order they timed out,
+ * which saves seeks on spinning disks and round trips on NFS. The entries
+ * stay in the queue, so rrd_queue_dequeue() still finds them.
+ * XXX: You must hold "queue_lock" when calling this function! */
+static void rrd_queue_sort (rrd_queue_worker_t *w, /* {{{ */
+		rrd_queue_t **buffer)
+{
+	rrd_queue_t *rest = w->queue_head;
+	size_t n = 0;
+	size_t i;
+
+	while ((n < queue_sort_window) && (rest != NULL))
+	{
+		buffer[n] = rest;
+		rest = rest->next;
+		n++;
+	}
+
+	if (n > 1)
+	{
+		qsort (buffer, n, sizeof (*buffer), rrd_queue_compare);
+
+		for (i = 0; i < (n - 1); i++)
+			buffer[i]->next = buffer[i + 1];
+		buffer[n - 1]->next = rest;
+
+		w->queue_head = buffer[0];
+		if (rest == NULL)
+			w->queue_tail = buffer[n - 1];
+	}
+
+	w->sorted_num = n;
+} /* }}} void rrd_queue_sort */
+
+static void *rrd_queue_thread (void *data)
+{
+	rrd_queue_worker_t *w = data;
+	rrd_queue_t **sort_buffer = NULL;
         struct timeval tv_next_update;
         struct timeval tv_now;
 
+	rrd_update_buffer_t buffer;
+
+	memset (&buffer, 0, sizeof (buffer));
         gettimeofday (&tv_next_update, /* timezone = */ NULL);
 
+	if (queue_sort_window > 1)
+	{
+		sort_buffer = calloc (queue_sort_window, sizeof (*sort_buffer));
+		if (sort_buffer == NULL)
+			ERROR ("rrdtool plugin: queue thread: calloc failed. "
+					"The queue will not be sorted.");
+	}
+
 	while (42)
 	{
 		rrd_queue_t *queue_entry;
 		rrd_cache_t *cache_entry;
-		char **values;
+		const data_set_t *ds = NULL;
 		int    values_num;
+		int    argc;
 		int    status;
 		int    i;
 
-		values = NULL;
 		values_num = 0;
 
-                pthread_mutex_lock (&queue_lock);
+                c_mutex_lock (&queue_lock);
                 /* Wait for values to arrive */
                 while (42)
                 {
                   struct timespec ts_wait;
 
-                  while ((flushq_head == NULL) && (queue_head == NULL)
+                  while ((w->flushq_head == NULL) && (w->queue_head == NULL)
                       && (do_shutdown == 0))
-                    pthread_cond_wait (&queue_cond, &queue_lock);
+                    c_cond_wait (&w->cond, &queue_lock);
 
-                  if ((flushq_head == NULL) && (queue_head == NULL))
+                  if ((w->flushq_head == NULL) && (w->queue_head == NULL))
                     break;
 
                   /* Don't delay if there's something to flush */
-                  if (flushq_head != NULL)
+                  if (w->flushq_head != NULL)
                     break;
 
                   /* Don't delay if we're shutting down */
@@ -343,7 +692,7 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                   ts_wait.tv_sec = tv_next_update.tv_sec;
                   ts_wait.tv_nsec = 1000 * tv_next_update.tv_usec;
 
-                  status = pthread_cond_timedwait (&queue_cond, &queue_lock,
+                  status = c_cond_timedwait (&w->cond, &queue_lock,
                       &ts_wait);
                   if (status == ETIMEDOUT)
                     break;
@@ -352,58 +701,93 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                 /* XXX: If you need to lock both, cache_lock and queue_lock, at
                  * the same time, ALWAYS lock `cache_lock' first! */
 
-                /* We're in the shutdown phase */
-                if ((flushq_head == NULL) && (queue_head == NULL))
+                /* We're in the shutdown phase. If the cache has been saved
+                 * to the journal, the remaining files are not written. */
+                if (((w->flushq_head == NULL) && (w->queue_head == NULL))
+                    || journal_written)
                 {
-                  pthread_mutex_unlock (&queue_lock);
+                  c_mutex_unlock (&queue_lock);
                   break;
                 }
 
-                if (flushq_head != NULL)
+                if (w->flushq_head != NULL)
                 {
                   /* Dequeue the first flush entry */
-                  queue_entry = flushq_head;
-                  if (flushq_head == flushq_tail)
-                    flushq_head = flushq_tail = NULL;
+                  queue_entry = w->flushq_head;
+                  if (w->flushq_head == w->flushq_tail)
+                    w->flushq_head = w->flushq_tail = NULL;
                   else
-                    flushq_head = flushq_head->next;
+                    w->flushq_head = w->flushq_head->next;
                 }
-                else /* if (queue_head != NULL) */
+                else /* if (w->queue_head != NULL) */
                 {
+                  if ((sort_buffer != NULL) && (w->sorted_num == 0))
+                    rrd_queue_sort (w, sort_buffer);
+                  if (w->sorted_num > 0)
+                    w->sorted_num--;
+
                   /* Dequeue the first regular entry */
-                  queue_entry = queue_head;
-                  if (queue_head == queue_tail)
-                    queue_head = queue_tail = NULL;
+                  queue_entry = w->queue_head;
+                  if (w->queue_head == w->queue_tail)
+                    w->queue_head = w->queue_tail = NULL;
                   else
-                    queue_head = queue_head->next;
+                    w->queue_head = w->queue_head->next;
                 }
 
 		/* Unlock the queue again */
-		pthread_mutex_unlock (&queue_lock);
+		c_mutex_unlock (&queue_lock);
 
 		/* We now need the cache lock so the entry isn't updated while
 		 * we make a copy of it's values */
-		pthread_mutex_lock (&cache_lock);
+		c_mutex_lock (&cache_lock);
 
-		status = c_avl_get (cache, queue_entry->filename,
-				(void *) &cache_entry);
+		/* The values have been saved to the journal meanwhile. */
+		if (journal_written)
+			status = -1;
+		else
+			status = c_htable_get (cache, queue_entry->filename,
+					(void *) &cache_entry);
 
+		/* Copy the binary updates, leaving the entry's buffer in place
+		 * for the next values. Formatting happens after unlocking. */
 		if (status == 0)
 		{
-			values = cache_entry->values;
+			ds = cache_entry->ds;
 			values_num = cache_entry->values_num;
 
-			cache_entry->values = NULL;
+			if (rrd_update_buffer_reserve (&buffer, (size_t) values_num,
+						(size_t) ds->ds_num) == 0)
+			{
+				memcpy (buffer.times, cache_entry->times,
+						values_num * sizeof (*buffer.times));
+				memcpy (buffer.values, cache_entry->values,
+						values_num * ds->ds_num * sizeof (*buffer.values));
+			}
+			else
+			{
+				ERROR ("rrdtool plugin: queue thread: realloc failed. "
+						"Dropping %i value%s of %s.",
+						values_num, (values_num == 1) ? "" : "s",
+						queue_entry->filename);
+				values_num = 0;
+			}
+
+			cache_values_pending -= (uint64_t) cache_entry->values_num;
 			cache_entry->values_num = 0;
 			cache_entry->flags = FLAG_NONE;
+			rrd_heap_insert (cache_entry);
+
+			/* Over budget, the buffer is allocated anew for the
+			 * next values instead of being kept. */
+			if ((cache_max_memory > 0) && (cache_bytes > cache_max_memory))
+				rrd_cache_entry_release (cache_entry);
 		}
 
-		pthread_mutex_unlock (&cache_lock);
+		c_mutex_unlock (&cache_lock);
 
 		if (status != 0)
 		{
-			sfree (queue_entry->filename);
-			sfree (queue_entry);
+			rrd_queue_entry_free (queue_entry);
 			continue;
 		}
 
@@ -421,29 +805,79 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                   }
                 }
 
-		/* Write the values to the RRD-file */
-		srrd_update (queue_entry->filename, NULL,
-				values_num, (const char **)values);
-		DEBUG ("rrdtool plugin: queue thread: Wrote %i value%s to %s",
-				values_num, (values_num == 1) ? "" : "s",
-				queue_entry->filename);
-
+		argc = 0;
 		for (i = 0; i < values_num; i++)
 		{
-			sfree (values[i]);
+			char *str = buffer.strings + (argc * RRD_UPDATE_SIZE);
+
+			status = value_list_to_string (str, RRD_UPDATE_SIZE, ds,
+					buffer.times[i], buffer.values + (i * ds->ds_num));
+			if (status != 0)
+			{
+				ERROR ("rrdtool plugin: queue thread: Formatting "
+						"an update of %s failed.",
+						queue_entry->filename);
+				continue;
+			}
+
+			buffer.argv[argc] = str;
+			argc++;
+		}
+
+		/* Write the values to the RRD-file */
+		if (argc > 0)
+		{
+			srrd_update (queue_entry->filename, NULL,
+					argc, buffer.argv);
+			DEBUG ("rrdtool plugin: queue thread: Wrote %i value%s to %s",
+					argc, (argc == 1) ? "" : "s",
+					queue_entry->filename);
 		}
-		sfree (values);
-		sfree (queue_entry->filename);
-		sfree (queue_entry);
+
+		rrd_queue_entry_free (queue_entry);
 	} /* while (42) */
 
+	sfree (buffer.times);
+	sfree (buffer.values);
+	sfree (buffer.strings);
+	sfree (buffer.argv);
+	sfree (sort_buffer);
+
 	pthread_exit ((void *) 0);
 	return ((void *) 0);
 } /* void *rrd_queue_thread */
 
-static int rrd_queue_enqueue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+/* Returns the queue thread writing "filename", determined by hashing the
+ * file's directory. */
+static size_t rrd_queue_worker_index (const char *filename)
+{
+  const char *end;
+  const char *ptr;
+  uint32_t hash = 2166136261U;
+
+  if (workers_num <= 1)
+    return (0);
+
+  end = strrchr (filename, '/');
+  if (end == NULL)
+    end = filename + strlen (filename);
+
+  /* FNV-1a */
+  for (ptr = filename; ptr < end; ptr++)
+  {
+    hash ^= (uint32_t) (unsigned char) *ptr;
+    hash *= 16777619U;
+  }
+
+  return (((size_t) hash) % workers_num);
+} /* size_t rrd_queue_worker_index */
+
+static int rrd_queue_enqueue (const char *filename, size_t worker,
+    _Bool flush)
 {
+  rrd_queue_worker_t *w = workers + worker;
+  rrd_queue_t **head = flush ? &w->flushq_head : &w->queue_head;
+  rrd_queue_t **tail = flush ? &w->flushq_tail : &w->queue_tail;
   rrd_queue_t *queue_entry;
 
   queue_entry = (rrd_queue_t *) malloc (sizeof (rrd_queue_t));
@@ -458,8 +892,10 @@ static int rrd_queue_enqueue (const char *filename,
   }
 
   queue_entry->next = NULL;
+  plugin_memory_add (queue_memory, (int64_t) (sizeof (*queue_entry)
+        + strlen (queue_entry->filename) + 1));
 
-  pthread_mutex_lock (&queue_lock);
+  c_mutex_lock (&queue_lock);
 
   if (*tail == NULL)
     *head = queue_entry;
@@ -467,19 +903,23 @@ static int rrd_queue_enqueue (const char *filename,
     (*tail)->next = queue_entry;
   *tail = queue_entry;
 
-  pthread_cond_signal (&queue_cond);
-  pthread_mutex_unlock (&queue_lock);
+  pthread_cond_signal (&w->cond);
+  c_mutex_unlock (&queue_lock);
 
   return (0);
 } /* int rrd_queue_enqueue */
 
-static int rrd_queue_dequeue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+static int rrd_queue_dequeue (const char *filename, size_t worker,
+    _Bool flush)
 {
+  rrd_queue_worker_t *w = workers + worker;
+  rrd_queue_t **head = flush ? &w->flushq_head : &w->queue_head;
+  rrd_queue_t **tail = flush ? &w->flushq_tail : &w->queue_tail;
   rrd_queue_t *this;
   rrd_queue_t *prev;
+  size_t index = 0;
 
-  pthread_mutex_lock (&queue_lock);
+  c_mutex_lock (&queue_lock);
 
   prev = NULL;
   this = *head;
@@ -491,11 +931,12 @@ static int rrd_queue_dequeue (const char *filename,
     
     prev = this;
     this = this->next;
+    index++;
   }
 
   if (this == NULL)
   {
-    pthread_mutex_unlock (&queue_lock);
+    c_mutex_unlock (&queue_lock);
     return (-1);
   }
 
@@ -507,90 +948,81 @@ static int rrd_queue_dequeue (const char *filename,
   if (this->next == NULL)
     *tail = prev;
 
-  pthread_mutex_unlock (&queue_lock);
+  if (!flush && (index < w->sorted_num))
+    w->sorted_num--;
+
+  c_mutex_unlock (&queue_lock);
 
-  sfree (this->filename);
-  sfree (this);
+  rrd_queue_entry_free (this);
 
   return (0);
 } /* int rrd_queue_dequeue */
 
+/* The memory allocated for cache entry "rc". */
+static size_t rrd_cache_entry_size (rrd_cache_t const *rc) /* {{{ */
+{
+	size_t size = sizeof (*rc);
+
+	if (rc->filename != NULL)
+		size += strlen (rc->filename) + 1;
+	size += ((size_t) rc->values_size) * (sizeof (*rc->times)
+			+ ((size_t) rc->ds->ds_num) * sizeof (*rc->values));
+
+	return (size);
+} /* }}} size_t rrd_cache_entry_size */
+
 /* XXX: You must hold "cache_lock" when calling this function! */
 static void rrd_cache_flush (cdtime_t timeout)
 {
 	rrd_cache_t *rc;
 	cdtime_t     now;
 
-	char **keys = NULL;
-	int    keys_num = 0;
-
-	char *key;
-	c_avl_iterator_t *iter;
-	int i;
-
 	DEBUG ("rrdtool plugin: Flushing cache, timeout = %.3f",
 			CDTIME_T_TO_DOUBLE (timeout));
 
 	now = cdtime ();
 	timeout = TIME_T_TO_CDTIME_T (timeout);
 
-	/* Build a list of entries to be flushed */
-	iter = c_avl_get_iterator (cache);
-	while (c_avl_iterator_next (iter, (void *) &key, (void *) &rc) == 0)
+	/* Pop the entries that are due */
+	while (flush_heap_num > 0)
 	{
-		if (rc->flags != FLAG_NONE)
-			continue;
+		rc = flush_heap[0];
+
 		/* timeout == 0  =>  flush everything */
-		else if ((timeout != 0)
+		if ((timeout != 0)
 				&& ((now - rc->first_value) < timeout))
-			continue;
-		else if (rc->values_num > 0)
+			break;
+
+		if (rc->values_num > 0)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (key, &queue_head,  &queue_tail);
-			if (status == 0)
-				rc->flags = FLAG_QUEUED;
+			status = rrd_queue_enqueue (rc->filename, rc->worker,
+					/* flush = */ 0);
+			if (status != 0)
+				break;
+
+			rc->flags = FLAG_QUEUED;
+			rrd_heap_remove (rc);
 		}
 		else /* ancient and no values -> waste of memory */
 		{
-			char **tmp = (char **) realloc ((void *) keys,
-					(keys_num + 1) * sizeof (char *));
-			if (tmp == NULL)
+			rrd_heap_remove (rc);
+
+			if (c_htable_remove (cache, rc->filename, NULL, NULL) != 0)
 			{
-				char errbuf[1024];
-				ERROR ("rrdtool plugin: "
-						"realloc failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				c_avl_iterator_destroy (iter);
-				sfree (keys);
-				return;
+				DEBUG ("rrdtool plugin: c_htable_remove (%s) failed.",
+						rc->filename);
+				continue;
 			}
-			keys = tmp;
-			keys[keys_num] = key;
-			keys_num++;
-		}
-	} /* while (c_avl_iterator_next) */
-	c_avl_iterator_destroy (iter);
-	
-	for (i = 0; i < keys_num; i++)
-	{
-		if (c_avl_remove (cache, keys[i], (void *) &key, (void *) &rc) != 0)
-		{
-			DEBUG ("rrdtool plugin: c_avl_remove (%s) failed.", keys[i]);
-			continue;
-		}
 
-		assert (rc->values == NULL);
-		assert (rc->values_num == 0);
-
-		sfree (rc);
-		sfree (key);
-		keys[i] = NULL;
-	} /* for (i = 0..keys_num) */
-
-	sfree (keys);
+			rrd_cache_memory_add (-((int64_t) rrd_cache_entry_size (rc)));
+			sfree (rc->filename);
+			sfree (rc->times);
+			sfree (rc->values);
+			sfree (rc);
+		}
+	} /* while (flush_heap_num > 0) */
 
 	cache_flush_last = now;
 } /* void rrd_cache_flush */
@@ -619,25 +1051,30 @@ static int rrd_cache_flush_identifier (cdtime_t timeout,
         datadir, identifier);
   key[sizeof (key) - 1] = 0;
 
-  status = c_avl_get (cache, key, (void *) &rc);
+  status = c_htable_get (cache, key, (void *) &rc);
   if (status != 0)
   {
     INFO ("rrdtool plugin: rrd_cache_flush_identifier: "
-        "c_avl_get (%s) failed. Does that file really exist?",
+        "c_htable_get (%s) failed. Does that file really exist?",
         key);
     return (status);
   }
 
-  if (rc->flags == FLAG_FLUSHQ)
+  if ((rc->flags == FLAG_FLUSHQ) || rc->creating)
   {
     status = 0;
   }
   else if (rc->flags == FLAG_QUEUED)
   {
-    rrd_queue_dequeue (key, &queue_head, &queue_tail);
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    rrd_queue_dequeue (key, rc->worker, /* flush = */ 0);
+    status = rrd_queue_enqueue (key, rc->worker, /* flush = */ 1);
     if (status == 0)
       rc->flags = FLAG_FLUSHQ;
+    else
+    {
+      rc->flags = FLAG_NONE;
+      rrd_heap_insert (rc);
+    }
   }
   else if ((now - rc->first_value) < timeout)
   {
@@ -645,9 +1082,12 @@ static int rrd_cache_flush_identifier (cdtime_t timeout,
   }
   else if (rc->values_num > 0)
   {
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    status = rrd_queue_enqueue (key, rc->worker, /* flush = */ 1);
     if (status == 0)
+    {
       rc->flags = FLAG_FLUSHQ;
+      rrd_heap_remove (rc);
+    }
   }
 
   return (status);
@@ -688,77 +1128,144 @@ static int64_t rrd_get_random_variation (void)
   return (ret);
 } /* int64_t rrd_get_random_variation */
 
-static int rrd_cache_insert (const char *filename,
-		const char *value, cdtime_t value_time)
+/* First allocation of a cache entry's buffer, in updates. */
+#define RRD_CACHE_VALUES_INIT 4
+
+/* XXX: You must hold "cache_lock" when calling this function! */
+static int rrd_cache_insert_nolock (const char *filename,
+		const data_set_t *ds, const value_list_t *vl, _Bool creating)
 {
 	rrd_cache_t *rc = NULL;
 	int new_rc = 0;
-	char **values_new;
-
-	pthread_mutex_lock (&cache_lock);
 
 	/* This shouldn't happen, but it did happen at least once, so we'll be
 	 * careful. */
 	if (cache == NULL)
 	{
-		pthread_mutex_unlock (&cache_lock);
 		WARNING ("rrdtool plugin: cache == NULL.");
 		return (-1);
 	}
 
-	c_avl_get (cache, filename, (void *) &rc);
+	c_htable_get (cache, filename, (void *) &rc);
 
 	if (rc == NULL)
 	{
 		rc = malloc (sizeof (*rc));
 		if (rc == NULL)
 			return (-1);
+		rc->ds = ds;
 		rc->values_num = 0;
+		rc->values_size = 0;
+		rc->times = NULL;
 		rc->values = NULL;
 		rc->first_value = 0;
 		rc->last_value = 0;
 		rc->random_variation = rrd_get_random_variation ();
+		rc->worker = rrd_queue_worker_index (filename);
+		rc->creating = creating;
+		rc->filename = NULL;
+		rc->heap_index = HEAP_INDEX_NONE;
 		rc->flags = FLAG_NONE;
 		new_rc = 1;
 	}
 
-	if (rc->last_value >= value_time)
+	if (rc->last_value >= vl->time)
 	{
-		pthread_mutex_unlock (&cache_lock);
 		DEBUG ("rrdtool plugin: (rc->last_value = %"PRIu64") "
 				">= (value_time = %"PRIu64")",
-				rc->last_value, value_time);
+				rc->last_value, vl->time);
+		if (new_rc)
+			sfree (rc);
 		return (-1);
 	}
 
-	values_new = (char **) realloc ((void *) rc->values,
-			(rc->values_num + 1) * sizeof (char *));
-	if (values_new == NULL)
+	if (rc->ds->ds_num != ds->ds_num)
 	{
-		char errbuf[1024];
-		void *cache_key = NULL;
+		ERROR ("rrdtool plugin: The number of data sources of %s "
+				"changed from %i to %i.",
+				filename, rc->ds->ds_num, ds->ds_num);
+		if (new_rc)
+			sfree (rc);
+		return (-1);
+	}
+	rc->ds = ds;
 
-		sstrerror (errno, errbuf, sizeof (errbuf));
+	/* The file has been created: take part in flushing again. */
+	if (rc->creating && !creating)
+	{
+		rc->creating = 0;
+		if (rc->flags == FLAG_NONE)
+			rrd_heap_insert (rc);
+	}
 
-		c_avl_remove (cache, filename, &cache_key, NULL);
-		pthread_mutex_unlock (&cache_lock);
+	if ((cache_memory_limit > 0) && (cache_bytes >= cache_memory_limit)
+			&& (new_rc || (rc->values_num >= rc->values_size)))
+	{
+		cache_values_shed++;
+		if (!cache_shedding)
+		{
+			cache_shedding = 1;
+			WARNING ("rrdtool plugin: The cache uses more than "
+					"CacheMemoryLimit (%"PRIu64" bytes). Values are "
+					"dropped until the queue threads have caught up.",
+					cache_memory_limit);
+		}
+		if (new_rc)
+			sfree (rc);
+		return (-1);
+	}
+
+	if (rc->values_num >= rc->values_size)
+	{
+		int size = (rc->values_size > 0)
+			? (2 * rc->values_size) : RRD_CACHE_VALUES_INIT;
+		cdtime_t *times_new;
+		value_t *values_new;
 
-		ERROR ("rrdtool plugin: realloc failed: %s", errbuf);
+		times_new = realloc (rc->times, size * sizeof (*times_new));
+		if (times_new != NULL)
+			rc->times = times_new;
 
-		sfree (cache_key);
-		sfree (rc->values);
-		sfree (rc);
-		return (-1);
+		values_new = NULL;
+		if (times_new != NULL)
+			values_new = realloc (rc->values,
+					size * ds->ds_num * sizeof (*values_new));
+
+		if (values_new == NULL)
+		{
+			char errbuf[1024];
+
+			ERROR ("rrdtool plugin: realloc failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+
+			if (new_rc)
+			{
+				sfree (rc->times);
+				sfree (rc);
+			}
+			return (-1);
+		}
+		rc->values = values_new;
+		/* New entries are accounted once they have been inserted. */
+		if (!new_rc)
+			rrd_cache_memory_add (((int64_t) (size - rc->values_size))
+					* (int64_t) (sizeof (*rc->times)
+						+ ds->ds_num * sizeof (*rc->values)));
+		rc->values_size = size;
 	}
-	rc->values = values_new;
 
-	rc->values[rc->values_num] = strdup (value);
-	if (rc->values[rc->values_num] != NULL)
-		rc->values_num++;
+	rc->times[rc->values_num] = vl->time;
+	memcpy (rc->values + (rc->values_num * ds->ds_num), vl->values,
+			ds->ds_num * sizeof (*rc->values));
+	rc->values_num++;
+	cache_values_pending++;
 
 	if (rc->values_num == 1)
-		rc->first_value = value_time;
-	rc->last_value = value_time;
+	{
+		rc->first_value = vl->time;
+		rrd_heap_update (rc);
+	}
+	rc->last_value = vl->time;
 
 	/* Insert if this is the first value */
 	if (new_rc == 1)
@@ -770,17 +1277,19 @@ static int rrd_cache_insert (const char *filename,
 			char errbuf[1024];
 			sstrerror (errno, errbuf, sizeof (errbuf));
 
-			pthread_mutex_unlock (&cache_lock);
-
 			ERROR ("rrdtool plugin: strdup failed: %s", errbuf);
 
-			sfree (rc->values[0]);
+			sfree (rc->times);
 			sfree (rc->values);
 			sfree (rc);
 			return (-1);
 		}
 
-		c_avl_insert (cache, cache_key, rc);
+		c_htable_insert (cache, cache_key, rc);
+		rc->filename = cache_key;
+		rrd_cache_memory_add ((int64_t) rrd_cache_entry_size (rc));
+		if (!rc->creating)
+			rrd_heap_insert (rc);
 	}
 
 	DEBUG ("rrdtool plugin: rrd_cache_insert: file = %s; "
@@ -788,17 +1297,39 @@ static int rrd_cache_insert (const char *filename,
 			filename, rc->values_num,
 			CDTIME_T_TO_DOUBLE (rc->last_value - rc->first_value));
 
-	if ((rc->last_value - rc->first_value) >= (cache_timeout + rc->random_variation))
+	/* Over budget, entries with more pending values than the average
+	 * don't wait for their timeout: writing them frees the most memory. */
+	if ((cache_max_memory > 0) && (cache_bytes > cache_max_memory)
+			&& !rc->creating && (rc->flags == FLAG_NONE)
+			&& (rc->values_num > 1)
+			&& (((uint64_t) rc->values_num) * ((uint64_t) c_htable_size (cache))
+				> cache_values_pending))
+	{
+		if (rrd_queue_enqueue (filename, rc->worker, /* flush = */ 1) == 0)
+		{
+			rc->flags = FLAG_FLUSHQ;
+			rrd_heap_remove (rc);
+		}
+	}
+	else if ((rc->last_value - rc->first_value) >= (cache_timeout + rc->random_variation))
 	{
 		/* XXX: If you need to lock both, cache_lock and queue_lock, at
 		 * the same time, ALWAYS lock `cache_lock' first! */
-		if (rc->flags == FLAG_NONE)
+		if (rc->creating)
+		{
+			DEBUG ("rrdtool plugin: `%s' is still being created.", filename);
+		}
+		else if (rc->flags == FLAG_NONE)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (filename, &queue_head, &queue_tail);
+			status = rrd_queue_enqueue (filename, rc->worker,
+					/* flush = */ 0);
 			if (status == 0)
+			{
 				rc->flags = FLAG_QUEUED;
+				rrd_heap_remove (rc);
+			}
 
                         rc->random_variation = rrd_get_random_variation ();
 		}
@@ -808,14 +1339,8 @@ static int rrd_cache_insert (const char *filename,
 		}
 	}
 
-	if ((cache_timeout > 0) &&
-			((cdtime () - cache_flush_last) > cache_flush_timeout))
-		rrd_cache_flush (cache_flush_timeout);
-
-	pthread_mutex_unlock (&cache_lock);
-
 	return (0);
-} /* int rrd_cache_insert */
+} /* int rrd_cache_insert_nolock */
 
 static int rrd_cache_destroy (void) /* {{{ */
 {
@@ -824,18 +1349,17 @@ static int rrd_cache_destroy (void) /* {{{ */
 
   int non_empty = 0;
 
-  pthread_mutex_lock (&cache_lock);
+  c_mutex_lock (&cache_lock);
 
   if (cache == NULL)
   {
-    pthread_mutex_unlock (&cache_lock);
+    c_mutex_unlock (&cache_lock);
     return (0);
   }
 
-  while (c_avl_pick (cache, &key, &value) == 0)
+  while (c_htable_pick (cache, &key, &value) == 0)
   {
     rrd_cache_t *rc;
-    int i;
 
     sfree (key);
     key = NULL;
@@ -846,16 +1370,19 @@ static int rrd_cache_destroy (void) /* {{{ */
     if (rc->values_num > 0)
       non_empty++;
 
-    for (i = 0; i < rc->values_num; i++)
-      sfree (rc->values[i]);
+    sfree (rc->times);
     sfree (rc->values);
     sfree (rc);
   }
 
-  c_avl_destroy (cache);
+  c_htable_destroy (cache);
   cache = NULL;
 
-  if (non_empty > 0)
+  sfree (flush_heap);
+  flush_heap_num = 0;
+  flush_heap_size = 0;
+
+  if ((non_empty > 0) && !journal_written)
   {
     INFO ("rrdtool plugin: %i cache %s had values when destroying the cache.",
         non_empty, (non_empty == 1) ? "entry" : "entries");
@@ -866,10 +1393,288 @@ static int rrd_cache_destroy (void) /* {{{ */
         "when destroying the cache.");
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&cache_lock);
   return (0);
 } /* }}} int rrd_cache_destroy */
 
+/* Saves the values of all cache entries to "journal_file", one line per file:
+ * "<type> <number of updates> <time>:<value>... <file name>", with the times
+ * in cdtime_t. The journal is written sequentially under a temporary name and
+ * renamed when complete, so a partial journal is never loaded.
+ * XXX: You must hold "cache_lock" when calling this function! */
+static int rrd_journal_write (void) /* {{{ */
+{
+	char tmp_file[PATH_MAX];
+	char buffer[RRD_UPDATE_SIZE];
+	c_htable_iterator_t *iter;
+	void *key;
+	void *value;
+	FILE *fh;
+	uint64_t values_num = 0;
+	size_t files_num = 0;
+	int status = 0;
+
+	ssnprintf (tmp_file, sizeof (tmp_file), "%s.tmp", journal_file);
+
+	fh = fopen (tmp_file, "w");
+	if (fh == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("rrdtool plugin: Opening the journal %s failed: %s",
+				tmp_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	iter = c_htable_get_iterator (cache);
+	while ((status == 0) && (c_htable_iterator_next (iter, &key, &value) == 0))
+	{
+		rrd_cache_t *rc = value;
+		int i;
+
+		if (rc->values_num == 0)
+			continue;
+
+		if (fprintf (fh, "%s %i", rc->ds->type, rc->values_num) < 0)
+			status = -1;
+
+		for (i = 0; (status == 0) && (i < rc->values_num); i++)
+		{
+			status = values_to_string (buffer, sizeof (buffer), rc->ds,
+					rc->values + (i * rc->ds->ds_num));
+			if ((status == 0) && (fprintf (fh, " %"PRIu64"%s",
+							(uint64_t) rc->times[i], buffer) < 0))
+				status = -1;
+		}
+
+		if ((status == 0) && (fprintf (fh, " %s\n", rc->filename) < 0))
+			status = -1;
+
+		values_num += (uint64_t) rc->values_num;
+		files_num++;
+	}
+	c_htable_iterator_destroy (iter);
+
+	if ((status == 0) && ((fflush (fh) != 0) || (fsync (fileno (fh)) != 0)))
+		status = -1;
+	if ((fclose (fh) != 0) && (status == 0))
+		status = -1;
+	if ((status == 0) && (rename (tmp_file, journal_file) != 0))
+		status = -1;
+
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("rrdtool plugin: Writing the journal %s failed: %s",
+				journal_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+		unlink (tmp_file);
+		return (-1);
+	}
+
+	INFO ("rrdtool plugin: Saved %"PRIu64" value%s of %zu file%s to the "
+			"journal %s.", values_num, (values_num == 1) ? "" : "s",
+			files_num, (files_num == 1) ? "" : "s", journal_file);
+	return (0);
+} /* }}} int rrd_journal_write */
+
+/* Reads one line of arbitrary length into "*buffer", which is grown as
+ * needed. Returns NULL at the end of the file. */
+static char *rrd_journal_getline (FILE *fh, char **buffer, /* {{{ */
+		size_t *buffer_size)
+{
+	size_t len = 0;
+
+	while (42)
+	{
+		if ((*buffer_size - len) < 2)
+		{
+			size_t size = (*buffer_size > 0) ? (2 * *buffer_size) : 4096;
+			char *tmp;
+
+			tmp = realloc (*buffer, size);
+			if (tmp == NULL)
+				return (NULL);
+			*buffer = tmp;
+			*buffer_size = size;
+		}
+
+		if (fgets (*buffer + len, (int) (*buffer_size - len), fh) == NULL)
+			return ((len > 0) ? *buffer : NULL);
+
+		len += strlen (*buffer + len);
+		if ((*buffer)[len - 1] == '\n')
+		{
+			(*buffer)[len - 1] = 0;
+			return (*buffer);
+		}
+	}
+} /* }}} char *rrd_journal_getline */
+
+/* Inserts the values of one journal line into the cache. Returns the number
+ * of values inserted or less than zero if the line is invalid.
+ * XXX: You must hold "cache_lock" when calling this function! */
+static int rrd_journal_load_line (char *line) /* {{{ */
+{
+	const data_set_t *ds;
+	value_list_t vl = VALUE_LIST_INIT;
+	struct stat statbuf;
+	char *updates[2];
+	char *type;
+	char *filename;
+	char *ptr;
+	char *endptr;
+	long updates_num;
+	long i;
+	int inserted = 0;
+
+	/* "<type> <number of updates>", then the updates and the file name,
+	 * which may contain spaces. */
+	type = line;
+	ptr = strchr (line, ' ');
+	if (ptr == NULL)
+		return (-1);
+	*ptr = 0;
+	ptr++;
+
+	updates_num = strtol (ptr, &endptr, 10);
+	if ((endptr == ptr) || (*endptr != ' ') || (updates_num < 1))
+		return (-1);
+
+	updates[0] = endptr + 1;
+	filename = updates[0];
+	for (i = 0; i < updates_num; i++)
+	{
+		filename = strchr (filename, ' ');
+		if (filename == NULL)
+			return (-1);
+		filename++;
+	}
+
+	ds = plugin_get_ds (type);
+	if (ds == NULL)
+		return (-1);
+
+	if ((stat (filename, &statbuf) != 0) || !S_ISREG (statbuf.st_mode))
+	{
+		WARNING ("rrdtool plugin: Dropping the journaled values of %s: "
+				"The file doesn't exist.", filename);
+		return (0);
+	}
+
+	vl.values_len = ds->ds_num;
+	vl.values = calloc ((size_t) ds->ds_num, sizeof (*vl.values));
+	if (vl.values == NULL)
+		return (-1);
+
+	for (i = 0; i < updates_num; i++)
+	{
+		int j;
+
+		/* Terminates the update. */
+		updates[1] = strchr (updates[0], ' ');
+		*updates[1] = 0;
+
+		ptr = updates[0];
+		vl.time = (cdtime_t) strtoull (ptr, &endptr, 10);
+		ptr = endptr;
+
+		for (j = 0; j < ds->ds_num; j++)
+		{
+			char *field;
+
+			if (*ptr != ':')
+				break;
+			field = ptr + 1;
+
+			ptr = strchr (field, ':');
+			if (ptr != NULL)
+				*ptr = 0;
+
+			if ((strcmp ("U", field) == 0)
+					&& (ds->ds[j].type == DS_TYPE_GAUGE))
+				vl.values[j].gauge = NAN;
+			else if (parse_value (field, vl.values + j,
+						ds->ds[j].type) != 0)
+				break;
+
+			if (ptr == NULL)
+				ptr = field + strlen (field);
+			else
+				*ptr = ':';
+		}
+
+		if ((j == ds->ds_num) && (*ptr == 0)
+				&& (rrd_cache_insert_nolock (filename, ds, &vl,
+						/* creating = */ 0) == 0))
+			inserted++;
+
+		updates[0] = updates[1] + 1;
+	}
+
+	sfree (vl.values);
+	return (inserted);
+} /* }}} int rrd_journal_load_line */
+
+/* Loads the journal saved on shutdown into the cache and removes it. The
+ * entries are queued right away, so the queue threads write them at the pace
+ * set with "WritesPerSecond".
+ * XXX: You must hold "cache_lock" when calling this function! */
+static int rrd_journal_load (void) /* {{{ */
+{
+	FILE *fh;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	char *line;
+	uint64_t values_num = 0;
+	size_t invalid_num = 0;
+
+	fh = fopen (journal_file, "r");
+	if (fh == NULL)
+	{
+		char errbuf[1024];
+
+		if (errno == ENOENT)
+			return (0);
+
+		ERROR ("rrdtool plugin: Opening the journal %s failed: %s",
+				journal_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	while ((line = rrd_journal_getline (fh, &buffer, &buffer_size)) != NULL)
+	{
+		int status;
+
+		status = rrd_journal_load_line (line);
+		if (status < 0)
+			invalid_num++;
+		else
+			values_num += (uint64_t) status;
+	}
+
+	fclose (fh);
+	sfree (buffer);
+
+	if (invalid_num > 0)
+		WARNING ("rrdtool plugin: Ignored %zu invalid line%s of the "
+				"journal %s.", invalid_num,
+				(invalid_num == 1) ? "" : "s", journal_file);
+
+	/* The values are in memory now. Loading them again after a crash
+	 * would only cause errors for the values written meanwhile. */
+	if (unlink (journal_file) != 0)
+	{
+		char errbuf[1024];
+		WARNING ("rrdtool plugin: Removing the journal %s failed: %s",
+				journal_file, sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+
+	INFO ("rrdtool plugin: Loaded %"PRIu64" value%s from the journal %s.",
+			values_num, (values_num == 1) ? "" : "s", journal_file);
+
+	rrd_cache_flush (0);
+	return (0);
+} /* }}} int rrd_journal_load */
+
 static int rrd_compare_numeric (const void *a_ptr, const void *b_ptr)
 {
 	int a = *((int *) a_ptr);
@@ -883,26 +1688,28 @@ static int rrd_compare_numeric (const void *a_ptr, const void *b_ptr)
 		return (0);
 } /* int rrd_compare_numeric */
 
-static int rrd_write (const data_set_t *ds, const value_list_t *vl,
-		user_data_t __attribute__((unused)) *user_data)
+/* Value lists handled per acquisition of "cache_lock". */
+#define RRD_WRITE_CHUNK 32
+
+/* Determines the file name of "vl" and creates the RRD file if necessary.
+ * Returns zero if the value has to be inserted into the cache, greater than
+ * zero if the file is being created in the background, in which case the value
+ * is cached but must not be written yet, and less than zero on failure. */
+static int rrd_write_prepare (const data_set_t *ds, const value_list_t *vl,
+		char *filename, size_t filename_size)
 {
 	struct stat  statbuf;
-	char         filename[512];
-	char         values[512];
 	int          status;
 
-	if (do_shutdown)
-		return (0);
-
 	if (0 != strcmp (ds->type, vl->type)) {
 		ERROR ("rrdtool plugin: DS type does not match value list type");
 		return -1;
 	}
 
-	if (value_list_to_filename (filename, sizeof (filename), ds, vl) != 0)
+	if (value_list_to_filename (filename, filename_size, ds, vl) != 0)
 		return (-1);
 
-	if (value_list_to_string (values, sizeof (values), ds, vl) != 0)
+	if (rrd_ds_check (ds) != 0)
 		return (-1);
 
 	if (stat (filename, &statbuf) == -1)
@@ -914,7 +1721,7 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 			if (status != 0)
 				return (-1);
 			else if (rrdcreate_config.async)
-				return (0);
+				return (1);
 		}
 		else
 		{
@@ -932,24 +1739,86 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 		return (-1);
 	}
 
-	status = rrd_cache_insert (filename, values, vl->time);
+	return (0);
+} /* int rrd_write_prepare */
 
-	return (status);
-} /* int rrd_write */
+static int rrd_write_batch (const plugin_write_item_t *items, size_t items_num,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	struct
+	{
+		char filename[512];
+		const data_set_t *ds;
+		const value_list_t *vl;
+		_Bool creating;
+	} pending[RRD_WRITE_CHUNK];
+	size_t offset;
+	int ret = 0;
+
+	if (do_shutdown)
+		return (0);
+
+	for (offset = 0; offset < items_num; offset += RRD_WRITE_CHUNK)
+	{
+		size_t pending_num = 0;
+		size_t i;
+
+		/* stat(2) and creating files happen without holding the
+		 * cache lock. */
+		for (i = offset; (i < items_num) && (i < offset + RRD_WRITE_CHUNK); i++)
+		{
+			int status;
+
+			status = rrd_write_prepare (items[i].ds, items[i].vl,
+					pending[pending_num].filename,
+					sizeof (pending[pending_num].filename));
+			if (status < 0)
+			{
+				ret = -1;
+				continue;
+			}
+
+			pending[pending_num].ds = items[i].ds;
+			pending[pending_num].vl = items[i].vl;
+			pending[pending_num].creating = (status > 0);
+			pending_num++;
+		}
+
+		if (pending_num == 0)
+			continue;
+
+		c_mutex_lock (&cache_lock);
+		for (i = 0; i < pending_num; i++)
+		{
+			if (rrd_cache_insert_nolock (pending[i].filename,
+						pending[i].ds, pending[i].vl,
+						pending[i].creating) != 0)
+				ret = -1;
+		}
+
+		if ((cache_timeout > 0) &&
+				((cdtime_coarse () - cache_flush_last)
+				 > cache_flush_timeout))
+			rrd_cache_flush (cache_flush_timeout);
+		c_mutex_unlock (&cache_lock);
+	}
+
+	return (ret);
+} /* int rrd_write_batch */
 
 static int rrd_flush (cdtime_t timeout, const char *identifier,
 		__attribute__((unused)) user_data_t *user_data)
 {
-	pthread_mutex_lock (&cache_lock);
+	c_mutex_lock (&cache_lock);
 
 	if (cache == NULL) {
-		pthread_mutex_unlock (&cache_lock);
+		c_mutex_unlock (&cache_lock);
 		return (0);
 	}
 
 	rrd_cache_flush_identifier (timeout, identifier);
 
-	pthread_mutex_unlock (&cache_lock);
+	c_mutex_unlock (&cache_lock);
 	return (0);
 } /* int rrd_flush */
 
@@ -1020,6 +1889,26 @@ static int rrd_config (const char *key, const char *value)
 		else
 			rrdcreate_config.async = 0;
 	}
+	else if (strcasecmp ("CreateFilesThreads", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			fprintf (stderr, "rrdtool: `CreateFilesThreads' must "
+					"be at least 1.\n");
+			ERROR ("rrdtool: `CreateFilesThreads' must "
+					"be at least 1.");
+			return (1);
+		}
+		rrdcreate_config.async_threads = tmp;
+	}
+	else if (strcasecmp ("CreateFilesFromTemplate", key) == 0)
+	{
+		if (IS_TRUE (value))
+			rrdcreate_config.async_templates = 1;
+		else
+			rrdcreate_config.async_templates = 0;
+	}
 	else if (strcasecmp ("RRARows", key) == 0)
 	{
 		int tmp = atoi (value);
@@ -1104,6 +1993,55 @@ static int rrd_config (const char *key, const char *value)
 			write_rate = 1.0 / wps;
 		}
 	}
+	else if (strcasecmp ("WriteThreads", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			fprintf (stderr, "rrdtool: `WriteThreads' must "
+					"be at least 1.\n");
+			ERROR ("rrdtool: `WriteThreads' must "
+					"be at least 1.");
+			return (1);
+		}
+		workers_num = (size_t) tmp;
+	}
+	else if (strcasecmp ("QueueSortWindow", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 0)
+		{
+			fprintf (stderr, "rrdtool: `QueueSortWindow' must "
+					"not be negative.\n");
+			ERROR ("rrdtool: `QueueSortWindow' must "
+					"not be negative.");
+			return (1);
+		}
+		queue_sort_window = (size_t) tmp;
+	}
+	else if ((strcasecmp ("CacheMaxMemory", key) == 0)
+			|| (strcasecmp ("CacheMemoryLimit", key) == 0))
+	{
+		double tmp = atof (value);
+		if (tmp < 0.0)
+		{
+			fprintf (stderr, "rrdtool: `%s' must "
+					"not be negative.\n", key);
+			ERROR ("rrdtool: `%s' must "
+					"not be negative.", key);
+			return (1);
+		}
+		if (strcasecmp ("CacheMaxMemory", key) == 0)
+			cache_max_memory = (uint64_t) tmp;
+		else
+			cache_memory_limit = (uint64_t) tmp;
+	}
+	else if (strcasecmp ("JournalFile", key) == 0)
+	{
+		sfree (journal_file);
+		if (value[0] != 0)
+			journal_file = strdup (value);
+	}
 	else if (strcasecmp ("RandomTimeout", key) == 0)
         {
 		double tmp;
@@ -1130,34 +2068,91 @@ static int rrd_config (const char *key, const char *value)
 
 static int rrd_shutdown (void)
 {
-	pthread_mutex_lock (&cache_lock);
-	rrd_cache_flush (0);
-	pthread_mutex_unlock (&cache_lock);
+	size_t pending = 0;
+	size_t running = 0;
+	_Bool journaled = 0;
+	size_t i;
 
-	pthread_mutex_lock (&queue_lock);
+	if (workers == NULL)
+	{
+		rrd_cache_destroy ();
+		return (0);
+	}
+
+	/* Saving the cache to the journal is one sequential write instead of a
+	 * random write per file. If that fails, all files are written. The
+	 * cache lock is held until "journal_written" is set, so the queue
+	 * threads don't write any of the saved values. */
+	c_mutex_lock (&cache_lock);
+	if (journal_file != NULL)
+		journaled = (rrd_journal_write () == 0);
+	if (!journaled)
+		rrd_cache_flush (0);
+
+	c_mutex_lock (&queue_lock);
 	do_shutdown = 1;
-	pthread_cond_signal (&queue_cond);
-	pthread_mutex_unlock (&queue_lock);
+	journal_written = journaled;
+	c_mutex_unlock (&cache_lock);
+	for (i = 0; i < workers_num; i++)
+	{
+		if (workers[i].thread_running == 0)
+			continue;
 
-	if ((queue_thread_running != 0)
-			&& ((queue_head != NULL) || (flushq_head != NULL)))
+		running++;
+		if ((workers[i].queue_head != NULL)
+				|| (workers[i].flushq_head != NULL))
+			pending++;
+		pthread_cond_signal (&workers[i].cond);
+	}
+	c_mutex_unlock (&queue_lock);
+
+	if ((pending > 0) && !journaled)
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread. "
-				"This may take a while.");
+		INFO ("rrdtool plugin: Shutting down the queue thread%s. "
+				"This may take a while.", (running == 1) ? "" : "s");
 	}
-	else if (queue_thread_running != 0)
+	else if (running > 0)
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread.");
+		INFO ("rrdtool plugin: Shutting down the queue thread%s.",
+				(running == 1) ? "" : "s");
 	}
 
 	/* Wait for all the values to be written to disk before returning. */
-	if (queue_thread_running != 0)
+	for (i = 0; i < workers_num; i++)
+	{
+		if (workers[i].thread_running == 0)
+			continue;
+
+		pthread_join (workers[i].thread, NULL);
+		workers[i].thread_running = 0;
+		DEBUG ("rrdtool plugin: queue_thread %zu exited.", i);
+	}
+
+	for (i = 0; i < workers_num; i++)
 	{
-		pthread_join (queue_thread, NULL);
-		memset (&queue_thread, 0, sizeof (queue_thread));
-		queue_thread_running = 0;
-		DEBUG ("rrdtool plugin: queue_thread exited.");
+		rrd_queue_worker_t *w = workers + i;
+		rrd_queue_t *queue_entry;
+
+		/* Left over if the cache has been saved to the journal. */
+		while ((queue_entry = w->queue_head) != NULL)
+		{
+			w->queue_head = queue_entry->next;
+			rrd_queue_entry_free (queue_entry);
+		}
+		while ((queue_entry = w->flushq_head) != NULL)
+		{
+			w->flushq_head = queue_entry->next;
+			rrd_queue_entry_free (queue_entry);
+		}
+
+		pthread_cond_destroy (&w->cond);
 	}
+	sfree (workers);
+
+	if (cache_values_shed > 0)
+		NOTICE ("rrdtool plugin: %"PRIu64" value%s dropped because the "
+				"cache exceeded CacheMemoryLimit.", cache_values_shed,
+				(cache_values_shed == 1) ? " was" : "s were");
 
 	rrd_cache_destroy ();
 
@@ -1168,6 +2163,7 @@ static int rrd_init (void)
 {
 	static int init_once = 0;
 	int status;
+	size_t i;
 
 	if (init_once != 0)
 		return (0);
@@ -1176,17 +2172,40 @@ static int rrd_init (void)
 	if (rrdcreate_config.heartbeat <= 0)
 		rrdcreate_config.heartbeat = 2 * rrdcreate_config.stepsize;
 
+	workers = calloc (workers_num, sizeof (*workers));
+	if (workers == NULL)
+	{
+		ERROR ("rrdtool plugin: calloc failed.");
+		return (-1);
+	}
+	for (i = 0; i < workers_num; i++)
+		pthread_cond_init (&workers[i].cond, /* attr = */ NULL);
+
+	cache_memory = plugin_memory_counter ("rrdtool-cache");
+	queue_memory = plugin_memory_counter ("rrdtool-queue");
+
+	if ((cache_max_memory > 0) && (cache_memory_limit == 0))
+		cache_memory_limit = 2 * cache_max_memory;
+	else if ((cache_memory_limit > 0)
+			&& (cache_memory_limit < cache_max_memory))
+	{
+		WARNING ("rrdtool plugin: CacheMemoryLimit is lower than "
+				"CacheMaxMemory. Raising it to %"PRIu64" bytes.",
+				cache_max_memory);
+		cache_memory_limit = cache_max_memory;
+	}
+
 	/* Set the cache up */
-	pthread_mutex_lock (&cache_lock);
+	c_mutex_lock (&cache_lock);
 
-	cache = c_avl_create ((int (*) (const void *, const void *)) strcmp);
+	cache = c_htable_create ();
 	if (cache == NULL)
 	{
-		ERROR ("rrdtool plugin: c_avl_create failed.");
+		ERROR ("rrdtool plugin: c_htable_create failed.");
 		return (-1);
 	}
 
-	cache_flush_last = cdtime ();
+	cache_flush_last = cdtime_coarse ();
 	if (cache_timeout == 0)
 	{
 		cache_flush_timeout = 0;
@@ -1194,24 +2213,56 @@ static int rrd_init (void)
 	else if (cache_flush_timeout < cache_timeout)
 		cache_flush_timeout = 10 * cache_timeout;
 
-	pthread_mutex_unlock (&cache_lock);
+	c_mutex_unlock (&cache_lock);
 
-	status = plugin_thread_create (&queue_thread, /* attr = */ NULL,
-			rrd_queue_thread, /* args = */ NULL);
-	if (status != 0)
+	for (i = 0; i < workers_num; i++)
+	{
+		status = plugin_thread_create (&workers[i].thread,
+				/* attr = */ NULL, rrd_queue_thread,
+				/* args = */ workers + i);
+		if (status != 0)
+			break;
+		workers[i].thread_running = 1;
+	}
+
+	if (i == 0)
 	{
 		ERROR ("rrdtool plugin: Cannot create queue-thread.");
 		return (-1);
 	}
-	queue_thread_running = 1;
+	else if (i < workers_num)
+	{
+		/* No files have been assigned to a thread yet, so the
+		 * threads that exist can simply take over. */
+		size_t created = i;
+
+		WARNING ("rrdtool plugin: Only %zu of %zu queue threads "
+				"could be created.", created, workers_num);
+		for (; i < workers_num; i++)
+			pthread_cond_destroy (&workers[i].cond);
+
+		c_mutex_lock (&cache_lock);
+		workers_num = created;
+		c_mutex_unlock (&cache_lock);
+	}
+
+	/* Only now the files can be assigned to the queue threads. */
+	if (journal_file != NULL)
+	{
+		c_mutex_lock (&cache_lock);
+		rrd_journal_load ();
+		c_mutex_unlock (&cache_lock);
+	}
 
 	DEBUG ("rrdtool plugin: rrd_init: datadir = %s; stepsize = %lu;"
-			" heartbeat = %i; rrarows = %i; xff = %lf;",
+			" heartbeat = %i; rrarows = %i; xff = %lf;"
+			" write threads = %zu;",
 			(datadir == NULL) ? "(null)" : datadir,
 			rrdcreate_config.stepsize,
 			rrdcreate_config.heartbeat,
 			rrdcreate_config.rrarows,
-			rrdcreate_config.xff);
+			rrdcreate_config.xff,
+			workers_num);
 
 	return (0);
 } /* int rrd_init */
@@ -1221,7 +2272,8 @@ void module_register (void)
 	plugin_register_config ("rrdtool", rrd_config,
 			config_keys, config_keys_num);
 	plugin_register_init ("rrdtool", rrd_init);
-	plugin_register_write ("rrdtool", rrd_write, /* user_data = */ NULL);
+	plugin_register_write_batch ("rrdtool", rrd_write_batch,
+			/* user_data = */ NULL);
 	plugin_register_flush ("rrdtool", rrd_flush, /* user_data = */ NULL);
 	plugin_register_shutdown ("rrdtool", rrd_shutdown);
 }
@@ -0,0 +1,359 @@
+/**
+ * collectd - src/self.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/*
+ * Dispatches statistics about the daemon itself: the write queue, the value
+ * cache and the read and write callbacks of all other plugins.
+ */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_cache.h"
+#include "utils_lock.h"
+
+static void self_submit (const char *plugin_instance, /* {{{ */
+		const char *type, const char *type_instance, value_t value)
+{
+	value_list_t vl = VALUE_LIST_INIT;
+
+	vl.values = &value;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "self", sizeof (vl.plugin));
+	if (plugin_instance != NULL)
+		sstrncpy (vl.plugin_instance, plugin_instance,
+				sizeof (vl.plugin_instance));
+	sstrncpy (vl.type, type, sizeof (vl.type));
+	if (type_instance != NULL)
+		sstrncpy (vl.type_instance, type_instance,
+				sizeof (vl.type_instance));
+
+	plugin_dispatch_values (&vl);
+} /* }}} void self_submit */
+
+static void self_submit_gauge (const char *plugin_instance, /* {{{ */
+		const char *type, const char *type_instance, gauge_t gauge)
+{
+	value_t value;
+
+	value.gauge = gauge;
+	self_submit (plugin_instance, type, type_instance, value);
+} /* }}} void self_submit_gauge */
+
+static void self_submit_derive (const char *plugin_instance, /* {{{ */
+		const char *type, const char *type_instance, derive_t derive)
+{
+	value_t value;
+
+	value.derive = derive;
+	self_submit (plugin_instance, type, type_instance, value);
+} /* }}} void self_submit_derive */
+
+static void self_read_func_cb (const char *name, /* {{{ */
+		cdtime_t interval, cdtime_t effective_interval,
+		cdtime_t duration, void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "read-%s", name);
+
+	self_submit_gauge (plugin_instance, "duration", "call",
+			CDTIME_T_TO_DOUBLE (duration));
+	self_submit_gauge (plugin_instance, "duration", "interval",
+			CDTIME_T_TO_DOUBLE (interval));
+	/* Greater than "interval" while the callback is failing. */
+	self_submit_gauge (plugin_instance, "duration", "effective_interval",
+			CDTIME_T_TO_DOUBLE (effective_interval));
+} /* }}} void self_read_func_cb */
+
+static void self_read_thread_cb (const char *pool, size_t index, /* {{{ */
+		uint64_t reads, uint64_t stolen, cdtime_t lag,
+		void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	if (pool[0] == 0)
+		ssnprintf (plugin_instance, sizeof (plugin_instance),
+				"read_thread-%zu", index);
+	else
+		ssnprintf (plugin_instance, sizeof (plugin_instance),
+				"read_thread-%s-%zu", pool, index);
+
+	self_submit_derive (plugin_instance, "total_requests", "reads",
+			(derive_t) reads);
+	self_submit_derive (plugin_instance, "total_requests", "stolen",
+			(derive_t) stolen);
+	self_submit_derive (plugin_instance, "derive", "lag_us",
+			(derive_t) CDTIME_T_TO_US (lag));
+} /* }}} void self_read_thread_cb */
+
+/* Dispatches a histogram as returned by plugin_write_latency_stats(), each
+ * bucket as the type instance "<prefix>-<limit>". */
+static void self_submit_buckets (const char *plugin_instance, /* {{{ */
+		const char *prefix, const uint64_t *buckets, size_t buckets_num)
+{
+	size_t i;
+
+	for (i = 0; i < buckets_num; i++)
+	{
+		char type_instance[DATA_MAX_NAME_LEN];
+
+		/* The counters never decrease, so skipping empty buckets
+		 * doesn't leave any gaps. */
+		if (buckets[i] == 0)
+			continue;
+
+		if (i < (buckets_num - 1))
+			ssnprintf (type_instance, sizeof (type_instance),
+					"%s-%llu", prefix, 1ULL << i);
+		else
+			ssnprintf (type_instance, sizeof (type_instance),
+					"%s-inf", prefix);
+
+		self_submit_derive (plugin_instance, "derive", type_instance,
+				(derive_t) buckets[i]);
+	}
+} /* }}} void self_submit_buckets */
+
+/* "user_data" is the prefix of the type instances. */
+static void self_write_latency_cb (const char *name, /* {{{ */
+		const uint64_t *buckets, size_t buckets_num, void *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "write-%s", name);
+	self_submit_buckets (plugin_instance, user_data, buckets, buckets_num);
+} /* }}} void self_write_latency_cb */
+
+static void self_write_async_cb (const char *name, /* {{{ */
+		size_t length, uint64_t dropped,
+		void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "write-%s", name);
+
+	self_submit_gauge (plugin_instance, "queue_length", NULL,
+			(gauge_t) length);
+	self_submit_derive (plugin_instance, "total_values", "dropped",
+			(derive_t) dropped);
+} /* }}} void self_write_async_cb */
+
+/* Only called if built with "--enable-lockstats". */
+static void self_lock_cb (const char *name, /* {{{ */
+		uint64_t acquired, uint64_t contended, cdtime_t wait,
+		cdtime_t hold, void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "lock-%s", name);
+
+	self_submit_derive (plugin_instance, "total_requests", "acquired",
+			(derive_t) acquired);
+	self_submit_derive (plugin_instance, "total_requests", "contended",
+			(derive_t) contended);
+	self_submit_derive (plugin_instance, "derive", "wait_us",
+			(derive_t) CDTIME_T_TO_US (wait));
+	self_submit_derive (plugin_instance, "derive", "hold_us",
+			(derive_t) CDTIME_T_TO_US (hold));
+} /* }}} void self_lock_cb */
+
+static void self_cpu_cb (const char *type, const char *name, /* {{{ */
+		cdtime_t cpu, void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "%s-%s",
+			type, name);
+	self_submit_derive (plugin_instance, "derive", "cpu_us",
+			(derive_t) CDTIME_T_TO_US (cpu));
+} /* }}} void self_cpu_cb */
+
+static void self_memory_cb (const char *name, uint64_t bytes, /* {{{ */
+		void __attribute__((unused)) *user_data)
+{
+	self_submit_gauge (NULL, "memory", name, (gauge_t) bytes);
+} /* }}} void self_memory_cb */
+
+static void self_series_cb (const char *plugin, size_t series, /* {{{ */
+		uint64_t created, uint64_t rejected,
+		void __attribute__((unused)) *user_data)
+{
+	char plugin_instance[DATA_MAX_NAME_LEN];
+
+	ssnprintf (plugin_instance, sizeof (plugin_instance), "series-%s",
+			plugin);
+	self_submit_gauge (plugin_instance, "cache_size", NULL,
+			(gauge_t) series);
+	self_submit_derive (plugin_instance, "total_values", "created",
+			(derive_t) created);
+	self_submit_derive (plugin_instance, "total_values", "rejected",
+			(derive_t) rejected);
+} /* }}} void self_series_cb */
+
+static int self_read (void) /* {{{ */
+{
+	size_t notif_length;
+	uint64_t notif_dropped;
+	uint64_t notif_coalesced;
+	uint64_t log_dropped;
+	uint64_t log_suppressed;
+	unsigned int overload_stretch;
+	uint64_t overload_adjustments;
+	size_t write_threads;
+	size_t read_hung;
+	uint64_t read_timeouts;
+	uint64_t write_threads_adjustments;
+	uint64_t wait[PLUGIN_WRITE_LATENCY_BUCKETS];
+
+	/* Write queue */
+	self_submit_gauge (NULL, "queue_length", "write",
+			(gauge_t) plugin_write_queue_length ());
+	self_submit_gauge (NULL, "queue_length", "write-peak",
+			(gauge_t) plugin_write_queue_peak ());
+
+	/* Write threads */
+	plugin_write_threads_stats (&write_threads, &write_threads_adjustments);
+	self_submit_gauge (NULL, "threads", "write", (gauge_t) write_threads);
+	self_submit_derive (NULL, "total_requests", "write_threads-adjustments",
+			(derive_t) write_threads_adjustments);
+
+	/* Values */
+	self_submit_derive (NULL, "total_values", "dispatched",
+			(derive_t) plugin_values_dispatched ());
+	self_submit_derive (NULL, "total_values", "dropped",
+			(derive_t) plugin_write_queue_dropped ());
+	self_submit_derive (NULL, "total_values", "too_old",
+			(derive_t) uc_get_values_too_old ());
+
+	/* Value cache */
+	self_submit_gauge (NULL, "cache_size", NULL, (gauge_t) uc_get_size ());
+	self_submit_gauge (NULL, "memory", "cache", (gauge_t) uc_get_memory ());
+	self_submit_derive (NULL, "total_values", "series_created",
+			(derive_t) uc_get_series_created ());
+	self_submit_derive (NULL, "total_values", "series_rejected",
+			(derive_t) uc_get_values_rejected ());
+	uc_series_stats (self_series_cb, /* user data = */ NULL);
+	plugin_memory_stats (self_memory_cb, /* user data = */ NULL);
+
+	/* Notification queue */
+	plugin_notification_queue_stats (&notif_length, &notif_dropped,
+			&notif_coalesced);
+	self_submit_gauge (NULL, "queue_length", "notification",
+			(gauge_t) notif_length);
+	self_submit_derive (NULL, "derive", "notification-dropped",
+			(derive_t) notif_dropped);
+	self_submit_derive (NULL, "derive", "notification-coalesced",
+			(derive_t) notif_coalesced);
+
+	/* Overload controller */
+	plugin_overload_stats (&overload_stretch, &overload_adjustments);
+	self_submit_gauge ("overload", "gauge", "stretch",
+			(gauge_t) overload_stretch);
+	self_submit_derive ("overload", "total_requests", "adjustments",
+			(derive_t) overload_adjustments);
+
+	/* Log messages */
+	plugin_log_stats (&log_dropped, &log_suppressed);
+	self_submit_derive (NULL, "derive", "log-dropped",
+			(derive_t) log_dropped);
+	self_submit_derive (NULL, "derive", "log-suppressed",
+			(derive_t) log_suppressed);
+
+	/* Read callbacks which exceeded their timeout */
+	plugin_read_timeout_stats (&read_hung, &read_timeouts);
+	self_submit_gauge (NULL, "threads", "read-hung", (gauge_t) read_hung);
+	self_submit_derive (NULL, "derive", "read-timeouts",
+			(derive_t) read_timeouts);
+
+	/* Callbacks */
+	plugin_read_func_stats (self_read_func_cb, /* user data = */ NULL);
+	plugin_read_thread_stats (self_read_thread_cb, /* user data = */ NULL);
+	plugin_write_latency_stats (self_write_latency_cb, "latency");
+	plugin_write_delay_stats (self_write_latency_cb, "delay");
+	plugin_write_async_stats (self_write_async_cb, /* user data = */ NULL);
+	plugin_callback_cpu_stats (self_cpu_cb, /* user data = */ NULL);
+
+	c_lock_stats (self_lock_cb, /* user data = */ NULL);
+
+	/* With "WriteTracing" only. */
+	if (plugin_write_queue_wait_stats (wait, STATIC_ARRAY_SIZE (wait)) == 0)
+		self_submit_buckets ("write_queue", "wait", wait,
+				STATIC_ARRAY_SIZE (wait));
+
+	return (0);
+} /* }}} int self_read */
+
+/* Prints the traces sampled with "WriteTraceSample". */
+static int self_traces_command (FILE *fh, /* {{{ */
+		__attribute__((unused)) char *buffer,
+		__attribute__((unused)) user_data_t *ud)
+{
+	plugin_write_trace_t *traces = NULL;
+	size_t traces_num = 0;
+	size_t i;
+	int status;
+
+	status = plugin_write_traces (&traces, &traces_num);
+	if (status == EINVAL)
+	{
+		fprintf (fh, "-1 Tracing is not enabled.\n");
+		return (-1);
+	}
+	else if (status != 0)
+	{
+		fprintf (fh, "-1 Copying the traces failed.\n");
+		return (-1);
+	}
+
+	fprintf (fh, "%zu Trace%s found\n", traces_num,
+			(traces_num == 1) ? "" : "s");
+	for (i = 0; i < traces_num; i++)
+	{
+		plugin_write_trace_t *t = traces + i;
+		size_t j;
+
+		fprintf (fh, "%s %.3f", t->identity,
+				CDTIME_T_TO_DOUBLE (t->enqueued));
+		if (t->dequeued != 0)
+			fprintf (fh, " dequeued=+%"PRIu64,
+					(uint64_t) CDTIME_T_TO_US (t->dequeued
+						- t->enqueued));
+		for (j = 0; j < t->writers_num; j++)
+			fprintf (fh, " %s=+%"PRIu64, t->writers[j],
+					(uint64_t) CDTIME_T_TO_US (t->written[j]
+						- t->enqueued));
+		fprintf (fh, "\n");
+	}
+
+	sfree (traces);
+	return (0);
+} /* }}} int self_traces_command */
+
+void module_register (void)
+{
+	plugin_register_read ("self", self_read);
+	plugin_register_command ("LISTTRACES", self_traces_command,
+			/* user data = */ NULL);
+} /* void module_register */
+
+/* vim: set sw=8 ts=8 noet fdm=marker : */
@@ -162,6 +162,18 @@ typedef struct featurelist
 	const sensors_chip_name    *chip;
 	const sensors_feature      *feature;
 	const sensors_subfeature   *subfeature;
+
+	/* Determined once by sensors_load_conf. */
+	char                        plugin_instance[DATA_MAX_NAME_LEN];
+	const char                 *type;
+	char                        type_instance[DATA_MAX_NAME_LEN];
+	_Bool                       ignored;
+
+	/* If set, the value is read from this sysfs file instead of calling
+	 * sensors_get_value, and divided by "scale". */
+	pread_file_t               *pf;
+	double                      scale;
+
 	struct featurelist         *next;
 } featurelist_t;
 
@@ -275,11 +287,145 @@ void sensors_free_features (void)
 	for (thisft = first_feature; thisft != NULL; thisft = nextft)
 	{
 		nextft = thisft->next;
+#if (SENSORS_API_VERSION >= 0x400) && (SENSORS_API_VERSION < 0x500)
+		pread_file_destroy (thisft->pf);
+#endif
 		sfree (thisft);
 	}
 	first_feature = NULL;
 }
 
+static _Bool sensors_is_ignored (const char *plugin_instance,
+		const char *type, const char *type_instance)
+{
+	char match_key[1024];
+	int status;
+
+	if (sensor_list == NULL)
+		return (0);
+
+	status = ssnprintf (match_key, sizeof (match_key), "%s/%s-%s",
+			plugin_instance, type, type_instance);
+	if (status < 1)
+		return (1);
+
+	DEBUG ("sensors plugin: Checking ignorelist for `%s'", match_key);
+	return (ignorelist_match (sensor_list, match_key) != 0);
+} /* _Bool sensors_is_ignored */
+
+#if (SENSORS_API_VERSION >= 0x400) && (SENSORS_API_VERSION < 0x500)
+static int sensors_read_value (featurelist_t *fl, double *ret_value)
+{
+	if (fl->pf != NULL)
+	{
+		char *buffer;
+		char *endptr = NULL;
+		double raw;
+
+		buffer = pread_file_read (fl->pf, /* ret_len = */ NULL);
+		if (buffer == NULL)
+			return (-1);
+
+		errno = 0;
+		raw = strtod (buffer, &endptr);
+		if ((errno != 0) || (endptr == buffer))
+			return (-1);
+
+		*ret_value = raw / fl->scale;
+		return (0);
+	}
+
+	if (sensors_get_value (fl->chip, fl->subfeature->number, ret_value) < 0)
+		return (-1);
+	return (0);
+} /* int sensors_read_value */
+
+# if KERNEL_LINUX
+/* Keeps the sysfs file of the subfeature open, so that reading it doesn't
+ * need an open(2) and close(2) by libsensors every time. This bypasses the
+ * "compute" statements of sensors.conf, so the file is only used if its
+ * value agrees with the one computed by libsensors. */
+static void sensors_open_direct (featurelist_t *fl)
+{
+	char path[PATH_MAX];
+	double before;
+	double expected;
+	double after;
+	int status;
+
+	if ((fl->chip->path == NULL)
+			|| ((fl->subfeature->flags & SENSORS_MODE_R) == 0))
+		return;
+
+	if (fl->subfeature->type == SENSORS_SUBFEATURE_FAN_INPUT)
+		fl->scale = 1.0;
+	else
+		fl->scale = 1000.0;
+
+	status = ssnprintf (path, sizeof (path), "%s/%s",
+			fl->chip->path, fl->subfeature->name);
+	if ((status < 1) || ((size_t) status >= sizeof (path)))
+		return;
+
+	fl->pf = pread_file_create (path);
+	if (fl->pf == NULL)
+		return;
+
+	/* The value may change between the reads, so it's enough if the
+	 * result of libsensors lies between the two direct reads. */
+	if ((sensors_read_value (fl, &before) == 0)
+			&& (sensors_get_value (fl->chip, fl->subfeature->number,
+					&expected) >= 0)
+			&& (sensors_read_value (fl, &after) == 0)
+			&& (expected >= ((before < after) ? before : after))
+			&& (expected <= ((before < after) ? after : before)))
+	{
+		DEBUG ("sensors plugin: Reading `%s' directly.", path);
+		return;
+	}
+
+	DEBUG ("sensors plugin: Not reading `%s' directly.", path);
+	pread_file_destroy (fl->pf);
+	fl->pf = NULL;
+} /* void sensors_open_direct */
+# endif /* KERNEL_LINUX */
+
+/* Determines everything about the feature that doesn't change between
+ * reads. Returns non-zero if the feature can't be handled. */
+static int sensors_feature_init (featurelist_t *fl)
+{
+	int status;
+
+	if (fl->feature->type == SENSORS_FEATURE_IN)
+		fl->type = "voltage";
+	else if (fl->feature->type == SENSORS_FEATURE_FAN)
+		fl->type = "fanspeed";
+	else if (fl->feature->type == SENSORS_FEATURE_TEMP)
+		fl->type = "temperature";
+	else
+		return (-1);
+
+	status = sensors_snprintf_chip_name (fl->plugin_instance,
+			sizeof (fl->plugin_instance), fl->chip);
+	if (status < 0)
+		return (-1);
+
+	sstrncpy (fl->type_instance, fl->feature->name,
+			sizeof (fl->type_instance));
+
+	fl->ignored = sensors_is_ignored (fl->plugin_instance, fl->type,
+			fl->type_instance);
+	if (fl->ignored)
+		return (0);
+
+# if KERNEL_LINUX
+	sensors_open_direct (fl);
+# endif
+
+	return (0);
+} /* int sensors_feature_init */
+#endif /* (SENSORS_API_VERSION >= 0x400) && (SENSORS_API_VERSION < 0x500) */
+
 static int sensors_load_conf (void)
 {
 	static int call_once = 0;
@@ -442,6 +588,12 @@ static int sensors_load_conf (void)
 				fl->feature = feature;
 				fl->subfeature = subfeature;
 
+				if (sensors_feature_init (fl) != 0)
+				{
+					sfree (fl);
+					continue;
+				}
+
 				if (first_feature == NULL)
 					first_feature = fl;
 				else
@@ -471,28 +623,13 @@ static int sensors_shutdown (void)
 	return (0);
 } /* int sensors_shutdown */
 
-static void sensors_submit (const char *plugin_instance,
+static void sensors_dispatch (const char *plugin_instance,
 		const char *type, const char *type_instance,
 		double val)
 {
-	char match_key[1024];
-	int status;
-
 	value_t values[1];
 	value_list_t vl = VALUE_LIST_INIT;
 
-	status = ssnprintf (match_key, sizeof (match_key), "%s/%s-%s",
-			plugin_instance, type, type_instance);
-	if (status < 1)
-		return;
-
-	if (sensor_list != NULL)
-	{
-		DEBUG ("sensors plugin: Checking ignorelist for `%s'", match_key);
-		if (ignorelist_match (sensor_list, match_key))
-			return;
-	}
-
 	values[0].gauge = val;
 
 	vl.values = values;
@@ -506,7 +643,19 @@ static void sensors_submit (const char *plugin_instance,
 	sstrncpy (vl.type_instance, type_instance, sizeof (vl.type_instance));
 
 	plugin_dispatch_values (&vl);
+} /* void sensors_dispatch */
+
+#if SENSORS_API_VERSION < 0x400
+static void sensors_submit (const char *plugin_instance,
+		const char *type, const char *type_instance,
+		double val)
+{
+	if (sensors_is_ignored (plugin_instance, type, type_instance))
+		return;
+
+	sensors_dispatch (plugin_instance, type, type_instance, val);
 } /* void sensors_submit */
+#endif
 
 static int sensors_read (void)
 {
@@ -547,36 +696,15 @@ static int sensors_read (void)
 	for (fl = first_feature; fl != NULL; fl = fl->next)
 	{
 		double value;
-		int status;
-		char plugin_instance[DATA_MAX_NAME_LEN];
-		char type_instance[DATA_MAX_NAME_LEN];
-		const char *type;
 
-		status = sensors_get_value (fl->chip,
-				fl->subfeature->number, &value);
-		if (status < 0)
+		if (fl->ignored)
 			continue;
 
-		status = sensors_snprintf_chip_name (plugin_instance,
-				sizeof (plugin_instance), fl->chip);
-		if (status < 0)
-			continue;
-
-		sstrncpy (type_instance, fl->feature->name,
-				sizeof (type_instance));
-
-		if (fl->feature->type == SENSORS_FEATURE_IN)
-			type = "voltage";
-		else if (fl->feature->type
-				== SENSORS_FEATURE_FAN)
-			type = "fanspeed";
-		else if (fl->feature->type
-				== SENSORS_FEATURE_TEMP)
-			type = "temperature";
-		else
+		if (sensors_read_value (fl, &value) != 0)
 			continue;
 
-		sensors_submit (plugin_instance, type, type_instance, value);
+		sensors_dispatch (fl->plugin_instance, fl->type,
+				fl->type_instance, value);
 	} /* for fl = first_feature .. NULL */
 #endif /* (SENSORS_API_VERSION >= 0x400) && (SENSORS_API_VERSION < 0x500) */
 
@@ -0,0 +1,375 @@
+/**
+ * collectd - src/shm.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_cache.h"
+#include "utils_htable.h"
+
+#include "libcollectdclient/collectd/shm.h"
+
+#include <pthread.h>
+
+#if HAVE_FNMATCH_H
+# include <fnmatch.h>
+#endif
+
+/*
+ * Mirrors the rates in the cache into a shared memory segment, so that local
+ * readers can get them without a round trip through the unixsock plugin. See
+ * libcollectdclient/collectd/shm.h for the layout. The segment is created
+ * under a temporary name and renamed, so that readers never see a file which
+ * is shorter than its header says; readers of a previous segment notice that
+ * its writer has gone because "pid" is reset on shutdown.
+ */
+
+/* Value of "slots" for series which are not exported. */
+#define SHM_NOT_SELECTED ((void *) -1)
+
+static char *conf_file = NULL;
+static uint32_t conf_slots_num = 4096;
+static char **conf_select = NULL;
+static size_t conf_select_num = 0;
+
+static void *shm_base = NULL;
+static size_t shm_size = 0;
+static lcc_shm_t shm;
+/* Identifies our file, which may have been replaced by a newer process. */
+static dev_t shm_dev;
+static ino_t shm_ino;
+
+/* Protects "slots" and serializes the writers of the sequence locks. */
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Maps names to their slot number plus one, or SHM_NOT_SELECTED. */
+static c_htable_t *slots = NULL;
+static _Bool shm_full_warned = 0;
+
+static _Bool shm_selected (const char *name) /* {{{ */
+{
+  size_t i;
+
+  if (conf_select_num == 0)
+    return (1);
+
+  for (i = 0; i < conf_select_num; i++)
+  {
+#if HAVE_FNMATCH_H
+    if (fnmatch (conf_select[i], name, /* flags = */ 0) == 0)
+      return (1);
+#else
+    if (strncmp (conf_select[i], name, strlen (conf_select[i])) == 0)
+      return (1);
+#endif
+  }
+
+  return (0);
+} /* }}} _Bool shm_selected */
+
+/* Allocates the slot for "name". Returns NULL for series which are not
+ * exported. Called with "shm_lock" held. */
+static lcc_shm_slot_t *shm_slot_get (const char *name, /* {{{ */
+    const data_set_t *ds)
+{
+  lcc_shm_header_t *h = shm_base;
+  volatile uint32_t *index = (volatile uint32_t *) shm.index;
+  lcc_shm_slot_t *s;
+  void *value = NULL;
+  char *key;
+  uint32_t num;
+  uint32_t mask;
+  uint32_t pos;
+  int i;
+
+  if (c_htable_get (slots, name, &value) == 0)
+  {
+    if (value == SHM_NOT_SELECTED)
+      return (NULL);
+    return ((lcc_shm_slot_t *) shm.slots + ((uintptr_t) value - 1));
+  }
+
+  key = strdup (name);
+  if (key == NULL)
+    return (NULL);
+
+  if (!shm_selected (name) || (strlen (name) >= LCC_SHM_NAME_LEN)
+      || (ds->ds_num > LCC_SHM_VALUES_MAX))
+  {
+    if (c_htable_insert (slots, key, SHM_NOT_SELECTED) != 0)
+      sfree (key);
+    return (NULL);
+  }
+
+  num = h->slots_used;
+  if (num >= h->slots_num)
+  {
+    if (!shm_full_warned)
+    {
+      WARNING ("shm plugin: All %"PRIu32" slots are in use, \"%s\" and "
+          "later series will not be exported. Consider increasing `Slots'.",
+          h->slots_num, name);
+      shm_full_warned = 1;
+    }
+    if (c_htable_insert (slots, key, SHM_NOT_SELECTED) != 0)
+      sfree (key);
+    return (NULL);
+  }
+
+  if (c_htable_insert (slots, key, (void *) (uintptr_t) (num + 1)) != 0)
+  {
+    sfree (key);
+    return (NULL);
+  }
+
+  s = (lcc_shm_slot_t *) shm.slots + num;
+  sstrncpy (s->name, name, sizeof (s->name));
+  s->values_num = (uint32_t) ds->ds_num;
+  for (i = 0; i < ds->ds_num; i++)
+    sstrncpy (s->values_names[i], ds->ds[i].name,
+        sizeof (s->values_names[i]));
+
+  /* Readers don't look at the slot before it's in the index. */
+  __sync_synchronize ();
+  mask = h->index_size - 1;
+  pos = lcc_shm_hash (name) & mask;
+  while (index[pos] != 0)
+    pos = (pos + 1) & mask;
+  index[pos] = num + 1;
+  h->slots_used = num + 1;
+
+  return (s);
+} /* }}} lcc_shm_slot_t *shm_slot_get */
+
+static int shm_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
+    user_data_t __attribute__((unused)) *user_data)
+{
+  char buffer[6 * DATA_MAX_NAME_LEN];
+  const char *name = vl->identity;
+  lcc_shm_slot_t *s;
+  gauge_t *rates;
+  int i;
+
+  if (name == NULL)
+  {
+    if (FORMAT_VL (buffer, sizeof (buffer), vl) != 0)
+      return (-1);
+    name = buffer;
+  }
+
+  pthread_mutex_lock (&shm_lock);
+  s = shm_slot_get (name, ds);
+  pthread_mutex_unlock (&shm_lock);
+  if (s == NULL)
+    return (0);
+
+  /* Values renamed in the post-cache chain are not in the cache. */
+  rates = uc_get_rate (ds, vl);
+  if (rates == NULL)
+    return (0);
+
+  pthread_mutex_lock (&shm_lock);
+  s->seq++;
+  __sync_synchronize ();
+
+  s->time = (uint64_t) vl->time;
+  s->interval = (uint64_t) vl->interval;
+  for (i = 0; (i < ds->ds_num) && (i < LCC_SHM_VALUES_MAX); i++)
+    s->values[i] = (double) rates[i];
+
+  __sync_synchronize ();
+  s->seq++;
+  pthread_mutex_unlock (&shm_lock);
+
+  sfree (rates);
+  return (0);
+} /* }}} int shm_write */
+
+static int shm_config (oconfig_item_t *ci) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("File", child->key) == 0)
+      cf_util_get_string (child, &conf_file);
+    else if (strcasecmp ("Slots", child->key) == 0)
+    {
+      int tmp = (int) conf_slots_num;
+      if ((cf_util_get_int (child, &tmp) == 0)
+          && ((tmp < 1) || (tmp > (1 << 24))))
+        WARNING ("shm plugin: `Slots' must be between 1 and %i.", 1 << 24);
+      else
+        conf_slots_num = (uint32_t) tmp;
+    }
+    else if (strcasecmp ("Select", child->key) == 0)
+    {
+      char **tmp;
+
+      tmp = realloc (conf_select,
+          (conf_select_num + 1) * sizeof (*conf_select));
+      if (tmp == NULL)
+        return (ENOMEM);
+      conf_select = tmp;
+      conf_select[conf_select_num] = NULL;
+      if (cf_util_get_string (child, conf_select + conf_select_num) == 0)
+        conf_select_num++;
+    }
+    else
+      ERROR ("shm plugin: The \"%s\" config option is not valid.",
+          child->key);
+  }
+
+  return (0);
+} /* }}} int shm_config */
+
+static int shm_init (void) /* {{{ */
+{
+  const char *file = (conf_file != NULL) ? conf_file : LCC_SHM_DEFAULT_FILE;
+  char tmpfile[PATH_MAX];
+  struct stat statbuf;
+  lcc_shm_header_t *h;
+  uint32_t index_size;
+  int fd;
+
+  if (shm_base != NULL)
+    return (0);
+
+  index_size = 1;
+  while (index_size < 2 * conf_slots_num)
+    index_size *= 2;
+  shm_size = lcc_shm_size (conf_slots_num, index_size);
+
+  slots = c_htable_create ();
+  if (slots == NULL)
+  {
+    ERROR ("shm plugin: c_htable_create failed.");
+    return (-1);
+  }
+
+  ssnprintf (tmpfile, sizeof (tmpfile), "%s.XXXXXX", file);
+  fd = mkstemp (tmpfile);
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    ERROR ("shm plugin: Creating \"%s\" failed: %s", tmpfile,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  if ((fchmod (fd, 0644) != 0) || (ftruncate (fd, (off_t) shm_size) != 0)
+      || (fstat (fd, &statbuf) != 0))
+  {
+    char errbuf[1024];
+    ERROR ("shm plugin: Resizing \"%s\" to %zu bytes failed: %s", tmpfile,
+        shm_size, sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    unlink (tmpfile);
+    return (-1);
+  }
+
+  shm_dev = statbuf.st_dev;
+  shm_ino = statbuf.st_ino;
+
+  shm_base = mmap (NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, /* offset = */ 0);
+  close (fd);
+  if (shm_base == MAP_FAILED)
+  {
+    char errbuf[1024];
+    ERROR ("shm plugin: mmap failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    shm_base = NULL;
+    unlink (tmpfile);
+    return (-1);
+  }
+
+  h = shm_base;
+  h->magic = LCC_SHM_MAGIC;
+  h->version = LCC_SHM_VERSION;
+  h->slots_num = conf_slots_num;
+  h->index_size = index_size;
+  h->slots_used = 0;
+  h->pid = (uint32_t) getpid ();
+  lcc_shm_attach (&shm, shm_base, shm_size);
+
+  if (rename (tmpfile, file) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("shm plugin: Renaming \"%s\" to \"%s\" failed: %s", tmpfile,
+        file, sstrerror (errno, errbuf, sizeof (errbuf)));
+    munmap (shm_base, shm_size);
+    shm_base = NULL;
+    unlink (tmpfile);
+    return (-1);
+  }
+
+  plugin_register_write ("shm", shm_write, /* user_data = */ NULL);
+  return (0);
+} /* }}} int shm_init */
+
+static int shm_shutdown (void) /* {{{ */
+{
+  const char *file = (conf_file != NULL) ? conf_file : LCC_SHM_DEFAULT_FILE;
+  struct stat statbuf;
+  void *key;
+  void *value;
+  size_t i;
+
+  plugin_unregister_write ("shm");
+
+  if (shm_base != NULL)
+  {
+    ((lcc_shm_header_t *) shm_base)->pid = 0;
+    if ((stat (file, &statbuf) == 0) && (statbuf.st_dev == shm_dev)
+        && (statbuf.st_ino == shm_ino))
+      unlink (file);
+    munmap (shm_base, shm_size);
+    shm_base = NULL;
+  }
+
+  if (slots != NULL)
+  {
+    while (c_htable_pick (slots, &key, &value) == 0)
+      sfree (key);
+    c_htable_destroy (slots);
+    slots = NULL;
+  }
+
+  for (i = 0; i < conf_select_num; i++)
+    sfree (conf_select[i]);
+  sfree (conf_select);
+  conf_select_num = 0;
+  sfree (conf_file);
+
+  return (0);
+} /* }}} int shm_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("shm", shm_config);
+  plugin_register_init ("shm", shm_init);
+  plugin_register_shutdown ("shm", shm_shutdown);
+} /* void module_register */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -61,6 +61,15 @@ struct data_definition_s
 };
 typedef struct data_definition_s data_definition_t;
 
+struct csnmp_engine_s;
+typedef struct csnmp_engine_s csnmp_engine_t;
+
+struct csnmp_walk_s;
+typedef struct csnmp_walk_s csnmp_walk_t;
+
+struct csnmp_instance_cache_s;
+typedef struct csnmp_instance_cache_s csnmp_instance_cache_t;
+
 struct host_definition_s
 {
   char *name;
@@ -72,6 +81,31 @@ struct host_definition_s
   cdtime_t interval;
   data_definition_t **data_list;
   int data_list_len;
+  /* Tables are walked with GETBULK requests of this many repetitions. Zero
+   * selects GETNEXT, which is always used with SNMPv1. */
+  int max_repetitions;
+  /* Maximum number of requests per second sent to this host, or zero. */
+  double rate_limit;
+  /* The instances of tables are only walked this often, zero walks them on
+   * every read. `instance_cache' has one entry per `data_list' entry. */
+  cdtime_t instance_refresh;
+  csnmp_instance_cache_t *instance_cache;
+  int index;
+
+  /* State of the asynchronous engine. `busy' and `queue_next' are protected
+   * by the engine's lock, everything else is only used by the engine's
+   * thread. */
+  csnmp_engine_t *engine;
+  _Bool busy;
+  struct host_definition_s *queue_next;
+  struct host_definition_s *active_next;
+  int data_index;
+  csnmp_walk_t *walk;
+  int success;
+  _Bool waiting;
+  _Bool failed;
+  cdtime_t poll_start;
+  cdtime_t next_send;
 };
 typedef struct host_definition_s host_definition_t;
 
@@ -93,19 +127,83 @@ struct csnmp_table_values_s
 };
 typedef struct csnmp_table_values_s csnmp_table_values_t;
 
+/* The instances of a table read by a previous walk. */
+struct csnmp_instance_cache_s
+{
+  csnmp_list_instances_t *head;
+  cdtime_t last_update;
+};
+
+/* State of a table walk, kept between the requests. */
+struct csnmp_walk_s
+{
+  host_definition_t *host;
+  data_definition_t *data;
+  const data_set_t *ds;
+  /* Where the instances are kept between reads, or NULL. */
+  csnmp_instance_cache_t *cache;
+  /* Whether the instance column is walked, too. */
+  _Bool walk_instance;
+
+  /* The OIDs to request next. */
+  oid_t *oid_list;
+  uint32_t oid_list_len;
+
+  /* `value_list_head' and `value_list_tail' implement a linked list for each
+   * value. `instance_list_head' and `instance_list_tail' implement a linked
+   * list of instance names. This is used to jump gaps in the table. */
+  csnmp_list_instances_t *instance_list_head;
+  csnmp_list_instances_t *instance_list_tail;
+  csnmp_table_values_t **value_list_head;
+  csnmp_table_values_t **value_list_tail;
+};
+
+/*
+ * The asynchronous engine: Each engine thread multiplexes the sessions of a
+ * share of the hosts with select(2). The hosts' read callbacks only queue a
+ * poll and wake up the thread via `pipe_fd'. Each host has at most one
+ * request outstanding; requests to different hosts are sent in parallel.
+ */
+struct csnmp_engine_s
+{
+  pthread_t thread;
+  _Bool thread_running;
+  pthread_mutex_t lock;
+  int pipe_fd[2];
+  host_definition_t *queue_head;
+  host_definition_t *queue_tail;
+  _Bool shutdown;
+};
+
 /*
  * Private variables
  */
 static data_definition_t *data_head = NULL;
 
+static int hosts_num = 0;
+
+static csnmp_engine_t *engines = NULL;
+static int engines_num = 0;
+
 /*
  * Prototypes
  */
 static int csnmp_read_host (user_data_t *ud);
+static void csnmp_engines_stop (void);
 
 /*
  * Private functions
  */
+static void csnmp_instance_list_free (csnmp_list_instances_t *il) /* {{{ */
+{
+  while (il != NULL)
+  {
+    csnmp_list_instances_t *next = il->next;
+    sfree (il);
+    il = next;
+  }
+} /* }}} void csnmp_instance_list_free */
+
 static void csnmp_oid_init (oid_t *dst, oid const *src, size_t n)
 {
   assert (n <= STATIC_ARRAY_SIZE (dst->oid));
@@ -178,8 +276,22 @@ static void csnmp_host_definition_destroy (void *arg) /* {{{ */
         hd->name);
   }
 
+  /* The read functions are destroyed before the shutdown callback is
+   * called, so the engine threads using this host have to be stopped
+   * here. */
+  csnmp_engines_stop ();
+
   csnmp_host_close_session (hd);
 
+  if (hd->instance_cache != NULL)
+  {
+    int i;
+
+    for (i = 0; i < hd->data_list_len; i++)
+      csnmp_instance_list_free (hd->instance_cache[i].head);
+    sfree (hd->instance_cache);
+  }
+
   sfree (hd->name);
   sfree (hd->address);
   sfree (hd->community);
@@ -207,6 +319,9 @@ static void csnmp_host_definition_destroy (void *arg) /* {{{ */
  *      +-> csnmp_config_add_host_community
  *      +-> csnmp_config_add_host_version
  *      +-> csnmp_config_add_host_collect
+ *      +-> csnmp_config_add_host_max_repetitions
+ *      +-> csnmp_config_add_host_rate_limit
+ *      +-> csnmp_config_add_host_instance_refresh
  */
 static void call_snmp_init_once (void)
 {
@@ -590,6 +705,66 @@ static int csnmp_config_add_host_collect (host_definition_t *host,
   return (0);
 } /* int csnmp_config_add_host_collect */
 
+static int csnmp_config_add_host_max_repetitions (host_definition_t *hd,
+    oconfig_item_t *ci)
+{
+  int tmp = 0;
+  int status;
+
+  status = cf_util_get_int (ci, &tmp);
+  if (status != 0)
+    return (status);
+
+  if (tmp < 0)
+  {
+    WARNING ("snmp plugin: `MaxRepetitions' must not be negative.");
+    return (-1);
+  }
+
+  hd->max_repetitions = tmp;
+  return (0);
+} /* int csnmp_config_add_host_max_repetitions */
+
+static int csnmp_config_add_host_rate_limit (host_definition_t *hd,
+    oconfig_item_t *ci)
+{
+  double tmp = 0.0;
+  int status;
+
+  status = cf_util_get_double (ci, &tmp);
+  if (status != 0)
+    return (status);
+
+  if (tmp < 0.0)
+  {
+    WARNING ("snmp plugin: `RateLimit' must not be negative.");
+    return (-1);
+  }
+
+  hd->rate_limit = tmp;
+  return (0);
+} /* int csnmp_config_add_host_rate_limit */
+
+static int csnmp_config_add_host_instance_refresh (host_definition_t *hd,
+    oconfig_item_t *ci)
+{
+  double tmp = 0.0;
+  int status;
+
+  status = cf_util_get_double (ci, &tmp);
+  if (status != 0)
+    return (status);
+
+  if (tmp < 0.0)
+  {
+    WARNING ("snmp plugin: `InstanceRefreshInterval' must not be negative.");
+    return (-1);
+  }
+
+  hd->instance_refresh = DOUBLE_TO_CDTIME_T (tmp);
+  return (0);
+} /* int csnmp_config_add_host_instance_refresh */
+
 static int csnmp_config_add_host (oconfig_item_t *ci)
 {
   host_definition_t *hd;
@@ -612,6 +787,7 @@ static int csnmp_config_add_host (oconfig_item_t *ci)
     return (-1);
   memset (hd, '\0', sizeof (host_definition_t));
   hd->version = 2;
+  hd->max_repetitions = 10;
   C_COMPLAIN_INIT (&hd->complaint);
 
   hd->name = strdup (ci->values[0].value.string);
@@ -639,6 +815,12 @@ static int csnmp_config_add_host (oconfig_item_t *ci)
       csnmp_config_add_host_collect (hd, option);
     else if (strcasecmp ("Interval", option->key) == 0)
       cf_util_get_cdtime (option, &hd->interval);
+    else if (strcasecmp ("MaxRepetitions", option->key) == 0)
+      status = csnmp_config_add_host_max_repetitions (hd, option);
+    else if (strcasecmp ("RateLimit", option->key) == 0)
+      status = csnmp_config_add_host_rate_limit (hd, option);
+    else if (strcasecmp ("InstanceRefreshInterval", option->key) == 0)
+      status = csnmp_config_add_host_instance_refresh (hd, option);
     else
     {
       WARNING ("snmp plugin: csnmp_config_add_host: Option `%s' not allowed here.", option->key);
@@ -664,6 +846,18 @@ static int csnmp_config_add_host (oconfig_item_t *ci)
       break;
     }
 
+    if ((hd->instance_refresh > 0) && (hd->data_list_len > 0))
+    {
+      hd->instance_cache = calloc ((size_t) hd->data_list_len,
+          sizeof (*hd->instance_cache));
+      if (hd->instance_cache == NULL)
+      {
+        ERROR ("snmp plugin: calloc failed.");
+        status = -1;
+        break;
+      }
+    }
+
     break;
   } /* while (status == 0) */
 
@@ -676,6 +870,9 @@ static int csnmp_config_add_host (oconfig_item_t *ci)
   DEBUG ("snmp plugin: hd = { name = %s, address = %s, community = %s, version = %i }",
       hd->name, hd->address, hd->community, hd->version);
 
+  hd->index = hosts_num;
+  hosts_num++;
+
   ssnprintf (cb_name, sizeof (cb_name), "snmp-%s", hd->name);
 
   memset (&cb_data, 0, sizeof (cb_data));
@@ -710,6 +907,19 @@ static int csnmp_config (oconfig_item_t *ci)
       csnmp_config_add_data (child);
     else if (strcasecmp ("Host", child->key) == 0)
       csnmp_config_add_host (child);
+    else if (strcasecmp ("AsyncThreads", child->key) == 0)
+    {
+      int tmp = 0;
+
+      if (cf_util_get_int (child, &tmp) != 0)
+        continue;
+      if (tmp < 0)
+      {
+        WARNING ("snmp plugin: `AsyncThreads' must not be negative.");
+        continue;
+      }
+      engines_num = tmp;
+    }
     else
     {
       WARNING ("snmp plugin: Ignoring unknown config option `%s'.", child->key);
@@ -897,24 +1107,25 @@ static value_t csnmp_value_list_to_value (struct variable_list *vl, int type,
 } /* value_t csnmp_value_list_to_value */
 
 /* Returns true if all OIDs have left their subtree */
+/* Checks one row of variables, starting at `row'. With GETNEXT this is the
+ * entire response, with GETBULK one repetition. */
 static int csnmp_check_res_left_subtree (const host_definition_t *host,
-    const data_definition_t *data,
-    struct snmp_pdu *res)
+    const data_definition_t *data, _Bool with_instance,
+    struct variable_list *row)
 {
   struct variable_list *vb;
   int num_checked;
   int num_left_subtree;
   int i;
 
-  vb = res->variables;
-  if (vb == NULL)
+  if (row == NULL)
     return (-1);
 
   num_checked = 0;
   num_left_subtree = 0;
 
   /* check all the variables and count how many have left their subtree */
-  for (vb = res->variables, i = 0;
+  for (vb = row, i = 0;
       (vb != NULL) && (i < data->values_len);
       vb = vb->next_variable, i++)
   {
@@ -936,7 +1147,7 @@ static int csnmp_check_res_left_subtree (const host_definition_t *host,
     return (-1);
   }
 
-  if (data->instance.oid.oid_len > 0)
+  if (with_instance)
   {
     if (vb == NULL)
     {
@@ -1027,21 +1238,16 @@ static int csnmp_strvbcopy (char *dst, /* {{{ */
   return ((int) vb->val_len);
 } /* }}} int csnmp_strvbcopy */
 
+/* `vb' is the variable holding the instance, the last one of a row. */
 static int csnmp_instance_list_add (csnmp_list_instances_t **head,
     csnmp_list_instances_t **tail,
-    const struct snmp_pdu *res,
+    struct variable_list *vb,
     const host_definition_t *hd, const data_definition_t *dd)
 {
   csnmp_list_instances_t *il;
-  struct variable_list *vb;
   oid_t vb_name;
   int status;
 
-  /* Set vb on the last variable */
-  for (vb = res->variables;
-      (vb != NULL) && (vb->next_variable != NULL);
-      vb = vb->next_variable)
-    /* do nothing */;
   if (vb == NULL)
     return (-1);
 
@@ -1257,279 +1463,342 @@ static int csnmp_dispatch_table (host_definition_t *host, data_definition_t *dat
   return (0);
 } /* int csnmp_dispatch_table */
 
-static int csnmp_read_table (host_definition_t *host, data_definition_t *data)
+static void csnmp_walk_destroy (csnmp_walk_t *walk) /* {{{ */
 {
-  struct snmp_pdu *req;
-  struct snmp_pdu *res;
-  struct variable_list *vb;
-
-  const data_set_t *ds;
-  oid_t *oid_list;
-  uint32_t oid_list_len;
-
-  int status;
   int i;
 
-  /* `value_list_head' and `value_list_tail' implement a linked list for each
-   * value. `instance_list_head' and `instance_list_tail' implement a linked list of
-   * instance names. This is used to jump gaps in the table. */
-  csnmp_list_instances_t *instance_list_head;
-  csnmp_list_instances_t *instance_list_tail;
-  csnmp_table_values_t **value_list_head;
-  csnmp_table_values_t **value_list_tail;
+  if (walk == NULL)
+    return;
 
-  DEBUG ("snmp plugin: csnmp_read_table (host = %s, data = %s)",
-      host->name, data->name);
+  /* Free all allocated variables here */
+  csnmp_instance_list_free (walk->instance_list_head);
 
-  if (host->sess_handle == NULL)
+  if (walk->value_list_head != NULL)
   {
-    DEBUG ("snmp plugin: csnmp_read_table: host->sess_handle == NULL");
-    return (-1);
+    for (i = 0; i < walk->data->values_len; i++)
+    {
+      while (walk->value_list_head[i] != NULL)
+      {
+        csnmp_table_values_t *next = walk->value_list_head[i]->next;
+        sfree (walk->value_list_head[i]);
+        walk->value_list_head[i] = next;
+      }
+    }
   }
 
+  sfree (walk->value_list_head);
+  sfree (walk->value_list_tail);
+  sfree (walk->oid_list);
+  sfree (walk);
+} /* }}} void csnmp_walk_destroy */
+
+/* `cache' is where the instances of this table are kept between reads, or
+ * NULL. */
+static csnmp_walk_t *csnmp_walk_create (host_definition_t *host, /* {{{ */
+    data_definition_t *data, csnmp_instance_cache_t *cache)
+{
+  csnmp_walk_t *walk;
+  const data_set_t *ds;
+
   ds = plugin_get_ds (data->type);
   if (!ds)
   {
     ERROR ("snmp plugin: DataSet `%s' not defined.", data->type);
-    return (-1);
+    return (NULL);
   }
 
   if (ds->ds_num != data->values_len)
   {
     ERROR ("snmp plugin: DataSet `%s' requires %i values, but config talks about %i",
         data->type, ds->ds_num, data->values_len);
-    return (-1);
+    return (NULL);
   }
 
-  /* We need a copy of all the OIDs, because GETNEXT will destroy them. */
-  oid_list_len = data->values_len + 1;
-  oid_list = (oid_t *) malloc (sizeof (oid_t) * (oid_list_len));
-  if (oid_list == NULL)
+  walk = calloc (1, sizeof (*walk));
+  if (walk == NULL)
   {
-    ERROR ("snmp plugin: csnmp_read_table: malloc failed.");
-    return (-1);
+    ERROR ("snmp plugin: csnmp_walk_create: calloc failed.");
+    return (NULL);
   }
-  memcpy (oid_list, data->values, data->values_len * sizeof (oid_t));
-  if (data->instance.oid.oid_len > 0)
-    memcpy (oid_list + data->values_len, &data->instance.oid, sizeof (oid_t));
-  else
-    oid_list_len--;
+  walk->host = host;
+  walk->data = data;
+  walk->ds = ds;
+  walk->cache = cache;
+
+  /* The instance column is skipped while the cached one is fresh enough. */
+  walk->walk_instance = (data->instance.oid.oid_len > 0);
+  if (walk->walk_instance && (cache != NULL) && (cache->head != NULL)
+      && ((cdtime () - cache->last_update) < host->instance_refresh))
+    walk->walk_instance = 0;
+
+  /* We need a copy of all the OIDs, because GETNEXT will destroy them. */
+  walk->oid_list_len = data->values_len + 1;
+  walk->oid_list = (oid_t *) malloc (sizeof (oid_t) * (walk->oid_list_len));
 
   /* We're going to construct n linked lists, one for each "value".
    * value_list_head will contain pointers to the heads of these linked lists,
    * value_list_tail will contain pointers to the tail of the lists. */
-  value_list_head = calloc (data->values_len, sizeof (*value_list_head));
-  value_list_tail = calloc (data->values_len, sizeof (*value_list_tail));
-  if ((value_list_head == NULL) || (value_list_tail == NULL))
-  {
-    ERROR ("snmp plugin: csnmp_read_table: calloc failed.");
-    sfree (oid_list);
-    sfree (value_list_head);
-    sfree (value_list_tail);
-    return (-1);
+  walk->value_list_head = calloc (data->values_len,
+      sizeof (*walk->value_list_head));
+  walk->value_list_tail = calloc (data->values_len,
+      sizeof (*walk->value_list_tail));
+
+  if ((walk->oid_list == NULL) || (walk->value_list_head == NULL)
+      || (walk->value_list_tail == NULL))
+  {
+    ERROR ("snmp plugin: csnmp_walk_create: malloc failed.");
+    csnmp_walk_destroy (walk);
+    return (NULL);
   }
 
-  instance_list_head = NULL;
-  instance_list_tail = NULL;
+  memcpy (walk->oid_list, data->values, data->values_len * sizeof (oid_t));
+  if (walk->walk_instance)
+    memcpy (walk->oid_list + data->values_len, &data->instance.oid,
+        sizeof (oid_t));
+  else
+    walk->oid_list_len--;
 
-  status = 0;
-  while (status == 0)
+  return (walk);
+} /* }}} csnmp_walk_t *csnmp_walk_create */
+
+/* Creates the next request of a table walk: GETBULK with SNMPv2c, unless
+ * disabled, and GETNEXT otherwise. */
+static struct snmp_pdu *csnmp_walk_request (csnmp_walk_t *walk) /* {{{ */
+{
+  struct snmp_pdu *req;
+  uint32_t i;
+
+  if ((walk->host->version != 1) && (walk->host->max_repetitions > 0))
   {
-    req = snmp_pdu_create (SNMP_MSG_GETNEXT);
-    if (req == NULL)
+    req = snmp_pdu_create (SNMP_MSG_GETBULK);
+    if (req != NULL)
     {
-      ERROR ("snmp plugin: snmp_pdu_create failed.");
-      status = -1;
-      break;
+      req->non_repeaters = 0;
+      req->max_repetitions = walk->host->max_repetitions;
     }
+  }
+  else
+    req = snmp_pdu_create (SNMP_MSG_GETNEXT);
 
-    for (i = 0; (uint32_t) i < oid_list_len; i++)
-      snmp_add_null_var (req, oid_list[i].oid, oid_list[i].oid_len);
+  if (req == NULL)
+  {
+    ERROR ("snmp plugin: snmp_pdu_create failed.");
+    return (NULL);
+  }
 
-    res = NULL;
-    status = snmp_sess_synch_response (host->sess_handle, req, &res);
+  for (i = 0; i < walk->oid_list_len; i++)
+    snmp_add_null_var (req, walk->oid_list[i].oid, walk->oid_list[i].oid_len);
 
-    if ((status != STAT_SUCCESS) || (res == NULL))
-    {
-      char *errstr = NULL;
+  return (req);
+} /* }}} struct snmp_pdu *csnmp_walk_request */
 
-      snmp_sess_error (host->sess_handle, NULL, NULL, &errstr);
+/* Handles one row of a response, i.e. `oid_list_len' variables starting at
+ * `row'. */
+static int csnmp_walk_process_row (csnmp_walk_t *walk, /* {{{ */
+    struct variable_list *row)
+{
+  host_definition_t *host = walk->host;
+  data_definition_t *data = walk->data;
+  struct variable_list *vb;
+  int status = 0;
+  int i;
 
-      c_complain (LOG_ERR, &host->complaint,
-          "snmp plugin: host %s: snmp_sess_synch_response failed: %s",
-          host->name, (errstr == NULL) ? "Unknown problem" : errstr);
+  /* Copy the OID of the value used as instance to oid_list, if the instance
+   * column is walked. */
+  if (walk->walk_instance)
+  {
+    /* The instance OID is added to the list of OIDs to GET from the
+     * snmp agent last, so set vb on the last variable of the row and copy
+     * that OID. */
+    for (vb = row, i = 0;
+        (vb != NULL) && (i < data->values_len);
+        vb = vb->next_variable, i++)
+      /* do nothing */;
+    assert (vb != NULL);
 
-      if (res != NULL)
-        snmp_free_pdu (res);
-      res = NULL;
+    /* Allocate a new `csnmp_list_instances_t', insert the instance name and
+     * add it to the list */
+    if (csnmp_instance_list_add (&walk->instance_list_head,
+          &walk->instance_list_tail, vb, host, data) != 0)
+    {
+      ERROR ("snmp plugin: csnmp_instance_list_add failed.");
+      return (-1);
+    }
 
-      sfree (errstr);
-      csnmp_host_close_session (host);
+    /* Copy the OID of the instance value to oid_list[data->values_len].
+     * "oid_list" is used for the next GETNEXT request. */
+    memcpy (walk->oid_list[data->values_len].oid, vb->name,
+        sizeof (oid) * vb->name_length);
+    walk->oid_list[data->values_len].oid_len = vb->name_length;
+  }
 
-      status = -1;
-      break;
-    }
-    status = 0;
-    assert (res != NULL);
-    c_release (LOG_INFO, &host->complaint,
-        "snmp plugin: host %s: snmp_sess_synch_response successful.",
-        host->name);
+  /* Iterate over all the (non-instance) values returned by the agent. The
+   * (i < value_len) check will make sure we're not handling the instance OID
+   * twice. */
+  for (vb = row, i = 0;
+      (vb != NULL) && (i < data->values_len);
+      vb = vb->next_variable, i++)
+  {
+    csnmp_table_values_t *vt;
+    oid_t vb_name;
+    oid_t suffix;
 
-    vb = res->variables;
-    if (vb == NULL)
-    {
-      status = -1;
-      break;
-    }
+    csnmp_oid_init (&vb_name, vb->name, vb->name_length);
 
-    /* Check if all values (and possibly the instance) have left their
-     * subtree */
-    if (csnmp_check_res_left_subtree (host, data, res) != 0)
+    /* Calculate the current suffix. This is later used to check that the
+     * suffix is increasing. This also checks if we left the subtree */
+    status = csnmp_oid_suffix (&suffix, &vb_name, data->values + i);
+    if (status != 0)
     {
+      DEBUG ("snmp plugin: host = %s; data = %s; Value %i failed. "
+          "It probably left its subtree.",
+          host->name, data->name, i);
       status = 0;
-      break;
+      continue;
     }
 
-    /* Copy the OID of the value used as instance to oid_list, if an instance
-     * is configured. */
-    if (data->instance.oid.oid_len > 0)
+    /* Make sure the OIDs returned by the agent are increasing. Otherwise our
+     * table matching algorithm will get confused. */
+    if ((walk->value_list_tail[i] != NULL)
+        && (csnmp_oid_compare (&suffix, &walk->value_list_tail[i]->suffix) <= 0))
     {
-      /* Allocate a new `csnmp_list_instances_t', insert the instance name and
-       * add it to the list */
-      if (csnmp_instance_list_add (&instance_list_head, &instance_list_tail,
-	    res, host, data) != 0)
-      {
-        ERROR ("snmp plugin: csnmp_instance_list_add failed.");
-        status = -1;
-        break;
-      }
-
-      /* The instance OID is added to the list of OIDs to GET from the
-       * snmp agent last, so set vb on the last variable returned and copy
-       * that OID. */
-      for (vb = res->variables;
-          (vb != NULL) && (vb->next_variable != NULL);
-          vb = vb->next_variable)
-        /* do nothing */;
-      assert (vb != NULL);
-
-      /* Copy the OID of the instance value to oid_list[data->values_len].
-       * "oid_list" is used for the next GETNEXT request. */
-      memcpy (oid_list[data->values_len].oid, vb->name,
-          sizeof (oid) * vb->name_length);
-      oid_list[data->values_len].oid_len = vb->name_length;
+      DEBUG ("snmp plugin: host = %s; data = %s; i = %i; "
+          "Suffix is not increasing.",
+          host->name, data->name, i);
+      continue;
     }
 
-    /* Iterate over all the (non-instance) values returned by the agent. The
-     * (i < value_len) check will make sure we're not handling the instance OID
-     * twice. */
-    for (vb = res->variables, i = 0;
-        (vb != NULL) && (i < data->values_len);
-        vb = vb->next_variable, i++)
+    vt = malloc (sizeof (*vt));
+    if (vt == NULL)
     {
-      csnmp_table_values_t *vt;
-      oid_t vb_name;
-      oid_t suffix;
+      ERROR ("snmp plugin: malloc failed.");
+      return (-1);
+    }
+    memset (vt, 0, sizeof (*vt));
 
-      csnmp_oid_init (&vb_name, vb->name, vb->name_length);
+    vt->value = csnmp_value_list_to_value (vb, walk->ds->ds[i].type,
+        data->scale, data->shift, host->name, data->name);
+    memcpy (&vt->suffix, &suffix, sizeof (vt->suffix));
+    vt->next = NULL;
 
-      /* Calculate the current suffix. This is later used to check that the
-       * suffix is increasing. This also checks if we left the subtree */
-      status = csnmp_oid_suffix (&suffix, &vb_name, data->values + i);
-      if (status != 0)
-      {
-        DEBUG ("snmp plugin: host = %s; data = %s; Value %i failed. "
-            "It probably left its subtree.",
-            host->name, data->name, i);
-        continue;
-      }
+    if (walk->value_list_tail[i] == NULL)
+      walk->value_list_head[i] = vt;
+    else
+      walk->value_list_tail[i]->next = vt;
+    walk->value_list_tail[i] = vt;
 
-      /* Make sure the OIDs returned by the agent are increasing. Otherwise our
-       * table matching algorithm will get confused. */
-      if ((value_list_tail[i] != NULL)
-          && (csnmp_oid_compare (&suffix, &value_list_tail[i]->suffix) <= 0))
-      {
-        DEBUG ("snmp plugin: host = %s; data = %s; i = %i; "
-            "Suffix is not increasing.",
-            host->name, data->name, i);
-        continue;
-      }
+    /* Copy OID to oid_list[i + 1] */
+    memcpy (walk->oid_list[i].oid, vb->name, sizeof (oid) * vb->name_length);
+    walk->oid_list[i].oid_len = vb->name_length;
+  } /* for (i = data->values_len) */
 
-      vt = malloc (sizeof (*vt));
-      if (vt == NULL)
-      {
-        ERROR ("snmp plugin: malloc failed.");
-        status = -1;
-        break;
-      }
-      memset (vt, 0, sizeof (*vt));
+  return (status);
+} /* }}} int csnmp_walk_process_row */
 
-      vt->value = csnmp_value_list_to_value (vb, ds->ds[i].type,
-          data->scale, data->shift, host->name, data->name);
-      memcpy (&vt->suffix, &suffix, sizeof (vt->suffix));
-      vt->next = NULL;
+/* Handles a response of a table walk. Returns zero if another request is
+ * needed, greater than zero when all values have left their subtree and less
+ * than zero on error. */
+static int csnmp_walk_process (csnmp_walk_t *walk, /* {{{ */
+    struct snmp_pdu *res)
+{
+  struct variable_list *row;
+  int rows_num = 0;
 
-      if (value_list_tail[i] == NULL)
-        value_list_head[i] = vt;
-      else
-        value_list_tail[i]->next = vt;
-      value_list_tail[i] = vt;
+  row = res->variables;
+  if (row == NULL)
+    return (-1);
 
-      /* Copy OID to oid_list[i + 1] */
-      memcpy (oid_list[i].oid, vb->name, sizeof (oid) * vb->name_length);
-      oid_list[i].oid_len = vb->name_length;
-    } /* for (i = data->values_len) */
+  while (row != NULL)
+  {
+    struct variable_list *next;
+    uint32_t i;
+    int status;
 
-    if (res != NULL)
-      snmp_free_pdu (res);
-    res = NULL;
-  } /* while (status == 0) */
+    /* Find the start of the next row. An agent may cut a GETBULK response
+     * short; an incomplete row is requested again. */
+    for (next = row, i = 0; (next != NULL) && (i < walk->oid_list_len); i++)
+      next = next->next_variable;
+    if ((i < walk->oid_list_len) && (rows_num > 0))
+      break;
 
-  if (res != NULL)
-    snmp_free_pdu (res);
-  res = NULL;
+    /* Check if all values (and possibly the instance) have left their
+     * subtree */
+    if (csnmp_check_res_left_subtree (walk->host, walk->data,
+          walk->walk_instance, row) != 0)
+      return (1);
 
-  if (status == 0)
-    csnmp_dispatch_table (host, data, instance_list_head, value_list_head);
+    status = csnmp_walk_process_row (walk, row);
+    if (status != 0)
+      return (-1);
 
-  /* Free all allocated variables here */
-  while (instance_list_head != NULL)
+    rows_num++;
+    row = next;
+  }
+
+  return (0);
+} /* }}} int csnmp_walk_process */
+
+/* Returns true if there is an instance for every row of `vt'. Both lists are
+ * sorted by suffix. */
+static _Bool csnmp_instance_list_covers ( /* {{{ */
+    const csnmp_list_instances_t *il, const csnmp_table_values_t *vt)
+{
+  for (; vt != NULL; vt = vt->next)
   {
-    csnmp_list_instances_t *next = instance_list_head->next;
-    sfree (instance_list_head);
-    instance_list_head = next;
+    while ((il != NULL) && (csnmp_oid_compare (&il->suffix, &vt->suffix) < 0))
+      il = il->next;
+
+    if ((il == NULL) || (csnmp_oid_compare (&il->suffix, &vt->suffix) != 0))
+      return (0);
   }
 
-  for (i = 0; i < data->values_len; i++)
+  return (1);
+} /* }}} _Bool csnmp_instance_list_covers */
+
+/* Dispatches the table read by a complete walk and updates the cached
+ * instances. */
+static int csnmp_walk_dispatch (csnmp_walk_t *walk) /* {{{ */
+{
+  csnmp_instance_cache_t *cache = walk->cache;
+  csnmp_list_instances_t *instances = walk->instance_list_head;
+
+  if ((cache != NULL) && (walk->data->instance.oid.oid_len > 0))
   {
-    while (value_list_head[i] != NULL)
+    if (walk->walk_instance)
     {
-      csnmp_table_values_t *next = value_list_head[i]->next;
-      sfree (value_list_head[i]);
-      value_list_head[i] = next;
+      csnmp_instance_list_free (cache->head);
+      cache->head = walk->instance_list_head;
+      cache->last_update = cdtime ();
+      walk->instance_list_head = NULL;
+      walk->instance_list_tail = NULL;
+    }
+    else if (!csnmp_instance_list_covers (cache->head,
+          walk->value_list_head[0]))
+    {
+      /* Rows without a cached instance are skipped; the instances are
+       * walked again by the next read. */
+      DEBUG ("snmp plugin: host = %s; data = %s; Unknown index found, "
+          "refreshing the instances.",
+          walk->host->name, walk->data->name);
+      cache->last_update = 0;
     }
-  }
 
-  sfree (value_list_head);
-  sfree (value_list_tail);
-  sfree (oid_list);
+    instances = cache->head;
+  }
 
-  return (0);
-} /* int csnmp_read_table */
+  return (csnmp_dispatch_table (walk->host, walk->data, instances,
+        walk->value_list_head));
+} /* }}} int csnmp_walk_dispatch */
 
-static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
+static int csnmp_read_table (host_definition_t *host, data_definition_t *data,
+    csnmp_instance_cache_t *cache)
 {
+  csnmp_walk_t *walk;
   struct snmp_pdu *req;
   struct snmp_pdu *res;
-  struct variable_list *vb;
-
-  const data_set_t *ds;
-  value_list_t vl = VALUE_LIST_INIT;
-
   int status;
-  int i;
 
-  DEBUG ("snmp plugin: csnmp_read_value (host = %s, data = %s)",
+  DEBUG ("snmp plugin: csnmp_read_table (host = %s, data = %s)",
       host->name, data->name);
 
   if (host->sess_handle == NULL)
@@ -1538,6 +1807,93 @@ static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
     return (-1);
   }
 
+  walk = csnmp_walk_create (host, data, cache);
+  if (walk == NULL)
+    return (-1);
+
+  status = 0;
+  while (status == 0)
+  {
+    req = csnmp_walk_request (walk);
+    if (req == NULL)
+    {
+      status = -1;
+      break;
+    }
+
+    res = NULL;
+    status = snmp_sess_synch_response (host->sess_handle, req, &res);
+
+    if ((status != STAT_SUCCESS) || (res == NULL))
+    {
+      char *errstr = NULL;
+
+      snmp_sess_error (host->sess_handle, NULL, NULL, &errstr);
+
+      c_complain (LOG_ERR, &host->complaint,
+          "snmp plugin: host %s: snmp_sess_synch_response failed: %s",
+          host->name, (errstr == NULL) ? "Unknown problem" : errstr);
+
+      if (res != NULL)
+        snmp_free_pdu (res);
+      res = NULL;
+
+      sfree (errstr);
+      csnmp_host_close_session (host);
+
+      status = -1;
+      break;
+    }
+    c_release (LOG_INFO, &host->complaint,
+        "snmp plugin: host %s: snmp_sess_synch_response successful.",
+        host->name);
+
+    status = csnmp_walk_process (walk, res);
+
+    snmp_free_pdu (res);
+    res = NULL;
+  } /* while (status == 0) */
+
+  if (status > 0)
+    csnmp_walk_dispatch (walk);
+
+  csnmp_walk_destroy (walk);
+
+  return (0);
+} /* int csnmp_read_table */
+
+static struct snmp_pdu *csnmp_value_request (host_definition_t *host,
+    data_definition_t *data)
+{
+  struct snmp_pdu *req;
+  int i;
+
+  DEBUG ("snmp plugin: csnmp_read_value (host = %s, data = %s)",
+      host->name, data->name);
+
+  req = snmp_pdu_create (SNMP_MSG_GET);
+  if (req == NULL)
+  {
+    ERROR ("snmp plugin: snmp_pdu_create failed.");
+    return (NULL);
+  }
+
+  for (i = 0; i < data->values_len; i++)
+    snmp_add_null_var (req, data->values[i].oid, data->values[i].oid_len);
+
+  return (req);
+} /* struct snmp_pdu *csnmp_value_request */
+
+static int csnmp_value_process (host_definition_t *host,
+    data_definition_t *data, struct snmp_pdu *res)
+{
+  struct variable_list *vb;
+
+  const data_set_t *ds;
+  value_list_t vl = VALUE_LIST_INIT;
+
+  int i;
+
   ds = plugin_get_ds (data->type);
   if (!ds)
   {
@@ -1571,16 +1927,44 @@ static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
 
   vl.interval = host->interval;
 
-  req = snmp_pdu_create (SNMP_MSG_GET);
-  if (req == NULL)
+  for (vb = res->variables; vb != NULL; vb = vb->next_variable)
   {
-    ERROR ("snmp plugin: snmp_pdu_create failed.");
-    sfree (vl.values);
+#if COLLECT_DEBUG
+    char buffer[1024];
+    snprint_variable (buffer, sizeof (buffer),
+        vb->name, vb->name_length, vb);
+    DEBUG ("snmp plugin: Got this variable: %s", buffer);
+#endif /* COLLECT_DEBUG */
+
+    for (i = 0; i < data->values_len; i++)
+      if (snmp_oid_compare (data->values[i].oid, data->values[i].oid_len,
+            vb->name, vb->name_length) == 0)
+        vl.values[i] = csnmp_value_list_to_value (vb, ds->ds[i].type,
+            data->scale, data->shift, host->name, data->name);
+  } /* for (res->variables) */
+
+  DEBUG ("snmp plugin: -> plugin_dispatch_values (&vl);");
+  plugin_dispatch_values (&vl);
+  sfree (vl.values);
+
+  return (0);
+} /* int csnmp_value_process */
+
+static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
+{
+  struct snmp_pdu *req;
+  struct snmp_pdu *res;
+  int status;
+
+  if (host->sess_handle == NULL)
+  {
+    DEBUG ("snmp plugin: csnmp_read_table: host->sess_handle == NULL");
     return (-1);
   }
 
-  for (i = 0; i < data->values_len; i++)
-    snmp_add_null_var (req, data->values[i].oid, data->values[i].oid_len);
+  req = csnmp_value_request (host, data);
+  if (req == NULL)
+    return (-1);
 
   res = NULL;
   status = snmp_sess_synch_response (host->sess_handle, req, &res);
@@ -1603,33 +1987,456 @@ static int csnmp_read_value (host_definition_t *host, data_definition_t *data)
     return (-1);
   }
 
+  status = csnmp_value_process (host, data, res);
+  snmp_free_pdu (res);
 
-  for (vb = res->variables; vb != NULL; vb = vb->next_variable)
+  return (status);
+} /* int csnmp_read_value */
+
+/* Asynchronous engine {{{ */
+static void csnmp_poll_finish (host_definition_t *host)
+{
+  cdtime_t time_end = cdtime ();
+
+  csnmp_walk_destroy (host->walk);
+  host->walk = NULL;
+
+  if ((time_end - host->poll_start) > host->interval)
   {
-#if COLLECT_DEBUG
-    char buffer[1024];
-    snprint_variable (buffer, sizeof (buffer),
-        vb->name, vb->name_length, vb);
-    DEBUG ("snmp plugin: Got this variable: %s", buffer);
-#endif /* COLLECT_DEBUG */
+    WARNING ("snmp plugin: Host `%s' should be queried every %.3f "
+	"seconds, but reading all values takes %.3f seconds.",
+	host->name,
+	CDTIME_T_TO_DOUBLE (host->interval),
+	CDTIME_T_TO_DOUBLE (time_end - host->poll_start));
+  }
 
-    for (i = 0; i < data->values_len; i++)
-      if (snmp_oid_compare (data->values[i].oid, data->values[i].oid_len,
-            vb->name, vb->name_length) == 0)
-        vl.values[i] = csnmp_value_list_to_value (vb, ds->ds[i].type,
-            data->scale, data->shift, host->name, data->name);
-  } /* for (res->variables) */
+  if (host->success == 0)
+    DEBUG ("snmp plugin: host %s: No data was read successfully.",
+        host->name);
+} /* void csnmp_poll_finish */
 
-  if (res != NULL)
-    snmp_free_pdu (res);
-  res = NULL;
+static int csnmp_async_callback (int operation,
+    struct snmp_session __attribute__((unused)) *sess,
+    int __attribute__((unused)) reqid,
+    struct snmp_pdu *res, void *magic)
+{
+  host_definition_t *host = magic;
+  data_definition_t *data;
+  int status;
 
-  DEBUG ("snmp plugin: -> plugin_dispatch_values (&vl);");
-  plugin_dispatch_values (&vl);
-  sfree (vl.values);
+  host->waiting = 0;
+
+  if ((operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) || (res == NULL))
+  {
+    c_complain (LOG_ERR, &host->complaint,
+        "snmp plugin: host %s: %s", host->name,
+        (operation == NETSNMP_CALLBACK_OP_TIMED_OUT)
+        ? "Request timed out." : "Request failed.");
+    host->failed = 1;
+    return (1);
+  }
+
+  c_release (LOG_INFO, &host->complaint,
+      "snmp plugin: host %s: Request successful.", host->name);
+
+  data = host->data_list[host->data_index];
+  if (data->is_table)
+  {
+    status = csnmp_walk_process (host->walk, res);
+    if (status == 0)
+      return (1);
+
+    if (status > 0)
+    {
+      csnmp_walk_dispatch (host->walk);
+      host->success++;
+    }
+
+    csnmp_walk_destroy (host->walk);
+    host->walk = NULL;
+  }
+  else
+  {
+    if (csnmp_value_process (host, data, res) == 0)
+      host->success++;
+  }
+
+  host->data_index++;
+  return (1);
+} /* int csnmp_async_callback */
+
+/* Sends the next request of a poll. Returns zero if a request was sent,
+ * greater than zero if the poll is complete and less than zero on error. */
+static int csnmp_poll_send (host_definition_t *host)
+{
+  while (host->data_index < host->data_list_len)
+  {
+    data_definition_t *data = host->data_list[host->data_index];
+    struct snmp_pdu *req;
+
+    if (data->is_table)
+    {
+      if (host->walk == NULL)
+        host->walk = csnmp_walk_create (host, data,
+            (host->instance_cache != NULL)
+            ? host->instance_cache + host->data_index : NULL);
+      if (host->walk == NULL)
+      {
+        host->data_index++;
+        continue;
+      }
+      req = csnmp_walk_request (host->walk);
+    }
+    else
+      req = csnmp_value_request (host, data);
+
+    if (req == NULL)
+      return (-1);
+
+    if (snmp_sess_async_send (host->sess_handle, req,
+          csnmp_async_callback, host) == 0)
+    {
+      char *errstr = NULL;
+
+      snmp_sess_error (host->sess_handle, NULL, NULL, &errstr);
+      c_complain (LOG_ERR, &host->complaint,
+          "snmp plugin: host %s: snmp_sess_async_send failed: %s",
+          host->name, (errstr == NULL) ? "Unknown problem" : errstr);
+      sfree (errstr);
+      snmp_free_pdu (req);
+      return (-1);
+    }
+
+    host->waiting = 1;
+    return (0);
+  }
+
+  return (1);
+} /* int csnmp_poll_send */
+
+static void *csnmp_engine_thread (void *arg)
+{
+  csnmp_engine_t *engine = arg;
+  host_definition_t *active = NULL;
+  netsnmp_large_fd_set fdset;
+
+  netsnmp_large_fd_set_init (&fdset, FD_SETSIZE);
+
+  while (42)
+  {
+    host_definition_t *host;
+    host_definition_t **host_ptr;
+    struct timeval timeout;
+    cdtime_t now;
+    cdtime_t wakeup = 0;
+    int numfds;
+    int block = 1;
+    char buffer[64];
+    int status;
+
+    /* Start the polls requested by the read callbacks. */
+    pthread_mutex_lock (&engine->lock);
+    if (engine->shutdown)
+    {
+      pthread_mutex_unlock (&engine->lock);
+      break;
+    }
+    while (engine->queue_head != NULL)
+    {
+      host = engine->queue_head;
+      engine->queue_head = host->queue_next;
+      host->queue_next = NULL;
+
+      host->active_next = active;
+      active = host;
+    }
+    engine->queue_tail = NULL;
+    pthread_mutex_unlock (&engine->lock);
+
+    now = cdtime ();
+
+    /* Send the next request of every host that is ready, and remove
+     * completed polls. */
+    host_ptr = &active;
+    while ((host = *host_ptr) != NULL)
+    {
+      if (host->failed)
+      {
+        csnmp_host_close_session (host);
+        host->data_index = host->data_list_len;
+      }
+
+      if (!host->waiting && (host->data_index < host->data_list_len)
+          && (host->next_send > now))
+      {
+        if ((wakeup == 0) || (host->next_send < wakeup))
+          wakeup = host->next_send;
+        host_ptr = &host->active_next;
+        continue;
+      }
+
+      if (!host->waiting && (host->data_index < host->data_list_len))
+      {
+        status = csnmp_poll_send (host);
+        if (status < 0)
+        {
+          csnmp_host_close_session (host);
+          host->data_index = host->data_list_len;
+        }
+        else if ((status == 0) && (host->rate_limit > 0.0))
+          host->next_send = now
+            + DOUBLE_TO_CDTIME_T (1.0 / host->rate_limit);
+      }
+
+      if (!host->waiting)
+      {
+        *host_ptr = host->active_next;
+        host->active_next = NULL;
+        csnmp_poll_finish (host);
+
+        pthread_mutex_lock (&engine->lock);
+        host->busy = 0;
+        pthread_mutex_unlock (&engine->lock);
+        continue;
+      }
+
+      host_ptr = &host->active_next;
+    }
+
+    /* Wait for responses, time outs, rate limits and new polls. */
+    numfds = engine->pipe_fd[0] + 1;
+    NETSNMP_LARGE_FD_ZERO (&fdset);
+    netsnmp_large_fd_setfd (engine->pipe_fd[0], &fdset);
+
+    memset (&timeout, 0, sizeof (timeout));
+    for (host = active; host != NULL; host = host->active_next)
+    {
+      struct timeval host_timeout;
+      int host_block = 1;
+
+      memset (&host_timeout, 0, sizeof (host_timeout));
+      snmp_sess_select_info2 (host->sess_handle, &numfds, &fdset,
+          &host_timeout, &host_block);
+      if (!host_block && (block || timercmp (&host_timeout, &timeout, <)))
+      {
+        timeout = host_timeout;
+        block = 0;
+      }
+    }
+
+    if (wakeup != 0)
+    {
+      struct timeval wakeup_tv;
+
+      now = cdtime ();
+      CDTIME_T_TO_TIMEVAL ((wakeup > now) ? (wakeup - now) : 0, &wakeup_tv);
+      if (block || timercmp (&wakeup_tv, &timeout, <))
+      {
+        timeout = wakeup_tv;
+        block = 0;
+      }
+    }
+
+    status = netsnmp_large_fd_set_select (numfds, &fdset, NULL, NULL,
+        block ? NULL : &timeout);
+    if (status < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+      ERROR ("snmp plugin: select failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    if (netsnmp_large_fd_is_set (engine->pipe_fd[0], &fdset))
+      while (read (engine->pipe_fd[0], buffer, sizeof (buffer)) > 0)
+        /* drain */;
+
+    for (host = active; host != NULL; host = host->active_next)
+    {
+      if (status > 0)
+        snmp_sess_read2 (host->sess_handle, &fdset);
+      if (host->waiting)
+        snmp_sess_timeout (host->sess_handle);
+    }
+  } /* while (42) */
+
+  /* Abort the polls in progress. */
+  while (active != NULL)
+  {
+    host_definition_t *host = active;
+
+    active = host->active_next;
+    host->active_next = NULL;
+
+    csnmp_walk_destroy (host->walk);
+    host->walk = NULL;
+    csnmp_host_close_session (host);
+
+    pthread_mutex_lock (&engine->lock);
+    host->busy = 0;
+    pthread_mutex_unlock (&engine->lock);
+  }
+
+  netsnmp_large_fd_set_cleanup (&fdset);
+
+  return ((void *) 0);
+} /* void *csnmp_engine_thread */
+
+/* Queues a poll of all of the host's data. Returns immediately. */
+static int csnmp_poll_queue (host_definition_t *host)
+{
+  csnmp_engine_t *engine = host->engine;
+
+  pthread_mutex_lock (&engine->lock);
+  if (host->busy)
+  {
+    pthread_mutex_unlock (&engine->lock);
+    WARNING ("snmp plugin: Host `%s' should be queried every %.3f "
+        "seconds, but the previous query is still running. Skipping "
+        "this interval.", host->name, CDTIME_T_TO_DOUBLE (host->interval));
+    return (-1);
+  }
+  host->busy = 1;
+  pthread_mutex_unlock (&engine->lock);
+
+  /* The engine's thread doesn't touch the host until it is queued, so the
+   * session can be opened without holding the lock. */
+  if (host->sess_handle == NULL)
+    csnmp_host_open_session (host);
+
+  pthread_mutex_lock (&engine->lock);
+  if (host->sess_handle == NULL)
+  {
+    host->busy = 0;
+    pthread_mutex_unlock (&engine->lock);
+    return (-1);
+  }
+
+  host->data_index = 0;
+  host->success = 0;
+  host->waiting = 0;
+  host->failed = 0;
+  host->next_send = 0;
+  host->poll_start = cdtime ();
+
+  if (engine->queue_tail == NULL)
+    engine->queue_head = host;
+  else
+    engine->queue_tail->queue_next = host;
+  engine->queue_tail = host;
+  pthread_mutex_unlock (&engine->lock);
+
+  /* Wake up the engine's thread. */
+  if (write (engine->pipe_fd[1], "", 1) < 0)
+  {
+    char errbuf[1024];
+    if (errno != EAGAIN)
+      ERROR ("snmp plugin: write(2) to the engine's pipe failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+  }
 
   return (0);
-} /* int csnmp_read_value */
+} /* int csnmp_poll_queue */
+
+static int csnmp_engines_start (void)
+{
+  int i;
+
+  if ((engines_num <= 0) || (engines != NULL))
+    return (0);
+
+  engines = calloc (engines_num, sizeof (*engines));
+  if (engines == NULL)
+  {
+    ERROR ("snmp plugin: calloc failed.");
+    engines_num = 0;
+    return (-1);
+  }
+
+  for (i = 0; i < engines_num; i++)
+  {
+    csnmp_engine_t *engine = engines + i;
+    int status;
+
+    pthread_mutex_init (&engine->lock, /* attr = */ NULL);
+    engine->pipe_fd[0] = -1;
+    engine->pipe_fd[1] = -1;
+
+    if (pipe (engine->pipe_fd) != 0)
+    {
+      char errbuf[1024];
+      ERROR ("snmp plugin: pipe(2) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+    fcntl (engine->pipe_fd[0], F_SETFL,
+        fcntl (engine->pipe_fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl (engine->pipe_fd[1], F_SETFL,
+        fcntl (engine->pipe_fd[1], F_GETFL) | O_NONBLOCK);
+
+    status = plugin_thread_create (&engine->thread, /* attr = */ NULL,
+        csnmp_engine_thread, engine);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("snmp plugin: pthread_create failed: %s",
+          sstrerror (status, errbuf, sizeof (errbuf)));
+      break;
+    }
+    engine->thread_running = 1;
+  }
+
+  if (i < engines_num)
+  {
+    csnmp_engines_stop ();
+    return (-1);
+  }
+
+  INFO ("snmp plugin: Started %i engine thread%s for %i host%s.",
+      engines_num, (engines_num == 1) ? "" : "s",
+      hosts_num, (hosts_num == 1) ? "" : "s");
+
+  return (0);
+} /* int csnmp_engines_start */
+
+static void csnmp_engines_stop (void)
+{
+  int i;
+
+  if (engines == NULL)
+    return;
+
+  for (i = 0; i < engines_num; i++)
+  {
+    csnmp_engine_t *engine = engines + i;
+
+    if (engine->thread_running)
+    {
+      pthread_mutex_lock (&engine->lock);
+      engine->shutdown = 1;
+      pthread_mutex_unlock (&engine->lock);
+
+      if (write (engine->pipe_fd[1], "", 1) < 0)
+        /* the thread will notice anyway */;
+
+      pthread_join (engine->thread, /* retval = */ NULL);
+      engine->thread_running = 0;
+    }
+
+    if (engine->pipe_fd[0] >= 0)
+      close (engine->pipe_fd[0]);
+    if (engine->pipe_fd[1] >= 0)
+      close (engine->pipe_fd[1]);
+    pthread_mutex_destroy (&engine->lock);
+  }
+
+  sfree (engines);
+  engines_num = 0;
+} /* void csnmp_engines_stop */
+/* }}} Asynchronous engine */
 
 static int csnmp_read_host (user_data_t *ud)
 {
@@ -1645,6 +2452,12 @@ static int csnmp_read_host (user_data_t *ud)
   if (host->interval == 0)
     host->interval = plugin_get_interval ();
 
+  if (engines != NULL)
+  {
+    host->engine = engines + (host->index % engines_num);
+    return (csnmp_poll_queue (host));
+  }
+
   time_start = cdtime ();
 
   if (host->sess_handle == NULL)
@@ -1659,7 +2472,8 @@ static int csnmp_read_host (user_data_t *ud)
     data_definition_t *data = host->data_list[i];
 
     if (data->is_table)
-      status = csnmp_read_table (host, data);
+      status = csnmp_read_table (host, data,
+          (host->instance_cache != NULL) ? host->instance_cache + i : NULL);
     else
       status = csnmp_read_value (host, data);
 
@@ -1687,7 +2501,7 @@ static int csnmp_init (void)
 {
   call_snmp_init_once ();
 
-  return (0);
+  return (csnmp_engines_start ());
 } /* int csnmp_init */
 
 static int csnmp_shutdown (void)
@@ -1697,6 +2511,8 @@ static int csnmp_shutdown (void)
 
   /* When we get here, the read threads have been stopped and all the
    * `host_definition_t' will be freed. */
+  csnmp_engines_stop ();
+
   DEBUG ("snmp plugin: Destroying all data definitions.");
 
   data_this = data_head;
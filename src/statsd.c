@@ -0,0 +1,1492 @@
+/**
+ * collectd - src/statsd.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#define _GNU_SOURCE /* For recvmmsg() */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_histogram.h"
+#include "utils_htable.h"
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+/*
+ * Receives metrics in the statsd line protocol, "<name>:<value>|<type>", and
+ * dispatches their aggregates once per interval. Each receive thread
+ * aggregates into its own shard, so the threads never wait for each other;
+ * the read callback merges the shards into the global state and dispatches
+ * all metrics with one call to plugin_dispatch_values_multi().
+ */
+
+#define STATSD_DEFAULT_SERVICE "8125"
+
+/* Longer packets and lines are cut off. */
+#define STATSD_PACKET_SIZE 8192
+
+/* Maximum number of TCP connections handled at the same time. */
+#define STATSD_TCP_CONNECTIONS_MAX 256
+
+enum metric_type_e
+{
+  STATSD_COUNTER,
+  STATSD_TIMER,
+  STATSD_GAUGE,
+  STATSD_SET
+};
+typedef enum metric_type_e metric_type_t;
+
+/* Keys are the type's letter, a colon and the name, e.g. "c:requests". */
+#define STATSD_KEY_SIZE (DATA_MAX_NAME_LEN + 2)
+
+/* What one shard received for one metric since the last read. */
+struct statsd_shard_metric_s /* {{{ */
+{
+  char key[STATSD_KEY_SIZE];
+  metric_type_t type;
+  _Bool updated;
+
+  /* Counters: the sum of the increments. Gauges: the sum of the changes
+   * after the last absolute value. */
+  gauge_t value;
+  /* Gauges only. */
+  _Bool have_absolute;
+  gauge_t absolute;
+
+  /* Timers only. "count" is a gauge because of sample rates. */
+  histogram_t *histogram;
+  gauge_t count;
+  gauge_t sum;
+  gauge_t min;
+  gauge_t max;
+
+  /* Sets only. Keys are the members, values are unused. */
+  c_htable_t *members;
+}; /* }}} */
+typedef struct statsd_shard_metric_s statsd_shard_metric_t;
+
+struct statsd_shard_s /* {{{ */
+{
+  pthread_mutex_t lock;
+  c_htable_t *metrics;
+}; /* }}} */
+typedef struct statsd_shard_s statsd_shard_t;
+
+/* The merged state of one metric, kept across reads. */
+struct statsd_metric_s /* {{{ */
+{
+  char key[STATSD_KEY_SIZE];
+  metric_type_t type;
+  /* Set if the metric was received since the last read. */
+  _Bool updated;
+
+  /* Counters: the total, dispatched as a derive. Gauges: the value. */
+  gauge_t value;
+  /* Counters: the increments since the last read. */
+  gauge_t interval_sum;
+
+  /* Timers: the values since the last read. */
+  histogram_t *histogram;
+  gauge_t count;
+  gauge_t sum;
+  gauge_t min;
+  gauge_t max;
+
+  /* Sets: the members since the last read. */
+  c_htable_t *members;
+}; /* }}} */
+typedef struct statsd_metric_s statsd_metric_t;
+
+/* A receive thread reads from "fds" and aggregates into "shard". */
+struct statsd_thread_s /* {{{ */
+{
+  pthread_t id;
+  _Bool running;
+  statsd_shard_t shard;
+
+  int *fds;
+  size_t fds_num;
+  /* Set for the TCP thread, which polls the listening sockets in "fds". */
+  _Bool tcp;
+}; /* }}} */
+typedef struct statsd_thread_s statsd_thread_t;
+
+struct statsd_tcp_conn_s /* {{{ */
+{
+  int fd;
+  char buffer[STATSD_PACKET_SIZE];
+  size_t fill;
+}; /* }}} */
+typedef struct statsd_tcp_conn_s statsd_tcp_conn_t;
+
+/*
+ * Configuration
+ */
+static char *conf_node = NULL;
+static char *conf_service = NULL;
+static _Bool conf_tcp = 0;
+static int conf_receive_threads = 1;
+#if HAVE_RECVMMSG
+static int conf_batch_size = 32;
+#else
+static int conf_batch_size = 1;
+#endif
+
+static _Bool conf_delete_counters = 0;
+static _Bool conf_delete_timers = 0;
+static _Bool conf_delete_gauges = 0;
+static _Bool conf_delete_sets = 0;
+
+static _Bool conf_counter_sum = 0;
+static _Bool conf_timer_lower = 0;
+static _Bool conf_timer_upper = 0;
+static _Bool conf_timer_sum = 0;
+static _Bool conf_timer_count = 0;
+static double *conf_timer_percentile = NULL;
+static size_t conf_timer_percentile_num = 0;
+
+/*
+ * State
+ */
+static statsd_thread_t *threads = NULL;
+static size_t threads_num = 0;
+static _Bool threads_quit = 0;
+
+/* Only used by the read callback. */
+static c_htable_t *metrics = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Metrics
+ */
+static void statsd_members_destroy (c_htable_t *members) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  if (members == NULL)
+    return;
+
+  while (c_htable_pick (members, &key, &value) == 0)
+    sfree (key);
+  c_htable_destroy (members);
+} /* }}} void statsd_members_destroy */
+
+/* Adds a copy of "member" to "members" unless it is stored already. */
+static int statsd_members_add (c_htable_t *members, /* {{{ */
+    const char *member)
+{
+  char *copy;
+  int status;
+
+  if (members == NULL)
+    return (EINVAL);
+  if (c_htable_get (members, member, NULL) == 0)
+    return (0);
+
+  copy = strdup (member);
+  if (copy == NULL)
+    return (ENOMEM);
+
+  status = c_htable_insert (members, copy, /* value = */ NULL);
+  if (status != 0)
+    sfree (copy);
+  return (status);
+} /* }}} int statsd_members_add */
+
+static void statsd_shard_metric_destroy (statsd_shard_metric_t *sm) /* {{{ */
+{
+  if (sm == NULL)
+    return;
+
+  histogram_destroy (sm->histogram);
+  statsd_members_destroy (sm->members);
+  sfree (sm);
+} /* }}} void statsd_shard_metric_destroy */
+
+/* Resets the metric to "nothing received". The shard lock must be held. */
+static void statsd_shard_metric_reset (statsd_shard_metric_t *sm) /* {{{ */
+{
+  sm->updated = 0;
+  sm->value = 0.0;
+  sm->have_absolute = 0;
+  sm->absolute = NAN;
+
+  if (sm->histogram != NULL)
+    histogram_reset (sm->histogram);
+  sm->count = 0.0;
+  sm->sum = 0.0;
+  sm->min = NAN;
+  sm->max = NAN;
+
+  if ((sm->members != NULL) && (c_htable_size (sm->members) > 0))
+  {
+    statsd_members_destroy (sm->members);
+    sm->members = c_htable_create ();
+  }
+} /* }}} void statsd_shard_metric_reset */
+
+/* Returns the metric "key" of the shard, creating it if needed. The shard lock
+ * must be held. */
+static statsd_shard_metric_t *statsd_shard_metric_get ( /* {{{ */
+    statsd_shard_t *shard, const char *key, metric_type_t type)
+{
+  statsd_shard_metric_t *sm = NULL;
+
+  if (c_htable_get (shard->metrics, key, (void *) &sm) == 0)
+    return (sm);
+
+  sm = malloc (sizeof (*sm));
+  if (sm == NULL)
+  {
+    ERROR ("statsd plugin: malloc failed.");
+    return (NULL);
+  }
+  memset (sm, 0, sizeof (*sm));
+  sstrncpy (sm->key, key, sizeof (sm->key));
+  sm->type = type;
+
+  if (type == STATSD_TIMER)
+    sm->histogram = histogram_create ();
+  else if (type == STATSD_SET)
+    sm->members = c_htable_create ();
+  if (((type == STATSD_TIMER) && (sm->histogram == NULL))
+      || ((type == STATSD_SET) && (sm->members == NULL)))
+  {
+    ERROR ("statsd plugin: Allocating the state of \"%s\" failed.", key);
+    statsd_shard_metric_destroy (sm);
+    return (NULL);
+  }
+  statsd_shard_metric_reset (sm);
+
+  if (c_htable_insert (shard->metrics, sm->key, sm) != 0)
+  {
+    ERROR ("statsd plugin: c_htable_insert failed.");
+    statsd_shard_metric_destroy (sm);
+    return (NULL);
+  }
+
+  return (sm);
+} /* }}} statsd_shard_metric_t *statsd_shard_metric_get */
+
+static void statsd_metric_destroy (statsd_metric_t *m) /* {{{ */
+{
+  if (m == NULL)
+    return;
+
+  histogram_destroy (m->histogram);
+  statsd_members_destroy (m->members);
+  sfree (m);
+} /* }}} void statsd_metric_destroy */
+
+/* Returns the global metric of "sm", creating it if needed. "metrics_lock"
+ * must be held. */
+static statsd_metric_t *statsd_metric_get ( /* {{{ */
+    const statsd_shard_metric_t *sm)
+{
+  statsd_metric_t *m = NULL;
+
+  if (c_htable_get (metrics, sm->key, (void *) &m) == 0)
+    return (m);
+
+  m = malloc (sizeof (*m));
+  if (m == NULL)
+  {
+    ERROR ("statsd plugin: malloc failed.");
+    return (NULL);
+  }
+  memset (m, 0, sizeof (*m));
+  sstrncpy (m->key, sm->key, sizeof (m->key));
+  m->type = sm->type;
+  m->value = (sm->type == STATSD_GAUGE) ? NAN : 0.0;
+  m->min = NAN;
+  m->max = NAN;
+
+  if (m->type == STATSD_TIMER)
+    m->histogram = histogram_create ();
+  else if (m->type == STATSD_SET)
+    m->members = c_htable_create ();
+  if (((m->type == STATSD_TIMER) && (m->histogram == NULL))
+      || ((m->type == STATSD_SET) && (m->members == NULL)))
+  {
+    ERROR ("statsd plugin: Allocating the state of \"%s\" failed.", m->key);
+    statsd_metric_destroy (m);
+    return (NULL);
+  }
+
+  if (c_htable_insert (metrics, m->key, m) != 0)
+  {
+    ERROR ("statsd plugin: c_htable_insert failed.");
+    statsd_metric_destroy (m);
+    return (NULL);
+  }
+
+  return (m);
+} /* }}} statsd_metric_t *statsd_metric_get */
+
+/* Adds what "sm" received to its global metric. Both "metrics_lock" and the
+ * shard lock must be held. */
+static void statsd_metric_merge (statsd_shard_metric_t *sm) /* {{{ */
+{
+  statsd_metric_t *m;
+
+  m = statsd_metric_get (sm);
+  if (m == NULL)
+    return;
+
+  m->updated = 1;
+
+  switch (sm->type)
+  {
+    case STATSD_COUNTER:
+      m->value += sm->value;
+      m->interval_sum += sm->value;
+      break;
+
+    case STATSD_GAUGE:
+      /* The order of the values received by different threads is
+       * unknown, so absolute values of one shard may override changes
+       * received by another one. */
+      if (sm->have_absolute)
+        m->value = sm->absolute + sm->value;
+      else if (isnan (m->value))
+        m->value = sm->value;
+      else
+        m->value += sm->value;
+      break;
+
+    case STATSD_TIMER:
+      histogram_merge (m->histogram, sm->histogram);
+      m->count += sm->count;
+      m->sum += sm->sum;
+      if (!isnan (sm->min) && (isnan (m->min) || (m->min > sm->min)))
+        m->min = sm->min;
+      if (!isnan (sm->max) && (isnan (m->max) || (m->max < sm->max)))
+        m->max = sm->max;
+      break;
+
+    case STATSD_SET:
+    {
+      c_htable_iterator_t *iter;
+      char *member;
+      void *unused;
+
+      iter = c_htable_get_iterator (sm->members);
+      while ((iter != NULL)
+          && (c_htable_iterator_next (iter, (void *) &member, &unused) == 0))
+        statsd_members_add (m->members, member);
+      c_htable_iterator_destroy (iter);
+      break;
+    }
+  }
+} /* }}} void statsd_metric_merge */
+
+/* Merges and resets all metrics of "shard". Metrics not received since the
+ * last read are removed, so shards don't keep metrics which are gone. */
+static void statsd_shard_merge (statsd_shard_t *shard) /* {{{ */
+{
+  c_htable_iterator_t *iter;
+  statsd_shard_metric_t **idle = NULL;
+  size_t idle_num = 0;
+  char *key;
+  statsd_shard_metric_t *sm;
+  size_t i;
+
+  pthread_mutex_lock (&shard->lock);
+
+  iter = c_htable_get_iterator (shard->metrics);
+  while ((iter != NULL)
+      && (c_htable_iterator_next (iter, (void *) &key, (void *) &sm) == 0))
+  {
+    statsd_shard_metric_t **tmp;
+
+    if (sm->updated)
+    {
+      statsd_metric_merge (sm);
+      statsd_shard_metric_reset (sm);
+      continue;
+    }
+
+    tmp = realloc (idle, (idle_num + 1) * sizeof (*idle));
+    if (tmp == NULL)
+      continue;
+    idle = tmp;
+    idle[idle_num] = sm;
+    idle_num++;
+  }
+  c_htable_iterator_destroy (iter);
+
+  for (i = 0; i < idle_num; i++)
+  {
+    c_htable_remove (shard->metrics, idle[i]->key, NULL, NULL);
+    statsd_shard_metric_destroy (idle[i]);
+  }
+  sfree (idle);
+
+  pthread_mutex_unlock (&shard->lock);
+} /* }}} void statsd_shard_merge */
+
+/*
+ * Parsing
+ */
+static int statsd_parse_value (const char *str, gauge_t *ret) /* {{{ */
+{
+  char *endptr = NULL;
+
+  errno = 0;
+  *ret = (gauge_t) strtod (str, &endptr);
+  if ((errno != 0) || (endptr == str) || (*endptr != 0))
+    return (-1);
+  return (0);
+} /* }}} int statsd_parse_value */
+
+/* Handles one line, "<name>:<value>|<type>[|@<sample rate>]". The shard lock
+ * must be held. */
+static int statsd_handle_line (statsd_shard_t *shard, char *line) /* {{{ */
+{
+  char key[STATSD_KEY_SIZE];
+  char *name = line;
+  char *value_str;
+  char *type_str;
+  char *extra;
+  char *ptr;
+  metric_type_t type;
+  statsd_shard_metric_t *sm;
+  gauge_t value = NAN;
+  gauge_t rate = 1.0;
+
+  value_str = strchr (line, ':');
+  if (value_str == NULL)
+    return (-1);
+  *value_str = 0;
+  value_str++;
+
+  type_str = strchr (value_str, '|');
+  if (type_str == NULL)
+    return (-1);
+  *type_str = 0;
+  type_str++;
+
+  extra = strchr (type_str, '|');
+  if (extra != NULL)
+  {
+    *extra = 0;
+    extra++;
+
+    if ((extra[0] != '@') || (statsd_parse_value (extra + 1, &rate) != 0)
+        || (rate <= 0.0) || (rate > 1.0))
+      return (-1);
+  }
+
+  if ((name[0] == 0) || (value_str[0] == 0))
+    return (-1);
+
+  /* Slashes separate the parts of identifiers. */
+  for (ptr = name; *ptr != 0; ptr++)
+    if (*ptr == '/')
+      *ptr = '_';
+
+  if (strcmp ("c", type_str) == 0)
+    type = STATSD_COUNTER;
+  else if ((strcmp ("ms", type_str) == 0) || (strcmp ("h", type_str) == 0))
+    type = STATSD_TIMER;
+  else if (strcmp ("g", type_str) == 0)
+    type = STATSD_GAUGE;
+  else if (strcmp ("s", type_str) == 0)
+    type = STATSD_SET;
+  else
+    return (-1);
+
+  if ((type != STATSD_SET) && (statsd_parse_value (value_str, &value) != 0))
+    return (-1);
+
+  ssnprintf (key, sizeof (key), "%c:%s", type_str[0], name);
+
+  sm = statsd_shard_metric_get (shard, key, type);
+  if (sm == NULL)
+    return (-1);
+
+  switch (type)
+  {
+    case STATSD_COUNTER:
+      sm->value += value / rate;
+      break;
+
+    case STATSD_TIMER:
+      /* Timers are in milliseconds, latencies are dispatched in seconds. */
+      value /= 1000.0;
+      histogram_add (sm->histogram, value);
+      sm->count += 1.0 / rate;
+      sm->sum += value / rate;
+      if (isnan (sm->min) || (sm->min > value))
+        sm->min = value;
+      if (isnan (sm->max) || (sm->max < value))
+        sm->max = value;
+      break;
+
+    case STATSD_GAUGE:
+      if ((value_str[0] == '+') || (value_str[0] == '-'))
+        sm->value += value;
+      else
+      {
+        sm->have_absolute = 1;
+        sm->absolute = value;
+        sm->value = 0.0;
+      }
+      break;
+
+    case STATSD_SET:
+      if (statsd_members_add (sm->members, value_str) != 0)
+        return (-1);
+      break;
+  }
+
+  sm->updated = 1;
+  return (0);
+} /* }}} int statsd_handle_line */
+
+/* Handles all lines in "buffer". The shard lock must be held. */
+static void statsd_handle_buffer (statsd_shard_t *shard, /* {{{ */
+    char *buffer, size_t buffer_len)
+{
+  char *line = buffer;
+  char *end = buffer + buffer_len;
+
+  while (line < end)
+  {
+    char *next = memchr (line, '\n', (size_t) (end - line));
+    if (next == NULL)
+      next = end;
+    *next = 0;
+
+    if ((next > line) && (next[-1] == '\r'))
+      next[-1] = 0;
+
+    if ((line[0] != 0) && (statsd_handle_line (shard, line) != 0))
+    {
+      DEBUG ("statsd plugin: Ignoring invalid line \"%s\".", line);
+    }
+
+    line = next + 1;
+  }
+} /* }}} void statsd_handle_buffer */
+
+/*
+ * Receiving
+ */
+
+/* Reads up to "num" packets from "fd" into "buffers", each
+ * STATSD_PACKET_SIZE + 1 bytes long, and their lengths into "lengths".
+ * Returns the number of packets read, zero if there were none and less than
+ * zero on error. */
+static int statsd_receive_packets (int fd, /* {{{ */
+    char **buffers, size_t *lengths, size_t num)
+{
+#if HAVE_RECVMMSG
+  if (num > 1)
+  {
+    struct mmsghdr msgs[num];
+    struct iovec iovs[num];
+    size_t i;
+    int status;
+
+    memset (msgs, 0, sizeof (msgs));
+    for (i = 0; i < num; i++)
+    {
+      iovs[i].iov_base = buffers[i];
+      iovs[i].iov_len = STATSD_PACKET_SIZE;
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    status = recvmmsg (fd, msgs, (unsigned int) num,
+        MSG_DONTWAIT, /* timeout = */ NULL);
+    if (status > 0)
+    {
+      for (i = 0; i < ((size_t) status); i++)
+        lengths[i] = (size_t) msgs[i].msg_len;
+      return (status);
+    }
+  }
+  else
+#endif /* HAVE_RECVMMSG */
+  {
+    ssize_t len = recv (fd, buffers[0], STATSD_PACKET_SIZE, MSG_DONTWAIT);
+    if (len >= 0)
+    {
+      lengths[0] = (size_t) len;
+      return (1);
+    }
+  }
+
+  if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+    return (0);
+  return (-1);
+} /* }}} int statsd_receive_packets */
+
+static void *statsd_udp_thread (void *arg) /* {{{ */
+{
+  statsd_thread_t *t = arg;
+  struct pollfd pfds[t->fds_num];
+  char *buffers[conf_batch_size];
+  size_t lengths[conf_batch_size];
+  size_t batch_size = (size_t) conf_batch_size;
+  size_t i;
+
+  memset (pfds, 0, sizeof (pfds));
+  for (i = 0; i < t->fds_num; i++)
+  {
+    pfds[i].fd = t->fds[i];
+    pfds[i].events = POLLIN | POLLPRI;
+  }
+
+  memset (buffers, 0, sizeof (buffers));
+  for (i = 0; i < batch_size; i++)
+  {
+    /* One more byte for the terminating null byte. */
+    buffers[i] = malloc (STATSD_PACKET_SIZE + 1);
+    if (buffers[i] == NULL)
+    {
+      ERROR ("statsd plugin: malloc failed.");
+      batch_size = i;
+      break;
+    }
+  }
+
+  while (!threads_quit && (batch_size > 0))
+  {
+    int status;
+
+    status = poll (pfds, (nfds_t) t->fds_num, /* timeout = */ 1000);
+    if (status <= 0)
+    {
+      char errbuf[1024];
+
+      if ((status == 0) || (errno == EINTR))
+        continue;
+      ERROR ("statsd plugin: poll(2) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    for (i = 0; i < t->fds_num; i++)
+    {
+      size_t j;
+
+      if ((pfds[i].revents & (POLLIN | POLLPRI)) == 0)
+        continue;
+
+      status = statsd_receive_packets (pfds[i].fd, buffers, lengths,
+          batch_size);
+      if (status < 0)
+      {
+        char errbuf[1024];
+        ERROR ("statsd plugin: Receiving packets failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        continue;
+      }
+
+      /* The read callback only takes the lock briefly, so it is held for
+       * the whole batch. */
+      pthread_mutex_lock (&t->shard.lock);
+      for (j = 0; j < ((size_t) status); j++)
+      {
+        buffers[j][lengths[j]] = 0;
+        statsd_handle_buffer (&t->shard, buffers[j], lengths[j]);
+      }
+      pthread_mutex_unlock (&t->shard.lock);
+    }
+  }
+
+  for (i = 0; i < batch_size; i++)
+    sfree (buffers[i]);
+
+  return (NULL);
+} /* }}} void *statsd_udp_thread */
+
+/* Reads from the connection and handles all complete lines. Returns non-zero
+ * if the connection has been closed. */
+static int statsd_tcp_read (statsd_thread_t *t, /* {{{ */
+    statsd_tcp_conn_t *conn)
+{
+  ssize_t status;
+  char *end;
+
+  status = read (conn->fd, conn->buffer + conn->fill,
+      sizeof (conn->buffer) - conn->fill - 1);
+  if (status < 0)
+  {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+      return (0);
+    return (-1);
+  }
+  else if (status == 0)
+    return (-1);
+
+  conn->fill += (size_t) status;
+
+  end = NULL;
+  {
+    size_t i;
+    for (i = conn->fill; i > 0; i--)
+    {
+      if (conn->buffer[i - 1] == '\n')
+      {
+        end = conn->buffer + i;
+        break;
+      }
+    }
+  }
+
+  if (end == NULL)
+  {
+    /* No room left for the rest of the line: it is dropped. */
+    if (conn->fill >= (sizeof (conn->buffer) - 1))
+      conn->fill = 0;
+    return (0);
+  }
+
+  {
+    size_t len = (size_t) (end - conn->buffer);
+
+    pthread_mutex_lock (&t->shard.lock);
+    statsd_handle_buffer (&t->shard, conn->buffer, len);
+    pthread_mutex_unlock (&t->shard.lock);
+
+    conn->fill -= len;
+    memmove (conn->buffer, end, conn->fill);
+  }
+
+  return (0);
+} /* }}} int statsd_tcp_read */
+
+static void *statsd_tcp_thread (void *arg) /* {{{ */
+{
+  statsd_thread_t *t = arg;
+  struct pollfd pfds[t->fds_num + STATSD_TCP_CONNECTIONS_MAX];
+  statsd_tcp_conn_t *conns[STATSD_TCP_CONNECTIONS_MAX];
+  size_t conns_num = 0;
+  size_t i;
+
+  memset (conns, 0, sizeof (conns));
+
+  while (!threads_quit)
+  {
+    int status;
+
+    memset (pfds, 0, sizeof (pfds));
+    for (i = 0; i < t->fds_num; i++)
+    {
+      pfds[i].fd = t->fds[i];
+      pfds[i].events = POLLIN;
+    }
+    for (i = 0; i < conns_num; i++)
+    {
+      pfds[t->fds_num + i].fd = conns[i]->fd;
+      pfds[t->fds_num + i].events = POLLIN;
+    }
+
+    status = poll (pfds, (nfds_t) (t->fds_num + conns_num),
+        /* timeout = */ 1000);
+    if (status <= 0)
+    {
+      char errbuf[1024];
+
+      if ((status == 0) || (errno == EINTR))
+        continue;
+      ERROR ("statsd plugin: poll(2) failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    /* Connections are handled first, so that new ones can be appended. */
+    for (i = conns_num; i > 0; i--)
+    {
+      struct pollfd *pfd = pfds + t->fds_num + (i - 1);
+
+      if (pfd->revents == 0)
+        continue;
+
+      if (((pfd->revents & POLLIN) == 0)
+          || (statsd_tcp_read (t, conns[i - 1]) != 0))
+      {
+        close (conns[i - 1]->fd);
+        sfree (conns[i - 1]);
+        conns[i - 1] = conns[conns_num - 1];
+        conns[conns_num - 1] = NULL;
+        conns_num--;
+      }
+    }
+
+    for (i = 0; i < t->fds_num; i++)
+    {
+      int fd;
+
+      if ((pfds[i].revents & POLLIN) == 0)
+        continue;
+
+      fd = accept (pfds[i].fd, /* addr = */ NULL, /* addrlen = */ NULL);
+      if (fd < 0)
+        continue;
+
+      if (conns_num >= STATSD_TCP_CONNECTIONS_MAX)
+      {
+        WARNING ("statsd plugin: Too many TCP connections; "
+            "closing the new one.");
+        close (fd);
+        continue;
+      }
+
+      conns[conns_num] = calloc (1, sizeof (*conns[conns_num]));
+      if (conns[conns_num] == NULL)
+      {
+        ERROR ("statsd plugin: calloc failed.");
+        close (fd);
+        continue;
+      }
+      conns[conns_num]->fd = fd;
+      conns_num++;
+    }
+  }
+
+  for (i = 0; i < conns_num; i++)
+  {
+    close (conns[i]->fd);
+    sfree (conns[i]);
+  }
+
+  return (NULL);
+} /* }}} void *statsd_tcp_thread */
+
+/* Opens the sockets of "socktype" listening on the configured address, "num"
+ * per address, and appends them to "ret_fds". */
+static int statsd_open_sockets (int socktype, size_t num, /* {{{ */
+    int **ret_fds, size_t *ret_fds_num)
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  const char *service = (conf_service != NULL)
+    ? conf_service : STATSD_DEFAULT_SERVICE;
+  int status;
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+  ai_hints.ai_flags = 0;
+#ifdef AI_PASSIVE
+  ai_hints.ai_flags |= AI_PASSIVE;
+#endif
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = socktype;
+
+  status = getaddrinfo (conf_node, service, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    ERROR ("statsd plugin: getaddrinfo (%s, %s) failed: %s",
+        (conf_node == NULL) ? "(null)" : conf_node, service,
+        gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    size_t i;
+
+    for (i = 0; i < num; i++)
+    {
+      int *tmp;
+      int fd;
+      int yes = 1;
+
+      tmp = realloc (*ret_fds, (*ret_fds_num + 1) * sizeof (*tmp));
+      if (tmp == NULL)
+      {
+        ERROR ("statsd plugin: realloc failed.");
+        break;
+      }
+      *ret_fds = tmp;
+
+      /* Sockets handed over by the previous process are bound and set up
+       * already. */
+      fd = plugin_handoff_take (socktype, ai_ptr->ai_addr,
+          ai_ptr->ai_addrlen);
+      if (fd >= 0)
+      {
+        plugin_handoff_add (fd);
+        (*ret_fds)[*ret_fds_num] = fd;
+        (*ret_fds_num)++;
+        continue;
+      }
+
+      fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+          ai_ptr->ai_protocol);
+      if (fd < 0)
+      {
+        char errbuf[1024];
+        ERROR ("statsd plugin: socket(2) failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        break;
+      }
+
+      status = setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+#ifdef SO_REUSEPORT
+      /* Let the kernel spread the packets over the sockets of the receive
+       * threads. */
+      if ((status == 0) && (num > 1))
+        status = setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+            &yes, sizeof (yes));
+#endif
+      if (status == 0)
+        status = bind (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+      if ((status == 0) && (socktype == SOCK_STREAM))
+      {
+        int flags = fcntl (fd, F_GETFL);
+        status = ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK)))
+          ? -1 : listen (fd, /* backlog = */ 64);
+      }
+      if (status != 0)
+      {
+        char errbuf[1024];
+        ERROR ("statsd plugin: Setting up the socket failed: %s",
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        close (fd);
+        break;
+      }
+
+      plugin_handoff_add (fd);
+      (*ret_fds)[*ret_fds_num] = fd;
+      (*ret_fds_num)++;
+    }
+  }
+
+  freeaddrinfo (ai_list);
+
+  return ((*ret_fds_num > 0) ? 0 : -1);
+} /* }}} int statsd_open_sockets */
+
+static void statsd_stop_threads (void) /* {{{ */
+{
+  size_t i;
+
+  threads_quit = 1;
+  for (i = 0; i < threads_num; i++)
+  {
+    if (!threads[i].running)
+      continue;
+    pthread_join (threads[i].id, /* retval = */ NULL);
+    threads[i].running = 0;
+  }
+} /* }}} void statsd_stop_threads */
+
+/*
+ * Dispatching
+ */
+
+/* Appends one entry for "m" of the given type to the arrays. */
+static void statsd_entry_add (plugin_value_entry_t *entries, /* {{{ */
+    value_t *values, char (*type_instances)[DATA_MAX_NAME_LEN],
+    size_t *num, const char *type, const statsd_metric_t *m,
+    const char *suffix, value_t value)
+{
+  size_t i = *num;
+
+  if (suffix == NULL)
+    sstrncpy (type_instances[i], m->key + 2, DATA_MAX_NAME_LEN);
+  else
+    ssnprintf (type_instances[i], DATA_MAX_NAME_LEN, "%s-%s",
+        m->key + 2, suffix);
+
+  values[i] = value;
+  entries[i].type = type;
+  entries[i].type_instance = type_instances[i];
+  entries[i].values = values + i;
+  entries[i].values_len = 1;
+
+  *num = i + 1;
+} /* }}} void statsd_entry_add */
+
+/* Appends the entries of "m" and resets its per-interval state. "num" is the
+ * number of entries used so far. */
+static void statsd_metric_entries (statsd_metric_t *m, /* {{{ */
+    plugin_value_entry_t *entries, value_t *values,
+    char (*type_instances)[DATA_MAX_NAME_LEN], size_t *num)
+{
+  value_t v;
+  size_t i;
+
+#define ADD_GAUGE(type, suffix, g) do { \
+  v.gauge = (g); \
+  statsd_entry_add (entries, values, type_instances, num, \
+      type, m, suffix, v); \
+} while (0)
+
+  switch (m->type)
+  {
+    case STATSD_COUNTER:
+      v.derive = (derive_t) llround (m->value);
+      statsd_entry_add (entries, values, type_instances, num,
+          "derive", m, NULL, v);
+      if (conf_counter_sum)
+        ADD_GAUGE ("gauge", "sum", m->interval_sum);
+      m->interval_sum = 0.0;
+      break;
+
+    case STATSD_GAUGE:
+      ADD_GAUGE ("gauge", NULL, m->value);
+      break;
+
+    case STATSD_TIMER:
+      ADD_GAUGE ("latency", "average",
+          (m->count > 0.0) ? (m->sum / m->count) : NAN);
+      if (conf_timer_lower)
+        ADD_GAUGE ("latency", "lower", m->min);
+      if (conf_timer_upper)
+        ADD_GAUGE ("latency", "upper", m->max);
+      if (conf_timer_sum)
+        ADD_GAUGE ("latency", "sum", m->sum);
+      for (i = 0; i < conf_timer_percentile_num; i++)
+      {
+        char suffix[DATA_MAX_NAME_LEN];
+        ssnprintf (suffix, sizeof (suffix), "percentile-%.0f",
+            conf_timer_percentile[i]);
+        ADD_GAUGE ("latency", suffix,
+            histogram_percentile (m->histogram, conf_timer_percentile[i]));
+      }
+      if (conf_timer_count)
+        ADD_GAUGE ("gauge", "count", m->count);
+
+      histogram_reset (m->histogram);
+      m->count = 0.0;
+      m->sum = 0.0;
+      m->min = NAN;
+      m->max = NAN;
+      break;
+
+    case STATSD_SET:
+      ADD_GAUGE ("objects", NULL, (gauge_t) c_htable_size (m->members));
+      if (c_htable_size (m->members) > 0)
+      {
+        statsd_members_destroy (m->members);
+        m->members = c_htable_create ();
+        if (m->members == NULL)
+          ERROR ("statsd plugin: c_htable_create failed.");
+      }
+      break;
+  }
+
+#undef ADD_GAUGE
+} /* }}} void statsd_metric_entries */
+
+/* Returns non-zero if "m" wasn't received and is removed instead of being
+ * dispatched. */
+static _Bool statsd_metric_expired (const statsd_metric_t *m) /* {{{ */
+{
+  if (m->updated)
+    return (0);
+
+  switch (m->type)
+  {
+    case STATSD_COUNTER: return (conf_delete_counters);
+    case STATSD_TIMER:   return (conf_delete_timers);
+    case STATSD_GAUGE:   return (conf_delete_gauges);
+    case STATSD_SET:     return (conf_delete_sets || (m->members == NULL));
+  }
+
+  return (0);
+} /* }}} _Bool statsd_metric_expired */
+
+static int statsd_read (void) /* {{{ */
+{
+  value_list_t vl = VALUE_LIST_INIT;
+  c_htable_iterator_t *iter;
+  plugin_value_entry_t *entries;
+  value_t *values;
+  char (*type_instances)[DATA_MAX_NAME_LEN];
+  statsd_metric_t **expired = NULL;
+  size_t expired_num = 0;
+  size_t entries_max;
+  size_t num = 0;
+  char *key;
+  statsd_metric_t *m;
+  size_t i;
+
+  pthread_mutex_lock (&metrics_lock);
+
+  if (metrics == NULL)
+  {
+    pthread_mutex_unlock (&metrics_lock);
+    return (-1);
+  }
+
+  for (i = 0; i < threads_num; i++)
+    statsd_shard_merge (&threads[i].shard);
+
+  /* The most entries a metric has, see statsd_metric_entries(). */
+  entries_max = ((size_t) c_htable_size (metrics))
+    * (6 + conf_timer_percentile_num);
+  if (entries_max == 0)
+  {
+    pthread_mutex_unlock (&metrics_lock);
+    return (0);
+  }
+
+  entries = calloc (entries_max, sizeof (*entries));
+  values = calloc (entries_max, sizeof (*values));
+  type_instances = calloc (entries_max, sizeof (*type_instances));
+  if ((entries == NULL) || (values == NULL) || (type_instances == NULL))
+  {
+    ERROR ("statsd plugin: calloc failed.");
+    sfree (entries);
+    sfree (values);
+    sfree (type_instances);
+    pthread_mutex_unlock (&metrics_lock);
+    return (-1);
+  }
+
+  iter = c_htable_get_iterator (metrics);
+  while ((iter != NULL)
+      && (c_htable_iterator_next (iter, (void *) &key, (void *) &m) == 0))
+  {
+    if (statsd_metric_expired (m))
+    {
+      statsd_metric_t **tmp = realloc (expired,
+          (expired_num + 1) * sizeof (*expired));
+      if (tmp != NULL)
+      {
+        expired = tmp;
+        expired[expired_num] = m;
+        expired_num++;
+        continue;
+      }
+    }
+
+    statsd_metric_entries (m, entries, values, type_instances, &num);
+    m->updated = 0;
+  }
+  c_htable_iterator_destroy (iter);
+
+  for (i = 0; i < expired_num; i++)
+  {
+    c_htable_remove (metrics, expired[i]->key, NULL, NULL);
+    statsd_metric_destroy (expired[i]);
+  }
+  sfree (expired);
+
+  pthread_mutex_unlock (&metrics_lock);
+
+  vl.time = cdtime ();
+  sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+  sstrncpy (vl.plugin, "statsd", sizeof (vl.plugin));
+
+  plugin_dispatch_values_multi (&vl, entries, num);
+
+  sfree (entries);
+  sfree (values);
+  sfree (type_instances);
+
+  return (0);
+} /* }}} int statsd_read */
+
+/*
+ * Configuration and life cycle
+ */
+static int statsd_config_percentile (const oconfig_item_t *ci) /* {{{ */
+{
+  double percent = NAN;
+  double *tmp;
+  int status;
+
+  status = cf_util_get_double (ci, &percent);
+  if (status != 0)
+    return (status);
+
+  if ((percent <= 0.0) || (percent >= 100.0))
+  {
+    ERROR ("statsd plugin: The value for \"%s\" must be between 0 and 100, "
+        "exclusively.", ci->key);
+    return (ERANGE);
+  }
+
+  tmp = realloc (conf_timer_percentile,
+      (conf_timer_percentile_num + 1) * sizeof (*tmp));
+  if (tmp == NULL)
+  {
+    ERROR ("statsd plugin: realloc failed.");
+    return (ENOMEM);
+  }
+  conf_timer_percentile = tmp;
+  conf_timer_percentile[conf_timer_percentile_num] = percent;
+  conf_timer_percentile_num++;
+
+  return (0);
+} /* }}} int statsd_config_percentile */
+
+static int statsd_config (oconfig_item_t *ci) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Host", child->key) == 0)
+      cf_util_get_string (child, &conf_node);
+    else if (strcasecmp ("Port", child->key) == 0)
+      cf_util_get_service (child, &conf_service);
+    else if (strcasecmp ("TCP", child->key) == 0)
+      cf_util_get_boolean (child, &conf_tcp);
+    else if (strcasecmp ("ReceiveThreads", child->key) == 0)
+    {
+      int tmp = conf_receive_threads;
+      if ((cf_util_get_int (child, &tmp) == 0)
+          && ((tmp < 1) || (tmp > 64)))
+        WARNING ("statsd plugin: `ReceiveThreads' must be between 1 "
+            "and 64.");
+      else
+        conf_receive_threads = tmp;
+    }
+    else if (strcasecmp ("ReceiveBatchSize", child->key) == 0)
+    {
+      int tmp = conf_batch_size;
+      if ((cf_util_get_int (child, &tmp) == 0)
+          && ((tmp < 1) || (tmp > 1024)))
+        WARNING ("statsd plugin: `ReceiveBatchSize' must be between 1 "
+            "and 1024.");
+      else
+        conf_batch_size = tmp;
+    }
+    else if (strcasecmp ("DeleteCounters", child->key) == 0)
+      cf_util_get_boolean (child, &conf_delete_counters);
+    else if (strcasecmp ("DeleteTimers", child->key) == 0)
+      cf_util_get_boolean (child, &conf_delete_timers);
+    else if (strcasecmp ("DeleteGauges", child->key) == 0)
+      cf_util_get_boolean (child, &conf_delete_gauges);
+    else if (strcasecmp ("DeleteSets", child->key) == 0)
+      cf_util_get_boolean (child, &conf_delete_sets);
+    else if (strcasecmp ("CounterSum", child->key) == 0)
+      cf_util_get_boolean (child, &conf_counter_sum);
+    else if (strcasecmp ("TimerLower", child->key) == 0)
+      cf_util_get_boolean (child, &conf_timer_lower);
+    else if (strcasecmp ("TimerUpper", child->key) == 0)
+      cf_util_get_boolean (child, &conf_timer_upper);
+    else if (strcasecmp ("TimerSum", child->key) == 0)
+      cf_util_get_boolean (child, &conf_timer_sum);
+    else if (strcasecmp ("TimerCount", child->key) == 0)
+      cf_util_get_boolean (child, &conf_timer_count);
+    else if (strcasecmp ("TimerPercentile", child->key) == 0)
+      statsd_config_percentile (child);
+    else
+      ERROR ("statsd plugin: The \"%s\" config option is not valid.",
+          child->key);
+  }
+
+#if !HAVE_RECVMMSG
+  if (conf_batch_size > 1)
+  {
+    WARNING ("statsd plugin: recvmmsg(2) isn't available. Packets will be "
+        "read one by one.");
+    conf_batch_size = 1;
+  }
+#endif
+
+  return (0);
+} /* }}} int statsd_config */
+
+static int statsd_init (void) /* {{{ */
+{
+  int *udp_fds = NULL;
+  size_t udp_fds_num = 0;
+  size_t i;
+  int status;
+
+  pthread_mutex_lock (&metrics_lock);
+  if (metrics != NULL)
+  {
+    pthread_mutex_unlock (&metrics_lock);
+    return (0);
+  }
+
+  metrics = c_htable_create ();
+  if (metrics == NULL)
+  {
+    pthread_mutex_unlock (&metrics_lock);
+    ERROR ("statsd plugin: c_htable_create failed.");
+    return (-1);
+  }
+  pthread_mutex_unlock (&metrics_lock);
+
+  status = statsd_open_sockets (SOCK_DGRAM, (size_t) conf_receive_threads,
+      &udp_fds, &udp_fds_num);
+  if (status != 0)
+  {
+    ERROR ("statsd plugin: Opening the UDP sockets failed.");
+    sfree (udp_fds);
+    return (-1);
+  }
+  threads_num = (size_t) conf_receive_threads + (conf_tcp ? 1 : 0);
+  threads = calloc (threads_num, sizeof (*threads));
+  if (threads == NULL)
+  {
+    ERROR ("statsd plugin: calloc failed.");
+    for (i = 0; i < udp_fds_num; i++)
+      close (udp_fds[i]);
+    sfree (udp_fds);
+    threads_num = 0;
+    return (-1);
+  }
+
+  for (i = 0; i < threads_num; i++)
+  {
+    statsd_thread_t *t = threads + i;
+
+    pthread_mutex_init (&t->shard.lock, /* attr = */ NULL);
+    t->shard.metrics = c_htable_create ();
+    if (t->shard.metrics == NULL)
+    {
+      ERROR ("statsd plugin: c_htable_create failed.");
+      continue;
+    }
+
+    if (i < (size_t) conf_receive_threads)
+    {
+      size_t j;
+
+      /* "statsd_open_sockets" opens "conf_receive_threads" sockets per
+       * address, one after another, so each thread gets one socket of each
+       * address. */
+      t->fds = calloc (udp_fds_num, sizeof (*t->fds));
+      if (t->fds == NULL)
+      {
+        ERROR ("statsd plugin: calloc failed.");
+        continue;
+      }
+      for (j = i; j < udp_fds_num; j += (size_t) conf_receive_threads)
+      {
+        t->fds[t->fds_num] = udp_fds[j];
+        udp_fds[j] = -1;
+        t->fds_num++;
+      }
+      if (t->fds_num == 0)
+        continue;
+    }
+    else
+    {
+      t->tcp = 1;
+      if (statsd_open_sockets (SOCK_STREAM, /* num = */ 1,
+            &t->fds, &t->fds_num) != 0)
+      {
+        ERROR ("statsd plugin: Opening the TCP sockets failed.");
+        continue;
+      }
+    }
+
+    status = plugin_thread_create (&t->id, /* attr = */ NULL,
+        t->tcp ? statsd_tcp_thread : statsd_udp_thread, t);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("statsd plugin: pthread_create failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      continue;
+    }
+    t->running = 1;
+  }
+
+  /* Sockets no thread has taken. */
+  for (i = 0; i < udp_fds_num; i++)
+    if (udp_fds[i] >= 0)
+      close (udp_fds[i]);
+  sfree (udp_fds);
+  return (0);
+} /* }}} int statsd_init */
+
+/* Called on hitless restarts: the next process reads from the sockets now,
+ * so the values received so far are dispatched right away. */
+static int statsd_handoff (void) /* {{{ */
+{
+  statsd_stop_threads ();
+  return (statsd_read ());
+} /* }}} int statsd_handoff */
+
+static int statsd_shutdown (void) /* {{{ */
+{
+  void *key;
+  void *value;
+  size_t i;
+
+  statsd_stop_threads ();
+
+  for (i = 0; i < threads_num; i++)
+  {
+    statsd_thread_t *t = threads + i;
+    size_t j;
+
+    for (j = 0; j < t->fds_num; j++)
+      close (t->fds[j]);
+    sfree (t->fds);
+
+    if (t->shard.metrics != NULL)
+    {
+      while (c_htable_pick (t->shard.metrics, &key, &value) == 0)
+        statsd_shard_metric_destroy (value);
+      c_htable_destroy (t->shard.metrics);
+    }
+    pthread_mutex_destroy (&t->shard.lock);
+  }
+  sfree (threads);
+  threads_num = 0;
+
+  pthread_mutex_lock (&metrics_lock);
+  if (metrics != NULL)
+  {
+    while (c_htable_pick (metrics, &key, &value) == 0)
+      statsd_metric_destroy (value);
+    c_htable_destroy (metrics);
+    metrics = NULL;
+  }
+  pthread_mutex_unlock (&metrics_lock);
+
+  sfree (conf_node);
+  sfree (conf_service);
+  sfree (conf_timer_percentile);
+  conf_timer_percentile_num = 0;
+
+  return (0);
+} /* }}} int statsd_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("statsd", statsd_config);
+  plugin_register_init ("statsd", statsd_init);
+  plugin_register_read ("statsd", statsd_read);
+  plugin_register_handoff ("statsd", statsd_handoff);
+  plugin_register_shutdown ("statsd", statsd_shutdown);
+} /* void module_register */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
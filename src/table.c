@@ -45,6 +45,10 @@ typedef struct {
 	size_t values_num;
 
 	const data_set_t *ds;
+
+	/* Filled in by tbl_prepare() with everything but the values and, if
+	 * "InstancesFrom" is used, the type instance. */
+	value_list_t vl;
 } tbl_result_t;
 
 typedef struct {
@@ -56,6 +60,16 @@ typedef struct {
 	size_t        results_num;
 
 	size_t max_colnum;
+
+	/* sep_map[c] is non-zero if c is one of the separators. */
+	char sep_map[256];
+
+	/* A line's fields point into the buffer of "pf". Files in /proc and
+	 * /sys are kept open, others are opened on each read so that a file
+	 * which has been replaced or rotated is followed. */
+	pread_file_t *pf;
+	_Bool keep_open;
+	char **fields;
 } tbl_t;
 
 static void tbl_result_setup (tbl_result_t *res)
@@ -70,6 +84,8 @@ static void tbl_result_setup (tbl_result_t *res)
 	res->values_num      = 0;
 
 	res->ds              = NULL;
+
+	memset (&res->vl, 0, sizeof (res->vl));
 } /* tbl_result_setup */
 
 static void tbl_result_clear (tbl_result_t *res)
@@ -96,6 +112,13 @@ static void tbl_setup (tbl_t *tbl, char *file)
 	tbl->results_num = 0;
 
 	tbl->max_colnum  = 0;
+
+	memset (tbl->sep_map, 0, sizeof (tbl->sep_map));
+
+	tbl->pf          = NULL;
+	tbl->keep_open   = (0 == strncmp (file, "/proc/", strlen ("/proc/")))
+		|| (0 == strncmp (file, "/sys/", strlen ("/sys/")));
+	tbl->fields      = NULL;
 } /* tbl_setup */
 
 static void tbl_clear (tbl_t *tbl)
@@ -112,6 +135,10 @@ static void tbl_clear (tbl_t *tbl)
 	tbl->results_num = 0;
 
 	tbl->max_colnum  = 0;
+
+	pread_file_destroy (tbl->pf);
+	tbl->pf = NULL;
+	sfree (tbl->fields);
 } /* tbl_clear */
 
 static tbl_t *tables;
@@ -279,7 +306,13 @@ static int tbl_config_table (oconfig_item_t *ci)
 		log_err ("Table \"%s\" does not specify any separator.", tbl->file);
 		status = 1;
 	}
-	strunescape (tbl->sep, strlen (tbl->sep) + 1);
+	else {
+		char *sep;
+
+		strunescape (tbl->sep, strlen (tbl->sep) + 1);
+		for (sep = tbl->sep; '\0' != *sep; ++sep)
+			tbl->sep_map[(unsigned char)*sep] = 1;
+	}
 
 	if (NULL == tbl->instance) {
 		tbl->instance = sstrdup (tbl->file);
@@ -310,6 +343,14 @@ static int tbl_config_table (oconfig_item_t *ci)
 			if (res->values[j] > tbl->max_colnum)
 				tbl->max_colnum = res->values[j];
 	}
+
+	tbl->fields = (char **)calloc (tbl->max_colnum + 1, sizeof (*tbl->fields));
+	if (NULL == tbl->fields) {
+		log_err ("calloc failed.");
+		tbl_clear (tbl);
+		--tables_num;
+		return -1;
+	}
 	return 0;
 } /* tbl_config_table */
 
@@ -353,6 +394,21 @@ static int tbl_prepare (tbl_t *tbl)
 					res->ds->ds_num);
 			return -1;
 		}
+
+		/* The parts of the identifier that don't depend on the line are
+		 * set up once per read rather than once per line. */
+		{
+			value_list_t vl = VALUE_LIST_INIT;
+			memcpy (&res->vl, &vl, sizeof (res->vl));
+		}
+		sstrncpy (res->vl.host, hostname_g, sizeof (res->vl.host));
+		sstrncpy (res->vl.plugin, "table", sizeof (res->vl.plugin));
+		sstrncpy (res->vl.plugin_instance, tbl->instance,
+				sizeof (res->vl.plugin_instance));
+		sstrncpy (res->vl.type, res->type, sizeof (res->vl.type));
+		if ((0 == res->instances_num) && (NULL != res->instance_prefix))
+			sstrncpy (res->vl.type_instance, res->instance_prefix,
+					sizeof (res->vl.type_instance));
 	}
 	return 0;
 } /* tbl_prepare */
@@ -366,10 +422,10 @@ static int tbl_finish (tbl_t *tbl)
 	return 0;
 } /* tbl_finish */
 
-static int tbl_result_dispatch (tbl_t *tbl, tbl_result_t *res,
+static int tbl_result_dispatch (tbl_result_t *res,
 		char **fields, size_t fields_num)
 {
-	value_list_t vl = VALUE_LIST_INIT;
+	value_list_t vl;
 	value_t values[res->values_num];
 
 	size_t i;
@@ -387,20 +443,11 @@ static int tbl_result_dispatch (tbl_t *tbl, tbl_result_t *res,
 			return -1;
 	}
 
+	memcpy (&vl, &res->vl, sizeof (vl));
 	vl.values     = values;
 	vl.values_len = STATIC_ARRAY_SIZE (values);
 
-	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
-	sstrncpy (vl.plugin, "table", sizeof (vl.plugin));
-	sstrncpy (vl.plugin_instance, tbl->instance, sizeof (vl.plugin_instance));
-	sstrncpy (vl.type, res->type, sizeof (vl.type));
-
-	if (0 == res->instances_num) {
-		if (NULL != res->instance_prefix)
-			sstrncpy (vl.type_instance, res->instance_prefix,
-					sizeof (vl.type_instance));
-	}
-	else {
+	if (0 != res->instances_num) {
 		char *instances[res->instances_num];
 		char  instances_str[DATA_MAX_NAME_LEN];
 
@@ -431,34 +478,60 @@ static int tbl_result_dispatch (tbl_t *tbl, tbl_result_t *res,
 	return 0;
 } /* tbl_result_dispatch */
 
-static int tbl_parse_line (tbl_t *tbl, char *line, size_t len)
+/* Splits the line at *ptr in place and moves *ptr to the next line. Like
+ * strtok(3), runs of separators are treated as a single one. Only the first
+ * max_colnum + 1 fields are stored in tbl->fields; the number of stored
+ * fields is returned. */
+static size_t tbl_split_line (tbl_t *tbl, char **ptr)
 {
-	char *fields[tbl->max_colnum + 1];
-	char *ptr, *saveptr;
+	char  *p = *ptr;
+	size_t fields_num = 0;
 
-	size_t i;
-
-	i = 0;
-	ptr = line;
-	saveptr = NULL;
-	while (NULL != (fields[i] = strtok_r (ptr, tbl->sep, &saveptr))) {
-		ptr = NULL;
-		++i;
+	while (('\0' != *p) && ('\n' != *p)) {
+		if (tbl->sep_map[(unsigned char)*p]) {
+			*p = '\0';
+			++p;
+			continue;
+		}
 
-		if (i > tbl->max_colnum)
+		if (fields_num > tbl->max_colnum) {
+			/* All required columns have been found. */
+			while (('\0' != *p) && ('\n' != *p))
+				++p;
 			break;
+		}
+
+		tbl->fields[fields_num] = p;
+		++fields_num;
+
+		while (('\0' != *p) && ('\n' != *p)
+				&& (! tbl->sep_map[(unsigned char)*p]))
+			++p;
+	}
+
+	if ('\n' == *p) {
+		*p = '\0';
+		++p;
 	}
 
-	if (i <= tbl->max_colnum) {
+	*ptr = p;
+	return fields_num;
+} /* tbl_split_line */
+
+static int tbl_parse_line (tbl_t *tbl, size_t fields_num)
+{
+	size_t i;
+
+	if (fields_num <= tbl->max_colnum) {
 		log_err ("Not enough columns in line "
 				"(expected at least %zu, got %zu).",
-				tbl->max_colnum + 1, i);
+				tbl->max_colnum + 1, fields_num);
 		return -1;
 	}
 
 	for (i = 0; i < tbl->results_num; ++i)
-		if (0 != tbl_result_dispatch (tbl, tbl->results + i,
-					fields, STATIC_ARRAY_SIZE (fields))) {
+		if (0 != tbl_result_dispatch (tbl->results + i,
+					tbl->fields, fields_num)) {
 			log_err ("Failed to dispatch result.");
 			continue;
 		}
@@ -467,39 +540,42 @@ static int tbl_parse_line (tbl_t *tbl, char *line, size_t len)
 
 static int tbl_read_table (tbl_t *tbl)
 {
-	FILE *fh;
-	char  buf[4096];
+	char  *buf;
+	char  *ptr;
+	size_t line_num = 0;
+
+	if (NULL == tbl->pf) {
+		tbl->pf = pread_file_create (tbl->file);
+		if (NULL == tbl->pf) {
+			log_err ("pread_file_create failed.");
+			return -1;
+		}
+	}
 
-	fh = fopen (tbl->file, "r");
-	if (NULL == fh) {
+	buf = pread_file_read (tbl->pf, /* ret_len = */ NULL);
+	/* The buffer stays valid once the file is closed. */
+	if (! tbl->keep_open)
+		pread_file_close (tbl->pf);
+	if (NULL == buf) {
 		char errbuf[1024];
-		log_err ("Failed to open file \"%s\": %s.", tbl->file,
+		log_err ("Failed to read from file \"%s\": %s.", tbl->file,
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 		return -1;
 	}
 
-	buf[sizeof (buf) - 1] = '\0';
-	while (NULL != fgets (buf, sizeof (buf), fh)) {
-		if ('\0' != buf[sizeof (buf) - 1]) {
-			buf[sizeof (buf) - 1] = '\0';
-			log_err ("Table %s: Truncated line: %s", tbl->file, buf);
-		}
+	ptr = buf;
+	while ('\0' != *ptr) {
+		size_t fields_num;
 
-		if (0 != tbl_parse_line (tbl, buf, sizeof (buf))) {
-			log_err ("Table %s: Failed to parse line: %s", tbl->file, buf);
+		++line_num;
+		fields_num = tbl_split_line (tbl, &ptr);
+
+		if (0 != tbl_parse_line (tbl, fields_num)) {
+			log_err ("Table %s: Failed to parse line %zu.",
+					tbl->file, line_num);
 			continue;
 		}
 	}
-
-	if (0 != ferror (fh)) {
-		char errbuf[1024];
-		log_err ("Failed to read from file \"%s\": %s.", tbl->file,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (fh);
-		return -1;
-	}
-
-	fclose (fh);
 	return 0;
 } /* tbl_read_table */
 
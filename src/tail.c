@@ -227,6 +227,7 @@ static int ctail_config_add_file (oconfig_item_t *ci)
 {
   cu_tail_match_t *tm;
   char *plugin_instance = NULL;
+  _Bool inotify = 0;
   int num_matches = 0;
   int status;
   int i;
@@ -260,6 +261,8 @@ static int ctail_config_add_file (oconfig_item_t *ci)
     }
     else if (strcasecmp ("Instance", option->key) == 0)
       status = ctail_config_add_string ("Instance", &plugin_instance, option);
+    else if (strcasecmp ("Inotify", option->key) == 0)
+      status = cf_util_get_boolean (option, &inotify);
     else
     {
       WARNING ("tail plugin: Option `%s' not allowed here.", option->key);
@@ -281,6 +284,10 @@ static int ctail_config_add_file (oconfig_item_t *ci)
   {
     cu_tail_match_t **temp;
 
+    if (inotify && (tail_match_watch (tm) != 0))
+      WARNING ("tail plugin: Watching `%s' failed. Will check the file "
+	  "periodically instead.", ci->values[0].value.string);
+
     temp = (cu_tail_match_t **) realloc (tail_match_list,
 	sizeof (cu_tail_match_t *) * (tail_match_list_num + 1));
     if (temp == NULL)
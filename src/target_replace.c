@@ -24,8 +24,13 @@
 #include "filter_chain.h"
 #include "utils_subst.h"
 
+#include <pthread.h>
 #include <regex.h>
 
+/* The rewritten identifier only depends on the identifier, so the results are
+ * kept for the "CacheSize" series used most recently. */
+#define TR_CACHE_SIZE_DEFAULT 4096
+
 struct tr_action_s;
 typedef struct tr_action_s tr_action_t;
 struct tr_action_s
@@ -37,6 +42,31 @@ struct tr_action_s
   tr_action_t *next;
 };
 
+struct tr_ident_s
+{
+  char host[DATA_MAX_NAME_LEN];
+  char plugin[DATA_MAX_NAME_LEN];
+  char plugin_instance[DATA_MAX_NAME_LEN];
+  char type[DATA_MAX_NAME_LEN];
+  char type_instance[DATA_MAX_NAME_LEN];
+};
+typedef struct tr_ident_s tr_ident_t;
+
+struct tr_cache_entry_s;
+typedef struct tr_cache_entry_s tr_cache_entry_t;
+struct tr_cache_entry_s
+{
+  uint64_t hash;
+  tr_ident_t in;
+  tr_ident_t out;
+
+  /* Next entry in the same bucket. */
+  tr_cache_entry_t *next;
+  /* Neighbours in the list of entries, most recently used first. */
+  tr_cache_entry_t *lru_prev;
+  tr_cache_entry_t *lru_next;
+};
+
 struct tr_data_s
 {
   tr_action_t *host;
@@ -44,6 +74,15 @@ struct tr_data_s
   tr_action_t *plugin_instance;
   /* tr_action_t *type; */
   tr_action_t *type_instance;
+
+  int cache_size;
+  int cache_num;
+  /* "buckets_num" is a power of two. */
+  tr_cache_entry_t **buckets;
+  size_t buckets_num;
+  tr_cache_entry_t *lru_head;
+  tr_cache_entry_t *lru_tail;
+  pthread_mutex_t cache_lock;
 };
 typedef struct tr_data_s tr_data_t;
 
@@ -212,6 +251,162 @@ static int tr_action_invoke (tr_action_t *act_head, /* {{{ */
   return (0);
 } /* }}} int tr_action_invoke */
 
+static void tr_ident_from_vl (tr_ident_t *ident, /* {{{ */
+    const value_list_t *vl)
+{
+  sstrncpy (ident->host, vl->host, sizeof (ident->host));
+  sstrncpy (ident->plugin, vl->plugin, sizeof (ident->plugin));
+  sstrncpy (ident->plugin_instance, vl->plugin_instance,
+      sizeof (ident->plugin_instance));
+  sstrncpy (ident->type, vl->type, sizeof (ident->type));
+  sstrncpy (ident->type_instance, vl->type_instance,
+      sizeof (ident->type_instance));
+} /* }}} void tr_ident_from_vl */
+
+static _Bool tr_ident_equal (const tr_ident_t *ident, /* {{{ */
+    const value_list_t *vl)
+{
+  return ((strcmp (ident->host, vl->host) == 0)
+      && (strcmp (ident->plugin, vl->plugin) == 0)
+      && (strcmp (ident->plugin_instance, vl->plugin_instance) == 0)
+      && (strcmp (ident->type, vl->type) == 0)
+      && (strcmp (ident->type_instance, vl->type_instance) == 0));
+} /* }}} _Bool tr_ident_equal */
+
+/* Unlinks "e" from the list of entries. The caller must hold "cache_lock". */
+static void tr_cache_lru_unlink (tr_data_t *data, /* {{{ */
+    tr_cache_entry_t *e)
+{
+  if (e->lru_prev != NULL)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    data->lru_head = e->lru_next;
+
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    data->lru_tail = e->lru_prev;
+
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+} /* }}} void tr_cache_lru_unlink */
+
+/* Puts "e" at the head of the list of entries. The caller must hold
+ * "cache_lock". */
+static void tr_cache_lru_push (tr_data_t *data, /* {{{ */
+    tr_cache_entry_t *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = data->lru_head;
+  if (data->lru_head != NULL)
+    data->lru_head->lru_prev = e;
+  data->lru_head = e;
+  if (data->lru_tail == NULL)
+    data->lru_tail = e;
+} /* }}} void tr_cache_lru_push */
+
+/* Copies the cached rewrite of "vl" to "vl" and returns zero, or returns
+ * ENOENT if the identifier isn't cached. */
+static int tr_cache_get (tr_data_t *data, uint64_t hash, /* {{{ */
+    value_list_t *vl)
+{
+  tr_cache_entry_t *e;
+
+  pthread_mutex_lock (&data->cache_lock);
+
+  for (e = data->buckets[hash & (data->buckets_num - 1)];
+      e != NULL;
+      e = e->next)
+  {
+    if ((e->hash == hash) && tr_ident_equal (&e->in, vl))
+      break;
+  }
+
+  if (e == NULL)
+  {
+    pthread_mutex_unlock (&data->cache_lock);
+    return (ENOENT);
+  }
+
+  if (e != data->lru_head)
+  {
+    tr_cache_lru_unlink (data, e);
+    tr_cache_lru_push (data, e);
+  }
+
+  sstrncpy (vl->host, e->out.host, sizeof (vl->host));
+  sstrncpy (vl->plugin, e->out.plugin, sizeof (vl->plugin));
+  sstrncpy (vl->plugin_instance, e->out.plugin_instance,
+      sizeof (vl->plugin_instance));
+  sstrncpy (vl->type_instance, e->out.type_instance,
+      sizeof (vl->type_instance));
+
+  pthread_mutex_unlock (&data->cache_lock);
+  return (0);
+} /* }}} int tr_cache_get */
+
+/* Stores the rewrite of "in" to "vl", replacing the entry used least recently
+ * if the cache is full. */
+static void tr_cache_put (tr_data_t *data, uint64_t hash, /* {{{ */
+    const tr_ident_t *in, const value_list_t *vl)
+{
+  tr_cache_entry_t *e;
+  tr_cache_entry_t **ptr;
+
+  pthread_mutex_lock (&data->cache_lock);
+
+  /* Another thread may have added the identifier meanwhile. */
+  for (e = data->buckets[hash & (data->buckets_num - 1)];
+      e != NULL;
+      e = e->next)
+  {
+    if ((e->hash == hash) && (memcmp (&e->in, in, sizeof (*in)) == 0))
+    {
+      pthread_mutex_unlock (&data->cache_lock);
+      return;
+    }
+  }
+
+  if (data->cache_num < data->cache_size)
+  {
+    e = malloc (sizeof (*e));
+    if (e == NULL)
+    {
+      pthread_mutex_unlock (&data->cache_lock);
+      return;
+    }
+    data->cache_num++;
+  }
+  else
+  {
+    e = data->lru_tail;
+    tr_cache_lru_unlink (data, e);
+
+    for (ptr = &data->buckets[e->hash & (data->buckets_num - 1)];
+        *ptr != NULL;
+        ptr = &(*ptr)->next)
+    {
+      if (*ptr == e)
+      {
+        *ptr = e->next;
+        break;
+      }
+    }
+  }
+
+  memset (e, 0, sizeof (*e));
+  e->hash = hash;
+  memcpy (&e->in, in, sizeof (e->in));
+  tr_ident_from_vl (&e->out, vl);
+
+  ptr = &data->buckets[hash & (data->buckets_num - 1)];
+  e->next = *ptr;
+  *ptr = e;
+  tr_cache_lru_push (data, e);
+
+  pthread_mutex_unlock (&data->cache_lock);
+} /* }}} void tr_cache_put */
+
 static int tr_destroy (void **user_data) /* {{{ */
 {
   tr_data_t *data;
@@ -228,6 +423,16 @@ static int tr_destroy (void **user_data) /* {{{ */
   tr_action_destroy (data->plugin_instance);
   /* tr_action_destroy (data->type); */
   tr_action_destroy (data->type_instance);
+
+  while (data->lru_head != NULL)
+  {
+    tr_cache_entry_t *e = data->lru_head;
+    data->lru_head = e->lru_next;
+    sfree (e);
+  }
+  sfree (data->buckets);
+  pthread_mutex_destroy (&data->cache_lock);
+
   sfree (data);
 
   return (0);
@@ -253,6 +458,12 @@ static int tr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
   /* data->type = NULL; */
   data->type_instance = NULL;
 
+  data->cache_size = TR_CACHE_SIZE_DEFAULT;
+  data->buckets = NULL;
+  data->lru_head = NULL;
+  data->lru_tail = NULL;
+  pthread_mutex_init (&data->cache_lock, /* attr = */ NULL);
+
   status = 0;
   for (i = 0; i < ci->children_num; i++)
   {
@@ -276,6 +487,8 @@ static int tr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
     else if (strcasecmp ("TypeInstance", child->key) == 0)
       status = tr_config_add_action (&data->type_instance, child,
           /* may be empty = */ 1);
+    else if (strcasecmp ("CacheSize", child->key) == 0)
+      status = cf_util_get_int (child, &data->cache_size);
     else
     {
       ERROR ("Target `replace': The `%s' configuration option is not understood "
@@ -300,6 +513,25 @@ static int tr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
           "`Plugin', `PluginInstance', `Type', or `TypeInstance'.");
       status = -1;
     }
+    else if (data->cache_size < 0)
+    {
+      ERROR ("Target `replace': `CacheSize' must not be negative.");
+      status = -1;
+    }
+
+    if ((status == 0) && (data->cache_size > 0))
+    {
+      data->buckets_num = 1;
+      while (data->buckets_num < (size_t) data->cache_size)
+        data->buckets_num *= 2;
+
+      data->buckets = calloc (data->buckets_num, sizeof (*data->buckets));
+      if (data->buckets == NULL)
+      {
+        ERROR ("tr_create: calloc failed.");
+        status = -ENOMEM;
+      }
+    }
 
     break;
   }
@@ -318,6 +550,8 @@ static int tr_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
     notification_meta_t __attribute__((unused)) **meta, void **user_data)
 {
   tr_data_t *data;
+  tr_ident_t in;
+  uint64_t hash = 0;
 
   if ((ds == NULL) || (vl == NULL) || (user_data == NULL))
     return (-EINVAL);
@@ -329,6 +563,20 @@ static int tr_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
     return (-EINVAL);
   }
 
+  if (plugin_value_list_make_writable (vl) != 0)
+  {
+    ERROR ("Target `replace': Invoke: Copying the value list failed.");
+    return (-ENOMEM);
+  }
+
+  if (data->buckets != NULL)
+  {
+    hash = plugin_hash_vl (vl);
+    if (tr_cache_get (data, hash, vl) == 0)
+      return (FC_TARGET_CONTINUE);
+    tr_ident_from_vl (&in, vl);
+  }
+
 #define HANDLE_FIELD(f,e) \
   if (data->f != NULL) \
     tr_action_invoke (data->f, vl->f, sizeof (vl->f), e)
@@ -338,6 +586,9 @@ static int tr_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
   /* HANDLE_FIELD (type); */
   HANDLE_FIELD (type_instance, 1);
 
+  if (data->buckets != NULL)
+    tr_cache_put (data, hash, &in, vl);
+
   return (FC_TARGET_CONTINUE);
 } /* }}} int tr_invoke */
 
@@ -0,0 +1,605 @@
+/**
+ * collectd - src/target_rollup.c
+ * Copyright (C) 2013  Florian Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "filter_chain.h"
+#include "utils_avltree.h"
+
+#include <pthread.h>
+
+/*
+ * The values of each series are combined over windows of "Interval" seconds,
+ * aligned to multiples of the interval since the epoch. When the first value
+ * of the next window arrives, the combined values of the previous window are
+ * written to the configured plugins, with the end of the window as their
+ * time. Gauges are combined with the configured functions. Counters and
+ * derives are passed on as the last value of the window, absolutes as the
+ * sum, so rates computed from them stay the same.
+ */
+
+#define TR_AVERAGE 0
+#define TR_MINIMUM 1
+#define TR_MAXIMUM 2
+#define TR_LAST    3
+#define TR_FUNCTIONS_NUM 4
+
+static const char *tr_function_names[TR_FUNCTIONS_NUM] =
+{
+  "average", "min", "max", "last"
+};
+
+struct tr_acc_s
+{
+  gauge_t    min;
+  gauge_t    max;
+  gauge_t    sum;
+  uint64_t   num;
+  absolute_t absolute_sum;
+  value_t    last;
+};
+typedef struct tr_acc_s tr_acc_t;
+
+struct tr_series_s
+{
+  char *identifier;
+  const data_set_t *ds;
+  /* The identifier fields; "values" isn't used. */
+  value_list_t vl;
+
+  /* Start of the window being combined, zero if there are no values. */
+  cdtime_t window;
+  tr_acc_t *acc;
+};
+typedef struct tr_series_s tr_series_t;
+
+/* A combined value list, written once the lock has been released. */
+struct tr_output_s
+{
+  const data_set_t *ds;
+  value_list_t vl;
+};
+typedef struct tr_output_s tr_output_t;
+
+struct tr_data_s
+{
+  cdtime_t interval;
+  _Bool functions[TR_FUNCTIONS_NUM];
+  size_t functions_num;
+
+  plugin_write_ref_t *plugins;
+  size_t plugins_num;
+
+  pthread_mutex_t lock;
+  c_avl_tree_t *series;
+  /* Series which haven't been updated since the window before the last
+   * one was current are written and removed every interval. */
+  cdtime_t sweep_time;
+};
+typedef struct tr_data_s tr_data_t;
+
+static void tr_series_destroy (tr_series_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
+
+  sfree (s->identifier);
+  sfree (s->acc);
+  sfree (s);
+} /* }}} void tr_series_destroy */
+
+static void tr_acc_reset (tr_series_t *s) /* {{{ */
+{
+  size_t i;
+
+  for (i = 0; i < (size_t) s->ds->ds_num; i++)
+  {
+    memset (s->acc + i, 0, sizeof (s->acc[i]));
+    s->acc[i].min = NAN;
+    s->acc[i].max = NAN;
+  }
+} /* }}} void tr_acc_reset */
+
+static void tr_acc_add (tr_series_t *s, const value_list_t *vl) /* {{{ */
+{
+  size_t i;
+
+  for (i = 0; i < (size_t) s->ds->ds_num; i++)
+  {
+    tr_acc_t *acc = s->acc + i;
+
+    acc->last = vl->values[i];
+
+    if (s->ds->ds[i].type == DS_TYPE_ABSOLUTE)
+      acc->absolute_sum += vl->values[i].absolute;
+    else if (s->ds->ds[i].type == DS_TYPE_GAUGE)
+    {
+      gauge_t g = vl->values[i].gauge;
+
+      if (isnan (g))
+        continue;
+
+      if (isnan (acc->min) || (g < acc->min))
+        acc->min = g;
+      if (isnan (acc->max) || (g > acc->max))
+        acc->max = g;
+      acc->sum += g;
+      acc->num++;
+    }
+  }
+} /* }}} void tr_acc_add */
+
+/* Appends the combined values of the window of "s" to "outputs" and resets
+ * the window. Must be called with the lock held. */
+static int tr_series_emit (tr_data_t *data, tr_series_t *s, /* {{{ */
+    tr_output_t **outputs, size_t *outputs_num)
+{
+  tr_output_t *tmp;
+  size_t values_num = (size_t) s->ds->ds_num;
+  int f;
+
+  if (s->window == 0)
+    return (0);
+
+  tmp = realloc (*outputs,
+      (*outputs_num + data->functions_num) * sizeof (**outputs));
+  if (tmp == NULL)
+  {
+    ERROR ("Target `rollup': realloc failed.");
+    s->window = 0;
+    return (-1);
+  }
+  *outputs = tmp;
+
+  for (f = 0; f < TR_FUNCTIONS_NUM; f++)
+  {
+    tr_output_t *out;
+    size_t i;
+
+    if (!data->functions[f])
+      continue;
+
+    out = *outputs + *outputs_num;
+    out->ds = s->ds;
+    memcpy (&out->vl, &s->vl, sizeof (out->vl));
+    out->vl.values = calloc (values_num, sizeof (*out->vl.values));
+    if (out->vl.values == NULL)
+    {
+      ERROR ("Target `rollup': calloc failed.");
+      continue;
+    }
+    out->vl.values_len = (int) values_num;
+    out->vl.time = s->window + data->interval;
+    out->vl.interval = data->interval;
+    out->vl.meta = NULL;
+
+    /* With more than one function, each one gets a series of its own. */
+    if (data->functions_num > 1)
+    {
+      if (s->vl.type_instance[0] != 0)
+        ssnprintf (out->vl.type_instance, sizeof (out->vl.type_instance),
+            "%s-%s", s->vl.type_instance, tr_function_names[f]);
+      else
+        sstrncpy (out->vl.type_instance, tr_function_names[f],
+            sizeof (out->vl.type_instance));
+    }
+
+    for (i = 0; i < values_num; i++)
+    {
+      tr_acc_t *acc = s->acc + i;
+
+      if (s->ds->ds[i].type == DS_TYPE_ABSOLUTE)
+        out->vl.values[i].absolute = acc->absolute_sum;
+      else if (s->ds->ds[i].type != DS_TYPE_GAUGE)
+        out->vl.values[i] = acc->last;
+      else if (f == TR_AVERAGE)
+        out->vl.values[i].gauge = (acc->num > 0)
+          ? (acc->sum / ((gauge_t) acc->num)) : NAN;
+      else if (f == TR_MINIMUM)
+        out->vl.values[i].gauge = acc->min;
+      else if (f == TR_MAXIMUM)
+        out->vl.values[i].gauge = acc->max;
+      else
+        out->vl.values[i] = acc->last;
+    }
+
+    (*outputs_num)++;
+  }
+
+  s->window = 0;
+  return (0);
+} /* }}} int tr_series_emit */
+
+/* Writes and removes the series which stopped reporting. Must be called with
+ * the lock held. */
+static void tr_sweep (tr_data_t *data, cdtime_t now, /* {{{ */
+    tr_output_t **outputs, size_t *outputs_num)
+{
+  c_avl_iterator_t *iter;
+  tr_series_t **stale = NULL;
+  size_t stale_num = 0;
+  char *key;
+  tr_series_t *s;
+  size_t i;
+
+  iter = c_avl_get_iterator (data->series);
+  if (iter == NULL)
+    return;
+
+  while (c_avl_iterator_next (iter, (void *) &key, (void *) &s) == 0)
+  {
+    tr_series_t **tmp;
+
+    if ((s->window != 0) && (s->window + 2 * data->interval > now))
+      continue;
+
+    tmp = realloc (stale, (stale_num + 1) * sizeof (*stale));
+    if (tmp == NULL)
+      break;
+    stale = tmp;
+    stale[stale_num] = s;
+    stale_num++;
+  }
+  c_avl_iterator_destroy (iter);
+
+  for (i = 0; i < stale_num; i++)
+  {
+    tr_series_emit (data, stale[i], outputs, outputs_num);
+    c_avl_remove (data->series, stale[i]->identifier, NULL, NULL);
+    tr_series_destroy (stale[i]);
+  }
+  sfree (stale);
+} /* }}} void tr_sweep */
+
+static void tr_write_outputs (tr_data_t *data, /* {{{ */
+    tr_output_t *outputs, size_t outputs_num)
+{
+  size_t i;
+  size_t j;
+
+  for (i = 0; i < outputs_num; i++)
+  {
+    if (outputs[i].vl.values == NULL)
+      continue;
+
+    for (j = 0; j < data->plugins_num; j++)
+    {
+      int status = plugin_write_ref (data->plugins + j, outputs[i].ds,
+          &outputs[i].vl);
+      if (status != 0)
+        INFO ("Target `rollup': Dispatching value to the `%s' plugin "
+            "failed with status %i.", data->plugins[j].name, status);
+    }
+    sfree (outputs[i].vl.values);
+  }
+} /* }}} void tr_write_outputs */
+
+static int tr_config_function (tr_data_t *data, /* {{{ */
+    const oconfig_item_t *ci)
+{
+  int i;
+
+  if (ci->values_num < 1)
+  {
+    ERROR ("Target `rollup': The `Function' option requires at least one "
+        "argument.");
+    return (-1);
+  }
+
+  for (i = 0; i < ci->values_num; i++)
+  {
+    const char *name;
+    int f;
+
+    if (ci->values[i].type != OCONFIG_TYPE_STRING)
+    {
+      ERROR ("Target `rollup': The `Function' option accepts only string "
+          "arguments.");
+      return (-1);
+    }
+    name = ci->values[i].value.string;
+
+    if (strcasecmp ("Average", name) == 0)
+      f = TR_AVERAGE;
+    else if ((strcasecmp ("Minimum", name) == 0)
+        || (strcasecmp ("Min", name) == 0))
+      f = TR_MINIMUM;
+    else if ((strcasecmp ("Maximum", name) == 0)
+        || (strcasecmp ("Max", name) == 0))
+      f = TR_MAXIMUM;
+    else if (strcasecmp ("Last", name) == 0)
+      f = TR_LAST;
+    else
+    {
+      ERROR ("Target `rollup': Unknown function `%s'. Use one of `Average', "
+          "`Minimum', `Maximum' and `Last'.", name);
+      return (-1);
+    }
+
+    if (!data->functions[f])
+      data->functions_num++;
+    data->functions[f] = 1;
+  }
+
+  return (0);
+} /* }}} int tr_config_function */
+
+static int tr_config_plugin (tr_data_t *data, /* {{{ */
+    const oconfig_item_t *ci)
+{
+  int i;
+
+  if (ci->values_num < 1)
+  {
+    ERROR ("Target `rollup': The `Plugin' option requires at least one "
+        "argument.");
+    return (-1);
+  }
+
+  for (i = 0; i < ci->values_num; i++)
+  {
+    plugin_write_ref_t *tmp;
+
+    if (ci->values[i].type != OCONFIG_TYPE_STRING)
+    {
+      ERROR ("Target `rollup': The `Plugin' option accepts only string "
+          "arguments.");
+      return (-1);
+    }
+
+    tmp = realloc (data->plugins,
+        (data->plugins_num + 1) * sizeof (*data->plugins));
+    if (tmp == NULL)
+    {
+      ERROR ("Target `rollup': realloc failed.");
+      return (-1);
+    }
+    data->plugins = tmp;
+
+    plugin_write_ref_init (data->plugins + data->plugins_num,
+        ci->values[i].value.string);
+    data->plugins_num++;
+  }
+
+  return (0);
+} /* }}} int tr_config_plugin */
+
+static int tr_destroy (void **user_data) /* {{{ */
+{
+  tr_data_t *data;
+
+  if ((user_data == NULL) || (*user_data == NULL))
+    return (0);
+
+  data = *user_data;
+
+  /* The values of the current windows are lost: the write plugins may be
+   * gone already. */
+  if (data->series != NULL)
+  {
+    char *key;
+    tr_series_t *s;
+
+    while (c_avl_pick (data->series, (void *) &key, (void *) &s) == 0)
+      tr_series_destroy (s);
+    c_avl_destroy (data->series);
+  }
+
+  pthread_mutex_destroy (&data->lock);
+  sfree (data->plugins);
+  sfree (data);
+  *user_data = NULL;
+
+  return (0);
+} /* }}} int tr_destroy */
+
+static int tr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
+{
+  tr_data_t *data;
+  int status = 0;
+  int i;
+
+  data = calloc (1, sizeof (*data));
+  if (data == NULL)
+  {
+    ERROR ("tr_create: calloc failed.");
+    return (-ENOMEM);
+  }
+  pthread_mutex_init (&data->lock, /* attr = */ NULL);
+  data->interval = TIME_T_TO_CDTIME_T (300);
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Interval", child->key) == 0)
+      status = cf_util_get_cdtime (child, &data->interval);
+    else if (strcasecmp ("Function", child->key) == 0)
+      status = tr_config_function (data, child);
+    else if (strcasecmp ("Plugin", child->key) == 0)
+      status = tr_config_plugin (data, child);
+    else
+    {
+      ERROR ("Target `rollup': The `%s' configuration option is not "
+          "understood and will be ignored.", child->key);
+      status = 0;
+    }
+
+    if (status != 0)
+      break;
+  }
+
+  if ((status == 0) && (data->interval == 0))
+  {
+    ERROR ("Target `rollup': The `Interval' must be greater than zero.");
+    status = -1;
+  }
+
+  if ((status == 0) && (data->plugins_num == 0))
+  {
+    ERROR ("Target `rollup': No `Plugin' has been configured.");
+    status = -1;
+  }
+
+  if ((status == 0) && (data->functions_num == 0))
+  {
+    data->functions[TR_AVERAGE] = 1;
+    data->functions_num = 1;
+  }
+
+  if (status == 0)
+  {
+    data->series = c_avl_create ((void *) strcmp);
+    if (data->series == NULL)
+    {
+      ERROR ("Target `rollup': c_avl_create failed.");
+      status = -1;
+    }
+  }
+
+  if (status != 0)
+  {
+    tr_destroy ((void *) &data);
+    return (-1);
+  }
+
+  *user_data = data;
+  return (0);
+} /* }}} int tr_create */
+
+static tr_series_t *tr_series_create (tr_data_t *data, /* {{{ */
+    const char *identifier, const data_set_t *ds, const value_list_t *vl)
+{
+  tr_series_t *s;
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+
+  s->identifier = strdup (identifier);
+  s->acc = calloc ((size_t) ds->ds_num, sizeof (*s->acc));
+  if ((s->identifier == NULL) || (s->acc == NULL))
+  {
+    tr_series_destroy (s);
+    return (NULL);
+  }
+
+  s->ds = ds;
+  memcpy (&s->vl, vl, sizeof (s->vl));
+  s->vl.values = NULL;
+  s->vl.values_len = 0;
+  s->vl.meta = NULL;
+
+  if (c_avl_insert (data->series, s->identifier, s) != 0)
+  {
+    tr_series_destroy (s);
+    return (NULL);
+  }
+
+  return (s);
+} /* }}} tr_series_t *tr_series_create */
+
+static int tr_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
+    notification_meta_t __attribute__((unused)) **meta, void **user_data)
+{
+  char identifier[6 * DATA_MAX_NAME_LEN];
+  tr_output_t *outputs = NULL;
+  size_t outputs_num = 0;
+  tr_data_t *data;
+  tr_series_t *s = NULL;
+  cdtime_t window;
+  cdtime_t now;
+
+  if ((ds == NULL) || (vl == NULL) || (user_data == NULL))
+    return (-EINVAL);
+
+  data = *user_data;
+  if (data == NULL)
+  {
+    ERROR ("Target `rollup': Invoke: `data' is NULL.");
+    return (-EINVAL);
+  }
+
+  if (FORMAT_VL (identifier, sizeof (identifier), vl) != 0)
+    return (-1);
+
+  window = vl->time - (vl->time % data->interval);
+  now = cdtime ();
+
+  pthread_mutex_lock (&data->lock);
+
+  if (c_avl_get (data->series, identifier, (void *) &s) != 0)
+    s = tr_series_create (data, identifier, ds, vl);
+  else if (s->ds != ds)
+  {
+    /* The data set changed, e.g. the types were reloaded. */
+    tr_series_emit (data, s, &outputs, &outputs_num);
+    c_avl_remove (data->series, identifier, NULL, NULL);
+    tr_series_destroy (s);
+    s = tr_series_create (data, identifier, ds, vl);
+  }
+
+  if (s == NULL)
+    ERROR ("Target `rollup': Creating the series %s failed.", identifier);
+  else if ((s->window != 0) && (window < s->window))
+  {
+    /* Values of windows already written are dropped. */
+    DEBUG ("Target `rollup': Ignoring a late value of %s.", identifier);
+  }
+  else
+  {
+    if (window != s->window)
+    {
+      tr_series_emit (data, s, &outputs, &outputs_num);
+      tr_acc_reset (s);
+      s->window = window;
+    }
+    tr_acc_add (s, vl);
+  }
+
+  if (now >= data->sweep_time)
+  {
+    if (data->sweep_time != 0)
+      tr_sweep (data, now, &outputs, &outputs_num);
+    data->sweep_time = now + data->interval;
+  }
+
+  pthread_mutex_unlock (&data->lock);
+
+  tr_write_outputs (data, outputs, outputs_num);
+  sfree (outputs);
+
+  return (FC_TARGET_CONTINUE);
+} /* }}} int tr_invoke */
+
+void module_register (void)
+{
+  target_proc_t tproc;
+
+  memset (&tproc, 0, sizeof (tproc));
+  tproc.create  = tr_create;
+  tproc.destroy = tr_destroy;
+  tproc.invoke  = tr_invoke;
+  fc_register_target ("rollup", tproc);
+} /* module_register */
+
+/* vim: set sw=2 sts=2 tw=78 et fdm=marker : */
@@ -465,6 +465,12 @@ static int ts_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
 		return (-EINVAL);
 	}
 
+	if (plugin_value_list_make_writable (vl) != 0)
+	{
+		ERROR ("Target `scale': Invoke: Copying the value list failed.");
+		return (-ENOMEM);
+	}
+
 	for (i = 0; i < ds->ds_num; i++)
 	{
 		/* If we've got a list of data sources, is it in the list? */
@@ -204,6 +204,12 @@ static int ts_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
     return (-EINVAL);
   }
 
+  if (plugin_value_list_make_writable (vl) != 0)
+  {
+    ERROR ("Target `set': Invoke: Copying the value list failed.");
+    return (-ENOMEM);
+  }
+
 #define SET_FIELD(f) if (data->f != NULL) { sstrncpy (vl->f, data->f, sizeof (vl->f)); }
   SET_FIELD (host);
   SET_FIELD (plugin);
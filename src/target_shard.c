@@ -0,0 +1,404 @@
+/**
+ * collectd - src/target_shard.c
+ * Copyright (C) 2013  Florian Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "filter_chain.h"
+
+/*
+ * Each value list is written to one of the configured write plugins, chosen
+ * by consistent hashing: every plugin gets a number of points on a ring of
+ * 64 bit hashes, proportional to its weight, and a series goes to the plugin
+ * owning the first point at or after the hash of its identifier. The points
+ * only depend on the plugin's name, so adding a plugin only moves the series
+ * which land on its new points, about 1/n of them, and removing one only
+ * moves the series it had.
+ */
+
+/* Points per unit of weight. More points spread the series more evenly. */
+#define TS_POINTS_PER_WEIGHT 160
+
+#define TS_FIELD_HOST            0x01
+#define TS_FIELD_PLUGIN          0x02
+#define TS_FIELD_PLUGIN_INSTANCE 0x04
+#define TS_FIELD_TYPE            0x08
+#define TS_FIELD_TYPE_INSTANCE   0x10
+#define TS_FIELD_ALL             0x1f
+
+struct ts_point_s
+{
+  uint64_t hash;
+  uint64_t name_hash;
+  size_t   target;
+};
+typedef struct ts_point_s ts_point_t;
+
+struct ts_data_s
+{
+  plugin_write_ref_t *targets;
+  double             *weights;
+  size_t              targets_num;
+
+  ts_point_t *points;
+  size_t      points_num;
+
+  int fields;
+};
+typedef struct ts_data_s ts_data_t;
+
+/* Mixes the bits of "h", so similar names and identifiers end up far apart
+ * on the ring. This is the finalizer of MurmurHash3. */
+static uint64_t ts_mix (uint64_t h) /* {{{ */
+{
+  h ^= h >> 33;
+  h *= UINT64_C (0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C (0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+
+  return (h);
+} /* }}} uint64_t ts_mix */
+
+static uint64_t ts_hash_vl (const ts_data_t *data, /* {{{ */
+    const value_list_t *vl)
+{
+  uint64_t hash = 0;
+
+  if (data->fields == TS_FIELD_ALL)
+    return (ts_mix (plugin_hash_vl (vl)));
+
+  /* The field boundaries are part of the hash, so "a" "bc" and "ab" "c"
+   * differ. */
+#define TS_HASH_FIELD(flag, field) \
+  if ((data->fields & (flag)) != 0) \
+    hash = (hash ^ plugin_hash_string (field)) * UINT64_C (1099511628211)
+  TS_HASH_FIELD (TS_FIELD_HOST, vl->host);
+  TS_HASH_FIELD (TS_FIELD_PLUGIN, vl->plugin);
+  TS_HASH_FIELD (TS_FIELD_PLUGIN_INSTANCE, vl->plugin_instance);
+  TS_HASH_FIELD (TS_FIELD_TYPE, vl->type);
+  TS_HASH_FIELD (TS_FIELD_TYPE_INSTANCE, vl->type_instance);
+#undef TS_HASH_FIELD
+
+  return (ts_mix (hash));
+} /* }}} uint64_t ts_hash_vl */
+
+static int ts_point_compare (const void *a, const void *b) /* {{{ */
+{
+  const ts_point_t *p0 = a;
+  const ts_point_t *p1 = b;
+
+  if (p0->hash != p1->hash)
+    return ((p0->hash < p1->hash) ? -1 : 1);
+
+  /* Ties are broken by name, so the ring doesn't depend on the order of the
+   * options. */
+  if (p0->name_hash != p1->name_hash)
+    return ((p0->name_hash < p1->name_hash) ? -1 : 1);
+  return (0);
+} /* }}} int ts_point_compare */
+
+static int ts_config_add_plugin (ts_data_t *data, /* {{{ */
+    const oconfig_item_t *ci)
+{
+  plugin_write_ref_t *tmp_targets;
+  double *tmp_weights;
+  double weight = 1.0;
+  size_t i;
+
+  if ((ci->values_num < 1) || (ci->values_num > 2)
+      || (ci->values[0].type != OCONFIG_TYPE_STRING)
+      || ((ci->values_num == 2)
+        && (ci->values[1].type != OCONFIG_TYPE_NUMBER)))
+  {
+    ERROR ("Target `shard': The `Plugin' option requires a plugin name and "
+        "an optional weight.");
+    return (-1);
+  }
+
+  if (ci->values_num == 2)
+    weight = ci->values[1].value.number;
+  if (!(weight > 0.0) || (weight > 1000.0))
+  {
+    ERROR ("Target `shard': The weight of `%s' must be greater than zero "
+        "and at most 1000.", ci->values[0].value.string);
+    return (-1);
+  }
+
+  for (i = 0; i < data->targets_num; i++)
+  {
+    if (strcasecmp (data->targets[i].name, ci->values[0].value.string) == 0)
+    {
+      ERROR ("Target `shard': The plugin `%s' is given more than once.",
+          ci->values[0].value.string);
+      return (-1);
+    }
+  }
+
+  tmp_targets = realloc (data->targets,
+      (data->targets_num + 1) * sizeof (*data->targets));
+  if (tmp_targets == NULL)
+  {
+    ERROR ("Target `shard': realloc failed.");
+    return (-1);
+  }
+  data->targets = tmp_targets;
+
+  tmp_weights = realloc (data->weights,
+      (data->targets_num + 1) * sizeof (*data->weights));
+  if (tmp_weights == NULL)
+  {
+    ERROR ("Target `shard': realloc failed.");
+    return (-1);
+  }
+  data->weights = tmp_weights;
+
+  plugin_write_ref_init (data->targets + data->targets_num,
+      ci->values[0].value.string);
+  data->weights[data->targets_num] = weight;
+  data->targets_num++;
+
+  return (0);
+} /* }}} int ts_config_add_plugin */
+
+static int ts_config_hash_by (ts_data_t *data, /* {{{ */
+    const oconfig_item_t *ci)
+{
+  int i;
+
+  if (ci->values_num < 1)
+  {
+    ERROR ("Target `shard': The `HashBy' option requires at least one "
+        "argument.");
+    return (-1);
+  }
+
+  data->fields = 0;
+  for (i = 0; i < ci->values_num; i++)
+  {
+    const char *field;
+
+    if (ci->values[i].type != OCONFIG_TYPE_STRING)
+    {
+      ERROR ("Target `shard': The `HashBy' option accepts only string "
+          "arguments.");
+      return (-1);
+    }
+    field = ci->values[i].value.string;
+
+    if (strcasecmp ("Host", field) == 0)
+      data->fields |= TS_FIELD_HOST;
+    else if (strcasecmp ("Plugin", field) == 0)
+      data->fields |= TS_FIELD_PLUGIN;
+    else if (strcasecmp ("PluginInstance", field) == 0)
+      data->fields |= TS_FIELD_PLUGIN_INSTANCE;
+    else if (strcasecmp ("Type", field) == 0)
+      data->fields |= TS_FIELD_TYPE;
+    else if (strcasecmp ("TypeInstance", field) == 0)
+      data->fields |= TS_FIELD_TYPE_INSTANCE;
+    else
+    {
+      ERROR ("Target `shard': Unknown identifier field `%s'. Use one of "
+          "`Host', `Plugin', `PluginInstance', `Type' and `TypeInstance'.",
+          field);
+      return (-1);
+    }
+  }
+
+  return (0);
+} /* }}} int ts_config_hash_by */
+
+/* Places the points of all targets on the ring. */
+static int ts_build_ring (ts_data_t *data) /* {{{ */
+{
+  size_t points_num = 0;
+  size_t i;
+
+  for (i = 0; i < data->targets_num; i++)
+  {
+    size_t n = (size_t) (data->weights[i] * TS_POINTS_PER_WEIGHT + .5);
+    points_num += (n > 0) ? n : 1;
+  }
+
+  data->points = calloc (points_num, sizeof (*data->points));
+  if (data->points == NULL)
+  {
+    ERROR ("Target `shard': calloc failed.");
+    return (-1);
+  }
+
+  data->points_num = 0;
+  for (i = 0; i < data->targets_num; i++)
+  {
+    size_t n = (size_t) (data->weights[i] * TS_POINTS_PER_WEIGHT + .5);
+    uint64_t name_hash = plugin_hash_string (data->targets[i].name);
+    size_t j;
+
+    if (n == 0)
+      n = 1;
+
+    /* A target's points only depend on its name, so they stay where they
+     * are when other targets are added or removed, and raising its weight
+     * adds points without moving the existing ones. */
+    for (j = 0; j < n; j++)
+    {
+      ts_point_t *p = data->points + data->points_num;
+
+      p->hash = ts_mix (name_hash ^ ts_mix ((uint64_t) j + 1));
+      p->name_hash = name_hash;
+      p->target = i;
+      data->points_num++;
+    }
+  }
+
+  qsort (data->points, data->points_num, sizeof (*data->points),
+      ts_point_compare);
+
+  return (0);
+} /* }}} int ts_build_ring */
+
+static int ts_destroy (void **user_data) /* {{{ */
+{
+  ts_data_t *data;
+
+  if ((user_data == NULL) || (*user_data == NULL))
+    return (0);
+
+  data = *user_data;
+  sfree (data->targets);
+  sfree (data->weights);
+  sfree (data->points);
+  sfree (data);
+  *user_data = NULL;
+
+  return (0);
+} /* }}} int ts_destroy */
+
+static int ts_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
+{
+  ts_data_t *data;
+  int status = 0;
+  int i;
+
+  data = calloc (1, sizeof (*data));
+  if (data == NULL)
+  {
+    ERROR ("ts_create: calloc failed.");
+    return (-ENOMEM);
+  }
+  data->fields = TS_FIELD_ALL;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp ("Plugin", child->key) == 0)
+      status = ts_config_add_plugin (data, child);
+    else if (strcasecmp ("HashBy", child->key) == 0)
+      status = ts_config_hash_by (data, child);
+    else
+    {
+      ERROR ("Target `shard': The `%s' configuration option is not "
+          "understood and will be ignored.", child->key);
+      status = 0;
+    }
+
+    if (status != 0)
+      break;
+  }
+
+  if ((status == 0) && (data->targets_num == 0))
+  {
+    ERROR ("Target `shard': No `Plugin' has been configured.");
+    status = -1;
+  }
+
+  if (status == 0)
+    status = ts_build_ring (data);
+
+  if (status != 0)
+  {
+    ts_destroy ((void *) &data);
+    return (-1);
+  }
+
+  *user_data = data;
+  return (0);
+} /* }}} int ts_create */
+
+static int ts_invoke (const data_set_t *ds, value_list_t *vl, /* {{{ */
+    notification_meta_t __attribute__((unused)) **meta, void **user_data)
+{
+  ts_data_t *data;
+  uint64_t hash;
+  size_t lo;
+  size_t hi;
+  size_t target;
+  int status;
+
+  if ((ds == NULL) || (vl == NULL) || (user_data == NULL))
+    return (-EINVAL);
+
+  data = *user_data;
+  if (data == NULL)
+  {
+    ERROR ("Target `shard': Invoke: `data' is NULL.");
+    return (-EINVAL);
+  }
+
+  hash = ts_hash_vl (data, vl);
+
+  /* The first point at or after "hash", wrapping around to the first. */
+  lo = 0;
+  hi = data->points_num;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (data->points[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo >= data->points_num)
+    lo = 0;
+  target = data->points[lo].target;
+
+  status = plugin_write_ref (data->targets + target, ds, vl);
+  if (status != 0)
+    INFO ("Target `shard': Dispatching value to the `%s' plugin failed "
+        "with status %i.", data->targets[target].name, status);
+
+  return (FC_TARGET_CONTINUE);
+} /* }}} int ts_invoke */
+
+void module_register (void)
+{
+  target_proc_t tproc;
+
+  memset (&tproc, 0, sizeof (tproc));
+  tproc.create  = ts_create;
+  tproc.destroy = ts_destroy;
+  tproc.invoke  = ts_invoke;
+  fc_register_target ("shard", tproc);
+} /* module_register */
+
+/* vim: set sw=2 sts=2 tw=78 et fdm=marker : */
@@ -95,6 +95,12 @@ static int v5_interface (const data_set_t *ds, value_list_t *vl) /* {{{ */
   if ((vl->plugin_instance[0] != 0) || (vl->type_instance[0] == 0))
     return (FC_TARGET_CONTINUE);
 
+  if (plugin_value_list_make_writable (vl) != 0)
+  {
+    ERROR ("Target `v5upgrade': Copying the value list failed.");
+    return (-ENOMEM);
+  }
+
   v5_swap_instances (vl);
   return (FC_TARGET_CONTINUE);
 } /* }}} int v5_interface */
@@ -268,12 +268,19 @@ static const char *config_keys[] =
 {
   "ListeningPorts",
   "LocalPort",
-  "RemotePort"
+  "RemotePort",
+  "AllPortsSummary"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static int port_collect_listening = 0;
+static int port_collect_total = 0;
+/* The connections of all ports, by state. */
+static uint32_t count_total[TCP_STATE_MAX + 1];
 static port_entry_t *port_list_head = NULL;
+/* Indexes the entries of "port_list_head" by port number, so that looking up
+ * the ports of a connection doesn't depend on the number of ports. */
+static port_entry_t *port_table[65536];
 
 #if KERNEL_LINUX
 static uint32_t sequence_number = 0;
@@ -330,10 +337,36 @@ static void conn_submit_port_entry (port_entry_t *pe)
   }
 } /* void conn_submit */
 
+static void conn_submit_port_total (void)
+{
+  value_t values[1];
+  value_list_t vl = VALUE_LIST_INIT;
+  int i;
+
+  vl.values = values;
+  vl.values_len = 1;
+  sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+  sstrncpy (vl.plugin, "tcpconns", sizeof (vl.plugin));
+  sstrncpy (vl.plugin_instance, "all", sizeof (vl.plugin_instance));
+  sstrncpy (vl.type, "tcp_connections", sizeof (vl.type));
+
+  for (i = 1; i <= TCP_STATE_MAX; i++)
+  {
+    vl.values[0].gauge = count_total[i];
+
+    sstrncpy (vl.type_instance, tcp_state[i], sizeof (vl.type_instance));
+
+    plugin_dispatch_values (&vl);
+  }
+} /* void conn_submit_port_total */
+
 static void conn_submit_all (void)
 {
   port_entry_t *pe;
 
+  if (port_collect_total)
+    conn_submit_port_total ();
+
   for (pe = port_list_head; pe != NULL; pe = pe->next)
     conn_submit_port_entry (pe);
 } /* void conn_submit_all */
@@ -342,13 +375,7 @@ static port_entry_t *conn_get_port_entry (uint16_t port, int create)
 {
   port_entry_t *ret;
 
-  ret = port_list_head;
-  while (ret != NULL)
-  {
-    if (ret->port == port)
-      break;
-    ret = ret->next;
-  }
+  ret = port_table[port];
 
   if ((ret == NULL) && (create != 0))
   {
@@ -360,6 +387,7 @@ static port_entry_t *conn_get_port_entry (uint16_t port, int create)
     ret->port = port;
     ret->next = port_list_head;
     port_list_head = ret;
+    port_table[port] = ret;
   }
 
   return (ret);
@@ -372,6 +400,8 @@ static void conn_reset_port_entry (void)
   port_entry_t *prev = NULL;
   port_entry_t *pe = port_list_head;
 
+  memset (count_total, '\0', sizeof (count_total));
+
   while (pe != NULL)
   {
     /* If this entry was created while reading the files (ant not when handling
@@ -390,6 +420,7 @@ static void conn_reset_port_entry (void)
       else
 	prev->next = next;
 
+      port_table[pe->port] = NULL;
       sfree (pe);
       pe = next;
 
@@ -400,6 +431,7 @@ static void conn_reset_port_entry (void)
     memset (pe->count_remote, '\0', sizeof (pe->count_remote));
     pe->flags &= ~PORT_IS_LISTENING;
 
+    prev = pe;
     pe = pe->next;
   }
 } /* void conn_reset_port_entry */
@@ -419,6 +451,8 @@ static int conn_handle_ports (uint16_t port_local, uint16_t port_remote, uint8_t
     return (-1);
   }
 
+  count_total[state]++;
+
   /* Listening sockets */
   if ((state == TCP_STATE_LISTEN) && (port_collect_listening != 0))
   {
@@ -452,7 +486,9 @@ static int conn_read_netlink (void)
   struct msghdr msg;
   struct iovec iov;
   struct inet_diag_msg *r;
-  char buf[8192];
+  /* Large enough for the kernel to put many sockets into each message of the
+   * dump, which saves system calls on hosts with many connections. */
+  char buf[65536];
 
   /* If this fails, it's likely a permission problem. We'll fall back to
    * reading this information from files below. */
@@ -691,6 +727,13 @@ static int conn_config (const char *key, const char *value)
       else
 	pe->flags |= PORT_COLLECT_REMOTE;
   }
+  else if (strcasecmp (key, "AllPortsSummary") == 0)
+  {
+    if (IS_TRUE (value))
+      port_collect_total = 1;
+    else
+      port_collect_total = 0;
+  }
   else
   {
     return (-1);
@@ -702,7 +745,7 @@ static int conn_config (const char *key, const char *value)
 #if KERNEL_LINUX
 static int conn_init (void)
 {
-  if (port_list_head == NULL)
+  if ((port_list_head == NULL) && (port_collect_total == 0))
     port_collect_listening = 1;
 
   return (0);
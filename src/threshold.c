@@ -26,7 +26,7 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
-#include "utils_avltree.h"
+#include "utils_htable.h"
 #include "utils_cache.h"
 
 #include <assert.h>
@@ -57,21 +57,133 @@ typedef struct threshold_s
   int hits;
   struct threshold_s *next;
 } threshold_t;
+
+/* All thresholds configured for one type, most specific first. */
+typedef struct threshold_index_s
+{
+  threshold_t **thresholds;
+  size_t thresholds_num;
+} threshold_index_t;
+
+/* One complete set of thresholds. A reload builds a new set and replaces the
+ * current one. */
+typedef struct threshold_set_s
+{
+  c_htable_t *tree;
+  /* Maps types to threshold_index_t, used by "threshold_search". */
+  c_htable_t *index;
+} threshold_set_t;
+
+/* A value waiting to be checked by an evaluation thread: its identifier and
+ * the rates read when it was written. Types with more data sources are
+ * checked by the write thread. */
+#define UT_RECORD_VALUES 8
+typedef struct ut_record_s
+{
+  const data_set_t *ds;
+  /* Identifier, time and interval only. */
+  value_list_t vl;
+  gauge_t rates[UT_RECORD_VALUES];
+} ut_record_t;
+
+/* The records of one evaluation thread, a ring of "size" entries. The
+ * records of a series always go to the same thread, so they are checked in
+ * order. */
+typedef struct ut_queue_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  cond_records;
+  pthread_cond_t  cond_space;
+  ut_record_t    *records;
+  size_t          size;
+  size_t          head;
+  size_t          len;
+  _Bool           stop;
+  pthread_t       thread;
+} ut_queue_t;
+
+/* Maximum number of records an evaluation thread takes at once. */
+#define UT_BATCH_SIZE 64
 /* }}} */
 
 /*
  * Private (static) variables
  * {{{ */
-static c_avl_tree_t   *threshold_tree = NULL;
+static threshold_set_t *thresholds = NULL;
+/* The set replaced by the last reload. The callbacks may still use
+ * thresholds they have looked up before, so it is freed by the next
+ * reload. */
+static threshold_set_t *thresholds_retired = NULL;
 static pthread_mutex_t threshold_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Bool threshold_callbacks_registered = 0;
+
+/* Evaluation threads, see ut_enqueue(). With zero threads, the write threads
+ * check the thresholds themselves. */
+static int ut_threads_num = 0;
+static size_t ut_queue_length = 4096;
+static ut_queue_t *ut_queues = NULL;
+static size_t ut_queues_num = 0;
 /* }}} */
 
 /*
  * Threshold management
  * ====================
  * The following functions add, delete, search, etc. configured thresholds to
- * the underlying AVL trees.
+ * the underlying hash tables.
  */
+static threshold_set_t *threshold_set_create (void)
+{ /* {{{ */
+  threshold_set_t *ts;
+
+  ts = calloc (1, sizeof (*ts));
+  if (ts == NULL)
+    return (NULL);
+
+  ts->tree = c_htable_create ();
+  if (ts->tree == NULL)
+  {
+    sfree (ts);
+    return (NULL);
+  }
+
+  return (ts);
+} /* }}} threshold_set_t *threshold_set_create */
+
+static void threshold_set_destroy (threshold_set_t *ts)
+{ /* {{{ */
+  void *key;
+  void *value;
+
+  if (ts == NULL)
+    return;
+
+  while (c_htable_pick (ts->tree, &key, &value) == 0)
+  {
+    threshold_t *th = value;
+
+    while (th != NULL)
+    {
+      threshold_t *next = th->next;
+      sfree (th);
+      th = next;
+    }
+    sfree (key);
+  }
+  c_htable_destroy (ts->tree);
+
+  while (c_htable_pick (ts->index, &key, &value) == 0)
+  {
+    threshold_index_t *ti = value;
+
+    sfree (ti->thresholds);
+    sfree (ti);
+    sfree (key);
+  }
+  c_htable_destroy (ts->index);
+
+  sfree (ts);
+} /* }}} void threshold_set_destroy */
+
 /*
  * threshold_t *threshold_get
  *
@@ -79,8 +191,8 @@ static pthread_mutex_t threshold_lock = PTHREAD_MUTEX_INITIALIZER;
  * matching a value_list_t, see "threshold_search" below. Returns NULL if the
  * specified threshold doesn't exist.
  */
-static threshold_t *threshold_get (const char *hostname,
-    const char *plugin, const char *plugin_instance,
+static threshold_t *threshold_get (threshold_set_t *ts,
+    const char *hostname, const char *plugin, const char *plugin_instance,
     const char *type, const char *type_instance)
 { /* {{{ */
   char name[6 * DATA_MAX_NAME_LEN];
@@ -92,20 +204,101 @@ static threshold_t *threshold_get (const char *hostname,
       (type == NULL) ? "" : type, type_instance);
   name[sizeof (name) - 1] = '\0';
 
-  if (c_avl_get (threshold_tree, name, (void *) &th) == 0)
+  if (c_htable_get (ts->tree, name, (void *) &th) == 0)
     return (th);
   else
     return (NULL);
 } /* }}} threshold_t *threshold_get */
 
+/*
+ * int threshold_specificity
+ *
+ * Ranks thresholds in the order "threshold_search" has to try them: a
+ * matching host beats a matching plugin, which beats a matching plugin
+ * instance, which beats a matching type instance.
+ */
+static int threshold_specificity (const threshold_t *th)
+{ /* {{{ */
+  int specificity = 0;
+
+  if (th->host[0] != 0)
+    specificity |= 0x08;
+  if (th->plugin[0] != 0)
+    specificity |= 0x04;
+  if (th->plugin_instance[0] != 0)
+    specificity |= 0x02;
+  if (th->type_instance[0] != 0)
+    specificity |= 0x01;
+
+  return (specificity);
+} /* }}} int threshold_specificity */
+
+/*
+ * int threshold_index_add
+ *
+ * Adds the first threshold of a new "tree" entry to the index of its type.
+ * Must be called with "threshold_lock" held.
+ */
+static int threshold_index_add (threshold_set_t *ts, threshold_t *th)
+{ /* {{{ */
+  threshold_index_t *ti = NULL;
+  threshold_t **tmp;
+  size_t i;
+  int specificity;
+
+  if (ts->index == NULL)
+  {
+    ts->index = c_htable_create ();
+    if (ts->index == NULL)
+      return (-1);
+  }
+
+  if (c_htable_get (ts->index, th->type, (void *) &ti) != 0)
+  {
+    char *type_copy;
+
+    ti = calloc (1, sizeof (*ti));
+    type_copy = strdup (th->type);
+    if ((ti == NULL) || (type_copy == NULL)
+        || (c_htable_insert (ts->index, type_copy, ti) != 0))
+    {
+      ERROR ("threshold_index_add: Adding type `%s' failed.", th->type);
+      sfree (ti);
+      sfree (type_copy);
+      return (-1);
+    }
+  }
+
+  tmp = realloc (ti->thresholds,
+      (ti->thresholds_num + 1) * sizeof (*ti->thresholds));
+  if (tmp == NULL)
+  {
+    ERROR ("threshold_index_add: realloc failed.");
+    return (-1);
+  }
+  ti->thresholds = tmp;
+
+  specificity = threshold_specificity (th);
+  for (i = ti->thresholds_num; i > 0; i--)
+  {
+    if (threshold_specificity (ti->thresholds[i - 1]) >= specificity)
+      break;
+    ti->thresholds[i] = ti->thresholds[i - 1];
+  }
+  ti->thresholds[i] = th;
+  ti->thresholds_num++;
+
+  return (0);
+} /* }}} int threshold_index_add */
+
 /*
  * int ut_threshold_add
  *
- * Adds a threshold configuration to the list of thresholds. The threshold_t
- * structure is copied and may be destroyed after this call. Returns zero on
- * success, non-zero otherwise.
+ * Adds a threshold configuration to the set "ts". The threshold_t structure is
+ * copied and may be destroyed after this call. Returns zero on success,
+ * non-zero otherwise.
  */
-static int ut_threshold_add (const threshold_t *th)
+static int ut_threshold_add (threshold_set_t *ts, const threshold_t *th)
 { /* {{{ */
   char name[6 * DATA_MAX_NAME_LEN];
   char *name_copy;
@@ -142,7 +335,7 @@ static int ut_threshold_add (const threshold_t *th)
 
   pthread_mutex_lock (&threshold_lock);
 
-  th_ptr = threshold_get (th->host, th->plugin, th->plugin_instance,
+  th_ptr = threshold_get (ts, th->host, th->plugin, th->plugin_instance,
       th->type, th->type_instance);
 
   while ((th_ptr != NULL) && (th_ptr->next != NULL))
@@ -150,7 +343,16 @@ static int ut_threshold_add (const threshold_t *th)
 
   if (th_ptr == NULL) /* no such threshold yet */
   {
-    status = c_avl_insert (threshold_tree, name_copy, th_copy);
+    status = c_htable_insert (ts->tree, name_copy, th_copy);
+    if (status == 0)
+    {
+      status = threshold_index_add (ts, th_copy);
+      if (status != 0)
+      {
+        c_htable_remove (ts->tree, name, NULL, NULL);
+        /* name_copy is freed below */
+      }
+    }
   }
   else /* th_ptr points to the last threshold in the list */
   {
@@ -163,7 +365,7 @@ static int ut_threshold_add (const threshold_t *th)
 
   if (status != 0)
   {
-    ERROR ("ut_threshold_add: c_avl_insert (%s) failed.", name);
+    ERROR ("ut_threshold_add: c_htable_insert (%s) failed.", name);
     sfree (name_copy);
     sfree (th_copy);
   }
@@ -171,54 +373,41 @@ static int ut_threshold_add (const threshold_t *th)
   return (status);
 } /* }}} int ut_threshold_add */
 
-/* 
+/*
  * threshold_t *threshold_search
  *
  * Searches for a threshold configuration using all the possible variations of
- * "Host", "Plugin" and "Type" blocks. Returns NULL if no threshold could be
- * found.
- * XXX: This is likely the least efficient function in collectd.
+ * "Host", "Plugin" and "Type" blocks. The thresholds of the value's type are
+ * sorted by specificity, so the first one matching is the most specific one.
+ * Returns NULL if no threshold could be found. Must be called with
+ * "threshold_lock" held.
  */
 static threshold_t *threshold_search (const value_list_t *vl)
 { /* {{{ */
-  threshold_t *th;
+  threshold_index_t *ti = NULL;
+  size_t i;
+
+  if ((thresholds == NULL) || (thresholds->index == NULL)
+      || (c_htable_get (thresholds->index, vl->type, (void *) &ti) != 0))
+    return (NULL);
+
+  for (i = 0; i < ti->thresholds_num; i++)
+  {
+    threshold_t *th = ti->thresholds[i];
+
+    if ((th->host[0] != 0) && (strcmp (th->host, vl->host) != 0))
+      continue;
+    if ((th->plugin[0] != 0) && (strcmp (th->plugin, vl->plugin) != 0))
+      continue;
+    if ((th->plugin_instance[0] != 0)
+        && (strcmp (th->plugin_instance, vl->plugin_instance) != 0))
+      continue;
+    if ((th->type_instance[0] != 0)
+        && (strcmp (th->type_instance, vl->type_instance) != 0))
+      continue;
 
-  if ((th = threshold_get (vl->host, vl->plugin, vl->plugin_instance,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, vl->plugin_instance,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, "", NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, "", NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, vl->plugin_instance,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, vl->plugin_instance,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", "", NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", "", NULL,
-	  vl->type, NULL)) != NULL)
     return (th);
+  }
 
   return (NULL);
 } /* }}} threshold_t *threshold_search */
@@ -327,7 +516,8 @@ static int ut_config_type_hysteresis (threshold_t *th, oconfig_item_t *ci)
   return (0);
 } /* int ut_config_type_hysteresis */
 
-static int ut_config_type (const threshold_t *th_orig, oconfig_item_t *ci)
+static int ut_config_type (threshold_set_t *ts, const threshold_t *th_orig,
+    oconfig_item_t *ci)
 {
   int i;
   threshold_t th;
@@ -400,7 +590,7 @@ static int ut_config_type (const threshold_t *th_orig, oconfig_item_t *ci)
 
   if (status == 0)
   {
-    status = ut_threshold_add (&th);
+    status = ut_threshold_add (ts, &th);
   }
 
   return (status);
@@ -422,7 +612,8 @@ static int ut_config_plugin_instance (threshold_t *th, oconfig_item_t *ci)
   return (0);
 } /* int ut_config_plugin_instance */
 
-static int ut_config_plugin (const threshold_t *th_orig, oconfig_item_t *ci)
+static int ut_config_plugin (threshold_set_t *ts, const threshold_t *th_orig,
+    oconfig_item_t *ci)
 {
   int i;
   threshold_t th;
@@ -452,7 +643,7 @@ static int ut_config_plugin (const threshold_t *th_orig, oconfig_item_t *ci)
     status = 0;
 
     if (strcasecmp ("Type", option->key) == 0)
-      status = ut_config_type (&th, option);
+      status = ut_config_type (ts, &th, option);
     else if (strcasecmp ("Instance", option->key) == 0)
       status = ut_config_plugin_instance (&th, option);
     else
@@ -469,7 +660,8 @@ static int ut_config_plugin (const threshold_t *th_orig, oconfig_item_t *ci)
   return (status);
 } /* int ut_config_plugin */
 
-static int ut_config_host (const threshold_t *th_orig, oconfig_item_t *ci)
+static int ut_config_host (threshold_set_t *ts, const threshold_t *th_orig,
+    oconfig_item_t *ci)
 {
   int i;
   threshold_t th;
@@ -499,9 +691,9 @@ static int ut_config_host (const threshold_t *th_orig, oconfig_item_t *ci)
     status = 0;
 
     if (strcasecmp ("Type", option->key) == 0)
-      status = ut_config_type (&th, option);
+      status = ut_config_type (ts, &th, option);
     else if (strcasecmp ("Plugin", option->key) == 0)
-      status = ut_config_plugin (&th, option);
+      status = ut_config_plugin (ts, &th, option);
     else
     {
       WARNING ("threshold values: Option `%s' not allowed inside a `Host' "
@@ -521,46 +713,33 @@ static int ut_config_host (const threshold_t *th_orig, oconfig_item_t *ci)
 /* }}} */
 
 /*
- * int ut_report_state
+ * _Bool ut_update_state
  *
- * Checks if the `state' differs from the old state and creates a notification
- * if appropriate.
+ * Updates the hit counter and the state of the cache entry "h" refers to.
+ * Returns true if the `state' differs from the old state or a notification
+ * should be sent anyway, see ut_report_state() below.
  * Does not fail.
  */
-static int ut_report_state (const data_set_t *ds,
-    const value_list_t *vl,
-    const threshold_t *th,
-    const gauge_t *values,
-    int ds_index,
-    int state)
+static _Bool ut_update_state (const threshold_t *th, int state, int state_old,
+    uc_handle_t *h)
 { /* {{{ */
-  int state_old;
-  notification_t n;
-
-  char *buf;
-  size_t bufsize;
-
-  int status;
-
   /* Check if hits matched */
   if ( (th->hits != 0) )
   {
-    int hits = uc_get_hits(ds,vl);
+    int hits = uc_handle_get_hits (h);
     /* STATE_OKAY resets hits unless PERSIST_OK flag is set. Hits resets if
      * threshold is hit. */
     if ( ( (state == STATE_OKAY) && ((th->flags & UT_FLAG_PERSIST_OK) == 0) ) || (hits > th->hits) )
     {
-        DEBUG("ut_report_state: reset uc_get_hits = 0");
-        uc_set_hits(ds,vl,0); /* reset hit counter and notify */
+        DEBUG("ut_update_state: reset hits = 0");
+        uc_handle_set_hits (h, 0); /* reset hit counter and notify */
     } else {
-      DEBUG("ut_report_state: th->hits = %d, uc_get_hits = %d",th->hits,uc_get_hits(ds,vl));
-      (void) uc_inc_hits(ds,vl,1); /* increase hit counter */
+      DEBUG("ut_update_state: th->hits = %d, hits = %d", th->hits, hits);
+      uc_handle_set_hits (h, hits + 1); /* increase hit counter */
       return (0);
     }
   } /* end check hits */
 
-  state_old = uc_get_state (ds, vl);
-
   /* If the state didn't change, report if `persistent' is specified. If the
    * state is `okay', then only report if `persist_ok` flag is set. */
   if (state == state_old)
@@ -572,7 +751,32 @@ static int ut_report_state (const data_set_t *ds,
   }
 
   if (state != state_old)
-    uc_set_state (ds, vl, state);
+    uc_handle_set_state (h, state);
+
+  return (1);
+} /* }}} _Bool ut_update_state */
+
+/*
+ * int ut_report_state
+ *
+ * Creates a notification about the `state' of a value, which has been
+ * `state_old' before.
+ * Does not fail.
+ */
+static int ut_report_state (const data_set_t *ds,
+    const value_list_t *vl,
+    const threshold_t *th,
+    const gauge_t *values,
+    int ds_index,
+    int state,
+    int state_old)
+{ /* {{{ */
+  notification_t n;
+
+  char *buf;
+  size_t bufsize;
+
+  int status;
 
   NOTIFICATION_INIT_VL (&n, vl);
 
@@ -723,12 +927,12 @@ static int ut_check_one_data_source (const data_set_t *ds,
     const value_list_t __attribute__((unused)) *vl,
     const threshold_t *th,
     const gauge_t *values,
-    int ds_index)
+    int ds_index,
+    int prev_state)
 { /* {{{ */
   const char *ds_name;
   int is_warning = 0;
   int is_failure = 0;
-  int prev_state = STATE_OKAY;
 
   /* check if this threshold applies to this data source */
   if (ds != NULL)
@@ -747,7 +951,7 @@ static int ut_check_one_data_source (const data_set_t *ds,
 
   /* XXX: This is an experimental code, not optimized, not fast, not reliable,
    * and probably, do not work as you expect. Enjoy! :D */
-  if ( (th->hysteresis > 0) && ((prev_state = uc_get_state(ds,vl)) != STATE_OKAY) )
+  if ( (th->hysteresis > 0) && (prev_state != STATE_OKAY) )
   {
     switch(prev_state)
     {
@@ -796,6 +1000,7 @@ static int ut_check_one_threshold (const data_set_t *ds,
     const value_list_t *vl,
     const threshold_t *th,
     const gauge_t *values,
+    int prev_state,
     int *ret_ds_index)
 { /* {{{ */
   int ret = -1;
@@ -843,7 +1048,8 @@ static int ut_check_one_threshold (const data_set_t *ds,
   {
     int status;
 
-    status = ut_check_one_data_source (ds, vl, th, values_copy, i);
+    status = ut_check_one_data_source (ds, vl, th, values_copy, i,
+        prev_state);
     if (ret < status)
     {
       ret = status;
@@ -858,51 +1064,50 @@ static int ut_check_one_threshold (const data_set_t *ds,
 } /* }}} int ut_check_one_threshold */
 
 /*
- * int ut_check_threshold
+ * int ut_evaluate
  *
- * Gets a list of matching thresholds and searches for the worst status by one
- * of the thresholds. Then reports that status using the ut_report_state
- * function above. 
- * Returns zero on success and if no threshold has been configured. Returns
- * less than zero on failure.
+ * Checks "vl" against "th" and the thresholds following it, and reports the
+ * worst status using the ut_report_state function above. If "rates" is NULL,
+ * the rates are read from the cache. The state and hit counter of the value
+ * are read and updated while the cache entry is held, so that no other
+ * thread can change them in between.
+ * Returns less than zero on failure.
  */
-static int ut_check_threshold (const data_set_t *ds, const value_list_t *vl,
-    __attribute__((unused)) user_data_t *ud)
+static int ut_evaluate (const data_set_t *ds, const value_list_t *vl,
+    threshold_t *th, const gauge_t *rates)
 { /* {{{ */
-  threshold_t *th;
-  gauge_t *values;
+  gauge_t values[ds->ds_num];
+  uc_handle_t h;
+  int state_old;
+  _Bool report;
   int status;
 
   int worst_state = -1;
   threshold_t *worst_th = NULL;
   int worst_ds_index = -1;
 
-  if (threshold_tree == NULL)
+  if (uc_get_handle (vl, &h) != 0)
     return (0);
 
-  /* Is this lock really necessary? So far, thresholds are only inserted at
-   * startup. -octo */
-  pthread_mutex_lock (&threshold_lock);
-  th = threshold_search (vl);
-  pthread_mutex_unlock (&threshold_lock);
-  if (th == NULL)
-    return (0);
-
-  DEBUG ("ut_check_threshold: Found matching threshold(s)");
-
-  values = uc_get_rate (ds, vl);
-  if (values == NULL)
+  if (rates != NULL)
+    memcpy (values, rates, sizeof (values));
+  else if (uc_handle_get_rate (&h, values, (size_t) ds->ds_num) != 0)
+  {
+    uc_handle_release (&h);
     return (0);
+  }
+  state_old = uc_handle_get_state (&h);
 
   while (th != NULL)
   {
     int ds_index = -1;
 
-    status = ut_check_one_threshold (ds, vl, th, values, &ds_index);
+    status = ut_check_one_threshold (ds, vl, th, values, state_old,
+        &ds_index);
     if (status < 0)
     {
+      uc_handle_release (&h);
       ERROR ("ut_check_threshold: ut_check_one_threshold failed.");
-      sfree (values);
       return (-1);
     }
 
@@ -916,18 +1121,151 @@ static int ut_check_threshold (const data_set_t *ds, const value_list_t *vl,
     th = th->next;
   } /* while (th) */
 
+  report = ut_update_state (worst_th, worst_state, state_old, &h);
+  uc_handle_release (&h);
+
+  if (!report)
+    return (0);
+
+  /* Notifications are dispatched without holding the cache entry, because
+   * notification plugins may use the cache themselves. */
   status = ut_report_state (ds, vl, worst_th, values,
-      worst_ds_index, worst_state);
+      worst_ds_index, worst_state, state_old);
   if (status != 0)
   {
     ERROR ("ut_check_threshold: ut_report_state failed.");
-    sfree (values);
     return (-1);
   }
 
-  sfree (values);
+  return (0);
+} /* }}} int ut_evaluate */
+
+/* Takes up to UT_BATCH_SIZE records from the queue and checks them. The
+ * thresholds of the whole batch are looked up with one lock operation. */
+static void *ut_thread_main (void *arg)
+{ /* {{{ */
+  ut_queue_t *q = arg;
+  ut_record_t batch[UT_BATCH_SIZE];
+  threshold_t *th[UT_BATCH_SIZE];
+
+  pthread_mutex_lock (&q->lock);
+  while (!q->stop || (q->len > 0))
+  {
+    size_t num = 0;
+    size_t i;
+
+    if (q->len == 0)
+    {
+      pthread_cond_wait (&q->cond_records, &q->lock);
+      continue;
+    }
+
+    while ((num < UT_BATCH_SIZE) && (q->len > 0))
+    {
+      memcpy (batch + num, q->records + q->head, sizeof (batch[num]));
+      q->head = (q->head + 1) % q->size;
+      q->len--;
+      num++;
+    }
+    pthread_cond_broadcast (&q->cond_space);
+    pthread_mutex_unlock (&q->lock);
+
+    pthread_mutex_lock (&threshold_lock);
+    for (i = 0; i < num; i++)
+      th[i] = threshold_search (&batch[i].vl);
+    pthread_mutex_unlock (&threshold_lock);
+
+    for (i = 0; i < num; i++)
+      if (th[i] != NULL)
+        ut_evaluate (batch[i].ds, &batch[i].vl, th[i], batch[i].rates);
+
+    pthread_mutex_lock (&q->lock);
+  }
+  pthread_mutex_unlock (&q->lock);
+
+  return (NULL);
+} /* }}} void *ut_thread_main */
+
+/*
+ * int ut_enqueue
+ *
+ * Hands "vl" to the evaluation thread of its series, together with its rates.
+ * Waits while the thread's queue is full. Returns ENOENT if there are no
+ * evaluation threads (anymore).
+ */
+static int ut_enqueue (const data_set_t *ds, const value_list_t *vl)
+{ /* {{{ */
+  ut_queue_t *q;
+  ut_record_t *r;
+  gauge_t rates[UT_RECORD_VALUES];
+  uc_handle_t h;
+  int status;
+
+  if ((ut_queues_num == 0) || (ds->ds_num > UT_RECORD_VALUES))
+    return (ENOENT);
+
+  if (uc_get_handle (vl, &h) != 0)
+    return (0);
+  status = uc_handle_get_rate (&h, rates, (size_t) ds->ds_num);
+  uc_handle_release (&h);
+  if (status != 0)
+    return (0);
+
+  q = ut_queues + (plugin_hash_vl (vl) % ut_queues_num);
+
+  pthread_mutex_lock (&q->lock);
+  while (!q->stop && (q->len >= q->size))
+    pthread_cond_wait (&q->cond_space, &q->lock);
+  if (q->stop)
+  {
+    pthread_mutex_unlock (&q->lock);
+    return (ENOENT);
+  }
+
+  r = q->records + ((q->head + q->len) % q->size);
+  r->ds = ds;
+  memcpy (&r->vl, vl, sizeof (r->vl));
+  r->vl.values = NULL;
+  r->vl.values_len = 0;
+  r->vl.meta = NULL;
+  memcpy (r->rates, rates, sizeof (rates[0]) * ds->ds_num);
+  q->len++;
+
+  pthread_cond_signal (&q->cond_records);
+  pthread_mutex_unlock (&q->lock);
 
   return (0);
+} /* }}} int ut_enqueue */
+
+/*
+ * int ut_check_threshold
+ *
+ * Looks up the thresholds of "vl" and checks them, either right away or, if
+ * evaluation threads are configured, by handing the value to one of them.
+ * Returns zero on success and if no threshold has been configured. Returns
+ * less than zero on failure.
+ */
+static int ut_check_threshold (const data_set_t *ds, const value_list_t *vl,
+    __attribute__((unused)) user_data_t *ud)
+{ /* {{{ */
+  threshold_t *th;
+
+  if (thresholds == NULL)
+    return (0);
+
+  /* The lock protects against reloads replacing "thresholds". */
+  pthread_mutex_lock (&threshold_lock);
+  th = threshold_search (vl);
+  pthread_mutex_unlock (&threshold_lock);
+  if (th == NULL)
+    return (0);
+
+  DEBUG ("ut_check_threshold: Found matching threshold(s)");
+
+  if (ut_enqueue (ds, vl) != ENOENT)
+    return (0);
+
+  return (ut_evaluate (ds, vl, th, /* rates = */ NULL));
 } /* }}} int ut_check_threshold */
 
 /*
@@ -944,10 +1282,12 @@ static int ut_missing (const value_list_t *vl,
   notification_t n;
 
   /* dispatch notifications for "interesting" values only */
-  if (threshold_tree == NULL)
+  if (thresholds == NULL)
     return (0);
 
+  pthread_mutex_lock (&threshold_lock);
   th = threshold_search (vl);
+  pthread_mutex_unlock (&threshold_lock);
   if (th == NULL)
     return (0);
 
@@ -964,23 +1304,14 @@ static int ut_missing (const value_list_t *vl,
   return (0);
 } /* }}} int ut_missing */
 
-int ut_config (oconfig_item_t *ci)
+/* Adds the thresholds configured in "ci" to "ts". */
+static int ut_config_set (threshold_set_t *ts, oconfig_item_t *ci)
 { /* {{{ */
   int i;
   int status = 0;
 
   threshold_t th;
 
-  if (threshold_tree == NULL)
-  {
-    threshold_tree = c_avl_create ((void *) strcmp);
-    if (threshold_tree == NULL)
-    {
-      ERROR ("ut_config: c_avl_create failed.");
-      return (-1);
-    }
-  }
-
   memset (&th, '\0', sizeof (th));
   th.warning_min = NAN;
   th.warning_max = NAN;
@@ -997,11 +1328,28 @@ int ut_config (oconfig_item_t *ci)
     status = 0;
 
     if (strcasecmp ("Type", option->key) == 0)
-      status = ut_config_type (&th, option);
+      status = ut_config_type (ts, &th, option);
     else if (strcasecmp ("Plugin", option->key) == 0)
-      status = ut_config_plugin (&th, option);
+      status = ut_config_plugin (ts, &th, option);
     else if (strcasecmp ("Host", option->key) == 0)
-      status = ut_config_host (&th, option);
+      status = ut_config_host (ts, &th, option);
+    /* Only take effect on start-up, see ut_init(). */
+    else if (strcasecmp ("Threads", option->key) == 0)
+      status = cf_util_get_int (option, &ut_threads_num);
+    else if (strcasecmp ("QueueLength", option->key) == 0)
+    {
+      int tmp = 0;
+
+      status = cf_util_get_int (option, &tmp);
+      if ((status == 0) && (tmp < UT_BATCH_SIZE))
+      {
+        WARNING ("threshold plugin: `QueueLength' must be at least %i.",
+            UT_BATCH_SIZE);
+        status = -1;
+      }
+      else if (status == 0)
+        ut_queue_length = (size_t) tmp;
+    }
     else
     {
       WARNING ("threshold values: Option `%s' not allowed here.", option->key);
@@ -1012,19 +1360,163 @@ int ut_config (oconfig_item_t *ci)
       break;
   }
 
-  if (c_avl_size (threshold_tree) > 0) {
-    plugin_register_missing ("threshold", ut_missing,
-        /* user data = */ NULL);
-    plugin_register_write ("threshold", ut_check_threshold,
-        /* user data = */ NULL);
+  return (status);
+} /* }}} int ut_config_set */
+
+static void ut_register_callbacks (void)
+{ /* {{{ */
+  if (threshold_callbacks_registered
+      || (c_htable_size (thresholds->tree) == 0))
+    return;
+
+  plugin_register_missing ("threshold", ut_missing,
+      /* user data = */ NULL);
+  plugin_register_write ("threshold", ut_check_threshold,
+      /* user data = */ NULL);
+  threshold_callbacks_registered = 1;
+} /* }}} void ut_register_callbacks */
+
+int ut_config (oconfig_item_t *ci)
+{ /* {{{ */
+  int status;
+
+  if (thresholds == NULL)
+  {
+    thresholds = threshold_set_create ();
+    if (thresholds == NULL)
+    {
+      ERROR ("ut_config: threshold_set_create failed.");
+      return (-1);
+    }
   }
 
+  status = ut_config_set (thresholds, ci);
+  ut_register_callbacks ();
+
   return (status);
 } /* }}} int um_config */
 
+/* Builds a new set from the complete configuration and replaces the current
+ * one, unless the new configuration contains errors. The hit counters and
+ * states are stored in the value cache and are kept. */
+static int ut_reload (oconfig_item_t *ci)
+{ /* {{{ */
+  threshold_set_t *ts;
+  threshold_set_t *old;
+
+  ts = threshold_set_create ();
+  if (ts == NULL)
+  {
+    ERROR ("ut_reload: threshold_set_create failed.");
+    return (-1);
+  }
+
+  if (ut_config_set (ts, ci) != 0)
+  {
+    ERROR ("ut_reload: The new thresholds are invalid. Keeping the current "
+        "thresholds.");
+    threshold_set_destroy (ts);
+    return (-1);
+  }
+
+  pthread_mutex_lock (&threshold_lock);
+  old = thresholds;
+  thresholds = ts;
+  pthread_mutex_unlock (&threshold_lock);
+
+  threshold_set_destroy (thresholds_retired);
+  thresholds_retired = old;
+
+  ut_register_callbacks ();
+
+  INFO ("threshold plugin: Reloaded %i threshold(s).",
+      c_htable_size (ts->tree));
+  return (0);
+} /* }}} int ut_reload */
+
+/* Stops the evaluation threads once they have checked the queued values. */
+static int ut_shutdown (void)
+{ /* {{{ */
+  size_t i;
+
+  for (i = 0; i < ut_queues_num; i++)
+  {
+    ut_queue_t *q = ut_queues + i;
+
+    pthread_mutex_lock (&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast (&q->cond_records);
+    pthread_cond_broadcast (&q->cond_space);
+    pthread_mutex_unlock (&q->lock);
+  }
+
+  /* Write threads which find their queue stopped check the values
+   * themselves, so the queues can't be freed. */
+  for (i = 0; i < ut_queues_num; i++)
+    pthread_join (ut_queues[i].thread, /* retval = */ NULL);
+
+  return (0);
+} /* }}} int ut_shutdown */
+
+static int ut_init (void)
+{ /* {{{ */
+  size_t num;
+  size_t i;
+
+  if ((ut_threads_num <= 0) || (ut_queues != NULL))
+    return (0);
+
+  num = (size_t) ut_threads_num;
+  ut_queues = calloc (num, sizeof (*ut_queues));
+  if (ut_queues == NULL)
+  {
+    ERROR ("threshold plugin: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < num; i++)
+  {
+    ut_queue_t *q = ut_queues + i;
+    int status;
+
+    q->size = ut_queue_length;
+    q->records = calloc (q->size, sizeof (*q->records));
+    if (q->records == NULL)
+    {
+      ERROR ("threshold plugin: calloc failed.");
+      break;
+    }
+    pthread_mutex_init (&q->lock, /* attr = */ NULL);
+    pthread_cond_init (&q->cond_records, /* attr = */ NULL);
+    pthread_cond_init (&q->cond_space, /* attr = */ NULL);
+
+    status = plugin_thread_create (&q->thread, /* attr = */ NULL,
+        ut_thread_main, q);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("threshold plugin: Starting an evaluation thread failed: %s",
+          sstrerror (status, errbuf, sizeof (errbuf)));
+      sfree (q->records);
+      break;
+    }
+  }
+
+  /* Values are spread over the threads which could be started. */
+  ut_queues_num = i;
+  if (ut_queues_num < num)
+    WARNING ("threshold plugin: Started %zu of %zu evaluation threads.",
+        ut_queues_num, num);
+
+  return (0);
+} /* }}} int ut_init */
+
 void module_register (void)
 {
   plugin_register_complex_config ("threshold", ut_config);
+  plugin_register_reload_config ("threshold", ut_reload);
+  plugin_register_init ("threshold", ut_init);
+  plugin_register_shutdown ("threshold", ut_shutdown);
 }
 
 /* vim: set sw=2 ts=8 sts=2 tw=78 et fdm=marker : */
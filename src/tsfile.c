@@ -0,0 +1,1050 @@
+/**
+ * collectd - src/tsfile.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_htable.h"
+#include "utils_lock.h"
+
+#include <pthread.h>
+
+/*
+ * Values are kept in memory, compressed, until the time window of their
+ * chunk has passed. Then the chunk is appended to the data file of its host
+ * and window, "<DataDir>/<host>/<window start>.tsc", and a line describing it
+ * is appended to the index next to it, "<window start>.idx".
+ *
+ * A chunk starts with a header:
+ *   "TSC1", identifier length (16 bit), identifier, number of data sources
+ *   (8 bit), the type of each data source (8 bit each), time resolution
+ *   (64 bit, cdtime_t), number of samples (32 bit), payload length in bytes
+ *   (32 bit)
+ * All numbers are big endian. The payload is a bit stream, most significant
+ * bit first, compressed as described in "Gorilla: A Fast, Scalable, In-Memory
+ * Time Series Database" (Pelkonen et al., 2015):
+ *   - The first sample: the time (64 bit) and the raw value of each data
+ *     source (64 bit each).
+ *   - Each further sample: the delta of the time delta, then the XOR of each
+ *     value with its predecessor.
+ * Times are in units of the resolution; gauges are stored as IEEE 754
+ * doubles, the other types as 64 bit integers.
+ */
+
+#define TSF_MAGIC "TSC1"
+
+/* Retirement "age" which never matches; only ended windows are written. */
+#define TSF_WINDOW_ONLY ((cdtime_t) -1)
+
+/* A bit stream, written most significant bit first. */
+struct tsf_bits_s
+{
+  uint8_t *data;
+  size_t size;
+  size_t bits;
+};
+typedef struct tsf_bits_s tsf_bits_t;
+
+/* The chunk currently being built for one value list. */
+struct tsf_series_s
+{
+  char *identifier;
+  char host[DATA_MAX_NAME_LEN];
+
+  size_t values_num;
+  uint8_t *ds_types;
+
+  /* Start of the chunk's time window and the time the first value was
+   * added. */
+  cdtime_t window;
+  cdtime_t opened;
+
+  uint32_t count;
+  uint64_t time_first;
+  uint64_t time_last;
+  int64_t delta_last;
+
+  /* Per data source: the last value and the position of its meaningful
+   * bits. A leading count of 0xff means there is no previous block. */
+  uint64_t *value_last;
+  uint8_t *leading;
+  uint8_t *trailing;
+
+  tsf_bits_t bits;
+};
+typedef struct tsf_series_s tsf_series_t;
+
+/* A finished chunk waiting to be appended to its file. */
+struct tsf_chunk_s
+{
+  char host[DATA_MAX_NAME_LEN];
+  cdtime_t window;
+  char *identifier;
+
+  uint32_t count;
+  cdtime_t time_first;
+  cdtime_t time_last;
+
+  uint8_t *data;
+  size_t data_len;
+
+  struct tsf_chunk_s *next;
+};
+typedef struct tsf_chunk_s tsf_chunk_t;
+
+/*
+ * Private variables
+ */
+static char *datadir = NULL;
+static cdtime_t chunk_duration = 0;
+static cdtime_t resolution = 0;
+static cdtime_t cache_timeout = 0;
+static cdtime_t cache_flush_timeout = 0;
+
+static c_htable_t *cache = NULL;
+static c_mutex_t cache_lock = C_MUTEX_INITIALIZER ("tsfile-cache");
+static cdtime_t cache_flush_last = 0;
+static plugin_memory_t *cache_memory = NULL;
+
+static tsf_chunk_t *queue_head = NULL;
+static tsf_chunk_t *queue_tail = NULL;
+static c_mutex_t queue_lock = C_MUTEX_INITIALIZER ("tsfile-queue");
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t queue_thread;
+static _Bool queue_thread_running = 0;
+static _Bool do_shutdown = 0;
+
+/*
+ * Bit stream
+ */
+/* Makes sure `bits' more bits can be written without failing. */
+static int tsf_bits_reserve (tsf_bits_t *b, size_t bits) /* {{{ */
+{
+  size_t needed = (b->bits + bits + 7) / 8;
+  size_t size;
+  uint8_t *tmp;
+
+  if (needed <= b->size)
+    return (0);
+
+  size = (b->size > 0) ? b->size : 64;
+  while (size < needed)
+    size *= 2;
+
+  tmp = realloc (b->data, size);
+  if (tmp == NULL)
+    return (ENOMEM);
+  memset (tmp + b->size, 0, size - b->size);
+
+  plugin_memory_add (cache_memory, (int64_t) (size - b->size));
+  b->data = tmp;
+  b->size = size;
+
+  return (0);
+} /* }}} int tsf_bits_reserve */
+
+/* Appends the lowest `n' bits of `value'. Space must have been reserved. */
+static void tsf_bits_put (tsf_bits_t *b, uint64_t value, unsigned int n) /* {{{ */
+{
+  while (n > 0)
+  {
+    unsigned int avail = 8 - (unsigned int) (b->bits % 8);
+    unsigned int take = (n < avail) ? n : avail;
+    uint8_t part;
+
+    part = (uint8_t) ((value >> (n - take)) & ((1U << take) - 1));
+    b->data[b->bits / 8] |= (uint8_t) (part << (avail - take));
+
+    b->bits += take;
+    n -= take;
+  }
+} /* }}} void tsf_bits_put */
+
+static void tsf_bits_clear (tsf_bits_t *b) /* {{{ */
+{
+  if (b->data != NULL)
+    memset (b->data, 0, (b->bits + 7) / 8);
+  b->bits = 0;
+} /* }}} void tsf_bits_clear */
+
+/*
+ * Compression
+ */
+static uint64_t tsf_value_raw (uint8_t ds_type, value_t v) /* {{{ */
+{
+  uint64_t raw = 0;
+
+  switch (ds_type)
+  {
+    case DS_TYPE_GAUGE:
+      assert (sizeof (v.gauge) == sizeof (raw));
+      memcpy (&raw, &v.gauge, sizeof (raw));
+      break;
+    case DS_TYPE_COUNTER:
+      raw = (uint64_t) v.counter;
+      break;
+    case DS_TYPE_DERIVE:
+      raw = (uint64_t) v.derive;
+      break;
+    case DS_TYPE_ABSOLUTE:
+      raw = (uint64_t) v.absolute;
+      break;
+  }
+
+  return (raw);
+} /* }}} uint64_t tsf_value_raw */
+
+static unsigned int tsf_leading_zeros (uint64_t v) /* {{{ */
+{
+  unsigned int n = 0;
+
+  while ((n < 64) && ((v & (((uint64_t) 1) << 63)) == 0))
+  {
+    v <<= 1;
+    n++;
+  }
+
+  return (n);
+} /* }}} unsigned int tsf_leading_zeros */
+
+static unsigned int tsf_trailing_zeros (uint64_t v) /* {{{ */
+{
+  unsigned int n = 0;
+
+  while ((n < 64) && ((v & 1) == 0))
+  {
+    v >>= 1;
+    n++;
+  }
+
+  return (n);
+} /* }}} unsigned int tsf_trailing_zeros */
+
+static void tsf_put_dod (tsf_bits_t *b, int64_t dod) /* {{{ */
+{
+  if (dod == 0)
+    tsf_bits_put (b, 0x00, 1);
+  else if ((dod >= -63) && (dod <= 64))
+  {
+    tsf_bits_put (b, 0x02, 2);
+    tsf_bits_put (b, (uint64_t) (dod + 63), 7);
+  }
+  else if ((dod >= -255) && (dod <= 256))
+  {
+    tsf_bits_put (b, 0x06, 3);
+    tsf_bits_put (b, (uint64_t) (dod + 255), 9);
+  }
+  else if ((dod >= -2047) && (dod <= 2048))
+  {
+    tsf_bits_put (b, 0x0e, 4);
+    tsf_bits_put (b, (uint64_t) (dod + 2047), 12);
+  }
+  else
+  {
+    /* Fits because a window is at most 2^31 units long. */
+    tsf_bits_put (b, 0x0f, 4);
+    tsf_bits_put (b, (uint64_t) dod, 32);
+  }
+} /* }}} void tsf_put_dod */
+
+static void tsf_put_value (tsf_series_t *s, size_t i, uint64_t raw) /* {{{ */
+{
+  uint64_t xor = raw ^ s->value_last[i];
+  unsigned int leading;
+  unsigned int trailing;
+
+  s->value_last[i] = raw;
+
+  if (xor == 0)
+  {
+    tsf_bits_put (&s->bits, 0x00, 1);
+    return;
+  }
+
+  leading = tsf_leading_zeros (xor);
+  trailing = tsf_trailing_zeros (xor);
+  /* The count of leading zeros is stored in five bits. */
+  if (leading > 31)
+    leading = 31;
+
+  if ((s->leading[i] != 0xff)
+      && (leading >= s->leading[i]) && (trailing >= s->trailing[i]))
+  {
+    /* The meaningful bits fit into the previous block. */
+    unsigned int len = 64 - s->leading[i] - s->trailing[i];
+
+    tsf_bits_put (&s->bits, 0x02, 2);
+    tsf_bits_put (&s->bits, xor >> s->trailing[i], len);
+  }
+  else
+  {
+    unsigned int len = 64 - leading - trailing;
+
+    tsf_bits_put (&s->bits, 0x03, 2);
+    tsf_bits_put (&s->bits, leading, 5);
+    /* A length of 64 is stored as zero. */
+    tsf_bits_put (&s->bits, (len == 64) ? 0 : len, 6);
+    tsf_bits_put (&s->bits, xor >> trailing, len);
+
+    s->leading[i] = (uint8_t) leading;
+    s->trailing[i] = (uint8_t) trailing;
+  }
+} /* }}} void tsf_put_value */
+
+static int tsf_series_append (tsf_series_t *s, /* {{{ */
+    const value_list_t *vl)
+{
+  uint64_t t = (uint64_t) (vl->time / resolution);
+  size_t i;
+  int status;
+
+  /* The worst case: four prefix bits and 32 bits for the time, and 77 bits
+   * for each value. */
+  status = tsf_bits_reserve (&s->bits, 64 + 77 * s->values_num);
+  if (status != 0)
+    return (status);
+
+  if (s->count == 0)
+  {
+    tsf_bits_put (&s->bits, t, 64);
+    for (i = 0; i < s->values_num; i++)
+    {
+      uint64_t raw = tsf_value_raw (s->ds_types[i], vl->values[i]);
+
+      tsf_bits_put (&s->bits, raw, 64);
+      s->value_last[i] = raw;
+      s->leading[i] = 0xff;
+      s->trailing[i] = 0;
+    }
+
+    s->time_first = t;
+    s->delta_last = 0;
+    s->opened = cdtime_coarse ();
+  }
+  else
+  {
+    int64_t delta;
+
+    /* Two values within one unit of the resolution are fine, going back in
+     * time isn't. */
+    if (t < s->time_last)
+      return (EINVAL);
+
+    delta = (int64_t) (t - s->time_last);
+    tsf_put_dod (&s->bits, delta - s->delta_last);
+    for (i = 0; i < s->values_num; i++)
+      tsf_put_value (s, i,
+          tsf_value_raw (s->ds_types[i], vl->values[i]));
+
+    s->delta_last = delta;
+  }
+
+  s->time_last = t;
+  s->count++;
+
+  return (0);
+} /* }}} int tsf_series_append */
+
+/*
+ * Cache
+ */
+static void tsf_put_be (uint8_t *ptr, uint64_t value, size_t bytes) /* {{{ */
+{
+  size_t i;
+
+  for (i = 0; i < bytes; i++)
+    ptr[i] = (uint8_t) (value >> (8 * (bytes - i - 1)));
+} /* }}} void tsf_put_be */
+
+static void tsf_chunk_free (tsf_chunk_t *c) /* {{{ */
+{
+  if (c == NULL)
+    return;
+
+  sfree (c->identifier);
+  sfree (c->data);
+  sfree (c);
+} /* }}} void tsf_chunk_free */
+
+/* Moves the chunk built so far to the write queue and starts a new one. Must
+ * be called with `cache_lock' held. */
+static int tsf_series_retire (tsf_series_t *s) /* {{{ */
+{
+  tsf_chunk_t *c;
+  size_t id_len;
+  size_t payload_len;
+  size_t header_len;
+  uint8_t *ptr;
+  size_t i;
+
+  if (s->count == 0)
+    return (0);
+
+  id_len = strlen (s->identifier);
+  payload_len = (s->bits.bits + 7) / 8;
+  header_len = 4 + 2 + id_len + 1 + s->values_num + 8 + 4 + 4;
+
+  c = calloc (1, sizeof (*c));
+  if (c == NULL)
+    return (ENOMEM);
+
+  c->identifier = strdup (s->identifier);
+  c->data = malloc (header_len + payload_len);
+  if ((c->identifier == NULL) || (c->data == NULL))
+  {
+    tsf_chunk_free (c);
+    return (ENOMEM);
+  }
+
+  sstrncpy (c->host, s->host, sizeof (c->host));
+  c->window = s->window;
+  c->count = s->count;
+  c->time_first = (cdtime_t) s->time_first * resolution;
+  c->time_last = (cdtime_t) s->time_last * resolution;
+  c->data_len = header_len + payload_len;
+
+  ptr = c->data;
+  memcpy (ptr, TSF_MAGIC, 4);
+  ptr += 4;
+  tsf_put_be (ptr, id_len, 2);
+  ptr += 2;
+  memcpy (ptr, s->identifier, id_len);
+  ptr += id_len;
+  tsf_put_be (ptr, s->values_num, 1);
+  ptr += 1;
+  for (i = 0; i < s->values_num; i++)
+    *(ptr++) = s->ds_types[i];
+  tsf_put_be (ptr, resolution, 8);
+  ptr += 8;
+  tsf_put_be (ptr, s->count, 4);
+  ptr += 4;
+  tsf_put_be (ptr, payload_len, 4);
+  ptr += 4;
+  memcpy (ptr, s->bits.data, payload_len);
+
+  s->count = 0;
+  tsf_bits_clear (&s->bits);
+
+  c_mutex_lock (&queue_lock);
+  if (queue_tail == NULL)
+    queue_head = c;
+  else
+    queue_tail->next = c;
+  queue_tail = c;
+  pthread_cond_signal (&queue_cond);
+  c_mutex_unlock (&queue_lock);
+
+  return (0);
+} /* }}} int tsf_series_retire */
+
+static void tsf_series_free (tsf_series_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
+
+  plugin_memory_add (cache_memory, -(int64_t) (sizeof (*s) + s->bits.size
+        + s->values_num * (sizeof (*s->value_last) + 3)));
+
+  sfree (s->identifier);
+  sfree (s->ds_types);
+  sfree (s->value_last);
+  sfree (s->leading);
+  sfree (s->trailing);
+  sfree (s->bits.data);
+  sfree (s);
+} /* }}} void tsf_series_free */
+
+static tsf_series_t *tsf_series_create (const char *identifier, /* {{{ */
+    const data_set_t *ds, const value_list_t *vl)
+{
+  tsf_series_t *s;
+  size_t i;
+
+  if (ds->ds_num > 255)
+  {
+    ERROR ("tsfile plugin: Data set \"%s\" has too many data sources.",
+        ds->type);
+    return (NULL);
+  }
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+
+  s->values_num = (size_t) ds->ds_num;
+  s->identifier = strdup (identifier);
+  s->ds_types = calloc (s->values_num, sizeof (*s->ds_types));
+  s->value_last = calloc (s->values_num, sizeof (*s->value_last));
+  s->leading = calloc (s->values_num, sizeof (*s->leading));
+  s->trailing = calloc (s->values_num, sizeof (*s->trailing));
+  if ((s->identifier == NULL) || (s->ds_types == NULL)
+      || (s->value_last == NULL) || (s->leading == NULL)
+      || (s->trailing == NULL))
+  {
+    sfree (s->identifier);
+    sfree (s->ds_types);
+    sfree (s->value_last);
+    sfree (s->leading);
+    sfree (s->trailing);
+    sfree (s);
+    return (NULL);
+  }
+
+  sstrncpy (s->host, vl->host, sizeof (s->host));
+  for (i = 0; i < s->values_num; i++)
+    s->ds_types[i] = (uint8_t) ds->ds[i].type;
+
+  plugin_memory_add (cache_memory, (int64_t) (sizeof (*s)
+        + s->values_num * (sizeof (*s->value_last) + 3)));
+
+  return (s);
+} /* }}} tsf_series_t *tsf_series_create */
+
+/* Writes all chunks whose window has ended or which are at least `max_age'
+ * old. Their series are removed from the cache, so series which stopped
+ * reporting don't use memory. Must be called with `cache_lock' held. */
+static void tsf_cache_flush_nolock (cdtime_t max_age) /* {{{ */
+{
+  c_htable_iterator_t *iter;
+  tsf_series_t **expired = NULL;
+  size_t expired_num = 0;
+  size_t expired_size = 0;
+  cdtime_t now;
+  void *key;
+  void *value;
+  size_t i;
+
+  now = cdtime_coarse ();
+  cache_flush_last = now;
+
+  iter = c_htable_get_iterator (cache);
+  if (iter == NULL)
+    return;
+
+  while (c_htable_iterator_next (iter, &key, &value) == 0)
+  {
+    tsf_series_t *s = value;
+
+    if ((s->window + chunk_duration > now)
+        && ((max_age == TSF_WINDOW_ONLY) || (now - s->opened < max_age)))
+      continue;
+
+    if (expired_num >= expired_size)
+    {
+      size_t size = (expired_size > 0) ? (2 * expired_size) : 64;
+      tsf_series_t **tmp = realloc (expired, size * sizeof (*expired));
+
+      if (tmp == NULL)
+        break;
+      expired = tmp;
+      expired_size = size;
+    }
+    expired[expired_num] = s;
+    expired_num++;
+  }
+  c_htable_iterator_destroy (iter);
+
+  for (i = 0; i < expired_num; i++)
+  {
+    if (tsf_series_retire (expired[i]) != 0)
+    {
+      ERROR ("tsfile plugin: Writing the chunk of \"%s\" failed.",
+          expired[i]->identifier);
+      continue;
+    }
+    c_htable_remove (cache, expired[i]->identifier,
+        /* key = */ NULL, /* value = */ NULL);
+    tsf_series_free (expired[i]);
+  }
+  sfree (expired);
+} /* }}} void tsf_cache_flush_nolock */
+
+static int tsf_cache_insert_nolock (const data_set_t *ds, /* {{{ */
+    const value_list_t *vl)
+{
+  char identifier[6 * DATA_MAX_NAME_LEN];
+  tsf_series_t *s = NULL;
+  cdtime_t window;
+  int status;
+
+  if (FORMAT_VL (identifier, sizeof (identifier), vl) != 0)
+    return (-1);
+
+  window = vl->time - (vl->time % chunk_duration);
+
+  if (c_htable_get (cache, identifier, (void *) &s) != 0)
+  {
+    s = tsf_series_create (identifier, ds, vl);
+    if (s == NULL)
+      return (-1);
+
+    if (c_htable_insert (cache, s->identifier, s) != 0)
+    {
+      tsf_series_free (s);
+      return (-1);
+    }
+    s->window = window;
+  }
+  else if (s->values_num != (size_t) ds->ds_num)
+  {
+    ERROR ("tsfile plugin: The number of data sources of \"%s\" changed.",
+        identifier);
+    return (-1);
+  }
+
+  /* A chunk never spans more than one window, and is written after at most
+   * `CacheTimeout' seconds. */
+  if ((s->count > 0) && ((window != s->window)
+        || ((cache_timeout > 0)
+          && ((cdtime_coarse () - s->opened) >= cache_timeout))))
+  {
+    status = tsf_series_retire (s);
+    if (status != 0)
+      return (status);
+  }
+  s->window = window;
+
+  status = tsf_series_append (s, vl);
+  if (status != 0)
+  {
+    if (status == EINVAL)
+    {
+      DEBUG ("tsfile plugin: Ignoring a value of \"%s\" which is older than "
+          "the last one.", identifier);
+    }
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int tsf_cache_insert_nolock */
+
+static void tsf_cache_destroy (void) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  if (cache == NULL)
+    return;
+
+  while (c_htable_pick (cache, &key, &value) == 0)
+    tsf_series_free (value);
+
+  c_htable_destroy (cache);
+  cache = NULL;
+} /* }}} void tsf_cache_destroy */
+
+/*
+ * Writing files
+ */
+static int tsf_chunk_compare (const void *a, const void *b) /* {{{ */
+{
+  const tsf_chunk_t *c0 = *((tsf_chunk_t * const *) a);
+  const tsf_chunk_t *c1 = *((tsf_chunk_t * const *) b);
+  int status;
+
+  status = strcmp (c0->host, c1->host);
+  if (status != 0)
+    return (status);
+
+  if (c0->window != c1->window)
+    return ((c0->window < c1->window) ? -1 : 1);
+
+  return (0);
+} /* }}} int tsf_chunk_compare */
+
+static int tsf_filename (char *buffer, size_t buffer_size, /* {{{ */
+    const tsf_chunk_t *c, const char *suffix)
+{
+  int status;
+
+  if (datadir != NULL)
+    status = ssnprintf (buffer, buffer_size, "%s/%s/%lu.%s", datadir,
+        c->host, (unsigned long) CDTIME_T_TO_TIME_T (c->window), suffix);
+  else
+    status = ssnprintf (buffer, buffer_size, "%s/%lu.%s",
+        c->host, (unsigned long) CDTIME_T_TO_TIME_T (c->window), suffix);
+
+  if ((status < 1) || ((size_t) status >= buffer_size))
+    return (-1);
+  return (0);
+} /* }}} int tsf_filename */
+
+/* Appends chunks, which all belong to the same host and window, to the data
+ * file and adds them to its index. */
+static int tsf_write_group (tsf_chunk_t **chunks, size_t chunks_num) /* {{{ */
+{
+  char data_file[512];
+  char index_file[512];
+  struct stat statbuf;
+  FILE *index_fh;
+  off_t offset;
+  int fd;
+  size_t i;
+
+  if ((tsf_filename (data_file, sizeof (data_file), chunks[0], "tsc") != 0)
+      || (tsf_filename (index_file, sizeof (index_file),
+          chunks[0], "idx") != 0))
+  {
+    ERROR ("tsfile plugin: File name for host \"%s\" is too long.",
+        chunks[0]->host);
+    return (-1);
+  }
+
+  if (check_create_dir (data_file) != 0)
+    return (-1);
+
+  fd = open (data_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    ERROR ("tsfile plugin: open (%s) failed: %s", data_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  /* This thread is the only one appending, so the end of the file is where
+   * the chunks go. */
+  if (fstat (fd, &statbuf) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("tsfile plugin: fstat (%s) failed: %s", data_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    return (-1);
+  }
+  offset = statbuf.st_size;
+
+  index_fh = fopen (index_file, "a");
+  if (index_fh == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("tsfile plugin: fopen (%s) failed: %s", index_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    return (-1);
+  }
+
+  for (i = 0; i < chunks_num; i++)
+  {
+    tsf_chunk_t *c = chunks[i];
+
+    if (swrite (fd, c->data, c->data_len) != 0)
+    {
+      char errbuf[1024];
+      ERROR ("tsfile plugin: Writing to %s failed: %s", data_file,
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      break;
+    }
+
+    /* offset length samples first last identifier */
+    fprintf (index_fh, "%llu %zu %"PRIu32" %.3f %.3f %s\n",
+        (unsigned long long) offset, c->data_len, c->count,
+        CDTIME_T_TO_DOUBLE (c->time_first),
+        CDTIME_T_TO_DOUBLE (c->time_last), c->identifier);
+    offset += (off_t) c->data_len;
+  }
+
+  close (fd);
+  if (fclose (index_fh) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("tsfile plugin: Writing to %s failed: %s", index_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  return ((i < chunks_num) ? -1 : 0);
+} /* }}} int tsf_write_group */
+
+static void tsf_write_chunks (tsf_chunk_t *list) /* {{{ */
+{
+  tsf_chunk_t **chunks;
+  tsf_chunk_t *c;
+  size_t chunks_num = 0;
+  size_t i;
+
+  for (c = list; c != NULL; c = c->next)
+    chunks_num++;
+
+  chunks = calloc (chunks_num, sizeof (*chunks));
+  if (chunks == NULL)
+  {
+    ERROR ("tsfile plugin: calloc failed. Dropping %zu chunks.", chunks_num);
+    while (list != NULL)
+    {
+      c = list->next;
+      tsf_chunk_free (list);
+      list = c;
+    }
+    return;
+  }
+
+  chunks_num = 0;
+  for (c = list; c != NULL; c = c->next)
+    chunks[chunks_num++] = c;
+
+  /* Group the chunks by file, so each file is opened once and written
+   * sequentially. */
+  qsort (chunks, chunks_num, sizeof (*chunks), tsf_chunk_compare);
+
+  i = 0;
+  while (i < chunks_num)
+  {
+    size_t j;
+
+    for (j = i + 1; j < chunks_num; j++)
+      if (tsf_chunk_compare (&chunks[i], &chunks[j]) != 0)
+        break;
+
+    tsf_write_group (chunks + i, j - i);
+    i = j;
+  }
+
+  for (i = 0; i < chunks_num; i++)
+    tsf_chunk_free (chunks[i]);
+  sfree (chunks);
+} /* }}} void tsf_write_chunks */
+
+static void *tsf_queue_thread (void __attribute__((unused)) *arg) /* {{{ */
+{
+  c_mutex_lock (&queue_lock);
+  while (42)
+  {
+    tsf_chunk_t *list;
+
+    while ((queue_head == NULL) && !do_shutdown)
+      c_cond_wait (&queue_cond, &queue_lock);
+
+    if (queue_head == NULL)
+      break;
+
+    list = queue_head;
+    queue_head = NULL;
+    queue_tail = NULL;
+
+    c_mutex_unlock (&queue_lock);
+    tsf_write_chunks (list);
+    c_mutex_lock (&queue_lock);
+  }
+  c_mutex_unlock (&queue_lock);
+
+  return (NULL);
+} /* }}} void *tsf_queue_thread */
+
+/*
+ * Callbacks
+ */
+static int tsf_write_batch (const plugin_write_item_t *items, /* {{{ */
+    size_t items_num, user_data_t __attribute__((unused)) *user_data)
+{
+  int ret = 0;
+  size_t i;
+
+  c_mutex_lock (&cache_lock);
+  if (cache == NULL)
+  {
+    c_mutex_unlock (&cache_lock);
+    return (-1);
+  }
+
+  for (i = 0; i < items_num; i++)
+  {
+    if (strcmp (items[i].ds->type, items[i].vl->type) != 0)
+    {
+      ERROR ("tsfile plugin: DS type does not match value list type");
+      ret = -1;
+      continue;
+    }
+
+    if (tsf_cache_insert_nolock (items[i].ds, items[i].vl) != 0)
+      ret = -1;
+  }
+
+  /* Write the chunks of series which stopped reporting. */
+  if ((cdtime_coarse () - cache_flush_last) >= cache_flush_timeout)
+    tsf_cache_flush_nolock ((cache_timeout > 0)
+        ? cache_timeout : TSF_WINDOW_ONLY);
+  c_mutex_unlock (&cache_lock);
+
+  return (ret);
+} /* }}} int tsf_write_batch */
+
+static int tsf_flush (cdtime_t timeout, const char *identifier, /* {{{ */
+    user_data_t __attribute__((unused)) *user_data)
+{
+  c_mutex_lock (&cache_lock);
+  if (cache == NULL)
+  {
+    c_mutex_unlock (&cache_lock);
+    return (0);
+  }
+
+  if (identifier == NULL)
+    tsf_cache_flush_nolock (timeout);
+  else
+  {
+    tsf_series_t *s = NULL;
+
+    if ((c_htable_get (cache, identifier, (void *) &s) == 0)
+        && ((timeout == 0) || ((cdtime_coarse () - s->opened) >= timeout)))
+      tsf_series_retire (s);
+  }
+  c_mutex_unlock (&cache_lock);
+
+  return (0);
+} /* }}} int tsf_flush */
+
+static int tsf_config (oconfig_item_t *ci) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < ci->children_num; i++)
+  {
+    oconfig_item_t *child = ci->children + i;
+    int status = 0;
+
+    if (strcasecmp ("DataDir", child->key) == 0)
+    {
+      status = cf_util_get_string (child, &datadir);
+      if (status == 0)
+      {
+        size_t len = strlen (datadir);
+
+        while ((len > 0) && (datadir[len - 1] == '/'))
+          datadir[--len] = 0;
+        if (len == 0)
+          sfree (datadir);
+      }
+    }
+    else if (strcasecmp ("ChunkDuration", child->key) == 0)
+      status = cf_util_get_cdtime (child, &chunk_duration);
+    else if (strcasecmp ("TimeResolution", child->key) == 0)
+      status = cf_util_get_cdtime (child, &resolution);
+    else if (strcasecmp ("CacheTimeout", child->key) == 0)
+      status = cf_util_get_cdtime (child, &cache_timeout);
+    else if (strcasecmp ("CacheFlush", child->key) == 0)
+      status = cf_util_get_cdtime (child, &cache_flush_timeout);
+    else
+      WARNING ("tsfile plugin: Ignoring unknown config option \"%s\".",
+          child->key);
+
+    if (status != 0)
+      return (-1);
+  }
+
+  return (0);
+} /* }}} int tsf_config */
+
+static int tsf_init (void) /* {{{ */
+{
+  int status;
+
+  if (chunk_duration == 0)
+    chunk_duration = TIME_T_TO_CDTIME_T (7200);
+  if (resolution == 0)
+    resolution = TIME_T_TO_CDTIME_T (1);
+  if (cache_flush_timeout == 0)
+    cache_flush_timeout = TIME_T_TO_CDTIME_T (60);
+
+  /* Deltas within a window have to fit into 32 bits. */
+  if ((chunk_duration / resolution) >= (((cdtime_t) 1) << 31))
+  {
+    ERROR ("tsfile plugin: \"ChunkDuration\" is too long for the "
+        "\"TimeResolution\". At most 2^31 time units fit into one chunk.");
+    return (-1);
+  }
+
+  if ((chunk_duration < resolution) || (chunk_duration % resolution != 0))
+  {
+    ERROR ("tsfile plugin: \"ChunkDuration\" must be a multiple of "
+        "\"TimeResolution\".");
+    return (-1);
+  }
+
+  cache_memory = plugin_memory_counter ("tsfile-cache");
+
+  c_mutex_lock (&cache_lock);
+  if (cache == NULL)
+    cache = c_htable_create ();
+  cache_flush_last = cdtime_coarse ();
+  c_mutex_unlock (&cache_lock);
+
+  if (cache == NULL)
+  {
+    ERROR ("tsfile plugin: c_htable_create failed.");
+    return (-1);
+  }
+
+  if (queue_thread_running)
+    return (0);
+
+  status = plugin_thread_create (&queue_thread, /* attr = */ NULL,
+      tsf_queue_thread, /* arg = */ NULL);
+  if (status != 0)
+  {
+    ERROR ("tsfile plugin: Cannot create the queue thread.");
+    return (-1);
+  }
+  queue_thread_running = 1;
+
+  return (0);
+} /* }}} int tsf_init */
+
+static int tsf_shutdown (void) /* {{{ */
+{
+  c_mutex_lock (&cache_lock);
+  if (cache != NULL)
+    tsf_cache_flush_nolock (/* max_age = */ 0);
+  c_mutex_unlock (&cache_lock);
+
+  c_mutex_lock (&queue_lock);
+  do_shutdown = 1;
+  pthread_cond_signal (&queue_cond);
+  c_mutex_unlock (&queue_lock);
+
+  /* Wait for all chunks to be written before returning. */
+  if (queue_thread_running)
+  {
+    pthread_join (queue_thread, NULL);
+    queue_thread_running = 0;
+  }
+
+  c_mutex_lock (&cache_lock);
+  tsf_cache_destroy ();
+  c_mutex_unlock (&cache_lock);
+
+  sfree (datadir);
+
+  return (0);
+} /* }}} int tsf_shutdown */
+
+void module_register (void)
+{
+  plugin_register_complex_config ("tsfile", tsf_config);
+  plugin_register_init ("tsfile", tsf_init);
+  plugin_register_write_batch ("tsfile", tsf_write_batch,
+      /* user_data = */ NULL);
+  plugin_register_flush ("tsfile", tsf_flush, /* user_data = */ NULL);
+  plugin_register_shutdown ("tsfile", tsf_shutdown);
+} /* void module_register */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
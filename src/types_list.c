@@ -25,6 +25,8 @@
 #include "plugin.h"
 #include "configfile.h"
 
+#include <sys/mman.h>
+
 static int parse_ds (data_source_t *dsrc, char *buf, size_t buf_len)
 {
   char *dummy;
@@ -91,7 +93,51 @@ static int parse_ds (data_source_t *dsrc, char *buf, size_t buf_len)
   return (0);
 } /* int parse_ds */
 
-static void parse_line (char *buf)
+/* The data sets of one file, in the order they appear in it. */
+typedef struct types_list_s
+{
+  data_set_t *sets;
+  size_t sets_num;
+  size_t sets_size;
+  /* If true, the data sources point into a mapped cache file and must not
+   * be freed. */
+  _Bool mapped;
+} types_list_t;
+
+static void types_list_free (types_list_t *list)
+{
+  size_t i;
+
+  if (!list->mapped)
+    for (i = 0; i < list->sets_num; i++)
+      sfree (list->sets[i].ds);
+  sfree (list->sets);
+  memset (list, 0, sizeof (*list));
+} /* void types_list_free */
+
+/* Returns a new, zeroed data set at the end of the list. */
+static data_set_t *types_list_append (types_list_t *list)
+{
+  data_set_t *ds;
+
+  if (list->sets_num >= list->sets_size)
+  {
+    size_t new_size = (list->sets_size == 0) ? 256 : 2 * list->sets_size;
+    data_set_t *tmp;
+
+    tmp = realloc (list->sets, new_size * sizeof (*tmp));
+    if (tmp == NULL)
+      return (NULL);
+    list->sets = tmp;
+    list->sets_size = new_size;
+  }
+
+  ds = list->sets + list->sets_num;
+  memset (ds, 0, sizeof (*ds));
+  return (ds);
+} /* data_set_t *types_list_append */
+
+static void parse_line (char *buf, types_list_t *list)
 {
   char  *fields[64];
   size_t fields_num;
@@ -106,12 +152,10 @@ static void parse_line (char *buf)
   if (fields[0][0] == '#')
     return;
 
-  ds = (data_set_t *) malloc (sizeof (data_set_t));
+  ds = types_list_append (list);
   if (ds == NULL)
     return;
 
-  memset (ds, '\0', sizeof (data_set_t));
-
   sstrncpy (ds->type, fields[0], sizeof (ds->type));
 
   ds->ds_num = fields_num - 1;
@@ -128,13 +172,11 @@ static void parse_line (char *buf)
       return;
     }
 
-  plugin_register_data_set (ds);
-
-  sfree (ds->ds);
-  sfree (ds);
+  /* Only complete data sets make it into the list. */
+  list->sets_num++;
 } /* void parse_line */
 
-static void parse_file (FILE *fh)
+static void parse_file (FILE *fh, types_list_t *list)
 {
   char buf[4096];
   size_t buf_len;
@@ -165,17 +207,284 @@ static void parse_file (FILE *fh)
     if (buf_len == 0)
       continue;
 
-    parse_line (buf);
+    parse_line (buf, list);
   } /* while (fgets) */
 } /* void parse_file */
 
+/*
+ * Types cache
+ *
+ * If the global option "TypesDBCache" names a directory, the data sets of
+ * each types.db file are stored there in a binary file, which is used
+ * instead of parsing the text file as long as the latter's modification
+ * time, size and inode are unchanged. The file is in native byte order and
+ * all records are aligned to eight bytes, so it can be mapped into memory
+ * and registered as is:
+ *
+ *   types_cache_header_t
+ *   char     path[path_len]     (the source file, including the null byte)
+ *            padding to eight bytes
+ *   record 0: types_cache_record_t
+ *             data_source_t ds[ds_num]
+ *   record 1: ...
+ *
+ * The checksum covers everything after the header.
+ */
+#define TYPES_CACHE_MAGIC      "CDTYPES1"
+#define TYPES_CACHE_VERSION    1
+#define TYPES_CACHE_BYTE_ORDER 0x01020304
+#define TYPES_CACHE_ALIGN(s)   (((s) + 7) & ~((size_t) 7))
+
+typedef struct types_cache_header_s
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  /* Catches builds with a different data_source_t. */
+  uint32_t name_len;
+  uint32_t ds_size;
+  /* The source file the cache was compiled from. */
+  int64_t  source_mtime;
+  uint64_t source_size;
+  uint64_t source_inode;
+  uint32_t path_len;
+  uint32_t sets_num;
+  uint64_t data_size;
+  uint64_t checksum;
+} types_cache_header_t;
+
+typedef struct types_cache_record_s
+{
+  char     type[DATA_MAX_NAME_LEN];
+  uint32_t ds_num;
+  uint32_t reserved;
+} types_cache_record_t;
+
+#define TYPES_CACHE_RECORD_SIZE TYPES_CACHE_ALIGN (sizeof (types_cache_record_t))
+
+/* 64 bit FNV-1a of "size" bytes. */
+static uint64_t types_cache_checksum (const char *data, size_t size)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < size; i++)
+  {
+    hash ^= (uint64_t) (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return (hash);
+} /* uint64_t types_cache_checksum */
+
+/* Returns the name of the cache file for "file" in "buffer", or NULL if no
+ * cache is configured. */
+static const char *types_cache_file (const char *file,
+    char *buffer, size_t buffer_size)
+{
+  const char *dir = global_option_get ("TypesDBCache");
+
+  if ((dir == NULL) || (dir[0] == 0))
+    return (NULL);
+
+  ssnprintf (buffer, buffer_size, "%s/types-%016"PRIx64".cache",
+      dir, plugin_hash_string (file));
+  return (buffer);
+} /* const char *types_cache_file */
+
+static void types_cache_header_init (types_cache_header_t *header,
+    const char *file, const struct stat *source)
+{
+  memset (header, 0, sizeof (*header));
+  memcpy (header->magic, TYPES_CACHE_MAGIC, sizeof (header->magic));
+  header->version = TYPES_CACHE_VERSION;
+  header->byte_order = TYPES_CACHE_BYTE_ORDER;
+  header->name_len = DATA_MAX_NAME_LEN;
+  header->ds_size = (uint32_t) sizeof (data_source_t);
+  header->source_mtime = (int64_t) source->st_mtime;
+  header->source_size = (uint64_t) source->st_size;
+  header->source_inode = (uint64_t) source->st_ino;
+  header->path_len = (uint32_t) (strlen (file) + 1);
+} /* void types_cache_header_init */
+
+/* Maps the cache of "file" and fills "list" with data sets pointing into
+ * the mapping. Returns zero upon success and non-zero if there is no usable
+ * cache, i.e. the source has to be parsed. */
+static int types_cache_read (const char *cache_file, const char *file,
+    const struct stat *source, types_list_t *list,
+    char **ret_data, size_t *ret_data_size)
+{
+  types_cache_header_t expected;
+  const types_cache_header_t *header;
+  struct stat statbuf;
+  char *data;
+  size_t data_size;
+  size_t offset;
+  uint32_t i;
+  int fd;
+
+  fd = open (cache_file, O_RDONLY);
+  if (fd < 0)
+    return (-1);
+
+  if ((fstat (fd, &statbuf) != 0)
+      || ((size_t) statbuf.st_size < sizeof (*header)))
+  {
+    close (fd);
+    return (-1);
+  }
+  data_size = (size_t) statbuf.st_size;
+
+  data = mmap (/* addr = */ NULL, data_size, PROT_READ, MAP_PRIVATE,
+      fd, /* offset = */ 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return (-1);
+
+  /* Everything but the checksum and the number of data sets must match what
+   * would be written for the source file now. */
+  header = (const types_cache_header_t *) data;
+  types_cache_header_init (&expected, file, source);
+  expected.sets_num = header->sets_num;
+  expected.data_size = (uint64_t) (data_size - sizeof (*header));
+  expected.checksum = header->checksum;
+  offset = sizeof (*header) + TYPES_CACHE_ALIGN (expected.path_len);
+
+  if ((memcmp (header, &expected, sizeof (expected)) != 0)
+      || (data_size < offset)
+      || (strcmp (data + sizeof (*header), file) != 0)
+      || (header->checksum != types_cache_checksum (data + sizeof (*header),
+          data_size - sizeof (*header))))
+  {
+    munmap (data, data_size);
+    return (-1);
+  }
+
+  list->mapped = 1;
+  for (i = 0; i < header->sets_num; i++)
+  {
+    const types_cache_record_t *rec;
+    data_set_t *ds;
+    size_t rec_size;
+
+    if ((data_size - offset) < TYPES_CACHE_RECORD_SIZE)
+      break;
+    rec = (const types_cache_record_t *) (data + offset);
+
+    rec_size = TYPES_CACHE_RECORD_SIZE
+      + ((size_t) rec->ds_num) * sizeof (data_source_t);
+    if (((data_size - offset) < rec_size)
+        || (memchr (rec->type, 0, sizeof (rec->type)) == NULL))
+      break;
+
+    ds = types_list_append (list);
+    if (ds == NULL)
+      break;
+    sstrncpy (ds->type, rec->type, sizeof (ds->type));
+    ds->ds_num = (int) rec->ds_num;
+    ds->ds = (data_source_t *) (data + offset + TYPES_CACHE_RECORD_SIZE);
+    list->sets_num++;
+
+    offset += rec_size;
+  }
+
+  if ((i != header->sets_num) || (offset != data_size))
+  {
+    types_list_free (list);
+    munmap (data, data_size);
+    return (-1);
+  }
+
+  *ret_data = data;
+  *ret_data_size = data_size;
+  return (0);
+} /* int types_cache_read */
+
+static int types_cache_write (const char *cache_file, const char *file,
+    const struct stat *source, const types_list_t *list)
+{
+  types_cache_header_t header;
+  char tmp_file[PATH_MAX];
+  char *data;
+  size_t data_size;
+  size_t offset;
+  size_t i;
+  int status = 0;
+  int fd;
+
+  types_cache_header_init (&header, file, source);
+  header.sets_num = (uint32_t) list->sets_num;
+
+  data_size = TYPES_CACHE_ALIGN (header.path_len);
+  for (i = 0; i < list->sets_num; i++)
+    data_size += TYPES_CACHE_RECORD_SIZE
+      + ((size_t) list->sets[i].ds_num) * sizeof (data_source_t);
+
+  data = calloc (1, data_size);
+  if (data == NULL)
+    return (ENOMEM);
+
+  memcpy (data, file, header.path_len);
+  offset = TYPES_CACHE_ALIGN (header.path_len);
+  for (i = 0; i < list->sets_num; i++)
+  {
+    const data_set_t *ds = list->sets + i;
+    types_cache_record_t *rec = (types_cache_record_t *) (data + offset);
+
+    sstrncpy (rec->type, ds->type, sizeof (rec->type));
+    rec->ds_num = (uint32_t) ds->ds_num;
+    offset += TYPES_CACHE_RECORD_SIZE;
+
+    memcpy (data + offset, ds->ds, ((size_t) ds->ds_num)
+        * sizeof (data_source_t));
+    offset += ((size_t) ds->ds_num) * sizeof (data_source_t);
+  }
+
+  header.data_size = (uint64_t) data_size;
+  header.checksum = types_cache_checksum (data, data_size);
+
+  /* Many instances may start at the same time and share the directory, so
+   * each writes its own temporary file. The rename is atomic. */
+  ssnprintf (tmp_file, sizeof (tmp_file), "%s.XXXXXX", cache_file);
+  fd = mkstemp (tmp_file);
+  if (fd < 0)
+  {
+    free (data);
+    return (errno);
+  }
+
+  if ((swrite (fd, &header, sizeof (header)) != 0)
+      || (swrite (fd, data, data_size) != 0))
+    status = errno;
+  free (data);
+
+  if ((close (fd) != 0) && (status == 0))
+    status = errno;
+  if ((status == 0) && (chmod (tmp_file, 0644) != 0))
+    status = errno;
+  if ((status == 0) && (rename (tmp_file, cache_file) != 0))
+    status = errno;
+
+  if (status != 0)
+    unlink (tmp_file);
+  return (status);
+} /* int types_cache_write */
+
 int read_types_list (const char *file)
 {
   FILE *fh;
+  struct stat statbuf;
+  types_list_t list;
+  char cache_buffer[PATH_MAX];
+  const char *cache_file;
+  char *cache_data = NULL;
+  size_t cache_data_size = 0;
 
   if (file == NULL)
     return (-1);
 
+  memset (&list, 0, sizeof (list));
+
   fh = fopen (file, "r");
   if (fh == NULL)
   {
@@ -187,11 +496,41 @@ int read_types_list (const char *file)
     return (-1);
   }
 
-  parse_file (fh);
+  cache_file = types_cache_file (file, cache_buffer, sizeof (cache_buffer));
+  if ((cache_file != NULL) && (fstat (fileno (fh), &statbuf) != 0))
+    cache_file = NULL;
+
+  if ((cache_file != NULL)
+      && (types_cache_read (cache_file, file, &statbuf, &list,
+          &cache_data, &cache_data_size) == 0))
+  {
+    DEBUG ("Read `%s' from the cache `%s'", file, cache_file);
+  }
+  else
+  {
+    parse_file (fh, &list);
+
+    if (cache_file != NULL)
+    {
+      int status = types_cache_write (cache_file, file, &statbuf, &list);
+      if (status != 0)
+      {
+	char errbuf[1024];
+	WARNING ("Writing the types cache `%s' failed: %s", cache_file,
+	    sstrerror (status, errbuf, sizeof (errbuf)));
+      }
+    }
+  }
 
   fclose (fh);
   fh = NULL;
 
+  plugin_register_data_sets (list.sets, list.sets_num);
+
+  types_list_free (&list);
+  if (cache_data != NULL)
+    munmap (cache_data, cache_data_size);
+
   DEBUG ("Done parsing `%s'", file);
 
   return (0);
@@ -29,6 +29,7 @@
 #include "utils_cmd_listval.h"
 #include "utils_cmd_putval.h"
 #include "utils_cmd_putnotif.h"
+#include "utils_parse_option.h"
 
 /* Folks without pthread will need to disable this plugin. */
 #include <pthread.h>
@@ -37,7 +38,13 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#include <fcntl.h>
 #include <grp.h>
+#include <poll.h>
+
+#if HAVE_FNMATCH_H
+# include <fnmatch.h>
+#endif
 
 #ifndef UNIX_PATH_MAX
 # define UNIX_PATH_MAX sizeof (((struct sockaddr_un *)0)->sun_path)
@@ -45,6 +52,71 @@
 
 #define US_DEFAULT_PATH LOCALSTATEDIR"/run/"PACKAGE_NAME"-unixsock"
 
+/* The input buffer of a connection starts at US_BUFFER_SIZE bytes and grows
+ * up to US_LINE_MAX, the longest command accepted. */
+#define US_BUFFER_SIZE 4096
+#define US_LINE_MAX    65536
+/* A worker reads at most this many times from one connection before handing
+ * it back, so busy clients cannot starve the others. */
+#define US_CLIENT_READS 16
+#define US_DEFAULT_WORKER_THREADS 4
+#define US_DEFAULT_SUBSCRIBER_QUEUE 1024
+
+#ifdef MSG_DONTWAIT
+# define US_MSG_DONTWAIT MSG_DONTWAIT
+#else
+# define US_MSG_DONTWAIT 0
+#endif
+
+/*
+ * Private data types
+ */
+struct us_client_s;
+typedef struct us_client_s us_client_t;
+struct us_client_s
+{
+	int fd;
+	/* Answers are written to this stream, on a copy of "fd". */
+	FILE *fh;
+
+	/* Input not handled yet, i.e. the start of an incomplete line. */
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_fill;
+	/* Set while skipping the rest of a line exceeding US_LINE_MAX. */
+	_Bool discard;
+
+	/* In the worker queue or the list of connections handed back. */
+	us_client_t *next;
+
+	/* Set by SUBSCRIBE, see us_subscriber_t. */
+	char **patterns;
+	size_t patterns_num;
+};
+
+/* A connection that has sent SUBSCRIBE. Matching values are queued by the
+ * write callback as PUTVAL lines and sent by the subscriber thread. If the
+ * client doesn't keep up, the oldest lines are dropped. */
+struct us_subscriber_s;
+typedef struct us_subscriber_s us_subscriber_t;
+struct us_subscriber_s
+{
+	int fd;
+	char **patterns;
+	size_t patterns_num;
+
+	/* Ring buffer of subscriber_queue_size lines. The first "queue_offset"
+	 * bytes of the oldest line have been sent already. */
+	char **queue;
+	size_t queue_head;
+	size_t queue_num;
+	size_t queue_offset;
+	uint64_t dropped;
+
+	_Bool dead;
+	us_subscriber_t *next;
+};
+
 /*
  * Private variables
  */
@@ -54,7 +126,9 @@ static const char *config_keys[] =
 	"SocketFile",
 	"SocketGroup",
 	"SocketPerms",
-	"DeleteSocket"
+	"DeleteSocket",
+	"WorkerThreads",
+	"SubscriberQueueSize"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -67,8 +141,33 @@ static char *sock_group = NULL;
 static int   sock_perms = S_IRWXU | S_IRWXG;
 static _Bool delete_socket = 0;
 
+static int   worker_threads_num = US_DEFAULT_WORKER_THREADS;
+static size_t subscriber_queue_size = US_DEFAULT_SUBSCRIBER_QUEUE;
+
 static pthread_t listen_thread = (pthread_t) 0;
 
+/* Connections with pending input, handled by the worker threads, and
+ * connections handed back to the server thread afterwards. */
+static pthread_mutex_t us_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  us_queue_cond = PTHREAD_COND_INITIALIZER;
+static us_client_t *us_queue_head = NULL;
+static us_client_t *us_queue_tail = NULL;
+static us_client_t *us_return_head = NULL;
+
+static pthread_t *us_workers = NULL;
+static size_t     us_workers_num = 0;
+
+/* Wakes up the server thread when connections are handed back or on
+ * shutdown. */
+static int us_wake_pipe[2] = { -1, -1 };
+
+/* Subscribers are added by the workers and removed by the subscriber
+ * thread, which is woken up through its own pipe. */
+static pthread_mutex_t  us_subscribers_lock = PTHREAD_MUTEX_INITIALIZER;
+static us_subscriber_t *us_subscribers = NULL;
+static pthread_t        us_subscriber_tid = (pthread_t) 0;
+static int us_subscriber_pipe[2] = { -1, -1 };
+
 /*
  * Functions
  */
@@ -174,211 +273,1068 @@ static int us_open_socket (void)
 	return (0);
 } /* int us_open_socket */
 
-static void *us_handle_client (void *arg)
+/* RELOAD: Re-reads the config file, see cf_reload(). */
+static int us_handle_reload (FILE *fh)
+{
+	int status;
+
+	status = cf_reload ();
+	if (status == 0)
+		status = fprintf (fh, "0 Configuration reloaded\n");
+	else
+		status = fprintf (fh, "-1 Reloading the configuration failed, "
+				"see the log for details\n");
+
+	if (status < 0)
+	{
+		char errbuf[1024];
+		WARNING ("unixsock plugin: failed to write to socket #%i: %s",
+				fileno (fh), sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+	return (0);
+} /* int us_handle_reload */
+
+static us_client_t *us_client_create (int fd)
 {
-	int fdin;
+	us_client_t *c;
 	int fdout;
-	FILE *fhin, *fhout;
 
-	fdin = *((int *) arg);
-	free (arg);
-	arg = NULL;
+	c = calloc (1, sizeof (*c));
+	if (c == NULL)
+	{
+		ERROR ("unixsock plugin: calloc failed.");
+		return (NULL);
+	}
+	c->fd = fd;
 
-	DEBUG ("unixsock plugin: us_handle_client: Reading from fd #%i", fdin);
+	c->buffer_size = US_BUFFER_SIZE;
+	c->buffer = malloc (c->buffer_size);
+	if (c->buffer == NULL)
+	{
+		ERROR ("unixsock plugin: malloc failed.");
+		sfree (c);
+		return (NULL);
+	}
 
-	fdout = dup (fdin);
+	/* The handlers write their answers to a stream. It is fully buffered and
+	 * flushed after all pending commands have been handled, so pipelined
+	 * commands are answered with few writes. */
+	fdout = dup (fd);
 	if (fdout < 0)
 	{
 		char errbuf[1024];
 		ERROR ("unixsock plugin: dup failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		close (fdin);
-		pthread_exit ((void *) 1);
+		sfree (c->buffer);
+		sfree (c);
+		return (NULL);
 	}
 
-	fhin  = fdopen (fdin, "r");
-	if (fhin == NULL)
+	c->fh = fdopen (fdout, "w");
+	if (c->fh == NULL)
 	{
 		char errbuf[1024];
 		ERROR ("unixsock plugin: fdopen failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		close (fdin);
 		close (fdout);
-		pthread_exit ((void *) 1);
-		return ((void *) 1);
+		sfree (c->buffer);
+		sfree (c);
+		return (NULL);
 	}
 
-	fhout = fdopen (fdout, "w");
-	if (fhout == NULL)
+	return (c);
+} /* us_client_t *us_client_create */
+
+static void us_client_destroy (us_client_t *c)
+{
+	if (c == NULL)
+		return;
+
+	DEBUG ("unixsock plugin: Closing connection on fd #%i", c->fd);
+
+	fclose (c->fh);
+	if (c->fd >= 0)
+		close (c->fd);
+	sfree (c->buffer);
+	if (c->patterns != NULL)
 	{
-		char errbuf[1024];
-		ERROR ("unixsock plugin: fdopen failed: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (fhin); /* this closes fdin as well */
-		close (fdout);
-		pthread_exit ((void *) 1);
-		return ((void *) 1);
+		size_t i;
+		for (i = 0; i < c->patterns_num; i++)
+			sfree (c->patterns[i]);
+		sfree (c->patterns);
+	}
+	sfree (c);
+} /* void us_client_destroy */
+
+/* SUBSCRIBE <pattern> [<pattern> ...]: Answers like the other commands and
+ * then streams matching values as PUTVAL lines. Returns greater than zero
+ * if the connection has to be turned into a subscriber. */
+static int us_handle_subscribe (us_client_t *c, char *buffer)
+{
+	char *command = NULL;
+	int status;
+
+	status = parse_string (&buffer, &command);
+	if ((status != 0) || (strcasecmp ("SUBSCRIBE", command) != 0))
+	{
+		if (fprintf (c->fh, "-1 Cannot parse command.\n") < 0)
+			return (-1);
+		return (0);
+	}
+
+	while (*buffer != 0)
+	{
+		char *pattern = NULL;
+		char **tmp;
+
+		status = parse_string (&buffer, &pattern);
+		if (status != 0)
+			break;
+
+		tmp = realloc (c->patterns,
+				(c->patterns_num + 1) * sizeof (*c->patterns));
+		if (tmp == NULL)
+		{
+			status = -1;
+			break;
+		}
+		c->patterns = tmp;
+
+		c->patterns[c->patterns_num] = strdup (pattern);
+		if (c->patterns[c->patterns_num] == NULL)
+		{
+			status = -1;
+			break;
+		}
+		c->patterns_num++;
+	}
+
+	if ((status != 0) || (c->patterns_num == 0))
+	{
+		size_t i;
+
+		for (i = 0; i < c->patterns_num; i++)
+			sfree (c->patterns[i]);
+		sfree (c->patterns);
+		c->patterns_num = 0;
+
+		if (fprintf (c->fh, "-1 Cannot parse pattern.\n") < 0)
+			return (-1);
+		return (0);
+	}
+
+	if (fprintf (c->fh, "0 Subscribed to %zu pattern%s\n", c->patterns_num,
+				(c->patterns_num == 1) ? "" : "s") < 0)
+		return (-1);
+
+	return (1);
+} /* int us_handle_subscribe */
+
+static void us_subscriber_wake (void)
+{
+	char c = 0;
+
+	if (write (us_subscriber_pipe[1], &c, 1) < 0)
+		return;
+} /* void us_subscriber_wake */
+
+static void us_subscriber_destroy (us_subscriber_t *s)
+{
+	size_t i;
+
+	if (s == NULL)
+		return;
+
+	DEBUG ("unixsock plugin: Closing subscription on fd #%i, "
+			"%"PRIu64" lines dropped", s->fd, s->dropped);
+
+	close (s->fd);
+	for (i = 0; i < s->queue_num; i++)
+		sfree (s->queue[(s->queue_head + i) % subscriber_queue_size]);
+	sfree (s->queue);
+	for (i = 0; i < s->patterns_num; i++)
+		sfree (s->patterns[i]);
+	sfree (s->patterns);
+	sfree (s);
+} /* void us_subscriber_destroy */
+
+/* Turns the connection into a subscriber. The connection is destroyed in
+ * any case. */
+static void us_subscriber_add (us_client_t *c)
+{
+	us_subscriber_t *s;
+	int flags;
+
+	s = calloc (1, sizeof (*s));
+	if (s != NULL)
+		s->queue = calloc (subscriber_queue_size, sizeof (*s->queue));
+	if ((s == NULL) || (s->queue == NULL))
+	{
+		ERROR ("unixsock plugin: calloc failed.");
+		sfree (s);
+		us_client_destroy (c);
+		return;
 	}
 
-	/* change output buffer to line buffered mode */
-	if (setvbuf (fhout, NULL, _IOLBF, 0) != 0)
+	/* The subscriber thread must never block on a slow client. */
+	flags = fcntl (c->fd, F_GETFL);
+	if ((flags == -1) || (fcntl (c->fd, F_SETFL, flags | O_NONBLOCK) != 0))
 	{
 		char errbuf[1024];
-		ERROR ("unixsock plugin: setvbuf failed: %s",
+		ERROR ("unixsock plugin: fcntl failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (fhin);
-		fclose (fhout);
-		pthread_exit ((void *) 1);
-		return ((void *) 0);
+		sfree (s->queue);
+		sfree (s);
+		us_client_destroy (c);
+		return;
 	}
 
-	while (42)
+	s->fd = c->fd;
+	s->patterns = c->patterns;
+	s->patterns_num = c->patterns_num;
+	c->fd = -1;
+	c->patterns = NULL;
+	c->patterns_num = 0;
+	us_client_destroy (c);
+
+	pthread_mutex_lock (&us_subscribers_lock);
+	s->next = us_subscribers;
+	us_subscribers = s;
+	pthread_mutex_unlock (&us_subscribers_lock);
+	us_subscriber_wake ();
+
+	DEBUG ("unixsock plugin: New subscription on fd #%i", s->fd);
+} /* void us_subscriber_add */
+
+static _Bool us_subscriber_match (const us_subscriber_t *s, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < s->patterns_num; i++)
 	{
-		char buffer[1024];
-		char buffer_copy[1024];
-		char *fields[128];
-		int   fields_num;
-		int   len;
+#if HAVE_FNMATCH_H
+		if (strpbrk (s->patterns[i], "*?[") != NULL)
+		{
+			if (fnmatch (s->patterns[i], name, /* flags = */ 0) == 0)
+				return (1);
+			continue;
+		}
+#endif
+		if (strncmp (s->patterns[i], name, strlen (s->patterns[i])) == 0)
+			return (1);
+	}
 
-		errno = 0;
-		if (fgets (buffer, sizeof (buffer), fhin) == NULL)
+	return (0);
+} /* _Bool us_subscriber_match */
+
+/* Appends "line" to the queue, dropping the oldest line if it is full. A
+ * line that has been sent partially is kept, so the stream stays intact.
+ * Returns true if the queue was empty. Called with us_subscribers_lock
+ * held. */
+static _Bool us_subscriber_enqueue (us_subscriber_t *s, char *line)
+{
+	_Bool was_empty = (s->queue_num == 0);
+
+	if (s->queue_num >= subscriber_queue_size)
+	{
+		size_t second = (s->queue_head + 1) % subscriber_queue_size;
+
+		if (s->queue_offset > 0)
+		{
+			sfree (s->queue[second]);
+			s->queue[second] = s->queue[s->queue_head];
+		}
+		else
+		{
+			sfree (s->queue[s->queue_head]);
+		}
+		s->queue[s->queue_head] = NULL;
+		s->queue_head = second;
+		s->queue_num--;
+		s->dropped++;
+	}
+
+	s->queue[(s->queue_head + s->queue_num) % subscriber_queue_size] = line;
+	s->queue_num++;
+
+	return (was_empty);
+} /* _Bool us_subscriber_enqueue */
+
+/* Sends as many queued lines as the socket accepts. Returns less than zero
+ * if the connection failed. Called with us_subscribers_lock held. */
+static int us_subscriber_flush (us_subscriber_t *s)
+{
+	while (s->queue_num > 0)
+	{
+		char *line = s->queue[s->queue_head];
+		size_t len = strlen (line) - s->queue_offset;
+		ssize_t status;
+
+		status = write (s->fd, line + s->queue_offset, len);
+		if (status < 0)
 		{
-			if ((errno == EINTR) || (errno == EAGAIN))
+			if (errno == EINTR)
 				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return (0);
+			return (-1);
+		}
 
-			if (errno != 0)
+		if ((size_t) status < len)
+		{
+			s->queue_offset += (size_t) status;
+			return (0);
+		}
+
+		sfree (s->queue[s->queue_head]);
+		s->queue_head = (s->queue_head + 1) % subscriber_queue_size;
+		s->queue_num--;
+		s->queue_offset = 0;
+	}
+
+	return (0);
+} /* int us_subscriber_flush */
+
+/* Sends queued lines to the subscribers as their sockets become writable
+ * and notices closed connections. Input from subscribers is ignored. */
+static void *us_subscriber_thread (void __attribute__((unused)) *arg)
+{
+	struct pollfd *fds = NULL;
+	size_t fds_size = 0;
+
+	while (loop != 0)
+	{
+		us_subscriber_t *first;
+		us_subscriber_t *s;
+		us_subscriber_t **prev;
+		size_t fds_num = 1;
+		size_t i;
+		int status;
+
+		pthread_mutex_lock (&us_subscribers_lock);
+		for (s = us_subscribers; s != NULL; s = s->next)
+			fds_num++;
+
+		if (fds_num > fds_size)
+		{
+			struct pollfd *tmp;
+
+			tmp = realloc (fds, fds_num * sizeof (*fds));
+			if (tmp == NULL)
 			{
-				char errbuf[1024];
-				WARNING ("unixsock plugin: failed to read from socket #%i: %s",
-						fileno (fhin),
-						sstrerror (errno, errbuf, sizeof (errbuf)));
+				pthread_mutex_unlock (&us_subscribers_lock);
+				ERROR ("unixsock plugin: realloc failed.");
+				break;
 			}
-			break;
+			fds = tmp;
+			fds_size = fds_num;
+		}
+
+		memset (fds, 0, fds_num * sizeof (*fds));
+		fds[0].fd = us_subscriber_pipe[0];
+		fds[0].events = POLLIN;
+		/* New subscribers are only ever prepended, so the ones polled
+		 * start at "first". */
+		first = us_subscribers;
+		for (s = first, i = 1; s != NULL; s = s->next, i++)
+		{
+			fds[i].fd = s->fd;
+			fds[i].events = POLLIN;
+			if (s->queue_num > 0)
+				fds[i].events |= POLLOUT;
 		}
+		pthread_mutex_unlock (&us_subscribers_lock);
 
-		len = strlen (buffer);
-		while ((len > 0)
-				&& ((buffer[len - 1] == '\n') || (buffer[len - 1] == '\r')))
-			buffer[--len] = '\0';
+		status = poll (fds, (nfds_t) fds_num, /* timeout = */ -1);
+		if (status < 0)
+		{
+			char errbuf[1024];
 
-		if (len == 0)
-			continue;
+			if (errno == EINTR)
+				continue;
 
-		sstrncpy (buffer_copy, buffer, sizeof (buffer_copy));
+			ERROR ("unixsock plugin: poll failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			break;
+		}
 
-		fields_num = strsplit (buffer_copy, fields,
-				sizeof (fields) / sizeof (fields[0]));
-		if (fields_num < 1)
+		if (fds[0].revents != 0)
 		{
-			fprintf (fhout, "-1 Internal error\n");
-			fclose (fhin);
-			fclose (fhout);
-			pthread_exit ((void *) 1);
-			return ((void *) 1);
+			char buffer[64];
+			while (read (us_subscriber_pipe[0], buffer, sizeof (buffer)) > 0)
+				/* drain */;
 		}
 
-		if (strcasecmp (fields[0], "getval") == 0)
+		pthread_mutex_lock (&us_subscribers_lock);
+		for (s = first, i = 1; (s != NULL) && (i < fds_num);
+				s = s->next, i++)
 		{
-			handle_getval (fhout, buffer);
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+			{
+				char buffer[4096];
+				ssize_t len;
+
+				len = recv (s->fd, buffer, sizeof (buffer), US_MSG_DONTWAIT);
+				if ((len == 0) || ((len < 0) && (errno != EINTR)
+							&& (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+					s->dead = 1;
+			}
+
+			if (!s->dead && (fds[i].revents & POLLOUT)
+					&& (us_subscriber_flush (s) != 0))
+				s->dead = 1;
 		}
-		else if (strcasecmp (fields[0], "putval") == 0)
+
+		prev = &us_subscribers;
+		while (*prev != NULL)
 		{
-			handle_putval (fhout, buffer);
+			s = *prev;
+			if (!s->dead)
+			{
+				prev = &s->next;
+				continue;
+			}
+			*prev = s->next;
+			us_subscriber_destroy (s);
 		}
-		else if (strcasecmp (fields[0], "listval") == 0)
+		pthread_mutex_unlock (&us_subscribers_lock);
+	} /* while (loop) */
+
+	sfree (fds);
+	return ((void *) 0);
+} /* void *us_subscriber_thread */
+
+static void us_stop_subscribers (void)
+{
+	if (us_subscriber_tid != (pthread_t) 0)
+	{
+		us_subscriber_wake ();
+		pthread_join (us_subscriber_tid, NULL);
+		us_subscriber_tid = (pthread_t) 0;
+	}
+
+	pthread_mutex_lock (&us_subscribers_lock);
+	while (us_subscribers != NULL)
+	{
+		us_subscriber_t *s = us_subscribers;
+		us_subscribers = s->next;
+		us_subscriber_destroy (s);
+	}
+	pthread_mutex_unlock (&us_subscribers_lock);
+} /* void us_stop_subscribers */
+
+/* Queues the values for all subscribers with a matching pattern. */
+static int us_write (const data_set_t *ds, const value_list_t *vl,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	char name[6 * DATA_MAX_NAME_LEN];
+	char line[6 * DATA_MAX_NAME_LEN + 1024];
+	_Bool have_line = 0;
+	_Bool wake = 0;
+	us_subscriber_t *s;
+
+	/* Checked without the lock, so values are not serialized while no one
+	 * is subscribed. */
+	if (us_subscribers == NULL)
+		return (0);
+
+	if (FORMAT_VL (name, sizeof (name), vl) != 0)
+		return (-1);
+
+	pthread_mutex_lock (&us_subscribers_lock);
+	for (s = us_subscribers; s != NULL; s = s->next)
+	{
+		char *copy;
+
+		if (s->dead || !us_subscriber_match (s, name))
+			continue;
+
+		if (!have_line)
 		{
-			handle_listval (fhout, buffer);
+			size_t len;
+
+			if (create_putval (line, sizeof (line) - 1, ds, vl) != 0)
+				break;
+			len = strlen (line);
+			line[len] = '\n';
+			line[len + 1] = 0;
+			have_line = 1;
 		}
-		else if (strcasecmp (fields[0], "putnotif") == 0)
+
+		copy = strdup (line);
+		if (copy == NULL)
+			continue;
+
+		if (us_subscriber_enqueue (s, copy))
+			wake = 1;
+	}
+	pthread_mutex_unlock (&us_subscribers_lock);
+
+	if (wake)
+		us_subscriber_wake ();
+
+	return (0);
+} /* int us_write */
+
+/* Handles one command. Returns less than zero if the connection should be
+ * closed and greater than zero if it has subscribed. */
+static int us_handle_line (us_client_t *c, char *buffer)
+{
+	FILE *fhout = c->fh;
+	char command[64];
+	size_t len;
+
+	buffer += strspn (buffer, " \t");
+
+	len = strlen (buffer);
+	while ((len > 0) && (buffer[len - 1] == '\r'))
+		buffer[--len] = '\0';
+
+	if (len == 0)
+		return (0);
+
+	len = strcspn (buffer, " \t");
+	if (len >= sizeof (command))
+		len = sizeof (command) - 1;
+	memcpy (command, buffer, len);
+	command[len] = '\0';
+
+	if (strcasecmp (command, "getval") == 0)
+	{
+		handle_getval (fhout, buffer);
+	}
+	else if (strcasecmp (command, "putval") == 0)
+	{
+		handle_putval (fhout, buffer);
+	}
+	else if (strcasecmp (command, "putvals") == 0)
+	{
+		handle_putvals (fhout, buffer);
+	}
+	else if (strcasecmp (command, "listval") == 0)
+	{
+		handle_listval (fhout, buffer);
+	}
+	else if (strcasecmp (command, "putnotif") == 0)
+	{
+		handle_putnotif (fhout, buffer);
+	}
+	else if (strcasecmp (command, "flush") == 0)
+	{
+		handle_flush (fhout, buffer);
+	}
+	else if (strcasecmp (command, "reload") == 0)
+	{
+		us_handle_reload (fhout);
+	}
+	else if (strcasecmp (command, "subscribe") == 0)
+	{
+		return (us_handle_subscribe (c, buffer));
+	}
+	else if (plugin_command (command, fhout, buffer) <= 0)
+	{
+		/* Handled by a plugin. */
+	}
+	else
+	{
+		if (fprintf (fhout, "-1 Unknown command: %s\n", command) < 0)
 		{
-			handle_putnotif (fhout, buffer);
+			char errbuf[1024];
+			WARNING ("unixsock plugin: failed to write to socket #%i: %s",
+					fileno (fhout),
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return (-1);
 		}
-		else if (strcasecmp (fields[0], "flush") == 0)
+	}
+
+	return (0);
+} /* int us_handle_line */
+
+/* Handles all complete lines in the buffer and keeps the rest for the next
+ * call. If "eof" is true, a trailing line without newline is handled, too.
+ * Returns greater than zero once the client has subscribed; the remaining
+ * input is ignored then. */
+static int us_client_process (us_client_t *c, _Bool eof)
+{
+	char *begin = c->buffer;
+	char *end = c->buffer + c->buffer_fill;
+
+	*end = '\0';
+	while (begin < end)
+	{
+		char *newline;
+
+		newline = memchr (begin, '\n', (size_t) (end - begin));
+		if (newline == NULL)
+		{
+			if (!eof)
+				break;
+			newline = end;
+		}
+		*newline = '\0';
+
+		if (c->discard)
 		{
-			handle_flush (fhout, buffer);
+			c->discard = 0;
 		}
 		else
 		{
-			if (fprintf (fhout, "-1 Unknown command: %s\n", fields[0]) < 0)
-			{
-				char errbuf[1024];
-				WARNING ("unixsock plugin: failed to write to socket #%i: %s",
-						fileno (fhout),
-						sstrerror (errno, errbuf, sizeof (errbuf)));
+			int status = us_handle_line (c, begin);
+			if (status != 0)
+				return (status);
+		}
+
+		begin = (newline < end) ? (newline + 1) : end;
+	}
+
+	c->buffer_fill = (size_t) (end - begin);
+	memmove (c->buffer, begin, c->buffer_fill);
+
+	if ((c->buffer_fill + 1) < c->buffer_size)
+		return (0);
+
+	if (c->buffer_size < US_LINE_MAX)
+	{
+		size_t new_size = 2 * c->buffer_size;
+		char *tmp;
+
+		if (new_size > US_LINE_MAX)
+			new_size = US_LINE_MAX;
+
+		tmp = realloc (c->buffer, new_size);
+		if (tmp == NULL)
+		{
+			ERROR ("unixsock plugin: realloc failed.");
+			return (-1);
+		}
+		c->buffer = tmp;
+		c->buffer_size = new_size;
+		return (0);
+	}
+
+	/* The buffer is full without holding a complete line. Skip the rest of
+	 * the line. */
+	if (!c->discard)
+	{
+		if (fprintf (c->fh, "-1 Line too long\n") < 0)
+			return (-1);
+		c->discard = 1;
+	}
+	c->buffer_fill = 0;
+
+	return (0);
+} /* int us_client_process */
+
+/* Reads what the client has sent and handles the commands. Called when poll()
+ * reported the connection as readable, so the first recv() doesn't block.
+ * Returns less than zero if the connection has been closed and greater than
+ * zero if it has subscribed. */
+static int us_client_handle (us_client_t *c)
+{
+	int status = 0;
+	int i;
+
+	for (i = 0; i < US_CLIENT_READS; i++)
+	{
+		ssize_t len;
+
+		len = recv (c->fd, c->buffer + c->buffer_fill,
+				c->buffer_size - c->buffer_fill - 1,
+				(i == 0) ? 0 : US_MSG_DONTWAIT);
+		if (len < 0)
+		{
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 				break;
-			}
+
+			WARNING ("unixsock plugin: failed to read from socket #%i: %s",
+					c->fd, sstrerror (errno, errbuf, sizeof (errbuf)));
+			status = -1;
+			break;
+		}
+		else if (len == 0)
+		{
+			us_client_process (c, /* eof = */ 1);
+			status = -1;
+			break;
+		}
+
+		c->buffer_fill += (size_t) len;
+		status = us_client_process (c, /* eof = */ 0);
+		if (status != 0)
+			break;
+
+#if !defined(MSG_DONTWAIT)
+		/* Without non-blocking reads, wait for poll() again. */
+		break;
+#endif
+	}
+
+	if ((fflush (c->fh) != 0) && (status == 0))
+	{
+		char errbuf[1024];
+		WARNING ("unixsock plugin: failed to write to socket #%i: %s",
+				c->fd, sstrerror (errno, errbuf, sizeof (errbuf)));
+		status = -1;
+	}
+
+	return (status);
+} /* int us_client_handle */
+
+static void us_wake_server (void)
+{
+	char c = 0;
+
+	/* If the pipe is full, the server will wake up anyway. */
+	if (write (us_wake_pipe[1], &c, 1) < 0)
+		return;
+} /* void us_wake_server */
+
+static void *us_worker_thread (void __attribute__((unused)) *arg)
+{
+	while (42)
+	{
+		us_client_t *c;
+		int status;
+
+		pthread_mutex_lock (&us_queue_lock);
+		while ((loop != 0) && (us_queue_head == NULL))
+			pthread_cond_wait (&us_queue_cond, &us_queue_lock);
+
+		if (us_queue_head == NULL)
+		{
+			pthread_mutex_unlock (&us_queue_lock);
+			break;
 		}
-	} /* while (fgets) */
 
-	DEBUG ("unixsock plugin: us_handle_client: Exiting..");
-	fclose (fhin);
-	fclose (fhout);
+		c = us_queue_head;
+		us_queue_head = c->next;
+		if (us_queue_head == NULL)
+			us_queue_tail = NULL;
+		c->next = NULL;
+		pthread_mutex_unlock (&us_queue_lock);
+
+		status = us_client_handle (c);
+		if (status < 0)
+		{
+			us_client_destroy (c);
+			continue;
+		}
+		else if (status > 0)
+		{
+			us_subscriber_add (c);
+			continue;
+		}
+
+		/* Hand the connection back to the server thread. */
+		pthread_mutex_lock (&us_queue_lock);
+		c->next = us_return_head;
+		us_return_head = c;
+		pthread_mutex_unlock (&us_queue_lock);
+		us_wake_server ();
+	}
 
-	pthread_exit ((void *) 0);
 	return ((void *) 0);
-} /* void *us_handle_client */
+} /* void *us_worker_thread */
 
-static void *us_server_thread (void __attribute__((unused)) *arg)
+static void us_queue_client (us_client_t *c)
 {
-	int  status;
-	int *remote_fd;
-	pthread_t th;
-	pthread_attr_t th_attr;
+	pthread_mutex_lock (&us_queue_lock);
+	c->next = NULL;
+	if (us_queue_tail == NULL)
+		us_queue_head = c;
+	else
+		us_queue_tail->next = c;
+	us_queue_tail = c;
+	pthread_cond_signal (&us_queue_cond);
+	pthread_mutex_unlock (&us_queue_lock);
+} /* void us_queue_client */
 
-	pthread_attr_init (&th_attr);
-	pthread_attr_setdetachstate (&th_attr, PTHREAD_CREATE_DETACHED);
+static int us_start_workers (void)
+{
+	size_t i;
 
-	if (us_open_socket () != 0)
-		pthread_exit ((void *) 1);
+	us_workers = calloc ((size_t) worker_threads_num, sizeof (*us_workers));
+	if (us_workers == NULL)
+	{
+		ERROR ("unixsock plugin: calloc failed.");
+		return (-1);
+	}
 
-	while (loop != 0)
+	for (i = 0; i < (size_t) worker_threads_num; i++)
 	{
-		DEBUG ("unixsock plugin: Calling accept..");
-		status = accept (sock_fd, NULL, NULL);
-		if (status < 0)
+		int status;
+
+		status = plugin_thread_create (us_workers + us_workers_num, NULL,
+				us_worker_thread, NULL);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("unixsock plugin: pthread_create failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			break;
+		}
+		us_workers_num++;
+	}
+
+	return ((us_workers_num > 0) ? 0 : -1);
+} /* int us_start_workers */
+
+static void us_stop_workers (void)
+{
+	size_t i;
+
+	pthread_mutex_lock (&us_queue_lock);
+	pthread_cond_broadcast (&us_queue_cond);
+	pthread_mutex_unlock (&us_queue_lock);
+
+	for (i = 0; i < us_workers_num; i++)
+		pthread_join (us_workers[i], NULL);
+	sfree (us_workers);
+	us_workers_num = 0;
+
+	/* The workers are gone, so no locking is needed anymore. */
+	while (us_queue_head != NULL)
+	{
+		us_client_t *c = us_queue_head;
+		us_queue_head = c->next;
+		us_client_destroy (c);
+	}
+	us_queue_tail = NULL;
+
+	while (us_return_head != NULL)
+	{
+		us_client_t *c = us_return_head;
+		us_return_head = c->next;
+		us_client_destroy (c);
+	}
+} /* void us_stop_workers */
+
+/* Accepts all pending connections. Returns less than zero if the socket
+ * failed. */
+static int us_accept_clients (us_client_t ***clients, size_t *clients_num,
+		size_t *clients_size)
+{
+	while (42)
+	{
+		us_client_t *c;
+		int fd;
+		int flags;
+
+		fd = accept (sock_fd, NULL, NULL);
+		if (fd < 0)
 		{
 			char errbuf[1024];
 
 			if (errno == EINTR)
 				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+					|| (errno == ECONNABORTED))
+				return (0);
 
 			ERROR ("unixsock plugin: accept failed: %s",
 					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (sock_fd);
-			sock_fd = -1;
-			pthread_attr_destroy (&th_attr);
-			pthread_exit ((void *) 1);
+			return (-1);
 		}
 
-		remote_fd = (int *) malloc (sizeof (int));
-		if (remote_fd == NULL)
+		/* Some systems pass O_NONBLOCK on to the new socket, but writes to
+		 * the client must block. */
+		flags = fcntl (fd, F_GETFL);
+		if ((flags != -1) && ((flags & O_NONBLOCK) != 0))
+			fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+
+		c = us_client_create (fd);
+		if (c == NULL)
 		{
-			char errbuf[1024];
-			WARNING ("unixsock plugin: malloc failed: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (status);
+			close (fd);
 			continue;
 		}
-		*remote_fd = status;
 
-		DEBUG ("Spawning child to handle connection on fd #%i", *remote_fd);
+		if (*clients_num >= *clients_size)
+		{
+			size_t new_size = (*clients_size == 0) ? 16 : (2 * *clients_size);
+			us_client_t **tmp;
+
+			tmp = realloc (*clients, new_size * sizeof (**clients));
+			if (tmp == NULL)
+			{
+				ERROR ("unixsock plugin: realloc failed.");
+				us_client_destroy (c);
+				continue;
+			}
+			*clients = tmp;
+			*clients_size = new_size;
+		}
 
-		status = plugin_thread_create (&th, &th_attr,
-				us_handle_client, (void *) remote_fd);
-		if (status != 0)
+		DEBUG ("unixsock plugin: Accepted connection on fd #%i", fd);
+		(*clients)[*clients_num] = c;
+		(*clients_num)++;
+	}
+} /* int us_accept_clients */
+
+/* Waits for new connections and for commands from the connected clients,
+ * using poll(2). Connections with pending input are handed to the worker
+ * threads and are given back when all commands have been handled, so each
+ * connection is served by one thread at a time. */
+static void *us_server_thread (void __attribute__((unused)) *arg)
+{
+	us_client_t **clients = NULL;
+	size_t clients_num = 0;
+	size_t clients_size = 0;
+	struct pollfd *fds = NULL;
+	size_t fds_size = 0;
+	int flags;
+	int status;
+	size_t i;
+
+	if (us_open_socket () != 0)
+		pthread_exit ((void *) 1);
+
+	flags = fcntl (sock_fd, F_GETFL);
+	if ((flags == -1) || (fcntl (sock_fd, F_SETFL, flags | O_NONBLOCK) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: fcntl failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (sock_fd);
+		sock_fd = -1;
+		pthread_exit ((void *) 1);
+	}
+
+	if (us_start_workers () != 0)
+	{
+		close (sock_fd);
+		sock_fd = -1;
+		pthread_exit ((void *) 1);
+	}
+
+	status = plugin_thread_create (&us_subscriber_tid, NULL,
+			us_subscriber_thread, NULL);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: pthread_create failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		us_subscriber_tid = (pthread_t) 0;
+	}
+
+	while (loop != 0)
+	{
+		size_t fds_num = clients_num + 2;
+		size_t polled_num;
+		size_t kept_num;
+
+		if (fds_num > fds_size)
+		{
+			struct pollfd *tmp;
+
+			tmp = realloc (fds, fds_num * sizeof (*fds));
+			if (tmp == NULL)
+			{
+				ERROR ("unixsock plugin: realloc failed.");
+				break;
+			}
+			fds = tmp;
+			fds_size = fds_num;
+		}
+
+		memset (fds, 0, fds_num * sizeof (*fds));
+		fds[0].fd = sock_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = us_wake_pipe[0];
+		fds[1].events = POLLIN;
+		for (i = 0; i < clients_num; i++)
+		{
+			fds[i + 2].fd = clients[i]->fd;
+			fds[i + 2].events = POLLIN;
+		}
+		polled_num = clients_num;
+
+		status = poll (fds, (nfds_t) fds_num, /* timeout = */ -1);
+		if (status < 0)
 		{
 			char errbuf[1024];
-			WARNING ("unixsock plugin: pthread_create failed: %s",
+
+			if (errno == EINTR)
+				continue;
+
+			ERROR ("unixsock plugin: poll failed: %s",
 					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (*remote_fd);
-			free (remote_fd);
-			continue;
+			break;
 		}
+
+		/* Hand connections with pending input (or errors) to the workers. */
+		kept_num = 0;
+		for (i = 0; i < polled_num; i++)
+		{
+			if (fds[i + 2].revents == 0)
+				clients[kept_num++] = clients[i];
+			else
+				us_queue_client (clients[i]);
+		}
+		clients_num = kept_num;
+
+		if (fds[1].revents != 0)
+		{
+			char buffer[64];
+			us_client_t *returned;
+
+			while (read (us_wake_pipe[0], buffer, sizeof (buffer)) > 0)
+				/* drain */;
+
+			pthread_mutex_lock (&us_queue_lock);
+			returned = us_return_head;
+			us_return_head = NULL;
+			pthread_mutex_unlock (&us_queue_lock);
+
+			while (returned != NULL)
+			{
+				us_client_t *c = returned;
+				returned = c->next;
+				c->next = NULL;
+
+				if (clients_num >= clients_size)
+				{
+					size_t new_size = (clients_size == 0)
+						? 16 : (2 * clients_size);
+					us_client_t **tmp;
+
+					tmp = realloc (clients, new_size * sizeof (*clients));
+					if (tmp == NULL)
+					{
+						ERROR ("unixsock plugin: realloc failed.");
+						us_client_destroy (c);
+						continue;
+					}
+					clients = tmp;
+					clients_size = new_size;
+				}
+				clients[clients_num++] = c;
+			}
+		}
+
+		if ((fds[0].revents != 0)
+				&& (us_accept_clients (&clients, &clients_num,
+						&clients_size) != 0))
+			break;
 	} /* while (loop) */
 
+	loop = 0;
+	us_stop_workers ();
+	us_stop_subscribers ();
+
+	for (i = 0; i < clients_num; i++)
+		us_client_destroy (clients[i]);
+	sfree (clients);
+	sfree (fds);
+
 	close (sock_fd);
 	sock_fd = -1;
-	pthread_attr_destroy (&th_attr);
 
 	status = unlink ((sock_file != NULL) ? sock_file : US_DEFAULT_PATH);
 	if (status != 0)
@@ -423,6 +1379,26 @@ static int us_config (const char *key, const char *val)
 		else
 			delete_socket = 0;
 	}
+	else if (strcasecmp (key, "WorkerThreads") == 0)
+	{
+		int tmp = atoi (val);
+		if (tmp < 1)
+		{
+			WARNING ("unixsock plugin: WorkerThreads must be at least 1.");
+			return (1);
+		}
+		worker_threads_num = tmp;
+	}
+	else if (strcasecmp (key, "SubscriberQueueSize") == 0)
+	{
+		int tmp = atoi (val);
+		if (tmp < 2)
+		{
+			WARNING ("unixsock plugin: SubscriberQueueSize must be at least 2.");
+			return (1);
+		}
+		subscriber_queue_size = (size_t) tmp;
+	}
 	else
 	{
 		return (-1);
@@ -444,6 +1420,30 @@ static int us_init (void)
 
 	loop = 1;
 
+	if (pipe (us_wake_pipe) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: pipe failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+	fcntl (us_wake_pipe[0], F_SETFL,
+			fcntl (us_wake_pipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl (us_wake_pipe[1], F_SETFL,
+			fcntl (us_wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+	if (pipe (us_subscriber_pipe) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: pipe failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+	fcntl (us_subscriber_pipe[0], F_SETFL,
+			fcntl (us_subscriber_pipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl (us_subscriber_pipe[1], F_SETFL,
+			fcntl (us_subscriber_pipe[1], F_GETFL) | O_NONBLOCK);
+
 	status = plugin_thread_create (&listen_thread, NULL,
 			us_server_thread, NULL);
 	if (status != 0)
@@ -465,12 +1465,29 @@ static int us_shutdown (void)
 
 	if (listen_thread != (pthread_t) 0)
 	{
-		pthread_kill (listen_thread, SIGTERM);
+		us_wake_server ();
 		pthread_join (listen_thread, &ret);
 		listen_thread = (pthread_t) 0;
 	}
 
+	if (us_wake_pipe[0] >= 0)
+	{
+		close (us_wake_pipe[0]);
+		close (us_wake_pipe[1]);
+		us_wake_pipe[0] = -1;
+		us_wake_pipe[1] = -1;
+	}
+
+	if (us_subscriber_pipe[0] >= 0)
+	{
+		close (us_subscriber_pipe[0]);
+		close (us_subscriber_pipe[1]);
+		us_subscriber_pipe[0] = -1;
+		us_subscriber_pipe[1] = -1;
+	}
+
 	plugin_unregister_init ("unixsock");
+	plugin_unregister_write ("unixsock");
 	plugin_unregister_shutdown ("unixsock");
 
 	return (0);
@@ -481,6 +1498,7 @@ void module_register (void)
 	plugin_register_config ("unixsock", us_config,
 			config_keys, config_keys_num);
 	plugin_register_init ("unixsock", us_init);
+	plugin_register_write ("unixsock", us_write, /* user_data = */ NULL);
 	plugin_register_shutdown ("unixsock", us_shutdown);
 } /* void module_register (void) */
 
@@ -0,0 +1,194 @@
+/**
+ * collectd - src/utils_affinity.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#define _GNU_SOURCE /* For pthread_setaffinity_np() */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_affinity.h"
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+# include <sched.h>
+#endif
+
+#define CPUSET_WORDS (C_CPUSETS_MAX_CPU / 64)
+
+struct c_cpuset_s
+{
+  uint64_t bits[CPUSET_WORDS];
+};
+typedef struct c_cpuset_s c_cpuset_t;
+
+struct c_cpusets_s
+{
+  c_cpuset_t *sets;
+  size_t sets_num;
+};
+
+static int cpu_number_parse (const char *str, int *ret) /* {{{ */
+{
+  char *endptr = NULL;
+  long n;
+
+  errno = 0;
+  n = strtol (str, &endptr, 10);
+  /* Unquoted numbers in the config file are passed on as "3.000000". */
+  if ((endptr != str) && (*endptr == '.'))
+    while (*(++endptr) == '0')
+      /* do nothing */;
+  if ((errno != 0) || (endptr == str) || (*endptr != 0)
+      || (n < 0) || (n >= C_CPUSETS_MAX_CPU))
+    return (EINVAL);
+
+  *ret = (int) n;
+  return (0);
+} /* }}} int cpu_number_parse */
+
+/* Parses one set, "0-3,8", into "set". Modifies "str". */
+static int cpuset_parse (char *str, c_cpuset_t *set) /* {{{ */
+{
+  char *saveptr = NULL;
+  char *item;
+
+  memset (set, 0, sizeof (*set));
+
+  for (item = strtok_r (str, ",", &saveptr); item != NULL;
+      item = strtok_r (NULL, ",", &saveptr))
+  {
+    char *dash = strchr (item, '-');
+    int first;
+    int last;
+    int i;
+
+    if (dash != NULL)
+      *dash = 0;
+
+    if (cpu_number_parse (item, &first) != 0)
+      return (EINVAL);
+    last = first;
+    if ((dash != NULL) && (cpu_number_parse (dash + 1, &last) != 0))
+      return (EINVAL);
+    if (last < first)
+      return (EINVAL);
+
+    for (i = first; i <= last; i++)
+      set->bits[i / 64] |= ((uint64_t) 1) << (i % 64);
+  }
+
+  return (0);
+} /* }}} int cpuset_parse */
+
+c_cpusets_t *c_cpusets_parse (const char *spec) /* {{{ */
+{
+  c_cpusets_t *s;
+  char *copy;
+  char *fields[64];
+  int fields_num;
+  int i;
+
+  if (spec == NULL)
+    return (NULL);
+
+  copy = strdup (spec);
+  if (copy == NULL)
+    return (NULL);
+
+  fields_num = strsplit (copy, fields, STATIC_ARRAY_SIZE (fields));
+  if (fields_num < 1)
+  {
+    ERROR ("c_cpusets_parse: No CPU set given.");
+    sfree (copy);
+    return (NULL);
+  }
+
+  s = calloc (1, sizeof (*s));
+  if (s != NULL)
+    s->sets = calloc ((size_t) fields_num, sizeof (*s->sets));
+  if ((s == NULL) || (s->sets == NULL))
+  {
+    ERROR ("c_cpusets_parse: calloc failed.");
+    c_cpusets_destroy (s);
+    sfree (copy);
+    return (NULL);
+  }
+
+  for (i = 0; i < fields_num; i++)
+  {
+    if (cpuset_parse (fields[i], s->sets + i) != 0)
+    {
+      ERROR ("c_cpusets_parse: Invalid CPU set in \"%s\". CPU sets are "
+          "lists of CPU numbers and ranges below %i, for example "
+          "\"0-3,8\".", spec, C_CPUSETS_MAX_CPU);
+      c_cpusets_destroy (s);
+      sfree (copy);
+      return (NULL);
+    }
+    s->sets_num++;
+  }
+
+  sfree (copy);
+  return (s);
+} /* }}} c_cpusets_t *c_cpusets_parse */
+
+void c_cpusets_destroy (c_cpusets_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
+
+  sfree (s->sets);
+  sfree (s);
+} /* }}} void c_cpusets_destroy */
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+int c_cpusets_apply (c_cpusets_t const *s, pthread_t thread, /* {{{ */
+    size_t index)
+{
+  c_cpuset_t const *set;
+  cpu_set_t cpus;
+  int i;
+
+  if ((s == NULL) || (s->sets_num == 0))
+    return (0);
+
+  set = s->sets + (index % s->sets_num);
+
+  CPU_ZERO (&cpus);
+  for (i = 0; (i < C_CPUSETS_MAX_CPU) && (i < CPU_SETSIZE); i++)
+    if (set->bits[i / 64] & (((uint64_t) 1) << (i % 64)))
+      CPU_SET (i, &cpus);
+
+  return (pthread_setaffinity_np (thread, sizeof (cpus), &cpus));
+} /* }}} int c_cpusets_apply */
+#else /* !HAVE_PTHREAD_SETAFFINITY_NP */
+int c_cpusets_apply (c_cpusets_t const *s, /* {{{ */
+    pthread_t __attribute__((unused)) thread,
+    size_t __attribute__((unused)) index)
+{
+  if (s == NULL)
+    return (0);
+
+  return (ENOTSUP);
+} /* }}} int c_cpusets_apply */
+#endif /* !HAVE_PTHREAD_SETAFFINITY_NP */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
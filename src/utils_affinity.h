@@ -0,0 +1,68 @@
+/**
+ * collectd - src/utils_affinity.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_AFFINITY_H
+#define UTILS_AFFINITY_H 1
+
+#include "collectd.h"
+
+#include <pthread.h>
+
+/*
+ * A list of CPU sets threads are pinned to. It is written as sets separated
+ * by white space, each a comma separated list of CPU numbers and ranges, for
+ * example "0-7,16-23 8-15,24-31" for two sets. The n-th thread of a pool is
+ * pinned to set n modulo the number of sets, so with one set per NUMA node
+ * and as many threads as nodes, each thread runs on a node of its own.
+ */
+struct c_cpusets_s;
+typedef struct c_cpusets_s c_cpusets_t;
+
+/*
+ * NAME
+ *   c_cpusets_parse
+ *
+ * DESCRIPTION
+ *   Parses `spec' as described above. Returns NULL and logs an error if it is
+ *   malformed or names a CPU greater than or equal to C_CPUSETS_MAX_CPU.
+ */
+#define C_CPUSETS_MAX_CPU 1024
+c_cpusets_t *c_cpusets_parse (const char *spec);
+void c_cpusets_destroy (c_cpusets_t *s);
+
+/*
+ * NAME
+ *   c_cpusets_apply
+ *
+ * DESCRIPTION
+ *   Pins `thread' to set number `index' modulo the number of sets in `s'.
+ *   Memory the thread allocates and touches first afterwards is then, with
+ *   the default policy of Linux, allocated on the NUMA node of those CPUs.
+ *   Does nothing if `s' is NULL.
+ *
+ * RETURN VALUE
+ *   Zero upon success, ENOTSUP if the system doesn't support pinning threads
+ *   and the error returned by pthread_setaffinity_np() otherwise.
+ */
+int c_cpusets_apply (c_cpusets_t const *s, pthread_t thread, size_t index);
+
+#endif /* UTILS_AFFINITY_H */
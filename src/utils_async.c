@@ -0,0 +1,772 @@
+/**
+ * collectd - src/utils_async.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_complain.h"
+#include "utils_async.h"
+
+#include <pthread.h>
+#include <netdb.h>
+
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+
+#define UAS_REQUEST_SIZE 4096
+#define UAS_RESPONSE_MAX (1024 * 1024)
+/* How long an event loop thread sleeps at most, which is also the accuracy
+ * of the timeouts. */
+#define UAS_WAIT_MS 1000
+
+struct uas_thread_s;
+typedef struct uas_thread_s uas_thread_t;
+
+struct uas_request_s
+{
+  char name[DATA_MAX_NAME_LEN];
+  plugin_async_read_t cb;
+  user_data_t ud;
+  plugin_ctx_t ctx;
+  c_complain_t complaint;
+
+  int fd;
+  char request[UAS_REQUEST_SIZE];
+  size_t request_len;
+  size_t request_sent;
+  _Bool sending;
+  char *response;
+  size_t response_len;
+  size_t response_size;
+  cdtime_t deadline;
+
+  /* "busy" is set by uas_request_start() and cleared once the exchange has
+   * finished. While it is set, the request belongs to "thread" and is in its
+   * list; both are protected by the thread's lock. */
+  volatile _Bool busy;
+  uas_thread_t *thread;
+  uas_request_t *prev;
+  uas_request_t *next;
+};
+
+#if HAVE_SYS_EPOLL_H
+struct uas_thread_s
+{
+  pthread_t thread;
+  _Bool thread_running;
+  int epoll_fd;
+  int pipe_fd[2];
+
+  /* Protects the list of exchanges in progress, the requests destroyed
+   * while they were in progress, which the thread frees once no event can
+   * refer to them any more, and "shutdown". */
+  pthread_mutex_t lock;
+  uas_request_t *busy_head;
+  uas_request_t *dead;
+  _Bool shutdown;
+};
+
+/*
+ * Private variables
+ */
+static pthread_mutex_t uas_lock = PTHREAD_MUTEX_INITIALIZER;
+static uas_thread_t *uas_threads = NULL;
+static size_t uas_threads_num = 0;
+static size_t uas_next_thread = 0;
+static _Bool uas_stopped = 0;
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ * Private functions
+ */
+static void uas_request_free (uas_request_t *r) /* {{{ */
+{
+  if (r->fd >= 0)
+    close (r->fd);
+  sfree (r->response);
+  if (r->ud.free_func != NULL)
+    r->ud.free_func (r->ud.data);
+  sfree (r);
+} /* }}} void uas_request_free */
+
+/* Moves the exchange forward. Returns zero while it is in progress, greater
+ * than zero once the response has been parsed and less than zero if it
+ * failed. */
+static int uas_request_io (uas_request_t *r, /* {{{ */
+    _Bool readable, _Bool writable)
+{
+  plugin_ctx_t old_ctx;
+  _Bool received = 0;
+  _Bool eof = 0;
+  int status;
+
+  if (r->sending)
+  {
+    if (!writable)
+      return (0);
+
+    if (r->request_sent == 0)
+    {
+      int error = 0;
+      socklen_t error_len = sizeof (error);
+
+      if (getsockopt (r->fd, SOL_SOCKET, SO_ERROR,
+            &error, &error_len) != 0)
+        error = errno;
+      if (error != 0)
+      {
+        char errbuf[1024];
+        c_complain (LOG_ERR, &r->complaint, "%s: Connecting failed: %s",
+            r->name, sstrerror (error, errbuf, sizeof (errbuf)));
+        return (-1);
+      }
+    }
+
+    while (r->request_sent < r->request_len)
+    {
+      ssize_t n = write (r->fd, r->request + r->request_sent,
+          r->request_len - r->request_sent);
+
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        return (0);
+      if (n < 0)
+      {
+        char errbuf[1024];
+        c_complain (LOG_ERR, &r->complaint,
+            "%s: Sending the request failed: %s", r->name,
+            sstrerror (errno, errbuf, sizeof (errbuf)));
+        return (-1);
+      }
+      r->request_sent += (size_t) n;
+    }
+
+    r->sending = 0;
+    return (0);
+  }
+
+  if (!readable)
+    return (0);
+
+  while (42)
+  {
+    ssize_t n;
+
+    if (r->response_len + 1 >= r->response_size)
+    {
+      size_t size = (r->response_size > 0) ? (2 * r->response_size) : 4096;
+      char *tmp;
+
+      if (size > UAS_RESPONSE_MAX)
+      {
+        c_complain (LOG_ERR, &r->complaint,
+            "%s: The response exceeds %i bytes.", r->name, UAS_RESPONSE_MAX);
+        return (-1);
+      }
+
+      tmp = realloc (r->response, size);
+      if (tmp == NULL)
+        return (-1);
+      r->response = tmp;
+      r->response_size = size;
+    }
+
+    n = read (r->fd, r->response + r->response_len,
+        r->response_size - r->response_len - 1);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      break;
+    if (n < 0)
+    {
+      char errbuf[1024];
+      c_complain (LOG_ERR, &r->complaint, "%s: Receiving failed: %s",
+          r->name, sstrerror (errno, errbuf, sizeof (errbuf)));
+      return (-1);
+    }
+    if (n == 0)
+    {
+      eof = 1;
+      break;
+    }
+
+    r->response_len += (size_t) n;
+    received = 1;
+  }
+
+  if (!received && !eof)
+    return (0);
+  r->response[r->response_len] = 0;
+
+  old_ctx = plugin_set_ctx (r->ctx);
+  status = r->cb.parse (r->response, r->response_len, eof, &r->ud);
+  plugin_set_ctx (old_ctx);
+
+  if (status == 0)
+    return (1);
+  else if ((status == EAGAIN) && !eof)
+    return (0);
+
+  if (status == EAGAIN)
+    c_complain (LOG_ERR, &r->complaint, "%s: The peer closed the "
+        "connection before the response was complete.", r->name);
+  else
+    c_complain (LOG_ERR, &r->complaint, "%s: Parsing the response failed "
+        "with status %i.", r->name, status);
+  return (-1);
+} /* }}} int uas_request_io */
+
+/* Closes the socket unless the exchange succeeded and it's to be kept. */
+static void uas_request_done (uas_request_t *r, int status) /* {{{ */
+{
+  if (((status <= 0) || !r->cb.keep_open) && (r->fd >= 0))
+  {
+    close (r->fd);
+    r->fd = -1;
+  }
+
+  if (status > 0)
+    c_release (LOG_INFO, &r->complaint, "%s: Exchanges succeed again.",
+        r->name);
+} /* }}} void uas_request_done */
+
+#if HAVE_SYS_EPOLL_H
+/* Ends the exchange of "r". Call with the thread's lock held. */
+static void uas_request_finish (uas_thread_t *t, uas_request_t *r, /* {{{ */
+    int status)
+{
+  epoll_ctl (t->epoll_fd, EPOLL_CTL_DEL, r->fd, /* event = */ NULL);
+  uas_request_done (r, status);
+
+  if (r->prev != NULL)
+    r->prev->next = r->next;
+  else
+    t->busy_head = r->next;
+  if (r->next != NULL)
+    r->next->prev = r->prev;
+  r->prev = r->next = NULL;
+
+  r->busy = 0;
+} /* }}} void uas_request_finish */
+
+static void uas_thread_handle (uas_thread_t *t, uas_request_t *r, /* {{{ */
+    uint32_t events)
+{
+  _Bool was_sending = r->sending;
+  int status;
+
+  status = uas_request_io (r,
+      (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0,
+      (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0);
+
+  /* The request is out, wait for the response. */
+  if ((status == 0) && was_sending && !r->sending)
+  {
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    if (epoll_ctl (t->epoll_fd, EPOLL_CTL_MOD, r->fd, &ev) != 0)
+      status = -1;
+  }
+
+  if (status != 0)
+    uas_request_finish (t, r, status);
+} /* }}} void uas_thread_handle */
+
+static void *uas_thread_main (void *arg) /* {{{ */
+{
+  uas_thread_t *t = arg;
+
+  while (42)
+  {
+    struct epoll_event events[64];
+    uas_request_t *r;
+    cdtime_t now;
+    int events_num;
+    int i;
+
+    events_num = epoll_wait (t->epoll_fd, events, STATIC_ARRAY_SIZE (events),
+        UAS_WAIT_MS);
+    if ((events_num < 0) && (errno != EINTR))
+    {
+      char errbuf[1024];
+      ERROR ("utils_async: epoll_wait failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      sleep (1);
+    }
+
+    pthread_mutex_lock (&t->lock);
+    if (t->shutdown)
+      break;
+
+    for (i = 0; i < events_num; i++)
+    {
+      char buffer[64];
+
+      r = events[i].data.ptr;
+      if (r == NULL)
+      {
+        while (read (t->pipe_fd[0], buffer, sizeof (buffer)) > 0)
+          /* drain */;
+        continue;
+      }
+
+      /* Finished or destroyed since epoll_wait returned. */
+      if (!r->busy)
+        continue;
+
+      uas_thread_handle (t, r, events[i].events);
+    }
+
+    now = cdtime ();
+    r = t->busy_head;
+    while (r != NULL)
+    {
+      uas_request_t *next = r->next;
+
+      if (r->deadline <= now)
+      {
+        c_complain (LOG_ERR, &r->complaint, "%s: The exchange timed out.",
+            r->name);
+        uas_request_finish (t, r, -1);
+      }
+      r = next;
+    }
+
+    /* No event returned by the next epoll_wait can refer to these. */
+    while ((r = t->dead) != NULL)
+    {
+      t->dead = r->next;
+      uas_request_free (r);
+    }
+    pthread_mutex_unlock (&t->lock);
+  }
+
+  while (t->busy_head != NULL)
+    uas_request_finish (t, t->busy_head, -1);
+  while (t->dead != NULL)
+  {
+    uas_request_t *r = t->dead;
+
+    t->dead = r->next;
+    uas_request_free (r);
+  }
+  pthread_mutex_unlock (&t->lock);
+
+  return ((void *) 0);
+} /* }}} void *uas_thread_main */
+
+static void uas_thread_destroy (uas_thread_t *t) /* {{{ */
+{
+  if (t->thread_running)
+  {
+    pthread_join (t->thread, /* retval = */ NULL);
+    t->thread_running = 0;
+  }
+
+  if (t->epoll_fd >= 0)
+    close (t->epoll_fd);
+  if (t->pipe_fd[0] >= 0)
+    close (t->pipe_fd[0]);
+  if (t->pipe_fd[1] >= 0)
+    close (t->pipe_fd[1]);
+  t->epoll_fd = t->pipe_fd[0] = t->pipe_fd[1] = -1;
+
+  pthread_mutex_destroy (&t->lock);
+} /* }}} void uas_thread_destroy */
+
+static int uas_thread_init (uas_thread_t *t) /* {{{ */
+{
+  struct epoll_event ev;
+  int status;
+
+  memset (t, 0, sizeof (*t));
+  pthread_mutex_init (&t->lock, /* attr = */ NULL);
+  t->pipe_fd[0] = t->pipe_fd[1] = -1;
+
+  t->epoll_fd = epoll_create (64);
+  if ((t->epoll_fd < 0) || (pipe (t->pipe_fd) != 0))
+  {
+    char errbuf[1024];
+    ERROR ("utils_async: Creating an event loop failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+  fcntl (t->pipe_fd[0], F_SETFL, fcntl (t->pipe_fd[0], F_GETFL) | O_NONBLOCK);
+  fcntl (t->pipe_fd[1], F_SETFL, fcntl (t->pipe_fd[1], F_GETFL) | O_NONBLOCK);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl (t->epoll_fd, EPOLL_CTL_ADD, t->pipe_fd[0], &ev) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("utils_async: epoll_ctl failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  status = plugin_thread_create (&t->thread, /* attr = */ NULL,
+      uas_thread_main, t);
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("utils_async: pthread_create failed: %s",
+        sstrerror (status, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+  t->thread_running = 1;
+
+  return (0);
+} /* }}} int uas_thread_init */
+
+/* Starts the event loop threads. Call with "uas_lock" held. */
+static int uas_start (void) /* {{{ */
+{
+  int num;
+  int i;
+
+  if (uas_threads != NULL)
+    return (0);
+
+  num = atoi (global_option_get ("AsyncReadThreads"));
+  if (num < 1)
+    num = 2;
+
+  uas_threads = calloc ((size_t) num, sizeof (*uas_threads));
+  if (uas_threads == NULL)
+  {
+    ERROR ("utils_async: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < num; i++)
+  {
+    if (uas_thread_init (uas_threads + i) != 0)
+    {
+      int j;
+
+      for (j = 0; j <= i; j++)
+      {
+        pthread_mutex_lock (&uas_threads[j].lock);
+        uas_threads[j].shutdown = 1;
+        pthread_mutex_unlock (&uas_threads[j].lock);
+        if ((uas_threads[j].pipe_fd[1] >= 0)
+            && (write (uas_threads[j].pipe_fd[1], "", 1) < 0))
+          /* the thread will notice within UAS_WAIT_MS */;
+      }
+      for (j = 0; j <= i; j++)
+        uas_thread_destroy (uas_threads + j);
+      sfree (uas_threads);
+      return (-1);
+    }
+  }
+
+  uas_threads_num = (size_t) num;
+  INFO ("utils_async: Started %i event loop threads.", num);
+  return (0);
+} /* }}} int uas_start */
+
+/* Returns the thread running the exchanges of "r". */
+static uas_thread_t *uas_thread_get (uas_request_t *r) /* {{{ */
+{
+  uas_thread_t *t = NULL;
+
+  pthread_mutex_lock (&uas_lock);
+  if (!uas_stopped && (uas_start () == 0))
+  {
+    if ((r->thread == NULL) && (uas_threads_num > 0))
+    {
+      r->thread = uas_threads + (uas_next_thread % uas_threads_num);
+      uas_next_thread++;
+    }
+    t = r->thread;
+  }
+  pthread_mutex_unlock (&uas_lock);
+
+  return (t);
+} /* }}} uas_thread_t *uas_thread_get */
+
+#else /* !HAVE_SYS_EPOLL_H */
+/* Runs the exchange in the calling thread. */
+static int uas_request_run (uas_request_t *r) /* {{{ */
+{
+  int status = 0;
+
+  while (status == 0)
+  {
+    struct pollfd pfd;
+    cdtime_t now = cdtime ();
+
+    if (now >= r->deadline)
+    {
+      c_complain (LOG_ERR, &r->complaint, "%s: The exchange timed out.",
+          r->name);
+      status = -1;
+      break;
+    }
+
+    memset (&pfd, 0, sizeof (pfd));
+    pfd.fd = r->fd;
+    pfd.events = r->sending ? POLLOUT : POLLIN;
+    if (poll (&pfd, 1, (int) CDTIME_T_TO_MS (r->deadline - now)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      status = -1;
+      break;
+    }
+
+    status = uas_request_io (r,
+        (pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0,
+        (pfd.revents & (POLLOUT | POLLHUP | POLLERR)) != 0);
+  }
+
+  uas_request_done (r, status);
+  return ((status > 0) ? 0 : -1);
+} /* }}} int uas_request_run */
+#endif /* !HAVE_SYS_EPOLL_H */
+
+/*
+ * Public functions
+ */
+int uas_connect (const char *name, const char *host, /* {{{ */
+    const char *port, int socktype)
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  int fd = -1;
+  int status;
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = socktype;
+
+  status = getaddrinfo (host, port, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("%s: getaddrinfo (%s, %s) failed: %s", name, host, port,
+        (status == EAI_SYSTEM)
+        ? sstrerror (errno, errbuf, sizeof (errbuf))
+        : gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        ai_ptr->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    if ((fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == 0)
+        && ((connect (fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0)
+          || (errno == EINPROGRESS)))
+      break;
+
+    close (fd);
+    fd = -1;
+  }
+  freeaddrinfo (ai_list);
+
+  if (fd < 0)
+    ERROR ("%s: Connecting to %s:%s failed.", name, host, port);
+  return (fd);
+} /* }}} int uas_connect */
+
+uas_request_t *uas_request_create (const char *name, /* {{{ */
+    const plugin_async_read_t *cb, user_data_t *ud)
+{
+  uas_request_t *r;
+
+  if ((name == NULL) || (cb == NULL) || (cb->connect == NULL)
+      || (cb->parse == NULL))
+    return (NULL);
+
+  r = calloc (1, sizeof (*r));
+  if (r == NULL)
+    return (NULL);
+
+  sstrncpy (r->name, name, sizeof (r->name));
+  r->cb = *cb;
+  if (ud != NULL)
+    r->ud = *ud;
+  r->ctx = plugin_get_ctx ();
+  C_COMPLAIN_INIT (&r->complaint);
+  r->fd = -1;
+
+  return (r);
+} /* }}} uas_request_t *uas_request_create */
+
+int uas_request_start (uas_request_t *r) /* {{{ */
+{
+#if HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  uas_thread_t *t;
+#endif
+  cdtime_t timeout;
+
+  /* Only this function sets "busy", so it can't become set meanwhile. */
+  if (r->busy)
+  {
+    NOTICE ("%s: The previous exchange is still in progress. Skipping this "
+        "interval.", r->name);
+    return (0);
+  }
+
+  timeout = (r->cb.timeout > 0) ? r->cb.timeout : plugin_get_interval ();
+
+  if (r->fd < 0)
+  {
+    r->fd = r->cb.connect (&r->ud);
+    if (r->fd < 0)
+      return (-1);
+  }
+
+  r->request_len = 0;
+  if (r->cb.request != NULL)
+  {
+    int len = r->cb.request (r->request, sizeof (r->request), &r->ud);
+
+    if ((len < 0) || ((size_t) len > sizeof (r->request)))
+    {
+      uas_request_done (r, -1);
+      return (-1);
+    }
+    r->request_len = (size_t) len;
+  }
+
+  r->request_sent = 0;
+  r->sending = 1;
+  r->response_len = 0;
+  r->deadline = cdtime () + timeout;
+
+#if HAVE_SYS_EPOLL_H
+  t = uas_thread_get (r);
+  if (t == NULL)
+  {
+    uas_request_done (r, -1);
+    return (-1);
+  }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLOUT;
+  ev.data.ptr = r;
+
+  pthread_mutex_lock (&t->lock);
+  if (t->shutdown || (epoll_ctl (t->epoll_fd, EPOLL_CTL_ADD, r->fd, &ev) != 0))
+  {
+    pthread_mutex_unlock (&t->lock);
+    uas_request_done (r, -1);
+    return (-1);
+  }
+
+  r->busy = 1;
+  r->prev = NULL;
+  r->next = t->busy_head;
+  if (t->busy_head != NULL)
+    t->busy_head->prev = r;
+  t->busy_head = r;
+  pthread_mutex_unlock (&t->lock);
+
+  return (0);
+#else
+  return (uas_request_run (r));
+#endif
+} /* }}} int uas_request_start */
+
+void uas_request_destroy (uas_request_t *r, _Bool free_user_data) /* {{{ */
+{
+  if (r == NULL)
+    return;
+
+  if (!free_user_data)
+    r->ud.free_func = NULL;
+
+#if HAVE_SYS_EPOLL_H
+  if (r->busy)
+  {
+    uas_thread_t *t = r->thread;
+
+    pthread_mutex_lock (&t->lock);
+    if (r->busy)
+    {
+      uas_request_finish (t, r, -1);
+      r->next = t->dead;
+      t->dead = r;
+      pthread_mutex_unlock (&t->lock);
+      return;
+    }
+    pthread_mutex_unlock (&t->lock);
+  }
+#endif
+
+  uas_request_free (r);
+} /* }}} void uas_request_destroy */
+
+void uas_shutdown (void) /* {{{ */
+{
+#if HAVE_SYS_EPOLL_H
+  uas_thread_t *threads;
+  size_t threads_num;
+  size_t i;
+
+  pthread_mutex_lock (&uas_lock);
+  uas_stopped = 1;
+  threads = uas_threads;
+  threads_num = uas_threads_num;
+  uas_threads = NULL;
+  uas_threads_num = 0;
+  pthread_mutex_unlock (&uas_lock);
+
+  if (threads == NULL)
+    return;
+
+  for (i = 0; i < threads_num; i++)
+  {
+    pthread_mutex_lock (&threads[i].lock);
+    threads[i].shutdown = 1;
+    pthread_mutex_unlock (&threads[i].lock);
+    if (write (threads[i].pipe_fd[1], "", 1) < 0)
+      /* the thread will notice within UAS_WAIT_MS */;
+  }
+
+  /* The threads abort their exchanges, after which no request refers to
+   * them any more. */
+  for (i = 0; i < threads_num; i++)
+    uas_thread_destroy (threads + i);
+  sfree (threads);
+#endif
+} /* }}} void uas_shutdown */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,102 @@
+/**
+ * collectd - src/utils_async.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_ASYNC_H
+#define UTILS_ASYNC_H 1
+
+#include "plugin.h"
+
+/*
+ * The event loop behind plugin_register_async_read(). Exchanges are driven
+ * by a few threads sharing one epoll(7) set each, started on first use; the
+ * number is set by the global `AsyncReadThreads' option. Where epoll isn't
+ * available, the exchange is run by the read callback itself. Plugins only
+ * need uas_connect(), the rest is used by the daemon.
+ */
+
+struct uas_request_s;
+typedef struct uas_request_s uas_request_t;
+
+/*
+ * NAME
+ *   uas_connect
+ *
+ * DESCRIPTION
+ *   Resolves `host' and `port' and starts connecting a non-blocking socket of
+ *   type `socktype', SOCK_STREAM or SOCK_DGRAM, to the first address that
+ *   works. Meant to be called from the `connect' callback of an asynchronous
+ *   read function. Errors are logged with `name' as the prefix.
+ *
+ * RETURN VALUE
+ *   The socket, which may still be connecting, or less than zero.
+ */
+int uas_connect (const char *name, const char *host, const char *port,
+    int socktype);
+
+/*
+ * NAME
+ *   uas_request_create
+ *
+ * DESCRIPTION
+ *   Creates the state of the asynchronous read function `name'. `cb' and
+ *   `ud' are copied.
+ */
+uas_request_t *uas_request_create (const char *name,
+    const plugin_async_read_t *cb, user_data_t *ud);
+
+/*
+ * NAME
+ *   uas_request_start
+ *
+ * DESCRIPTION
+ *   Starts an exchange, unless the previous one is still in progress. Called
+ *   by the read callback.
+ *
+ * RETURN VALUE
+ *   Zero if the exchange was started or is still in progress, non-zero if
+ *   connecting or building the request failed. Without epoll, the result of
+ *   the whole exchange.
+ */
+int uas_request_start (uas_request_t *r);
+
+/*
+ * NAME
+ *   uas_request_destroy
+ *
+ * DESCRIPTION
+ *   Aborts the exchange in progress, closes the socket and frees `r' and,
+ *   if `free_user_data' is true, its user data, possibly later and from
+ *   another thread.
+ */
+void uas_request_destroy (uas_request_t *r, _Bool free_user_data);
+
+/*
+ * NAME
+ *   uas_shutdown
+ *
+ * DESCRIPTION
+ *   Aborts all exchanges and stops the event loop threads. Must be called
+ *   after the read threads have been stopped and before the write threads
+ *   are. Exchanges can't be started afterwards.
+ */
+void uas_shutdown (void);
+
+#endif /* UTILS_ASYNC_H */
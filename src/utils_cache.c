@@ -22,16 +22,29 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
-#include "utils_avltree.h"
 #include "utils_cache.h"
+#include "utils_lock.h"
+#include "utils_htable.h"
 #include "meta_data.h"
 
 #include <assert.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
+#if HAVE_FNMATCH_H
+# include <fnmatch.h>
+#endif
+
+#if HAVE_REGEX_H
+# include <regex.h>
+#endif
+
+/* Entries are allocated in one piece: the struct is followed by the raw
+ * values, the gauge values and the name, which take only as much space as
+ * they need. */
 typedef struct cache_entry_s
 {
-	char name[6 * DATA_MAX_NAME_LEN];
+	char      *name;
 	int        values_num;
 	gauge_t   *values_gauge;
 	value_t   *values_raw;
@@ -46,6 +59,9 @@ typedef struct cache_entry_s
 	cdtime_t interval;
 	int state;
 	int hits;
+	/* Which of the loops in uc_update_values() handles this entry, see
+	 * uc_data_set_kind(). */
+	int kind;
 
 	/*
 	 * +-----+-----+-----+-----+-----+-----+-----+-----+-----+----
@@ -61,45 +77,654 @@ typedef struct cache_entry_s
 	size_t   history_length;
 
 	meta_data_t *meta;
+
+	/* Values last passed on by a filter which suppresses unchanged values,
+	 * see uc_handle_set_emitted(). Allocated when first set. */
+	gauge_t *values_emitted;
+	cdtime_t emitted_time;
+
+	/* Hash of "name", see plugin_hash_string(), and the next entry in the
+	 * same bucket. */
+	uint64_t hash;
+	struct cache_entry_s *next;
+
+	/* Position in the timer wheel of the shard. "timer_pprev" is NULL while
+	 * the entry is not in the wheel, i.e. while it is being timed out. */
+	uint64_t timer_tick;
+	struct cache_entry_s *timer_next;
+	struct cache_entry_s **timer_pprev;
+
+	/* Counts of the plugin and host the entry is accounted to, see
+	 * uc_set_series_limits(). NULL unless a limit is configured. */
+	struct cache_series_s *series_plugin;
+	struct cache_series_s *series_host;
+
+	/* value_t values_raw[values_num], gauge_t values_gauge[values_num],
+	 * char name[]; both types are 8 bytes, so the alignment is right. */
+	value_t data[];
 } cache_entry_t;
 
-static c_avl_tree_t   *cache_tree = NULL;
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Entries whose data sources are all gauges or all derives are updated by a
+ * loop of their own, without looking at each data source's type. */
+#define CACHE_KIND_MIXED  0
+#define CACHE_KIND_GAUGE  1
+#define CACHE_KIND_DERIVE 2
+
+/* Longest name, including the null byte, as formatted by uc_get_key(). */
+#define CACHE_NAME_MAX (6 * DATA_MAX_NAME_LEN)
+
+/* The cache is split into shards, each a hash table with its own lock, so
+ * that threads updating different series rarely contend. The shard is chosen
+ * by the upper bits of the hash, the bucket by the lower bits. */
+#define CACHE_SHARDS_BITS 6
+#define CACHE_SHARDS      (1 << CACHE_SHARDS_BITS)
+#define CACHE_SHARD_INDEX(hash) \
+  ((size_t) ((hash) >> (64 - CACHE_SHARDS_BITS)))
+#define CACHE_BUCKETS_MIN 64
+
+/* Each shard keeps its entries in a hierarchical timer wheel, sorted by the
+ * time they time out at, so uc_check_timeout() only visits the entries which
+ * actually do. The wheel ticks once per second. Level 0 has one slot per
+ * tick; each slot of the level above covers all slots of the level below,
+ * and its entries are moved down once those have been passed. */
+#define CACHE_WHEEL_BITS   6
+#define CACHE_WHEEL_SLOTS  (1 << CACHE_WHEEL_BITS)
+#define CACHE_WHEEL_MASK   (CACHE_WHEEL_SLOTS - 1)
+#define CACHE_WHEEL_LEVELS 4
+
+/* Number of updates uc_update_multi() sorts by shard at once. */
+#define CACHE_UPDATE_CHUNK 128
+
+typedef struct cache_shard_s
+{
+	c_mutex_t       lock;
+	cache_entry_t **buckets;
+	size_t          buckets_num;
+	size_t          entries_num;
+
+	cache_entry_t  *wheel[CACHE_WHEEL_LEVELS][CACHE_WHEEL_SLOTS];
+	/* The next tick to be handled. Zero until the first entry is added. */
+	uint64_t        wheel_tick;
+} cache_shard_t;
+
+static cache_shard_t   cache_shards[CACHE_SHARDS];
+static pthread_once_t  cache_once = PTHREAD_ONCE_INIT;
+/* Number of values rejected by uc_update() because they were not newer than
+ * the cached value. Updated atomically. */
+static volatile uint64_t cache_values_too_old = 0;
+/* Bytes allocated for entries, histories and hash buckets. Updated
+ * atomically. */
+static volatile uint64_t cache_memory = 0;
+
+#define CACHE_MEMORY_ADD(n) \
+  (void) __sync_add_and_fetch (&cache_memory, (uint64_t) (n))
+#define CACHE_MEMORY_SUB(n) \
+  (void) __sync_sub_and_fetch (&cache_memory, (uint64_t) (n))
+
+/* Number of entries created since startup, and of values rejected because
+ * their series would have exceeded a limit. Updated atomically. */
+static volatile uint64_t cache_series_created = 0;
+static volatile uint64_t cache_values_rejected = 0;
+
+/* Number of entries of one plugin or host. While a limit is configured, each
+ * entry is accounted to the count of its plugin and, if hosts are limited,
+ * of its host, so a single source adding series without bound can't fill
+ * the cache. Counts of plugins are kept, those of hosts are freed together
+ * with their last entry. Inserting a series is rare compared to updating
+ * one, so a single lock is good enough. The lock of a shard may be held
+ * while taking "cache_series_lock", never the other way round. */
+typedef struct cache_series_s
+{
+	char    *name;
+	size_t   entries;
+	uint64_t created;
+	uint64_t rejected;
+	/* Whether reaching the limit has been reported. Cleared once the
+	 * number of entries drops below the limit again. */
+	_Bool    reported;
+} cache_series_t;
+
+static c_mutex_t   cache_series_lock;
+static c_htable_t *cache_series_plugins = NULL;
+static c_htable_t *cache_series_hosts = NULL;
+static size_t      cache_series_limit_plugin = 0;
+static size_t      cache_series_limit_host = 0;
+
+static void cache_shards_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SHARDS; i++)
+  {
+    memset (cache_shards + i, 0, sizeof (cache_shards[i]));
+    c_mutex_init (&cache_shards[i].lock, "cache");
+  }
+  c_mutex_init (&cache_series_lock, "cache_series");
+} /* void cache_shards_init */
+
+static cache_shard_t *cache_shard_get (uint64_t hash)
+{
+  pthread_once (&cache_once, cache_shards_init);
+  return (cache_shards + CACHE_SHARD_INDEX (hash));
+} /* cache_shard_t *cache_shard_get */
+
+/* The lock of "shard" must be held. */
+static cache_entry_t *cache_lookup (cache_shard_t *shard,
+    const char *name, uint64_t hash)
+{
+  cache_entry_t *ce;
+
+  if (shard->buckets_num == 0)
+    return (NULL);
+
+  for (ce = shard->buckets[hash & (shard->buckets_num - 1)];
+      ce != NULL;
+      ce = ce->next)
+    if ((ce->hash == hash) && (strcmp (ce->name, name) == 0))
+      return (ce);
+
+  return (NULL);
+} /* cache_entry_t *cache_lookup */
+
+/* The lock of "shard" must be held. */
+static int cache_link (cache_shard_t *shard, cache_entry_t *ce)
+{
+  size_t bucket;
+
+  /* Keep the chains short: grow once there are more entries than buckets. */
+  if (shard->entries_num >= shard->buckets_num)
+  {
+    size_t new_num;
+    cache_entry_t **new_buckets;
+    size_t i;
+
+    new_num = (shard->buckets_num == 0)
+      ? CACHE_BUCKETS_MIN : (2 * shard->buckets_num);
+    new_buckets = calloc (new_num, sizeof (*new_buckets));
+    if ((new_buckets == NULL) && (shard->buckets_num == 0))
+      return (ENOMEM);
+
+    /* If growing fails, the chains just get longer. */
+    if (new_buckets != NULL)
+    {
+      for (i = 0; i < shard->buckets_num; i++)
+      {
+        cache_entry_t *this = shard->buckets[i];
+
+        while (this != NULL)
+        {
+          cache_entry_t *next = this->next;
+          size_t b = this->hash & (new_num - 1);
+
+          this->next = new_buckets[b];
+          new_buckets[b] = this;
+          this = next;
+        }
+      }
+
+      CACHE_MEMORY_SUB (shard->buckets_num * sizeof (*shard->buckets));
+      CACHE_MEMORY_ADD (new_num * sizeof (*new_buckets));
+      sfree (shard->buckets);
+      shard->buckets = new_buckets;
+      shard->buckets_num = new_num;
+    }
+  }
+
+  bucket = ce->hash & (shard->buckets_num - 1);
+  ce->next = shard->buckets[bucket];
+  shard->buckets[bucket] = ce;
+  shard->entries_num++;
+
+  return (0);
+} /* int cache_link */
+
+static uint64_t cache_tick (cdtime_t t)
+{
+  return ((uint64_t) CDTIME_T_TO_TIME_T (t));
+} /* uint64_t cache_tick */
+
+/* The lock of "shard" must be held. */
+static void cache_timer_unlink (cache_entry_t *ce)
+{
+  if (ce->timer_pprev == NULL)
+    return;
+
+  *ce->timer_pprev = ce->timer_next;
+  if (ce->timer_next != NULL)
+    ce->timer_next->timer_pprev = ce->timer_pprev;
+
+  ce->timer_next = NULL;
+  ce->timer_pprev = NULL;
+} /* void cache_timer_unlink */
+
+/* Puts "ce" into the wheel slot for its "timer_tick". The lock of "shard" must
+ * be held. */
+static void cache_timer_link (cache_shard_t *shard, cache_entry_t *ce)
+{
+  uint64_t tick = ce->timer_tick;
+  uint64_t delta;
+  cache_entry_t **slot;
+  int level;
+
+  /* Entries which are due already are handled with the next tick. */
+  if (tick < shard->wheel_tick)
+    tick = shard->wheel_tick;
+  delta = tick - shard->wheel_tick;
+
+  for (level = 0; level < (CACHE_WHEEL_LEVELS - 1); level++)
+    if (delta < (((uint64_t) 1) << (CACHE_WHEEL_BITS * (level + 1))))
+      break;
+
+  /* Beyond the range of the wheel: park the entry in the farthest slot, it
+   * is put back with the next round. */
+  if (delta >= (((uint64_t) 1) << (CACHE_WHEEL_BITS * CACHE_WHEEL_LEVELS)))
+    tick = shard->wheel_tick
+      + (((uint64_t) 1) << (CACHE_WHEEL_BITS * CACHE_WHEEL_LEVELS)) - 1;
+
+  slot = &shard->wheel[level][(tick >> (CACHE_WHEEL_BITS * level))
+    & CACHE_WHEEL_MASK];
+
+  ce->timer_next = *slot;
+  if (ce->timer_next != NULL)
+    ce->timer_next->timer_pprev = &ce->timer_next;
+  ce->timer_pprev = slot;
+  *slot = ce;
+} /* void cache_timer_link */
+
+/* (Re-)Schedules the timeout of "ce" according to its last update and
+ * interval. The lock of "shard" must be held. */
+static void cache_timer_arm (cache_shard_t *shard, cache_entry_t *ce)
+{
+  /* Round up, so the entry isn't handled before it has actually timed
+   * out. */
+  uint64_t tick = cache_tick (ce->last_update
+      + (ce->interval * timeout_g) + TIME_T_TO_CDTIME_T (1) - 1);
+
+  if ((ce->timer_pprev != NULL) && (ce->timer_tick == tick))
+    return;
+
+  if (shard->wheel_tick == 0)
+    shard->wheel_tick = cache_tick (cdtime ());
+
+  cache_timer_unlink (ce);
+  ce->timer_tick = tick;
+  cache_timer_link (shard, ce);
+} /* void cache_timer_arm */
+
+/* Moves the entries of a slot of an upper level to the levels below. Returns
+ * true if the index of the slot is zero, i.e. if the level above has to be
+ * cascaded, too. */
+static _Bool cache_timer_cascade (cache_shard_t *shard, int level)
+{
+  size_t index = (size_t) ((shard->wheel_tick >> (CACHE_WHEEL_BITS * level))
+      & CACHE_WHEEL_MASK);
+  cache_entry_t *ce = shard->wheel[level][index];
+
+  shard->wheel[level][index] = NULL;
+  while (ce != NULL)
+  {
+    cache_entry_t *next = ce->timer_next;
+
+    ce->timer_next = NULL;
+    ce->timer_pprev = NULL;
+    cache_timer_link (shard, ce);
+
+    ce = next;
+  }
+
+  return (index == 0);
+} /* _Bool cache_timer_cascade */
+
+/* Advances the wheel of "shard" up to and including "now" and returns the
+ * entries which have timed out as a list linked by "timer_next". These are no
+ * longer in the wheel. The lock of "shard" must be held. */
+static cache_entry_t *cache_timer_expire (cache_shard_t *shard, uint64_t now)
+{
+  cache_entry_t *expired = NULL;
+
+  if (shard->wheel_tick == 0)
+    return (NULL);
+
+  while (shard->wheel_tick <= now)
+  {
+    size_t index = (size_t) (shard->wheel_tick & CACHE_WHEEL_MASK);
+    cache_entry_t *ce;
+
+    if (index == 0)
+    {
+      int level;
+
+      for (level = 1; level < CACHE_WHEEL_LEVELS; level++)
+        if (!cache_timer_cascade (shard, level))
+          break;
+    }
+
+    ce = shard->wheel[0][index];
+    shard->wheel[0][index] = NULL;
+    while (ce != NULL)
+    {
+      cache_entry_t *next = ce->timer_next;
+
+      /* Entries parked beyond the range of the wheel are put back. */
+      if (ce->timer_tick > shard->wheel_tick)
+      {
+        ce->timer_next = NULL;
+        ce->timer_pprev = NULL;
+        cache_timer_link (shard, ce);
+      }
+      else
+      {
+        ce->timer_pprev = NULL;
+        ce->timer_next = expired;
+        expired = ce;
+      }
+
+      ce = next;
+    }
+
+    shard->wheel_tick++;
+  }
+
+  return (expired);
+} /* cache_entry_t *cache_timer_expire */
+
+/* Removes the entry "name" from "shard" and returns it. The lock of "shard"
+ * must be held. */
+static cache_entry_t *cache_unlink (cache_shard_t *shard,
+    const char *name, uint64_t hash)
+{
+  cache_entry_t **ptr;
+
+  if (shard->buckets_num == 0)
+    return (NULL);
 
-static int cache_compare (const cache_entry_t *a, const cache_entry_t *b)
+  for (ptr = shard->buckets + (hash & (shard->buckets_num - 1));
+      *ptr != NULL;
+      ptr = &(*ptr)->next)
+  {
+    cache_entry_t *ce = *ptr;
+
+    if ((ce->hash != hash) || (strcmp (ce->name, name) != 0))
+      continue;
+
+    *ptr = ce->next;
+    ce->next = NULL;
+    shard->entries_num--;
+    cache_timer_unlink (ce);
+    return (ce);
+  }
+
+  return (NULL);
+} /* cache_entry_t *cache_unlink */
+
+/* Returns the cache key of "vl" and stores its hash in "ret_hash". Value
+ * lists which are being dispatched carry both already; for all others the
+ * identifier is formatted into "buffer". */
+static const char *uc_get_key (const value_list_t *vl,
+    char *buffer, size_t buffer_size, uint64_t *ret_hash)
 {
-  assert ((a != NULL) && (b != NULL));
-  return (strcmp (a->name, b->name));
-} /* int cache_compare */
+  if (vl->identity != NULL)
+  {
+    *ret_hash = vl->identity_hash;
+    return (vl->identity);
+  }
+
+  if (FORMAT_VL (buffer, buffer_size, vl) != 0)
+    return (NULL);
+
+  *ret_hash = plugin_hash_string (buffer);
+  return (buffer);
+} /* const char *uc_get_key */
 
-static cache_entry_t *cache_alloc (int values_num)
+/* Looks up the entry "name" and returns it with the shard's lock held, or
+ * NULL without holding any lock. */
+static cache_entry_t *uc_get_entry_by_key (const char *name, uint64_t hash,
+    cache_shard_t **ret_shard)
 {
+  cache_shard_t *shard;
   cache_entry_t *ce;
 
-  ce = (cache_entry_t *) malloc (sizeof (cache_entry_t));
+  shard = cache_shard_get (hash);
+  c_mutex_lock (&shard->lock);
+
+  ce = cache_lookup (shard, name, hash);
   if (ce == NULL)
   {
-    ERROR ("utils_cache: cache_alloc: malloc failed.");
+    c_mutex_unlock (&shard->lock);
     return (NULL);
   }
-  memset (ce, '\0', sizeof (cache_entry_t));
-  ce->values_num = values_num;
 
-  ce->values_gauge = calloc (values_num, sizeof (*ce->values_gauge));
-  ce->values_raw   = calloc (values_num, sizeof (*ce->values_raw));
-  if ((ce->values_gauge == NULL) || (ce->values_raw == NULL))
+  *ret_shard = shard;
+  return (ce);
+} /* cache_entry_t *uc_get_entry_by_key */
+
+/* Like uc_get_entry_by_key() for the value list "vl". */
+static cache_entry_t *uc_get_entry (const value_list_t *vl,
+    cache_shard_t **ret_shard)
+{
+  char buffer[CACHE_NAME_MAX];
+  const char *name;
+  uint64_t hash;
+
+  name = uc_get_key (vl, buffer, sizeof (buffer), &hash);
+  if (name == NULL)
+  {
+    ERROR ("utils_cache: FORMAT_VL failed.");
+    return (NULL);
+  }
+
+  return (uc_get_entry_by_key (name, hash, ret_shard));
+} /* cache_entry_t *uc_get_entry */
+
+/* Returns the count of "name" in "t", adding one if there is none yet. The
+ * series lock must be held. */
+static cache_series_t *cache_series_get (c_htable_t *t, const char *name)
+{
+  cache_series_t *s = NULL;
+
+  if (c_htable_get (t, name, (void *) &s) == 0)
+    return (s);
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+  s->name = strdup (name);
+  if ((s->name == NULL) || (c_htable_insert (t, s->name, s) != 0))
+  {
+    sfree (s->name);
+    sfree (s);
+    return (NULL);
+  }
+
+  return (s);
+} /* cache_series_t *cache_series_get */
+
+/* Frees the count of a host once its last entry is gone. The series lock
+ * must be held. */
+static void cache_series_put_host (cache_series_t *s)
+{
+  if ((s == NULL) || (s->entries > 0))
+    return;
+
+  c_htable_remove (cache_series_hosts, s->name, NULL, NULL);
+  sfree (s->name);
+  sfree (s);
+} /* void cache_series_put_host */
+
+/* Accounts a new entry of "vl" to the counts of its plugin and host, which
+ * are returned in "ret_plugin" and "ret_host". Returns EDQUOT if either has
+ * reached its limit, unless "force" is true. */
+static int cache_series_acquire (const value_list_t *vl, _Bool force,
+    cache_series_t **ret_plugin, cache_series_t **ret_host)
+{
+  cache_series_t *p;
+  cache_series_t *h = NULL;
+
+  *ret_plugin = NULL;
+  *ret_host = NULL;
+
+  if (cache_series_plugins == NULL)
   {
-    sfree (ce->values_gauge);
-    sfree (ce->values_raw);
-    sfree (ce);
-    ERROR ("utils_cache: cache_alloc: calloc failed.");
+    if (!force)
+      __sync_fetch_and_add (&cache_series_created, 1);
+    return (0);
+  }
+
+  c_mutex_lock (&cache_series_lock);
+
+  p = cache_series_get (cache_series_plugins, vl->plugin);
+  if ((p != NULL) && (cache_series_hosts != NULL))
+    h = cache_series_get (cache_series_hosts, vl->host);
+  if ((p == NULL) || ((cache_series_hosts != NULL) && (h == NULL)))
+  {
+    c_mutex_unlock (&cache_series_lock);
+    ERROR ("utils_cache: cache_series_acquire: Allocating a count failed.");
+    return (-1);
+  }
+
+  if (!force
+      && (((cache_series_limit_plugin > 0)
+	  && (p->entries >= cache_series_limit_plugin))
+	|| ((h != NULL) && (cache_series_limit_host > 0)
+	  && (h->entries >= cache_series_limit_host))))
+  {
+    p->rejected++;
+    if (h != NULL)
+      h->rejected++;
+    cache_series_put_host (h);
+    c_mutex_unlock (&cache_series_lock);
+
+    __sync_fetch_and_add (&cache_values_rejected, 1);
+    return (EDQUOT);
+  }
+
+  p->entries++;
+  if (h != NULL)
+    h->entries++;
+  if (!force)
+  {
+    p->created++;
+    if (h != NULL)
+      h->created++;
+  }
+
+  c_mutex_unlock (&cache_series_lock);
+
+  if (!force)
+    __sync_fetch_and_add (&cache_series_created, 1);
+
+  *ret_plugin = p;
+  *ret_host = h;
+  return (0);
+} /* int cache_series_acquire */
+
+static void cache_series_release (cache_series_t *p, cache_series_t *h)
+{
+  if ((p == NULL) && (h == NULL))
+    return;
+
+  c_mutex_lock (&cache_series_lock);
+  if (p != NULL)
+  {
+    p->entries--;
+    if (p->entries < cache_series_limit_plugin)
+      p->reported = 0;
+  }
+  if (h != NULL)
+  {
+    h->entries--;
+    if (h->entries < cache_series_limit_host)
+      h->reported = 0;
+    cache_series_put_host (h);
+  }
+  c_mutex_unlock (&cache_series_lock);
+} /* void cache_series_release */
+
+/* Reports that a series of "vl" has been rejected, once for each time the
+ * plugin or host reaches its limit. Must be called without holding the lock
+ * of any shard, since notifications are dispatched. */
+static void cache_series_report (const value_list_t *vl)
+{
+  cache_series_t *s = NULL;
+  notification_t n;
+  size_t limit = 0;
+  _Bool is_host = 0;
+
+  memset (&n, 0, sizeof (n));
+
+  c_mutex_lock (&cache_series_lock);
+  if ((c_htable_get (cache_series_plugins, vl->plugin, (void *) &s) == 0)
+      && (cache_series_limit_plugin > 0)
+      && (s->entries >= cache_series_limit_plugin) && !s->reported)
+    limit = cache_series_limit_plugin;
+  else if ((cache_series_hosts != NULL)
+      && (c_htable_get (cache_series_hosts, vl->host, (void *) &s) == 0)
+      && (cache_series_limit_host > 0)
+      && (s->entries >= cache_series_limit_host) && !s->reported)
+  {
+    limit = cache_series_limit_host;
+    is_host = 1;
+  }
+
+  if (limit > 0)
+  {
+    s->reported = 1;
+    ssnprintf (n.message, sizeof (n.message),
+	"The %s \"%s\" has reached the limit of %zu series. Values of new "
+	"series are dropped until some of its series have timed out.",
+	is_host ? "host" : "plugin", s->name, limit);
+  }
+  c_mutex_unlock (&cache_series_lock);
+
+  if (limit == 0)
+    return;
+
+  n.severity = NOTIF_WARNING;
+  n.time = cdtime ();
+  sstrncpy (n.host, hostname_g, sizeof (n.host));
+  sstrncpy (n.plugin, "collectd", sizeof (n.plugin));
+  sstrncpy (n.plugin_instance, is_host ? vl->host : vl->plugin,
+      sizeof (n.plugin_instance));
+  sstrncpy (n.type_instance, is_host ? "series_limit-host"
+      : "series_limit-plugin", sizeof (n.type_instance));
+
+  WARNING ("uc_update: %s", n.message);
+  plugin_dispatch_notification (&n);
+} /* void cache_series_report */
+
+static size_t cache_entry_size (int values_num, size_t name_len)
+{
+  return (sizeof (cache_entry_t)
+      + values_num * (sizeof (value_t) + sizeof (gauge_t))
+      + name_len + 1);
+} /* size_t cache_entry_size */
+
+static cache_entry_t *cache_alloc (int values_num, const char *name)
+{
+  cache_entry_t *ce;
+  size_t name_len = strlen (name);
+  size_t size = cache_entry_size (values_num, name_len);
+
+  ce = (cache_entry_t *) malloc (size);
+  if (ce == NULL)
+  {
+    ERROR ("utils_cache: cache_alloc: malloc failed.");
     return (NULL);
   }
+  memset (ce, '\0', size);
+  ce->values_num = values_num;
+
+  ce->values_raw = ce->data;
+  ce->values_gauge = (gauge_t *) (ce->values_raw + values_num);
+  ce->name = (char *) (ce->values_gauge + values_num);
+  memcpy (ce->name, name, name_len + 1);
 
   ce->history = NULL;
   ce->history_length = 0;
   ce->meta = NULL;
+  ce->values_emitted = NULL;
 
+  CACHE_MEMORY_ADD (size);
   return (ce);
 } /* cache_entry_t *cache_alloc */
 
@@ -108,9 +733,15 @@ static void cache_free (cache_entry_t *ce)
   if (ce == NULL)
     return;
 
-  sfree (ce->values_gauge);
-  sfree (ce->values_raw);
+  cache_series_release (ce->series_plugin, ce->series_host);
+  CACHE_MEMORY_SUB (cache_entry_size (ce->values_num, strlen (ce->name))
+      + ce->history_length * ce->values_num * sizeof (*ce->history));
   sfree (ce->history);
+  if (ce->values_emitted != NULL)
+  {
+    CACHE_MEMORY_SUB (ce->values_num * sizeof (*ce->values_emitted));
+    sfree (ce->values_emitted);
+  }
   if (ce->meta != NULL)
   {
     meta_data_destroy (ce->meta);
@@ -119,6 +750,22 @@ static void cache_free (cache_entry_t *ce)
   sfree (ce);
 } /* void cache_free */
 
+static int uc_data_set_kind (const data_set_t *ds)
+{
+  int type = ds->ds[0].type;
+  int i;
+
+  for (i = 1; i < ds->ds_num; i++)
+    if (ds->ds[i].type != type)
+      return (CACHE_KIND_MIXED);
+
+  if (type == DS_TYPE_GAUGE)
+    return (CACHE_KIND_GAUGE);
+  else if (type == DS_TYPE_DERIVE)
+    return (CACHE_KIND_DERIVE);
+  return (CACHE_KIND_MIXED);
+} /* int uc_data_set_kind */
+
 static void uc_check_range (const data_set_t *ds, cache_entry_t *ce)
 {
   int i;
@@ -134,31 +781,35 @@ static void uc_check_range (const data_set_t *ds, cache_entry_t *ce)
   }
 } /* void uc_check_range */
 
-static int uc_insert (const data_set_t *ds, const value_list_t *vl,
-    const char *key)
+static int uc_insert (cache_shard_t *shard, const data_set_t *ds,
+    const value_list_t *vl, const char *key, uint64_t hash,
+    gauge_t *ret_rates)
 {
   int i;
-  char *key_copy;
+  int status;
   cache_entry_t *ce;
+  cache_series_t *series_plugin;
+  cache_series_t *series_host;
 
-  /* `cache_lock' has been locked by `uc_update' */
+  /* The lock of `shard' has been locked by `uc_update' */
 
-  key_copy = strdup (key);
-  if (key_copy == NULL)
-  {
-    ERROR ("uc_insert: strdup failed.");
-    return (-1);
-  }
+  status = cache_series_acquire (vl, /* force = */ 0,
+      &series_plugin, &series_host);
+  if (status != 0)
+    return (status);
 
-  ce = cache_alloc (ds->ds_num);
+  ce = cache_alloc (ds->ds_num, key);
   if (ce == NULL)
   {
-    sfree (key_copy);
+    cache_series_release (series_plugin, series_host);
     ERROR ("uc_insert: cache_alloc (%i) failed.", ds->ds_num);
     return (-1);
   }
 
-  sstrncpy (ce->name, key, sizeof (ce->name));
+  ce->series_plugin = series_plugin;
+  ce->series_host = series_host;
+  ce->hash = hash;
+  ce->kind = uc_data_set_kind (ds);
 
   for (i = 0; i < ds->ds_num; i++)
   {
@@ -191,6 +842,7 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
 	/* This shouldn't happen. */
 	ERROR ("uc_insert: Don't know how to handle data source type %i.",
 	    ds->ds[i].type);
+	cache_free (ce);
 	return (-1);
     } /* switch (ds->ds[i].type) */
   } /* for (i) */
@@ -199,16 +851,20 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
   uc_check_range (ds, ce);
 
   ce->last_time = vl->time;
-  ce->last_update = cdtime ();
+  ce->last_update = cdtime_coarse ();
   ce->interval = vl->interval;
   ce->state = STATE_OKAY;
 
-  if (c_avl_insert (cache_tree, key_copy, ce) != 0)
+  if (cache_link (shard, ce) != 0)
   {
-    sfree (key_copy);
-    ERROR ("uc_insert: c_avl_insert failed.");
+    cache_free (ce);
+    ERROR ("uc_insert: cache_link failed.");
     return (-1);
   }
+  cache_timer_arm (shard, ce);
+
+  if (ret_rates != NULL)
+    memcpy (ret_rates, ce->values_gauge, ds->ds_num * sizeof (*ret_rates));
 
   DEBUG ("uc_insert: Added %s to the cache.", key);
   return (0);
@@ -216,183 +872,657 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
 
 int uc_init (void)
 {
-  if (cache_tree == NULL)
-    cache_tree = c_avl_create ((int (*) (const void *, const void *))
-	cache_compare);
+  pthread_once (&cache_once, cache_shards_init);
 
   return (0);
 } /* int uc_init */
 
-int uc_check_timeout (void)
+int uc_set_series_limits (size_t per_plugin, size_t per_host) /* {{{ */
 {
-  cdtime_t now;
-  cache_entry_t *ce;
+  pthread_once (&cache_once, cache_shards_init);
 
-  char **keys = NULL;
-  cdtime_t *keys_time = NULL;
-  cdtime_t *keys_interval = NULL;
-  int keys_len = 0;
-
-  char *key;
-  c_avl_iterator_t *iter;
-
-  int status;
-  int i;
-  
-  pthread_mutex_lock (&cache_lock);
+  /* Entries which are in the cache already are not accounted. */
+  if (cache_series_plugins != NULL)
+  {
+    ERROR ("uc_set_series_limits: The limits have been set already.");
+    return (-1);
+  }
 
-  now = cdtime ();
+  if ((per_plugin == 0) && (per_host == 0))
+    return (0);
 
-  /* Build a list of entries to be flushed */
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &ce) == 0)
+  cache_series_plugins = c_htable_create ();
+  if (cache_series_plugins == NULL)
   {
-    char **tmp;
-    cdtime_t *tmp_time;
-
-    /* If the entry is fresh enough, continue. */
-    if ((now - ce->last_update) < (ce->interval * timeout_g))
-      continue;
+    ERROR ("uc_set_series_limits: c_htable_create failed.");
+    return (-1);
+  }
 
-    /* If entry has not been updated, add to `keys' array */
-    tmp = (char **) realloc ((void *) keys,
-	(keys_len + 1) * sizeof (char *));
-    if (tmp == NULL)
+  if (per_host > 0)
+  {
+    cache_series_hosts = c_htable_create ();
+    if (cache_series_hosts == NULL)
     {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
+      ERROR ("uc_set_series_limits: c_htable_create failed.");
+      c_htable_destroy (cache_series_plugins);
+      cache_series_plugins = NULL;
+      return (-1);
     }
-    keys = tmp;
+  }
 
-    tmp_time = realloc (keys_time, (keys_len + 1) * sizeof (*keys_time));
-    if (tmp_time == NULL)
-    {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    keys_time = tmp_time;
+  cache_series_limit_plugin = per_plugin;
+  cache_series_limit_host = per_host;
+  return (0);
+} /* }}} int uc_set_series_limits */
 
-    tmp_time = realloc (keys_interval, (keys_len + 1) * sizeof (*keys_interval));
-    if (tmp_time == NULL)
-    {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    keys_interval = tmp_time;
+/*
+ * Cache snapshots
+ *
+ * On shutdown the cache can be written to a file which is read again on
+ * startup, so rates can be computed for the first values after a restart.
+ * The file is in native byte order and all records are aligned to eight
+ * bytes, so it can be mapped into memory and used as is:
+ *
+ *   uc_snapshot_header_t
+ *   record 0: uc_snapshot_record_t
+ *             value_t  values_raw[values_num]
+ *             gauge_t  values_gauge[values_num]
+ *             gauge_t  history[history_length * values_num]
+ *             uint8_t  ds_types[values_num]
+ *             char     name[name_len]        (including the null byte)
+ *             padding to "record_size"
+ *   record 1: ...
+ *
+ * Meta data is not saved: it belongs to the plugins which added it.
+ */
+#define UC_SNAPSHOT_MAGIC      "CDCACHE1"
+#define UC_SNAPSHOT_VERSION    1
+#define UC_SNAPSHOT_BYTE_ORDER 0x01020304
+#define UC_SNAPSHOT_ALIGN(s)   (((s) + 7) & ~((size_t) 7))
 
-    keys[keys_len] = strdup (key);
-    if (keys[keys_len] == NULL)
-    {
-      ERROR ("uc_check_timeout: strdup failed.");
-      continue;
-    }
-    keys_time[keys_len] = ce->last_time;
-    keys_interval[keys_len] = ce->interval;
+typedef struct uc_snapshot_header_s
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t records_num;
+} uc_snapshot_header_t;
 
-    keys_len++;
-  } /* while (c_avl_iterator_next) */
+typedef struct uc_snapshot_record_s
+{
+  uint64_t last_time;
+  uint64_t interval;
+  int32_t  state;
+  int32_t  hits;
+  uint32_t values_num;
+  uint32_t history_length;
+  uint32_t history_index;
+  uint32_t name_len;
+  /* Size of the record, including this header and the padding. */
+  uint64_t record_size;
+} uc_snapshot_record_t;
+
+static size_t uc_snapshot_record_size (size_t name_len, size_t values_num,
+    size_t history_length)
+{
+  return (UC_SNAPSHOT_ALIGN (sizeof (uc_snapshot_record_t)
+        + values_num * (sizeof (value_t) + sizeof (gauge_t))
+        + history_length * values_num * sizeof (gauge_t)
+        + values_num * sizeof (uint8_t)
+        + name_len));
+} /* size_t uc_snapshot_record_size */
+
+/* The lock of the shard "ce" belongs to must be held. */
+static int uc_snapshot_write_entry (FILE *fh, const cache_entry_t *ce)
+{
+  static const char padding[8] = { 0 };
+  uc_snapshot_record_t rec;
+  value_list_t vl = VALUE_LIST_INIT;
+  const data_set_t *ds;
+  size_t name_len;
+  size_t data_size;
+  int i;
 
-  c_avl_iterator_destroy (iter);
-  pthread_mutex_unlock (&cache_lock);
+  /* The data source types aren't kept in the cache. They are saved so that
+   * values can't be misinterpreted when the types have changed by the time
+   * the snapshot is read. */
+  if (parse_identifier_vl (ce->name, &vl) != 0)
+    return (-1);
+  ds = plugin_get_ds (vl.type);
+  if ((ds == NULL) || (ds->ds_num != ce->values_num))
+    return (-1);
 
-  if (keys_len == 0)
-    return (0);
+  name_len = strlen (ce->name) + 1;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.last_time = (uint64_t) ce->last_time;
+  rec.interval = (uint64_t) ce->interval;
+  rec.state = (int32_t) ce->state;
+  rec.hits = (int32_t) ce->hits;
+  rec.values_num = (uint32_t) ce->values_num;
+  rec.history_length = (uint32_t) ce->history_length;
+  rec.history_index = (uint32_t) ce->history_index;
+  rec.name_len = (uint32_t) name_len;
+  rec.record_size = (uint64_t) uc_snapshot_record_size (name_len,
+      (size_t) ce->values_num, ce->history_length);
+
+  data_size = sizeof (rec);
+  if (fwrite (&rec, sizeof (rec), 1, fh) != 1)
+    return (-1);
 
-  /* Call the "missing" callback for each value. Do this before removing the
-   * value from the cache, so that callbacks can still access the data stored,
-   * including plugin specific meta data, rates, history, …. This must be done
-   * without holding the lock, otherwise we will run into a deadlock if a
-   * plugin calls the cache interface. */
-  for (i = 0; i < keys_len; i++)
-  {
-    value_list_t vl = VALUE_LIST_INIT;
+  data_size += ce->values_num * sizeof (*ce->values_raw);
+  if (fwrite (ce->values_raw, sizeof (*ce->values_raw),
+        (size_t) ce->values_num, fh) != (size_t) ce->values_num)
+    return (-1);
 
-    vl.values = NULL;
-    vl.values_len = 0;
-    vl.meta = NULL;
+  data_size += ce->values_num * sizeof (*ce->values_gauge);
+  if (fwrite (ce->values_gauge, sizeof (*ce->values_gauge),
+        (size_t) ce->values_num, fh) != (size_t) ce->values_num)
+    return (-1);
 
-    status = parse_identifier_vl (keys[i], &vl);
-    if (status != 0)
-    {
-      ERROR ("uc_check_timeout: parse_identifier_vl (\"%s\") failed.", keys[i]);
-      cache_free (ce);
-      continue;
-    }
+  if (ce->history_length > 0)
+  {
+    size_t history_num = ce->history_length * ce->values_num;
 
-    vl.time = keys_time[i];
-    vl.interval = keys_interval[i];
+    data_size += history_num * sizeof (*ce->history);
+    if (fwrite (ce->history, sizeof (*ce->history), history_num, fh)
+        != history_num)
+      return (-1);
+  }
 
-    plugin_dispatch_missing (&vl);
-  } /* for (i = 0; i < keys_len; i++) */
+  data_size += ce->values_num * sizeof (uint8_t);
+  for (i = 0; i < ce->values_num; i++)
+    if (fputc ((uint8_t) ds->ds[i].type, fh) == EOF)
+      return (-1);
 
-  /* Now actually remove all the values from the cache. We don't re-evaluate
-   * the timestamp again, so in theory it is possible we remove a value after
-   * it is updated here. */
-  pthread_mutex_lock (&cache_lock);
-  for (i = 0; i < keys_len; i++)
+  data_size += name_len;
+  if (fwrite (ce->name, name_len, 1, fh) != 1)
+    return (-1);
+
+  assert (data_size <= rec.record_size);
+  if ((data_size < rec.record_size)
+      && (fwrite (padding, rec.record_size - data_size, 1, fh) != 1))
+    return (-1);
+
+  return (0);
+} /* int uc_snapshot_write_entry */
+
+int uc_snapshot_write (const char *file) /* {{{ */
+{
+  uc_snapshot_header_t header;
+  char tmp_file[PATH_MAX];
+  FILE *fh;
+  uint64_t records_num = 0;
+  uint64_t skipped = 0;
+  cdtime_t start = cdtime ();
+  int status = 0;
+  size_t i;
+
+  if (file == NULL)
+    return (EINVAL);
+
+  ssnprintf (tmp_file, sizeof (tmp_file), "%s.tmp", file);
+
+  fh = fopen (tmp_file, "w");
+  if (fh == NULL)
   {
-    key = NULL;
-    ce = NULL;
+    char errbuf[1024];
+    ERROR ("uc_snapshot_write: fopen (%s) failed: %s", tmp_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
 
-    status = c_avl_remove (cache_tree, keys[i],
-	(void *) &key, (void *) &ce);
-    if (status != 0)
+  /* The number of records is filled in once they have been written. */
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, UC_SNAPSHOT_MAGIC, sizeof (header.magic));
+  header.version = UC_SNAPSHOT_VERSION;
+  header.byte_order = UC_SNAPSHOT_BYTE_ORDER;
+  if (fwrite (&header, sizeof (header), 1, fh) != 1)
+    status = -1;
+
+  pthread_once (&cache_once, cache_shards_init);
+  for (i = 0; (i < CACHE_SHARDS) && (status == 0); i++)
+  {
+    cache_shard_t *shard = cache_shards + i;
+    size_t j;
+
+    c_mutex_lock (&shard->lock);
+    for (j = 0; (j < shard->buckets_num) && (status == 0); j++)
     {
-      ERROR ("uc_check_timeout: c_avl_remove (\"%s\") failed.", keys[i]);
-      sfree (keys[i]);
-      continue;
+      cache_entry_t *ce;
+
+      for (ce = shard->buckets[j]; ce != NULL; ce = ce->next)
+      {
+        /* Only values the identifier of which can't be parsed or which
+         * don't match their data set are skipped. I/O errors abort. */
+        if (uc_snapshot_write_entry (fh, ce) != 0)
+        {
+          if (ferror (fh))
+          {
+            status = -1;
+            break;
+          }
+          skipped++;
+          continue;
+        }
+        records_num++;
+      }
     }
+    c_mutex_unlock (&shard->lock);
+  }
+
+  if (status == 0)
+  {
+    header.records_num = records_num;
+    if ((fseek (fh, 0, SEEK_SET) != 0)
+        || (fwrite (&header, sizeof (header), 1, fh) != 1)
+        || (fflush (fh) != 0)
+        || (fsync (fileno (fh)) != 0))
+      status = -1;
+  }
+
+  if ((fclose (fh) != 0) && (status == 0))
+    status = -1;
+
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("uc_snapshot_write: Writing %s failed: %s", tmp_file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    unlink (tmp_file);
+    return (-1);
+  }
+
+  /* Replace the old snapshot atomically, so a crash while writing never
+   * leaves a truncated file behind. */
+  if (rename (tmp_file, file) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("uc_snapshot_write: rename (%s, %s) failed: %s", tmp_file, file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    unlink (tmp_file);
+    return (-1);
+  }
+
+  INFO ("uc_snapshot_write: Wrote %"PRIu64" entries to %s in %.3f seconds "
+      "(%"PRIu64" skipped).", records_num, file,
+      CDTIME_T_TO_DOUBLE (cdtime () - start), skipped);
+  return (0);
+} /* }}} int uc_snapshot_write */
+
+/* Returns zero if the record was added to the cache, greater than zero if it
+ * was skipped and less than zero if it is malformed. */
+static int uc_snapshot_read_record (const char *data, size_t data_size,
+    cdtime_t now)
+{
+  const uc_snapshot_record_t *rec = (const uc_snapshot_record_t *) data;
+  const value_t *values_raw;
+  const gauge_t *values_gauge;
+  const gauge_t *history;
+  const uint8_t *ds_types;
+  const char *name;
+  value_list_t vl = VALUE_LIST_INIT;
+  const data_set_t *ds;
+  cache_shard_t *shard;
+  cache_entry_t *ce;
+  uint64_t hash;
+  size_t history_num;
+  size_t i;
 
-    sfree (keys[i]);
-    sfree (key);
+  if ((rec->values_num == 0) || (rec->name_len < 2)
+      || (rec->name_len > CACHE_NAME_MAX)
+      || ((rec->history_length > 0)
+        && (rec->history_index >= rec->history_length))
+      || (rec->record_size > data_size)
+      || (rec->record_size != uc_snapshot_record_size (rec->name_len,
+          rec->values_num, rec->history_length)))
+    return (-1);
+
+  history_num = ((size_t) rec->history_length) * rec->values_num;
+  values_raw = (const value_t *) (rec + 1);
+  values_gauge = (const gauge_t *) (values_raw + rec->values_num);
+  history = values_gauge + rec->values_num;
+  ds_types = (const uint8_t *) (history + history_num);
+  name = (const char *) (ds_types + rec->values_num);
+  if (name[rec->name_len - 1] != 0)
+    return (-1);
+
+  /* The data set may have changed or be gone since the snapshot was
+   * written. Restoring such a value would yield bogus rates. */
+  if (parse_identifier_vl (name, &vl) != 0)
+    return (1);
+  ds = plugin_get_ds (vl.type);
+  if ((ds == NULL) || (((size_t) ds->ds_num) != rec->values_num))
+    return (1);
+  for (i = 0; i < rec->values_num; i++)
+    if (ds->ds[i].type != (int) ds_types[i])
+      return (1);
+
+  ce = cache_alloc ((int) rec->values_num, name);
+  if (ce == NULL)
+    return (1);
+  ce->kind = uc_data_set_kind (ds);
+
+  /* The entries existed before the restart, so they are accounted even if
+   * that exceeds a limit. */
+  if (cache_series_acquire (&vl, /* force = */ 1,
+	&ce->series_plugin, &ce->series_host) != 0)
+  {
     cache_free (ce);
-  } /* for (i = 0; i < keys_len; i++) */
-  pthread_mutex_unlock (&cache_lock);
+    return (1);
+  }
 
-  sfree (keys);
-  sfree (keys_time);
-  sfree (keys_interval);
+  if (history_num > 0)
+  {
+    ce->history = malloc (history_num * sizeof (*ce->history));
+    if (ce->history == NULL)
+    {
+      cache_free (ce);
+      return (1);
+    }
+    memcpy (ce->history, history, history_num * sizeof (*ce->history));
+    CACHE_MEMORY_ADD (history_num * sizeof (*ce->history));
+    ce->history_length = rec->history_length;
+    ce->history_index = rec->history_index;
+  }
+
+  memcpy (ce->values_raw, values_raw,
+      rec->values_num * sizeof (*ce->values_raw));
+  memcpy (ce->values_gauge, values_gauge,
+      rec->values_num * sizeof (*ce->values_gauge));
+  ce->last_time = (cdtime_t) rec->last_time;
+  ce->interval = (cdtime_t) rec->interval;
+  ce->state = (int) rec->state;
+  ce->hits = (int) rec->hits;
+  /* Give the entry the full timeout to be updated again: collectd wasn't
+   * running while it wasn't. */
+  ce->last_update = now;
+
+  hash = plugin_hash_string (ce->name);
+  ce->hash = hash;
+  shard = cache_shard_get (hash);
+
+  c_mutex_lock (&shard->lock);
+  /* Values which have been dispatched already are newer. */
+  if ((cache_lookup (shard, ce->name, hash) != NULL)
+      || (cache_link (shard, ce) != 0))
+  {
+    c_mutex_unlock (&shard->lock);
+    cache_free (ce);
+    return (1);
+  }
+  cache_timer_arm (shard, ce);
+  c_mutex_unlock (&shard->lock);
 
   return (0);
-} /* int uc_check_timeout */
+} /* int uc_snapshot_read_record */
 
-int uc_update (const data_set_t *ds, const value_list_t *vl)
+int uc_snapshot_read (const char *file) /* {{{ */
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int status;
-  int i;
+  const uc_snapshot_header_t *header;
+  struct stat statbuf;
+  char *data;
+  size_t data_size;
+  size_t offset;
+  uint64_t restored = 0;
+  uint64_t skipped = 0;
+  uint64_t i;
+  cdtime_t now = cdtime ();
+  int status = 0;
+  int fd;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (file == NULL)
+    return (EINVAL);
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0)
   {
-    ERROR ("uc_update: FORMAT_VL failed.");
+    char errbuf[1024];
+
+    /* There is nothing to restore on the first start. */
+    if (errno == ENOENT)
+      return (0);
+
+    ERROR ("uc_snapshot_read: open (%s) failed: %s", file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
-  pthread_mutex_lock (&cache_lock);
+  if (fstat (fd, &statbuf) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("uc_snapshot_read: fstat (%s) failed: %s", file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    close (fd);
+    return (-1);
+  }
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0) /* entry does not yet exist */
+  data_size = (size_t) statbuf.st_size;
+  if (data_size < sizeof (*header))
   {
-    status = uc_insert (ds, vl, name);
-    pthread_mutex_unlock (&cache_lock);
-    return (status);
+    ERROR ("uc_snapshot_read: %s is too short.", file);
+    close (fd);
+    return (-1);
   }
 
-  assert (ce != NULL);
-  assert (ce->values_num == ds->ds_num);
+  data = mmap (/* addr = */ NULL, data_size, PROT_READ, MAP_PRIVATE,
+      fd, /* offset = */ 0);
+  close (fd);
+  if (data == MAP_FAILED)
+  {
+    char errbuf[1024];
+    ERROR ("uc_snapshot_read: mmap (%s) failed: %s", file,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+  /* The records are read front to back exactly once. */
+  madvise (data, data_size, MADV_SEQUENTIAL);
 
-  if (ce->last_time >= vl->time)
+  header = (const uc_snapshot_header_t *) data;
+  if ((memcmp (header->magic, UC_SNAPSHOT_MAGIC, sizeof (header->magic)) != 0)
+      || (header->version != UC_SNAPSHOT_VERSION)
+      || (header->byte_order != UC_SNAPSHOT_BYTE_ORDER))
   {
-    pthread_mutex_unlock (&cache_lock);
-    NOTICE ("uc_update: Value too old: name = %s; value time = %.3f; "
-	"last cache update = %.3f;",
-	name,
-	CDTIME_T_TO_DOUBLE (vl->time),
-	CDTIME_T_TO_DOUBLE (ce->last_time));
+    ERROR ("uc_snapshot_read: %s is not a value cache snapshot written by "
+        "this version of collectd on this architecture.", file);
+    munmap (data, data_size);
     return (-1);
   }
 
+  pthread_once (&cache_once, cache_shards_init);
+
+  offset = sizeof (*header);
+  for (i = 0; i < header->records_num; i++)
+  {
+    const uc_snapshot_record_t *rec;
+
+    if ((data_size - offset) < sizeof (*rec))
+    {
+      status = -1;
+      break;
+    }
+    rec = (const uc_snapshot_record_t *) (data + offset);
+
+    status = uc_snapshot_read_record (data + offset, data_size - offset, now);
+    if (status < 0)
+      break;
+    else if (status > 0)
+      skipped++;
+    else
+      restored++;
+    status = 0;
+
+    offset += (size_t) rec->record_size;
+  }
+
+  munmap (data, data_size);
+
+  if (status != 0)
+    ERROR ("uc_snapshot_read: %s is corrupt after %"PRIu64" records. "
+        "Ignoring the rest of it.", file, i);
+
+  INFO ("uc_snapshot_read: Restored %"PRIu64" entries from %s in %.3f "
+      "seconds (%"PRIu64" skipped).", restored, file,
+      CDTIME_T_TO_DOUBLE (cdtime () - now), skipped);
+  return (status);
+} /* }}} int uc_snapshot_read */
+
+int uc_check_timeout (void)
+{
+  struct timed_out_s
+  {
+    char *name;
+    uint64_t hash;
+    cdtime_t time;
+    cdtime_t interval;
+  } *keys = NULL;
+  size_t keys_len = 0;
+  size_t keys_size = 0;
+
+  uint64_t now;
+  size_t i;
+  int status;
+
+  now = cache_tick (cdtime_coarse ());
+
+  /* Build a list of entries to be flushed, one shard at a time. Only the
+   * entries which have timed out are visited. */
+  pthread_once (&cache_once, cache_shards_init);
+  for (i = 0; i < CACHE_SHARDS; i++)
+  {
+    cache_shard_t *shard = cache_shards + i;
+    cache_entry_t *ce;
+
+    c_mutex_lock (&shard->lock);
+    ce = cache_timer_expire (shard, now);
+    while (ce != NULL)
+    {
+      cache_entry_t *next = ce->timer_next;
+
+      ce->timer_next = NULL;
+
+      /* Add to `keys' array. On failure, try again with the next call. */
+      if (keys_len >= keys_size)
+      {
+        struct timed_out_s *tmp;
+        size_t new_size = (keys_size == 0) ? 16 : (2 * keys_size);
+
+        tmp = realloc (keys, new_size * sizeof (*keys));
+        if (tmp == NULL)
+        {
+          ERROR ("uc_check_timeout: realloc failed.");
+          cache_timer_link (shard, ce);
+          ce = next;
+          continue;
+        }
+        keys = tmp;
+        keys_size = new_size;
+      }
+
+      keys[keys_len].name = strdup (ce->name);
+      if (keys[keys_len].name == NULL)
+      {
+        ERROR ("uc_check_timeout: strdup failed.");
+        cache_timer_link (shard, ce);
+        ce = next;
+        continue;
+      }
+      keys[keys_len].hash = ce->hash;
+      keys[keys_len].time = ce->last_time;
+      keys[keys_len].interval = ce->interval;
+
+      keys_len++;
+      ce = next;
+    }
+    c_mutex_unlock (&shard->lock);
+  }
+
+  if (keys_len == 0)
+  {
+    sfree (keys);
+    return (0);
+  }
+
+  /* Call the "missing" callback for each value. Do this before removing the
+   * value from the cache, so that callbacks can still access the data stored,
+   * including plugin specific meta data, rates, history, …. This must be done
+   * without holding the lock, otherwise we will run into a deadlock if a
+   * plugin calls the cache interface. */
+  for (i = 0; i < keys_len; i++)
+  {
+    value_list_t vl = VALUE_LIST_INIT;
+
+    vl.values = NULL;
+    vl.values_len = 0;
+    vl.meta = NULL;
+
+    status = parse_identifier_vl (keys[i].name, &vl);
+    if (status != 0)
+    {
+      ERROR ("uc_check_timeout: parse_identifier_vl (\"%s\") failed.",
+          keys[i].name);
+      continue;
+    }
+
+    vl.time = keys[i].time;
+    vl.interval = keys[i].interval;
+
+    plugin_dispatch_missing (&vl);
+  } /* for (i = 0; i < keys_len; i++) */
+
+  /* Now actually remove all the values from the cache. Entries which have
+   * been updated in the meantime are back in the timer wheel and are kept. */
+  for (i = 0; i < keys_len; i++)
+  {
+    cache_shard_t *shard = cache_shard_get (keys[i].hash);
+    cache_entry_t *ce;
+
+    c_mutex_lock (&shard->lock);
+    ce = cache_lookup (shard, keys[i].name, keys[i].hash);
+    if ((ce != NULL) && (ce->timer_pprev == NULL))
+      ce = cache_unlink (shard, keys[i].name, keys[i].hash);
+    else
+      ce = NULL;
+    c_mutex_unlock (&shard->lock);
+
+    sfree (keys[i].name);
+    cache_free (ce);
+  } /* for (i = 0; i < keys_len; i++) */
+
+  sfree (keys);
+
+  return (0);
+} /* int uc_check_timeout */
+
+/* Computes the rates of "vl", which is newer than "ce", and stores its values
+ * in "ce". Returns the type of the first data source which can't be handled,
+ * or zero. The lock of the entry's shard must be held. */
+static int uc_update_values (const data_set_t *ds, const value_list_t *vl,
+    cache_entry_t *ce)
+{
+  gauge_t interval = CDTIME_T_TO_DOUBLE (vl->time - ce->last_time);
+  int i;
+
+  if (ce->kind == CACHE_KIND_GAUGE)
+  {
+    for (i = 0; i < ds->ds_num; i++)
+    {
+      ce->values_raw[i].gauge = vl->values[i].gauge;
+      ce->values_gauge[i] = vl->values[i].gauge;
+    }
+    return (0);
+  }
+  else if (ce->kind == CACHE_KIND_DERIVE)
+  {
+    for (i = 0; i < ds->ds_num; i++)
+    {
+      ce->values_gauge[i] = ((double) (vl->values[i].derive
+	    - ce->values_raw[i].derive)) / interval;
+      ce->values_raw[i].derive = vl->values[i].derive;
+    }
+    return (0);
+  }
+
   for (i = 0; i < ds->ds_num; i++)
   {
     switch (ds->ds[i].type)
@@ -416,8 +1546,7 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
 	    diff = vl->values[i].counter - ce->values_raw[i].counter;
 	  }
 
-	  ce->values_gauge[i] = ((double) diff)
-	    / (CDTIME_T_TO_DOUBLE (vl->time - ce->last_time));
+	  ce->values_gauge[i] = ((double) diff) / interval;
 	  ce->values_raw[i].counter = vl->values[i].counter;
 	}
 	break;
@@ -433,29 +1562,44 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
 
 	  diff = vl->values[i].derive - ce->values_raw[i].derive;
 
-	  ce->values_gauge[i] = ((double) diff)
-	    / (CDTIME_T_TO_DOUBLE (vl->time - ce->last_time));
+	  ce->values_gauge[i] = ((double) diff) / interval;
 	  ce->values_raw[i].derive = vl->values[i].derive;
 	}
 	break;
 
       case DS_TYPE_ABSOLUTE:
-	ce->values_gauge[i] = ((double) vl->values[i].absolute)
-	  / (CDTIME_T_TO_DOUBLE (vl->time - ce->last_time));
+	ce->values_gauge[i] = ((double) vl->values[i].absolute) / interval;
 	ce->values_raw[i].absolute = vl->values[i].absolute;
 	break;
 
       default:
 	/* This shouldn't happen. */
-	pthread_mutex_unlock (&cache_lock);
-	ERROR ("uc_update: Don't know how to handle data source type %i.",
-	    ds->ds[i].type);
-	return (-1);
+	return ((ds->ds[i].type != 0) ? ds->ds[i].type : -1);
     } /* switch (ds->ds[i].type) */
-
-    DEBUG ("uc_update: %s: ds[%i] = %lf", name, i, ce->values_gauge[i]);
   } /* for (i) */
 
+  return (0);
+} /* int uc_update_values */
+
+/* Updates the existing entry "ce" with "vl". Returns zero, EEXIST if "vl" is
+ * not newer than the entry or EINVAL if "ds" has an unknown data source type.
+ * Nothing is logged, because the lock of "shard" must be held. */
+static int uc_update_entry (cache_shard_t *shard, const data_set_t *ds,
+    const value_list_t *vl, cache_entry_t *ce, gauge_t *ret_rates)
+{
+  int i;
+
+  assert (ce->values_num == ds->ds_num);
+
+  if (ce->last_time >= vl->time)
+  {
+    __sync_fetch_and_add (&cache_values_too_old, 1);
+    return (EEXIST);
+  }
+
+  if (uc_update_values (ds, vl, ce) != 0)
+    return (EINVAL);
+
   /* Update the history if it exists. */
   if (ce->history != NULL)
   {
@@ -474,253 +1618,925 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
   uc_check_range (ds, ce);
 
   ce->last_time = vl->time;
-  ce->last_update = cdtime ();
+  ce->last_update = cdtime_coarse ();
   ce->interval = vl->interval;
+  cache_timer_arm (shard, ce);
+
+  if (ret_rates != NULL)
+    memcpy (ret_rates, ce->values_gauge, ds->ds_num * sizeof (*ret_rates));
+
+
+  return (0);
+} /* int uc_update_entry */
+
+static void uc_update_log_failure (const value_list_t *vl, const char *name,
+    cdtime_t last_time, int status)
+{
+  if (status == EEXIST)
+    NOTICE ("uc_update: Value too old: name = %s; value time = %.3f; "
+	"last cache update = %.3f;",
+	name,
+	CDTIME_T_TO_DOUBLE (vl->time),
+	CDTIME_T_TO_DOUBLE (last_time));
+  else if (status == EINVAL)
+    ERROR ("uc_update: Don't know how to handle a data source type of %s.",
+	vl->type);
+  else if (status == EDQUOT)
+    cache_series_report (vl);
+} /* void uc_update_log_failure */
+
+int uc_update_rates (const data_set_t *ds, const value_list_t *vl,
+    gauge_t *ret_rates)
+{
+  char buffer[CACHE_NAME_MAX];
+  const char *name;
+  uint64_t hash;
+  cache_shard_t *shard;
+  cache_entry_t *ce = NULL;
+  cdtime_t last_time;
+  int status;
+
+  name = uc_get_key (vl, buffer, sizeof (buffer), &hash);
+  if (name == NULL)
+  {
+    ERROR ("uc_update: FORMAT_VL failed.");
+    return (-1);
+  }
+
+  shard = cache_shard_get (hash);
+  c_mutex_lock (&shard->lock);
+
+  ce = cache_lookup (shard, name, hash);
+  if (ce == NULL) /* entry does not yet exist */
+  {
+    status = uc_insert (shard, ds, vl, name, hash, ret_rates);
+    c_mutex_unlock (&shard->lock);
+    if (status == EDQUOT)
+      uc_update_log_failure (vl, name, /* last_time = */ 0, status);
+    return (status);
+  }
+
+  last_time = ce->last_time;
+  status = uc_update_entry (shard, ds, vl, ce, ret_rates);
+
+  c_mutex_unlock (&shard->lock);
+
+  if (status != 0)
+  {
+    uc_update_log_failure (vl, name, last_time, status);
+    return (-1);
+  }
+
+  return (0);
+} /* int uc_update_rates */
+
+int uc_update (const data_set_t *ds, const value_list_t *vl)
+{
+  return (uc_update_rates (ds, vl, /* ret_rates = */ NULL));
+} /* int uc_update */
+
+/* Updates the cache with "updates". Those carrying their identity are
+ * grouped by shard, so that each shard's lock is taken once, and each
+ * group's entries are looked up and prefetched before the rates are
+ * computed. The order of the updates within a shard is kept, so several
+ * values of one series are applied in order. */
+static void uc_update_chunk (uc_update_t *updates, size_t updates_num)
+{
+  size_t order[CACHE_UPDATE_CHUNK];
+  cache_entry_t *entries[CACHE_UPDATE_CHUNK];
+  cdtime_t last_times[CACHE_UPDATE_CHUNK];
+  size_t shard_first[CACHE_SHARDS + 1];
+  size_t shard_next[CACHE_SHARDS];
+  size_t i;
+  size_t j;
+
+  assert (updates_num <= CACHE_UPDATE_CHUNK);
+
+  /* Without an identity there is no key to sort by. */
+  for (i = 0; i < updates_num; i++)
+    if (updates[i].vl->identity == NULL)
+      updates[i].status = uc_update_rates (updates[i].ds, updates[i].vl,
+	  updates[i].rates);
+
+  /* Counting sort of the others by shard, which is stable. */
+  memset (shard_first, 0, sizeof (shard_first));
+  for (i = 0; i < updates_num; i++)
+    if (updates[i].vl->identity != NULL)
+      shard_first[CACHE_SHARD_INDEX (updates[i].vl->identity_hash) + 1]++;
+  for (i = 0; i < CACHE_SHARDS; i++)
+  {
+    shard_first[i + 1] += shard_first[i];
+    shard_next[i] = shard_first[i];
+  }
+  for (i = 0; i < updates_num; i++)
+    if (updates[i].vl->identity != NULL)
+      order[shard_next[CACHE_SHARD_INDEX (updates[i].vl->identity_hash)]++] = i;
+
+  pthread_once (&cache_once, cache_shards_init);
+  for (i = 0; i < CACHE_SHARDS; i++)
+  {
+    cache_shard_t *shard = cache_shards + i;
+
+    if (shard_first[i] == shard_first[i + 1])
+      continue;
+
+    c_mutex_lock (&shard->lock);
+
+    for (j = shard_first[i]; j < shard_first[i + 1]; j++)
+    {
+      const value_list_t *vl = updates[order[j]].vl;
+
+      entries[j] = cache_lookup (shard, vl->identity, vl->identity_hash);
+      if (entries[j] != NULL)
+	__builtin_prefetch (entries[j]->data, /* rw = */ 1);
+    }
+
+    for (j = shard_first[i]; j < shard_first[i + 1]; j++)
+    {
+      uc_update_t *u = updates + order[j];
+      cache_entry_t *ce = entries[j];
+
+      /* An earlier update of this group may have created the entry. */
+      if (ce == NULL)
+	ce = cache_lookup (shard, u->vl->identity, u->vl->identity_hash);
+
+      if (ce == NULL)
+      {
+	u->status = uc_insert (shard, u->ds, u->vl, u->vl->identity,
+	    u->vl->identity_hash, u->rates);
+	last_times[j] = 0;
+      }
+      else
+      {
+	last_times[j] = ce->last_time;
+	u->status = uc_update_entry (shard, u->ds, u->vl, ce, u->rates);
+      }
+    }
+
+    c_mutex_unlock (&shard->lock);
+
+    for (j = shard_first[i]; j < shard_first[i + 1]; j++)
+    {
+      uc_update_t *u = updates + order[j];
+
+      if (u->status == 0)
+	continue;
+      uc_update_log_failure (u->vl, u->vl->identity, last_times[j],
+	  u->status);
+      if (u->status != EDQUOT)
+	u->status = -1;
+    }
+  }
+} /* void uc_update_chunk */
+
+int uc_update_multi (uc_update_t *updates, size_t updates_num)
+{
+  size_t i;
+  size_t n;
+  int status = 0;
+
+  for (i = 0; i < updates_num; i += n)
+  {
+    size_t j;
+
+    n = updates_num - i;
+    if (n > CACHE_UPDATE_CHUNK)
+      n = CACHE_UPDATE_CHUNK;
+
+    uc_update_chunk (updates + i, n);
+    for (j = i; j < i + n; j++)
+      if (updates[j].status != 0)
+	status = -1;
+  }
+
+  return (status);
+} /* int uc_update_multi */
+
+static int uc_get_rate_by_key (const char *name, uint64_t hash,
+    gauge_t **ret_values, size_t *ret_values_num)
+{
+  gauge_t *ret = NULL;
+  size_t ret_num = 0;
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce = NULL;
+  int status = 0;
+
+  ce = uc_get_entry_by_key (name, hash, &shard);
+  if (ce != NULL)
+  {
+    /* remove missing values from getval */
+    if (ce->state == STATE_MISSING)
+    {
+      status = -1;
+    }
+    else
+    {
+      ret_num = ce->values_num;
+      ret = (gauge_t *) malloc (ret_num * sizeof (gauge_t));
+      if (ret == NULL)
+      {
+        ERROR ("utils_cache: uc_get_rate_by_name: malloc failed.");
+        status = -1;
+      }
+      else
+      {
+        memcpy (ret, ce->values_gauge, ret_num * sizeof (gauge_t));
+      }
+    }
+
+    c_mutex_unlock (&shard->lock);
+  }
+  else
+  {
+    DEBUG ("utils_cache: uc_get_rate_by_name: No such value: %s", name);
+    status = -1;
+  }
+
+  if (status == 0)
+  {
+    *ret_values = ret;
+    *ret_values_num = ret_num;
+  }
+
+  return (status);
+} /* int uc_get_rate_by_key */
+
+int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num)
+{
+  return (uc_get_rate_by_key (name, plugin_hash_string (name),
+        ret_values, ret_values_num));
+} /* int uc_get_rate_by_name */
+
+gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl)
+{
+  char buffer[CACHE_NAME_MAX];
+  const char *name;
+  gauge_t *ret = NULL;
+  size_t ret_num = 0;
+  int status;
+
+  uint64_t hash;
+
+  /* Attached by the daemon while dispatching "vl". */
+  if ((vl->rates != NULL) && (vl->values_len == ds->ds_num))
+  {
+    ret = malloc (ds->ds_num * sizeof (*ret));
+    if (ret == NULL)
+    {
+      ERROR ("utils_cache: uc_get_rate: malloc failed.");
+      return (NULL);
+    }
+    memcpy (ret, vl->rates, ds->ds_num * sizeof (*ret));
+    return (ret);
+  }
+
+  name = uc_get_key (vl, buffer, sizeof (buffer), &hash);
+  if (name == NULL)
+  {
+    ERROR ("utils_cache: uc_get_rate: FORMAT_VL failed.");
+    return (NULL);
+  }
+
+  status = uc_get_rate_by_key (name, hash, &ret, &ret_num);
+  if (status != 0)
+    return (NULL);
+
+  /* This is important - the caller has no other way of knowing how many
+   * values are returned. */
+  if (ret_num != (size_t) ds->ds_num)
+  {
+    ERROR ("utils_cache: uc_get_rate: ds[%s] has %i values, "
+	"but uc_get_rate_by_name returned %zu.",
+	ds->type, ds->ds_num, ret_num);
+    sfree (ret);
+    return (NULL);
+  }
+
+  return (ret);
+} /* gauge_t *uc_get_rate */
+
+const gauge_t *uc_get_rate_ref (const data_set_t *ds, /* {{{ */
+    const value_list_t *vl)
+{
+  if ((vl->rates != NULL) && (vl->values_len == ds->ds_num))
+    return (vl->rates);
+
+  return (uc_get_rate (ds, vl));
+} /* }}} const gauge_t *uc_get_rate_ref */
+
+void uc_release_rate_ref (const value_list_t *vl, /* {{{ */
+    const gauge_t *rates)
+{
+  if ((rates == NULL) || (rates == vl->rates))
+    return;
+
+  free ((void *) rates);
+} /* }}} void uc_release_rate_ref */
+
+size_t uc_get_size (void) /* {{{ */
+{
+  size_t size = 0;
+  size_t i;
+
+  pthread_once (&cache_once, cache_shards_init);
+  for (i = 0; i < CACHE_SHARDS; i++)
+  {
+    c_mutex_lock (&cache_shards[i].lock);
+    size += cache_shards[i].entries_num;
+    c_mutex_unlock (&cache_shards[i].lock);
+  }
+
+  return (size);
+} /* }}} size_t uc_get_size */
+
+uint64_t uc_get_memory (void) /* {{{ */
+{
+  return ((uint64_t) cache_memory);
+} /* }}} uint64_t uc_get_memory */
+
+uint64_t uc_get_values_too_old (void) /* {{{ */
+{
+  return ((uint64_t) cache_values_too_old);
+} /* }}} uint64_t uc_get_values_too_old */
+
+uint64_t uc_get_series_created (void) /* {{{ */
+{
+  return ((uint64_t) cache_series_created);
+} /* }}} uint64_t uc_get_series_created */
+
+uint64_t uc_get_values_rejected (void) /* {{{ */
+{
+  return ((uint64_t) cache_values_rejected);
+} /* }}} uint64_t uc_get_values_rejected */
+
+void uc_series_stats (void (*callback) (const char *plugin, /* {{{ */
+      size_t series, uint64_t created, uint64_t rejected, void *user_data),
+    void *user_data)
+{
+  struct
+  {
+    char name[DATA_MAX_NAME_LEN];
+    size_t entries;
+    uint64_t created;
+    uint64_t rejected;
+  } *stats = NULL;
+  c_htable_iterator_t *iter;
+  cache_series_t *s;
+  char *key;
+  size_t stats_num = 0;
+  size_t i;
+
+  if (cache_series_plugins == NULL)
+    return;
+
+  /* The callback may dispatch values, which would take the lock again. */
+  c_mutex_lock (&cache_series_lock);
+  stats = calloc ((size_t) c_htable_size (cache_series_plugins) + 1,
+      sizeof (*stats));
+  iter = (stats != NULL) ? c_htable_get_iterator (cache_series_plugins) : NULL;
+  while ((iter != NULL)
+      && (c_htable_iterator_next (iter, (void *) &key, (void *) &s) == 0))
+  {
+    sstrncpy (stats[stats_num].name, s->name, sizeof (stats[stats_num].name));
+    stats[stats_num].entries = s->entries;
+    stats[stats_num].created = s->created;
+    stats[stats_num].rejected = s->rejected;
+    stats_num++;
+  }
+  if (iter != NULL)
+    c_htable_iterator_destroy (iter);
+  c_mutex_unlock (&cache_series_lock);
+
+  for (i = 0; i < stats_num; i++)
+    (*callback) (stats[i].name, stats[i].entries, stats[i].created,
+	stats[i].rejected, user_data);
+  sfree (stats);
+} /* }}} void uc_series_stats */
+
+int uc_get_names (char ***ret_names, cdtime_t **ret_times, size_t *ret_number)
+{
+  char **names = NULL;
+  cdtime_t *times = NULL;
+  size_t number = 0;
+  size_t size_arrays = 0;
+  size_t i;
+
+  int status = 0;
+
+  if ((ret_names == NULL) || (ret_number == NULL))
+    return (-1);
+
+  pthread_once (&cache_once, cache_shards_init);
+  for (i = 0; (i < CACHE_SHARDS) && (status == 0); i++)
+  {
+    cache_shard_t *shard = cache_shards + i;
+    size_t j;
+
+    c_mutex_lock (&shard->lock);
+
+    /* Make room for all entries of this shard at once. */
+    if ((number + shard->entries_num) > size_arrays)
+    {
+      size_t new_size = number + shard->entries_num;
+      char **tmp_names;
+      cdtime_t *tmp_times;
+
+      tmp_names = realloc (names, new_size * sizeof (*names));
+      if (tmp_names != NULL)
+        names = tmp_names;
+      tmp_times = realloc (times, new_size * sizeof (*times));
+      if (tmp_times != NULL)
+        times = tmp_times;
+
+      if ((tmp_names == NULL) || (tmp_times == NULL))
+      {
+        ERROR ("uc_get_names: realloc failed.");
+        c_mutex_unlock (&shard->lock);
+        status = ENOMEM;
+        break;
+      }
+      size_arrays = new_size;
+    }
+
+    for (j = 0; (j < shard->buckets_num) && (status == 0); j++)
+    {
+      cache_entry_t *ce;
+
+      for (ce = shard->buckets[j]; ce != NULL; ce = ce->next)
+      {
+        /* remove missing values when list values */
+        if (ce->state == STATE_MISSING)
+          continue;
+
+        assert (number < size_arrays);
+
+        times[number] = ce->last_time;
+        names[number] = strdup (ce->name);
+        if (names[number] == NULL)
+        {
+          status = -1;
+          break;
+        }
+
+        number++;
+      }
+    }
+
+    c_mutex_unlock (&shard->lock);
+  }
+
+  if (status != 0)
+  {
+    for (i = 0; i < number; i++)
+    {
+      sfree (names[i]);
+    }
+    sfree (names);
+    sfree (times);
+
+    return (-1);
+  }
+
+  /* Handle the "no values" case like before: nothing is returned. */
+  if (number == 0)
+  {
+    sfree (names);
+    sfree (times);
+    return (0);
+  }
+
+  *ret_names = names;
+  if (ret_times != NULL)
+    *ret_times = times;
+  else
+    sfree (times);
+  *ret_number = number;
+
+  return (0);
+} /* int uc_get_names */
+
+/*
+ * Iterator
+ *
+ * The iterator copies the entries of the cache in chunks of about
+ * UC_ITER_CHUNK entries, holding the lock of one shard at a time, and hands
+ * them out from the copy. Buckets are visited in the order of the reversed
+ * bits of their index, so an entry present during the whole iteration is
+ * returned exactly once even if its shard grows in between chunks.
+ */
+#define UC_ITER_CHUNK 256
+
+struct uc_iter_entry_s
+{
+  size_t   name_offset;
+  cdtime_t time;
+  /* Only used with UC_ITER_VALUES. */
+  size_t   values_offset;
+  size_t   values_num;
+};
+
+struct uc_iter_s
+{
+  /* A name matches if it matches any of the patterns and the regex. */
+  char  **patterns;
+  _Bool  *patterns_glob;
+  size_t  patterns_num;
+#if HAVE_REGEX_H
+  regex_t regex;
+  _Bool   have_regex;
+#endif
+  int     flags;
+
+  size_t   shard_index;
+  uint64_t cursor;
+
+  struct uc_iter_entry_s *entries;
+  size_t entries_num;
+  size_t entries_size;
+  /* Index of the current entry plus one; zero before the first. */
+  size_t entries_pos;
+
+  char  *names;
+  size_t names_len;
+  size_t names_size;
+
+  gauge_t *values;
+  size_t   values_len;
+  size_t   values_size;
+};
+
+static uint64_t uc_iter_reverse (uint64_t v)
+{
+  v = ((v >>  1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) <<  1);
+  v = ((v >>  2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) <<  2);
+  v = ((v >>  4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) <<  4);
+  v = ((v >>  8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) <<  8);
+  v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+  return ((v >> 32) | (v << 32));
+} /* uint64_t uc_iter_reverse */
+
+/* Increments the reversed bits of "cursor". Returns zero once all buckets
+ * have been visited. */
+static uint64_t uc_iter_cursor_next (uint64_t cursor, uint64_t mask)
+{
+  cursor |= ~mask;
+  cursor = uc_iter_reverse (cursor);
+  cursor++;
+  return (uc_iter_reverse (cursor));
+} /* uint64_t uc_iter_cursor_next */
+
+static _Bool uc_iter_match (const uc_iter_t *iter, const char *name)
+{
+  size_t i;
+
+#if HAVE_REGEX_H
+  if (iter->have_regex
+      && (regexec (&iter->regex, name, /* nmatch = */ 0,
+          /* pmatch = */ NULL, /* eflags = */ 0) != 0))
+    return (0);
+#endif
+
+  if (iter->patterns_num == 0)
+    return (1);
+
+  for (i = 0; i < iter->patterns_num; i++)
+  {
+#if HAVE_FNMATCH_H
+    if (iter->patterns_glob[i])
+    {
+      if (fnmatch (iter->patterns[i], name, /* flags = */ 0) == 0)
+        return (1);
+      continue;
+    }
+#endif
+
+    if (iter->flags & UC_ITER_EXACT)
+    {
+      if (strcmp (iter->patterns[i], name) == 0)
+        return (1);
+    }
+    else if (strncmp (iter->patterns[i], name,
+          strlen (iter->patterns[i])) == 0)
+      return (1);
+  }
+
+  return (0);
+} /* _Bool uc_iter_match */
+
+static void uc_iter_free_patterns (uc_iter_t *iter)
+{
+  size_t i;
+
+  if (iter->patterns != NULL)
+    for (i = 0; i < iter->patterns_num; i++)
+      sfree (iter->patterns[i]);
+  sfree (iter->patterns);
+  sfree (iter->patterns_glob);
+  iter->patterns_num = 0;
+} /* void uc_iter_free_patterns */
+
+static int uc_iter_append (uc_iter_t *iter, const cache_entry_t *ce)
+{
+  size_t name_size = strlen (ce->name) + 1;
+
+  if (iter->entries_num >= iter->entries_size)
+  {
+    size_t new_size = (iter->entries_size == 0)
+      ? UC_ITER_CHUNK : (2 * iter->entries_size);
+    struct uc_iter_entry_s *tmp;
+
+    tmp = realloc (iter->entries, new_size * sizeof (*tmp));
+    if (tmp == NULL)
+      return (ENOMEM);
+    iter->entries = tmp;
+    iter->entries_size = new_size;
+  }
+
+  if ((iter->names_len + name_size) > iter->names_size)
+  {
+    size_t new_size = (iter->names_size == 0)
+      ? (UC_ITER_CHUNK * 64) : (2 * iter->names_size);
+    char *tmp;
+
+    while (new_size < (iter->names_len + name_size))
+      new_size *= 2;
+
+    tmp = realloc (iter->names, new_size);
+    if (tmp == NULL)
+      return (ENOMEM);
+    iter->names = tmp;
+    iter->names_size = new_size;
+  }
+
+  if ((iter->flags & UC_ITER_VALUES)
+      && ((iter->values_len + (size_t) ce->values_num) > iter->values_size))
+  {
+    size_t new_size = (iter->values_size == 0)
+      ? (UC_ITER_CHUNK * 4) : (2 * iter->values_size);
+    gauge_t *tmp;
+
+    while (new_size < (iter->values_len + (size_t) ce->values_num))
+      new_size *= 2;
+
+    tmp = realloc (iter->values, new_size * sizeof (*tmp));
+    if (tmp == NULL)
+      return (ENOMEM);
+    iter->values = tmp;
+    iter->values_size = new_size;
+  }
 
-  pthread_mutex_unlock (&cache_lock);
+  memcpy (iter->names + iter->names_len, ce->name, name_size);
+  iter->entries[iter->entries_num].name_offset = iter->names_len;
+  iter->entries[iter->entries_num].time = ce->last_time;
+  iter->entries[iter->entries_num].values_offset = iter->values_len;
+  iter->entries[iter->entries_num].values_num = 0;
+  if (iter->flags & UC_ITER_VALUES)
+  {
+    memcpy (iter->values + iter->values_len, ce->values_gauge,
+        ((size_t) ce->values_num) * sizeof (*iter->values));
+    iter->entries[iter->entries_num].values_num = (size_t) ce->values_num;
+    iter->values_len += (size_t) ce->values_num;
+  }
+  iter->entries_num++;
+  iter->names_len += name_size;
 
   return (0);
-} /* int uc_update */
+} /* int uc_iter_append */
 
-int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num)
+/* Copies the next chunk of entries. The last bucket visited is copied
+ * completely, so there may be more than UC_ITER_CHUNK entries. */
+static int uc_iter_fill (uc_iter_t *iter)
 {
-  gauge_t *ret = NULL;
-  size_t ret_num = 0;
-  cache_entry_t *ce = NULL;
-  int status = 0;
+  iter->entries_num = 0;
+  iter->entries_pos = 0;
+  iter->names_len = 0;
+  iter->values_len = 0;
 
-  pthread_mutex_lock (&cache_lock);
-
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  while ((iter->shard_index < CACHE_SHARDS)
+      && (iter->entries_num < UC_ITER_CHUNK))
   {
-    assert (ce != NULL);
+    cache_shard_t *shard = cache_shards + iter->shard_index;
 
-    /* remove missing values from getval */
-    if (ce->state == STATE_MISSING)
-    {
-      status = -1;
-    }
+    c_mutex_lock (&shard->lock);
+    if (shard->buckets_num == 0)
+      iter->cursor = 0;
     else
     {
-      ret_num = ce->values_num;
-      ret = (gauge_t *) malloc (ret_num * sizeof (gauge_t));
-      if (ret == NULL)
-      {
-        ERROR ("utils_cache: uc_get_rate_by_name: malloc failed.");
-        status = -1;
-      }
-      else
+      uint64_t mask = (uint64_t) (shard->buckets_num - 1);
+
+      do
       {
-        memcpy (ret, ce->values_gauge, ret_num * sizeof (gauge_t));
-      }
+        cache_entry_t *ce;
+
+        for (ce = shard->buckets[iter->cursor & mask];
+            ce != NULL;
+            ce = ce->next)
+        {
+          /* remove missing values when list values */
+          if (ce->state == STATE_MISSING)
+            continue;
+          if (!uc_iter_match (iter, ce->name))
+            continue;
+
+          if (uc_iter_append (iter, ce) != 0)
+          {
+            c_mutex_unlock (&shard->lock);
+            ERROR ("uc_iterator_next: realloc failed.");
+            return (ENOMEM);
+          }
+        }
+
+        iter->cursor = uc_iter_cursor_next (iter->cursor, mask);
+      } while ((iter->cursor != 0) && (iter->entries_num < UC_ITER_CHUNK));
     }
-  }
-  else
-  {
-    DEBUG ("utils_cache: uc_get_rate_by_name: No such value: %s", name);
-    status = -1;
-  }
-
-  pthread_mutex_unlock (&cache_lock);
+    c_mutex_unlock (&shard->lock);
 
-  if (status == 0)
-  {
-    *ret_values = ret;
-    *ret_values_num = ret_num;
+    if (iter->cursor == 0)
+      iter->shard_index++;
   }
 
-  return (status);
-} /* gauge_t *uc_get_rate_by_name */
+  return (0);
+} /* int uc_iter_fill */
 
-gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl)
+uc_iter_t *uc_get_iterator_filtered (char const * const *patterns, /* {{{ */
+    size_t patterns_num, const char *regex, int flags)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  gauge_t *ret = NULL;
-  size_t ret_num = 0;
-  int status;
+  uc_iter_t *iter;
+  size_t i;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("utils_cache: uc_get_rate: FORMAT_VL failed.");
+  iter = malloc (sizeof (*iter));
+  if (iter == NULL)
     return (NULL);
+  memset (iter, 0, sizeof (*iter));
+  iter->flags = flags;
+
+  if (patterns_num > 0)
+  {
+    iter->patterns = calloc (patterns_num, sizeof (*iter->patterns));
+    iter->patterns_glob = calloc (patterns_num, sizeof (*iter->patterns_glob));
+    if ((iter->patterns == NULL) || (iter->patterns_glob == NULL))
+    {
+      uc_iterator_destroy (iter);
+      return (NULL);
+    }
   }
 
-  status = uc_get_rate_by_name (name, &ret, &ret_num);
-  if (status != 0)
-    return (NULL);
+  for (i = 0; i < patterns_num; i++)
+  {
+    /* An empty pattern matches all names. */
+    if ((patterns[i] == NULL) || (patterns[i][0] == 0))
+    {
+      uc_iter_free_patterns (iter);
+      break;
+    }
 
-  /* This is important - the caller has no other way of knowing how many
-   * values are returned. */
-  if (ret_num != (size_t) ds->ds_num)
+    iter->patterns[i] = strdup (patterns[i]);
+    if (iter->patterns[i] == NULL)
+    {
+      uc_iterator_destroy (iter);
+      return (NULL);
+    }
+    iter->patterns_glob[i] = (strpbrk (patterns[i], "*?[") != NULL);
+    iter->patterns_num++;
+  }
+
+  if ((regex != NULL) && (regex[0] != 0))
   {
-    ERROR ("utils_cache: uc_get_rate: ds[%s] has %i values, "
-	"but uc_get_rate_by_name returned %zu.",
-	ds->type, ds->ds_num, ret_num);
-    sfree (ret);
+#if HAVE_REGEX_H
+    int status;
+
+    status = regcomp (&iter->regex, regex, REG_EXTENDED | REG_NOSUB);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      regerror (status, &iter->regex, errbuf, sizeof (errbuf));
+      ERROR ("uc_get_iterator_filtered: Compiling the regular expression "
+          "\"%s\" failed: %s", regex, errbuf);
+      uc_iterator_destroy (iter);
+      return (NULL);
+    }
+    iter->have_regex = 1;
+#else
+    ERROR ("uc_get_iterator_filtered: Regular expressions are not "
+        "supported on this system.");
+    uc_iterator_destroy (iter);
     return (NULL);
+#endif
   }
 
-  return (ret);
-} /* gauge_t *uc_get_rate */
+  pthread_once (&cache_once, cache_shards_init);
+  return (iter);
+} /* }}} uc_iter_t *uc_get_iterator_filtered */
 
-int uc_get_names (char ***ret_names, cdtime_t **ret_times, size_t *ret_number)
+uc_iter_t *uc_get_iterator (const char *pattern) /* {{{ */
 {
-  c_avl_iterator_t *iter;
-  char *key;
-  cache_entry_t *value;
-
-  char **names = NULL;
-  cdtime_t *times = NULL;
-  size_t number = 0;
-  size_t size_arrays = 0;
-
-  int status = 0;
+  return (uc_get_iterator_filtered (&pattern, (pattern != NULL) ? 1 : 0,
+        /* regex = */ NULL, /* flags = */ 0));
+} /* }}} uc_iter_t *uc_get_iterator */
 
-  if ((ret_names == NULL) || (ret_number == NULL))
+int uc_iterator_next (uc_iter_t *iter, char **ret_name) /* {{{ */
+{
+  if ((iter == NULL) || (ret_name == NULL))
     return (-1);
 
-  pthread_mutex_lock (&cache_lock);
-
-  size_arrays = (size_t) c_avl_size (cache_tree);
-  if (size_arrays < 1)
+  while (iter->entries_pos >= iter->entries_num)
   {
-    /* Handle the "no values" case here, to avoid the error message when
-     * calloc() returns NULL. */
-    pthread_mutex_unlock (&cache_lock);
-    return (0);
-  }
+    if (iter->shard_index >= CACHE_SHARDS)
+      return (1);
 
-  names = calloc (size_arrays, sizeof (*names));
-  times = calloc (size_arrays, sizeof (*times));
-  if ((names == NULL) || (times == NULL))
-  {
-    ERROR ("uc_get_names: calloc failed.");
-    sfree (names);
-    sfree (times);
-    pthread_mutex_unlock (&cache_lock);
-    return (ENOMEM);
+    if (uc_iter_fill (iter) != 0)
+      return (-1);
   }
 
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &value) == 0)
-  {
-    /* remove missing values when list values */
-    if (value->state == STATE_MISSING)
-      continue;
-
-    /* c_avl_size does not return a number smaller than the number of elements
-     * returned by c_avl_iterator_next. */
-    assert (number < size_arrays);
+  *ret_name = iter->names + iter->entries[iter->entries_pos].name_offset;
+  iter->entries_pos++;
 
-    if (ret_times != NULL)
-      times[number] = value->last_time;
-
-    names[number] = strdup (key);
-    if (names[number] == NULL)
-    {
-      status = -1;
-      break;
-    }
+  return (0);
+} /* }}} int uc_iterator_next */
 
-    number++;
-  } /* while (c_avl_iterator_next) */
+int uc_iterator_get_values (uc_iter_t *iter, /* {{{ */
+    gauge_t **ret_values, size_t *ret_values_num)
+{
+  struct uc_iter_entry_s *entry;
 
-  c_avl_iterator_destroy (iter);
-  pthread_mutex_unlock (&cache_lock);
+  if ((iter == NULL) || (ret_values == NULL) || (ret_values_num == NULL)
+      || (iter->entries_pos == 0) || ((iter->flags & UC_ITER_VALUES) == 0))
+    return (-1);
 
-  if (status != 0)
-  {
-    size_t i;
-    
-    for (i = 0; i < number; i++)
-    {
-      sfree (names[i]);
-    }
-    sfree (names);
+  entry = iter->entries + (iter->entries_pos - 1);
+  *ret_values = iter->values + entry->values_offset;
+  *ret_values_num = entry->values_num;
+  return (0);
+} /* }}} int uc_iterator_get_values */
 
+int uc_iterator_get_time (uc_iter_t *iter, cdtime_t *ret_time) /* {{{ */
+{
+  if ((iter == NULL) || (ret_time == NULL) || (iter->entries_pos == 0))
     return (-1);
-  }
-
-  *ret_names = names;
-  if (ret_times != NULL)
-    *ret_times = times;
-  *ret_number = number;
 
+  *ret_time = iter->entries[iter->entries_pos - 1].time;
   return (0);
-} /* int uc_get_names */
+} /* }}} int uc_iterator_get_time */
+
+void uc_iterator_destroy (uc_iter_t *iter) /* {{{ */
+{
+  if (iter == NULL)
+    return;
+
+  uc_iter_free_patterns (iter);
+#if HAVE_REGEX_H
+  if (iter->have_regex)
+    regfree (&iter->regex);
+#endif
+  sfree (iter->entries);
+  sfree (iter->names);
+  sfree (iter->values);
+  sfree (iter);
+} /* }}} void uc_iterator_destroy */
 
 int uc_get_state (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int ret = STATE_ERROR;
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
+  int ret;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
     return (STATE_ERROR);
-  }
 
-  pthread_mutex_lock (&cache_lock);
+  ret = ce->state;
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
-  {
-    assert (ce != NULL);
-    ret = ce->state;
-  }
-
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_get_state */
 
 int uc_set_state (const data_set_t *ds, const value_list_t *vl, int state)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int ret = -1;
-
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
-    return (STATE_ERROR);
-  }
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
+  int ret;
 
-  pthread_mutex_lock (&cache_lock);
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
+    return (-1);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
-  {
-    assert (ce != NULL);
-    ret = ce->state;
-    ce->state = state;
-  }
+  ret = ce->state;
+  ce->state = state;
 
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_set_state */
 
-int uc_get_history_by_name (const char *name,
+/* The lock of the entry's shard must be held. */
+static int uc_entry_get_history (cache_entry_t *ce,
     gauge_t *ret_history, size_t num_steps, size_t num_ds)
 {
-  cache_entry_t *ce = NULL;
   size_t i;
-  int status = 0;
-
-  pthread_mutex_lock (&cache_lock);
-
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0)
-  {
-    pthread_mutex_unlock (&cache_lock);
-    return (-ENOENT);
-  }
 
   if (((size_t) ce->values_num) != num_ds)
-  {
-    pthread_mutex_unlock (&cache_lock);
     return (-EINVAL);
-  }
 
   /* Check if there are enough values available. If not, increase the buffer
    * size. */
@@ -732,16 +2548,15 @@ int uc_get_history_by_name (const char *name,
     tmp = realloc (ce->history, sizeof (*ce->history)
 	* num_steps * ce->values_num);
     if (tmp == NULL)
-    {
-      pthread_mutex_unlock (&cache_lock);
       return (-ENOMEM);
-    }
 
     for (i = ce->history_length * ce->values_num;
 	i < (num_steps * ce->values_num);
 	i++)
       tmp[i] = NAN;
 
+    CACHE_MEMORY_ADD ((num_steps - ce->history_length)
+        * ce->values_num * sizeof (*ce->history));
     ce->history = tmp;
     ce->history_length = num_steps;
   } /* if (ce->history_length < num_steps) */
@@ -764,134 +2579,232 @@ int uc_get_history_by_name (const char *name,
 	sizeof (*ret_history) * num_ds);
   }
 
-  pthread_mutex_unlock (&cache_lock);
-
   return (0);
+} /* int uc_entry_get_history */
+
+static int uc_get_history_by_key (const char *name, uint64_t hash,
+    gauge_t *ret_history, size_t num_steps, size_t num_ds)
+{
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce = NULL;
+  int status;
+
+  ce = uc_get_entry_by_key (name, hash, &shard);
+  if (ce == NULL)
+    return (-ENOENT);
+
+  status = uc_entry_get_history (ce, ret_history, num_steps, num_ds);
+
+  c_mutex_unlock (&shard->lock);
+
+  return (status);
+} /* int uc_get_history_by_key */
+
+int uc_get_history_by_name (const char *name,
+    gauge_t *ret_history, size_t num_steps, size_t num_ds)
+{
+  return (uc_get_history_by_key (name, plugin_hash_string (name),
+        ret_history, num_steps, num_ds));
 } /* int uc_get_history_by_name */
 
 int uc_get_history (const data_set_t *ds, const value_list_t *vl,
     gauge_t *ret_history, size_t num_steps, size_t num_ds)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  char buffer[CACHE_NAME_MAX];
+  const char *name;
+  uint64_t hash;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  name = uc_get_key (vl, buffer, sizeof (buffer), &hash);
+  if (name == NULL)
   {
     ERROR ("utils_cache: uc_get_history: FORMAT_VL failed.");
     return (-1);
   }
 
-  return (uc_get_history_by_name (name, ret_history, num_steps, num_ds));
+  return (uc_get_history_by_key (name, hash,
+        ret_history, num_steps, num_ds));
 } /* int uc_get_history */
 
 int uc_get_hits (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int ret = STATE_ERROR;
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
+  int ret;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
     return (STATE_ERROR);
-  }
 
-  pthread_mutex_lock (&cache_lock);
+  ret = ce->hits;
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
-  {
-    assert (ce != NULL);
-    ret = ce->hits;
-  }
-
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_get_hits */
 
 int uc_set_hits (const data_set_t *ds, const value_list_t *vl, int hits)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int ret = -1;
-
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
-    return (STATE_ERROR);
-  }
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
+  int ret;
 
-  pthread_mutex_lock (&cache_lock);
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
+    return (-1);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
-  {
-    assert (ce != NULL);
-    ret = ce->hits;
-    ce->hits = hits;
-  }
+  ret = ce->hits;
+  ce->hits = hits;
 
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_set_hits */
 
 int uc_inc_hits (const data_set_t *ds, const value_list_t *vl, int step)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int ret = -1;
-
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
-  {
-    ERROR ("uc_get_state: FORMAT_VL failed.");
-    return (STATE_ERROR);
-  }
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
+  int ret;
 
-  pthread_mutex_lock (&cache_lock);
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
+    return (-1);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
-  {
-    assert (ce != NULL);
-    ret = ce->hits;
-    ce->hits = ret + step;
-  }
+  ret = ce->hits;
+  ce->hits = ret + step;
 
-  pthread_mutex_unlock (&cache_lock);
+  c_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_inc_hits */
 
-/*
- * Meta data interface
- */
-/* XXX: This function will acquire `cache_lock' but will not free it! */
-static meta_data_t *uc_get_meta (const value_list_t *vl) /* {{{ */
+int uc_get_handle (const value_list_t *vl, uc_handle_t *h) /* {{{ */
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int status;
+  cache_shard_t *shard = NULL;
+  cache_entry_t *ce;
 
-  status = FORMAT_VL (name, sizeof (name), vl);
-  if (status != 0)
+  ce = uc_get_entry (vl, &shard);
+  if (ce == NULL)
+    return (ENOENT);
+
+  h->shard = shard;
+  h->entry = ce;
+  return (0);
+} /* }}} int uc_get_handle */
+
+void uc_handle_release (uc_handle_t *h) /* {{{ */
+{
+  cache_shard_t *shard = h->shard;
+
+  h->shard = NULL;
+  h->entry = NULL;
+  c_mutex_unlock (&shard->lock);
+} /* }}} void uc_handle_release */
+
+int uc_handle_get_rate (uc_handle_t *h, /* {{{ */
+    gauge_t *ret_values, size_t values_num)
+{
+  cache_entry_t *ce = h->entry;
+
+  if ((ce->state == STATE_MISSING) || ((size_t) ce->values_num != values_num))
+    return (-1);
+
+  memcpy (ret_values, ce->values_gauge, values_num * sizeof (gauge_t));
+  return (0);
+} /* }}} int uc_handle_get_rate */
+
+int uc_handle_get_state (uc_handle_t *h) /* {{{ */
+{
+  return (((cache_entry_t *) h->entry)->state);
+} /* }}} int uc_handle_get_state */
+
+int uc_handle_set_state (uc_handle_t *h, int state) /* {{{ */
+{
+  cache_entry_t *ce = h->entry;
+  int ret;
+
+  ret = ce->state;
+  ce->state = state;
+  return (ret);
+} /* }}} int uc_handle_set_state */
+
+int uc_handle_get_hits (uc_handle_t *h) /* {{{ */
+{
+  return (((cache_entry_t *) h->entry)->hits);
+} /* }}} int uc_handle_get_hits */
+
+int uc_handle_set_hits (uc_handle_t *h, int hits) /* {{{ */
+{
+  cache_entry_t *ce = h->entry;
+  int ret;
+
+  ret = ce->hits;
+  ce->hits = hits;
+  return (ret);
+} /* }}} int uc_handle_set_hits */
+
+int uc_handle_get_history (uc_handle_t *h, /* {{{ */
+    gauge_t *ret_history, size_t num_steps, size_t num_ds)
+{
+  return (uc_entry_get_history (h->entry, ret_history, num_steps, num_ds));
+} /* }}} int uc_handle_get_history */
+
+int uc_handle_get_emitted (uc_handle_t *h, /* {{{ */
+    gauge_t *ret_values, size_t values_num, cdtime_t *ret_time)
+{
+  cache_entry_t *ce = h->entry;
+
+  if (ce->values_emitted == NULL)
+    return (ENOENT);
+  if ((size_t) ce->values_num != values_num)
+    return (-1);
+
+  memcpy (ret_values, ce->values_emitted, values_num * sizeof (gauge_t));
+  if (ret_time != NULL)
+    *ret_time = ce->emitted_time;
+  return (0);
+} /* }}} int uc_handle_get_emitted */
+
+int uc_handle_set_emitted (uc_handle_t *h, /* {{{ */
+    const gauge_t *values, size_t values_num, cdtime_t time)
+{
+  cache_entry_t *ce = h->entry;
+
+  if ((size_t) ce->values_num != values_num)
+    return (-1);
+
+  if (ce->values_emitted == NULL)
   {
-    ERROR ("utils_cache: uc_get_meta: FORMAT_VL failed.");
-    return (NULL);
+    ce->values_emitted = malloc (values_num * sizeof (*ce->values_emitted));
+    if (ce->values_emitted == NULL)
+      return (ENOMEM);
+    CACHE_MEMORY_ADD (values_num * sizeof (*ce->values_emitted));
   }
 
-  pthread_mutex_lock (&cache_lock);
+  memcpy (ce->values_emitted, values, values_num * sizeof (gauge_t));
+  ce->emitted_time = time;
+  return (0);
+} /* }}} int uc_handle_set_emitted */
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0)
-  {
-    pthread_mutex_unlock (&cache_lock);
+/*
+ * Meta data interface
+ */
+/* XXX: This function will acquire the lock of the shard holding `vl' but
+ * will not free it! */
+static meta_data_t *uc_get_meta (const value_list_t *vl, /* {{{ */
+    cache_shard_t **ret_shard)
+{
+  cache_entry_t *ce;
+
+  ce = uc_get_entry (vl, ret_shard);
+  if (ce == NULL)
     return (NULL);
-  }
-  assert (ce != NULL);
 
   if (ce->meta == NULL)
     ce->meta = meta_data_create ();
 
   if (ce->meta == NULL)
-    pthread_mutex_unlock (&cache_lock);
+    c_mutex_unlock (&(*ret_shard)->lock);
 
   return (ce->meta);
 } /* }}} meta_data_t *uc_get_meta */
@@ -899,12 +2812,13 @@ static meta_data_t *uc_get_meta (const value_list_t *vl) /* {{{ */
 /* Sorry about this preprocessor magic, but it really makes this file much
  * shorter.. */
 #define UC_WRAP(wrap_function) { \
+  cache_shard_t *shard; \
   meta_data_t *meta; \
   int status; \
-  meta = uc_get_meta (vl); \
+  meta = uc_get_meta (vl, &shard); \
   if (meta == NULL) return (-1); \
   status = wrap_function (meta, key); \
-  pthread_mutex_unlock (&cache_lock); \
+  c_mutex_unlock (&shard->lock); \
   return (status); \
 }
 int uc_meta_data_exists (const value_list_t *vl, const char *key)
@@ -917,12 +2831,13 @@ int uc_meta_data_delete (const value_list_t *vl, const char *key)
 /* We need a new version of this macro because the following functions take
  * two argumetns. */
 #define UC_WRAP(wrap_function) { \
+  cache_shard_t *shard; \
   meta_data_t *meta; \
   int status; \
-  meta = uc_get_meta (vl); \
+  meta = uc_get_meta (vl, &shard); \
   if (meta == NULL) return (-1); \
   status = wrap_function (meta, key, value); \
-  pthread_mutex_unlock (&cache_lock); \
+  c_mutex_unlock (&shard->lock); \
   return (status); \
 }
 int uc_meta_data_add_string (const value_list_t *vl,
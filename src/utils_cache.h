@@ -30,13 +30,99 @@
 #define STATE_MISSING 15
 
 int uc_init (void);
+/* Limits the number of entries per plugin and per host, zero meaning no
+ * limit. Must be called before the first entry is added. */
+int uc_set_series_limits (size_t per_plugin, size_t per_host);
 int uc_check_timeout (void);
 int uc_update (const data_set_t *ds, const value_list_t *vl);
+/* Like uc_update(), but also copies the rates computed for "vl" to
+ * "ret_rates", which must have room for "ds->ds_num" values, on success.
+ * Both return EDQUOT if "vl" is not in the cache and adding it would exceed
+ * a limit set by uc_set_series_limits(). */
+int uc_update_rates (const data_set_t *ds, const value_list_t *vl,
+    gauge_t *ret_rates);
+
+/* One value list of a uc_update_multi() call. "rates" may be NULL; "status"
+ * is set to zero on success, to EDQUOT like uc_update_rates() and to -1 if
+ * the cache was not updated for another reason. */
+struct uc_update_s
+{
+  const data_set_t *ds;
+  const value_list_t *vl;
+  gauge_t *rates;
+  int status;
+};
+typedef struct uc_update_s uc_update_t;
+
+/* Same as calling uc_update_rates() for each of "updates", but takes the
+ * lock of each shard of the cache only once. Value lists of one series are
+ * applied in order. Returns zero if all updates succeeded. */
+int uc_update_multi (uc_update_t *updates, size_t updates_num);
+/* Writes all entries of the cache to "file", replacing it atomically, and
+ * adds the entries in "file" to the cache, respectively. Reading a file that
+ * doesn't exist is not an error. Entries which don't match their data set are
+ * skipped. */
+int uc_snapshot_write (const char *file);
+int uc_snapshot_read (const char *file);
+
 int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num);
 gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl);
+/* Returns the rates of "vl" like uc_get_rate(). For value lists being
+ * dispatched, these are the rates computed by the daemon a moment ago and
+ * neither the cache nor malloc(3) is touched. Either way, the result must be
+ * handed back with uc_release_rate_ref(), not freed. */
+const gauge_t *uc_get_rate_ref (const data_set_t *ds, const value_list_t *vl);
+void uc_release_rate_ref (const value_list_t *vl, const gauge_t *rates);
 
 int uc_get_names (char ***ret_names, cdtime_t **ret_times, size_t *ret_number);
 
+/* Iterates over the names in the cache without holding any lock for long.
+ * Only names matching "pattern" are returned: a shell wildcard pattern, see
+ * fnmatch(3), if it contains "*", "?" or "[", a prefix otherwise. NULL
+ * matches all names. uc_iterator_next() returns zero and the next name,
+ * which is valid until the next call, or greater than zero once all names
+ * have been returned. uc_iterator_get_time() returns the time of the name
+ * returned last. */
+struct uc_iter_s;
+typedef struct uc_iter_s uc_iter_t;
+
+uc_iter_t *uc_get_iterator (const char *pattern);
+int uc_iterator_next (uc_iter_t *iter, char **ret_name);
+int uc_iterator_get_time (uc_iter_t *iter, cdtime_t *ret_time);
+
+/* Like uc_get_iterator(), but names are returned if they match any of the
+ * "patterns" (all names if there are none) and the extended regular
+ * expression "regex", unless it is NULL. Patterns without glob characters
+ * are prefixes, or complete names with UC_ITER_EXACT. With UC_ITER_VALUES,
+ * the rates are copied together with the names and uc_iterator_get_values()
+ * returns those of the name returned last, valid until the next call. */
+#define UC_ITER_VALUES 0x01
+#define UC_ITER_EXACT  0x02
+uc_iter_t *uc_get_iterator_filtered (char const * const *patterns,
+    size_t patterns_num, const char *regex, int flags);
+int uc_iterator_get_values (uc_iter_t *iter,
+    gauge_t **ret_values, size_t *ret_values_num);
+void uc_iterator_destroy (uc_iter_t *iter);
+
+/* Returns the number of entries in the cache. */
+size_t uc_get_size (void);
+/* Returns the number of bytes allocated for the entries of the cache, not
+ * counting their meta data. */
+uint64_t uc_get_memory (void);
+/* Returns the number of values rejected since startup because they were not
+ * newer than the value in the cache. */
+uint64_t uc_get_values_too_old (void);
+/* Returns the number of entries added since startup and the number of values
+ * rejected because of a limit set by uc_set_series_limits(). */
+uint64_t uc_get_series_created (void);
+uint64_t uc_get_values_rejected (void);
+/* Calls "callback" with the number of entries of each plugin, the number
+ * added since startup and the number of values rejected because of a limit.
+ * Only available while a limit is set. */
+void uc_series_stats (void (*callback) (const char *plugin,
+      size_t series, uint64_t created, uint64_t rejected, void *user_data),
+    void *user_data);
+
 int uc_get_state (const data_set_t *ds, const value_list_t *vl);
 int uc_set_state (const data_set_t *ds, const value_list_t *vl, int state);
 int uc_get_hits (const data_set_t *ds, const value_list_t *vl);
@@ -48,6 +134,37 @@ int uc_get_history (const data_set_t *ds, const value_list_t *vl,
 int uc_get_history_by_name (const char *name,
     gauge_t *ret_history, size_t num_steps, size_t num_ds);
 
+/* Gives access to several fields of one entry in a single critical section,
+ * instead of looking the entry up and locking it once per field.
+ * uc_get_handle() looks up "vl" and returns zero with the entry locked, or
+ * ENOENT if there is no such entry. Until uc_handle_release() is called, the
+ * thread must not call any other function of the cache, and should not block.
+ * uc_handle_get_rate() fails if the value is missing or doesn't have
+ * "values_num" values; the set functions return the previous value.
+ * uc_handle_get_emitted() and uc_handle_set_emitted() keep the rates last
+ * passed on by a filter which suppresses unchanged values, and their time;
+ * the former returns ENOENT if they haven't been set yet. */
+typedef struct uc_handle_s
+{
+  void *shard;
+  void *entry;
+} uc_handle_t;
+
+int uc_get_handle (const value_list_t *vl, uc_handle_t *h);
+void uc_handle_release (uc_handle_t *h);
+
+int uc_handle_get_rate (uc_handle_t *h, gauge_t *ret_values, size_t values_num);
+int uc_handle_get_state (uc_handle_t *h);
+int uc_handle_set_state (uc_handle_t *h, int state);
+int uc_handle_get_hits (uc_handle_t *h);
+int uc_handle_set_hits (uc_handle_t *h, int hits);
+int uc_handle_get_history (uc_handle_t *h,
+    gauge_t *ret_history, size_t num_steps, size_t num_ds);
+int uc_handle_get_emitted (uc_handle_t *h,
+    gauge_t *ret_values, size_t values_num, cdtime_t *ret_time);
+int uc_handle_set_emitted (uc_handle_t *h,
+    const gauge_t *values, size_t values_num, cdtime_t time);
+
 /*
  * Meta data interface
  */
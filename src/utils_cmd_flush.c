@@ -151,9 +151,16 @@ int handle_flush (FILE *fh, char *buffer)
 			int status;
 
 			identifier = identifiers[j];
-			status = plugin_flush (plugin,
-					DOUBLE_TO_CDTIME_T (timeout),
-					identifier);
+			/* Frontends flush once per graph, so these requests are
+			 * merged and done by the flush thread. */
+			if (identifier != NULL)
+				status = plugin_flush_async (plugin,
+						DOUBLE_TO_CDTIME_T (timeout),
+						identifier);
+			else
+				status = plugin_flush (plugin,
+						DOUBLE_TO_CDTIME_T (timeout),
+						identifier);
 			if (status == 0)
 				success++;
 			else
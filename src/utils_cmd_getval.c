@@ -24,6 +24,7 @@
 #include "plugin.h"
 
 #include "utils_cache.h"
+#include "utils_cmd_listval.h"
 #include "utils_parse_option.h"
 
 #define print_to_socket(fh, ...) \
@@ -34,6 +35,101 @@
     return -1; \
   }
 
+/* Handles "GETVAL <identifier> [<identifier> ...]" with more than one
+ * identifier or with glob patterns. All values are copied in one pass over
+ * the cache and returned one per line, in the format of
+ * "LISTVAL values=true". */
+static int getval_multi (FILE *fh, char *identifier, char *buffer) /* {{{ */
+{
+  char **patterns = NULL;
+  size_t patterns_num = 0;
+  uc_iter_t *iter;
+  char *output = NULL;
+  size_t output_len = 0;
+  size_t output_size = 0;
+  size_t number = 0;
+  char *name;
+  int status = 0;
+
+  patterns = malloc (sizeof (*patterns));
+  if (patterns == NULL)
+  {
+    print_to_socket (fh, "-1 malloc failed.\n");
+    return (-1);
+  }
+  patterns[patterns_num++] = identifier;
+
+  while (*buffer != 0)
+  {
+    char **tmp;
+
+    tmp = realloc (patterns, (patterns_num + 1) * sizeof (*patterns));
+    if (tmp == NULL)
+    {
+      sfree (patterns);
+      print_to_socket (fh, "-1 realloc failed.\n");
+      return (-1);
+    }
+    patterns = tmp;
+
+    if (parse_string (&buffer, &patterns[patterns_num]) != 0)
+    {
+      sfree (patterns);
+      print_to_socket (fh, "-1 Cannot parse identifier.\n");
+      return (-1);
+    }
+    patterns_num++;
+  }
+
+  iter = uc_get_iterator_filtered ((char const * const *) patterns,
+      patterns_num, /* regex = */ NULL, UC_ITER_VALUES | UC_ITER_EXACT);
+  sfree (patterns);
+  if (iter == NULL)
+  {
+    print_to_socket (fh, "-1 uc_get_iterator failed.\n");
+    return (-1);
+  }
+
+  while ((status = uc_iterator_next (iter, &name)) == 0)
+  {
+    cdtime_t time = 0;
+    gauge_t *values = NULL;
+    size_t values_num = 0;
+
+    uc_iterator_get_time (iter, &time);
+    uc_iterator_get_values (iter, &values, &values_num);
+    if (listval_append (&output, &output_len, &output_size,
+          time, name, values, values_num) != 0)
+    {
+      status = -1;
+      break;
+    }
+    number++;
+  }
+  uc_iterator_destroy (iter);
+
+  if (status < 0)
+  {
+    sfree (output);
+    print_to_socket (fh, "-1 Reading the values failed.\n");
+    return (-1);
+  }
+
+  status = 0;
+  if ((fprintf (fh, "%i Value%s found\n",
+          (int) number, (number == 1) ? "" : "s") < 0)
+      || ((output_len > 0) && (fwrite (output, output_len, 1, fh) != 1)))
+  {
+    char errbuf[1024];
+    WARNING ("handle_getval: failed to write to socket #%i: %s",
+        fileno (fh), sstrerror (errno, errbuf, sizeof (errbuf)));
+    status = -1;
+  }
+
+  sfree (output);
+  return (status);
+} /* }}} int getval_multi */
+
 int handle_getval (FILE *fh, char *buffer)
 {
   char *command;
@@ -83,11 +179,8 @@ int handle_getval (FILE *fh, char *buffer)
   }
   assert (identifier != NULL);
 
-  if (*buffer != 0)
-  {
-    print_to_socket (fh, "-1 Garbage after end of command: %s\n", buffer);
-    return (-1);
-  }
+  if ((*buffer != 0) || (strpbrk (identifier, "*?[") != NULL))
+    return (getval_multi (fh, identifier, buffer));
 
   /* parse_identifier() modifies its first argument,
    * returning pointers into it */
@@ -145,7 +238,10 @@ int handle_getval (FILE *fh, char *buffer)
     }
     else
     {
-      print_to_socket (fh, "%12e\n", values[i]);
+      char buffer[64];
+
+      format_gauge (buffer, sizeof (buffer), "%12e", values[i]);
+      print_to_socket (fh, "%s\n", buffer);
     }
   }
 
@@ -28,13 +28,9 @@
 #include "utils_parse_option.h"
 
 #define free_everything_and_return(status) do { \
-    size_t j; \
-    for (j = 0; j < number; j++) { \
-      sfree(names[j]); \
-      names[j] = NULL; \
-    } \
-    sfree(names); \
-    sfree(times); \
+    uc_iterator_destroy (iter); \
+    sfree (output); \
+    sfree (patterns); \
     return (status); \
   } while (0)
 
@@ -46,13 +42,100 @@
     free_everything_and_return (-1); \
   }
 
+static int listval_reserve (char **output, size_t *output_len, /* {{{ */
+    size_t *output_size, size_t need)
+{
+  size_t new_size;
+  char *tmp;
+
+  if ((*output_len + need) <= *output_size)
+    return (0);
+
+  new_size = (*output_size == 0) ? 65536 : (2 * *output_size);
+  while (new_size < (*output_len + need))
+    new_size *= 2;
+
+  tmp = realloc (*output, new_size);
+  if (tmp == NULL)
+    return (ENOMEM);
+  *output = tmp;
+  *output_size = new_size;
+
+  return (0);
+} /* }}} int listval_reserve */
+
+int listval_append (char **output, size_t *output_len, /* {{{ */
+    size_t *output_size, cdtime_t time, const char *name,
+    const gauge_t *values, size_t values_num)
+{
+  const data_set_t *ds = NULL;
+  size_t i;
+  int status;
+
+  if (values_num > 0)
+  {
+    char name_copy[6 * DATA_MAX_NAME_LEN];
+    char *hostname, *plugin, *plugin_instance, *type, *type_instance;
+
+    sstrncpy (name_copy, name, sizeof (name_copy));
+    if (parse_identifier (name_copy, &hostname, &plugin, &plugin_instance,
+          &type, &type_instance) == 0)
+      ds = plugin_get_ds (type);
+    if ((ds != NULL) && ((size_t) ds->ds_num != values_num))
+      ds = NULL;
+  }
+
+  if (listval_reserve (output, output_len, output_size,
+        strlen (name) + 32 + values_num * (DATA_MAX_NAME_LEN + 32)) != 0)
+    return (ENOMEM);
+
+  status = ssnprintf (*output + *output_len, *output_size - *output_len,
+      "%.3f %s", CDTIME_T_TO_DOUBLE (time), name);
+  if ((status < 0) || ((size_t) status >= (*output_size - *output_len)))
+    return (-1);
+  *output_len += (size_t) status;
+
+  for (i = 0; i < values_num; i++)
+  {
+    char value[64];
+    char ds_name[DATA_MAX_NAME_LEN];
+
+    if (isnan (values[i]))
+      sstrncpy (value, "NaN", sizeof (value));
+    else
+      format_gauge (value, sizeof (value), "%12e", values[i]);
+
+    /* Without a matching data set, the values are numbered. */
+    if (ds != NULL)
+      sstrncpy (ds_name, ds->ds[i].name, sizeof (ds_name));
+    else
+      ssnprintf (ds_name, sizeof (ds_name), "%zu", i);
+
+    status = ssnprintf (*output + *output_len, *output_size - *output_len,
+        " %s=%s", ds_name, value);
+    if ((status < 0) || ((size_t) status >= (*output_size - *output_len)))
+      return (-1);
+    *output_len += (size_t) status;
+  }
+
+  (*output)[(*output_len)++] = '\n';
+
+  return (0);
+} /* }}} int listval_append */
+
 int handle_listval (FILE *fh, char *buffer)
 {
   char *command;
-  char **names = NULL;
-  cdtime_t *times = NULL;
+  char **patterns = NULL;
+  size_t patterns_num = 0;
+  char *regex = NULL;
+  int flags = 0;
+  uc_iter_t *iter = NULL;
+  char *output = NULL;
+  size_t output_len = 0;
+  size_t output_size = 0;
   size_t number = 0;
-  size_t i;
+  char *name;
   int status;
 
   DEBUG ("utils_cmd_listval: handle_listval (fh = %p, buffer = %s);",
@@ -73,25 +156,104 @@ int handle_listval (FILE *fh, char *buffer)
     free_everything_and_return (-1);
   }
 
-  if (*buffer != 0)
+  /* The remaining fields are patterns and the options "regex=<regex>" and
+   * "values=<bool>". */
+  while (*buffer != 0)
+  {
+    if ((strncasecmp ("regex=", buffer, strlen ("regex=")) == 0)
+        || (strncasecmp ("values=", buffer, strlen ("values=")) == 0))
+    {
+      char *key;
+      char *value;
+
+      status = parse_option (&buffer, &key, &value);
+      if (status != 0)
+      {
+        print_to_socket (fh, "-1 Cannot parse option.\n");
+        free_everything_and_return (-1);
+      }
+
+      if (strcasecmp ("regex", key) == 0)
+        regex = value;
+      else if (IS_TRUE (value))
+        flags |= UC_ITER_VALUES;
+      else
+        flags &= ~UC_ITER_VALUES;
+    }
+    else
+    {
+      char **tmp;
+
+      tmp = realloc (patterns, (patterns_num + 1) * sizeof (*patterns));
+      if (tmp == NULL)
+      {
+        print_to_socket (fh, "-1 realloc failed.\n");
+        free_everything_and_return (-1);
+      }
+      patterns = tmp;
+
+      status = parse_string (&buffer, &patterns[patterns_num]);
+      if (status != 0)
+      {
+        print_to_socket (fh, "-1 Cannot parse pattern.\n");
+        free_everything_and_return (-1);
+      }
+      patterns_num++;
+    }
+  }
+
+  iter = uc_get_iterator_filtered ((char const * const *) patterns,
+      patterns_num, regex, flags);
+  if (iter == NULL)
   {
-    print_to_socket (fh, "-1 Garbage after end of command: %s\n", buffer);
+    if (regex != NULL)
+    {
+      print_to_socket (fh, "-1 Invalid regular expression: %s\n", regex);
+    }
+    else
+    {
+      print_to_socket (fh, "-1 uc_get_iterator failed.\n");
+    }
     free_everything_and_return (-1);
   }
 
-  status = uc_get_names (&names, &times, &number);
-  if (status != 0)
+  /* The number of values has to be sent first, so the lines are collected
+   * here. The cache itself is only locked while the iterator copies a
+   * chunk. */
+  while ((status = uc_iterator_next (iter, &name)) == 0)
+  {
+    cdtime_t time = 0;
+    gauge_t *values = NULL;
+    size_t values_num = 0;
+
+    uc_iterator_get_time (iter, &time);
+    if (flags & UC_ITER_VALUES)
+      uc_iterator_get_values (iter, &values, &values_num);
+    if (listval_append (&output, &output_len, &output_size,
+          time, name, values, values_num) != 0)
+    {
+      status = -1;
+      break;
+    }
+    number++;
+  }
+
+  if (status < 0)
   {
-    DEBUG ("command listval: uc_get_names failed with status %i", status);
-    print_to_socket (fh, "-1 uc_get_names failed.\n");
+    DEBUG ("command listval: uc_iterator_next failed with status %i", status);
+    print_to_socket (fh, "-1 Listing the values failed.\n");
     free_everything_and_return (-1);
   }
 
   print_to_socket (fh, "%i Value%s found\n",
       (int) number, (number == 1) ? "" : "s");
-  for (i = 0; i < number; i++)
-    print_to_socket (fh, "%.3f %s\n", CDTIME_T_TO_DOUBLE (times[i]),
-       	names[i]);
+  if ((output_len > 0) && (fwrite (output, output_len, 1, fh) != 1))
+  {
+    char errbuf[1024];
+    WARNING ("handle_listval: failed to write to socket #%i: %s",
+	fileno (fh), sstrerror (errno, errbuf, sizeof (errbuf)));
+    free_everything_and_return (-1);
+  }
 
   free_everything_and_return (0);
 } /* int handle_listval */
@@ -24,8 +24,16 @@
 
 #include <stdio.h>
 
+#include "plugin.h"
+
 int handle_listval (FILE *fh, char *buffer);
 
+/* Appends the line "<time> <name>[ <ds>=<value>...]" to the buffer
+ * "*output", growing it as necessary. Also used by GETVAL. */
+int listval_append (char **output, size_t *output_len, size_t *output_size,
+    cdtime_t time, const char *name,
+    const gauge_t *values, size_t values_num);
+
 #endif /* UTILS_CMD_LISTVAL_H */
 
 /* vim: set sw=2 sts=2 ts=8 : */
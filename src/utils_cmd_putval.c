@@ -24,6 +24,8 @@
 #include "plugin.h"
 
 #include "utils_parse_option.h"
+#include "utils_avltree.h"
+#include "utils_cmd_putval.h"
 
 #define print_to_socket(fh, ...) \
 	if (fprintf (fh, __VA_ARGS__) < 0) { \
@@ -227,6 +229,603 @@ int handle_putval (FILE *fh, char *buffer)
 	return (0);
 } /* int handle_putval */
 
+/*
+ * PUTVALS <Host>/<Plugin>[-<PluginInstance>] [<Option>=<Value> ...]
+ *         <Type>[-<TypeInstance>]=<Value>[:<Value>...] ...
+ *
+ * Dispatches many value lists which share host and plugin. The fields are
+ * split at whitespace in place and are not unescaped, which is what makes
+ * this faster than one PUTVAL per value list.
+ */
+#define PUTVALS_BATCH_SIZE 128
+
+static const double putvals_pow10[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+	1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+/* Parses plain decimal numbers without calling strtod(3). Returns non-zero
+ * if "str" has any other format, e.g. an exponent, so parse_value() can take
+ * care of it. The gauge is exact if the digits fit into the mantissa of a
+ * double, so both conversions are divisions of exactly representable
+ * values and return the same, correctly rounded result. */
+static int putvals_parse_fast (const char *str, value_t *ret, int ds_type)
+{
+	const char *ptr = str;
+	_Bool negative = 0;
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int decimals = -1;
+
+	if ((*ptr == '-') || (*ptr == '+'))
+	{
+		negative = (*ptr == '-');
+		ptr++;
+	}
+
+	for (; *ptr != 0; ptr++)
+	{
+		if ((*ptr == '.') && (decimals < 0) && (ds_type == DS_TYPE_GAUGE))
+		{
+			decimals = 0;
+			continue;
+		}
+		if ((*ptr < '0') || (*ptr > '9'))
+			return (-1);
+		/* 18 decimal digits always fit into 63 bits. */
+		if (++digits > 18)
+			return (-1);
+		mantissa = (10 * mantissa) + (uint64_t) (*ptr - '0');
+		if (decimals >= 0)
+			decimals++;
+	}
+
+	if (digits == 0)
+		return (-1);
+
+	switch (ds_type)
+	{
+		case DS_TYPE_GAUGE:
+			if (mantissa > (((uint64_t) 1) << 53))
+				return (-1);
+			ret->gauge = (gauge_t) mantissa;
+			if (decimals > 0)
+				ret->gauge /= putvals_pow10[decimals];
+			if (negative)
+				ret->gauge = -ret->gauge;
+			break;
+
+		case DS_TYPE_DERIVE:
+			ret->derive = negative
+				? -((derive_t) mantissa) : (derive_t) mantissa;
+			break;
+
+		case DS_TYPE_COUNTER:
+		case DS_TYPE_ABSOLUTE:
+			if (negative)
+				return (-1);
+			if (ds_type == DS_TYPE_COUNTER)
+				ret->counter = (counter_t) mantissa;
+			else
+				ret->absolute = (absolute_t) mantissa;
+			break;
+
+		default:
+			return (-1);
+	}
+
+	return (0);
+} /* int putvals_parse_fast */
+
+/* Parses "<Value>[:<Value>...]" into "values". */
+static int putvals_parse_values (char *str, value_t *values,
+		const data_set_t *ds)
+{
+	int i;
+
+	for (i = 0; i < ds->ds_num; i++)
+	{
+		char *end;
+
+		end = strchr (str, ':');
+		if ((end == NULL) != (i == (ds->ds_num - 1)))
+			return (-1);
+		if (end != NULL)
+			*end = 0;
+
+		if ((strcmp ("U", str) == 0) && (ds->ds[i].type == DS_TYPE_GAUGE))
+			values[i].gauge = NAN;
+		else if ((putvals_parse_fast (str, values + i, ds->ds[i].type) != 0)
+				&& (parse_value (str, values + i, ds->ds[i].type) != 0))
+			return (-1);
+
+		if (end != NULL)
+			str = end + 1;
+	}
+
+	return (0);
+} /* int putvals_parse_values */
+
+/* Returns the next whitespace separated field of "*buffer" and terminates it
+ * in place, or NULL at the end of the buffer. */
+static char *putvals_next_field (char **buffer)
+{
+	char *field;
+	char *end;
+
+	field = *buffer + strspn (*buffer, " \t\r\n");
+	if (*field == 0)
+		return (NULL);
+
+	end = field + strcspn (field, " \t\r\n");
+	if (*end != 0)
+		*end++ = 0;
+	*buffer = end;
+
+	return (field);
+} /* char *putvals_next_field */
+
+int handle_putvals (FILE *fh, char *buffer)
+{
+	char *field;
+	char *plugin;
+	char *plugin_instance;
+	value_list_t vl = VALUE_LIST_INIT;
+
+	value_list_t *vls;
+	size_t vls_num = 0;
+	value_t *values;
+	size_t values_num = 0;
+	size_t values_size = PUTVALS_BATCH_SIZE * 4;
+
+	const data_set_t *ds = NULL;
+	_Bool options_done = 0;
+	int values_submitted = 0;
+	int errors = 0;
+
+	DEBUG ("utils_cmd_putval: handle_putvals (fh = %p, buffer = %s);",
+			(void *) fh, buffer);
+
+	field = putvals_next_field (&buffer);
+	if ((field == NULL) || (strcasecmp ("PUTVALS", field) != 0))
+	{
+		print_to_socket (fh, "-1 Unexpected command: `%s'.\n",
+				(field != NULL) ? field : "");
+		return (-1);
+	}
+
+	/* <Host>/<Plugin>[-<PluginInstance>] */
+	field = putvals_next_field (&buffer);
+	plugin = (field != NULL) ? strchr (field, '/') : NULL;
+	if ((plugin == NULL) || (plugin == field) || (plugin[1] == 0))
+	{
+		print_to_socket (fh, "-1 Cannot parse host and plugin.\n");
+		return (-1);
+	}
+	*plugin++ = 0;
+
+	plugin_instance = strchr (plugin, '-');
+	if (plugin_instance != NULL)
+		*plugin_instance++ = 0;
+
+	if ((strlen (field) >= sizeof (vl.host))
+			|| (strlen (plugin) >= sizeof (vl.plugin))
+			|| ((plugin_instance != NULL)
+				&& (strlen (plugin_instance) >= sizeof (vl.plugin_instance))))
+	{
+		print_to_socket (fh, "-1 Identifier too long.\n");
+		return (-1);
+	}
+
+	sstrncpy (vl.host, field, sizeof (vl.host));
+	sstrncpy (vl.plugin, plugin, sizeof (vl.plugin));
+	if (plugin_instance != NULL)
+		sstrncpy (vl.plugin_instance, plugin_instance,
+				sizeof (vl.plugin_instance));
+	vl.time = cdtime ();
+
+	vls = malloc (PUTVALS_BATCH_SIZE * sizeof (*vls));
+	values = malloc (values_size * sizeof (*values));
+	if ((vls == NULL) || (values == NULL))
+	{
+		sfree (vls);
+		sfree (values);
+		print_to_socket (fh, "-1 malloc failed.\n");
+		return (-1);
+	}
+
+	while ((field = putvals_next_field (&buffer)) != NULL)
+	{
+		char *type;
+		char *type_instance;
+		char *value;
+		value_list_t *this;
+
+		value = strchr (field, '=');
+		if (value == NULL)
+		{
+			errors++;
+			continue;
+		}
+		*value++ = 0;
+
+		/* Options are only recognized before the first value. */
+		if (!options_done)
+		{
+			if (strcasecmp ("time", field) == 0)
+			{
+				if (strcmp ("N", value) != 0)
+				{
+					char *endptr = NULL;
+					double tmp;
+
+					errno = 0;
+					tmp = strtod (value, &endptr);
+					if ((errno != 0) || (endptr == value) || (*endptr != 0))
+						errors++;
+					else
+						vl.time = DOUBLE_TO_CDTIME_T (tmp);
+				}
+				continue;
+			}
+			else if (set_option (&vl, field, value) == 0)
+				continue;
+			options_done = 1;
+		}
+
+		type = field;
+		type_instance = strchr (type, '-');
+		if (type_instance != NULL)
+			*type_instance++ = 0;
+
+		if ((ds == NULL) || (strcmp (ds->type, type) != 0))
+			ds = plugin_get_ds (type);
+		if ((ds == NULL)
+				|| ((type_instance != NULL)
+					&& (strlen (type_instance) >= sizeof (vl.type_instance))))
+		{
+			errors++;
+			continue;
+		}
+
+		/* Dispatch the batch once either array is full. */
+		if ((vls_num >= PUTVALS_BATCH_SIZE)
+				|| ((values_num + (size_t) ds->ds_num) > values_size))
+		{
+			if (plugin_dispatch_values_batch (vls, vls_num) != 0)
+				errors += (int) vls_num;
+			else
+				values_submitted += (int) vls_num;
+			vls_num = 0;
+			values_num = 0;
+		}
+
+		if ((size_t) ds->ds_num > values_size)
+		{
+			errors++;
+			continue;
+		}
+
+		if (putvals_parse_values (value, values + values_num, ds) != 0)
+		{
+			errors++;
+			continue;
+		}
+
+		this = vls + vls_num;
+		memcpy (this, &vl, sizeof (*this));
+		sstrncpy (this->type, type, sizeof (this->type));
+		if (type_instance != NULL)
+			sstrncpy (this->type_instance, type_instance,
+					sizeof (this->type_instance));
+		this->values = values + values_num;
+		this->values_len = ds->ds_num;
+
+		vls_num++;
+		values_num += (size_t) ds->ds_num;
+	} /* while (field) */
+
+	if (vls_num > 0)
+	{
+		if (plugin_dispatch_values_batch (vls, vls_num) != 0)
+			errors += (int) vls_num;
+		else
+			values_submitted += (int) vls_num;
+	}
+
+	sfree (vls);
+	sfree (values);
+
+	print_to_socket (fh, "0 Done: %i %s been dispatched, %i errors.\n",
+			values_submitted,
+			(values_submitted == 1) ? "value has" : "values have",
+			errors);
+
+	return (0);
+} /* int handle_putvals */
+
+/*
+ * PUTVAL batches
+ *
+ * Parsed identifiers are kept in a tree, so that programs which write the
+ * same identifiers over and over only pay for parsing them once. The value
+ * lists are dispatched with plugin_dispatch_values_batch().
+ */
+#define PUTVAL_CACHE_MAX 4096
+
+typedef struct putval_ident_s
+{
+	/* Only the identifier and the interval are set. */
+	value_list_t vl;
+	const data_set_t *ds;
+} putval_ident_t;
+
+struct putval_batch_s
+{
+	c_avl_tree_t *idents;
+
+	value_list_t vls[PUTVALS_BATCH_SIZE];
+	size_t vls_num;
+	value_t values[PUTVALS_BATCH_SIZE * 4];
+	size_t values_num;
+};
+
+static int putval_ident_create (FILE *fh, const char *identifier,
+		putval_ident_t **ret)
+{
+	putval_ident_t *ident;
+	char buffer[6 * DATA_MAX_NAME_LEN];
+	char *hostname;
+	char *plugin;
+	char *plugin_instance;
+	char *type;
+	char *type_instance;
+	const data_set_t *ds;
+
+	if (strlen (identifier) >= sizeof (buffer))
+	{
+		print_to_socket (fh, "-1 Identifier too long.\n");
+		return (-1);
+	}
+	sstrncpy (buffer, identifier, sizeof (buffer));
+
+	if (parse_identifier (buffer, &hostname, &plugin, &plugin_instance,
+				&type, &type_instance) != 0)
+	{
+		print_to_socket (fh, "-1 Cannot parse identifier `%s'.\n",
+				identifier);
+		return (-1);
+	}
+
+	ds = plugin_get_ds (type);
+	if (ds == NULL)
+	{
+		print_to_socket (fh, "-1 Type `%s' isn't defined.\n", type);
+		return (-1);
+	}
+
+	ident = calloc (1, sizeof (*ident));
+	if (ident == NULL)
+	{
+		print_to_socket (fh, "-1 malloc failed.\n");
+		return (-1);
+	}
+
+	/* The identifier is shorter than the buffer, but each part must fit
+	 * into its field, too. */
+	if ((strlen (hostname) >= sizeof (ident->vl.host))
+			|| (strlen (plugin) >= sizeof (ident->vl.plugin))
+			|| ((plugin_instance != NULL)
+				&& (strlen (plugin_instance) >= sizeof (ident->vl.plugin_instance)))
+			|| ((type_instance != NULL)
+				&& (strlen (type_instance) >= sizeof (ident->vl.type_instance))))
+	{
+		sfree (ident);
+		print_to_socket (fh, "-1 Identifier too long.\n");
+		return (-1);
+	}
+
+	sstrncpy (ident->vl.host, hostname, sizeof (ident->vl.host));
+	sstrncpy (ident->vl.plugin, plugin, sizeof (ident->vl.plugin));
+	sstrncpy (ident->vl.type, type, sizeof (ident->vl.type));
+	if (plugin_instance != NULL)
+		sstrncpy (ident->vl.plugin_instance, plugin_instance,
+				sizeof (ident->vl.plugin_instance));
+	if (type_instance != NULL)
+		sstrncpy (ident->vl.type_instance, type_instance,
+				sizeof (ident->vl.type_instance));
+	ident->ds = ds;
+
+	*ret = ident;
+	return (0);
+} /* int putval_ident_create */
+
+/* Parses "<Time>:<Value>[:<Value>...]" and appends the value list to the
+ * batch. */
+static int putval_batch_append (putval_batch_t *b, const value_list_t *vl,
+		const data_set_t *ds, char *str)
+{
+	value_list_t *this;
+	char *values;
+	cdtime_t t;
+
+	if ((size_t) ds->ds_num > STATIC_ARRAY_SIZE (b->values))
+		return (-1);
+
+	if ((b->vls_num >= STATIC_ARRAY_SIZE (b->vls))
+			|| ((b->values_num + (size_t) ds->ds_num)
+				> STATIC_ARRAY_SIZE (b->values)))
+		putval_batch_flush (b);
+
+	values = strchr (str, ':');
+	if (values == NULL)
+		return (-1);
+	*values++ = 0;
+
+	if (strcmp ("N", str) == 0)
+		t = cdtime ();
+	else
+	{
+		char *endptr = NULL;
+		double tmp;
+
+		errno = 0;
+		tmp = strtod (str, &endptr);
+		if ((errno != 0) || (endptr == str) || (*endptr != 0))
+			return (-1);
+		t = DOUBLE_TO_CDTIME_T (tmp);
+	}
+
+	if (putvals_parse_values (values, b->values + b->values_num, ds) != 0)
+		return (-1);
+
+	this = b->vls + b->vls_num;
+	memcpy (this, vl, sizeof (*this));
+	this->time = t;
+	this->values = b->values + b->values_num;
+	this->values_len = ds->ds_num;
+
+	b->vls_num++;
+	b->values_num += (size_t) ds->ds_num;
+	return (0);
+} /* int putval_batch_append */
+
+putval_batch_t *putval_batch_create (void)
+{
+	putval_batch_t *b;
+
+	b = calloc (1, sizeof (*b));
+	if (b == NULL)
+		return (NULL);
+
+	b->idents = c_avl_create ((int (*) (const void *, const void *)) strcmp);
+	if (b->idents == NULL)
+	{
+		sfree (b);
+		return (NULL);
+	}
+
+	return (b);
+} /* putval_batch_t *putval_batch_create */
+
+void putval_batch_destroy (putval_batch_t *b)
+{
+	void *key;
+	void *value;
+
+	if (b == NULL)
+		return;
+
+	putval_batch_flush (b);
+
+	while (c_avl_pick (b->idents, &key, &value) == 0)
+	{
+		sfree (key);
+		sfree (value);
+	}
+	c_avl_destroy (b->idents);
+
+	sfree (b);
+} /* void putval_batch_destroy */
+
+int putval_batch_add (putval_batch_t *b, FILE *fh, char *buffer)
+{
+	char *command = NULL;
+	char *identifier = NULL;
+	putval_ident_t *ident = NULL;
+	_Bool cached = 1;
+	const char *error = NULL;
+	value_list_t vl;
+	int status;
+
+	status = parse_string (&buffer, &command);
+	if ((status != 0) || (strcasecmp ("PUTVAL", command) != 0))
+	{
+		print_to_socket (fh, "-1 Unexpected command: `%s'.\n",
+				(status == 0) ? command : "");
+		return (-1);
+	}
+
+	status = parse_string (&buffer, &identifier);
+	if (status != 0)
+	{
+		print_to_socket (fh, "-1 Cannot parse identifier.\n");
+		return (-1);
+	}
+
+	if (c_avl_get (b->idents, identifier, (void *) &ident) != 0)
+	{
+		char *key;
+
+		if (putval_ident_create (fh, identifier, &ident) != 0)
+			return (-1);
+
+		key = NULL;
+		if (c_avl_size (b->idents) < PUTVAL_CACHE_MAX)
+			key = strdup (identifier);
+		if ((key == NULL) || (c_avl_insert (b->idents, key, ident) != 0))
+		{
+			sfree (key);
+			cached = 0;
+		}
+	}
+
+	memcpy (&vl, &ident->vl, sizeof (vl));
+	while (*buffer != 0)
+	{
+		char *string = NULL;
+		char *value = NULL;
+
+		status = parse_option (&buffer, &string, &value);
+		if (status < 0)
+		{
+			error = "Misformatted option.";
+			break;
+		}
+		else if (status == 0)
+		{
+			set_option (&vl, string, value);
+			continue;
+		}
+
+		if (parse_string (&buffer, &string) != 0)
+		{
+			error = "Misformatted value.";
+			break;
+		}
+
+		if (putval_batch_append (b, &vl, ident->ds, string) != 0)
+		{
+			error = "Parsing the values string failed.";
+			break;
+		}
+	}
+
+	if (!cached)
+		sfree (ident);
+
+	if (error != NULL)
+	{
+		print_to_socket (fh, "-1 %s\n", error);
+		return (-1);
+	}
+
+	return (0);
+} /* int putval_batch_add */
+
+int putval_batch_flush (putval_batch_t *b)
+{
+	int status = 0;
+
+	if (b->vls_num > 0)
+		status = plugin_dispatch_values_batch (b->vls, b->vls_num);
+
+	b->vls_num = 0;
+	b->values_num = 0;
+	return (status);
+} /* int putval_batch_flush */
+
 int create_putval (char *ret, size_t ret_len, /* {{{ */
 	const data_set_t *ds, const value_list_t *vl)
 {
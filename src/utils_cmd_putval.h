@@ -27,6 +27,26 @@
 #include "plugin.h"
 
 int handle_putval (FILE *fh, char *buffer);
+/* Dispatches many value lists sharing host and plugin, see
+ * collectd-unixsock(5). */
+int handle_putvals (FILE *fh, char *buffer);
+
+/*
+ * A batch collects the value lists of many PUTVAL commands and dispatches
+ * them together. The parsed identifiers are kept for as long as the batch
+ * exists, so it should be reused for all commands from the same source.
+ * Unlike handle_putval(), only errors are printed to `fh'.
+ */
+struct putval_batch_s;
+typedef struct putval_batch_s putval_batch_t;
+
+putval_batch_t *putval_batch_create (void);
+/* Dispatches the remaining value lists and frees the batch. */
+void putval_batch_destroy (putval_batch_t *b);
+/* Handles one PUTVAL command. The value lists may not be dispatched until
+ * the next call to putval_batch_flush(). */
+int putval_batch_add (putval_batch_t *b, FILE *fh, char *buffer);
+int putval_batch_flush (putval_batch_t *b);
 
 int create_putval (char *ret, size_t ret_len,
 		const data_set_t *ds, const value_list_t *vl);
@@ -77,6 +77,31 @@ void c_complain_once (int level, c_complain_t *c, const char *format, ...)
 	va_end (ap);
 } /* c_complain_once */
 
+_Bool c_ratelimit (c_ratelimit_t *r, unsigned int burst, cdtime_t interval,
+		uint64_t *suppressed)
+{
+	cdtime_t now = cdtime ();
+
+	*suppressed = 0;
+
+	if ((r->window_start + interval) <= now)
+	{
+		*suppressed = r->suppressed;
+		r->window_start = now;
+		r->count = 0;
+		r->suppressed = 0;
+	}
+
+	if (r->count >= burst)
+	{
+		r->suppressed++;
+		return (0);
+	}
+
+	r->count++;
+	return (1);
+} /* c_ratelimit */
+
 void c_do_release (int level, c_complain_t *c, const char *format, ...)
 {
 	char message[512];
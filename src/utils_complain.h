@@ -103,6 +103,49 @@ void c_do_release (int level, c_complain_t *c, const char *format, ...);
 			c_do_release(level, c, __VA_ARGS__); \
 	} while (0)
 
+typedef struct
+{
+	/* start of the current window */
+	cdtime_t window_start;
+
+	/* number of messages in the current window */
+	unsigned int count;
+
+	/* number of messages suppressed in the current window */
+	uint64_t suppressed;
+} c_ratelimit_t;
+
+#define C_RATELIMIT_INIT_STATIC { 0, 0, 0 }
+#define C_RATELIMIT_INIT(r) do { \
+	(r)->window_start = 0; \
+	(r)->count = 0; \
+	(r)->suppressed = 0; \
+} while (0)
+
+/*
+ * NAME
+ *   c_ratelimit
+ *
+ * DESCRIPTION
+ *   Decides whether a message may be reported: at most `burst' messages are
+ *   allowed per `interval'. Unlike the functions above, this function does
+ *   not report anything itself and does not lock; the caller has to
+ *   serialize calls with the same `r'.
+ *
+ * PARAMETERS
+ *   `r'          Identifier of the message source.
+ *   `burst'      Maximum number of messages per interval.
+ *   `interval'   Length of the interval.
+ *   `suppressed' If a new interval starts and messages have been suppressed
+ *                in the previous one, their number is stored here. Zero is
+ *                stored otherwise.
+ *
+ * RETURN VALUE
+ *   True if the message may be reported, false if it has to be suppressed.
+ */
+_Bool c_ratelimit (c_ratelimit_t *r, unsigned int burst, cdtime_t interval,
+		uint64_t *suppressed);
+
 #endif /* UTILS_COMPLAIN_H */
 
 /* vim: set sw=4 ts=4 tw=78 noexpandtab : */
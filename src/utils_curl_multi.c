@@ -0,0 +1,530 @@
+/**
+ * collectd - src/utils_curl_multi.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_avltree.h"
+#include "utils_curl_multi.h"
+
+#include <pthread.h>
+
+/* How long a fetch thread sleeps in curl_multi_wait(3) at most. New
+ * transfers wake it up earlier via its pipe. */
+#define UCM_WAIT_MS 1000
+
+struct ucm_request_s;
+typedef struct ucm_request_s ucm_request_t;
+struct ucm_request_s
+{
+  CURL *curl;
+  ucm_callback_t callback;
+  void *user_data;
+  ucm_request_t *next;
+};
+
+struct ucm_thread_s
+{
+  pthread_t thread;
+  _Bool thread_running;
+  int pipe_fd[2];
+
+  /* Protected by `lock': the queue of transfers not yet handed to `multi'
+   * and the tree of all submitted handles, used to find the request of a
+   * finished handle and to reject handles which are still in progress. */
+  pthread_mutex_t lock;
+  ucm_request_t *queue_head;
+  ucm_request_t *queue_tail;
+  c_avl_tree_t *requests;
+  _Bool shutdown;
+
+  /* Only used by the thread. */
+  CURLM *multi;
+  int active;
+};
+typedef struct ucm_thread_s ucm_thread_t;
+
+/*
+ * Private variables
+ */
+static int ucm_threads_num = 1;
+static long ucm_max_connections = 0;
+static long ucm_max_host_connections = 0;
+static cdtime_t ucm_timeout = 0;
+
+static pthread_mutex_t ucm_lock = PTHREAD_MUTEX_INITIALIZER;
+static ucm_thread_t *ucm_threads = NULL;
+static _Bool ucm_stopped = 0;
+
+/*
+ * Private functions
+ */
+static int ucm_compare_ptr (const void *a, const void *b) /* {{{ */
+{
+  if (a == b)
+    return (0);
+  return ((a < b) ? -1 : 1);
+} /* }}} int ucm_compare_ptr */
+
+/* Hashes the host part of `url', so that all transfers to one host end up
+ * in the same thread. */
+static int ucm_thread_index (const char *url) /* {{{ */
+{
+  const char *ptr;
+  uint32_t hash = 2166136261U;
+
+  if (ucm_threads_num <= 1)
+    return (0);
+
+  ptr = strstr (url, "://");
+  ptr = (ptr != NULL) ? (ptr + 3) : url;
+
+  for (; (*ptr != 0) && (*ptr != '/') && (*ptr != '?'); ptr++)
+  {
+    hash ^= (uint32_t) tolower ((unsigned char) *ptr);
+    hash *= 16777619U;
+  }
+
+  return ((int) (hash % (uint32_t) ucm_threads_num));
+} /* }}} int ucm_thread_index */
+
+/* Removes the request of `curl' from the thread's tree and returns it. */
+static ucm_request_t *ucm_request_take (ucm_thread_t *t, /* {{{ */
+    CURL *curl)
+{
+  ucm_request_t *r = NULL;
+  void *key;
+
+  pthread_mutex_lock (&t->lock);
+  if (c_avl_remove (t->requests, curl, &key, (void *) &r) != 0)
+    r = NULL;
+  pthread_mutex_unlock (&t->lock);
+
+  return (r);
+} /* }}} ucm_request_t *ucm_request_take */
+
+static void ucm_request_finish (ucm_thread_t *t, /* {{{ */
+    CURL *curl, CURLcode status)
+{
+  ucm_request_t *r;
+
+  r = ucm_request_take (t, curl);
+  if (r == NULL)
+    return;
+
+  r->callback (r->curl, status, r->user_data);
+  sfree (r);
+} /* }}} void ucm_request_finish */
+
+/* Hands queued requests to the multi handle, as far as the limit allows. */
+static void ucm_thread_start_requests (ucm_thread_t *t, /* {{{ */
+    long limit)
+{
+  ucm_request_t *start = NULL;
+
+  pthread_mutex_lock (&t->lock);
+  while ((t->queue_head != NULL) && ((limit <= 0) || (t->active < limit)))
+  {
+    ucm_request_t *r = t->queue_head;
+
+    t->queue_head = r->next;
+    r->next = start;
+    start = r;
+    t->active++;
+  }
+  if (t->queue_head == NULL)
+    t->queue_tail = NULL;
+  pthread_mutex_unlock (&t->lock);
+
+  while (start != NULL)
+  {
+    ucm_request_t *r = start;
+    CURLMcode status;
+
+    start = r->next;
+    r->next = NULL;
+
+    status = curl_multi_add_handle (t->multi, r->curl);
+    if (status != CURLM_OK)
+    {
+      ERROR ("utils_curl_multi: curl_multi_add_handle failed "
+          "with status %i.", (int) status);
+      t->active--;
+      ucm_request_finish (t, r->curl, CURLE_FAILED_INIT);
+    }
+  }
+} /* }}} void ucm_thread_start_requests */
+
+static void ucm_thread_finish_requests (ucm_thread_t *t) /* {{{ */
+{
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ((msg = curl_multi_info_read (t->multi, &msgs_left)) != NULL)
+  {
+    CURL *curl;
+    CURLcode result;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    /* "msg" is invalid once the handle has been removed. */
+    curl = msg->easy_handle;
+    result = msg->data.result;
+
+    curl_multi_remove_handle (t->multi, curl);
+    t->active--;
+
+    ucm_request_finish (t, curl, result);
+  }
+} /* }}} void ucm_thread_finish_requests */
+
+static void *ucm_thread_main (void *arg) /* {{{ */
+{
+  ucm_thread_t *t = arg;
+  long limit = 0;
+
+  if (ucm_max_connections > 0)
+    limit = (ucm_max_connections + ucm_threads_num - 1) / ucm_threads_num;
+
+  while (42)
+  {
+    struct curl_waitfd waitfd;
+    int running = 0;
+    char buffer[64];
+    _Bool shutdown;
+
+    pthread_mutex_lock (&t->lock);
+    shutdown = t->shutdown;
+    pthread_mutex_unlock (&t->lock);
+    if (shutdown)
+      break;
+
+    ucm_thread_start_requests (t, limit);
+
+    curl_multi_perform (t->multi, &running);
+    ucm_thread_finish_requests (t);
+
+    memset (&waitfd, 0, sizeof (waitfd));
+    waitfd.fd = t->pipe_fd[0];
+    waitfd.events = CURL_WAIT_POLLIN;
+
+    curl_multi_wait (t->multi, &waitfd, 1, UCM_WAIT_MS, /* numfds = */ NULL);
+    if (waitfd.revents != 0)
+      while (read (t->pipe_fd[0], buffer, sizeof (buffer)) > 0)
+        /* drain */;
+  }
+
+  /* Abort what is left. The tree holds the running as well as the queued
+   * requests. */
+  pthread_mutex_lock (&t->lock);
+  t->queue_head = NULL;
+  t->queue_tail = NULL;
+  pthread_mutex_unlock (&t->lock);
+
+  while (42)
+  {
+    ucm_request_t *r = NULL;
+    c_avl_iterator_t *iter;
+    void *key;
+
+    pthread_mutex_lock (&t->lock);
+    iter = c_avl_get_iterator (t->requests);
+    if (c_avl_iterator_next (iter, &key, (void *) &r) != 0)
+      r = NULL;
+    c_avl_iterator_destroy (iter);
+    pthread_mutex_unlock (&t->lock);
+
+    if (r == NULL)
+      break;
+
+    /* Fails harmlessly for queued handles. */
+    curl_multi_remove_handle (t->multi, r->curl);
+    ucm_request_finish (t, r->curl, CURLE_ABORTED_BY_CALLBACK);
+  }
+
+  return ((void *) 0);
+} /* }}} void *ucm_thread_main */
+
+/* Tells the thread to exit. Submissions to the thread fail from now on. */
+static void ucm_thread_stop (ucm_thread_t *t) /* {{{ */
+{
+  pthread_mutex_lock (&t->lock);
+  t->shutdown = 1;
+  pthread_mutex_unlock (&t->lock);
+
+  if ((t->pipe_fd[1] >= 0)
+      && (write (t->pipe_fd[1], "", 1) < 0))
+    /* the thread will notice within UCM_WAIT_MS */;
+} /* }}} void ucm_thread_stop */
+
+/* Joins the thread and frees its resources. All threads must have been
+ * stopped, since callbacks may still submit to any of them. */
+static void ucm_thread_destroy (ucm_thread_t *t) /* {{{ */
+{
+  if (t->thread_running)
+  {
+    pthread_join (t->thread, /* retval = */ NULL);
+    t->thread_running = 0;
+  }
+
+  if (t->multi != NULL)
+    curl_multi_cleanup (t->multi);
+  t->multi = NULL;
+
+  if (t->requests != NULL)
+    c_avl_destroy (t->requests);
+  t->requests = NULL;
+
+  if (t->pipe_fd[0] >= 0)
+    close (t->pipe_fd[0]);
+  if (t->pipe_fd[1] >= 0)
+    close (t->pipe_fd[1]);
+  t->pipe_fd[0] = t->pipe_fd[1] = -1;
+
+  pthread_mutex_destroy (&t->lock);
+} /* }}} void ucm_thread_destroy */
+
+static int ucm_thread_init (ucm_thread_t *t) /* {{{ */
+{
+  int status;
+
+  memset (t, 0, sizeof (*t));
+  pthread_mutex_init (&t->lock, /* attr = */ NULL);
+  t->pipe_fd[0] = t->pipe_fd[1] = -1;
+
+  t->requests = c_avl_create (ucm_compare_ptr);
+  t->multi = curl_multi_init ();
+  if ((t->requests == NULL) || (t->multi == NULL))
+  {
+    ERROR ("utils_curl_multi: Initializing a fetch thread failed.");
+    return (-1);
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x071e00
+  if (ucm_max_host_connections > 0)
+    curl_multi_setopt (t->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+        ucm_max_host_connections);
+#endif
+
+  if (pipe (t->pipe_fd) != 0)
+  {
+    char errbuf[1024];
+    ERROR ("utils_curl_multi: pipe(2) failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+  fcntl (t->pipe_fd[0], F_SETFL, fcntl (t->pipe_fd[0], F_GETFL) | O_NONBLOCK);
+  fcntl (t->pipe_fd[1], F_SETFL, fcntl (t->pipe_fd[1], F_GETFL) | O_NONBLOCK);
+
+  status = plugin_thread_create (&t->thread, /* attr = */ NULL,
+      ucm_thread_main, t);
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("utils_curl_multi: pthread_create failed: %s",
+        sstrerror (status, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+  t->thread_running = 1;
+
+  return (0);
+} /* }}} int ucm_thread_init */
+
+/* Starts the fetch threads. Call with "ucm_lock" held. */
+static int ucm_start (void) /* {{{ */
+{
+  int i;
+
+  if (ucm_threads != NULL)
+    return (0);
+
+  ucm_threads = calloc ((size_t) ucm_threads_num, sizeof (*ucm_threads));
+  if (ucm_threads == NULL)
+  {
+    ERROR ("utils_curl_multi: calloc failed.");
+    return (-1);
+  }
+
+  for (i = 0; i < ucm_threads_num; i++)
+  {
+    if (ucm_thread_init (ucm_threads + i) != 0)
+    {
+      int j;
+
+      for (j = 0; j <= i; j++)
+        ucm_thread_stop (ucm_threads + j);
+      for (j = 0; j <= i; j++)
+        ucm_thread_destroy (ucm_threads + j);
+      sfree (ucm_threads);
+      return (-1);
+    }
+  }
+
+#if LIBCURL_VERSION_NUM < 0x071e00
+  if (ucm_max_host_connections > 0)
+    WARNING ("utils_curl_multi: MaxConnectionsPerHost requires libcurl "
+        "7.30.0 or later and is ignored.");
+#endif
+
+  return (0);
+} /* }}} int ucm_start */
+
+/*
+ * Public functions
+ */
+int ucm_config (oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
+
+  if (strcasecmp ("FetchThreads", ci->key) == 0)
+  {
+    tmp = ucm_threads_num;
+    if (cf_util_get_int (ci, &tmp) != 0)
+      return (-1);
+    if (tmp < 1)
+    {
+      WARNING ("%s: `FetchThreads' must be at least 1.", ci->key);
+      return (-1);
+    }
+    ucm_threads_num = tmp;
+    return (0);
+  }
+  else if ((strcasecmp ("MaxConnections", ci->key) == 0)
+      || (strcasecmp ("MaxConnectionsPerHost", ci->key) == 0))
+  {
+    tmp = 0;
+    if (cf_util_get_int (ci, &tmp) != 0)
+      return (-1);
+    if (tmp < 0)
+    {
+      WARNING ("`%s' must not be negative.", ci->key);
+      return (-1);
+    }
+    if (strcasecmp ("MaxConnections", ci->key) == 0)
+      ucm_max_connections = (long) tmp;
+    else
+      ucm_max_host_connections = (long) tmp;
+    return (0);
+  }
+  else if (strcasecmp ("Timeout", ci->key) == 0)
+    return (cf_util_get_cdtime (ci, &ucm_timeout));
+
+  return (1);
+} /* }}} int ucm_config */
+
+int ucm_submit (CURL *curl, const char *url, /* {{{ */
+    ucm_callback_t callback, void *user_data)
+{
+  ucm_thread_t *threads;
+  ucm_thread_t *t;
+  ucm_request_t *r;
+  cdtime_t timeout;
+  int status;
+
+  if ((curl == NULL) || (url == NULL) || (callback == NULL))
+    return (EINVAL);
+
+  pthread_mutex_lock (&ucm_lock);
+  if (ucm_stopped)
+  {
+    pthread_mutex_unlock (&ucm_lock);
+    return (ESHUTDOWN);
+  }
+  status = ucm_start ();
+  threads = ucm_threads;
+  pthread_mutex_unlock (&ucm_lock);
+  if (status != 0)
+    return (-1);
+
+  r = calloc (1, sizeof (*r));
+  if (r == NULL)
+    return (ENOMEM);
+  r->curl = curl;
+  r->callback = callback;
+  r->user_data = user_data;
+  r->next = NULL;
+
+  timeout = (ucm_timeout > 0) ? ucm_timeout : plugin_get_interval ();
+#if LIBCURL_VERSION_NUM >= 0x071002
+  curl_easy_setopt (curl, CURLOPT_TIMEOUT_MS,
+      (long) CDTIME_T_TO_MS (timeout));
+#else
+  curl_easy_setopt (curl, CURLOPT_TIMEOUT,
+      (long) CDTIME_T_TO_TIME_T (timeout));
+#endif
+
+  t = threads + ucm_thread_index (url);
+
+  /* "threads" stays valid while callbacks may run: ucm_shutdown stops all
+   * threads before it frees any of them. */
+  pthread_mutex_lock (&t->lock);
+  if (t->shutdown)
+  {
+    pthread_mutex_unlock (&t->lock);
+    sfree (r);
+    return (ESHUTDOWN);
+  }
+
+  status = c_avl_insert (t->requests, curl, r);
+  if (status != 0)
+  {
+    pthread_mutex_unlock (&t->lock);
+    sfree (r);
+    return ((status > 0) ? EBUSY : -1);
+  }
+
+  if (t->queue_tail == NULL)
+    t->queue_head = r;
+  else
+    t->queue_tail->next = r;
+  t->queue_tail = r;
+  pthread_mutex_unlock (&t->lock);
+
+  if (write (t->pipe_fd[1], "", 1) < 0)
+    /* the pipe is full, so the thread is going to wake up anyway */;
+
+  return (0);
+} /* }}} int ucm_submit */
+
+void ucm_shutdown (void) /* {{{ */
+{
+  ucm_thread_t *threads;
+  int i;
+
+  pthread_mutex_lock (&ucm_lock);
+  ucm_stopped = 1;
+  threads = ucm_threads;
+  ucm_threads = NULL;
+  pthread_mutex_unlock (&ucm_lock);
+
+  if (threads == NULL)
+    return;
+
+  /* Callbacks of aborted transfers may still submit to any thread. */
+  for (i = 0; i < ucm_threads_num; i++)
+    ucm_thread_stop (threads + i);
+  for (i = 0; i < ucm_threads_num; i++)
+    ucm_thread_destroy (threads + i);
+  sfree (threads);
+} /* }}} void ucm_shutdown */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,94 @@
+/**
+ * collectd - src/utils_curl_multi.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_CURL_MULTI_H
+#define UTILS_CURL_MULTI_H 1
+
+#include "configfile.h"
+
+#include <curl/curl.h>
+
+/*
+ * A fetch service for the HTTP based plugins. Transfers are driven by a few
+ * threads, each running a curl "multi" handle, so that a read callback only
+ * has to start a transfer instead of waiting for it. All transfers to one
+ * host are handled by the same thread, which lets libcurl reuse its
+ * connections and enforce the per-host limit.
+ *
+ * Each plugin linking this file has a service of its own. All functions are
+ * thread-safe.
+ */
+
+/*
+ * Called by a fetch thread when the transfer of `curl' has finished. `status'
+ * is the result of the transfer, CURLE_ABORTED_BY_CALLBACK if it was
+ * aborted by `ucm_shutdown'. The handle may be submitted again from within
+ * the callback.
+ */
+typedef void (*ucm_callback_t) (CURL *curl, CURLcode status,
+    void *user_data);
+
+/*
+ * NAME
+ *   ucm_config
+ *
+ * DESCRIPTION
+ *   Handles the options of the fetch service, which plugins accept in their
+ *   top-level configuration: `FetchThreads', `MaxConnections',
+ *   `MaxConnectionsPerHost' and `Timeout'.
+ *
+ * RETURN VALUE
+ *   Zero if the option was handled, less than zero if its value was invalid
+ *   and greater than zero if `ci' is not an option of the fetch service.
+ */
+int ucm_config (oconfig_item_t *ci);
+
+/*
+ * NAME
+ *   ucm_submit
+ *
+ * DESCRIPTION
+ *   Queues the transfer of `curl', which has been set up to fetch `url'. The
+ *   fetch threads are started on first use. Unless configured otherwise, the
+ *   transfer times out after the interval of the calling read callback.
+ *   `callback' is called with `user_data' once the transfer has finished.
+ *   Until then, the handle must not be touched.
+ *
+ * RETURN VALUE
+ *   Zero upon success, EBUSY if a transfer of `curl' is still in progress
+ *   and another non-zero value upon failure. The callback is only called if
+ *   zero is returned.
+ */
+int ucm_submit (CURL *curl, const char *url,
+    ucm_callback_t callback, void *user_data);
+
+/*
+ * NAME
+ *   ucm_shutdown
+ *
+ * DESCRIPTION
+ *   Aborts all transfers and stops the fetch threads. Must be called before
+ *   any submitted handle or its user data is freed. Further submissions
+ *   fail. Calling this function more than once is safe.
+ */
+void ucm_shutdown (void);
+
+#endif /* UTILS_CURL_MULTI_H */
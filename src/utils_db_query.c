@@ -25,6 +25,9 @@
 #include "configfile.h"
 #include "utils_db_query.h"
 
+/* Number of value lists dispatched at once. */
+#define UDB_BATCH_SIZE 64
+
 /*
  * Data types
  */
@@ -62,6 +65,11 @@ struct udb_result_preparation_area_s /* {{{ */
   char  **instances_buffer;
   char  **values_buffer;
 
+  /* The type instance without the instances, i.e. the prefix followed by a
+   * dash if there are instances. */
+  char    type_instance[DATA_MAX_NAME_LEN];
+  size_t  type_instance_prefix_len;
+
   struct udb_result_preparation_area_s *next;
 }; /* }}} */
 typedef struct udb_result_preparation_area_s udb_result_preparation_area_t;
@@ -75,6 +83,21 @@ struct udb_query_preparation_area_s /* {{{ */
 
   cdtime_t interval;
 
+  /* The column names the result preparation areas have been set up for.
+   * As long as a query returns the same columns, the positions are kept
+   * across executions. */
+  char  **plan_columns;
+  size_t  plan_columns_num;
+  _Bool   plan_valid;
+
+  /* Value lists waiting to be dispatched. */
+  value_list_t          vl;
+  plugin_value_entry_t *batch;
+  char                (*batch_type_instances)[DATA_MAX_NAME_LEN];
+  value_t              *batch_values;
+  size_t                batch_values_max;
+  size_t                batch_num;
+
   udb_result_preparation_area_t *result_prep_areas;
 }; /* }}} */
 
@@ -182,30 +205,39 @@ static int udb_config_set_uint (unsigned int *ret_value, /* {{{ */
 /*
  * Result private functions
  */
+static void udb_query_flush_batch (udb_query_preparation_area_t *q_area) /* {{{ */
+{
+  if (q_area->batch_num == 0)
+    return;
+
+  plugin_dispatch_values_multi (&q_area->vl, q_area->batch, q_area->batch_num);
+  q_area->batch_num = 0;
+} /* }}} void udb_query_flush_batch */
+
 static int udb_result_submit (udb_result_t *r, /* {{{ */
     udb_result_preparation_area_t *r_area,
     udb_query_t const *q, udb_query_preparation_area_t *q_area)
 {
-  value_list_t vl = VALUE_LIST_INIT;
+  plugin_value_entry_t *entry;
+  value_t *values;
   size_t i;
 
   assert (r != NULL);
   assert (r_area->ds != NULL);
   assert (((size_t) r_area->ds->ds_num) == r->values_num);
+  assert (r->values_num <= q_area->batch_values_max);
 
-  vl.values = (value_t *) calloc (r_area->ds->ds_num, sizeof (value_t));
-  if (vl.values == NULL)
-  {
-    ERROR ("db query utils: malloc failed.");
-    return (-1);
-  }
-  vl.values_len = r_area->ds->ds_num;
+  if (q_area->batch_num >= UDB_BATCH_SIZE)
+    udb_query_flush_batch (q_area);
+
+  entry = q_area->batch + q_area->batch_num;
+  values = q_area->batch_values + (q_area->batch_num * q_area->batch_values_max);
 
   for (i = 0; i < r->values_num; i++)
   {
     char *value_str = r_area->values_buffer[i];
 
-    if (0 != parse_value (value_str, &vl.values[i], r_area->ds->ds[i].type))
+    if (0 != parse_value (value_str, &values[i], r_area->ds->ds[i].type))
     {
       ERROR ("db query utils: udb_result_submit: Parsing `%s' as %s failed.",
           value_str, DS_TYPE_TO_STRING (r_area->ds->ds[i].type));
@@ -214,48 +246,31 @@ static int udb_result_submit (udb_result_t *r, /* {{{ */
     }
   }
 
-  if (q_area->interval > 0)
-    vl.interval = q_area->interval;
+  entry->type = r->type;
+  entry->values = values;
+  entry->values_len = (int) r->values_num;
 
-  sstrncpy (vl.host, q_area->host, sizeof (vl.host));
-  sstrncpy (vl.plugin, q_area->plugin, sizeof (vl.plugin));
-  sstrncpy (vl.plugin_instance, q_area->db_name, sizeof (vl.plugin_instance));
-  sstrncpy (vl.type, r->type, sizeof (vl.type));
-
-  /* Set vl.type_instance {{{ */
+  /* Set the type instance {{{ */
   if (r->instances_num <= 0)
   {
-    if (r->instance_prefix == NULL)
-      vl.type_instance[0] = 0;
-    else
-      sstrncpy (vl.type_instance, r->instance_prefix,
-          sizeof (vl.type_instance));
+    /* Doesn't change until the plan is rebuilt, which flushes the batch. */
+    entry->type_instance = r_area->type_instance;
   }
   else /* if ((r->instances_num > 0) */
   {
-    if (r->instance_prefix == NULL)
-    {
-      strjoin (vl.type_instance, sizeof (vl.type_instance),
-          r_area->instances_buffer, r->instances_num, "-");
-    }
-    else
-    {
-      char tmp[DATA_MAX_NAME_LEN];
+    char *type_instance = q_area->batch_type_instances[q_area->batch_num];
+    size_t prefix_len = r_area->type_instance_prefix_len;
 
-      strjoin (tmp, sizeof (tmp), r_area->instances_buffer,
-          r->instances_num, "-");
-      tmp[sizeof (tmp) - 1] = 0;
+    memcpy (type_instance, r_area->type_instance, prefix_len);
+    strjoin (type_instance + prefix_len, DATA_MAX_NAME_LEN - prefix_len,
+        r_area->instances_buffer, r->instances_num, "-");
+    type_instance[DATA_MAX_NAME_LEN - 1] = 0;
 
-      snprintf (vl.type_instance, sizeof (vl.type_instance), "%s-%s",
-          r->instance_prefix, tmp);
-    }
+    entry->type_instance = type_instance;
   }
-  vl.type_instance[sizeof (vl.type_instance) - 1] = 0;
   /* }}} */
 
-  plugin_dispatch_values (&vl);
-
-  sfree (vl.values);
+  q_area->batch_num++;
   return (0);
 } /* }}} void udb_result_submit */
 
@@ -417,6 +432,18 @@ static int udb_result_prepare_result (udb_result_t const *r, /* {{{ */
     }
   } /* }}} for (i = 0; i < r->values_num; i++) */
 
+  /* Prepare the type instance {{{ */
+  if (r->instance_prefix == NULL)
+    prep_area->type_instance[0] = 0;
+  else if (r->instances_num <= 0)
+    sstrncpy (prep_area->type_instance, r->instance_prefix,
+        sizeof (prep_area->type_instance));
+  else
+    ssnprintf (prep_area->type_instance, sizeof (prep_area->type_instance),
+        "%s-", r->instance_prefix);
+  prep_area->type_instance_prefix_len = strlen (prep_area->type_instance);
+  /* }}} */
+
 #undef BAIL_OUT
   return (0);
 } /* }}} int udb_result_prepare_result */
@@ -825,30 +852,114 @@ int udb_query_check_version (udb_query_t *q, unsigned int version) /* {{{ */
   return (1);
 } /* }}} int udb_query_check_version */
 
-void udb_query_finish_result (udb_query_t const *q, /* {{{ */
+/* Forgets the column positions, e.g. because the columns have changed. */
+static void udb_query_invalidate_plan (udb_query_t const *q, /* {{{ */
     udb_query_preparation_area_t *prep_area)
 {
   udb_result_preparation_area_t *r_area;
   udb_result_t *r;
+  size_t i;
+
+  for (r = q->results, r_area = prep_area->result_prep_areas;
+      r != NULL; r = r->next, r_area = r_area->next)
+  {
+    /* this may happen during error conditions of the caller */
+    if (r_area == NULL)
+      break;
+    udb_result_finish_result (r, r_area);
+  }
+
+  for (i = 0; i < prep_area->plan_columns_num; i++)
+    sfree (prep_area->plan_columns[i]);
+  sfree (prep_area->plan_columns);
+  prep_area->plan_columns_num = 0;
+  prep_area->plan_valid = 0;
+} /* }}} void udb_query_invalidate_plan */
+
+static _Bool udb_query_plan_matches ( /* {{{ */
+    udb_query_preparation_area_t const *prep_area,
+    char **column_names, size_t column_num)
+{
+  size_t i;
+
+  if (!prep_area->plan_valid || (prep_area->plan_columns_num != column_num))
+    return (0);
+
+  for (i = 0; i < column_num; i++)
+    if (strcmp (prep_area->plan_columns[i], column_names[i]) != 0)
+      return (0);
+
+  return (1);
+} /* }}} _Bool udb_query_plan_matches */
+
+static int udb_query_save_plan (udb_query_t const *q, /* {{{ */
+    udb_query_preparation_area_t *prep_area,
+    char **column_names, size_t column_num)
+{
+  udb_result_t *r;
+  size_t values_max;
+  size_t i;
+
+  prep_area->plan_columns = (char **) calloc (column_num, sizeof (char *));
+  if (prep_area->plan_columns == NULL)
+    return (-ENOMEM);
+  prep_area->plan_columns_num = column_num;
+
+  for (i = 0; i < column_num; i++)
+  {
+    prep_area->plan_columns[i] = strdup (column_names[i]);
+    if (prep_area->plan_columns[i] == NULL)
+      return (-ENOMEM);
+  }
+
+  values_max = 0;
+  for (r = q->results; r != NULL; r = r->next)
+    if (r->values_num > values_max)
+      values_max = r->values_num;
+
+  if (prep_area->batch == NULL)
+  {
+    prep_area->batch = (plugin_value_entry_t *) calloc (UDB_BATCH_SIZE,
+        sizeof (*prep_area->batch));
+    prep_area->batch_type_instances = calloc (UDB_BATCH_SIZE,
+        sizeof (*prep_area->batch_type_instances));
+    if ((prep_area->batch == NULL)
+        || (prep_area->batch_type_instances == NULL))
+      return (-ENOMEM);
+  }
+
+  if (values_max > prep_area->batch_values_max)
+  {
+    sfree (prep_area->batch_values);
+    prep_area->batch_values_max = 0;
+
+    prep_area->batch_values = (value_t *) calloc (UDB_BATCH_SIZE * values_max,
+        sizeof (*prep_area->batch_values));
+    if (prep_area->batch_values == NULL)
+      return (-ENOMEM);
+    prep_area->batch_values_max = values_max;
+  }
+
+  prep_area->plan_valid = 1;
+  return (0);
+} /* }}} int udb_query_save_plan */
 
+void udb_query_finish_result (udb_query_t const *q, /* {{{ */
+    udb_query_preparation_area_t *prep_area)
+{
   if ((q == NULL) || (prep_area == NULL))
     return;
 
+  /* The batch refers to the result preparation areas, so this has to happen
+   * before they may be changed. */
+  udb_query_flush_batch (prep_area);
+
   prep_area->column_num = 0;
   sfree (prep_area->host);
   sfree (prep_area->plugin);
   sfree (prep_area->db_name);
 
   prep_area->interval = 0;
-
-  for (r = q->results, r_area = prep_area->result_prep_areas;
-      r != NULL; r = r->next, r_area = r_area->next)
-  {
-    /* this may happen during error conditions of the caller */
-    if (r_area == NULL)
-      break;
-    udb_result_finish_result (r, r_area);
-  }
 } /* }}} void udb_query_finish_result */
 
 int udb_query_handle_result (udb_query_t const *q, /* {{{ */
@@ -933,6 +1044,20 @@ int udb_query_prepare_result (udb_query_t const *q, /* {{{ */
     return (-ENOMEM);
   }
 
+  /* The template for all value lists dispatched for this result. */
+  memset (&prep_area->vl, 0, sizeof (prep_area->vl));
+  prep_area->vl.interval = (interval > 0) ? interval : plugin_get_interval ();
+  sstrncpy (prep_area->vl.host, host, sizeof (prep_area->vl.host));
+  sstrncpy (prep_area->vl.plugin, plugin, sizeof (prep_area->vl.plugin));
+  sstrncpy (prep_area->vl.plugin_instance, db_name,
+      sizeof (prep_area->vl.plugin_instance));
+
+  /* Most queries return the same columns each time they're executed. */
+  if (udb_query_plan_matches (prep_area, column_names, column_num))
+    return (0);
+
+  udb_query_invalidate_plan (q, prep_area);
+
 #if defined(COLLECT_DEBUG) && COLLECT_DEBUG
   do
   {
@@ -954,6 +1079,7 @@ int udb_query_prepare_result (udb_query_t const *q, /* {{{ */
     {
       ERROR ("db query utils: Query `%s': Invalid number of result "
           "preparation areas.", q->name);
+      udb_query_invalidate_plan (q, prep_area);
       udb_query_finish_result (q, prep_area);
       return (-EINVAL);
     }
@@ -961,11 +1087,21 @@ int udb_query_prepare_result (udb_query_t const *q, /* {{{ */
     status = udb_result_prepare_result (r, r_area, column_names, column_num);
     if (status != 0)
     {
+      udb_query_invalidate_plan (q, prep_area);
       udb_query_finish_result (q, prep_area);
       return (status);
     }
   }
 
+  status = udb_query_save_plan (q, prep_area, column_names, column_num);
+  if (status != 0)
+  {
+    ERROR ("db query utils: Query `%s': Prepare failed: Out of memory.", q->name);
+    udb_query_invalidate_plan (q, prep_area);
+    udb_query_finish_result (q, prep_area);
+    return (status);
+  }
+
   return (0);
 } /* }}} int udb_query_prepare_result */
 
@@ -1012,6 +1148,7 @@ void
 udb_query_delete_preparation_area (udb_query_preparation_area_t *q_area) /* {{{ */
 {
   udb_result_preparation_area_t *r_area;
+  size_t i;
 
   if (q_area == NULL)
     return;
@@ -1034,6 +1171,14 @@ udb_query_delete_preparation_area (udb_query_preparation_area_t *q_area) /* {{{
   sfree (q_area->plugin);
   sfree (q_area->db_name);
 
+  for (i = 0; i < q_area->plan_columns_num; i++)
+    sfree (q_area->plan_columns[i]);
+  sfree (q_area->plan_columns);
+
+  sfree (q_area->batch);
+  sfree (q_area->batch_type_instances);
+  sfree (q_area->batch_values);
+
   free (q_area);
 } /* }}} void udb_query_delete_preparation_area */
 
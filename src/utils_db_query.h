@@ -65,6 +65,11 @@ void *udb_query_get_user_data (udb_query_t *q);
  */
 int udb_query_check_version (udb_query_t *q, unsigned int version);
 
+/*
+ * The values of a result are dispatched in batches. `udb_query_finish_result'
+ * dispatches the remaining values, so it has to be called after the last row
+ * has been handled.
+ */
 int udb_query_prepare_result (udb_query_t const *q,
     udb_query_preparation_area_t *prep_area,
     const char *host, const char *plugin, const char *db_name,
@@ -0,0 +1,215 @@
+/**
+ * collectd - src/utils_epoch.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/*
+ * Each thread which has ever entered a section has a record, which holds the
+ * global epoch it entered its current section in, or zero. The writer
+ * advances the global epoch and waits for every record to be zero or to hold
+ * the new epoch. Both sides store first and load afterwards with a full
+ * barrier in between, so either the writer sees the reader's section or the
+ * reader sees the data as the writer left it.
+ *
+ * Records are reused by later threads, but never freed, so the writer can
+ * walk the list while threads come and go.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utils_epoch.h"
+
+struct c_epoch_thread_s
+{
+  volatile uint64_t epoch;
+  unsigned int nesting;
+  _Bool in_use;
+  struct c_epoch_thread_s *next;
+};
+typedef struct c_epoch_thread_s c_epoch_thread_t;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static c_epoch_thread_t *epoch_threads = NULL;
+static volatile uint64_t epoch_global = 1;
+
+/* Threads whose record couldn't be allocated point their key at this and
+ * count their sections in "epoch_anonymous", which writers wait to drop to
+ * zero. */
+static c_epoch_thread_t epoch_fallback;
+static volatile uint64_t epoch_anonymous = 0;
+
+static void epoch_thread_exit (void *arg) /* {{{ */
+{
+  c_epoch_thread_t *t = arg;
+
+  if ((t == NULL) || (t == &epoch_fallback))
+    return;
+
+  t->nesting = 0;
+  t->epoch = 0;
+  __sync_synchronize ();
+
+  pthread_mutex_lock (&epoch_lock);
+  t->in_use = 0;
+  pthread_mutex_unlock (&epoch_lock);
+} /* }}} void epoch_thread_exit */
+
+static void epoch_init (void) /* {{{ */
+{
+  pthread_key_create (&epoch_key, epoch_thread_exit);
+} /* }}} void epoch_init */
+
+static c_epoch_thread_t *epoch_thread_get (void) /* {{{ */
+{
+  c_epoch_thread_t *t;
+
+  pthread_once (&epoch_once, epoch_init);
+
+  t = pthread_getspecific (epoch_key);
+  if (t != NULL)
+    return (t);
+
+  pthread_mutex_lock (&epoch_lock);
+  for (t = epoch_threads; t != NULL; t = t->next)
+    if (!t->in_use)
+      break;
+
+  if (t == NULL)
+  {
+    t = calloc (1, sizeof (*t));
+    if (t != NULL)
+    {
+      t->next = epoch_threads;
+      epoch_threads = t;
+    }
+  }
+
+  if (t != NULL)
+    t->in_use = 1;
+  else
+    t = &epoch_fallback;
+  pthread_mutex_unlock (&epoch_lock);
+
+  pthread_setspecific (epoch_key, t);
+  return (t);
+} /* }}} c_epoch_thread_t *epoch_thread_get */
+
+void c_epoch_enter (void) /* {{{ */
+{
+  c_epoch_thread_t *t = epoch_thread_get ();
+
+  if (t == &epoch_fallback)
+  {
+    __sync_fetch_and_add (&epoch_anonymous, 1);
+    return;
+  }
+
+  if (t->nesting++ > 0)
+    return;
+
+  t->epoch = epoch_global;
+  __sync_synchronize ();
+} /* }}} void c_epoch_enter */
+
+void c_epoch_leave (void) /* {{{ */
+{
+  c_epoch_thread_t *t;
+
+  pthread_once (&epoch_once, epoch_init);
+  t = pthread_getspecific (epoch_key);
+
+  if (t == &epoch_fallback)
+  {
+    __sync_fetch_and_sub (&epoch_anonymous, 1);
+    return;
+  }
+
+  if ((t == NULL) || (t->nesting == 0))
+    return;
+
+  if (--t->nesting > 0)
+    return;
+
+  __sync_synchronize ();
+  t->epoch = 0;
+} /* }}} void c_epoch_leave */
+
+uint64_t c_epoch_retire (void) /* {{{ */
+{
+  return (__sync_add_and_fetch (&epoch_global, 1));
+} /* }}} uint64_t c_epoch_retire */
+
+_Bool c_epoch_passed (uint64_t ticket) /* {{{ */
+{
+  c_epoch_thread_t *t;
+  _Bool passed = 1;
+
+  __sync_synchronize ();
+
+  pthread_mutex_lock (&epoch_lock);
+  for (t = epoch_threads; t != NULL; t = t->next)
+  {
+    uint64_t epoch = t->epoch;
+
+    if ((epoch != 0) && (epoch < ticket))
+    {
+      passed = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&epoch_lock);
+
+  if (epoch_anonymous > 0)
+    passed = 0;
+
+  return (passed);
+} /* }}} _Bool c_epoch_passed */
+
+void c_epoch_synchronize (void) /* {{{ */
+{
+  struct timespec ts = { 0, 1000000 };
+  c_epoch_thread_t *t;
+  uint64_t target;
+
+  target = __sync_add_and_fetch (&epoch_global, 1);
+
+  pthread_mutex_lock (&epoch_lock);
+  for (t = epoch_threads; t != NULL; t = t->next)
+  {
+    while (42)
+    {
+      uint64_t epoch = t->epoch;
+
+      if ((epoch == 0) || (epoch >= target))
+        break;
+      nanosleep (&ts, /* remaining = */ NULL);
+    }
+  }
+  pthread_mutex_unlock (&epoch_lock);
+
+  while (epoch_anonymous > 0)
+    nanosleep (&ts, /* remaining = */ NULL);
+} /* }}} void c_epoch_synchronize */
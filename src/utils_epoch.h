@@ -0,0 +1,79 @@
+/**
+ * collectd - src/utils_epoch.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_EPOCH_H
+#define UTILS_EPOCH_H 1
+
+#include <stdint.h>
+
+/*
+ * Epoch based reclamation of data which other threads read without taking a
+ * lock. Readers enclose their use of the data in c_epoch_enter() and
+ * c_epoch_leave(). A writer first makes the data unreachable, e.g. by
+ * replacing the pointer to it, then calls c_epoch_synchronize() and frees it
+ * afterwards. Entering and leaving costs a memory barrier; only the writer
+ * waits.
+ */
+
+/*
+ * NAME
+ *   c_epoch_enter, c_epoch_leave
+ *
+ * DESCRIPTION
+ *   Start and end a section in which the calling thread may use shared data.
+ *   Sections may be nested; only the outermost one counts. Sections should
+ *   be short, since writers wait for them.
+ */
+void c_epoch_enter (void);
+void c_epoch_leave (void);
+
+/*
+ * NAME
+ *   c_epoch_synchronize
+ *
+ * DESCRIPTION
+ *   Waits until all sections which have been entered before the call have
+ *   been left. Data which was made unreachable before the call can be freed
+ *   afterwards. Must not be called from within a section.
+ */
+void c_epoch_synchronize (void);
+
+/*
+ * NAME
+ *   c_epoch_retire, c_epoch_passed
+ *
+ * DESCRIPTION
+ *   Non-blocking variant of c_epoch_synchronize() for writers which cannot
+ *   wait, e.g. because they may be called from within a section themselves.
+ *   c_epoch_retire() is called after the data has been made unreachable and
+ *   returns a ticket. Once c_epoch_passed() returns true for that ticket, all
+ *   sections which could have seen the data have been left and it can be
+ *   freed.
+ *
+ * RETURN VALUE
+ *   c_epoch_passed() returns true if the grace period of `ticket' is over and
+ *   false otherwise.
+ */
+uint64_t c_epoch_retire (void);
+_Bool c_epoch_passed (uint64_t ticket);
+
+#endif /* UTILS_EPOCH_H */
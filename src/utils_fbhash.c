@@ -26,14 +26,36 @@
 
 #include "utils_fbhash.h"
 #include "utils_avltree.h"
+#include "utils_epoch.h"
+
+/* The contents of the file at one point in time. Snapshots are never
+ * modified once they have been published, so they can be read without
+ * taking a lock. */
+struct fbh_snapshot_s
+{
+  c_avl_tree_t *tree;
+  /* Incremented each time the file is read. */
+  unsigned int generation;
+
+  /* Epoch ticket taken when the snapshot was replaced by a newer one. */
+  uint64_t retired;
+  struct fbh_snapshot_s *next;
+};
+typedef struct fbh_snapshot_s fbh_snapshot_t;
 
 struct fbhash_s
 {
   char *filename;
   time_t mtime;
+  /* The file is checked at most once a second. */
+  time_t checked;
+
+  fbh_snapshot_t *current;
 
+  /* Serializes checking and re-reading the file. Lookups don't take it. */
   pthread_mutex_t lock;
-  c_avl_tree_t *tree;
+  /* Replaced snapshots which may still be in use by readers. */
+  fbh_snapshot_t *retired;
 };
 
 /* 
@@ -62,12 +84,44 @@ static void fbh_free_tree (c_avl_tree_t *tree) /* {{{ */
   c_avl_destroy (tree);
 } /* }}} void fbh_free_tree */
 
+static void fbh_free_snapshots (fbh_snapshot_t *snap) /* {{{ */
+{
+  while (snap != NULL)
+  {
+    fbh_snapshot_t *next = snap->next;
+
+    fbh_free_tree (snap->tree);
+    free (snap);
+    snap = next;
+  }
+} /* }}} void fbh_free_snapshots */
+
+/* Frees the replaced snapshots no reader can be using anymore. The list is
+ * sorted newest first, so once one snapshot's grace period is over, so are
+ * those of all older ones. Must be called with `h->lock' held. */
+static void fbh_expire_snapshots (fbhash_t *h) /* {{{ */
+{
+  fbh_snapshot_t **ptr;
+
+  for (ptr = &h->retired; *ptr != NULL; ptr = &(*ptr)->next)
+  {
+    if (c_epoch_passed ((*ptr)->retired))
+    {
+      fbh_free_snapshots (*ptr);
+      *ptr = NULL;
+      break;
+    }
+  }
+} /* }}} void fbh_expire_snapshots */
+
 static int fbh_read_file (fbhash_t *h) /* {{{ */
 {
   FILE *fh;
   char buffer[4096];
   struct flock fl;
   c_avl_tree_t *tree;
+  fbh_snapshot_t *snap;
+  fbh_snapshot_t *old;
   int status;
 
   fh = fopen (h->filename, "r");
@@ -166,8 +220,28 @@ static int fbh_read_file (fbhash_t *h) /* {{{ */
 
   fclose (fh);
 
-  fbh_free_tree (h->tree);
-  h->tree = tree;
+  snap = calloc (1, sizeof (*snap));
+  if (snap == NULL)
+  {
+    fbh_free_tree (tree);
+    return (-1);
+  }
+  snap->tree = tree;
+  snap->generation = (h->current != NULL) ? (h->current->generation + 1) : 1;
+
+  /* Make sure the tree is visible to other threads before the pointer to
+   * it is. */
+  __sync_synchronize ();
+
+  old = h->current;
+  h->current = snap;
+
+  if (old != NULL)
+  {
+    old->retired = c_epoch_retire ();
+    old->next = h->retired;
+    h->retired = old;
+  }
 
   return (0);
 } /* }}} int fbh_read_file */
@@ -175,8 +249,16 @@ static int fbh_read_file (fbhash_t *h) /* {{{ */
 static int fbh_check_file (fbhash_t *h) /* {{{ */
 {
   struct stat statbuf;
+  time_t now;
   int status;
 
+  now = time (NULL);
+  if (now == h->checked)
+    return (0);
+  h->checked = now;
+
+  fbh_expire_snapshots (h);
+
   memset (&statbuf, 0, sizeof (statbuf));
 
   status = stat (h->filename, &statbuf);
@@ -236,36 +318,101 @@ void fbh_destroy (fbhash_t *h) /* {{{ */
 
   pthread_mutex_destroy (&h->lock);
   free (h->filename);
-  fbh_free_tree (h->tree);
+  fbh_free_snapshots (h->current);
+  fbh_free_snapshots (h->retired);
+  free (h);
 } /* }}} void fbh_destroy */
 
+/* Enters an epoch section and returns the current snapshot, checking the
+ * file for changes first if that's due. Only one thread checks; the others
+ * use the current snapshot meanwhile instead of waiting for it. The snapshot
+ * may be used until fbh_snapshot_release() is called. */
+static fbh_snapshot_t *fbh_snapshot_acquire (fbhash_t *h) /* {{{ */
+{
+  if ((h->checked != time (NULL))
+      && (pthread_mutex_trylock (&h->lock) == 0))
+  {
+    fbh_check_file (h);
+    pthread_mutex_unlock (&h->lock);
+  }
+
+  c_epoch_enter ();
+
+  /* The snapshot is fully initialized before the pointer is published (see
+   * fbh_read_file), and all accesses depend on the pointer. */
+  return (h->current);
+} /* }}} fbh_snapshot_t *fbh_snapshot_acquire */
+
+static void fbh_snapshot_release (void) /* {{{ */
+{
+  c_epoch_leave ();
+} /* }}} void fbh_snapshot_release */
+
 char *fbh_get (fbhash_t *h, const char *key) /* {{{ */
 {
-  char *value;
-  char *value_copy;
-  int status;
+  fbh_snapshot_t *snap;
+  char *value = NULL;
 
   if ((h == NULL) || (key == NULL))
     return (NULL);
 
-  value = NULL;
-  value_copy = NULL;
+  snap = fbh_snapshot_acquire (h);
+  if ((snap == NULL) || (c_avl_get (snap->tree, key, (void *) &value) != 0))
+  {
+    fbh_snapshot_release ();
+    return (NULL);
+  }
 
-  pthread_mutex_lock (&h->lock);
+  assert (value != NULL);
+  value = strdup (value);
+  fbh_snapshot_release ();
 
-  /* TODO: Checking this everytime may be a bit much..? */
-  fbh_check_file (h);
+  return (value);
+} /* }}} char *fbh_get */
 
-  status = c_avl_get (h->tree, key, (void *) &value);
-  if (status == 0)
+int fbh_get_r (fbhash_t *h, const char *key, /* {{{ */
+    char *buffer, size_t buffer_size)
+{
+  fbh_snapshot_t *snap;
+  char *value = NULL;
+  size_t value_len;
+
+  if ((h == NULL) || (key == NULL) || (buffer == NULL) || (buffer_size < 1))
+    return (EINVAL);
+
+  snap = fbh_snapshot_acquire (h);
+  if ((snap == NULL) || (c_avl_get (snap->tree, key, (void *) &value) != 0))
   {
-    assert (value != NULL);
-    value_copy = strdup (value);
+    fbh_snapshot_release ();
+    return (ENOENT);
   }
 
-  pthread_mutex_unlock (&h->lock);
+  assert (value != NULL);
+  value_len = strlen (value);
+  if (value_len >= buffer_size)
+  {
+    fbh_snapshot_release ();
+    return (ERANGE);
+  }
 
-  return (value_copy);
-} /* }}} char *fbh_get */
+  memcpy (buffer, value, value_len + 1);
+  fbh_snapshot_release ();
+  return (0);
+} /* }}} int fbh_get_r */
+
+unsigned int fbh_generation (fbhash_t *h) /* {{{ */
+{
+  fbh_snapshot_t *snap;
+  unsigned int generation;
+
+  if (h == NULL)
+    return (0);
+
+  snap = fbh_snapshot_acquire (h);
+  generation = (snap != NULL) ? snap->generation : 0;
+  fbh_snapshot_release ();
+
+  return (generation);
+} /* }}} unsigned int fbh_generation */
 
 /* vim: set sw=2 sts=2 et fdm=marker : */
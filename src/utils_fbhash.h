@@ -22,6 +22,8 @@
 #ifndef UTILS_FBHASH_H
 #define UTILS_FBHASH_H 1
 
+#include <stddef.h>
+
 /*
  * File-backed hash
  *
@@ -42,6 +44,17 @@ void fbh_destroy (fbhash_t *h);
  * responsibility to free this memory. */
 char *fbh_get (fbhash_t *h, const char *key);
 
+/* Copies the value into `buffer'. Neither takes a lock nor allocates memory,
+ * so it may be used from hot paths. Returns zero on success, ENOENT if the
+ * key is unknown and ERANGE if the value doesn't fit into `buffer'. */
+int fbh_get_r (fbhash_t *h, const char *key,
+    char *buffer, size_t buffer_size);
+
+/* Returns a number which changes whenever the file is re-read, i.e. values
+ * returned by `fbh_get' before may be out of date. The file is checked for
+ * changes at most once a second. */
+unsigned int fbh_generation (fbhash_t *h);
+
 #endif /* UTILS_FBHASH_H */
 
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -26,6 +26,7 @@
 #include "common.h"
 
 #include "utils_format_graphite.h"
+#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_parse_option.h"
 
@@ -58,10 +59,17 @@ static int gr_format_values (char *ret, size_t ret_len,
     offset += ((size_t) status); \
 } while (0)
 
+#define BUFFER_ADD_GAUGE(value) do { \
+    status = format_gauge (ret + offset, ret_len - offset, "%f", (value)); \
+    if ((status < 1) || (((size_t) status) >= (ret_len - offset))) \
+        return (-1); \
+    offset += ((size_t) status); \
+} while (0)
+
     if (ds->ds[ds_num].type == DS_TYPE_GAUGE)
-        BUFFER_ADD ("%f", vl->values[ds_num].gauge);
+        BUFFER_ADD_GAUGE (vl->values[ds_num].gauge);
     else if (rates != NULL)
-        BUFFER_ADD ("%f", rates[ds_num]);
+        BUFFER_ADD_GAUGE (rates[ds_num]);
     else if (ds->ds[ds_num].type == DS_TYPE_COUNTER)
         BUFFER_ADD ("%llu", vl->values[ds_num].counter);
     else if (ds->ds[ds_num].type == DS_TYPE_DERIVE)
@@ -75,6 +83,7 @@ static int gr_format_values (char *ret, size_t ret_len,
         return (-1);
     }
 
+#undef BUFFER_ADD_GAUGE
 #undef BUFFER_ADD
 
     return (0);
@@ -169,6 +178,78 @@ static int gr_format_name (char *ret, int ret_len,
     return (0);
 }
 
+/* Formats "<key> <value> <time>\r\n" for the "ds_num"th data source and
+ * appends it to "buffer" at "*buffer_pos". */
+static int gr_format_line (char *buffer, size_t buffer_size,
+        size_t *buffer_pos, char const *key, int ds_num,
+        data_set_t const *ds, value_list_t const *vl, gauge_t const *rates)
+{
+    char   values[512];
+    size_t message_len;
+    char   message[1024];
+    int    status;
+
+    /* Convert the values to an ASCII representation and put that into
+     * `values'. */
+    status = gr_format_values (values, sizeof (values), ds_num, ds, vl, rates);
+    if (status != 0)
+    {
+        ERROR ("format_graphite: error with gr_format_values");
+        return (status);
+    }
+
+    /* Compute the graphite command */
+    message_len = (size_t) ssnprintf (message, sizeof (message),
+            "%s %s %u\r\n",
+            key,
+            values,
+            (unsigned int) CDTIME_T_TO_TIME_T (vl->time));
+    if (message_len >= sizeof (message)) {
+        ERROR ("format_graphite: message buffer too small: "
+                "Need %zu bytes.", message_len + 1);
+        return (-ENOMEM);
+    }
+
+    /* Append it in case we got multiple data set */
+    if ((*buffer_pos + message_len) >= buffer_size)
+    {
+        ERROR ("format_graphite: target buffer too small");
+        return (-ENOMEM);
+    }
+    /* Copy the terminating null byte, too, so callers need not clear the
+     * buffer. */
+    memcpy((void *) (buffer + *buffer_pos), message, message_len + 1);
+    *buffer_pos += message_len;
+
+    return (0);
+} /* int gr_format_line */
+
+/* Builds the escaped metric name for the "ds_num"th data source. */
+static int gr_format_key (char *key, size_t key_size, int ds_num,
+        data_set_t const *ds, value_list_t const *vl,
+        char const *prefix, char const *postfix, char const escape_char,
+        unsigned int flags)
+{
+    char const *ds_name = NULL;
+    int status;
+
+    if ((flags & GRAPHITE_ALWAYS_APPEND_DS)
+        || (ds->ds_num > 1))
+      ds_name = ds->ds[ds_num].name;
+
+    /* Copy the identifier to `key' and escape it. */
+    status = gr_format_name (key, (int) key_size, vl, ds_name,
+                prefix, postfix, escape_char, flags);
+    if (status != 0)
+    {
+        ERROR ("format_graphite: error with gr_format_name");
+        return (status);
+    }
+
+    escape_string (key, key_size);
+    return (0);
+} /* int gr_format_key */
+
 int format_graphite (char *buffer, size_t buffer_size,
     data_set_t const *ds, value_list_t const *vl,
     char const *prefix, char const *postfix, char const escape_char,
@@ -176,70 +257,263 @@ int format_graphite (char *buffer, size_t buffer_size,
 {
     int status = 0;
     int i;
-    int buffer_pos = 0;
+    size_t buffer_pos = 0;
 
-    gauge_t *rates = NULL;
+    const gauge_t *rates = NULL;
     if (flags & GRAPHITE_STORE_RATES)
-      rates = uc_get_rate (ds, vl);
+      rates = uc_get_rate_ref (ds, vl);
 
     for (i = 0; i < ds->ds_num; i++)
     {
-        char const *ds_name = NULL;
         char        key[10*DATA_MAX_NAME_LEN];
-        char        values[512];
-        size_t      message_len;
-        char        message[1024];
 
-        if ((flags & GRAPHITE_ALWAYS_APPEND_DS)
-            || (ds->ds_num > 1))
-          ds_name = ds->ds[i].name;
-
-        /* Copy the identifier to `key' and escape it. */
-        status = gr_format_name (key, sizeof (key), vl, ds_name,
-                    prefix, postfix, escape_char, flags);
+        status = gr_format_key (key, sizeof (key), i, ds, vl,
+                prefix, postfix, escape_char, flags);
+        if (status == 0)
+            status = gr_format_line (buffer, buffer_size, &buffer_pos,
+                    key, i, ds, vl, rates);
         if (status != 0)
         {
-            ERROR ("format_graphite: error with gr_format_name");
-            sfree (rates);
+            uc_release_rate_ref (vl, rates);
             return (status);
         }
+    }
+    uc_release_rate_ref (vl, rates);
+    return (status);
+} /* int format_graphite */
 
-        escape_string (key, sizeof (key));
-        /* Convert the values to an ASCII representation and put that into
-         * `values'. */
-        status = gr_format_values (values, sizeof (values), i, ds, vl, rates);
-        if (status != 0)
+/*
+ * Name cache
+ */
+/* Upper bound of cached series; the cache is emptied when it is reached so
+ * that series which went away don't accumulate forever. */
+#ifndef GRAPHITE_NAME_CACHE_MAX
+# define GRAPHITE_NAME_CACHE_MAX 65536
+#endif
+
+struct gr_name_s
+{
+    /* Identity of the series. Points into "identity_buf" for cached
+     * entries and into the value list for lookups. */
+    char const *host;
+    char const *plugin;
+    char const *plugin_instance;
+    char const *type;
+    char const *type_instance;
+
+    char  *identity_buf;
+
+    /* One escaped metric name per data source. */
+    char **names;
+    int    names_num;
+};
+typedef struct gr_name_s gr_name_t;
+
+struct graphite_name_cache_s
+{
+    c_avl_tree_t *tree;
+    int size;
+
+    char *prefix;
+    char *postfix;
+    char  escape_char;
+    unsigned int flags;
+};
+
+static int gr_name_compare (void const *a, void const *b) /* {{{ */
+{
+    gr_name_t const *n0 = a;
+    gr_name_t const *n1 = b;
+    int status;
+
+    status = strcmp (n0->host, n1->host);
+    if (status == 0)
+        status = strcmp (n0->plugin, n1->plugin);
+    if (status == 0)
+        status = strcmp (n0->plugin_instance, n1->plugin_instance);
+    if (status == 0)
+        status = strcmp (n0->type, n1->type);
+    if (status == 0)
+        status = strcmp (n0->type_instance, n1->type_instance);
+
+    return (status);
+} /* }}} int gr_name_compare */
+
+static void gr_name_free (gr_name_t *n) /* {{{ */
+{
+    int i;
+
+    if (n == NULL)
+        return;
+
+    for (i = 0; i < n->names_num; i++)
+        sfree (n->names[i]);
+    sfree (n->names);
+    sfree (n->identity_buf);
+    sfree (n);
+} /* }}} void gr_name_free */
+
+static void gr_name_cache_clear (graphite_name_cache_t *c) /* {{{ */
+{
+    void *key;
+    void *value;
+
+    while (c_avl_pick (c->tree, &key, &value) == 0)
+        gr_name_free (value);
+    c->size = 0;
+} /* }}} void gr_name_cache_clear */
+
+static gr_name_t *gr_name_create (graphite_name_cache_t *c, /* {{{ */
+        data_set_t const *ds, value_list_t const *vl)
+{
+    gr_name_t *n;
+    size_t lens[5];
+    char *ptr;
+    int i;
+
+    n = calloc (1, sizeof (*n));
+    if (n == NULL)
+        return (NULL);
+
+    lens[0] = strlen (vl->host) + 1;
+    lens[1] = strlen (vl->plugin) + 1;
+    lens[2] = strlen (vl->plugin_instance) + 1;
+    lens[3] = strlen (vl->type) + 1;
+    lens[4] = strlen (vl->type_instance) + 1;
+
+    n->identity_buf = malloc (lens[0] + lens[1] + lens[2] + lens[3] + lens[4]);
+    n->names = calloc ((size_t) ds->ds_num, sizeof (*n->names));
+    if ((n->identity_buf == NULL) || (n->names == NULL))
+    {
+        gr_name_free (n);
+        return (NULL);
+    }
+
+    ptr = n->identity_buf;
+#define COPY_PART(field, i) do { \
+    memcpy (ptr, vl->field, lens[i]); \
+    n->field = ptr; \
+    ptr += lens[i]; \
+} while (0)
+    COPY_PART (host, 0);
+    COPY_PART (plugin, 1);
+    COPY_PART (plugin_instance, 2);
+    COPY_PART (type, 3);
+    COPY_PART (type_instance, 4);
+#undef COPY_PART
+
+    for (i = 0; i < ds->ds_num; i++)
+    {
+        char key[10*DATA_MAX_NAME_LEN];
+
+        n->names_num = i;
+        if ((gr_format_key (key, sizeof (key), i, ds, vl, c->prefix,
+                        c->postfix, c->escape_char, c->flags) != 0)
+                || ((n->names[i] = strdup (key)) == NULL))
         {
-            ERROR ("format_graphite: error with gr_format_values");
-            sfree (rates);
-            return (status);
+            gr_name_free (n);
+            return (NULL);
         }
+    }
+    n->names_num = ds->ds_num;
+
+    return (n);
+} /* }}} gr_name_t *gr_name_create */
+
+graphite_name_cache_t *graphite_name_cache_create (char const *prefix,
+        char const *postfix, char escape_char, unsigned int flags)
+{
+    graphite_name_cache_t *c;
+
+    c = calloc (1, sizeof (*c));
+    if (c == NULL)
+        return (NULL);
+
+    c->tree = c_avl_create (gr_name_compare);
+    if (c->tree == NULL)
+    {
+        sfree (c);
+        return (NULL);
+    }
+
+    c->prefix = (prefix != NULL) ? strdup (prefix) : NULL;
+    c->postfix = (postfix != NULL) ? strdup (postfix) : NULL;
+    c->escape_char = escape_char;
+    c->flags = flags;
+
+    return (c);
+} /* graphite_name_cache_t *graphite_name_cache_create */
 
-        /* Compute the graphite command */
-        message_len = (size_t) ssnprintf (message, sizeof (message),
-                "%s %s %u\r\n",
-                key,
-                values,
-                (unsigned int) CDTIME_T_TO_TIME_T (vl->time));
-        if (message_len >= sizeof (message)) {
-            ERROR ("format_graphite: message buffer too small: "
-                    "Need %zu bytes.", message_len + 1);
-            sfree (rates);
-            return (-ENOMEM);
+void graphite_name_cache_destroy (graphite_name_cache_t *c)
+{
+    if (c == NULL)
+        return;
+
+    gr_name_cache_clear (c);
+    c_avl_destroy (c->tree);
+    sfree (c->prefix);
+    sfree (c->postfix);
+    sfree (c);
+} /* void graphite_name_cache_destroy */
+
+int format_graphite_cached (char *buffer, size_t buffer_size,
+        data_set_t const *ds, value_list_t const *vl,
+        graphite_name_cache_t *c)
+{
+    gr_name_t lookup;
+    gr_name_t *n = NULL;
+    const gauge_t *rates = NULL;
+    size_t buffer_pos = 0;
+    int status = 0;
+    int i;
+
+    lookup.host = vl->host;
+    lookup.plugin = vl->plugin;
+    lookup.plugin_instance = vl->plugin_instance;
+    lookup.type = vl->type;
+    lookup.type_instance = vl->type_instance;
+
+    if ((c_avl_get (c->tree, &lookup, (void *) &n) != 0)
+            || (n->names_num != ds->ds_num))
+    {
+        if (n != NULL)
+        {
+            c_avl_remove (c->tree, n, NULL, NULL);
+            gr_name_free (n);
+            c->size--;
+        }
+
+        if (c->size >= GRAPHITE_NAME_CACHE_MAX)
+            gr_name_cache_clear (c);
+
+        n = gr_name_create (c, ds, vl);
+        if (n == NULL)
+        {
+            ERROR ("format_graphite: Creating the cached name failed.");
+            return (-1);
         }
 
-        /* Append it in case we got multiple data set */
-        if ((buffer_pos + message_len) >= buffer_size)
+        if (c_avl_insert (c->tree, n, n) != 0)
         {
-            ERROR ("format_graphite: target buffer too small");
-            sfree (rates);
-            return (-ENOMEM);
+            gr_name_free (n);
+            return (-1);
         }
-        memcpy((void *) (buffer + buffer_pos), message, message_len);
-        buffer_pos += message_len;
+        c->size++;
+    }
+
+    if (c->flags & GRAPHITE_STORE_RATES)
+      rates = uc_get_rate_ref (ds, vl);
+
+    for (i = 0; i < ds->ds_num; i++)
+    {
+        status = gr_format_line (buffer, buffer_size, &buffer_pos,
+                n->names[i], i, ds, vl, rates);
+        if (status != 0)
+            break;
     }
-    sfree (rates);
+
+    uc_release_rate_ref (vl, rates);
     return (status);
-} /* int format_graphite */
+} /* int format_graphite_cached */
 
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -35,4 +35,18 @@ int format_graphite (char *buffer,
     const char *postfix, const char escape_char,
     unsigned int flags);
 
+/* Caches the escaped metric names per series, so that only the values and
+ * the time have to be formatted for series seen before. Not thread-safe;
+ * the caller has to serialize access to a cache. */
+struct graphite_name_cache_s;
+typedef struct graphite_name_cache_s graphite_name_cache_t;
+
+graphite_name_cache_t *graphite_name_cache_create (const char *prefix,
+    const char *postfix, char escape_char, unsigned int flags);
+void graphite_name_cache_destroy (graphite_name_cache_t *c);
+
+int format_graphite_cached (char *buffer, size_t buffer_size,
+    const data_set_t *ds, const value_list_t *vl,
+    graphite_name_cache_t *c);
+
 #endif /* UTILS_FORMAT_GRAPHITE_H */
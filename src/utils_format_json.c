@@ -23,383 +23,664 @@
 #include "plugin.h"
 #include "common.h"
 
+#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_format_json.h"
 
-static int escape_string (char *buffer, size_t buffer_size, /* {{{ */
-    const char *string)
+/* Upper bound of cached series; the cache is emptied when it is reached so
+ * that series which went away don't accumulate forever. */
+#ifndef FORMAT_JSON_CACHE_MAX
+# define FORMAT_JSON_CACHE_MAX 65536
+#endif
+
+/*
+ * Output buffer
+ */
+struct format_json_buffer_s
+{
+  char  *data;
+  size_t fill;
+  size_t size;
+  _Bool  grow;
+};
+typedef struct format_json_buffer_s format_json_buffer_t;
+#define FORMAT_JSON_BUFFER_INIT { NULL, 0, 0, 1 }
+
+/* Makes room for "len" more bytes plus the terminating null byte. Buffers
+ * without "grow" are the caller's memory and cannot be enlarged. */
+static int jb_reserve (format_json_buffer_t *b, size_t len) /* {{{ */
 {
-  size_t src_pos;
-  size_t dst_pos;
+  size_t need = b->fill + len + 1;
+  size_t size;
+  char *tmp;
 
-  if ((buffer == NULL) || (string == NULL))
-    return (-EINVAL);
+  if (need <= b->size)
+    return (0);
 
-  if (buffer_size < 3)
+  if (!b->grow)
     return (-ENOMEM);
 
-  dst_pos = 0;
+  size = (b->size > 0) ? b->size : 1024;
+  while (size < need)
+    size *= 2;
 
-#define BUFFER_ADD(c) do { \
-  if (dst_pos >= (buffer_size - 1)) { \
-    buffer[buffer_size - 1] = 0; \
-    return (-ENOMEM); \
-  } \
-  buffer[dst_pos] = (c); \
-  dst_pos++; \
-} while (0)
+  tmp = realloc (b->data, size);
+  if (tmp == NULL)
+    return (-ENOMEM);
+
+  b->data = tmp;
+  b->size = size;
+  return (0);
+} /* }}} int jb_reserve */
+
+static int jb_add (format_json_buffer_t *b, /* {{{ */
+    char const *str, size_t len)
+{
+  if (jb_reserve (b, len) != 0)
+    return (-ENOMEM);
+
+  memcpy (b->data + b->fill, str, len);
+  b->fill += len;
+  b->data[b->fill] = 0;
+  return (0);
+} /* }}} int jb_add */
+
+static int jb_printf (format_json_buffer_t *b, /* {{{ */
+    char const *format, ...)
+{
+  va_list ap;
+  size_t avail;
+  int status;
+
+  if (jb_reserve (b, 0) != 0)
+    return (-ENOMEM);
+
+  avail = b->size - b->fill;
+  va_start (ap, format);
+  status = vsnprintf (b->data + b->fill, avail, format, ap);
+  va_end (ap);
+  if (status < 0)
+    return (-1);
+
+  if (((size_t) status) >= avail)
+  {
+    b->data[b->fill] = 0;
+    if (jb_reserve (b, (size_t) status) != 0)
+      return (-ENOMEM);
+
+    va_start (ap, format);
+    status = vsnprintf (b->data + b->fill, b->size - b->fill, format, ap);
+    va_end (ap);
+    if (status < 0)
+      return (-1);
+  }
+
+  b->fill += (size_t) status;
+  return (0);
+} /* }}} int jb_printf */
 
-  /* Escape special characters */
-  BUFFER_ADD ('"');
-  for (src_pos = 0; string[src_pos] != 0; src_pos++)
+static int jb_add_gauge (format_json_buffer_t *b, /* {{{ */
+    char const *legacy_format, double value)
+{
+  int status;
+
+  if (jb_reserve (b, 0) != 0)
+    return (-ENOMEM);
+
+  status = format_gauge (b->data + b->fill, b->size - b->fill,
+      legacy_format, value);
+  if (status < 1)
+    return (-1);
+
+  if (((size_t) status) >= (b->size - b->fill))
+  {
+    b->data[b->fill] = 0;
+    if (jb_reserve (b, (size_t) status) != 0)
+      return (-ENOMEM);
+
+    status = format_gauge (b->data + b->fill, b->size - b->fill,
+        legacy_format, value);
+    if (status < 1)
+      return (-1);
+  }
+
+  b->fill += (size_t) status;
+  return (0);
+} /* }}} int jb_add_gauge */
+
+/* Appends "string" as a quoted JSON string. Special characters are escaped,
+ * control characters are replaced with a question mark. */
+static int jb_add_string (format_json_buffer_t *b, /* {{{ */
+    char const *string)
+{
+  size_t i;
+
+  if (string == NULL)
+    return (-EINVAL);
+
+  /* Worst case: every character escaped, plus the quotes. */
+  if (jb_reserve (b, 2 * strlen (string) + 2) != 0)
+    return (-ENOMEM);
+
+  b->data[b->fill++] = '"';
+  for (i = 0; string[i] != 0; i++)
   {
-    if ((string[src_pos] == '"')
-        || (string[src_pos] == '\\'))
+    if ((string[i] == '"') || (string[i] == '\\'))
     {
-      BUFFER_ADD ('\\');
-      BUFFER_ADD (string[src_pos]);
+      b->data[b->fill++] = '\\';
+      b->data[b->fill++] = string[i];
     }
-    else if (string[src_pos] <= 0x001F)
-      BUFFER_ADD ('?');
+    else if (string[i] <= 0x001F)
+      b->data[b->fill++] = '?';
     else
-      BUFFER_ADD (string[src_pos]);
-  } /* for */
-  BUFFER_ADD ('"');
-  buffer[dst_pos] = 0;
-
-#undef BUFFER_ADD
+      b->data[b->fill++] = string[i];
+  }
+  b->data[b->fill++] = '"';
+  b->data[b->fill] = 0;
 
   return (0);
-} /* }}} int escape_string */
+} /* }}} int jb_add_string */
+
+#define JB_ADD(b, str) do { \
+  if (jb_add ((b), (str), strlen (str)) != 0) \
+    return (-ENOMEM); \
+} while (0)
+
+#define JB_CALL(expr) do { \
+  int jb_status = (expr); \
+  if (jb_status != 0) \
+    return (jb_status); \
+} while (0)
 
-static int values_to_json (char *buffer, size_t buffer_size, /* {{{ */
+/*
+ * JSON fragments
+ */
+static int values_to_json (format_json_buffer_t *b, /* {{{ */
                 const data_set_t *ds, const value_list_t *vl, int store_rates)
 {
-  size_t offset = 0;
   int i;
-  gauge_t *rates = NULL;
-
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-  { \
-    sfree(rates); \
-    return (-1); \
-  } \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-  { \
-    sfree(rates); \
-    return (-ENOMEM); \
-  } \
-  else \
-    offset += ((size_t) status); \
-} while (0)
+  const gauge_t *rates = NULL;
+  int status = 0;
 
-  BUFFER_ADD ("[");
-  for (i = 0; i < ds->ds_num; i++)
+  JB_ADD (b, "[");
+  for (i = 0; (i < ds->ds_num) && (status == 0); i++)
   {
     if (i > 0)
-      BUFFER_ADD (",");
+      status = jb_add (b, ",", 1);
+    if (status != 0)
+      break;
 
     if (ds->ds[i].type == DS_TYPE_GAUGE)
     {
       if(isfinite (vl->values[i].gauge))
-        BUFFER_ADD ("%g", vl->values[i].gauge);
+        status = jb_add_gauge (b, "%g", vl->values[i].gauge);
       else
-        BUFFER_ADD ("null");
+        status = jb_add (b, "null", 4);
     }
     else if (store_rates)
     {
       if (rates == NULL)
-        rates = uc_get_rate (ds, vl);
+        rates = uc_get_rate_ref (ds, vl);
       if (rates == NULL)
       {
         WARNING ("utils_format_json: uc_get_rate failed.");
-        sfree(rates);
         return (-1);
       }
 
       if(isfinite (rates[i]))
-        BUFFER_ADD ("%g", rates[i]);
+        status = jb_add_gauge (b, "%g", rates[i]);
       else
-        BUFFER_ADD ("null");
+        status = jb_add (b, "null", 4);
     }
     else if (ds->ds[i].type == DS_TYPE_COUNTER)
-      BUFFER_ADD ("%llu", vl->values[i].counter);
+      status = jb_printf (b, "%llu", vl->values[i].counter);
     else if (ds->ds[i].type == DS_TYPE_DERIVE)
-      BUFFER_ADD ("%"PRIi64, vl->values[i].derive);
+      status = jb_printf (b, "%"PRIi64, vl->values[i].derive);
     else if (ds->ds[i].type == DS_TYPE_ABSOLUTE)
-      BUFFER_ADD ("%"PRIu64, vl->values[i].absolute);
+      status = jb_printf (b, "%"PRIu64, vl->values[i].absolute);
     else
     {
       ERROR ("format_json: Unknown data source type: %i",
           ds->ds[i].type);
-      sfree (rates);
-      return (-1);
+      status = -1;
     }
   } /* for ds->ds_num */
-  BUFFER_ADD ("]");
+  uc_release_rate_ref (vl, rates);
 
-#undef BUFFER_ADD
+  if (status != 0)
+    return (status);
+  JB_ADD (b, "]");
 
-  DEBUG ("format_json: values_to_json: buffer = %s;", buffer);
-  sfree(rates);
   return (0);
 } /* }}} int values_to_json */
 
-static int dstypes_to_json (char *buffer, size_t buffer_size, /* {{{ */
+/* Appends `,"dstypes":[...],"dsnames":[...]'. This only depends on the data
+ * set. */
+static int ds_to_json (format_json_buffer_t *b, /* {{{ */
                 const data_set_t *ds)
 {
-  size_t offset = 0;
   int i;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
-
-  BUFFER_ADD ("[");
+  JB_ADD (b, ",\"dstypes\":[");
   for (i = 0; i < ds->ds_num; i++)
   {
     if (i > 0)
-      BUFFER_ADD (",");
-
-    BUFFER_ADD ("\"%s\"", DS_TYPE_TO_STRING (ds->ds[i].type));
-  } /* for ds->ds_num */
-  BUFFER_ADD ("]");
-
-#undef BUFFER_ADD
-
-  DEBUG ("format_json: dstypes_to_json: buffer = %s;", buffer);
-
-  return (0);
-} /* }}} int dstypes_to_json */
-
-static int dsnames_to_json (char *buffer, size_t buffer_size, /* {{{ */
-                const data_set_t *ds)
-{
-  size_t offset = 0;
-  int i;
-
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
-
-  BUFFER_ADD ("[");
+      JB_ADD (b, ",");
+    JB_ADD (b, "\"");
+    JB_ADD (b, DS_TYPE_TO_STRING (ds->ds[i].type));
+    JB_ADD (b, "\"");
+  }
+  JB_ADD (b, "],\"dsnames\":[");
   for (i = 0; i < ds->ds_num; i++)
   {
     if (i > 0)
-      BUFFER_ADD (",");
-
-    BUFFER_ADD ("\"%s\"", ds->ds[i].name);
-  } /* for ds->ds_num */
-  BUFFER_ADD ("]");
+      JB_ADD (b, ",");
+    JB_ADD (b, "\"");
+    JB_ADD (b, ds->ds[i].name);
+    JB_ADD (b, "\"");
+  }
+  JB_ADD (b, "]");
 
-#undef BUFFER_ADD
+  return (0);
+} /* }}} int ds_to_json */
 
-  DEBUG ("format_json: dsnames_to_json: buffer = %s;", buffer);
+/* Appends `,"host":"...",...,"type_instance":"..."'. This only depends on
+ * the identity of the series. */
+static int identity_to_json (format_json_buffer_t *b, /* {{{ */
+    char const *host, char const *plugin, char const *plugin_instance,
+    char const *type, char const *type_instance)
+{
+  JB_ADD (b, ",\"host\":");
+  JB_CALL (jb_add_string (b, host));
+  JB_ADD (b, ",\"plugin\":");
+  JB_CALL (jb_add_string (b, plugin));
+  JB_ADD (b, ",\"plugin_instance\":");
+  JB_CALL (jb_add_string (b, plugin_instance));
+  JB_ADD (b, ",\"type\":");
+  JB_CALL (jb_add_string (b, type));
+  JB_ADD (b, ",\"type_instance\":");
+  JB_CALL (jb_add_string (b, type_instance));
 
   return (0);
-} /* }}} int dsnames_to_json */
+} /* }}} int identity_to_json */
 
-static int meta_data_to_json (char *buffer, size_t buffer_size, /* {{{ */
+static int meta_data_to_json (format_json_buffer_t *b, /* {{{ */
     meta_data_t *meta)
 {
-  size_t offset = 0;
   char **keys = NULL;
   int keys_num;
-  int status;
+  size_t start = b->fill;
+  int status = 0;
   int i;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
-
   keys_num = meta_data_toc (meta, &keys);
   for (i = 0; i < keys_num; ++i)
   {
     int type;
     char *key = keys[i];
 
+    if (status != 0)
+    {
+      free (key);
+      continue;
+    }
+
     type = meta_data_type (meta, key);
     if (type == MD_TYPE_STRING)
     {
       char *value = NULL;
       if (meta_data_get_string (meta, key, &value) == 0)
       {
-        char temp[512] = "";
-        escape_string (temp, sizeof (temp), value);
+        status = jb_printf (b, ",\"%s\":", key);
+        if (status == 0)
+          status = jb_add_string (b, value);
         sfree (value);
-        BUFFER_ADD (",\"%s\":%s", key, temp);
       }
     }
     else if (type == MD_TYPE_SIGNED_INT)
     {
       int64_t value = 0;
       if (meta_data_get_signed_int (meta, key, &value) == 0)
-        BUFFER_ADD (",\"%s\":%"PRIi64, key, value);
+        status = jb_printf (b, ",\"%s\":%"PRIi64, key, value);
     }
     else if (type == MD_TYPE_UNSIGNED_INT)
     {
       uint64_t value = 0;
       if (meta_data_get_unsigned_int (meta, key, &value) == 0)
-        BUFFER_ADD (",\"%s\":%"PRIu64, key, value);
+        status = jb_printf (b, ",\"%s\":%"PRIu64, key, value);
     }
     else if (type == MD_TYPE_DOUBLE)
     {
       double value = 0.0;
       if (meta_data_get_double (meta, key, &value) == 0)
-        BUFFER_ADD (",\"%s\":%f", key, value);
+      {
+        status = jb_printf (b, ",\"%s\":", key);
+        if (status == 0)
+          status = jb_add_gauge (b, "%f", value);
+      }
     }
     else if (type == MD_TYPE_BOOLEAN)
     {
       _Bool value = 0;
       if (meta_data_get_boolean (meta, key, &value) == 0)
-        BUFFER_ADD (",\"%s\":%s", key, value ? "true" : "false");
+        status = jb_printf (b, ",\"%s\":%s", key,
+            value ? "true" : "false");
     }
 
     free (key);
   } /* for (keys) */
   free (keys);
 
-  if (offset <= 0)
-    return (ENOENT);
+  if (status != 0)
+    return (status);
 
-  buffer[0] = '{'; /* replace leading ',' */
-  BUFFER_ADD ("}");
+  if (b->fill <= start)
+    return (ENOENT);
 
-#undef BUFFER_ADD
+  b->data[start] = '{'; /* replace leading ',' */
+  JB_ADD (b, "}");
 
   return (0);
-} /* int meta_data_to_json */
+} /* }}} int meta_data_to_json */
 
-static int value_list_to_json (char *buffer, size_t buffer_size, /* {{{ */
-                const data_set_t *ds, const value_list_t *vl, int store_rates)
+/*
+ * Fragment cache
+ */
+struct fj_series_s
+{
+  /* Identity of the series. Points into "identity_buf" for cached entries
+   * and into the value list for lookups. */
+  char const *host;
+  char const *plugin;
+  char const *plugin_instance;
+  char const *type;
+  char const *type_instance;
+
+  char *identity_buf;
+
+  char  *identity_json;
+  size_t identity_json_len;
+
+  /* Owned by the data set tree. */
+  char const *ds_json;
+  size_t      ds_json_len;
+};
+typedef struct fj_series_s fj_series_t;
+
+struct format_json_cache_s
 {
-  char temp[512];
-  size_t offset = 0;
+  c_avl_tree_t *series;
+  int series_num;
+
+  /* Maps type names to their "dstypes" and "dsnames" fragment. */
+  c_avl_tree_t *data_sets;
+};
+
+static int fj_series_compare (void const *a, void const *b) /* {{{ */
+{
+  fj_series_t const *s0 = a;
+  fj_series_t const *s1 = b;
   int status;
 
-  memset (buffer, 0, buffer_size);
+  status = strcmp (s0->host, s1->host);
+  if (status == 0)
+    status = strcmp (s0->plugin, s1->plugin);
+  if (status == 0)
+    status = strcmp (s0->plugin_instance, s1->plugin_instance);
+  if (status == 0)
+    status = strcmp (s0->type, s1->type);
+  if (status == 0)
+    status = strcmp (s0->type_instance, s1->type_instance);
 
-#define BUFFER_ADD(...) do { \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
+  return (status);
+} /* }}} int fj_series_compare */
 
-  /* All value lists have a leading comma. The first one will be replaced with
-   * a square bracket in `format_json_finalize'. */
-  BUFFER_ADD (",{");
+static void fj_series_free (fj_series_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
 
-  status = values_to_json (temp, sizeof (temp), ds, vl, store_rates);
-  if (status != 0)
-    return (status);
-  BUFFER_ADD ("\"values\":%s", temp);
+  sfree (s->identity_buf);
+  sfree (s->identity_json);
+  sfree (s);
+} /* }}} void fj_series_free */
 
-  status = dstypes_to_json (temp, sizeof (temp), ds);
-  if (status != 0)
-    return (status);
-  BUFFER_ADD (",\"dstypes\":%s", temp);
+static void fj_cache_clear_series (format_json_cache_t *c) /* {{{ */
+{
+  void *key;
+  void *value;
 
-  status = dsnames_to_json (temp, sizeof (temp), ds);
-  if (status != 0)
-    return (status);
-  BUFFER_ADD (",\"dsnames\":%s", temp);
+  while (c_avl_pick (c->series, &key, &value) == 0)
+    fj_series_free (value);
+  c->series_num = 0;
+} /* }}} void fj_cache_clear_series */
+
+/* Returns the cached fragment of the data set, creating it if needed. */
+static char const *fj_cache_data_set (format_json_cache_t *c, /* {{{ */
+    data_set_t const *ds)
+{
+  format_json_buffer_t b = FORMAT_JSON_BUFFER_INIT;
+  char *key;
+
+  if (c_avl_get (c->data_sets, ds->type, (void *) &b.data) == 0)
+    return (b.data);
+
+  if (ds_to_json (&b, ds) != 0)
+  {
+    sfree (b.data);
+    return (NULL);
+  }
+
+  key = strdup (ds->type);
+  if ((key == NULL) || (c_avl_insert (c->data_sets, key, b.data) != 0))
+  {
+    sfree (key);
+    sfree (b.data);
+    return (NULL);
+  }
+
+  return (b.data);
+} /* }}} char const *fj_cache_data_set */
+
+static fj_series_t *fj_series_create (format_json_cache_t *c, /* {{{ */
+    data_set_t const *ds, value_list_t const *vl)
+{
+  format_json_buffer_t b = FORMAT_JSON_BUFFER_INIT;
+  fj_series_t *s;
+  size_t lens[5];
+  char *ptr;
 
-  BUFFER_ADD (",\"time\":%.3f", CDTIME_T_TO_DOUBLE (vl->time));
-  BUFFER_ADD (",\"interval\":%.3f", CDTIME_T_TO_DOUBLE (vl->interval));
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
 
-#define BUFFER_ADD_KEYVAL(key, value) do { \
-  status = escape_string (temp, sizeof (temp), (value)); \
-  if (status != 0) \
-    return (status); \
-  BUFFER_ADD (",\"%s\":%s", (key), temp); \
+  s->ds_json = fj_cache_data_set (c, ds);
+  if (s->ds_json == NULL)
+  {
+    fj_series_free (s);
+    return (NULL);
+  }
+  s->ds_json_len = strlen (s->ds_json);
+
+  lens[0] = strlen (vl->host) + 1;
+  lens[1] = strlen (vl->plugin) + 1;
+  lens[2] = strlen (vl->plugin_instance) + 1;
+  lens[3] = strlen (vl->type) + 1;
+  lens[4] = strlen (vl->type_instance) + 1;
+
+  s->identity_buf = malloc (lens[0] + lens[1] + lens[2] + lens[3] + lens[4]);
+  if (s->identity_buf == NULL)
+  {
+    fj_series_free (s);
+    return (NULL);
+  }
+
+  ptr = s->identity_buf;
+#define COPY_PART(field, i) do { \
+  memcpy (ptr, vl->field, lens[i]); \
+  s->field = ptr; \
+  ptr += lens[i]; \
 } while (0)
+  COPY_PART (host, 0);
+  COPY_PART (plugin, 1);
+  COPY_PART (plugin_instance, 2);
+  COPY_PART (type, 3);
+  COPY_PART (type_instance, 4);
+#undef COPY_PART
+
+  if (identity_to_json (&b, vl->host, vl->plugin, vl->plugin_instance,
+        vl->type, vl->type_instance) != 0)
+  {
+    sfree (b.data);
+    fj_series_free (s);
+    return (NULL);
+  }
+  s->identity_json = b.data;
+  s->identity_json_len = b.fill;
+
+  return (s);
+} /* }}} fj_series_t *fj_series_create */
+
+static fj_series_t *fj_cache_lookup (format_json_cache_t *c, /* {{{ */
+    data_set_t const *ds, value_list_t const *vl)
+{
+  fj_series_t lookup;
+  fj_series_t *s = NULL;
 
-  BUFFER_ADD_KEYVAL ("host", vl->host);
-  BUFFER_ADD_KEYVAL ("plugin", vl->plugin);
-  BUFFER_ADD_KEYVAL ("plugin_instance", vl->plugin_instance);
-  BUFFER_ADD_KEYVAL ("type", vl->type);
-  BUFFER_ADD_KEYVAL ("type_instance", vl->type_instance);
+  lookup.host = vl->host;
+  lookup.plugin = vl->plugin;
+  lookup.plugin_instance = vl->plugin_instance;
+  lookup.type = vl->type;
+  lookup.type_instance = vl->type_instance;
 
-  if (vl->meta != NULL)
+  if (c_avl_get (c->series, &lookup, (void *) &s) == 0)
+    return (s);
+
+  if (c->series_num >= FORMAT_JSON_CACHE_MAX)
+    fj_cache_clear_series (c);
+
+  s = fj_series_create (c, ds, vl);
+  if (s == NULL)
+    return (NULL);
+
+  if (c_avl_insert (c->series, s, s) != 0)
   {
-    char meta_buffer[buffer_size];
-    memset (meta_buffer, 0, sizeof (meta_buffer));
-    status = meta_data_to_json (meta_buffer, sizeof (meta_buffer), vl->meta);
-    if (status != 0)
-      return (status);
+    fj_series_free (s);
+    return (NULL);
+  }
+  c->series_num++;
 
-    BUFFER_ADD (",\"meta\":%s", meta_buffer);
-  } /* if (vl->meta != NULL) */
+  return (s);
+} /* }}} fj_series_t *fj_cache_lookup */
 
-  BUFFER_ADD ("}");
+format_json_cache_t *format_json_cache_create (void) /* {{{ */
+{
+  format_json_cache_t *c;
 
-#undef BUFFER_ADD_KEYVAL
-#undef BUFFER_ADD
+  c = calloc (1, sizeof (*c));
+  if (c == NULL)
+    return (NULL);
 
-  DEBUG ("format_json: value_list_to_json: buffer = %s;", buffer);
+  c->series = c_avl_create (fj_series_compare);
+  c->data_sets = c_avl_create ((int (*) (const void *, const void *)) strcmp);
+  if ((c->series == NULL) || (c->data_sets == NULL))
+  {
+    format_json_cache_destroy (c);
+    return (NULL);
+  }
 
-  return (0);
-} /* }}} int value_list_to_json */
+  return (c);
+} /* }}} format_json_cache_t *format_json_cache_create */
 
-static int format_json_value_list_nocheck (char *buffer, /* {{{ */
-    size_t *ret_buffer_fill, size_t *ret_buffer_free,
-    const data_set_t *ds, const value_list_t *vl,
-    int store_rates, size_t temp_size)
+void format_json_cache_destroy (format_json_cache_t *c) /* {{{ */
 {
-  char temp[temp_size];
-  int status;
+  void *key;
+  void *value;
 
-  status = value_list_to_json (temp, sizeof (temp), ds, vl, store_rates);
-  if (status != 0)
-    return (status);
-  temp_size = strlen (temp);
+  if (c == NULL)
+    return;
 
-  memcpy (buffer + (*ret_buffer_fill), temp, temp_size + 1);
-  (*ret_buffer_fill) += temp_size;
-  (*ret_buffer_free) -= temp_size;
+  if (c->series != NULL)
+  {
+    fj_cache_clear_series (c);
+    c_avl_destroy (c->series);
+  }
+
+  if (c->data_sets != NULL)
+  {
+    while (c_avl_pick (c->data_sets, &key, &value) == 0)
+    {
+      sfree (key);
+      sfree (value);
+    }
+    c_avl_destroy (c->data_sets);
+  }
+
+  sfree (c);
+} /* }}} void format_json_cache_destroy */
+
+/* Appends `,{...}' to "b". The identifier and data set fragments are taken
+ * from "c" if it is not NULL. */
+static int value_list_to_json (format_json_buffer_t *b, /* {{{ */
+                const data_set_t *ds, const value_list_t *vl, int store_rates,
+                format_json_cache_t *c)
+{
+  fj_series_t *s = NULL;
+
+  if (c != NULL)
+  {
+    s = fj_cache_lookup (c, ds, vl);
+    if (s == NULL)
+    {
+      ERROR ("format_json: Caching the JSON fragments failed.");
+      return (-1);
+    }
+  }
+
+  /* All value lists have a leading comma. The first one will be replaced with
+   * a square bracket in `format_json_finalize'. */
+  JB_ADD (b, ",{\"values\":");
+  JB_CALL (values_to_json (b, ds, vl, store_rates));
+
+  if (s != NULL)
+    JB_CALL (jb_add (b, s->ds_json, s->ds_json_len));
+  else
+    JB_CALL (ds_to_json (b, ds));
+
+  JB_CALL (jb_printf (b, ",\"time\":%.3f", CDTIME_T_TO_DOUBLE (vl->time)));
+  JB_CALL (jb_printf (b, ",\"interval\":%.3f",
+        CDTIME_T_TO_DOUBLE (vl->interval)));
+
+  if (s != NULL)
+    JB_CALL (jb_add (b, s->identity_json, s->identity_json_len));
+  else
+    JB_CALL (identity_to_json (b, vl->host, vl->plugin, vl->plugin_instance,
+          vl->type, vl->type_instance));
+
+  if (vl->meta != NULL)
+  {
+    size_t fill = b->fill;
+    int status;
+
+    JB_ADD (b, ",\"meta\":");
+    status = meta_data_to_json (b, vl->meta);
+    if (status == ENOENT)
+    {
+      /* No keys: drop the `"meta":' again. */
+      b->fill = fill;
+      b->data[fill] = 0;
+    }
+    else if (status != 0)
+      return (status);
+  } /* if (vl->meta != NULL) */
+
+  JB_ADD (b, "}");
 
   return (0);
-} /* }}} int format_json_value_list_nocheck */
+} /* }}} int value_list_to_json */
+
+#undef JB_CALL
+#undef JB_ADD
 
 int format_json_initialize (char *buffer, /* {{{ */
     size_t *ret_buffer_fill, size_t *ret_buffer_free)
@@ -419,7 +700,9 @@ int format_json_initialize (char *buffer, /* {{{ */
   if (buffer_free < 3)
     return (-ENOMEM);
 
-  memset (buffer, 0, buffer_free);
+  /* Everything appended later is null-terminated; don't clear the whole
+   * (possibly large) buffer. */
+  buffer[0] = 0;
   *ret_buffer_fill = buffer_fill;
   *ret_buffer_free = buffer_free;
 
@@ -453,10 +736,14 @@ int format_json_finalize (char *buffer, /* {{{ */
   return (0);
 } /* }}} int format_json_finalize */
 
-int format_json_value_list (char *buffer, /* {{{ */
+static int format_json_value_list_internal (char *buffer, /* {{{ */
     size_t *ret_buffer_fill, size_t *ret_buffer_free,
-    const data_set_t *ds, const value_list_t *vl, int store_rates)
+    const data_set_t *ds, const value_list_t *vl, int store_rates,
+    format_json_cache_t *cache)
 {
+  format_json_buffer_t b;
+  int status;
+
   if ((buffer == NULL)
       || (ret_buffer_fill == NULL) || (ret_buffer_free == NULL)
       || (ds == NULL) || (vl == NULL))
@@ -465,9 +752,46 @@ int format_json_value_list (char *buffer, /* {{{ */
   if (*ret_buffer_free < 3)
     return (-ENOMEM);
 
-  return (format_json_value_list_nocheck (buffer,
-        ret_buffer_fill, ret_buffer_free, ds, vl,
-        store_rates, (*ret_buffer_free) - 2));
+  /* Format directly into the caller's buffer, keeping two bytes for
+   * `format_json_finalize'. */
+  b.data = buffer;
+  b.fill = *ret_buffer_fill;
+  b.size = *ret_buffer_fill + *ret_buffer_free - 2;
+  b.grow = 0;
+
+  status = value_list_to_json (&b, ds, vl, store_rates, cache);
+  if (status != 0)
+  {
+    /* Don't leave a partial value list behind. */
+    buffer[*ret_buffer_fill] = 0;
+    return (status);
+  }
+
+  (*ret_buffer_free) -= b.fill - (*ret_buffer_fill);
+  (*ret_buffer_fill) = b.fill;
+
+  return (0);
+} /* }}} int format_json_value_list_internal */
+
+int format_json_value_list (char *buffer, /* {{{ */
+    size_t *ret_buffer_fill, size_t *ret_buffer_free,
+    const data_set_t *ds, const value_list_t *vl, int store_rates)
+{
+  return (format_json_value_list_internal (buffer,
+        ret_buffer_fill, ret_buffer_free, ds, vl, store_rates,
+        /* cache = */ NULL));
 } /* }}} int format_json_value_list */
 
+int format_json_value_list_cached (char *buffer, /* {{{ */
+    size_t *ret_buffer_fill, size_t *ret_buffer_free,
+    const data_set_t *ds, const value_list_t *vl, int store_rates,
+    format_json_cache_t *cache)
+{
+  if (cache == NULL)
+    return (-EINVAL);
+
+  return (format_json_value_list_internal (buffer,
+        ret_buffer_fill, ret_buffer_free, ds, vl, store_rates, cache));
+} /* }}} int format_json_value_list_cached */
+
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -33,4 +33,21 @@ int format_json_value_list (char *buffer,
 int format_json_finalize (char *buffer,
     size_t *ret_buffer_fill, size_t *ret_buffer_free);
 
+/* Caches the JSON fragments describing the identifier and the data set of
+ * each series, so that only the values, the time and the meta data have to
+ * be formatted for series seen before. Not thread-safe; the caller has to
+ * serialize access to a cache. */
+struct format_json_cache_s;
+typedef struct format_json_cache_s format_json_cache_t;
+
+format_json_cache_t *format_json_cache_create (void);
+void format_json_cache_destroy (format_json_cache_t *cache);
+
+/* Like format_json_value_list(), but takes the identifier and data set
+ * fragments from "cache". */
+int format_json_value_list_cached (char *buffer,
+    size_t *ret_buffer_fill, size_t *ret_buffer_free,
+    const data_set_t *ds, const value_list_t *vl, int store_rates,
+    format_json_cache_t *cache);
+
 #endif /* UTILS_FORMAT_JSON_H */
@@ -92,5 +92,20 @@ int c_heap_insert (c_heap_t *h, void *ptr);
  */
 void *c_heap_get_root (c_heap_t *h);
 
+/*
+ * NAME
+ *   c_heap_peek_root
+ *
+ * DESCRIPTION
+ *   Returns the value at the root of the heap without removing it.
+ *
+ * PARAMETERS
+ *   `h'           Heap to look at.
+ *
+ * RETURN VALUE
+ *   The pointer passed to `c_heap_insert' or NULL if the heap is empty.
+ */
+void *c_heap_peek_root (c_heap_t *h);
+
 #endif /* UTILS_HEAP_H */
 /* vim: set sw=2 sts=2 et : */
@@ -0,0 +1,204 @@
+/**
+ * collectd - src/utils_histogram.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "utils_histogram.h"
+
+#include <math.h>
+
+/* Each power of two, i.e. each exponent returned by frexp(3), is split into
+ * HISTOGRAM_SUB_BUCKETS buckets of equal width. Values smaller than
+ * 2^(HISTOGRAM_EXP_MIN - 1) are counted as zero, values of
+ * 2^(HISTOGRAM_EXP_MAX - 1) and above are counted in the last bucket. */
+#define HISTOGRAM_SUB_BUCKETS 32
+#define HISTOGRAM_EXP_MIN    -32
+#define HISTOGRAM_EXP_MAX     64
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_EXP_MAX - HISTOGRAM_EXP_MIN) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram_s
+{
+  /* Buckets for the absolute value of positive and negative values. */
+  uint32_t positive[HISTOGRAM_BUCKETS];
+  uint32_t negative[HISTOGRAM_BUCKETS];
+  uint64_t zero;
+  uint64_t count;
+
+  /* Used to keep estimates within the range of actual values. */
+  gauge_t min;
+  gauge_t max;
+};
+
+static size_t histogram_bucket (gauge_t value) /* {{{ */
+{
+  double mantissa;
+  int exponent;
+  int sub;
+
+  if (isinf (value))
+    return (HISTOGRAM_BUCKETS - 1);
+
+  /* 0.5 <= mantissa < 1.0 */
+  mantissa = frexp (value, &exponent);
+  if (exponent >= HISTOGRAM_EXP_MAX)
+    return (HISTOGRAM_BUCKETS - 1);
+
+  sub = (int) ((mantissa - 0.5) * (2.0 * HISTOGRAM_SUB_BUCKETS));
+  if (sub >= HISTOGRAM_SUB_BUCKETS)
+    sub = HISTOGRAM_SUB_BUCKETS - 1;
+
+  return ((size_t) (exponent - HISTOGRAM_EXP_MIN) * HISTOGRAM_SUB_BUCKETS
+      + (size_t) sub);
+} /* }}} size_t histogram_bucket */
+
+/* Returns the middle of the values counted in "bucket". */
+static gauge_t histogram_bucket_value (size_t bucket) /* {{{ */
+{
+  int exponent = (int) (bucket / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_EXP_MIN;
+  size_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+  return (ldexp (0.5 + (((double) sub) + 0.5) / (2.0 * HISTOGRAM_SUB_BUCKETS),
+        exponent));
+} /* }}} gauge_t histogram_bucket_value */
+
+histogram_t *histogram_create (void) /* {{{ */
+{
+  histogram_t *h;
+
+  h = malloc (sizeof (*h));
+  if (h == NULL)
+    return (NULL);
+
+  histogram_reset (h);
+  return (h);
+} /* }}} histogram_t *histogram_create */
+
+void histogram_destroy (histogram_t *h) /* {{{ */
+{
+  sfree (h);
+} /* }}} void histogram_destroy */
+
+void histogram_reset (histogram_t *h) /* {{{ */
+{
+  memset (h, 0, sizeof (*h));
+  h->min = NAN;
+  h->max = NAN;
+} /* }}} void histogram_reset */
+
+void histogram_add (histogram_t *h, gauge_t value) /* {{{ */
+{
+  if (isnan (value))
+    return;
+
+  if (fabs (value) < ldexp (0.5, HISTOGRAM_EXP_MIN))
+    h->zero++;
+  else if (value > 0.0)
+    h->positive[histogram_bucket (value)]++;
+  else
+    h->negative[histogram_bucket (-value)]++;
+  h->count++;
+
+  if (isnan (h->min) || (h->min > value))
+    h->min = value;
+  if (isnan (h->max) || (h->max < value))
+    h->max = value;
+} /* }}} void histogram_add */
+
+void histogram_merge (histogram_t *dst, histogram_t const *src) /* {{{ */
+{
+  size_t i;
+
+  if (src->count == 0)
+    return;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    dst->positive[i] += src->positive[i];
+    dst->negative[i] += src->negative[i];
+  }
+  dst->zero += src->zero;
+  dst->count += src->count;
+
+  if (isnan (dst->min) || (dst->min > src->min))
+    dst->min = src->min;
+  if (isnan (dst->max) || (dst->max < src->max))
+    dst->max = src->max;
+} /* }}} void histogram_merge */
+
+uint64_t histogram_count (histogram_t const *h) /* {{{ */
+{
+  return (h->count);
+} /* }}} uint64_t histogram_count */
+
+gauge_t histogram_percentile (histogram_t const *h, double percent) /* {{{ */
+{
+  uint64_t rank;
+  uint64_t sum = 0;
+  gauge_t value = NAN;
+  size_t i;
+
+  if ((h->count == 0) || !(percent > 0.0) || (percent > 100.0))
+    return (NAN);
+
+  /* The value with this (one-based) rank is being looked for. */
+  rank = (uint64_t) ceil (((double) h->count) * percent / 100.0);
+  if (rank < 1)
+    rank = 1;
+  else if (rank > h->count)
+    rank = h->count;
+
+  /* Negative values, starting with the smallest, i.e. the largest absolute
+   * value. */
+  for (i = HISTOGRAM_BUCKETS; i > 0; i--)
+  {
+    sum += h->negative[i - 1];
+    if (sum >= rank)
+    {
+      value = -histogram_bucket_value (i - 1);
+      break;
+    }
+  }
+
+  if (isnan (value))
+  {
+    sum += h->zero;
+    if (sum >= rank)
+      value = 0.0;
+  }
+
+  for (i = 0; isnan (value) && (i < HISTOGRAM_BUCKETS); i++)
+  {
+    sum += h->positive[i];
+    if (sum >= rank)
+      value = histogram_bucket_value (i);
+  }
+
+  if (value < h->min)
+    value = h->min;
+  else if (value > h->max)
+    value = h->max;
+
+  return (value);
+} /* }}} gauge_t histogram_percentile */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,112 @@
+/**
+ * collectd - src/utils_histogram.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_HISTOGRAM_H
+#define UTILS_HISTOGRAM_H 1
+
+#include "plugin.h"
+
+/*
+ * A histogram of gauge values with logarithmic buckets, used to estimate
+ * percentiles. Each power of two is split into 32 buckets, so estimates are
+ * within about 1.6% of the exact value, regardless of its magnitude.
+ * Histograms can be merged by adding their buckets, which makes it possible
+ * to fill several of them concurrently and combine them later.
+ *
+ * The functions are not thread-safe; the caller must serialize access to
+ * each histogram.
+ */
+struct histogram_s;
+typedef struct histogram_s histogram_t;
+
+/*
+ * NAME
+ *   histogram_create
+ *
+ * DESCRIPTION
+ *   Allocates a new, empty histogram.
+ *
+ * RETURN VALUE
+ *   A histogram_t-pointer upon success or NULL upon failure.
+ */
+histogram_t *histogram_create (void);
+
+/*
+ * NAME
+ *   histogram_destroy
+ *
+ * DESCRIPTION
+ *   Frees all memory used by the histogram.
+ */
+void histogram_destroy (histogram_t *h);
+
+/*
+ * NAME
+ *   histogram_reset
+ *
+ * DESCRIPTION
+ *   Removes all values from the histogram.
+ */
+void histogram_reset (histogram_t *h);
+
+/*
+ * NAME
+ *   histogram_add
+ *
+ * DESCRIPTION
+ *   Adds `value' to the histogram. NaN is ignored.
+ */
+void histogram_add (histogram_t *h, gauge_t value);
+
+/*
+ * NAME
+ *   histogram_merge
+ *
+ * DESCRIPTION
+ *   Adds all values of `src' to `dst'. `src' is not modified.
+ */
+void histogram_merge (histogram_t *dst, histogram_t const *src);
+
+/*
+ * NAME
+ *   histogram_count
+ *
+ * DESCRIPTION
+ *   Returns the number of values in the histogram.
+ */
+uint64_t histogram_count (histogram_t const *h);
+
+/*
+ * NAME
+ *   histogram_percentile
+ *
+ * DESCRIPTION
+ *   Estimates the value below which `percent' percent of the values in the
+ *   histogram lie.
+ *
+ * RETURN VALUE
+ *   The estimate, or NaN if the histogram is empty or `percent' is not in
+ *   the range (0, 100].
+ */
+gauge_t histogram_percentile (histogram_t const *h, double percent);
+
+#endif /* UTILS_HISTOGRAM_H */
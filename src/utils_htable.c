@@ -0,0 +1,331 @@
+/**
+ * collectd - src/utils_htable.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utils_htable.h"
+
+/* The table has a power of two slots and is grown before more than
+ * HTABLE_LOAD_PERCENT percent of them are used. Collisions are resolved by
+ * linear probing, which keeps the entries of a lookup next to each other. */
+#define HTABLE_SIZE_MIN     16
+#define HTABLE_LOAD_PERCENT 70
+
+/*
+ * private data types
+ */
+struct c_htable_slot_s
+{
+	uint64_t hash;
+	void *key; /* NULL if the slot is unused */
+	void *value;
+};
+typedef struct c_htable_slot_s c_htable_slot_t;
+
+struct c_htable_s
+{
+	c_htable_slot_t *slots;
+	size_t size;
+	size_t num;
+	/* c_htable_pick() continues searching here. */
+	size_t pick_pos;
+};
+
+struct c_htable_iterator_s
+{
+	c_htable_t *table;
+	size_t pos;
+};
+
+/*
+ * private functions
+ */
+/* 64 bit FNV-1a, the same hash as plugin_hash_string(). It is repeated here
+ * so that the table can be used without linking plugin.c. */
+static uint64_t htable_hash (const char *str)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char *ptr;
+
+	for (ptr = (const unsigned char *) str; *ptr != 0; ptr++)
+	{
+		hash ^= (uint64_t) *ptr;
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash);
+} /* uint64_t htable_hash */
+
+/* Returns the slot holding "key" or, if there is none, the unused slot it
+ * would be stored in. */
+static size_t htable_find (const c_htable_t *t, const char *key,
+		uint64_t hash)
+{
+	size_t mask = t->size - 1;
+	size_t i;
+
+	for (i = (size_t) (hash & mask);
+			t->slots[i].key != NULL;
+			i = (i + 1) & mask)
+	{
+		if ((t->slots[i].hash == hash)
+				&& (strcmp (t->slots[i].key, key) == 0))
+			break;
+	}
+
+	return (i);
+} /* size_t htable_find */
+
+static int htable_resize (c_htable_t *t, size_t new_size)
+{
+	c_htable_slot_t *old = t->slots;
+	size_t old_size = t->size;
+	size_t i;
+
+	t->slots = calloc (new_size, sizeof (*t->slots));
+	if (t->slots == NULL)
+	{
+		t->slots = old;
+		return (-1);
+	}
+	t->size = new_size;
+	t->pick_pos = 0;
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].key != NULL)
+			t->slots[htable_find (t, old[i].key, old[i].hash)] = old[i];
+
+	free (old);
+	return (0);
+} /* int htable_resize */
+
+/* Empties slot "i" and moves the following entries of the same run of used
+ * slots back where necessary, so lookups never hit a gap before reaching
+ * their entry. */
+static void htable_remove_slot (c_htable_t *t, size_t i)
+{
+	size_t mask = t->size - 1;
+	size_t j = i;
+
+	while (42)
+	{
+		size_t home;
+
+		j = (j + 1) & mask;
+		if (t->slots[j].key == NULL)
+			break;
+
+		/* Leave the entry where it is if its home slot lies cyclically in
+		 * (i, j]. */
+		home = (size_t) (t->slots[j].hash & mask);
+		if ((i <= j)
+				? ((i < home) && (home <= j))
+				: ((i < home) || (home <= j)))
+			continue;
+
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+
+	memset (t->slots + i, 0, sizeof (t->slots[i]));
+	t->num--;
+} /* void htable_remove_slot */
+
+/*
+ * public functions
+ */
+c_htable_t *c_htable_create (void)
+{
+	c_htable_t *t;
+
+	t = calloc (1, sizeof (*t));
+	if (t == NULL)
+		return (NULL);
+
+	t->slots = calloc (HTABLE_SIZE_MIN, sizeof (*t->slots));
+	if (t->slots == NULL)
+	{
+		free (t);
+		return (NULL);
+	}
+	t->size = HTABLE_SIZE_MIN;
+
+	return (t);
+} /* c_htable_t *c_htable_create */
+
+void c_htable_destroy (c_htable_t *t)
+{
+	if (t == NULL)
+		return;
+
+	free (t->slots);
+	free (t);
+} /* void c_htable_destroy */
+
+int c_htable_insert (c_htable_t *t, void *key, void *value)
+{
+	uint64_t hash;
+	size_t i;
+
+	if ((t == NULL) || (key == NULL))
+		return (-1);
+
+	hash = htable_hash (key);
+	i = htable_find (t, key, hash);
+	if (t->slots[i].key != NULL)
+		return (1);
+
+	if (((t->num + 1) * 100) > (t->size * HTABLE_LOAD_PERCENT))
+	{
+		if (htable_resize (t, 2 * t->size) != 0)
+			return (-1);
+		i = htable_find (t, key, hash);
+	}
+
+	t->slots[i].hash = hash;
+	t->slots[i].key = key;
+	t->slots[i].value = value;
+	t->num++;
+
+	return (0);
+} /* int c_htable_insert */
+
+int c_htable_remove (c_htable_t *t, const void *key,
+		void **rkey, void **rvalue)
+{
+	size_t i;
+
+	if ((t == NULL) || (key == NULL))
+		return (-1);
+
+	i = htable_find (t, key, htable_hash (key));
+	if (t->slots[i].key == NULL)
+		return (-1);
+
+	if (rkey != NULL)
+		*rkey = t->slots[i].key;
+	if (rvalue != NULL)
+		*rvalue = t->slots[i].value;
+
+	htable_remove_slot (t, i);
+	return (0);
+} /* int c_htable_remove */
+
+int c_htable_get (c_htable_t *t, const void *key, void **value)
+{
+	size_t i;
+
+	if ((t == NULL) || (key == NULL))
+		return (-1);
+
+	i = htable_find (t, key, htable_hash (key));
+	if (t->slots[i].key == NULL)
+		return (-1);
+
+	if (value != NULL)
+		*value = t->slots[i].value;
+
+	return (0);
+} /* int c_htable_get */
+
+int c_htable_pick (c_htable_t *t, void **key, void **value)
+{
+	size_t n;
+
+	if ((t == NULL) || (key == NULL) || (value == NULL))
+		return (-1);
+	if (t->num == 0)
+		return (-1);
+
+	/* Removing an entry may move others back into earlier slots, so the
+	 * search wraps around. */
+	for (n = 0; n < t->size; n++)
+	{
+		size_t i = (t->pick_pos + n) & (t->size - 1);
+
+		if (t->slots[i].key == NULL)
+			continue;
+
+		*key = t->slots[i].key;
+		*value = t->slots[i].value;
+
+		htable_remove_slot (t, i);
+		t->pick_pos = i;
+		return (0);
+	}
+
+	return (-1);
+} /* int c_htable_pick */
+
+c_htable_iterator_t *c_htable_get_iterator (c_htable_t *t)
+{
+	c_htable_iterator_t *iter;
+
+	if (t == NULL)
+		return (NULL);
+
+	iter = calloc (1, sizeof (*iter));
+	if (iter == NULL)
+		return (NULL);
+	iter->table = t;
+
+	return (iter);
+} /* c_htable_iterator_t *c_htable_get_iterator */
+
+int c_htable_iterator_next (c_htable_iterator_t *iter,
+		void **key, void **value)
+{
+	c_htable_t *t;
+
+	if ((iter == NULL) || (key == NULL) || (value == NULL))
+		return (-1);
+
+	t = iter->table;
+	for (; iter->pos < t->size; iter->pos++)
+	{
+		if (t->slots[iter->pos].key == NULL)
+			continue;
+
+		*key = t->slots[iter->pos].key;
+		*value = t->slots[iter->pos].value;
+		iter->pos++;
+		return (0);
+	}
+
+	return (-1);
+} /* int c_htable_iterator_next */
+
+void c_htable_iterator_destroy (c_htable_iterator_t *iter)
+{
+	free (iter);
+} /* void c_htable_iterator_destroy */
+
+int c_htable_size (c_htable_t *t)
+{
+	if (t == NULL)
+		return (0);
+	return ((int) t->num);
+} /* int c_htable_size */
@@ -0,0 +1,127 @@
+/**
+ * collectd - src/utils_htable.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_HTABLE_H
+#define UTILS_HTABLE_H 1
+
+/*
+ * A hash table with string keys, for lookups on hot paths. The entries are
+ * stored in one array, together with the hash of their key, so a lookup
+ * usually touches one or two cache lines and compares only one string.
+ * Unlike the AVL tree, the entries are not kept in any order. Otherwise the
+ * functions behave like their c_avl_* counterparts; see utils_avltree.h.
+ *
+ * The functions are not thread-safe.
+ */
+struct c_htable_s;
+typedef struct c_htable_s c_htable_t;
+
+struct c_htable_iterator_s;
+typedef struct c_htable_iterator_s c_htable_iterator_t;
+
+/*
+ * NAME
+ *   c_htable_create
+ * DESCRIPTION
+ *   Allocates a new, empty hash table for null-terminated string keys.
+ * RETURN VALUE
+ *   A c_htable_t-pointer upon success or NULL upon failure.
+ */
+c_htable_t *c_htable_create (void);
+
+/*
+ * NAME
+ *   c_htable_destroy
+ * DESCRIPTION
+ *   Deallocates a hash table. Stored value- and key-pointer are lost, but of
+ *   course not freed.
+ */
+void c_htable_destroy (c_htable_t *t);
+
+/*
+ * NAME
+ *   c_htable_insert
+ * DESCRIPTION
+ *   Stores the key-value-pair in the table. The key is _not_ copied and must
+ *   not be freed or modified before the entry is removed.
+ * RETURN VALUE
+ *   Zero upon success, non-zero otherwise. It's less than zero if an error
+ *   occurred or greater than zero if the key is already stored in the table.
+ */
+int c_htable_insert (c_htable_t *t, void *key, void *value);
+
+/*
+ * NAME
+ *   c_htable_remove
+ * DESCRIPTION
+ *   Removes a key-value-pair from the table. The stored key and value may be
+ *   returned in `rkey' and `rvalue', either of which may be NULL.
+ * RETURN VALUE
+ *   Zero upon success or non-zero if the key isn't found in the table.
+ */
+int c_htable_remove (c_htable_t *t, const void *key,
+		void **rkey, void **rvalue);
+
+/*
+ * NAME
+ *   c_htable_get
+ * DESCRIPTION
+ *   Retrieve the `value' belonging to `key'. `value' may be NULL.
+ * RETURN VALUE
+ *   Zero upon success or non-zero if the key isn't found in the table.
+ */
+int c_htable_get (c_htable_t *t, const void *key, void **value);
+
+/*
+ * NAME
+ *   c_htable_pick
+ * DESCRIPTION
+ *   Removes an arbitrary entry from the table and returns its `key' and
+ *   `value'. Intended for removing all entries, one at a time.
+ * RETURN VALUE
+ *   Zero upon success or non-zero if the table is empty or key or value is
+ *   NULL.
+ */
+int c_htable_pick (c_htable_t *t, void **key, void **value);
+
+/*
+ * NAME
+ *   c_htable_get_iterator, c_htable_iterator_next, c_htable_iterator_destroy
+ * DESCRIPTION
+ *   Iterates over all entries, in no particular order. The table must not be
+ *   modified while an iterator exists. c_htable_iterator_next() returns zero
+ *   and the next entry, or non-zero once all entries have been returned.
+ */
+c_htable_iterator_t *c_htable_get_iterator (c_htable_t *t);
+int c_htable_iterator_next (c_htable_iterator_t *iter,
+		void **key, void **value);
+void c_htable_iterator_destroy (c_htable_iterator_t *iter);
+
+/*
+ * NAME
+ *   c_htable_size
+ * DESCRIPTION
+ *   Returns the number of entries in the table, 0 if it is empty or NULL.
+ */
+int c_htable_size (c_htable_t *t);
+
+#endif /* UTILS_HTABLE_H */
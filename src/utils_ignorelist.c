@@ -57,29 +57,40 @@
 #include "plugin.h"
 #include "utils_ignorelist.h"
 
+#include "utils_htable.h"
+
 /*
  * private prototypes
  */
+#if HAVE_REGEX_H
 struct ignorelist_item_s
 {
-#if HAVE_REGEX_H
 	regex_t *rmatch;	/* regular expression entry identification */
-#endif
-	char *smatch;		/* string entry identification */
+	char *rstring;		/* source of "rmatch" */
+	_Bool combined;		/* part of "ignorelist_s.combined" */
 	struct ignorelist_item_s *next;
 };
 typedef struct ignorelist_item_s ignorelist_item_t;
+#endif
 
 struct ignorelist_s
 {
 	int ignore;		/* ignore entries */
-	ignorelist_item_t *head;	/* pointer to the first entry */
+	c_htable_t *strings;	/* string entries, looked up directly */
+#if HAVE_REGEX_H
+	ignorelist_item_t *head;	/* pointer to the first regex entry */
+	/* All regex entries which can be combined, joined into one expression
+	 * so that an entry is matched against all of them in one pass. NULL if
+	 * there are none or combining them failed. */
+	regex_t *combined;
+#endif
 };
 
 /* *** *** *** ********************************************* *** *** *** */
 /* *** *** *** *** *** ***   private functions   *** *** *** *** *** *** */
 /* *** *** *** ********************************************* *** *** *** */
 
+#if HAVE_REGEX_H
 static inline void ignorelist_append (ignorelist_t *il, ignorelist_item_t *item)
 {
 	assert ((il != NULL) && (item != NULL));
@@ -88,7 +99,93 @@ static inline void ignorelist_append (ignorelist_t *il, ignorelist_item_t *item)
 	il->head = item;
 }
 
-#if HAVE_REGEX_H
+/*
+ * Back-references refer to groups by number, which changes when
+ * expressions are combined. Expressions using them are matched on their
+ * own.
+ */
+static _Bool ignorelist_regex_combinable (const char *entry)
+{
+	const char *ptr;
+
+	for (ptr = entry; *ptr != 0; ptr++)
+	{
+		if (*ptr != '\\')
+			continue;
+		if (isdigit ((unsigned char) ptr[1]))
+			return (0);
+		if (ptr[1] != 0)
+			ptr++;
+	}
+
+	return (1);
+} /* _Bool ignorelist_regex_combinable (const char *entry) */
+
+/*
+ * (re)build "il->combined" as "(re1)|(re2)|..."
+ * return 0 on success
+ */
+static int ignorelist_combine (ignorelist_t *il)
+{
+	ignorelist_item_t *item;
+	regex_t *combined;
+	char *buffer;
+	size_t buffer_size = 1;
+	size_t buffer_fill = 0;
+	int status;
+
+	if (il->combined != NULL)
+	{
+		regfree (il->combined);
+		sfree (il->combined);
+	}
+	for (item = il->head; item != NULL; item = item->next)
+		item->combined = 0;
+
+	for (item = il->head; item != NULL; item = item->next)
+		if (ignorelist_regex_combinable (item->rstring))
+			buffer_size += strlen (item->rstring) + 3;
+	if (buffer_size == 1)
+		return (0);
+
+	buffer = malloc (buffer_size);
+	combined = calloc (1, sizeof (*combined));
+	if ((buffer == NULL) || (combined == NULL))
+	{
+		sfree (buffer);
+		sfree (combined);
+		return (-1);
+	}
+
+	for (item = il->head; item != NULL; item = item->next)
+	{
+		if (!ignorelist_regex_combinable (item->rstring))
+			continue;
+
+		status = ssnprintf (buffer + buffer_fill, buffer_size - buffer_fill,
+				"%s(%s)", (buffer_fill > 0) ? "|" : "", item->rstring);
+		buffer_fill += (size_t) status;
+	}
+
+	status = regcomp (combined, buffer, REG_EXTENDED | REG_NOSUB);
+	sfree (buffer);
+	if (status != 0)
+	{
+		/* Fall back to matching the expressions one by one. */
+		DEBUG ("Combining the regular expressions failed with status %i.",
+				status);
+		sfree (combined);
+		return (-1);
+	}
+
+	for (item = il->head; item != NULL; item = item->next)
+		if (ignorelist_regex_combinable (item->rstring))
+			item->combined = 1;
+	il->combined = combined;
+
+	return (0);
+} /* int ignorelist_combine (ignorelist_t *il) */
+
 static int ignorelist_append_regex(ignorelist_t *il, const char *entry)
 {
 	int rcompile;
@@ -144,29 +241,44 @@ static int ignorelist_append_regex(ignorelist_t *il, const char *entry)
 	}
 	memset (new, '\0', sizeof(ignorelist_item_t));
 	new->rmatch = regtemp;
+	new->rstring = sstrdup (entry);
 
 	/* append new entry */
 	ignorelist_append (il, new);
 
+	/* Entries are added when reading the configuration only, so rebuilding
+	 * the combined expression each time is cheap enough. */
+	ignorelist_combine (il);
+
 	return (0);
 } /* int ignorelist_append_regex(ignorelist_t *il, const char *entry) */
 #endif
 
 static int ignorelist_append_string(ignorelist_t *il, const char *entry)
 {
-	ignorelist_item_t *new;
+	char *key;
 
-	/* create new entry */
-	if ((new = malloc(sizeof(ignorelist_item_t))) == NULL )
+	if (il->strings == NULL)
+	{
+		il->strings = c_htable_create ();
+		if (il->strings == NULL)
+		{
+			ERROR ("cannot allocate new entry");
+			return (1);
+		}
+	}
+
+	/* duplicates are harmless */
+	if (c_htable_get (il->strings, entry, NULL) == 0)
+		return (0);
+
+	key = sstrdup (entry);
+	if (c_htable_insert (il->strings, key, NULL) != 0)
 	{
 		ERROR ("cannot allocate new entry");
+		sfree (key);
 		return (1);
 	}
-	memset (new, '\0', sizeof(ignorelist_item_t));
-	new->smatch = sstrdup(entry);
-
-	/* append new entry */
-	ignorelist_append (il, new);
 
 	return (0);
 } /* int ignorelist_append_string(ignorelist_t *il, const char *entry) */
@@ -176,33 +288,54 @@ static int ignorelist_append_string(ignorelist_t *il, const char *entry)
  * check list for entry regex match
  * return 1 if found
  */
-static int ignorelist_match_regex (ignorelist_item_t *item, const char *entry)
+static int ignorelist_match_regex (ignorelist_t *il, const char *entry)
 {
-	assert ((item != NULL) && (item->rmatch != NULL)
-			&& (entry != NULL) && (strlen (entry) > 0));
+	ignorelist_item_t *item;
 
-	/* match regex */
-	if (regexec (item->rmatch, entry, 0, NULL, 0) == 0)
+	assert ((il != NULL) && (entry != NULL) && (strlen (entry) > 0));
+
+	if ((il->combined != NULL)
+			&& (regexec (il->combined, entry, 0, NULL, 0) == 0))
 		return (1);
 
+	for (item = il->head; item != NULL; item = item->next)
+	{
+		if (item->combined)
+			continue;
+
+		/* match regex */
+		if (regexec (item->rmatch, entry, 0, NULL, 0) == 0)
+			return (1);
+	}
+
 	return (0);
-} /* int ignorelist_match_regex (ignorelist_item_t *item, const char *entry) */
+} /* int ignorelist_match_regex (ignorelist_t *il, const char *entry) */
 #endif
 
 /*
  * check list for entry string match
  * return 1 if found
  */
-static int ignorelist_match_string (ignorelist_item_t *item, const char *entry)
+static int ignorelist_match_string (ignorelist_t *il, const char *entry)
 {
-	assert ((item != NULL) && (item->smatch != NULL)
-			&& (entry != NULL) && (strlen (entry) > 0));
+	assert ((il != NULL) && (entry != NULL) && (strlen (entry) > 0));
 
-	if (strcmp (entry, item->smatch) == 0)
+	if ((il->strings != NULL) && (c_htable_get (il->strings, entry, NULL) == 0))
 		return (1);
 
 	return (0);
-} /* int ignorelist_match_string (ignorelist_item_t *item, const char *entry) */
+} /* int ignorelist_match_string (ignorelist_t *il, const char *entry) */
+
+static _Bool ignorelist_is_empty (ignorelist_t *il)
+{
+	if ((il->strings != NULL) && (c_htable_size (il->strings) > 0))
+		return (0);
+#if HAVE_REGEX_H
+	if (il->head != NULL)
+		return (0);
+#endif
+	return (1);
+} /* _Bool ignorelist_is_empty (ignorelist_t *il) */
 
 
 /* *** *** *** ******************************************** *** *** *** */
@@ -235,30 +368,45 @@ ignorelist_t *ignorelist_create (int invert)
  */
 void ignorelist_free (ignorelist_t *il)
 {
+#if HAVE_REGEX_H
 	ignorelist_item_t *this;
 	ignorelist_item_t *next;
+#endif
 
 	if (il == NULL)
 		return;
 
+	if (il->strings != NULL)
+	{
+		void *key;
+		void *value;
+
+		while (c_htable_pick (il->strings, &key, &value) == 0)
+			sfree (key);
+		c_htable_destroy (il->strings);
+		il->strings = NULL;
+	}
+
+#if HAVE_REGEX_H
 	for (this = il->head; this != NULL; this = next)
 	{
 		next = this->next;
-#if HAVE_REGEX_H
 		if (this->rmatch != NULL)
 		{
 			regfree (this->rmatch);
-			this->rmatch = NULL;
-		}
-#endif
-		if (this->smatch != NULL)
-		{
-			sfree (this->smatch);
-			this->smatch = NULL;
+			sfree (this->rmatch);
 		}
+		sfree (this->rstring);
 		sfree (this);
 	}
 
+	if (il->combined != NULL)
+	{
+		regfree (il->combined);
+		sfree (il->combined);
+	}
+#endif
+
 	sfree (il);
 	il = NULL;
 } /* void ignorelist_destroy (ignorelist_t *il) */
@@ -333,31 +481,20 @@ int ignorelist_add (ignorelist_t *il, const char *entry)
  */
 int ignorelist_match (ignorelist_t *il, const char *entry)
 {
-	ignorelist_item_t *traverse;
-
 	/* if no entries, collect all */
-	if ((il == NULL) || (il->head == NULL))
+	if ((il == NULL) || ignorelist_is_empty (il))
 		return (0);
 
 	if ((entry == NULL) || (strlen (entry) == 0))
 		return (0);
 
-	/* traverse list and check entries */
-	for (traverse = il->head; traverse != NULL; traverse = traverse->next)
-	{
+	if (ignorelist_match_string (il, entry))
+		return (il->ignore);
+
 #if HAVE_REGEX_H
-		if (traverse->rmatch != NULL)
-		{
-			if (ignorelist_match_regex (traverse, entry))
-				return (il->ignore);
-		}
-		else
+	if (ignorelist_match_regex (il, entry))
+		return (il->ignore);
 #endif
-		{
-			if (ignorelist_match_string (traverse, entry))
-				return (il->ignore);
-		}
-	} /* for traverse */
 
 	return (1 - il->ignore);
 } /* int ignorelist_match (ignorelist_t *il, const char *entry) */
@@ -27,6 +27,7 @@
 #include <string.h>
 
 #include "utils_llist.h"
+#include "utils_htable.h"
 
 /*
  * Private data types
@@ -36,8 +37,59 @@ struct llist_s
 	llentry_t *head;
 	llentry_t *tail;
 	int size;
+
+	/* Maps each key to the first entry with that key, so llist_search()
+	 * doesn't have to walk the list. NULL if the index could not be
+	 * maintained, in which case the list is searched linearly. */
+	c_htable_t *index;
 };
 
+/*
+ * Private functions
+ */
+static void llist_index_drop (llist_t *l)
+{
+	c_htable_destroy (l->index);
+	l->index = NULL;
+}
+
+/* Makes "e" the entry returned for its key, if "replace" is true or no
+ * entry with that key is indexed yet. */
+static void llist_index_add (llist_t *l, llentry_t *e, int replace)
+{
+	if ((l->index == NULL) || (e->key == NULL))
+		return;
+
+	if (replace)
+		c_htable_remove (l->index, e->key, NULL, NULL);
+
+	if (c_htable_insert (l->index, e->key, e) < 0)
+		llist_index_drop (l);
+}
+
+static void llist_index_remove (llist_t *l, llentry_t *e)
+{
+	llentry_t *other;
+	void *value = NULL;
+
+	if ((l->index == NULL) || (e->key == NULL))
+		return;
+
+	if ((c_htable_get (l->index, e->key, &value) != 0) || (value != e))
+		return;
+	c_htable_remove (l->index, e->key, NULL, NULL);
+
+	/* Another entry with the same key may follow; it is found now. */
+	for (other = l->head; other != NULL; other = other->next)
+	{
+		if ((other->key != NULL) && (strcmp (other->key, e->key) == 0))
+		{
+			llist_index_add (l, other, /* replace = */ 0);
+			break;
+		}
+	}
+}
+
 /*
  * Public functions
  */
@@ -51,6 +103,9 @@ llist_t *llist_create (void)
 
 	memset (ret, '\0', sizeof (llist_t));
 
+	/* Without an index the list still works, only searching is slower. */
+	ret->index = c_htable_create ();
+
 	return (ret);
 }
 
@@ -68,6 +123,7 @@ void llist_destroy (llist_t *l)
 		llentry_destroy (e_this);
 	}
 
+	c_htable_destroy (l->index);
 	free (l);
 }
 
@@ -103,6 +159,8 @@ void llist_append (llist_t *l, llentry_t *e)
 	l->tail = e;
 
 	++(l->size);
+
+	llist_index_add (l, e, /* replace = */ 0);
 }
 
 void llist_prepend (llist_t *l, llentry_t *e)
@@ -114,6 +172,8 @@ void llist_prepend (llist_t *l, llentry_t *e)
 		l->tail = e;
 
 	++(l->size);
+
+	llist_index_add (l, e, /* replace = */ 1);
 }
 
 void llist_remove (llist_t *l, llentry_t *e)
@@ -132,6 +192,8 @@ void llist_remove (llist_t *l, llentry_t *e)
 		l->tail = prev;
 
 	--(l->size);
+
+	llist_index_remove (l, e);
 }
 
 int llist_size (llist_t *l)
@@ -148,6 +210,15 @@ static int llist_strcmp (llentry_t *e, void *ud)
 
 llentry_t *llist_search (llist_t *l, const char *key)
 {
+	if ((l != NULL) && (l->index != NULL) && (key != NULL))
+	{
+		void *e = NULL;
+
+		if (c_htable_get (l->index, key, &e) != 0)
+			return (NULL);
+		return (e);
+	}
+
 	return (llist_search_custom (l, llist_strcmp, (void *)key));
 }
 
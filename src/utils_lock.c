@@ -0,0 +1,216 @@
+/**
+ * collectd - src/utils_lock.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "utils_lock.h"
+
+#if COLLECT_LOCKSTATS
+/* The counters of all mutexes with the same name. They are updated with
+ * atomic operations because mutexes sharing a name may be held by different
+ * threads at the same time. Entries are never freed. */
+struct c_lock_stats_s
+{
+  char name[DATA_MAX_NAME_LEN];
+  volatile uint64_t acquired;
+  volatile uint64_t contended;
+  volatile uint64_t wait;
+  volatile uint64_t hold;
+  struct c_lock_stats_s *next;
+};
+typedef struct c_lock_stats_s c_lock_stats_t;
+
+static c_lock_stats_t *stats_list = NULL;
+static pthread_mutex_t stats_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t lock_now (void) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (((uint64_t) ts.tv_sec) * 1000000000 + (uint64_t) ts.tv_nsec);
+} /* }}} uint64_t lock_now */
+
+static c_lock_stats_t *lock_stats_get (const char *name) /* {{{ */
+{
+  c_lock_stats_t *s;
+
+  if (name == NULL)
+    name = "unnamed";
+
+  pthread_mutex_lock (&stats_list_lock);
+  for (s = stats_list; s != NULL; s = s->next)
+    if (strcmp (s->name, name) == 0)
+      break;
+
+  if (s == NULL)
+  {
+    s = calloc (1, sizeof (*s));
+    if (s != NULL)
+    {
+      sstrncpy (s->name, name, sizeof (s->name));
+      s->next = stats_list;
+      stats_list = s;
+    }
+  }
+  pthread_mutex_unlock (&stats_list_lock);
+
+  return (s);
+} /* }}} c_lock_stats_t *lock_stats_get */
+
+/* Called with "m" held. */
+static void lock_acquired (c_mutex_t *m, _Bool contended, /* {{{ */
+    uint64_t wait, uint64_t now)
+{
+  if (m->stats == NULL)
+    m->stats = lock_stats_get (m->name);
+
+  if (m->stats != NULL)
+  {
+    __sync_fetch_and_add (&m->stats->acquired, 1);
+    if (contended)
+    {
+      __sync_fetch_and_add (&m->stats->contended, 1);
+      __sync_fetch_and_add (&m->stats->wait, wait);
+    }
+  }
+
+  m->locked = now;
+} /* }}} void lock_acquired */
+
+/* Called with "m" held, before it is released. */
+static void lock_released (c_mutex_t *m) /* {{{ */
+{
+  if (m->stats != NULL)
+    __sync_fetch_and_add (&m->stats->hold, lock_now () - m->locked);
+} /* }}} void lock_released */
+
+int c_mutex_init (c_mutex_t *m, const char *name) /* {{{ */
+{
+  m->name = name;
+  m->stats = NULL;
+  m->locked = 0;
+
+  return (pthread_mutex_init (&m->mutex, /* attr = */ NULL));
+} /* }}} int c_mutex_init */
+
+int c_mutex_destroy (c_mutex_t *m) /* {{{ */
+{
+  return (pthread_mutex_destroy (&m->mutex));
+} /* }}} int c_mutex_destroy */
+
+int c_mutex_lock (c_mutex_t *m) /* {{{ */
+{
+  uint64_t start;
+  uint64_t now;
+  int status;
+
+  status = pthread_mutex_trylock (&m->mutex);
+  if (status == 0)
+  {
+    lock_acquired (m, /* contended = */ 0, /* wait = */ 0, lock_now ());
+    return (0);
+  }
+  else if (status != EBUSY)
+    return (status);
+
+  start = lock_now ();
+  status = pthread_mutex_lock (&m->mutex);
+  if (status != 0)
+    return (status);
+  now = lock_now ();
+
+  lock_acquired (m, /* contended = */ 1, now - start, now);
+  return (0);
+} /* }}} int c_mutex_lock */
+
+int c_mutex_trylock (c_mutex_t *m) /* {{{ */
+{
+  int status;
+
+  status = pthread_mutex_trylock (&m->mutex);
+  if (status == 0)
+    lock_acquired (m, /* contended = */ 0, /* wait = */ 0, lock_now ());
+
+  return (status);
+} /* }}} int c_mutex_trylock */
+
+int c_mutex_unlock (c_mutex_t *m) /* {{{ */
+{
+  lock_released (m);
+  return (pthread_mutex_unlock (&m->mutex));
+} /* }}} int c_mutex_unlock */
+
+int c_cond_wait (pthread_cond_t *c, c_mutex_t *m) /* {{{ */
+{
+  int status;
+
+  lock_released (m);
+  status = pthread_cond_wait (c, &m->mutex);
+  m->locked = lock_now ();
+
+  return (status);
+} /* }}} int c_cond_wait */
+
+int c_cond_timedwait (pthread_cond_t *c, c_mutex_t *m, /* {{{ */
+    const struct timespec *abstime)
+{
+  int status;
+
+  lock_released (m);
+  status = pthread_cond_timedwait (c, &m->mutex, abstime);
+  m->locked = lock_now ();
+
+  return (status);
+} /* }}} int c_cond_timedwait */
+
+void c_lock_stats (void (*callback) (const char *name, /* {{{ */
+      uint64_t acquired, uint64_t contended, cdtime_t wait, cdtime_t hold,
+      void *user_data),
+    void *user_data)
+{
+  c_lock_stats_t *s;
+
+  if (callback == NULL)
+    return;
+
+  /* Entries are only ever prepended, so the list can be walked without
+   * holding the lock once its head has been read. */
+  pthread_mutex_lock (&stats_list_lock);
+  s = stats_list;
+  pthread_mutex_unlock (&stats_list_lock);
+
+  for (; s != NULL; s = s->next)
+    (*callback) (s->name, (uint64_t) s->acquired, (uint64_t) s->contended,
+        NS_TO_CDTIME_T (s->wait), NS_TO_CDTIME_T (s->hold), user_data);
+} /* }}} void c_lock_stats */
+#else /* !COLLECT_LOCKSTATS */
+void c_lock_stats (void __attribute__((unused)) (*callback) (const char *name, /* {{{ */
+      uint64_t acquired, uint64_t contended, cdtime_t wait, cdtime_t hold,
+      void *user_data),
+    void __attribute__((unused)) *user_data)
+{
+  /* Not compiled in. */
+} /* }}} void c_lock_stats */
+#endif /* !COLLECT_LOCKSTATS */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,98 @@
+/**
+ * collectd - src/utils_lock.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_LOCK_H
+#define UTILS_LOCK_H 1
+
+#include "collectd.h"
+#include "utils_time.h"
+
+#include <pthread.h>
+
+/*
+ * Mutexes which count how often they were acquired, how often a thread had
+ * to wait for them and for how long they were waited for and held. The
+ * counters are aggregated by the name given to the mutex, so that e.g. the
+ * locks of all instances of a write plugin show up as one. Use a string
+ * literal as name: it is not copied.
+ *
+ * The counting is only compiled in with "configure --enable-lockstats".
+ * Otherwise c_mutex_t is a plain pthread_mutex_t and all functions are
+ * macros for their pthread counterparts.
+ */
+#if COLLECT_LOCKSTATS
+struct c_lock_stats_s;
+
+struct c_mutex_s
+{
+  pthread_mutex_t mutex;
+  const char *name;
+  /* Looked up by the first thread acquiring the mutex. */
+  struct c_lock_stats_s *stats;
+  /* When the current holder acquired the mutex, in nanoseconds. */
+  uint64_t locked;
+};
+typedef struct c_mutex_s c_mutex_t;
+
+# define C_MUTEX_INITIALIZER(name) { PTHREAD_MUTEX_INITIALIZER, (name), NULL, 0 }
+
+int c_mutex_init (c_mutex_t *m, const char *name);
+int c_mutex_destroy (c_mutex_t *m);
+int c_mutex_lock (c_mutex_t *m);
+int c_mutex_trylock (c_mutex_t *m);
+int c_mutex_unlock (c_mutex_t *m);
+/* The time spent waiting for the condition counts neither as waiting for
+ * nor as holding the mutex. */
+int c_cond_wait (pthread_cond_t *c, c_mutex_t *m);
+int c_cond_timedwait (pthread_cond_t *c, c_mutex_t *m,
+    const struct timespec *abstime);
+#else /* !COLLECT_LOCKSTATS */
+typedef pthread_mutex_t c_mutex_t;
+
+# define C_MUTEX_INITIALIZER(name) PTHREAD_MUTEX_INITIALIZER
+
+# define c_mutex_init(m, name) pthread_mutex_init ((m), /* attr = */ NULL)
+# define c_mutex_destroy(m) pthread_mutex_destroy (m)
+# define c_mutex_lock(m) pthread_mutex_lock (m)
+# define c_mutex_trylock(m) pthread_mutex_trylock (m)
+# define c_mutex_unlock(m) pthread_mutex_unlock (m)
+# define c_cond_wait(c, m) pthread_cond_wait ((c), (m))
+# define c_cond_timedwait(c, m, abstime) pthread_cond_timedwait ((c), (m), (abstime))
+#endif /* !COLLECT_LOCKSTATS */
+
+/*
+ * NAME
+ *   c_lock_stats
+ *
+ * DESCRIPTION
+ *   Calls `callback' once for each name a c_mutex_t has been acquired with.
+ *   `acquired' is the number of times it was acquired, `contended' the
+ *   number of times a thread had to wait, `wait' and `hold' the total time
+ *   spent waiting for and holding the mutexes. The counters are not reset.
+ *   Does nothing unless built with "--enable-lockstats".
+ */
+void c_lock_stats (void (*callback) (const char *name,
+      uint64_t acquired, uint64_t contended, cdtime_t wait, cdtime_t hold,
+      void *user_data),
+    void *user_data);
+
+#endif /* UTILS_LOCK_H */
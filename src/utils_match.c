@@ -33,6 +33,7 @@
 
 struct cu_match_s
 {
+  char *regex_str;
   regex_t regex;
   regex_t excluderegex;
   int flags;
@@ -40,36 +41,18 @@ struct cu_match_s
   int (*callback) (const char *str, char * const *matches, size_t matches_num,
       void *user_data);
   void *user_data;
+
+  /* The (sub-)matches passed to the callback, each null-terminated. Reused
+   * for every line, so applying a match doesn't allocate memory. */
+  char *buffer;
+  size_t buffer_size;
 };
 
+#define UTILS_MATCH_MAX 32
+
 /*
  * Private functions
  */
-static char *match_substr (const char *str, int begin, int end)
-{
-  char *ret;
-  size_t ret_len;
-
-  if ((begin < 0) || (end < 0) || (begin >= end))
-    return (NULL);
-  if ((size_t) end > (strlen (str) + 1))
-  {
-    ERROR ("utils_match: match_substr: `end' points after end of string.");
-    return (NULL);
-  }
-
-  ret_len = end - begin;
-  ret = (char *) malloc (sizeof (char) * (ret_len + 1));
-  if (ret == NULL)
-  {
-    ERROR ("utils_match: match_substr: malloc failed.");
-    return (NULL);
-  }
-
-  sstrncpy (ret, str + begin, ret_len + 1);
-  return (ret);
-} /* char *match_substr */
-
 static int default_callback (const char __attribute__((unused)) *str,
     char * const *matches, size_t matches_num, void *user_data)
 {
@@ -228,20 +211,32 @@ cu_match_t *match_create_callback (const char *regex, const char *excluderegex,
     return (NULL);
   memset (obj, '\0', sizeof (cu_match_t));
 
+  obj->regex_str = strdup (regex);
+  if (obj->regex_str == NULL)
+  {
+    sfree (obj);
+    return (NULL);
+  }
+
   status = regcomp (&obj->regex, regex, REG_EXTENDED | REG_NEWLINE);
   if (status != 0)
   {
     ERROR ("Compiling the regular expression \"%s\" failed.", regex);
+    sfree (obj->regex_str);
     sfree (obj);
     return (NULL);
   }
 
   if (excluderegex && strcmp(excluderegex, "") != 0) {
-    status = regcomp (&obj->excluderegex, excluderegex, REG_EXTENDED);
+    /* Only used to check whether it matches at all. */
+    status = regcomp (&obj->excluderegex, excluderegex,
+	REG_EXTENDED | REG_NOSUB);
     if (status != 0)
     {
 	ERROR ("Compiling the excluding regular expression \"%s\" failed.",
 	       excluderegex);
+	regfree (&obj->regex);
+	sfree (obj->regex_str);
 	sfree (obj);
 	return (NULL);
     }
@@ -289,23 +284,42 @@ void match_destroy (cu_match_t *obj)
     sfree (obj->user_data);
   }
 
+  regfree (&obj->regex);
+  if (obj->flags & UTILS_MATCH_FLAGS_EXCLUDE_REGEX)
+    regfree (&obj->excluderegex);
+  sfree (obj->buffer);
+  sfree (obj->regex_str);
   sfree (obj);
 } /* void match_destroy */
 
 int match_apply (cu_match_t *obj, const char *str)
 {
   int status;
-  regmatch_t re_match[32];
-  char *matches[32];
+  regmatch_t re_match[UTILS_MATCH_MAX];
+  char *matches[UTILS_MATCH_MAX];
   size_t matches_num;
+  size_t nmatch;
+  size_t size;
   size_t i;
 
   if ((obj == NULL) || (str == NULL))
     return (-1);
 
+  /* Only ask for the submatches the regex has. */
+  nmatch = obj->regex.re_nsub + 1;
+  if (nmatch > STATIC_ARRAY_SIZE (re_match))
+    nmatch = STATIC_ARRAY_SIZE (re_match);
+
+  status = regexec (&obj->regex, str, nmatch, re_match, /* eflags = */ 0);
+
+  /* Regex did not match */
+  if (status != 0)
+    return (0);
+
+  /* Checked second, as most lines usually don't match the regex. */
   if (obj->flags & UTILS_MATCH_FLAGS_EXCLUDE_REGEX) {
     status = regexec (&obj->excluderegex, str,
-		      STATIC_ARRAY_SIZE (re_match), re_match,
+		      /* nmatch = */ 0, /* pmatch = */ NULL,
 		      /* eflags = */ 0);
     /* Regex did match, so exclude this line */
     if (status == 0) {
@@ -314,51 +328,62 @@ int match_apply (cu_match_t *obj, const char *str)
     }
   }
 
-  status = regexec (&obj->regex, str,
-      STATIC_ARRAY_SIZE (re_match), re_match,
-      /* eflags = */ 0);
-
-  /* Regex did not match */
-  if (status != 0)
-    return (0);
-
-  memset (matches, '\0', sizeof (matches));
-  for (matches_num = 0; matches_num < STATIC_ARRAY_SIZE (matches); matches_num++)
+  size = 0;
+  for (matches_num = 0; matches_num < nmatch; matches_num++)
   {
     if ((re_match[matches_num].rm_so < 0)
-	|| (re_match[matches_num].rm_eo < 0))
-      break;
-
-    matches[matches_num] = match_substr (str,
-	re_match[matches_num].rm_so, re_match[matches_num].rm_eo);
-    if (matches[matches_num] == NULL)
-    {
-      status = -1;
+	|| (re_match[matches_num].rm_eo < re_match[matches_num].rm_so))
       break;
-    }
+    size += (size_t) (re_match[matches_num].rm_eo
+	- re_match[matches_num].rm_so) + 1;
   }
 
-  if (status != 0)
-  {
-    ERROR ("utils_match: match_apply: match_substr failed.");
-  }
-  else
+  if (size > obj->buffer_size)
   {
-    status = obj->callback (str, matches, matches_num, obj->user_data);
-    if (status != 0)
+    size_t new_size = (obj->buffer_size > 0) ? obj->buffer_size : 64;
+    char *tmp;
+
+    while (new_size < size)
+      new_size *= 2;
+
+    tmp = realloc (obj->buffer, new_size);
+    if (tmp == NULL)
     {
-      ERROR ("utils_match: match_apply: callback failed.");
+      ERROR ("utils_match: match_apply: realloc failed.");
+      return (-1);
     }
+    obj->buffer = tmp;
+    obj->buffer_size = new_size;
   }
 
+  /* Copy the matches into the buffer, one after another. */
+  size = 0;
   for (i = 0; i < matches_num; i++)
   {
-    sfree (matches[i]);
+    size_t len = (size_t) (re_match[i].rm_eo - re_match[i].rm_so);
+
+    matches[i] = obj->buffer + size;
+    memcpy (matches[i], str + re_match[i].rm_so, len);
+    matches[i][len] = 0;
+    size += len + 1;
+  }
+
+  status = obj->callback (str, matches, matches_num, obj->user_data);
+  if (status != 0)
+  {
+    ERROR ("utils_match: match_apply: callback failed.");
   }
 
   return (status);
 } /* int match_apply */
 
+const char *match_get_regex (cu_match_t *obj)
+{
+  if (obj == NULL)
+    return (NULL);
+  return (obj->regex_str);
+} /* const char *match_get_regex */
+
 void *match_get_user_data (cu_match_t *obj)
 {
   if (obj == NULL)
@@ -133,6 +133,8 @@ void match_destroy (cu_match_t *obj);
  * DESCRIPTION
  *  Tries to match the string `str' with the regular expression of `obj'. If
  *  the string matches, calls the callback in `obj' with the (sub-)match.
+ *  The (sub-)matches are null-terminated copies in a buffer of `obj', which is
+ *  reused for the next line; they are only valid during the callback.
  *
  *  The user_data pointer passed to `match_create_callback' is NOT freed
  *  automatically. The `cu_match_value_t' structure allocated by
@@ -150,6 +152,15 @@ int match_apply (cu_match_t *obj, const char *str);
  */
 void *match_get_user_data (cu_match_t *obj);
 
+/*
+ * NAME
+ *  match_get_regex
+ *
+ * DESCRIPTION
+ *  Returns the regular expression passed to `match_create_callback'.
+ */
+const char *match_get_regex (cu_match_t *obj);
+
 #endif /* UTILS_MATCH_H */
 
 /* vim: set sw=2 sts=2 ts=8 : */
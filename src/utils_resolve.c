@@ -0,0 +1,396 @@
+/**
+ * collectd - src/utils_resolve.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "configfile.h"
+#include "utils_resolve.h"
+
+#include <pthread.h>
+
+/* Failed lookups are repeated after this many seconds, or after the TTL if
+ * that is shorter. */
+#define URES_RETRY_INTERVAL 10.0
+
+struct ures_entry_s;
+typedef struct ures_entry_s ures_entry_t;
+
+struct ures_entry_s
+{
+  /* The key. Only the flags, family, socket type and protocol of "hints" are
+   * used. */
+  char *node;
+  char *service;
+  struct addrinfo hints;
+  _Bool has_hints;
+
+  /* The last answer, or NULL and the error of the last lookup in "status",
+   * or EAI_AGAIN if there hasn't been one yet. */
+  struct addrinfo *list;
+  int status;
+  cdtime_t expires;
+  /* Set while the entry waits for or is looked up by the thread. */
+  _Bool queued;
+
+  ures_entry_t *next;
+};
+
+/* Protects all of the below and the entries. */
+static pthread_mutex_t ures_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ures_cond = PTHREAD_COND_INITIALIZER;
+static ures_entry_t *ures_entries = NULL;
+static size_t ures_queue_len = 0;
+static pthread_t ures_thread;
+static _Bool ures_thread_running = 0;
+static _Bool ures_stopped = 0;
+
+static cdtime_t ures_ttl (void) /* {{{ */
+{
+  double ttl = atof (global_option_get ("ResolverCacheTTL"));
+
+  if (ttl < 0.0)
+    ttl = 0.0;
+  return (DOUBLE_TO_CDTIME_T (ttl));
+} /* }}} cdtime_t ures_ttl */
+
+/* Copies "src" into one allocation per address, so that the copy can be
+ * freed without freeaddrinfo(3). */
+static struct addrinfo *ures_copy (const struct addrinfo *src) /* {{{ */
+{
+  struct addrinfo *head = NULL;
+  struct addrinfo **tail = &head;
+
+  for (; src != NULL; src = src->ai_next)
+  {
+    struct addrinfo *ai;
+    size_t canon_len = (src->ai_canonname != NULL)
+      ? strlen (src->ai_canonname) + 1 : 0;
+    char *ptr;
+
+    ai = malloc (sizeof (*ai) + src->ai_addrlen + canon_len);
+    if (ai == NULL)
+    {
+      ures_freeaddrinfo (head);
+      return (NULL);
+    }
+
+    memcpy (ai, src, sizeof (*ai));
+    ai->ai_next = NULL;
+    ptr = (char *) (ai + 1);
+
+    ai->ai_addr = (struct sockaddr *) ptr;
+    memcpy (ptr, src->ai_addr, src->ai_addrlen);
+    ptr += src->ai_addrlen;
+
+    if (canon_len > 0)
+    {
+      ai->ai_canonname = ptr;
+      memcpy (ptr, src->ai_canonname, canon_len);
+    }
+
+    *tail = ai;
+    tail = &ai->ai_next;
+  }
+
+  return (head);
+} /* }}} struct addrinfo *ures_copy */
+
+static _Bool ures_string_equal (const char *a, const char *b) /* {{{ */
+{
+  if ((a == NULL) || (b == NULL))
+    return (a == b);
+  return (strcmp (a, b) == 0);
+} /* }}} _Bool ures_string_equal */
+
+/* Returns the entry of the arguments, creating it if necessary. Call with
+ * "ures_lock" held. */
+static ures_entry_t *ures_entry_get (const char *node, /* {{{ */
+    const char *service, const struct addrinfo *hints)
+{
+  ures_entry_t *e;
+
+  for (e = ures_entries; e != NULL; e = e->next)
+  {
+    if (!ures_string_equal (e->node, node)
+        || !ures_string_equal (e->service, service)
+        || (e->has_hints != (hints != NULL)))
+      continue;
+    if ((hints != NULL)
+        && ((e->hints.ai_flags != hints->ai_flags)
+          || (e->hints.ai_family != hints->ai_family)
+          || (e->hints.ai_socktype != hints->ai_socktype)
+          || (e->hints.ai_protocol != hints->ai_protocol)))
+      continue;
+    return (e);
+  }
+
+  e = calloc (1, sizeof (*e));
+  if (e == NULL)
+    return (NULL);
+
+  e->node = (node != NULL) ? strdup (node) : NULL;
+  e->service = (service != NULL) ? strdup (service) : NULL;
+  if (((node != NULL) && (e->node == NULL))
+      || ((service != NULL) && (e->service == NULL)))
+  {
+    sfree (e->node);
+    sfree (e->service);
+    sfree (e);
+    return (NULL);
+  }
+
+  if (hints != NULL)
+  {
+    e->hints.ai_flags = hints->ai_flags;
+    e->hints.ai_family = hints->ai_family;
+    e->hints.ai_socktype = hints->ai_socktype;
+    e->hints.ai_protocol = hints->ai_protocol;
+    e->has_hints = 1;
+  }
+  e->status = EAI_AGAIN;
+
+  e->next = ures_entries;
+  ures_entries = e;
+  return (e);
+} /* }}} ures_entry_t *ures_entry_get */
+
+/* Stores the result of a lookup of "e". Call with "ures_lock" held. */
+static void ures_entry_update (ures_entry_t *e, int status, /* {{{ */
+    struct addrinfo *list)
+{
+  cdtime_t now = cdtime ();
+  cdtime_t ttl = ures_ttl ();
+
+  if ((status == 0) && (list != NULL))
+  {
+    ures_freeaddrinfo (e->list);
+    e->list = list;
+    e->status = 0;
+    e->expires = now + ttl;
+    return;
+  }
+
+  if (status == 0)
+    status = EAI_MEMORY;
+  if (ttl > DOUBLE_TO_CDTIME_T (URES_RETRY_INTERVAL))
+    ttl = DOUBLE_TO_CDTIME_T (URES_RETRY_INTERVAL);
+  e->expires = now + ttl;
+
+  if (e->list != NULL)
+  {
+    NOTICE ("utils_resolve: Looking up \"%s\" failed, keeping the previous "
+        "addresses: %s", (e->node != NULL) ? e->node : "(null)",
+        gai_strerror (status));
+    return;
+  }
+  e->status = status;
+} /* }}} void ures_entry_update */
+
+/* Looks up "e" without holding the lock. The entry isn't freed meanwhile,
+ * since that only happens in ures_shutdown() once the thread has exited and
+ * callers have returned. */
+static int ures_entry_lookup (const ures_entry_t *e, /* {{{ */
+    struct addrinfo **ret_list)
+{
+  struct addrinfo *list = NULL;
+  int status;
+
+  *ret_list = NULL;
+  status = getaddrinfo (e->node, e->service,
+      e->has_hints ? &e->hints : NULL, &list);
+  if (status != 0)
+    return (status);
+
+  *ret_list = ures_copy (list);
+  freeaddrinfo (list);
+  return ((*ret_list == NULL) ? EAI_MEMORY : 0);
+} /* }}} int ures_entry_lookup */
+
+static void *ures_thread_main (void __attribute__((unused)) *arg) /* {{{ */
+{
+  pthread_mutex_lock (&ures_lock);
+  while (!ures_stopped)
+  {
+    struct addrinfo *list;
+    ures_entry_t *e;
+    int status;
+
+    if (ures_queue_len == 0)
+    {
+      pthread_cond_wait (&ures_cond, &ures_lock);
+      continue;
+    }
+
+    for (e = ures_entries; e != NULL; e = e->next)
+      if (e->queued)
+        break;
+    assert (e != NULL);
+
+    pthread_mutex_unlock (&ures_lock);
+    status = ures_entry_lookup (e, &list);
+    pthread_mutex_lock (&ures_lock);
+
+    ures_entry_update (e, status, list);
+    e->queued = 0;
+    ures_queue_len--;
+  }
+  pthread_mutex_unlock (&ures_lock);
+
+  return (NULL);
+} /* }}} void *ures_thread_main */
+
+/* Has the thread look up "e" again. Call with "ures_lock" held. */
+static void ures_entry_queue (ures_entry_t *e) /* {{{ */
+{
+  if (e->queued)
+    return;
+
+  if (!ures_thread_running)
+  {
+    int status = plugin_thread_create (&ures_thread, /* attr = */ NULL,
+        ures_thread_main, /* arg = */ NULL);
+    if (status != 0)
+    {
+      char errbuf[1024];
+      ERROR ("utils_resolve: Starting the resolver thread failed: %s",
+          sstrerror (status, errbuf, sizeof (errbuf)));
+      return;
+    }
+    ures_thread_running = 1;
+  }
+
+  e->queued = 1;
+  ures_queue_len++;
+  pthread_cond_signal (&ures_cond);
+} /* }}} void ures_entry_queue */
+
+int ures_getaddrinfo (const char *node, const char *service, /* {{{ */
+    const struct addrinfo *hints, _Bool wait, struct addrinfo **ret_list)
+{
+  struct addrinfo *list;
+  ures_entry_t *e;
+  int status;
+
+  if (ret_list == NULL)
+    return (EAI_FAIL);
+  *ret_list = NULL;
+
+  pthread_mutex_lock (&ures_lock);
+
+  if (ures_stopped)
+  {
+    pthread_mutex_unlock (&ures_lock);
+    if (!wait)
+      return (EAI_AGAIN);
+    status = getaddrinfo (node, service, hints, &list);
+    if (status != 0)
+      return (status);
+    *ret_list = ures_copy (list);
+    freeaddrinfo (list);
+    return ((*ret_list == NULL) ? EAI_MEMORY : 0);
+  }
+
+  e = ures_entry_get (node, service, hints);
+  if (e == NULL)
+  {
+    pthread_mutex_unlock (&ures_lock);
+    return (EAI_MEMORY);
+  }
+
+  if (e->list != NULL)
+  {
+    /* Stale answers are good enough while we're asking again. */
+    if (cdtime () >= e->expires)
+      ures_entry_queue (e);
+    *ret_list = ures_copy (e->list);
+    pthread_mutex_unlock (&ures_lock);
+    return ((*ret_list == NULL) ? EAI_MEMORY : 0);
+  }
+
+  if (!wait)
+  {
+    if ((e->expires == 0) || (cdtime () >= e->expires))
+      ures_entry_queue (e);
+    status = e->queued ? EAI_AGAIN : e->status;
+    pthread_mutex_unlock (&ures_lock);
+    return (status);
+  }
+
+  pthread_mutex_unlock (&ures_lock);
+  status = ures_entry_lookup (e, &list);
+  pthread_mutex_lock (&ures_lock);
+
+  ures_entry_update (e, status, list);
+  if (e->list != NULL)
+    *ret_list = ures_copy (e->list);
+  status = (e->list == NULL) ? e->status
+    : ((*ret_list == NULL) ? EAI_MEMORY : 0);
+
+  pthread_mutex_unlock (&ures_lock);
+  return (status);
+} /* }}} int ures_getaddrinfo */
+
+void ures_freeaddrinfo (struct addrinfo *list) /* {{{ */
+{
+  while (list != NULL)
+  {
+    struct addrinfo *next = list->ai_next;
+    free (list);
+    list = next;
+  }
+} /* }}} void ures_freeaddrinfo */
+
+void ures_shutdown (void) /* {{{ */
+{
+  ures_entry_t *e;
+  _Bool running;
+
+  pthread_mutex_lock (&ures_lock);
+  ures_stopped = 1;
+  running = ures_thread_running;
+  ures_thread_running = 0;
+  pthread_cond_broadcast (&ures_cond);
+  pthread_mutex_unlock (&ures_lock);
+
+  /* A lookup in progress is waited for. */
+  if (running)
+    pthread_join (ures_thread, /* retval = */ NULL);
+
+  pthread_mutex_lock (&ures_lock);
+  e = ures_entries;
+  ures_entries = NULL;
+  ures_queue_len = 0;
+  pthread_mutex_unlock (&ures_lock);
+
+  while (e != NULL)
+  {
+    ures_entry_t *next = e->next;
+
+    ures_freeaddrinfo (e->list);
+    sfree (e->node);
+    sfree (e->service);
+    sfree (e);
+    e = next;
+  }
+} /* }}} void ures_shutdown */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
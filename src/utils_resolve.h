@@ -0,0 +1,75 @@
+/**
+ * collectd - src/utils_resolve.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_RESOLVE_H
+#define UTILS_RESOLVE_H 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/*
+ * A cache of getaddrinfo(3) results shared by the plugins, so that write
+ * callbacks don't wait for the DNS server when they reconnect. Answers are
+ * kept for the number of seconds set by the global `ResolverCacheTTL'
+ * option. Expired answers are still handed out while a thread, started on
+ * first use, looks the name up again; if that fails, the previous answer is
+ * kept.
+ */
+
+/*
+ * NAME
+ *   ures_getaddrinfo
+ *
+ * DESCRIPTION
+ *   Looks up `node' and `service' like getaddrinfo(3). If there is no answer
+ *   in the cache, the lookup is started in the background and EAI_AGAIN is
+ *   returned, unless `wait' is true, in which case the caller does the
+ *   lookup itself. Pass true only where blocking is fine, e.g. when reading
+ *   the configuration.
+ *
+ * RETURN VALUE
+ *   Zero and a list in `ret_list', which has to be freed with
+ *   ures_freeaddrinfo(), or an EAI_* error code.
+ */
+int ures_getaddrinfo (const char *node, const char *service,
+    const struct addrinfo *hints, _Bool wait, struct addrinfo **ret_list);
+
+/*
+ * NAME
+ *   ures_freeaddrinfo
+ *
+ * DESCRIPTION
+ *   Frees a list returned by ures_getaddrinfo().
+ */
+void ures_freeaddrinfo (struct addrinfo *list);
+
+/*
+ * NAME
+ *   ures_shutdown
+ *
+ * DESCRIPTION
+ *   Stops the resolver thread and empties the cache. Later calls of
+ *   ures_getaddrinfo() only succeed with `wait' set.
+ */
+void ures_shutdown (void);
+
+#endif /* UTILS_RESOLVE_H */
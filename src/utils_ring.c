@@ -0,0 +1,354 @@
+/**
+ * collectd - src/utils_ring.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/*
+ * This is the bounded multi-producer / multi-consumer queue described by
+ * Dmitry Vyukov: every cell carries a sequence number which tells producers
+ * and consumers whether the cell is theirs to use in the current "lap" around
+ * the ring. The only contended operations are the compare-and-swap on the
+ * head and tail positions.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "utils_ring.h"
+
+#define RING_CACHE_LINE 64
+
+struct c_ring_cell_s
+{
+  volatile size_t seq;
+  void *ptr;
+};
+typedef struct c_ring_cell_s c_ring_cell_t;
+
+struct c_ring_s
+{
+  c_ring_cell_t *cells;
+  size_t mask;
+  char pad0[RING_CACHE_LINE];
+
+  /* Producers and consumers hammer on these, keep them on separate cache
+   * lines. */
+  volatile size_t enqueue_pos;
+  char pad1[RING_CACHE_LINE];
+
+  volatile size_t dequeue_pos;
+  char pad2[RING_CACHE_LINE];
+};
+
+c_ring_t *c_ring_create (size_t size)
+{
+  c_ring_t *r;
+  size_t capacity;
+  size_t i;
+
+  if (size < 2)
+    size = 2;
+
+  capacity = 1;
+  while (capacity < size)
+  {
+    capacity <<= 1;
+    if (capacity == 0)
+      return (NULL);
+  }
+
+  r = malloc (sizeof (*r));
+  if (r == NULL)
+    return (NULL);
+  memset (r, 0, sizeof (*r));
+
+  r->cells = calloc (capacity, sizeof (*r->cells));
+  if (r->cells == NULL)
+  {
+    free (r);
+    return (NULL);
+  }
+
+  for (i = 0; i < capacity; i++)
+  {
+    r->cells[i].seq = i;
+    r->cells[i].ptr = NULL;
+  }
+
+  r->mask = capacity - 1;
+  r->enqueue_pos = 0;
+  r->dequeue_pos = 0;
+
+  return (r);
+} /* c_ring_t *c_ring_create */
+
+void c_ring_destroy (c_ring_t *r)
+{
+  if (r == NULL)
+    return;
+
+  free (r->cells);
+  free (r);
+} /* void c_ring_destroy */
+
+int c_ring_push (c_ring_t *r, void *ptr)
+{
+  c_ring_cell_t *cell;
+  size_t pos;
+
+  if ((r == NULL) || (ptr == NULL))
+    return (EINVAL);
+
+  pos = r->enqueue_pos;
+  while (42)
+  {
+    intptr_t diff;
+
+    cell = r->cells + (pos & r->mask);
+    diff = (intptr_t) cell->seq - (intptr_t) pos;
+
+    if (diff == 0)
+    {
+      /* The cell is free in this lap. Try to claim it. The compare and swap
+       * is a full barrier, so the store below is not reordered before it. */
+      if (__sync_bool_compare_and_swap (&r->enqueue_pos, pos, pos + 1))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* The consumer of the previous lap has not yet released this cell:
+       * the ring is full. */
+      return (EAGAIN);
+    }
+
+    pos = r->enqueue_pos;
+  }
+
+  cell->ptr = ptr;
+  __sync_synchronize ();
+  cell->seq = pos + 1;
+
+  return (0);
+} /* int c_ring_push */
+
+void *c_ring_pop (c_ring_t *r)
+{
+  c_ring_cell_t *cell;
+  size_t pos;
+  void *ptr;
+
+  if (r == NULL)
+    return (NULL);
+
+  pos = r->dequeue_pos;
+  while (42)
+  {
+    intptr_t diff;
+
+    cell = r->cells + (pos & r->mask);
+    diff = (intptr_t) cell->seq - (intptr_t) (pos + 1);
+
+    if (diff == 0)
+    {
+      if (__sync_bool_compare_and_swap (&r->dequeue_pos, pos, pos + 1))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* Nothing has been published to this cell yet: the ring is empty. */
+      return (NULL);
+    }
+
+    pos = r->dequeue_pos;
+  }
+
+  ptr = cell->ptr;
+  cell->ptr = NULL;
+  __sync_synchronize ();
+  /* Hand the cell back to the producers of the next lap. */
+  cell->seq = pos + r->mask + 1;
+
+  return (ptr);
+} /* void *c_ring_pop */
+
+size_t c_ring_length (c_ring_t *r)
+{
+  size_t enqueue_pos;
+  size_t dequeue_pos;
+
+  if (r == NULL)
+    return (0);
+
+  dequeue_pos = r->dequeue_pos;
+  __sync_synchronize ();
+  enqueue_pos = r->enqueue_pos;
+
+  /* Both positions are read without a lock, so the tail may have been seen
+   * "behind" the head if consumers raced ahead in between. */
+  if (enqueue_pos <= dequeue_pos)
+    return (0);
+  else if ((enqueue_pos - dequeue_pos) > (r->mask + 1))
+    return (r->mask + 1);
+
+  return (enqueue_pos - dequeue_pos);
+} /* size_t c_ring_length */
+
+size_t c_ring_capacity (c_ring_t *r)
+{
+  if (r == NULL)
+    return (0);
+
+  return (r->mask + 1);
+} /* size_t c_ring_capacity */
+
+/*
+ * Single-producer / single-consumer ring
+ *
+ * Both positions only ever grow. Each side owns one of them and caches the
+ * other, so it only reads the other side's cache line when the cached value
+ * says the ring is full or empty, respectively.
+ */
+struct c_spsc_s
+{
+  void **cells;
+  size_t mask;
+  char pad0[RING_CACHE_LINE];
+
+  /* Written by the producer. */
+  volatile size_t tail;
+  size_t head_cache;
+  char pad1[RING_CACHE_LINE];
+
+  /* Written by the consumer. */
+  volatile size_t head;
+  size_t tail_cache;
+  char pad2[RING_CACHE_LINE];
+};
+
+c_spsc_t *c_spsc_create (size_t size)
+{
+  c_spsc_t *r;
+  size_t capacity;
+
+  if (size < 2)
+    size = 2;
+
+  capacity = 1;
+  while (capacity < size)
+  {
+    capacity <<= 1;
+    if (capacity == 0)
+      return (NULL);
+  }
+
+  r = malloc (sizeof (*r));
+  if (r == NULL)
+    return (NULL);
+  memset (r, 0, sizeof (*r));
+
+  r->cells = calloc (capacity, sizeof (*r->cells));
+  if (r->cells == NULL)
+  {
+    free (r);
+    return (NULL);
+  }
+
+  r->mask = capacity - 1;
+
+  return (r);
+} /* c_spsc_t *c_spsc_create */
+
+void c_spsc_destroy (c_spsc_t *r)
+{
+  if (r == NULL)
+    return;
+
+  free (r->cells);
+  free (r);
+} /* void c_spsc_destroy */
+
+int c_spsc_push (c_spsc_t *r, void *ptr)
+{
+  size_t tail;
+
+  if ((r == NULL) || (ptr == NULL))
+    return (EINVAL);
+
+  tail = r->tail;
+  if ((tail - r->head_cache) > r->mask)
+  {
+    r->head_cache = r->head;
+    if ((tail - r->head_cache) > r->mask)
+      return (EAGAIN);
+  }
+
+  r->cells[tail & r->mask] = ptr;
+  /* Publish the element before the new position. */
+  __sync_synchronize ();
+  r->tail = tail + 1;
+
+  return (0);
+} /* int c_spsc_push */
+
+void *c_spsc_pop (c_spsc_t *r)
+{
+  size_t head;
+  void *ptr;
+
+  if (r == NULL)
+    return (NULL);
+
+  head = r->head;
+  if (head == r->tail_cache)
+  {
+    r->tail_cache = r->tail;
+    if (head == r->tail_cache)
+      return (NULL);
+  }
+
+  /* Read the element only after having seen the position. */
+  __sync_synchronize ();
+  ptr = r->cells[head & r->mask];
+  __sync_synchronize ();
+  r->head = head + 1;
+
+  return (ptr);
+} /* void *c_spsc_pop */
+
+size_t c_spsc_length (c_spsc_t *r)
+{
+  size_t head;
+  size_t tail;
+
+  if (r == NULL)
+    return (0);
+
+  head = r->head;
+  __sync_synchronize ();
+  tail = r->tail;
+
+  if (tail <= head)
+    return (0);
+  return (tail - head);
+} /* size_t c_spsc_length */
+
+/* vim: set sw=2 sts=2 et : */
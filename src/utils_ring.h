@@ -0,0 +1,174 @@
+/**
+ * collectd - src/utils_ring.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_RING_H
+#define UTILS_RING_H 1
+
+#include <stddef.h>
+
+/*
+ * A fixed-size, lock-free queue of pointers. Any number of threads may insert
+ * and remove elements concurrently. The ring never blocks; callers that want
+ * to sleep while it is empty (or full) have to provide their own condition
+ * variables.
+ */
+struct c_ring_s;
+typedef struct c_ring_s c_ring_t;
+
+/*
+ * NAME
+ *   c_ring_create
+ *
+ * DESCRIPTION
+ *   Allocates a new ring which can hold at least `size' elements. The
+ *   capacity is rounded up to the next power of two.
+ *
+ * RETURN VALUE
+ *   A c_ring_t-pointer upon success or NULL upon failure.
+ */
+c_ring_t *c_ring_create (size_t size);
+
+/*
+ * NAME
+ *   c_ring_destroy
+ *
+ * DESCRIPTION
+ *   Deallocates a ring. Pointers still stored in the ring are lost, but of
+ *   course not freed. Must not be called while other threads access the ring.
+ */
+void c_ring_destroy (c_ring_t *r);
+
+/*
+ * NAME
+ *   c_ring_push
+ *
+ * DESCRIPTION
+ *   Appends `ptr' to the end of the ring.
+ *
+ * RETURN VALUE
+ *   Zero upon success, EAGAIN if the ring is full and EINVAL if an argument
+ *   is NULL.
+ */
+int c_ring_push (c_ring_t *r, void *ptr);
+
+/*
+ * NAME
+ *   c_ring_pop
+ *
+ * DESCRIPTION
+ *   Removes the element at the head of the ring.
+ *
+ * RETURN VALUE
+ *   The pointer passed to `c_ring_push' or NULL if the ring is empty.
+ */
+void *c_ring_pop (c_ring_t *r);
+
+/*
+ * NAME
+ *   c_ring_length
+ *
+ * DESCRIPTION
+ *   Returns the number of elements currently stored in the ring. When other
+ *   threads modify the ring concurrently, this is a snapshot that may be
+ *   outdated by the time the function returns.
+ */
+size_t c_ring_length (c_ring_t *r);
+
+/*
+ * NAME
+ *   c_ring_capacity
+ *
+ * DESCRIPTION
+ *   Returns the maximum number of elements the ring can hold.
+ */
+size_t c_ring_capacity (c_ring_t *r);
+
+/*
+ * A fixed-size, lock-free queue of pointers for exactly one producer and one
+ * consumer thread. It avoids the compare-and-swap operations of c_ring_t and
+ * is therefore cheaper when there is only one thread on either side.
+ */
+struct c_spsc_s;
+typedef struct c_spsc_s c_spsc_t;
+
+/*
+ * NAME
+ *   c_spsc_create
+ *
+ * DESCRIPTION
+ *   Allocates a new single-producer / single-consumer ring which can hold at
+ *   least `size' elements. The capacity is rounded up to the next power of
+ *   two.
+ *
+ * RETURN VALUE
+ *   A c_spsc_t-pointer upon success or NULL upon failure.
+ */
+c_spsc_t *c_spsc_create (size_t size);
+
+/*
+ * NAME
+ *   c_spsc_destroy
+ *
+ * DESCRIPTION
+ *   Deallocates a ring. Pointers still stored in the ring are lost.
+ */
+void c_spsc_destroy (c_spsc_t *r);
+
+/*
+ * NAME
+ *   c_spsc_push
+ *
+ * DESCRIPTION
+ *   Appends `ptr' to the end of the ring. Must only be called by the producer
+ *   thread.
+ *
+ * RETURN VALUE
+ *   Zero upon success, EAGAIN if the ring is full and EINVAL if an argument
+ *   is NULL.
+ */
+int c_spsc_push (c_spsc_t *r, void *ptr);
+
+/*
+ * NAME
+ *   c_spsc_pop
+ *
+ * DESCRIPTION
+ *   Removes the element at the head of the ring. Must only be called by the
+ *   consumer thread.
+ *
+ * RETURN VALUE
+ *   The pointer passed to `c_spsc_push' or NULL if the ring is empty.
+ */
+void *c_spsc_pop (c_spsc_t *r);
+
+/*
+ * NAME
+ *   c_spsc_length
+ *
+ * DESCRIPTION
+ *   Returns the number of elements currently stored in the ring. May be
+ *   called by any thread; the result is a snapshot.
+ */
+size_t c_spsc_length (c_spsc_t *r);
+
+#endif /* UTILS_RING_H */
+/* vim: set sw=2 sts=2 et : */
@@ -21,6 +21,7 @@
 
 #include "collectd.h"
 #include "common.h"
+#include "utils_avltree.h"
 #include "utils_rrdcreate.h"
 
 #include <pthread.h>
@@ -33,16 +34,25 @@ struct srrd_create_args_s
   time_t last_up;
   int argc;
   char **argv;
+  _Bool use_template;
+  struct srrd_create_args_s *next;
 };
 typedef struct srrd_create_args_s srrd_create_args_t;
 
-struct async_create_file_s;
-typedef struct async_create_file_s async_create_file_t;
-struct async_create_file_s
+/* Image of a freshly created, empty RRD file. Files with the same definition
+ * are created by writing this image instead of calling rrd_create(3), as long
+ * as the image's "last update" is less than one step before theirs. */
+struct rrd_template_s
 {
-  char *filename;
-  async_create_file_t *next;
+  char *key;
+  char *data;
+  size_t size;
+  unsigned long pdp_step;
+  time_t last_up;
 };
+typedef struct rrd_template_s rrd_template_t;
+
+#define RRD_TEMPLATES_MAX 16
 
 /*
  * Private variables
@@ -69,8 +79,19 @@ static int rra_types_num = STATIC_ARRAY_SIZE (rra_types);
 static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-static async_create_file_t *async_creation_list = NULL;
+/* Files being created in the background, the queue of creation requests and
+ * the threads working on it. All protected by "async_creation_lock". */
+static c_avl_tree_t *async_creation_tree = NULL;
+static srrd_create_args_t *async_queue_head = NULL;
+static srrd_create_args_t *async_queue_tail = NULL;
+static int async_threads_num = 0;
+static int async_threads_idle = 0;
 static pthread_mutex_t async_creation_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_creation_cond = PTHREAD_COND_INITIALIZER;
+
+static rrd_template_t templates[RRD_TEMPLATES_MAX];
+static size_t templates_next = 0;
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Private functions
@@ -99,6 +120,7 @@ static void srrd_create_args_destroy (srrd_create_args_t *args)
       sfree (args->argv[i]);
     sfree (args->argv);
   }
+  sfree (args);
 } /* void srrd_create_args_destroy */
 
 static srrd_create_args_t *srrd_create_args_create (const char *filename,
@@ -118,6 +140,7 @@ static srrd_create_args_t *srrd_create_args_create (const char *filename,
   args->pdp_step = pdp_step;
   args->last_up = last_up;
   args->argv = NULL;
+  args->next = NULL;
 
   args->filename = strdup (filename);
   if (args->filename == NULL)
@@ -445,128 +468,233 @@ static int srrd_create (const char *filename, /* {{{ */
 } /* }}} int srrd_create */
 #endif /* !HAVE_THREADSAFE_LIBRRD */
 
+/* XXX: You must hold "async_creation_lock" when calling this function! */
 static int lock_file (char const *filename) /* {{{ */
 {
-  async_create_file_t *ptr;
+  char *key;
   struct stat sb;
   int status;
 
-  pthread_mutex_lock (&async_creation_lock);
-
-  for (ptr = async_creation_list; ptr != NULL; ptr = ptr->next)
-    if (strcmp (filename, ptr->filename) == 0)
-      break;
-
-  if (ptr != NULL)
+  if (async_creation_tree == NULL)
   {
-    pthread_mutex_unlock (&async_creation_lock);
-    return (EEXIST);
+    async_creation_tree = c_avl_create ((void *) strcmp);
+    if (async_creation_tree == NULL)
+      return (ENOMEM);
   }
 
+  if (c_avl_get (async_creation_tree, filename, NULL) == 0)
+    return (EEXIST);
+
   errno = 0;
   status = stat (filename, &sb);
   if (errno != ENOENT)
-  {
-    pthread_mutex_unlock (&async_creation_lock);
     return (EEXIST);
-  }
 
-  ptr = malloc (sizeof (*ptr));
-  if (ptr == NULL)
-  {
-    pthread_mutex_unlock (&async_creation_lock);
+  key = strdup (filename);
+  if (key == NULL)
     return (ENOMEM);
-  }
 
-  ptr->filename = strdup (filename);
-  if (ptr->filename == NULL)
+  status = c_avl_insert (async_creation_tree, key, /* value = */ NULL);
+  if (status != 0)
   {
-    pthread_mutex_unlock (&async_creation_lock);
-    sfree (ptr);
+    sfree (key);
     return (ENOMEM);
   }
 
-  ptr->next = async_creation_list;
-  async_creation_list = ptr;
+  return (0);
+} /* }}} int lock_file */
+
+static int unlock_file (char const *filename) /* {{{ */
+{
+  char *key = NULL;
+  int status;
 
+  pthread_mutex_lock (&async_creation_lock);
+  status = c_avl_remove (async_creation_tree, filename,
+      (void *) &key, /* value = */ NULL);
   pthread_mutex_unlock (&async_creation_lock);
 
+  if (status != 0)
+    return (ENOENT);
+
+  sfree (key);
   return (0);
-} /* }}} int lock_file */
+} /* }}} int unlock_file */
 
-static int unlock_file (char const *filename) /* {{{ */
+/* Returns the template key of "args": the step size and all DS and RRA
+ * definitions. */
+static char *template_key (const srrd_create_args_t *args) /* {{{ */
 {
-  async_create_file_t *this;
-  async_create_file_t *prev;
+  size_t size;
+  size_t offset;
+  char *key;
+  int i;
 
+  size = 32;
+  for (i = 0; i < args->argc; i++)
+    size += strlen (args->argv[i]) + 1;
 
-  pthread_mutex_lock (&async_creation_lock);
+  key = malloc (size);
+  if (key == NULL)
+    return (NULL);
+
+  offset = (size_t) ssnprintf (key, size, "%lu", args->pdp_step);
+  for (i = 0; i < args->argc; i++)
+    offset += (size_t) ssnprintf (key + offset, size - offset, " %s",
+        args->argv[i]);
+
+  return (key);
+} /* }}} char *template_key */
+
+/* Creates "filename" from a matching template. Returns zero on success and
+ * non-zero if there is no usable template. */
+static int template_copy (const srrd_create_args_t *args, /* {{{ */
+    const char *filename)
+{
+  char *key;
+  ssize_t status = -1;
+  size_t i;
+  int fd;
 
-  prev = NULL;
-  for (this = async_creation_list; this != NULL; this = this->next)
+  key = template_key (args);
+  if (key == NULL)
+    return (-1);
+
+  pthread_mutex_lock (&templates_lock);
+  for (i = 0; i < RRD_TEMPLATES_MAX; i++)
   {
-    if (strcmp (filename, this->filename) == 0)
+    rrd_template_t *t = templates + i;
+
+    if ((t->key == NULL) || (strcmp (t->key, key) != 0))
+      continue;
+
+    if ((t->last_up > args->last_up)
+        || ((unsigned long) (args->last_up - t->last_up) >= t->pdp_step))
       break;
-    prev = this;
+
+    fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      break;
+
+    status = swrite (fd, t->data, t->size);
+    if (close (fd) != 0)
+      status = -1;
+    if (status != 0)
+      unlink (filename);
+    break;
   }
+  pthread_mutex_unlock (&templates_lock);
+
+  sfree (key);
+  return ((status == 0) ? 0 : -1);
+} /* }}} int template_copy */
+
+/* Keeps an image of the just created "filename" as template. */
+static void template_save (const srrd_create_args_t *args, /* {{{ */
+    const char *filename)
+{
+  rrd_template_t *t = NULL;
+  struct stat sb;
+  char *key;
+  char *data;
+  size_t offset;
+  size_t i;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return;
 
-  if (this == NULL)
+  if ((fstat (fd, &sb) != 0) || (sb.st_size <= 0))
   {
-    pthread_mutex_unlock (&async_creation_lock);
-    return (ENOENT);
+    close (fd);
+    return;
   }
 
-  if (prev == NULL)
+  data = malloc ((size_t) sb.st_size);
+  if (data == NULL)
   {
-    assert (this == async_creation_list);
-    async_creation_list = this->next;
+    close (fd);
+    return;
   }
-  else
+
+  /* Not using sread(), because it closes "fd" on EOF. */
+  for (offset = 0; offset < (size_t) sb.st_size; )
   {
-    assert (this == prev->next);
-    prev->next = this->next;
+    ssize_t status = read (fd, data + offset, (size_t) sb.st_size - offset);
+    if ((status < 0) && (errno == EINTR))
+      continue;
+    else if (status <= 0)
+      break;
+    offset += (size_t) status;
   }
-  this->next = NULL;
+  close (fd);
 
-  pthread_mutex_unlock (&async_creation_lock);
+  if (offset != (size_t) sb.st_size)
+  {
+    sfree (data);
+    return;
+  }
 
-  sfree (this->filename);
-  sfree (this);
+  key = template_key (args);
+  if (key == NULL)
+  {
+    sfree (data);
+    return;
+  }
 
-  return (0);
-} /* }}} int unlock_file */
+  pthread_mutex_lock (&templates_lock);
+  /* Replace the template with the same key or the least recently added one. */
+  for (i = 0; i < RRD_TEMPLATES_MAX; i++)
+  {
+    if ((templates[i].key != NULL) && (strcmp (templates[i].key, key) == 0))
+    {
+      t = templates + i;
+      break;
+    }
+  }
+  if (t == NULL)
+  {
+    t = templates + templates_next;
+    templates_next = (templates_next + 1) % RRD_TEMPLATES_MAX;
+  }
+
+  sfree (t->key);
+  sfree (t->data);
+  t->key = key;
+  t->data = data;
+  t->size = (size_t) sb.st_size;
+  t->pdp_step = args->pdp_step;
+  t->last_up = args->last_up;
+  pthread_mutex_unlock (&templates_lock);
+} /* }}} void template_save */
 
-static void *srrd_create_thread (void *targs) /* {{{ */
+static void srrd_create_file_async (srrd_create_args_t *args) /* {{{ */
 {
-  srrd_create_args_t *args = targs;
   char tmpfile[PATH_MAX];
   int status;
 
-  status = lock_file (args->filename);
-  if (status != 0)
-  {
-    if (status == EEXIST)
-      NOTICE ("srrd_create_thread: File \"%s\" is already being created.",
-          args->filename);
-    else
-      ERROR ("srrd_create_thread: Unable to lock file \"%s\".",
-          args->filename);
-    srrd_create_args_destroy (args);
-    return (0);
-  }
-
   ssnprintf (tmpfile, sizeof (tmpfile), "%s.async", args->filename);
 
-  status = srrd_create (tmpfile, args->pdp_step, args->last_up,
-      args->argc, (void *) args->argv);
+  status = -1;
+  if (args->use_template)
+    status = template_copy (args, tmpfile);
+
   if (status != 0)
   {
-    WARNING ("srrd_create_thread: srrd_create (%s) returned status %i.",
-        args->filename, status);
-    unlink (tmpfile);
-    unlock_file (args->filename);
-    srrd_create_args_destroy (args);
-    return (0);
+    status = srrd_create (tmpfile, args->pdp_step, args->last_up,
+        args->argc, (void *) args->argv);
+    if (status != 0)
+    {
+      WARNING ("srrd_create_thread: srrd_create (%s) returned status %i.",
+          args->filename, status);
+      unlink (tmpfile);
+      unlock_file (args->filename);
+      return;
+    }
+
+    if (args->use_template)
+      template_save (args, tmpfile);
   }
 
   status = rename (tmpfile, args->filename);
@@ -578,26 +706,47 @@ static void *srrd_create_thread (void *targs) /* {{{ */
         sstrerror (errno, errbuf, sizeof (errbuf)));
     unlink (tmpfile);
     unlock_file (args->filename);
-    srrd_create_args_destroy (args);
-    return (0);
+    return;
   }
 
   DEBUG ("srrd_create_thread: Successfully created RRD file \"%s\".",
       args->filename);
 
   unlock_file (args->filename);
-  srrd_create_args_destroy (args);
+} /* }}} void srrd_create_file_async */
 
-  return (0);
+static void *srrd_create_thread (void __attribute__((unused)) *arg) /* {{{ */
+{
+  while (42)
+  {
+    srrd_create_args_t *args;
+
+    pthread_mutex_lock (&async_creation_lock);
+    async_threads_idle++;
+    while (async_queue_head == NULL)
+      pthread_cond_wait (&async_creation_cond, &async_creation_lock);
+    async_threads_idle--;
+
+    args = async_queue_head;
+    async_queue_head = args->next;
+    if (async_queue_head == NULL)
+      async_queue_tail = NULL;
+    pthread_mutex_unlock (&async_creation_lock);
+
+    srrd_create_file_async (args);
+    srrd_create_args_destroy (args);
+  }
+
+  return ((void *) 0);
 } /* }}} void *srrd_create_thread */
 
+/* Queues the creation of "filename" for one of at most "threads_max" threads.
+ * Succeeds without doing anything if the file is already being created. */
 static int srrd_create_async (const char *filename, /* {{{ */
     unsigned long pdp_step, time_t last_up,
-    int argc, const char **argv)
+    int argc, const char **argv, int threads_max, _Bool use_template)
 {
   srrd_create_args_t *args;
-  pthread_t thread;
-  pthread_attr_t attr;
   int status;
 
   DEBUG ("srrd_create_async: Creating \"%s\" in the background.", filename);
@@ -605,34 +754,59 @@ static int srrd_create_async (const char *filename, /* {{{ */
   args = srrd_create_args_create (filename, pdp_step, last_up, argc, argv);
   if (args == NULL)
     return (-1);
+  args->use_template = use_template;
 
-  status = pthread_attr_init (&attr);
-  if (status != 0)
-  {
-    srrd_create_args_destroy (args);
-    return (-1);
-  }
+  pthread_mutex_lock (&async_creation_lock);
 
-  status = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  status = lock_file (args->filename);
   if (status != 0)
   {
-    pthread_attr_destroy (&attr);
+    pthread_mutex_unlock (&async_creation_lock);
     srrd_create_args_destroy (args);
+    if (status == EEXIST)
+      return (0);
+    ERROR ("srrd_create_async: Unable to lock file \"%s\".", filename);
     return (-1);
   }
 
-  status = pthread_create (&thread, &attr, srrd_create_thread, args);
-  if (status != 0)
+  if ((async_threads_idle == 0) && (async_threads_num < threads_max))
   {
-    char errbuf[1024];
-    ERROR ("srrd_create_async: pthread_create failed: %s",
-        sstrerror (status, errbuf, sizeof (errbuf)));
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    status = pthread_create (&thread, &attr, srrd_create_thread,
+        /* arg = */ NULL);
     pthread_attr_destroy (&attr);
-    srrd_create_args_destroy (args);
-    return (status);
+
+    if (status == 0)
+      async_threads_num++;
+    else if (async_threads_num == 0)
+    {
+      char errbuf[1024];
+      char *key = NULL;
+
+      ERROR ("srrd_create_async: pthread_create failed: %s",
+          sstrerror (status, errbuf, sizeof (errbuf)));
+      c_avl_remove (async_creation_tree, args->filename,
+          (void *) &key, /* value = */ NULL);
+      pthread_mutex_unlock (&async_creation_lock);
+      sfree (key);
+      srrd_create_args_destroy (args);
+      return (status);
+    }
   }
 
-  pthread_attr_destroy (&attr);
+  if (async_queue_tail == NULL)
+    async_queue_head = args;
+  else
+    async_queue_tail->next = args;
+  async_queue_tail = args;
+
+  pthread_cond_signal (&async_creation_cond);
+  pthread_mutex_unlock (&async_creation_lock);
+
   /* args is freed in srrd_create_thread(). */
   return (0);
 } /* }}} int srrd_create_async */
@@ -654,6 +828,11 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   time_t last_up;
   unsigned long stepsize;
 
+  /* Don't bother calculating the definitions again while the file is still
+   * being created. */
+  if (cfg->async && cu_rrd_create_pending (filename))
+    return (0);
+
   if (check_create_dir (filename))
     return (-1);
 
@@ -696,7 +875,9 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   if (cfg->async)
   {
     status = srrd_create_async (filename, stepsize, last_up,
-        argc, (const char **) argv);
+        argc, (const char **) argv,
+        (cfg->async_threads > 0) ? cfg->async_threads : 1,
+        cfg->async_templates);
     if (status != 0)
       WARNING ("cu_rrd_create_file: srrd_create_async (%s) "
           "returned status %i.",
@@ -726,4 +907,17 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   return (status);
 } /* }}} int cu_rrd_create_file */
 
+_Bool cu_rrd_create_pending (const char *filename) /* {{{ */
+{
+  _Bool pending = 0;
+
+  pthread_mutex_lock (&async_creation_lock);
+  if ((async_creation_tree != NULL)
+      && (c_avl_get (async_creation_tree, filename, NULL) == 0))
+    pending = 1;
+  pthread_mutex_unlock (&async_creation_lock);
+
+  return (pending);
+} /* }}} _Bool cu_rrd_create_pending */
+
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -40,13 +40,22 @@ struct rrdcreate_config_s
   size_t consolidation_functions_num;
 
   _Bool async;
+  /* Upper limit of threads creating files if "async" is set. */
+  int async_threads;
+  /* Copy new files from earlier ones with the same definition. */
+  _Bool async_templates;
 };
 typedef struct rrdcreate_config_s rrdcreate_config_t;
 
+/* With "async" set, the file is created in the background and zero is returned
+ * right away. Use cu_rrd_create_pending() to find out when it is done. */
 int cu_rrd_create_file (const char *filename,
     const data_set_t *ds, const value_list_t *vl,
     const rrdcreate_config_t *cfg);
 
+/* Returns true while "filename" is being created in the background. */
+_Bool cu_rrd_create_pending (const char *filename);
+
 #endif /* UTILS_RRDCREATE_H */
 
 /* vim: set sw=2 sts=2 et : */
@@ -0,0 +1,692 @@
+/**
+ * collectd - src/utils_spool.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+/*
+ * Each segment file is named after its sequence number and holds a series of
+ * records, each starting on an eight byte boundary:
+ *
+ *  +---------+---------+---------+----------+----------------------+
+ *  |  magic  |  flags  | length  | checksum |  data (length bytes) |
+ *  +---------+---------+---------+----------+----------------------+
+ *
+ * All header fields are 32 bit integers in host byte order; the spool is not
+ * meant to be moved between machines. The checksum is the CRC-32 of the
+ * data. The magic number is written last, so a record which was only
+ * partially written when the daemon died looks like the end of the segment.
+ * Records which have been taken are marked in "flags" rather than removed;
+ * a segment is deleted once all of its records are marked.
+ *
+ * Files are written through a shared memory mapping, so records survive the
+ * daemon crashing. They may be lost if the system goes down before the
+ * kernel has written them back; the spool doesn't call msync(2) for each
+ * record.
+ */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_complain.h"
+#include "utils_spool.h"
+
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define SPOOL_MAGIC 0x4c4f4f53 /* "SOOL" */
+#define SPOOL_FLAG_TAKEN 0x0001
+
+/* Preferred size of segment files. Larger records get a segment of their
+ * own. */
+#ifndef SPOOL_SEGMENT_SIZE
+# define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+#define SPOOL_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+struct spool_record_header_s
+{
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t length;
+  uint32_t checksum;
+};
+typedef struct spool_record_header_s spool_record_header_t;
+
+#define SPOOL_HEADER_SIZE sizeof (spool_record_header_t)
+
+struct spool_segment_s;
+typedef struct spool_segment_s spool_segment_t;
+struct spool_segment_s
+{
+  uint64_t seq;
+
+  /* Only the head and the tail segment are mapped. */
+  char *data;
+  size_t size;
+
+  /* End of the records and first record which hasn't been taken. */
+  size_t fill;
+  size_t read_pos;
+  uint64_t pending;
+
+  spool_segment_t *next;
+};
+
+struct c_spool_s
+{
+  char *directory;
+  uint64_t max_size;
+
+  /* Token bucket limiting the rate of c_spool_shift(). */
+  uint64_t replay_rate;
+  double tokens;
+  cdtime_t tokens_time;
+
+  spool_segment_t *head;
+  spool_segment_t *tail;
+  /* Segments found at startup are not appended to. */
+  _Bool tail_writable;
+  uint64_t next_seq;
+
+  uint64_t size;
+  uint64_t pending;
+
+  c_complain_t full_complaint;
+  pthread_mutex_t lock;
+};
+
+static uint32_t spool_crc_table[256];
+static pthread_once_t spool_crc_once = PTHREAD_ONCE_INIT;
+
+static void spool_crc_init (void) /* {{{ */
+{
+  uint32_t i;
+
+  for (i = 0; i < 256; i++)
+  {
+    uint32_t c = i;
+    int j;
+
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+    spool_crc_table[i] = c;
+  }
+} /* }}} void spool_crc_init */
+
+static uint32_t spool_crc32 (const void *data, size_t data_len) /* {{{ */
+{
+  const unsigned char *ptr = data;
+  uint32_t crc = 0xffffffff;
+  size_t i;
+
+  pthread_once (&spool_crc_once, spool_crc_init);
+
+  for (i = 0; i < data_len; i++)
+    crc = spool_crc_table[(crc ^ ptr[i]) & 0xff] ^ (crc >> 8);
+
+  return (crc ^ 0xffffffff);
+} /* }}} uint32_t spool_crc32 */
+
+static void spool_segment_path (c_spool_t *s, uint64_t seq, /* {{{ */
+    char *buffer, size_t buffer_size)
+{
+  ssnprintf (buffer, buffer_size, "%s/%016"PRIx64".spool",
+      s->directory, seq);
+} /* }}} void spool_segment_path */
+
+static int spool_segment_map (c_spool_t *s, spool_segment_t *seg) /* {{{ */
+{
+  char path[PATH_MAX];
+  void *data;
+  int fd;
+
+  if (seg->data != NULL)
+    return (0);
+
+  spool_segment_path (s, seg->seq, path, sizeof (path));
+  fd = open (path, O_RDWR);
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    ERROR ("spool: Opening \"%s\" failed: %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  data = mmap (/* addr = */ NULL, seg->size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, /* offset = */ 0);
+  close (fd);
+  if (data == MAP_FAILED)
+  {
+    char errbuf[1024];
+    ERROR ("spool: Mapping \"%s\" failed: %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  seg->data = data;
+  return (0);
+} /* }}} int spool_segment_map */
+
+static void spool_segment_unmap (spool_segment_t *seg) /* {{{ */
+{
+  if (seg->data == NULL)
+    return;
+
+  munmap (seg->data, seg->size);
+  seg->data = NULL;
+} /* }}} void spool_segment_unmap */
+
+/* Removes the head segment and its file. The caller must hold "s->lock". */
+static void spool_remove_head (c_spool_t *s) /* {{{ */
+{
+  spool_segment_t *seg = s->head;
+  char path[PATH_MAX];
+
+  if (seg == NULL)
+    return;
+
+  s->head = seg->next;
+  if (s->tail == seg)
+  {
+    s->tail = NULL;
+    s->tail_writable = 0;
+  }
+
+  spool_segment_unmap (seg);
+  spool_segment_path (s, seg->seq, path, sizeof (path));
+  if ((unlink (path) != 0) && (errno != ENOENT))
+  {
+    char errbuf[1024];
+    WARNING ("spool: Removing \"%s\" failed: %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+  }
+
+  s->size -= seg->size;
+  s->pending -= seg->pending;
+  sfree (seg);
+} /* }}} void spool_remove_head */
+
+/* Starts a new segment with room for at least "min_size" bytes. The caller
+ * must hold "s->lock". */
+static int spool_add_segment (c_spool_t *s, size_t min_size) /* {{{ */
+{
+  spool_segment_t *seg;
+  char path[PATH_MAX];
+  size_t size;
+  int fd;
+  int status;
+
+  size = SPOOL_SEGMENT_SIZE;
+  if (size > s->max_size)
+    size = (size_t) s->max_size;
+  if (size < min_size)
+    size = min_size;
+
+  /* Stop appending to the current tail. */
+  if (s->tail_writable)
+  {
+    msync (s->tail->data, s->tail->size, MS_ASYNC);
+    if (s->tail != s->head)
+      spool_segment_unmap (s->tail);
+    s->tail_writable = 0;
+  }
+
+  while ((s->head != NULL) && ((s->size + size) > s->max_size))
+  {
+    c_complain (LOG_WARNING, &s->full_complaint,
+        "spool: %s is full. Dropping the oldest records.", s->directory);
+    spool_remove_head (s);
+  }
+
+  seg = calloc (1, sizeof (*seg));
+  if (seg == NULL)
+    return (ENOMEM);
+  seg->seq = s->next_seq;
+  seg->size = size;
+
+  spool_segment_path (s, seg->seq, path, sizeof (path));
+  fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+  {
+    char errbuf[1024];
+    status = errno;
+    ERROR ("spool: Creating \"%s\" failed: %s", path,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    sfree (seg);
+    return (status);
+  }
+
+  /* Allocate the blocks up front: writing to a mapping of a sparse file on a
+   * full file system raises SIGBUS. */
+#if HAVE_POSIX_FALLOCATE
+  status = posix_fallocate (fd, 0, (off_t) size);
+#else
+  status = (ftruncate (fd, (off_t) size) == 0) ? 0 : errno;
+#endif
+  if (status != 0)
+  {
+    char errbuf[1024];
+    ERROR ("spool: Allocating %zu bytes for \"%s\" failed: %s", size, path,
+        sstrerror (status, errbuf, sizeof (errbuf)));
+    close (fd);
+    unlink (path);
+    sfree (seg);
+    return (status);
+  }
+  close (fd);
+
+  status = spool_segment_map (s, seg);
+  if (status != 0)
+  {
+    unlink (path);
+    sfree (seg);
+    return (status);
+  }
+
+  s->next_seq++;
+  s->size += size;
+
+  if (s->tail != NULL)
+    s->tail->next = seg;
+  else
+    s->head = seg;
+  s->tail = seg;
+  s->tail_writable = 1;
+
+  return (0);
+} /* }}} int spool_add_segment */
+
+/* Validates the records of a segment found at startup. Everything after a
+ * damaged record is ignored. */
+static int spool_segment_scan (c_spool_t *s, spool_segment_t *seg) /* {{{ */
+{
+  size_t pos = 0;
+  _Bool have_read_pos = 0;
+
+  while ((pos + SPOOL_HEADER_SIZE) <= seg->size)
+  {
+    spool_record_header_t *hdr = (void *) (seg->data + pos);
+
+    if (hdr->magic == 0)
+      break;
+
+    if ((hdr->magic != SPOOL_MAGIC)
+        || (hdr->length > (seg->size - pos - SPOOL_HEADER_SIZE))
+        || (spool_crc32 (seg->data + pos + SPOOL_HEADER_SIZE, hdr->length)
+          != hdr->checksum))
+    {
+      WARNING ("spool: Segment %016"PRIx64" in %s is damaged at offset %zu. "
+          "Ignoring the rest of it.", seg->seq, s->directory, pos);
+      break;
+    }
+
+    if (!(hdr->flags & SPOOL_FLAG_TAKEN))
+    {
+      if (!have_read_pos)
+      {
+        seg->read_pos = pos;
+        have_read_pos = 1;
+      }
+      seg->pending += hdr->length;
+    }
+
+    pos += SPOOL_ALIGN (SPOOL_HEADER_SIZE + hdr->length);
+  }
+
+  seg->fill = pos;
+  if (!have_read_pos)
+    seg->read_pos = seg->fill;
+
+  return (0);
+} /* }}} int spool_segment_scan */
+
+static int spool_seq_compare (const void *a, const void *b) /* {{{ */
+{
+  uint64_t seq_a = *((const uint64_t *) a);
+  uint64_t seq_b = *((const uint64_t *) b);
+
+  if (seq_a < seq_b)
+    return (-1);
+  else if (seq_a > seq_b)
+    return (1);
+  return (0);
+} /* }}} int spool_seq_compare */
+
+/* Picks up the segment files left in the directory. */
+static int spool_recover (c_spool_t *s) /* {{{ */
+{
+  DIR *dh;
+  struct dirent *de;
+  uint64_t *seqs = NULL;
+  size_t seqs_num = 0;
+  size_t i;
+
+  dh = opendir (s->directory);
+  if (dh == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("spool: Opening the directory \"%s\" failed: %s", s->directory,
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  while ((de = readdir (dh)) != NULL)
+  {
+    uint64_t seq;
+    uint64_t *tmp;
+    char suffix[8];
+
+    if ((strlen (de->d_name) != 22)
+        || (sscanf (de->d_name, "%16"SCNx64"%7s", &seq, suffix) != 2)
+        || (strcmp (".spool", suffix) != 0))
+      continue;
+
+    tmp = realloc (seqs, (seqs_num + 1) * sizeof (*seqs));
+    if (tmp == NULL)
+    {
+      ERROR ("spool: realloc failed.");
+      break;
+    }
+    seqs = tmp;
+    seqs[seqs_num] = seq;
+    seqs_num++;
+  }
+  closedir (dh);
+
+  qsort (seqs, seqs_num, sizeof (*seqs), spool_seq_compare);
+
+  for (i = 0; i < seqs_num; i++)
+  {
+    spool_segment_t *seg;
+    struct stat statbuf;
+    char path[PATH_MAX];
+
+    spool_segment_path (s, seqs[i], path, sizeof (path));
+    if (stat (path, &statbuf) != 0)
+      continue;
+
+    seg = calloc (1, sizeof (*seg));
+    if (seg == NULL)
+      break;
+    seg->seq = seqs[i];
+    seg->size = (size_t) statbuf.st_size;
+
+    if ((seg->size < SPOOL_HEADER_SIZE) || (spool_segment_map (s, seg) != 0))
+    {
+      sfree (seg);
+      unlink (path);
+      continue;
+    }
+    spool_segment_scan (s, seg);
+    spool_segment_unmap (seg);
+
+    if (seqs[i] >= s->next_seq)
+      s->next_seq = seqs[i] + 1;
+
+    if (seg->pending == 0)
+    {
+      sfree (seg);
+      unlink (path);
+      continue;
+    }
+
+    if (s->tail != NULL)
+      s->tail->next = seg;
+    else
+      s->head = seg;
+    s->tail = seg;
+
+    s->size += seg->size;
+    s->pending += seg->pending;
+  }
+  sfree (seqs);
+
+  if (s->pending > 0)
+    INFO ("spool: Found %"PRIu64" bytes of spooled data in %s.",
+        s->pending, s->directory);
+
+  return (0);
+} /* }}} int spool_recover */
+
+c_spool_t *c_spool_create (const char *directory, /* {{{ */
+    uint64_t max_size, uint64_t replay_rate)
+{
+  c_spool_t *s;
+  char dir_slash[PATH_MAX];
+
+  if ((directory == NULL) || (max_size < SPOOL_HEADER_SIZE))
+    return (NULL);
+
+  /* check_create_dir() considers the last component a file name unless it
+   * ends in a slash. */
+  ssnprintf (dir_slash, sizeof (dir_slash), "%s/", directory);
+  if (check_create_dir (dir_slash) != 0)
+  {
+    ERROR ("spool: Creating the directory \"%s\" failed.", directory);
+    return (NULL);
+  }
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+
+  s->directory = strdup (directory);
+  if (s->directory == NULL)
+  {
+    sfree (s);
+    return (NULL);
+  }
+  s->max_size = max_size;
+  s->replay_rate = replay_rate;
+  s->tokens = (double) replay_rate;
+  s->tokens_time = cdtime ();
+  C_COMPLAIN_INIT (&s->full_complaint);
+  pthread_mutex_init (&s->lock, /* attr = */ NULL);
+
+  if (spool_recover (s) != 0)
+  {
+    c_spool_destroy (s);
+    return (NULL);
+  }
+
+  return (s);
+} /* }}} c_spool_t *c_spool_create */
+
+int c_spool_config_size (oconfig_item_t *ci, /* {{{ */
+    uint64_t *dest, uint64_t unit)
+{
+  int tmp = 0;
+  int status;
+
+  status = cf_util_get_int (ci, &tmp);
+  if (status != 0)
+    return (status);
+
+  if (tmp <= 0)
+  {
+    ERROR ("The \"%s\" option requires a positive number.", ci->key);
+    return (-1);
+  }
+
+  *dest = ((uint64_t) tmp) * unit;
+  return (0);
+} /* }}} int c_spool_config_size */
+
+void c_spool_destroy (c_spool_t *s) /* {{{ */
+{
+  spool_segment_t *seg;
+
+  if (s == NULL)
+    return;
+
+  seg = s->head;
+  while (seg != NULL)
+  {
+    spool_segment_t *next = seg->next;
+
+    spool_segment_unmap (seg);
+    sfree (seg);
+    seg = next;
+  }
+
+  pthread_mutex_destroy (&s->lock);
+  sfree (s->directory);
+  sfree (s);
+} /* }}} void c_spool_destroy */
+
+int c_spool_append (c_spool_t *s, const void *data, size_t data_len) /* {{{ */
+{
+  spool_record_header_t *hdr;
+  size_t record_size;
+
+  if ((s == NULL) || (data == NULL))
+    return (EINVAL);
+
+  record_size = SPOOL_ALIGN (SPOOL_HEADER_SIZE + data_len);
+  if ((data_len > UINT32_MAX) || (record_size > s->max_size))
+    return (E2BIG);
+
+  pthread_mutex_lock (&s->lock);
+
+  if (!s->tail_writable || ((s->tail->fill + record_size) > s->tail->size))
+  {
+    int status = spool_add_segment (s, record_size);
+    if (status != 0)
+    {
+      pthread_mutex_unlock (&s->lock);
+      return (status);
+    }
+  }
+
+  hdr = (void *) (s->tail->data + s->tail->fill);
+  memcpy (s->tail->data + s->tail->fill + SPOOL_HEADER_SIZE, data, data_len);
+  hdr->flags = 0;
+  hdr->length = (uint32_t) data_len;
+  hdr->checksum = spool_crc32 (data, data_len);
+  hdr->magic = SPOOL_MAGIC;
+
+  s->tail->fill += record_size;
+  s->tail->pending += data_len;
+  s->pending += data_len;
+
+  pthread_mutex_unlock (&s->lock);
+  return (0);
+} /* }}} int c_spool_append */
+
+int c_spool_shift (c_spool_t *s, void **ret_data, /* {{{ */
+    size_t *ret_data_len)
+{
+  if ((s == NULL) || (ret_data == NULL) || (ret_data_len == NULL))
+    return (EINVAL);
+
+  pthread_mutex_lock (&s->lock);
+
+  if (s->replay_rate > 0)
+  {
+    cdtime_t now = cdtime ();
+
+    s->tokens += CDTIME_T_TO_DOUBLE (now - s->tokens_time)
+      * (double) s->replay_rate;
+    if (s->tokens > (double) s->replay_rate)
+      s->tokens = (double) s->replay_rate;
+    s->tokens_time = now;
+
+    if (s->tokens <= 0.0)
+    {
+      pthread_mutex_unlock (&s->lock);
+      return (EAGAIN);
+    }
+  }
+
+  while (s->head != NULL)
+  {
+    spool_segment_t *seg = s->head;
+    spool_record_header_t *hdr;
+    char *record_data;
+    void *copy;
+
+    if ((seg->read_pos >= seg->fill) || (spool_segment_map (s, seg) != 0))
+    {
+      spool_remove_head (s);
+      continue;
+    }
+
+    hdr = (void *) (seg->data + seg->read_pos);
+    record_data = seg->data + seg->read_pos + SPOOL_HEADER_SIZE;
+
+    hdr->flags |= SPOOL_FLAG_TAKEN;
+    seg->read_pos += SPOOL_ALIGN (SPOOL_HEADER_SIZE + hdr->length);
+    seg->pending -= hdr->length;
+    s->pending -= hdr->length;
+
+    if (spool_crc32 (record_data, hdr->length) != hdr->checksum)
+    {
+      WARNING ("spool: Dropping a damaged record of %"PRIu32" bytes "
+          "from %s.", hdr->length, s->directory);
+      continue;
+    }
+
+    copy = malloc (hdr->length > 0 ? hdr->length : 1);
+    if (copy == NULL)
+    {
+      ERROR ("spool: malloc failed.");
+      pthread_mutex_unlock (&s->lock);
+      return (ENOMEM);
+    }
+    memcpy (copy, record_data, hdr->length);
+
+    *ret_data = copy;
+    *ret_data_len = hdr->length;
+    s->tokens -= (double) hdr->length;
+
+    /* Don't keep files around which hold nothing but taken records. */
+    if (seg->read_pos >= seg->fill)
+      spool_remove_head (s);
+
+    if (s->pending == 0)
+      c_release (LOG_INFO, &s->full_complaint,
+          "spool: %s has been drained.", s->directory);
+
+    pthread_mutex_unlock (&s->lock);
+    return (0);
+  }
+
+  pthread_mutex_unlock (&s->lock);
+  return (ENOENT);
+} /* }}} int c_spool_shift */
+
+uint64_t c_spool_pending (c_spool_t *s) /* {{{ */
+{
+  uint64_t pending;
+
+  if (s == NULL)
+    return (0);
+
+  pthread_mutex_lock (&s->lock);
+  pending = s->pending;
+  pthread_mutex_unlock (&s->lock);
+
+  return (pending);
+} /* }}} uint64_t c_spool_pending */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
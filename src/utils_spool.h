@@ -0,0 +1,125 @@
+/**
+ * collectd - src/utils_spool.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_SPOOL_H
+#define UTILS_SPOOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "configfile.h"
+
+/*
+ * A queue of opaque records on disk, used by network writers to keep data
+ * they cannot deliver while the server is unavailable. Records are appended
+ * to memory mapped segment files in a directory of their own and carry a
+ * checksum, so that the spool survives restarts of the daemon and damaged
+ * records are detected. Segment files are removed as soon as all of their
+ * records have been taken, so an unused spool takes no space on disk.
+ *
+ * All functions are thread-safe.
+ */
+struct c_spool_s;
+typedef struct c_spool_s c_spool_t;
+
+/* Defaults for the "SpoolMaxSize" and "SpoolReplayRate" options of the
+ * plugins using a spool, in bytes and bytes per second. */
+#define C_SPOOL_DEFAULT_MAX_SIZE    (256 * 1024 * 1024)
+#define C_SPOOL_DEFAULT_REPLAY_RATE (1024 * 1024)
+
+/*
+ * NAME
+ *   c_spool_create
+ *
+ * DESCRIPTION
+ *   Opens the spool in `directory', creating the directory if necessary.
+ *   Records left by a previous run are picked up again. The segment files
+ *   take up to `max_size' bytes; when more space is needed, the oldest
+ *   records are dropped. `c_spool_shift' hands out at most `replay_rate'
+ *   bytes per second, or any amount if `replay_rate' is zero.
+ *
+ * RETURN VALUE
+ *   A c_spool_t-pointer upon success or NULL upon failure.
+ */
+c_spool_t *c_spool_create (const char *directory, uint64_t max_size,
+    uint64_t replay_rate);
+
+/*
+ * NAME
+ *   c_spool_config_size
+ *
+ * DESCRIPTION
+ *   Reads a positive number from the config item `ci', e.g. "SpoolMaxSize"
+ *   in megabytes, and stores it in `*dest' multiplied by `unit'.
+ *
+ * RETURN VALUE
+ *   Zero upon success, non-zero otherwise. `*dest' is not changed then.
+ */
+int c_spool_config_size (oconfig_item_t *ci, uint64_t *dest, uint64_t unit);
+
+/*
+ * NAME
+ *   c_spool_destroy
+ *
+ * DESCRIPTION
+ *   Closes the spool. Records which have not been taken remain on disk.
+ */
+void c_spool_destroy (c_spool_t *s);
+
+/*
+ * NAME
+ *   c_spool_append
+ *
+ * DESCRIPTION
+ *   Appends a copy of `data' as a new record.
+ *
+ * RETURN VALUE
+ *   Zero upon success, E2BIG if the record cannot fit into the spool and
+ *   another non-zero value if writing to the disk failed.
+ */
+int c_spool_append (c_spool_t *s, const void *data, size_t data_len);
+
+/*
+ * NAME
+ *   c_spool_shift
+ *
+ * DESCRIPTION
+ *   Removes the oldest record from the spool and stores a copy in
+ *   `*ret_data', which the caller must free. If the caller fails to deliver
+ *   the record, it can put it back using `c_spool_append'.
+ *
+ * RETURN VALUE
+ *   Zero upon success, ENOENT if the spool is empty and EAGAIN if the
+ *   replay rate has been exhausted for now.
+ */
+int c_spool_shift (c_spool_t *s, void **ret_data, size_t *ret_data_len);
+
+/*
+ * NAME
+ *   c_spool_pending
+ *
+ * DESCRIPTION
+ *   Returns the number of bytes in records which have not been taken yet.
+ */
+uint64_t c_spool_pending (c_spool_t *s);
+
+#endif /* UTILS_SPOOL_H */
@@ -25,26 +25,135 @@
  *   the end of a file.
  **/
 
+
 #include "collectd.h"
 #include "common.h"
 #include "utils_tail.h"
 
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+/* Data is read in blocks of this size. Longer lines are split. */
+#define CU_TAIL_BUFFER_SIZE 65536
+
 struct cu_tail_s
 {
 	char  *file;
-	FILE  *fh;
+	int    fd;
 	struct stat stat;
+	off_t  offset;
+
+	/* Lines are split in place. `buffer' holds `buffer_fill' bytes, of which
+	 * the ones before `line_start' have been returned already. */
+	char  *buffer;
+	size_t buffer_fill;
+	size_t line_start;
+
+	/* With inotify, the file is only read after it has been modified and
+	 * only reopened after it has been moved, deleted or created. */
+	int    inotify_fd;
+	_Bool  modified;
+	_Bool  rotated;
 };
 
-static int cu_tail_reopen (cu_tail_t *obj)
+#if HAVE_SYS_INOTIFY_H
+static void cu_tail_watch_close (cu_tail_t *obj)
+{
+  if (obj->inotify_fd < 0)
+    return;
+
+  close (obj->inotify_fd);
+  obj->inotify_fd = -1;
+} /* void cu_tail_watch_close */
+
+/* Reads all pending events and updates the `modified' and `rotated' flags. */
+static void cu_tail_watch_check (cu_tail_t *obj)
+{
+  const char *name;
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  name = strrchr (obj->file, '/');
+  name = (name != NULL) ? (name + 1) : obj->file;
+
+  while (42)
+  {
+    ssize_t len;
+    char *ptr;
+
+    len = read (obj->inotify_fd, buffer, sizeof (buffer));
+    if ((len < 0) && (errno == EINTR))
+      continue;
+    else if (len < 0)
+    {
+      if (errno != EAGAIN)
+      {
+	char errbuf[1024];
+	WARNING ("utils_tail: Reading inotify events for `%s' failed, "
+	    "falling back to polling: %s", obj->file,
+	    sstrerror (errno, errbuf, sizeof (errbuf)));
+	cu_tail_watch_close (obj);
+	obj->modified = 1;
+	obj->rotated = 1;
+      }
+      return;
+    }
+    else if (len == 0)
+      return;
+
+    for (ptr = buffer; ptr < buffer + len; )
+    {
+      struct inotify_event *ev = (struct inotify_event *) ptr;
+
+      ptr += sizeof (*ev) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+	obj->modified = 1;
+	obj->rotated = 1;
+	continue;
+      }
+
+      if ((ev->len == 0) || (strcmp (ev->name, name) != 0))
+	continue;
+
+      if (ev->mask & IN_MODIFY)
+	obj->modified = 1;
+      else
+	obj->rotated = 1;
+    }
+  }
+} /* void cu_tail_watch_check */
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Returns zero if the file is still the same, i.e. the open file may have
+ * grown. Sets `*ret_reopen' if the file appears to have been replaced. */
+static int cu_tail_check (cu_tail_t *obj, struct stat *stat_buf,
+    _Bool *ret_reopen)
 {
-  int seek_end = 0;
-  FILE *fh;
-  struct stat stat_buf;
   int status;
 
-  memset (&stat_buf, 0, sizeof (stat_buf));
-  status = stat (obj->file, &stat_buf);
+  *ret_reopen = 0;
+
+#if HAVE_SYS_INOTIFY_H
+  /* Nothing has happened to the file since the last check, so there's no
+   * need to look at it. */
+  if ((obj->inotify_fd >= 0) && (obj->fd >= 0) && !obj->rotated)
+  {
+    if (!obj->modified)
+      return (1);
+
+    /* The file may have been truncated; it's still open, so there's no
+     * path to look up. */
+    status = fstat (obj->fd, stat_buf);
+    if (status == 0)
+      return (0);
+  }
+#endif
+
+  memset (stat_buf, 0, sizeof (*stat_buf));
+  status = stat (obj->file, stat_buf);
   if (status != 0)
   {
     char errbuf[1024];
@@ -53,25 +162,53 @@ static int cu_tail_reopen (cu_tail_t *obj)
     return (-1);
   }
 
+  if ((obj->fd < 0) || (stat_buf->st_ino != obj->stat.st_ino))
+    *ret_reopen = 1;
+
+  return (0);
+} /* int cu_tail_check */
+
+/* Returns zero if the file has been (re-)opened, greater than zero if the
+ * already open file is still current and less than zero upon failure. */
+static int cu_tail_reopen (cu_tail_t *obj)
+{
+  int seek_end = 0;
+  int fd;
+  struct stat stat_buf;
+  _Bool reopen;
+  int status;
+
+#if HAVE_SYS_INOTIFY_H
+  if (obj->inotify_fd >= 0)
+    cu_tail_watch_check (obj);
+#endif
+
+  status = cu_tail_check (obj, &stat_buf, &reopen);
+  if (status != 0)
+    return (status);
+
   /* The file is already open.. */
-  if ((obj->fh != NULL) && (stat_buf.st_ino == obj->stat.st_ino))
+  if (!reopen)
   {
     /* Seek to the beginning if file was truncated */
-    if (stat_buf.st_size < obj->stat.st_size)
+    if (stat_buf.st_size < obj->offset)
     {
       INFO ("utils_tail: File `%s' was truncated.", obj->file);
-      status = fseek (obj->fh, 0, SEEK_SET);
-      if (status != 0)
+      if (lseek (obj->fd, 0, SEEK_SET) == (off_t) -1)
       {
 	char errbuf[1024];
-	ERROR ("utils_tail: fseek (%s) failed: %s", obj->file,
+	ERROR ("utils_tail: lseek (%s) failed: %s", obj->file,
 	    sstrerror (errno, errbuf, sizeof (errbuf)));
-	fclose (obj->fh);
-	obj->fh = NULL;
+	close (obj->fd);
+	obj->fd = -1;
 	return (-1);
       }
+      obj->offset = 0;
+      obj->buffer_fill = 0;
+      obj->line_start = 0;
     }
     memcpy (&obj->stat, &stat_buf, sizeof (struct stat));
+    obj->modified = 0;
     return (1);
   }
 
@@ -80,36 +217,169 @@ static int cu_tail_reopen (cu_tail_t *obj)
   if ((obj->stat.st_ino == 0) || (obj->stat.st_ino == stat_buf.st_ino))
     seek_end = 1;
 
-  fh = fopen (obj->file, "r");
-  if (fh == NULL)
+  fd = open (obj->file, O_RDONLY);
+  if (fd < 0)
   {
     char errbuf[1024];
-    ERROR ("utils_tail: fopen (%s) failed: %s", obj->file,
+    ERROR ("utils_tail: open (%s) failed: %s", obj->file,
 	sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
+  obj->offset = 0;
   if (seek_end != 0)
   {
-    status = fseek (fh, 0, SEEK_END);
-    if (status != 0)
+    obj->offset = lseek (fd, 0, SEEK_END);
+    if (obj->offset == (off_t) -1)
     {
       char errbuf[1024];
-      ERROR ("utils_tail: fseek (%s) failed: %s", obj->file,
+      ERROR ("utils_tail: lseek (%s) failed: %s", obj->file,
 	  sstrerror (errno, errbuf, sizeof (errbuf)));
-      fclose (fh);
+      close (fd);
+      obj->offset = 0;
       return (-1);
     }
   }
 
-  if (obj->fh != NULL)
-    fclose (obj->fh);
-  obj->fh = fh;
+  if (obj->fd >= 0)
+    close (obj->fd);
+  obj->fd = fd;
   memcpy (&obj->stat, &stat_buf, sizeof (struct stat));
+  obj->modified = 0;
+  obj->rotated = 0;
 
   return (0);
 } /* int cu_tail_reopen */
 
+/* Returns the partial line at the end of the buffer, e.g. when the file
+ * it was read from has been replaced. */
+static int cu_tail_flush_line (cu_tail_t *obj, char **ret_line,
+    size_t *ret_len)
+{
+  if (obj->line_start >= obj->buffer_fill)
+  {
+    obj->buffer_fill = 0;
+    obj->line_start = 0;
+    return (0);
+  }
+
+  obj->buffer[obj->buffer_fill] = 0;
+  *ret_line = obj->buffer + obj->line_start;
+  *ret_len = obj->buffer_fill - obj->line_start;
+
+  obj->buffer_fill = 0;
+  obj->line_start = 0;
+  return (1);
+} /* int cu_tail_flush_line */
+
+/* Returns one if a line has been stored in `ret_line', zero if the end of the
+ * file has been reached and less than zero upon failure. The line is null
+ * terminated instead of newline terminated and valid until the next call. */
+static int cu_tail_next_line (cu_tail_t *obj, char **ret_line,
+    size_t *ret_len)
+{
+  while (42)
+  {
+    char *start;
+    char *newline;
+    ssize_t len;
+
+    start = obj->buffer + obj->line_start;
+    newline = memchr (start, '\n', obj->buffer_fill - obj->line_start);
+    if (newline != NULL)
+    {
+      *newline = 0;
+      *ret_line = start;
+      *ret_len = (size_t) (newline - start);
+      obj->line_start += *ret_len + 1;
+      return (1);
+    }
+
+    /* Move the incomplete line to the front and read more. */
+    if (obj->line_start > 0)
+    {
+      obj->buffer_fill -= obj->line_start;
+      memmove (obj->buffer, start, obj->buffer_fill);
+      obj->line_start = 0;
+    }
+
+    /* The line doesn't fit into the buffer. Return what we have. */
+    if (obj->buffer_fill >= CU_TAIL_BUFFER_SIZE)
+      return (cu_tail_flush_line (obj, ret_line, ret_len));
+
+    len = read (obj->fd, obj->buffer + obj->buffer_fill,
+	CU_TAIL_BUFFER_SIZE - obj->buffer_fill);
+    if ((len < 0) && (errno == EINTR))
+      continue;
+    else if (len < 0)
+    {
+      char errbuf[1024];
+      WARNING ("utils_tail: read (%s) failed: %s", obj->file,
+	  sstrerror (errno, errbuf, sizeof (errbuf)));
+      return (-1);
+    }
+    else if (len == 0)
+      return (0);
+
+    obj->buffer_fill += (size_t) len;
+    obj->offset += (off_t) len;
+  }
+} /* int cu_tail_next_line */
+
+/* Like `cu_tail_next_line', but upon EOF checks whether the file has been
+ * truncated or replaced and continues reading if so. Returns zero if there's
+ * nothing more to read. */
+static int cu_tail_get_line (cu_tail_t *obj, char **ret_line,
+    size_t *ret_len)
+{
+  int status;
+
+  if (obj->fd < 0)
+  {
+    status = cu_tail_reopen (obj);
+    if (status < 0)
+      return (status);
+  }
+  assert (obj->fd >= 0);
+
+  status = cu_tail_next_line (obj, ret_line, ret_len);
+  if (status > 0)
+    return (status);
+  else if (status < 0)
+  {
+    /* Jupp, error. Force `cu_tail_reopen' to reopen the file.. */
+    close (obj->fd);
+    obj->fd = -1;
+    obj->buffer_fill = 0;
+    obj->line_start = 0;
+  }
+  /* else: eof -> check if the file was moved away and reopen the new file if
+   * so.. */
+
+  status = cu_tail_reopen (obj);
+  /* error -> return with error */
+  if (status < 0)
+    return (status);
+  /* file end reached and file not reopened -> nothing more to read. If the
+   * file has been truncated, start over. */
+  else if (status > 0)
+    return ((obj->offset == 0) ? cu_tail_next_line (obj, ret_line, ret_len)
+	: 0);
+
+  /* If we get here: file was re-opened. The last line of the old file is
+   * complete, even without a newline. */
+  if (cu_tail_flush_line (obj, ret_line, ret_len) > 0)
+    return (1);
+
+  status = cu_tail_next_line (obj, ret_line, ret_len);
+  if (status < 0)
+  {
+    close (obj->fd);
+    obj->fd = -1;
+  }
+  return (status);
+} /* int cu_tail_get_line */
+
 cu_tail_t *cu_tail_create (const char *file)
 {
 	cu_tail_t *obj;
@@ -126,90 +396,131 @@ cu_tail_t *cu_tail_create (const char *file)
 		return (NULL);
 	}
 
-	obj->fh = NULL;
+	/* One more byte for the null terminating a line which fills the
+	 * buffer. */
+	obj->buffer = malloc (CU_TAIL_BUFFER_SIZE + 1);
+	if (obj->buffer == NULL)
+	{
+		free (obj->file);
+		free (obj);
+		return (NULL);
+	}
+
+	obj->fd = -1;
+	obj->inotify_fd = -1;
 
 	return (obj);
 } /* cu_tail_t *cu_tail_create */
 
 int cu_tail_destroy (cu_tail_t *obj)
 {
-	if (obj->fh != NULL)
-		fclose (obj->fh);
+	if (obj->fd >= 0)
+		close (obj->fd);
+#if HAVE_SYS_INOTIFY_H
+	cu_tail_watch_close (obj);
+#endif
+	free (obj->buffer);
 	free (obj->file);
 	free (obj);
 
 	return (0);
 } /* int cu_tail_destroy */
 
-int cu_tail_readline (cu_tail_t *obj, char *buf, int buflen)
+int cu_tail_watch (cu_tail_t *obj)
 {
+#if HAVE_SYS_INOTIFY_H
+  char dir[PATH_MAX];
+  char *ptr;
   int status;
 
-  if (buflen < 1)
+  if (obj->inotify_fd >= 0)
+    return (0);
+
+  sstrncpy (dir, obj->file, sizeof (dir));
+  ptr = strrchr (dir, '/');
+  if (ptr == NULL)
+    sstrncpy (dir, ".", sizeof (dir));
+  else if (ptr == dir)
+    ptr[1] = 0;
+  else
+    ptr[0] = 0;
+
+  obj->inotify_fd = inotify_init ();
+  if (obj->inotify_fd < 0)
   {
-    ERROR ("utils_tail: cu_tail_readline: buflen too small: %i bytes.",
-	buflen);
+    char errbuf[1024];
+    ERROR ("utils_tail: inotify_init failed: %s",
+	sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
-  if (obj->fh == NULL)
+  status = fcntl (obj->inotify_fd, F_SETFL,
+      fcntl (obj->inotify_fd, F_GETFL) | O_NONBLOCK);
+  if (status != 0)
   {
-    status = cu_tail_reopen (obj);
-    if (status < 0)
-      return (status);
+    char errbuf[1024];
+    ERROR ("utils_tail: fcntl (O_NONBLOCK) failed: %s",
+	sstrerror (errno, errbuf, sizeof (errbuf)));
+    cu_tail_watch_close (obj);
+    return (-1);
   }
-  assert (obj->fh != NULL);
 
-  /* Try to read from the filehandle. If that succeeds, everything appears to
-   * be fine and we can return. */
-  clearerr (obj->fh);
-  if (fgets (buf, buflen, obj->fh) != NULL)
+  /* Watching the directory reports the file being written to as well as
+   * being replaced. */
+  status = inotify_add_watch (obj->inotify_fd, dir, IN_MODIFY
+      | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+  if (status < 0)
   {
-    buf[buflen - 1] = 0;
-    return (0);
+    char errbuf[1024];
+    ERROR ("utils_tail: inotify_add_watch (%s) failed: %s", dir,
+	sstrerror (errno, errbuf, sizeof (errbuf)));
+    cu_tail_watch_close (obj);
+    return (-1);
   }
 
-  /* Check if we encountered an error */
-  if (ferror (obj->fh) != 0)
+  /* Check the file once, to catch up with anything that happened before the
+   * watch was added. */
+  obj->modified = 1;
+  obj->rotated = 1;
+  return (0);
+#else
+  ERROR ("utils_tail: Watching `%s' isn't supported on this system.",
+      obj->file);
+  return (ENOTSUP);
+#endif
+} /* int cu_tail_watch */
+
+int cu_tail_readline (cu_tail_t *obj, char *buf, int buflen)
+{
+  char *line;
+  size_t len;
+  int status;
+
+  if (buflen < 1)
   {
-    /* Jupp, error. Force `cu_tail_reopen' to reopen the file.. */
-    fclose (obj->fh);
-    obj->fh = NULL;
+    ERROR ("utils_tail: cu_tail_readline: buflen too small: %i bytes.",
+	buflen);
+    return (-1);
   }
-  /* else: eof -> check if the file was moved away and reopen the new file if
-   * so.. */
 
-  status = cu_tail_reopen (obj);
-  /* error -> return with error */
+  status = cu_tail_get_line (obj, &line, &len);
   if (status < 0)
     return (status);
-  /* file end reached and file not reopened -> nothing more to read */
-  else if (status > 0)
+  /* EOf */
+  else if (status == 0)
   {
     buf[0] = 0;
     return (0);
   }
 
-  /* If we get here: file was re-opened and there may be more to read.. Let's
-   * try again. */
-  if (fgets (buf, buflen, obj->fh) != NULL)
-  {
-    buf[buflen - 1] = 0;
-    return (0);
-  }
+  /* Keep the newline, like fgets(3) does. */
+  if (len > (size_t) (buflen - 2))
+    len = (buflen > 1) ? (size_t) (buflen - 2) : 0;
+  memcpy (buf, line, len);
+  if (buflen > 1)
+    buf[len++] = '\n';
+  buf[len] = 0;
 
-  if (ferror (obj->fh) != 0)
-  {
-    char errbuf[1024];
-    WARNING ("utils_tail: fgets (%s) returned an error: %s", obj->file,
-	sstrerror (errno, errbuf, sizeof (errbuf)));
-    fclose (obj->fh);
-    obj->fh = NULL;
-    return (-1);
-  }
-
-  /* EOf, well, apparently the new file is empty.. */
-  buf[0] = 0;
   return (0);
 } /* int cu_tail_readline */
 
@@ -220,29 +531,24 @@ int cu_tail_read (cu_tail_t *obj, char *buf, int buflen, tailfunc_t *callback,
 
 	while (42)
 	{
+		char *line;
 		size_t len;
 
-		status = cu_tail_readline (obj, buf, buflen);
-		if (status != 0)
+		status = cu_tail_get_line (obj, &line, &len);
+		if (status < 0)
 		{
-			ERROR ("utils_tail: cu_tail_read: cu_tail_readline "
+			ERROR ("utils_tail: cu_tail_read: cu_tail_get_line "
 					"failed.");
 			break;
 		}
 
 		/* check for EOF */
-		if (buf[0] == 0)
+		if (status == 0)
 			break;
 
-		len = strlen (buf);
-		while (len > 0) {
-			if (buf[len - 1] != '\n')
-				break;
-			buf[len - 1] = '\0';
-			len--;
-		}
-
-		status = callback (data, buf, buflen);
+		/* Lines are passed in place; `buf' is only kept for
+		 * compatibility. */
+		status = callback (data, line, (int) len + 1);
 		if (status != 0)
 		{
 			ERROR ("utils_tail: cu_tail_read: callback returned "
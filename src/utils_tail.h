@@ -54,13 +54,26 @@ cu_tail_t *cu_tail_create (const char *file);
  */
 int cu_tail_destroy (cu_tail_t *obj);
 
+/*
+ * cu_tail_watch
+ *
+ * Uses inotify to find out whether the file has been written to, truncated
+ * or replaced, rather than looking it up each time the end of the file is
+ * reached. Changes made by other hosts, e.g. to files on NFS, aren't noticed
+ * this way.
+ *
+ * Returns 0 when successful and non-zero if inotify isn't available.
+ */
+int cu_tail_watch (cu_tail_t *obj);
+
 /*
  * cu_tail_readline
  *
- * Reads from the file until `buflen' characters are read, a newline
- * character is read, or an eof condition is encountered. `buf' is
- * always null-terminated on successful return and isn't touched when non-zero
- * is returned.
+ * Reads the next line from the file and stores it in `buf', including the
+ * newline character. Lines longer than `buflen' are truncated. A line is
+ * only returned once its newline has been written, unless the file has been
+ * replaced. `buf' is always null-terminated on successful return and isn't
+ * touched when non-zero is returned.
  *
  * You can check if the EOF condition is reached by looking at the buffer: If
  * the length of the string stored in the buffer is zero, EOF occurred.
@@ -71,9 +84,12 @@ int cu_tail_destroy (cu_tail_t *obj);
 int cu_tail_readline (cu_tail_t *obj, char *buf, int buflen);
 
 /*
- * cu_tail_readline
+ * cu_tail_read
  *
- * Reads from the file until eof condition or an error is encountered.
+ * Reads from the file until eof condition or an error is encountered and
+ * calls `callback' for each line. The file is read in large blocks and the
+ * line passed to the callback, without its newline, points into the internal
+ * buffer; it's only valid until the callback returns. `buf' isn't used.
  *
  * Returns 0 when successful and non-zero otherwise.
  */
@@ -31,6 +31,8 @@
 #include "utils_tail.h"
 #include "utils_tail_match.h"
 
+#include <regex.h>
+
 struct cu_tail_match_simple_s
 {
   char plugin[DATA_MAX_NAME_LEN];
@@ -56,6 +58,12 @@ struct cu_tail_match_s
 
   cu_tail_match_match_t *matches;
   size_t matches_num;
+
+  /* All regular expressions combined into one. Lines which don't match it
+   * don't need to be checked against each regular expression. */
+  regex_t prefilter;
+  _Bool have_prefilter;
+  _Bool prefilter_done;
 };
 
 /*
@@ -99,12 +107,76 @@ static int simple_submit_match (cu_match_t *match, void *user_data)
   return (0);
 } /* int simple_submit_match */
 
+static void tail_match_prefilter_create (cu_tail_match_t *obj)
+{
+  char *regex;
+  size_t regex_size;
+  size_t i;
+  int status;
+
+  obj->prefilter_done = 1;
+
+  /* Nothing to gain from a single regular expression. */
+  if (obj->matches_num < 2)
+    return;
+
+  regex_size = 1;
+  for (i = 0; i < obj->matches_num; i++)
+  {
+    const char *r = match_get_regex (obj->matches[i].match);
+    const char *ptr;
+
+    if (r == NULL)
+      return;
+
+    /* Back references would refer to the wrong group. */
+    for (ptr = strchr (r, '\\'); ptr != NULL; ptr = strchr (ptr + 2, '\\'))
+    {
+      if (isdigit ((unsigned char) ptr[1]))
+	return;
+      if (ptr[1] == 0)
+	break;
+    }
+
+    regex_size += strlen (r) + 3;
+  }
+
+  regex = malloc (regex_size);
+  if (regex == NULL)
+    return;
+  regex[0] = 0;
+
+  for (i = 0; i < obj->matches_num; i++)
+  {
+    if (i > 0)
+      strcat (regex, "|");
+    strcat (regex, "(");
+    strcat (regex, match_get_regex (obj->matches[i].match));
+    strcat (regex, ")");
+  }
+
+  status = regcomp (&obj->prefilter, regex,
+      REG_EXTENDED | REG_NEWLINE | REG_NOSUB);
+  if (status == 0)
+    obj->have_prefilter = 1;
+  else
+    DEBUG ("tail_match: Combining the regular expressions failed; "
+	"checking each line against every one of them.");
+
+  sfree (regex);
+} /* void tail_match_prefilter_create */
+
 static int tail_callback (void *data, char *buf,
     int __attribute__((unused)) buflen)
 {
   cu_tail_match_t *obj = (cu_tail_match_t *) data;
   size_t i;
 
+  if (obj->have_prefilter
+      && (regexec (&obj->prefilter, buf, /* nmatch = */ 0,
+	  /* pmatch = */ NULL, /* eflags = */ 0) != 0))
+    return (0);
+
   for (i = 0; i < obj->matches_num; i++)
     match_apply (obj->matches[i].match, buf);
 
@@ -162,6 +234,10 @@ void tail_match_destroy (cu_tail_match_t *obj)
   }
 
   sfree (obj->matches);
+
+  if (obj->have_prefilter)
+    regfree (&obj->prefilter);
+
   sfree (obj);
 } /* void tail_match_destroy */
 
@@ -187,6 +263,12 @@ int tail_match_add_match (cu_tail_match_t *obj, cu_match_t *match,
   temp->submit = submit_match;
   temp->free = free_user_data;
 
+  /* Rebuilt on the next read. */
+  if (obj->have_prefilter)
+    regfree (&obj->prefilter);
+  obj->have_prefilter = 0;
+  obj->prefilter_done = 0;
+
   return (0);
 } /* int tail_match_add_match */
 
@@ -233,12 +315,20 @@ int tail_match_add_match_simple (cu_tail_match_t *obj,
   return (status);
 } /* int tail_match_add_match_simple */
 
+int tail_match_watch (cu_tail_match_t *obj)
+{
+  return (cu_tail_watch (obj->tail));
+} /* int tail_match_watch */
+
 int tail_match_read (cu_tail_match_t *obj)
 {
   char buffer[4096];
   int status;
   size_t i;
 
+  if (!obj->prefilter_done)
+    tail_match_prefilter_create (obj);
+
   status = cu_tail_read (obj->tail, buffer, sizeof (buffer), tail_callback,
       (void *) obj);
   if (status != 0)
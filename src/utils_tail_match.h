@@ -107,6 +107,19 @@ int tail_match_add_match_simple (cu_tail_match_t *obj,
     const char *plugin, const char *plugin_instance,
     const char *type, const char *type_instance);
 
+/*
+ * NAME
+ *   tail_match_watch
+ *
+ * DESCRIPTION
+ *   Uses inotify to find out when the file has been written to or replaced,
+ *   see `cu_tail_watch'.
+ *
+ * RETURN VALUE
+ *   Zero on success, nonzero if inotify isn't available.
+ */
+int tail_match_watch (cu_tail_match_t *obj);
+
 /*
  * NAME
  *   tail_match_read
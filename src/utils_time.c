@@ -24,6 +24,27 @@
 #include "plugin.h"
 #include "common.h"
 
+static _Bool coarse_clock = 0;
+
+void cdtime_coarse_enable (_Bool enable) /* {{{ */
+{
+  coarse_clock = enable;
+} /* }}} void cdtime_coarse_enable */
+
+cdtime_t cdtime_coarse (void) /* {{{ */
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_REALTIME_COARSE)
+  struct timespec ts = { 0, 0 };
+
+  /* Falls back to the precise clock if the kernel doesn't provide the
+   * coarse one. */
+  if (coarse_clock && (clock_gettime (CLOCK_REALTIME_COARSE, &ts) == 0))
+    return (TIMESPEC_TO_CDTIME_T (&ts));
+#endif
+
+  return (cdtime ());
+} /* }}} cdtime_t cdtime_coarse */
+
 #if HAVE_CLOCK_GETTIME
 cdtime_t cdtime (void) /* {{{ */
 {
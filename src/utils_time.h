@@ -66,6 +66,13 @@
 
 cdtime_t cdtime (void);
 
+/* Like cdtime(), but with "CoarseClock" enabled it may lag behind by a few
+ * milliseconds, the resolution of the kernel's tick, and is cheaper to call.
+ * Use it for bookkeeping, e.g. when an entry was last updated or when a cache
+ * was last flushed, never for the time of a value. */
+cdtime_t cdtime_coarse (void);
+void cdtime_coarse_enable (_Bool enable);
+
 /* format a cdtime_t value in ISO 8601 format:
  * returns the number of characters written to the string (not including the
  * terminating null byte or 0 on error; the function ensures that the string
@@ -27,10 +27,11 @@
 #include "collectd.h"
 
 #include <regex.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "utils_vl_lookup.h"
-#include "utils_avltree.h"
+#include "utils_htable.h"
 
 #if BUILD_TEST
 # define sstrncpy strncpy
@@ -41,6 +42,10 @@
 } while (0)
 #endif
 
+/* Number of series lookup_search() remembers the result for. When the cache
+ * is full, it is emptied and filled again. */
+#define LU_CACHE_MAX_ENTRIES 65536
+
 /*
  * Types
  */
@@ -66,7 +71,14 @@ typedef struct identifier_match_s identifier_match_t;
 
 struct lookup_s
 {
-  c_avl_tree_t *by_type_tree;
+  c_htable_t *by_type_tree;
+
+  /* Maps series identifiers to lu_cache_entry_t. Matching a series against
+   * the classes always gives the same result, so it is done only once. The
+   * lock also protects the lists of user objects. */
+  c_htable_t *cache;
+  size_t cache_num;
+  pthread_mutex_t lock;
 
   lookup_class_callback_t cb_user_class;
   lookup_obj_callback_t cb_user_obj;
@@ -100,9 +112,26 @@ struct user_class_list_s
   user_class_list_t *next;
 };
 
+/* A user object a series belongs to, and its class. */
+struct lu_match_s
+{
+  user_class_t *user_class;
+  user_obj_t *user_obj;
+};
+typedef struct lu_match_s lu_match_t;
+
+/* All user objects a series belongs to, in the order their callbacks are
+ * called in. For most series, this list is empty. */
+struct lu_cache_entry_s
+{
+  lu_match_t *matches;
+  size_t matches_num;
+};
+typedef struct lu_cache_entry_s lu_cache_entry_t;
+
 struct by_type_entry_s
 {
-  c_avl_tree_t *by_plugin_tree; /* plugin -> user_class_list_t */
+  c_htable_t *by_plugin_tree; /* plugin -> user_class_list_t */
   user_class_list_t *wildcard_plugin_list;
 };
 typedef struct by_type_entry_s by_type_entry_t;
@@ -277,12 +306,14 @@ static user_obj_t *lu_find_user_obj (user_class_t *user_class, /* {{{ */
   return (NULL);
 } /* }}} user_obj_t *lu_find_user_obj */
 
-static int lu_handle_user_class (lookup_t *obj, /* {{{ */
+/* Returns zero and stores the user object of "vl" in "ret_user_obj" if "vl"
+ * matches the class, creating the object if necessary. Returns greater than
+ * zero if it doesn't match and less than zero on error. */
+static int lu_match_user_class (lookup_t *obj, /* {{{ */
     data_set_t const *ds, value_list_t const *vl,
-    user_class_t *user_class)
+    user_class_t *user_class, user_obj_t **ret_user_obj)
 {
   user_obj_t *user_obj;
-  int status;
 
   assert (strcmp (vl->type, user_class->match.type.str) == 0);
   assert (user_class->match.plugin.is_regex
@@ -303,42 +334,106 @@ static int lu_handle_user_class (lookup_t *obj, /* {{{ */
       return (-1);
   }
 
-  status = obj->cb_user_obj (ds, vl,
-      user_class->user_class, user_obj->user_obj);
-  if (status != 0)
-  {
-    ERROR ("utils_vl_lookup: The user object callback failed with status %i.",
-        status);
-    /* Returning a negative value means: abort! */
-    if (status < 0)
-      return (status);
-    else
-      return (1);
-  }
-
+  *ret_user_obj = user_obj;
   return (0);
-} /* }}} int lu_handle_user_class */
+} /* }}} int lu_match_user_class */
 
-static int lu_handle_user_class_list (lookup_t *obj, /* {{{ */
+static int lu_match_user_class_list (lookup_t *obj, /* {{{ */
     data_set_t const *ds, value_list_t const *vl,
-    user_class_list_t *user_class_list)
+    user_class_list_t *user_class_list, lu_cache_entry_t *entry)
 {
   user_class_list_t *ptr;
-  int retval = 0;
-  
+
   for (ptr = user_class_list; ptr != NULL; ptr = ptr->next)
   {
+    user_obj_t *user_obj = NULL;
+    lu_match_t *tmp;
     int status;
 
-    status = lu_handle_user_class (obj, ds, vl, &ptr->entry);
+    status = lu_match_user_class (obj, ds, vl, &ptr->entry, &user_obj);
     if (status < 0)
       return (status);
-    else if (status == 0)
-      retval++;
+    else if (status > 0)
+      continue;
+
+    tmp = realloc (entry->matches,
+        (entry->matches_num + 1) * sizeof (*entry->matches));
+    if (tmp == NULL)
+    {
+      ERROR ("utils_vl_lookup: realloc failed.");
+      return (-1);
+    }
+    entry->matches = tmp;
+    entry->matches[entry->matches_num].user_class = &ptr->entry;
+    entry->matches[entry->matches_num].user_obj = user_obj;
+    entry->matches_num++;
   }
 
-  return (retval);
-} /* }}} int lu_handle_user_class_list */
+  return (0);
+} /* }}} int lu_match_user_class_list */
+
+static void lu_cache_entry_free (lu_cache_entry_t *entry) /* {{{ */
+{
+  if (entry == NULL)
+    return;
+
+  sfree (entry->matches);
+  sfree (entry);
+} /* }}} void lu_cache_entry_free */
+
+/* The lock must be held. */
+static void lu_cache_clear (lookup_t *obj) /* {{{ */
+{
+  char *key = NULL;
+  lu_cache_entry_t *entry = NULL;
+
+  while (c_htable_pick (obj->cache, (void *) &key, (void *) &entry) == 0)
+  {
+    sfree (key);
+    lu_cache_entry_free (entry);
+  }
+  obj->cache_num = 0;
+} /* }}} void lu_cache_clear */
+
+/* Stores the result for the series "key". Returns non-zero if it hasn't been
+ * stored, in which case the caller keeps ownership of "entry". The lock must
+ * be held. */
+static int lu_cache_insert (lookup_t *obj, /* {{{ */
+    char const *key, lu_cache_entry_t *entry)
+{
+  char *key_copy;
+
+  if (obj->cache_num >= LU_CACHE_MAX_ENTRIES)
+    lu_cache_clear (obj);
+
+  key_copy = strdup (key);
+  if (key_copy == NULL)
+    return (-1);
+
+  if (c_htable_insert (obj->cache, key_copy, entry) != 0)
+  {
+    sfree (key_copy);
+    return (-1);
+  }
+  obj->cache_num++;
+
+  return (0);
+} /* }}} int lu_cache_insert */
+
+/* Returns the cache key of "vl": the identity of values being dispatched, the
+ * identifier formatted into "buffer" for all others. */
+static char const *lu_cache_key (value_list_t const *vl, /* {{{ */
+    char *buffer, size_t buffer_size)
+{
+  if (vl->identity != NULL)
+    return (vl->identity);
+
+  snprintf (buffer, buffer_size, "%s/%s-%s/%s-%s",
+      vl->host, vl->plugin, vl->plugin_instance,
+      vl->type, vl->type_instance);
+  buffer[buffer_size - 1] = 0;
+  return (buffer);
+} /* }}} char const *lu_cache_key */
 
 static by_type_entry_t *lu_search_by_type (lookup_t *obj, /* {{{ */
     char const *type, _Bool allocate_if_missing)
@@ -347,7 +442,7 @@ static by_type_entry_t *lu_search_by_type (lookup_t *obj, /* {{{ */
   char *type_copy;
   int status;
 
-  status = c_avl_get (obj->by_type_tree, type, (void *) &by_type);
+  status = c_htable_get (obj->by_type_tree, type, (void *) &by_type);
   if (status == 0)
     return (by_type);
 
@@ -371,22 +466,22 @@ static by_type_entry_t *lu_search_by_type (lookup_t *obj, /* {{{ */
   memset (by_type, 0, sizeof (*by_type));
   by_type->wildcard_plugin_list = NULL;
   
-  by_type->by_plugin_tree = c_avl_create ((void *) strcmp);
+  by_type->by_plugin_tree = c_htable_create ();
   if (by_type->by_plugin_tree == NULL)
   {
-    ERROR ("utils_vl_lookup: c_avl_create failed.");
+    ERROR ("utils_vl_lookup: c_htable_create failed.");
     sfree (by_type);
     sfree (type_copy);
     return (NULL);
   }
 
-  status = c_avl_insert (obj->by_type_tree,
+  status = c_htable_insert (obj->by_type_tree,
       /* key = */ type_copy, /* value = */ by_type);
   assert (status <= 0); /* >0 => entry exists => race condition. */
   if (status != 0)
   {
-    ERROR ("utils_vl_lookup: c_avl_insert failed.");
-    c_avl_destroy (by_type->by_plugin_tree);
+    ERROR ("utils_vl_lookup: c_htable_insert failed.");
+    c_htable_destroy (by_type->by_plugin_tree);
     sfree (by_type);
     sfree (type_copy);
     return (NULL);
@@ -418,7 +513,7 @@ static int lu_add_by_plugin (by_type_entry_t *by_type, /* {{{ */
   {
     int status;
 
-    status = c_avl_get (by_type->by_plugin_tree,
+    status = c_htable_get (by_type->by_plugin_tree,
         match->plugin.str, (void *) &ptr);
 
     if (status != 0) /* plugin not yet in tree */
@@ -432,11 +527,11 @@ static int lu_add_by_plugin (by_type_entry_t *by_type, /* {{{ */
         return (ENOMEM);
       }
 
-      status = c_avl_insert (by_type->by_plugin_tree,
+      status = c_htable_insert (by_type->by_plugin_tree,
           plugin_copy, user_class_list);
       if (status != 0)
       {
-        ERROR ("utils_vl_lookup: c_avl_insert(\"%s\") failed with status %i.",
+        ERROR ("utils_vl_lookup: c_htable_insert(\"%s\") failed with status %i.",
             plugin_copy, status);
         sfree (plugin_copy);
         sfree (user_class_list);
@@ -503,7 +598,7 @@ static void lu_destroy_by_type (lookup_t *obj, /* {{{ */
     user_class_list_t *user_class_list = NULL;
     int status;
 
-    status = c_avl_pick (by_type->by_plugin_tree,
+    status = c_htable_pick (by_type->by_plugin_tree,
         (void *) &plugin, (void *) &user_class_list);
     if (status != 0)
       break;
@@ -514,7 +609,7 @@ static void lu_destroy_by_type (lookup_t *obj, /* {{{ */
     lu_destroy_user_class_list (obj, user_class_list);
   }
 
-  c_avl_destroy (by_type->by_plugin_tree);
+  c_htable_destroy (by_type->by_plugin_tree);
   by_type->by_plugin_tree = NULL;
 
   lu_destroy_user_class_list (obj, by_type->wildcard_plugin_list);
@@ -539,13 +634,23 @@ lookup_t *lookup_create (lookup_class_callback_t cb_user_class, /* {{{ */
   }
   memset (obj, 0, sizeof (*obj));
 
-  obj->by_type_tree = c_avl_create ((void *) strcmp);
+  obj->by_type_tree = c_htable_create ();
   if (obj->by_type_tree == NULL)
   {
-    ERROR ("utils_vl_lookup: c_avl_create failed.");
+    ERROR ("utils_vl_lookup: c_htable_create failed.");
+    sfree (obj);
+    return (NULL);
+  }
+
+  obj->cache = c_htable_create ();
+  if (obj->cache == NULL)
+  {
+    ERROR ("utils_vl_lookup: c_htable_create failed.");
+    c_htable_destroy (obj->by_type_tree);
     sfree (obj);
     return (NULL);
   }
+  pthread_mutex_init (&obj->lock, /* attr = */ NULL);
 
   obj->cb_user_class = cb_user_class;
   obj->cb_user_obj = cb_user_obj;
@@ -567,7 +672,7 @@ void lookup_destroy (lookup_t *obj) /* {{{ */
     char *type = NULL;
     by_type_entry_t *by_type = NULL;
 
-    status = c_avl_pick (obj->by_type_tree, (void *) &type, (void *) &by_type);
+    status = c_htable_pick (obj->by_type_tree, (void *) &type, (void *) &by_type);
     if (status != 0)
       break;
 
@@ -576,9 +681,14 @@ void lookup_destroy (lookup_t *obj) /* {{{ */
     lu_destroy_by_type (obj, by_type);
   }
 
-  c_avl_destroy (obj->by_type_tree);
+  c_htable_destroy (obj->by_type_tree);
   obj->by_type_tree = NULL;
 
+  lu_cache_clear (obj);
+  c_htable_destroy (obj->cache);
+  obj->cache = NULL;
+  pthread_mutex_destroy (&obj->lock);
+
   sfree (obj);
 } /* }}} void lookup_destroy */
 
@@ -587,14 +697,21 @@ int lookup_add (lookup_t *obj, /* {{{ */
 {
   by_type_entry_t *by_type = NULL;
   user_class_list_t *user_class_obj;
+  int status;
+
+  pthread_mutex_lock (&obj->lock);
 
   by_type = lu_search_by_type (obj, ident->type, /* allocate = */ 1);
   if (by_type == NULL)
+  {
+    pthread_mutex_unlock (&obj->lock);
     return (-1);
+  }
 
   user_class_obj = malloc (sizeof (*user_class_obj));
   if (user_class_obj == NULL)
   {
+    pthread_mutex_unlock (&obj->lock);
     ERROR ("utils_vl_lookup: malloc failed.");
     return (ENOMEM);
   }
@@ -604,7 +721,14 @@ int lookup_add (lookup_t *obj, /* {{{ */
   user_class_obj->entry.user_obj_list = NULL;
   user_class_obj->next = NULL;
 
-  return (lu_add_by_plugin (by_type, user_class_obj));
+  status = lu_add_by_plugin (by_type, user_class_obj);
+
+  /* Series may match the new class, too. */
+  lu_cache_clear (obj);
+
+  pthread_mutex_unlock (&obj->lock);
+
+  return (status);
 } /* }}} int lookup_add */
 
 /* returns the number of successful calls to the callback function */
@@ -613,34 +737,87 @@ int lookup_search (lookup_t *obj, /* {{{ */
 {
   by_type_entry_t *by_type = NULL;
   user_class_list_t *user_class_list = NULL;
+  lu_cache_entry_t *entry = NULL;
+  char buffer[6 * DATA_MAX_NAME_LEN];
+  char const *key;
+  _Bool cached = 1;
+  size_t matches_num;
+  size_t i;
   int retval = 0;
   int status;
 
   if ((obj == NULL) || (ds == NULL) || (vl == NULL))
     return (-EINVAL);
 
+  /* Classes are only added while reading the configuration, so types without
+   * any class are skipped without taking the lock. */
   by_type = lu_search_by_type (obj, vl->type, /* allocate = */ 0);
   if (by_type == NULL)
     return (0);
 
-  status = c_avl_get (by_type->by_plugin_tree,
-      vl->plugin, (void *) &user_class_list);
-  if (status == 0)
+  key = lu_cache_key (vl, buffer, sizeof (buffer));
+
+  pthread_mutex_lock (&obj->lock);
+
+  if (c_htable_get (obj->cache, key, (void *) &entry) != 0)
   {
-    status = lu_handle_user_class_list (obj, ds, vl, user_class_list);
-    if (status < 0)
+    entry = calloc (1, sizeof (*entry));
+    if (entry == NULL)
+    {
+      pthread_mutex_unlock (&obj->lock);
+      ERROR ("utils_vl_lookup: calloc failed.");
+      return (-1);
+    }
+
+    status = c_htable_get (by_type->by_plugin_tree,
+        vl->plugin, (void *) &user_class_list);
+    if (status == 0)
+      status = lu_match_user_class_list (obj, ds, vl, user_class_list, entry);
+    else
+      status = 0;
+
+    if ((status == 0) && (by_type->wildcard_plugin_list != NULL))
+      status = lu_match_user_class_list (obj, ds, vl,
+          by_type->wildcard_plugin_list, entry);
+
+    if (status != 0)
+    {
+      pthread_mutex_unlock (&obj->lock);
+      lu_cache_entry_free (entry);
       return (status);
-    retval += status;
+    }
+
+    if (lu_cache_insert (obj, key, entry) != 0)
+      cached = 0;
   }
 
-  if (by_type->wildcard_plugin_list != NULL)
+  /* Copy the matches, so the callbacks can run without holding the lock. */
+  matches_num = entry->matches_num;
+  lu_match_t matches[(matches_num > 0) ? matches_num : 1];
+  if (matches_num > 0)
+    memcpy (matches, entry->matches, matches_num * sizeof (*matches));
+
+  pthread_mutex_unlock (&obj->lock);
+
+  if (!cached)
+    lu_cache_entry_free (entry);
+
+  for (i = 0; i < matches_num; i++)
   {
-    status = lu_handle_user_class_list (obj, ds, vl,
-        by_type->wildcard_plugin_list);
-    if (status < 0)
-      return (status);
-    retval += status;
+    status = obj->cb_user_obj (ds, vl,
+        matches[i].user_class->user_class, matches[i].user_obj->user_obj);
+    if (status != 0)
+    {
+      ERROR ("utils_vl_lookup: The user object callback failed with status %i.",
+          status);
+      /* Returning a negative value means: abort! */
+      if (status < 0)
+        return (status);
+      continue;
+    }
+
+    retval++;
   }
-    
+
   return (retval);
 } /* }}} lookup_search */
@@ -0,0 +1,370 @@
+/**
+ * collectd - src/utils_xml_stream.c
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#include "collectd.h"
+#include "common.h"
+#include "utils_xml_stream.h"
+
+#include <libxml/parser.h>
+
+/* Longer texts are truncated. This is plenty for the numbers and names the
+ * plugins are interested in. */
+#define UXS_TEXT_MAX 4096
+
+struct uxs_s
+{
+  xmlSAXHandler sax;
+  xmlParserCtxtPtr ctxt;
+  int status;
+  char errbuf[256];
+
+  uxs_start_callback_t start;
+  uxs_end_callback_t end;
+  void *user_data;
+
+  /* The path of the current element, e.g. "/html/body/table", and the
+   * offset of each element's slash within it. */
+  char *path;
+  size_t path_len;
+  size_t path_size;
+  size_t *offsets;
+  int depth;
+  int depth_size;
+
+  char text[UXS_TEXT_MAX];
+  size_t text_len;
+};
+
+/*
+ * Private functions
+ */
+static void uxs_error (uxs_t *s, const char *msg) /* {{{ */
+{
+  size_t len;
+
+  if (s->status != 0)
+    return;
+
+  s->status = -1;
+  sstrncpy (s->errbuf, msg, sizeof (s->errbuf));
+
+  /* libxml2's messages end with a newline. */
+  len = strlen (s->errbuf);
+  while ((len > 0) && isspace ((unsigned char) s->errbuf[len - 1]))
+    s->errbuf[--len] = 0;
+
+  if (s->ctxt != NULL)
+    xmlStopParser (s->ctxt);
+} /* }}} void uxs_error */
+
+static int uxs_push (uxs_t *s, const char *name) /* {{{ */
+{
+  size_t name_len = strlen (name);
+
+  if (s->depth >= s->depth_size)
+  {
+    size_t *tmp;
+    int size = (s->depth_size > 0) ? (2 * s->depth_size) : 16;
+
+    tmp = realloc (s->offsets, size * sizeof (*s->offsets));
+    if (tmp == NULL)
+      return (-1);
+    s->offsets = tmp;
+    s->depth_size = size;
+  }
+
+  if ((s->path_len + name_len + 2) > s->path_size)
+  {
+    char *tmp;
+    size_t size = (s->path_size > 0) ? s->path_size : 256;
+
+    while ((s->path_len + name_len + 2) > size)
+      size *= 2;
+
+    tmp = realloc (s->path, size);
+    if (tmp == NULL)
+      return (-1);
+    s->path = tmp;
+    s->path_size = size;
+  }
+
+  s->offsets[s->depth] = s->path_len;
+  s->depth++;
+
+  s->path[s->path_len] = '/';
+  memcpy (s->path + s->path_len + 1, name, name_len + 1);
+  s->path_len += name_len + 1;
+
+  return (0);
+} /* }}} int uxs_push */
+
+static void uxs_pop (uxs_t *s) /* {{{ */
+{
+  if (s->depth <= 0)
+    return;
+
+  s->depth--;
+  s->path_len = s->offsets[s->depth];
+  s->path[s->path_len] = 0;
+} /* }}} void uxs_pop */
+
+static void uxs_sax_start (void *ctx, const xmlChar *name, /* {{{ */
+    const xmlChar **attrs)
+{
+  uxs_t *s = ctx;
+
+  if (s->status != 0)
+    return;
+
+  if (uxs_push (s, (const char *) name) != 0)
+  {
+    uxs_error (s, "Out of memory.");
+    return;
+  }
+  s->text_len = 0;
+
+  if (s->start != NULL)
+    (*s->start) (s, (const char *) name, (const char **) attrs,
+        s->user_data);
+} /* }}} void uxs_sax_start */
+
+static void uxs_sax_end (void *ctx, const xmlChar *name) /* {{{ */
+{
+  uxs_t *s = ctx;
+  char *text;
+  size_t len;
+
+  if (s->status != 0)
+    return;
+
+  s->text[s->text_len] = 0;
+
+  text = s->text;
+  while (isspace ((unsigned char) *text))
+    text++;
+  len = s->text_len - (text - s->text);
+  while ((len > 0) && isspace ((unsigned char) text[len - 1]))
+    text[--len] = 0;
+
+  if (s->end != NULL)
+    (*s->end) (s, (const char *) name, text, s->user_data);
+
+  uxs_pop (s);
+  s->text_len = 0;
+} /* }}} void uxs_sax_end */
+
+static void uxs_sax_characters (void *ctx, const xmlChar *ch, /* {{{ */
+    int len)
+{
+  uxs_t *s = ctx;
+  size_t avail;
+
+  if ((s->status != 0) || (len <= 0))
+    return;
+
+  avail = sizeof (s->text) - 1 - s->text_len;
+  if ((size_t) len > avail)
+    len = (int) avail;
+
+  memcpy (s->text + s->text_len, ch, (size_t) len);
+  s->text_len += (size_t) len;
+} /* }}} void uxs_sax_characters */
+
+static void uxs_check_ctxt (uxs_t *s, int status) /* {{{ */
+{
+  xmlErrorPtr err;
+
+  if ((status == 0) && s->ctxt->wellFormed)
+    return;
+
+  err = xmlCtxtGetLastError (s->ctxt);
+  uxs_error (s, ((err != NULL) && (err->message != NULL))
+      ? err->message : "Parsing the document failed.");
+} /* }}} void uxs_check_ctxt */
+
+/*
+ * Public functions
+ */
+uxs_t *uxs_create (uxs_start_callback_t start, /* {{{ */
+    uxs_end_callback_t end, void *user_data)
+{
+  uxs_t *s;
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return (NULL);
+
+  /* Not thread-safe, which is why it's called here rather than on first
+   * use. */
+  xmlInitParser ();
+
+  /* The old (SAX1) callbacks; the parser doesn't build a tree when
+   * `initialized' isn't set to XML_SAX2_MAGIC. */
+  s->sax.startElement = uxs_sax_start;
+  s->sax.endElement = uxs_sax_end;
+  s->sax.characters = uxs_sax_characters;
+  s->sax.cdataBlock = uxs_sax_characters;
+
+  s->start = start;
+  s->end = end;
+  s->user_data = user_data;
+
+  return (s);
+} /* }}} uxs_t *uxs_create */
+
+void uxs_destroy (uxs_t *s) /* {{{ */
+{
+  if (s == NULL)
+    return;
+
+  uxs_reset (s);
+  sfree (s->path);
+  sfree (s->offsets);
+  sfree (s);
+} /* }}} void uxs_destroy */
+
+int uxs_feed (uxs_t *s, const char *data, size_t len) /* {{{ */
+{
+  int status;
+
+  if (s->status != 0)
+    return (s->status);
+
+  if (s->ctxt == NULL)
+  {
+    s->ctxt = xmlCreatePushParserCtxt (&s->sax, s,
+        /* chunk = */ NULL, /* size = */ 0, /* filename = */ NULL);
+    if (s->ctxt == NULL)
+    {
+      uxs_error (s, "xmlCreatePushParserCtxt failed.");
+      return (s->status);
+    }
+    xmlCtxtUseOptions (s->ctxt, XML_PARSE_NONET);
+  }
+
+  /* xmlParseChunk takes an int. */
+  while ((len > 0) && (s->status == 0))
+  {
+    int chunk_len = (len > INT_MAX) ? INT_MAX : (int) len;
+
+    status = xmlParseChunk (s->ctxt, data, chunk_len, /* terminate = */ 0);
+    uxs_check_ctxt (s, status);
+
+    data += chunk_len;
+    len -= (size_t) chunk_len;
+  }
+
+  return (s->status);
+} /* }}} int uxs_feed */
+
+int uxs_finish (uxs_t *s) /* {{{ */
+{
+  int status;
+
+  if ((s->status == 0) && (s->ctxt == NULL))
+    uxs_error (s, "The document is empty.");
+
+  if (s->status == 0)
+  {
+    status = xmlParseChunk (s->ctxt, NULL, 0, /* terminate = */ 1);
+    uxs_check_ctxt (s, status);
+  }
+
+  status = s->status;
+
+  /* Keep the error message around for uxs_strerror. */
+  if (s->ctxt != NULL)
+  {
+    xmlFreeParserCtxt (s->ctxt);
+    s->ctxt = NULL;
+  }
+  s->status = 0;
+  s->depth = 0;
+  s->path_len = 0;
+  s->text_len = 0;
+
+  return (status);
+} /* }}} int uxs_finish */
+
+void uxs_reset (uxs_t *s) /* {{{ */
+{
+  if (s->ctxt != NULL)
+  {
+    xmlFreeParserCtxt (s->ctxt);
+    s->ctxt = NULL;
+  }
+
+  s->status = 0;
+  s->errbuf[0] = 0;
+  s->depth = 0;
+  s->path_len = 0;
+  s->text_len = 0;
+} /* }}} void uxs_reset */
+
+const char *uxs_strerror (uxs_t *s) /* {{{ */
+{
+  return ((s->errbuf[0] != 0) ? s->errbuf : "Success");
+} /* }}} const char *uxs_strerror */
+
+int uxs_depth (uxs_t *s) /* {{{ */
+{
+  return (s->depth);
+} /* }}} int uxs_depth */
+
+int uxs_matches (uxs_t *s, int depth, const char *path) /* {{{ */
+{
+  size_t path_len;
+  size_t end;
+
+  if ((depth < 1) || (depth > s->depth))
+    return (0);
+
+  end = (depth < s->depth) ? s->offsets[depth] : s->path_len;
+
+  if (strncmp ("//", path, 2) == 0)
+  {
+    /* Compare with the end of the path, starting at a slash. */
+    path++;
+    path_len = strlen (path);
+    if (path_len > end)
+      return (0);
+    return (memcmp (s->path + end - path_len, path, path_len) == 0);
+  }
+
+  path_len = strlen (path);
+  return ((path_len == end) && (memcmp (s->path, path, path_len) == 0));
+} /* }}} int uxs_matches */
+
+const char *uxs_attribute (const char **attrs, const char *name) /* {{{ */
+{
+  size_t i;
+
+  if (attrs == NULL)
+    return (NULL);
+
+  for (i = 0; attrs[i] != NULL; i += 2)
+    if (strcmp (attrs[i], name) == 0)
+      return (attrs[i + 1]);
+
+  return (NULL);
+} /* }}} const char *uxs_attribute */
+
+/* vim: set sw=2 sts=2 et fdm=marker : */
@@ -0,0 +1,111 @@
+/**
+ * collectd - src/utils_xml_stream.h
+ * Copyright (C) 2013  Florian octo Forster
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * Authors:
+ *   Florian octo Forster <octo at collectd.org>
+ **/
+
+#ifndef UTILS_XML_STREAM_H
+#define UTILS_XML_STREAM_H 1
+
+#include <stddef.h>
+
+/*
+ * An incremental XML parser for documents which arrive in chunks, e.g. from
+ * a curl write callback. Instead of building a tree, the parser calls back
+ * at the start and the end of each element. Only the names of the open
+ * elements and the text of the current element are kept, so memory use
+ * depends on the depth of the document rather than its size.
+ */
+struct uxs_s;
+typedef struct uxs_s uxs_t;
+
+/*
+ * Called when an element starts. `attrs' is a NULL terminated array of
+ * name/value pairs and may be NULL if the element has no attributes.
+ */
+typedef void (*uxs_start_callback_t) (uxs_t *s, const char *name,
+    const char **attrs, void *user_data);
+
+/*
+ * Called when an element ends. `text' is the text of the element with
+ * surrounding white space removed. For elements with children, only the
+ * text following the last child is passed.
+ */
+typedef void (*uxs_end_callback_t) (uxs_t *s, const char *name,
+    const char *text, void *user_data);
+
+uxs_t *uxs_create (uxs_start_callback_t start, uxs_end_callback_t end,
+    void *user_data);
+void uxs_destroy (uxs_t *s);
+
+/*
+ * NAME
+ *   uxs_feed
+ *
+ * DESCRIPTION
+ *   Parses the next `len' bytes of the document. The callbacks are called
+ *   from within this function. The first call after `uxs_create',
+ *   `uxs_finish' or `uxs_reset' starts a new document.
+ *
+ * RETURN VALUE
+ *   Zero upon success, non-zero if the document is not well-formed. Once an
+ *   error occurred, all further data is ignored until the parser is reset.
+ */
+int uxs_feed (uxs_t *s, const char *data, size_t len);
+
+/*
+ * NAME
+ *   uxs_finish
+ *
+ * DESCRIPTION
+ *   Signals the end of the document and resets the parser.
+ *
+ * RETURN VALUE
+ *   Zero if a complete, well-formed document has been parsed, non-zero
+ *   otherwise.
+ */
+int uxs_finish (uxs_t *s);
+
+/* Discards the current document. */
+void uxs_reset (uxs_t *s);
+
+/* Returns a description of the last error. */
+const char *uxs_strerror (uxs_t *s);
+
+/* Returns the depth of the current element. The root element has depth
+ * one. */
+int uxs_depth (uxs_t *s);
+
+/*
+ * NAME
+ *   uxs_matches
+ *
+ * DESCRIPTION
+ *   Checks the path of the open element at `depth', which must not be
+ *   greater than `uxs_depth'. `path' is a list of element names separated by
+ *   slashes. If it starts with a single slash, it has to match the path from
+ *   the root element, e.g. "/html/body/table". If it starts with two
+ *   slashes, it has to match the end of the path, e.g. "//table/tr".
+ */
+int uxs_matches (uxs_t *s, int depth, const char *path);
+
+/* Returns the value of the attribute `name' from `attrs' as passed to the
+ * start callback, or NULL if it isn't set. */
+const char *uxs_attribute (const char **attrs, const char *name);
+
+#endif /* UTILS_XML_STREAM_H */
@@ -31,6 +31,8 @@ static const char *config_keys[] =
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static int verbose_output = 0;
+
+static pread_file_t *pf_vmstat = NULL;
 /* #endif KERNEL_LINUX */
 
 #else
@@ -105,28 +107,32 @@ static int vmem_read (void)
   derive_t pgmajfault = 0;
   int pgfaultvalid = 0;
 
-  FILE *fh;
-  char buffer[1024];
+  char *buffer;
+  char *ptr;
+  char *fields[4];
+  int fields_num;
+
+  if (pf_vmstat == NULL)
+    pf_vmstat = pread_file_create ("/proc/vmstat");
 
-  fh = fopen ("/proc/vmstat", "r");
-  if (fh == NULL)
+  buffer = pread_file_read (pf_vmstat, NULL);
+  if (buffer == NULL)
   {
     char errbuf[1024];
-    ERROR ("vmem plugin: fopen (/proc/vmstat) failed: %s",
+    ERROR ("vmem plugin: Reading /proc/vmstat failed: %s",
 	sstrerror (errno, errbuf, sizeof (errbuf)));
     return (-1);
   }
 
-  while (fgets (buffer, sizeof (buffer), fh) != NULL)
+  ptr = buffer;
+  while ((fields_num = strsplit_line (&ptr, fields,
+	  STATIC_ARRAY_SIZE (fields))) >= 0)
   {
-    char *fields[4];
-    int fields_num;
     char *key;
     char *endptr;
     derive_t counter;
     gauge_t gauge;
 
-    fields_num = strsplit (buffer, fields, STATIC_ARRAY_SIZE (fields));
     if (fields_num != 2)
       continue;
 
@@ -254,10 +260,7 @@ static int vmem_read (void)
       value_t value  = { .derive = counter };
       submit_one (NULL, "vmpage_action", "deactivate", value);
     }
-  } /* while (fgets) */
-
-  fclose (fh);
-  fh = NULL;
+  } /* while (strsplit_line) */
 
   if (pgfaultvalid == 0x03)
     submit_two (NULL, "vmpage_faults", NULL, pgfault, pgmajfault);
@@ -272,11 +275,22 @@ static int vmem_read (void)
   return (0);
 } /* int vmem_read */
 
+static int vmem_shutdown (void)
+{
+#if KERNEL_LINUX
+  pread_file_destroy (pf_vmstat);
+  pf_vmstat = NULL;
+#endif /* KERNEL_LINUX */
+
+  return (0);
+} /* int vmem_shutdown */
+
 void module_register (void)
 {
   plugin_register_config ("vmem", vmem_config,
       config_keys, config_keys_num);
   plugin_register_read ("vmem", vmem_read);
+  plugin_register_shutdown ("vmem", vmem_shutdown);
 } /* void module_register */
 
 /* vim: set sw=2 sts=2 ts=8 : */
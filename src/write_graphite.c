@@ -47,14 +47,19 @@
 
 #include "utils_cache.h"
 #include "utils_complain.h"
+#include "utils_lock.h"
 #include "utils_parse_option.h"
+#include "utils_resolve.h"
 #include "utils_format_graphite.h"
+#include "utils_spool.h"
 
 /* Folks without pthread will need to disable this plugin. */
 #include <pthread.h>
 
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #ifndef WG_DEFAULT_NODE
 # define WG_DEFAULT_NODE "localhost"
@@ -73,6 +78,34 @@
 # define WG_SEND_BUF_SIZE 1428
 #endif
 
+/* Largest write(2) issued by the sender thread when "BufferSize" is set. */
+#ifndef WG_SEND_CHUNK_SIZE
+# define WG_SEND_CHUNK_SIZE 65536
+#endif
+
+/* Milliseconds the sender thread waits for a stalled socket before giving
+ * up on the connection. */
+#ifndef WG_SEND_TIMEOUT
+# define WG_SEND_TIMEOUT 10000
+#endif
+
+#define WG_NODE(cb) (((cb)->node != NULL) ? (cb)->node : WG_DEFAULT_NODE)
+#define WG_SERVICE(cb) \
+    (((cb)->service != NULL) ? (cb)->service : WG_DEFAULT_SERVICE)
+
+#define WG_OVERFLOW_DROP_NEW 0
+#define WG_OVERFLOW_DROP_OLD 1
+
+#define WG_ROUTING_CONSISTENT_HASH 0
+#define WG_ROUTING_ROUND_ROBIN     1
+
+/* Number of points per destination on the consistent hashing ring. This
+ * must match carbon-relay's replica count for metrics to end up on the same
+ * destination. */
+#ifndef WG_HASH_REPLICAS
+# define WG_HASH_REPLICAS 100
+#endif
+
 /*
  * Private variables
  */
@@ -89,15 +122,79 @@ struct wg_callback
     char     escape_char;
 
     unsigned int format_flags;
+    graphite_name_cache_t *name_cache;
 
     char     send_buf[WG_SEND_BUF_SIZE];
     size_t   send_buf_free;
     size_t   send_buf_fill;
     cdtime_t send_buf_init_time;
 
-    pthread_mutex_t send_lock;
+    c_mutex_t send_lock;
     c_complain_t init_complaint;
+    /* Only the first connection waits for the name to be looked up. */
+    _Bool    resolved_once;
+
+    /* Ring buffer drained by "send_thread". Only used if "BufferSize" has
+     * been configured, i.e. if ring_size > 0. Protected by "send_lock". */
+    char    *ring;
+    size_t   ring_size;
+    size_t   ring_head;
+    size_t   ring_fill;
+    int      overflow_policy;
+
+    uint64_t bytes_queued;
+    uint64_t bytes_sent;
+    uint64_t bytes_dropped;
+
+    pthread_cond_t send_cond;
+    pthread_t send_thread;
+    _Bool    send_thread_running;
+    _Bool    send_thread_shutdown;
+    c_complain_t overflow_complaint;
+
+    /* Holds data on disk while the server cannot be reached. Only used if
+     * "SpoolDirectory" has been configured. */
+    char    *spool_dir;
+    uint64_t spool_max_size;
+    uint64_t spool_replay_rate;
+    c_spool_t *spool;
+    cdtime_t retry_time;
+};
+
+struct wg_hash_point_s
+{
+    unsigned int position;
+    size_t dest;
+};
+typedef struct wg_hash_point_s wg_hash_point_t;
+
+/* A <Node> with several "Destination"s. Each destination is a complete
+ * wg_callback with its own connection and buffer; the group formats the
+ * metrics and routes each line to one of them. */
+struct wg_group
+{
+    int      routing;
+
+    struct wg_callback **dests;
+    size_t   dests_num;
+
+    /* Sorted by position; only used with consistent hashing. */
+    wg_hash_point_t *points;
+    size_t   points_num;
+
+    size_t   rr_next;
+
+    graphite_name_cache_t *name_cache;
+    pthread_mutex_t lock;
+};
+
+struct wg_destination_conf_s
+{
+    char *host;
+    char *service;
+    char *instance;
 };
+typedef struct wg_destination_conf_s wg_destination_conf_t;
 
 
 /*
@@ -132,6 +229,82 @@ static int wg_send_buffer (struct wg_callback *cb)
     return (0);
 }
 
+static int wg_callback_init (struct wg_callback *cb);
+
+/* Connects unless the last attempt failed less than a second ago, so that
+ * every value isn't held up by a server which is down. The caller must hold
+ * "send_lock". */
+static int wg_spool_connect_nolock (struct wg_callback *cb)
+{
+    cdtime_t now;
+
+    if (cb->sock_fd >= 0)
+        return (0);
+
+    now = cdtime ();
+    if (now < cb->retry_time)
+        return (-1);
+
+    if (wg_callback_init (cb) != 0)
+    {
+        cb->retry_time = now + TIME_T_TO_CDTIME_T (1);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Sends spooled data until the spool is empty or the replay rate has been
+ * used up. The caller must hold "send_lock". */
+static void wg_spool_replay_nolock (struct wg_callback *cb)
+{
+    while (cb->sock_fd >= 0)
+    {
+        void *data;
+        size_t data_len;
+
+        if (c_spool_shift (cb->spool, &data, &data_len) != 0)
+            break;
+
+        if (swrite (cb->sock_fd, data, data_len) != 0)
+        {
+            char errbuf[1024];
+            ERROR ("write_graphite plugin: [%s]:%s: Replaying spooled data "
+                    "failed: %s", WG_NODE (cb), WG_SERVICE (cb),
+                    sstrerror (errno, errbuf, sizeof (errbuf)));
+            close (cb->sock_fd);
+            cb->sock_fd = -1;
+
+            c_spool_append (cb->spool, data, data_len);
+        }
+        sfree (data);
+    }
+}
+
+/* Sends the send buffer or, if the server cannot be reached, writes it to the
+ * spool. The caller must hold "send_lock". */
+static int wg_spool_send_nolock (struct wg_callback *cb)
+{
+    int status;
+
+    if ((wg_spool_connect_nolock (cb) == 0) && (wg_send_buffer (cb) == 0))
+    {
+        wg_spool_replay_nolock (cb);
+        return (0);
+    }
+
+    status = c_spool_append (cb->spool, cb->send_buf, cb->send_buf_fill);
+    if (status != 0)
+    {
+        ERROR ("write_graphite plugin: [%s]:%s: Spooling %zu bytes failed "
+                "with status %i.", WG_NODE (cb), WG_SERVICE (cb),
+                cb->send_buf_fill, status);
+        return (-1);
+    }
+
+    return (0);
+}
+
 /* NOTE: You must hold cb->send_lock when calling this function! */
 static int wg_flush_nolock (cdtime_t timeout, struct wg_callback *cb)
 {
@@ -155,10 +328,15 @@ static int wg_flush_nolock (cdtime_t timeout, struct wg_callback *cb)
     if (cb->send_buf_fill <= 0)
     {
         cb->send_buf_init_time = cdtime ();
+        if ((cb->spool != NULL) && (wg_spool_connect_nolock (cb) == 0))
+            wg_spool_replay_nolock (cb);
         return (0);
     }
 
-    status = wg_send_buffer (cb);
+    if (cb->spool != NULL)
+        status = wg_spool_send_nolock (cb);
+    else
+        status = wg_send_buffer (cb);
     wg_reset_buffer (cb);
 
     return (status);
@@ -186,10 +364,13 @@ static int wg_callback_init (struct wg_callback *cb)
 
     ai_list = NULL;
 
-    status = getaddrinfo (node, service, &ai_hints, &ai_list);
+    status = ures_getaddrinfo (node, service, &ai_hints,
+            /* wait = */ !cb->resolved_once, &ai_list);
+    cb->resolved_once = 1;
     if (status != 0)
     {
-        ERROR ("write_graphite plugin: getaddrinfo (%s, %s) failed: %s",
+        c_complain (LOG_ERR, &cb->init_complaint,
+                "write_graphite plugin: getaddrinfo (%s, %s) failed: %s",
                 node, service, gai_strerror (status));
         return (-1);
     }
@@ -213,7 +394,7 @@ static int wg_callback_init (struct wg_callback *cb)
         break;
     }
 
-    freeaddrinfo (ai_list);
+    ures_freeaddrinfo (ai_list);
 
     if (cb->sock_fd < 0)
     {
@@ -232,7 +413,452 @@ static int wg_callback_init (struct wg_callback *cb)
                 node, service);
     }
 
-    wg_reset_buffer (cb);
+    return (0);
+}
+
+/* Removes whole lines from the head of the ring until at least "len" bytes
+ * are free. The caller must hold "send_lock". */
+static void wg_ring_drop_oldest_nolock (struct wg_callback *cb, size_t len)
+{
+    size_t dropped = 0;
+    _Bool line_start = 1;
+
+    /* Stop at the end of a line only, so the sender never starts in the
+     * middle of a metric. */
+    while ((cb->ring_fill > 0)
+            && (!line_start || ((cb->ring_size - cb->ring_fill) < len)))
+    {
+        line_start = (cb->ring[cb->ring_head] == '\n');
+
+        cb->ring_head = (cb->ring_head + 1) % cb->ring_size;
+        cb->ring_fill--;
+        dropped++;
+    }
+
+    cb->bytes_dropped += dropped;
+}
+
+/* Appends "message" to the ring buffer, applying the overflow policy if the
+ * ring is full. The caller must hold "send_lock". */
+static int wg_ring_append_nolock (char const *message, struct wg_callback *cb)
+{
+    size_t message_len;
+    size_t tail;
+    size_t part;
+
+    message_len = strlen (message);
+    if (message_len == 0)
+        return (0);
+
+    if ((message_len > cb->ring_size)
+            || ((message_len > (cb->ring_size - cb->ring_fill))
+                && (cb->overflow_policy == WG_OVERFLOW_DROP_NEW)))
+    {
+        cb->bytes_dropped += message_len;
+        c_complain (LOG_WARNING, &cb->overflow_complaint,
+                "write_graphite plugin: [%s]:%s: The send buffer is full. "
+                "Dropping new metrics until the server catches up.",
+                WG_NODE (cb), WG_SERVICE (cb));
+        return (0);
+    }
+
+    if (message_len > (cb->ring_size - cb->ring_fill))
+    {
+        c_complain (LOG_WARNING, &cb->overflow_complaint,
+                "write_graphite plugin: [%s]:%s: The send buffer is full. "
+                "Dropping old metrics until the server catches up.",
+                WG_NODE (cb), WG_SERVICE (cb));
+        wg_ring_drop_oldest_nolock (cb, message_len);
+    }
+    else if (cb->ring_fill == 0)
+    {
+        c_release (LOG_INFO, &cb->overflow_complaint,
+                "write_graphite plugin: [%s]:%s: The send buffer has been "
+                "drained.", WG_NODE (cb), WG_SERVICE (cb));
+    }
+
+    tail = (cb->ring_head + cb->ring_fill) % cb->ring_size;
+    part = cb->ring_size - tail;
+    if (part > message_len)
+        part = message_len;
+
+    memcpy (cb->ring + tail, message, part);
+    if (part < message_len)
+        memcpy (cb->ring, message + part, message_len - part);
+
+    cb->ring_fill += message_len;
+    cb->bytes_queued += message_len;
+
+    return (0);
+}
+
+/* Copies up to "buffer_size" bytes of complete lines from the ring into
+ * "buffer" and removes them from the ring. Returns the number of bytes
+ * copied. The caller must hold "send_lock". */
+static size_t wg_ring_take_nolock (struct wg_callback *cb,
+        char *buffer, size_t buffer_size)
+{
+    size_t len;
+    size_t part;
+
+    len = cb->ring_fill;
+    if (len > buffer_size)
+        len = buffer_size;
+
+    part = cb->ring_size - cb->ring_head;
+    if (part > len)
+        part = len;
+
+    memcpy (buffer, cb->ring + cb->ring_head, part);
+    if (part < len)
+        memcpy (buffer + part, cb->ring, len - part);
+
+    /* The ring only ever holds complete lines. If we couldn't take all of
+     * them, cut at the last newline so reconnects happen between lines. */
+    if (len < cb->ring_fill)
+    {
+        while ((len > 0) && (buffer[len - 1] != '\n'))
+            len--;
+    }
+
+    cb->ring_head = (cb->ring_head + len) % cb->ring_size;
+    cb->ring_fill -= len;
+
+    return (len);
+}
+
+/* Writes "buffer" to the non-blocking socket, waiting for the socket to
+ * become writable as needed. Returns the number of bytes sent; the
+ * connection is closed if this is less than "buffer_len". */
+static size_t wg_send_chunk (struct wg_callback *cb,
+        char const *buffer, size_t buffer_len)
+{
+    size_t sent = 0;
+
+    while (sent < buffer_len)
+    {
+        ssize_t status;
+
+        status = send (cb->sock_fd, buffer + sent, buffer_len - sent,
+                /* flags = */ 0);
+        if (status > 0)
+        {
+            sent += (size_t) status;
+            continue;
+        }
+
+        if ((status < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+                    || (errno == EINTR)))
+        {
+            struct pollfd pfd;
+
+            memset (&pfd, 0, sizeof (pfd));
+            pfd.fd = cb->sock_fd;
+            pfd.events = POLLOUT;
+
+            status = poll (&pfd, 1, WG_SEND_TIMEOUT);
+            if (status > 0)
+                continue;
+            if ((status < 0) && (errno == EINTR))
+                continue;
+            if (status == 0)
+            {
+                ERROR ("write_graphite plugin: [%s]:%s: Sending timed out "
+                        "after %i ms.", WG_NODE (cb), WG_SERVICE (cb),
+                        WG_SEND_TIMEOUT);
+                break;
+            }
+        }
+
+        {
+            char errbuf[1024];
+            ERROR ("write_graphite plugin: send failed with status %zi (%s)",
+                    status, sstrerror (errno, errbuf, sizeof (errbuf)));
+        }
+        break;
+    }
+
+    if (sent < buffer_len)
+    {
+        close (cb->sock_fd);
+        cb->sock_fd = -1;
+    }
+
+    return (sent);
+}
+
+/* Writes the part of "buffer" which wg_send_chunk() didn't get out to the
+ * spool. The line which was cut off is spooled in full: carbon discards
+ * partial lines when the connection is closed. */
+static int wg_spool_unsent (struct wg_callback *cb,
+        char const *buffer, size_t sent, size_t buffer_len)
+{
+    size_t start = sent;
+    int status;
+
+    while ((start > 0) && (buffer[start - 1] != '\n'))
+        start--;
+
+    status = c_spool_append (cb->spool, buffer + start, buffer_len - start);
+    if (status != 0)
+        ERROR ("write_graphite plugin: [%s]:%s: Spooling %zu bytes failed "
+                "with status %i.", WG_NODE (cb), WG_SERVICE (cb),
+                buffer_len - start, status);
+
+    return (status);
+}
+
+/* Moves the content of the ring to the spool, using "chunk" as scratch
+ * space. The caller must hold "send_lock". */
+static void wg_spool_ring_nolock (struct wg_callback *cb, char *chunk)
+{
+    while (cb->ring_fill > 0)
+    {
+        size_t len;
+
+        len = wg_ring_take_nolock (cb, chunk, WG_SEND_CHUNK_SIZE);
+        if (len == 0)
+            break;
+
+        if (c_spool_append (cb->spool, chunk, len) != 0)
+            cb->bytes_dropped += len;
+    }
+}
+
+/* Sends the oldest record from the spool. Returns EAGAIN if the replay rate
+ * has been used up and ENOENT if the spool is empty. Only called by the
+ * sender thread, without "send_lock" held. */
+static int wg_send_thread_replay (struct wg_callback *cb)
+{
+    void *data;
+    size_t data_len;
+    size_t sent;
+    int status;
+
+    status = c_spool_shift (cb->spool, &data, &data_len);
+    if (status != 0)
+        return (status);
+
+    sent = wg_send_chunk (cb, data, data_len);
+    if (sent < data_len)
+        wg_spool_unsent (cb, data, sent, data_len);
+    sfree (data);
+
+    c_mutex_lock (&cb->send_lock);
+    cb->bytes_sent += sent;
+    c_mutex_unlock (&cb->send_lock);
+
+    return ((sent < data_len) ? -1 : 0);
+}
+
+/* Connects if necessary and switches the socket to non-blocking mode.
+ * The socket is only ever touched by the sender thread, so this must not
+ * be called with "send_lock" held. */
+static int wg_send_thread_connect (struct wg_callback *cb)
+{
+    int flags;
+    int status;
+
+    if (cb->sock_fd >= 0)
+        return (0);
+
+    status = wg_callback_init (cb);
+    if (status != 0)
+        return (status);
+
+    flags = fcntl (cb->sock_fd, F_GETFL);
+    if ((flags == -1)
+            || (fcntl (cb->sock_fd, F_SETFL, flags | O_NONBLOCK) != 0))
+    {
+        char errbuf[1024];
+        ERROR ("write_graphite plugin: Setting O_NONBLOCK failed: %s",
+                sstrerror (errno, errbuf, sizeof (errbuf)));
+        close (cb->sock_fd);
+        cb->sock_fd = -1;
+        return (-1);
+    }
+
+    return (0);
+}
+
+static void *wg_send_thread (void *arg) /* {{{ */
+{
+    struct wg_callback *cb = arg;
+    char *chunk;
+
+    chunk = malloc (WG_SEND_CHUNK_SIZE);
+    if (chunk == NULL)
+    {
+        ERROR ("write_graphite plugin: malloc failed.");
+        return ((void *) -1);
+    }
+
+    c_mutex_lock (&cb->send_lock);
+    while (42)
+    {
+        size_t len;
+        size_t sent;
+        _Bool spooled = 0;
+        int status;
+
+        /* Spooled data is replayed while there is nothing new to send. */
+        while (!cb->send_thread_shutdown && (cb->ring_fill == 0)
+                && ((cb->sock_fd < 0) || (c_spool_pending (cb->spool) == 0)))
+            c_cond_wait (&cb->send_cond, &cb->send_lock);
+
+        if (cb->send_thread_shutdown && (cb->ring_fill == 0))
+            break;
+
+        if (cb->ring_fill == 0)
+        {
+            c_mutex_unlock (&cb->send_lock);
+            status = wg_send_thread_replay (cb);
+            c_mutex_lock (&cb->send_lock);
+
+            if (status == EAGAIN)
+            {
+                struct timespec ts;
+
+                CDTIME_T_TO_TIMESPEC (cdtime () + TIME_T_TO_CDTIME_T (1), &ts);
+                c_cond_timedwait (&cb->send_cond, &cb->send_lock, &ts);
+            }
+            continue;
+        }
+
+        if (cb->sock_fd < 0)
+        {
+            c_mutex_unlock (&cb->send_lock);
+            status = wg_send_thread_connect (cb);
+            c_mutex_lock (&cb->send_lock);
+
+            if (status != 0)
+            {
+                struct timespec ts;
+
+                if (cb->spool != NULL)
+                    wg_spool_ring_nolock (cb, chunk);
+
+                /* Don't hold up shutdown for a server that is down. */
+                if (cb->send_thread_shutdown)
+                    break;
+
+                /* Retry in a second. Without a spool, values keep
+                 * accumulating in the ring meanwhile, subject to the
+                 * overflow policy. */
+                CDTIME_T_TO_TIMESPEC (cdtime () + TIME_T_TO_CDTIME_T (1), &ts);
+                c_cond_timedwait (&cb->send_cond, &cb->send_lock, &ts);
+                continue;
+            }
+        }
+
+        len = wg_ring_take_nolock (cb, chunk, WG_SEND_CHUNK_SIZE);
+        c_mutex_unlock (&cb->send_lock);
+
+        sent = wg_send_chunk (cb, chunk, len);
+        if ((sent < len) && (cb->spool != NULL))
+            spooled = (wg_spool_unsent (cb, chunk, sent, len) == 0);
+        else if ((sent == len) && (cb->spool != NULL))
+            wg_send_thread_replay (cb);
+
+        c_mutex_lock (&cb->send_lock);
+        cb->bytes_sent += sent;
+        if (!spooled)
+            cb->bytes_dropped += len - sent;
+    }
+
+    /* Without a spool, whatever couldn't be sent before shutdown is lost. */
+    if (cb->spool != NULL)
+        wg_spool_ring_nolock (cb, chunk);
+    cb->bytes_dropped += cb->ring_fill;
+    cb->ring_fill = 0;
+    c_mutex_unlock (&cb->send_lock);
+
+    sfree (chunk);
+    return ((void *) 0);
+} /* }}} void *wg_send_thread */
+
+/* Starts the sender thread if it is not already running. The caller must
+ * hold "send_lock". */
+static int wg_send_thread_start_nolock (struct wg_callback *cb)
+{
+    int status;
+
+    if (cb->send_thread_running)
+        return (0);
+
+    status = plugin_thread_create (&cb->send_thread, /* attr = */ NULL,
+            wg_send_thread, cb);
+    if (status != 0)
+    {
+        char errbuf[1024];
+        ERROR ("write_graphite plugin: Starting the sender thread failed: %s",
+                sstrerror (errno, errbuf, sizeof (errbuf)));
+        return (-1);
+    }
+
+    cb->send_thread_running = 1;
+    return (0);
+}
+
+static int wg_read_stats (user_data_t *user_data)
+{
+    struct wg_callback *cb;
+    value_list_t vl = VALUE_LIST_INIT;
+    value_t values[1];
+    uint64_t queued, sent, dropped;
+    size_t fill;
+
+    if (user_data == NULL)
+        return (-EINVAL);
+
+    cb = user_data->data;
+
+    c_mutex_lock (&cb->send_lock);
+    fill = cb->ring_fill;
+    queued = cb->bytes_queued;
+    sent = cb->bytes_sent;
+    dropped = cb->bytes_dropped;
+    c_mutex_unlock (&cb->send_lock);
+
+    vl.values = values;
+    vl.values_len = 1;
+    sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+    sstrncpy (vl.plugin, "write_graphite", sizeof (vl.plugin));
+    if (cb->name != NULL)
+        sstrncpy (vl.plugin_instance, cb->name, sizeof (vl.plugin_instance));
+    else
+        ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance), "%s_%s",
+                WG_NODE (cb), WG_SERVICE (cb));
+
+    sstrncpy (vl.type, "bytes", sizeof (vl.type));
+    if (cb->spool != NULL)
+    {
+        values[0].gauge = (gauge_t) c_spool_pending (cb->spool);
+        sstrncpy (vl.type_instance, "spooled", sizeof (vl.type_instance));
+        plugin_dispatch_values (&vl);
+    }
+
+    /* The remaining counters are maintained by the sender thread. */
+    if (cb->ring_size == 0)
+        return (0);
+
+    values[0].gauge = (gauge_t) fill;
+    sstrncpy (vl.type_instance, "buffered", sizeof (vl.type_instance));
+    plugin_dispatch_values (&vl);
+
+    sstrncpy (vl.type, "total_bytes", sizeof (vl.type));
+
+    values[0].derive = (derive_t) queued;
+    sstrncpy (vl.type_instance, "queued", sizeof (vl.type_instance));
+    plugin_dispatch_values (&vl);
+
+    values[0].derive = (derive_t) sent;
+    sstrncpy (vl.type_instance, "sent", sizeof (vl.type_instance));
+    plugin_dispatch_values (&vl);
+
+    values[0].derive = (derive_t) dropped;
+    sstrncpy (vl.type_instance, "dropped", sizeof (vl.type_instance));
+    plugin_dispatch_values (&vl);
 
     return (0);
 }
@@ -246,11 +872,25 @@ static void wg_callback_free (void *data)
 
     cb = data;
 
-    pthread_mutex_lock (&cb->send_lock);
+    if (cb->send_thread_running)
+    {
+        /* The sender thread drains the ring before it exits. */
+        c_mutex_lock (&cb->send_lock);
+        cb->send_thread_shutdown = 1;
+        pthread_cond_broadcast (&cb->send_cond);
+        c_mutex_unlock (&cb->send_lock);
+
+        pthread_join (cb->send_thread, /* retval = */ NULL);
+        cb->send_thread_running = 0;
+    }
+
+    c_mutex_lock (&cb->send_lock);
 
-    wg_flush_nolock (/* timeout = */ 0, cb);
+    if (cb->ring_size == 0)
+        wg_flush_nolock (/* timeout = */ 0, cb);
 
-    close(cb->sock_fd);
+    if (cb->sock_fd >= 0)
+        close(cb->sock_fd);
     cb->sock_fd = -1;
 
     sfree(cb->name);
@@ -258,8 +898,14 @@ static void wg_callback_free (void *data)
     sfree(cb->service);
     sfree(cb->prefix);
     sfree(cb->postfix);
+    sfree(cb->ring);
+    sfree(cb->spool_dir);
+    c_spool_destroy (cb->spool);
+    graphite_name_cache_destroy (cb->name_cache);
 
-    pthread_mutex_destroy (&cb->send_lock);
+    c_mutex_unlock (&cb->send_lock);
+    c_mutex_destroy (&cb->send_lock);
+    pthread_cond_destroy (&cb->send_cond);
 
     sfree(cb);
 }
@@ -276,41 +922,48 @@ static int wg_flush (cdtime_t timeout,
 
     cb = user_data->data;
 
-    pthread_mutex_lock (&cb->send_lock);
+    c_mutex_lock (&cb->send_lock);
 
-    if (cb->sock_fd < 0)
+    /* The sender thread sends continuously; just make sure it's awake. */
+    if (cb->ring_size > 0)
+    {
+        pthread_cond_signal (&cb->send_cond);
+        c_mutex_unlock (&cb->send_lock);
+        return (0);
+    }
+
+    /* With a spool, wg_flush_nolock() connects when it needs to. */
+    if ((cb->sock_fd < 0) && (cb->spool == NULL))
     {
         status = wg_callback_init (cb);
         if (status != 0)
         {
             /* An error message has already been printed. */
-            pthread_mutex_unlock (&cb->send_lock);
+            c_mutex_unlock (&cb->send_lock);
             return (-1);
         }
     }
 
     status = wg_flush_nolock (timeout, cb);
-    pthread_mutex_unlock (&cb->send_lock);
+    c_mutex_unlock (&cb->send_lock);
 
     return (status);
 }
 
-static int wg_send_message (char const *message, struct wg_callback *cb)
+/* Appends "message" to the send buffer. The caller must hold "send_lock". */
+static int wg_send_message_nolock (char const *message, struct wg_callback *cb)
 {
     int status;
     size_t message_len;
 
     message_len = strlen (message);
 
-    pthread_mutex_lock (&cb->send_lock);
-
-    if (cb->sock_fd < 0)
+    if ((cb->sock_fd < 0) && (cb->spool == NULL))
     {
         status = wg_callback_init (cb);
         if (status != 0)
         {
             /* An error message has already been printed. */
-            pthread_mutex_unlock (&cb->send_lock);
             return (-1);
         }
     }
@@ -319,10 +972,7 @@ static int wg_send_message (char const *message, struct wg_callback *cb)
     {
         status = wg_flush_nolock (/* timeout = */ 0, cb);
         if (status != 0)
-        {
-            pthread_mutex_unlock (&cb->send_lock);
             return (status);
-        }
     }
 
     /* Assert that we have enough space for this message. */
@@ -342,11 +992,25 @@ static int wg_send_message (char const *message, struct wg_callback *cb)
             100.0 * ((double) cb->send_buf_fill) / ((double) sizeof (cb->send_buf)),
             message);
 
-    pthread_mutex_unlock (&cb->send_lock);
-
     return (0);
 }
 
+/* Hands "message" to the ring buffer if one is configured, and to the send
+ * buffer otherwise. The caller must hold "send_lock". */
+static int wg_queue_message_nolock (char const *message,
+        struct wg_callback *cb)
+{
+    if (cb->ring_size == 0)
+        return (wg_send_message_nolock (message, cb));
+
+    /* The thread is started lazily so it is not lost when the daemon
+     * forks after reading the configuration. */
+    wg_send_thread_start_nolock (cb);
+
+    return (wg_ring_append_nolock (message, cb));
+}
+
+/* The caller must hold "send_lock". */
 static int wg_write_messages (const data_set_t *ds, const value_list_t *vl,
         struct wg_callback *cb)
 {
@@ -360,14 +1024,14 @@ static int wg_write_messages (const data_set_t *ds, const value_list_t *vl,
         return -1;
     }
 
-    memset (buffer, 0, sizeof (buffer));
-    status = format_graphite (buffer, sizeof (buffer), ds, vl,
-            cb->prefix, cb->postfix, cb->escape_char, cb->format_flags);
+    buffer[0] = 0;
+    status = format_graphite_cached (buffer, sizeof (buffer), ds, vl,
+            cb->name_cache);
     if (status != 0) /* error message has been printed already. */
         return (status);
 
     /* Send the message to graphite */
-    wg_send_message (buffer, cb);
+    status = wg_queue_message_nolock (buffer, cb);
     if (status != 0)
     {
         /* An error message has already been printed. */
@@ -377,22 +1041,389 @@ static int wg_write_messages (const data_set_t *ds, const value_list_t *vl,
     return (0);
 } /* int wg_write_messages */
 
-static int wg_write (const data_set_t *ds, const value_list_t *vl,
+static int wg_write_batch (const plugin_write_item_t *items, size_t items_num,
         user_data_t *user_data)
 {
     struct wg_callback *cb;
-    int status;
+    size_t i;
+    int ret = 0;
 
     if (user_data == NULL)
         return (EINVAL);
 
     cb = user_data->data;
 
-    status = wg_write_messages (ds, vl, cb);
+    /* Take the lock once for all values dequeued together. */
+    c_mutex_lock (&cb->send_lock);
+    for (i = 0; i < items_num; i++)
+    {
+        int status = wg_write_messages (items[i].ds, items[i].vl, cb);
+        if (status != 0)
+            ret = status;
+    }
+
+    if ((cb->ring_size > 0) && (cb->ring_fill > 0))
+        pthread_cond_signal (&cb->send_cond);
+    c_mutex_unlock (&cb->send_lock);
+
+    return (ret);
+}
+
+/*
+ * MD5 as described in RFC 1321. carbon-relay places destinations and
+ * metrics on its consistent hashing ring using the first 16 bits of the MD5
+ * digest; we need the very same positions.
+ */
+static uint32_t const wg_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static uint8_t const wg_md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void wg_md5_block (uint32_t h[4], uint8_t const *block)
+{
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t) block[4 * i])
+            | (((uint32_t) block[4 * i + 1]) << 8)
+            | (((uint32_t) block[4 * i + 2]) << 16)
+            | (((uint32_t) block[4 * i + 3]) << 24);
+
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t f;
+        uint32_t tmp;
+        int g;
+
+        if (i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if (i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        }
+        else if (i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+
+        tmp = a + f + wg_md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ((tmp << wg_md5_r[i]) | (tmp >> (32 - wg_md5_r[i])));
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+/* Returns the position of "key" on carbon's ring, i.e. the first two bytes
+ * of its MD5 digest. */
+static unsigned int wg_hash_position (char const *key, size_t key_len)
+{
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint8_t tail[128];
+    uint64_t bits = ((uint64_t) key_len) * 8;
+    size_t tail_len;
+    size_t offset;
+    int i;
+
+    for (offset = 0; (key_len - offset) >= 64; offset += 64)
+        wg_md5_block (h, (uint8_t const *) key + offset);
+
+    memset (tail, 0, sizeof (tail));
+    memcpy (tail, key + offset, key_len - offset);
+    tail[key_len - offset] = 0x80;
+    tail_len = ((key_len - offset) < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++)
+        tail[tail_len - 8 + i] = (uint8_t) (bits >> (8 * i));
+
+    wg_md5_block (h, tail);
+    if (tail_len == 128)
+        wg_md5_block (h, tail + 64);
+
+    /* The digest is h[0] .. h[3] in little endian byte order. */
+    return ((unsigned int) (((h[0] & 0xff) << 8) | ((h[0] >> 8) & 0xff)));
+}
+
+static int wg_hash_point_compare (void const *a, void const *b)
+{
+    wg_hash_point_t const *p0 = a;
+    wg_hash_point_t const *p1 = b;
+
+    if (p0->position < p1->position)
+        return (-1);
+    else if (p0->position > p1->position)
+        return (1);
+    return (0);
+}
+
+/* Places WG_HASH_REPLICAS points per destination on the ring the way
+ * carbon's ConsistentHashRing does: the replica key is the Python
+ * representation of the (server, instance) tuple followed by ":<i>", and
+ * taken positions are skipped. */
+static int wg_group_build_ring (struct wg_group *g,
+        wg_destination_conf_t const *dests)
+{
+    size_t i;
+
+    g->points = calloc (g->dests_num * WG_HASH_REPLICAS, sizeof (*g->points));
+    if (g->points == NULL)
+        return (-1);
+    g->points_num = 0;
+
+    for (i = 0; i < g->dests_num; i++)
+    {
+        char node_key[1024];
+        int j;
+
+        if (dests[i].instance != NULL)
+            ssnprintf (node_key, sizeof (node_key), "('%s', '%s')",
+                    dests[i].host, dests[i].instance);
+        else
+            ssnprintf (node_key, sizeof (node_key), "('%s', None)",
+                    dests[i].host);
+
+        for (j = 0; j < WG_HASH_REPLICAS; j++)
+        {
+            char replica_key[1100];
+            unsigned int position;
+            size_t k;
+
+            ssnprintf (replica_key, sizeof (replica_key), "%s:%i",
+                    node_key, j);
+            position = wg_hash_position (replica_key, strlen (replica_key));
+
+            /* The ring is small, and this only runs during startup. */
+            do
+            {
+                for (k = 0; k < g->points_num; k++)
+                    if (g->points[k].position == position)
+                        break;
+                if (k < g->points_num)
+                    position++;
+            } while (k < g->points_num);
+
+            g->points[g->points_num].position = position;
+            g->points[g->points_num].dest = i;
+            g->points_num++;
+        }
+    }
+
+    qsort (g->points, g->points_num, sizeof (*g->points),
+            wg_hash_point_compare);
+
+    return (0);
+}
+
+/* Returns the destination of the first point at or after the position of
+ * "metric", wrapping around at the end of the ring. */
+static struct wg_callback *wg_group_lookup (struct wg_group *g,
+        char const *metric, size_t metric_len)
+{
+    unsigned int position;
+    size_t lo = 0;
+    size_t hi = g->points_num;
+
+    position = wg_hash_position (metric, metric_len);
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (g->points[mid].position < position)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo >= g->points_num)
+        lo = 0;
+
+    return (g->dests[g->points[lo].dest]);
+}
+
+/* Hands "message" to destination "cb". The caller must hold the group's
+ * "lock", which orders before "send_lock". */
+static int wg_group_send (struct wg_callback *cb, char const *message)
+{
+    int status;
+
+    c_mutex_lock (&cb->send_lock);
+    status = wg_queue_message_nolock (message, cb);
+    if ((cb->ring_size > 0) && (cb->ring_fill > 0))
+        pthread_cond_signal (&cb->send_cond);
+    c_mutex_unlock (&cb->send_lock);
 
     return (status);
 }
 
+/* Routes each line in "buffer" to its destination on the ring. "buffer" is
+ * modified temporarily. */
+static int wg_group_send_lines (struct wg_group *g, char *buffer)
+{
+    char *line = buffer;
+    int ret = 0;
+
+    while (*line != 0)
+    {
+        char *end;
+        char *name_end;
+        char saved;
+        int status;
+
+        end = strchr (line, '\n');
+        if (end == NULL)
+            end = line + strlen (line);
+        else
+            end++;
+
+        name_end = memchr (line, ' ', (size_t) (end - line));
+        if (name_end == NULL)
+            name_end = end;
+
+        saved = *end;
+        *end = 0;
+        status = wg_group_send (wg_group_lookup (g, line,
+                    (size_t) (name_end - line)), line);
+        *end = saved;
+
+        if (status != 0)
+            ret = status;
+        line = end;
+    }
+
+    return (ret);
+}
+
+static int wg_group_write_batch (const plugin_write_item_t *items,
+        size_t items_num, user_data_t *user_data)
+{
+    struct wg_group *g;
+    size_t i;
+    int ret = 0;
+
+    if (user_data == NULL)
+        return (EINVAL);
+
+    g = user_data->data;
+
+    pthread_mutex_lock (&g->lock);
+    for (i = 0; i < items_num; i++)
+    {
+        char buffer[WG_SEND_BUF_SIZE];
+        int status;
+
+        if (0 != strcmp (items[i].ds->type, items[i].vl->type))
+        {
+            ERROR ("write_graphite plugin: DS type does not match "
+                    "value list type");
+            ret = -1;
+            continue;
+        }
+
+        buffer[0] = 0;
+        status = format_graphite_cached (buffer, sizeof (buffer),
+                items[i].ds, items[i].vl, g->name_cache);
+        if (status != 0) /* error message has been printed already. */
+        {
+            ret = status;
+            continue;
+        }
+
+        if (g->routing == WG_ROUTING_ROUND_ROBIN)
+        {
+            status = wg_group_send (g->dests[g->rr_next], buffer);
+            g->rr_next = (g->rr_next + 1) % g->dests_num;
+        }
+        else
+            status = wg_group_send_lines (g, buffer);
+
+        if (status != 0)
+            ret = status;
+    }
+    pthread_mutex_unlock (&g->lock);
+
+    return (ret);
+}
+
+static int wg_group_flush (cdtime_t timeout, const char *identifier,
+        user_data_t *user_data)
+{
+    struct wg_group *g;
+    size_t i;
+    int ret = 0;
+
+    if (user_data == NULL)
+        return (-EINVAL);
+
+    g = user_data->data;
+
+    for (i = 0; i < g->dests_num; i++)
+    {
+        user_data_t ud = { g->dests[i], NULL };
+        int status;
+
+        status = wg_flush (timeout, identifier, &ud);
+        if (status != 0)
+            ret = status;
+    }
+
+    return (ret);
+}
+
+static void wg_group_free (void *data)
+{
+    struct wg_group *g = data;
+    size_t i;
+
+    if (g == NULL)
+        return;
+
+    for (i = 0; i < g->dests_num; i++)
+        wg_callback_free (g->dests[i]);
+    sfree (g->dests);
+    sfree (g->points);
+    graphite_name_cache_destroy (g->name_cache);
+    pthread_mutex_destroy (&g->lock);
+
+    sfree (g);
+}
+
 static int config_set_char (char *dest,
         oconfig_item_t *ci)
 {
@@ -424,18 +1455,39 @@ static int config_set_char (char *dest,
     return (0);
 }
 
-static int wg_config_node (oconfig_item_t *ci)
+static int config_set_overflow (int *dest, oconfig_item_t *ci)
+{
+    char buffer[16];
+    int status;
+
+    status = cf_util_get_string_buffer (ci, buffer, sizeof (buffer));
+    if (status != 0)
+        return (status);
+
+    if (strcasecmp ("DropNew", buffer) == 0)
+        *dest = WG_OVERFLOW_DROP_NEW;
+    else if (strcasecmp ("DropOld", buffer) == 0)
+        *dest = WG_OVERFLOW_DROP_OLD;
+    else
+    {
+        ERROR ("write_graphite plugin: Invalid value for the "
+                "\"BufferOverflow\" option: \"%s\". Valid values are "
+                "\"DropNew\" and \"DropOld\".", buffer);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static struct wg_callback *wg_callback_create (void)
 {
     struct wg_callback *cb;
-    user_data_t user_data;
-    char callback_name[DATA_MAX_NAME_LEN];
-    int i;
 
     cb = malloc (sizeof (*cb));
     if (cb == NULL)
     {
         ERROR ("write_graphite plugin: malloc failed.");
-        return (-1);
+        return (NULL);
     }
     memset (cb, 0, sizeof (*cb));
     cb->sock_fd = -1;
@@ -446,6 +1498,264 @@ static int wg_config_node (oconfig_item_t *ci)
     cb->postfix = NULL;
     cb->escape_char = WG_DEFAULT_ESCAPE;
     cb->format_flags = GRAPHITE_STORE_RATES;
+    cb->spool_max_size = C_SPOOL_DEFAULT_MAX_SIZE;
+    cb->spool_replay_rate = C_SPOOL_DEFAULT_REPLAY_RATE;
+    wg_reset_buffer (cb);
+
+    c_mutex_init (&cb->send_lock, "write_graphite");
+    pthread_cond_init (&cb->send_cond, /* attr = */ NULL);
+    C_COMPLAIN_INIT (&cb->init_complaint);
+    C_COMPLAIN_INIT (&cb->overflow_complaint);
+
+    return (cb);
+}
+
+static int wg_callback_set_buffer (struct wg_callback *cb, int buffer_size)
+{
+    if (buffer_size <= 0)
+        return (0);
+
+    cb->ring = malloc ((size_t) buffer_size);
+    if (cb->ring == NULL)
+    {
+        ERROR ("write_graphite plugin: Allocating a %i byte send buffer "
+                "failed.", buffer_size);
+        return (-1);
+    }
+    cb->ring_size = (size_t) buffer_size;
+
+    return (0);
+}
+
+static int wg_callback_set_spool (struct wg_callback *cb,
+        struct wg_callback const *tmpl, char const *directory)
+{
+    if (tmpl->spool_dir == NULL)
+        return (0);
+
+    cb->spool = c_spool_create (directory, tmpl->spool_max_size,
+            tmpl->spool_replay_rate);
+    if (cb->spool == NULL)
+    {
+        ERROR ("write_graphite plugin: Opening the spool in \"%s\" failed.",
+                directory);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static int config_set_routing (int *dest, oconfig_item_t *ci)
+{
+    char buffer[32];
+    int status;
+
+    status = cf_util_get_string_buffer (ci, buffer, sizeof (buffer));
+    if (status != 0)
+        return (status);
+
+    if (strcasecmp ("ConsistentHash", buffer) == 0)
+        *dest = WG_ROUTING_CONSISTENT_HASH;
+    else if (strcasecmp ("RoundRobin", buffer) == 0)
+        *dest = WG_ROUTING_ROUND_ROBIN;
+    else
+    {
+        ERROR ("write_graphite plugin: Invalid value for the "
+                "\"Routing\" option: \"%s\". Valid values are "
+                "\"ConsistentHash\" and \"RoundRobin\".", buffer);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Parses `Destination "host" "port" ["instance"]'. */
+static int config_add_destination (wg_destination_conf_t **dests,
+        size_t *dests_num, oconfig_item_t *ci)
+{
+    wg_destination_conf_t *tmp;
+    wg_destination_conf_t *d;
+    char service[32];
+
+    if ((ci->values_num < 2) || (ci->values_num > 3)
+            || (ci->values[0].type != OCONFIG_TYPE_STRING)
+            || ((ci->values[1].type != OCONFIG_TYPE_STRING)
+                && (ci->values[1].type != OCONFIG_TYPE_NUMBER))
+            || ((ci->values_num == 3)
+                && (ci->values[2].type != OCONFIG_TYPE_STRING)))
+    {
+        ERROR ("write_graphite plugin: The \"Destination\" option requires "
+                "a host, a port and an optional instance name.");
+        return (-1);
+    }
+
+    if (ci->values[1].type == OCONFIG_TYPE_NUMBER)
+        ssnprintf (service, sizeof (service), "%i",
+                (int) ci->values[1].value.number);
+    else
+        sstrncpy (service, ci->values[1].value.string, sizeof (service));
+
+    tmp = realloc (*dests, (*dests_num + 1) * sizeof (**dests));
+    if (tmp == NULL)
+    {
+        ERROR ("write_graphite plugin: realloc failed.");
+        return (-1);
+    }
+    *dests = tmp;
+
+    d = *dests + *dests_num;
+    memset (d, 0, sizeof (*d));
+    d->host = strdup (ci->values[0].value.string);
+    d->service = strdup (service);
+    if (ci->values_num == 3)
+        d->instance = strdup (ci->values[2].value.string);
+    if ((d->host == NULL) || (d->service == NULL)
+            || ((ci->values_num == 3) && (d->instance == NULL)))
+    {
+        ERROR ("write_graphite plugin: strdup failed.");
+        sfree (d->host);
+        sfree (d->service);
+        sfree (d->instance);
+        return (-1);
+    }
+
+    (*dests_num)++;
+    return (0);
+}
+
+static void wg_destinations_free (wg_destination_conf_t *dests,
+        size_t dests_num)
+{
+    size_t i;
+
+    for (i = 0; i < dests_num; i++)
+    {
+        sfree (dests[i].host);
+        sfree (dests[i].service);
+        sfree (dests[i].instance);
+    }
+    sfree (dests);
+}
+
+/* Creates one wg_callback per destination; "tmpl" provides the formatting
+ * and buffering options. */
+static int wg_config_group (struct wg_callback const *tmpl,
+        char const *callback_name, wg_destination_conf_t const *dests,
+        size_t dests_num, int routing, int buffer_size)
+{
+    struct wg_group *g;
+    user_data_t user_data;
+    size_t i;
+
+    g = calloc (1, sizeof (*g));
+    if (g == NULL)
+    {
+        ERROR ("write_graphite plugin: calloc failed.");
+        return (-1);
+    }
+    pthread_mutex_init (&g->lock, /* attr = */ NULL);
+    g->routing = routing;
+
+    g->name_cache = graphite_name_cache_create (tmpl->prefix, tmpl->postfix,
+            tmpl->escape_char, tmpl->format_flags);
+    g->dests = calloc (dests_num, sizeof (*g->dests));
+    if ((g->name_cache == NULL) || (g->dests == NULL))
+    {
+        ERROR ("write_graphite plugin: Allocating %s failed.", callback_name);
+        wg_group_free (g);
+        return (-1);
+    }
+
+    for (i = 0; i < dests_num; i++)
+    {
+        struct wg_callback *cb;
+        char name[DATA_MAX_NAME_LEN];
+        char spool_dir[PATH_MAX];
+
+        cb = wg_callback_create ();
+        if (cb == NULL)
+        {
+            wg_group_free (g);
+            return (-1);
+        }
+        g->dests[g->dests_num] = cb;
+        g->dests_num++;
+
+        /* Used as the plugin instance of the buffer statistics. */
+        ssnprintf (name, sizeof (name), "%s-%s_%s",
+                (tmpl->name != NULL) ? tmpl->name : "carbon",
+                dests[i].host, dests[i].service);
+
+        cb->name = strdup (name);
+        cb->node = strdup (dests[i].host);
+        cb->service = strdup (dests[i].service);
+        cb->overflow_policy = tmpl->overflow_policy;
+
+        /* Destinations must not share a spool. */
+        ssnprintf (spool_dir, sizeof (spool_dir), "%s/%s_%s",
+                (tmpl->spool_dir != NULL) ? tmpl->spool_dir : "",
+                dests[i].host, dests[i].service);
+
+        if ((cb->name == NULL) || (cb->node == NULL) || (cb->service == NULL)
+                || (wg_callback_set_buffer (cb, buffer_size) != 0)
+                || (wg_callback_set_spool (cb, tmpl, spool_dir) != 0))
+        {
+            ERROR ("write_graphite plugin: Allocating %s failed.",
+                    callback_name);
+            wg_group_free (g);
+            return (-1);
+        }
+    }
+
+    if ((routing == WG_ROUTING_CONSISTENT_HASH)
+            && (wg_group_build_ring (g, dests) != 0))
+    {
+        ERROR ("write_graphite plugin: Building the hash ring for %s "
+                "failed.", callback_name);
+        wg_group_free (g);
+        return (-1);
+    }
+
+    memset (&user_data, 0, sizeof (user_data));
+    user_data.data = g;
+    user_data.free_func = wg_group_free;
+    plugin_register_write_batch (callback_name, wg_group_write_batch,
+            &user_data);
+
+    user_data.free_func = NULL;
+    plugin_register_flush (callback_name, wg_group_flush, &user_data);
+
+    for (i = 0; i < g->dests_num; i++)
+    {
+        char read_name[2 * DATA_MAX_NAME_LEN];
+
+        if ((g->dests[i]->ring_size == 0) && (g->dests[i]->spool == NULL))
+            continue;
+
+        ssnprintf (read_name, sizeof (read_name), "%s/%s:%s",
+                callback_name, g->dests[i]->node, g->dests[i]->service);
+        user_data.data = g->dests[i];
+        plugin_register_complex_read (/* group = */ NULL, read_name,
+                wg_read_stats, /* interval = */ NULL, &user_data);
+    }
+
+    return (0);
+}
+
+static int wg_config_node (oconfig_item_t *ci)
+{
+    struct wg_callback *cb;
+    user_data_t user_data;
+    char callback_name[DATA_MAX_NAME_LEN];
+    wg_destination_conf_t *dests = NULL;
+    size_t dests_num = 0;
+    int routing = WG_ROUTING_CONSISTENT_HASH;
+    int buffer_size = 0;
+    int i;
+
+    cb = wg_callback_create ();
+    if (cb == NULL)
+        return (-1);
 
     /* FIXME: Legacy configuration syntax. */
     if (strcasecmp ("Carbon", ci->key) != 0)
@@ -458,9 +1768,6 @@ static int wg_config_node (oconfig_item_t *ci)
         }
     }
 
-    pthread_mutex_init (&cb->send_lock, /* attr = */ NULL);
-    C_COMPLAIN_INIT (&cb->init_complaint);
-
     for (i = 0; i < ci->children_num; i++)
     {
         oconfig_item_t *child = ci->children + i;
@@ -469,6 +1776,10 @@ static int wg_config_node (oconfig_item_t *ci)
             cf_util_get_string (child, &cb->node);
         else if (strcasecmp ("Port", child->key) == 0)
             cf_util_get_service (child, &cb->service);
+        else if (strcasecmp ("Destination", child->key) == 0)
+            config_add_destination (&dests, &dests_num, child);
+        else if (strcasecmp ("Routing", child->key) == 0)
+            config_set_routing (&routing, child);
         else if (strcasecmp ("Prefix", child->key) == 0)
             cf_util_get_string (child, &cb->prefix);
         else if (strcasecmp ("Postfix", child->key) == 0)
@@ -484,6 +1795,16 @@ static int wg_config_node (oconfig_item_t *ci)
                     GRAPHITE_ALWAYS_APPEND_DS);
         else if (strcasecmp ("EscapeCharacter", child->key) == 0)
             config_set_char (&cb->escape_char, child);
+        else if (strcasecmp ("BufferSize", child->key) == 0)
+            cf_util_get_int (child, &buffer_size);
+        else if (strcasecmp ("BufferOverflow", child->key) == 0)
+            config_set_overflow (&cb->overflow_policy, child);
+        else if (strcasecmp ("SpoolDirectory", child->key) == 0)
+            cf_util_get_string (child, &cb->spool_dir);
+        else if (strcasecmp ("SpoolMaxSize", child->key) == 0)
+            c_spool_config_size (child, &cb->spool_max_size, 1024 * 1024);
+        else if (strcasecmp ("SpoolReplayRate", child->key) == 0)
+            c_spool_config_size (child, &cb->spool_replay_rate, 1024);
         else
         {
             ERROR ("write_graphite plugin: Invalid configuration "
@@ -500,14 +1821,63 @@ static int wg_config_node (oconfig_item_t *ci)
         ssnprintf (callback_name, sizeof (callback_name), "write_graphite/%s",
                 cb->name);
 
+    if (buffer_size < 0)
+    {
+        WARNING ("write_graphite plugin: Ignoring negative \"BufferSize\" "
+                "for %s.", callback_name);
+        buffer_size = 0;
+    }
+    else if ((buffer_size > 0) && (buffer_size < WG_SEND_BUF_SIZE))
+    {
+        WARNING ("write_graphite plugin: \"BufferSize\" for %s is too small; "
+                "using %i bytes.", callback_name, WG_SEND_BUF_SIZE);
+        buffer_size = WG_SEND_BUF_SIZE;
+    }
+
+    if (dests_num > 0)
+    {
+        int status;
+
+        if ((cb->node != NULL) || (cb->service != NULL))
+            WARNING ("write_graphite plugin: %s: \"Host\" and \"Port\" are "
+                    "ignored when \"Destination\" is used.", callback_name);
+
+        /* "cb" only served as a template for the destinations. */
+        status = wg_config_group (cb, callback_name, dests, dests_num,
+                routing, buffer_size);
+        wg_destinations_free (dests, dests_num);
+        wg_callback_free (cb);
+        return (status);
+    }
+
+    cb->name_cache = graphite_name_cache_create (cb->prefix, cb->postfix,
+            cb->escape_char, cb->format_flags);
+    if (cb->name_cache == NULL)
+    {
+        ERROR ("write_graphite plugin: graphite_name_cache_create failed.");
+        wg_callback_free (cb);
+        return (-1);
+    }
+
+    if ((wg_callback_set_buffer (cb, buffer_size) != 0)
+            || (wg_callback_set_spool (cb, cb, cb->spool_dir) != 0))
+    {
+        wg_callback_free (cb);
+        return (-1);
+    }
+
     memset (&user_data, 0, sizeof (user_data));
     user_data.data = cb;
     user_data.free_func = wg_callback_free;
-    plugin_register_write (callback_name, wg_write, &user_data);
+    plugin_register_write_batch (callback_name, wg_write_batch, &user_data);
 
     user_data.free_func = NULL;
     plugin_register_flush (callback_name, wg_flush, &user_data);
 
+    if ((cb->ring_size > 0) || (cb->spool != NULL))
+        plugin_register_complex_read (/* group = */ NULL, callback_name,
+                wg_read_stats, /* interval = */ NULL, &user_data);
+
     return (0);
 }
 
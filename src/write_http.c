@@ -26,9 +26,13 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "configfile.h"
 #include "utils_cache.h"
+#include "utils_complain.h"
+#include "utils_lock.h"
 #include "utils_parse_option.h"
 #include "utils_format_json.h"
+#include "utils_spool.h"
 
 #if HAVE_PTHREAD_H
 # include <pthread.h>
@@ -36,9 +40,52 @@
 
 #include <curl/curl.h>
 
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+#ifndef WH_DEFAULT_BUFFER_SIZE
+# define WH_DEFAULT_BUFFER_SIZE 4096
+#endif
+
+/* Number of filled buffers, per allowed concurrent request, which may wait
+ * for the sender thread before the oldest one is dropped. */
+#ifndef WH_QUEUE_DEPTH
+# define WH_QUEUE_DEPTH 4
+#endif
+
+/* How long the sender thread tries to deliver pending data at shutdown. */
+#ifndef WH_SHUTDOWN_TIMEOUT
+# define WH_SHUTDOWN_TIMEOUT TIME_T_TO_CDTIME_T (10)
+#endif
+
 /*
  * Private variables
  */
+/* A filled send buffer waiting for, or being sent by, the sender thread. */
+struct wh_payload_s;
+typedef struct wh_payload_s wh_payload_t;
+struct wh_payload_s
+{
+        char  *data;
+        size_t data_size;
+
+        wh_payload_t *next;
+};
+
+/* One easy handle, and thus one keep-alive connection, of the sender
+ * thread. */
+struct wh_request_s
+{
+        CURL *curl;
+        char curl_errbuf[CURL_ERROR_SIZE];
+
+        wh_payload_t *payload;
+        char  *body;
+        size_t body_size;
+};
+typedef struct wh_request_s wh_request_t;
+
 struct wh_callback_s
 {
         char *location;
@@ -55,22 +102,61 @@ struct wh_callback_s
 #define WH_FORMAT_JSON    1
         int format;
 
+#define WH_COMPRESS_NONE    0
+#define WH_COMPRESS_GZIP    1
+#define WH_COMPRESS_DEFLATE 2
+        int compression;
+
+        struct curl_slist *headers;
         CURL *curl;
         char curl_errbuf[CURL_ERROR_SIZE];
 
-        char   send_buffer[4096];
+        char  *send_buffer;
+        size_t send_buffer_size;
         size_t send_buffer_free;
         size_t send_buffer_fill;
         cdtime_t send_buffer_init_time;
 
-        pthread_mutex_t send_lock;
+        /* Identifier and data set fragments of the JSON output. Protected by
+         * "send_lock". */
+        format_json_cache_t *json_cache;
+
+        c_mutex_t send_lock;
+
+        /* If max_requests > 0, filled buffers are queued for a sender
+         * thread which keeps up to that many requests in flight. Protected
+         * by "send_lock". */
+        int max_requests;
+        cdtime_t flush_interval;
+        wh_payload_t *queue_head;
+        wh_payload_t *queue_tail;
+        size_t queue_len;
+        uint64_t dropped;
+
+        pthread_cond_t send_cond;
+        pthread_t send_thread;
+        _Bool send_thread_running;
+        _Bool send_thread_shutdown;
+        c_complain_t queue_complaint;
+
+        /* Holds request bodies on disk while the server is unavailable. Only
+         * used if "SpoolDirectory" has been configured. "retry_time" is used
+         * by the synchronous path, "healthy" only by the sender thread. */
+        char *spool_dir;
+        uint64_t spool_max_size;
+        uint64_t spool_replay_rate;
+        c_spool_t *spool;
+        cdtime_t retry_time;
+        _Bool healthy;
 };
 typedef struct wh_callback_s wh_callback_t;
 
 static void wh_reset_buffer (wh_callback_t *cb)  /* {{{ */
 {
-        memset (cb->send_buffer, 0, sizeof (cb->send_buffer));
-        cb->send_buffer_free = sizeof (cb->send_buffer);
+        /* Everything appended to the buffer is null-terminated, so there's
+         * no need to clear all of it. */
+        cb->send_buffer[0] = 0;
+        cb->send_buffer_free = cb->send_buffer_size;
         cb->send_buffer_fill = 0;
         cb->send_buffer_init_time = cdtime ();
 
@@ -82,11 +168,137 @@ static void wh_reset_buffer (wh_callback_t *cb)  /* {{{ */
         }
 } /* }}} wh_reset_buffer */
 
-static int wh_send_buffer (wh_callback_t *cb) /* {{{ */
+/* Compresses "data" into a newly allocated buffer according to the
+ * "Compression" option. */
+static int wh_compress (wh_callback_t *cb, /* {{{ */
+                char const *data, size_t data_size,
+                char **ret_body, size_t *ret_body_size)
 {
+#if HAVE_LIBZ
+        z_stream z;
+        char *body;
+        size_t body_size;
+        int status;
+
+        memset (&z, 0, sizeof (z));
+        /* A window size of 15 + 16 makes zlib write a gzip header. */
+        status = deflateInit2 (&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        (cb->compression == WH_COMPRESS_GZIP) ? (15 + 16) : 15,
+                        /* memLevel = */ 8, Z_DEFAULT_STRATEGY);
+        if (status != Z_OK)
+        {
+                ERROR ("write_http plugin: deflateInit2 failed with status %i.",
+                                status);
+                return (-1);
+        }
+
+        /* deflateBound() doesn't account for the gzip header. */
+        body_size = deflateBound (&z, (uLong) data_size) + 32;
+        body = malloc (body_size);
+        if (body == NULL)
+        {
+                ERROR ("write_http plugin: malloc failed.");
+                deflateEnd (&z);
+                return (-1);
+        }
+
+        z.next_in = (Bytef *) data;
+        z.avail_in = (uInt) data_size;
+        z.next_out = (Bytef *) body;
+        z.avail_out = (uInt) body_size;
+
+        status = deflate (&z, Z_FINISH);
+        if (status != Z_STREAM_END)
+        {
+                ERROR ("write_http plugin: deflate failed with status %i.",
+                                status);
+                deflateEnd (&z);
+                sfree (body);
+                return (-1);
+        }
+
+        *ret_body = body;
+        *ret_body_size = (size_t) z.total_out;
+        deflateEnd (&z);
+
+        return (0);
+#else
+        ERROR ("write_http plugin: Compression requested, but the plugin has "
+                        "been built without zlib.");
+        return (-1);
+#endif
+} /* }}} int wh_compress */
+
+/* Points "curl" at the body of the next request, compressing "data" if
+ * configured. "*ret_body" must be freed by the caller if it is not "data". */
+static int wh_prepare_body (wh_callback_t *cb, CURL *curl, /* {{{ */
+                char *data, size_t data_size,
+                char **ret_body, size_t *ret_body_size)
+{
+        *ret_body = data;
+        *ret_body_size = data_size;
+
+        if (cb->compression != WH_COMPRESS_NONE)
+        {
+                int status;
+
+                status = wh_compress (cb, data, data_size,
+                                ret_body, ret_body_size);
+                if (status != 0)
+                        return (status);
+        }
+
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long) *ret_body_size);
+        curl_easy_setopt (curl, CURLOPT_POSTFIELDS, *ret_body);
+
+        return (0);
+} /* }}} int wh_prepare_body */
+
+/* Returns true if a request should be retried later: the server couldn't be
+ * reached or reported a temporary problem. Other errors, such as the server
+ * rejecting the data, won't go away by sending it again. */
+static _Bool wh_request_failed (CURL *curl, int curl_status) /* {{{ */
+{
+        long code = 0;
+
+        if (curl_status != CURLE_OK)
+                return (1);
+
+        curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+        return (code >= 500);
+} /* }}} _Bool wh_request_failed */
+
+static int wh_spool_append (wh_callback_t *cb, /* {{{ */
+                char const *data, size_t data_size)
+{
+        int status;
+
+        status = c_spool_append (cb->spool, data, data_size);
+        if (status != 0)
+        {
+                ERROR ("write_http plugin: %s: Spooling %zu bytes failed "
+                                "with status %i.", cb->location, data_size,
+                                status);
+                return (-1);
+        }
+
+        return (0);
+} /* }}} int wh_spool_append */
+
+/* Sends "data" with the synchronous handle. Returns zero if the request
+ * doesn't need to be retried. */
+static int wh_perform (wh_callback_t *cb, /* {{{ */
+                char *data, size_t data_size)
+{
+        char *body;
+        size_t body_size;
         int status = 0;
 
-        curl_easy_setopt (cb->curl, CURLOPT_POSTFIELDS, cb->send_buffer);
+        status = wh_prepare_body (cb, cb->curl, data, data_size,
+                        &body, &body_size);
+        if (status != 0)
+                return (status);
+
         status = curl_easy_perform (cb->curl);
         if (status != 0)
         {
@@ -94,39 +306,483 @@ static int wh_send_buffer (wh_callback_t *cb) /* {{{ */
                                 "status %i: %s",
                                 status, cb->curl_errbuf);
         }
+        else if ((cb->spool != NULL) && wh_request_failed (cb->curl, status))
+        {
+                ERROR ("write_http plugin: %s: The server responded with "
+                                "a server error. The data will be retried.",
+                                cb->location);
+                status = -1;
+        }
+
+        if (body != data)
+                sfree (body);
         return (status);
-} /* }}} wh_send_buffer */
+} /* }}} int wh_perform */
 
-static int wh_callback_init (wh_callback_t *cb) /* {{{ */
+/* Sends spooled data until the spool is empty, the replay rate has been used
+ * up or a request fails. The caller must hold "send_lock". */
+static void wh_spool_replay (wh_callback_t *cb) /* {{{ */
 {
-        struct curl_slist *headers;
+        while (42)
+        {
+                void *data;
+                size_t data_size;
 
-        if (cb->curl != NULL)
-                return (0);
+                if (c_spool_shift (cb->spool, &data, &data_size) != 0)
+                        break;
 
-        cb->curl = curl_easy_init ();
-        if (cb->curl == NULL)
+                if (wh_perform (cb, data, data_size) != 0)
+                {
+                        cb->retry_time = cdtime () + TIME_T_TO_CDTIME_T (1);
+                        wh_spool_append (cb, data, data_size);
+                        sfree (data);
+                        break;
+                }
+                sfree (data);
+        }
+} /* }}} void wh_spool_replay */
+
+static int wh_send_buffer (wh_callback_t *cb) /* {{{ */
+{
+        int status;
+
+        if (cb->spool == NULL)
+                return (wh_perform (cb, cb->send_buffer, cb->send_buffer_fill));
+
+        /* Don't wait for a server which failed a second ago. */
+        if (cdtime () < cb->retry_time)
+                return (wh_spool_append (cb, cb->send_buffer,
+                                        cb->send_buffer_fill));
+
+        status = wh_perform (cb, cb->send_buffer, cb->send_buffer_fill);
+        if (status != 0)
+        {
+                cb->retry_time = cdtime () + TIME_T_TO_CDTIME_T (1);
+                return (wh_spool_append (cb, cb->send_buffer,
+                                        cb->send_buffer_fill));
+        }
+
+        wh_spool_replay (cb);
+        return (0);
+} /* }}} wh_send_buffer */
+
+/* Creates an easy handle with all per-URL options set. */
+static CURL *wh_curl_create (wh_callback_t *cb, char *errbuf) /* {{{ */
+{
+        CURL *curl;
+
+        curl = curl_easy_init ();
+        if (curl == NULL)
         {
                 ERROR ("curl plugin: curl_easy_init failed.");
+                return (NULL);
+        }
+
+        curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (curl, CURLOPT_USERAGENT, PACKAGE_NAME"/"PACKAGE_VERSION);
+        curl_easy_setopt (curl, CURLOPT_HTTPHEADER, cb->headers);
+
+        curl_easy_setopt (curl, CURLOPT_ERRORBUFFER, errbuf);
+        curl_easy_setopt (curl, CURLOPT_URL, cb->location);
+
+        if (cb->credentials != NULL)
+        {
+                curl_easy_setopt (curl, CURLOPT_USERPWD, cb->credentials);
+                curl_easy_setopt (curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+        }
+
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, (long) cb->verify_peer);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST,
+                        cb->verify_host ? 2L : 0L);
+        if (cb->cacert != NULL)
+                curl_easy_setopt (curl, CURLOPT_CAINFO, cb->cacert);
+
+        return (curl);
+} /* }}} CURL *wh_curl_create */
+
+/* Takes a record from the spool if the last request succeeded. Returns NULL
+ * if there is nothing to replay right now. Only called by the sender
+ * thread. */
+static wh_payload_t *wh_spool_payload (wh_callback_t *cb) /* {{{ */
+{
+        wh_payload_t *p;
+        void *data;
+        size_t data_size;
+
+        if ((cb->spool == NULL) || !cb->healthy || cb->send_thread_shutdown)
+                return (NULL);
+
+        p = malloc (sizeof (*p));
+        if (p == NULL)
+                return (NULL);
+
+        if (c_spool_shift (cb->spool, &data, &data_size) != 0)
+        {
+                sfree (p);
+                return (NULL);
+        }
+
+        p->data = data;
+        p->data_size = data_size;
+        p->next = NULL;
+        return (p);
+} /* }}} wh_payload_t *wh_spool_payload */
+
+/* Starts transfers for queued payloads on idle handles. Spooled payloads are
+ * replayed when the queue is empty. Called by the sender thread with
+ * "send_lock" held; the lock is released while the bodies are compressed.
+ * Returns the number of started transfers. */
+static int wh_start_requests (wh_callback_t *cb, CURLM *multi, /* {{{ */
+                wh_request_t *requests)
+{
+        int started = 0;
+        int i;
+
+        for (i = 0; i < cb->max_requests; i++)
+        {
+                wh_request_t *r = requests + i;
+                wh_payload_t *p;
+                int status;
+
+                if ((r->payload != NULL) || (r->curl == NULL))
+                        continue;
+
+                if (cb->queue_head != NULL)
+                {
+                        p = cb->queue_head;
+                        cb->queue_head = p->next;
+                        if (cb->queue_head == NULL)
+                                cb->queue_tail = NULL;
+                        cb->queue_len--;
+                        p->next = NULL;
+                }
+                else
+                {
+                        p = wh_spool_payload (cb);
+                        if (p == NULL)
+                                break;
+                }
+
+                c_mutex_unlock (&cb->send_lock);
+                status = wh_prepare_body (cb, r->curl, p->data, p->data_size,
+                                &r->body, &r->body_size);
+                if (status == 0)
+                {
+                        r->payload = p;
+                        status = (int) curl_multi_add_handle (multi, r->curl);
+                        if (status != 0)
+                        {
+                                ERROR ("write_http plugin: "
+                                                "curl_multi_add_handle failed "
+                                                "with status %i.", status);
+                                r->payload = NULL;
+                        }
+                }
+                if (r->payload == NULL)
+                {
+                        if ((r->body != NULL) && (r->body != p->data))
+                                sfree (r->body);
+                        r->body = NULL;
+                        sfree (p->data);
+                        sfree (p);
+                }
+                else
+                        started++;
+                c_mutex_lock (&cb->send_lock);
+        }
+
+        return (started);
+} /* }}} int wh_start_requests */
+
+/* Releases the request's handle, spooling its payload first if "spool" is
+ * true. */
+static void wh_request_release (wh_callback_t *cb, CURLM *multi, /* {{{ */
+                wh_request_t *r, _Bool spool)
+{
+        curl_multi_remove_handle (multi, r->curl);
+
+        if (spool && (cb->spool != NULL))
+                wh_spool_append (cb, r->payload->data, r->payload->data_size);
+
+        if (r->body != r->payload->data)
+                sfree (r->body);
+        r->body = NULL;
+        r->curl_errbuf[0] = 0;
+
+        sfree (r->payload->data);
+        sfree (r->payload);
+} /* }}} void wh_request_release */
+
+/* Reports and releases finished transfers, or all of them if "abort" is
+ * true. Failed and aborted transfers go to the spool, if there is one.
+ * Returns the number of released transfers. */
+static int wh_finish_requests (wh_callback_t *cb, CURLM *multi, /* {{{ */
+                wh_request_t *requests, int requests_num, _Bool abort)
+{
+        CURLMsg *msg;
+        int msgs_left;
+        int finished = 0;
+        _Bool failed;
+        int i;
+
+        while ((msg = curl_multi_info_read (multi, &msgs_left)) != NULL)
+        {
+                if (msg->msg != CURLMSG_DONE)
+                        continue;
+
+                for (i = 0; i < requests_num; i++)
+                        if (requests[i].curl == msg->easy_handle)
+                                break;
+                if ((i >= requests_num) || (requests[i].payload == NULL))
+                        continue;
+
+                failed = wh_request_failed (requests[i].curl,
+                                (int) msg->data.result);
+                cb->healthy = !failed;
+
+                if (msg->data.result != CURLE_OK)
+                {
+                        ERROR ("write_http plugin: Request failed with "
+                                        "status %i: %s", (int) msg->data.result,
+                                        requests[i].curl_errbuf);
+                }
+                else
+                {
+                        long code = 0;
+
+                        curl_easy_getinfo (requests[i].curl,
+                                        CURLINFO_RESPONSE_CODE, &code);
+                        if ((code < 200) || (code >= 300))
+                                ERROR ("write_http plugin: The server "
+                                                "responded with HTTP status "
+                                                "%li.", code);
+                }
+
+                wh_request_release (cb, multi, requests + i, failed);
+                finished++;
+        }
+
+        if (abort)
+        {
+                for (i = 0; i < requests_num; i++)
+                {
+                        if (requests[i].payload == NULL)
+                                continue;
+
+                        wh_request_release (cb, multi, requests + i,
+                                        /* spool = */ 1);
+                        finished++;
+                }
+        }
+
+        return (finished);
+} /* }}} int wh_finish_requests */
+
+static int wh_flush_nolock (cdtime_t timeout, wh_callback_t *cb);
+
+static void *wh_send_thread (void *arg) /* {{{ */
+{
+        wh_callback_t *cb = arg;
+        wh_request_t *requests;
+        CURLM *multi;
+        cdtime_t deadline = 0;
+        int active = 0;
+        int i;
+
+        requests = calloc ((size_t) cb->max_requests, sizeof (*requests));
+        multi = curl_multi_init ();
+        if ((requests == NULL) || (multi == NULL))
+        {
+                ERROR ("write_http plugin: Initializing the sender thread "
+                                "for %s failed.", cb->location);
+                sfree (requests);
+                if (multi != NULL)
+                        curl_multi_cleanup (multi);
+                return ((void *) -1);
+        }
+
+        for (i = 0; i < cb->max_requests; i++)
+                requests[i].curl = wh_curl_create (cb, requests[i].curl_errbuf);
+
+        /* Try replaying what a previous run left in the spool. */
+        cb->healthy = 1;
+
+        c_mutex_lock (&cb->send_lock);
+        while (42)
+        {
+                int running = 0;
+
+                /* Send partially filled buffers after "FlushInterval". */
+                if (!cb->send_thread_shutdown)
+                        wh_flush_nolock (cb->flush_interval, cb);
+
+                active += wh_start_requests (cb, multi, requests);
+
+                if (active == 0)
+                {
+                        struct timespec ts;
+
+                        if (cb->send_thread_shutdown
+                                        && (cb->queue_head == NULL))
+                                break;
+
+                        CDTIME_T_TO_TIMESPEC (cb->send_buffer_init_time
+                                        + cb->flush_interval, &ts);
+                        c_cond_timedwait (&cb->send_cond,
+                                        &cb->send_lock, &ts);
+                        continue;
+                }
+
+                if (cb->send_thread_shutdown && (deadline == 0))
+                        deadline = cdtime () + WH_SHUTDOWN_TIMEOUT;
+                c_mutex_unlock (&cb->send_lock);
+
+                curl_multi_perform (multi, &running);
+                active -= wh_finish_requests (cb, multi, requests,
+                                cb->max_requests, /* abort = */ 0);
+
+                /* Wake up regularly to pick up newly queued buffers. */
+                if (active > 0)
+                        curl_multi_wait (multi, NULL, 0, /* ms = */ 100, NULL);
+
+                c_mutex_lock (&cb->send_lock);
+
+                if ((deadline != 0) && (cdtime () > deadline))
+                {
+                        WARNING ("write_http plugin: %s: Giving up on %i "
+                                        "requests and %zu queued buffers at "
+                                        "shutdown.", cb->location, active,
+                                        cb->queue_len);
+                        active -= wh_finish_requests (cb, multi, requests,
+                                        cb->max_requests, /* abort = */ 1);
+                        break;
+                }
+        }
+
+        /* Whatever is left couldn't be sent in time. */
+        while (cb->queue_head != NULL)
+        {
+                wh_payload_t *p = cb->queue_head;
+
+                cb->queue_head = p->next;
+                if (cb->spool != NULL)
+                        wh_spool_append (cb, p->data, p->data_size);
+                sfree (p->data);
+                sfree (p);
+        }
+        cb->queue_tail = NULL;
+        cb->queue_len = 0;
+        c_mutex_unlock (&cb->send_lock);
+
+        for (i = 0; i < cb->max_requests; i++)
+                if (requests[i].curl != NULL)
+                        curl_easy_cleanup (requests[i].curl);
+        curl_multi_cleanup (multi);
+        sfree (requests);
+
+        return ((void *) 0);
+} /* }}} void *wh_send_thread */
+
+/* Hands the current send buffer to the sender thread and provides a new,
+ * empty one. The caller must hold "send_lock". */
+static int wh_queue_buffer (wh_callback_t *cb) /* {{{ */
+{
+        wh_payload_t *p;
+        char *buffer;
+
+        p = malloc (sizeof (*p));
+        buffer = malloc (cb->send_buffer_size);
+        if ((p == NULL) || (buffer == NULL))
+        {
+                ERROR ("write_http plugin: malloc failed.");
+                sfree (p);
+                sfree (buffer);
                 return (-1);
         }
 
-        curl_easy_setopt (cb->curl, CURLOPT_NOSIGNAL, 1L);
-        curl_easy_setopt (cb->curl, CURLOPT_USERAGENT, PACKAGE_NAME"/"PACKAGE_VERSION);
+        p->data = cb->send_buffer;
+        p->data_size = cb->send_buffer_fill;
+        p->next = NULL;
+        cb->send_buffer = buffer;
 
-        headers = NULL;
-        headers = curl_slist_append (headers, "Accept:  */*");
-        if (cb->format == WH_FORMAT_JSON)
-                headers = curl_slist_append (headers, "Content-Type: application/json");
+        /* Drop the oldest data if the server doesn't keep up. */
+        if (cb->queue_len >= (size_t) (cb->max_requests * WH_QUEUE_DEPTH))
+        {
+                wh_payload_t *old = cb->queue_head;
+
+                cb->queue_head = old->next;
+                if (cb->queue_head == NULL)
+                        cb->queue_tail = NULL;
+                cb->queue_len--;
+
+                if ((cb->spool != NULL)
+                                && (c_spool_append (cb->spool, old->data,
+                                                old->data_size) == 0))
+                        c_complain (LOG_WARNING, &cb->queue_complaint,
+                                        "write_http plugin: %s: The server "
+                                        "doesn't keep up; spooling the oldest "
+                                        "buffered values.", cb->location);
+                else
+                {
+                        cb->dropped += old->data_size;
+                        c_complain (LOG_WARNING, &cb->queue_complaint,
+                                        "write_http plugin: %s: The server "
+                                        "doesn't keep up; dropping the oldest "
+                                        "buffered values.", cb->location);
+                }
+                sfree (old->data);
+                sfree (old);
+        }
+        else if (cb->queue_len == 0)
+        {
+                c_release (LOG_INFO, &cb->queue_complaint,
+                                "write_http plugin: %s: The server caught "
+                                "up again.", cb->location);
+        }
+
+        if (cb->queue_tail == NULL)
+                cb->queue_head = p;
         else
-                headers = curl_slist_append (headers, "Content-Type: text/plain");
-        headers = curl_slist_append (headers, "Expect:");
-        curl_easy_setopt (cb->curl, CURLOPT_HTTPHEADER, headers);
+                cb->queue_tail->next = p;
+        cb->queue_tail = p;
+        cb->queue_len++;
+
+        pthread_cond_signal (&cb->send_cond);
+        return (0);
+} /* }}} int wh_queue_buffer */
+
+/* Sends the buffer right away, or queues it for the sender thread. */
+static int wh_dispatch_buffer (wh_callback_t *cb) /* {{{ */
+{
+        if (cb->max_requests > 0)
+                return (wh_queue_buffer (cb));
+        return (wh_send_buffer (cb));
+} /* }}} int wh_dispatch_buffer */
+
+static int wh_callback_init (wh_callback_t *cb) /* {{{ */
+{
+        struct curl_slist *headers;
+
+        if ((cb->curl != NULL) || cb->send_thread_running)
+                return (0);
 
-        curl_easy_setopt (cb->curl, CURLOPT_ERRORBUFFER, cb->curl_errbuf);
-        curl_easy_setopt (cb->curl, CURLOPT_URL, cb->location);
+        if (cb->headers == NULL)
+        {
+                headers = NULL;
+                headers = curl_slist_append (headers, "Accept:  */*");
+                if (cb->format == WH_FORMAT_JSON)
+                        headers = curl_slist_append (headers, "Content-Type: application/json");
+                else
+                        headers = curl_slist_append (headers, "Content-Type: text/plain");
+                if (cb->compression == WH_COMPRESS_GZIP)
+                        headers = curl_slist_append (headers, "Content-Encoding: gzip");
+                else if (cb->compression == WH_COMPRESS_DEFLATE)
+                        headers = curl_slist_append (headers, "Content-Encoding: deflate");
+                headers = curl_slist_append (headers, "Expect:");
+                cb->headers = headers;
+        }
 
-        if (cb->user != NULL)
+        if ((cb->user != NULL) && (cb->credentials == NULL))
         {
                 size_t credentials_size;
 
@@ -143,15 +799,31 @@ static int wh_callback_init (wh_callback_t *cb) /* {{{ */
 
                 ssnprintf (cb->credentials, credentials_size, "%s:%s",
                                 cb->user, (cb->pass == NULL) ? "" : cb->pass);
-                curl_easy_setopt (cb->curl, CURLOPT_USERPWD, cb->credentials);
-                curl_easy_setopt (cb->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
         }
 
-        curl_easy_setopt (cb->curl, CURLOPT_SSL_VERIFYPEER, (long) cb->verify_peer);
-        curl_easy_setopt (cb->curl, CURLOPT_SSL_VERIFYHOST,
-                        cb->verify_host ? 2L : 0L);
-        if (cb->cacert != NULL)
-                curl_easy_setopt (cb->curl, CURLOPT_CAINFO, cb->cacert);
+        if (cb->max_requests > 0)
+        {
+                /* Started here rather than during configuration so that the
+                 * thread survives the daemon forking. */
+                int status = plugin_thread_create (&cb->send_thread,
+                                /* attr = */ NULL, wh_send_thread, cb);
+                if (status != 0)
+                {
+                        char errbuf[1024];
+                        ERROR ("write_http plugin: Starting the sender "
+                                        "thread failed: %s",
+                                        sstrerror (errno, errbuf,
+                                                sizeof (errbuf)));
+                        return (-1);
+                }
+                cb->send_thread_running = 1;
+        }
+        else
+        {
+                cb->curl = wh_curl_create (cb, cb->curl_errbuf);
+                if (cb->curl == NULL)
+                        return (-1);
+        }
 
         wh_reset_buffer (cb);
 
@@ -185,7 +857,7 @@ static int wh_flush_nolock (cdtime_t timeout, wh_callback_t *cb) /* {{{ */
                         return (0);
                 }
 
-                status = wh_send_buffer (cb);
+                status = wh_dispatch_buffer (cb);
                 wh_reset_buffer (cb);
         }
         else if (cb->format == WH_FORMAT_JSON)
@@ -207,7 +879,7 @@ static int wh_flush_nolock (cdtime_t timeout, wh_callback_t *cb) /* {{{ */
                         return (status);
                 }
 
-                status = wh_send_buffer (cb);
+                status = wh_dispatch_buffer (cb);
                 wh_reset_buffer (cb);
         }
         else
@@ -233,7 +905,7 @@ static int wh_flush (cdtime_t timeout, /* {{{ */
 
         cb = user_data->data;
 
-        pthread_mutex_lock (&cb->send_lock);
+        c_mutex_lock (&cb->send_lock);
 
         if (cb->curl == NULL)
         {
@@ -241,13 +913,13 @@ static int wh_flush (cdtime_t timeout, /* {{{ */
                 if (status != 0)
                 {
                         ERROR ("write_http plugin: wh_callback_init failed.");
-                        pthread_mutex_unlock (&cb->send_lock);
+                        c_mutex_unlock (&cb->send_lock);
                         return (-1);
                 }
         }
 
         status = wh_flush_nolock (timeout, cb);
-        pthread_mutex_unlock (&cb->send_lock);
+        c_mutex_unlock (&cb->send_lock);
 
         return (status);
 } /* }}} int wh_flush */
@@ -261,18 +933,48 @@ static void wh_callback_free (void *data) /* {{{ */
 
         cb = data;
 
-        wh_flush_nolock (/* timeout = */ 0, cb);
+        c_mutex_lock (&cb->send_lock);
+        if ((cb->curl != NULL) || cb->send_thread_running)
+                wh_flush_nolock (/* timeout = */ 0, cb);
+        c_mutex_unlock (&cb->send_lock);
+
+        if (cb->send_thread_running)
+        {
+                /* The thread sends what has been queued before it exits. */
+                c_mutex_lock (&cb->send_lock);
+                cb->send_thread_shutdown = 1;
+                pthread_cond_signal (&cb->send_cond);
+                c_mutex_unlock (&cb->send_lock);
+
+                pthread_join (cb->send_thread, /* retval = */ NULL);
+                cb->send_thread_running = 0;
+        }
+
+        if (cb->dropped > 0)
+                WARNING ("write_http plugin: %s: Dropped %"PRIu64" bytes of "
+                                "values because the server didn't keep up.",
+                                cb->location, cb->dropped);
 
-        curl_easy_cleanup (cb->curl);
+        if (cb->curl != NULL)
+                curl_easy_cleanup (cb->curl);
+        curl_slist_free_all (cb->headers);
+        format_json_cache_destroy (cb->json_cache);
+        sfree (cb->send_buffer);
         sfree (cb->location);
         sfree (cb->user);
         sfree (cb->pass);
         sfree (cb->credentials);
         sfree (cb->cacert);
+        sfree (cb->spool_dir);
+        c_spool_destroy (cb->spool);
+
+        c_mutex_destroy (&cb->send_lock);
+        pthread_cond_destroy (&cb->send_cond);
 
         sfree (cb);
 } /* }}} void wh_callback_free */
 
+/* The caller must hold "send_lock". */
 static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{{ */
                 wh_callback_t *cb)
 {
@@ -290,10 +992,15 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
         }
 
         /* Copy the identifier to `key' and escape it. */
-        status = FORMAT_VL (key, sizeof (key), vl);
-        if (status != 0) {
-                ERROR ("write_http plugin: error with format_name");
-                return (status);
+        if (vl->identity != NULL)
+                sstrncpy (key, vl->identity, sizeof (key));
+        else
+        {
+                status = FORMAT_VL (key, sizeof (key), vl);
+                if (status != 0) {
+                        ERROR ("write_http plugin: error with format_name");
+                        return (status);
+                }
         }
         escape_string (key, sizeof (key));
 
@@ -317,15 +1024,12 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
                 return (-1);
         }
 
-        pthread_mutex_lock (&cb->send_lock);
-
         if (cb->curl == NULL)
         {
                 status = wh_callback_init (cb);
                 if (status != 0)
                 {
                         ERROR ("write_http plugin: wh_callback_init failed.");
-                        pthread_mutex_unlock (&cb->send_lock);
                         return (-1);
                 }
         }
@@ -334,10 +1038,7 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
         {
                 status = wh_flush_nolock (/* timeout = */ 0, cb);
                 if (status != 0)
-                {
-                        pthread_mutex_unlock (&cb->send_lock);
                         return (status);
-                }
         }
         assert (command_len < cb->send_buffer_free);
 
@@ -350,88 +1051,99 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
 
         DEBUG ("write_http plugin: <%s> buffer %zu/%zu (%g%%) \"%s\"",
                         cb->location,
-                        cb->send_buffer_fill, sizeof (cb->send_buffer),
-                        100.0 * ((double) cb->send_buffer_fill) / ((double) sizeof (cb->send_buffer)),
+                        cb->send_buffer_fill, cb->send_buffer_size,
+                        100.0 * ((double) cb->send_buffer_fill) / ((double) cb->send_buffer_size),
                         command);
 
-        /* Check if we have enough space for this command. */
-        pthread_mutex_unlock (&cb->send_lock);
-
         return (0);
 } /* }}} int wh_write_command */
 
+/* The caller must hold "send_lock". */
 static int wh_write_json (const data_set_t *ds, const value_list_t *vl, /* {{{ */
                 wh_callback_t *cb)
 {
         int status;
 
-        pthread_mutex_lock (&cb->send_lock);
-
         if (cb->curl == NULL)
         {
                 status = wh_callback_init (cb);
                 if (status != 0)
                 {
                         ERROR ("write_http plugin: wh_callback_init failed.");
-                        pthread_mutex_unlock (&cb->send_lock);
                         return (-1);
                 }
         }
 
-        status = format_json_value_list (cb->send_buffer,
+        if (cb->json_cache == NULL)
+        {
+                cb->json_cache = format_json_cache_create ();
+                if (cb->json_cache == NULL)
+                {
+                        ERROR ("write_http plugin: format_json_cache_create "
+                                        "failed.");
+                        return (-1);
+                }
+        }
+
+        status = format_json_value_list_cached (cb->send_buffer,
                         &cb->send_buffer_fill,
                         &cb->send_buffer_free,
-                        ds, vl, cb->store_rates);
+                        ds, vl, cb->store_rates, cb->json_cache);
         if (status == (-ENOMEM))
         {
                 status = wh_flush_nolock (/* timeout = */ 0, cb);
                 if (status != 0)
                 {
                         wh_reset_buffer (cb);
-                        pthread_mutex_unlock (&cb->send_lock);
                         return (status);
                 }
 
-                status = format_json_value_list (cb->send_buffer,
+                status = format_json_value_list_cached (cb->send_buffer,
                                 &cb->send_buffer_fill,
                                 &cb->send_buffer_free,
-                                ds, vl, cb->store_rates);
+                                ds, vl, cb->store_rates, cb->json_cache);
         }
         if (status != 0)
-        {
-                pthread_mutex_unlock (&cb->send_lock);
                 return (status);
-        }
 
         DEBUG ("write_http plugin: <%s> buffer %zu/%zu (%g%%)",
                         cb->location,
-                        cb->send_buffer_fill, sizeof (cb->send_buffer),
-                        100.0 * ((double) cb->send_buffer_fill) / ((double) sizeof (cb->send_buffer)));
-
-        /* Check if we have enough space for this command. */
-        pthread_mutex_unlock (&cb->send_lock);
+                        cb->send_buffer_fill, cb->send_buffer_size,
+                        100.0 * ((double) cb->send_buffer_fill) / ((double) cb->send_buffer_size));
 
         return (0);
 } /* }}} int wh_write_json */
 
-static int wh_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
-                user_data_t *user_data)
+static int wh_write_batch (const plugin_write_item_t *items, /* {{{ */
+                size_t items_num, user_data_t *user_data)
 {
         wh_callback_t *cb;
-        int status;
+        size_t i;
+        int ret = 0;
 
         if (user_data == NULL)
                 return (-EINVAL);
 
         cb = user_data->data;
 
-        if (cb->format == WH_FORMAT_JSON)
-                status = wh_write_json (ds, vl, cb);
-        else
-                status = wh_write_command (ds, vl, cb);
+        /* Take the lock once for all values dequeued together. */
+        c_mutex_lock (&cb->send_lock);
+        for (i = 0; i < items_num; i++)
+        {
+                int status;
 
-        return (status);
-} /* }}} int wh_write */
+                if (cb->format == WH_FORMAT_JSON)
+                        status = wh_write_json (items[i].ds, items[i].vl, cb);
+                else
+                        status = wh_write_command (items[i].ds, items[i].vl, cb);
+
+                if (status != 0)
+                        ret = status;
+        }
+        c_mutex_unlock (&cb->send_lock);
+
+        return (ret);
+} /* }}} int wh_write_batch */
 
 static int config_set_string (char **ret_string, /* {{{ */
                 oconfig_item_t *ci)
@@ -502,10 +1214,51 @@ static int config_set_format (wh_callback_t *cb, /* {{{ */
         return (0);
 } /* }}} int config_set_string */
 
+static int config_set_compression (wh_callback_t *cb, /* {{{ */
+                oconfig_item_t *ci)
+{
+        char *string;
+
+        if ((ci->values_num != 1)
+                        || (ci->values[0].type != OCONFIG_TYPE_STRING))
+        {
+                WARNING ("write_http plugin: The `%s' config option "
+                                "needs exactly one string argument.", ci->key);
+                return (-1);
+        }
+
+        string = ci->values[0].value.string;
+        if (strcasecmp ("None", string) == 0)
+                cb->compression = WH_COMPRESS_NONE;
+        else if (strcasecmp ("Gzip", string) == 0)
+                cb->compression = WH_COMPRESS_GZIP;
+        else if (strcasecmp ("Deflate", string) == 0)
+                cb->compression = WH_COMPRESS_DEFLATE;
+        else
+        {
+                ERROR ("write_http plugin: Invalid compression: %s", string);
+                return (-1);
+        }
+
+#if !HAVE_LIBZ
+        if (cb->compression != WH_COMPRESS_NONE)
+        {
+                ERROR ("write_http plugin: Compression is not available "
+                                "because the plugin has been built without "
+                                "zlib.");
+                cb->compression = WH_COMPRESS_NONE;
+                return (-1);
+        }
+#endif
+
+        return (0);
+} /* }}} int config_set_compression */
+
 static int wh_config_url (oconfig_item_t *ci) /* {{{ */
 {
         wh_callback_t *cb;
         user_data_t user_data;
+        int buffer_size = WH_DEFAULT_BUFFER_SIZE;
         int i;
 
         cb = malloc (sizeof (*cb));
@@ -523,9 +1276,16 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
         cb->verify_host = 1;
         cb->cacert = NULL;
         cb->format = WH_FORMAT_COMMAND;
+        cb->compression = WH_COMPRESS_NONE;
         cb->curl = NULL;
+        cb->send_buffer_size = WH_DEFAULT_BUFFER_SIZE;
+        cb->flush_interval = plugin_get_interval ();
+        cb->spool_max_size = C_SPOOL_DEFAULT_MAX_SIZE;
+        cb->spool_replay_rate = C_SPOOL_DEFAULT_REPLAY_RATE;
 
-        pthread_mutex_init (&cb->send_lock, /* attr = */ NULL);
+        c_mutex_init (&cb->send_lock, "write_http");
+        pthread_cond_init (&cb->send_cond, /* attr = */ NULL);
+        C_COMPLAIN_INIT (&cb->queue_complaint);
 
         config_set_string (&cb->location, ci);
         if (cb->location == NULL)
@@ -549,6 +1309,22 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
                         config_set_format (cb, child);
                 else if (strcasecmp ("StoreRates", child->key) == 0)
                         config_set_boolean (&cb->store_rates, child);
+                else if (strcasecmp ("BufferSize", child->key) == 0)
+                        cf_util_get_int (child, &buffer_size);
+                else if (strcasecmp ("Compression", child->key) == 0)
+                        config_set_compression (cb, child);
+                else if (strcasecmp ("ConcurrentRequests", child->key) == 0)
+                        cf_util_get_int (child, &cb->max_requests);
+                else if (strcasecmp ("FlushInterval", child->key) == 0)
+                        cf_util_get_cdtime (child, &cb->flush_interval);
+                else if (strcasecmp ("SpoolDirectory", child->key) == 0)
+                        config_set_string (&cb->spool_dir, child);
+                else if (strcasecmp ("SpoolMaxSize", child->key) == 0)
+                        c_spool_config_size (child, &cb->spool_max_size,
+                                        1024 * 1024);
+                else if (strcasecmp ("SpoolReplayRate", child->key) == 0)
+                        c_spool_config_size (child, &cb->spool_replay_rate,
+                                        1024);
                 else
                 {
                         ERROR ("write_http plugin: Invalid configuration "
@@ -556,6 +1332,39 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
                 }
         }
 
+        if (buffer_size < 1024)
+        {
+                WARNING ("write_http plugin: BufferSize %i is too small for "
+                                "%s; using 1024 bytes.", buffer_size,
+                                cb->location);
+                buffer_size = 1024;
+        }
+        if (cb->max_requests < 0)
+                cb->max_requests = 0;
+
+        cb->send_buffer_size = (size_t) buffer_size;
+        cb->send_buffer = malloc (cb->send_buffer_size);
+        if (cb->send_buffer == NULL)
+        {
+                ERROR ("write_http plugin: Allocating a %i byte send buffer "
+                                "failed.", buffer_size);
+                wh_callback_free (cb);
+                return (-1);
+        }
+
+        if (cb->spool_dir != NULL)
+        {
+                cb->spool = c_spool_create (cb->spool_dir, cb->spool_max_size,
+                                cb->spool_replay_rate);
+                if (cb->spool == NULL)
+                {
+                        ERROR ("write_http plugin: Opening the spool in "
+                                        "\"%s\" failed.", cb->spool_dir);
+                        wh_callback_free (cb);
+                        return (-1);
+                }
+        }
+
         DEBUG ("write_http: Registering write callback with URL %s",
                         cb->location);
 
@@ -565,7 +1374,8 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
         plugin_register_flush ("write_http", wh_flush, &user_data);
 
         user_data.free_func = wh_callback_free;
-        plugin_register_write ("write_http", wh_write, &user_data);
+        plugin_register_write_batch ("write_http", wh_write_batch,
+                        &user_data);
 
         return (0);
 } /* }}} int wh_config_url */
@@ -43,6 +43,29 @@
 #endif
 #include <mongo.h>
 
+/* Documents waiting to be inserted into one collection. */
+struct wm_batch_s
+{
+  char collection_name[DATA_MAX_NAME_LEN + 16];
+  bson **docs;
+  int docs_num;
+  int docs_size;
+};
+typedef struct wm_batch_s wm_batch_t;
+
+struct wm_conn_s
+{
+  mongo conn[1];
+  pthread_mutex_t lock;
+
+  /* Documents not inserted yet, one batch per collection. */
+  wm_batch_t *batches;
+  size_t batches_num;
+  int docs_num;
+  cdtime_t batch_init_time;
+};
+typedef struct wm_conn_s wm_conn_t;
+
 struct wm_node_s
 {
   char name[DATA_MAX_NAME_LEN];
@@ -53,8 +76,21 @@ struct wm_node_s
 
   _Bool store_rates;
 
-  mongo conn[1];
-  pthread_mutex_t lock;
+  /* Documents are inserted once "batch_size" of them have been collected on
+   * a connection, or the oldest is "batch_timeout" old. */
+  int batch_size;
+  cdtime_t batch_timeout;
+
+  _Bool unacknowledged;
+#if MONGO_MINOR >= 6
+  mongo_write_concern write_concern[1];
+#endif
+
+  /* Write threads use whichever connection is idle. */
+  wm_conn_t *conns;
+  size_t conns_num;
+  size_t conns_next;
+  pthread_mutex_t conns_lock;
 };
 typedef struct wm_node_s wm_node_t;
 
@@ -66,7 +102,7 @@ static bson *wm_create_bson (const data_set_t *ds, /* {{{ */
     _Bool store_rates)
 {
   bson *ret;
-  gauge_t *rates;
+  const gauge_t *rates;
   int i;
 
   ret = bson_create ();
@@ -78,7 +114,7 @@ static bson *wm_create_bson (const data_set_t *ds, /* {{{ */
 
   if (store_rates)
   {
-    rates = uc_get_rate (ds, vl);
+    rates = uc_get_rate_ref (ds, vl);
     if (rates == NULL)
     {
       ERROR ("write_mongodb plugin: uc_get_rate() failed.");
@@ -146,95 +182,301 @@ static bson *wm_create_bson (const data_set_t *ds, /* {{{ */
 
   bson_finish (ret);
 
-  sfree (rates);
+  uc_release_rate_ref (vl, rates);
   return (ret);
 } /* }}} bson *wm_create_bson */
 
-static int wm_write (const data_set_t *ds, /* {{{ */
-    const value_list_t *vl,
-    user_data_t *ud)
+/* Returns a connection with its lock held. Prefers connections which no
+ * other thread is using. */
+static wm_conn_t *wm_conn_acquire (wm_node_t *node) /* {{{ */
 {
-  wm_node_t *node = ud->data;
-  char collection_name[512];
-  bson *bson_record;
-  int status;
+  wm_conn_t *c;
+  size_t start;
+  size_t i;
 
-  ssnprintf (collection_name, sizeof (collection_name), "collectd.%s",
-      vl->plugin);
+  pthread_mutex_lock (&node->conns_lock);
+  start = node->conns_next;
+  node->conns_next = (node->conns_next + 1) % node->conns_num;
+  pthread_mutex_unlock (&node->conns_lock);
 
-  bson_record = wm_create_bson (ds, vl, node->store_rates);
-  if (bson_record == NULL)
-    return (ENOMEM);
+  for (i = 0; i < node->conns_num; i++)
+  {
+    c = node->conns + ((start + i) % node->conns_num);
+    if (pthread_mutex_trylock (&c->lock) == 0)
+      return (c);
+  }
 
-  pthread_mutex_lock (&node->lock);
+  c = node->conns + start;
+  pthread_mutex_lock (&c->lock);
+  return (c);
+} /* }}} wm_conn_t *wm_conn_acquire */
 
-  if (!mongo_is_connected (node->conn))
-  {
-    INFO ("write_mongodb plugin: Connecting to [%s]:%i",
+/* The caller must hold "c->lock". */
+static int wm_connect (wm_node_t *node, wm_conn_t *c) /* {{{ */
+{
+  int status;
+
+  if (mongo_is_connected (c->conn))
+    return (0);
+
+  INFO ("write_mongodb plugin: Connecting to [%s]:%i",
+      (node->host != NULL) ? node->host : "localhost",
+      (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
+  status = mongo_connect (c->conn, node->host, node->port);
+  if (status != MONGO_OK) {
+    ERROR ("write_mongodb plugin: Connecting to [%s]:%i failed.",
         (node->host != NULL) ? node->host : "localhost",
         (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
-    status = mongo_connect (node->conn, node->host, node->port);
-    if (status != MONGO_OK) {
-      ERROR ("write_mongodb plugin: Connecting to [%s]:%i failed.",
-          (node->host != NULL) ? node->host : "localhost",
-          (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
-      mongo_destroy (node->conn);
-      pthread_mutex_unlock (&node->lock);
-      return (-1);
-    }
+    mongo_destroy (c->conn);
+    return (-1);
+  }
 
-    if (node->timeout > 0) {
-      status = mongo_set_op_timeout (node->conn, node->timeout);
-      if (status != MONGO_OK) {
-        WARNING ("write_mongodb plugin: mongo_set_op_timeout(%i) failed: %s",
-            node->timeout, node->conn->errstr);
-      }
+  if (node->timeout > 0) {
+    status = mongo_set_op_timeout (c->conn, node->timeout);
+    if (status != MONGO_OK) {
+      WARNING ("write_mongodb plugin: mongo_set_op_timeout(%i) failed: %s",
+          node->timeout, c->conn->errstr);
     }
   }
 
   /* Assert if the connection has been established */
-  assert (mongo_is_connected (node->conn));
+  assert (mongo_is_connected (c->conn));
+
+  return (0);
+} /* }}} int wm_connect */
+
+static void wm_batch_clear (wm_batch_t *batch) /* {{{ */
+{
+  int i;
+
+  for (i = 0; i < batch->docs_num; i++)
+  {
+    bson_dispose (batch->docs[i]);
+    batch->docs[i] = NULL;
+  }
+  batch->docs_num = 0;
+} /* }}} void wm_batch_clear */
+
+/* The caller must hold "c->lock". */
+static int wm_insert (wm_node_t *node, wm_conn_t *c, /* {{{ */
+    wm_batch_t *batch)
+{
+  int status;
 
   #if MONGO_MINOR >= 6
     /* There was an API change in 0.6.0 as linked below */
     /* https://github.com/mongodb/mongo-c-driver/blob/master/HISTORY.md */
-    status = mongo_insert (node->conn, collection_name, bson_record, NULL);
+    status = mongo_insert_batch (c->conn, batch->collection_name,
+        (const bson **) batch->docs, batch->docs_num,
+        node->unacknowledged ? node->write_concern : NULL, /* flags = */ 0);
   #else
-    status = mongo_insert (node->conn, collection_name, bson_record);
+    status = mongo_insert_batch (c->conn, batch->collection_name,
+        (const bson **) batch->docs, batch->docs_num);
   #endif
 
   if(status != MONGO_OK)
   {
-    ERROR ( "write_mongodb plugin: error inserting record: %d", node->conn->err);
-    if (node->conn->err != MONGO_BSON_INVALID)
-      ERROR ("write_mongodb plugin: %s", node->conn->errstr);
-    else if (bson_record->err)
-      ERROR ("write_mongodb plugin: %s", bson_record->errstr);
+    ERROR ("write_mongodb plugin: error inserting %i records: %d",
+        batch->docs_num, c->conn->err);
+    if (c->conn->err != MONGO_BSON_INVALID)
+      ERROR ("write_mongodb plugin: %s", c->conn->errstr);
 
     /* Disconnect except on data errors. */
-    if ((node->conn->err != MONGO_BSON_INVALID)
-        && (node->conn->err != MONGO_BSON_NOT_FINISHED))
-      mongo_destroy (node->conn);
+    if ((c->conn->err != MONGO_BSON_INVALID)
+        && (c->conn->err != MONGO_BSON_NOT_FINISHED))
+      mongo_destroy (c->conn);
   }
 
-  pthread_mutex_unlock (&node->lock);
+  return ((status == MONGO_OK) ? 0 : -1);
+} /* }}} int wm_insert */
+
+/* Inserts all documents collected on "c". They are dropped if inserting
+ * them fails. The caller must hold "c->lock". */
+static int wm_flush_conn (wm_node_t *node, wm_conn_t *c) /* {{{ */
+{
+  int status = 0;
+  size_t i;
+
+  if (c->docs_num == 0)
+    return (0);
+
+  if (wm_connect (node, c) != 0)
+    status = -1;
+
+  for (i = 0; i < c->batches_num; i++)
+  {
+    wm_batch_t *batch = c->batches + i;
+
+    if (batch->docs_num == 0)
+      continue;
 
-  /* free our resource as not to leak memory */
-  bson_dispose (bson_record);
+    if ((status == 0) && (wm_insert (node, c, batch) != 0))
+      status = -1;
+
+    wm_batch_clear (batch);
+  }
+
+  c->docs_num = 0;
+  return (status);
+} /* }}} int wm_flush_conn */
+
+/* Adds "doc" to the batch of its collection, taking ownership of it. */
+static int wm_batch_add (wm_conn_t *c, /* {{{ */
+    char const *collection_name, bson *doc)
+{
+  wm_batch_t *batch = NULL;
+  size_t i;
+
+  for (i = 0; i < c->batches_num; i++)
+  {
+    if (strcmp (c->batches[i].collection_name, collection_name) == 0)
+    {
+      batch = c->batches + i;
+      break;
+    }
+  }
+
+  if (batch == NULL)
+  {
+    wm_batch_t *tmp;
+
+    tmp = realloc (c->batches, (c->batches_num + 1) * sizeof (*c->batches));
+    if (tmp == NULL)
+      return (ENOMEM);
+    c->batches = tmp;
+
+    batch = c->batches + c->batches_num;
+    memset (batch, 0, sizeof (*batch));
+    sstrncpy (batch->collection_name, collection_name,
+        sizeof (batch->collection_name));
+    c->batches_num++;
+  }
+
+  if (batch->docs_num >= batch->docs_size)
+  {
+    int new_size = (batch->docs_size > 0) ? 2 * batch->docs_size : 16;
+    bson **tmp;
+
+    tmp = realloc (batch->docs, new_size * sizeof (*batch->docs));
+    if (tmp == NULL)
+      return (ENOMEM);
+    batch->docs = tmp;
+    batch->docs_size = new_size;
+  }
+
+  if (c->docs_num == 0)
+    c->batch_init_time = cdtime ();
+
+  batch->docs[batch->docs_num] = doc;
+  batch->docs_num++;
+  c->docs_num++;
 
   return (0);
-} /* }}} int wm_write */
+} /* }}} int wm_batch_add */
+
+static int wm_write_batch (const plugin_write_item_t *items, /* {{{ */
+    size_t items_num, user_data_t *ud)
+{
+  wm_node_t *node = ud->data;
+  wm_conn_t *c;
+  int status = 0;
+  size_t i;
+
+  c = wm_conn_acquire (node);
+
+  for (i = 0; i < items_num; i++)
+  {
+    char collection_name[512];
+    bson *bson_record;
+
+    ssnprintf (collection_name, sizeof (collection_name), "collectd.%s",
+        items[i].vl->plugin);
+
+    bson_record = wm_create_bson (items[i].ds, items[i].vl,
+        node->store_rates);
+    if (bson_record == NULL)
+    {
+      status = ENOMEM;
+      continue;
+    }
+
+    if (wm_batch_add (c, collection_name, bson_record) != 0)
+    {
+      ERROR ("write_mongodb plugin: realloc failed.");
+      bson_dispose (bson_record);
+      status = ENOMEM;
+      continue;
+    }
+
+    if (c->docs_num >= node->batch_size)
+      wm_flush_conn (node, c);
+  }
+
+  if ((c->docs_num > 0)
+      && ((cdtime () - c->batch_init_time) >= node->batch_timeout))
+    wm_flush_conn (node, c);
+
+  pthread_mutex_unlock (&c->lock);
+
+  return (status);
+} /* }}} int wm_write_batch */
+
+static int wm_flush (cdtime_t timeout, /* {{{ */
+    const char __attribute__((unused)) *identifier,
+    user_data_t *ud)
+{
+  wm_node_t *node = ud->data;
+  int status = 0;
+  size_t i;
+
+  for (i = 0; i < node->conns_num; i++)
+  {
+    wm_conn_t *c = node->conns + i;
+
+    pthread_mutex_lock (&c->lock);
+    if ((c->docs_num > 0)
+        && ((timeout == 0) || ((cdtime () - c->batch_init_time) >= timeout)))
+    {
+      if (wm_flush_conn (node, c) != 0)
+        status = -1;
+    }
+    pthread_mutex_unlock (&c->lock);
+  }
+
+  return (status);
+} /* }}} int wm_flush */
 
 static void wm_config_free (void *ptr) /* {{{ */
 {
   wm_node_t *node = ptr;
+  size_t i;
 
   if (node == NULL)
     return;
 
-  if (mongo_is_connected (node->conn))
-    mongo_destroy (node->conn);
+  for (i = 0; i < node->conns_num; i++)
+  {
+    wm_conn_t *c = node->conns + i;
+    size_t j;
+
+    wm_flush_conn (node, c);
+
+    if (mongo_is_connected (c->conn))
+      mongo_destroy (c->conn);
+
+    for (j = 0; j < c->batches_num; j++)
+      sfree (c->batches[j].docs);
+    sfree (c->batches);
+    pthread_mutex_destroy (&c->lock);
+  }
+  sfree (node->conns);
 
+#if MONGO_MINOR >= 6
+  if (node->unacknowledged)
+    mongo_write_concern_destroy (node->write_concern);
+#endif
+
+  pthread_mutex_destroy (&node->conns_lock);
   sfree (node->host);
   sfree (node);
 } /* }}} void wm_config_free */
@@ -242,6 +484,7 @@ static void wm_config_free (void *ptr) /* {{{ */
 static int wm_config_node (oconfig_item_t *ci) /* {{{ */
 {
   wm_node_t *node;
+  _Bool unacknowledged = 0;
   int status;
   int i;
 
@@ -249,16 +492,17 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
   if (node == NULL)
     return (ENOMEM);
   memset (node, 0, sizeof (*node));
-  mongo_init (node->conn);
   node->host = NULL;
   node->store_rates = 1;
-  pthread_mutex_init (&node->lock, /* attr = */ NULL);
+  node->batch_size = 1;
+  node->batch_timeout = plugin_get_interval ();
+  pthread_mutex_init (&node->conns_lock, /* attr = */ NULL);
 
   status = cf_util_get_string_buffer (ci, node->name, sizeof (node->name));
 
   if (status != 0)
   {
-    sfree (node);
+    wm_config_free (node);
     return (status);
   }
 
@@ -281,6 +525,46 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
       status = cf_util_get_int (child, &node->timeout);
     else if (strcasecmp ("StoreRates", child->key) == 0)
       status = cf_util_get_boolean (child, &node->store_rates);
+    else if (strcasecmp ("Connections", child->key) == 0)
+    {
+      int tmp = 0;
+      status = cf_util_get_int (child, &tmp);
+      if ((status == 0) && (tmp < 1))
+      {
+        ERROR ("write_mongodb plugin: \"Connections\" must be at least 1.");
+        status = -1;
+      }
+      if (status == 0)
+        node->conns_num = (size_t) tmp;
+    }
+    else if (strcasecmp ("BatchSize", child->key) == 0)
+    {
+      status = cf_util_get_int (child, &node->batch_size);
+      if ((status == 0) && (node->batch_size < 1))
+      {
+        ERROR ("write_mongodb plugin: \"BatchSize\" must be at least 1.");
+        status = -1;
+      }
+    }
+    else if (strcasecmp ("BatchFlushTimeout", child->key) == 0)
+      status = cf_util_get_cdtime (child, &node->batch_timeout);
+    else if (strcasecmp ("WriteConcern", child->key) == 0)
+    {
+      char tmp[32];
+      status = cf_util_get_string_buffer (child, tmp, sizeof (tmp));
+      if (status != 0)
+        ;
+      else if (strcasecmp ("Acknowledged", tmp) == 0)
+        unacknowledged = 0;
+      else if (strcasecmp ("Unacknowledged", tmp) == 0)
+        unacknowledged = 1;
+      else
+      {
+        ERROR ("write_mongodb plugin: Invalid \"WriteConcern\" \"%s\". "
+            "Valid values are \"Acknowledged\" and \"Unacknowledged\".", tmp);
+        status = -1;
+      }
+    }
     else
       WARNING ("write_mongodb plugin: Ignoring unknown config option \"%s\".",
           child->key);
@@ -289,6 +573,39 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
       break;
   } /* for (i = 0; i < ci->children_num; i++) */
 
+  if (status == 0)
+  {
+    if (node->conns_num == 0)
+      node->conns_num = 1;
+
+    node->conns = calloc (node->conns_num, sizeof (*node->conns));
+    if (node->conns == NULL)
+    {
+      ERROR ("write_mongodb plugin: calloc failed.");
+      node->conns_num = 0;
+      status = ENOMEM;
+    }
+
+    for (i = 0; i < (int) node->conns_num; i++)
+    {
+      mongo_init (node->conns[i].conn);
+      pthread_mutex_init (&node->conns[i].lock, /* attr = */ NULL);
+    }
+  }
+
+  if ((status == 0) && unacknowledged)
+  {
+#if MONGO_MINOR >= 6
+    mongo_write_concern_init (node->write_concern);
+    node->write_concern->w = 0;
+    mongo_write_concern_finish (node->write_concern);
+    node->unacknowledged = 1;
+#else
+    WARNING ("write_mongodb plugin: Unacknowledged writes need version 0.6 "
+        "or later of the MongoDB C driver. Using the default write concern.");
+#endif
+  }
+
   if (status == 0)
   {
     char cb_name[DATA_MAX_NAME_LEN];
@@ -298,9 +615,14 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
 
     ud.data = node;
     ud.free_func = wm_config_free;
-
-    status = plugin_register_write (cb_name, wm_write, &ud);
+    status = plugin_register_write_batch (cb_name, wm_write_batch, &ud);
     INFO ("write_mongodb plugin: registered write plugin %s %d",cb_name,status);
+
+    if (status == 0)
+    {
+      ud.free_func = NULL;
+      plugin_register_flush (cb_name, wm_flush, &ud);
+    }
   }
 
   if (status != 0)
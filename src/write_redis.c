@@ -28,10 +28,23 @@
 #include "plugin.h"
 #include "common.h"
 #include "configfile.h"
+#include "utils_htable.h"
+#include "utils_complain.h"
 
 #include <pthread.h>
-#include <credis.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
 
+#define REDIS_DEFAULT_PORT "6379"
+/* Default number of commands which may be waiting for their reply. */
+#define WR_MAX_PENDING 4096
+
+/*
+ * The plugin speaks the Redis protocol itself, so that commands can be
+ * pipelined: they are collected in "send_buffer", sent in one go, and the
+ * replies are read as they arrive instead of after each command.
+ */
 struct wr_node_s
 {
   char name[DATA_MAX_NAME_LEN];
@@ -40,7 +53,30 @@ struct wr_node_s
   int port;
   int timeout;
 
-  REDIS conn;
+  /* Commands are sent once "batch_size" value lists are queued or the oldest
+   * of them is "batch_timeout" old. */
+  int batch_size;
+  cdtime_t batch_timeout;
+  int max_pending;
+
+  int fd;
+  char *send_buffer;
+  size_t send_buffer_fill;
+  size_t send_buffer_size;
+  int send_buffer_commands;
+  int send_buffer_values;
+  cdtime_t send_buffer_init_time;
+
+  /* Commands sent whose reply hasn't been read yet. */
+  int pending;
+  char recv_buffer[4096];
+  size_t recv_fill;
+
+  /* Identifiers which have been added to "collectd/values" on this
+   * connection, so the SADD can be skipped. */
+  c_htable_t *known_values;
+
+  c_complain_t complaint;
   pthread_mutex_t lock;
 };
 typedef struct wr_node_s wr_node_t;
@@ -48,30 +84,343 @@ typedef struct wr_node_s wr_node_t;
 /*
  * Functions
  */
-static int wr_write (const data_set_t *ds, /* {{{ */
-    const value_list_t *vl,
-    user_data_t *ud)
+static void wr_known_values_clear (wr_node_t *node) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  if (node->known_values == NULL)
+    return;
+
+  while (c_htable_pick (node->known_values, &key, &value) == 0)
+    sfree (key);
+} /* }}} void wr_known_values_clear */
+
+/* The caller must hold "node->lock". */
+static void wr_disconnect (wr_node_t *node) /* {{{ */
+{
+  if (node->fd < 0)
+    return;
+
+  close (node->fd);
+  node->fd = -1;
+
+  /* Replies for the old connection won't arrive anymore, and the server may
+   * have been restarted without its data. */
+  node->pending = 0;
+  node->recv_fill = 0;
+  wr_known_values_clear (node);
+} /* }}} void wr_disconnect */
+
+/* The caller must hold "node->lock". */
+static int wr_connect (wr_node_t *node) /* {{{ */
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_ptr;
+  char const *host;
+  char port[16];
+  int status;
+
+  if (node->fd >= 0)
+    return (0);
+
+  host = (node->host != NULL) ? node->host : "localhost";
+  if (node->port > 0)
+    ssnprintf (port, sizeof (port), "%i", node->port);
+  else
+    sstrncpy (port, REDIS_DEFAULT_PORT, sizeof (port));
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  ai_list = NULL;
+  status = getaddrinfo (host, port, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    c_complain (LOG_ERR, &node->complaint, "write_redis plugin: "
+        "Resolving host \"%s\" failed: %s", host, gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    node->fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        ai_ptr->ai_protocol);
+    if (node->fd < 0)
+      continue;
+
+    if (connect (node->fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) != 0)
+    {
+      close (node->fd);
+      node->fd = -1;
+      continue;
+    }
+
+    break;
+  }
+  freeaddrinfo (ai_list);
+
+  if (node->fd < 0)
+  {
+    c_complain (LOG_ERR, &node->complaint, "write_redis plugin: "
+        "Connecting to host \"%s\" (port %s) failed.", host, port);
+    return (-1);
+  }
+
+  c_release (LOG_INFO, &node->complaint, "write_redis plugin: "
+      "Connected to host \"%s\" (port %s).", host, port);
+  return (0);
+} /* }}} int wr_connect */
+
+static int wr_buffer_add (wr_node_t *node, /* {{{ */
+    char const *data, size_t data_len)
+{
+  if ((node->send_buffer_fill + data_len) > node->send_buffer_size)
+  {
+    size_t new_size = (node->send_buffer_size > 0)
+      ? node->send_buffer_size : 4096;
+    char *tmp;
+
+    while (new_size < (node->send_buffer_fill + data_len))
+      new_size *= 2;
+
+    tmp = realloc (node->send_buffer, new_size);
+    if (tmp == NULL)
+      return (ENOMEM);
+    node->send_buffer = tmp;
+    node->send_buffer_size = new_size;
+  }
+
+  memcpy (node->send_buffer + node->send_buffer_fill, data, data_len);
+  node->send_buffer_fill += data_len;
+  return (0);
+} /* }}} int wr_buffer_add */
+
+/* Appends a command in the Redis protocol to the send buffer. The buffer is
+ * restored if this fails. */
+static int wr_queue_command (wr_node_t *node, /* {{{ */
+    int argc, char const **argv)
+{
+  size_t fill = node->send_buffer_fill;
+  char header[32];
+  int status;
+  int i;
+
+  ssnprintf (header, sizeof (header), "*%i\r\n", argc);
+  status = wr_buffer_add (node, header, strlen (header));
+
+  for (i = 0; (i < argc) && (status == 0); i++)
+  {
+    size_t len = strlen (argv[i]);
+
+    ssnprintf (header, sizeof (header), "$%zu\r\n", len);
+    status = wr_buffer_add (node, header, strlen (header));
+    if (status == 0)
+      status = wr_buffer_add (node, argv[i], len);
+    if (status == 0)
+      status = wr_buffer_add (node, "\r\n", 2);
+  }
+
+  if (status != 0)
+  {
+    ERROR ("write_redis plugin: realloc failed.");
+    node->send_buffer_fill = fill;
+    return (status);
+  }
+
+  node->send_buffer_commands++;
+  return (0);
+} /* }}} int wr_queue_command */
+
+/* Handles the complete replies in the receive buffer. Returns non-zero if
+ * the stream cannot be parsed. */
+static int wr_handle_replies (wr_node_t *node) /* {{{ */
+{
+  size_t offset = 0;
+
+  while (offset < node->recv_fill)
+  {
+    char *line = node->recv_buffer + offset;
+    size_t avail = node->recv_fill - offset;
+    char *end;
+    size_t reply_len;
+
+    end = memchr (line, '\n', avail);
+    if (end == NULL)
+      break;
+    reply_len = (size_t) (end - line) + 1;
+
+    if ((reply_len < 3) || (end[-1] != '\r'))
+      return (-1);
+
+    if (line[0] == '$')
+    {
+      long bulk_len = strtol (line + 1, NULL, 10);
+
+      if (bulk_len >= 0)
+        reply_len += (size_t) bulk_len + 2;
+      if (reply_len > avail)
+        break;
+    }
+    else if (line[0] == '-')
+    {
+      end[-1] = 0;
+      ERROR ("write_redis plugin: Redis returned an error: %s", line + 1);
+    }
+    else if ((line[0] != '+') && (line[0] != ':'))
+      /* None of the commands used returns anything else. */
+      return (-1);
+
+    offset += reply_len;
+    if (node->pending > 0)
+      node->pending--;
+  }
+
+  if (offset > 0)
+  {
+    memmove (node->recv_buffer, node->recv_buffer + offset,
+        node->recv_fill - offset);
+    node->recv_fill -= offset;
+  }
+  else if (node->recv_fill >= sizeof (node->recv_buffer))
+    /* A single reply doesn't fit into the buffer. */
+    return (-1);
+
+  return (0);
+} /* }}} int wr_handle_replies */
+
+/* Reads the replies which have arrived. Waits for them while more than
+ * "max_pending" commands are outstanding. The caller must hold
+ * "node->lock". */
+static int wr_read_replies (wr_node_t *node) /* {{{ */
+{
+  while (node->pending > 0)
+  {
+    _Bool wait = (node->pending > node->max_pending);
+    ssize_t status;
+
+    if (wait)
+    {
+      struct pollfd pfd = { node->fd, POLLIN, 0 };
+
+      status = poll (&pfd, 1, (node->timeout > 0) ? node->timeout : -1);
+      if (status == 0)
+      {
+        ERROR ("write_redis plugin: Timed out waiting for replies from "
+            "Redis.");
+        wr_disconnect (node);
+        return (-1);
+      }
+      else if ((status < 0) && (errno == EINTR))
+        continue;
+    }
+
+    status = recv (node->fd, node->recv_buffer + node->recv_fill,
+        sizeof (node->recv_buffer) - node->recv_fill,
+        wait ? 0 : MSG_DONTWAIT);
+    if (status < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+      if (!wait && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        return (0);
+
+      ERROR ("write_redis plugin: Receiving from Redis failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      wr_disconnect (node);
+      return (-1);
+    }
+    else if (status == 0)
+    {
+      ERROR ("write_redis plugin: Redis closed the connection.");
+      wr_disconnect (node);
+      return (-1);
+    }
+
+    node->recv_fill += (size_t) status;
+    if (wr_handle_replies (node) != 0)
+    {
+      ERROR ("write_redis plugin: Unable to parse the replies from Redis.");
+      wr_disconnect (node);
+      return (-1);
+    }
+  }
+
+  return (0);
+} /* }}} int wr_read_replies */
+
+/* Sends the queued commands. They are dropped if that fails. The caller must
+ * hold "node->lock". */
+static int wr_flush_nolock (wr_node_t *node) /* {{{ */
+{
+  int status;
+
+  if (node->send_buffer_fill == 0)
+    return (0);
+
+  status = wr_connect (node);
+  if (status == 0)
+  {
+    status = (int) swrite (node->fd, node->send_buffer,
+        node->send_buffer_fill);
+    if (status != 0)
+    {
+      char errbuf[1024];
+
+      ERROR ("write_redis plugin: Sending to Redis failed: %s",
+          sstrerror (errno, errbuf, sizeof (errbuf)));
+      wr_disconnect (node);
+    }
+    else
+      node->pending += node->send_buffer_commands;
+  }
+
+  node->send_buffer_fill = 0;
+  node->send_buffer_commands = 0;
+  node->send_buffer_values = 0;
+
+  if (status != 0)
+    return (status);
+
+  return (wr_read_replies (node));
+} /* }}} int wr_flush_nolock */
+
+/* The caller must hold "node->lock". */
+static int wr_queue_value_list (wr_node_t *node, /* {{{ */
+    const data_set_t *ds, const value_list_t *vl)
 {
-  wr_node_t *node = ud->data;
   char ident[512];
   char key[512];
+  char score[64];
   char value[512];
+  char const *argv[4];
   size_t value_size;
   char *value_ptr;
   int status;
   int i;
 
-  status = FORMAT_VL (ident, sizeof (ident), vl);
-  if (status != 0)
-    return (status);
+  if (vl->identity != NULL)
+    sstrncpy (ident, vl->identity, sizeof (ident));
+  else
+  {
+    status = FORMAT_VL (ident, sizeof (ident), vl);
+    if (status != 0)
+      return (status);
+  }
   ssnprintf (key, sizeof (key), "collectd/%s", ident);
 
   memset (value, 0, sizeof (value));
   value_size = sizeof (value);
   value_ptr = &value[0];
 
-#define APPEND(...) do {                                             \
-  status = snprintf (value_ptr, value_size, __VA_ARGS__);            \
+#define ADVANCE() do {                                               \
   if (((size_t) status) > value_size)                                \
   {                                                                  \
     value_ptr += value_size;                                         \
@@ -84,13 +433,23 @@ static int wr_write (const data_set_t *ds, /* {{{ */
   }                                                                  \
 } while (0)
 
+#define APPEND(...) do {                                             \
+  status = snprintf (value_ptr, value_size, __VA_ARGS__);            \
+  ADVANCE ();                                                        \
+} while (0)
+
+#define APPEND_GAUGE(value) do {                                     \
+  status = format_gauge (value_ptr, value_size, "%g", (value));      \
+  ADVANCE ();                                                        \
+} while (0)
+
   APPEND ("%lu", (unsigned long) vl->time);
   for (i = 0; i < ds->ds_num; i++)
   {
     if (ds->ds[i].type == DS_TYPE_COUNTER)
       APPEND ("%llu", vl->values[i].counter);
     else if (ds->ds[i].type == DS_TYPE_GAUGE)
-      APPEND ("%g", vl->values[i].gauge);
+      APPEND_GAUGE (vl->values[i].gauge);
     else if (ds->ds[i].type == DS_TYPE_DERIVE)
       APPEND ("%"PRIi64, vl->values[i].derive);
     else if (ds->ds[i].type == DS_TYPE_ABSOLUTE)
@@ -99,34 +458,99 @@ static int wr_write (const data_set_t *ds, /* {{{ */
       assert (23 == 42);
   }
 
+#undef APPEND_GAUGE
 #undef APPEND
+#undef ADVANCE
+
+  /* Same score as credis_zadd() used to send. */
+  ssnprintf (score, sizeof (score), "%f", (double) vl->time);
+
+  argv[0] = "ZADD";
+  argv[1] = key;
+  argv[2] = score;
+  argv[3] = value;
+  status = wr_queue_command (node, 4, argv);
+  if (status != 0)
+    return (status);
+
+  if (c_htable_get (node->known_values, ident, NULL) != 0)
+  {
+    char *ident_copy;
+
+    argv[0] = "SADD";
+    argv[1] = "collectd/values";
+    argv[2] = ident;
+    status = wr_queue_command (node, 3, argv);
+    if (status != 0)
+      return (status);
+
+    ident_copy = strdup (ident);
+    if ((ident_copy != NULL)
+        && (c_htable_insert (node->known_values, ident_copy, NULL) != 0))
+      sfree (ident_copy);
+  }
+
+  if (node->send_buffer_values == 0)
+    node->send_buffer_init_time = cdtime ();
+  node->send_buffer_values++;
+
+  return (0);
+} /* }}} int wr_queue_value_list */
+
+static int wr_write_batch (const plugin_write_item_t *items, /* {{{ */
+    size_t items_num, user_data_t *ud)
+{
+  wr_node_t *node = ud->data;
+  int status = 0;
+  size_t i;
 
   pthread_mutex_lock (&node->lock);
 
-  if (node->conn == NULL)
+  for (i = 0; i < items_num; i++)
   {
-    node->conn = credis_connect (node->host, node->port, node->timeout);
-    if (node->conn == NULL)
+    int tmp;
+
+    tmp = wr_queue_value_list (node, items[i].ds, items[i].vl);
+    if (tmp != 0)
+      status = tmp;
+
+    if (node->send_buffer_values >= node->batch_size)
     {
-      ERROR ("write_redis plugin: Connecting to host \"%s\" (port %i) failed.",
-          (node->host != NULL) ? node->host : "localhost",
-          (node->port != 0) ? node->port : 6379);
-      pthread_mutex_unlock (&node->lock);
-      return (-1);
+      tmp = wr_flush_nolock (node);
+      if (tmp != 0)
+        status = tmp;
     }
   }
 
-  /* "credis_zadd" doesn't handle a NULL pointer gracefully, so I'd rather
-   * have a meaningful assertion message than a normal segmentation fault. */
-  assert (node->conn != NULL);
-  status = credis_zadd (node->conn, key, (double) vl->time, value);
+  if ((node->send_buffer_values > 0)
+      && ((cdtime () - node->send_buffer_init_time) >= node->batch_timeout))
+  {
+    int tmp = wr_flush_nolock (node);
+    if (tmp != 0)
+      status = tmp;
+  }
+
+  pthread_mutex_unlock (&node->lock);
+
+  return (status);
+} /* }}} int wr_write_batch */
 
-  credis_sadd (node->conn, "collectd/values", ident);
+static int wr_flush (cdtime_t timeout, /* {{{ */
+    const char __attribute__((unused)) *identifier,
+    user_data_t *ud)
+{
+  wr_node_t *node = ud->data;
+  int status = 0;
 
+  pthread_mutex_lock (&node->lock);
+  if ((node->send_buffer_values > 0)
+      && ((timeout == 0)
+        || ((cdtime () - node->send_buffer_init_time) >= timeout)))
+    status = wr_flush_nolock (node);
   pthread_mutex_unlock (&node->lock);
 
-  return (0);
-} /* }}} int wr_write */
+  return (status);
+} /* }}} int wr_flush */
 
 static void wr_config_free (void *ptr) /* {{{ */
 {
@@ -135,13 +559,18 @@ static void wr_config_free (void *ptr) /* {{{ */
   if (node == NULL)
     return;
 
-  if (node->conn != NULL)
+  wr_flush_nolock (node);
+  wr_disconnect (node);
+
+  if (node->known_values != NULL)
   {
-    credis_close (node->conn);
-    node->conn = NULL;
+    wr_known_values_clear (node);
+    c_htable_destroy (node->known_values);
   }
 
+  sfree (node->send_buffer);
   sfree (node->host);
+  pthread_mutex_destroy (&node->lock);
   sfree (node);
 } /* }}} void wr_config_free */
 
@@ -158,13 +587,24 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
   node->host = NULL;
   node->port = 0;
   node->timeout = 1000;
-  node->conn = NULL;
+  node->batch_size = 1;
+  node->batch_timeout = plugin_get_interval ();
+  node->max_pending = WR_MAX_PENDING;
+  node->fd = -1;
+  C_COMPLAIN_INIT (&node->complaint);
   pthread_mutex_init (&node->lock, /* attr = */ NULL);
 
+  node->known_values = c_htable_create ();
+  if (node->known_values == NULL)
+  {
+    wr_config_free (node);
+    return (ENOMEM);
+  }
+
   status = cf_util_get_string_buffer (ci, node->name, sizeof (node->name));
   if (status != 0)
   {
-    sfree (node);
+    wr_config_free (node);
     return (status);
   }
 
@@ -185,6 +625,26 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
     }
     else if (strcasecmp ("Timeout", child->key) == 0)
       status = cf_util_get_int (child, &node->timeout);
+    else if (strcasecmp ("BatchSize", child->key) == 0)
+    {
+      status = cf_util_get_int (child, &node->batch_size);
+      if ((status == 0) && (node->batch_size < 1))
+      {
+        ERROR ("write_redis plugin: \"BatchSize\" must be at least 1.");
+        status = -1;
+      }
+    }
+    else if (strcasecmp ("BatchFlushTimeout", child->key) == 0)
+      status = cf_util_get_cdtime (child, &node->batch_timeout);
+    else if (strcasecmp ("MaxPending", child->key) == 0)
+    {
+      status = cf_util_get_int (child, &node->max_pending);
+      if ((status == 0) && (node->max_pending < 0))
+      {
+        ERROR ("write_redis plugin: \"MaxPending\" must not be negative.");
+        status = -1;
+      }
+    }
     else
       WARNING ("write_redis plugin: Ignoring unknown config option \"%s\".",
           child->key);
@@ -203,7 +663,12 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
     ud.data = node;
     ud.free_func = wr_config_free;
 
-    status = plugin_register_write (cb_name, wr_write, &ud);
+    status = plugin_register_write_batch (cb_name, wr_write_batch, &ud);
+    if (status == 0)
+    {
+      ud.free_func = NULL;
+      plugin_register_flush (cb_name, wr_flush, &ud);
+    }
   }
 
   if (status != 0)
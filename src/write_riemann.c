@@ -26,6 +26,7 @@
 #include "common.h"
 #include "configfile.h"
 #include "utils_cache.h"
+#include "utils_resolve.h"
 #include "riemann.pb-c.h"
 
 #include <sys/socket.h>
@@ -34,13 +35,47 @@
 #include <netdb.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <poll.h>
 
 #define RIEMANN_HOST		"localhost"
 #define RIEMANN_PORT		"5555"
 
+/* Default upper bound for the size of a batched message, in bytes. */
+#define RIEMANN_BATCH_MAX	8192
+/* Default number of TCP messages which may be waiting for their
+ * acknowledgement. */
+#define RIEMANN_MAX_OUTSTANDING	16
+/* How long to wait for an acknowledgement before giving up on the
+ * connection, in milliseconds. */
+#define RIEMANN_ACK_TIMEOUT	5000
+#define RIEMANN_ARENA_BLOCK_SIZE 16384
+
+/*
+ * All protobuf structures of the message being built are allocated from an
+ * arena. It's emptied, but not freed, once the message has been sent, so
+ * building events doesn't need a malloc(3) and free(3) per string.
+ */
+struct riemann_arena_block_s;
+typedef struct riemann_arena_block_s riemann_arena_block_t;
+struct riemann_arena_block_s {
+	riemann_arena_block_t	*next;
+	size_t			 size;
+	size_t			 used;
+	/* Followed by "size" bytes of memory. */
+};
+
+struct riemann_arena_s {
+	riemann_arena_block_t	*head;
+	riemann_arena_block_t	*tail;
+	riemann_arena_block_t	*current;
+};
+typedef struct riemann_arena_s riemann_arena_t;
+
 struct riemann_host {
 	char			*name;
 #define F_CONNECT		 0x01
+/* Set once the first connection waited for the name to be looked up. */
+#define F_RESOLVED		 0x02
 	uint8_t			 flags;
 	pthread_mutex_t		 lock;
 	_Bool			 store_rates;
@@ -50,15 +85,38 @@ struct riemann_host {
 	_Bool			 use_tcp;
 	int			 s;
 
+	/* Events are collected in one message until it reaches "batch_max"
+	 * bytes or is older than "batch_timeout". TCP only. */
+	_Bool			 batch_mode;
+	size_t			 batch_max;
+	cdtime_t		 batch_timeout;
+
+	riemann_arena_t		 arena;
+	Event			**batch_events;
+	size_t			 batch_events_num;
+	size_t			 batch_events_size;
+	size_t			 batch_size;
+	cdtime_t		 batch_init_time;
+
+	uint8_t			*send_buffer;
+	size_t			 send_buffer_size;
+
+	/* Messages sent via TCP which haven't been acknowledged yet and the
+	 * partially received acknowledgements. */
+	int			 max_outstanding;
+	int			 outstanding;
+	uint8_t			 recv_buffer[4096];
+	size_t			 recv_fill;
+
 	int			 reference_count;
 };
 
 static char	**riemann_tags;
 static size_t	  riemann_tags_num;
 
-static int	riemann_send(struct riemann_host *, Msg const *);
 static int	riemann_notification(const notification_t *, user_data_t *);
-static int	riemann_write(const data_set_t *, const value_list_t *, user_data_t *);
+static int	riemann_write_batch(const plugin_write_item_t *, size_t, user_data_t *);
+static int	riemann_flush(cdtime_t, const char *, user_data_t *);
 static int	riemann_connect(struct riemann_host *);
 static int	riemann_disconnect (struct riemann_host *host);
 static void	riemann_free(void *);
@@ -66,161 +124,412 @@ static int	riemann_config_node(oconfig_item_t *);
 static int	riemann_config(oconfig_item_t *);
 void	module_register(void);
 
-static void riemann_event_protobuf_free (Event *event) /* {{{ */
+static void *riemann_arena_alloc (riemann_arena_t *arena, /* {{{ */
+		size_t size)
 {
-	if (event == NULL)
-		return;
+	riemann_arena_block_t *block;
+	void *ptr;
+
+	/* Keep everything aligned for the 64 bit members of the events. */
+	size = (size + 7) & ~((size_t) 7);
+
+	block = arena->current;
+	while ((block != NULL) && ((block->size - block->used) < size))
+		block = block->next;
+
+	if (block == NULL)
+	{
+		size_t block_size = (size > RIEMANN_ARENA_BLOCK_SIZE)
+			? size : RIEMANN_ARENA_BLOCK_SIZE;
+
+		block = malloc (sizeof (*block) + block_size);
+		if (block == NULL)
+		{
+			ERROR ("write_riemann plugin: malloc failed.");
+			return (NULL);
+		}
+		block->next = NULL;
+		block->size = block_size;
+		block->used = 0;
 
-	sfree (event->state);
-	sfree (event->service);
-	sfree (event->host);
-	sfree (event->description);
+		if (arena->tail == NULL)
+			arena->head = block;
+		else
+			arena->tail->next = block;
+		arena->tail = block;
+	}
+
+	arena->current = block;
+	ptr = ((char *) (block + 1)) + block->used;
+	block->used += size;
+
+	return (ptr);
+} /* }}} void *riemann_arena_alloc */
+
+static char *riemann_arena_strdup (riemann_arena_t *arena, /* {{{ */
+		char const *string)
+{
+	size_t len = strlen (string) + 1;
+	char *ret;
+
+	ret = riemann_arena_alloc (arena, len);
+	if (ret != NULL)
+		memcpy (ret, string, len);
+
+	return (ret);
+} /* }}} char *riemann_arena_strdup */
+
+static void riemann_arena_reset (riemann_arena_t *arena) /* {{{ */
+{
+	riemann_arena_block_t *block;
+
+	for (block = arena->head; block != NULL; block = block->next)
+		block->used = 0;
+	arena->current = arena->head;
+} /* }}} void riemann_arena_reset */
+
+static void riemann_arena_free (riemann_arena_t *arena) /* {{{ */
+{
+	riemann_arena_block_t *block;
+
+	block = arena->head;
+	while (block != NULL)
+	{
+		riemann_arena_block_t *next = block->next;
+		sfree (block);
+		block = next;
+	}
 
-	strarray_free (event->tags, event->n_tags);
-	event->tags = NULL;
+	arena->head = NULL;
+	arena->tail = NULL;
+	arena->current = NULL;
+} /* }}} void riemann_arena_free */
+
+/* Creates an event with room for "tags_max" tags in the arena. */
+static Event *riemann_event_create (riemann_arena_t *arena, /* {{{ */
+		size_t tags_max)
+{
+	Event *event;
+
+	event = riemann_arena_alloc (arena, sizeof (*event));
+	if (event == NULL)
+		return (NULL);
+	memset (event, 0, sizeof (*event));
+	event__init (event);
+
+	event->tags = riemann_arena_alloc (arena,
+			tags_max * sizeof (*event->tags));
+	if (event->tags == NULL)
+		return (NULL);
 	event->n_tags = 0;
 
-	sfree (event);
-} /* }}} void riemann_event_protobuf_free */
+	return (event);
+} /* }}} Event *riemann_event_create */
 
-static void riemann_msg_protobuf_free (Msg *msg) /* {{{ */
+static int riemann_event_add_tag (riemann_arena_t *arena, /* {{{ */
+		Event *event, char const *format, ...)
+{
+	va_list ap;
+	char buffer[1024];
+	size_t ret;
+	char *tag;
+
+	va_start (ap, format);
+	ret = vsnprintf (buffer, sizeof (buffer), format, ap);
+	if (ret >= sizeof (buffer))
+		ret = sizeof (buffer) - 1;
+	buffer[ret] = 0;
+	va_end (ap);
+
+	tag = riemann_arena_strdup (arena, buffer);
+	if (tag == NULL)
+		return (ENOMEM);
+
+	event->tags[event->n_tags] = tag;
+	event->n_tags++;
+	return (0);
+} /* }}} int riemann_event_add_tag */
+
+/* The tags configured with the "Tag" option aren't copied, they live until
+ * the plugin is unloaded. */
+static void riemann_event_add_global_tags (Event *event) /* {{{ */
 {
 	size_t i;
 
-	if (msg == NULL)
-		return;
+	for (i = 0; i < riemann_tags_num; i++)
+	{
+		event->tags[event->n_tags] = riemann_tags[i];
+		event->n_tags++;
+	}
+} /* }}} void riemann_event_add_global_tags */
 
-	for (i = 0; i < msg->n_events; i++)
+static size_t riemann_varint_size (size_t value) /* {{{ */
+{
+	size_t size = 1;
+
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		size++;
+	}
+
+	return (size);
+} /* }}} size_t riemann_varint_size */
+
+/* Appends "event" to the message being batched. "host->lock" must be held. */
+static int riemann_batch_add (struct riemann_host *host, /* {{{ */
+		Event *event)
+{
+	size_t event_size;
+
+	if (host->batch_events_num >= host->batch_events_size)
 	{
-		riemann_event_protobuf_free (msg->events[i]);
-		msg->events[i] = NULL;
+		size_t new_size = (host->batch_events_size > 0)
+			? 2 * host->batch_events_size : 64;
+		Event **tmp;
+
+		tmp = realloc (host->batch_events,
+				new_size * sizeof (*host->batch_events));
+		if (tmp == NULL)
+		{
+			ERROR ("write_riemann plugin: realloc failed.");
+			return (ENOMEM);
+		}
+		host->batch_events = tmp;
+		host->batch_events_size = new_size;
 	}
 
-	sfree (msg->events);
-	msg->n_events = 0;
+	if (host->batch_events_num == 0)
+		host->batch_init_time = cdtime ();
+
+	/* Size of the "events" field: tag, length and the event itself. */
+	event_size = event__get_packed_size (event);
+	host->batch_size += 1 + riemann_varint_size (event_size) + event_size;
+
+	host->batch_events[host->batch_events_num] = event;
+	host->batch_events_num++;
+
+	return (0);
+} /* }}} int riemann_batch_add */
+
+static void riemann_batch_reset (struct riemann_host *host) /* {{{ */
+{
+	host->batch_events_num = 0;
+	host->batch_size = 0;
+	riemann_arena_reset (&host->arena);
+} /* }}} void riemann_batch_reset */
+
+/* Handles the acknowledgements in the receive buffer. Returns non-zero if
+ * the stream cannot be parsed. "host->lock" must be held. */
+static int riemann_handle_acks (struct riemann_host *host) /* {{{ */
+{
+	size_t offset = 0;
+
+	while ((host->recv_fill - offset) >= 4)
+	{
+		uint32_t length;
+		Msg *msg;
+
+		memcpy (&length, host->recv_buffer + offset, 4);
+		length = ntohl (length);
+		if (length > (sizeof (host->recv_buffer) - 4))
+		{
+			ERROR ("write_riemann plugin: Received a response of "
+					"%"PRIu32" bytes from Riemann, which is "
+					"more than expected.", length);
+			return (-1);
+		}
+
+		if ((host->recv_fill - offset) < (4 + length))
+			break;
 
-	sfree (msg);
-} /* }}} void riemann_msg_protobuf_free */
+		msg = msg__unpack (NULL, length,
+				host->recv_buffer + offset + 4);
+		if (msg == NULL)
+		{
+			ERROR ("write_riemann plugin: Parsing the response "
+					"from Riemann failed.");
+			return (-1);
+		}
+
+		if (msg->has_ok && !msg->ok)
+			ERROR ("write_riemann plugin: Riemann rejected a "
+					"message: %s",
+					(msg->error != NULL) ? msg->error : "unknown error");
+		msg__free_unpacked (msg, NULL);
+
+		offset += 4 + length;
+		if (host->outstanding > 0)
+			host->outstanding--;
+	}
+
+	if (offset > 0)
+	{
+		memmove (host->recv_buffer, host->recv_buffer + offset,
+				host->recv_fill - offset);
+		host->recv_fill -= offset;
+	}
 
+	return (0);
+} /* }}} int riemann_handle_acks */
+
+/* Reads the acknowledgements which have arrived. Waits for them while too
+ * many messages are outstanding. "host->lock" must be held. */
+static int riemann_read_acks (struct riemann_host *host) /* {{{ */
+{
+	while (host->outstanding > 0)
+	{
+		_Bool wait = (host->outstanding >= host->max_outstanding);
+		ssize_t status;
+
+		if (wait)
+		{
+			struct pollfd pfd = { host->s, POLLIN, 0 };
+
+			status = poll (&pfd, 1, RIEMANN_ACK_TIMEOUT);
+			if (status == 0)
+			{
+				ERROR ("write_riemann plugin: Timed out waiting "
+						"for an acknowledgement from Riemann.");
+				riemann_disconnect (host);
+				return (-1);
+			}
+			else if ((status < 0) && (errno == EINTR))
+				continue;
+		}
+
+		status = recv (host->s, host->recv_buffer + host->recv_fill,
+				sizeof (host->recv_buffer) - host->recv_fill,
+				wait ? 0 : MSG_DONTWAIT);
+		if (status < 0)
+		{
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			if (!wait && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				return (0);
+
+			ERROR ("write_riemann plugin: Receiving from Riemann "
+					"failed: %s",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			riemann_disconnect (host);
+			return (-1);
+		}
+		else if (status == 0)
+		{
+			ERROR ("write_riemann plugin: Riemann closed the "
+					"connection.");
+			riemann_disconnect (host);
+			return (-1);
+		}
+
+		host->recv_fill += (size_t) status;
+		if (riemann_handle_acks (host) != 0)
+		{
+			riemann_disconnect (host);
+			return (-1);
+		}
+	}
+
+	return (0);
+} /* }}} int riemann_read_acks */
+
+/* "host->lock" must be held when calling this function. */
 static int
 riemann_send(struct riemann_host *host, Msg const *msg)
 {
-	u_char *buffer;
 	size_t  buffer_len;
+	size_t  header_len = host->use_tcp ? 4 : 0;
 	int status;
 
-	pthread_mutex_lock (&host->lock);
-
 	status = riemann_connect (host);
 	if (status != 0)
-	{
-		pthread_mutex_unlock (&host->lock);
 		return status;
-	}
 
-	buffer_len = msg__get_packed_size(msg);
-	if (host->use_tcp)
-		buffer_len += 4;
+	buffer_len = header_len + msg__get_packed_size(msg);
+	if (buffer_len > host->send_buffer_size)
+	{
+		uint8_t *tmp;
 
-	buffer = malloc (buffer_len);
-	if (buffer == NULL) {
-		pthread_mutex_unlock (&host->lock);
-		ERROR ("write_riemann plugin: malloc failed.");
-		return ENOMEM;
+		tmp = realloc (host->send_buffer, buffer_len);
+		if (tmp == NULL) {
+			ERROR ("write_riemann plugin: realloc failed.");
+			return ENOMEM;
+		}
+		host->send_buffer = tmp;
+		host->send_buffer_size = buffer_len;
 	}
-	memset (buffer, 0, buffer_len);
 
 	if (host->use_tcp)
 	{
 		uint32_t length = htonl ((uint32_t) (buffer_len - 4));
-		memcpy (buffer, &length, 4);
-		msg__pack(msg, buffer + 4);
-	}
-	else
-	{
-		msg__pack(msg, buffer);
+		memcpy (host->send_buffer, &length, 4);
 	}
+	msg__pack(msg, host->send_buffer + header_len);
 
-	status = (int) swrite (host->s, buffer, buffer_len);
+	status = (int) swrite (host->s, host->send_buffer, buffer_len);
 	if (status != 0)
 	{
 		char errbuf[1024];
 
 		riemann_disconnect (host);
-		pthread_mutex_unlock (&host->lock);
 
 		ERROR ("write_riemann plugin: Sending to Riemann at %s:%s failed: %s",
 				(host->node != NULL) ? host->node : RIEMANN_HOST,
 				(host->service != NULL) ? host->service : RIEMANN_PORT,
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		sfree (buffer);
 		return -1;
 	}
 
-	pthread_mutex_unlock (&host->lock);
-	sfree (buffer);
+	/* Riemann acknowledges each message sent via TCP. Rather than waiting
+	 * for the answer, keep sending and only make sure that they don't
+	 * pile up. */
+	if (host->use_tcp)
+	{
+		host->outstanding++;
+		return (riemann_read_acks (host));
+	}
+
 	return 0;
 }
 
-static int riemann_event_add_tag (Event *event, /* {{{ */
-		char const *format, ...)
+/* Sends the batched events. "host->lock" must be held. */
+static int riemann_flush_nolock (struct riemann_host *host) /* {{{ */
 {
-	va_list ap;
-	char buffer[1024];
-	size_t ret;
+	Msg msg;
+	int status;
 
-	va_start (ap, format);
-	ret = vsnprintf (buffer, sizeof (buffer), format, ap);
-	if (ret >= sizeof (buffer))
-		ret = sizeof (buffer) - 1;
-	buffer[ret] = 0;
-	va_end (ap);
+	if (host->batch_events_num == 0)
+		return (0);
 
-	return (strarray_add (&event->tags, &event->n_tags, buffer));
-} /* }}} int riemann_event_add_tag */
+	msg__init (&msg);
+	msg.events = host->batch_events;
+	msg.n_events = host->batch_events_num;
+
+	status = riemann_send (host, &msg);
+	if (status != 0)
+		ERROR ("write_riemann plugin: riemann_send failed with status %i",
+				status);
+
+	riemann_batch_reset (host);
+	return (status);
+} /* }}} int riemann_flush_nolock */
 
-static Msg *riemann_notification_to_protobuf (struct riemann_host *host, /* {{{ */
+static int riemann_notification_add (struct riemann_host *host, /* {{{ */
 		notification_t const *n)
 {
-	Msg *msg;
+	riemann_arena_t *arena = &host->arena;
 	Event *event;
 	char service_buffer[6 * DATA_MAX_NAME_LEN];
 	char const *severity;
 	notification_meta_t *meta;
-	int i;
 
-	msg = malloc (sizeof (*msg));
-	if (msg == NULL)
-	{
-		ERROR ("write_riemann plugin: malloc failed.");
-		return (NULL);
-	}
-	memset (msg, 0, sizeof (*msg));
-	msg__init (msg);
-
-	msg->events = malloc (sizeof (*msg->events));
-	if (msg->events == NULL)
-	{
-		ERROR ("write_riemann plugin: malloc failed.");
-		sfree (msg);
-		return (NULL);
-	}
-
-	event = malloc (sizeof (*event));
+	event = riemann_event_create (arena, 5 + riemann_tags_num);
 	if (event == NULL)
-	{
-		ERROR ("write_riemann plugin: malloc failed.");
-		sfree (msg->events);
-		sfree (msg);
-		return (NULL);
-	}
-	memset (event, 0, sizeof (*event));
-	event__init (event);
+		return (ENOMEM);
 
-	msg->events[0] = event;
-	msg->n_events = 1;
-
-	event->host = strdup (n->host);
+	event->host = riemann_arena_strdup (arena, n->host);
 	event->time = CDTIME_T_TO_TIME_T (n->time);
 	event->has_time = 1;
 
@@ -231,28 +540,31 @@ static Msg *riemann_notification_to_protobuf (struct riemann_host *host, /* {{{
 		case NOTIF_FAILURE:	severity = "failure"; break;
 		default:		severity = "unknown";
 	}
-	event->state = strdup (severity);
+	event->state = riemann_arena_strdup (arena, severity);
 
-	riemann_event_add_tag (event, "notification");
+	riemann_event_add_tag (arena, event, "notification");
 	if (n->plugin[0] != 0)
-		riemann_event_add_tag (event, "plugin:%s", n->plugin);
+		riemann_event_add_tag (arena, event, "plugin:%s", n->plugin);
 	if (n->plugin_instance[0] != 0)
-		riemann_event_add_tag (event, "plugin_instance:%s",
+		riemann_event_add_tag (arena, event, "plugin_instance:%s",
 				n->plugin_instance);
 
 	if (n->type[0] != 0)
-		riemann_event_add_tag (event, "type:%s", n->type);
+		riemann_event_add_tag (arena, event, "type:%s", n->type);
 	if (n->type_instance[0] != 0)
-		riemann_event_add_tag (event, "type_instance:%s",
+		riemann_event_add_tag (arena, event, "type_instance:%s",
 				n->type_instance);
 
-	for (i = 0; i < riemann_tags_num; i++)
-		riemann_event_add_tag (event, "%s", riemann_tags[i]);
+	riemann_event_add_global_tags (event);
 
 	format_name (service_buffer, sizeof (service_buffer),
 			/* host = */ "", n->plugin, n->plugin_instance,
 			n->type, n->type_instance);
-	event->service = strdup (&service_buffer[1]);
+	event->service = riemann_arena_strdup (arena, &service_buffer[1]);
+
+	if ((event->host == NULL) || (event->state == NULL)
+			|| (event->service == NULL))
+		return (ENOMEM);
 
 	/* Pull in values from threshold */
 	for (meta = n->meta; meta != NULL; meta = meta->next)
@@ -268,59 +580,53 @@ static Msg *riemann_notification_to_protobuf (struct riemann_host *host, /* {{{
 	DEBUG ("write_riemann plugin: Successfully created protobuf for notification: "
 			"host = \"%s\", service = \"%s\", state = \"%s\"",
 			event->host, event->service, event->state);
-	return (msg);
-} /* }}} Msg *riemann_notification_to_protobuf */
+	return (riemann_batch_add (host, event));
+} /* }}} int riemann_notification_add */
 
-static Event *riemann_value_to_protobuf (struct riemann_host const *host, /* {{{ */
+static Event *riemann_value_to_protobuf (struct riemann_host *host, /* {{{ */
 		data_set_t const *ds,
 		value_list_t const *vl, size_t index,
 		gauge_t const *rates)
 {
+	riemann_arena_t *arena = &host->arena;
 	Event *event;
 	char name_buffer[5 * DATA_MAX_NAME_LEN];
 	char service_buffer[6 * DATA_MAX_NAME_LEN];
-	int i;
 
-	event = malloc (sizeof (*event));
+	event = riemann_event_create (arena, 7 + riemann_tags_num);
 	if (event == NULL)
-	{
-		ERROR ("write_riemann plugin: malloc failed.");
 		return (NULL);
-	}
-	memset (event, 0, sizeof (*event));
-	event__init (event);
 
-	event->host = strdup (vl->host);
+	event->host = riemann_arena_strdup (arena, vl->host);
 	event->time = CDTIME_T_TO_TIME_T (vl->time);
 	event->has_time = 1;
 	event->ttl = CDTIME_T_TO_TIME_T (2 * vl->interval);
 	event->has_ttl = 1;
 
-	riemann_event_add_tag (event, "plugin:%s", vl->plugin);
+	riemann_event_add_tag (arena, event, "plugin:%s", vl->plugin);
 	if (vl->plugin_instance[0] != 0)
-		riemann_event_add_tag (event, "plugin_instance:%s",
+		riemann_event_add_tag (arena, event, "plugin_instance:%s",
 				vl->plugin_instance);
 
-	riemann_event_add_tag (event, "type:%s", vl->type);
+	riemann_event_add_tag (arena, event, "type:%s", vl->type);
 	if (vl->type_instance[0] != 0)
-		riemann_event_add_tag (event, "type_instance:%s",
+		riemann_event_add_tag (arena, event, "type_instance:%s",
 				vl->type_instance);
 
 	if ((ds->ds[index].type != DS_TYPE_GAUGE) && (rates != NULL))
 	{
-		riemann_event_add_tag (event, "ds_type:%s:rate",
+		riemann_event_add_tag (arena, event, "ds_type:%s:rate",
 				DS_TYPE_TO_STRING(ds->ds[index].type));
 	}
 	else
 	{
-		riemann_event_add_tag (event, "ds_type:%s",
+		riemann_event_add_tag (arena, event, "ds_type:%s",
 				DS_TYPE_TO_STRING(ds->ds[index].type));
 	}
-	riemann_event_add_tag (event, "ds_name:%s", ds->ds[index].name);
-	riemann_event_add_tag (event, "ds_index:%zu", index);
+	riemann_event_add_tag (arena, event, "ds_name:%s", ds->ds[index].name);
+	riemann_event_add_tag (arena, event, "ds_index:%zu", index);
 
-	for (i = 0; i < riemann_tags_num; i++)
-		riemann_event_add_tag (event, "%s", riemann_tags[i]);
+	riemann_event_add_global_tags (event);
 
 	if (ds->ds[index].type == DS_TYPE_GAUGE)
 	{
@@ -353,7 +659,10 @@ static Event *riemann_value_to_protobuf (struct riemann_host const *host, /* {{{
 		sstrncpy (service_buffer, &name_buffer[1],
 				sizeof (service_buffer));
 
-	event->service = strdup (service_buffer);
+	event->service = riemann_arena_strdup (arena, service_buffer);
+
+	if ((event->host == NULL) || (event->service == NULL))
+		return (NULL);
 
 	DEBUG ("write_riemann plugin: Successfully created protobuf for metric: "
 			"host = \"%s\", service = \"%s\"",
@@ -361,102 +670,127 @@ static Event *riemann_value_to_protobuf (struct riemann_host const *host, /* {{{
 	return (event);
 } /* }}} Event *riemann_value_to_protobuf */
 
-static Msg *riemann_value_list_to_protobuf (struct riemann_host const *host, /* {{{ */
+/* Appends one event per data source to the batch. "host->lock" must be
+ * held. */
+static int riemann_value_list_add (struct riemann_host *host, /* {{{ */
 		data_set_t const *ds,
 		value_list_t const *vl)
 {
-	Msg *msg;
 	size_t i;
-	gauge_t *rates = NULL;
-
-	/* Initialize the Msg structure. */
-	msg = malloc (sizeof (*msg));
-	if (msg == NULL)
-	{
-		ERROR ("write_riemann plugin: malloc failed.");
-		return (NULL);
-	}
-	memset (msg, 0, sizeof (*msg));
-	msg__init (msg);
-
-	/* Set up events. First, the list of pointers. */
-	msg->n_events = (size_t) vl->values_len;
-	msg->events = calloc (msg->n_events, sizeof (*msg->events));
-	if (msg->events == NULL)
-	{
-		ERROR ("write_riemann plugin: calloc failed.");
-		riemann_msg_protobuf_free (msg);
-		return (NULL);
-	}
+	const gauge_t *rates = NULL;
+	int status = 0;
 
 	if (host->store_rates)
 	{
-		rates = uc_get_rate (ds, vl);
+		rates = uc_get_rate_ref (ds, vl);
 		if (rates == NULL)
 		{
 			ERROR ("write_riemann plugin: uc_get_rate failed.");
-			riemann_msg_protobuf_free (msg);
-			return (NULL);
+			return (-1);
 		}
 	}
 
-	for (i = 0; i < msg->n_events; i++)
+	for (i = 0; i < (size_t) vl->values_len; i++)
 	{
-		msg->events[i] = riemann_value_to_protobuf (host, ds, vl,
-				(int) i, rates);
-		if (msg->events[i] == NULL)
+		Event *event;
+
+		event = riemann_value_to_protobuf (host, ds, vl, i, rates);
+		if (event == NULL)
 		{
-			riemann_msg_protobuf_free (msg);
-			sfree (rates);
-			return (NULL);
+			status = ENOMEM;
+			break;
 		}
+
+		status = riemann_batch_add (host, event);
+		if (status != 0)
+			break;
 	}
 
-	sfree (rates);
-	return (msg);
-} /* }}} Msg *riemann_value_list_to_protobuf */
+	uc_release_rate_ref (vl, rates);
+	return (status);
+} /* }}} int riemann_value_list_add */
 
 static int
 riemann_notification(const notification_t *n, user_data_t *ud)
 {
 	int			 status;
 	struct riemann_host	*host = ud->data;
-	Msg			*msg;
 
-	msg = riemann_notification_to_protobuf (host, n);
-	if (msg == NULL)
-		return (-1);
+	pthread_mutex_lock (&host->lock);
 
-	status = riemann_send (host, msg);
-	if (status != 0)
-		ERROR ("write_riemann plugin: riemann_send failed with status %i",
-				status);
+	/* Notifications are sent right away, together with the values
+	 * collected so far. */
+	status = riemann_notification_add (host, n);
+	if (status == 0)
+		status = riemann_flush_nolock (host);
+	else
+		ERROR ("write_riemann plugin: Creating the event for a "
+				"notification failed with status %i.", status);
 
-	riemann_msg_protobuf_free (msg);
+	pthread_mutex_unlock (&host->lock);
 	return (status);
 } /* }}} int riemann_notification */
 
 static int
-riemann_write(const data_set_t *ds,
-	      const value_list_t *vl,
-	      user_data_t *ud)
+riemann_write_batch(const plugin_write_item_t *items, size_t items_num,
+		user_data_t *ud)
 {
-	int			 status;
+	int			 status = 0;
 	struct riemann_host	*host = ud->data;
-	Msg			*msg;
+	size_t			 i;
 
-	msg = riemann_value_list_to_protobuf (host, ds, vl);
-	if (msg == NULL)
-		return (-1);
+	pthread_mutex_lock (&host->lock);
 
-	status = riemann_send (host, msg);
-	if (status != 0)
-		ERROR ("write_riemann plugin: riemann_send failed with status %i",
-				status);
+	for (i = 0; i < items_num; i++)
+	{
+		int tmp;
 
-	riemann_msg_protobuf_free (msg);
-	return status;
-}
+		tmp = riemann_value_list_add (host, items[i].ds, items[i].vl);
+		if (tmp != 0)
+		{
+			ERROR ("write_riemann plugin: Creating the events failed "
+					"with status %i.", tmp);
+			status = tmp;
+		}
+
+		if (!host->batch_mode || (host->batch_size >= host->batch_max))
+		{
+			tmp = riemann_flush_nolock (host);
+			if (tmp != 0)
+				status = tmp;
+		}
+	}
+
+	if ((host->batch_events_num > 0)
+			&& ((cdtime () - host->batch_init_time) >= host->batch_timeout))
+	{
+		int tmp = riemann_flush_nolock (host);
+		if (tmp != 0)
+			status = tmp;
+	}
+
+	pthread_mutex_unlock (&host->lock);
+	return (status);
+} /* }}} int riemann_write_batch */
+
+static int
+riemann_flush(cdtime_t timeout,
+		const char __attribute__((unused)) *identifier,
+		user_data_t *ud)
+{
+	struct riemann_host	*host = ud->data;
+	int			 status = 0;
+
+	pthread_mutex_lock (&host->lock);
+
+	if ((host->batch_events_num > 0)
+			&& ((timeout == 0)
+				|| ((cdtime () - host->batch_init_time) >= timeout)))
+		status = riemann_flush_nolock (host);
+
+	pthread_mutex_unlock (&host->lock);
+	return (status);
+} /* }}} int riemann_flush */
 
 /* host->lock must be held when calling this function. */
 static int
@@ -481,7 +815,10 @@ riemann_connect(struct riemann_host *host)
 	node = (host->node != NULL) ? host->node : RIEMANN_HOST;
 	service = (host->service != NULL) ? host->service : RIEMANN_PORT;
 
-	if ((e = getaddrinfo(node, service, &hints, &res)) != 0) {
+	e = ures_getaddrinfo(node, service, &hints,
+			/* wait = */ (host->flags & F_RESOLVED) == 0, &res);
+	host->flags |= F_RESOLVED;
+	if (e != 0) {
 		ERROR ("write_riemann plugin: Unable to resolve host \"%s\": %s",
 			node, gai_strerror(e));
 		return -1;
@@ -507,7 +844,7 @@ riemann_connect(struct riemann_host *host)
 		break;
 	}
 
-	freeaddrinfo(res);
+	ures_freeaddrinfo(res);
 
 	if (host->s < 0) {
 		WARNING("write_riemann plugin: Unable to connect to Riemann at %s:%s",
@@ -528,6 +865,11 @@ riemann_disconnect (struct riemann_host *host)
 	host->s = -1;
 	host->flags &= ~F_CONNECT;
 
+	/* Acknowledgements for messages sent on the old connection won't
+	 * arrive anymore. */
+	host->outstanding = 0;
+	host->recv_fill = 0;
+
 	return (0);
 }
 
@@ -548,9 +890,16 @@ riemann_free(void *p)
 		return;
 	}
 
+	riemann_flush_nolock (host);
 	riemann_disconnect (host);
 
+	riemann_arena_free (&host->arena);
+	sfree(host->batch_events);
+	sfree(host->send_buffer);
+	sfree(host->name);
+	sfree(host->node);
 	sfree(host->service);
+	pthread_mutex_unlock (&host->lock);
 	pthread_mutex_destroy (&host->lock);
 	sfree(host);
 }
@@ -576,6 +925,10 @@ riemann_config_node(oconfig_item_t *ci)
 	host->store_rates = 1;
 	host->always_append_ds = 0;
 	host->use_tcp = 0;
+	host->batch_mode = 1;
+	host->batch_max = RIEMANN_BATCH_MAX;
+	host->batch_timeout = plugin_get_interval ();
+	host->max_outstanding = RIEMANN_MAX_OUTSTANDING;
 
 	status = cf_util_get_string (ci, &host->name);
 	if (status != 0) {
@@ -635,6 +988,36 @@ riemann_config_node(oconfig_item_t *ci)
 					&host->always_append_ds);
 			if (status != 0)
 				break;
+		} else if (strcasecmp ("Batch", child->key) == 0) {
+			status = cf_util_get_boolean (child, &host->batch_mode);
+			if (status != 0)
+				break;
+		} else if (strcasecmp ("BatchMaxSize", child->key) == 0) {
+			int tmp = 0;
+			status = cf_util_get_int (child, &tmp);
+			if (status != 0)
+				break;
+			if (tmp < 1) {
+				ERROR ("write_riemann plugin: The \"BatchMaxSize\" "
+						"option must be positive.");
+				status = -1;
+				break;
+			}
+			host->batch_max = (size_t) tmp;
+		} else if (strcasecmp ("BatchFlushTimeout", child->key) == 0) {
+			status = cf_util_get_cdtime (child, &host->batch_timeout);
+			if (status != 0)
+				break;
+		} else if (strcasecmp ("MaxOutstanding", child->key) == 0) {
+			status = cf_util_get_int (child, &host->max_outstanding);
+			if (status != 0)
+				break;
+			if (host->max_outstanding < 1) {
+				ERROR ("write_riemann plugin: The \"MaxOutstanding\" "
+						"option must be positive.");
+				status = -1;
+				break;
+			}
 		} else {
 			WARNING("write_riemann plugin: ignoring unknown config "
 				"option: \"%s\"", child->key);
@@ -645,6 +1028,10 @@ riemann_config_node(oconfig_item_t *ci)
 		return status;
 	}
 
+	/* Messages sent via UDP have to fit into one datagram. */
+	if (!host->use_tcp)
+		host->batch_mode = 0;
+
 	ssnprintf (callback_name, sizeof (callback_name), "write_riemann/%s",
 			host->name);
 	ud.data = host;
@@ -652,14 +1039,26 @@ riemann_config_node(oconfig_item_t *ci)
 
 	pthread_mutex_lock (&host->lock);
 
-	status = plugin_register_write (callback_name, riemann_write, &ud);
+	status = plugin_register_write_batch (callback_name,
+			riemann_write_batch, &ud);
 	if (status != 0)
-		WARNING ("write_riemann plugin: plugin_register_write (\"%s\") "
+		WARNING ("write_riemann plugin: plugin_register_write_batch (\"%s\") "
 				"failed with status %i.",
 				callback_name, status);
 	else /* success */
+	{
 		host->reference_count++;
 
+		status = plugin_register_flush (callback_name, riemann_flush,
+				&ud);
+		if (status != 0)
+			WARNING ("write_riemann plugin: plugin_register_flush "
+					"(\"%s\") failed with status %i.",
+					callback_name, status);
+		else /* success */
+			host->reference_count++;
+	}
+
 	status = plugin_register_notification (callback_name,
 			riemann_notification, &ud);
 	if (status != 0)
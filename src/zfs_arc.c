@@ -54,39 +54,89 @@ static void za_submit_gauge (const char* type, const char* type_instance, gauge_
 	za_submit (type, type_instance, &vv, 1);
 }
 
-static int za_read_derive (kstat_t *ksp, const char *kstat_value,
-    const char *type, const char *type_instance)
+/* The values read, with the position of each in the kstat's entries, which
+ * is looked up on the first read only, see get_kstat_value_index(). */
+typedef struct za_value_s
 {
-  long long tmp;
-  value_t v;
+	char       *name;
+	int         ds_type;
+	const char *type;
+	const char *type_instance;
+	int         index;
+} za_value_t;
+
+static za_value_t za_values[] =
+{
+	/* Sizes */
+	{ "size",    DS_TYPE_GAUGE, "cache_size", "arc", -1 },
+	{ "l2_size", DS_TYPE_GAUGE, "cache_size", "L2",  -1 },
 
-  tmp = get_kstat_value (ksp, (char *)kstat_value);
-  if (tmp == -1LL)
-  {
-    ERROR ("zfs_arc plugin: Reading kstat value \"%s\" failed.", kstat_value);
-    return (-1);
-  }
+	/* Operations */
+	{ "allocated", DS_TYPE_DERIVE, "cache_operation", "allocated", -1 },
+	{ "deleted",   DS_TYPE_DERIVE, "cache_operation", "deleted",   -1 },
+	{ "stolen",    DS_TYPE_DERIVE, "cache_operation", "stolen",    -1 },
 
-  v.derive = (derive_t) tmp;
-  za_submit (type, type_instance, /* values = */ &v, /* values_num = */ 1);
-  return (0);
-}
+	/* Issue indicators */
+	{ "mutex_miss",      DS_TYPE_DERIVE, "mutex_operations", "miss", -1 },
+	{ "hash_collisions", DS_TYPE_DERIVE, "hash_collisions",  "",     -1 },
+
+	/* Evictions */
+	{ "evict_l2_cached",     DS_TYPE_DERIVE, "cache_eviction", "cached",     -1 },
+	{ "evict_l2_eligible",   DS_TYPE_DERIVE, "cache_eviction", "eligible",   -1 },
+	{ "evict_l2_ineligible", DS_TYPE_DERIVE, "cache_eviction", "ineligible", -1 },
 
-static int za_read_gauge (kstat_t *ksp, const char *kstat_value,
-    const char *type, const char *type_instance)
+	/* Hits / misses */
+	{ "demand_data_hits",         DS_TYPE_DERIVE, "cache_result", "demand_data-hit",        -1 },
+	{ "demand_metadata_hits",     DS_TYPE_DERIVE, "cache_result", "demand_metadata-hit",    -1 },
+	{ "prefetch_data_hits",       DS_TYPE_DERIVE, "cache_result", "prefetch_data-hit",      -1 },
+	{ "prefetch_metadata_hits",   DS_TYPE_DERIVE, "cache_result", "prefetch_metadata-hit",  -1 },
+	{ "demand_data_misses",       DS_TYPE_DERIVE, "cache_result", "demand_data-miss",       -1 },
+	{ "demand_metadata_misses",   DS_TYPE_DERIVE, "cache_result", "demand_metadata-miss",   -1 },
+	{ "prefetch_data_misses",     DS_TYPE_DERIVE, "cache_result", "prefetch_data-miss",     -1 },
+	{ "prefetch_metadata_misses", DS_TYPE_DERIVE, "cache_result", "prefetch_metadata-miss", -1 }
+};
+static size_t za_values_num = STATIC_ARRAY_SIZE (za_values);
+
+/* Values which are combined before being submitted. */
+enum
+{
+	ZA_HITS,
+	ZA_MISSES,
+	ZA_L2_HITS,
+	ZA_L2_MISSES,
+	ZA_L2_READ_BYTES,
+	ZA_L2_WRITE_BYTES,
+	ZA_RAW_NUM
+};
+static char *za_raw_names[ZA_RAW_NUM] =
+{
+	"hits", "misses", "l2_hits", "l2_misses",
+	"l2_read_bytes", "l2_write_bytes"
+};
+static int za_raw_index[ZA_RAW_NUM] = { -1, -1, -1, -1, -1, -1 };
+
+/* The arcstats kstat, looked up again only when the chain changes. */
+static kstat_t *za_ksp = NULL;
+static kid_t    za_chain_id = 0;
+
+static int za_read_value (kstat_t *ksp, za_value_t *zv)
 {
   long long tmp;
   value_t v;
 
-  tmp = get_kstat_value (ksp, (char *)kstat_value);
+  tmp = get_kstat_value_index (ksp, zv->name, &zv->index);
   if (tmp == -1LL)
   {
-    ERROR ("zfs_arc plugin: Reading kstat value \"%s\" failed.", kstat_value);
+    ERROR ("zfs_arc plugin: Reading kstat value \"%s\" failed.", zv->name);
     return (-1);
   }
 
-  v.gauge = (gauge_t) tmp;
-  za_submit (type, type_instance, /* values = */ &v, /* values_num = */ 1);
+  if (zv->ds_type == DS_TYPE_GAUGE)
+    v.gauge = (gauge_t) tmp;
+  else
+    v.derive = (derive_t) tmp;
+  za_submit (zv->type, zv->type_instance,
+      /* values = */ &v, /* values_num = */ 1);
   return (0);
 }
 
@@ -109,55 +159,36 @@ static int za_read (void)
 {
 	gauge_t  arc_hits, arc_misses, l2_hits, l2_misses;
 	value_t  l2_io[2];
-	kstat_t	 *ksp	= NULL;
+	long long raw[ZA_RAW_NUM];
+	size_t   i;
 
-	get_kstat (&ksp, "zfs", 0, "arcstats");
-	if (ksp == NULL)
+	/* Only the arcstats kstat is read, not the whole chain. */
+	get_kstat_cached (&za_ksp, &za_chain_id, "zfs", 0, "arcstats");
+	if (za_ksp == NULL)
 	{
 		ERROR ("zfs_arc plugin: Cannot find zfs:0:arcstats kstat.");
 		return (-1);
 	}
 
-	/* Sizes */
-	za_read_gauge (ksp, "size",    "cache_size", "arc");
-	za_read_gauge (ksp, "l2_size", "cache_size", "L2");
-
-        /* Operations */
-	za_read_derive (ksp, "allocated","cache_operation", "allocated");
-	za_read_derive (ksp, "deleted",  "cache_operation", "deleted");
-	za_read_derive (ksp, "stolen",   "cache_operation", "stolen");
-
-        /* Issue indicators */
-        za_read_derive (ksp, "mutex_miss", "mutex_operations", "miss");
-	za_read_derive (ksp, "hash_collisions", "hash_collisions", "");
-	
-        /* Evictions */
-	za_read_derive (ksp, "evict_l2_cached",     "cache_eviction", "cached");
-	za_read_derive (ksp, "evict_l2_eligible",   "cache_eviction", "eligible");
-	za_read_derive (ksp, "evict_l2_ineligible", "cache_eviction", "ineligible");
+	for (i = 0; i < za_values_num; i++)
+		za_read_value (za_ksp, za_values + i);
 
-	/* Hits / misses */
-	za_read_derive (ksp, "demand_data_hits",         "cache_result", "demand_data-hit");
-	za_read_derive (ksp, "demand_metadata_hits",     "cache_result", "demand_metadata-hit");
-	za_read_derive (ksp, "prefetch_data_hits",       "cache_result", "prefetch_data-hit");
-	za_read_derive (ksp, "prefetch_metadata_hits",   "cache_result", "prefetch_metadata-hit");
-	za_read_derive (ksp, "demand_data_misses",       "cache_result", "demand_data-miss");
-	za_read_derive (ksp, "demand_metadata_misses",   "cache_result", "demand_metadata-miss");
-	za_read_derive (ksp, "prefetch_data_misses",     "cache_result", "prefetch_data-miss");
-	za_read_derive (ksp, "prefetch_metadata_misses", "cache_result", "prefetch_metadata-miss");
+	for (i = 0; i < ZA_RAW_NUM; i++)
+		raw[i] = get_kstat_value_index (za_ksp, za_raw_names[i],
+				za_raw_index + i);
 
 	/* Ratios */
-	arc_hits   = (gauge_t) get_kstat_value(ksp, "hits");
-	arc_misses = (gauge_t) get_kstat_value(ksp, "misses");
-	l2_hits    = (gauge_t) get_kstat_value(ksp, "l2_hits");
-	l2_misses  = (gauge_t) get_kstat_value(ksp, "l2_misses");
+	arc_hits   = (gauge_t) raw[ZA_HITS];
+	arc_misses = (gauge_t) raw[ZA_MISSES];
+	l2_hits    = (gauge_t) raw[ZA_L2_HITS];
+	l2_misses  = (gauge_t) raw[ZA_L2_MISSES];
 
 	za_submit_ratio ("arc", arc_hits, arc_misses);
 	za_submit_ratio ("L2", l2_hits, l2_misses);
 
 	/* I/O */
-	l2_io[0].derive = get_kstat_value(ksp, "l2_read_bytes");
-	l2_io[1].derive = get_kstat_value(ksp, "l2_write_bytes");
+	l2_io[0].derive = raw[ZA_L2_READ_BYTES];
+	l2_io[1].derive = raw[ZA_L2_WRITE_BYTES];
 
 	za_submit ("io_octets", "L2", l2_io, /* num values = */ 2);
 